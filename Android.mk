@@ -51,6 +51,29 @@ LOCAL_SRC_FILES := \
     twrp.cpp \
     fixContexts.cpp \
     twrpTar.cpp \
+    twrpTarProgress.cpp \
+    twrpCompress.cpp \
+    twrpScan.cpp \
+    twrpManifest.cpp \
+    twrpTarIndex.cpp \
+    twrpRestorePipeline.cpp \
+    twrpEncrypt.cpp \
+    twrpChunkStore.cpp \
+    twrpSparse.cpp \
+    twrpRawCopy.cpp \
+    twrpZipEntry.cpp \
+    twrpZipPrefetch.cpp \
+    twrpIoScheduler.cpp \
+    twrpThermal.cpp \
+    twrpMemBudget.cpp \
+    twrpStorageBench.cpp \
+    twrpPerfProfile.cpp \
+    twrpPerfReport.cpp \
+    twrpLog.cpp \
+    twrpStartupTasks.cpp \
+    twrpStartupTrace.cpp \
+    twrpDelete.cpp \
+    twrpFsTool.cpp \
     exclude.cpp \
     find_file.cpp \
     infomanager.cpp \
@@ -61,6 +84,7 @@ LOCAL_SRC_FILES := \
     twinstall.cpp \
     twrp-functions.cpp \
     twrpDigestDriver.cpp \
+    twrpDigestTree.cpp \
     openrecoveryscript.cpp \
     tarWrite.c \
     twrpAdbBuFifo.cpp
@@ -134,7 +158,7 @@ endif
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 24; echo $$?),0)
     LOCAL_SHARED_LIBRARIES += libmincrypttwrp
     LOCAL_C_INCLUDES += $(LOCAL_PATH)/libmincrypt/includes
-    LOCAL_CFLAGS += -DUSE_OLD_VERIFIER
+    LOCAL_CFLAGS += -DUSE_OLD_VERIFIER -DTW_NO_AES_LIBRARY
 else
     LOCAL_SHARED_LIBRARIES += libcrypto
 endif
@@ -237,6 +261,9 @@ endif
 ifneq ($(TW_INCLUDE_DUMLOCK),)
 	LOCAL_CFLAGS += -DTW_INCLUDE_DUMLOCK
 endif
+ifneq ($(TW_MTD_VERIFY_WRITES),)
+	LOCAL_CFLAGS += -DTW_MTD_VERIFY_WRITES
+endif
 ifneq ($(TW_INTERNAL_STORAGE_PATH),)
 	LOCAL_CFLAGS += -DTW_INTERNAL_STORAGE_PATH=$(TW_INTERNAL_STORAGE_PATH)
 endif
@@ -306,6 +333,9 @@ endif
 ifeq ($(TW_NO_EXFAT_FUSE), true)
     LOCAL_CFLAGS += -DTW_NO_EXFAT_FUSE
 endif
+ifneq ($(TW_EXFAT_FUSE_THREADS),)
+    LOCAL_CFLAGS += -DTW_EXFAT_FUSE_THREADS=$(TW_EXFAT_FUSE_THREADS)
+endif
 ifeq ($(TW_NO_HAPTICS), true)
     LOCAL_CFLAGS += -DTW_NO_HAPTICS
 endif
@@ -360,11 +390,30 @@ endif
 ifneq ($(TW_CUSTOM_CPU_TEMP_PATH),)
 	LOCAL_CFLAGS += -DTW_CUSTOM_CPU_TEMP_PATH=$(TW_CUSTOM_CPU_TEMP_PATH)
 endif
+ifneq ($(TW_THERMAL_TARGET),)
+	LOCAL_CFLAGS += -DTW_THERMAL_TARGET=$(TW_THERMAL_TARGET)
+endif
+ifneq ($(TW_MEM_BUDGET_PERCENT),)
+	LOCAL_CFLAGS += -DTW_MEM_BUDGET_PERCENT=$(TW_MEM_BUDGET_PERCENT)
+endif
+ifneq ($(TW_MEM_BUDGET_MB),)
+	LOCAL_CFLAGS += -DTW_MEM_BUDGET_MB=$(TW_MEM_BUDGET_MB)
+endif
 ifneq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
     LOCAL_SHARED_LIBRARIES += libopenaes
 else
     LOCAL_CFLAGS += -DTW_EXCLUDE_ENCRYPTED_BACKUPS
 endif
+ifneq ($(wildcard external/zstd/lib/zstd.h),)
+    LOCAL_CFLAGS += -DTW_INCLUDE_ZSTD
+    LOCAL_C_INCLUDES += external/zstd/lib
+    LOCAL_SHARED_LIBRARIES += libzstd
+endif
+ifneq ($(wildcard external/lz4/lib/lz4frame.h),)
+    LOCAL_CFLAGS += -DTW_INCLUDE_LZ4
+    LOCAL_C_INCLUDES += external/lz4/lib
+    LOCAL_SHARED_LIBRARIES += liblz4
+endif
 ifeq ($(TARGET_RECOVERY_QCOM_RTC_FIX),)
   ifneq ($(filter msm8226 msm8x26 msm8610 msm8974 msm8x74 msm8084 msm8x84 apq8084 msm8909 msm8916 msm8992 msm8994 msm8952 msm8996 msm8937 msm8953 msm8998,$(TARGET_BOARD_PLATFORM)),)
     LOCAL_CFLAGS += -DQCOM_RTC_FIX
@@ -385,6 +434,7 @@ ifneq ($(TARGET_RECOVERY_INITRC),)
 endif
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -gt 22; echo $$?),0)
     LOCAL_CFLAGS += -DTW_USE_NEW_MINADBD
+    LOCAL_SHARED_LIBRARIES += libfusesideload
 endif
 ifneq ($(TW_DEFAULT_LANGUAGE),)
     LOCAL_CFLAGS += -DTW_DEFAULT_LANGUAGE=$(TW_DEFAULT_LANGUAGE)
@@ -4,6 +4,12 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := libtwadbbu
 LOCAL_MODULE_TAGS := optional
 LOCAL_CFLAGS = -fno-strict-aliasing -D_LARGFILE_SOURCE #-D_DEBUG_ADB_BACKUP
+ifneq ($(TW_ADB_RESTORE_BUFFER_MB),)
+    LOCAL_CFLAGS += -DTW_ADB_RESTORE_BUFFER_MB=$(TW_ADB_RESTORE_BUFFER_MB)
+endif
+ifneq ($(TW_NET_SOCKET_BUFFER_KB),)
+    LOCAL_CFLAGS += -DTW_NET_SOCKET_BUFFER_KB=$(TW_NET_SOCKET_BUFFER_KB)
+endif
 LOCAL_C_INCLUDES += bionic external/zlib
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
     LOCAL_C_INCLUDES += external/stlport/stlport
@@ -38,10 +38,20 @@ int main(int argc, char **argv) {
 	std::string command;
 	twrpback tw;
 
+	std::string netAddress;
+	int netBufferKB = TW_NET_SOCKET_BUFFER_KB;
+
 	tw.adblogwrite("Starting adb backup and restore\n");
-	command = argv[1];
-	for (index = 2; index < argc; index++) {
-		command = command + " " + argv[index];
+	//the network options pick the transport and are not passed on to TWRP
+	for (index = 1; index < argc; index++) {
+		if (strcmp(argv[index], TWRP_NET_ARG) == 0 && index + 1 < argc)
+			netAddress = argv[++index];
+		else if (strcmp(argv[index], TWRP_NET_BUFFER_ARG) == 0 && index + 1 < argc)
+			netBufferKB = atoi(argv[++index]);
+		else if (command.empty())
+			command = argv[index];
+		else
+			command = command + " " + argv[index];
 	}
 
 	pos = command.find(TWRP_BACKUP_ARG);
@@ -58,19 +68,27 @@ int main(int argc, char **argv) {
 
 	if (command.substr(0, sizeof(TWRP_BACKUP_ARG) - 1) == TWRP_BACKUP_ARG) {
 		tw.adblogwrite("Starting adb backup\n");
-		if (isdigit(*argv[1]))
-			tw.adbd_fd = atoi(argv[1]);
-		else
-			tw.adbd_fd = 1;
-		ret = tw.backup(command);
+		if (!netAddress.empty())
+			ret = tw.connectNet(netAddress, netBufferKB) && tw.backup(command);
+		else {
+			if (isdigit(*argv[1]))
+				tw.adbd_fd = atoi(argv[1]);
+			else
+				tw.adbd_fd = 1;
+			ret = tw.backup(command);
+		}
 	}
 	else if (command.substr(0, sizeof(TWRP_RESTORE_ARG) - 1) == TWRP_RESTORE_ARG) {
 		tw.adblogwrite("Starting adb restore\n");
-		if (isdigit(*argv[1]))
-			tw.adbd_fd = atoi(argv[1]);
-		else
-			tw.adbd_fd = 0;
-		ret = tw.restore();
+		if (!netAddress.empty())
+			ret = tw.connectNet(netAddress, netBufferKB) && tw.restore();
+		else {
+			if (isdigit(*argv[1]))
+				tw.adbd_fd = atoi(argv[1]);
+			else
+				tw.adbd_fd = 0;
+			ret = tw.restore();
+		}
 	}
 	else if (command.substr(0, sizeof(TWRP_STREAM_ARG) - 1) == TWRP_STREAM_ARG) {
 		tw.setStreamFileName(argv[3]);
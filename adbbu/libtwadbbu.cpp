@@ -67,6 +67,7 @@ std::vector<std::string> twadbbu::Get_ADB_Backup_Files(std::string fname) {
 	unsigned char buf[MAX_ADB_READ];
 	struct AdbBackupControlType structcmd;
 	std::vector<std::string> adb_partitions;
+	uint64_t version = ADB_BACKUP_MIN_VERSION;
 
 	int fd = open(fname.c_str(), O_RDONLY);
 	if (fd < 0) {
@@ -80,10 +81,26 @@ std::vector<std::string> twadbbu::Get_ADB_Backup_Files(std::string fname) {
 		int readbytes;
 		if ((readbytes = read(fd, &buf, sizeof(buf))) > 0) {
 			memcpy(&structcmd, buf, sizeof(structcmd));
-			assert(structcmd.type == TWENDADB || structcmd.type == TWIMG || structcmd.type == TWFN);
 			cmdstr = structcmd.type;
 			std::string cmdtype = cmdstr.substr(0, sizeof(structcmd.type) - 1);
-			if (cmdtype == TWENDADB) {
+			if (cmdtype == TWSTREAMHDR) {
+				struct AdbBackupStreamHeader twhdr;
+
+				memcpy(&twhdr, buf, sizeof(twhdr));
+				version = twhdr.version;
+			}
+			//framed data is skipped without looking at it
+			else if (cmdtype == TWDATA && version >= ADB_FRAMED_VERSION) {
+				struct AdbBackupDataHeader datahdr;
+
+				memcpy(&datahdr, buf, sizeof(datahdr));
+				if (lseek(fd, datahdr.size, SEEK_CUR) < 0) {
+					printf("Unable to seek in %s: %s\n", fname.c_str(), strerror(errno));
+					close(fd);
+					return std::vector<std::string>();
+				}
+			}
+			else if (cmdtype == TWENDADB) {
 				struct AdbBackupControlType endadb;
 				uint32_t crc, endadbcrc;
 
@@ -130,7 +147,7 @@ std::vector<std::string> twadbbu::Get_ADB_Backup_Files(std::string fname) {
 	return adb_partitions;
 }
 
-bool twadbbu::Write_ADB_Stream_Header(uint64_t partition_count) {
+bool twadbbu::Write_ADB_Stream_Header(uint64_t partition_count, uint32_t compression) {
 	struct AdbBackupStreamHeader twhdr;
 	int adb_control_bu_fd;
 
@@ -145,6 +162,8 @@ bool twadbbu::Write_ADB_Stream_Header(uint64_t partition_count) {
 	strncpy(twhdr.type, TWSTREAMHDR, sizeof(twhdr.type));
 	twhdr.partition_count = partition_count;
 	twhdr.version = ADB_BACKUP_VERSION;
+	twhdr.compression = compression;
+	twhdr.digest = ADB_DIGEST_XXH64;
 	memset(twhdr.space, 0, sizeof(twhdr.space));
 	twhdr.crc = crc32(0L, Z_NULL, 0);
 	twhdr.crc = crc32(twhdr.crc, (const unsigned char*) &twhdr, sizeof(twhdr));
@@ -180,15 +199,17 @@ bool twadbbu::Write_ADB_Stream_Trailer() {
 	return true;
 }
 
-bool twadbbu::Write_TWFN(std::string Backup_FileName, uint64_t file_size, bool use_compression) {
+bool twadbbu::Write_TWFN(std::string Backup_FileName, uint64_t file_size, uint64_t compression, unsigned streams) {
 	int adb_control_bu_fd;
 	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_WRONLY | O_NONBLOCK);
 	struct twfilehdr twfilehdr;
+	memset(&twfilehdr, 0, sizeof(twfilehdr));
 	strncpy(twfilehdr.start_of_header, TWRP, sizeof(twfilehdr.start_of_header));
 	strncpy(twfilehdr.type, TWFN, sizeof(twfilehdr.type));
 	strncpy(twfilehdr.name, Backup_FileName.c_str(), sizeof(twfilehdr.name));
 	twfilehdr.size = (file_size == 0 ? 1024 : file_size);
-	twfilehdr.compressed = use_compression;
+	twfilehdr.compressed = compression;
+	twfilehdr.streams = streams;
 	twfilehdr.crc = crc32(0L, Z_NULL, 0);
 	twfilehdr.crc = crc32(twfilehdr.crc, (const unsigned char*) &twfilehdr, sizeof(twfilehdr));
 
@@ -203,15 +224,17 @@ bool twadbbu::Write_TWFN(std::string Backup_FileName, uint64_t file_size, bool u
 	return true;
 }
 
-bool twadbbu::Write_TWIMG(std::string Backup_FileName, uint64_t file_size) {
+bool twadbbu::Write_TWIMG(std::string Backup_FileName, uint64_t file_size, uint64_t compression) {
 	int adb_control_bu_fd;
 	struct twfilehdr twimghdr;
 
 	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_WRONLY | O_NONBLOCK);
+	memset(&twimghdr, 0, sizeof(twimghdr));
 	strncpy(twimghdr.start_of_header, TWRP, sizeof(twimghdr.start_of_header));
 	strncpy(twimghdr.type, TWIMG, sizeof(twimghdr.type));
 	twimghdr.size = file_size;
 	strncpy(twimghdr.name, Backup_FileName.c_str(), sizeof(twimghdr.name));
+	twimghdr.compressed = compression;
 	twimghdr.crc = crc32(0L, Z_NULL, 0);
 	twimghdr.crc = crc32(twimghdr.crc, (const unsigned char*) &twimghdr, sizeof(twimghdr));
 	printf("Sending TWIMG to adb\n");
@@ -226,20 +249,14 @@ bool twadbbu::Write_TWIMG(std::string Backup_FileName, uint64_t file_size) {
 bool twadbbu::Write_TWEOF() {
 	struct AdbBackupControlType tweof;
 	int adb_control_bu_fd;
-	int errctr = 0;
 
+	//twrpback opens its end before it sends the operation, so the
+	//open only fails when it is gone
 	printf("opening TW_ADB_BU_CONTROL\n");
 	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_WRONLY | O_NONBLOCK);
-	while (adb_control_bu_fd < 0) {
-		printf("failed to open TW_ADB_BU_CONTROL. Retrying: %s\n", strerror(errno));
-		adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_WRONLY | O_NONBLOCK);
-		usleep(10000);
-		errctr++;
-		if (errctr > ADB_BU_MAX_ERROR) {
-			printf("Cannot write to adb_control_bu_fd: %s.\n", strerror(errno));
-			close(adb_control_bu_fd);
-			return false;
-		}
+	if (adb_control_bu_fd < 0) {
+		printf("Cannot write to adb_control_bu_fd: %s.\n", strerror(errno));
+		return false;
 	}
 	memset(&tweof, 0, sizeof(tweof));
 	strncpy(tweof.start_of_header, TWRP, sizeof(tweof.start_of_header));
@@ -293,11 +310,13 @@ bool twadbbu::Write_TWENDADB() {
 	return true;
 }
 
-bool twadbbu::Write_TWDATA(FILE* adbd_fp) {
-	struct AdbBackupControlType data_block;
+bool twadbbu::Write_TWDATA(FILE* adbd_fp, uint64_t data_size, unsigned stream_id) {
+	struct AdbBackupDataHeader data_block;
 	memset(&data_block, 0, sizeof(data_block));
 	strncpy(data_block.start_of_header, TWRP, sizeof(data_block.start_of_header));
 	strncpy(data_block.type, TWDATA, sizeof(data_block.type));
+	data_block.size = data_size;
+	data_block.stream_id = stream_id;
 	data_block.crc = crc32(0L, Z_NULL, 0);
 	data_block.crc = crc32(data_block.crc, (const unsigned char*) &data_block, sizeof(data_block));
 	if (fwrite(&data_block, 1, sizeof(data_block), adbd_fp) != sizeof(data_block))  {
@@ -305,3 +324,23 @@ bool twadbbu::Write_TWDATA(FILE* adbd_fp) {
 	}
 	return true;
 }
+
+bool twadbbu::Write_Session(std::string fn, std::string record, bool append) {
+	std::ofstream session(fn.c_str(), append ? std::ios::app : std::ios::trunc);
+
+	session << record << std::endl;
+	session.close();
+	return !session.fail();
+}
+
+std::vector<std::string> twadbbu::Read_Session(std::string fn) {
+	std::vector<std::string> records;
+	std::ifstream session(fn.c_str());
+	std::string line;
+
+	while (std::getline(session, line)) {
+		if (!line.empty())
+			records.push_back(line);
+	}
+	return records;
+}
@@ -38,14 +38,16 @@ class twadbbu {
 public:
 	static bool Check_ADB_Backup_File(std::string fname);                                          //Check if file is ADB Backup file
 	static std::vector<std::string> Get_ADB_Backup_Files(std::string fname);                       //List ADB Files in String Vector
-	static bool Write_ADB_Stream_Header(uint64_t partition_count);                                 //Write ADB Stream Header to stream
+	static bool Write_ADB_Stream_Header(uint64_t partition_count, uint32_t compression);           //Write ADB Stream Header with the codec of the backup to stream
 	static bool Write_ADB_Stream_Trailer();                                                        //Write ADB Stream Trailer to stream
-	static bool Write_TWFN(std::string Backup_FileName, uint64_t file_size, bool use_compression); //Write a tar image to stream
-	static bool Write_TWIMG(std::string Backup_FileName, uint64_t file_size);                      //Write a partition image to stream
+	static bool Write_TWFN(std::string Backup_FileName, uint64_t file_size, uint64_t compression, unsigned streams); //Write a tar image split over streams to stream
+	static bool Write_TWIMG(std::string Backup_FileName, uint64_t file_size, uint64_t compression); //Write a partition image to stream
 	static bool Write_TWEOF();                                                                     //Write ADB End-Of-File marker to stream
 	static bool Write_TWERROR();                                                                   //Write error message occurred to stream
 	static bool Write_TWENDADB();                                                                  //Write ADB End-Of-Stream command to stream
-	static bool Write_TWDATA(FILE* adbd_fp);                                                       //Write TWDATA separator
+	static bool Write_TWDATA(FILE* adbd_fp, uint64_t data_size, unsigned stream_id);               //Write TWDATA header of a data_size frame of stream_id
+	static bool Write_Session(std::string fn, std::string record, bool append);                    //Add a record to a resume session file, a new file unless append
+	static std::vector<std::string> Read_Session(std::string fn);                                  //List the records of a resume session file, empty without one
 };
 
 #endif //__LIBTWADBBU_HPP
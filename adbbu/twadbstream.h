@@ -16,16 +16,25 @@
 #ifndef __TWADBSTREAM_H
 #define __TWADBSTREAM_H
 
+#include <stdint.h>
+#include <string>
+
 #define TWRPARG "--twrp"
 #define TWRP_BACKUP_ARG "backup"
 #define TWRP_RESTORE_ARG "restore"
 #define TWRP_STREAM_ARG "stream"
+#define TWRP_RESUME_ARG "resume"			//Continue the interrupted adb backup of the session file
+#define TWRP_NET_ARG "--net"				//Stream to or from a host listening on host:port over TCP instead of adbd
+#define TWRP_NET_BUFFER_ARG "--netbuf"			//Socket buffer of a network stream in KB
 #define TW_ADB_BACKUP "/tmp/twadbbackup"		//FIFO for adb backup
 #define TW_ADB_RESTORE "/tmp/twadbrestore"		//FIFO for adb restore
 #define TW_ADB_BU_CONTROL "/tmp/twadbbucontrol"		//FIFO for sending control from TWRP to ADB Backup
 #define TW_ADB_TWRP_CONTROL "/tmp/twadbtwrpcontrol"	//FIFO for sending control from ADB Backup to TWRP
+#define TW_ADB_BACKUP_SESSION "/tmp/twadbbackup.session"	//Files of an unfinished adb backup the host has received
+#define TW_ADB_RESTORE_SESSION "/tmp/twadbrestore.session"	//Files of an unfinished adb restore that were restored
+#define TW_ADB_STATS "/tmp/twadbstats"			//Transfer counters of the last adb backup or restore, one record per line
+#define TW_ADB_STATS_INTERVAL 5				//Seconds between progress records in TW_ADB_STATS
 #define TWRP "TWRP"					//Magic Value
-#define ADB_BU_MAX_ERROR 20				//Max amount of errors for while loops
 #define ADB_BACKUP_OP "adbbackup"
 #define ADB_RESTORE_OP "adbrestore"
 
@@ -39,9 +48,20 @@
 #define TWMD5 "twverifymd5"				//This command is compared to the md5trailer by ORS to verify transfer
 #define TWENDADB "twendadb"				//End Protocol
 #define TWERROR "twerror"				//Send error
-#define ADB_BACKUP_VERSION 3				//Backup Version
+#define ADB_BACKUP_VERSION 8				//Backup Version
+#define ADB_BACKUP_MIN_VERSION 3			//Oldest stream version that can still be restored
+#define ADB_FRAMED_VERSION 4				//First version where TWDATA carries the size of its data frame
+#define ADB_MUX_VERSION 5				//First version where a file can be split over several streams
+#define ADB_CODEC_VERSION 6				//First version where file headers give the codec and images can be compressed
+#define ADB_DIGEST_VERSION 7				//First version where the stream header gives the digest of the trailers
+#define ADB_ENCRYPT_VERSION 8				//First version where file headers mark the encrypted streams
+#define ADB_ENCRYPTED_STREAMS(compressed) ((uint32_t) ((compressed) >> 32))	//Stream n of the file is encrypted if bit n is set
+#define ADB_DIGEST_MD5 0				//Trailers hold the md5 of the file
+#define ADB_DIGEST_XXH64 1				//Trailers hold the xxh64 of the file
+#define TW_ADB_MAX_STREAMS 9				//Streams one file can be split over, one per tar thread
 #define DATA_MAX_CHUNK_SIZE 1048576			//Maximum size between each data header
-#define MAX_ADB_READ 512				//align with default tar size for amount to read fom adb stream
+#define TW_ADB_RESUME_MARGIN (4 * DATA_MAX_CHUNK_SIZE)	//Data sent after a file before the host is assumed to have all of it
+#define MAX_ADB_READ 512				//size of every header and control struct in the adb stream
 
 /*
 structs for adb backup need to align to 512 bytes for reading 512
@@ -60,8 +80,59 @@ struct but not really a command
   | File Data              |
   | File/Image MD5 Trailer |
   | etc...                 |
+
+  Version 3 file data is a run of DATA_MAX_CHUNK_SIZE chunks, each starting
+  with a TWDATA header, and the last one padded with zeros. Readers have to
+  check every 512 byte block for the MD5 trailer.
+
+  From version 4 file data is a run of frames, a TWDATA header with the
+  size of the data that follows it, up to DATA_MAX_CHUNK_SIZE, and no
+  padding. The next header always follows the end of a frame.
+
+  From version 5 a tar can be written by several threads at once. The
+  TW File Stream Header gives the number of streams and each frame the
+  stream it belongs to, stream N travels through its own fifo on both
+  ends. The MD5 trailer covers the frames in the order they were sent.
+
+  From version 6 the backup command picks a codec for the stream, given
+  in the TW ADB Backup Header. TWRP compresses partition images with it
+  as well as tars, and the compressed field of every file header holds
+  the Archive_Type of its data. Version 5 and older only knew 1 for gzip
+  tars. The relays never look into the data, so the host is unchanged.
+
+  From version 7 the TW ADB Backup Header gives the digest the relay
+  puts in the MD5 trailers. It is xxh64, which keeps up with USB 3 on one
+  core, older streams always use md5. TWRP only compares the trailer to
+  the TWMD5 digest the relay computed on restore, so it works with both.
+
+  The relay keeps a session file of the files that made it through, one
+  record per line. A backup session starts with "options <command>" and
+  has "file <bytes> <md5> <name>" for every file followed by at least
+  TW_ADB_RESUME_MARGIN of other data, since adbd and the host still hold
+  the last data written. "adb backup --twrp resume" sends the partitions
+  that are not in it as a new stream. A restore session has "file
+  <header crc> <md5> <name>" for every file TWRP restored, the names
+  hold the backup folder so the crc tells the backups apart. Restoring
+  the stream again only checks the digest of those files. Tar streams
+  are not reproducible, so a file always restarts from its header.
+
+  TW_ADB_STATS gets a line of space separated key=value pairs every
+  TW_ADB_STATS_INTERVAL seconds ("progress"), at the end of every file
+  ("file") and at the end of the stream ("stream"). fifo_wait is the time
+  the relay waited for TWRP and adb_wait the time it waited for adbd and
+  the host, both in seconds. file comes last and runs to the end of the
+  line.
 */
 
+//fifo of stream_id of a multiplexed file, stream 0 uses the plain fifo
+inline std::string twadb_stream_fifo(const char* fifo, unsigned stream_id) {
+	std::string name(fifo);
+
+	if (stream_id > 0)
+		name += (char) ('0' + stream_id);
+	return name;
+}
+
 //determine whether struct is 512 bytes, if not fail compilation
 #define ADBSTRUCT_STATIC_ASSERT(structure) typedef char adb_assertion[( !!(structure) )*2-1 ]
 
@@ -83,9 +154,20 @@ struct twfilehdr {
 	char start_of_header[8];			//stores the magic value #define TWRP
 	char type[16];					//stores the type of file header, TWFN or TWIMG
 	uint64_t size;					//stores the size of the file contained after this header in the backup file
-	uint64_t compressed;				//stores whether the file is compressed or not. 1 == compressed and 0 == uncompressed
+	uint64_t compressed;				//stores the Archive_Type the file is compressed with, 0 == uncompressed and 1 == gzip, and ADB_ENCRYPTED_STREAMS in the high 32 bits
 	uint32_t crc;					//stores the zlib 32 bit crc of the twfilehdr struct to allow for making sure we are processing metadata
-	char name[468];					//stores the filename of the file
+	char name[464];					//stores the filename of the file
+	uint32_t streams;				//stores the number of streams the data is split over, 0 or 1 for a single stream
+};
+
+//data frame header, version 4 and later fill in size
+struct AdbBackupDataHeader {
+	char start_of_header[8];			//stores the magic value #define TWRP
+	char type[16];					//stores the AdbBackupDataHeader type TWDATA
+	uint64_t size;					//stores the number of data bytes following this header
+	uint32_t crc;					//stores the zlib 32 bit crc of the AdbBackupDataHeader struct to allow for making sure we are processing metadata
+	uint32_t stream_id;				//stores the stream of a multiplexed file the data belongs to
+	char space[472];				//stores space to align the struct to 512 bytes
 };
 
 //md5 for files stored as a trailer to files in the adb backup file to check
@@ -95,7 +177,7 @@ struct AdbBackupFileTrailer {
 	char type[16];					//stores the AdbBackupFileTrailer type MD5TRAILER
 	uint32_t crc;					//stores the zlib 32 bit crc of the AdbBackupFileTrailer struct to allow for making sure we are processing metadata
 	uint32_t ident;					//stores crc to determine if header is encapsulated in stream as data
-	char md5[40];					//stores the md5 computation of the file
+	char md5[40];					//stores the digest of the file, md5 or what the stream header gives
 	char space[440];				//stores space to align the struct to 512 bytes
 };
 
@@ -106,7 +188,9 @@ struct AdbBackupStreamHeader {
 	uint64_t partition_count;			//stores the number of partitions to restore in the stream
 	uint64_t version;				//stores the version of adb backup. increment ADB_BACKUP_VERSION each time the metadata is updated
 	uint32_t crc;					//stores the zlib 32 bit crc of the AdbBackupStreamHeader struct to allow for making sure we are processing metadata
-	char space[468];				//stores space to align the struct to 512 bytes
+	uint32_t compression;				//stores the Archive_Type the backup command asked for, 0 for none
+	uint32_t digest;				//stores the ADB_DIGEST_* of the trailers
+	char space[460];				//stores space to align the struct to 512 bytes
 };
 
 #endif //__TWADBSTREAM_H
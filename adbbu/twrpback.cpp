@@ -24,13 +24,22 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
 #include <zlib.h>
 #include <ctype.h>
 #include <semaphore.h>
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <iomanip>
 #include <algorithm>
+#include <vector>
 #include <utils/threads.h>
 #include <pthread.h>
 
@@ -47,11 +56,20 @@ twrpback::twrpback(void) {
 	write_fd = 0;
 	adb_control_twrp_fd = 0;
 	adb_control_bu_fd = 0;
-	adb_read_fd = 0;
-	adb_write_fd = 0;
+	for (unsigned i = 0; i < TW_ADB_MAX_STREAMS; i++) {
+		streams[i].fd = -1;
+		streams[i].frameBytes = 0;
+		streams[i].writeFailed = false;
+	}
+	streamCount = 1;
 	ors_fd = 0;
 	debug_adb_fd = 0;
 	firstPart = true;
+	useSplice = false;
+	splicePipeSize = 0;
+	digestPipe[0] = digestPipe[1] = -1;
+	relayPipe[0] = relayPipe[1] = -1;
+	lastStatsReport = 0;
 	createFifos();
 	adbloginit();
 }
@@ -103,8 +121,7 @@ void twrpback::close_backup_fds() {
 		close(ors_fd);
 	if (write_fd > 0)
 		close(write_fd);
-	if (adb_read_fd > 0)
-		close(adb_read_fd);
+	closeStreams();
 	if (adb_control_bu_fd > 0)
 		close(adb_control_bu_fd);
 	#ifdef _DEBUG_ADB_BACKUP
@@ -113,8 +130,13 @@ void twrpback::close_backup_fds() {
 	#endif
 	if (adbd_fp != NULL)
 		fclose(adbd_fp);
-	if (access(TW_ADB_BACKUP, F_OK) == 0)
-		unlink(TW_ADB_BACKUP);
+	adbd_fp = NULL;
+	closeSplicePipes();
+	for (unsigned i = 0; i < TW_ADB_MAX_STREAMS; i++) {
+		std::string fifo = twadb_stream_fifo(TW_ADB_BACKUP, i);
+		if (access(fifo.c_str(), F_OK) == 0)
+			unlink(fifo.c_str());
+	}
 }
 
 void twrpback::close_restore_fds() {
@@ -126,10 +148,22 @@ void twrpback::close_restore_fds() {
 		close(adb_control_bu_fd);
 	if (adb_control_twrp_fd > 0)
 		close(adb_control_twrp_fd);
+	closeStreams();
+	if (readAhead.isRunning()) {
+		std::stringstream str;
+		str << "read ahead waited " << readAhead.fullWaits << " times for TWRP and " << readAhead.emptyWaits << " times for adbd\n";
+		adblogwrite(str.str());
+		readAhead.stopReader();
+	}
 	if (adbd_fp != NULL)
 		fclose(adbd_fp);
-	if (access(TW_ADB_RESTORE, F_OK) == 0)
-		unlink(TW_ADB_RESTORE);
+	adbd_fp = NULL;
+	closeSplicePipes();
+	for (unsigned i = 0; i < TW_ADB_MAX_STREAMS; i++) {
+		std::string fifo = twadb_stream_fifo(TW_ADB_RESTORE, i);
+		if (access(fifo.c_str(), F_OK) == 0)
+			unlink(fifo.c_str());
+	}
 	#ifdef _DEBUG_ADB_BACKUP
 	if (debug_adb_fd > 0)
 		close(debug_adb_fd);
@@ -137,43 +171,58 @@ void twrpback::close_restore_fds() {
 }
 
 bool twrpback::backup(std::string command) {
-	twrpMD5 digest;
-	int bytes = 0, errctr = 0;
-	char adbReadStream[MAX_ADB_READ];
-	uint64_t totalbytes = 0, dataChunkBytes = 0, fileBytes = 0;
+	twrpDigest* digest = &md5Digest;
+	uint64_t totalbytes = 0, fileStart = 0;
 	uint64_t md5fnsize = 0;
 	struct AdbBackupControlType endadb;
+	std::string fileName, arg;
+	std::istringstream args(command);
+	bool resume = false;
 
 	//ADBSTRUCT_STATIC_ASSERT(sizeof(endadb) == MAX_ADB_READ);
 
 	bool writedata = true;
 	bool compressed = false;
-	bool firstDataPacket = true;
 
+	dataFrame.resize(DATA_MAX_CHUNK_SIZE);
 	adbd_fp = fdopen(adbd_fd, "w");
 	if (adbd_fp == NULL) {
 		adblogwrite("Unable to open adb_fp\n");
 		return false;
 	}
 
-	if (mkfifo(TW_ADB_BACKUP, 0666) < 0) {
-		adblogwrite("Unable to create TW_ADB_BACKUP fifo\n");
+	for (unsigned i = 0; i < TW_ADB_MAX_STREAMS; i++) {
+		if (mkfifo(twadb_stream_fifo(TW_ADB_BACKUP, i).c_str(), 0666) < 0) {
+			adblogwrite("Unable to create TW_ADB_BACKUP fifo\n");
+			return false;
+		}
+	}
+
+	//a new backup replaces the session of an interrupted one, a resumed
+	//backup adds the files it sends to it
+	while (args >> arg) {
+		if (arg == TWRP_RESUME_ARG || arg == "--" TWRP_RESUME_ARG)
+			resume = true;
+	}
+	unconfirmedFiles.clear();
+	if (!resume && !twadbbu::Write_Session(TW_ADB_BACKUP_SESSION, "options " + command, false))
+		adblogwrite("Unable to write TW_ADB_BACKUP_SESSION\n");
+
+	//the control fifo is ready before TWRP hears of the backup, so its
+	//first message doesn't find it closed
+	adblogwrite("opening TW_ADB_BU_CONTROL\n");
+	if (!openControl(TW_ADB_BU_CONTROL, &adb_control_bu_fd)) {
+		close_backup_fds();
 		return false;
 	}
 
 	adblogwrite("opening TW_ADB_FIFO\n");
-
 	write_fd = open(TW_ADB_FIFO, O_WRONLY);
-	while (write_fd < 0) {
-		write_fd = open(TW_ADB_FIFO, O_WRONLY);
-		usleep(10000);
-		errctr++;
-		if (errctr > ADB_BU_MAX_ERROR) {
-			std::string msg = "Unable to open TW_ADB_FIFO";
-			printErrMsg(msg, errno);
-			close_backup_fds();
-			return false;
-		}
+	if (write_fd < 0) {
+		std::string msg = "Unable to open TW_ADB_FIFO";
+		printErrMsg(msg, errno);
+		close_backup_fds();
+		return false;
 	}
 
 	memset(operation, 0, sizeof(operation));
@@ -188,28 +237,25 @@ bool twrpback::backup(std::string command) {
 		return false;
 	}
 
-	memset(&adbReadStream, 0, sizeof(adbReadStream));
 	memset(&cmd, 0, sizeof(cmd));
 
-	adblogwrite("opening TW_ADB_BU_CONTROL\n");
-	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_RDONLY | O_NONBLOCK);
-	if (adb_control_bu_fd < 0) {
-		adblogwrite("Unable to open TW_ADB_BU_CONTROL for reading.\n");
-		close_backup_fds();
-		return false;
-	}
-
 	adblogwrite("opening TW_ADB_BACKUP\n");
-	adb_read_fd = open(TW_ADB_BACKUP, O_RDONLY | O_NONBLOCK);
-	if (adb_read_fd < 0) {
+	if (!openStreams(TW_ADB_BACKUP, O_RDONLY | O_NONBLOCK, TW_ADB_MAX_STREAMS)) {
 		adblogwrite("Unable to open TW_ADB_BACKUP for reading.\n");
 		close_backup_fds();
 		return false;
 	}
+	openSplicePipes(false);
+	startStats("backup");
 
 	//loop until TWENDADB sent
 	while (true) {
+		double loopStart = statsTime();
+		uint64_t loopBytes = totalbytes;
+		bool gotCommand = false;
+
 		if (read(adb_control_bu_fd, &cmd, sizeof(cmd)) > 0) {
+			gotCommand = true;
 			struct AdbBackupControlType structcmd;
 
 			memcpy(&structcmd, cmd, sizeof(cmd));
@@ -230,12 +276,17 @@ bool twrpback::backup(std::string command) {
 				std::stringstream str;
 				str << totalbytes;
 				adblogwrite(str.str() + " total bytes written\n");
+				reportStats("stream", streamStats);
 				break;
 			}
 			//we recieved the TWSTREAMHDR structure metadata to write to adb
 			else if (cmdtype == TWSTREAMHDR) {
+				struct AdbBackupStreamHeader cnthdr;
+
 				writedata = false;
 				adblogwrite("writing TWSTREAMHDR\n");
+				memcpy(&cnthdr, cmd, sizeof(cmd));
+				digest = streamDigest(&cnthdr);
 				if (fwrite(cmd, 1, sizeof(cmd), adbd_fp) != sizeof(cmd)) {
 					std::string msg = "Error writing TWSTREAMHDR to adbd";
 					printErrMsg(msg, errno);
@@ -249,11 +300,15 @@ bool twrpback::backup(std::string command) {
 				struct twfilehdr twimghdr;
 
 				adblogwrite("writing TWIMG\n");
-				digest.init();
+				digest->init();
 				memset(&twimghdr, 0, sizeof(twimghdr));
 				memcpy(&twimghdr, cmd, sizeof(cmd));
 				md5fnsize = twimghdr.size;
 				compressed = false;
+				streamCount = 1;
+				fileName = twimghdr.name;
+				fileStart = totalbytes;
+				startFileStats(fileName);
 
 				#ifdef _DEBUG_ADB_BACKUP
 				std::string debug_fname = "/data/media/";
@@ -276,7 +331,7 @@ bool twrpback::backup(std::string command) {
 				struct twfilehdr twfilehdr;
 
 				adblogwrite("writing TWFN\n");
-				digest.init();
+				digest->init();
 
 				//ADBSTRUCT_STATIC_ASSERT(sizeof(twfilehdr) == MAX_ADB_READ);
 
@@ -285,6 +340,10 @@ bool twrpback::backup(std::string command) {
 				md5fnsize = twfilehdr.size;
 
 				compressed = twfilehdr.compressed == 1 ? true: false;
+				setStreamCount(twfilehdr.streams);
+				fileName = twfilehdr.name;
+				fileStart = totalbytes;
+				startFileStats(fileName);
 
 				#ifdef _DEBUG_ADB_BACKUP
 				std::string debug_fname = "/data/media/";
@@ -304,72 +363,26 @@ bool twrpback::backup(std::string command) {
 			}
 			/*
 			We received the command that we are done with the file stream.
-			We will flush the remaining data stream.
+			We will flush the remaining data stream as data frames.
 			Update md5 and write final results to adb stream.
-			If we need padding because the total bytes are not a multiple
-			of 512, we pad the end with 0s to we reach 512.
-			We also write the final md5 to the adb stream.
+			Frames carry their own size, so no padding is needed
+			before the md5 trailer. Every stream of the file ended
+			before TWRP sent TWEOF.
 			*/
 			else if (cmdtype == TWEOF) {
 				adblogwrite("received TWEOF\n");
-				while ((bytes = read(adb_read_fd, &adbReadStream, sizeof(adbReadStream)) != 0)) {
-					totalbytes += bytes;
-					fileBytes += bytes;
-					dataChunkBytes += bytes;
-
-					char *writeAdbReadStream = new char [bytes];
-					memcpy(writeAdbReadStream, adbReadStream, bytes);
-
-					digest.update((unsigned char *) writeAdbReadStream, bytes);
-					if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) < 0) {
-						std::string msg = "Cannot write to adbd stream: ";
-						printErrMsg(msg, errno);
-					}
-					#if defined(_DEBUG_ADB_BACKUP)
-					if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-						std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-						printErrMsg(msg, errno);
-						close_restore_fds();
-						return false;
-					}
-					#endif
-					fflush(adbd_fp);
-					delete [] writeAdbReadStream;
-					memset(adbReadStream, 0, sizeof(adbReadStream));
-				}
-
-				if (fileBytes % DATA_MAX_CHUNK_SIZE != 0) {
-					int64_t count = fileBytes / DATA_MAX_CHUNK_SIZE + 1;
-					uint64_t ceilingBytes = count * DATA_MAX_CHUNK_SIZE;
-					char padding[ceilingBytes - fileBytes];
-					int paddingBytes = sizeof(padding);
-					memset(padding, 0, paddingBytes);
-					std::stringstream paddingStr;
-					paddingStr << paddingBytes;
-					adblogwrite("writing padding to stream: " + paddingStr.str() + " bytes\n");
-					if (fwrite(padding, 1, paddingBytes, adbd_fp) != sizeof(padding)) {
-						adblogwrite("Error writing padding to adbd\n");
+				for (unsigned i = 0; i < streamCount; i++) {
+					if (!backupStreamData(i, true, digest, &totalbytes)) {
 						close_backup_fds();
 						return false;
 					}
-					#if defined(_DEBUG_ADB_BACKUP)
-					if (write(debug_adb_fd, padding, paddingBytes) < 1) {
-						std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-						printErrMsg(msg, errno);
-						close_restore_fds();
-						return false;
-					}
-					#endif
-					totalbytes += paddingBytes;
-					digest.update((unsigned char *) padding, paddingBytes);
-					fflush(adbd_fp);
 				}
 
 				AdbBackupFileTrailer md5trailer;
 
 				memset(&md5trailer, 0, sizeof(md5trailer));
 
-				std::string md5string = digest.return_digest_string();
+				std::string md5string = digest->return_digest_string();
 
 				strncpy(md5trailer.start_of_trailer, TWRP, sizeof(md5trailer.start_of_trailer));
 				strncpy(md5trailer.type, MD5TRAILER, sizeof(md5trailer.type));
@@ -389,104 +402,38 @@ bool twrpback::backup(std::string command) {
 				}
 				fflush(adbd_fp);
 				writedata = false;
-				firstDataPacket = true;
-				fileBytes = 0;
+
+				std::stringstream record;
+				record << "file " << totalbytes - fileStart << " " << md5string << " " << fileName;
+				unconfirmedFiles.push_back(std::make_pair(totalbytes, record.str()));
+				endFileStats();
 			}
 			memset(&cmd, 0, sizeof(cmd));
-			dataChunkBytes = 0;
 		}
 		//If we are to write data because of a new file stream, lets write all the data.
 		//This will allow us to not write data after a command structure has been written
 		//to the adb stream.
 		//If the stream is compressed, we need to always write the data.
+		//Data is collected into frames of up to DATA_MAX_CHUNK_SIZE, a partial
+		//frame is kept until it fills up or TWEOF is received.
+		//The streams of a file take turns so each thread keeps moving.
 		if (writedata || compressed) {
-			while ((bytes = read(adb_read_fd, &adbReadStream, sizeof(adbReadStream))) > 0) {
-				if (firstDataPacket) {
-					if (!twadbbu::Write_TWDATA(adbd_fp)) {
-						close_backup_fds();
-						return false;
-					}
-					fileBytes += MAX_ADB_READ;
-					fflush(adbd_fp);
-					firstDataPacket = false;
-					dataChunkBytes += sizeof(adbReadStream);
-				}
-				char *writeAdbReadStream = new char [bytes];
-				memcpy(writeAdbReadStream, adbReadStream, bytes);
-
-				digest.update((unsigned char *) writeAdbReadStream, bytes);
-
-				totalbytes += bytes;
-				fileBytes += bytes;
-				dataChunkBytes += bytes;
-
-				if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) != (unsigned long long)bytes) {
-					adblogwrite("Error writing backup data to adbd\n");
+			for (unsigned i = 0; i < streamCount; i++) {
+				if (!backupStreamData(i, false, digest, &totalbytes)) {
 					close_backup_fds();
 					return false;
 				}
-				#ifdef _DEBUG_ADB_BACKUP
-				if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-					std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-					printErrMsg(msg, errno);
-					close_restore_fds();
-					return false;
-				}
-				#endif
-				fflush(adbd_fp);
-				delete [] writeAdbReadStream;
-
-				memset(&adbReadStream, 0, sizeof(adbReadStream));
-
-				if (dataChunkBytes == DATA_MAX_CHUNK_SIZE) {
-					dataChunkBytes = 0;
-					firstDataPacket = true;
-				}
-				else if (dataChunkBytes > (DATA_MAX_CHUNK_SIZE - sizeof(adbReadStream))) {
-					int bytesLeft = DATA_MAX_CHUNK_SIZE - dataChunkBytes;
-					char extraData[bytesLeft];
-
-					memset(&extraData, 0, bytesLeft);
-					while ((bytes = read(adb_read_fd, &extraData, bytesLeft)) != 0) {
-						if (bytes > 0) {
-							totalbytes += bytes;
-							fileBytes += bytes;
-							dataChunkBytes += bytes;
-
-							bytesLeft -= bytes;
-							char *writeAdbReadStream = new char [bytes];
-							memcpy(writeAdbReadStream, extraData, bytes);
-
-							digest.update((unsigned char *) writeAdbReadStream, bytes);
-							if (fwrite(writeAdbReadStream, 1, bytes, adbd_fp) < 0) {
-								std::string msg = "Cannot write to adbd stream: ";
-								printErrMsg(msg, errno);
-								close_restore_fds();
-								return false;
-							}
-							#ifdef _DEBUG_ADB_BACKUP
-							if (write(debug_adb_fd, writeAdbReadStream, bytes) < 1) {
-								std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
-								printErrMsg(msg, errno);
-								close_restore_fds();
-								return false;
-							}
-							#endif
-							fflush(adbd_fp);
-							delete [] writeAdbReadStream;
-						}
-						memset(&extraData, 0, bytesLeft);
-						if (bytesLeft == 0) {
-							break;
-						}
-					}
-
-					fflush(adbd_fp);
-					dataChunkBytes = 0;
-					firstDataPacket = true;
-				}
 			}
 		}
+		confirmSessionFiles(totalbytes);
+		//nothing came from TWRP in this round, between files only a
+		//command can come next
+		if (!gotCommand && totalbytes == loopBytes) {
+			if (!writedata && !compressed)
+				waitForControl();
+			countWait(false, loopStart);
+		}
+		periodicStats();
 	}
 
 	//Write the final end adb structure to the adb stream
@@ -496,23 +443,31 @@ bool twrpback::backup(std::string command) {
 		return false;
 	}
 	fflush(adbd_fp);
+	//nothing is left to resume
+	unconfirmedFiles.clear();
+	unlink(TW_ADB_BACKUP_SESSION);
 	close_backup_fds();
 	return true;
 }
 
 bool twrpback::restore(void) {
-	twrpMD5 digest;
+	twrpDigest* digest = &md5Digest;
 	char cmd[MAX_ADB_READ];
 	char readAdbStream[MAX_ADB_READ];
 	struct AdbBackupControlType structcmd;
-	int errctr = 0;
 	uint64_t totalbytes = 0, dataChunkBytes = 0;
 	uint64_t md5fnsize = 0, fileBytes = 0;
+	uint64_t stream_version = ADB_BACKUP_MIN_VERSION;
 	bool read_from_adb;
 	bool md5sumdata;
-	bool compressed, tweofrcvd, extraData;
+	bool compressed, tweofrcvd = false, extraData;
+	//files an earlier, interrupted restore of the stream finished
+	std::vector<std::string> session = twadbbu::Read_Session(TW_ADB_RESTORE_SESSION);
+	std::string fileRecord, fileName, fileMd5, restoredRecord;
+	bool skipFile = false, streamEnded = false;
 
 	read_from_adb = true;
+	dataFrame.resize(DATA_MAX_CHUNK_SIZE);
 
 	signal(SIGPIPE, SIG_IGN);
 	signal(SIGHUP, SIG_IGN);
@@ -523,25 +478,46 @@ bool twrpback::restore(void) {
 		close_restore_fds();
 		return false;
 	}
+	//a thread reads ahead of TWRP into a ring, so a stall writing the flash
+	//does not stop USB and the other way round. Without it frames are
+	//spliced straight from adbd_fd, so nothing may be left in the stdio
+	//buffer after reading a header
+	if (readAhead.startReader(adbd_fd, (size_t) TW_ADB_RESTORE_BUFFER_MB * 1048576)) {
+		std::stringstream str;
+		str << TW_ADB_RESTORE_BUFFER_MB;
+		adblogwrite("reading up to " + str.str() + "MB ahead of TWRP\n");
+	}
+	else if (openSplicePipes(true))
+		setvbuf(adbd_fp, NULL, _IONBF, 0);
 
-	if(mkfifo(TW_ADB_RESTORE, 0666)) {
-		adblogwrite("Unable to create TW_ADB_RESTORE fifo\n");
+	for (unsigned i = 0; i < TW_ADB_MAX_STREAMS; i++) {
+		if (mkfifo(twadb_stream_fifo(TW_ADB_RESTORE, i).c_str(), 0666)) {
+			adblogwrite("Unable to create TW_ADB_RESTORE fifo\n");
+			close_restore_fds();
+			return false;
+		}
+	}
+
+	//both control fifos are ready before TWRP hears of the restore, so
+	//neither side has to retry opening them
+	adblogwrite("opening TW_ADB_BU_CONTROL\n");
+	if (!openControl(TW_ADB_BU_CONTROL, &adb_control_bu_fd)) {
+		close_restore_fds();
+		return false;
+	}
+	adblogwrite("opening TW_ADB_TWRP_CONTROL\n");
+	if (!openControl(TW_ADB_TWRP_CONTROL, &adb_control_twrp_fd)) {
 		close_restore_fds();
 		return false;
 	}
 
 	adblogwrite("opening TW_ADB_FIFO\n");
 	write_fd = open(TW_ADB_FIFO, O_WRONLY);
-
-	while (write_fd < 0) {
-		write_fd = open(TW_ADB_FIFO, O_WRONLY);
-		errctr++;
-		if (errctr > ADB_BU_MAX_ERROR) {
-			std::string msg = "Unable to open TW_ADB_FIFO.";
-			printErrMsg(msg, errno);
-			close_restore_fds();
-			return false;
-		}
+	if (write_fd < 0) {
+		std::string msg = "Unable to open TW_ADB_FIFO.";
+		printErrMsg(msg, errno);
+		close_restore_fds();
+		return false;
 	}
 
 	memset(operation, 0, sizeof(operation));
@@ -555,36 +531,16 @@ bool twrpback::restore(void) {
 	memset(&readAdbStream, 0, sizeof(readAdbStream));
 	memset(&cmd, 0, sizeof(cmd));
 
-	adblogwrite("opening TW_ADB_BU_CONTROL\n");
-	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_RDONLY | O_NONBLOCK);
-	if (adb_control_bu_fd < 0) {
-		std::string msg = "Unable to open TW_ADB_BU_CONTROL for writing.";
-		printErrMsg(msg, errno);
-		close_restore_fds();
-		return false;
-	}
-
-	adblogwrite("opening TW_ADB_TWRP_CONTROL\n");
-	adb_control_twrp_fd = open(TW_ADB_TWRP_CONTROL, O_WRONLY | O_NONBLOCK);
-	if (adb_control_twrp_fd < 0) {
-		std::string msg = "Unable to open TW_ADB_TWRP_CONTROL for writing. Retrying...";
-		printErrMsg(msg, errno);
-		while (adb_control_twrp_fd < 0) {
-			adb_control_twrp_fd = open(TW_ADB_TWRP_CONTROL, O_WRONLY | O_NONBLOCK);
-			usleep(10000);
-			errctr++;
-			if (errctr > ADB_BU_MAX_ERROR) {
-				adblogwrite("Unable to open TW_ADB_TWRP_CONTROL\n");
-				close_backup_fds();
-				return false;
-			}
-		}
-	}
+	startStats("restore");
 
 	//Loop until we receive TWENDADB from TWRP
 	while (true) {
+		double loopStart = statsTime();
+		bool gotCommand = false;
+
 		memset(&cmd, 0, sizeof(cmd));
 		if (read(adb_control_bu_fd, &cmd, sizeof(cmd)) > 0) {
+			gotCommand = true;
 			struct AdbBackupControlType structcmd;
 			memcpy(&structcmd, cmd, sizeof(cmd));
 			std::string cmdtype = structcmd.get_type();
@@ -594,7 +550,11 @@ bool twrpback::restore(void) {
 				adblogwrite("Received TWEOF\n");
 				read_from_adb = true;
 				tweofrcvd = true;
-				close(adb_write_fd);
+				closeStreams();
+				if (!restoredRecord.empty()) {
+					twadbbu::Write_Session(TW_ADB_RESTORE_SESSION, restoredRecord, true);
+					restoredRecord.clear();
+				}
 			}
 			//Break when TWRP sends TWENDADB
 			else if (cmdtype == TWENDADB) {
@@ -611,7 +571,7 @@ bool twrpback::restore(void) {
 		//If we should read from the adb stream, write commands and data to TWRP
 		if (read_from_adb) {
 			int readbytes;
-			if ((readbytes = fread(readAdbStream, 1, sizeof(readAdbStream), adbd_fp)) == sizeof(readAdbStream)) {
+			if ((readbytes = readAdbData(readAdbStream, sizeof(readAdbStream))) == sizeof(readAdbStream)) {
 				memcpy(&structcmd, readAdbStream, sizeof(readAdbStream));
 				std::string cmdtype = structcmd.get_type();
 
@@ -629,6 +589,7 @@ bool twrpback::restore(void) {
 					crc = crc32(crc, (const unsigned char*) &endadb, sizeof(endadb));
 
 					if (crc == endadbcrc) {
+						streamEnded = true;
 						adblogwrite("sending TWENDADB\n");
 						if (write(adb_control_twrp_fd, &endadb, sizeof(endadb)) < 1) {
 							std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
@@ -661,6 +622,8 @@ bool twrpback::restore(void) {
 
 					if (crc == cnthdrcrc) {
 						adblogwrite("Restoring TWSTREAMHDR\n");
+						stream_version = cnthdr.version;
+						digest = streamDigest(&cnthdr);
 						if (write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 0) {
 							std::string msg = "Cannot write to adb_control_twrp_fd: ";
 							printErrMsg(msg, errno);
@@ -684,7 +647,7 @@ bool twrpback::restore(void) {
 					dataChunkBytes = 0;
 					extraData = false;
 
-					digest.init();
+					digest->init();
 					adblogwrite("Restoring TWIMG\n");
 					memset(&twimghdr, 0, sizeof(twimghdr));
 					memcpy(&twimghdr, readAdbStream, sizeof(readAdbStream));
@@ -695,7 +658,10 @@ bool twrpback::restore(void) {
 					crc = crc32(0L, Z_NULL, 0);
 					crc = crc32(crc, (const unsigned char*) &twimghdr, sizeof(twimghdr));
 					if (crc == twimghdrcrc) {
-						if (write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 1) {
+						fileName = twimghdr.name;
+						startFileStats(fileName);
+						skipFile = stream_version >= ADB_FRAMED_VERSION && restoredBefore(session, twimghdrcrc, &fileRecord, &fileMd5);
+						if (!skipFile && write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 1) {
 							std::string msg = "Cannot write to adb_control_twrp_fd: ";
 							printErrMsg(msg, errno);
 							close_restore_fds();
@@ -717,8 +683,14 @@ bool twrpback::restore(void) {
 					adblogwrite("Opened restore image\n");
 					#endif
 
+					streamCount = 1;
+					if (skipFile)
+						continue;
 					adblogwrite("opening TW_ADB_RESTORE\n");
-					adb_write_fd = open(TW_ADB_RESTORE, O_WRONLY);
+					if (!openStreams(TW_ADB_RESTORE, O_WRONLY, streamCount)) {
+						close_restore_fds();
+						return false;
+					}
 				}
 				//Tell TWRP we are sending a tar stream
 				else if (cmdtype == TWFN) {
@@ -730,7 +702,7 @@ bool twrpback::restore(void) {
 					dataChunkBytes = 0;
 					extraData = false;
 
-					digest.init();
+					digest->init();
 					adblogwrite("Restoring TWFN\n");
 					memset(&twfilehdr, 0, sizeof(twfilehdr));
 					memcpy(&twfilehdr, readAdbStream, sizeof(readAdbStream));
@@ -742,7 +714,10 @@ bool twrpback::restore(void) {
 					crc = crc32(crc, (const unsigned char*) &twfilehdr, sizeof(twfilehdr));
 
 					if (crc == twfilehdrcrc) {
-						if (write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 1) {
+						fileName = twfilehdr.name;
+						startFileStats(fileName);
+						skipFile = stream_version >= ADB_FRAMED_VERSION && restoredBefore(session, twfilehdrcrc, &fileRecord, &fileMd5);
+						if (!skipFile && write(adb_control_twrp_fd, readAdbStream, sizeof(readAdbStream)) < 1) {
 							std::string msg = "Cannot write to adb_control_twrp_fd: ";
 							printErrMsg(msg, errno);
 							close_restore_fds();
@@ -765,30 +740,77 @@ bool twrpback::restore(void) {
 					#endif
 
 					compressed = twfilehdr.compressed == 1 ? true: false;
+					//each tar thread of TWRP reads its stream from its own fifo
+					setStreamCount(twfilehdr.streams);
+					if (skipFile)
+						continue;
 					adblogwrite("opening TW_ADB_RESTORE\n");
-					adb_write_fd = open(TW_ADB_RESTORE, O_WRONLY);
+					if (!openStreams(TW_ADB_RESTORE, O_WRONLY, streamCount)) {
+						close_restore_fds();
+						return false;
+					}
 				}
 				else if (cmdtype == MD5TRAILER) {
-					if (fileBytes >= md5fnsize)
-						close(adb_write_fd);
+					struct AdbBackupFileTrailer md5tr;
+					bool restored = tweofrcvd;
+
+					memcpy(&md5tr, readAdbStream, sizeof(md5tr));
+					std::string md5string(md5tr.md5, strnlen(md5tr.md5, sizeof(md5tr.md5)));
+					md5sumdata = false;
+					endFileStats();
+					//a skipped file has to be the one restored before
+					if (skipFile) {
+						skipFile = false;
+						if (digest->return_digest_string() != fileMd5 || md5string != fileMd5) {
+							adblogwrite("ADB file " + fileName + " differs from the one restored before\n");
+							close_restore_fds();
+							return false;
+						}
+						continue;
+					}
+					//framed data ends right before the trailer
+					if (fileBytes >= md5fnsize || stream_version >= ADB_FRAMED_VERSION)
+						closeStreams();
 					if (tweofrcvd) {
 						read_from_adb = true;
 						tweofrcvd = false;
 					}
 					else
 						read_from_adb = false; //don't read from adb until TWRP sends TWEOF
-					md5sumdata = false;
-					if (!checkMD5Trailer(readAdbStream, md5fnsize, &digest)) {
+					std::string sentmd5;
+					if (!checkMD5Trailer(readAdbStream, md5fnsize, digest, &sentmd5)) {
 						close_restore_fds();
 						break;
 					}
+					//the file is in the session once TWRP restored it, TWEOF
+					//can come before or after the trailer
+					if (stream_version >= ADB_FRAMED_VERSION && sentmd5 == md5string) {
+						restoredRecord = fileRecord + md5string + " " + fileName;
+						if (restored) {
+							twadbbu::Write_Session(TW_ADB_RESTORE_SESSION, restoredRecord, true);
+							restoredRecord.clear();
+						}
+					}
 					continue;
 				}
+				//Send a data frame of the tar or partition image to TWRP
+				else if (cmdtype == TWDATA && stream_version >= ADB_FRAMED_VERSION) {
+					uint64_t frameBytes;
+
+					md5sumdata = false;
+					read_from_adb = true;
+					if (!restoreDataFrame(readAdbStream, digest, &frameBytes)) {
+						close_restore_fds();
+						return false;
+					}
+					totalbytes += frameBytes;
+					fileBytes += frameBytes;
+				}
 				//Send the tar or partition image md5 to TWRP
 				else if (cmdtype == TWDATA) {
 					dataChunkBytes += sizeof(readAdbStream);
 					while (true) {
-						if ((readbytes = fread(readAdbStream, 1, sizeof(readAdbStream), adbd_fp)) != sizeof(readAdbStream)) {
+						if ((readbytes = readAdbData(readAdbStream, sizeof(readAdbStream))) != sizeof(readAdbStream)) {
 							close_restore_fds();
 							return false;
 						}
@@ -800,22 +822,23 @@ bool twrpback::restore(void) {
 						fileBytes += readbytes;
 
 						if (cmdtype == MD5TRAILER) {
+							endFileStats();
 							if (fileBytes >= md5fnsize)
-								close(adb_write_fd);
+								closeStreams();
 							if (tweofrcvd) {
 								tweofrcvd = false;
 								read_from_adb = true;
 							}
 							else
 								read_from_adb = false; //don't read from adb until TWRP sends TWEOF
-							if (!checkMD5Trailer(readAdbStream, md5fnsize, &digest)) {
+							if (!checkMD5Trailer(readAdbStream, md5fnsize, digest)) {
 								close_restore_fds();
 								break;
 							}
 							break;
 						}
 
-						digest.update((unsigned char*)readAdbStream, readbytes);
+						digest->update((unsigned char*)readAdbStream, readbytes);
 
 						read_from_adb = true;
 
@@ -828,7 +851,7 @@ bool twrpback::restore(void) {
 						}
 						#endif
 
-						if (write(adb_write_fd, readAdbStream, sizeof(readAdbStream)) < 0) {
+						if (write(streams[0].fd, readAdbStream, sizeof(readAdbStream)) < 0) {
 							std::string msg = "Cannot write to TWRP ADB FIFO: ";
 							md5sumdata = true;
 							printErrMsg(msg, errno);
@@ -844,12 +867,22 @@ bool twrpback::restore(void) {
 					}
 				}
 				else if (md5sumdata) {
-					digest.update((unsigned char*)readAdbStream, sizeof(readAdbStream));
+					digest->update((unsigned char*)readAdbStream, sizeof(readAdbStream));
 					md5sumdata = true;
 				}
 			}
 		}
+		//waiting for TWRP to finish the file before reading on
+		else if (!gotCommand) {
+			waitForControl();
+			countWait(false, loopStart);
+		}
+		periodicStats();
 	}
+	//the whole stream was restored, nothing is left to resume
+	if (streamEnded)
+		unlink(TW_ADB_RESTORE_SESSION);
+	reportStats("stream", streamStats);
 	std::stringstream str;
 	str << totalbytes;
 	close_restore_fds();
@@ -857,6 +890,651 @@ bool twrpback::restore(void) {
 	return true;
 }
 
+bool twrpback::openStreams(const char* fifo, int flags, unsigned count) {
+	for (unsigned i = 0; i < count; i++) {
+		std::string name = twadb_stream_fifo(fifo, i);
+
+		streams[i].fd = open(name.c_str(), flags);
+		if (streams[i].fd < 0) {
+			printErrMsg("Unable to open " + name + ":", errno);
+			return false;
+		}
+		#ifdef F_SETPIPE_SZ
+		//let TWRP write a whole frame before it has to wait for us
+		fcntl(streams[i].fd, F_SETPIPE_SZ, DATA_MAX_CHUNK_SIZE);
+		#endif
+		streams[i].frameBytes = 0;
+		streams[i].writeFailed = false;
+	}
+	return true;
+}
+
+void twrpback::closeStreams() {
+	for (unsigned i = 0; i < TW_ADB_MAX_STREAMS; i++) {
+		if (streams[i].fd >= 0)
+			close(streams[i].fd);
+		streams[i].fd = -1;
+	}
+}
+
+void twrpback::setStreamCount(uint32_t count) {
+	if (count < 1)
+		count = 1;
+	if (count > TW_ADB_MAX_STREAMS) {
+		adblogwrite("Too many streams in TWFN, data of the others is dropped\n");
+		count = TW_ADB_MAX_STREAMS;
+	}
+	streamCount = count;
+}
+
+bool twrpback::backupStreamData(unsigned stream_id, bool drain, twrpDigest* digest, uint64_t* totalbytes) {
+	twrpbackStream& stream = streams[stream_id];
+
+	if (useSplice && stream.frameBytes == 0 && !spliceBackupData(stream_id, drain, digest, totalbytes))
+		return false;
+	if (useSplice && !drain)
+		return true;
+
+	if (stream.frame.empty())
+		stream.frame.resize(DATA_MAX_CHUNK_SIZE);
+	//commands TWRP sent before this data have to go out first, so
+	//a full frame waits while one is pending
+	while (true) {
+		if (stream.frameBytes < DATA_MAX_CHUNK_SIZE) {
+			ssize_t bytes = read(stream.fd, &stream.frame[0] + stream.frameBytes, DATA_MAX_CHUNK_SIZE - stream.frameBytes);
+			if (bytes < 0 && drain) {
+				//the writers of this file closed before TWEOF, anything
+				//that comes later belongs to the next file
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN)
+					break;
+				std::string msg = "Cannot read from TW_ADB_BACKUP: ";
+				printErrMsg(msg, errno);
+			}
+			if (bytes <= 0)
+				break;
+			stream.frameBytes += bytes;
+			continue;
+		}
+		if (!drain && controlPending())
+			return true;
+		if (!writeDataFrame(stream_id, digest))
+			return false;
+		*totalbytes += stream.frameBytes;
+		stream.frameBytes = 0;
+		//one frame at a time, so the other streams get their turn
+		if (!drain)
+			return true;
+	}
+	//the file ended, send what is left as a short frame
+	if (drain && stream.frameBytes > 0) {
+		if (!writeDataFrame(stream_id, digest))
+			return false;
+		*totalbytes += stream.frameBytes;
+		stream.frameBytes = 0;
+	}
+	return true;
+}
+
+bool twrpback::writeDataFrame(unsigned stream_id, twrpDigest* digest) {
+	twrpbackStream& stream = streams[stream_id];
+	double writeStart = statsTime();
+
+	if (!twadbbu::Write_TWDATA(adbd_fp, stream.frameBytes, stream_id)) {
+		adblogwrite("Error writing TWDATA to adbd\n");
+		return false;
+	}
+	digest->update((unsigned char *) &stream.frame[0], stream.frameBytes);
+	if (fwrite(&stream.frame[0], 1, stream.frameBytes, adbd_fp) != stream.frameBytes) {
+		adblogwrite("Error writing backup data to adbd\n");
+		return false;
+	}
+	#ifdef _DEBUG_ADB_BACKUP
+	if (write(debug_adb_fd, &stream.frame[0], stream.frameBytes) < 1) {
+		std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+		printErrMsg(msg, errno);
+		return false;
+	}
+	#endif
+	fflush(adbd_fp);
+	countWait(true, writeStart);
+	countFrame(stream.frameBytes);
+	return true;
+}
+
+bool twrpback::restoreDataFrame(char readAdbStream[], twrpDigest* digest, uint64_t* frameBytes) {
+	struct AdbBackupDataHeader datahdr;
+	uint32_t crc, datahdrcrc;
+	uint64_t done = 0;
+
+	memcpy(&datahdr, readAdbStream, sizeof(datahdr));
+	datahdrcrc = datahdr.crc;
+	memset(&datahdr.crc, 0, sizeof(datahdr.crc));
+	crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, (const unsigned char*) &datahdr, sizeof(datahdr));
+	if (crc != datahdrcrc || datahdr.size > DATA_MAX_CHUNK_SIZE) {
+		adblogwrite("ADB TWDATA crc header doesn't match\n");
+		return false;
+	}
+	if (datahdr.stream_id >= streamCount) {
+		adblogwrite("ADB TWDATA stream is not part of the file\n");
+		return false;
+	}
+	*frameBytes = datahdr.size;
+	countFrame(datahdr.size);
+
+	if (useSplice && !spliceRestoreData(datahdr.stream_id, datahdr.size, digest, &done))
+		return false;
+	if (done == datahdr.size)
+		return true;
+
+	uint64_t size = datahdr.size - done;
+	double readStart = statsTime();
+	if (readAdbData(&dataFrame[0], size) != size) {
+		adblogwrite("Unexpected end of adb stream in data frame\n");
+		return false;
+	}
+	countWait(true, readStart);
+	digest->update((unsigned char*) &dataFrame[0], size);
+
+	#ifdef _DEBUG_ADB_BACKUP
+	if (write(debug_adb_fd, &dataFrame[0], size) < 0) {
+		std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+		printErrMsg(msg, errno);
+		return false;
+	}
+	#endif
+
+	writeTWRPData(datahdr.stream_id, &dataFrame[0], size);
+	return true;
+}
+
+void twrpback::writeTWRPData(unsigned stream_id, const char* data, uint64_t size) {
+	twrpbackStream& stream = streams[stream_id];
+	double writeStart = statsTime();
+
+	//once TWRP stops reading, the rest of the stream is only digested
+	uint64_t written = 0;
+	while (!stream.writeFailed && written < size) {
+		ssize_t w = write(stream.fd, data + written, size - written);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0) {
+			std::string msg = "Cannot write to TWRP ADB FIFO: ";
+			printErrMsg(msg, errno);
+			adblogwrite("end of stream reached.\n");
+			stream.writeFailed = true;
+			break;
+		}
+		written += w;
+	}
+	countWait(false, writeStart);
+}
+
+bool twrpback::openSplicePipes(bool relay) {
+	if (digestPipe[0] < 0 && pipe2(digestPipe, O_CLOEXEC) < 0) {
+		printErrMsg("Unable to create digest pipe, copying data instead of splicing:", errno);
+		useSplice = false;
+		return false;
+	}
+	if (relay && relayPipe[0] < 0 && pipe2(relayPipe, O_CLOEXEC) < 0) {
+		printErrMsg("Unable to create relay pipe, copying data instead of splicing:", errno);
+		useSplice = false;
+		return false;
+	}
+	splicePipeSize = 65536;
+	#ifdef F_SETPIPE_SZ
+	fcntl(digestPipe[1], F_SETPIPE_SZ, DATA_MAX_CHUNK_SIZE);
+	int pipe_size = fcntl(digestPipe[1], F_GETPIPE_SZ);
+	if (relay) {
+		fcntl(relayPipe[1], F_SETPIPE_SZ, DATA_MAX_CHUNK_SIZE);
+		pipe_size = std::min(pipe_size, fcntl(relayPipe[1], F_GETPIPE_SZ));
+	}
+	if (pipe_size > 0)
+		splicePipeSize = pipe_size;
+	#endif
+	useSplice = true;
+	return true;
+}
+
+void twrpback::closeSplicePipes() {
+	for (int i = 0; i < 2; i++) {
+		if (digestPipe[i] >= 0)
+			close(digestPipe[i]);
+		if (relayPipe[i] >= 0)
+			close(relayPipe[i]);
+		digestPipe[i] = relayPipe[i] = -1;
+	}
+}
+
+twrpDigest* twrpback::streamDigest(const struct AdbBackupStreamHeader* hdr) {
+	if (hdr->version >= ADB_DIGEST_VERSION && hdr->digest == ADB_DIGEST_XXH64) {
+		adblogwrite("using xxh64 trailers\n");
+		return &xxh64Digest;
+	}
+	adblogwrite("using md5 trailers\n");
+	return &md5Digest;
+}
+
+double twrpback::statsTime(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void resetStats(twrpbackStats* stats, const std::string& name, double start) {
+	stats->name = name;
+	stats->start = start;
+	stats->bytes = stats->frames = 0;
+	stats->fifoWait = stats->adbWait = 0;
+}
+
+void twrpback::startStats(const std::string& direction) {
+	statsDirection = direction;
+	lastStatsReport = statsTime();
+	resetStats(&streamStats, "", lastStatsReport);
+	resetStats(&fileStats, "", lastStatsReport);
+	std::ofstream out(TW_ADB_STATS, std::ios::trunc);
+}
+
+void twrpback::startFileStats(const std::string& fileName) {
+	resetStats(&fileStats, fileName, statsTime());
+}
+
+void twrpback::endFileStats(void) {
+	if (fileStats.name.empty())
+		return;
+	reportStats("file", fileStats);
+	fileStats.name.clear();
+}
+
+void twrpback::countFrame(uint64_t bytes) {
+	fileStats.bytes += bytes;
+	fileStats.frames++;
+	streamStats.bytes += bytes;
+	streamStats.frames++;
+}
+
+void twrpback::countWait(bool adb, double since) {
+	double waited = statsTime() - since;
+
+	if (adb) {
+		fileStats.adbWait += waited;
+		streamStats.adbWait += waited;
+	} else {
+		fileStats.fifoWait += waited;
+		streamStats.fifoWait += waited;
+	}
+}
+
+void twrpback::reportStats(const char* kind, const twrpbackStats& stats) {
+	double secs = statsTime() - stats.start;
+	std::stringstream record;
+
+	record << std::fixed << std::setprecision(3) << kind << " direction=" << statsDirection
+		<< " seconds=" << secs << " bytes=" << stats.bytes << " frames=" << stats.frames
+		<< " mbps=" << (secs > 0 ? stats.bytes / 1048576.0 / secs : 0.0)
+		<< " fifo_wait=" << stats.fifoWait << " adb_wait=" << stats.adbWait;
+	if (!stats.name.empty())
+		record << " file=" << stats.name;
+	record << "\n";
+	adblogwrite(record.str());
+	std::ofstream out(TW_ADB_STATS, std::ios::app);
+	out << record.str();
+}
+
+void twrpback::periodicStats(void) {
+	double now = statsTime();
+
+	if (now - lastStatsReport < TW_ADB_STATS_INTERVAL)
+		return;
+	lastStatsReport = now;
+	reportStats("progress", fileStats.name.empty() ? streamStats : fileStats);
+}
+
+bool twrpback::readDigestPipe(uint64_t size, twrpDigest* digest) {
+	uint64_t done = 0;
+
+	while (done < size) {
+		ssize_t r = read(digestPipe[0], &dataFrame[0] + done, size - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			printErrMsg("Cannot read from digest pipe:", errno);
+			return false;
+		}
+		done += r;
+	}
+	digest->update((unsigned char*) &dataFrame[0], size);
+	#ifdef _DEBUG_ADB_BACKUP
+	if (write(debug_adb_fd, &dataFrame[0], size) < 0) {
+		std::string msg = "Cannot write to ADB_CONTROL_READ_FD: ";
+		printErrMsg(msg, errno);
+		return false;
+	}
+	#endif
+	return true;
+}
+
+size_t twrpback::readAdbData(char* buf, size_t size) {
+	if (readAhead.isRunning())
+		return readAhead.readData(buf, size);
+	return fread(buf, 1, size, adbd_fp);
+}
+
+twrpbackReadAhead::twrpbackReadAhead(void) {
+	fd = -1;
+	head = bytes = 0;
+	eof = stopping = running = false;
+	fullWaits = emptyWaits = 0;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+twrpbackReadAhead::~twrpbackReadAhead(void) {
+	stopReader();
+	pthread_mutex_destroy(&lock);
+	pthread_cond_destroy(&cond);
+}
+
+bool twrpbackReadAhead::startReader(int read_fd, size_t size) {
+	if (running || size == 0)
+		return false;
+	ring.resize(size);
+	fd = read_fd;
+	head = bytes = 0;
+	eof = stopping = false;
+	if (pthread_create(&thread, NULL, readerThread, this) != 0) {
+		ring.clear();
+		return false;
+	}
+	running = true;
+	return true;
+}
+
+void twrpbackReadAhead::stopReader(void) {
+	if (!running)
+		return;
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	running = false;
+	ring.clear();
+}
+
+void* twrpbackReadAhead::readerThread(void* cookie) {
+	((twrpbackReadAhead*) cookie)->fillRing();
+	return NULL;
+}
+
+void twrpbackReadAhead::fillRing(void) {
+	while (true) {
+		size_t tail, len;
+
+		pthread_mutex_lock(&lock);
+		if (bytes == ring.size() && !stopping)
+			fullWaits++;
+		while (bytes == ring.size() && !stopping)
+			pthread_cond_wait(&cond, &lock);
+		if (stopping) {
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		//only this thread fills the free part, so it is read unlocked
+		tail = (head + bytes) % ring.size();
+		len = std::min(ring.size() - bytes, ring.size() - tail);
+		pthread_mutex_unlock(&lock);
+
+		//wake up now and then so a failed restore can stop the thread
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		int ready = poll(&pfd, 1, 200);
+		if (ready == 0 || (ready < 0 && errno == EINTR)) {
+			pthread_mutex_lock(&lock);
+			bool stop = stopping;
+			pthread_mutex_unlock(&lock);
+			if (stop)
+				return;
+			continue;
+		}
+		ssize_t r = read(fd, &ring[tail], len);
+		if (r < 0 && errno == EINTR)
+			continue;
+
+		pthread_mutex_lock(&lock);
+		if (r <= 0)
+			eof = true;
+		else
+			bytes += r;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		if (r <= 0)
+			return;
+	}
+}
+
+size_t twrpbackReadAhead::readData(char* buf, size_t size) {
+	size_t done = 0;
+
+	pthread_mutex_lock(&lock);
+	while (done < size) {
+		if (bytes == 0 && !eof)
+			emptyWaits++;
+		while (bytes == 0 && !eof)
+			pthread_cond_wait(&cond, &lock);
+		if (bytes == 0)
+			break;
+		size_t len = std::min(std::min(size - done, bytes), ring.size() - head);
+		//the reader never touches the filled part
+		pthread_mutex_unlock(&lock);
+		memcpy(buf + done, &ring[head], len);
+		pthread_mutex_lock(&lock);
+		head = (head + len) % ring.size();
+		bytes -= len;
+		done += len;
+		pthread_cond_broadcast(&cond);
+	}
+	pthread_mutex_unlock(&lock);
+	return done;
+}
+
+bool twrpback::openControl(const char* fifo, int* fd) {
+	//opened for reading and writing, the open doesn't wait for TWRP, the
+	//fifo never reports a hangup while we hold it, and what is written
+	//before TWRP opens its end waits in the fifo
+	*fd = open(fifo, O_RDWR | O_NONBLOCK);
+	if (*fd < 0) {
+		printErrMsg(std::string("Unable to open ") + fifo + ": ", errno);
+		return false;
+	}
+	return true;
+}
+
+void twrpback::waitForControl() {
+	struct pollfd pfd;
+
+	pfd.fd = adb_control_bu_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+		;
+}
+
+bool twrpback::controlPending() {
+	int pending = 0;
+
+	return ioctl(adb_control_bu_fd, FIONREAD, &pending) == 0 && pending > 0;
+}
+
+void twrpback::confirmSessionFiles(uint64_t totalbytes) {
+	while (!unconfirmedFiles.empty() && unconfirmedFiles.front().first + TW_ADB_RESUME_MARGIN <= totalbytes) {
+		adblogwrite("host has " + unconfirmedFiles.front().second + "\n");
+		if (!twadbbu::Write_Session(TW_ADB_BACKUP_SESSION, unconfirmedFiles.front().second, true))
+			adblogwrite("Unable to write TW_ADB_BACKUP_SESSION\n");
+		unconfirmedFiles.erase(unconfirmedFiles.begin());
+	}
+}
+
+bool twrpback::restoredBefore(const std::vector<std::string>& session, uint32_t hdrcrc, std::string* record, std::string* md5) {
+	std::stringstream prefix;
+
+	prefix << "file " << hdrcrc << " ";
+	*record = prefix.str();
+	for (size_t i = 0; i < session.size(); i++) {
+		if (session[i].compare(0, record->size(), *record) == 0) {
+			std::istringstream fields(session[i].substr(record->size()));
+			fields >> *md5;
+			adblogwrite("skipping " + session[i].substr(record->size()) + ", it was restored before\n");
+			//the frames are only digested
+			for (unsigned s = 0; s < TW_ADB_MAX_STREAMS; s++)
+				streams[s].writeFailed = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool twrpback::spliceBackupData(unsigned stream_id, bool drain, twrpDigest* digest, uint64_t* totalbytes) {
+	int adb_read_fd = streams[stream_id].fd;
+
+	while (useSplice) {
+		int avail = 0;
+
+		if (ioctl(adb_read_fd, FIONREAD, &avail) < 0) {
+			printErrMsg("Unable to check TW_ADB_BACKUP:", errno);
+			return false;
+		}
+		//small frames are only sent once the file ends, and commands TWRP
+		//sent before this data have to go out first. Once the stream runs
+		//dry the copy loop reads up to the end of the file.
+		if (avail == 0 || (!drain && ((uint64_t) avail < splicePipeSize / 2 || controlPending())))
+			return true;
+
+		//the digest gets its own reference to the data, the data itself
+		//goes from the fifo to adbd without a copy
+		ssize_t size = tee(adb_read_fd, digestPipe[1], std::min((uint64_t) avail, (uint64_t) DATA_MAX_CHUNK_SIZE), SPLICE_F_NONBLOCK);
+		if (size < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (size <= 0) {
+			printErrMsg("tee from TW_ADB_BACKUP failed, copying data instead:", errno);
+			useSplice = false;
+			return true;
+		}
+		double writeStart = statsTime();
+		if (!twadbbu::Write_TWDATA(adbd_fp, size, stream_id) || fflush(adbd_fp) != 0) {
+			adblogwrite("Error writing TWDATA to adbd\n");
+			return false;
+		}
+
+		ssize_t moved = 0;
+		while (moved < size) {
+			ssize_t s = splice(adb_read_fd, NULL, adbd_fd, NULL, size - moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (s < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			if (s < 0 && errno == EINVAL && moved == 0) {
+				//adbd_fd can't be spliced to, send this frame from user
+				//space and copy from now on
+				printErrMsg("splice to adbd failed, copying data instead:", errno);
+				useSplice = false;
+				while (moved < size) {
+					s = read(adb_read_fd, &dataFrame[0] + moved, size - moved);
+					if (s < 0 && (errno == EAGAIN || errno == EINTR))
+						continue;
+					if (s <= 0)
+						return false;
+					moved += s;
+				}
+				if (fwrite(&dataFrame[0], 1, size, adbd_fp) != (size_t) size || fflush(adbd_fp) != 0) {
+					adblogwrite("Error writing backup data to adbd\n");
+					return false;
+				}
+				break;
+			}
+			if (s <= 0) {
+				printErrMsg("Cannot splice backup data to adbd:", errno);
+				return false;
+			}
+			moved += s;
+		}
+		countWait(true, writeStart);
+		countFrame(size);
+		if (!readDigestPipe(size, digest))
+			return false;
+		*totalbytes += size;
+		//one frame at a time, so the other streams get their turn
+		if (!drain)
+			break;
+	}
+	return true;
+}
+
+bool twrpback::spliceRestoreData(unsigned stream_id, uint64_t size, twrpDigest* digest, uint64_t* done) {
+	twrpbackStream& stream = streams[stream_id];
+
+	while (*done < size) {
+		double readStart = statsTime();
+		ssize_t in_pipe = splice(adbd_fd, NULL, relayPipe[1], NULL, std::min(size - *done, splicePipeSize), SPLICE_F_MOVE);
+		if (in_pipe < 0 && errno == EINTR)
+			continue;
+		if (in_pipe < 0 && errno == EINVAL && *done == 0) {
+			//adbd_fd can't be spliced from, fread the rest of the stream
+			printErrMsg("splice from adbd failed, copying data instead:", errno);
+			useSplice = false;
+			return true;
+		}
+		if (in_pipe <= 0) {
+			adblogwrite("Unexpected end of adb stream in data frame\n");
+			return false;
+		}
+		*done += in_pipe;
+		countWait(true, readStart);
+
+		while (in_pipe > 0) {
+			ssize_t size_teed = tee(relayPipe[0], digestPipe[1], in_pipe, 0);
+			if (size_teed < 0 && errno == EINTR)
+				continue;
+			if (size_teed <= 0) {
+				printErrMsg("tee of restore data failed:", errno);
+				return false;
+			}
+			ssize_t moved = 0;
+			double writeStart = statsTime();
+			while (!stream.writeFailed && moved < size_teed) {
+				ssize_t s = splice(relayPipe[0], NULL, stream.fd, NULL, size_teed - moved, SPLICE_F_MOVE);
+				if (s < 0 && errno == EINTR)
+					continue;
+				if (s <= 0) {
+					std::string msg = "Cannot write to TWRP ADB FIFO: ";
+					printErrMsg(msg, errno);
+					adblogwrite("end of stream reached.\n");
+					stream.writeFailed = true;
+					break;
+				}
+				moved += s;
+			}
+			countWait(false, writeStart);
+			//TWRP stopped reading, drop what is left in the relay pipe
+			while (moved < size_teed) {
+				ssize_t r = read(relayPipe[0], &dataFrame[0], size_teed - moved);
+				if (r < 0 && errno == EINTR)
+					continue;
+				if (r <= 0)
+					return false;
+				moved += r;
+			}
+			if (!readDigestPipe(size_teed, digest))
+				return false;
+			in_pipe -= size_teed;
+		}
+	}
+	return true;
+}
+
 void twrpback::streamFileForTWRP(void) {
 	adblogwrite("streamFileForTwrp" + streamFn + "\n");
 }
@@ -880,7 +1558,71 @@ void twrpback::threadStream(void) {
 	pthread_join(thread, NULL);
 }
 
-bool twrpback::checkMD5Trailer(char readAdbStream[], uint64_t md5fnsize, twrpMD5 *digest) {
+bool twrpback::connectNet(std::string address, int bufferKB) {
+	struct addrinfo hints, *res, *ai;
+	std::string host, port;
+	size_t colon = address.rfind(':');
+	int sock = -1, ret;
+
+	if (colon == std::string::npos || colon + 1 == address.size()) {
+		adblogwrite("Network address " + address + " is not host:port\n");
+		return false;
+	}
+	host = address.substr(0, colon);
+	port = address.substr(colon + 1);
+	if (host.size() > 1 && host[0] == '[' && host[host.size() - 1] == ']')
+		host = host.substr(1, host.size() - 2);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+	if (ret != 0) {
+		adblogwrite("Unable to resolve " + address + ": " + gai_strerror(ret) + "\n");
+		return false;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (sock < 0)
+			continue;
+		//the buffers have to be set before connecting for the window to scale up
+		if (bufferKB > 0) {
+			int size = bufferKB * 1024;
+			if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) < 0
+			||  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+				printErrMsg("Unable to set the socket buffer:", errno);
+		}
+		if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		printErrMsg("Unable to connect to " + address + ":", errno);
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(res);
+	if (sock < 0)
+		return false;
+
+	//frames are sent as soon as they are written, without waiting for the
+	//host to acknowledge the last one. Headers are small, so leave no
+	//partial segment waiting behind them
+	int nodelay = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	//a host that goes away fails the write instead of killing bu
+	signal(SIGPIPE, SIG_IGN);
+
+	int sndbuf = 0, rcvbuf = 0;
+	socklen_t len = sizeof(sndbuf);
+	getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+	len = sizeof(rcvbuf);
+	getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+	std::stringstream str;
+	str << "Connected to " << address << ", socket buffers " << sndbuf / 1024 << "KB send " << rcvbuf / 1024 << "KB receive\n";
+	adblogwrite(str.str());
+	adbd_fd = sock;
+	return true;
+}
+
+bool twrpback::checkMD5Trailer(char readAdbStream[], uint64_t md5fnsize, twrpDigest *digest, std::string* sentmd5) {
 	struct AdbBackupFileTrailer md5tr;
 	uint32_t crc, md5trcrc, md5ident, md5identmatch;
 
@@ -921,6 +1663,8 @@ bool twrpback::checkMD5Trailer(char readAdbStream[], uint64_t md5fnsize, twrpMD5
 		strncpy(md5.type, TWMD5, sizeof(md5.type));
 		std::string md5string = digest->return_digest_string();
 		strncpy(md5.md5, md5string.c_str(), sizeof(md5.md5));
+		if (sentmd5)
+			*sentmd5 = md5string;
 
 		adblogwrite("sending MD5 verification: " + md5string + "\n");
 		if (write(adb_control_twrp_fd, &md5, sizeof(md5)) < 1) {
@@ -17,8 +17,63 @@
 #ifndef _TWRPBACK_HPP
 #define _TWRPBACK_HPP
 
+#include <pthread.h>
 #include <fstream>
+#include <vector>
+#include <utility>
 #include "../twrpDigest/twrpMD5.hpp"
+#include "../twrpDigest/twrpXXH64.hpp"
+#include "twadbstream.h"
+
+#ifndef TW_ADB_RESTORE_BUFFER_MB
+#define TW_ADB_RESTORE_BUFFER_MB 8                                           // restore data read from adbd ahead of TWRP, 0 splices adbd to TWRP instead
+#endif
+
+#ifndef TW_NET_SOCKET_BUFFER_KB
+#define TW_NET_SOCKET_BUFFER_KB 4096                                         // send and receive buffer of a network stream, 0 keeps the kernel default
+#endif
+
+struct twrpbackStream {                                                      // one stream of a multiplexed file
+	int fd;                                                              // TWRP fifo of the stream
+	std::vector<char> frame;                                             // backup data not sent yet
+	uint64_t frameBytes;
+	bool writeFailed;                                                    // TWRP stopped reading the stream
+};
+
+struct twrpbackStats {                                                      // where the time of one file or the whole stream went
+	std::string name;                                                        // file of the stream, empty outside of a file
+	double start;                                                            // monotonic seconds
+	uint64_t bytes;                                                          // data moved between TWRP and adbd
+	uint64_t frames;
+	double fifoWait;                                                         // seconds spent waiting for TWRP
+	double adbWait;                                                          // seconds spent waiting for adbd and the host
+};
+
+class twrpbackReadAhead {                                                   // ring buffer a thread keeps filling from adbd during a restore
+public:
+	twrpbackReadAhead(void);
+	~twrpbackReadAhead(void);
+	bool startReader(int fd, size_t size);                                   // read fd into a ring of size bytes from now on
+	size_t readData(char* buf, size_t size);                                 // wait for size bytes, fewer at the end of the stream
+	void stopReader(void);                                                   // stop and join the reader thread
+	bool isRunning(void) { return running; }
+	unsigned long long fullWaits;                                            // times the reader waited for TWRP
+	unsigned long long emptyWaits;                                           // times TWRP waited for adbd
+
+private:
+	static void* readerThread(void* cookie);
+	void fillRing(void);
+	int fd;
+	std::vector<char> ring;
+	size_t head;                                                             // next byte to hand out
+	size_t bytes;                                                            // bytes in the ring
+	bool eof;                                                                // adbd closed the stream or failed
+	bool stopping;
+	bool running;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
 
 class twrpback {
 public:
@@ -33,6 +88,7 @@ public:
 	void streamFileForTWRP(void);                                            // stream file to twrp via bu
 	void setStreamFileName(std::string fn);                                  // tell adb backup what file to load on storage
 	void threadStream(void);                                                 // thread bu for streaming
+	bool connectNet(std::string address, int bufferKB);                      // stream over TCP to a host listening on host:port instead of adbd
 
 private:
 	int read_fd;                                                             // ors input fd
@@ -40,11 +96,24 @@ private:
 	int ors_fd;                                                              // ors output fd
 	int adb_control_twrp_fd;                                                 // fd for bu to twrp communication
 	int adb_control_bu_fd;                                                   // fd for twrp to bu communication
-	int adb_read_fd;                                                         // adb read data stream
-	int adb_write_fd;                                                        // adb write data stream
+	twrpbackStream streams[TW_ADB_MAX_STREAMS];                              // adb data streams of the current file
+	unsigned streamCount;                                                    // streams the current file is split over
 	int debug_adb_fd;                                                        // fd to write debug tars
 	bool firstPart;                                                          // first partition in the stream
+	std::vector<char> dataFrame;                                             // data of the frame being restored
+	twrpMD5 md5Digest;                                                       // trailer digest of streams before ADB_DIGEST_VERSION
+	twrpXXH64 xxh64Digest;                                                   // trailer digest the stream header can ask for
+	std::string statsDirection;                                              // backup or restore
+	twrpbackStats fileStats;
+	twrpbackStats streamStats;
+	double lastStatsReport;
+	std::vector<std::pair<uint64_t, std::string> > unconfirmedFiles;         // session records of sent files and the data sent up to them
+	bool useSplice;                                                          // move frames with splice instead of copying them
+	int digestPipe[2];                                                       // tee'd copy of the spliced data for the digest
+	int relayPipe[2];                                                        // restore data between adbd and the TWRP fifo
+	uint64_t splicePipeSize;                                                 // most data the pipes hold
 	FILE *adbd_fp;                                                           // file pointer for adb stream
+	twrpbackReadAhead readAhead;                                             // restore data from adbd that TWRP has not taken yet
 	char cmd[512];                                                           // store result of commands
 	char operation[512];                                                     // operation to send to ors
 	std::ofstream adblogfile;                                                // adb stream log file
@@ -54,8 +123,35 @@ private:
 	void adbloginit(void);                                                   // setup adb log stream file
 	void close_backup_fds();                                                 // close backup resources
 	void close_restore_fds();                                                // close restore resources
-	bool checkMD5Trailer(char adbReadStream[], uint64_t md5fnsize, twrpMD5* digest); // Check MD5 Trailer
+	bool checkMD5Trailer(char adbReadStream[], uint64_t md5fnsize, twrpDigest* digest, std::string* sentmd5 = NULL); // Check MD5 Trailer
+	bool openStreams(const char* fifo, int flags, unsigned count);           // Open the fifos of the first count streams
+	void closeStreams();
+	void setStreamCount(uint32_t count);                                     // streams of a TWFN header, 0 is a single stream
+	bool backupStreamData(unsigned stream_id, bool drain, twrpDigest* digest, uint64_t* totalbytes); // Send backup data of a stream to adbd
+	bool writeDataFrame(unsigned stream_id, twrpDigest* digest);               // Write the frame of a stream to adbd
+	bool restoreDataFrame(char readAdbStream[], twrpDigest* digest, uint64_t* frameBytes); // Send the frame after a TWDATA header to TWRP
+	void writeTWRPData(unsigned stream_id, const char* data, uint64_t size); // Write restore data to the TWRP fifo of a stream
+	bool openSplicePipes(bool relay);                                        // false if the data has to be copied
+	void closeSplicePipes();
+	bool readDigestPipe(uint64_t size, twrpDigest* digest);                     // Digest size bytes of the digest pipe
+	size_t readAdbData(char* buf, size_t size);                              // Read restore data from the read ahead ring or adbd
+	twrpDigest* streamDigest(const struct AdbBackupStreamHeader* hdr);     // Digest of the trailers of a stream
+	bool controlPending();                                                   // TWRP sent a command that was not read yet
+	bool openControl(const char* fifo, int* fd);                             // Open a control fifo before TWRP is sent the operation
+	void waitForControl();                                                   // Sleep until TWRP sends a command
+	void confirmSessionFiles(uint64_t totalbytes);                           // Add the files the host should have by now to the backup session
+	bool restoredBefore(const std::vector<std::string>& session, uint32_t hdrcrc, std::string* record, std::string* md5); // Find the file of a header crc in the restore session
+	bool spliceBackupData(unsigned stream_id, bool drain, twrpDigest* digest, uint64_t* totalbytes); // Splice a backup fifo to adbd in frames, drain waits for the end of the file
+	bool spliceRestoreData(unsigned stream_id, uint64_t size, twrpDigest* digest, uint64_t* done); // Splice a frame from adbd to the TWRP fifo of a stream
 	void printErrMsg(std::string msg, int errNum);                          // print error msg to adb log
+	static double statsTime(void);                                           // monotonic seconds
+	void startStats(const std::string& direction);                           // new TW_ADB_STATS for a backup or restore
+	void startFileStats(const std::string& fileName);
+	void endFileStats(void);                                                 // record the file that just ended
+	void countFrame(uint64_t bytes);
+	void countWait(bool adb, double since);                                  // add the time since since to the adb or the fifo wait
+	void reportStats(const char* kind, const twrpbackStats& stats);          // write a record to the adb log and TW_ADB_STATS
+	void periodicStats(void);                                                // report progress every TW_ADB_STATS_INTERVAL
 };
 
 #endif // _TWRPBACK_HPP
@@ -40,6 +40,10 @@ LOCAL_CFLAGS := \
     -DZLIB_CONST \
     -Werror
 
+ifneq ($(TW_IMGPATCH_OUTPUT_BUFFER_KB),)
+    LOCAL_CFLAGS += -DIMGPATCH_OUTPUT_BUFFER_KB=$(TW_IMGPATCH_OUTPUT_BUFFER_KB)
+endif
+
 BOARD_RECOVERY_DEFINES := BOARD_BML_BOOT BOARD_BML_RECOVERY
 
 $(foreach board_define,$(BOARD_RECOVERY_DEFINES), \
@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
@@ -47,10 +48,12 @@
 #include "otautil/print_sha1.h"
 
 static int LoadPartitionContents(const std::string& filename, FileContents* file);
+static int MapPartitionContents(const std::string& filename, FileContents* file);
 static size_t FileSink(const unsigned char* data, size_t len, int fd);
 static int GenerateTarget(const FileContents& source_file, const std::unique_ptr<Value>& patch,
                           const std::string& target_filename,
-                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data);
+                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], size_t target_size,
+                          const Value* bonus_data);
 
 static bool mtd_partitions_scanned = false;
 
@@ -88,6 +91,16 @@ int LoadFileContents(const char* filename, FileContents* file) {
   return 0;
 }
 
+// Like LoadFileContents(), but partitions are mapped rather than read into memory: the pages get
+// read in as they are hashed or used by the patch, and stay page cache the kernel can reclaim.
+// Regular files are still read, as the cached source copy gets rewritten while it is in use.
+int MapFileContents(const char* filename, FileContents* file) {
+  if (strncmp(filename, "EMMC:", 5) == 0) {
+    return MapPartitionContents(filename, file);
+  }
+  return LoadFileContents(filename, file);
+}
+
 // Load the contents of an EMMC partition into the provided
 // FileContents.  filename should be a string of the form
 // "EMMC:<partition_device>:...".  The smallest size_n bytes for
@@ -104,10 +117,34 @@ int LoadFileContents(const char* filename, FileContents* file) {
 // to find one of those hashes.
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const std::string& filename, FileContents* file) {
-  std::vector<std::string> pieces = android::base::Split(filename, ":");
-  if (pieces.size() < 4 || pieces.size() % 2 != 0) {
+// Splits a partition filename into its partition and the (size, sha1) pairs, sorted by size.
+static bool ParsePartitionFilename(const std::string& filename, std::vector<std::string>* pieces,
+                                   std::vector<std::pair<size_t, std::string>>* pairs) {
+  *pieces = android::base::Split(filename, ":");
+  if (pieces->size() < 4 || pieces->size() % 2 != 0) {
     printf("LoadPartitionContents called with bad filename \"%s\"\n", filename.c_str());
+    return false;
+  }
+
+  size_t pair_count = (pieces->size() - 2) / 2;  // # of (size, sha1) pairs in filename
+  for (size_t i = 0; i < pair_count; ++i) {
+    size_t size;
+    if (!android::base::ParseUint((*pieces)[i * 2 + 2], &size) || size == 0) {
+      printf("LoadPartitionContents called with bad size \"%s\"\n", (*pieces)[i * 2 + 2].c_str());
+      return false;
+    }
+    pairs->push_back({ size, (*pieces)[i * 2 + 3] });
+  }
+
+  // Sort the pairs array so that they are in order of increasing size.
+  std::sort(pairs->begin(), pairs->end());
+  return true;
+}
+
+static int LoadPartitionContents(const std::string& filename, FileContents* file) {
+  std::vector<std::string> pieces;
+  std::vector<std::pair<size_t, std::string>> pairs;
+  if (!ParsePartitionFilename(filename, &pieces, &pairs)) {
     return -1;
   }
 
@@ -123,20 +160,7 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
     return -1;
   }
 
-  size_t pair_count = (pieces.size() - 2) / 2;  // # of (size, sha1) pairs in filename
-  std::vector<std::pair<size_t, std::string>> pairs;
-  for (size_t i = 0; i < pair_count; ++i) {
-    size_t size;
-    if (!android::base::ParseUint(pieces[i * 2 + 2], &size) || size == 0) {
-      printf("LoadPartitionContents called with bad size \"%s\"\n", pieces[i * 2 + 2].c_str());
-      return -1;
-    }
-    pairs.push_back({ size, pieces[i * 2 + 3] });
-  }
-
-  // Sort the pairs array so that they are in order of increasing size.
-  std::sort(pairs.begin(), pairs.end());
-
+  size_t pair_count = pairs.size();
   const char* partition = pieces[1].c_str();
   unique_file dev(ota_fopen(partition, "rb"));
   if (!dev) {
@@ -214,6 +238,80 @@ static int LoadPartitionContents(const std::string& filename, FileContents* file
   return 0;
 }
 
+// LoadPartitionContents() over a read-only mapping of the partition. Falls back to reading it when
+// the partition can't be mapped.
+static int MapPartitionContents(const std::string& filename, FileContents* file) {
+  std::vector<std::string> pieces;
+  std::vector<std::pair<size_t, std::string>> pairs;
+  if (!ParsePartitionFilename(filename, &pieces, &pairs)) {
+    return -1;
+  }
+
+  const char* partition = pieces[1].c_str();
+  unique_fd fd(ota_open(partition, O_RDONLY));
+  if (fd == -1) {
+    printf("failed to open emmc partition \"%s\": %s\n", partition, strerror(errno));
+    return -1;
+  }
+
+  // Touching a mapped page past the end of the partition raises SIGBUS, where reading it would
+  // come up short.
+  off64_t partition_size = lseek64(fd, 0, SEEK_END);
+  size_t length = pairs.back().first;
+  if (partition_size != -1 && static_cast<uint64_t>(partition_size) < length) {
+    length = partition_size;
+  }
+  void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    printf("failed to map partition \"%s\" (%s); reading it\n", partition, strerror(errno));
+    return LoadPartitionContents(filename, file);
+  }
+  std::shared_ptr<const unsigned char> mapped(
+      static_cast<const unsigned char*>(addr),
+      [length](const unsigned char* data) { munmap(const_cast<unsigned char*>(data), length); });
+  madvise(addr, length, MADV_SEQUENTIAL);
+
+  SHA_CTX sha_ctx;
+  SHA1_Init(&sha_ctx);
+  size_t hashed = 0;
+  for (const auto& pair : pairs) {
+    size_t current_size = pair.first;
+    const std::string& current_sha1 = pair.second;
+    if (current_size > length) {
+      printf("short read (%zu bytes of %zu) for partition \"%s\"\n", length - hashed,
+             current_size - hashed, partition);
+      return -1;
+    }
+    SHA1_Update(&sha_ctx, mapped.get() + hashed, current_size - hashed);
+    hashed = current_size;
+
+    SHA_CTX temp_ctx;
+    memcpy(&temp_ctx, &sha_ctx, sizeof(SHA_CTX));
+    uint8_t sha_so_far[SHA_DIGEST_LENGTH];
+    SHA1_Final(sha_so_far, &temp_ctx);
+
+    uint8_t parsed_sha[SHA_DIGEST_LENGTH];
+    if (ParseSha1(current_sha1.c_str(), parsed_sha) != 0) {
+      printf("failed to parse SHA-1 %s in %s\n", current_sha1.c_str(), filename.c_str());
+      return -1;
+    }
+
+    if (memcmp(sha_so_far, parsed_sha, SHA_DIGEST_LENGTH) == 0) {
+      printf("partition read matched size %zu SHA-1 %s\n", current_size, current_sha1.c_str());
+      // The patch reads the source wherever it needs to.
+      madvise(addr, length, MADV_NORMAL);
+      memcpy(file->sha1, sha_so_far, SHA_DIGEST_LENGTH);
+      file->data.clear();
+      file->mapped = std::move(mapped);
+      file->mapped_size = current_size;
+      return 0;
+    }
+  }
+
+  printf("contents of partition \"%s\" didn't match %s\n", partition, filename.c_str());
+  return -1;
+}
+
 // Save the contents of the given FileContents object under the given
 // filename.  Return 0 on success.
 int SaveFileContents(const char* filename, const FileContents* file) {
@@ -223,10 +321,10 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return -1;
   }
 
-  size_t bytes_written = FileSink(file->data.data(), file->data.size(), fd);
-  if (bytes_written != file->data.size()) {
+  size_t bytes_written = FileSink(file->Data(), file->Size(), fd);
+  if (bytes_written != file->Size()) {
     printf("short write of \"%s\" (%zd bytes of %zu): %s\n", filename, bytes_written,
-           file->data.size(), strerror(errno));
+           file->Size(), strerror(errno));
     return -1;
   }
   if (ota_fsync(fd) != 0) {
@@ -494,7 +592,7 @@ int applypatch_check(const char* filename, const std::vector<std::string>& patch
   // LoadFileContents is successful.  (Useful for reading
   // partitions, where the filename encodes the sha1s; no need to
   // check them twice.)
-  if (LoadFileContents(filename, &file) != 0 ||
+  if (MapFileContents(filename, &file) != 0 ||
       (!patch_sha1_str.empty() && FindMatchingPatch(file.sha1, patch_sha1_str) < 0)) {
     printf("file \"%s\" doesn't have any of expected sha1 sums; checking cache\n", filename);
 
@@ -573,7 +671,7 @@ int CacheSizeCheck(size_t bytes) {
 // become obsolete since we have dropped the support for patching non-EMMC targets (EMMC targets
 // have the size embedded in the filename).
 int applypatch(const char* source_filename, const char* target_filename,
-               const char* target_sha1_str, size_t /* target_size */,
+               const char* target_sha1_str, size_t target_size,
                const std::vector<std::string>& patch_sha1_str,
                const std::vector<std::unique_ptr<Value>>& patch_data, const Value* bonus_data) {
   printf("patch %s: ", source_filename);
@@ -595,7 +693,7 @@ int applypatch(const char* source_filename, const char* target_filename,
 
   // We try to load the target file into the source_file object.
   FileContents source_file;
-  if (LoadFileContents(target_filename, &source_file) == 0) {
+  if (MapFileContents(target_filename, &source_file) == 0) {
     if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_LENGTH) == 0) {
       // The early-exit case: the patch was already applied, this file has the desired hash, nothing
       // for us to do.
@@ -604,19 +702,19 @@ int applypatch(const char* source_filename, const char* target_filename,
     }
   }
 
-  if (source_file.data.empty() ||
+  if (source_file.Size() == 0 ||
       (target_filename != source_filename && strcmp(target_filename, source_filename) != 0)) {
     // Need to load the source file: either we failed to load the target file, or we did but it's
     // different from the expected.
-    source_file.data.clear();
-    LoadFileContents(source_filename, &source_file);
+    source_file = FileContents();
+    MapFileContents(source_filename, &source_file);
   }
 
-  if (!source_file.data.empty()) {
+  if (source_file.Size() != 0) {
     int to_use = FindMatchingPatch(source_file.sha1, patch_sha1_str);
     if (to_use != -1) {
       return GenerateTarget(source_file, patch_data[to_use], target_filename, target_sha1,
-                            bonus_data);
+                            target_size, bonus_data);
     }
   }
 
@@ -634,7 +732,8 @@ int applypatch(const char* source_filename, const char* target_filename,
     return 1;
   }
 
-  return GenerateTarget(copy_file, patch_data[to_use], target_filename, target_sha1, bonus_data);
+  return GenerateTarget(copy_file, patch_data[to_use], target_filename, target_sha1, target_size,
+                        bonus_data);
 }
 
 /*
@@ -693,7 +792,8 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
 
 static int GenerateTarget(const FileContents& source_file, const std::unique_ptr<Value>& patch,
                           const std::string& target_filename,
-                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], const Value* bonus_data) {
+                          const uint8_t target_sha1[SHA_DIGEST_LENGTH], size_t target_size,
+                          const Value* bonus_data) {
   if (patch->type != VAL_BLOB) {
     printf("patch is not a blob\n");
     return 1;
@@ -713,8 +813,14 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
 
   CHECK(android::base::StartsWith(target_filename, "EMMC:"));
 
+  // The target is written to a file on cache next to the backup of the source as it's generated,
+  // when cache has room for both, instead of being held in memory.
+  std::string target_temp = CacheLocation::location().cache_temp_source() + ".target";
+  bool stream_target =
+      target_size != 0 && MakeFreeSpaceOnCache(source_file.Size() + target_size) == 0;
+
   // We still write the original source to cache, in case the partition write is interrupted.
-  if (MakeFreeSpaceOnCache(source_file.data.size()) < 0) {
+  if (!stream_target && MakeFreeSpaceOnCache(source_file.Size()) < 0) {
     printf("not enough free space on /cache\n");
     return 1;
   }
@@ -723,27 +829,48 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
     return 1;
   }
 
-  // We store the decoded output in memory.
+  unique_fd target_fd;
+  if (stream_target) {
+    target_fd.reset(ota_open(target_temp.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR));
+    if (target_fd == -1) {
+      printf("failed to open \"%s\" for write: %s; patching in memory\n", target_temp.c_str(),
+             strerror(errno));
+      stream_target = false;
+    }
+  }
+
   std::string memory_sink_str;  // Don't need to reserve space.
-  SinkFn sink = [&memory_sink_str](const unsigned char* data, size_t len) {
-    memory_sink_str.append(reinterpret_cast<const char*>(data), len);
-    return len;
-  };
+  size_t target_written = 0;
+  SinkFn sink;
+  if (stream_target) {
+    sink = [&target_fd, &target_written](const unsigned char* data, size_t len) {
+      size_t written = FileSink(data, len, target_fd);
+      target_written += written;
+      return written;
+    };
+  } else {
+    // We store the decoded output in memory.
+    sink = [&memory_sink_str](const unsigned char* data, size_t len) {
+      memory_sink_str.append(reinterpret_cast<const char*>(data), len);
+      return len;
+    };
+  }
 
+  // The patchers hash the output as it goes through the sink.
   SHA_CTX ctx;
   SHA1_Init(&ctx);
 
   int result;
   if (use_bsdiff) {
-    result =
-        ApplyBSDiffPatch(source_file.data.data(), source_file.data.size(), *patch, 0, sink, &ctx);
+    result = ApplyBSDiffPatch(source_file.Data(), source_file.Size(), *patch, 0, sink, &ctx);
   } else {
-    result = ApplyImagePatch(source_file.data.data(), source_file.data.size(), *patch, sink, &ctx,
-                             bonus_data);
+    result =
+        ApplyImagePatch(source_file.Data(), source_file.Size(), *patch, sink, &ctx, bonus_data);
   }
 
   if (result != 0) {
     printf("applying patch failed\n");
+    if (stream_target) unlink(target_temp.c_str());
     return 1;
   }
 
@@ -751,14 +878,35 @@ static int GenerateTarget(const FileContents& source_file, const std::unique_ptr
   SHA1_Final(current_target_sha1, &ctx);
   if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_LENGTH) != 0) {
     printf("patch did not produce expected sha1\n");
+    if (stream_target) unlink(target_temp.c_str());
     return 1;
   } else {
     printf("now %s\n", short_sha1(target_sha1).c_str());
   }
 
   // Write back the temp file to the partition.
-  if (WriteToPartition(reinterpret_cast<const unsigned char*>(memory_sink_str.c_str()),
-                       memory_sink_str.size(), target_filename) != 0) {
+  const unsigned char* target_data =
+      reinterpret_cast<const unsigned char*>(memory_sink_str.c_str());
+  size_t target_len = memory_sink_str.size();
+  void* target_map = MAP_FAILED;
+  if (stream_target && target_written != 0) {
+    target_map = mmap(nullptr, target_written, PROT_READ, MAP_PRIVATE, target_fd, 0);
+    if (target_map == MAP_FAILED) {
+      printf("failed to map \"%s\": %s\n", target_temp.c_str(), strerror(errno));
+      unlink(target_temp.c_str());
+      return 1;
+    }
+    target_data = static_cast<const unsigned char*>(target_map);
+    target_len = target_written;
+  }
+  int write_result = WriteToPartition(target_data, target_len, target_filename);
+  if (target_map != MAP_FAILED) {
+    munmap(target_map, target_written);
+  }
+  if (stream_target) {
+    unlink(target_temp.c_str());
+  }
+  if (write_result != 0) {
     printf("write of patched data to %s failed\n", target_filename.c_str());
     return 1;
   }
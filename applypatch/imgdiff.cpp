@@ -138,6 +138,10 @@
  *
  * Patch: [(src-0, patch-0) = tgt-0; (src-1, patch-1) = tgt-1; (src-2, patch-2) = tgt-2]
  * Concatenate: [tgt-0 + tgt-1 + tgt-2 = tgt_image]
+ *
+ * The bsdiff of each chunk doesn't depend on the others, so with "--threads" they are computed on
+ * that many threads. The patches are still put together in chunk order, and the output is the same
+ * as with a single thread.
  */
 
 #include "applypatch/imgdiff.h"
@@ -153,7 +157,10 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
@@ -180,6 +187,9 @@ static_assert(VERSION <= 9, "VERSION occupies more than one byte");
 static constexpr size_t BLOCK_SIZE = 4096;
 static constexpr size_t BUFFER_SIZE = 0x8000;
 
+// Number of threads computing the chunk patches, set by "--threads".
+static size_t patch_threads = 1;
+
 // If we use this function to write the offset and length (type size_t), their values should not
 // exceed 2^63; because the signed bit will be casted away.
 static inline bool Write8(int fd, int64_t value) {
@@ -245,12 +255,38 @@ static bool RemoveUsedBlocks(size_t* start, size_t* length, const SortedRangeSet
   return false;
 }
 
+// Calls |work| for each index in [0, count) on up to |patch_threads| threads. Returns false, after
+// the calls in progress return, as soon as one of them does.
+static bool RunInParallel(size_t count, const std::function<bool(size_t)>& work) {
+  std::atomic<size_t> next(0);
+  std::atomic<bool> ok(true);
+  auto worker = [&]() {
+    size_t i;
+    while (ok && (i = next++) < count) {
+      if (!work(i)) {
+        ok = false;
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < std::min(patch_threads, count); i++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return ok;
+}
+
 static const struct option OPTIONS[] = {
   { "zip-mode", no_argument, nullptr, 'z' },
   { "bonus-file", required_argument, nullptr, 'b' },
   { "block-limit", required_argument, nullptr, 0 },
   { "debug-dir", required_argument, nullptr, 0 },
   { "split-info", required_argument, nullptr, 0 },
+  { "threads", required_argument, nullptr, 0 },
   { "verbose", no_argument, nullptr, 'v' },
   { nullptr, 0, nullptr, 0 },
 };
@@ -1101,39 +1137,62 @@ bool ZipModeImage::GeneratePatchesInternal(const ZipModeImage& tgt_image,
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
   patch_chunks->clear();
 
-  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  // The source each target chunk is diffed against; nullptr for the chunks kept as raw data.
+  const ImageChunk pseudo_source = src_image.PseudoSource();
+  std::vector<const ImageChunk*> src_refs(tgt_image.NumOfChunks(), nullptr);
+  size_t first_pseudo = tgt_image.NumOfChunks();
   for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
     const auto& tgt_chunk = tgt_image[i];
-
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks->emplace_back(tgt_chunk);
       continue;
     }
 
     const ImageChunk* src_chunk = (tgt_chunk.GetType() != CHUNK_DEFLATE)
                                       ? nullptr
                                       : src_image.FindChunkByName(tgt_chunk.GetEntryName());
+    src_refs[i] = (src_chunk == nullptr) ? &pseudo_source : src_chunk;
+    if (src_chunk == nullptr && first_pseudo == tgt_image.NumOfChunks()) {
+      first_pseudo = i;
+    }
+  }
 
-    const auto& src_ref = (src_chunk == nullptr) ? src_image.PseudoSource() : *src_chunk;
+  std::vector<std::vector<uint8_t>> patches(tgt_image.NumOfChunks());
+  bsdiff::SuffixArrayIndexInterface* bsdiff_cache = nullptr;
+  auto make_patch = [&](size_t i) {
+    if (src_refs[i] == nullptr) {
+      return true;
+    }
+    const auto& tgt_chunk = tgt_image[i];
     bsdiff::SuffixArrayIndexInterface** bsdiff_cache_ptr =
-        (src_chunk == nullptr) ? &bsdiff_cache : nullptr;
-
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_ref, &patch_data, bsdiff_cache_ptr)) {
+        (src_refs[i] == &pseudo_source) ? &bsdiff_cache : nullptr;
+    if (!ImageChunk::MakePatch(tgt_chunk, *src_refs[i], &patches[i], bsdiff_cache_ptr)) {
       LOG(ERROR) << "Failed to generate patch, name: " << tgt_chunk.GetEntryName();
       return false;
     }
 
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
+    return true;
+  };
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+  // The first patch against the pseudo source builds the suffix array the others share, so it
+  // goes before the rest.
+  bool ok = first_pseudo == tgt_image.NumOfChunks() || make_patch(first_pseudo);
+  ok = ok && RunInParallel(tgt_image.NumOfChunks(),
+                           [&](size_t i) { return i == first_pseudo || make_patch(i); });
+  delete bsdiff_cache;
+  if (!ok) {
+    return false;
+  }
+
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    if (src_refs[i] == nullptr || PatchChunk::RawDataIsSmaller(tgt_chunk, patches[i].size())) {
       patch_chunks->emplace_back(tgt_chunk);
     } else {
-      patch_chunks->emplace_back(tgt_chunk, src_ref, std::move(patch_data));
+      patch_chunks->emplace_back(tgt_chunk, *src_refs[i], std::move(patches[i]));
     }
   }
-  delete bsdiff_cache;
 
   CHECK_EQ(patch_chunks->size(), tgt_image.NumOfChunks());
   return true;
@@ -1432,30 +1491,34 @@ bool ImageModeImage::GeneratePatches(const ImageModeImage& tgt_image,
                                      const ImageModeImage& src_image,
                                      const std::string& patch_name) {
   LOG(INFO) << "Constructing patches for " << tgt_image.NumOfChunks() << " chunks...";
-  std::vector<PatchChunk> patch_chunks;
-  patch_chunks.reserve(tgt_image.NumOfChunks());
-
-  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+  std::vector<std::vector<uint8_t>> patches(tgt_image.NumOfChunks());
+  auto make_patch = [&](size_t i) {
     const auto& tgt_chunk = tgt_image[i];
-    const auto& src_chunk = src_image[i];
-
     if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0)) {
-      patch_chunks.emplace_back(tgt_chunk);
-      continue;
+      return true;
     }
 
-    std::vector<uint8_t> patch_data;
-    if (!ImageChunk::MakePatch(tgt_chunk, src_chunk, &patch_data, nullptr)) {
+    if (!ImageChunk::MakePatch(tgt_chunk, src_image[i], &patches[i], nullptr)) {
       LOG(ERROR) << "Failed to generate patch for target chunk " << i;
       return false;
     }
-    LOG(INFO) << "patch " << i << " is " << patch_data.size() << " bytes (of "
+    LOG(INFO) << "patch " << i << " is " << patches[i].size() << " bytes (of "
               << tgt_chunk.GetRawDataLength() << ")";
+    return true;
+  };
+  if (!RunInParallel(tgt_image.NumOfChunks(), make_patch)) {
+    return false;
+  }
 
-    if (PatchChunk::RawDataIsSmaller(tgt_chunk, patch_data.size())) {
+  std::vector<PatchChunk> patch_chunks;
+  patch_chunks.reserve(tgt_image.NumOfChunks());
+  for (size_t i = 0; i < tgt_image.NumOfChunks(); i++) {
+    const auto& tgt_chunk = tgt_image[i];
+    if (PatchChunk::RawDataIsSmaller(tgt_chunk, 0) ||
+        PatchChunk::RawDataIsSmaller(tgt_chunk, patches[i].size())) {
       patch_chunks.emplace_back(tgt_chunk);
     } else {
-      patch_chunks.emplace_back(tgt_chunk, src_chunk, std::move(patch_data));
+      patch_chunks.emplace_back(tgt_chunk, src_image[i], std::move(patches[i]));
     }
   }
 
@@ -1482,6 +1545,7 @@ int imgdiff(int argc, const char** argv) {
   int opt;
   int option_index;
   optind = 0;  // Reset the getopt state so that we can call it multiple times for test.
+  patch_threads = 1;
 
   while ((opt = getopt_long(argc, const_cast<char**>(argv), "zb:v", OPTIONS, &option_index)) !=
          -1) {
@@ -1521,6 +1585,9 @@ int imgdiff(int argc, const char** argv) {
           split_info_file = optarg;
         } else if (name == "debug-dir") {
           debug_dir = optarg;
+        } else if (name == "threads" && !android::base::ParseUint(optarg, &patch_threads)) {
+          LOG(ERROR) << "Failed to parse thread count: " << optarg;
+          return 1;
         }
         break;
       }
@@ -1546,6 +1613,7 @@ int imgdiff(int argc, const char** argv) {
            "  --split-info,     Output the split information (patch_size, tgt_size, src_ranges);\n"
            "                    zip mode with block-limit only.\n"
            "  --debug-dir,      Debug directory to put the split srcs and patches, zip mode only.\n"
+           "  --threads,        Number of threads computing the chunk patches, 1 by default.\n"
            "  -v, --verbose,    Enable verbose logging.";
     return 2;
   }
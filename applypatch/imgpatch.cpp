@@ -39,6 +39,12 @@
 
 #include "edify/expr.h"
 
+// Size of the buffer the deflated target of a CHUNK_DEFLATE collects in before it goes to the
+// sink. It is the only memory a chunk's output takes, whatever the size of the chunk.
+#ifndef IMGPATCH_OUTPUT_BUFFER_KB
+#define IMGPATCH_OUTPUT_BUFFER_KB 32
+#endif
+
 static inline int64_t Read8(const void *address) {
   return android::base::get_unaligned<int64_t>(address);
 }
@@ -71,38 +77,49 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
     return false;
   }
 
+  // The compressed data collects in one buffer, allocated once per chunk, and goes to the given
+  // sink whenever the buffer fills up and at the end of the chunk.
+  size_t total_written = 0;
+  std::vector<uint8_t> buffer(IMGPATCH_OUTPUT_BUFFER_KB * 1024);
+  size_t buffered = 0;
+  auto flush = [&buffer, &buffered, &total_written, &ctx, &sink]() {
+    if (sink(buffer.data(), buffered) != buffered) {
+      LOG(ERROR) << "Failed to write " << buffered << " compressed bytes to output.";
+      return false;
+    }
+    if (ctx) SHA1_Update(ctx, buffer.data(), buffered);
+    total_written += buffered;
+    buffered = 0;
+    return true;
+  };
+
   // Define a custom sink wrapper that feeds to bspatch. It deflates the available patch data on
   // the fly and outputs the compressed data to the given sink.
   size_t actual_target_length = 0;
-  size_t total_written = 0;
-  static constexpr size_t buffer_size = 32768;
-  auto compression_sink = [&strm, &actual_target_length, &expected_target_length, &total_written,
-                           &ret, &ctx, &sink](const uint8_t* data, size_t len) -> size_t {
+  auto compression_sink = [&strm, &actual_target_length, &expected_target_length, &ret, &buffer,
+                           &buffered, &flush](const uint8_t* data, size_t len) -> size_t {
     // The input patch length for an update never exceeds INT_MAX.
     strm.avail_in = len;
     strm.next_in = data;
     do {
-      std::vector<uint8_t> buffer(buffer_size);
-      strm.avail_out = buffer_size;
-      strm.next_out = buffer.data();
+      strm.avail_out = buffer.size() - buffered;
+      strm.next_out = buffer.data() + buffered;
       if (actual_target_length + len < expected_target_length) {
         ret = deflate(&strm, Z_NO_FLUSH);
       } else {
         ret = deflate(&strm, Z_FINISH);
       }
-      if (ret != Z_OK && ret != Z_STREAM_END) {
+      // Z_BUF_ERROR only means that deflate() had nothing to add to a full buffer.
+      if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
         LOG(ERROR) << "Failed to deflate stream: " << ret;
         // zero length indicates an error in the sink function of bspatch().
         return 0;
       }
 
-      size_t have = buffer_size - strm.avail_out;
-      total_written += have;
-      if (sink(buffer.data(), have) != have) {
-        LOG(ERROR) << "Failed to write " << have << " compressed bytes to output.";
+      buffered = buffer.size() - strm.avail_out;
+      if (buffered == buffer.size() && !flush()) {
         return 0;
       }
-      if (ctx) SHA1_Update(ctx, buffer.data(), have);
     } while ((strm.avail_in != 0 || strm.avail_out == 0) && ret != Z_STREAM_END);
 
     actual_target_length += len;
@@ -122,6 +139,10 @@ static bool ApplyBSDiffPatchAndStreamOutput(const uint8_t* src_data, size_t src_
     return false;
   }
 
+  if (buffered != 0 && !flush()) {
+    return false;
+  }
+
   if (expected_target_length != actual_target_length) {
     LOG(ERROR) << "target length is expected to be " << expected_target_length << ", but it's "
                << actual_target_length;
@@ -32,6 +32,17 @@ struct Value;
 struct FileContents {
   uint8_t sha1[SHA_DIGEST_LENGTH];
   std::vector<unsigned char> data;
+  // Set instead of |data| when the contents are mapped from a partition, see MapFileContents().
+  // The mapping goes away with the last FileContents holding it.
+  std::shared_ptr<const unsigned char> mapped;
+  size_t mapped_size = 0;
+
+  const unsigned char* Data() const {
+    return mapped ? mapped.get() : data.data();
+  }
+  size_t Size() const {
+    return mapped ? mapped_size : data.size();
+  }
 };
 
 using SinkFn = std::function<size_t(const unsigned char*, size_t)>;
@@ -56,6 +67,7 @@ int applypatch_flash(const char* source_filename, const char* target_filename,
                      const char* target_sha1_str, size_t target_size);
 
 int LoadFileContents(const char* filename, FileContents* file);
+int MapFileContents(const char* filename, FileContents* file);
 int SaveFileContents(const char* filename, const FileContents* file);
 
 // bspatch.cpp
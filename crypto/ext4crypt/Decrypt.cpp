@@ -79,6 +79,8 @@ extern "C" {
 #include <hardware/gatekeeper.h>
 #endif
 #include "HashPassword.h"
+#include "HalTiming.h"
+#include "KeyCache.h"
 
 #include <android-base/file.h>
 
@@ -161,6 +163,24 @@ int gatekeeper_device_initialize(gatekeeper_device_t **dev) {
 }
 #endif //ifndef HAVE_GATEKEEPER1
 
+// Installs the CE key of user_id and sets up its storage
+static bool Unlock_User_Storage(const userid_t user_id, const char* token, const char* secret) {
+	int flags = user_id == 0 ? FLAG_STORAGE_DE : FLAG_STORAGE_CE;
+	if (!e4crypt_unlock_user_key(user_id, 0, token, secret)) {
+		printf("e4crypt_unlock_user_key returned fail\n");
+		return false;
+	}
+#ifdef USE_KEYSTORAGE_4
+	if (!e4crypt_prepare_user_storage("", user_id, 0, flags)) {
+#else
+	if (!e4crypt_prepare_user_storage(nullptr, user_id, 0, flags)) {
+#endif
+		printf("failed to e4crypt_prepare_user_storage\n");
+		return false;
+	}
+	return true;
+}
+
 bool Decrypt_DE() {
 	if (!e4crypt_initialize_global_de()) { // this deals with the overarching device encryption
 		printf("e4crypt_initialize_global_de returned fail\n");
@@ -547,6 +567,7 @@ bool Find_Keystore_Alias_SubID_And_Prep_Files(const userid_t user_id, std::strin
  * returning an empty string indicates an error */
 std::string unwrapSyntheticPasswordBlob(const std::string& spblob_path, const std::string& handle_str, const userid_t user_id, const void* application_id, const size_t application_id_size, uint32_t auth_token_len) {
 	std::string disk_decryption_secret_key = "";
+	uint64_t hal_start;
 
 	std::string keystore_alias_subid;
 	if (!Find_Keystore_Alias_SubID_And_Prep_Files(user_id, keystore_alias_subid, handle_str)) {
@@ -727,7 +748,9 @@ std::string unwrapSyntheticPasswordBlob(const std::string& spblob_path, const st
 		security::keymaster::OperationResult finish_result;
 		::android::security::keymaster::KeymasterArguments empty_params;
 		// These parameters are mostly driven by the cipher.init call https://android.googlesource.com/platform/frameworks/base/+/android-8.0.0_r23/services/core/java/com/android/server/locksettings/SyntheticPasswordCrypto.java#63
+		hal_start = Hal_Timing_Start();
 		service->begin(binder, keystore_alias16, (int32_t)purpose, true, android::security::keymaster::KeymasterArguments(begin_params.hidl_data()), entropy, -1, &begin_result);
+		Hal_Timing_Record(HAL_KEYMASTER_BEGIN, hal_start);
 #else
 		::keystore::KeyPurpose purpose = ::keystore::KeyPurpose::DECRYPT;
 		OperationResult begin_result;
@@ -736,7 +759,9 @@ std::string unwrapSyntheticPasswordBlob(const std::string& spblob_path, const st
 		::keystore::hidl_vec<::keystore::KeyParameter> empty_params;
 		empty_params.resize(0);
 		// These parameters are mostly driven by the cipher.init call https://android.googlesource.com/platform/frameworks/base/+/android-8.0.0_r23/services/core/java/com/android/server/locksettings/SyntheticPasswordCrypto.java#63
+		hal_start = Hal_Timing_Start();
 		service->begin(binder, keystore_alias16, purpose, true, begin_params.hidl_data(), entropy, -1, &begin_result);
+		Hal_Timing_Record(HAL_KEYMASTER_BEGIN, hal_start);
 #endif
 		ret = begin_result.resultCode;
 		if (ret != 1 /*android::keystore::ResponseCode::NO_ERROR*/) {
@@ -747,7 +772,9 @@ std::string unwrapSyntheticPasswordBlob(const std::string& spblob_path, const st
 		}
 		// The cipher.doFinal call triggers an update to the keystore followed by a finish https://android.googlesource.com/platform/frameworks/base/+/android-8.0.0_r23/services/core/java/com/android/server/locksettings/SyntheticPasswordCrypto.java#64
 		// See also https://android.googlesource.com/platform/frameworks/base/+/android-8.0.0_r23/keystore/java/android/security/keystore/KeyStoreCryptoOperationChunkedStreamer.java#208
+		hal_start = Hal_Timing_Start();
 		service->update(begin_result.token, empty_params, intermediate_key, &update_result);
+		Hal_Timing_Record(HAL_KEYMASTER_UPDATE, hal_start);
 		ret = update_result.resultCode;
 		if (ret != 1 /*android::keystore::ResponseCode::NO_ERROR*/) {
 			printf("keystore update error: (%d)\n", /*responses[ret],*/ ret);
@@ -762,7 +789,9 @@ std::string unwrapSyntheticPasswordBlob(const std::string& spblob_path, const st
 		disk_decryption_secret_key = PersonalizedHash(PERSONALIZATION_FBE_KEY, (const char*)&update_result.data[0], update_result.data.size());
 		//printf("disk_decryption_secret_key: '%s'\n", disk_decryption_secret_key.c_str());
 		::keystore::hidl_vec<uint8_t> signature;
+		hal_start = Hal_Timing_Start();
 		service->finish(begin_result.token, empty_params, signature, entropy, &finish_result);
+		Hal_Timing_Record(HAL_KEYMASTER_FINISH, hal_start);
 		ret = finish_result.resultCode;
 		if (ret != 1 /*android::keystore::ResponseCode::NO_ERROR*/) {
 			printf("keystore finish error: (%d)\n", /*responses[ret],*/ ret);
@@ -840,7 +869,9 @@ std::string unwrapSyntheticPasswordBlob(const std::string& spblob_path, const st
 		security::keymaster::OperationResult finish_result;
 		::android::security::keymaster::KeymasterArguments empty_params;
 		// These parameters are mostly driven by the cipher.init call https://android.googlesource.com/platform/frameworks/base/+/android-8.0.0_r23/services/core/java/com/android/server/locksettings/SyntheticPasswordCrypto.java#63
+		hal_start = Hal_Timing_Start();
 		service->begin(binder, keystore_alias16, (int32_t)purpose, true, android::security::keymaster::KeymasterArguments(begin_params.hidl_data()), entropy, -1, &begin_result);
+		Hal_Timing_Record(HAL_KEYMASTER_BEGIN, hal_start);
 #else
 		::keystore::KeyPurpose purpose = ::keystore::KeyPurpose::DECRYPT;
 		OperationResult begin_result;
@@ -849,7 +880,9 @@ std::string unwrapSyntheticPasswordBlob(const std::string& spblob_path, const st
 		::keystore::hidl_vec<::keystore::KeyParameter> empty_params;
 		empty_params.resize(0);
 		// These parameters are mostly driven by the cipher.init call https://android.googlesource.com/platform/frameworks/base/+/android-8.0.0_r23/services/core/java/com/android/server/locksettings/SyntheticPasswordCrypto.java#63
+		hal_start = Hal_Timing_Start();
 		service->begin(binder, keystore_alias16, purpose, true, begin_params.hidl_data(), entropy, -1, &begin_result);
+		Hal_Timing_Record(HAL_KEYMASTER_BEGIN, hal_start);
 #endif
 		ret = begin_result.resultCode;
 		if (ret != 1 /*android::keystore::ResponseCode::NO_ERROR*/) {
@@ -860,7 +893,9 @@ std::string unwrapSyntheticPasswordBlob(const std::string& spblob_path, const st
 		}*/
 		// The cipher.doFinal call triggers an update to the keystore followed by a finish https://android.googlesource.com/platform/frameworks/base/+/android-8.0.0_r23/services/core/java/com/android/server/locksettings/SyntheticPasswordCrypto.java#64
 		// See also https://android.googlesource.com/platform/frameworks/base/+/android-8.0.0_r23/keystore/java/android/security/keystore/KeyStoreCryptoOperationChunkedStreamer.java#208
+		hal_start = Hal_Timing_Start();
 		service->update(begin_result.token, empty_params, cipher_text_hidlvec, &update_result);
+		Hal_Timing_Record(HAL_KEYMASTER_UPDATE, hal_start);
 		ret = update_result.resultCode;
 		if (ret != 1 /*android::keystore::ResponseCode::NO_ERROR*/) {
 			printf("keystore update error: (%d)\n", /*responses[ret],*/ ret);
@@ -880,7 +915,9 @@ std::string unwrapSyntheticPasswordBlob(const std::string& spblob_path, const st
 		memcpy(keystore_result, &update_result.data[0], update_result.data.size());
 		//printf("keystore_result data: "); output_hex(keystore_result, keystore_result_size); printf("\n");
 		::keystore::hidl_vec<uint8_t> signature;
+		hal_start = Hal_Timing_Start();
 		service->finish(begin_result.token, empty_params, signature, entropy, &finish_result);
+		Hal_Timing_Record(HAL_KEYMASTER_FINISH, hal_start);
 		ret = finish_result.resultCode;
 		if (ret != 1 /*android::keystore::ResponseCode::NO_ERROR*/) {
 			printf("keystore finish error: (%d)\n", /*responses[ret],*/ ret);
@@ -1111,6 +1148,7 @@ bool Decrypt_User_Synth_Pass(const userid_t user_id, const std::string& Password
 		}
 		android::hardware::hidl_vec<uint8_t> gk_pwd_token_hidl;
 		gk_pwd_token_hidl.setToExternal(const_cast<uint8_t *>((const uint8_t *)gk_pwd_token), SHA512_DIGEST_LENGTH);
+		uint64_t hal_start = Hal_Timing_Start();
 		android::hardware::Return<void> hwRet =
 			gk_device->verify(fakeUid(user_id), 0 /* challange */,
 							  pwd_handle_hidl,
@@ -1140,6 +1178,7 @@ bool Decrypt_User_Synth_Pass(const userid_t user_id, const std::string& Password
 									}
 								}
 							 );
+		Hal_Timing_Record(HAL_GATEKEEPER_VERIFY, hal_start);
 		free(gk_pwd_token);
 		if (!hwRet.isOk() || ret != 0) {
 			printf("gatekeeper verification failed\n");
@@ -1167,6 +1206,7 @@ bool Decrypt_User_Synth_Pass(const userid_t user_id, const std::string& Password
 		return Free_Return(retval, weaver_key, &pwd);
 	}
 	printf("Decrypted Successfully!\n");
+	Key_Cache_Store(user_id, Password, token.c_str(), secret.c_str());
 	retval = true;
 	return Free_Return(retval, weaver_key, &pwd);
 }
@@ -1259,6 +1299,13 @@ bool Decrypt_User(const userid_t user_id, const std::string& Password) {
 		printf("Decrypted Successfully!\n");
 		return true;
 	}
+	// A retry, or another unlock of a user decrypted earlier in this session
+	if (Key_Cache_Unlock(user_id, Password, [user_id](const char* token, const char* secret) {
+			return Unlock_User_Storage(user_id, token, secret);
+		})) {
+		printf("Decrypted Successfully!\n");
+		return true;
+	}
 	if (stat("/data/system_de/0/spblob", &st) == 0) {
 #ifdef HAVE_SYNTH_PWD_SUPPORT
 		printf("Using synthetic password method\n");
@@ -1290,6 +1337,7 @@ bool Decrypt_User(const userid_t user_id, const std::string& Password) {
 	android::hardware::hidl_vec<uint8_t> enteredPwd;
 	enteredPwd.setToExternal(const_cast<uint8_t *>((const uint8_t *)Password.c_str()), Password.size());
 
+	uint64_t hal_start = Hal_Timing_Start();
 	android::hardware::Return<void> hwRet =
 		gk_device->verify(user_id, 0 /* challange */,
 						  curPwdHandle,
@@ -1308,6 +1356,7 @@ bool Decrypt_User(const userid_t user_id, const std::string& Password) {
 								}
 							}
 						 );
+	Hal_Timing_Record(HAL_GATEKEEPER_VERIFY, hal_start);
 	if (!hwRet.isOk()) {
 		return false;
 	}
@@ -1316,9 +1365,11 @@ bool Decrypt_User(const userid_t user_id, const std::string& Password) {
 	ret = gatekeeper_device_initialize(&gk_device);
     if (ret!=0)
 		return false;
+    uint64_t hal_start = Hal_Timing_Start();
     ret = gk_device->verify(gk_device, user_id, 0, (const uint8_t *)handle.c_str(), st.st_size,
                 (const uint8_t *)Password.c_str(), (uint32_t)Password.size(), &auth_token, &auth_token_len,
                 &should_reenroll);
+    Hal_Timing_Record(HAL_GATEKEEPER_VERIFY, hal_start);
     if (ret !=0) {
 		printf("failed to verify\n");
 		return false;
@@ -1341,5 +1392,6 @@ bool Decrypt_User(const userid_t user_id, const std::string& Password) {
 		return false;
 	}
 	printf("Decrypted Successfully!\n");
+	Key_Cache_Store(user_id, Password, token_hex, secret.c_str());
 	return true;
 }
@@ -27,6 +27,7 @@
 #include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <dirent.h>
@@ -308,6 +309,21 @@ static bool is_numeric(const char* name) {
     return true;
 }
 
+// Fetches and installs the DE key of one user, on its own thread when
+// several users have to be loaded
+struct de_key_load {
+    userid_t user_id;
+    std::string key_path;
+    std::string raw_ref;
+    bool ok;
+};
+
+static void load_de_key(de_key_load* load) {
+    KeyBuffer key;
+    load->ok = android::vold::retrieveKey(load->key_path, kEmptyAuthentication, &key) &&
+               android::vold::installKey(key, &load->raw_ref);
+}
+
 static bool load_all_de_keys() {
     auto de_dir = user_key_dir + "/de";
     auto dirp = std::unique_ptr<DIR, int (*)(DIR*)>(opendir(de_dir.c_str()), closedir);
@@ -315,6 +331,7 @@ static bool load_all_de_keys() {
         PLOG(ERROR) << "Unable to read de key directory" << std::endl;
         return false;
     }
+    std::vector<de_key_load> loads;
     for (;;) {
         errno = 0;
         auto entry = readdir(dirp.get());
@@ -330,16 +347,27 @@ static bool load_all_de_keys() {
             continue;
         }
         userid_t user_id = std::stoi(entry->d_name);
-        if (s_de_key_raw_refs.count(user_id) == 0) {
-            auto key_path = de_dir + "/" + entry->d_name;
-            KeyBuffer key;
-            if (!android::vold::retrieveKey(key_path, kEmptyAuthentication, &key)) return false;
-            std::string raw_ref;
-            if (!android::vold::installKey(key, &raw_ref)) return false;
-            s_de_key_raw_refs[user_id] = raw_ref;
-            LOG(DEBUG) << "Installed de key for user " << user_id << std::endl;
+        if (s_de_key_raw_refs.count(user_id) == 0)
+            loads.push_back({user_id, de_dir + "/" + entry->d_name, "", false});
+    }
+    // Every user's keymaster round trips are independent
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < loads.size(); i++)
+        threads.emplace_back(load_de_key, &loads[i]);
+    if (!loads.empty()) load_de_key(&loads[0]);
+    for (auto& thread : threads)
+        thread.join();
+    bool ret = true;
+    for (auto& load : loads) {
+        if (!load.ok) {
+            LOG(ERROR) << "Failed to install de key for user " << load.user_id << std::endl;
+            ret = false;
+            continue;
         }
+        s_de_key_raw_refs[load.user_id] = load.raw_ref;
+        LOG(DEBUG) << "Installed de key for user " << load.user_id << std::endl;
     }
+    if (!ret) return false;
     // ext4enc:TODO: go through all DE directories, ensure that all user dirs have the
     // correct policy set on them, and that no rogue ones exist.
     return true;
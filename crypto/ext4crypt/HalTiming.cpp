@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2018 The Team Win Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "HalTiming.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+static const char* hal_call_names[HAL_CALL_COUNT] = {
+	"keymaster_begin",
+	"keymaster_update",
+	"keymaster_finish",
+	"keymaster_upgrade_key",
+	"weaver_read",
+	"gatekeeper_verify",
+};
+
+static pthread_mutex_t timing_lock = PTHREAD_MUTEX_INITIALIZER;
+static Hal_Call_Stats timing[HAL_CALL_COUNT];
+static FILE* trace_file = NULL;
+
+static uint64_t Now_Usec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const char* Hal_Call_Name(Hal_Call call) {
+	return call < HAL_CALL_COUNT ? hal_call_names[call] : "unknown";
+}
+
+uint64_t Hal_Timing_Start() {
+	return Now_Usec();
+}
+
+void Hal_Timing_Record(Hal_Call call, uint64_t start) {
+	uint64_t usec = Now_Usec() - start;
+
+	if (call >= HAL_CALL_COUNT)
+		return;
+	pthread_mutex_lock(&timing_lock);
+	timing[call].calls++;
+	timing[call].total_usec += usec;
+	if (usec > timing[call].max_usec)
+		timing[call].max_usec = usec;
+	if (trace_file) {
+		fprintf(trace_file, "%llu %s %llu\n", (unsigned long long)start, hal_call_names[call], (unsigned long long)usec);
+		fflush(trace_file);
+	}
+	pthread_mutex_unlock(&timing_lock);
+}
+
+void Hal_Timing_Get(Hal_Call call, Hal_Call_Stats* stats) {
+	pthread_mutex_lock(&timing_lock);
+	if (call < HAL_CALL_COUNT)
+		*stats = timing[call];
+	else
+		memset(stats, 0, sizeof(*stats));
+	pthread_mutex_unlock(&timing_lock);
+}
+
+void Hal_Timing_Reset() {
+	pthread_mutex_lock(&timing_lock);
+	memset(timing, 0, sizeof(timing));
+	pthread_mutex_unlock(&timing_lock);
+}
+
+void Hal_Timing_Log() {
+	pthread_mutex_lock(&timing_lock);
+	for (int i = 0; i < HAL_CALL_COUNT; i++) {
+		if (timing[i].calls == 0)
+			continue;
+		printf("HAL %s: %u calls, %llu ms total, %llu ms max\n", hal_call_names[i], timing[i].calls,
+			(unsigned long long)timing[i].total_usec / 1000, (unsigned long long)timing[i].max_usec / 1000);
+	}
+	pthread_mutex_unlock(&timing_lock);
+}
+
+void Hal_Timing_Set_Trace(const char* path) {
+	pthread_mutex_lock(&timing_lock);
+	if (trace_file) {
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+	if (path) {
+		trace_file = fopen(path, "a");
+		if (!trace_file)
+			printf("Unable to open HAL trace file '%s'\n", path);
+		else
+			fprintf(trace_file, "# start_usec call duration_usec\n");
+	}
+	pthread_mutex_unlock(&timing_lock);
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2018 The Team Win Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __HAL_TIMING_H
+#define __HAL_TIMING_H
+
+#include <stdint.h>
+
+// Timing of the synchronous HAL calls that decrypt waits on, so a slow
+// decrypt can be pinned on the keymaster, weaver or gatekeeper of the
+// device. Every call is counted, and with a trace file set, every call is
+// also written to it as it finishes.
+
+enum Hal_Call {
+	HAL_KEYMASTER_BEGIN,
+	HAL_KEYMASTER_UPDATE,
+	HAL_KEYMASTER_FINISH,
+	HAL_KEYMASTER_UPGRADE_KEY,
+	HAL_WEAVER_READ,
+	HAL_GATEKEEPER_VERIFY,
+	HAL_CALL_COUNT
+};
+
+struct Hal_Call_Stats {
+	unsigned calls;
+	uint64_t total_usec;
+	uint64_t max_usec;
+};
+
+const char* Hal_Call_Name(Hal_Call call);                                  // "keymaster_begin" and so on
+uint64_t Hal_Timing_Start();                                               // Pass to Hal_Timing_Record() when the call returns
+void Hal_Timing_Record(Hal_Call call, uint64_t start);
+void Hal_Timing_Get(Hal_Call call, Hal_Call_Stats* stats);
+void Hal_Timing_Reset();
+void Hal_Timing_Log();                                                     // Prints the calls made so far
+void Hal_Timing_Set_Trace(const char* path);                               // NULL stops tracing
+
+#endif
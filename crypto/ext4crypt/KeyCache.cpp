@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2018 The Team Win Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "KeyCache.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+struct key_cache_entry {
+	bool used;
+	userid_t user_id;
+	unsigned char password_hash[SHA256_DIGEST_LENGTH];
+	char token[KEY_CACHE_MAX_TOKEN];
+	char secret[KEY_CACHE_MAX_SECRET];
+};
+
+struct key_cache {
+	unsigned char salt[32];                                                // Per session, so the hashes can't be looked up
+	key_cache_entry entries[KEY_CACHE_MAX_USERS];
+};
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static key_cache* cache = NULL;
+
+static void Wipe(void* ptr, size_t len) {
+	OPENSSL_cleanse(ptr, len);
+}
+
+// Maps the cache the first time it is needed, false if the pages can't be
+// locked, in which case nothing is cached
+static bool Map_Cache() {
+	if (cache)
+		return true;
+	void* pages = mmap(NULL, sizeof(key_cache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (pages == MAP_FAILED) {
+		printf("Key cache: unable to map: %s\n", strerror(errno));
+		return false;
+	}
+	if (mlock(pages, sizeof(key_cache)) != 0) {
+		printf("Key cache: unable to lock pages: %s\n", strerror(errno));
+		munmap(pages, sizeof(key_cache));
+		return false;
+	}
+	madvise(pages, sizeof(key_cache), MADV_DONTDUMP);
+	cache = (key_cache*) pages;
+	if (RAND_bytes(cache->salt, sizeof(cache->salt)) != 1) {
+		munlock(pages, sizeof(key_cache));
+		munmap(pages, sizeof(key_cache));
+		cache = NULL;
+		return false;
+	}
+	return true;
+}
+
+static void Hash_Password(const std::string& Password, unsigned char hash[SHA256_DIGEST_LENGTH]) {
+	SHA256_CTX ctx;
+	SHA256_Init(&ctx);
+	SHA256_Update(&ctx, cache->salt, sizeof(cache->salt));
+	SHA256_Update(&ctx, Password.data(), Password.size());
+	SHA256_Final(hash, &ctx);
+	Wipe(&ctx, sizeof(ctx));
+}
+
+static key_cache_entry* Find_Entry(userid_t user_id) {
+	for (int i = 0; i < KEY_CACHE_MAX_USERS; i++) {
+		if (cache->entries[i].used && cache->entries[i].user_id == user_id)
+			return &cache->entries[i];
+	}
+	return NULL;
+}
+
+bool Key_Cache_Store(userid_t user_id, const std::string& Password, const char* token, const char* secret) {
+	size_t token_len = strlen(token), secret_len = strlen(secret);
+	if (token_len >= KEY_CACHE_MAX_TOKEN || secret_len >= KEY_CACHE_MAX_SECRET) {
+		printf("Key cache: key of user %d is too large to cache\n", user_id);
+		return false;
+	}
+	pthread_mutex_lock(&cache_lock);
+	if (!Map_Cache()) {
+		pthread_mutex_unlock(&cache_lock);
+		return false;
+	}
+	key_cache_entry* entry = Find_Entry(user_id);
+	for (int i = 0; !entry && i < KEY_CACHE_MAX_USERS; i++) {
+		if (!cache->entries[i].used)
+			entry = &cache->entries[i];
+	}
+	if (!entry) {
+		pthread_mutex_unlock(&cache_lock);
+		return false;
+	}
+	Wipe(entry, sizeof(*entry));
+	entry->used = true;
+	entry->user_id = user_id;
+	Hash_Password(Password, entry->password_hash);
+	memcpy(entry->token, token, token_len + 1);
+	memcpy(entry->secret, secret, secret_len + 1);
+	pthread_mutex_unlock(&cache_lock);
+	return true;
+}
+
+bool Key_Cache_Unlock(userid_t user_id, const std::string& Password, const std::function<bool(const char*, const char*)>& unlock) {
+	unsigned char hash[SHA256_DIGEST_LENGTH];
+	bool ret = false;
+
+	pthread_mutex_lock(&cache_lock);
+	key_cache_entry* entry = cache ? Find_Entry(user_id) : NULL;
+	if (entry) {
+		Hash_Password(Password, hash);
+		if (CRYPTO_memcmp(hash, entry->password_hash, sizeof(hash)) == 0) {
+			printf("Using cached key of user %d\n", user_id);
+			ret = unlock(entry->token, entry->secret);
+			if (!ret) {
+				printf("Cached key of user %d failed, dropping it\n", user_id);
+				Wipe(entry, sizeof(*entry));
+			}
+		}
+		Wipe(hash, sizeof(hash));
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return ret;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2018 The Team Win Recovery Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __KEY_CACHE_H
+#define __KEY_CACHE_H
+
+#include <cutils/multiuser.h>
+
+#include <functional>
+#include <string>
+
+// Token and secret that unlocked a user's CE key, kept for the life of the
+// recovery session so unlocking the same user again with the same
+// credential skips the keymaster, gatekeeper, weaver and scrypt work.
+// Entries live in locked pages that are left out of core dumps, and the
+// credential is only kept as a salted hash.
+
+#define KEY_CACHE_MAX_USERS 16
+#define KEY_CACHE_MAX_TOKEN 1024                                           // hex auth tokens are a few hundred bytes
+#define KEY_CACHE_MAX_SECRET 1024
+
+// Remembers the token and secret that unlocked user_id with Password
+bool Key_Cache_Store(userid_t user_id, const std::string& Password, const char* token, const char* secret);
+// Calls unlock with the token and secret cached for user_id if Password
+// matches, and drops the entry if unlock fails. false if there was no
+// match or unlock failed.
+bool Key_Cache_Unlock(userid_t user_id, const std::string& Password, const std::function<bool(const char*, const char*)>& unlock);
+
+#endif
@@ -15,6 +15,7 @@
  */
 
 #include "Keymaster.h"
+#include "HalTiming.h"
 
 //#include <android-base/logging.h>
 #include <hardware/hardware.h>
@@ -127,8 +128,10 @@ bool KeymasterOperation::updateCompletely(const std::string& input, std::string*
         keymaster_blob_t inputBlob{reinterpret_cast<const uint8_t*>(&*it), toRead};
         keymaster_blob_t outputBlob;
         size_t inputConsumed;
+        uint64_t hal_start = Hal_Timing_Start();
         auto error =
             mDevice->update(mOpHandle, nullptr, &inputBlob, &inputConsumed, nullptr, &outputBlob);
+        Hal_Timing_Record(HAL_KEYMASTER_UPDATE, hal_start);
         if (error != KM_ERROR_OK) {
             LOG(ERROR) << "update failed, code " << error;
             mDevice = nullptr;
@@ -147,7 +150,9 @@ bool KeymasterOperation::updateCompletely(const std::string& input, std::string*
 }
 
 bool KeymasterOperation::finish() {
+    uint64_t hal_start = Hal_Timing_Start();
     auto error = mDevice->finish(mOpHandle, nullptr, nullptr, nullptr, nullptr);
+    Hal_Timing_Record(HAL_KEYMASTER_FINISH, hal_start);
     mDevice = nullptr;
     if (error != KM_ERROR_OK) {
         LOG(ERROR) << "finish failed, code " << error;
@@ -158,7 +163,9 @@ bool KeymasterOperation::finish() {
 
 bool KeymasterOperation::finishWithOutput(std::string* output) {
     keymaster_blob_t outputBlob;
+    uint64_t hal_start = Hal_Timing_Start();
     auto error = mDevice->finish(mOpHandle, nullptr, nullptr, nullptr, &outputBlob);
+    Hal_Timing_Record(HAL_KEYMASTER_FINISH, hal_start);
     mDevice = nullptr;
     if (error != KM_ERROR_OK) {
         LOG(ERROR) << "finish failed, code " << error;
@@ -227,7 +234,9 @@ KeymasterOperation Keymaster::begin(keymaster_purpose_t purpose, const std::stri
     keymaster_key_blob_t keyBlob{reinterpret_cast<const uint8_t*>(key.data()), key.size()};
     keymaster_operation_handle_t mOpHandle;
     keymaster_key_param_set_t outParams_set;
+    uint64_t hal_start = Hal_Timing_Start();
     auto error = mDevice->begin(purpose, &keyBlob, &inParams, &outParams_set, &mOpHandle);
+    Hal_Timing_Record(HAL_KEYMASTER_BEGIN, hal_start);
     if (error != KM_ERROR_OK) {
         LOG(ERROR) << "begin failed, code " << error;
         return KeymasterOperation(nullptr, mOpHandle);
@@ -242,7 +251,9 @@ KeymasterOperation Keymaster::begin(keymaster_purpose_t purpose, const std::stri
                                     const keymaster::AuthorizationSet& inParams) {
     keymaster_key_blob_t keyBlob{reinterpret_cast<const uint8_t*>(key.data()), key.size()};
     keymaster_operation_handle_t mOpHandle;
+    uint64_t hal_start = Hal_Timing_Start();
     auto error = mDevice->begin(purpose, &keyBlob, &inParams, nullptr, &mOpHandle);
+    Hal_Timing_Record(HAL_KEYMASTER_BEGIN, hal_start);
     if (error != KM_ERROR_OK) {
         LOG(ERROR) << "begin failed, code " << error;
         return KeymasterOperation(nullptr, mOpHandle);
@@ -15,6 +15,7 @@
  */
 
 #include "Keymaster3.h"
+#include "HalTiming.h"
 
 //#include <android-base/logging.h>
 #include <keystore/keymaster_tags.h>
@@ -54,7 +55,9 @@ bool KeymasterOperation::updateCompletely(const std::string& input, std::string*
     while (it != input.end()) {
         size_t toRead = static_cast<size_t>(input.end() - it);
         auto inputBlob = blob2hidlVec(reinterpret_cast<const uint8_t*>(&*it), toRead);
+        uint64_t hal_start = Hal_Timing_Start();
         auto error = mDevice->update(mOpHandle, hidl_vec<KeyParameter>(), inputBlob, hidlCB);
+        Hal_Timing_Record(HAL_KEYMASTER_UPDATE, hal_start);
         if (!error.isOk()) {
             LOG(ERROR) << "update failed: " << error.description();
             mDevice = nullptr;
@@ -84,8 +87,10 @@ bool KeymasterOperation::finish(std::string* output) {
         if (output)
             output->assign(reinterpret_cast<const char*>(&_output[0]), _output.size());
     };
+    uint64_t hal_start = Hal_Timing_Start();
     auto error = mDevice->finish(mOpHandle, hidl_vec<KeyParameter>(), hidl_vec<uint8_t>(),
             hidl_vec<uint8_t>(), hidlCb);
+    Hal_Timing_Record(HAL_KEYMASTER_FINISH, hal_start);
     mDevice = nullptr;
     if (!error.isOk()) {
         LOG(ERROR) << "finish failed: " << error.description();
@@ -151,7 +156,9 @@ bool Keymaster::upgradeKey(const std::string& oldKey, const AuthorizationSet& in
             newKey->assign(reinterpret_cast<const char*>(&upgradedKeyBlob[0]),
                     upgradedKeyBlob.size());
     };
+    uint64_t hal_start = Hal_Timing_Start();
     auto error = mDevice->upgradeKey(oldKeyBlob, inParams.hidl_data(), hidlCb);
+    Hal_Timing_Record(HAL_KEYMASTER_UPGRADE_KEY, hal_start);
     if (!error.isOk()) {
         LOG(ERROR) << "upgrade_key failed: " << error.description();
         return false;
@@ -179,7 +186,9 @@ KeymasterOperation Keymaster::begin(KeyPurpose purpose, const std::string& key,
         mOpHandle = operationHandle;
     };
 
+    uint64_t hal_start = Hal_Timing_Start();
     auto error = mDevice->begin(purpose, keyBlob, inParams.hidl_data(), hidlCb);
+    Hal_Timing_Record(HAL_KEYMASTER_BEGIN, hal_start);
     if (!error.isOk()) {
         LOG(ERROR) << "begin failed: " << error.description();
         return KeymasterOperation(ErrorCode::UNKNOWN_ERROR);
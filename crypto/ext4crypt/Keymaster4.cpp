@@ -15,6 +15,7 @@
  */
 
 #include "Keymaster4.h"
+#include "HalTiming.h"
 
 //#include <android-base/logging.h>
 #include <keymasterV4_0/authorization_set.h>
@@ -53,8 +54,10 @@ bool KeymasterOperation::updateCompletely(const char* input, size_t inputLen,
         size_t toRead = static_cast<size_t>(inputLen - inputConsumed);
         auto inputBlob = km::support::blob2hidlVec(
             reinterpret_cast<const uint8_t*>(&input[inputConsumed]), toRead);
+        uint64_t hal_start = Hal_Timing_Start();
         auto error = mDevice->update(mOpHandle, hidl_vec<km::KeyParameter>(), inputBlob,
                                      km::HardwareAuthToken(), km::VerificationToken(), hidlCB);
+        Hal_Timing_Record(HAL_KEYMASTER_UPDATE, hal_start);
         if (!error.isOk()) {
             LOG(ERROR) << "update failed: " << error.description() << std::endl;
             mDevice = nullptr;
@@ -82,9 +85,11 @@ bool KeymasterOperation::finish(std::string* output) {
         if (km_error != km::ErrorCode::OK) return;
         if (output) output->assign(reinterpret_cast<const char*>(&_output[0]), _output.size());
     };
+    uint64_t hal_start = Hal_Timing_Start();
     auto error = mDevice->finish(mOpHandle, hidl_vec<km::KeyParameter>(), hidl_vec<uint8_t>(),
                                  hidl_vec<uint8_t>(), km::HardwareAuthToken(),
                                  km::VerificationToken(), hidlCb);
+    Hal_Timing_Record(HAL_KEYMASTER_FINISH, hal_start);
     mDevice = nullptr;
     if (!error.isOk()) {
         LOG(ERROR) << "finish failed: " << error.description() << std::endl;
@@ -169,7 +174,9 @@ bool Keymaster::upgradeKey(const std::string& oldKey, const km::AuthorizationSet
             newKey->assign(reinterpret_cast<const char*>(&upgradedKeyBlob[0]),
                            upgradedKeyBlob.size());
     };
+    uint64_t hal_start = Hal_Timing_Start();
     auto error = mDevice->upgradeKey(oldKeyBlob, inParams.hidl_data(), hidlCb);
+    Hal_Timing_Record(HAL_KEYMASTER_UPGRADE_KEY, hal_start);
     if (!error.isOk()) {
         LOG(ERROR) << "upgrade_key failed: " << error.description() << std::endl;
         return false;
@@ -197,7 +204,9 @@ KeymasterOperation Keymaster::begin(km::KeyPurpose purpose, const std::string& k
         mOpHandle = operationHandle;
     };
 
+    uint64_t hal_start = Hal_Timing_Start();
     auto error = mDevice->begin(purpose, keyBlob, inParams.hidl_data(), authToken, hidlCb);
+    Hal_Timing_Record(HAL_KEYMASTER_BEGIN, hal_start);
     if (!error.isOk()) {
         LOG(ERROR) << "begin failed: " << error.description() << std::endl;
         return KeymasterOperation(km::ErrorCode::UNKNOWN_ERROR);
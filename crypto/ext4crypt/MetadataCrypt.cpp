@@ -17,6 +17,7 @@
 #include "KeyBuffer.h"
 #include "MetadataCrypt.h"
 
+#include <chrono>
 #include <string>
 #include <thread>
 #include <vector>
@@ -26,7 +27,9 @@
 #include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <linux/dm-ioctl.h>
 
@@ -51,11 +54,19 @@
 #define DM_CRYPT_BUF_SIZE 4096
 #define TABLE_LOAD_RETRIES 10
 #define DEFAULT_KEY_TARGET_TYPE "default-key"
+// default-key from this version on takes optional parameters, and is the
+// one the OS pairs with 4096 byte crypto data units
+#define DEFAULT_KEY_OPTIONS_VERSION 2
 
 using android::vold::KeyBuffer;
 
 static const std::string kDmNameUserdata = "userdata";
 
+static uint64_t elapsed_ms(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
 void get_blkdev_size(int fd, unsigned long* nr_sec) {
   if ((ioctl(fd, BLKGETSIZE, nr_sec)) == -1) {
     *nr_sec = 0;
@@ -111,13 +122,19 @@ static bool read_key(const std::string& key_dir, bool create_if_absent, KeyBuffe
     return true;
 }
 
-static KeyBuffer default_key_params(const std::string& real_blkdev, const KeyBuffer& key) {
+static KeyBuffer default_key_params(const std::string& real_blkdev, const KeyBuffer& key,
+                                    int target_version) {
     KeyBuffer hex_key;
     if (/*android::vold::*/StrToHex(key, hex_key) != android::OK) {
         LOG(ERROR) << "Failed to turn key to hex\n";
         return KeyBuffer();
     }
     auto res = KeyBuffer() + "AES-256-XTS " + hex_key + " " + real_blkdev.c_str() + " 0";
+    // Same options vold passes to a default-key that takes them: the
+    // inline crypto engine then works on whole 4096 byte blocks instead
+    // of 512 byte sectors, and discards reach the disk
+    if (target_version >= DEFAULT_KEY_OPTIONS_VERSION)
+        res = res + " 3 allow_discards sector_size:4096 iv_large_sectors";
     return res;
 }
 
@@ -158,6 +175,73 @@ static struct dm_ioctl* dm_ioctl_init(char *buffer, size_t buffer_size,
     return io;
 }
 
+// Major version of the dm target_type, 0 if the kernel doesn't have it
+static int get_dm_target_version(const std::string& target_type) {
+    android::base::unique_fd dm_fd(TEMP_FAILURE_RETRY(open(
+        "/dev/device-mapper", O_RDWR | O_CLOEXEC, 0)));
+    if (dm_fd == -1) {
+        PLOG(ERROR) << "Cannot open device-mapper\n";
+        return 0;
+    }
+    alignas(struct dm_ioctl) char buffer[DM_CRYPT_BUF_SIZE];
+    auto io = dm_ioctl_init(buffer, sizeof(buffer), "");
+    if (!io || ioctl(dm_fd.get(), DM_LIST_VERSIONS, io) != 0) {
+        PLOG(ERROR) << "Cannot list device-mapper targets\n";
+        return 0;
+    }
+    size_t offset = io->data_start;
+    while (offset + sizeof(struct dm_target_versions) <= io->data_size &&
+           offset + sizeof(struct dm_target_versions) <= sizeof(buffer)) {
+        auto tgt = (struct dm_target_versions*) (buffer + offset);
+        if (target_type == tgt->name)
+            return tgt->version[0];
+        if (!tgt->next)
+            break;
+        offset += tgt->next;
+    }
+    return 0;
+}
+
+// Whether the disk under real_blkdev has inline encryption hardware.
+// Kernels with blk-crypto list its modes in queue/crypto, without it
+// default-key runs on the blk-crypto software fallback.
+static bool has_inline_crypt_hw(const std::string& real_blkdev) {
+    struct stat st;
+    if (stat(real_blkdev.c_str(), &st) != 0 || !S_ISBLK(st.st_mode))
+        return false;
+    std::string sys_dev = "/sys/dev/block/" + std::to_string(major(st.st_rdev)) + ":" +
+        std::to_string(minor(st.st_rdev));
+    // A partition has the queue of its disk one directory up
+    if (access((sys_dev + "/partition").c_str(), F_OK) == 0)
+        sys_dev += "/..";
+    return access((sys_dev + "/queue/crypto").c_str(), F_OK) == 0;
+}
+
+// Block device of dm_name if it is already mapped with a table, so a
+// mapping made earlier in this boot is reused without unwrapping the key
+// or loading the table again. A leftover device without a table is
+// removed so it can be created again.
+static bool find_crypto_blk_dev(const std::string& dm_name, std::string* crypto_blkdev) {
+    android::base::unique_fd dm_fd(TEMP_FAILURE_RETRY(open(
+        "/dev/device-mapper", O_RDWR | O_CLOEXEC, 0)));
+    if (dm_fd == -1)
+        return false;
+    alignas(struct dm_ioctl) char buffer[DM_CRYPT_BUF_SIZE];
+    auto io = dm_ioctl_init(buffer, sizeof(buffer), dm_name);
+    if (!io || ioctl(dm_fd.get(), DM_DEV_STATUS, io) != 0)
+        return false;
+    if (!(io->flags & DM_ACTIVE_PRESENT_FLAG) || (io->flags & DM_SUSPEND_FLAG)) {
+        LOG(INFO) << "Removing inactive dm device " << dm_name << "\n";
+        io = dm_ioctl_init(buffer, sizeof(buffer), dm_name);
+        if (ioctl(dm_fd.get(), DM_DEV_REMOVE, io) != 0)
+            PLOG(ERROR) << "Cannot remove dm device " << dm_name << "\n";
+        return false;
+    }
+    *crypto_blkdev = std::string() + "/dev/block/dm-" + std::to_string(
+        (io->dev & 0xff) | ((io->dev >> 12) & 0xfff00));
+    return true;
+}
+
 static bool create_crypto_blk_dev(const std::string& dm_name, uint64_t nr_sec,
                                   const std::string& target_type, const KeyBuffer& crypt_params,
                                   std::string* crypto_blkdev) {
@@ -238,14 +322,26 @@ bool e4crypt_mount_metadata_encrypted(const std::string& mount_point, bool needs
         LOG(ERROR) << "Failed to get data_rec";
         return false;
     }*/
+    auto start = std::chrono::steady_clock::now();
+    if (!needs_encrypt && find_crypto_blk_dev(kDmNameUserdata, crypto_blkdev)) {
+        LOG(INFO) << "Reusing mapped crypto block device " << *crypto_blkdev << " ("
+                  << elapsed_ms(start) << " ms)\n";
+        return true;
+    }
     KeyBuffer key;
     if (!read_key(key_dir, needs_encrypt, &key)) return false;
+    uint64_t key_ms = elapsed_ms(start);
     uint64_t nr_sec;
     if (!get_number_of_sectors(blk_device, &nr_sec)) return false;
+    int target_version = get_dm_target_version(DEFAULT_KEY_TARGET_TYPE);
+    LOG(INFO) << DEFAULT_KEY_TARGET_TYPE << " target version " << target_version << ", inline crypto "
+              << (has_inline_crypt_hw(blk_device) ? "hardware" : "not found") << "\n";
     //std::string crypto_blkdev;
     if (!create_crypto_blk_dev(kDmNameUserdata, nr_sec, DEFAULT_KEY_TARGET_TYPE,
-                               default_key_params(blk_device, key), /*&*/crypto_blkdev))
+                               default_key_params(blk_device, key, target_version), /*&*/crypto_blkdev))
         return false;
+    LOG(INFO) << "Metadata encryption set up in " << elapsed_ms(start) << " ms (key "
+              << key_ms << " ms)\n";
     // FIXME handle the corrupt case
     /*if (needs_encrypt) {
         LOG(INFO) << "Beginning inplace encryption, nr_sec: " << nr_sec;
@@ -22,6 +22,7 @@
  */
 
 #include "Weaver1.h"
+#include "HalTiming.h"
 
 //#include <android-base/logging.h>
 //#include <keystore/keymaster_tags.h>
@@ -111,12 +112,14 @@ bool Weaver::WeaverVerify(const uint32_t slot, const void* weaver_key, std::vect
 		key[index] = *ptr;
 		ptr++;
 	}
+	uint64_t hal_start = Hal_Timing_Start();
 	const auto readRet = mDevice->read(slot, key, [&](WeaverReadStatus s, WeaverReadResponse r) {
 		callbackCalled = true;
 		status = s;
 		readValue = r.value;
 		timeout = r.timeout;
 	});
+	Hal_Timing_Record(HAL_WEAVER_READ, hal_start);
 	if (readRet.isOk() && callbackCalled && status == WeaverReadStatus::OK && timeout == 0) {
 		*payload = readValue;
 		return true;
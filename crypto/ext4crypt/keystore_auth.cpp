@@ -24,6 +24,7 @@
  * get deleted. */
 
 #include <stdio.h>
+#include <time.h>
 #include <string>
 
 #ifdef USE_SECURITY_NAMESPACE
@@ -85,6 +86,8 @@ int main() {
 		create_error_file();
 		return -2;
 	}
+	struct timespec start, stop;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 #ifdef USE_SECURITY_NAMESPACE
 	std::vector<uint8_t> auth_token_vector(&auth_token[0], (&auth_token[0]) + size);
 	int result = 0;
@@ -100,7 +103,9 @@ int main() {
 		create_error_file();
 		return -3;
 	}
-	printf("successfully added auth token to keystore\n");
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	printf("successfully added auth token to keystore in %lld ms\n",
+		(long long)(stop.tv_sec - start.tv_sec) * 1000 + (stop.tv_nsec - start.tv_nsec) / 1000000);
 	ALOGD("successfully added auth token to keystore\n");
 	unlink("/auth_token");
 	return 0;
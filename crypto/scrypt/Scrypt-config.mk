@@ -29,6 +29,7 @@ unknown_arch_exclude_files :=
 common_c_flags :=
 
 common_src_files := \
+  lib/crypto/crypto_scrypt-lanes.c \
   lib/crypto/crypto_scrypt-ref.c \
 
 common_c_includes := \
@@ -39,7 +39,7 @@ LOCAL_SHARED_LIBRARIES := $(log_shared_libraries)
 LOCAL_SRC_FILES += $(host_src_files)
 LOCAL_CFLAGS += $(host_c_flags)
 LOCAL_C_INCLUDES += $(host_c_includes) $(commands_recovery_local_path)/crypto/scrypt/lib/util
-LOCAL_LDLIBS += -ldl
+LOCAL_LDLIBS += -ldl -lpthread
 LOCAL_MODULE_TAGS := optional
 LOCAL_MODULE:= libscrypttwrp_static
 LOCAL_ADDITIONAL_DEPENDENCIES := $(local_additional_dependencies)
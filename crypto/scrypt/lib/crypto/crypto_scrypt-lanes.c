@@ -0,0 +1,129 @@
+/*-
+ * Copyright 2018 TeamWin
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include "scrypt_platform.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "crypto_scrypt-lanes.h"
+
+/* Lanes of one crypto_scrypt call, taken in turn by its threads. */
+struct lanes {
+	uint8_t * B;
+	size_t r;
+	uint64_t N;
+	uint32_t p;
+	crypto_scrypt_smix_t smix;
+	volatile uint32_t next;
+};
+
+struct worker {
+	struct lanes * lanes;
+	pthread_t thread;
+	void * V;
+	void * XY;
+};
+
+static void
+run_lanes(struct lanes * L, void * V, void * XY)
+{
+	uint32_t i;
+
+	while ((i = __sync_fetch_and_add(&L->next, 1)) < L->p)
+		L->smix(&L->B[i * 128 * L->r], L->r, L->N, V, XY);
+}
+
+static void *
+worker_main(void * cookie)
+{
+	struct worker * W = cookie;
+
+	run_lanes(W->lanes, W->V, W->XY);
+	return (NULL);
+}
+
+static void *
+alloc64(size_t len)
+{
+	void * ptr;
+
+	if (posix_memalign(&ptr, 64, len) != 0)
+		return (NULL);
+	return (ptr);
+}
+
+void
+crypto_scrypt_smix_lanes(uint8_t * B, size_t r, uint64_t N, uint32_t p,
+    crypto_scrypt_smix_t smix, void * V, void * XY, size_t XYlen)
+{
+	struct lanes L;
+	struct worker * W = NULL;
+	long cpus;
+	uint32_t nworkers = 0, started = 0, i;
+
+	L.B = B;
+	L.r = r;
+	L.N = N;
+	L.p = p;
+	L.smix = smix;
+	L.next = 0;
+
+	/* Each extra thread needs a V of its own, so only use the CPUs. */
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (p > 1 && cpus > 1) {
+		nworkers = ((uint64_t)(cpus) < p ? (uint32_t)(cpus) : p) - 1;
+		W = calloc(nworkers, sizeof(struct worker));
+		if (W == NULL)
+			nworkers = 0;
+	}
+	for (started = 0; started < nworkers; started++) {
+		W[started].lanes = &L;
+		if ((W[started].XY = alloc64(XYlen)) == NULL)
+			break;
+		if ((W[started].V = alloc64(128 * r * N)) == NULL) {
+			free(W[started].XY);
+			break;
+		}
+		if (pthread_create(&W[started].thread, NULL, worker_main,
+		    &W[started]) != 0) {
+			free(W[started].V);
+			free(W[started].XY);
+			break;
+		}
+	}
+
+	/* The lanes no thread took are left to this one. */
+	run_lanes(&L, V, XY);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(W[i].thread, NULL);
+		free(W[i].V);
+		free(W[i].XY);
+	}
+	free(W);
+}
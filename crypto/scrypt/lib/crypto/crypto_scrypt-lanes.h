@@ -0,0 +1,47 @@
+/*-
+ * Copyright 2018 TeamWin
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef _CRYPTO_SCRYPT_LANES_H_
+#define _CRYPTO_SCRYPT_LANES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* smix(B, r, N, V, XY) of one crypto_scrypt variant. */
+typedef void (*crypto_scrypt_smix_t)(uint8_t *, size_t, uint64_t, void *,
+    void *);
+
+/**
+ * crypto_scrypt_smix_lanes(B, r, N, p, smix, V, XY, XYlen):
+ * Run smix over the p lanes of B.  The lanes are independent, so when p > 1
+ * they are spread over up to one thread per online CPU; the calling thread
+ * uses V and XY, every other thread allocates its own 128 * r * N byte V and
+ * XYlen byte XY.  Threads that can't be started leave their lanes to the
+ * others, so this never fails.
+ */
+void crypto_scrypt_smix_lanes(uint8_t *, size_t, uint64_t, uint32_t,
+    crypto_scrypt_smix_t, void *, void *, size_t);
+
+#endif /* !_CRYPTO_SCRYPT_LANES_H_ */
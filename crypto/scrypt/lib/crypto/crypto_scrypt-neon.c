@@ -44,6 +44,7 @@
 #include "sysendian.h"
 
 #include "crypto_scrypt.h"
+#include "crypto_scrypt-lanes.h"
 
 #include "crypto_scrypt-neon-salsa208.h"
 
@@ -195,7 +196,6 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 	uint8_t * B;
 	uint32_t * V;
 	uint32_t * XY;
-	uint32_t i;
 
 	/* Sanity-check parameters. */
 #if SIZE_MAX > UINT32_MAX
@@ -267,10 +267,8 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 #endif
 
 	/* 2: for i = 0 to p - 1 do */
-	for (i = 0; i < p; i++) {
-		/* 3: B_i <-- MF(B_i, N) */
-		smix(&B[i * 128 * r], r, N, V, XY);
-	}
+	/* 3: B_i <-- MF(B_i, N), the lanes run in parallel */
+	crypto_scrypt_smix_lanes(B, r, N, p, smix, V, XY, 256 * r + 64);
 
 	/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
 #ifdef USE_OPENSSL_PBKDF2
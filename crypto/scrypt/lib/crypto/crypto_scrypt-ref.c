@@ -41,6 +41,7 @@
 #include "sysendian.h"
 
 #include "crypto_scrypt.h"
+#include "crypto_scrypt-lanes.h"
 
 static void blkcpy(uint8_t *, uint8_t *, size_t);
 static void blkxor(uint8_t *, uint8_t *, size_t);
@@ -48,6 +49,7 @@ static void salsa20_8(uint8_t[64]);
 static void blockmix_salsa8(uint8_t *, uint8_t *, size_t);
 static uint64_t integerify(uint8_t *, size_t);
 static void smix(uint8_t *, size_t, uint64_t, uint8_t *, uint8_t *);
+static void smix_lane(uint8_t *, size_t, uint64_t, void *, void *);
 
 static void
 blkcpy(uint8_t * dest, uint8_t * src, size_t len)
@@ -207,6 +209,14 @@ smix(uint8_t * B, size_t r, uint64_t N, uint8_t * V, uint8_t * XY)
 	blkcpy(B, X, 128 * r);
 }
 
+/* smix() with the signature crypto_scrypt_smix_lanes() takes. */
+static void
+smix_lane(uint8_t * B, size_t r, uint64_t N, void * V, void * XY)
+{
+
+	smix(B, r, N, V, XY);
+}
+
 /**
  * crypto_scrypt(passwd, passwdlen, salt, saltlen, N, r, p, buf, buflen):
  * Compute scrypt(passwd[0 .. passwdlen - 1], salt[0 .. saltlen - 1], N, r,
@@ -224,7 +234,6 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 	uint8_t * B;
 	uint8_t * V;
 	uint8_t * XY;
-	uint32_t i;
 
 	/* Sanity-check parameters. */
 #if SIZE_MAX > UINT32_MAX
@@ -266,10 +275,8 @@ crypto_scrypt(const uint8_t * passwd, size_t passwdlen,
 #endif
 
 	/* 2: for i = 0 to p - 1 do */
-	for (i = 0; i < p; i++) {
-		/* 3: B_i <-- MF(B_i, N) */
-		smix(&B[i * 128 * r], r, N, V, XY);
-	}
+	/* 3: B_i <-- MF(B_i, N), the lanes run in parallel */
+	crypto_scrypt_smix_lanes(B, r, N, p, smix_lane, V, XY, 256 * r);
 
 	/* 5: DK <-- PBKDF2(P, B, 1, dkLen) */
 #ifdef USE_OPENSSL_PBKDF2
@@ -56,6 +56,29 @@ static const uint8_t post_vectors[][64] = {
          0xe6,0x1e,0x85,0xdc,0x0d,0x65,0x1e,0x40,0xdf,0xcf,0x01,0x7b,0x45,0x57,0x58,0x87},
 };
 
+// Lanes are spread over the CPUs when p > 1. Reference outputs for lane
+// counts that don't divide evenly between threads, from a serial scrypt.
+static const uint32_t lane_counts[] = { 2, 3, 5, 7 };
+
+static const uint8_t lane_vectors[][64] = {
+        {0x6d,0x1a,0x16,0xd3,0x4e,0x55,0x43,0xff,0xa9,0xf6,0x32,0x2d,0xe7,0xfc,0x17,0xa0,
+         0xe1,0xa4,0x1b,0x56,0xe9,0xb1,0xd2,0xa7,0x48,0x03,0xb0,0x67,0xd2,0x4e,0x5f,0x66,
+         0x96,0xb6,0x05,0x30,0x00,0x9e,0xdb,0x8d,0xd0,0xd1,0x2c,0xa5,0xc6,0x0a,0x38,0x3d,
+         0x86,0x3f,0xf0,0x24,0x43,0x7a,0x89,0xfb,0xf2,0x3f,0x1b,0x4c,0x70,0x69,0xba,0xcd},
+        {0x26,0xa6,0x58,0xb5,0x0d,0xb3,0xd6,0x1d,0x6c,0x21,0xd9,0xe9,0xe7,0x08,0x59,0x3d,
+         0x3a,0xb8,0x5b,0xd1,0x34,0xf4,0xc4,0x9a,0x7c,0x73,0xe9,0x82,0x86,0x0c,0xcc,0x18,
+         0xee,0x18,0xb7,0x21,0x3d,0x4d,0x65,0xea,0x00,0xb1,0x67,0x16,0x02,0x79,0x6c,0x51,
+         0xdc,0xa0,0x0e,0x12,0x4f,0x6e,0xbb,0x62,0xcb,0xad,0x38,0x94,0xde,0xee,0x2a,0x5f},
+        {0xd3,0xd1,0xac,0x9a,0xa7,0x4c,0x2f,0x32,0xa9,0x7d,0x99,0x37,0x52,0xec,0xfa,0x44,
+         0xb7,0x97,0xd8,0x74,0xe1,0x08,0x9a,0x4c,0xfc,0xd5,0xc6,0x5e,0x50,0x60,0x32,0x03,
+         0x5e,0x2f,0x52,0xfd,0x20,0xa2,0x4a,0xf5,0x5c,0xeb,0x79,0x16,0x8c,0x1b,0x42,0x18,
+         0x99,0x58,0xee,0xaa,0xbd,0x1c,0x12,0x8d,0x07,0x86,0x64,0x2f,0x71,0xe0,0x51,0x88},
+        {0xf4,0x25,0x72,0x22,0xf3,0x1a,0xc2,0x1a,0x10,0x51,0x1e,0xab,0xa9,0xb2,0xdc,0x4c,
+         0x9d,0x4c,0xb0,0x45,0x8f,0xff,0x41,0xb0,0xfa,0x39,0xa6,0x5f,0x20,0x2c,0x6f,0x48,
+         0x57,0x4a,0x45,0x1e,0xa4,0xf0,0x80,0x2f,0x86,0xa5,0x37,0xeb,0xf0,0xc1,0x56,0x79,
+         0xf4,0x6e,0x82,0x67,0x42,0xec,0xeb,0x9b,0x36,0x3a,0x19,0x42,0xa6,0x35,0xf5,0xa9},
+};
+
 class ScryptTest : public ::testing::Test {
 };
 
@@ -75,4 +98,19 @@ TEST_F(ScryptTest, TestVectors) {
     }
 }
 
+TEST_F(ScryptTest, ParallelLanes) {
+    size_t i;
+
+    for (i = 0; i < sizeof(lane_counts) / sizeof(lane_counts[0]); i++) {
+        uint8_t output[64];
+
+        ASSERT_EQ(0,
+                crypto_scrypt((const uint8_t*) "password", 8, (const uint8_t*) "NaCl", 4,
+                        1024, 8, lane_counts[i], output, sizeof(output)))
+                << "scrypt call should succeed for p=" << lane_counts[i] << "; error=" << strerror(errno);
+        ASSERT_EQ(0, memcmp(lane_vectors[i], output, sizeof(output)))
+                << "Should match serial output for p=" << lane_counts[i];
+    }
+}
+
 }
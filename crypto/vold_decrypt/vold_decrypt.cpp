@@ -24,6 +24,10 @@
 #include <fcntl.h>
 #include <sys/mount.h>
 #include <sys/time.h>
+#include <sys/inotify.h>
+#include <sys/system_properties.h>
+#include <poll.h>
+#include <time.h>
 #include <dirent.h>
 #include <fnmatch.h>
 
@@ -31,6 +35,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <algorithm>
 #include <fstream>
 #include <string>
 #include <vector>
@@ -62,6 +67,9 @@ namespace {
  * when looping for SLEEP_MAX_USEC */
 #define  SLEEP_MIN_USEC      200000  /* 200 msec */
 
+/* Builds without __system_property_wait() poll properties this often */
+#define  SLEEP_POLL_USEC      20000  /* 20 msec */
+
 
 /* vold response codes defined in ResponseCode.h */
 // 200 series - Requested action has been successfully completed
@@ -114,24 +122,17 @@ void Strace_init_Start(void) {
 void Strace_init_Stop(void) {
 	if (pid_strace > 0) {
 		LOGKMSG("Stopping strace_init (pid=%d)\n", pid_strace);
-		int timeout;
 		int status;
-		pid_t retpid = waitpid(pid_strace, &status, WNOHANG);
+		pid_t retpid;
 
 		kill(pid_strace, SIGTERM);
-		for (timeout = 5; retpid == 0 && timeout; --timeout) {
-			sleep(1);
-			retpid = waitpid(pid_strace, &status, WNOHANG);
-		}
+		retpid = TWFunc::Wait_For_Child_Ms(pid_strace, &status, 5000);
 		if (retpid)
 			LOGKMSG("strace_init terminated successfully\n");
 		else {
 			// SIGTERM didn't work, kill it instead
 			kill(pid_strace, SIGKILL);
-			for (timeout = 5; retpid == 0 && timeout; --timeout) {
-				sleep(1);
-				retpid = waitpid(pid_strace, &status, WNOHANG);
-			}
+			retpid = TWFunc::Wait_For_Child_Ms(pid_strace, &status, 5000);
 			if (retpid)
 				LOGKMSG("strace_init killed successfully\n");
 			else
@@ -203,35 +204,89 @@ int vsymlink(const string& oldname, const string& newname, bool verbose = false)
 }
 
 
+/* Timing Functions */
+long long Now_Msec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
 /* Properties and Services Functions */
+
+/* Waits up to utimeout for property_name to change, or to be added when it
+ * does not exist yet. serial is the serial it had when last read. */
+void Wait_For_Property_Change(const prop_info* pi, uint32_t serial, int utimeout) {
+#ifdef TW_HAVE_PROPERTY_WAIT
+	struct timespec ts;
+	ts.tv_sec = utimeout / 1000000;
+	ts.tv_nsec = (utimeout % 1000000) * 1000;
+	uint32_t new_serial;
+	// Without a prop_info this waits on the serial of the whole property area,
+	// which changes when the property is added
+	__system_property_wait(pi, serial, &new_serial, &ts);
+#else
+	(void)pi;
+	(void)serial;
+	usleep(utimeout < SLEEP_POLL_USEC ? utimeout : SLEEP_POLL_USEC);
+#endif
+}
+
 string Wait_For_Property(const string& property_name, int utimeout = SLEEP_MAX_USEC, const string& expected_value = "not_empty") {
 	char prop_value[PROPERTY_VALUE_MAX];
-
-	if (expected_value == "not_empty") {
-		while (utimeout > 0) {
-			property_get(property_name.c_str(), prop_value, "error");
-			if (strcmp(prop_value, "error") != 0)
-				break;
+	long long start = Now_Msec(), deadline = start + utimeout / 1000;
+
+	for (;;) {
+		// Take the serial before reading, so a change in between ends the wait
+		const prop_info* pi = __system_property_find(property_name.c_str());
+		uint32_t serial = pi ? __system_property_serial(pi) : __system_property_area_serial();
+		property_get(property_name.c_str(), prop_value, "error");
+		if (expected_value == "not_empty" ? strcmp(prop_value, "error") != 0 : expected_value == prop_value)
+			break;
+		long long now = Now_Msec();
+		if (now >= deadline)
+			break;
+		if (expected_value == "not_empty")
 			LOGKMSG("waiting for %s to get set\n", property_name.c_str());
-			utimeout -= SLEEP_MIN_USEC;
-			usleep(SLEEP_MIN_USEC);;
-		}
-	}
-	else {
-		while (utimeout > 0) {
-			property_get(property_name.c_str(), prop_value, "error");
-			if (strcmp(prop_value, expected_value.c_str()) == 0)
-				break;
+		else
 			LOGKMSG("waiting for %s to change from '%s' to '%s'\n", property_name.c_str(), prop_value, expected_value.c_str());
-			utimeout -= SLEEP_MIN_USEC;
-			usleep(SLEEP_MIN_USEC);
-		}
+		Wait_For_Property_Change(pi, serial, (int)(deadline - now) * 1000);
 	}
-	property_get(property_name.c_str(), prop_value, "error");
+	LOGKMSG("%s is '%s' after %lld ms\n", property_name.c_str(), prop_value, Now_Msec() - start);
 
 	return prop_value;
 }
 
+/* Waits up to utimeout for path to be created, by watching its folder */
+bool Wait_For_File(const string& path, int utimeout = SLEEP_MAX_USEC) {
+	long long start = Now_Msec(), deadline = start + utimeout / 1000;
+	string dir = TWFunc::Get_Path(path);
+	int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+
+	if (fd >= 0 && inotify_add_watch(fd, dir.c_str(), IN_CREATE | IN_MOVED_TO) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	while (!PATH_EXISTS(path.c_str())) {
+		long long now = Now_Msec();
+		if (now >= deadline)
+			break;
+		if (fd >= 0) {
+			char events[4096];
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			if (poll(&pfd, 1, (int)(deadline - now)) > 0)
+				while (read(fd, events, sizeof(events)) > 0) {}
+		} else {
+			usleep(SLEEP_POLL_USEC);
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+	bool ret = PATH_EXISTS(path.c_str());
+	LOGINFO("%s %s after %lld ms\n", path.c_str(), ret ? "appeared" : "did not appear", Now_Msec() - start);
+	return ret;
+}
+
 string Get_Service_State(const string& initrc_svc) {
 	char prop_value[PROPERTY_VALUE_MAX];
 	string init_svc = "init.svc." + initrc_svc;
@@ -255,11 +310,12 @@ bool Start_Service(const string& initrc_svc, int utimeout = SLEEP_MAX_USEC) {
 	string res = "error";
 	string init_svc = "init.svc." + initrc_svc;
 
+	long long start = Now_Msec();
 	property_set("ctl.start", initrc_svc.c_str());
 
 	res = Wait_For_Property(init_svc, utimeout, "running");
 
-	LOGINFO("Start service %s: %s.\n", initrc_svc.c_str(), res.c_str());
+	LOGINFO("Start service %s: %s (%lld ms).\n", initrc_svc.c_str(), res.c_str(), Now_Msec() - start);
 
 	return (res == "running");
 }
@@ -269,9 +325,10 @@ bool Stop_Service(const string& initrc_svc, int utimeout = SLEEP_MAX_USEC) {
 
 	if (Service_Exists(initrc_svc)) {
 		string init_svc = "init.svc." + initrc_svc;
+		long long start = Now_Msec();
 		property_set("ctl.stop", initrc_svc.c_str());
 		res = Wait_For_Property(init_svc, utimeout, "stopped");
-		LOGINFO("Stop service %s: %s.\n", initrc_svc.c_str(), res.c_str());
+		LOGINFO("Stop service %s: %s (%lld ms).\n", initrc_svc.c_str(), res.c_str(), Now_Msec() - start);
 	}
 
 	return (res == "stopped");
@@ -917,7 +974,7 @@ int Exec_vdc_cryptfs(const string& command, const string& argument, vdc_ReturnVa
 
 		default:
 		{
-			int timeout = 30*100;
+			int timeout = 30*1000;
 
 			for (int i = 0; i < 2; ++i) {
 				close(pipe_fd[i][1]);
@@ -927,32 +984,78 @@ int Exec_vdc_cryptfs(const string& command, const string& argument, vdc_ReturnVa
 				fcntl(pipe_fd[i][0], F_SETFL, flags | O_NONBLOCK);
 			}
 
+			// Sleeps until vdc prints something or exits, instead of
+			// looking every 10ms. Without a pidfd the output pipes
+			// closing on exit wake it up, with a 100ms cap in case vdc
+			// left a child holding them
 			char buffer[128];
 			ssize_t count;
 			string strout[2];
-			pid_t retpid = waitpid(pid, &status, WNOHANG);
+			struct timespec start, now;
+			int pidfd = TWFunc::Pidfd_Open(pid);
+			pid_t retpid;
+			clock_gettime(CLOCK_MONOTONIC, &start);
 			while (true) {
+				struct pollfd fds[3];
+				int nfds = 0;
 				for (int i = 0; i < 2; ++i) {
-					count = read(pipe_fd[i][0], buffer, sizeof(buffer));
-					if (count == -1) {
-						if (errno == EINTR)
+					if (pipe_fd[i][0] < 0)
+						continue;
+					fds[nfds].fd = pipe_fd[i][0];
+					fds[nfds].events = POLLIN;
+					fds[nfds].revents = 0;
+					nfds++;
+				}
+				if (pidfd >= 0) {
+					fds[nfds].fd = pidfd;
+					fds[nfds].events = POLLIN;
+					fds[nfds].revents = 0;
+					nfds++;
+				}
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				int left = timeout - TWFunc::timespec_diff_ms(start, now);
+				if (pidfd < 0)
+					left = std::min(left, 100);
+				if (left > 0 && nfds > 0)
+					poll(fds, nfds, left);
+				else if (left > 0)
+					usleep(std::min(left, 10) * 1000);
+
+				for (int i = 0; i < 2; ++i) {
+					while (pipe_fd[i][0] >= 0) {
+						count = read(pipe_fd[i][0], buffer, sizeof(buffer));
+						if (count > 0) {
+							strout[i].append(buffer, count);
+							continue;
+						}
+						if (count == -1 && errno == EINTR)
 							continue;
-						else if (errno != EAGAIN)
+						if (count == -1 && errno != EAGAIN)
 							LOGERROR("exec_vdc_cryptfs: read() error %d (%s)\n!", errno, strerror(errno));
-					} else if (count > 0) {
-						strout[i].append(buffer, count);
+						if (count == 0) {
+							// vdc closed it, most likely by exiting
+							close(pipe_fd[i][0]);
+							pipe_fd[i][0] = -1;
+						}
+						break;
 					}
 				}
 
 				retpid = waitpid(pid, &status, WNOHANG);
-				if (retpid == 0 && --timeout)
-					usleep(10000);
-				else
+				if (retpid != 0)
 					break;
+				clock_gettime(CLOCK_MONOTONIC, &now);
+				if (TWFunc::timespec_diff_ms(start, now) >= timeout) {
+					timeout = 0;
+					break;
+				}
 			};
+			if (pidfd >= 0)
+				close(pidfd);
 
 			for (int i = 0; i < 2; ++i) {
-				close(pipe_fd[i][0]);
+				if (pipe_fd[i][0] >= 0)
+					close(pipe_fd[i][0]);
 			}
 
 			if (!strout[0].empty()) {
@@ -972,10 +1075,7 @@ int Exec_vdc_cryptfs(const string& command, const string& argument, vdc_ReturnVa
 			if (retpid == 0 && timeout == 0) {
 				LOGERROR("exec_vdc_cryptfs: took too long, killing process\n");
 				kill(pid, SIGKILL);
-				for (timeout = 5; retpid == 0 && timeout; --timeout) {
-					sleep(1);
-					retpid = waitpid(pid, &status, WNOHANG);
-				}
+				retpid = TWFunc::Wait_For_Child_Ms(pid, &status, 5000);
 				if (retpid)
 					LOGINFO("exec_vdc_cryptfs: process killed successfully\n");
 				else
@@ -1011,6 +1111,9 @@ int Run_vdc(const string& Password) {
 
 	// Pie vdc communicates with vold directly, no socket so lets not waste time
 	if (sdkver < 28) {
+		// vold accepts connections once it has created its socket
+		Wait_For_File("/dev/socket/vold", 5000000);
+
 		// Wait for vold connection
 		gettimeofday(&t1, NULL);
 		t2 = t1;
@@ -1022,7 +1125,7 @@ int Run_vdc(const string& Password) {
 				break;
 			}
 			LOGINFO("Retrying connection to vold (Reason: %s)\n", vdcResult.Output.c_str());
-			usleep(SLEEP_MIN_USEC); // vdc usually usleep(10000), but that causes too many unnecessary attempts
+			usleep(SLEEP_POLL_USEC); // the socket exists, so vold is only moments away
 			gettimeofday(&t2, NULL);
 		}
 
@@ -1127,6 +1230,7 @@ int Vold_Decrypt_Core(const string& Password) {
 #endif
 
 	fp_kmsg = fopen("/dev/kmsg", "a");
+	long long start = Now_Msec();
 
 	LOGINFO("TW_CRYPTO_USE_SYSTEM_VOLD := true\n");
 
@@ -1163,7 +1267,7 @@ int Vold_Decrypt_Core(const string& Password) {
 	Set_Needed_Properties();
 
 	// Start services needed for vold decrypt
-	LOGINFO("Starting services...\n");
+	LOGINFO("Starting services (%lld ms in)...\n", Now_Msec() - start);
 #ifdef TW_CRYPTO_SYSTEM_VOLD_SERVICES
 	for (size_t i = 0; i < Services.size(); ++i) {
 		if (Services[i].bin_exists) {
@@ -1227,7 +1331,7 @@ int Vold_Decrypt_Core(const string& Password) {
 	}
 
 	// Stop services needed for vold decrypt so /system can be unmounted
-	LOGINFO("Stopping services...\n");
+	LOGINFO("Stopping services (%lld ms in)...\n", Now_Msec() - start);
 	Stop_Service("sys_vold");
 #ifdef TW_CRYPTO_SYSTEM_VOLD_SERVICES
 	for (size_t i = 0; i < Services.size(); ++i) {
@@ -1264,7 +1368,7 @@ int Vold_Decrypt_Core(const string& Password) {
 	}
 #endif
 
-	LOGINFO("Finished.\n");
+	LOGINFO("Finished in %lld ms.\n", Now_Msec() - start);
 
 #ifdef TW_CRYPTO_SYSTEM_VOLD_SERVICES
 	Set_Needed_Properties();
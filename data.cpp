@@ -17,6 +17,7 @@
 */
 
 #include <pthread.h>
+#include <string.h>
 #include <time.h>
 #include <string>
 #include <sstream>
@@ -66,6 +67,52 @@ pthread_mutex_t DataManager::m_valuesLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
 pthread_mutex_t DataManager::m_valuesLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
 #endif
 
+// Seconds a changed setting has to stay unchanged before it is written, and
+// how long to wait before trying again when the storage can't be written
+#define SAVE_QUIET_SECS 2
+#define SAVE_RETRY_SECS 10
+
+pthread_once_t DataManager::mSaverOnce = PTHREAD_ONCE_INIT;
+pthread_mutex_t DataManager::mSaverLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t DataManager::mSaverCond;
+bool DataManager::mDirty = false;
+time_t DataManager::mDirtyTime = 0;
+pthread_mutex_t DataManager::mSaveLock = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t MonotonicSeconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+// Values up to this long are kept in the snapshot of an interned variable
+#define DATA_SNAPSHOT_SIZE 96
+
+enum InternedVarKind {
+	VAR_STORED,
+	VAR_MAGIC,
+	VAR_PROPERTY
+};
+
+// The snapshot is written under m_valuesLock and read without it: seq is odd
+// while it is being written, and readers retry under the lock if seq changed
+// while they copied it or the snapshot is from an older generation.
+struct DataManager::InternedVar {
+	string name;
+	InternedVarKind kind;
+	std::atomic<unsigned> seq;
+	unsigned generation;
+	bool found;
+	bool fits;
+	char value[DATA_SNAPSHOT_SIZE];
+};
+
+DataManager::InternedVar*               DataManager::mVars[DATA_MAX_VARS];
+std::atomic<int>                        DataManager::mVarCount(0);
+map<string, VarID>                      DataManager::mVarIDs;
+std::atomic<unsigned>                   DataManager::mGeneration(1);
+
 // Device ID functions
 void DataManager::sanitize_device_id(char* device_id) {
 	const char* whitelist ="-._";
@@ -232,6 +279,7 @@ int DataManager::ResetDefaults()
 	mPersist.Clear();
 	mData.Clear();
 	mConst.Clear();
+	InvalidateSnapshots();
 	pthread_mutex_unlock(&m_valuesLock);
 
 	SetDefaultValues();
@@ -254,6 +302,7 @@ int DataManager::LoadValues(const string& filename)
 	// Read in the file, if possible
 	pthread_mutex_lock(&m_valuesLock);
 	mPersist.LoadValues();
+	InvalidateSnapshots();
 
 #ifndef TW_NO_SCREEN_TIMEOUT
 	blankTimer.setTime(mPersist.GetIntValue("tw_screen_timeout_secs"));
@@ -294,6 +343,7 @@ int DataManager::LoadPersistValues(void)
 	// Read in the file, if possible
 	pthread_mutex_lock(&m_valuesLock);
 	mPersist.LoadValues();
+	InvalidateSnapshots();
 
 #ifndef TW_NO_SCREEN_TIMEOUT
 	blankTimer.setTime(mPersist.GetIntValue("tw_screen_timeout_secs"));
@@ -319,6 +369,11 @@ int DataManager::Flush()
 int DataManager::SaveValues()
 {
 #ifndef TW_OEM_BUILD
+	pthread_mutex_lock(&mSaveLock);
+	pthread_mutex_lock(&mSaverLock);
+	mDirty = false;
+	pthread_mutex_unlock(&mSaverLock);
+
 	if (PartitionManager.Mount_By_Path("/persist", false)) {
 		mPersist.SetFile(PERSIST_SETTINGS_FILE);
 		mPersist.SetFileVersion(FILE_VERSION);
@@ -328,8 +383,10 @@ int DataManager::SaveValues()
 		LOGINFO("Saved settings file values to %s\n", PERSIST_SETTINGS_FILE);
 	}
 
-	if (mBackingFile.empty())
+	if (mBackingFile.empty()) {
+		pthread_mutex_unlock(&mSaveLock);
 		return -1;
+	}
 
 	string mount_path = GetSettingsStoragePath();
 	PartitionManager.Mount_By_Path(mount_path.c_str(), 1);
@@ -342,25 +399,121 @@ int DataManager::SaveValues()
 
 	tw_set_default_metadata(mBackingFile.c_str());
 	LOGINFO("Saved settings file values to '%s'\n", mBackingFile.c_str());
+	pthread_mutex_unlock(&mSaveLock);
 #endif // ifdef TW_OEM_BUILD
 	return 0;
 }
 
+void DataManager::MarkDirty()
+{
+#ifndef TW_OEM_BUILD
+	pthread_once(&mSaverOnce, StartSaver);
+	pthread_mutex_lock(&mSaverLock);
+	mDirty = true;
+	mDirtyTime = MonotonicSeconds();
+	pthread_cond_signal(&mSaverCond);
+	pthread_mutex_unlock(&mSaverLock);
+#endif
+}
+
+void DataManager::StartSaver()
+{
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&mSaverCond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, SaverThread, NULL) == 0)
+		pthread_detach(thread);
+	else
+		LOGINFO("Unable to start the settings saver, settings are saved at reboot\n");
+}
+
+void* DataManager::SaverThread(void* cookie __unused)
+{
+	pthread_mutex_lock(&mSaverLock);
+	for (;;) {
+		while (!mDirty)
+			pthread_cond_wait(&mSaverCond, &mSaverLock);
+
+		// Every change moves the deadline, so a slider being dragged or a
+		// page of checkboxes being ticked ends up as one write
+		struct timespec deadline;
+		deadline.tv_sec = mDirtyTime + SAVE_QUIET_SECS;
+		deadline.tv_nsec = 0;
+		if (MonotonicSeconds() < deadline.tv_sec) {
+			pthread_cond_timedwait(&mSaverCond, &mSaverLock, &deadline);
+			continue;
+		}
+
+		mDirty = false;
+		pthread_mutex_unlock(&mSaverLock);
+		bool saved = SaveInBackground();
+		pthread_mutex_lock(&mSaverLock);
+		if (!saved && !mDirty) {
+			mDirty = true;
+			mDirtyTime = MonotonicSeconds() + SAVE_RETRY_SECS - SAVE_QUIET_SECS;
+		}
+	}
+	return NULL;
+}
+
+// Writes the settings files without mounting anything; an action may be
+// using the partitions, and the values are written at reboot in any case
+bool DataManager::SaveInBackground()
+{
+	if (GetIntValue(TW_ACTION_BUSY) != 0)
+		return false;
+
+	pthread_mutex_lock(&mSaveLock);
+	pthread_mutex_lock(&m_valuesLock);
+	string data = mPersist.SerializeValues();
+	string backing_file = mBackingFile;
+	pthread_mutex_unlock(&m_valuesLock);
+
+	bool saved = true;
+	if (PartitionManager.Is_Mounted_By_Path("/persist"))
+		InfoManager::WriteValues(PERSIST_SETTINGS_FILE, data);
+	if (!backing_file.empty()) {
+		if (PartitionManager.Is_Mounted_By_Path(GetSettingsStoragePath()))
+			saved = InfoManager::WriteValues(backing_file, data) == 0;
+		else
+			saved = false;
+		if (saved)
+			LOGINFO("Saved settings file values to '%s'\n", backing_file.c_str());
+	}
+	pthread_mutex_unlock(&mSaveLock);
+	return saved;
+}
+
+string DataManager::StripPercent(const string& varName)
+{
+	// Strip off leading and trailing '%' if provided
+	if (varName.length() > 2 && varName[0] == '%' && varName[varName.length()-1] == '%')
+		return varName.substr(1, varName.length() - 2);
+	return varName;
+}
+
+// Caller holds m_valuesLock
+int DataManager::GetStoredValue(const string& varName, string& value)
+{
+	if (mConst.GetValue(varName, value) == 0)
+		return 0;
+	if (mPersist.GetValue(varName, value) == 0)
+		return 0;
+	return mData.GetValue(varName, value);
+}
+
 int DataManager::GetValue(const string& varName, string& value)
 {
-	string localStr = varName;
+	string localStr = StripPercent(varName);
 	int ret = 0;
 
 	if (!mInitialized)
 		SetDefaultValues();
 
-	// Strip off leading and trailing '%' if provided
-	if (localStr.length() > 2 && localStr[0] == '%' && localStr[localStr.length()-1] == '%')
-	{
-		localStr.erase(0, 1);
-		localStr.erase(localStr.length() - 1, 1);
-	}
-
 	// Handle magic values
 	if (GetMagicValue(localStr, value) == 0)
 		return 0;
@@ -374,16 +527,7 @@ int DataManager::GetValue(const string& varName, string& value)
 	}
 
 	pthread_mutex_lock(&m_valuesLock);
-	ret = mConst.GetValue(localStr, value);
-	if (ret == 0)
-		goto exit;
-
-	ret = mPersist.GetValue(localStr, value);
-	if (ret == 0)
-		goto exit;
-
-	ret = mData.GetValue(localStr, value);
-exit:
+	ret = GetStoredValue(localStr, value);
 	pthread_mutex_unlock(&m_valuesLock);
 	return ret;
 }
@@ -439,6 +583,149 @@ int DataManager::GetIntValue(const string& varName)
 	return atoi(retVal.c_str());
 }
 
+VarID DataManager::GetVarID(const string& varName)
+{
+	string localStr = StripPercent(varName);
+	if (localStr.empty())
+		return INVALID_VAR_ID;
+
+	if (!mInitialized)
+		SetDefaultValues();
+
+	pthread_mutex_lock(&m_valuesLock);
+	map<string, VarID>::iterator pos = mVarIDs.find(localStr);
+	if (pos != mVarIDs.end()) {
+		VarID id = pos->second;
+		pthread_mutex_unlock(&m_valuesLock);
+		return id;
+	}
+
+	int count = mVarCount.load(std::memory_order_relaxed);
+	if (count >= DATA_MAX_VARS) {
+		pthread_mutex_unlock(&m_valuesLock);
+		LOGERR("Too many variables, unable to add '%s'\n", localStr.c_str());
+		return INVALID_VAR_ID;
+	}
+
+	InternedVar* var = new InternedVar;
+	var->name = localStr;
+	if (localStr == "tw_time" || localStr == "tw_cpu_temp" || localStr == "tw_battery")
+		var->kind = VAR_MAGIC;
+	else if (localStr.length() > 9 && localStr.compare(0, 9, "property.") == 0)
+		var->kind = VAR_PROPERTY;
+	else
+		var->kind = VAR_STORED;
+	var->seq.store(0, std::memory_order_relaxed);
+	string value;
+	StoreSnapshot(var, GetStoredValue(localStr, value) == 0, value);
+
+	mVars[count] = var;
+	mVarIDs[localStr] = count;
+	mVarCount.store(count + 1, std::memory_order_release);
+	pthread_mutex_unlock(&m_valuesLock);
+	return count;
+}
+
+// Caller holds m_valuesLock
+void DataManager::StoreSnapshot(InternedVar* var, bool found, const string& value)
+{
+	unsigned seq = var->seq.load(std::memory_order_relaxed);
+	var->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	var->generation = mGeneration.load(std::memory_order_relaxed);
+	var->found = found;
+	var->fits = value.size() < sizeof(var->value);
+	if (var->fits)
+		memcpy(var->value, value.c_str(), value.size() + 1);
+	var->seq.store(seq + 2, std::memory_order_release);
+}
+
+// Caller holds m_valuesLock; snapshots are taken again on their next read
+void DataManager::InvalidateSnapshots()
+{
+	mGeneration.fetch_add(1, std::memory_order_release);
+}
+
+int DataManager::GetValue(VarID var, string& value)
+{
+	if (var < 0 || var >= mVarCount.load(std::memory_order_acquire))
+		return -1;
+	InternedVar* iv = mVars[var];
+
+	if (iv->kind == VAR_MAGIC && GetMagicValue(iv->name, value) == 0)
+		return 0;
+
+	if (iv->kind == VAR_PROPERTY) {
+		char property_value[PROPERTY_VALUE_MAX];
+		property_get(iv->name.c_str() + 9, property_value, "");
+		value = property_value;
+		return 0;
+	}
+
+	unsigned seq = iv->seq.load(std::memory_order_acquire);
+	if (!(seq & 1)) {
+		char copy[DATA_SNAPSHOT_SIZE];
+		unsigned generation = iv->generation;
+		bool found = iv->found;
+		bool fits = iv->fits;
+		if (fits)
+			memcpy(copy, iv->value, sizeof(copy));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (fits && iv->seq.load(std::memory_order_relaxed) == seq && generation == mGeneration.load(std::memory_order_acquire)) {
+			if (!found)
+				return -1;
+			copy[sizeof(copy) - 1] = '\0';
+			value = copy;
+			return 0;
+		}
+	}
+
+	// Written meanwhile, too long for the snapshot, or reloaded since
+	pthread_mutex_lock(&m_valuesLock);
+	int ret = GetStoredValue(iv->name, value);
+	StoreSnapshot(iv, ret == 0, value);
+	pthread_mutex_unlock(&m_valuesLock);
+	return ret;
+}
+
+uint64_t DataManager::GetVersion(VarID var)
+{
+	if (var < 0 || var >= mVarCount.load(std::memory_order_acquire))
+		return 0;
+	InternedVar* iv = mVars[var];
+	if (iv->kind != VAR_STORED)
+		return 0;
+	uint64_t generation = mGeneration.load(std::memory_order_acquire);
+	return (generation << 32) | iv->seq.load(std::memory_order_acquire);
+}
+
+int DataManager::GetValue(VarID var, int& value)
+{
+	string data;
+
+	if (GetValue(var, data) != 0)
+		return -1;
+
+	value = atoi(data.c_str());
+	return 0;
+}
+
+string DataManager::GetStrValue(VarID var)
+{
+	string retVal;
+
+	GetValue(var, retVal);
+	return retVal;
+}
+
+int DataManager::GetIntValue(VarID var)
+{
+	string retVal;
+
+	GetValue(var, retVal);
+	return atoi(retVal.c_str());
+}
+
 int DataManager::SetValue(const string& varName, const string& value, const int persist /* = 0 */)
 {
 	if (!mInitialized)
@@ -464,19 +751,24 @@ int DataManager::SetValue(const string& varName, const string& value, const int
 		return -1;
 	}
 
-	if (persist) {
+	bool changed = false;
+	int persistChk = mPersist.GetValue(varName, test);
+	if (persist || persistChk == 0) {
+		changed = persistChk != 0 || test != value;
 		mPersist.SetValue(varName, value);
 	} else {
-		int persistChk = mPersist.GetValue(varName, test);
-		if (persistChk == 0) {
-			mPersist.SetValue(varName, value);
-		} else {
-			mData.SetValue(varName, value);
-		}
+		mData.SetValue(varName, value);
 	}
 
+	map<string, VarID>::iterator pos = mVarIDs.find(varName);
+	if (pos != mVarIDs.end())
+		StoreSnapshot(mVars[pos->second], true, value);
+
 	pthread_mutex_unlock(&m_valuesLock);
 
+	if (changed && mInitialized)
+		MarkDirty();
+
 #ifndef TW_NO_SCREEN_TIMEOUT
 	if (varName == "tw_screen_timeout_secs") {
 		blankTimer.setTime(atoi(value.c_str()));
@@ -750,10 +1042,31 @@ void DataManager::SetDefaultValues()
 	mPersist.SetValue(TW_DISABLE_FREE_SPACE_VAR, "0");
 	mPersist.SetValue(TW_FORCE_DIGEST_CHECK_VAR, "0");
 	mPersist.SetValue(TW_USE_COMPRESSION_VAR, "0");
+	mPersist.SetValue(TW_COMPRESSION_TYPE_VAR, "gzip");
+	mPersist.SetValue(TW_ZSTD_LEVEL_VAR, "3");
+	mData.SetValue(TW_ADB_COMPRESSION_VAR, "0");
+	mPersist.SetValue(TW_BACKUP_THREADS_VAR, "0");
+	mPersist.SetValue(TW_INCREMENTAL_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_DEDUP_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_SPARSE_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_COMPRESS_IMAGES_VAR, "0");
+	mPersist.SetValue(TW_BACKUP_INDEX_VAR, "1");
+	mPersist.SetValue(TW_BACKUP_AUTO_TUNE_VAR, "1");
+	mPersist.SetValue(TW_ENCRYPT_LEGACY_VAR, "0");
+	mPersist.SetValue(TW_RAW_DIRECT_IO_VAR, "0");
+	mPersist.SetValue(TW_BACKUP_IO_STREAMS_VAR, "2");
+	mPersist.SetValue(TW_BACKUP_READ_ORDER_VAR, "1");
+	mPersist.SetValue(TW_LOG_FILE_MESSAGES_VAR, "1");
 	mPersist.SetValue(TW_TIME_ZONE_VAR, "CST6CDT,M3.2.0,M11.1.0");
 	mPersist.SetValue(TW_GUI_SORT_ORDER, "1");
 	mPersist.SetValue(TW_RM_RF_VAR, "0");
+	mPersist.SetValue(TW_WIPE_DISCARD_VAR, "1");
+	mPersist.SetValue(TW_WIPE_SECURE_DISCARD_VAR, "0");
 	mPersist.SetValue(TW_SKIP_DIGEST_CHECK_VAR, "0");
+	mPersist.SetValue(TW_DIGEST_THREADS_VAR, "0");
+	mPersist.SetValue(TW_DIGEST_RATE_VAR, "0");
+	mPersist.SetValue(TW_DIGEST_ON_EXTRACT_VAR, "0");
+	mPersist.SetValue(TW_DIGEST_TREE_VAR, "0");
 	mPersist.SetValue(TW_SKIP_DIGEST_GENERATE_VAR, "0");
 	mPersist.SetValue(TW_SDEXT_SIZE, "0");
 	mPersist.SetValue(TW_SWAP_SIZE, "0");
@@ -772,6 +1085,7 @@ void DataManager::SetDefaultValues()
 	mData.SetValue(TW_IS_ENCRYPTED, "0");
 	mData.SetValue(TW_IS_DECRYPTED, "0");
 	mData.SetValue(TW_CRYPTO_PASSWORD, "0");
+	mData.SetValue(TW_CRYPTO_HAL_TRACE, "0");
 	mData.SetValue("tw_terminal_state", "0");
 	mData.SetValue("tw_background_thread_running", "0");
 	mData.SetValue(TW_RESTORE_FILE_DATE, "0");
@@ -792,6 +1106,7 @@ void DataManager::SetDefaultValues()
 	mPersist.SetValue("tw_no_screen_timeout", "0");
 #endif
 	mData.SetValue("tw_gui_done", "0");
+	mData.SetValue("tw_gui_profile", "0");
 	mData.SetValue("tw_encrypt_backup", "0");
 	mData.SetValue("tw_sleep_total", "5");
 	mData.SetValue("tw_sleep", "5");
@@ -879,6 +1194,16 @@ void DataManager::SetDefaultValues()
 	LOGINFO("TW_EXCLUDE_ENCRYPTED_BACKUPS := true\n");
 	mConst.SetValue("tw_include_encrypted_backup", "0");
 #endif
+#ifdef TW_INCLUDE_ZSTD
+	mConst.SetValue("tw_has_zstd", "1");
+#else
+	mConst.SetValue("tw_has_zstd", "0");
+#endif
+#ifdef TW_INCLUDE_LZ4
+	mConst.SetValue("tw_has_lz4", "1");
+#else
+	mConst.SetValue("tw_has_lz4", "0");
+#endif
 #ifdef TW_HAS_MTP
 	mConst.SetValue("tw_has_mtp", "1");
 	mPersist.SetValue("tw_mtp_enabled", "1");
@@ -918,6 +1243,7 @@ void DataManager::SetDefaultValues()
 
         mData.SetValue("tw_enable_adb_backup", "0");
 
+	InvalidateSnapshots();
 	pthread_mutex_unlock(&m_valuesLock);
 }
 
@@ -931,10 +1257,11 @@ int DataManager::GetMagicValue(const string& varName, string& value)
 
 		struct tm *current;
 		time_t now;
-		int tw_military_time;
+		int tw_military_time = 0;
+		static VarID military_time_var = GetVarID(TW_MILITARY_TIME);
 		now = time(0);
 		current = localtime(&now);
-		GetValue(TW_MILITARY_TIME, tw_military_time);
+		GetValue(military_time_var, tw_military_time);
 		if (current->tm_hour >= 12)
 		{
 			if (tw_military_time == 1)
@@ -20,13 +20,23 @@
 #define _DATAMANAGER_HPP_HEADER
 
 #include <string>
+#include <map>
+#include <atomic>
+#include <stdint.h>
 #include <pthread.h>
 #include "infomanager.hpp"
 
 #define PERSIST_SETTINGS_FILE  "/persist/.twrps"
 
+// Most variables that can be interned
+#define DATA_MAX_VARS 8192
+
 using namespace std;
 
+// A variable name looked up once, to be read often by number
+typedef int VarID;
+#define INVALID_VAR_ID -1
+
 class DataManager
 {
 public:
@@ -45,6 +55,18 @@ public:
 	static string GetStrValue(const string& varName);
 	static int GetIntValue(const string& varName);
 
+	// Interned variables, for the GUI to resolve its names at load time and
+	// read them every frame. Short values are read from a snapshot without
+	// taking the lock; the name based routines above do the full lookup.
+	static VarID GetVarID(const string& varName);
+	static int GetValue(VarID var, string& value);
+	static int GetValue(VarID var, int& value);
+	static string GetStrValue(VarID var);
+	static int GetIntValue(VarID var);
+	// Changes whenever the value may have; 0 if that can't be known, as for
+	// the clock, the battery and properties
+	static uint64_t GetVersion(VarID var);
+
 	// Core set routines
 	static int SetValue(const string& varName, const string& value, const int persist = 0);
 	static int SetValue(const string& varName, const int value, const int persist = 0);
@@ -79,10 +101,35 @@ protected:
 	static int GetMagicValue(const string& varName, string& value);
 
 private:
+	struct InternedVar;
+
 	static void sanitize_device_id(char* device_id);
 	static void get_device_id(void);
+	static string StripPercent(const string& varName);
+	static int GetStoredValue(const string& varName, string& value);
+	static void StoreSnapshot(InternedVar* var, bool found, const string& value);
+	static void InvalidateSnapshots();
 
 	static pthread_mutex_t m_valuesLock;
+
+	// Settings changed from the GUI are written by a background thread once
+	// they have stopped changing for a moment
+	static void MarkDirty();
+	static void StartSaver();
+	static void* SaverThread(void* cookie);
+	static bool SaveInBackground();
+
+	static pthread_once_t mSaverOnce;
+	static pthread_mutex_t mSaverLock; // protects mDirty and mDirtyTime
+	static pthread_cond_t mSaverCond;
+	static bool mDirty;
+	static time_t mDirtyTime;
+	static pthread_mutex_t mSaveLock; // held while the settings files are written
+
+	static InternedVar* mVars[DATA_MAX_VARS];
+	static std::atomic<int> mVarCount;
+	static map<string, VarID> mVarIDs; // protected by m_valuesLock
+	static std::atomic<unsigned> mGeneration; // changes when many values change at once
 };
 
 #endif // _DATAMANAGER_HPP_HEADER
@@ -121,7 +121,7 @@ loff_t alloc_rootdir_entry(DOS_FS * fs, DIR_ENT * de, const char *pattern)
 		die("Root directory full and no free cluster");
 	    set_fat(fs, prev, clu_num);
 	    set_fat(fs, clu_num, -1);
-	    set_owner(fs, clu_num, get_owner(fs, fs->root_cluster));
+	    set_owned(fs, clu_num, is_owned(fs, fs->root_cluster));
 	    /* clear new cluster */
 	    memset(&d2, 0, sizeof(d2));
 	    offset = cluster_start(fs, clu_num);
@@ -361,7 +361,8 @@ static void drop_file(DOS_FS * fs, DOS_FILE * file)
 	lfn_remove(file->lfn_offset, file->offset);
     for (cluster = FSTART(file, fs); cluster > 0 && cluster <
 	 fs->clusters + 2; cluster = next_cluster(fs, cluster))
-	set_owner(fs, cluster, NULL);
+	set_owned(fs, cluster, 0);
+    file->claimed = 0;
     --n_files;
 }
 
@@ -505,6 +506,40 @@ static int handle_dot(DOS_FS * fs, DOS_FILE * file, int dots)
     return 0;
 }
 
+/**
+ * Find the dentry that owns a cluster. Only a bit per cluster is kept, so
+ * this walks the chains of the files that claimed theirs. That is slow, but
+ * it is only needed when clusters turn out to be shared.
+ *
+ * @param[in]       fs          Information about the filesystem
+ * @param[in]       start       First dentry of the directory to search
+ * @param[in]       cluster     Cluster of interest
+ *
+ * @return  NULL    No file in the tree claims the cluster
+ * @return  Other   The owner
+ */
+static DOS_FILE *find_owner(DOS_FS * fs, DOS_FILE * start, uint32_t cluster)
+{
+    DOS_FILE *walk, *owner;
+    uint32_t curr, steps;
+
+    for (walk = start; walk; walk = walk->next) {
+	if (walk->claimed) {
+	    steps = 0;
+	    for (curr = FSTART(walk, fs); curr > 1 && curr < fs->clusters + 2 &&
+		 steps++ < fs->clusters; curr = next_cluster(fs, curr)) {
+		if (curr == cluster)
+		    return walk;
+		if (bad_cluster(fs, curr))
+		    break;
+	    }
+	}
+	if (walk->first && (owner = find_owner(fs, walk->first, cluster)))
+	    return owner;
+    }
+    return NULL;
+}
+
 static int check_file(DOS_FS * fs, DOS_FILE * file)
 {
     DOS_FILE *owner;
@@ -566,6 +601,7 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 	MODIFY_START(file, 0, fs);
     }
     clusters = prev = 0;
+    file->claimed = 1;
     for (curr = FSTART(file, fs) ? FSTART(file, fs) :
 	 -1; curr != -1; curr = next_cluster(fs, curr)) {
 	FAT_ENTRY curEntry;
@@ -593,8 +629,11 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 	    truncate_file(fs, file, clusters);
 	    break;
 	}
-	if ((owner = get_owner(fs, curr))) {
+	if (is_owned(fs, curr)) {
 	    int do_trunc = 0;
+	    if (!(owner = find_owner(fs, root, curr)))
+		die("Internal error: no owner for cluster %lu",
+		    (unsigned long)curr);
 	    printf("%s  and\n", path_name(owner));
 	    printf("%s\n  share clusters.\n", path_name(file));
 	    clusters2 = 0;
@@ -642,7 +681,7 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 			if (restart)
 			    return 1;
 			while (this > 0 && this != -1) {
-			    set_owner(fs, this, NULL);
+			    set_owned(fs, this, 0);
 			    this = next_cluster(fs, this);
 			}
 			this = curr;
@@ -662,7 +701,7 @@ static int check_file(DOS_FS * fs, DOS_FILE * file)
 		break;
 	    }
 	}
-	set_owner(fs, curr, file);
+	set_owned(fs, curr, 1);
 	clusters++;
 	prev = curr;
     }
@@ -685,6 +724,7 @@ static int check_files(DOS_FS * fs, DOS_FILE * start)
     while (start) {
 	if (check_file(fs, start))
 	    return 1;
+	report_progress(2, fs->owned_clusters, fs->used_clusters);
 	start = start->next;
     }
     return 0;
@@ -844,20 +884,22 @@ static int check_dir(DOS_FS * fs, DOS_FILE ** root, int dots)
  */
 static void test_file(DOS_FS * fs, DOS_FILE * file, int read_test)
 {
-    DOS_FILE *owner;
-    uint32_t walk, prev, clusters, next_clu;
+    uint32_t walk, prev, clusters, next_clu, marked, i;
 
-    prev = clusters = 0;
+    prev = clusters = marked = 0;
     for (walk = FSTART(file, fs); walk > 1 && walk < fs->clusters + 2;
 	 walk = next_clu) {
 	next_clu = next_cluster(fs, walk);
 
 	/* In this stage we are checking only for a loop within our own
-	 * cluster chain.
+	 * cluster chain, which are the first 'marked' clusters of it.
 	 * Cross-linking of clusters is handled in check_file()
 	 */
-	if ((owner = get_owner(fs, walk))) {
-	    if (owner == file) {
+	if (is_owned(fs, walk)) {
+	    uint32_t own = FSTART(file, fs);
+	    for (i = 0; i < marked && own != walk; i++)
+		own = next_cluster(fs, own);
+	    if (i < marked) {
 		printf("%s\n  Circular cluster chain. Truncating to %lu "
 		       "cluster%s.\n", path_name(file), (unsigned long)clusters,
 		       clusters == 1 ? "" : "s");
@@ -884,19 +926,20 @@ static void test_file(DOS_FS * fs, DOS_FILE * file, int read_test)
 		else
 		    MODIFY_START(file, next_cluster(fs, walk), fs);
 		set_fat(fs, walk, -2);
+		/* Not part of the chain any more, so not ours to revert */
+		continue;
 	    }
 	}
-	set_owner(fs, walk, file);
+	set_owned(fs, walk, 1);
+	marked++;
     }
     /* Revert ownership (for now) */
-    for (walk = FSTART(file, fs); walk > 1 && walk < fs->clusters + 2;
-	 walk = next_cluster(fs, walk))
+    for (walk = FSTART(file, fs); marked && walk > 1 &&
+	 walk < fs->clusters + 2; walk = next_cluster(fs, walk), marked--)
 	if (bad_cluster(fs, walk))
 	    break;
-	else if (get_owner(fs, walk) == file)
-	    set_owner(fs, walk, NULL);
 	else
-	    break;
+	    set_owned(fs, walk, 0);
 }
 
 static void undelete(DOS_FS * fs, DOS_FILE * file)
@@ -988,6 +1031,7 @@ static void add_file(DOS_FS * fs, DOS_FILE *** chain, DOS_FILE * parent,
     memcpy(&new->dir_ent, &de, sizeof(de));
     new->next = new->first = NULL;
     new->parent = parent;
+    new->claimed = 0;
     if (type == fdt_undelete)
 	undelete(fs, new);
     **chain = new;
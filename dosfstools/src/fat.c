@@ -70,6 +70,55 @@ void get_fat(FAT_ENTRY * entry, void *fat, uint32_t cluster, DOS_FS * fs)
     }
 }
 
+/* FATs are read and compared in pieces of this size */
+#define FAT_CHUNK (1024 * 1024)
+
+/**
+ * Read a copy of the FAT with large sequential reads, reporting the progress
+ * as pass 1.
+ *
+ * @param[in]	    fs          Information about the filesystem
+ * @param[in]	    pos         Offset of the FAT copy on the partition
+ * @param[in]	    size        Bytes to read
+ * @param[out]      data        Where to put the FAT
+ */
+static void read_fat_copy(DOS_FS * fs, loff_t pos, int size, void *data)
+{
+    int done, chunk;
+
+    for (done = 0; done < size; done += chunk) {
+	chunk = min(size - done, FAT_CHUNK);
+	fs_read(pos + done, chunk, (char *)data + done);
+	report_progress(1, done + chunk, size);
+    }
+}
+
+/**
+ * Compare the FAT in memory with a copy on the partition, a piece at a time
+ * so the second copy never has to be held in memory in full.
+ *
+ * @param[in]	    fat         FAT in memory
+ * @param[in]	    pos         Offset of the FAT copy on the partition
+ * @param[in]	    size        Bytes to compare
+ *
+ * @return  0       The copies are the same
+ * @return  1       They differ
+ */
+static int fat_differs(void *fat, loff_t pos, int size)
+{
+    void *chunk_data;
+    int done, chunk, differs = 0;
+
+    chunk_data = alloc(min(size, FAT_CHUNK));
+    for (done = 0; done < size && !differs; done += chunk) {
+	chunk = min(size - done, FAT_CHUNK);
+	fs_read(pos + done, chunk, chunk_data);
+	differs = memcmp((char *)fat + done, chunk_data, chunk) != 0;
+    }
+    free(chunk_data);
+    return differs;
+}
+
 /**
  * Build a bookkeeping structure from the partition's FAT table.
  * If the partition has multiple FATs and they don't agree, try to pick a winner,
@@ -82,17 +131,18 @@ void read_fat(DOS_FS * fs)
 {
     int eff_size, alloc_size;
     uint32_t i;
-    void *first, *second = NULL;
+    void *first;
+    unsigned char second_start[4];
     int first_ok, second_ok;
     uint32_t total_num_clusters;
 
     /* Clean up from previous pass */
     if (fs->fat)
 	free(fs->fat);
-    if (fs->cluster_owner)
-	free(fs->cluster_owner);
+    if (fs->owned)
+	free(fs->owned);
     fs->fat = NULL;
-    fs->cluster_owner = NULL;
+    fs->owned = NULL;
 
     total_num_clusters = fs->clusters + 2UL;
     eff_size = (total_num_clusters * fs->fat_bits + 7) / 8ULL;
@@ -105,15 +155,15 @@ void read_fat(DOS_FS * fs)
 	    alloc_size = (total_num_clusters * 12 + 23) / 24 * 3;
 
     first = alloc(alloc_size);
-    fs_read(fs->fat_start, eff_size, first);
-    if (fs->nfats > 1) {
-	second = alloc(alloc_size);
-	fs_read(fs->fat_start + fs->fat_size, eff_size, second);
-    }
-    if (second && memcmp(first, second, eff_size) != 0) {
+    read_fat_copy(fs, fs->fat_start, eff_size, first);
+    if (fs->nfats > 1 &&
+	fat_differs(first, fs->fat_start + fs->fat_size, eff_size)) {
 	FAT_ENTRY first_media, second_media;
+	/* The media entry is at most 4 bytes into the FAT */
+	memset(second_start, 0, sizeof(second_start));
+	fs_read(fs->fat_start + fs->fat_size, min(eff_size, 4), second_start);
 	get_fat(&first_media, first, 0, fs);
-	get_fat(&second_media, second, 0, fs);
+	get_fat(&second_media, second_start, 0, fs);
 	first_ok = (first_media.value & FAT_EXTD(fs)) == FAT_EXTD(fs);
 	second_ok = (second_media.value & FAT_EXTD(fs)) == FAT_EXTD(fs);
 	if (first_ok && !second_ok) {
@@ -122,8 +172,8 @@ void read_fat(DOS_FS * fs)
 	}
 	if (!first_ok && second_ok) {
 	    printf("FATs differ - using second FAT.\n");
-	    fs_write(fs->fat_start, eff_size, second);
-	    memcpy(first, second, eff_size);
+	    read_fat_copy(fs, fs->fat_start + fs->fat_size, eff_size, first);
+	    fs_write(fs->fat_start, eff_size, first);
 	}
 	if (first_ok && second_ok) {
 	    if (interactive) {
@@ -132,8 +182,9 @@ void read_fat(DOS_FS * fs)
 		if (get_key("12", "?") == '1') {
 		    fs_write(fs->fat_start + fs->fat_size, eff_size, first);
 		} else {
-		    fs_write(fs->fat_start, eff_size, second);
-		    memcpy(first, second, eff_size);
+		    read_fat_copy(fs, fs->fat_start + fs->fat_size, eff_size,
+				  first);
+		    fs_write(fs->fat_start, eff_size, first);
 		}
 	    } else {
 		printf("FATs differ but appear to be intact. Using first "
@@ -146,13 +197,13 @@ void read_fat(DOS_FS * fs)
 	    exit(1);
 	}
     }
-    if (second) {
-	free(second);
-    }
     fs->fat = (unsigned char *)first;
 
-    fs->cluster_owner = alloc(total_num_clusters * sizeof(DOS_FILE *));
-    memset(fs->cluster_owner, 0, (total_num_clusters * sizeof(DOS_FILE *)));
+    /* A bit per cluster is all that is kept about ownership */
+    fs->owned = alloc((total_num_clusters + 7) / 8);
+    memset(fs->owned, 0, (total_num_clusters + 7) / 8);
+    fs->owned_clusters = 0;
+    fs->used_clusters = 0;
 
     /* Truncate any cluster chains that link to something out of range */
     for (i = 2; i < fs->clusters + 2; i++) {
@@ -168,6 +219,8 @@ void read_fat(DOS_FS * fs)
 		   (long)(i - 2), (long)curEntry.value, (long)(fs->clusters + 2 - 1));
 	    set_fat(fs, i, -1);
 	}
+	if (curEntry.value && !FAT_IS_BAD(fs, curEntry.value))
+	    fs->used_clusters++;
     }
 }
 
@@ -278,32 +331,57 @@ loff_t cluster_start(DOS_FS * fs, uint32_t cluster)
 			     2) * (uint64_t)fs->cluster_size;
 }
 
+#define BIT_IS_SET(map, i)	((map)[(i) / 8] & (1 << ((i) % 8)))
+#define SET_BIT(map, i)		((map)[(i) / 8] |= 1 << ((i) % 8))
+#define CLEAR_BIT(map, i)	((map)[(i) / 8] &= ~(1 << ((i) % 8)))
+
 /**
- * Update internal bookkeeping to show that the specified cluster belongs
- * to the specified dentry.
+ * Update internal bookkeeping to show whether the specified cluster belongs
+ * to a dentry.
  *
  * @param[in,out]   fs          Information about the filesystem
  * @param[in]	    cluster     Cluster being assigned
- * @param[in]	    owner       Information on dentry that owns this cluster
- *                              (may be NULL)
+ * @param[in]	    owned       Nonzero == the cluster has an owner now
  */
-void set_owner(DOS_FS * fs, uint32_t cluster, DOS_FILE * owner)
+void set_owned(DOS_FS * fs, uint32_t cluster, int owned)
 {
-    if (fs->cluster_owner == NULL)
+    if (fs->owned == NULL)
 	die("Internal error: attempt to set owner in non-existent table");
 
-    if (owner && fs->cluster_owner[cluster]
-	&& (fs->cluster_owner[cluster] != owner))
-	die("Internal error: attempt to change file owner");
-    fs->cluster_owner[cluster] = owner;
+    if (owned && !BIT_IS_SET(fs->owned, cluster)) {
+	SET_BIT(fs->owned, cluster);
+	fs->owned_clusters++;
+    } else if (!owned && BIT_IS_SET(fs->owned, cluster)) {
+	CLEAR_BIT(fs->owned, cluster);
+	fs->owned_clusters--;
+    }
 }
 
-DOS_FILE *get_owner(DOS_FS * fs, uint32_t cluster)
+int is_owned(DOS_FS * fs, uint32_t cluster)
 {
-    if (fs->cluster_owner == NULL)
-	return NULL;
+    if (fs->owned == NULL)
+	return 0;
     else
-	return fs->cluster_owner[cluster];
+	return BIT_IS_SET(fs->owned, cluster) != 0;
+}
+
+void report_progress(int pass, uint32_t current, uint32_t max)
+{
+    static int last_pass, last_permille = -1;
+    int permille;
+    char line[64];
+
+    if (progress_fd < 0 || !max)
+	return;
+    /* Only whole steps of a thousandth, a line per file would be too much */
+    permille = (uint64_t)min(current, max) * 1000 / max;
+    if (pass == last_pass && permille == last_permille)
+	return;
+    last_pass = pass;
+    last_permille = permille;
+    snprintf(line, sizeof(line), "%d %d 1000\n", pass, permille);
+    if (write(progress_fd, line, strlen(line)) < 0)
+	progress_fd = -1;
 }
 
 void fix_bad(DOS_FS * fs)
@@ -316,7 +394,7 @@ void fix_bad(DOS_FS * fs)
 	FAT_ENTRY curEntry;
 	get_fat(&curEntry, fs->fat, i, fs);
 
-	if (!get_owner(fs, i) && !FAT_IS_BAD(fs, curEntry.value))
+	if (!is_owned(fs, i) && !FAT_IS_BAD(fs, curEntry.value))
 	    if (!fs_test(cluster_start(fs, i), fs->cluster_size)) {
 		printf("Cluster %lu is unreadable.\n", (unsigned long)i);
 		set_fat(fs, i, -2);
@@ -336,7 +414,7 @@ void reclaim_free(DOS_FS * fs)
 	FAT_ENTRY curEntry;
 	get_fat(&curEntry, fs->fat, i, fs);
 
-	if (!get_owner(fs, i) && curEntry.value &&
+	if (!is_owned(fs, i) && curEntry.value &&
 	    !FAT_IS_BAD(fs, curEntry.value)) {
 	    set_fat(fs, i, 0);
 	    reclaimed++;
@@ -349,16 +427,16 @@ void reclaim_free(DOS_FS * fs)
 }
 
 /**
- * Assign the specified owner to all orphan chains (except cycles).
+ * Claim all orphan chains (except cycles), marking them in the orphans bitmap.
  * Break cross-links between orphan chains.
  *
  * @param[in,out]   fs             Information about the filesystem
- * @param[in]	    owner          dentry to be assigned ownership of orphans
+ * @param[in,out]   orphans        Bitmap of the clusters claimed as orphans
  * @param[in,out]   num_refs	   For each orphan cluster [index], how many
  *				   clusters link to it.
  * @param[in]	    start_cluster  Where to start scanning for orphans
  */
-static void tag_free(DOS_FS * fs, DOS_FILE * owner, uint32_t *num_refs,
+static void tag_free(DOS_FS * fs, unsigned char *orphans, uint32_t *num_refs,
 		     uint32_t start_cluster)
 {
     int prev;
@@ -373,12 +451,13 @@ static void tag_free(DOS_FS * fs, DOS_FILE * owner, uint32_t *num_refs,
 
 	/* If the current entry is the head of an un-owned chain... */
 	if (curEntry.value && !FAT_IS_BAD(fs, curEntry.value) &&
-	    !get_owner(fs, i) && !num_refs[i]) {
+	    !is_owned(fs, i) && !num_refs[i]) {
 	    prev = 0;
 	    /* Walk the chain, claiming ownership as we go */
 	    for (walk = i; walk != -1; walk = next_cluster(fs, walk)) {
-		if (!get_owner(fs, walk)) {
-		    set_owner(fs, walk, owner);
+		if (!is_owned(fs, walk)) {
+		    set_owned(fs, walk, 1);
+		    SET_BIT(orphans, walk);
 		} else {
 		    /* We've run into cross-links between orphaned chains,
 		     * or a cycle with a tail.
@@ -408,7 +487,7 @@ static void tag_free(DOS_FS * fs, DOS_FILE * owner, uint32_t *num_refs,
  */
 void reclaim_file(DOS_FS * fs)
 {
-    DOS_FILE orphan;
+    unsigned char *orphans;	/* Clusters of orphan chains */
     int reclaimed, files;
     int changed = 0;
     uint32_t i, next, walk;
@@ -421,6 +500,8 @@ void reclaim_file(DOS_FS * fs)
     total_num_clusters = fs->clusters + 2UL;
     num_refs = alloc(total_num_clusters * sizeof(uint32_t));
     memset(num_refs, 0, (total_num_clusters * sizeof(uint32_t)));
+    orphans = alloc((total_num_clusters + 7) / 8);
+    memset(orphans, 0, (total_num_clusters + 7) / 8);
 
     /* Guarantee that all orphan chains (except cycles) end cleanly
      * with an end-of-chain mark.
@@ -431,7 +512,7 @@ void reclaim_file(DOS_FS * fs)
 	get_fat(&curEntry, fs->fat, i, fs);
 
 	next = curEntry.value;
-	if (!get_owner(fs, i) && next && next < fs->clusters + 2) {
+	if (!is_owned(fs, i) && next && next < fs->clusters + 2) {
 	    /* Cluster is linked, but not owned (orphan) */
 	    FAT_ENTRY nextEntry;
 	    get_fat(&nextEntry, fs->fat, next, fs);
@@ -439,7 +520,7 @@ void reclaim_file(DOS_FS * fs)
 	    /* Mark it end-of-chain if it links into an owned cluster,
 	     * a free cluster, or a bad cluster.
 	     */
-	    if (get_owner(fs, next) || !nextEntry.value ||
+	    if (is_owned(fs, next) || !nextEntry.value ||
 		FAT_IS_BAD(fs, nextEntry.value))
 		set_fat(fs, i, -1);
 	    else
@@ -451,7 +532,7 @@ void reclaim_file(DOS_FS * fs)
      * and all cycles and cross-links are broken
      */
     do {
-	tag_free(fs, &orphan, num_refs, changed);
+	tag_free(fs, orphans, num_refs, changed);
 	changed = 0;
 
 	/* Any unaccounted-for orphans must be part of a cycle */
@@ -460,7 +541,7 @@ void reclaim_file(DOS_FS * fs)
 	    get_fat(&curEntry, fs->fat, i, fs);
 
 	    if (curEntry.value && !FAT_IS_BAD(fs, curEntry.value) &&
-		!get_owner(fs, i)) {
+		!is_owned(fs, i)) {
 		if (!num_refs[curEntry.value]--)
 		    die("Internal error: num_refs going below zero");
 		set_fat(fs, i, -1);
@@ -481,7 +562,7 @@ void reclaim_file(DOS_FS * fs)
     files = reclaimed = 0;
     for (i = 2; i < total_num_clusters; i++)
 	/* If this cluster is the head of an orphan chain... */
-	if (get_owner(fs, i) == &orphan && !num_refs[i]) {
+	if (BIT_IS_SET(orphans, i) && !num_refs[i]) {
 	    DIR_ENT de;
 	    loff_t offset;
 	    files++;
@@ -503,6 +584,7 @@ void reclaim_file(DOS_FS * fs)
 	       files == 1 ? "" : "s");
 
     free(num_refs);
+    free(orphans);
 }
 
 uint32_t update_free(DOS_FS * fs)
@@ -515,7 +597,7 @@ uint32_t update_free(DOS_FS * fs)
 	FAT_ENTRY curEntry;
 	get_fat(&curEntry, fs->fat, i, fs);
 
-	if (!get_owner(fs, i) && !FAT_IS_BAD(fs, curEntry.value))
+	if (!is_owned(fs, i) && !FAT_IS_BAD(fs, curEntry.value))
 	    ++free;
     }
 
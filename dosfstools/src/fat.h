@@ -53,16 +53,15 @@ loff_t cluster_start(DOS_FS * fs, uint32_t cluster);
 
 /* Returns the byte offset of CLUSTER, relative to the respective device. */
 
-void set_owner(DOS_FS * fs, uint32_t cluster, DOS_FILE * owner);
+void set_owned(DOS_FS * fs, uint32_t cluster, int owned);
 
-/* Sets the owner pointer of the respective cluster to OWNER. If OWNER was NULL
-   before, it can be set to NULL or any non-NULL value. Otherwise, only NULL is
-   accepted as the new value. */
+/* Marks the respective cluster as owned by a file, or as free of any owner if
+   OWNED is zero. Only one bit is kept per cluster, the owning file is looked
+   up from the directory tree when it is needed. */
 
-DOS_FILE *get_owner(DOS_FS * fs, uint32_t cluster);
+int is_owned(DOS_FS * fs, uint32_t cluster);
 
-/* Returns the owner of the repective cluster or NULL if the cluster has no
-   owner. */
+/* Returns a non-zero integer if the respective cluster has an owner. */
 
 void fix_bad(DOS_FS * fs);
 
@@ -82,4 +81,9 @@ uint32_t update_free(DOS_FS * fs);
 
 /* Updates free cluster count in FSINFO sector. */
 
+void report_progress(int pass, uint32_t current, uint32_t max);
+
+/* Writes a "pass current max" completion line to progress_fd, the format of
+   e2fsck -C. Does nothing if no descriptor was given. */
+
 #endif
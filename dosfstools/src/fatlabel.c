@@ -42,6 +42,7 @@
 
 int interactive = 0, rw = 0, list = 0, test = 0, verbose = 0, write_immed = 0;
 int atari_format = 0;
+int progress_fd = -1;
 unsigned n_files = 0;
 void *mem_queue = NULL;
 
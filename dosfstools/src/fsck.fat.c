@@ -43,16 +43,18 @@
 
 int interactive = 0, rw = 0, list = 0, test = 0, verbose = 0, write_immed = 0;
 int atari_format = 0, boot_only = 0;
+int progress_fd = -1;
 unsigned n_files = 0;
 void *mem_queue = NULL;
 
 static void usage(char *name)
 {
-    fprintf(stderr, "usage: %s [-aAbflrtvVwy] [-d path -d ...] "
+    fprintf(stderr, "usage: %s [-aAbflrtvVwy] [-C fd] [-d path -d ...] "
 	    "[-u path -u ...]\n%15sdevice\n", name, "");
     fprintf(stderr, "  -a       automatically repair the filesystem\n");
     fprintf(stderr, "  -A       toggle Atari filesystem format\n");
     fprintf(stderr, "  -b       make read-only boot sector check\n");
+    fprintf(stderr, "  -C fd    write completion lines to that descriptor\n");
     fprintf(stderr, "  -d path  drop that file\n");
     fprintf(stderr, "  -f       salvage unused chains to files\n");
     fprintf(stderr, "  -l       list path names\n");
@@ -108,7 +110,7 @@ int main(int argc, char **argv)
     rw = interactive = 1;
     check_atari();
 
-    while ((c = getopt(argc, argv, "Aad:bflnprtu:vVwy")) != -1)
+    while ((c = getopt(argc, argv, "Aad:bC:flnprtu:vVwy")) != -1)
 	switch (c) {
 	case 'A':		/* toggle Atari format */
 	    atari_format = !atari_format;
@@ -125,6 +127,9 @@ int main(int argc, char **argv)
 	    interactive = 0;
 	    boot_only = 1;
 	    break;
+	case 'C':
+	    progress_fd = atoi(optarg);
+	    break;
 	case 'd':
 	    file_add(optarg, fdt_drop);
 	    break;
@@ -185,6 +190,7 @@ int main(int argc, char **argv)
     else
 	reclaim_free(&fs);
     free_clusters = update_free(&fs);
+    report_progress(3, 1, 1);
     file_unused();
     qfree(&mem_queue);
     if (verify) {
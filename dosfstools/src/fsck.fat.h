@@ -140,6 +140,7 @@ typedef struct _dos_file {
     struct _dos_file *parent;	/* parent directory */
     struct _dos_file *next;	/* next entry */
     struct _dos_file *first;	/* first entry (directory only) */
+    int claimed;		/* clusters are marked as owned by this file */
 } DOS_FILE;
 
 typedef struct {
@@ -163,12 +164,15 @@ typedef struct {
     long free_clusters;
     loff_t backupboot_start;	/* 0 if not present */
     unsigned char *fat;
-    DOS_FILE **cluster_owner;
+    unsigned char *owned;	/* bitmap of the clusters owned by a file */
+    uint32_t owned_clusters;	/* bits set in owned */
+    uint32_t used_clusters;	/* allocated in the FAT when it was read */
     char *label;
 } DOS_FS;
 
 extern int interactive, rw, list, verbose, test, write_immed;
 extern int atari_format;
+extern int progress_fd;
 extern unsigned n_files;
 extern void *mem_queue;
 
@@ -55,6 +55,14 @@ typedef struct _change {
 static CHANGE *changes, *last;
 static int fd, did_change = 0;
 
+/* Small reads, such as the directory entries that are read one at a time,
+   are served from a block read ahead of this size */
+#define READ_CACHE_SIZE 65536
+
+static char *read_cache;
+static loff_t read_cache_pos;
+static int read_cache_len;
+
 unsigned device_no;
 
 #ifdef __DJGPP__
@@ -87,6 +95,7 @@ void fs_open(char *path, int rw)
     }
     changes = last = NULL;
     did_change = 0;
+    read_cache_len = 0;
 
 #ifndef _DJGPP_
     if (fstat(fd, &stbuf) < 0)
@@ -122,12 +131,33 @@ void fs_read(loff_t pos, int size, void *data)
     CHANGE *walk;
     int got;
 
-    if (llseek(fd, pos, 0) != pos)
-	pdie("Seek to %lld", pos);
-    if ((got = read(fd, data, size)) < 0)
-	pdie("Read %d bytes at %lld", size, pos);
-    if (got != size)
-	die("Got %d bytes instead of %d at %lld", got, size, pos);
+    if (size <= READ_CACHE_SIZE / 2) {
+	if (pos < read_cache_pos ||
+	    pos + size > read_cache_pos + read_cache_len) {
+	    loff_t start = pos & ~(loff_t)4095;
+
+	    if (!read_cache)
+		read_cache = alloc(READ_CACHE_SIZE);
+	    read_cache_len = 0;
+	    if (llseek(fd, start, 0) != start)
+		pdie("Seek to %lld", start);
+	    if ((got = read(fd, read_cache, READ_CACHE_SIZE)) < 0)
+		pdie("Read %d bytes at %lld", size, pos);
+	    read_cache_pos = start;
+	    read_cache_len = got;
+	    if (pos + size > start + got)
+		die("Got %d bytes instead of %d at %lld",
+		    (int)(start + got > pos ? start + got - pos : 0), size, pos);
+	}
+	memcpy(data, read_cache + (pos - read_cache_pos), size);
+    } else {
+	if (llseek(fd, pos, 0) != pos)
+	    pdie("Seek to %lld", pos);
+	if ((got = read(fd, data, size)) < 0)
+	    pdie("Read %d bytes at %lld", size, pos);
+	if (got != size)
+	    die("Got %d bytes instead of %d at %lld", got, size, pos);
+    }
     for (walk = changes; walk; walk = walk->next) {
 	if (walk->pos < pos + size && walk->pos + walk->size > pos) {
 	    if (walk->pos < pos)
@@ -164,6 +194,9 @@ void fs_write(loff_t pos, int size, void *data)
 
     if (write_immed) {
 	did_change = 1;
+	if (pos < read_cache_pos + read_cache_len &&
+	    pos + size > read_cache_pos)
+	    read_cache_len = 0;
 	if (llseek(fd, pos, 0) != pos)
 	    pdie("Seek to %lld", pos);
 	if ((did = write(fd, data, size)) == size)
@@ -188,6 +221,7 @@ static void fs_flush(void)
     CHANGE *this;
     int size;
 
+    read_cache_len = 0;
     while (changes) {
 	this = changes;
 	changes = changes->next;
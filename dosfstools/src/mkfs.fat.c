@@ -59,6 +59,7 @@
 #include <stdlib.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <time.h>
@@ -264,6 +265,12 @@ static int orphaned_sectors = 0;	/* Sectors that exist in the last block of file
 static int invariant = 0;		/* Whether to set normally randomized or
 					   current time based values to
 					   constants */
+static int fast_format = FALSE;	/* Discard the device and align to its erase blocks */
+static unsigned erase_sectors = 0;	/* Erase block of the card in sectors, 0 if unknown */
+static unsigned long long erase_offset = 0;	/* Partition start modulo the erase block, in sectors */
+
+/* Blank areas are written in pieces of this size */
+#define ZERO_CHUNK (1024 * 1024)
 
 /* Function prototype definitions */
 
@@ -280,6 +287,8 @@ static void check_mount(char *device_name);
 static void establish_params(int device_num, int size);
 static void setup_tables(void);
 static void write_tables(void);
+static void probe_erase_block(dev_t rdev);
+static void discard_device(void);
 
 /* The function implementations */
 
@@ -512,6 +521,71 @@ static void check_mount(char *device_name)
 #endif
 }
 
+/* Read a number from a sysfs attribute, 0 if it is not there */
+
+static unsigned long long read_sysfs(const char *path)
+{
+    FILE *f;
+    unsigned long long value = 0;
+
+    if ((f = fopen(path, "r")) == NULL)
+	return 0;
+    if (fscanf(f, "%llu", &value) != 1)
+	value = 0;
+    fclose(f);
+    return value;
+}
+
+/* Find the erase block size of an SD/MMC card from sysfs, and where the
+   partition starts within one, so the data area can start on an erase
+   block. Leaves erase_sectors at 0 when the card doesn't say. */
+
+static void probe_erase_block(dev_t rdev)
+{
+    char path[128];
+    unsigned long long erase_size, start;
+
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/device/preferred_erase_size",
+	     major(rdev), minor(rdev));
+    erase_size = read_sysfs(path);
+    if (!erase_size) {
+	/* a partition, the card is its parent */
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../device/preferred_erase_size",
+		 major(rdev), minor(rdev));
+	erase_size = read_sysfs(path);
+    }
+    /* in 512 byte sectors, 0 for a whole disk */
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/start", major(rdev),
+	     minor(rdev));
+    start = read_sysfs(path);
+
+    if (erase_size < (unsigned)sector_size || erase_size > 64 * 1024 * 1024 ||
+	(erase_size & (erase_size - 1)))
+	return;
+    erase_sectors = erase_size / sector_size;
+    erase_offset = start * 512 / sector_size % erase_sectors;
+    if (verbose >= 2)
+	printf("Erase block of %llu bytes, partition starts %llu sectors into one\n",
+	       erase_size, erase_offset);
+}
+
+/* Tell the card that everything on the partition is unused. Old contents
+   don't have to be kept by its FTL, and the erase blocks come back clean
+   for the first writes after the format. */
+
+static void discard_device(void)
+{
+    uint64_t range[2];
+
+    range[0] = 0;
+    range[1] = blocks * BLOCK_SIZE;
+    if (ioctl(dev, BLKDISCARD, &range) < 0) {
+	if (verbose)
+	    printf("Device does not support discard: %s\n", strerror(errno));
+    } else if (verbose)
+	printf("Discarded %llu bytes\n", (unsigned long long)range[1]);
+}
+
 /* Establish the geometry and media parameters for the device */
 
 static void establish_params(int device_num, int size)
@@ -988,6 +1062,23 @@ static void setup_tables(void)
 	    die("FAT not 12, 16 or 32 bits");
 	}
 
+	/* Start the data area on an erase block of the card, the FAT32
+	 * reserved area takes up the difference */
+	if (erase_sectors && size_fat == 32) {
+	    unsigned data_start = reserved_sectors + nr_fats * fat_length;
+	    unsigned pad = (erase_sectors - (erase_offset + data_start) %
+			    erase_sectors) % erase_sectors;
+	    if (reserved_sectors + pad <= 0xffff &&
+		(num_sectors - data_start - pad) / bs.cluster_size >= MIN_CLUST_32) {
+		reserved_sectors += pad;
+		bs.reserved = htole16(reserved_sectors);
+		cluster_count = (num_sectors - data_start - pad) / bs.cluster_size;
+		if (verbose >= 2)
+		    printf("Using %d reserved sectors to align to the erase block\n",
+			   reserved_sectors);
+	    }
+	}
+
 	/* Adjust the number of root directory entries to help enforce alignment */
 	if (align_structures) {
 	    root_dir_entries = align_object(root_dir_sectors, bs.cluster_size)
@@ -1292,18 +1383,34 @@ static void setup_tables(void)
 	error ("failed whilst writing " errstr);	\
   } while(0)
 
+/* Write SIZE bytes of zeros at the current position, a chunk at a time
+   rather than a sector at a time */
+#define writezeros(zeros,size,errstr)				\
+  do {								\
+    long long __left = (size);					\
+    while (__left > 0) {					\
+	int __chunk = __left > ZERO_CHUNK ? ZERO_CHUNK : __left;	\
+	writebuf(zeros, __chunk, errstr);			\
+	__left -= __chunk;					\
+    }								\
+  } while(0)
+
 static void write_tables(void)
 {
     int x;
     int fat_length;
+    char *zeros;
 
     fat_length = (size_fat == 32) ?
 	le32toh(bs.fat32.fat32_length) : le16toh(bs.fat_length);
 
+    if (!(zeros = calloc(1, ZERO_CHUNK)))
+	error("out of memory");
+
     seekto(0, "start of device");
     /* clear all reserved sectors */
-    for (x = 0; x < reserved_sectors; ++x)
-	writebuf(blank_sector, sector_size, "reserved sector");
+    writezeros(zeros, (long long)reserved_sectors * sector_size,
+	       "reserved sector");
     /* seek back to sector 0 and write the boot sector */
     seekto(0, "boot sector");
     writebuf((char *)&bs, sizeof(struct msdos_boot_sector), "boot sector");
@@ -1320,16 +1427,15 @@ static void write_tables(void)
     /* seek to start of FATS and write them all */
     seekto(reserved_sectors * sector_size, "first FAT");
     for (x = 1; x <= nr_fats; x++) {
-	int y;
 	int blank_fat_length = fat_length - alloced_fat_length;
 	writebuf(fat, alloced_fat_length * sector_size, "FAT");
-	for (y = 0; y < blank_fat_length; y++)
-	    writebuf(blank_sector, sector_size, "FAT");
+	writezeros(zeros, (long long)blank_fat_length * sector_size, "FAT");
     }
     /* Write the root directory directly after the last FAT. This is the root
      * dir area on FAT12/16, and the first cluster on FAT32. */
     writebuf((char *)root_dir, size_root_dir, "root directory");
 
+    free(zeros);
     if (blank_sector)
 	free(blank_sector);
     if (info_sector)
@@ -1348,7 +1454,7 @@ Usage: mkfs.fat [-a][-A][-c][-C][-v][-I][-l bad-block-file][-b backup-boot-secto
        [-s sectors-per-cluster][-S logical-sector-size][-f number-of-FATs]\n\
        [-h hidden-sectors][-F fat-size][-r root-dir-entries][-R reserved-sectors]\n\
        [-M FAT-media-byte][-D drive_number]\n\
-       [--invariant]\n\
+       [--invariant][--fast]\n\
        [--help]\n\
        /dev/name [blocks]\n");
     exit(exitval);
@@ -1399,10 +1505,11 @@ int main(int argc, char **argv)
     int bad_block_count = 0;
     struct timeval create_timeval;
 
-    enum {OPT_HELP=1000, OPT_INVARIANT,};
+    enum {OPT_HELP=1000, OPT_INVARIANT, OPT_FAST,};
     const struct option long_options[] = {
 	    {"help", no_argument, NULL, OPT_HELP},
 	    {"invariant", no_argument, NULL, OPT_INVARIANT},
+	    {"fast", no_argument, NULL, OPT_FAST},
 	    {0,}
     };
 
@@ -1640,6 +1747,10 @@ int main(int argc, char **argv)
 	    create_time = 1426325213;
 	    break;
 
+	case OPT_FAST:
+	    fast_format = TRUE;
+	    break;
+
 	default:
 	    printf("Unknown option: %c\n", c);
 	    usage(1);
@@ -1741,6 +1852,9 @@ int main(int argc, char **argv)
 		"Warning: sector size is set to %d > 4096, such filesystem will not propably mount\n",
 		sector_size);
 
+    if (fast_format && S_ISBLK(statbuf.st_mode))
+	probe_erase_block(statbuf.st_rdev);
+
     establish_params(statbuf.st_rdev, statbuf.st_size);
     /* Establish the media parameters */
 
@@ -1751,6 +1865,9 @@ int main(int argc, char **argv)
     else if (listfile)
 	get_list_blocks(listfile);
 
+    if (fast_format && S_ISBLK(statbuf.st_mode))
+	discard_device();	/* Before the tables, or they would go too */
+
     write_tables();		/* Write the filesystem tables away! */
 
     exit(0);			/* Terminate with no errors! */
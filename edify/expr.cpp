@@ -22,6 +22,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <chrono>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -42,12 +43,28 @@ static bool BooleanString(const std::string& s) {
     return !s.empty();
 }
 
+// Calls the function of |expr|. With state->time_functions set, the call is timed, unless it's a
+// literal or an operator such as ';' that only wraps the calls in it.
+static Value* Call(State* state, const std::unique_ptr<Expr>& expr) {
+    if (!state->time_functions || expr->fn == Literal || expr->name[0] == '(') {
+        return expr->fn(expr->name.c_str(), state, expr->argv);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Value* v = expr->fn(expr->name.c_str(), state, expr->argv);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    FunctionTime& time = state->function_times[expr->name];
+    time.calls++;
+    time.ns += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    return v;
+}
+
 bool Evaluate(State* state, const std::unique_ptr<Expr>& expr, std::string* result) {
     if (result == nullptr) {
         return false;
     }
 
-    std::unique_ptr<Value> v(expr->fn(expr->name.c_str(), state, expr->argv));
+    std::unique_ptr<Value> v(Call(state, expr));
     if (!v) {
         return false;
     }
@@ -56,12 +73,12 @@ bool Evaluate(State* state, const std::unique_ptr<Expr>& expr, std::string* resu
         return false;
     }
 
-    *result = v->data;
+    *result = std::move(v->data);
     return true;
 }
 
 Value* EvaluateValue(State* state, const std::unique_ptr<Expr>& expr) {
-    return expr->fn(expr->name.c_str(), state, expr->argv);
+    return Call(state, expr);
 }
 
 Value* StringValue(const char* str) {
@@ -362,13 +379,14 @@ bool ReadArgs(State* state, const std::vector<std::unique_ptr<Expr>>& argv,
     if (start + len > argv.size()) {
         return false;
     }
+    args->reserve(args->size() + len);
     for (size_t i = start; i < start + len; ++i) {
         std::string var;
         if (!Evaluate(state, argv[i], &var)) {
             args->clear();
             return false;
         }
-        args->push_back(var);
+        args->push_back(std::move(var));
     }
     return true;
 }
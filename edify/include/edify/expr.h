@@ -17,8 +17,10 @@
 #ifndef _EXPRESSION_H
 #define _EXPRESSION_H
 
+#include <stdint.h>
 #include <unistd.h>
 
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
@@ -27,6 +29,12 @@
 enum ErrorCode : int;
 enum CauseCode : int;
 
+// The calls to one function in a script, and the time they took.
+struct FunctionTime {
+  uint64_t calls = 0;
+  uint64_t ns = 0;
+};
+
 struct State {
   State(const std::string& script, void* cookie);
 
@@ -51,6 +59,11 @@ struct State {
   CauseCode cause_code;
 
   bool is_retry = false;
+
+  // When set, the calls to each function and the time they took, including the evaluation of
+  // their arguments, are added up in function_times.
+  bool time_functions = false;
+  std::map<std::string, FunctionTime> function_times;
 };
 
 enum ValueType {
@@ -23,6 +23,11 @@ extern "C" {
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
 #include <string>
 #include <vector>
 #include "exclude.hpp"
@@ -35,52 +40,223 @@ using namespace std;
 extern bool datamedia;
 
 TWExclude::TWExclude() {
+	absolutedir.push_back(false); // "/"
+	absolutedir.push_back(false); // Paths that don't start with a slash
 	add_relative_dir(".");
 	add_relative_dir("..");
 	add_relative_dir("lost+found");
 }
 
+size_t TWExclude::Name_Hash(const char* name, size_t len) {
+	size_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+	return hash;
+}
+
+size_t TWExclude::Edge_Key(size_t parent, const char* name, size_t len) {
+	return Name_Hash(name, len) ^ (parent * 0x9e3779b9u);
+}
+
+bool TWExclude::Glob::Match(const char* name, size_t len) const {
+	switch (kind) {
+		case ANY:
+			return true;
+		case PREFIX:
+			return len >= fixed.size() && memcmp(name, fixed.data(), fixed.size()) == 0;
+		case SUFFIX:
+			return len >= fixed.size() && memcmp(name + len - fixed.size(), fixed.data(), fixed.size()) == 0;
+		default:
+			return fnmatch(pattern.c_str(), name, 0) == 0;
+	}
+}
+
 void TWExclude::add_relative_dir(const string& dir) {
-	relativedir.push_back(dir);
+	if (dir.find_first_of("*?[") == string::npos) {
+		relativedir.insert(make_pair(Name_Hash(dir.data(), dir.size()), dir));
+		return;
+	}
+
+	// Most globs are a name with a * on one end, those are compared directly
+	Glob glob;
+	glob.pattern = dir;
+	if (dir == "*") {
+		glob.kind = Glob::ANY;
+	} else if (dir[0] == '*' && dir.find_first_of("*?[\\", 1) == string::npos) {
+		glob.kind = Glob::SUFFIX;
+		glob.fixed = dir.substr(1);
+	} else if (dir[dir.size() - 1] == '*' && dir.find_first_of("*?[\\") == dir.size() - 1) {
+		glob.kind = Glob::PREFIX;
+		glob.fixed = dir.substr(0, dir.size() - 1);
+	} else {
+		glob.kind = Glob::FNMATCH;
+	}
+	relativeglob.push_back(glob);
 }
 
 void TWExclude::clear_relative_dir(string dir) {
-	vector<string>::iterator iter = relativedir.begin();
-	while (iter != relativedir.end()) {
-		if (*iter == dir)
+	size_t hash = Name_Hash(dir.data(), dir.size());
+	auto range = relativedir.equal_range(hash);
+	for (auto iter = range.first; iter != range.second;) {
+		if (iter->second == dir)
 			iter = relativedir.erase(iter);
 		else
 			iter++;
 	}
+	vector<Glob>::iterator iter = relativeglob.begin();
+	while (iter != relativeglob.end()) {
+		if (iter->pattern == dir)
+			iter = relativeglob.erase(iter);
+		else
+			iter++;
+	}
 }
 
 void TWExclude::add_absolute_dir(const string& dir) {
-	absolutedir.push_back(TWFunc::Remove_Trailing_Slashes(dir));
+	const char* path = dir.c_str();
+	size_t node = *path == '/' ? 0 : 1;
+
+	// One trie node per path component, repeated slashes are skipped the
+	// same way Remove_Trailing_Slashes drops them
+	while (*path) {
+		if (*path == '/') {
+			path++;
+			continue;
+		}
+		size_t len = strcspn(path, "/");
+		size_t next = child(node, path, len);
+		if (next == npos) {
+			Edge edge;
+			edge.parent = node;
+			edge.name.assign(path, len);
+			edge.node = next = absolutedir.size();
+			absolutedir.push_back(false);
+			absolutechild.insert(make_pair(Edge_Key(node, path, len), edge));
+		}
+		node = next;
+		path += len;
+	}
+	absolutedir[node] = true;
+}
+
+size_t TWExclude::child(size_t parent, const char* name, size_t len) const {
+	auto range = absolutechild.equal_range(Edge_Key(parent, name, len));
+	for (auto iter = range.first; iter != range.second; iter++) {
+		const Edge& edge = iter->second;
+		if (edge.parent == parent && edge.name.size() == len && memcmp(edge.name.data(), name, len) == 0)
+			return edge.node;
+	}
+	return npos;
+}
+
+bool TWExclude::check_relative(const char* name, size_t len) const {
+	auto range = relativedir.equal_range(Name_Hash(name, len));
+	for (auto iter = range.first; iter != range.second; iter++) {
+		if (iter->second.size() == len && memcmp(iter->second.data(), name, len) == 0)
+			return true;
+	}
+	if (relativeglob.empty())
+		return false;
+	// fnmatch needs the name terminated, names from a path are copied
+	char term[NAME_MAX + 1];
+	if (name[len] != '\0') {
+		if (len > NAME_MAX)
+			return false;
+		memcpy(term, name, len);
+		term[len] = '\0';
+		name = term;
+	}
+	for (size_t i = 0; i < relativeglob.size(); i++) {
+		if (relativeglob[i].Match(name, len))
+			return true;
+	}
+	return false;
+}
+
+bool TWExclude::check_absolute(const char* path, size_t len) const {
+	size_t node = len > 0 && *path == '/' ? 0 : 1;
+	size_t i = 0;
+
+	while (i < len) {
+		if (path[i] == '/') {
+			i++;
+			continue;
+		}
+		size_t end = i;
+		while (end < len && path[end] != '/')
+			end++;
+		node = child(node, path + i, end - i);
+		if (node == npos)
+			return false;
+		i = end;
+	}
+	return absolutedir[node];
+}
+
+size_t TWExclude::find_dir(const string& Path) const {
+	const char* path = Path.c_str();
+	size_t node = *path == '/' ? 0 : 1;
+
+	while (*path && node != npos) {
+		if (*path == '/') {
+			path++;
+			continue;
+		}
+		size_t len = strcspn(path, "/");
+		node = child(node, path, len);
+		path += len;
+	}
+	return node;
+}
+
+bool TWExclude::check_skip(size_t dir, const char* name) const {
+	size_t len = strlen(name);
+	if (check_relative(name, len))
+		return true;
+	if (dir == npos)
+		return false;
+	size_t node = child(dir, name, len);
+	return node != npos && absolutedir[node];
 }
 
 uint64_t TWExclude::Get_Folder_Size(const string& Path) {
+	int fd = open(Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
+		return 0;
+	}
+	return Folder_Size(fd, Path, find_dir(Path));
+}
+
+uint64_t TWExclude::Folder_Size(int dir_fd, const string& Path, size_t dir) {
 	DIR* d;
 	struct dirent* de;
 	struct stat st;
 	uint64_t dusize = 0;
-	string FullPath;
 
-	d = opendir(Path.c_str());
+	d = fdopendir(dir_fd);
 	if (d == NULL) {
 		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
+		close(dir_fd);
 		return 0;
 	}
 
 	while ((de = readdir(d)) != NULL) {
-		FullPath = Path + "/";
-		FullPath += de->d_name;
-		if (lstat(FullPath.c_str(), &st)) {
+		if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+			string FullPath = Path + "/" + de->d_name;
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(FullPath)(strerror(errno)));
 			LOGINFO("Real error: Unable to stat '%s'\n", FullPath.c_str());
 			continue;
 		}
-		if ((st.st_mode & S_IFDIR) && !check_skip_dirs(FullPath) && de->d_type != DT_SOCK) {
-			dusize += Get_Folder_Size(FullPath);
+		if ((st.st_mode & S_IFDIR) && !check_skip(dir, de->d_name) && de->d_type != DT_SOCK) {
+			string FullPath = Path + "/" + de->d_name;
+			int sub_fd = openat(dirfd(d), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (sub_fd < 0) {
+				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(FullPath)(strerror(errno)));
+				continue;
+			}
+			dusize += Folder_Size(sub_fd, FullPath, dir == npos ? npos : child(dir, de->d_name, strlen(de->d_name)));
 		} else if (st.st_mode & S_IFREG || st.st_mode & S_IFLNK) {
 			dusize += (uint64_t)(st.st_size);
 		}
@@ -90,19 +266,24 @@ uint64_t TWExclude::Get_Folder_Size(const string& Path) {
 }
 
 bool TWExclude::check_relative_skip_dirs(const string& dir) {
-	return std::find(relativedir.begin(), relativedir.end(), dir) != relativedir.end();
+	return check_relative(dir.c_str(), dir.size());
 }
 
 bool TWExclude::check_absolute_skip_dirs(const string& path) {
-	return std::find(absolutedir.begin(), absolutedir.end(), path) != absolutedir.end();
+	return check_absolute(path.c_str(), path.size());
 }
 
 bool TWExclude::check_skip_dirs(const string& path) {
-	string normalized = TWFunc::Remove_Trailing_Slashes(path);
-	size_t slashIdx = normalized.find_last_of('/');
-	if (slashIdx != std::string::npos && slashIdx+1 < normalized.size()) {
-		if (check_relative_skip_dirs(normalized.substr(slashIdx+1)))
-			return true;
-	}
-	return check_absolute_skip_dirs(normalized);
+	const char* str = path.c_str();
+	size_t len = path.size();
+
+	// The last component without any trailing slashes
+	while (len > 0 && str[len - 1] == '/')
+		len--;
+	size_t start = len;
+	while (start > 0 && str[start - 1] != '/')
+		start--;
+	if (start > 0 && start < len && check_relative(str + start, len - start))
+		return true;
+	return check_absolute(str, len);
 }
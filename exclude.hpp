@@ -19,14 +19,22 @@
 #ifndef TWEXCLUDE_HPP
 #define TWEXCLUDE_HPP
 
+#include <stdint.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
 
+// Folders and files left out of backups and wipes. Relative entries match
+// the name of an item anywhere and may be globs ("*.tmp"), absolute entries
+// match one full path. Lookups don't allocate, so walkers can check every
+// item they read.
 class TWExclude {
 
 public:
+	static const size_t npos = (size_t) -1;
+
 	TWExclude();
 	uint64_t Get_Folder_Size(const string& Path); // Gets the folder's size using stat
 	void add_absolute_dir(const string& Path);
@@ -35,9 +43,33 @@ public:
 	bool check_absolute_skip_dirs(const string& path);
 	bool check_skip_dirs(const string& path);
 	void clear_relative_dir(string dir);
+	size_t find_dir(const string& Path) const;                  // Position of folder Path for check_skip(), npos if no absolute entry is below it
+	bool check_skip(size_t dir, const char* name) const;        // Item name in the folder find_dir() returned dir for
+
 private:
-	vector<string> absolutedir;
-	vector<string> relativedir;
+	struct Glob {
+		enum Kind { ANY, PREFIX, SUFFIX, FNMATCH } kind;
+		string pattern;
+		string fixed;                                           // The literal part for PREFIX and SUFFIX
+		bool Match(const char* name, size_t len) const;
+	};
+	struct Edge {
+		size_t parent;
+		string name;
+		size_t node;
+	};
+
+	static size_t Name_Hash(const char* name, size_t len);
+	static size_t Edge_Key(size_t parent, const char* name, size_t len);
+	bool check_relative(const char* name, size_t len) const;
+	size_t child(size_t parent, const char* name, size_t len) const;
+	bool check_absolute(const char* path, size_t len) const;
+	uint64_t Folder_Size(int dir_fd, const string& Path, size_t dir);
+
+	unordered_multimap<size_t, string> relativedir;            // Literal names by Name_Hash()
+	vector<Glob> relativeglob;
+	vector<bool> absolutedir;                                   // Trie of the absolute entries by component, true if the path ending there is excluded. Node 0 is "/", node 1 the start of paths without a leading slash
+	unordered_multimap<size_t, Edge> absolutechild;            // Trie edges by Edge_Key()
 };
 
 #endif
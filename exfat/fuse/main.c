@@ -32,6 +32,7 @@
 #include <limits.h>
 #include <sys/types.h>
 #include <pwd.h>
+#include <pthread.h>
 #include <unistd.h>
 
 #ifndef DEBUG
@@ -47,6 +48,10 @@ const char* default_options = "ro_fallback,allow_other,blkdev,big_writes,"
 
 struct exfat ef;
 
+/* libexfat is not thread-safe, every call into it from a FUSE worker is
+   serialized by this lock */
+static pthread_mutex_t ef_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct exfat_node* get_node(const struct fuse_file_info* fi)
 {
 	return (struct exfat_node*) (size_t) fi->fh;
@@ -358,6 +363,9 @@ static void* fuse_exfat_init(struct fuse_conn_info* fci)
 	exfat_debug("[%s]", __func__);
 #ifdef FUSE_CAP_BIG_WRITES
 	fci->want |= FUSE_CAP_BIG_WRITES;
+#endif
+#ifdef FUSE_CAP_ASYNC_READ
+	fci->want |= FUSE_CAP_ASYNC_READ;
 #endif
 	return NULL;
 }
@@ -370,32 +378,70 @@ static void fuse_exfat_destroy(void* unused)
 
 static void usage(const char* prog)
 {
-	fprintf(stderr, "Usage: %s [-d] [-o options] [-V] <device> <dir>\n", prog);
+	fprintf(stderr, "Usage: %s [-d] [-o options] [-t threads] [-V] "
+			"<device> <dir>\n", prog);
 	exit(1);
 }
 
+#define LOCKED_OP(name, params, args) \
+	static int locked_##name params \
+	{ \
+		int rc; \
+		pthread_mutex_lock(&ef_lock); \
+		rc = fuse_exfat_##name args; \
+		pthread_mutex_unlock(&ef_lock); \
+		return rc; \
+	}
+
+LOCKED_OP(getattr, (const char* path, struct stat* stbuf), (path, stbuf))
+LOCKED_OP(truncate, (const char* path, loff_t size), (path, size))
+LOCKED_OP(readdir, (const char* path, void* buffer, fuse_fill_dir_t filler,
+		loff_t offset, struct fuse_file_info* fi),
+		(path, buffer, filler, offset, fi))
+LOCKED_OP(open, (const char* path, struct fuse_file_info* fi), (path, fi))
+LOCKED_OP(create, (const char* path, mode_t mode, struct fuse_file_info* fi),
+		(path, mode, fi))
+LOCKED_OP(release, (const char* path, struct fuse_file_info* fi), (path, fi))
+LOCKED_OP(flush, (const char* path, struct fuse_file_info* fi), (path, fi))
+LOCKED_OP(fsync, (const char* path, int datasync, struct fuse_file_info* fi),
+		(path, datasync, fi))
+LOCKED_OP(read, (const char* path, char* buffer, size_t size, loff_t offset,
+		struct fuse_file_info* fi), (path, buffer, size, offset, fi))
+LOCKED_OP(write, (const char* path, const char* buffer, size_t size,
+		loff_t offset, struct fuse_file_info* fi),
+		(path, buffer, size, offset, fi))
+LOCKED_OP(unlink, (const char* path), (path))
+LOCKED_OP(rmdir, (const char* path), (path))
+LOCKED_OP(mknod, (const char* path, mode_t mode, dev_t dev), (path, mode, dev))
+LOCKED_OP(mkdir, (const char* path, mode_t mode), (path, mode))
+LOCKED_OP(rename, (const char* old_path, const char* new_path),
+		(old_path, new_path))
+LOCKED_OP(utimens, (const char* path, const struct timespec tv[2]), (path, tv))
+LOCKED_OP(statfs, (const char* path, struct statvfs* sfs), (path, sfs))
+
+/* chmod and chown only validate their arguments and need no lock */
 static struct fuse_operations fuse_exfat_ops =
 {
-	.getattr	= fuse_exfat_getattr,
-	.truncate	= fuse_exfat_truncate,
-	.readdir	= fuse_exfat_readdir,
-	.open		= fuse_exfat_open,
-	.create		= fuse_exfat_create,
-	.release	= fuse_exfat_release,
-	.flush		= fuse_exfat_flush,
-	.fsync		= fuse_exfat_fsync,
-	.fsyncdir	= fuse_exfat_fsync,
-	.read		= fuse_exfat_read,
-	.write		= fuse_exfat_write,
-	.unlink		= fuse_exfat_unlink,
-	.rmdir		= fuse_exfat_rmdir,
-	.mknod		= fuse_exfat_mknod,
-	.mkdir		= fuse_exfat_mkdir,
-	.rename		= fuse_exfat_rename,
-	.utimens	= fuse_exfat_utimens,
+	.getattr	= locked_getattr,
+	.truncate	= locked_truncate,
+	.readdir	= locked_readdir,
+	.open		= locked_open,
+	.create		= locked_create,
+	.release	= locked_release,
+	.flush		= locked_flush,
+	.fsync		= locked_fsync,
+	.fsyncdir	= locked_fsync,
+	.read		= locked_read,
+	.write		= locked_write,
+	.unlink		= locked_unlink,
+	.rmdir		= locked_rmdir,
+	.mknod		= locked_mknod,
+	.mkdir		= locked_mkdir,
+	.rename		= locked_rename,
+	.utimens	= locked_utimens,
 	.chmod		= fuse_exfat_chmod,
 	.chown		= fuse_exfat_chown,
-	.statfs		= fuse_exfat_statfs,
+	.statfs		= locked_statfs,
 	.init		= fuse_exfat_init,
 	.destroy	= fuse_exfat_destroy,
 };
@@ -479,6 +525,7 @@ int main(int argc, char* argv[])
 	const char* mount_point = NULL;
 	char* mount_options;
 	int debug = 0;
+	int threads = 1;
 	struct fuse_chan* fc = NULL;
 	struct fuse* fh = NULL;
 	int opt;
@@ -492,7 +539,7 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	while ((opt = getopt(argc, argv, "dno:Vv")) != -1)
+	while ((opt = getopt(argc, argv, "dno:t:Vv")) != -1)
 	{
 		switch (opt)
 		{
@@ -506,6 +553,14 @@ int main(int argc, char* argv[])
 			if (mount_options == NULL)
 				return 1;
 			break;
+		case 't':
+			threads = atoi(optarg);
+			if (threads < 1)
+			{
+				free(mount_options);
+				usage(argv[0]);
+			}
+			break;
 		case 'V':
 			free(mount_options);
 			puts("Copyright (C) 2010-2015  Andrew Nayenko");
@@ -604,7 +659,14 @@ int main(int argc, char* argv[])
 	   main loop */
 	if (fuse_daemonize(debug) == 0)
 	{
-		if (fuse_loop(fh) != 0)
+		/* with more than one thread requests are received and replied to
+		   in parallel while libexfat itself stays behind ef_lock */
+		if (threads > 1)
+		{
+			if (fuse_loop_mt_max(fh, threads) != 0)
+				exfat_error("FUSE loop failure");
+		}
+		else if (fuse_loop(fh) != 0)
 			exfat_error("FUSE loop failure");
 	}
 	else
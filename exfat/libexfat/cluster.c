@@ -111,29 +111,55 @@ cluster_t exfat_advance_cluster(const struct exfat* ef,
 	return node->fptr_cluster;
 }
 
-static cluster_t find_bit_and_set(bitmap_t* bitmap, size_t start, size_t end)
+#define BMAP_BITS (sizeof(bitmap_t) * 8)
+#define BMAP_FULL (~(bitmap_t) 0)
+
+/*
+ * Returns the index of the first bit equal to value in [start, end), or end
+ * if there is none. Whole words are checked at once, four at a time over
+ * long stretches of full (or empty) ones.
+ */
+static size_t find_bit(const bitmap_t* bitmap, size_t start, size_t end,
+		bool value)
 {
-	const size_t start_index = start / sizeof(bitmap_t) / 8;
-	const size_t end_index = DIV_ROUND_UP(end, sizeof(bitmap_t) * 8);
-	size_t i;
-	size_t start_bitindex;
-	size_t end_bitindex;
-	size_t c;
-
-	for (i = start_index; i < end_index; i++)
+	/* flipped so that the bit looked for is always a zero */
+	const bitmap_t flip = value ? BMAP_FULL : 0;
+	const size_t end_index = DIV_ROUND_UP(end, BMAP_BITS);
+	size_t i = start / BMAP_BITS;
+	bitmap_t word;
+
+	if (start >= end)
+		return end;
+	/* the bits below start don't count */
+	word = (bitmap[i] ^ flip) | (BMAP_MASK(start) - 1);
+	for (;;)
 	{
-		if (bitmap[i] == ~((bitmap_t) 0))
-			continue;
-		start_bitindex = MAX(i * sizeof(bitmap_t) * 8, start);
-		end_bitindex = MIN((i + 1) * sizeof(bitmap_t) * 8, end);
-		for (c = start_bitindex; c < end_bitindex; c++)
-			if (BMAP_GET(bitmap, c) == 0)
-			{
-				BMAP_SET(bitmap, c);
-				return c + EXFAT_FIRST_DATA_CLUSTER;
-			}
+		if (word != BMAP_FULL)
+		{
+			/* lowest zero bit of the word */
+			size_t c = i * BMAP_BITS +
+					__builtin_ctzll(~(unsigned long long) word);
+			return MIN(c, end);
+		}
+		for (i++; i + 4 <= end_index; i += 4)
+			if (((bitmap[i] ^ flip) & (bitmap[i + 1] ^ flip) &
+					(bitmap[i + 2] ^ flip) & (bitmap[i + 3] ^ flip))
+					!= BMAP_FULL)
+				break;
+		if (i >= end_index)
+			return end;
+		word = bitmap[i] ^ flip;
 	}
-	return EXFAT_CLUSTER_END;
+}
+
+static void set_bits(bitmap_t* bitmap, size_t start, size_t count)
+{
+	for (; count != 0 && start % BMAP_BITS != 0; start++, count--)
+		BMAP_SET(bitmap, start);
+	for (; count >= BMAP_BITS; start += BMAP_BITS, count -= BMAP_BITS)
+		bitmap[BMAP_BLOCK(start)] = BMAP_FULL;
+	for (; count != 0; start++, count--)
+		BMAP_SET(bitmap, start);
 }
 
 static int flush_nodes(struct exfat* ef, struct exfat_node* node)
@@ -191,25 +217,43 @@ static bool set_next_cluster(const struct exfat* ef, bool contiguous,
 	return true;
 }
 
-static cluster_t allocate_cluster(struct exfat* ef, cluster_t hint)
+/*
+ * Allocates the free run of up to wanted clusters that starts nearest after
+ * hint, wrapping around to the beginning. Returns the first cluster and the
+ * length of the run in count.
+ */
+static cluster_t allocate_clusters(struct exfat* ef, cluster_t hint,
+		uint32_t wanted, uint32_t* count)
 {
-	cluster_t cluster;
+	const size_t size = ef->cmap.chunk_size;
+	size_t start;
+	size_t end;
 
 	hint -= EXFAT_FIRST_DATA_CLUSTER;
-	if (hint >= ef->cmap.chunk_size)
+	if (hint >= size)
 		hint = 0;
+	/* nothing below first_free to find, so don't look there again */
+	if (hint < ef->cmap.first_free)
+		hint = ef->cmap.first_free;
 
-	cluster = find_bit_and_set(ef->cmap.chunk, hint, ef->cmap.chunk_size);
-	if (cluster == EXFAT_CLUSTER_END)
-		cluster = find_bit_and_set(ef->cmap.chunk, 0, hint);
-	if (cluster == EXFAT_CLUSTER_END)
+	start = find_bit(ef->cmap.chunk, hint, size, false);
+	if (start == size)
 	{
-		exfat_error("no free space left");
-		return EXFAT_CLUSTER_END;
+		start = find_bit(ef->cmap.chunk, ef->cmap.first_free, hint, false);
+		if (start == hint)
+		{
+			exfat_error("no free space left");
+			return EXFAT_CLUSTER_END;
+		}
 	}
+	end = find_bit(ef->cmap.chunk, start, MIN(start + wanted, size), true);
 
+	set_bits(ef->cmap.chunk, start, end - start);
+	if (start == ef->cmap.first_free)
+		ef->cmap.first_free = end;
 	ef->cmap.dirty = true;
-	return cluster;
+	*count = end - start;
+	return start + EXFAT_FIRST_DATA_CLUSTER;
 }
 
 static void free_cluster(struct exfat* ef, cluster_t cluster)
@@ -221,17 +265,37 @@ static void free_cluster(struct exfat* ef, cluster_t cluster)
 				ef->cmap.size);
 
 	BMAP_CLR(ef->cmap.chunk, cluster - EXFAT_FIRST_DATA_CLUSTER);
+	if (cluster - EXFAT_FIRST_DATA_CLUSTER < ef->cmap.first_free)
+		ef->cmap.first_free = cluster - EXFAT_FIRST_DATA_CLUSTER;
 	ef->cmap.dirty = true;
 }
 
 static bool make_noncontiguous(const struct exfat* ef, cluster_t first,
 		cluster_t last)
 {
-	cluster_t c;
+	/* the FAT entries of a run of clusters are next to each other, so write
+	   them in blocks rather than one by one */
+	le32_t chain[1024];
+	loff_t fat_offset;
+	uint32_t count;
+	uint32_t i;
 
-	for (c = first; c < last; c++)
-		if (!set_next_cluster(ef, false, c, c + 1))
+	while (first < last)
+	{
+		count = MIN(last - first, sizeof(chain) / sizeof(chain[0]));
+		for (i = 0; i < count; i++)
+			chain[i] = cpu_to_le32(first + i + 1);
+		fat_offset = s2o(ef, le32_to_cpu(ef->sb->fat_sector_start))
+			+ first * sizeof(cluster_t);
+		if (exfat_pwrite(ef->dev, chain, count * sizeof(le32_t),
+				fat_offset) < 0)
+		{
+			exfat_error("failed to write the chain of %u clusters after %#x",
+					count, first);
 			return false;
+		}
+		first += count;
+	}
 	return true;
 }
 
@@ -244,6 +308,7 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 	cluster_t previous;
 	cluster_t next;
 	uint32_t allocated = 0;
+	uint32_t count;
 
 	if (difference == 0)
 		exfat_bug("zero clusters count passed");
@@ -263,26 +328,28 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 		if (node->fptr_index != 0)
 			exfat_bug("non-zero pointer index (%u)", node->fptr_index);
 		/* file does not have clusters (i.e. is empty), allocate
-		   the first one for it */
-		previous = allocate_cluster(ef, 0);
+		   the first run for it */
+		previous = allocate_clusters(ef, 0, difference, &count);
 		if (CLUSTER_INVALID(previous))
 			return -ENOSPC;
 		node->fptr_cluster = node->start_cluster = previous;
-		allocated = 1;
-		/* file consists of only one cluster, so it's contiguous */
+		previous += count - 1;
+		allocated = count;
+		/* file consists of only one run, so it's contiguous */
 		node->flags |= EXFAT_ATTRIB_CONTIGUOUS;
 	}
 
 	while (allocated < difference)
 	{
-		next = allocate_cluster(ef, previous + 1);
+		next = allocate_clusters(ef, previous + 1, difference - allocated,
+				&count);
 		if (CLUSTER_INVALID(next))
 		{
 			if (allocated != 0)
 				shrink_file(ef, node, current + allocated, allocated);
 			return -ENOSPC;
 		}
-		if (next != previous - 1 && IS_CONTIGUOUS(*node))
+		if (next != previous + 1 && IS_CONTIGUOUS(*node))
 		{
 			/* it's a pity, but we are not able to keep the file contiguous
 			   anymore */
@@ -293,8 +360,10 @@ static int grow_file(struct exfat* ef, struct exfat_node* node,
 		}
 		if (!set_next_cluster(ef, IS_CONTIGUOUS(*node), previous, next))
 			return -EIO;
-		previous = next;
-		allocated++;
+		previous = next + count - 1;
+		if (!IS_CONTIGUOUS(*node) && !make_noncontiguous(ef, next, previous))
+			return -EIO;
+		allocated += count;
 	}
 
 	if (!set_next_cluster(ef, IS_CONTIGUOUS(*node), previous,
@@ -443,7 +512,10 @@ uint32_t exfat_count_free_clusters(const struct exfat* ef)
 	uint32_t free_clusters = 0;
 	uint32_t i;
 
-	for (i = 0; i < ef->cmap.size; i++)
+	for (i = 0; i + BMAP_BITS <= ef->cmap.size; i += BMAP_BITS)
+		free_clusters += BMAP_BITS -
+				__builtin_popcountll(ef->cmap.chunk[BMAP_BLOCK(i)]);
+	for (; i < ef->cmap.size; i++)
 		if (BMAP_GET(ef->cmap.chunk, i) == 0)
 			free_clusters++;
 	return free_clusters;
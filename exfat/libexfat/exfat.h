@@ -110,6 +110,7 @@ struct exfat
 		uint32_t size;				/* in bits */
 		bitmap_t* chunk;
 		uint32_t chunk_size;		/* in bits */
+		uint32_t first_free;		/* all clusters below are in use */
 		bool dirty;
 	}
 	cmap;
@@ -145,6 +146,7 @@ void exfat_debug(const char* format, ...) PRINTF;
 struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode);
 int exfat_close(struct exfat_dev* dev);
 int exfat_fsync(struct exfat_dev* dev);
+int exfat_discard(struct exfat_dev* dev);
 enum exfat_mode exfat_get_mode(const struct exfat_dev* dev);
 loff_t exfat_get_size(const struct exfat_dev* dev);
 loff_t exfat_seek(struct exfat_dev* dev, loff_t offset, int whence);
@@ -42,14 +42,36 @@
 #include <ublio.h>
 #endif
 
+#ifndef USE_UBLIO
+/*
+ * I/Os smaller than a block (FAT entries, directory entries, sectors from
+ * mkfs) go through a write-back cache of 4k blocks, so that each of them
+ * doesn't cost a trip to the card. Block b lives in slot b % CACHE_SLOTS.
+ * A read miss right after the blocks read on the previous one reads the
+ * aligned 64k around the block, so walking the FAT or a directory takes one
+ * I/O per 16k FAT entries. Clusters are read and written whole and go
+ * straight to the device, so file data doesn't push the FAT out.
+ */
+#define CACHE_BLOCK_BITS 12
+#define CACHE_BLOCK (1 << CACHE_BLOCK_BITS)
+#define CACHE_SLOTS 512
+#define CACHE_READAHEAD 16
+#endif
+
 struct exfat_dev
 {
 	int fd;
 	enum exfat_mode mode;
 	loff_t size; /* in bytes */
-#ifdef USE_UBLIO
 	loff_t pos;
+#ifdef USE_UBLIO
 	ublio_filehandle_t ufh;
+#else
+	char* cache;			/* CACHE_SLOTS blocks */
+	char* readahead;		/* CACHE_READAHEAD blocks */
+	loff_t* cached;			/* block in each slot, -1 if none */
+	bool* dirty;
+	loff_t read_end;		/* block after the last ones read in */
 #endif
 };
 
@@ -78,6 +100,240 @@ static int open_rw(const char* spec)
 	return fd;
 }
 
+#ifndef USE_UBLIO
+static int cache_init(struct exfat_dev* dev)
+{
+	size_t i;
+
+	dev->cache = malloc(CACHE_SLOTS * CACHE_BLOCK);
+	dev->readahead = malloc(CACHE_READAHEAD * CACHE_BLOCK);
+	dev->cached = malloc(CACHE_SLOTS * sizeof(loff_t));
+	dev->dirty = calloc(CACHE_SLOTS, sizeof(bool));
+	if (dev->cache == NULL || dev->readahead == NULL || dev->cached == NULL ||
+			dev->dirty == NULL)
+		return -ENOMEM;
+	for (i = 0; i < CACHE_SLOTS; i++)
+		dev->cached[i] = -1;
+	dev->read_end = -1;
+	return 0;
+}
+
+static void cache_free(struct exfat_dev* dev)
+{
+	free(dev->cache);
+	free(dev->readahead);
+	free(dev->cached);
+	free(dev->dirty);
+}
+
+static char* slot_data(const struct exfat_dev* dev, size_t slot)
+{
+	return dev->cache + (size_t) slot * CACHE_BLOCK;
+}
+
+/* Writes count dirty slots holding consecutive blocks, the last block of the
+   device may be partial */
+static int write_slots(struct exfat_dev* dev, size_t slot, size_t count)
+{
+	const loff_t offset = dev->cached[slot] << CACHE_BLOCK_BITS;
+	const size_t size = MIN((loff_t) count * CACHE_BLOCK, dev->size - offset);
+	size_t i;
+
+	if (pwrite64(dev->fd, slot_data(dev, slot), size, offset) != size)
+	{
+		exfat_error("failed to write %zu bytes at %"PRId64, size, offset);
+		return -EIO;
+	}
+	for (i = 0; i < count; i++)
+		dev->dirty[slot + i] = false;
+	return 0;
+}
+
+static int cache_flush(struct exfat_dev* dev)
+{
+	size_t slot = 0;
+	size_t count;
+	int rc;
+
+	while (slot < CACHE_SLOTS)
+	{
+		if (!dev->dirty[slot])
+		{
+			slot++;
+			continue;
+		}
+		/* blocks next to each other sit in slots next to each other, write
+		   them together */
+		for (count = 1; slot + count < CACHE_SLOTS; count++)
+			if (!dev->dirty[slot + count] ||
+					dev->cached[slot + count] != dev->cached[slot] + count)
+				break;
+		rc = write_slots(dev, slot, count);
+		if (rc != 0)
+			return rc;
+		slot += count;
+	}
+	return 0;
+}
+
+/* Makes the slot of a block free for another one */
+static int evict(struct exfat_dev* dev, size_t slot, loff_t block)
+{
+	if (dev->cached[slot] != block && dev->dirty[slot])
+		return write_slots(dev, slot, 1);
+	return 0;
+}
+
+/* Returns the slot with the block in it, reading it first if needed. Only
+   sequential reads read ahead, a write only needs the block it changes. */
+static ssize_t cache_get(struct exfat_dev* dev, loff_t block, bool read)
+{
+	const bool ahead = read && block == dev->read_end;
+	const size_t count = ahead ? CACHE_READAHEAD : 1;
+	const loff_t first = block - block % count;
+	const loff_t offset = first << CACHE_BLOCK_BITS;
+	const size_t size = count * CACHE_BLOCK;
+	ssize_t result;
+	size_t i;
+
+	if (dev->cached[block % CACHE_SLOTS] == block)
+		return block % CACHE_SLOTS;
+	if (read)
+		dev->read_end = first + count;
+
+	result = pread64(dev->fd, dev->readahead, size, offset);
+	if (result < 0)
+	{
+		exfat_error("failed to read %zu bytes at %"PRId64, size, offset);
+		return -EIO;
+	}
+	/* past the end of the device */
+	memset(dev->readahead + result, 0, size - result);
+	for (i = 0; i < count; i++)
+	{
+		const size_t slot = (first + i) % CACHE_SLOTS;
+
+		/* a cached block may be newer than the device */
+		if (dev->cached[slot] == first + i)
+			continue;
+		if (evict(dev, slot, first + i) != 0)
+			return -EIO;
+		memcpy(slot_data(dev, slot), dev->readahead + i * CACHE_BLOCK,
+				CACHE_BLOCK);
+		dev->cached[slot] = first + i;
+	}
+	return block % CACHE_SLOTS;
+}
+
+static ssize_t cache_pread(struct exfat_dev* dev, void* buffer, size_t size,
+		loff_t offset)
+{
+	char* bufp = buffer;
+	size_t remainder = size;
+
+	if (size >= CACHE_BLOCK)
+	{
+		ssize_t result = pread64(dev->fd, buffer, size, offset);
+		loff_t block;
+
+		if (result <= 0)
+			return result;
+		/* cached blocks are the newest version of their part */
+		for (block = offset >> CACHE_BLOCK_BITS;
+				block << CACHE_BLOCK_BITS < offset + result; block++)
+		{
+			const size_t slot = block % CACHE_SLOTS;
+			const loff_t start = MAX(block << CACHE_BLOCK_BITS, offset);
+			const loff_t end = MIN((block + 1) << CACHE_BLOCK_BITS,
+					offset + result);
+
+			if (dev->cached[slot] == block && dev->dirty[slot])
+				memcpy(bufp + (start - offset), slot_data(dev, slot)
+						+ (start & (CACHE_BLOCK - 1)), end - start);
+		}
+		return result;
+	}
+
+	while (remainder > 0)
+	{
+		const size_t in = offset & (CACHE_BLOCK - 1);
+		const size_t n = MIN(CACHE_BLOCK - in, remainder);
+		const ssize_t slot = cache_get(dev, offset >> CACHE_BLOCK_BITS, true);
+
+		if (slot < 0)
+			return -1;
+		memcpy(bufp, slot_data(dev, slot) + in, n);
+		bufp += n;
+		offset += n;
+		remainder -= n;
+	}
+	return size;
+}
+
+static ssize_t cache_pwrite(struct exfat_dev* dev, const void* buffer,
+		size_t size, loff_t offset)
+{
+	const char* bufp = buffer;
+	size_t remainder = size;
+
+	/* the boot sector holds the volume dirty flag, everything before it has
+	   to be on the device when it changes */
+	if (offset < CACHE_BLOCK && cache_flush(dev) != 0)
+		return -1;
+
+	if (size >= CACHE_BLOCK || offset < CACHE_BLOCK)
+	{
+		ssize_t result = pwrite64(dev->fd, buffer, size, offset);
+		loff_t block;
+
+		if (result <= 0)
+			return result;
+		/* keep cached copies of what was written up to date */
+		for (block = offset >> CACHE_BLOCK_BITS;
+				block << CACHE_BLOCK_BITS < offset + result; block++)
+		{
+			const size_t slot = block % CACHE_SLOTS;
+			const loff_t start = MAX(block << CACHE_BLOCK_BITS, offset);
+			const loff_t end = MIN((block + 1) << CACHE_BLOCK_BITS,
+					offset + result);
+
+			if (dev->cached[slot] == block)
+				memcpy(slot_data(dev, slot) + (start & (CACHE_BLOCK - 1)),
+						bufp + (start - offset), end - start);
+		}
+		return result;
+	}
+
+	while (remainder > 0)
+	{
+		const loff_t block = offset >> CACHE_BLOCK_BITS;
+		const size_t in = offset & (CACHE_BLOCK - 1);
+		const size_t n = MIN(CACHE_BLOCK - in, remainder);
+		ssize_t slot = block % CACHE_SLOTS;
+
+		if (n == CACHE_BLOCK)
+		{
+			/* the whole block is replaced, no need to read it */
+			if (evict(dev, slot, block) != 0)
+				return -1;
+			dev->cached[slot] = block;
+		}
+		else
+		{
+			slot = cache_get(dev, block, false);
+			if (slot < 0)
+				return -1;
+		}
+		memcpy(slot_data(dev, slot) + in, bufp, n);
+		dev->dirty[slot] = true;
+		bufp += n;
+		offset += n;
+		remainder -= n;
+	}
+	return size;
+}
+#endif
+
 struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
 {
 	struct exfat_dev* dev;
@@ -238,6 +494,16 @@ struct exfat_dev* exfat_open(const char* spec, enum exfat_mode mode)
 		exfat_error("failed to initialize ublio");
 		return NULL;
 	}
+#else
+	dev->pos = 0;
+	if (cache_init(dev) != 0)
+	{
+		cache_free(dev);
+		close(dev->fd);
+		free(dev);
+		exfat_error("failed to allocate memory for the block cache");
+		return NULL;
+	}
 #endif
 
 	return dev;
@@ -253,6 +519,10 @@ int exfat_close(struct exfat_dev* dev)
 		exfat_error("failed to close ublio");
 		rc = -EIO;
 	}
+#else
+	if (cache_flush(dev) != 0)
+		rc = -EIO;
+	cache_free(dev);
 #endif
 	if (close(dev->fd) != 0)
 	{
@@ -273,6 +543,10 @@ int exfat_fsync(struct exfat_dev* dev)
 		exfat_error("ublio fsync failed");
 		rc = -EIO;
 	}
+#else
+	/* the cache is written back here and on close, nowhere else */
+	if (cache_flush(dev) != 0)
+		rc = -EIO;
 #endif
 	if (fsync(dev->fd) != 0)
 	{
@@ -282,6 +556,51 @@ int exfat_fsync(struct exfat_dev* dev)
 	return rc;
 }
 
+/*
+	Tells the device that all of it is free. Flash erases its blocks ahead of
+	the writes that follow, so formatting a card costs little more than the
+	metadata it writes. Nothing can be assumed about what discarded blocks
+	read back.
+*/
+int exfat_discard(struct exfat_dev* dev)
+{
+	struct stat stbuf;
+#ifndef USE_UBLIO
+	size_t i;
+
+	/* whatever is cached is gone along with the device contents */
+	for (i = 0; i < CACHE_SLOTS; i++)
+	{
+		dev->cached[i] = -1;
+		dev->dirty[i] = false;
+	}
+	dev->read_end = -1;
+#endif
+
+	if (fstat(dev->fd, &stbuf) != 0)
+		return -errno;
+#if defined(__linux__) && defined(BLKDISCARD)
+	if (S_ISBLK(stbuf.st_mode))
+	{
+		uint64_t range[2] = {0, dev->size};
+
+		if (ioctl(dev->fd, BLKDISCARD, range) != 0)
+			return -errno;
+		return 0;
+	}
+#endif
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+	if (S_ISREG(stbuf.st_mode))
+	{
+		if (fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				0, dev->size) != 0)
+			return -errno;
+		return 0;
+	}
+#endif
+	return -EOPNOTSUPP;
+}
+
 enum exfat_mode exfat_get_mode(const struct exfat_dev* dev)
 {
 	return dev->mode;
@@ -298,7 +617,13 @@ loff_t exfat_seek(struct exfat_dev* dev, loff_t offset, int whence)
 	/* XXX SEEK_CUR will be handled incorrectly */
 	return dev->pos = lseek(dev->fd, offset, whence);
 #else
-	return lseek64(dev->fd, offset, whence);
+	/* reads and writes don't move the descriptor's position */
+	if (whence == SEEK_CUR)
+	{
+		offset += dev->pos;
+		whence = SEEK_SET;
+	}
+	return dev->pos = lseek64(dev->fd, offset, whence);
 #endif
 }
 
@@ -310,7 +635,10 @@ ssize_t exfat_read(struct exfat_dev* dev, void* buffer, size_t size)
 		dev->pos += size;
 	return result;
 #else
-	return read(dev->fd, buffer, size);
+	ssize_t result = cache_pread(dev, buffer, size, dev->pos);
+	if (result > 0)
+		dev->pos += result;
+	return result;
 #endif
 }
 
@@ -322,7 +650,10 @@ ssize_t exfat_write(struct exfat_dev* dev, const void* buffer, size_t size)
 		dev->pos += size;
 	return result;
 #else
-	return write(dev->fd, buffer, size);
+	ssize_t result = cache_pwrite(dev, buffer, size, dev->pos);
+	if (result > 0)
+		dev->pos += result;
+	return result;
 #endif
 }
 
@@ -332,7 +663,7 @@ ssize_t exfat_pread(struct exfat_dev* dev, void* buffer, size_t size,
 #ifdef USE_UBLIO
 	return ublio_pread(dev->ufh, buffer, size, offset);
 #else
-	return pread64(dev->fd, buffer, size, offset);
+	return cache_pread(dev, buffer, size, offset);
 #endif
 }
 
@@ -342,7 +673,7 @@ ssize_t exfat_pwrite(struct exfat_dev* dev, const void* buffer, size_t size,
 #ifdef USE_UBLIO
 	return ublio_pwrite(dev->ufh, buffer, size, offset);
 #else
-	return pwrite64(dev->fd, buffer, size, offset);
+	return cache_pwrite(dev, buffer, size, offset);
 #endif
 }
 
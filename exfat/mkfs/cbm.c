@@ -29,7 +29,7 @@
 
 static loff_t cbm_alignment(void)
 {
-	return get_cluster_size();
+	return MAX(get_cluster_size(), get_erase_size());
 }
 
 static loff_t cbm_size(void)
@@ -28,7 +28,7 @@
 
 static loff_t fat_alignment(void)
 {
-	return (loff_t) 128 * get_sector_size();
+	return MAX((loff_t) 128 * get_sector_size(), get_erase_size());
 }
 
 static loff_t fat_size(void)
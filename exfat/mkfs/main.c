@@ -28,6 +28,8 @@
 #include "rootdir.h"
 #include <exfat.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <inttypes.h>
@@ -55,6 +57,8 @@ static struct
 	le16_t volume_label[EXFAT_ENAME_MAX + 1];
 	uint32_t volume_serial;
 	uint64_t first_sector;
+	loff_t erase_size;		/* of the card, 0 if unknown or not used */
+	loff_t erase_offset;	/* where the partition starts in an erase block */
 }
 param;
 
@@ -88,6 +92,16 @@ uint64_t get_first_sector(void)
 	return param.first_sector;
 }
 
+loff_t get_erase_size(void)
+{
+	return param.erase_size;
+}
+
+loff_t get_erase_offset(void)
+{
+	return param.erase_offset;
+}
+
 int get_sector_size(void)
 {
 	return 1 << get_sector_bits();
@@ -154,9 +168,68 @@ static uint32_t setup_volume_serial(uint32_t user_defined)
 	return (now.tv_sec << 20) | now.tv_usec;
 }
 
-static int setup(struct exfat_dev* dev, int sector_bits, int spc_bits,
-		const char* volume_label, uint32_t volume_serial,
-		uint64_t first_sector)
+static unsigned long long read_sysfs(const char* path)
+{
+	FILE* f = fopen(path, "r");
+	unsigned long long value = 0;
+
+	if (f == NULL)
+		return 0;
+	if (fscanf(f, "%llu", &value) != 1)
+		value = 0;
+	fclose(f);
+	return value;
+}
+
+/*
+	SD and MMC cards tell their erase block size in sysfs. The FAT and the
+	clusters heap are put on erase blocks of the card, so that no cluster
+	straddles two of them.
+*/
+static void setup_erase_size(const char* spec, uint64_t first_sector)
+{
+	struct stat stbuf;
+	char path[128];
+	unsigned long long erase_size, start;
+
+	param.erase_size = 0;
+	param.erase_offset = 0;
+	if (stat(spec, &stbuf) != 0 || !S_ISBLK(stbuf.st_mode))
+		return;
+
+	snprintf(path, sizeof(path),
+			"/sys/dev/block/%u:%u/device/preferred_erase_size",
+			major(stbuf.st_rdev), minor(stbuf.st_rdev));
+	erase_size = read_sysfs(path);
+	if (erase_size == 0)
+	{
+		/* a partition, the card is its parent */
+		snprintf(path, sizeof(path),
+				"/sys/dev/block/%u:%u/../device/preferred_erase_size",
+				major(stbuf.st_rdev), minor(stbuf.st_rdev));
+		erase_size = read_sysfs(path);
+	}
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/start",
+			major(stbuf.st_rdev), minor(stbuf.st_rdev));
+	start = read_sysfs(path);
+	if (start == 0)
+		start = first_sector;
+
+	if (erase_size < (unsigned long long) get_cluster_size() ||
+			erase_size > 64 * 1024 * 1024 ||
+			(erase_size & (erase_size - 1)) != 0 ||
+			erase_size * 16 > (unsigned long long) param.volume_size)
+		return;
+	/* the heap has to stay aligned to clusters within the volume */
+	if (start * 512 % erase_size % get_cluster_size() != 0)
+		return;
+	param.erase_size = erase_size;
+	param.erase_offset = start * 512 % erase_size;
+}
+
+static int setup(struct exfat_dev* dev, const char* spec, int sector_bits,
+		int spc_bits, const char* volume_label, uint32_t volume_serial,
+		uint64_t first_sector, bool fast)
 {
 	param.sector_bits = sector_bits;
 	param.first_sector = first_sector;
@@ -166,6 +239,17 @@ static int setup(struct exfat_dev* dev, int sector_bits, int spc_bits,
 	if (param.spc_bits == -1)
 		return 1;
 
+	if (fast)
+	{
+		setup_erase_size(spec, first_sector);
+		fputs("Discarding... ", stdout);
+		fflush(stdout);
+		if (exfat_discard(dev) != 0)
+			puts("not supported.");
+		else
+			puts("done.");
+	}
+
 	if (setup_volume_label(param.volume_label, volume_label) != 0)
 		return 1;
 
@@ -190,7 +274,7 @@ static void usage(const char* prog)
 {
 	fprintf(stderr, "Usage: %s [-i volume-id] [-n label] "
 			"[-p partition-first-sector] "
-			"[-s sectors-per-cluster] [-V] <device>\n", prog);
+			"[-s sectors-per-cluster] [-f] [-V] <device>\n", prog);
 	exit(1);
 }
 
@@ -202,11 +286,12 @@ int main(int argc, char* argv[])
 	const char* volume_label = NULL;
 	uint32_t volume_serial = 0;
 	uint64_t first_sector = 0;
+	bool fast = false;
 	struct exfat_dev* dev;
 
 	printf("mkexfatfs %s\n", VERSION);
 
-	while ((opt = getopt(argc, argv, "i:n:p:s:V")) != -1)
+	while ((opt = getopt(argc, argv, "i:n:p:s:fV")) != -1)
 	{
 		switch (opt)
 		{
@@ -227,6 +312,9 @@ int main(int argc, char* argv[])
 				return 1;
 			}
 			break;
+		case 'f':
+			fast = true;
+			break;
 		case 'V':
 			puts("Copyright (C) 2011-2015  Andrew Nayenko");
 			return 0;
@@ -242,8 +330,8 @@ int main(int argc, char* argv[])
 	dev = exfat_open(spec, EXFAT_MODE_RW);
 	if (dev == NULL)
 		return 1;
-	if (setup(dev, 9, spc_bits, volume_label, volume_serial,
-				first_sector) != 0)
+	if (setup(dev, spec, 9, spc_bits, volume_label, volume_serial,
+				first_sector, fast) != 0)
 	{
 		exfat_close(dev);
 		return 1;
@@ -27,6 +27,16 @@
 #include <stdio.h>
 #include <string.h>
 
+loff_t align_position(loff_t position, loff_t alignment)
+{
+	loff_t offset = 0;
+
+	/* erase blocks are counted from the start of the card, not the volume */
+	if (get_erase_size() != 0 && alignment % get_erase_size() == 0)
+		offset = get_erase_offset();
+	return ROUND_UP(position + offset, alignment) - offset;
+}
+
 static int check_size(loff_t volume_size)
 {
 	const struct fs_object** pp;
@@ -34,7 +44,7 @@ static int check_size(loff_t volume_size)
 
 	for (pp = objects; *pp; pp++)
 	{
-		position = ROUND_UP(position, (*pp)->get_alignment());
+		position = align_position(position, (*pp)->get_alignment());
 		position += (*pp)->get_size();
 	}
 
@@ -90,7 +100,7 @@ static int erase(struct exfat_dev* dev)
 
 	for (pp = objects; *pp; pp++)
 	{
-		position = ROUND_UP(position, (*pp)->get_alignment());
+		position = align_position(position, (*pp)->get_alignment());
 		if (erase_object(dev, block, block_size, position,
 				(*pp)->get_size()) != 0)
 		{
@@ -111,7 +121,7 @@ static int create(struct exfat_dev* dev)
 
 	for (pp = objects; *pp; pp++)
 	{
-		position = ROUND_UP(position, (*pp)->get_alignment());
+		position = align_position(position, (*pp)->get_alignment());
 		if (exfat_seek(dev, position, SEEK_SET) == (loff_t) -1)
 		{
 			exfat_error("seek to 0x%"PRIx64" failed", position);
@@ -153,7 +163,7 @@ loff_t get_position(const struct fs_object* object)
 
 	for (pp = objects; *pp; pp++)
 	{
-		position = ROUND_UP(position, (*pp)->get_alignment());
+		position = align_position(position, (*pp)->get_alignment());
 		if (*pp == object)
 			return position;
 		position += (*pp)->get_size();
@@ -40,10 +40,13 @@ loff_t get_volume_size(void);
 const le16_t* get_volume_label(void);
 uint32_t get_volume_serial(void);
 uint64_t get_first_sector(void);
+loff_t get_erase_size(void);
+loff_t get_erase_offset(void);
 int get_sector_size(void);
 int get_cluster_size(void);
 
 int mkfs(struct exfat_dev* dev, loff_t volume_size);
 loff_t get_position(const struct fs_object* object);
+loff_t align_position(loff_t position, loff_t alignment);
 
 #endif /* ifndef MKFS_MKEXFAT_H_INCLUDED */
@@ -54,16 +54,15 @@ static void init_sb(struct exfat_super_block* sb)
 	sb->sector_start = cpu_to_le64(get_first_sector());
 	sb->sector_count = cpu_to_le64(get_volume_size() / get_sector_size());
 	sb->fat_sector_start = cpu_to_le32(
-			fat.get_alignment() / get_sector_size());
+			get_position(&fat) / get_sector_size());
 	sb->fat_sector_count = cpu_to_le32(ROUND_UP(
 			le32_to_cpu(sb->fat_sector_start) + fat_sectors,
 				1 << get_spc_bits()) -
 			le32_to_cpu(sb->fat_sector_start));
 	sb->cluster_sector_start = cpu_to_le32(
 			get_position(&cbm) / get_sector_size());
-	sb->cluster_count = cpu_to_le32(clusters_max -
-			((le32_to_cpu(sb->fat_sector_start) +
-			  le32_to_cpu(sb->fat_sector_count)) >> get_spc_bits()));
+	sb->cluster_count = cpu_to_le32(
+			(get_volume_size() - get_position(&cbm)) / get_cluster_size());
 	sb->rootdir_cluster = cpu_to_le32(
 			(get_position(&rootdir) - get_position(&cbm)) / get_cluster_size()
 			+ EXFAT_FIRST_DATA_CLUSTER);
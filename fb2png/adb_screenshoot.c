@@ -165,7 +165,7 @@ int fb2png(const char* path)
         return -1;
     }
 
-    return fb_save_png(&fb, path);
+    return fb_save_png(&fb, path, 0);
 }
 
 int main(int argc, char *argv[])
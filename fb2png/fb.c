@@ -79,7 +79,7 @@ static int fb_get_format(const struct fb *fb)
     return FB_FORMAT_UNKNOWN;
 }
 
-int fb_save_png(const struct fb *fb, const char *path)
+int fb_save_png(const struct fb *fb, const char *path, int fast)
 {
     char *rgb_matrix;
     int ret = -1;
@@ -124,7 +124,7 @@ int fb_save_png(const struct fb *fb, const char *path)
 
     if (ret != 0)
         D("Error while processing input image.");
-    else if (0 != (ret = save_png(path, rgb_matrix, fb->width, fb->height)))
+    else if (0 != (ret = save_png(path, rgb_matrix, fb->width, fb->height, fast)))
         D("Failed to save in PNG format.");
 
     free(rgb_matrix);
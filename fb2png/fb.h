@@ -38,6 +38,6 @@ struct fb {
 };
 
 void fb_dump(const struct fb* fb);
-int fb_save_png(const struct fb *fb, const char *path);
+int fb_save_png(const struct fb *fb, const char *path, int fast);
 
 #endif
@@ -26,5 +26,5 @@ jint Java_im_kyan_android_graphics_FrameBuffer_captureScreen( JNIEnv *env,
                                           jobject this,
                                           jstring path )
 {
-    return fb2png("/data/local/fbdump.png");
+    return fb2png("/data/local/fbdump.png", 0);
 }
@@ -100,7 +100,7 @@ oops:
     return -1;
 }
 
-int fb2png(const char *path)
+int fb2png(const char *path, int fast)
 {
     struct fb fb;
     int ret;
@@ -118,6 +118,6 @@ int fb2png(const char *path)
 
     fb_dump(&fb);
 
-    return fb_save_png(&fb, path);
+    return fb_save_png(&fb, path, fast);
 }
 
@@ -21,6 +21,6 @@
 #ifndef __FB2PNG_H__
 #define __FB2PNG_H__
 
-int fb2png(const char *path);
+int fb2png(const char *path, int fast);
 
 #endif
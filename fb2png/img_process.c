@@ -19,133 +19,97 @@
  */
 
 #include <errno.h>
+#include <stdint.h>
 #include <png.h>
 
 #include "img_process.h"
 #include "log.h"
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
 int rgb565_to_rgb888(const char* src, char* dst, size_t pixel)
 {
-    struct rgb565  *from;
-    struct rgb888  *to;
-
-    from = (struct rgb565 *) src;
-    to = (struct rgb888 *) dst;
-
-    int i = 0;
-    /* traverse pixel of the row */
-    while(i++ < pixel) {
-
-        to->r = from->r;
-        to->g = from->g;
-        to->b = from->b;
-        /* scale */
-        to->r <<= 3;
-        to->g <<= 2;
-        to->b <<= 3;
-
-        to++;
-        from++;
+    const uint16_t *from = (const uint16_t *) src;
+    uint8_t *to = (uint8_t *) dst;
+    size_t i = 0;
+
+#ifdef __ARM_NEON
+    /* 8 pixels at a time */
+    for (; i + 8 <= pixel; i += 8) {
+        uint16x8_t p = vld1q_u16(from + i);
+        uint8x8x3_t rgb;
+
+        rgb.val[0] = vshl_n_u8(vmovn_u16(vshrq_n_u16(p, 11)), 3);
+        rgb.val[1] = vshl_n_u8(vmovn_u16(vshrq_n_u16(p, 5)), 2);
+        rgb.val[2] = vshl_n_u8(vmovn_u16(p), 3);
+        vst3_u8(to + i * 3, rgb);
     }
-
-    return 0;
-}
-
-int argb8888_to_rgb888(const char* src, char* dst, size_t pixel)
-{
-    int i;
-    struct argb8888  *from;
-    struct rgb888  *to;
-
-    from = (struct argb8888 *) src;
-    to = (struct rgb888 *) dst;
-
-    i = 0;
+#endif
     /* traverse pixel of the row */
-    while(i++ < pixel) {
-
-        to->r = from->r;
-        to->g = from->g;
-        to->b = from->b;
+    for (; i < pixel; i++) {
+        uint16_t p = from[i];
 
-        to++;
-        from++;
+        to[i * 3] = (p >> 11) << 3;
+        to[i * 3 + 1] = (p >> 5) << 2;
+        to[i * 3 + 2] = p << 3;
     }
 
     return 0;
 }
 
-int abgr8888_to_rgb888(const char* src, char* dst, size_t pixel)
-{
-    int i;
-    struct abgr8888  *from;
-    struct rgb888  *to;
-
-    from = (struct abgr8888 *) src;
-    to = (struct rgb888 *) dst;
-
-    i = 0;
-    /* traverse pixel of the row */
-    while(i++ < pixel) {
-
-        to->r = from->r;
-        to->g = from->g;
-        to->b = from->b;
-
-        to++;
-        from++;
-    }
-
-    return 0;
+/*
+ * The 32 bit formats only differ in which bytes of a pixel hold red, green
+ * and blue, r, g and b being their indexes. With NEON 16 pixels are
+ * deinterleaved into byte planes and the three wanted ones stored back
+ * interleaved; otherwise each pixel is picked apart byte by byte.
+ */
+#ifdef __ARM_NEON
+#define DEFINE_TO_RGB888(name, r, g, b)                                 \
+int name(const char* src, char* dst, size_t pixel)                      \
+{                                                                       \
+    const uint8_t *from = (const uint8_t *) src;                        \
+    uint8_t *to = (uint8_t *) dst;                                      \
+    size_t i = 0;                                                       \
+                                                                        \
+    for (; i + 16 <= pixel; i += 16) {                                  \
+        uint8x16x4_t p = vld4q_u8(from + i * 4);                        \
+        uint8x16x3_t rgb;                                               \
+                                                                        \
+        rgb.val[0] = p.val[r];                                          \
+        rgb.val[1] = p.val[g];                                          \
+        rgb.val[2] = p.val[b];                                          \
+        vst3q_u8(to + i * 3, rgb);                                      \
+    }                                                                   \
+    for (; i < pixel; i++) {                                            \
+        to[i * 3] = from[i * 4 + r];                                    \
+        to[i * 3 + 1] = from[i * 4 + g];                                \
+        to[i * 3 + 2] = from[i * 4 + b];                                \
+    }                                                                   \
+    return 0;                                                           \
 }
-
-int bgra8888_to_rgb888(const char* src, char* dst, size_t pixel)
-{
-    int i;
-    struct bgra8888  *from;
-    struct rgb888  *to;
-
-    from = (struct bgra8888 *) src;
-    to = (struct rgb888 *) dst;
-
-    i = 0;
-    /* traverse pixel of the row */
-    while(i++ < pixel) {
-
-        to->r = from->r;
-        to->g = from->g;
-        to->b = from->b;
-
-        to++;
-        from++;
-    }
-
-    return 0;
+#else
+#define DEFINE_TO_RGB888(name, r, g, b)                                 \
+int name(const char* src, char* dst, size_t pixel)                      \
+{                                                                       \
+    const uint8_t *from = (const uint8_t *) src;                        \
+    uint8_t *to = (uint8_t *) dst;                                      \
+    size_t i;                                                           \
+                                                                        \
+    for (i = 0; i < pixel; i++) {                                       \
+        to[i * 3] = from[i * 4 + r];                                    \
+        to[i * 3 + 1] = from[i * 4 + g];                                \
+        to[i * 3 + 2] = from[i * 4 + b];                                \
+    }                                                                   \
+    return 0;                                                           \
 }
+#endif
 
-int rgba8888_to_rgb888(const char* src, char* dst, size_t pixel)
-{
-    int i;
-    struct rgba8888  *from;
-    struct rgb888  *to;
-
-    from = (struct rgba8888 *) src;
-    to = (struct rgb888 *) dst;
-
-    i = 0;
-    /* traverse pixel of the row */
-    while(i++ < pixel) {
-
-        to->r = from->r;
-        to->g = from->g;
-        to->b = from->b;
-
-        to++;
-        from++;
-    }
-
-    return 0;
-}
+DEFINE_TO_RGB888(argb8888_to_rgb888, 1, 2, 3)
+DEFINE_TO_RGB888(abgr8888_to_rgb888, 3, 2, 1)
+DEFINE_TO_RGB888(bgra8888_to_rgb888, 2, 1, 0)
+DEFINE_TO_RGB888(rgba8888_to_rgb888, 0, 1, 2)
 
 static void
 stdio_write_func (png_structp png, png_bytep data, png_size_t size)
@@ -182,8 +146,13 @@ png_simple_warning_callback (png_structp png,
     fprintf(stderr, "png warning: %s\n", error_msg);
 }
 
-/* save rgb888 to png format in fp */
-int save_png(const char* path, const char* data, int width, int height)
+/*
+ * save rgb888 to png format in fp
+ * fast trades size for speed: zlib's fastest level and only the "up"
+ * filter, which suits the flat areas of a UI and costs one subtraction
+ * a byte. The file comes out a little larger, in a fraction of the time.
+ */
+int save_png(const char* path, const char* data, int width, int height, int fast)
 {
     FILE *fp;
     png_byte **volatile rows;
@@ -220,6 +189,10 @@ int save_png(const char* path, const char* data, int width, int height)
     }
 
     png_set_write_fn (png, fp, stdio_write_func, png_simple_output_flush_fn);
+    if (fast) {
+        png_set_compression_level (png, 1);
+        png_set_filter (png, PNG_FILTER_TYPE_BASE, PNG_FILTER_UP);
+    }
     png_set_IHDR (png, info,
             width,
             height,
@@ -79,6 +79,6 @@ int bgra8888_to_rgb888(const char* src, char* dst, size_t pixel);
 
 int rgba8888_to_rgb888(const char* src, char* dst, size_t pixel);
 
-int save_png(const char* path, const char* data, int width, int height);
+int save_png(const char* path, const char* data, int width, int height, int fast);
 
 #endif
@@ -34,8 +34,15 @@
 int main(int argc, char *argv[])
 {
     char fn[PATH_MAX];
+    int fast = 0;
     int ret;
 
+    if (argc > 1 && !strcmp(argv[1], "-f")) {
+        fast = 1;
+        argc--;
+        argv++;
+    }
+
     if (argc == 2 && argv[1][0] != '-') {
         if (strlen(argv[1]) >= PATH_MAX) {
             printf("Output path is too long!\n");
@@ -51,13 +58,14 @@ int main(int argc, char *argv[])
             "Author: Kyan He <kyan.ql.he@gmail.com>\n"
             "Modified by  Phil3759 & McKael @xda\n"
             "Base version 0.0.2 ---> v0.0.5  <2013>\n"
-            "Usage: fb2png [path/to/output.png]\n"
+            "Usage: fb2png [-f] [path/to/output.png]\n"
             "    The default output path is /data/local/fbdump.png\n"
+            "    -f  fast mode: larger file, much less time to encode\n"
             );
         exit(0);
     }
 
-    if (0 == (ret = fb2png(fn)))
+    if (0 == (ret = fb2png(fn, fast)))
         printf("Saved image to %s\n", fn);
 
     exit(ret);
@@ -16,8 +16,11 @@
 	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
 #include <string>
+#include <vector>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
@@ -25,11 +28,17 @@
 #include "fixContexts.hpp"
 #include "twrp-functions.hpp"
 #include "twcommon.h"
+#include "twrpScan.hpp"
+#include "exclude.hpp"
+#include "progresstracking.hpp"
 #include <selinux/selinux.h>
 #include <selinux/label.h>
 #include <selinux/android.h>
 #include <selinux/label.h>
 
+#define MAX_RELABEL_THREADS 8
+#define RELABEL_CHUNK 256                                                 // Items a worker takes from the list at a time
+
 using namespace std;
 
 struct selabel_handle *sehandle;
@@ -37,17 +46,50 @@ struct selinux_opt selinux_options[] = {
 	{ SELABEL_OPT_PATH, "/file_contexts" }
 };
 
-int fixContexts::restorecon(string entry, struct stat *sb) {
-	char *oldcontext, *newcontext;
+// The items of one scanned tree, relabeled by worker threads that each take
+// the next RELABEL_CHUNK items
+struct Relabel_Job {
+	const vector<twrpScanEntry>* Entries;
+	size_t Next;                                                          // First item no worker has taken yet
+	unsigned long long Done_Size;                                         // Bytes of the files relabeled so far, for the progress bar
+	unsigned long long Done_Count;
+	unsigned Running;                                                     // Workers that have not finished
+	pthread_mutex_t Lock;
+	pthread_cond_t Cond;
+};
+
+// selabel_lookup keeps state in the handle, so the workers take turns
+static pthread_mutex_t lookup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static mode_t entry_mode(unsigned char type) {
+	if (type == DT_DIR)
+		return S_IFDIR;
+	if (type == DT_LNK)
+		return S_IFLNK;
+	return S_IFREG;
+}
+
+static char* lookup_context(const string& entry, mode_t mode) {
+	char *context;
+	int ret;
+
+	pthread_mutex_lock(&lookup_lock);
+	ret = selabel_lookup(sehandle, &context, entry.c_str(), mode);
+	pthread_mutex_unlock(&lookup_lock);
+	if (ret < 0) {
+		LOGINFO("Couldn't lookup selinux context for %s\n", entry.c_str());
+		return NULL;
+	}
+	return context;
+}
+
+int fixContexts::restorecon(const string& entry, const char* newcontext) {
+	char *oldcontext;
 
 	if (lgetfilecon(entry.c_str(), &oldcontext) < 0) {
 		LOGINFO("Couldn't get selinux context for %s\n", entry.c_str());
 		return -1;
 	}
-	if (selabel_lookup(sehandle, &newcontext, entry.c_str(), sb->st_mode) < 0) {
-		LOGINFO("Couldn't lookup selinux context for %s\n", entry.c_str());
-		return -1;
-	}
 	if (strcmp(oldcontext, newcontext) != 0) {
 		LOGINFO("Relabeling %s from %s to %s\n", entry.c_str(), oldcontext, newcontext);
 		if (lsetfilecon(entry.c_str(), newcontext) < 0) {
@@ -55,42 +97,147 @@ int fixContexts::restorecon(string entry, struct stat *sb) {
 		}
 	}
 	freecon(oldcontext);
-	freecon(newcontext);
 	return 0;
 }
 
-int fixContexts::fixContextsRecursively(string name, int level) {
-	DIR *d;
-	struct dirent *de;
-	struct stat sb;
-	string path;
+int fixContexts::restorecon(const string& entry, mode_t mode) {
+	char *newcontext = lookup_context(entry, mode);
+	int ret;
 
-	if (!(d = opendir(name.c_str())))
-		return -1;
-	if (!(de = readdir(d)))
+	if (!newcontext)
 		return -1;
+	ret = restorecon(entry, newcontext);
+	freecon(newcontext);
+	return ret;
+}
 
-	do {
-		if (de->d_type ==  DT_DIR) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
-				continue;
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
-			fixContextsRecursively(path, level + 1);
+void* fixContexts::relabelWorker(void *cookie) {
+	Relabel_Job* job = (Relabel_Job*) cookie;
+	const vector<twrpScanEntry>& entries = *job->Entries;
+	// Files and symlinks in one folder nearly always get the same label, so
+	// it is looked up once per folder for each. Folders are looked up one by
+	// one as file_contexts names some of them, like obb, on their own.
+	string memo_dir;
+	char *memo_file = NULL, *memo_link = NULL;
+	unsigned long long size = 0, count = 0;
+
+	pthread_mutex_lock(&job->Lock);
+	while (job->Next < entries.size()) {
+		size_t i = job->Next, end = min(entries.size(), job->Next + RELABEL_CHUNK);
+		job->Next = end;
+		job->Done_Size += size;
+		job->Done_Count += count;
+		pthread_mutex_unlock(&job->Lock);
+
+		size = count = 0;
+		for (; i < end; i++) {
+			const twrpScanEntry& entry = entries[i];
+			mode_t mode = entry_mode(entry.type);
+
+			if (S_ISDIR(mode)) {
+				restorecon(entry.fn, mode);
+			} else {
+				size_t slash = entry.fn.rfind('/');
+				if (entry.fn.compare(0, slash, memo_dir) != 0 || slash != memo_dir.size()) {
+					memo_dir = entry.fn.substr(0, slash);
+					freecon(memo_file);
+					freecon(memo_link);
+					memo_file = memo_link = NULL;
+				}
+				char*& memo = S_ISLNK(mode) ? memo_link : memo_file;
+				if (!memo)
+					memo = lookup_context(entry.fn, mode);
+				if (memo)
+					restorecon(entry.fn, memo);
+				size += entry.size;
+			}
+			count++;
+		}
+		pthread_mutex_lock(&job->Lock);
+	}
+	job->Done_Size += size;
+	job->Done_Count += count;
+	job->Running--;
+	pthread_cond_broadcast(&job->Cond);
+	pthread_mutex_unlock(&job->Lock);
+	freecon(memo_file);
+	freecon(memo_link);
+	return NULL;
+}
+
+int fixContexts::fixContextsRecursively(string name) {
+	twrpScan scan;
+	TWExclude no_exclusions;
+	Relabel_Job job;
+	vector<pthread_t> workers;
+	timespec start, end;
+	size_t i, threads;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// The scan walks the tree with folder fds on several threads and gives
+	// each item's type, so the lookups get the right mode
+	if (!scan.Scan(name, &no_exclusions))
+		LOGINFO("Part of '%s' could not be read, relabeling the rest\n", name.c_str());
+	const vector<twrpScanEntry>& entries = scan.Get_Entries();
+
+	ProgressTracking progress(scan.Get_Size());
+	progress.SetSizeCount(scan.Get_Size(), entries.size());
+	job.Entries = &entries;
+	job.Next = 0;
+	job.Done_Size = 0;
+	job.Done_Count = 0;
+	pthread_mutex_init(&job.Lock, NULL);
+	pthread_cond_init(&job.Cond, NULL);
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = min((size_t) MAX_RELABEL_THREADS, (size_t) (cores > 1 ? cores : 1));
+	threads = min(threads, entries.size() / RELABEL_CHUNK + 1);
+	job.Running = threads;
+	for (i = 0; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, relabelWorker, &job) != 0) {
+			LOGINFO("Unable to create relabel thread %zu, continuing with %zu\n", i, i);
+			break;
 		}
-		else {
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
+		workers.push_back(thread);
+	}
+	pthread_mutex_lock(&job.Lock);
+	job.Running -= threads - workers.size();
+	pthread_mutex_unlock(&job.Lock);
+	if (workers.empty()) {
+		job.Running = 1;
+		relabelWorker(&job);
+	} else {
+		pthread_mutex_lock(&job.Lock);
+		while (job.Running) {
+			timespec wake;
+			clock_gettime(CLOCK_REALTIME, &wake);
+			wake.tv_nsec += 250000000;
+			if (wake.tv_nsec >= 1000000000) {
+				wake.tv_sec++;
+				wake.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&job.Cond, &job.Lock, &wake);
+			unsigned long long size = job.Done_Size, count = job.Done_Count;
+			pthread_mutex_unlock(&job.Lock);
+			progress.UpdateSizeCount(size, count);
+			pthread_mutex_lock(&job.Lock);
 		}
-	} while ((de = readdir(d)));
-	closedir(d);
+		pthread_mutex_unlock(&job.Lock);
+		for (i = 0; i < workers.size(); i++)
+			pthread_join(workers[i], NULL);
+	}
+	progress.UpdateSizeCount(job.Done_Size, job.Done_Count);
+	pthread_cond_destroy(&job.Cond);
+	pthread_mutex_destroy(&job.Lock);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	LOGINFO("Checked contexts of %zu items in '%s' with %zu threads in %i ms\n", entries.size(), name.c_str(), workers.size() ? workers.size() : 1, TWFunc::timespec_diff_ms(start, end));
 	return 0;
 }
 
 int fixContexts::fixDataMediaContexts(string Mount_Point) {
 	DIR *d;
 	struct dirent *de;
-	struct stat sb;
 
 	LOGINFO("Fixing media contexts on '%s'\n", Mount_Point.c_str());
 
@@ -128,14 +275,14 @@ int fixContexts::fixDataMediaContexts(string Mount_Point) {
 			if (is_numeric) {
 				dir = Mount_Point + "/media/";
 				dir += de->d_name;
-				restorecon(dir, &sb);
-				fixContextsRecursively(dir, 0);
+				restorecon(dir, S_IFDIR);
+				fixContextsRecursively(dir);
 			}
 		} while ((de = readdir(d)));
 		closedir(d);
 	} else if (TWFunc::Path_Exists(Mount_Point + "/media")) {
-		restorecon(Mount_Point + "/media", &sb);
-		fixContextsRecursively(Mount_Point + "/media", 0);
+		restorecon(Mount_Point + "/media", S_IFDIR);
+		fixContextsRecursively(Mount_Point + "/media");
 	} else {
 		LOGINFO("fixDataMediaContexts: %s/media does not exist!\n", Mount_Point.c_str());
 		return 0;
@@ -20,6 +20,7 @@
 #define __FIXCONTEXTS_HPP
 
 #include <string>
+#include <sys/types.h>
 
 using namespace std;
 
@@ -28,8 +29,10 @@ class fixContexts {
 		static int fixDataMediaContexts(string Mount_Point);
 
 	private:
-		static int restorecon(string entry, struct stat *sb);
-		static int fixContextsRecursively(string path, int level);
+		static int restorecon(const string& entry, const char* newcontext);
+		static int restorecon(const string& entry, mode_t mode);
+		static void* relabelWorker(void *cookie);
+		static int fixContextsRecursively(string path);
 };
 
 #endif
@@ -36,6 +36,7 @@ struct fuse_mt {
 	pthread_mutex_t lock;
 	int numworker;
 	int numavail;
+	int max_threads;	/* 0 means no limit */
 	struct fuse_session *se;
 	struct fuse_chan *prevch;
 	struct fuse_worker main;
@@ -137,7 +138,8 @@ static void *fuse_do_work(void *data)
 
 		if (!isforget)
 			mt->numavail--;
-		if (mt->numavail == 0)
+		if (mt->numavail == 0 &&
+		    (!mt->max_threads || mt->numworker < mt->max_threads))
 			fuse_loop_start_thread(mt);
 		pthread_mutex_unlock(&mt->lock);
 
@@ -243,7 +245,7 @@ static void fuse_join_worker(struct fuse_mt *mt, struct fuse_worker *w)
 	free(w);
 }
 
-int fuse_session_loop_mt(struct fuse_session *se)
+int fuse_session_loop_mt_max(struct fuse_session *se, int max_threads)
 {
 	int err;
 	struct fuse_mt mt;
@@ -255,6 +257,7 @@ int fuse_session_loop_mt(struct fuse_session *se)
 	mt.error = 0;
 	mt.numworker = 0;
 	mt.numavail = 0;
+	mt.max_threads = max_threads;
 	mt.main.thread_id = pthread_self();
 	mt.main.prev = mt.main.next = &mt.main;
 	sem_init(&mt.finish, 0, 0);
@@ -289,3 +292,8 @@ int fuse_session_loop_mt(struct fuse_session *se)
 	fuse_session_reset(se);
 	return err;
 }
+
+int fuse_session_loop_mt(struct fuse_session *se)
+{
+	return fuse_session_loop_mt_max(se, 0);
+}
@@ -105,7 +105,7 @@ int fuse_loop_mt_proc(struct fuse *f, fuse_processor_t proc, void *data)
 	return res;
 }
 
-int fuse_loop_mt(struct fuse *f)
+int fuse_loop_mt_max(struct fuse *f, int max_threads)
 {
 	if (f == NULL)
 		return -1;
@@ -114,9 +114,14 @@ int fuse_loop_mt(struct fuse *f)
 	if (res)
 		return -1;
 
-	res = fuse_session_loop_mt(fuse_get_session(f));
+	res = fuse_session_loop_mt_max(fuse_get_session(f), max_threads);
 	fuse_stop_cleanup_thread(f);
 	return res;
 }
 
+int fuse_loop_mt(struct fuse *f)
+{
+	return fuse_loop_mt_max(f, 0);
+}
+
 FUSE_SYMVER(".symver fuse_loop_mt_proc,__fuse_loop_mt@FUSE_UNVERSIONED");
@@ -714,6 +714,18 @@ void fuse_exit(struct fuse *f);
  */
 int fuse_loop_mt(struct fuse *f);
 
+/**
+ * FUSE event loop with a limited number of threads
+ *
+ * Like fuse_loop_mt(), but never runs more than max_threads workers,
+ * which bounds the memory used for request buffers.
+ *
+ * @param f the FUSE handle
+ * @param max_threads the most workers to start, 0 for no limit
+ * @return 0 if no error occurred, -1 otherwise
+ */
+int fuse_loop_mt_max(struct fuse *f, int max_threads);
+
 /**
  * Get the current context
  *
@@ -1697,6 +1697,15 @@ int fuse_session_loop(struct fuse_session *se);
  */
 int fuse_session_loop_mt(struct fuse_session *se);
 
+/**
+ * Enter a multi-threaded event loop with a limited number of threads
+ *
+ * @param se the session
+ * @param max_threads the most workers to start, 0 for no limit
+ * @return 0 on success, -1 on error
+ */
+int fuse_session_loop_mt_max(struct fuse_session *se, int max_threads);
+
 /* ----------------------------------------------------------- *
  * Channel interface					       *
  * ----------------------------------------------------------- */
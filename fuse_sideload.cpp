@@ -32,6 +32,15 @@
 // different than it did on the first read, the reader of the file
 // will see their read fail with EINVAL.
 //
+// Blocks from the host are kept in a small LRU cache. When the file is
+// read in order, the blocks after the one being read are requested ahead
+// of time and a fetch thread takes the answers in the order they were
+// asked for, so the host keeps sending while the updater works on what it
+// already has. A hash thread hashes each block as it arrives, while the
+// next one is on its way, and the hash is checked against the stored one
+// the first time the block is handed to the reader. Nothing is handed out
+// before its hash is in, so the invariant above is unchanged.
+//
 // The other file, "/sideload/exit", is used to control the subprocess
 // that creates this filesystem.  Calling stat() on the exit file
 // causes the filesystem to be unmounted and the adb process on the
@@ -65,6 +74,7 @@
 #include <openssl/sha.h>
 #endif
 
+#include <algorithm>
 #include <array>
 #include <string>
 #include <vector>
@@ -80,6 +90,37 @@ static constexpr int NO_STATUS_EXIT = 2;
 
 using SHA256Digest = std::array<uint8_t, SHA256_DIGEST_LENGTH>;
 
+// Memory for cached blocks unless set_fuse_sideload_cache_size() changes it, and how much is
+// requested past a sequential read
+static constexpr size_t CACHE_BYTES = 8 * 1024 * 1024;
+static constexpr size_t READ_AHEAD_BYTES = 2 * 1024 * 1024;
+
+// Largest read asked of the kernel. It caps the reads at the most pages it
+// puts in one request, 128 KiB on most kernels, so a large read of the
+// updater takes as few round trips as the kernel allows.
+static constexpr uint32_t MAX_READ_BYTES = 1024 * 1024;
+
+static size_t cache_bytes = CACHE_BYTES;
+
+enum slot_state {
+  SLOT_FREE,
+  SLOT_PENDING,   // requested, the fetch thread has not received it yet
+  SLOT_RECEIVED,  // received, the hash thread has not hashed it yet
+  SLOT_READY,
+  SLOT_FAILED,
+};
+
+struct cache_slot {
+  uint32_t block;
+  slot_state state;
+  bool verified;       // checked against the stored hash of the block
+  unsigned pins;       // reads replying from the data, which keep the slot from being reused
+  bool receive_failed;  // set by the fetch thread, turned into SLOT_FAILED by the hash thread
+  uint64_t last_use;
+  uint8_t* data;
+  uint8_t hash[SHA256_DIGEST_LENGTH];
+};
+
 #ifndef MIN
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
@@ -97,10 +138,26 @@ struct fuse_data {
   uid_t uid;
   gid_t gid;
 
-  uint32_t curr_block;  // cache the block most recently read from the host
-  uint8_t* block_data;
-
-  uint8_t* extra_block;  // another block of storage for reads that span two blocks
+  cache_slot* slots;
+  size_t slot_count;
+  uint64_t use_clock;
+  uint32_t read_ahead;  // blocks requested past a sequential read
+  uint32_t last_block;  // block of the previous read, to spot sequential reads
+
+  cache_slot** queue;  // requested blocks, in the order the host answers them
+  size_t queue_head;
+  size_t queue_len;
+  size_t queue_received;  // blocks at the head of the queue that are waiting to be hashed
+  bool stop;
+  bool fetch_started;
+  bool hash_started;
+  pthread_t fetch_thread;
+  pthread_t hash_thread;
+  pthread_mutex_t lock;  // guards the slot states and the queue
+  pthread_cond_t cond;
+
+  uint32_t max_read;     // bytes the kernel may ask for in one read
+  uint8_t* zero_block;   // returned for reads past the end of the file
 
   uint8_t* hashes;        // SHA-256 hash of each block (all zeros
                           // if block hasn't been read yet)
@@ -154,6 +211,7 @@ static int handle_init(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   out.flags = 0;
   out.max_background = 32;
   out.congestion_threshold = 32;
+  // The mount is read-only, so writes never come and the request buffer can stay small
   out.max_write = 4096;
   fuse_reply(fd, hdr->unique, &out, fuse_struct_size);
 
@@ -237,45 +295,123 @@ static int handle_release(void* /* data */, fuse_data* /* fd */, const fuse_in_h
   return 0;
 }
 
-// Fetch a block from the host into fd->curr_block and fd->block_data.
-// Returns 0 on successful fetch, negative otherwise.
-static int fetch_block(fuse_data* fd, uint32_t block) {
-  if (block == fd->curr_block) {
-    return 0;
-  }
-
-  if (block >= fd->file_blocks) {
-    memset(fd->block_data, 0, fd->block_size);
-    fd->curr_block = block;
-    return 0;
-  }
-
+// Receives one requested block into data, padding a short last block with zeroes.
+static int receive_block(fuse_data* fd, uint32_t block, uint8_t* data) {
   size_t fetch_size = fd->block_size;
   if (block * fd->block_size + fetch_size > fd->file_size) {
     // If we're reading the last (partial) block of the file, expect a shorter response from the
     // host, and pad the rest of the block with zeroes.
     fetch_size = fd->file_size - (block * fd->block_size);
-    memset(fd->block_data + fetch_size, 0, fd->block_size - fetch_size);
+    memset(data + fetch_size, 0, fd->block_size - fetch_size);
+  }
+  if (fd->vtab.request_block) {
+    return fd->vtab.receive_block(block, data, fetch_size);
   }
+  return fd->vtab.read_block(block, data, fetch_size);
+}
 
-  int result = fd->vtab.read_block(block, fd->block_data, fetch_size);
-  if (result < 0) return result;
+// Takes the answers of the host in the order the blocks were requested.
+static void* fetch_thread(void* cookie) {
+  fuse_data* fd = static_cast<fuse_data*>(cookie);
 
-  fd->curr_block = block;
+  pthread_mutex_lock(&fd->lock);
+  for (;;) {
+    while (fd->queue_received == fd->queue_len && !fd->stop) {
+      pthread_cond_wait(&fd->cond, &fd->lock);
+    }
+    // Requests still queued at the end are answered by the host anyway
+    if (fd->queue_received == fd->queue_len) break;
+    cache_slot* slot = fd->queue[(fd->queue_head + fd->queue_received) % fd->slot_count];
+    pthread_mutex_unlock(&fd->lock);
+
+    int result = receive_block(fd, slot->block, slot->data);
+
+    pthread_mutex_lock(&fd->lock);
+    slot->receive_failed = (result != 0);
+    slot->state = SLOT_RECEIVED;
+    fd->queue_received++;
+    pthread_cond_broadcast(&fd->cond);
+  }
+  pthread_mutex_unlock(&fd->lock);
+  return nullptr;
+}
 
-  // Verify the hash of the block we just got from the host.
-  //
-  // - If the hash of the just-received data matches the stored hash for the block, accept it.
-  // - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
-  //   time we've read this block).
-  // - Otherwise, return -EINVAL for the read.
+// Hashes the received blocks while the fetch thread waits for the next ones.
+static void* hash_thread(void* cookie) {
+  fuse_data* fd = static_cast<fuse_data*>(cookie);
 
-  uint8_t hash[SHA256_DIGEST_LENGTH];
+  pthread_mutex_lock(&fd->lock);
+  for (;;) {
+    while (fd->queue_received == 0 && !(fd->stop && fd->queue_len == 0)) {
+      pthread_cond_wait(&fd->cond, &fd->lock);
+    }
+    if (fd->queue_received == 0) break;
+    cache_slot* slot = fd->queue[fd->queue_head];
+    pthread_mutex_unlock(&fd->lock);
+
+    if (!slot->receive_failed) {
 #ifdef USE_MINCRYPT
-  SHA256_hash(fd->block_data, fd->block_size, hash);
+      SHA256_hash(slot->data, fd->block_size, slot->hash);
 #else
-  SHA256(fd->block_data, fd->block_size, hash);
+      SHA256(slot->data, fd->block_size, slot->hash);
 #endif
+    }
+
+    pthread_mutex_lock(&fd->lock);
+    fd->queue_head = (fd->queue_head + 1) % fd->slot_count;
+    fd->queue_len--;
+    fd->queue_received--;
+    slot->state = slot->receive_failed ? SLOT_FAILED : SLOT_READY;
+    pthread_cond_broadcast(&fd->cond);
+  }
+  pthread_mutex_unlock(&fd->lock);
+  return nullptr;
+}
+
+// Returns the slot holding or waiting for block, nullptr if there is none. Called with the lock.
+static cache_slot* find_slot(fuse_data* fd, uint32_t block) {
+  for (size_t i = 0; i < fd->slot_count; ++i) {
+    cache_slot* slot = &fd->slots[i];
+    if (slot->block == block && slot->state != SLOT_FREE && slot->state != SLOT_FAILED) {
+      return slot;
+    }
+  }
+  return nullptr;
+}
+
+// Queues a request for block in the least recently used slot that is not waiting for the host
+// or the hash thread, and not pinned by the read being answered. Returns nullptr if every slot is
+// busy. Called with the lock.
+static cache_slot* queue_block(fuse_data* fd, uint32_t block) {
+  cache_slot* lru = nullptr;
+  for (size_t i = 0; i < fd->slot_count; ++i) {
+    cache_slot* slot = &fd->slots[i];
+    if (slot->pins != 0 || slot->state == SLOT_PENDING || slot->state == SLOT_RECEIVED) continue;
+    if (lru == nullptr || slot->state == SLOT_FREE || slot->last_use < lru->last_use) {
+      lru = slot;
+      if (slot->state == SLOT_FREE) break;
+    }
+  }
+  if (lru == nullptr) return nullptr;
+
+  lru->block = block;
+  lru->state = SLOT_PENDING;
+  lru->verified = false;
+  lru->receive_failed = false;
+  lru->last_use = 0;
+  fd->queue[(fd->queue_head + fd->queue_len) % fd->slot_count] = lru;
+  fd->queue_len++;
+  pthread_cond_broadcast(&fd->cond);
+  return lru;
+}
+
+// Verify the hash of a block the first time it is handed out.
+//
+// - If the hash of the received data matches the stored hash for the block, accept it.
+// - If the stored hash is all zeroes, store the new hash and accept the block (this is the first
+//   time we've read this block).
+// - Otherwise, return -EIO for the read.
+static int verify_block(fuse_data* fd, uint32_t block, const uint8_t* hash) {
   uint8_t* blockhash = fd->hashes + block * SHA256_DIGEST_LENGTH;
   if (memcmp(hash, blockhash, SHA256_DIGEST_LENGTH) == 0) {
     return 0;
@@ -284,7 +420,6 @@ static int fetch_block(fuse_data* fd, uint32_t block) {
   int i;
   for (i = 0; i < SHA256_DIGEST_LENGTH; ++i) {
     if (blockhash[i] != 0) {
-      fd->curr_block = -1;
       return -EIO;
     }
   }
@@ -293,6 +428,86 @@ static int fetch_block(fuse_data* fd, uint32_t block) {
   return 0;
 }
 
+// Fetch a block from the host, or the cache, and point *data at it. The slot holding it is
+// pinned and returned in *pinned, nullptr past the end of the file, so the data stays valid until
+// unpin_slots(). Returns 0 on successful fetch, negative otherwise.
+static int fetch_block(fuse_data* fd, uint32_t block, uint8_t** data, cache_slot** pinned) {
+  *pinned = nullptr;
+  if (block >= fd->file_blocks) {
+    *data = fd->zero_block;
+    return 0;
+  }
+
+  std::vector<uint32_t> requests;
+  pthread_mutex_lock(&fd->lock);
+  cache_slot* slot = find_slot(fd, block);
+  if (slot == nullptr) {
+    // There are more slots than blocks read ahead and pinned, so one is always free
+    slot = queue_block(fd, block);
+    requests.push_back(block);
+  }
+  slot->last_use = ++fd->use_clock;
+  slot->pins++;
+
+  // A read of the same block as the one before it or the next asks for the blocks after it
+  if (block == fd->last_block || block == fd->last_block + 1) {
+    for (uint32_t ahead = block + 1; ahead <= block + fd->read_ahead && ahead < fd->file_blocks;
+         ++ahead) {
+      if (find_slot(fd, ahead) != nullptr) continue;
+      if (queue_block(fd, ahead) == nullptr) break;
+      requests.push_back(ahead);
+    }
+  }
+  fd->last_block = block;
+  pthread_mutex_unlock(&fd->lock);
+
+  // The requests go out in the order they were queued, and only this thread queues them
+  if (fd->vtab.request_block) {
+    for (uint32_t request : requests) {
+      if (fd->vtab.request_block(request) != 0) {
+        fprintf(stderr, "failed to request block %u\n", request);
+      }
+    }
+  }
+
+  pthread_mutex_lock(&fd->lock);
+  while (slot->state == SLOT_PENDING || slot->state == SLOT_RECEIVED) {
+    pthread_cond_wait(&fd->cond, &fd->lock);
+  }
+  slot_state state = slot->state;
+  if (state == SLOT_FAILED) {
+    slot->state = SLOT_FREE;
+    slot->pins--;
+  }
+  pthread_mutex_unlock(&fd->lock);
+  if (state == SLOT_FAILED) return -EIO;
+
+  // Only this thread moves a ready slot, so its data can be used without the lock. The block
+  // was hashed when it arrived, so only the comparison is left.
+  if (!slot->verified) {
+    int result = verify_block(fd, block, slot->hash);
+    if (result != 0) {
+      pthread_mutex_lock(&fd->lock);
+      slot->state = SLOT_FREE;
+      slot->pins--;
+      pthread_mutex_unlock(&fd->lock);
+      return result;
+    }
+    slot->verified = true;
+  }
+  *data = slot->data;
+  *pinned = slot;
+  return 0;
+}
+
+static void unpin_slots(fuse_data* fd, const std::vector<cache_slot*>& pinned) {
+  pthread_mutex_lock(&fd->lock);
+  for (cache_slot* slot : pinned) {
+    slot->pins--;
+  }
+  pthread_mutex_unlock(&fd->lock);
+}
+
 static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   if (hdr->nodeid != PACKAGE_FILE_ID) return -ENOENT;
 
@@ -313,49 +528,43 @@ static int handle_read(void* data, fuse_data* fd, const fuse_in_header* hdr) {
   outhdr.error = 0;
   outhdr.unique = hdr->unique;
 
-  struct iovec vec[3];
-  vec[0].iov_base = &outhdr;
-  vec[0].iov_len = sizeof(outhdr);
-
+  // A read may span several blocks. Each one is pinned in the cache and the reply is written
+  // straight from the cached blocks, without copying them into a reply buffer first.
   uint32_t block = offset / fd->block_size;
-  int result = fetch_block(fd, block);
-  if (result != 0) return result;
-
-  // Two cases:
-  //
-  //   - the read request is entirely within this block. In this case we can reply immediately.
-  //
-  //   - the read request goes over into the next block. Note that since we mount the filesystem
-  //     with max_read=block_size, a read can never span more than two blocks. In this case we copy
-  //     the block to extra_block and issue a fetch for the following block.
-
   uint32_t block_offset = offset - (block * fd->block_size);
+  uint32_t blocks = (block_offset + size + fd->block_size - 1) / fd->block_size;
+  if (blocks > fd->max_read / fd->block_size + 1) return -EINVAL;
 
-  int vec_used;
-  if (size + block_offset <= fd->block_size) {
-    // First case: the read fits entirely in the first block.
-
-    vec[1].iov_base = fd->block_data + block_offset;
-    vec[1].iov_len = size;
-    vec_used = 2;
-  } else {
-    // Second case: the read spills over into the next block.
-
-    memcpy(fd->extra_block, fd->block_data + block_offset, fd->block_size - block_offset);
-    vec[1].iov_base = fd->extra_block;
-    vec[1].iov_len = fd->block_size - block_offset;
+  std::vector<struct iovec> vec(blocks + 1);
+  std::vector<cache_slot*> pinned;
+  vec[0].iov_base = &outhdr;
+  vec[0].iov_len = sizeof(outhdr);
 
-    result = fetch_block(fd, block + 1);
-    if (result != 0) return result;
-    vec[2].iov_base = fd->block_data;
-    vec[2].iov_len = size - vec[1].iov_len;
-    vec_used = 3;
+  int result = 0;
+  uint32_t left = size;
+  for (uint32_t i = 0; i < blocks; ++i) {
+    uint8_t* block_data;
+    cache_slot* slot;
+    result = fetch_block(fd, block + i, &block_data, &slot);
+    if (result != 0) break;
+    if (slot != nullptr) pinned.push_back(slot);
+
+    uint32_t skip = (i == 0) ? block_offset : 0;
+    uint32_t len = std::min(left, fd->block_size - skip);
+    vec[i + 1].iov_base = block_data + skip;
+    vec[i + 1].iov_len = len;
+    left -= len;
   }
 
-  if (writev(fd->ffd, vec, vec_used) == -1) {
+  if (result == 0 && writev(fd->ffd, vec.data(), vec.size()) == -1) {
     printf("*** READ REPLY FAILED: %s ***\n", strerror(errno));
   }
-  return NO_STATUS;
+  unpin_slots(fd, pinned);
+  return (result != 0) ? result : NO_STATUS;
+}
+
+void set_fuse_sideload_cache_size(size_t bytes) {
+  cache_bytes = bytes;
 }
 
 int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
@@ -399,19 +608,47 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   fd.uid = getuid();
   fd.gid = getgid();
 
-  fd.curr_block = -1;
-  fd.block_data = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.block_data == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for block_data\n", block_size);
+  pthread_mutex_init(&fd.lock, nullptr);
+  pthread_cond_init(&fd.cond, nullptr);
+  fd.last_block = -1;
+  fd.read_ahead = std::max<size_t>(READ_AHEAD_BYTES / block_size, 1);
+  fd.max_read = std::max(block_size, MAX_READ_BYTES);
+  fd.slot_count = std::max<size_t>(cache_bytes / block_size,
+                                   2 * fd.read_ahead + 2 + fd.max_read / block_size + 1);
+  fd.slots = static_cast<cache_slot*>(calloc(fd.slot_count, sizeof(cache_slot)));
+  fd.queue = static_cast<cache_slot**>(calloc(fd.slot_count, sizeof(cache_slot*)));
+  if (fd.slots == nullptr || fd.queue == nullptr) {
+    fprintf(stderr, "failed to allocate %zu cache slots\n", fd.slot_count);
+    result = -1;
+    goto done;
+  }
+  for (size_t i = 0; i < fd.slot_count; ++i) {
+    fd.slots[i].data = static_cast<uint8_t*>(malloc(block_size));
+    if (fd.slots[i].data == nullptr) {
+      fprintf(stderr, "failed to allocate %zu bites for the block cache\n", fd.slot_count * block_size);
+      result = -1;
+      goto done;
+    }
+  }
+  fd.zero_block = static_cast<uint8_t*>(calloc(1, block_size));
+  if (fd.zero_block == nullptr) {
+    fprintf(stderr, "failed to allocate %d bites for zero_block\n", block_size);
+    result = -1;
+    goto done;
+  }
+
+  if (pthread_create(&fd.fetch_thread, nullptr, fetch_thread, &fd) != 0) {
+    fprintf(stderr, "failed to start the fetch thread\n");
     result = -1;
     goto done;
   }
-  fd.extra_block = static_cast<uint8_t*>(malloc(block_size));
-  if (fd.extra_block == nullptr) {
-    fprintf(stderr, "failed to allocate %d bites for extra_block\n", block_size);
+  fd.fetch_started = true;
+  if (pthread_create(&fd.hash_thread, nullptr, hash_thread, &fd) != 0) {
+    fprintf(stderr, "failed to start the hash thread\n");
     result = -1;
     goto done;
   }
+  fd.hash_started = true;
 
   fd.ffd = open("/dev/fuse", O_RDWR);
   if (!fd.ffd) {
@@ -425,7 +662,7 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   snprintf(opts, sizeof(opts),
           ("fd=%d,user_id=%d,group_id=%d,max_read=%u,"
            "allow_other,rootmode=040000"),
-           fd.ffd, fd.uid, fd.gid, block_size);
+           fd.ffd, fd.uid, fd.gid, fd.max_read);
 
   result = mount("/dev/fuse", FUSE_SIDELOAD_HOST_MOUNTPOINT, "fuse",
                  MS_NOSUID | MS_NODEV | MS_RDONLY | MS_NOEXEC, opts);
@@ -506,14 +743,36 @@ int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t bl
   }
 
 done:
+  // Every block requested from the host is taken before the host is told we are done
+  if (fd.fetch_started) {
+    pthread_mutex_lock(&fd.lock);
+    fd.stop = true;
+    pthread_cond_broadcast(&fd.cond);
+    pthread_mutex_unlock(&fd.lock);
+    pthread_join(fd.fetch_thread, nullptr);
+  }
+  if (fd.hash_started) {
+    pthread_join(fd.hash_thread, nullptr);
+  }
   fd.vtab.close();
 
   if (umount2(mount_point, MNT_DETACH) == -1) {
     fprintf(stderr, "fuse_sideload umount failed: %s\n", strerror(errno));
   }
 
-  free(fd.block_data);
-  free(fd.extra_block);
+  if (fd.slots != nullptr) {
+    for (size_t i = 0; i < fd.slot_count; ++i) {
+      free(fd.slots[i].data);
+    }
+  }
+  free(fd.slots);
+  free(fd.queue);
+  free(fd.zero_block);
+  free(fd.hashes);
+  if (fd.slot_count != 0) {
+    pthread_cond_destroy(&fd.cond);
+    pthread_mutex_destroy(&fd.lock);
+  }
 
   return result;
 }
@@ -34,6 +34,12 @@ struct provider_vtab {
   // read a block
   std::function<int(uint32_t block, uint8_t* buffer, uint32_t fetch_size)> read_block;
 
+  // optional, for providers that answer several requests in order: ask for a block without
+  // waiting for it, and take the answers in the order they were asked for. read_block is not
+  // used when these are set.
+  std::function<int(uint32_t block)> request_block;
+  std::function<int(uint32_t block, uint8_t* buffer, uint32_t fetch_size)> receive_block;
+
   // close down
   std::function<void(void)> close;
 };
@@ -41,6 +47,12 @@ struct provider_vtab {
 int run_fuse_sideload(const provider_vtab& vtab, uint64_t file_size, uint32_t block_size,
                       const char* mount_point = FUSE_SIDELOAD_HOST_MOUNTPOINT);
 
+// Memory for the block cache of the runs that follow. Recovery sets it from its memory budget,
+// between these two.
+static constexpr size_t FUSE_SIDELOAD_CACHE_MAX = 64 * 1024 * 1024;
+static constexpr size_t FUSE_SIDELOAD_CACHE_MIN = 2 * 1024 * 1024;
+void set_fuse_sideload_cache_size(size_t bytes);
+
 #ifdef __cplusplus
 extern "C" {
 #endif
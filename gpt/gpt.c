@@ -34,6 +34,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/utsname.h>
+#include <pthread.h>
 #include <asm/byteorder.h>
 #include "gpt.h"
 #include "gptcrc32.h"
@@ -49,6 +50,41 @@ struct blkdev_ioctl_param {
         char * block_contents;
 };
 
+/*
+ * find_valid_gpt() reads the start and the end of the disk in one go each:
+ * the PMBR, the primary header and the entries that follow it, then the
+ * entries and the alternate header. read_lba() serves what it can from
+ * these windows rather than going back to the disk for each structure.
+ * Only used with gpt_lock held.
+ */
+struct gpt_window {
+        uint64_t lba;           /* first sector held */
+        size_t bytes;           /* 0 if the window is empty */
+        uint8_t *data;
+};
+
+static struct gpt_window windows[2];
+
+/*
+ * Parsed tables of the last few disks looked at, so that looking up one
+ * partition after another doesn't re-read and re-check the table each
+ * time. An entry stays valid while the header it was read from is
+ * unchanged on disk; gpt_disk_invalidate_cache() drops them all when the
+ * kernel has been told to reread a partition table or a disk came or went.
+ */
+#define GPT_CACHE_DISKS 4
+
+struct gpt_cache_entry {
+        dev_t dev;
+        uint64_t lba;           /* of the header the entries were read with */
+        gpt_header *gpt;        /* NULL if the entry is unused */
+        gpt_entry *ptes;
+};
+
+static struct gpt_cache_entry gpt_cache[GPT_CACHE_DISKS];
+static unsigned int gpt_cache_next;
+static pthread_mutex_t gpt_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static inline int
 efi_guidcmp(efi_guid_t left, efi_guid_t right)
 {
@@ -237,10 +273,22 @@ read_lba(int fd, uint64_t lba, void *buffer, size_t bytes)
         ssize_t bytesread;
         void *aligned;
         void *unaligned;
+        unsigned int i;
 
         if (bytes % sector_size)
                 return EINVAL;
 
+        for (i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+                const struct gpt_window *w = &windows[i];
+
+                if (w->bytes && lba >= w->lba &&
+                    (lba - w->lba) * sector_size + bytes <= w->bytes) {
+                        memcpy(buffer, w->data + (lba - w->lba) * sector_size,
+                               bytes);
+                        return bytes;
+                }
+        }
+
 	unaligned = malloc(bytes+sector_size-1);
 	aligned = (void *)
 		(((unsigned long)unaligned + sector_size - 1) &
@@ -496,6 +544,61 @@ compare_gpts(gpt_header *pgpt, gpt_header *agpt, uint64_t lastlba)
 	return;
 }
 
+/**
+ * read_window() - reads @count sectors from @lba into window @w
+ * Description: leaves the window empty if the read fails, read_lba()
+ * then reads from the disk as before.
+ */
+static void
+read_window(int fd, struct gpt_window *w, uint64_t lba, size_t count)
+{
+        size_t bytes = count * get_sector_size(fd);
+
+        w->bytes = 0;
+        w->data = malloc(bytes);
+        if (!w->data)
+                return;
+        if (pread(fd, w->data, bytes, lba * get_sector_size(fd)) !=
+            (ssize_t) bytes) {
+                free(w->data);
+                w->data = NULL;
+                return;
+        }
+        w->lba = lba;
+        w->bytes = bytes;
+}
+
+/**
+ * read_windows() - reads the two ends of the disk for find_valid_gpt()
+ * Description: the first window holds the PMBR, the primary header and
+ * the entries following it, the second one the alternate entries and
+ * header at the end of the disk.
+ */
+static void
+read_windows(int fd)
+{
+        uint64_t lastlba = last_lba(fd);
+        size_t count = 2 + GPT_DEFAULT_RESERVED_PARTITION_ENTRY_ARRAY_SIZE /
+                get_sector_size(fd);
+
+        if (lastlba < 2 * count)
+                return;
+        read_window(fd, &windows[0], 0, count);
+        read_window(fd, &windows[1], lastlba - count + 2, count - 1);
+}
+
+static void
+free_windows(void)
+{
+        unsigned int i;
+
+        for (i = 0; i < sizeof(windows) / sizeof(windows[0]); i++) {
+                free(windows[i].data);
+                windows[i].data = NULL;
+                windows[i].bytes = 0;
+        }
+}
+
 /**
  * find_valid_gpt() - Search disk for valid GPT headers and PTEs
  * @fd  is an open file descriptor to the whole disk
@@ -623,6 +726,81 @@ void guid_to_ascii(const char *guid, char *s)
 }
 
 
+/**
+ * find_cached_gpt() - find_valid_gpt() through the cache of parsed tables
+ * @fd  is an open file descriptor to the whole disk
+ * @gpt is a GPT header ptr, filled on return.
+ * @ptes is a PTEs ptr, filled on return.
+ * Description: Returns 1 if valid, 0 on error.
+ * The header and PTEs belong to the cache, don't free them. Must be
+ * called with gpt_lock held.
+ */
+static int
+find_cached_gpt(int fd, gpt_header ** gpt, gpt_entry ** ptes)
+{
+        struct gpt_cache_entry *e;
+        gpt_header *header;
+        struct stat st;
+        dev_t dev;
+        unsigned int i;
+        int good;
+
+        if (fstat(fd, &st) == -1)
+                return 0;
+        dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+
+        for (i = 0; i < GPT_CACHE_DISKS; i++) {
+                e = &gpt_cache[i];
+                if (!e->gpt || e->dev != dev)
+                        continue;
+                /* the header carries the CRC of the entries, so an
+                   unchanged header means unchanged entries */
+                header = alloc_read_gpt_header(fd, e->lba);
+                if (header && !memcmp(header, e->gpt, sizeof (*header))) {
+                        free(header);
+                        *gpt = e->gpt;
+                        *ptes = e->ptes;
+                        return 1;
+                }
+                free(header);
+                free(e->gpt);
+                free(e->ptes);
+                e->gpt = NULL;
+                e->ptes = NULL;
+                break;
+        }
+
+        read_windows(fd);
+        good = find_valid_gpt(fd, gpt, ptes);
+        free_windows();
+        if (!good)
+                return 0;
+
+        e = &gpt_cache[gpt_cache_next++ % GPT_CACHE_DISKS];
+        free(e->gpt);
+        free(e->ptes);
+        e->dev = dev;
+        e->lba = __le64_to_cpu((*gpt)->my_lba);
+        e->gpt = *gpt;
+        e->ptes = *ptes;
+        return 1;
+}
+
+void
+gpt_disk_invalidate_cache(void)
+{
+        unsigned int i;
+
+        pthread_mutex_lock(&gpt_lock);
+        for (i = 0; i < GPT_CACHE_DISKS; i++) {
+                free(gpt_cache[i].gpt);
+                free(gpt_cache[i].ptes);
+                gpt_cache[i].gpt = NULL;
+                gpt_cache[i].ptes = NULL;
+        }
+        pthread_mutex_unlock(&gpt_lock);
+}
+
 /************************************************************
  * gpt_disk_get_partition_info()
  * Requires:
@@ -641,17 +819,22 @@ gpt_disk_get_partition_info(int fd, uint32_t num,
 	gpt_header *gpt = NULL;
 	gpt_entry *ptes = NULL, *p;
 
-	if (!find_valid_gpt(fd, &gpt, &ptes))
+	pthread_mutex_lock(&gpt_lock);
+	if (!find_cached_gpt(fd, &gpt, &ptes)) {
+		pthread_mutex_unlock(&gpt_lock);
 		return 1;
+	}
 
 	if (num > 0 && num <= __le32_to_cpu(gpt->num_partition_entries)) {
 		p = &ptes[num - 1];
 		guid_to_ascii((char*)&p->partition_type_guid, type);
 		guid_to_ascii((char*)&p->unique_partition_guid, part);
 	} else {
+		pthread_mutex_unlock(&gpt_lock);
 		fprintf (stderr,"partition %d is not valid\n", num);
 		return 1;
 	}
+	pthread_mutex_unlock(&gpt_lock);
 	return 0;
 }
 
@@ -159,6 +159,9 @@ typedef struct _legacy_mbr {
 int gpt_disk_get_partition_info (int fd, uint32_t num,
                                  char *type, char *part);
 
+/* Forget the tables read so far, for when partitions may have changed */
+void gpt_disk_invalidate_cache (void);
+
 
 #endif
 
@@ -49,7 +49,7 @@
 
 #include <stdint.h>
 
-static uint32_t crc32_tab[] = {
+static const uint32_t crc32_tab[] __attribute__((unused)) = {
       0x00000000L, 0x77073096L, 0xee0e612cL, 0x990951baL, 0x076dc419L,
       0x706af48fL, 0xe963a535L, 0x9e6495a3L, 0x0edb8832L, 0x79dcb8a4L,
       0xe0d5e91eL, 0x97d2d988L, 0x09b64c2bL, 0x7eb17cbdL, 0xe7b82d07L,
@@ -104,6 +104,92 @@ static uint32_t crc32_tab[] = {
       0x2d02ef8dL
    };
 
+#if defined(__ARM_FEATURE_CRC32)
+
+/* ARMv8 has the same CRC in hardware, eight bytes an instruction. */
+
+#include <string.h>
+#include <arm_acle.h>
+
+uint32_t
+gptcrc32(const void *buf, unsigned long len, uint32_t seed)
+{
+  const unsigned char *s = buf;
+  uint32_t crc32val = seed;
+  uint64_t v;
+
+  for (; len && ((uintptr_t) s & 7); len--)
+    crc32val = __crc32b(crc32val, *s++);
+  for (; len >= 8; len -= 8, s += 8)
+    {
+      memcpy(&v, s, 8);
+      crc32val = __crc32d(crc32val, v);
+    }
+  for (; len; len--)
+    crc32val = __crc32b(crc32val, *s++);
+  return crc32val;
+}
+
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+/*
+ * Slicing-by-8: crc32_slices[k][b] is the CRC of byte b followed by k zero
+ * bytes, so eight bytes are folded in with eight independent lookups
+ * rather than a chain of eight dependent ones. The 16 KiB partition entry
+ * array is where this pays off.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+static uint32_t crc32_slices[8][256];
+static pthread_once_t crc32_slices_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32_init_slices(void)
+{
+  int i, k;
+
+  for (i = 0; i < 256; i++)
+    crc32_slices[0][i] = crc32_tab[i];
+  for (k = 1; k < 8; k++)
+    for (i = 0; i < 256; i++)
+      crc32_slices[k][i] = (crc32_slices[k - 1][i] >> 8) ^
+        crc32_tab[crc32_slices[k - 1][i] & 0xff];
+}
+
+uint32_t
+gptcrc32(const void *buf, unsigned long len, uint32_t seed)
+{
+  const unsigned char *s = buf;
+  uint32_t crc32val = seed;
+  uint32_t lo, hi;
+
+  pthread_once(&crc32_slices_once, crc32_init_slices);
+
+  for (; len && ((uintptr_t) s & 3); len--)
+    crc32val = crc32_tab[(crc32val ^ *s++) & 0xff] ^ (crc32val >> 8);
+  for (; len >= 8; len -= 8, s += 8)
+    {
+      memcpy(&lo, s, 4);
+      memcpy(&hi, s + 4, 4);
+      lo ^= crc32val;
+      crc32val = crc32_slices[7][lo & 0xff] ^
+        crc32_slices[6][(lo >> 8) & 0xff] ^
+        crc32_slices[5][(lo >> 16) & 0xff] ^
+        crc32_slices[4][lo >> 24] ^
+        crc32_slices[3][hi & 0xff] ^
+        crc32_slices[2][(hi >> 8) & 0xff] ^
+        crc32_slices[1][(hi >> 16) & 0xff] ^
+        crc32_slices[0][hi >> 24];
+    }
+  for (; len; len--)
+    crc32val = crc32_tab[(crc32val ^ *s++) & 0xff] ^ (crc32val >> 8);
+  return crc32val;
+}
+
+#else
+
 /* Return a 32-bit CRC of the contents of the buffer. */
 
 uint32_t
@@ -122,3 +208,5 @@ gptcrc32(const void *buf, unsigned long len, uint32_t seed)
     }
   return crc32val;
 }
+
+#endif
@@ -6,6 +6,9 @@ LOCAL_CFLAGS := -fno-strict-aliasing
 LOCAL_SRC_FILES := \
     gui.cpp \
     resources.cpp \
+    imagecache.cpp \
+    profiler.cpp \
+    jobqueue.cpp \
     pages.cpp \
     text.cpp \
     image.cpp \
@@ -62,6 +65,9 @@ endif
 ifneq ($(TW_NO_SCREEN_TIMEOUT),)
     LOCAL_CFLAGS += -DTW_NO_SCREEN_TIMEOUT
 endif
+ifneq ($(TW_NO_PARTIAL_RENDER),)
+    LOCAL_CFLAGS += -DTW_NO_PARTIAL_RENDER
+endif
 ifeq ($(TW_OEM_BUILD), true)
     LOCAL_CFLAGS += -DTW_OEM_BUILD
 endif
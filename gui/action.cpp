@@ -44,6 +44,9 @@
 #include "../fuse_sideload.h"
 #include "blanktimer.hpp"
 #include "../twinstall.h"
+#include "../twrpZipPrefetch.hpp"
+#include "../twrpLog.hpp"
+#include "../twrpPerfProfile.hpp"
 
 extern "C" {
 #include "../twcommon.h"
@@ -60,90 +63,29 @@ extern "C" {
 
 GUIAction::mapFunc GUIAction::mf;
 std::set<string> GUIAction::setActionsRunningInCallerThread;
+std::set<string> GUIAction::setActionsRunningInBackground;
 static string zip_queue[10];
 static int zip_queue_index;
 pid_t sideload_child_pid;
 
-static void *ActionThread_work_wrapper(void *data);
-
-class ActionThread
+// Runs a list of actions on one of the job queue's lanes
+class ActionJob : public GUIJob
 {
 public:
-	ActionThread();
-	~ActionThread();
+	ActionJob(GUIAction* act) : GUIJob(act), mAction(act), mActions(act->mActions) {}
 
-	void threadActions(GUIAction *act);
-	void run(void *data);
-private:
-	friend void *ActionThread_work_wrapper(void*);
-	struct ThreadData
+	virtual void Run()
 	{
-		ActionThread *this_;
-		GUIAction *act;
-		ThreadData(ActionThread *this_, GUIAction *act) : this_(this_), act(act) {}
-	};
-
-	pthread_t m_thread;
-	bool m_thread_running;
-	pthread_mutex_t m_act_lock;
-};
-
-static ActionThread action_thread;	// for all kinds of longer running actions
-static ActionThread cancel_thread;	// for longer running "cancel" actions
-
-static void *ActionThread_work_wrapper(void *data)
-{
-	static_cast<ActionThread::ThreadData*>(data)->this_->run(data);
-	return NULL;
-}
-
-ActionThread::ActionThread()
-{
-	m_thread_running = false;
-	pthread_mutex_init(&m_act_lock, NULL);
-}
-
-ActionThread::~ActionThread()
-{
-	pthread_mutex_lock(&m_act_lock);
-	if (m_thread_running) {
-		pthread_mutex_unlock(&m_act_lock);
-		pthread_join(m_thread, NULL);
-	} else {
-		pthread_mutex_unlock(&m_act_lock);
-	}
-	pthread_mutex_destroy(&m_act_lock);
-}
-
-void ActionThread::threadActions(GUIAction *act)
-{
-	pthread_mutex_lock(&m_act_lock);
-	if (m_thread_running) {
-		pthread_mutex_unlock(&m_act_lock);
-		LOGERR("Another threaded action is already running -- not running %u actions starting with '%s'\n",
-				act->mActions.size(), act->mActions[0].mFunction.c_str());
-	} else {
-		m_thread_running = true;
-		pthread_mutex_unlock(&m_act_lock);
-		ThreadData *d = new ThreadData(this, act);
-		pthread_create(&m_thread, NULL, &ActionThread_work_wrapper, d);
+		// The list is a copy; a theme reload deletes the GUIAction and
+		// cancels the job, so it is left alone after that
+		for (size_t i = 0; i < mActions.size() && !IsCancelled(); ++i)
+			mAction->doAction(mActions[i]);
 	}
-}
-
-void ActionThread::run(void *data)
-{
-	ThreadData *d = (ThreadData*)data;
-	GUIAction* act = d->act;
-
-	std::vector<GUIAction::Action>::iterator it;
-	for (it = act->mActions.begin(); it != act->mActions.end(); ++it)
-		act->doAction(*it);
 
-	pthread_mutex_lock(&m_act_lock);
-	m_thread_running = false;
-	pthread_mutex_unlock(&m_act_lock);
-	delete d;
-}
+private:
+	GUIAction* mAction;
+	std::vector<GUIAction::Action> mActions;
+};
 
 GUIAction::GUIAction(xml_node<>* node)
 	: GUIObject(node)
@@ -163,7 +105,6 @@ GUIAction::GUIAction(xml_node<>* node)
 		ADD_ACTION(key);
 		ADD_ACTION(page);
 		ADD_ACTION(reload);
-		ADD_ACTION(readBackup);
 		ADD_ACTION(set);
 		ADD_ACTION(clear);
 		ADD_ACTION(mount);
@@ -204,7 +145,15 @@ GUIAction::GUIAction(xml_node<>* node)
 		for (mapFunc::const_iterator it = mf.begin(); it != mf.end(); ++it)
 			setActionsRunningInCallerThread.insert(it->first);
 
-		// These actions will run in a separate thread
+		// These actions only read, and run next to the others
+		ADD_ACTION(readBackup);
+
+		for (mapFunc::const_iterator it = mf.begin(); it != mf.end(); ++it) {
+			if (setActionsRunningInCallerThread.find(it->first) == setActionsRunningInCallerThread.end())
+				setActionsRunningInBackground.insert(it->first);
+		}
+
+		// These actions will run in a separate thread, one list at a time
 		ADD_ACTION(flash);
 		ADD_ACTION(wipe);
 		ADD_ACTION(refreshsizes);
@@ -213,6 +162,7 @@ GUIAction::GUIAction(xml_node<>* node)
 		ADD_ACTION(fixpermissions);
 		ADD_ACTION(dd);
 		ADD_ACTION(partitionsd);
+		ADD_ACTION(storagebench);
 		ADD_ACTION(installhtcdumlock);
 		ADD_ACTION(htcdumlockrestoreboot);
 		ADD_ACTION(htcdumlockreflashrecovery);
@@ -286,6 +236,11 @@ GUIAction::GUIAction(xml_node<>* node)
 	}
 }
 
+GUIAction::~GUIAction()
+{
+	GUIJobQueue::CancelOwner(this);
+}
+
 int GUIAction::NotifyTouch(TOUCH_STATE state, int x __unused, int y __unused)
 {
 	if (state == TOUCH_RELEASE)
@@ -415,6 +370,8 @@ GUIAction::ThreadType GUIAction::getThreadType(const GUIAction::Action& action)
 	if (needsThread) {
 		if (func == "cancelbackup")
 			return THREAD_CANCEL;
+		else if (setActionsRunningInBackground.find(func) != setActionsRunningInBackground.end())
+			return THREAD_BACKGROUND;
 		else
 			return THREAD_ACTION;
 	}
@@ -434,8 +391,10 @@ int GUIAction::doActions()
 		ThreadType tt = getThreadType(*it);
 		if (tt == THREAD_NONE)
 			continue;
-		if (threadType == THREAD_NONE)
+		if (threadType == THREAD_NONE || threadType == THREAD_BACKGROUND)
 			threadType = tt;
+		else if (tt == THREAD_BACKGROUND)
+			continue; // reading along with a threaded action doesn't change the lane
 		else if (threadType != tt) {
 			LOGERR("Can't mix normal and cancel actions in the same list.\n"
 				"Running the whole batch in the cancel thread.\n");
@@ -447,11 +406,15 @@ int GUIAction::doActions()
 	// Now run the actions in the desired thread.
 	switch (threadType) {
 		case THREAD_ACTION:
-			action_thread.threadActions(this);
+			queueActions(JOB_EXCLUSIVE);
 			break;
 
 		case THREAD_CANCEL:
-			cancel_thread.threadActions(this);
+			queueActions(JOB_CANCEL);
+			break;
+
+		case THREAD_BACKGROUND:
+			queueActions(JOB_BACKGROUND);
 			break;
 
 		default: {
@@ -465,6 +428,14 @@ int GUIAction::doActions()
 	return 0;
 }
 
+void GUIAction::queueActions(GUIJobLane lane)
+{
+	// Jobs of other buttons wait their turn; a second tap on this one is dropped
+	if (!GUIJobQueue::Post(lane, new ActionJob(this)))
+		LOGERR("These actions are already queued or running -- not running %u actions starting with '%s'\n",
+				mActions.size(), mActions[0].mFunction.c_str());
+}
+
 int GUIAction::doAction(Action action)
 {
 	DataManager::GetValue(TW_SIMULATE_ACTIONS, simulate);
@@ -656,6 +627,7 @@ int GUIAction::copylog(std::string arg __unused)
 		PartitionManager.Mount_Current_Storage(true);
 		curr_storage = DataManager::GetCurrentStoragePath();
 		dst = curr_storage + "/recovery.log";
+		twrpLog::Flush();
 		TWFunc::copy_file("/tmp/recovery.log", dst.c_str(), 0755);
 		tw_set_default_metadata(dst.c_str());
 		if (copy_kernel_log)
@@ -1033,9 +1005,12 @@ int GUIAction::flash(std::string arg)
 		DataManager::SetValue("tw_file", zip_filename);
 		DataManager::SetValue(TW_ZIP_INDEX, (i + 1));
 
-		TWFunc::SetPerformanceMode(true);
+		// The next zip is read and verified while this one installs
+		if (i + 1 < zip_queue_index)
+			twrpZipPrefetch::Get()->Start(zip_queue[i + 1]);
+		twrpPerfProfile::Get()->Enter(PERF_INSTALL);
 		ret_val = flash_zip(zip_path, &wipe_cache);
-		TWFunc::SetPerformanceMode(false);
+		twrpPerfProfile::Get()->Leave(PERF_INSTALL);
 		if (ret_val != 0) {
 			gui_msg(Msg(msg::kError, "zip_err=Error installing zip file '{1}'")(zip_path));
 			ret_val = 1;
@@ -1043,6 +1018,7 @@ int GUIAction::flash(std::string arg)
 		}
 	}
 	zip_queue_index = 0;
+	twrpZipPrefetch::Get()->Clear();
 
 	if (wipe_cache) {
 		gui_msg("zip_wipe_cache=One or more zip requested a cache wipe -- Wiping cache now.");
@@ -1066,6 +1042,7 @@ int GUIAction::wipe(std::string arg)
 	if (simulate) {
 		simulate_progress_bar();
 	} else {
+		twrpPerfProfile::Get()->Enter(PERF_WIPE);
 		if (arg == "data")
 			ret_val = PartitionManager.Factory_Reset();
 		else if (arg == "battery")
@@ -1093,8 +1070,7 @@ int GUIAction::wipe(std::string arg)
 		} else if (arg == "ANDROIDSECURE") {
 			ret_val = PartitionManager.Wipe_Android_Secure();
 		} else if (arg == "LIST") {
-			string Wipe_List, wipe_path;
-			bool skip = false;
+			string Wipe_List, wipe_path, batch;
 			ret_val = true;
 
 			DataManager::GetValue("tw_wipe_list", Wipe_List);
@@ -1109,42 +1085,34 @@ int GUIAction::wipe(std::string arg)
 							gui_msg("and_sec_wipe_err=Unable to wipe android secure");
 							ret_val = false;
 							break;
-						} else {
-							skip = true;
 						}
 					} else if (wipe_path == "DALVIK") {
 						if (!PartitionManager.Wipe_Dalvik_Cache()) {
 							gui_err("dalvik_wipe_err=Failed to wipe dalvik");
 							ret_val = false;
 							break;
-						} else {
-							skip = true;
 						}
 					} else if (wipe_path == "INTERNAL") {
 						if (!PartitionManager.Wipe_Media_From_Data()) {
 							ret_val = false;
 							break;
-						} else {
-							skip = true;
-						}
-					}
-					if (!skip) {
-						if (!PartitionManager.Wipe_By_Path(wipe_path)) {
-							gui_msg(Msg(msg::kError, "unable_to_wipe=Unable to wipe {1}.")(wipe_path));
-							ret_val = false;
-							break;
-						} else if (wipe_path == DataManager::GetSettingsStoragePath()) {
-							arg = wipe_path;
 						}
 					} else {
-						skip = false;
+						// Partitions are wiped together once the list is read
+						batch += wipe_path + ";";
+						if (wipe_path == DataManager::GetSettingsStoragePath())
+							arg = wipe_path;
 					}
 					start_pos = end_pos + 1;
 					end_pos = Wipe_List.find(";", start_pos);
 				}
 			}
+			// Wipe_By_Path names each partition that failed
+			if (ret_val && !batch.empty() && !PartitionManager.Wipe_By_Path(batch))
+				ret_val = false;
 		} else
 			ret_val = PartitionManager.Wipe_By_Path(arg);
+		twrpPerfProfile::Get()->Leave(PERF_WIPE);
 #ifndef TW_OEM_BUILD
 		if (arg == DataManager::GetSettingsStoragePath()) {
 			// If we wiped the settings storage path, recreate the TWRP folder and dump the settings
@@ -1175,8 +1143,11 @@ int GUIAction::refreshsizes(std::string arg __unused)
 	operation_start("Refreshing Sizes");
 	if (simulate) {
 		simulate_progress_bar();
-	} else
+	} else {
+		// Changes made outside of TWRP's own operations are not tracked
+		PartitionManager.Invalidate_All_Sizes();
 		PartitionManager.Update_System_Details();
+	}
 	operation_end(0);
 	return 0;
 }
@@ -1235,6 +1206,15 @@ int GUIAction::nandroid(std::string arg)
 				else
 					ret = 1; // failure
 			}
+		} else if (arg == "restorepath") {
+			string Restore_Name, Restore_Path;
+
+			DataManager::GetValue("tw_restore", Restore_Name);
+			DataManager::GetValue("tw_restore_path", Restore_Path);
+			if (PartitionManager.Run_Restore_Path(Restore_Name, Restore_Path))
+				ret = 0; // success
+			else
+				ret = 1; // failure
 		} else {
 			operation_end(1); // invalid arg specified, fail
 			return -1;
@@ -1246,6 +1226,9 @@ int GUIAction::nandroid(std::string arg)
 }
 
 int GUIAction::cancelbackup(std::string arg __unused) {
+	// Work queued behind the backup goes with it
+	GUIJobQueue::CancelPending(JOB_EXCLUSIVE);
+
 	if (simulate) {
 		PartitionManager.stop_backup.set_value(1);
 	}
@@ -1282,15 +1265,17 @@ int GUIAction::fixpermissions(std::string arg)
 
 int GUIAction::dd(std::string arg)
 {
+	int op_status = 0;
+
 	operation_start("imaging");
 
 	if (simulate) {
 		simulate_progress_bar();
 	} else {
-		string cmd = "dd " + arg;
-		TWFunc::Exec_Cmd(cmd);
+		if (!PartitionManager.Raw_Copy(arg))
+			op_status = 1;
 	}
-	operation_end(0);
+	operation_end(op_status);
 	return 0;
 }
 
@@ -1316,6 +1301,22 @@ int GUIAction::partitionsd(std::string arg __unused)
 
 }
 
+int GUIAction::storagebench(std::string arg __unused)
+{
+	operation_start("Storage Benchmark");
+	int ret_val = 0;
+
+	if (simulate) {
+		simulate_progress_bar();
+	} else {
+		PartitionManager.Mount_All_Storage();
+		if (!PartitionManager.Run_Storage_Benchmark())
+			ret_val = 1; // failed
+	}
+	operation_end(ret_val);
+	return 0;
+}
+
 int GUIAction::installhtcdumlock(std::string arg __unused)
 {
 	operation_start("Install HTC Dumlock");
@@ -1647,12 +1648,12 @@ int GUIAction::decrypt_backup(std::string arg __unused)
 		DataManager::GetValue("tw_restore", Restore_Path);
 		Restore_Path += "/";
 		DataManager::GetValue("tw_restore_password", Password);
-		TWFunc::SetPerformanceMode(true);
+		twrpPerfProfile::Get()->Enter(PERF_RESTORE);
 		if (TWFunc::Try_Decrypting_Backup(Restore_Path, Password))
 			op_status = 0; // success
 		else
 			op_status = 1; // fail
-		TWFunc::SetPerformanceMode(false);
+		twrpPerfProfile::Get()->Leave(PERF_RESTORE);
 	}
 
 	operation_end(op_status);
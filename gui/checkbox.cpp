@@ -33,6 +33,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <string>
 
 extern "C" {
@@ -55,6 +56,7 @@ GUICheckbox::GUICheckbox(xml_node<>* node)
 	mRendered = false;
 
 	mLastState = 0;
+	mVarID = INVALID_VAR_ID;
 
 	if (!node)
 		return;
@@ -80,6 +82,7 @@ GUICheckbox::GUICheckbox(xml_node<>* node)
 		attr = child->first_attribute("default");
 		if (attr)
 			DataManager::SetValue(mVarName, attr->value());
+		mVarID = DataManager::GetVarID(mVarName);
 	}
 
 	mCheckW = mCheckH = 0;
@@ -110,7 +113,7 @@ int GUICheckbox::Render(void)
 
 	int ret = 0;
 	int lastState = 0;
-	DataManager::GetValue(mVarName, lastState);
+	DataManager::GetValue(mVarID, lastState);
 
 	if (lastState)
 	{
@@ -135,13 +138,31 @@ int GUICheckbox::Update(void)
 	if (!mRendered)			return 2;
 
 	int lastState = 0;
-	DataManager::GetValue(mVarName, lastState);
+	DataManager::GetValue(mVarID, lastState);
 
 	if (lastState != mLastState)
 		return 2;
 	return 0;
 }
 
+int GUICheckbox::GetRenderArea(int& x, int& y, int& w, int& h)
+{
+	int lx, ly, lw, lh;
+
+	x = mRenderX;
+	y = mRenderY;
+	w = mRenderW;
+	h = mRenderH;
+	if (mLabel && mLabel->GetRenderArea(lx, ly, lw, lh) == 0 && lw > 0 && lh > 0) {
+		int r = std::max(x + w, lx + lw), b = std::max(y + h, ly + lh);
+		x = std::min(x, lx);
+		y = std::min(y, ly);
+		w = r - x;
+		h = b - y;
+	}
+	return (w > 0 && h > 0) ? 0 : -1;
+}
+
 int GUICheckbox::SetRenderPos(int x, int y, int w, int h)
 {
 	mRenderX = x;
@@ -175,7 +196,7 @@ int GUICheckbox::NotifyTouch(TOUCH_STATE state, int x __unused, int y __unused)
 	if (state == TOUCH_RELEASE)
 	{
 		int lastState;
-		DataManager::GetValue(mVarName, lastState);
+		DataManager::GetValue(mVarID, lastState);
 		lastState = (lastState == 0) ? 1 : 0;
 		DataManager::SetValue(mVarName, lastState);
 
@@ -27,6 +27,8 @@
 #include <unistd.h>
 #include <pthread.h>
 
+#include <atomic>
+#include <deque>
 #include <string>
 
 extern "C" {
@@ -41,12 +43,93 @@ extern "C" {
 
 #define GUI_CONSOLE_BUFFER_SIZE 512
 
+// Lines the consoles can scroll back to; older ones are only in the log
+#define GUI_CONSOLE_LOG_LINES 2048
+
+// The console lines of the session, newest GUI_CONSOLE_LOG_LINES only.
+// Writers take console_lock between them, readers take no lock at all:
+// every line has a sequence number, and a slot that was overwritten
+// while it was being copied is noticed and skipped.
+class ConsoleLog
+{
+public:
+	ConsoleLog() : mHead(0), mStart(0), mEpoch(0) {}
+
+	// Caller holds console_lock
+	void Append(const char* text, const char* color)
+	{
+		uint64_t seq = mHead.load(std::memory_order_relaxed);
+		Slot& slot = mSlots[seq % GUI_CONSOLE_LOG_LINES];
+		slot.state.store(seq * 2 + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		strlcpy(slot.text, text, sizeof(slot.text));
+		strlcpy(slot.color, color, sizeof(slot.color));
+		slot.state.store(seq * 2 + 2, std::memory_order_release);
+		mHead.store(seq + 1, std::memory_order_release);
+	}
+
+	// Caller holds console_lock; readers start over on the next read
+	void Clear()
+	{
+		mStart.store(mHead.load(std::memory_order_relaxed), std::memory_order_release);
+		mEpoch.fetch_add(1, std::memory_order_release);
+	}
+
+	// Sequence number of the next line to be added
+	uint64_t Head() const { return mHead.load(std::memory_order_acquire); }
+
+	// Oldest line that can still be read
+	uint64_t Oldest() const
+	{
+		uint64_t head = Head();
+		uint64_t start = mStart.load(std::memory_order_acquire);
+		if (head - start > GUI_CONSOLE_LOG_LINES)
+			start = head - GUI_CONSOLE_LOG_LINES;
+		return start;
+	}
+
+	// Changes with every Clear()
+	unsigned Epoch() const { return mEpoch.load(std::memory_order_acquire); }
+
+	// Copies line seq out; false if it has been overwritten already
+	bool Read(uint64_t seq, std::string* text, std::string* color) const
+	{
+		const Slot& slot = mSlots[seq % GUI_CONSOLE_LOG_LINES];
+		if (slot.state.load(std::memory_order_acquire) != seq * 2 + 2)
+			return false;
+		char textCopy[GUI_CONSOLE_BUFFER_SIZE];
+		char colorCopy[sizeof(slot.color)];
+		memcpy(textCopy, slot.text, sizeof(textCopy));
+		memcpy(colorCopy, slot.color, sizeof(colorCopy));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.state.load(std::memory_order_relaxed) != seq * 2 + 2)
+			return false;
+		textCopy[sizeof(textCopy) - 1] = '\0';
+		colorCopy[sizeof(colorCopy) - 1] = '\0';
+		text->assign(textCopy);
+		color->assign(colorCopy);
+		return true;
+	}
+
+private:
+	struct Slot {
+		std::atomic<uint64_t> state; // seq * 2 + 1 while being written, seq * 2 + 2 when done
+		char text[GUI_CONSOLE_BUFFER_SIZE];
+		char color[32];
+		Slot() : state(0) {}
+	};
+
+	Slot mSlots[GUI_CONSOLE_LOG_LINES];
+	std::atomic<uint64_t> mHead;
+	std::atomic<uint64_t> mStart;
+	std::atomic<unsigned> mEpoch;
+};
+
 static pthread_mutex_t console_lock;
 static size_t last_message_count = 0;
-static std::vector<Message> gMessages;
+static std::deque<Message> gMessages; // kept for retranslation, bounded like the log
 
-static std::vector<std::string> gConsole;
-static std::vector<std::string> gConsoleColor;
+static ConsoleLog gConsoleLog;
 static FILE* ors_file = NULL;
 
 struct InitMutex
@@ -78,8 +161,7 @@ static void internal_gui_print(const char *color, char *buf)
 		if (*next == '\n')
 		{
 			*next = '\0';
-			gConsole.push_back(start);
-			gConsoleColor.push_back(color);
+			gConsoleLog.Append(start, color);
 
 			start = ++next;
 		}
@@ -88,11 +170,10 @@ static void internal_gui_print(const char *color, char *buf)
 	}
 
 	// The text after last \n (or whole string if there is no \n)
-	if (*start) {
-		gConsole.push_back(start);
-		gConsoleColor.push_back(color);
-	}
+	if (*start)
+		gConsoleLog.Append(start, color);
 	pthread_mutex_unlock(&console_lock);
+	gui_wake();
 }
 
 extern "C" void gui_print(const char *fmt, ...)
@@ -168,6 +249,7 @@ void gui_msg(Message msg)
 	pthread_mutex_lock(&console_lock);
 	gMessages.push_back(msg);
 	pthread_mutex_unlock(&console_lock);
+	gui_wake();
 }
 
 void GUIConsole::Translate_Now()
@@ -189,10 +271,15 @@ void GUIConsole::Translate_Now()
 			color = "highlight";
 		else if (gMessages[m].GetKind() == msg::kWarning)
 			color = "warning";
-		gConsole.push_back(message);
-		gConsoleColor.push_back(color);
+		gConsoleLog.Append(message.c_str(), color.c_str());
 	}
 	last_message_count = message_count;
+
+	// A retranslation can't bring back more than the log holds anyway
+	while (gMessages.size() > GUI_CONSOLE_LOG_LINES) {
+		gMessages.pop_front();
+		--last_message_count;
+	}
 	pthread_mutex_unlock(&console_lock);
 }
 
@@ -200,8 +287,7 @@ void GUIConsole::Clear_For_Retranslation()
 {
 	pthread_mutex_lock(&console_lock);
 	last_message_count = 0;
-	gConsole.clear();
-	gConsoleColor.clear();
+	gConsoleLog.Clear();
 	pthread_mutex_unlock(&console_lock);
 }
 
@@ -209,7 +295,8 @@ GUIConsole::GUIConsole(xml_node<>* node) : GUIScrollList(node)
 {
 	xml_node<>* child;
 
-	mLastCount = 0;
+	mLastSeq = 0;
+	mLogEpoch = gConsoleLog.Epoch();
 	scrollToEnd = true;
 	mSlideoutX = mSlideoutY = mSlideoutW = mSlideoutH = 0;
 	mSlideout = 0;
@@ -267,12 +354,53 @@ int GUIConsole::RenderSlideout(void)
 	return 0;
 }
 
+bool GUIConsole::ReadNewLines(void)
+{
+	if (!mFont || !mFont->GetResource())
+		return false;
+
+	bool added = false;
+	unsigned epoch = gConsoleLog.Epoch();
+	if (epoch != mLogEpoch) {
+		mLogEpoch = epoch;
+		mLastSeq = 0;
+		rConsole.clear();
+		rConsoleColor.clear();
+		added = true;
+	}
+
+	uint64_t head = gConsoleLog.Head();
+	std::string text, color;
+	std::vector<std::string> wrapped;
+	while (mLastSeq < head) {
+		mLastSeq = std::max(mLastSeq, gConsoleLog.Oldest());
+		if (mLastSeq >= head)
+			break;
+		if (gConsoleLog.Read(mLastSeq, &text, &color)) {
+			wrapped.clear();
+			WrapLine(text, &wrapped);
+			rConsole.insert(rConsole.end(), wrapped.begin(), wrapped.end());
+			rConsoleColor.insert(rConsoleColor.end(), wrapped.size(), color);
+			added = true;
+		}
+		++mLastSeq;
+	}
+
+	// The wrapped lines are bounded like the log they come from
+	if (rConsole.size() > GUI_CONSOLE_LOG_LINES) {
+		size_t excess = rConsole.size() - GUI_CONSOLE_LOG_LINES;
+		rConsole.erase(rConsole.begin(), rConsole.begin() + excess);
+		rConsoleColor.erase(rConsoleColor.begin(), rConsoleColor.begin() + excess);
+		if (!scrollToEnd)
+			SetVisibleListLocation(std::max(firstDisplayedItem - (int) excess, 0));
+	}
+	return added;
+}
+
 int GUIConsole::RenderConsole(void)
 {
 	Translate_Now();
-	pthread_mutex_lock(&console_lock);
-	AddLines(&gConsole, &gConsoleColor, &mLastCount, &rConsole, &rConsoleColor);
-	pthread_mutex_unlock(&console_lock);
+	ReadNewLines();
 	GUIScrollList::Render();
 
 	// if last line is fully visible, keep tracking the last line when new lines are added
@@ -323,10 +451,7 @@ int GUIConsole::Update(void)
 		scrollToEnd = true;
 	}
 
-	pthread_mutex_lock(&console_lock);
-	bool addedNewText = AddLines(&gConsole, &gConsoleColor, &mLastCount, &rConsole, &rConsoleColor);
-	pthread_mutex_unlock(&console_lock);
-	if (addedNewText) {
+	if (ReadNewLines()) {
 		// someone added new text
 		// at least the scrollbar must be updated, even if the new lines are currently not visible
 		mUpdate = 1;
@@ -19,6 +19,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
 #include <algorithm>
 
 extern "C" {
@@ -34,6 +35,26 @@ extern "C" {
 
 int GUIFileSelector::mSortOrder = 0;
 
+// How many entries the worker reads before handing them to the GUI thread
+#define FILE_LIST_BATCH 256
+
+struct GUIFileSelector::FileListJob {
+	std::string folder;
+	DIR* dir;
+	std::string extn;
+	int showNavFolders;
+	bool needStat; // sorting by size or date; names and d_type are enough otherwise
+
+	pthread_mutex_t lock;
+	std::vector<FileData> folders; // found and not yet collected
+	std::vector<FileData> files;
+	bool done;
+	bool cancelled;
+
+	FileListJob() : dir(NULL), showNavFolders(0), needStat(false), done(false), cancelled(false) { pthread_mutex_init(&lock, NULL); }
+	~FileListJob() { if (dir) closedir(dir); pthread_mutex_destroy(&lock); }
+};
+
 GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 {
 	xml_attribute<>* attr;
@@ -133,6 +154,7 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 
 GUIFileSelector::~GUIFileSelector()
 {
+	CancelFileList();
 }
 
 int GUIFileSelector::Update(void)
@@ -152,6 +174,8 @@ int GUIFileSelector::Update(void)
 		} else
 			return 0;
 	}
+	if (mFileListJob && CollectFileList())
+		mUpdate = 1;
 
 	if (mUpdate) {
 		mUpdate = 0;
@@ -188,16 +212,16 @@ int GUIFileSelector::NotifyVarChange(const std::string& varName, const std::stri
 	return 0;
 }
 
-bool GUIFileSelector::fileSort(FileData d1, FileData d2)
+bool GUIFileSelector::fileSort(const FileData& d1, const FileData& d2)
 {
 	if (d1.fileName == ".")
-		return -1;
+		return d2.fileName != ".";
 	if (d2.fileName == ".")
-		return 0;
+		return false;
 	if (d1.fileName == "..")
-		return -1;
+		return d2.fileName != "..";
 	if (d2.fileName == "..")
-		return 0;
+		return false;
 
 	switch (mSortOrder) {
 		case 3: // by size largest first
@@ -227,10 +251,9 @@ bool GUIFileSelector::fileSort(FileData d1, FileData d2)
 int GUIFileSelector::GetFileList(const std::string folder)
 {
 	DIR* d;
-	struct dirent* de;
-	struct stat st;
 
 	// Clear all data
+	CancelFileList();
 	mFolderList.clear();
 	mFileList.clear();
 
@@ -251,48 +274,140 @@ int GUIFileSelector::GetFileList(const std::string folder)
 		return -1;
 	}
 
-	while ((de = readdir(d)) != NULL) {
+	std::shared_ptr<FileListJob> job = std::make_shared<FileListJob>();
+	job->folder = folder;
+	job->dir = d;
+	job->extn = mExtn;
+	job->showNavFolders = mShowNavFolders;
+	job->needStat = mSortOrder < -1 || mSortOrder > 1;
+
+	// The worker holds its own reference, so the job outlives a selector
+	// that goes away while a slow folder is still being read
+	pthread_t thread;
+	std::shared_ptr<FileListJob>* cookie = new std::shared_ptr<FileListJob>(job);
+	if (pthread_create(&thread, NULL, FileListWorker, cookie) == 0) {
+		pthread_detach(thread);
+	} else {
+		LOGINFO("Unable to start listing thread, reading '%s' here\n", folder.c_str());
+		FileListWorker(cookie);
+	}
+	mFileListJob = job;
+	CollectFileList();
+	return 0;
+}
+
+void* GUIFileSelector::FileListWorker(void* cookie)
+{
+	std::shared_ptr<FileListJob>* ref = (std::shared_ptr<FileListJob>*) cookie;
+	FileListJob* job = ref->get();
+	std::vector<FileData> folders, files;
+	struct dirent* de;
+	struct stat st;
+	bool cancelled = false;
+
+	while (!cancelled && (de = readdir(job->dir)) != NULL) {
 		FileData data;
 
 		data.fileName = de->d_name;
 		if (data.fileName == ".")
 			continue;
-		if (data.fileName == ".." && folder == "/")
+		if (data.fileName == ".." && job->folder == "/")
 			continue;
 
 		data.fileType = de->d_type;
 
-		std::string path = folder + "/" + data.fileName;
-		stat(path.c_str(), &st);
-		data.protection = st.st_mode;
-		data.userId = st.st_uid;
-		data.groupId = st.st_gid;
-		data.fileSize = st.st_size;
-		data.lastAccess = st.st_atime;
-		data.lastModified = st.st_mtime;
-		data.lastStatChange = st.st_ctime;
+		std::string path = job->folder + "/" + data.fileName;
+		if (job->needStat && stat(path.c_str(), &st) == 0) {
+			data.protection = st.st_mode;
+			data.userId = st.st_uid;
+			data.groupId = st.st_gid;
+			data.fileSize = st.st_size;
+			data.lastAccess = st.st_atime;
+			data.lastModified = st.st_mtime;
+			data.lastStatChange = st.st_ctime;
+		} else {
+			data.protection = 0;
+			data.userId = 0;
+			data.groupId = 0;
+			data.fileSize = 0;
+			data.lastAccess = data.lastModified = data.lastStatChange = 0;
+		}
 
 		if (data.fileType == DT_UNKNOWN) {
 			data.fileType = TWFunc::Get_D_Type_From_Stat(path);
 		}
 		if (data.fileType == DT_DIR) {
-			if (mShowNavFolders || (data.fileName != "." && data.fileName != ".."))
-				mFolderList.push_back(data);
+			if (job->showNavFolders || (data.fileName != "." && data.fileName != ".."))
+				folders.push_back(data);
 		} else if (data.fileType == DT_REG || data.fileType == DT_LNK || data.fileType == DT_BLK) {
-			if (mExtn.empty() || (data.fileName.length() > mExtn.length() && data.fileName.substr(data.fileName.length() - mExtn.length()) == mExtn)) {
-				if (mExtn == ".ab" && twadbbu::Check_ADB_Backup_File(path))
-					mFolderList.push_back(data);
+			const std::string& extn = job->extn;
+			if (extn.empty() || (data.fileName.length() > extn.length() && data.fileName.substr(data.fileName.length() - extn.length()) == extn)) {
+				if (extn == ".ab" && twadbbu::Check_ADB_Backup_File(path))
+					folders.push_back(data);
 				else
-					mFileList.push_back(data);
+					files.push_back(data);
 			}
 		}
+
+		if (folders.size() + files.size() >= FILE_LIST_BATCH) {
+			pthread_mutex_lock(&job->lock);
+			job->folders.insert(job->folders.end(), folders.begin(), folders.end());
+			job->files.insert(job->files.end(), files.begin(), files.end());
+			cancelled = job->cancelled;
+			pthread_mutex_unlock(&job->lock);
+			folders.clear();
+			files.clear();
+		}
 	}
-	closedir(d);
 
-	std::sort(mFolderList.begin(), mFolderList.end(), fileSort);
-	std::sort(mFileList.begin(), mFileList.end(), fileSort);
+	pthread_mutex_lock(&job->lock);
+	job->folders.insert(job->folders.end(), folders.begin(), folders.end());
+	job->files.insert(job->files.end(), files.begin(), files.end());
+	job->done = true;
+	pthread_mutex_unlock(&job->lock);
 
-	return 0;
+	delete ref;
+	return NULL;
+}
+
+void GUIFileSelector::MergeSorted(std::vector<FileData>& list, std::vector<FileData>& batch)
+{
+	if (batch.empty())
+		return;
+	std::sort(batch.begin(), batch.end(), fileSort);
+	size_t middle = list.size();
+	list.insert(list.end(), batch.begin(), batch.end());
+	std::inplace_merge(list.begin(), list.begin() + middle, list.end(), fileSort);
+}
+
+// Adds what the worker found since the last call to the sorted lists.
+// Returns true if the lists changed.
+bool GUIFileSelector::CollectFileList()
+{
+	std::vector<FileData> folders, files;
+	bool done;
+
+	pthread_mutex_lock(&mFileListJob->lock);
+	folders.swap(mFileListJob->folders);
+	files.swap(mFileListJob->files);
+	done = mFileListJob->done;
+	pthread_mutex_unlock(&mFileListJob->lock);
+
+	if (done)
+		mFileListJob.reset();
+	MergeSorted(mFolderList, folders);
+	MergeSorted(mFileList, files);
+	return !folders.empty() || !files.empty();
+}
+
+void GUIFileSelector::CancelFileList()
+{
+	if (!mFileListJob)
+		return;
+	pthread_mutex_lock(&mFileListJob->lock);
+	mFileListJob->cancelled = true;
+	pthread_mutex_unlock(&mFileListJob->lock);
+	mFileListJob.reset();
 }
 
 void GUIFileSelector::SetPageFocus(int inFocus)
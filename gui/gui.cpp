@@ -28,6 +28,9 @@
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
@@ -50,10 +53,12 @@ extern "C"
 #include "../openrecoveryscript.hpp"
 #include "../orscmd/orscmd.h"
 #include "blanktimer.hpp"
+#include "profiler.hpp"
 #include "../tw_atomic.hpp"
+#include "../twrpStartupTrace.hpp"
+#include "../twrpMemBudget.hpp"
 
 // Enable to print render time of each frame to the log file
-//#define PRINT_RENDER_TIME 1
 
 #ifdef _EVENT_LOGGING
 #define LOGEVENT(...) LOGERR(__VA_ARGS__)
@@ -61,6 +66,12 @@ extern "C"
 #define LOGEVENT(...) do {} while (0)
 #endif
 
+// String cache of each font, out of the memory budget. A theme loads about
+// FONT_CACHE_FONTS fonts
+#define FONT_CACHE_FONTS 4
+#define FONT_CACHE_BYTES (2 * 1024 * 1024)
+#define FONT_CACHE_MIN_BYTES (256 * 1024)
+
 using namespace rapidxml;
 
 // Global values
@@ -78,7 +89,20 @@ int gGuiRunning = 0;
 int g_pty_fd = -1;  // set by terminal on init
 void terminal_pty_read();
 
-int select_fd = 0;
+// The main loop sleeps on one epoll set: input, the pty, uevents, mountinfo,
+// the ORS fifo, the frame timer and the wake eventfd
+static int gEpollFd = -1;
+static int gWakeFd = -1;
+static int gFrameTimerFd = -1;
+static TWAtomicInt gFdsChanged;
+// What is in gEpollFd, -1 for nothing
+static int gWatchedInput = -1;
+static int gWatchedPty = -1;
+static int gWatchedUevent = -1;
+static int gWatchedMountinfo = -1;
+static int gWatchedOrs = -1;
+// A pty whose child went away, it would be readable forever
+static int gHungUpPty = -1;
 
 static int gRecorder = -1;
 
@@ -96,6 +120,18 @@ static void flip(void)
 	gr_flip();
 }
 
+static void flip_region(int x, int y, int w, int h)
+{
+	if (gRecorder != -1)
+	{
+		timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		write(gRecorder, &time, sizeof(timespec));
+		gr_write_frame_to_file(gRecorder);
+	}
+	gr_flip_region(x, y, w, h);
+}
+
 void rapidxml::parse_error_handler(const char *what, void *where)
 {
 	fprintf(stderr, "Parser error: %s\n", what);
@@ -118,6 +154,7 @@ public:
 		key_status = KS_NONE;
 		state = AS_NO_ACTION;
 		x = y = 0;
+		touch_time_us = 0;
 
 #ifndef TW_NO_SCREEN_TIMEOUT
 		{
@@ -134,8 +171,14 @@ public:
 	// process input events. returns true if any event was received.
 	bool processInput(int timeout_ms);
 
+	// whether a touch or key is held down, which needs frames to repeat
+	bool isHeld() { return touch_status != TS_NONE || key_status != KS_NONE; }
+
 	void handleDrag();
 
+	// event time of x and y, in microseconds
+	uint64_t touchTime() { return touch_time_us; }
+
 private:
 	// timeouts for touch/key hold and repeat
 	int touch_hold_ms;
@@ -163,6 +206,7 @@ private:
 	key_status_enum key_status;
 	action_state_enum state;
 	int x, y; // x and y coordinates of last touch
+	uint64_t touch_time_us;
 	struct timeval touchStart; // used to track time for long press / key repeat
 
 	void processHoldAndRepeat();
@@ -171,6 +215,8 @@ private:
 	void process_EV_KEY(input_event& ev);
 
 	void doTouchStart();
+	void doTouchRelease();
+	void setTouchTime(const input_event& ev) { touch_time_us = ev.time.tv_sec * 1000000ULL + ev.time.tv_usec; }
 };
 
 InputHandler input_handler;
@@ -262,19 +308,28 @@ void InputHandler::doTouchStart()
 	gettimeofday(&touchStart, NULL);
 }
 
+// Drags are held back until the frame is drawn, so the last position goes
+// out first to keep the release in order after it
+void InputHandler::doTouchRelease()
+{
+	handleDrag();
+	if (state == AS_IN_ACTION_AREA)
+	{
+		LOGEVENT("TOUCH_RELEASE: %d,%d\n", x, y);
+		PageManager::NotifyTouch(TOUCH_RELEASE, x, y);
+	}
+}
+
 void InputHandler::process_EV_ABS(input_event& ev)
 {
 	x = ev.value >> 16;
 	y = ev.value & 0xFFFF;
+	setTouchTime(ev);
 
 	if (ev.code == 0)
 	{
 #ifndef TW_USE_KEY_CODE_TOUCH_SYNC
-		if (state == AS_IN_ACTION_AREA)
-		{
-			LOGEVENT("TOUCH_RELEASE: %d,%d\n", x, y);
-			PageManager::NotifyTouch(TOUCH_RELEASE, x, y);
-		}
+		doTouchRelease();
 		touch_status = TS_NONE;
 #endif
 	}
@@ -306,6 +361,7 @@ void InputHandler::process_EV_KEY(input_event& ev)
 	if (ev.code == BTN_LEFT)
 	{
 		MouseCursor *cursor = PageManager::GetMouseCursor();
+		setTouchTime(ev);
 		if (ev.value == 1)
 		{
 			cursor->GetPos(x, y);
@@ -315,13 +371,8 @@ void InputHandler::process_EV_KEY(input_event& ev)
 		{
 			// Left mouse button was previously pressed and now is
 			// being released so send a TOUCH_RELEASE
-			if (state == AS_IN_ACTION_AREA)
-			{
-				cursor->GetPos(x, y);
-
-				LOGEVENT("Mouse TOUCH_RELEASE: %d,%d\n", x, y);
-				PageManager::NotifyTouch(TOUCH_RELEASE, x, y);
-			}
+			cursor->GetPos(x, y);
+			doTouchRelease();
 			touch_status = TS_NONE;
 		}
 	}
@@ -376,6 +427,7 @@ void InputHandler::process_EV_REL(input_event& ev)
 
 	if (touch_status) {
 		cursor->GetPos(x, y);
+		setTouchTime(ev);
 		LOGEVENT("Mouse TOUCH_DRAG: %d, %d\n", x, y);
 		key_status = KS_NONE;
 	}
@@ -397,11 +449,22 @@ void InputHandler::handleDrag()
 }
 
 void set_select_fd() {
-	select_fd = ors_read_fd + 1;
-	if (g_pty_fd >= select_fd)
-		select_fd = g_pty_fd + 1;
-	if (PartitionManager.uevent_pfd.fd >= select_fd)
-		select_fd = PartitionManager.uevent_pfd.fd + 1;
+	// The main loop picks the new fds up the next time it wakes
+	gFdsChanged.set_value(1);
+	gui_wake();
+}
+
+uint64_t gui_touch_time(void)
+{
+	return input_handler.touchTime();
+}
+
+void gui_wake(void)
+{
+	if (gWakeFd >= 0) {
+		uint64_t one = 1;
+		write(gWakeFd, &one, sizeof(one));
+	}
 }
 
 static void setup_ors_command()
@@ -501,52 +564,176 @@ static void ors_command_read()
 				// put all things that need to be done after the command is finished into ors_command_done, not here
 			}
 		}
+	} else if (read_ret == 0) {
+		// The writer went away without a command, and the fifo stays readable
+		// until it is opened again
+		close(ors_read_fd);
+		setup_ors_command();
 	}
 }
 
-// Get and dispatch input events until it's time to draw the next frame
-// This special function will return immediately the first time, but then
-// always returns 1/30th of a second (or immediately if called later) from
-// the last time it was called
-static void loopTimer(int input_timeout_ms)
+// Handles the input that is queued, but not so much that no frame gets drawn
+static void drain_input()
 {
-	static timespec lastCall;
-	static int initialized = 0;
+	for (int i = 0; i < 256 && input_handler.processInput(0); i++)
+		;
+}
 
-	if (!initialized)
-	{
-		clock_gettime(CLOCK_MONOTONIC, &lastCall);
-		initialized = 1;
+// Keeps one of the fds in gEpollFd in step with the fd itself. A closed fd drops
+// out of the set on its own and may come back under the same number, so after
+// set_select_fd() it is added again either way.
+static void watch_fd(int& watched, int fd, uint32_t events, bool changed)
+{
+	if (fd == watched && !changed)
 		return;
+
+	if (watched >= 0)
+		epoll_ctl(gEpollFd, EPOLL_CTL_DEL, watched, NULL);
+	watched = -1;
+	if (fd > 0) {
+		struct epoll_event event = {};
+		event.events = events;
+		event.data.fd = fd;
+		if (epoll_ctl(gEpollFd, EPOLL_CTL_ADD, fd, &event) == 0)
+			watched = fd;
 	}
+}
 
-	do
-	{
-		bool got_event = input_handler.processInput(input_timeout_ms); // get inputs but don't send drag notices
-		timespec curTime;
-		clock_gettime(CLOCK_MONOTONIC, &curTime);
+static void watch_fds()
+{
+	bool changed = false;
+	if (gFdsChanged.get_value()) {
+		gFdsChanged.set_value(0);
+		changed = true;
+		gHungUpPty = -1;
+	}
 
-		timespec diff = TWFunc::timespec_diff(lastCall, curTime);
+	watch_fd(gWatchedInput, ev_fd(), EPOLLIN, false);
+	watch_fd(gWatchedPty, g_pty_fd == gHungUpPty ? -1 : g_pty_fd, EPOLLIN, changed);
+	watch_fd(gWatchedUevent, PartitionManager.uevent_pfd.fd, EPOLLIN, changed);
+	// mountinfo is always readable, a change of the mounts shows up as EPOLLPRI
+	watch_fd(gWatchedMountinfo, PartitionManager.mountinfo_fd, EPOLLPRI, changed);
+#ifndef TW_OEM_BUILD
+	// orsout is non-NULL if a command is still running
+	watch_fd(gWatchedOrs, orsout ? -1 : ors_read_fd, EPOLLIN, changed);
+#endif
+}
 
-		// This is really 2 or 30 times per second
-		// As long as we get events, increase the timeout so we can catch up with input
-		long timeout = got_event ? 500000000 : 33333333;
+static void setup_main_loop()
+{
+	if (gEpollFd >= 0)
+		return;
 
-		if (diff.tv_sec || diff.tv_nsec > timeout)
-		{
-			// int32_t input_time = TWFunc::timespec_diff_ms(lastCall, curTime);
-			// LOGINFO("loopTimer(): %u ms, count: %u\n", input_time, count);
+	gEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (gEpollFd < 0) {
+		LOGERR("Unable to create the GUI epoll set: %s\n", strerror(errno));
+		return;
+	}
+	gWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	gFrameTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	int fds[] = { gWakeFd, gFrameTimerFd };
+	for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		struct epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = fds[i];
+		if (fds[i] >= 0)
+			epoll_ctl(gEpollFd, EPOLL_CTL_ADD, fds[i], &event);
+	}
+}
 
-			lastCall = curTime;
-			input_handler.handleDrag(); // send only drag notices if needed
-			return;
+// Sleeps until deadline, which is in the future, or until something needs the
+// GUI and handles that. Returns true when it was woken up by something other
+// than the deadline.
+static bool wait_for_events(timespec& deadline)
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespec wait = TWFunc::timespec_diff(now, deadline);
+	int timeout_ms = wait.tv_sec * 1000 + wait.tv_nsec / 1000000 + 1;
+
+	// Events read in the last batch don't make the input fd readable
+	if (ev_batched()) {
+		drain_input();
+		return true;
+	}
+
+	if (gEpollFd < 0) {
+		// Nothing to wait on, look for input every frame like we used to
+		usleep(timeout_ms * 1000);
+		drain_input();
+		return true;
+	}
+
+	if (gFrameTimerFd >= 0) {
+		struct itimerspec timer = {};
+		timer.it_value = deadline;
+		timerfd_settime(gFrameTimerFd, TFD_TIMER_ABSTIME, &timer, NULL);
+		timeout_ms = -1;
+	}
+
+	struct epoll_event events[8];
+	int count = epoll_wait(gEpollFd, events, 8, timeout_ms);
+	bool woken = false;
+	for (int i = 0; i < count; i++) {
+		int fd = events[i].data.fd;
+		uint64_t value;
+		if (fd == gFrameTimerFd) {
+			read(gFrameTimerFd, &value, sizeof(value));
+			continue;
+		}
+
+		woken = true;
+		if (fd == gWakeFd) {
+			read(gWakeFd, &value, sizeof(value));
+		} else if (fd == gWatchedInput) {
+			drain_input();
+		} else if (fd == gWatchedPty) {
+			terminal_pty_read();
+			if (events[i].events & (EPOLLHUP | EPOLLERR)) {
+				gHungUpPty = gWatchedPty;
+				watch_fd(gWatchedPty, -1, 0, false);
+			}
+		} else if (fd == gWatchedUevent) {
+			PartitionManager.read_uevent();
+		} else if (fd == gWatchedMountinfo) {
+			PartitionManager.Handle_Mountinfo_Change();
+		} else if (fd == gWatchedOrs && !orsout) {
+			ors_command_read();
 		}
+	}
+	return woken;
+}
+
+// Draws the frame if render is set and shows it, timing both for the
+// profiler while it is on
+static void render_frame(bool render, bool partial, int x, int y, int w, int h)
+{
+	bool profile = GUIProfiler::Enabled();
+	std::string page = profile ? PageManager::GetCurrentPage() : "";
+
+	uint64_t start = GUIProfiler::Now();
+	if (render)
+	{
+		if (partial)
+			PageManager::RenderRegion(x, y, w, h);
+		else
+			PageManager::Render();
+		if (GUIProfiler::OverlayEnabled())
+			GUIProfiler::RenderOverlay(page);
+	}
+	uint64_t rendered = GUIProfiler::Now();
+
+	if (partial)
+		flip_region(x, y, w, h);
+	else
+		flip();
 
-		// We need to sleep some period time microseconds
-		//unsigned int sleepTime = 33333 -(diff.tv_nsec / 1000);
-		//usleep(sleepTime); // removed so we can scan for input
-		input_timeout_ms = 0;
-	} while (1);
+	if (profile)
+	{
+		if (render)
+			GUIProfiler::AddPageTime(page, PROFILE_RENDER, rendered - start);
+		GUIProfiler::AddPageTime(page, PROFILE_FLIP, GUIProfiler::Now() - rendered);
+	}
 }
 
 static int runPages(const char *page_name, const int stop_on_page_done)
@@ -563,94 +750,92 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 
 	DataManager::SetValue("tw_loaded", 1);
 
-	struct timeval timeout;
-	fd_set fdset;
-	int has_data = 0;
+	setup_main_loop();
 
-	int input_timeout_ms = 0;
+	VarID page_done_var = DataManager::GetVarID("tw_page_done");
+	VarID gui_done_var = DataManager::GetVarID("tw_gui_done");
 	int idle_frames = 0;
+	bool woken = false;
+	bool first_frame = true;
+	timespec last_frame;
+	clock_gettime(CLOCK_MONOTONIC, &last_frame);
+	last_frame.tv_sec--; // the first frame is due right away
 
 	for (;;)
 	{
-		loopTimer(input_timeout_ms);
-		FD_ZERO(&fdset);
-		timeout.tv_sec = 0;
-		timeout.tv_usec = 1;
-		if (g_pty_fd > 0) {
-			FD_SET(g_pty_fd, &fdset);
-		}
-		if (PartitionManager.uevent_pfd.fd > 0) {
-			FD_SET(PartitionManager.uevent_pfd.fd, &fdset);
-		}
-#ifndef TW_OEM_BUILD
-		if (ors_read_fd > 0 && !orsout) { // orsout is non-NULL if a command is still running
-			FD_SET(ors_read_fd, &fdset);
+		// 30 frames a second while something changes, moves or is held down,
+		// otherwise one a second for whatever only shows up in Update()
+		bool active = woken || idle_frames <= 15 || input_handler.isHeld() || gWatchedInput < 0;
+		timespec next_frame = last_frame;
+		next_frame.tv_nsec += active ? 33333333 : 0;
+		next_frame.tv_sec += active ? 0 : 1;
+		if (next_frame.tv_nsec >= 1000000000) {
+			next_frame.tv_nsec -= 1000000000;
+			next_frame.tv_sec++;
 		}
-#endif
-		// TODO: combine this select with the poll done by input handling
-		has_data = select(select_fd, &fdset, NULL, NULL, &timeout);
-		if (has_data > 0) {
-			if (g_pty_fd > 0 && FD_ISSET(g_pty_fd, &fdset))
-				terminal_pty_read();
-			if (PartitionManager.uevent_pfd.fd > 0 && FD_ISSET(PartitionManager.uevent_pfd.fd, &fdset))
-				PartitionManager.read_uevent();
-			if (ors_read_fd > 0 && !orsout && FD_ISSET(ors_read_fd, &fdset))
-				ors_command_read();
+
+		timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timespec wait = TWFunc::timespec_diff(now, next_frame);
+		if (!gForceRender.get_value() && wait.tv_sec >= 0 && (wait.tv_sec || wait.tv_nsec))
+		{
+			watch_fds();
+			if (wait_for_events(next_frame))
+				woken = true;
+			continue;
 		}
+		last_frame = now;
+		woken = false;
 
+		// touch hold and key repeat, then only one drag notice per frame
+		drain_input();
+		input_handler.handleDrag();
+		GUIJobQueue::RunCompletions();
+
+		GUIProfiler::CheckMode();
 		if (!gForceRender.get_value())
 		{
+			uint64_t start = GUIProfiler::Now();
 			int ret = PageManager::Update();
+			if (GUIProfiler::Enabled())
+				GUIProfiler::AddPageTime(PageManager::GetCurrentPage(), PROFILE_UPDATE, GUIProfiler::Now() - start);
 			if (ret == 0)
 				++idle_frames;
 			else if (ret == -2)
 				break; // Theme reload failure
 			else
 				idle_frames = 0;
-			// due to possible animation objects, we need to delay activating the input timeout
-			input_timeout_ms = idle_frames > 15 ? 1000 : 0;
-
-#ifndef PRINT_RENDER_TIME
-			if (ret > 1)
-				PageManager::Render();
 
+			// The overlay isn't part of the damage, so it needs full frames
+			int x, y, w, h;
+			bool partial = (ret > 1 && !GUIProfiler::OverlayEnabled() && PageManager::GetDamage(x, y, w, h));
 			if (ret > 0)
-				flip();
-#else
-			if (ret > 1)
-			{
-				timespec start, end;
-				int32_t render_t, flip_t;
-				clock_gettime(CLOCK_MONOTONIC, &start);
-				PageManager::Render();
-				clock_gettime(CLOCK_MONOTONIC, &end);
-				render_t = TWFunc::timespec_diff_ms(start, end);
-
-				flip();
-				clock_gettime(CLOCK_MONOTONIC, &start);
-				flip_t = TWFunc::timespec_diff_ms(end, start);
-
-				LOGINFO("Render(): %u ms, flip(): %u ms, total: %u ms\n", render_t, flip_t, render_t+flip_t);
-			}
-			else if (ret > 0)
-				flip();
-#endif
+				render_frame(ret > 1, partial, x, y, w, h);
 		}
 		else
 		{
 			gForceRender.set_value(0);
-			PageManager::Render();
-			flip();
-			input_timeout_ms = 0;
+			render_frame(true, false, 0, 0, 0, 0);
+			idle_frames = 0;
+		}
+
+		if (first_frame) {
+			// The main page being up is the end of startup; pages shown
+			// before it, like decrypt, are marked on the way
+			first_frame = false;
+			if (stop_on_page_done)
+				twrpStartupTrace::Mark(std::string(page_name ? page_name : "gui") + " page shown");
+			else
+				twrpStartupTrace::Finish();
 		}
 
 		blankTimer.checkForTimeout();
-		if (stop_on_page_done && DataManager::GetIntValue("tw_page_done") != 0)
+		if (stop_on_page_done && DataManager::GetIntValue(page_done_var) != 0)
 		{
 			gui_changePage("main");
 			break;
 		}
-		if (DataManager::GetIntValue("tw_gui_done") != 0)
+		if (DataManager::GetIntValue(gui_done_var) != 0)
 			break;
 	}
 	if (ors_read_fd > 0)
@@ -664,6 +849,7 @@ static int runPages(const char *page_name, const int stop_on_page_done)
 int gui_forceRender(void)
 {
 	gForceRender.set_value(1);
+	gui_wake();
 	return 0;
 }
 
@@ -672,6 +858,7 @@ int gui_changePage(std::string newPage)
 	LOGINFO("Set page: '%s'\n", newPage.c_str());
 	PageManager::ChangePage(newPage);
 	gForceRender.set_value(1);
+	gui_wake();
 	return 0;
 }
 
@@ -680,6 +867,7 @@ int gui_changeOverlay(std::string overlay)
 	LOGINFO("Set overlay: '%s'\n", overlay.c_str());
 	PageManager::ChangeOverlay(overlay);
 	gForceRender.set_value(1);
+	gui_wake();
 	return 0;
 }
 
@@ -745,13 +933,143 @@ std::string gui_parse_text(std::string str)
 	}
 }
 
+std::atomic<unsigned> TextTemplate::mStringsVersion(1);
+
+TextTemplate::TextTemplate()
+{
+	mCompiledVersion = 0;
+	mEvaluated = false;
+}
+
+TextTemplate::TextTemplate(const std::string& text)
+{
+	SetText(text);
+}
+
+void TextTemplate::SetText(const std::string& text)
+{
+	mText = text;
+	mTokens.clear();
+	mCompiledVersion = 0;
+	mEvaluated = false;
+}
+
+// Splits mText the way gui_parse_text() reads it: resources are looked up
+// right away, variables become tokens. Unlike there, the value of a variable
+// is not searched for more variables.
+void TextTemplate::Compile()
+{
+	mCompiledVersion = mStringsVersion;
+	mTokens.clear();
+	mEvaluated = false;
+
+	std::string str = mText;
+	size_t pos = 0, next, end;
+	while (1)
+	{
+		next = str.find("{@", pos);
+		if (next == std::string::npos)
+			break;
+
+		end = str.find('}', next + 1);
+		if (end == std::string::npos)
+			break;
+
+		std::string var = str.substr(next + 2, (end - next) - 2);
+		str.erase(next, (end - next) + 1);
+
+		size_t default_loc = var.find('=', 0);
+		if (default_loc == std::string::npos)
+			str.insert(next, PageManager::GetResources()->FindString(var));
+		else
+			str.insert(next, PageManager::GetResources()->FindString(var.substr(0, default_loc), var.substr(default_loc + 1)));
+	}
+
+	Token token;
+	token.var = INVALID_VAR_ID;
+	token.version = 0;
+	size_t literal = 0; // where the literal text not yet in a token starts
+	pos = 0;
+	while (1)
+	{
+		next = str.find('%', pos);
+		if (next == std::string::npos)
+			break;
+
+		end = str.find('%', next + 1);
+		if (end == std::string::npos)
+			break;
+
+		std::string var = str.substr(next + 1, (end - next) - 1);
+		str.erase(next, (end - next) + 1);
+
+		if (var.empty())
+			str.insert(next, 1, '%');
+		else if (var[0] == '@') {
+			// this is a string resource ("%@string_name%")
+			str.insert(next, PageManager::GetResources()->FindString(var.substr(1)));
+		} else {
+			token.literal = str.substr(literal, next - literal);
+			token.var = INVALID_VAR_ID;
+			if (!token.literal.empty())
+				mTokens.push_back(token);
+			token.literal.clear();
+			token.var = DataManager::GetVarID(var);
+			mTokens.push_back(token);
+			literal = next;
+			pos = next;
+			continue;
+		}
+		pos = next + 1;
+	}
+	token.literal = str.substr(literal);
+	token.var = INVALID_VAR_ID;
+	if (!token.literal.empty())
+		mTokens.push_back(token);
+}
+
+const std::string& TextTemplate::Evaluate()
+{
+	if (mCompiledVersion != mStringsVersion)
+		Compile();
+
+	bool changed = !mEvaluated;
+	for (size_t i = 0; i < mTokens.size() && !changed; i++) {
+		if (mTokens[i].var == INVALID_VAR_ID)
+			continue;
+		uint64_t version = DataManager::GetVersion(mTokens[i].var);
+		changed = (version == 0 || version != mTokens[i].version);
+	}
+	if (!changed)
+		return mResult;
+
+	mResult.clear();
+	std::string value;
+	for (size_t i = 0; i < mTokens.size(); i++) {
+		Token& token = mTokens[i];
+		if (token.var == INVALID_VAR_ID) {
+			mResult += token.literal;
+			continue;
+		}
+		// Before the value, so that a change while reading is seen next time
+		token.version = DataManager::GetVersion(token.var);
+		if (DataManager::GetValue(token.var, value) == 0)
+			mResult += value;
+	}
+	mEvaluated = true;
+	return mResult;
+}
+
 std::string gui_lookup(const std::string& resource_name, const std::string& default_value) {
 	return PageManager::GetResources()->FindString(resource_name, default_value);
 }
 
 extern "C" int gui_init(void)
 {
+	twrpStartupTrace::Scope trace("graphics");
 	gr_init();
+	// Before the splash loads the first font
+	gr_ttf_set_string_cache_size(twrpMemBudget::Get()->Grant("font caches", FONT_CACHE_FONTS * FONT_CACHE_BYTES, FONT_CACHE_FONTS * FONT_CACHE_MIN_BYTES) / FONT_CACHE_FONTS);
 	TWFunc::Set_Brightness(DataManager::GetStrValue("tw_brightness"));
 
 	// load and show splash screen
@@ -771,6 +1089,7 @@ extern "C" int gui_init(void)
 
 extern "C" int gui_loadResources(void)
 {
+	twrpStartupTrace::Scope trace("theme");
 #ifndef TW_OEM_BUILD
 	int check = 0;
 	DataManager::GetValue(TW_IS_ENCRYPTED, check);
@@ -834,6 +1153,7 @@ error:
 
 extern "C" int gui_loadCustomResources(void)
 {
+	twrpStartupTrace::Scope trace("custom theme");
 #ifndef TW_OEM_BUILD
 	if (!PartitionManager.Mount_Settings_Storage(false)) {
 		LOGINFO("Unable to mount settings storage during GUI startup.\n");
@@ -0,0 +1,249 @@
+/*
+	Copyright 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// imagecache.cpp - Theme images scaled on an earlier boot
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <pixelflinger/pixelflinger.h>
+
+#include "../twcommon.h"
+#include "imagecache.hpp"
+
+#define IMAGE_CACHE_MAGIC "TWSC"
+#define IMAGE_CACHE_VERSION 1
+
+// Large screens make large images; past this the rest are scaled every boot
+#define IMAGE_CACHE_MAX_BYTES (48 * 1024 * 1024)
+
+// The file is a header, then one record per image: the name, padded to
+// four bytes, and width * height pixels of four bytes follow each record
+struct ImageCacheHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t theme_hash;
+	int32_t fb_width;
+	int32_t fb_height;
+	uint32_t count;
+	uint32_t reserved;
+};
+
+struct ScaledImageCache::Record {
+	uint32_t name_length;
+	float scale_w;
+	float scale_h;
+	int32_t width;
+	int32_t height;
+	int32_t format;
+
+	const char* Name() const { return (const char*) (this + 1); }
+	const unsigned char* Pixels() const { return (const unsigned char*) (this + 1) + ((name_length + 3) & ~3); }
+	size_t Size() const { return sizeof(*this) + ((name_length + 3) & ~3) + (size_t) width * height * 4; }
+};
+
+ScaledImageCache* ScaledImageCache::current = NULL;
+
+// FNV-1a over 8 byte words, enough to tell one theme zip from another
+static uint64_t HashThemeData(const unsigned char* data, size_t size)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL ^ size;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+	}
+	for (; i < size; i++)
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+	return hash;
+}
+
+ScaledImageCache::ScaledImageCache()
+{
+	mThemeHash = 0;
+	mMap = NULL;
+	mMapSize = 0;
+	mNewBytes = 0;
+	pthread_mutex_init(&mLock, NULL);
+}
+
+ScaledImageCache::~ScaledImageCache()
+{
+	Unmap();
+	pthread_mutex_destroy(&mLock);
+}
+
+std::string ScaledImageCache::Key(const std::string& name, float scale_w, float scale_h)
+{
+	std::string key = name;
+	key.append(1, '\0');
+	key.append((const char*) &scale_w, sizeof(scale_w));
+	key.append((const char*) &scale_h, sizeof(scale_h));
+	return key;
+}
+
+void ScaledImageCache::Open(const std::string& cache_file, const unsigned char* zip_data, size_t zip_size)
+{
+	Close();
+	mFile = cache_file;
+	mThemeHash = HashThemeData(zip_data, zip_size);
+
+	int fd = open(cache_file.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(ImageCacheHeader)) {
+		void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		if (map != MAP_FAILED) {
+			mMap = (unsigned char*) map;
+			mMapSize = st.st_size;
+		}
+	}
+	close(fd);
+	if (!mMap)
+		return;
+
+	const ImageCacheHeader* header = (const ImageCacheHeader*) mMap;
+	if (memcmp(header->magic, IMAGE_CACHE_MAGIC, 4) != 0 || header->version != IMAGE_CACHE_VERSION
+		|| header->theme_hash != mThemeHash || header->fb_width != gr_fb_width() || header->fb_height != gr_fb_height()) {
+		LOGINFO("Scaled image cache %s is for another theme or screen\n", cache_file.c_str());
+		Unmap();
+		return;
+	}
+
+	size_t pos = sizeof(ImageCacheHeader);
+	for (uint32_t i = 0; i < header->count; i++) {
+		const Record* record = (const Record*) (mMap + pos);
+		if (pos + sizeof(Record) > mMapSize || record->width <= 0 || record->height <= 0
+			|| record->width > 0x4000 || record->height > 0x4000 || record->name_length > 0x1000
+			|| pos + record->Size() > mMapSize) {
+			LOGINFO("Scaled image cache %s is truncated\n", cache_file.c_str());
+			break;
+		}
+		mRecords[Key(std::string(record->Name(), record->name_length), record->scale_w, record->scale_h)] = record;
+		pos += record->Size();
+	}
+	LOGINFO("Scaled image cache has %u images\n", (unsigned) mRecords.size());
+}
+
+bool ScaledImageCache::Find(const std::string& name, float scale_w, float scale_h, gr_surface* surface)
+{
+	std::map<std::string, const Record*>::const_iterator it = mRecords.find(Key(name, scale_w, scale_h));
+	if (it == mRecords.end())
+		return false;
+	const Record* record = it->second;
+	return res_create_surface_raw(record->width, record->height, record->format, record->Pixels(), surface) == 0;
+}
+
+void ScaledImageCache::Add(const std::string& name, float scale_w, float scale_h, gr_surface surface)
+{
+	const GGLSurface* image = (const GGLSurface*) surface;
+	if (mFile.empty() || !image || image->stride != image->width)
+		return;
+
+	size_t bytes = (size_t) image->width * image->height * 4;
+	pthread_mutex_lock(&mLock);
+	if (mMapSize + mNewBytes + bytes <= IMAGE_CACHE_MAX_BYTES) {
+		NewImage added;
+		added.name = name;
+		added.scale_w = scale_w;
+		added.scale_h = scale_h;
+		added.width = image->width;
+		added.height = image->height;
+		added.format = image->format;
+		added.pixels.assign(image->data, image->data + bytes);
+		mNewImages.push_back(added);
+		mNewBytes += bytes;
+	}
+	pthread_mutex_unlock(&mLock);
+}
+
+bool ScaledImageCache::Save()
+{
+	std::string temp_file = mFile + ".tmp";
+	FILE* f = fopen(temp_file.c_str(), "we");
+	if (!f)
+		return false;
+
+	ImageCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, IMAGE_CACHE_MAGIC, 4);
+	header.version = IMAGE_CACHE_VERSION;
+	header.theme_hash = mThemeHash;
+	header.fb_width = gr_fb_width();
+	header.fb_height = gr_fb_height();
+	header.count = mRecords.size() + mNewImages.size();
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+	// Images from the old file are kept as they are
+	for (std::map<std::string, const Record*>::const_iterator it = mRecords.begin(); ok && it != mRecords.end(); ++it)
+		ok = fwrite(it->second, it->second->Size(), 1, f) == 1;
+
+	static const char padding[4] = { 0 };
+	for (size_t i = 0; ok && i < mNewImages.size(); i++) {
+		const NewImage& image = mNewImages[i];
+		Record record;
+		record.name_length = image.name.size();
+		record.scale_w = image.scale_w;
+		record.scale_h = image.scale_h;
+		record.width = image.width;
+		record.height = image.height;
+		record.format = image.format;
+		size_t pad = ((record.name_length + 3) & ~3) - record.name_length;
+		ok = fwrite(&record, sizeof(record), 1, f) == 1
+			&& fwrite(image.name.data(), 1, image.name.size(), f) == image.name.size()
+			&& fwrite(padding, 1, pad, f) == pad
+			&& fwrite(image.pixels.data(), 1, image.pixels.size(), f) == image.pixels.size();
+	}
+
+	ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+	ok = fclose(f) == 0 && ok;
+	if (!ok || rename(temp_file.c_str(), mFile.c_str()) != 0) {
+		unlink(temp_file.c_str());
+		return false;
+	}
+	return true;
+}
+
+void ScaledImageCache::Close()
+{
+	if (!mNewImages.empty()) {
+		if (Save())
+			LOGINFO("Saved %u scaled images to %s\n", (unsigned) (mRecords.size() + mNewImages.size()), mFile.c_str());
+		else
+			LOGINFO("Unable to save scaled images to %s\n", mFile.c_str());
+	}
+	Unmap();
+	mFile.clear();
+	mNewImages.clear();
+	mNewBytes = 0;
+}
+
+void ScaledImageCache::Unmap()
+{
+	mRecords.clear();
+	if (mMap)
+		munmap(mMap, mMapSize);
+	mMap = NULL;
+	mMapSize = 0;
+}
@@ -0,0 +1,80 @@
+/*
+	Copyright 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// imagecache.hpp - Theme images scaled on an earlier boot
+
+#ifndef _IMAGECACHE_HEADER
+#define _IMAGECACHE_HEADER
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+extern "C" {
+#include "../minuitwrp/minui.h"
+}
+
+// Keeps the scaled images of a zip theme in a file next to it, so that the
+// next boot on the same screen can copy them out instead of decoding and
+// scaling them again. The file belongs to one theme and one screen size; it
+// is thrown away when either changes.
+class ScaledImageCache
+{
+public:
+	ScaledImageCache();
+	~ScaledImageCache();
+
+	// Maps cache_file if it was written for the theme in zip_data and the
+	// current screen. Images added afterwards are written out by Close().
+	void Open(const std::string& cache_file, const unsigned char* zip_data, size_t zip_size);
+	void Close();
+
+	// Makes a new surface from the cached image; false if there isn't one.
+	// Both are safe to call from several loader threads.
+	bool Find(const std::string& name, float scale_w, float scale_h, gr_surface* surface);
+	void Add(const std::string& name, float scale_w, float scale_h, gr_surface surface);
+
+	// The cache of the theme that is being loaded, if any
+	static ScaledImageCache* current;
+
+private:
+	struct Record;
+	struct NewImage {
+		std::string name;
+		float scale_w, scale_h;
+		int width, height, format;
+		std::vector<unsigned char> pixels;
+	};
+
+	static std::string Key(const std::string& name, float scale_w, float scale_h);
+	bool Save();
+	void Unmap();
+
+	std::string mFile;
+	uint64_t mThemeHash;
+	unsigned char* mMap;
+	size_t mMapSize;
+	std::map<std::string, const Record*> mRecords;
+	std::vector<NewImage> mNewImages;
+	size_t mNewBytes;
+	pthread_mutex_t mLock;
+};
+
+#endif // _IMAGECACHE_HEADER
@@ -0,0 +1,170 @@
+/*
+	Copyright 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// jobqueue.cpp - Work that the GUI hands to other threads
+
+#include <stdint.h>
+#include <algorithm>
+
+#include "../twcommon.h"
+#include "jobqueue.hpp"
+
+extern void gui_wake(void);
+
+// Worker threads per lane; they are started when first needed and stay
+static const int lane_threads[JOB_LANES] = { 1, 1, 2 };
+
+pthread_once_t GUIJobQueue::mOnce = PTHREAD_ONCE_INIT;
+pthread_mutex_t GUIJobQueue::mLock = PTHREAD_MUTEX_INITIALIZER;
+GUIJobQueue::Lane GUIJobQueue::mLanes[JOB_LANES];
+std::vector<GUIJob*> GUIJobQueue::mFinished;
+
+void GUIJobQueue::Init()
+{
+	for (int i = 0; i < JOB_LANES; i++) {
+		mLanes[i].threads = 0;
+		mLanes[i].idle = 0;
+		pthread_cond_init(&mLanes[i].cond, NULL);
+	}
+}
+
+bool GUIJobQueue::Post(GUIJobLane lane, GUIJob* job)
+{
+	pthread_once(&mOnce, Init);
+	pthread_mutex_lock(&mLock);
+	Lane& l = mLanes[lane];
+	bool duplicate = false;
+	if (job->Owner()) {
+		for (size_t i = 0; i < l.pending.size(); i++)
+			duplicate = duplicate || l.pending[i]->Owner() == job->Owner();
+		for (size_t i = 0; i < l.running.size(); i++)
+			duplicate = duplicate || (l.running[i]->Owner() == job->Owner() && !l.running[i]->IsCancelled());
+	}
+	if (duplicate) {
+		pthread_mutex_unlock(&mLock);
+		delete job;
+		return false;
+	}
+
+	l.pending.push_back(job);
+	if (l.idle > 0) {
+		pthread_cond_signal(&l.cond);
+	} else if (l.threads < lane_threads[lane]) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Worker, (void*) (intptr_t) lane) == 0) {
+			pthread_detach(thread);
+			l.threads++;
+		} else if (l.threads == 0) {
+			l.pending.pop_back();
+			pthread_mutex_unlock(&mLock);
+			LOGERR("Unable to start a worker thread\n");
+			delete job;
+			return false;
+		}
+	}
+	pthread_mutex_unlock(&mLock);
+	return true;
+}
+
+void* GUIJobQueue::Worker(void* cookie)
+{
+	Lane& l = mLanes[(intptr_t) cookie];
+
+	pthread_mutex_lock(&mLock);
+	for (;;) {
+		while (l.pending.empty()) {
+			l.idle++;
+			pthread_cond_wait(&l.cond, &mLock);
+			l.idle--;
+		}
+		GUIJob* job = l.pending.front();
+		l.pending.pop_front();
+		l.running.push_back(job);
+		pthread_mutex_unlock(&mLock);
+
+		if (!job->IsCancelled())
+			job->Run();
+
+		pthread_mutex_lock(&mLock);
+		l.running.erase(std::find(l.running.begin(), l.running.end(), job));
+		mFinished.push_back(job);
+		gui_wake();
+	}
+	return NULL;
+}
+
+void GUIJobQueue::CancelPending(GUIJobLane lane)
+{
+	pthread_once(&mOnce, Init);
+	pthread_mutex_lock(&mLock);
+	Lane& l = mLanes[lane];
+	for (size_t i = 0; i < l.pending.size(); i++) {
+		l.pending[i]->Cancel();
+		mFinished.push_back(l.pending[i]);
+	}
+	l.pending.clear();
+	pthread_mutex_unlock(&mLock);
+	gui_wake();
+}
+
+void GUIJobQueue::CancelOwner(const void* owner)
+{
+	pthread_once(&mOnce, Init);
+	pthread_mutex_lock(&mLock);
+	for (int lane = 0; lane < JOB_LANES; lane++) {
+		Lane& l = mLanes[lane];
+		std::deque<GUIJob*>::iterator it = l.pending.begin();
+		while (it != l.pending.end()) {
+			if ((*it)->Owner() == owner) {
+				(*it)->Cancel();
+				mFinished.push_back(*it);
+				it = l.pending.erase(it);
+			} else {
+				++it;
+			}
+		}
+		for (size_t i = 0; i < l.running.size(); i++) {
+			if (l.running[i]->Owner() == owner)
+				l.running[i]->Cancel();
+		}
+	}
+	pthread_mutex_unlock(&mLock);
+	gui_wake();
+}
+
+int GUIJobQueue::Count(GUIJobLane lane)
+{
+	pthread_once(&mOnce, Init);
+	pthread_mutex_lock(&mLock);
+	int count = mLanes[lane].pending.size() + mLanes[lane].running.size();
+	pthread_mutex_unlock(&mLock);
+	return count;
+}
+
+void GUIJobQueue::RunCompletions()
+{
+	std::vector<GUIJob*> finished;
+	pthread_mutex_lock(&mLock);
+	finished.swap(mFinished);
+	pthread_mutex_unlock(&mLock);
+
+	for (size_t i = 0; i < finished.size(); i++) {
+		finished[i]->Done();
+		delete finished[i];
+	}
+}
@@ -0,0 +1,95 @@
+/*
+	Copyright 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// jobqueue.hpp - Work that the GUI hands to other threads
+
+#ifndef _JOBQUEUE_HEADER
+#define _JOBQUEUE_HEADER
+
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <vector>
+
+enum GUIJobLane {
+	JOB_EXCLUSIVE,  // changes storage: one job at a time, in the order posted
+	JOB_CANCEL,     // stops what is running on JOB_EXCLUSIVE
+	JOB_BACKGROUND, // only reads: a few jobs at a time, next to the others
+	JOB_LANES
+};
+
+// A piece of work for GUIJobQueue. Run() is called on a worker thread and
+// should look at IsCancelled() between steps; Done() is called on the GUI
+// thread afterwards, or instead of Run() if the job was cancelled while
+// it waited. The queue deletes the job after Done().
+class GUIJob
+{
+public:
+	GUIJob(const void* owner = NULL) : mOwner(owner), mCancelled(false) {}
+	virtual ~GUIJob() {}
+
+	virtual void Run() = 0;
+	virtual void Done() {}
+
+	void Cancel() { mCancelled = true; }
+	bool IsCancelled() const { return mCancelled; }
+	const void* Owner() const { return mOwner; }
+
+private:
+	const void* mOwner;
+	std::atomic<bool> mCancelled;
+};
+
+class GUIJobQueue
+{
+public:
+	// Takes the job. Refuses (and deletes) it if the lane already has a job
+	// queued or running for the same owner, so a second tap on a button
+	// doesn't start the same work twice.
+	static bool Post(GUIJobLane lane, GUIJob* job);
+
+	// Cancels the jobs waiting on a lane, and those of one owner anywhere;
+	// the running ones are asked to stop
+	static void CancelPending(GUIJobLane lane);
+	static void CancelOwner(const void* owner);
+
+	// Jobs queued or running on a lane
+	static int Count(GUIJobLane lane);
+
+	// Calls Done() of the finished jobs; called by the GUI loop
+	static void RunCompletions();
+
+private:
+	struct Lane {
+		std::deque<GUIJob*> pending;
+		std::vector<GUIJob*> running;
+		int threads;
+		int idle;
+		pthread_cond_t cond;
+	};
+
+	static void* Worker(void* cookie);
+	static void Init();
+
+	static pthread_once_t mOnce;
+	static pthread_mutex_t mLock; // protects everything below
+	static Lane mLanes[JOB_LANES];
+	static std::vector<GUIJob*> mFinished;
+};
+
+#endif // _JOBQUEUE_HEADER
@@ -61,12 +61,62 @@ void GUIObject::LoadConditions(xml_node<>* node, std::vector<Condition>& conditi
 		attr = condition->first_attribute("var2");
 		if (attr)   cond.mVar2 = attr->value();
 
+		ParseCondition(cond);
 		conditions.push_back(cond);
 
 		condition = condition->next_sibling("condition");
 	}
 }
 
+// Conditions are checked often, so everything that doesn't depend on the
+// values of the variables is worked out only once
+void GUIObject::ParseCondition(Condition& condition)
+{
+	if (!condition.mVar1.empty())
+		condition.mVar1ID = DataManager::GetVarID(condition.mVar1);
+	if (!condition.mVar2.empty())
+		condition.mVar2ID = DataManager::GetVarID(condition.mVar2);
+
+	const string& op = condition.mCompareOp;
+	unsigned flags = 0;
+	if (!op.empty() && op[0] == '!')
+		flags |= Condition::OP_NOT;
+	if (op.find('=') != string::npos)
+		flags |= Condition::OP_EQUAL;
+	if (op.find('>') != string::npos)
+		flags |= Condition::OP_GREATER;
+	if (op.find('<') != string::npos)
+		flags |= Condition::OP_LESS;
+	if (op == "modified")
+		flags |= Condition::OP_MODIFIED;
+	if (condition.mVar1 == "fileexists")
+		flags |= Condition::OP_FILEEXISTS;
+	if (condition.mVar1 == "mounted")
+		flags |= Condition::OP_MOUNTED;
+	if (condition.mVar2.compare(0, 2, "{@") == 0) {
+		flags |= Condition::OP_RESOURCE;
+		condition.mVar2Text.SetText(condition.mVar2);
+	}
+	condition.mFlags = flags;
+
+	condition.mVar1Num = atof(condition.mVar1.c_str());
+	condition.mVar2Num = atof(condition.mVar2.c_str());
+}
+
+// True if the variables of the condition haven't changed since its result
+// was worked out. Files, mounts, "modified" and translated strings aren't
+// tracked, so those conditions are always worked out again.
+bool GUIObject::IsConditionCurrent(const Condition& condition)
+{
+	if (condition.mFlags & (Condition::OP_MODIFIED | Condition::OP_FILEEXISTS | Condition::OP_MOUNTED | Condition::OP_RESOURCE))
+		return false;
+	if (!condition.mVar1.empty() && (condition.mVar1Version == 0 || condition.mVar1Version != DataManager::GetVersion(condition.mVar1ID)))
+		return false;
+	if (!condition.mVar2.empty() && (condition.mVar2Version == 0 || condition.mVar2Version != DataManager::GetVersion(condition.mVar2ID)))
+		return false;
+	return true;
+}
+
 GUIObject::~GUIObject()
 {
 }
@@ -95,54 +145,70 @@ bool GUIObject::isConditionTrue(Condition* condition)
 	if (condition->mVar1.empty())
 		return bTrue;
 
-	if (!condition->mCompareOp.empty() && condition->mCompareOp[0] == '!')
+	const unsigned flags = condition->mFlags;
+	if (flags & Condition::OP_NOT)
 		bTrue = false;
 
-	if (condition->mVar2.empty() && condition->mCompareOp != "modified")
+	condition->mVar1Version = DataManager::GetVersion(condition->mVar1ID);
+	condition->mVar2Version = DataManager::GetVersion(condition->mVar2ID);
+
+	if (condition->mVar2.empty() && !(flags & Condition::OP_MODIFIED))
 	{
-		if (!DataManager::GetStrValue(condition->mVar1).empty())
+		if (!DataManager::GetStrValue(condition->mVar1ID).empty())
 			return bTrue;
 
 		return !bTrue;
 	}
 
 	string var1, var2;
-	if (DataManager::GetValue(condition->mVar1, var1))
+	bool var1IsLiteral = false, var2IsLiteral = false;
+	if (DataManager::GetValue(condition->mVar1ID, var1)) {
 		var1 = condition->mVar1;
-	if (DataManager::GetValue(condition->mVar2, var2))
-		var2 = condition->mVar2;
-
-	if (var2.substr(0, 2) == "{@")
+		var1IsLiteral = true;
+	}
+	if (flags & Condition::OP_RESOURCE) {
 		// translate resource string in value
-		var2 = gui_parse_text(var2);
+		var2 = condition->mVar2Text.Evaluate();
+	} else if (DataManager::GetValue(condition->mVar2ID, var2)) {
+		var2 = condition->mVar2;
+		var2IsLiteral = true;
+	}
 
 	// This is a special case, we stat the file and that determines our result
-	if (var1 == "fileexists")
+	if ((flags & Condition::OP_FILEEXISTS) && var1 == "fileexists")
 	{
 		struct stat st;
 		if (stat(var2.c_str(), &st) == 0)
 			var2 = var1;
 		else
 			var2 = "FAILED";
+		var2IsLiteral = false;
 	}
-	if (var1 == "mounted")
+	if ((flags & Condition::OP_MOUNTED) && var1 == "mounted")
 	{
 		if (isMounted(condition->mVar2))
 			var2 = var1;
 		else
 			var2 = "FAILED";
+		var2IsLiteral = false;
 	}
 
-	if (condition->mCompareOp.find('=') != string::npos && var1 == var2)
+	if ((flags & Condition::OP_EQUAL) && var1 == var2)
 		return bTrue;
 
-	if (condition->mCompareOp.find('>') != string::npos && (atof(var1.c_str()) > atof(var2.c_str())))
-		return bTrue;
+	if (flags & (Condition::OP_GREATER | Condition::OP_LESS))
+	{
+		double num1 = var1IsLiteral ? condition->mVar1Num : atof(var1.c_str());
+		double num2 = var2IsLiteral ? condition->mVar2Num : atof(var2.c_str());
 
-	if (condition->mCompareOp.find('<') != string::npos && (atof(var1.c_str()) < atof(var2.c_str())))
-		return bTrue;
+		if ((flags & Condition::OP_GREATER) && num1 > num2)
+			return bTrue;
+
+		if ((flags & Condition::OP_LESS) && num1 < num2)
+			return bTrue;
+	}
 
-	if (condition->mCompareOp == "modified")
+	if (flags & Condition::OP_MODIFIED)
 	{
 		// This is a hack to allow areas to reset the default value
 		if (var1.empty())
@@ -177,7 +243,7 @@ bool GUIObject::UpdateConditions(std::vector<Condition>& conditions, const std::
 	std::vector<Condition>::iterator iter;
 	for (iter = conditions.begin(); iter != conditions.end(); ++iter)
 	{
-		if (varNameEmpty && iter->mCompareOp == "modified")
+		if (varNameEmpty && (iter->mFlags & Condition::OP_MODIFIED))
 		{
 			string val;
 
@@ -190,7 +256,9 @@ bool GUIObject::UpdateConditions(std::vector<Condition>& conditions, const std::
 			iter->mLastVal = val;
 		}
 
-		if (varNameEmpty || iter->mVar1 == varName || iter->mVar2 == varName)
+		// A full refresh only has to look at the conditions whose variables
+		// changed since they were last worked out
+		if (varNameEmpty ? !IsConditionCurrent(*iter) : (iter->mVar1 == varName || iter->mVar2 == varName))
 			iter->mLastResult = isConditionTrue(&(*iter));
 
 		if (!iter->mLastResult)
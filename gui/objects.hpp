@@ -23,9 +23,12 @@
 
 #include "rapidxml.hpp"
 #include <vector>
+#include <deque>
 #include <string>
 #include <map>
 #include <set>
+#include <memory>
+#include <atomic>
 #include <time.h>
 
 using namespace rapidxml;
@@ -35,6 +38,7 @@ using namespace rapidxml;
 #include "pages.hpp"
 #include "../partitions.hpp"
 #include "placement.h"
+#include "jobqueue.hpp"
 
 #ifndef TW_X_OFFSET
 #define TW_X_OFFSET 0
@@ -67,6 +71,15 @@ public:
 	// GetRenderPos - Returns the current position of the object
 	virtual int GetRenderPos(int& x, int& y, int& w, int& h) { x = mRenderX; y = mRenderY; w = mRenderW; h = mRenderH; return 0; }
 
+	// GetRenderArea - Returns the area Render() draws in, so that only what changed is redrawn
+	//  Return 0 on success, <0 if the area isn't known
+	virtual int GetRenderArea(int& x, int& y, int& w, int& h) { GetRenderPos(x, y, w, h); return (w > 0 && h > 0) ? 0 : -1; }
+
+	// GetDamageArea - Returns the part of the render area that changed since the last Update(), if
+	//  the object knows it better than "all of it"
+	//  Return 0 on success, <0 to redraw the whole render area
+	virtual int GetDamageArea(int& x __unused, int& y __unused, int& w __unused, int& h __unused) { return -1; }
+
 	// SetRenderPos - Update the position of the object
 	//  Return 0 on success, <0 on error
 	virtual int SetRenderPos(int x, int y, int w = 0, int h = 0) { mRenderX = x; mRenderY = y; if (w || h) { mRenderW = w; mRenderH = h; } return 0; }
@@ -114,6 +127,42 @@ protected:
 	int mActionX, mActionY, mActionW, mActionH;
 };
 
+// A text with {@resource} and %variable% parts, split up once so that it can
+// be filled in again without parsing it. It is only filled in again when one
+// of its variables or the string resources changed.
+class TextTemplate
+{
+public:
+	TextTemplate();
+	explicit TextTemplate(const std::string& text);
+
+	void SetText(const std::string& text);
+	const std::string& GetText() const { return mText; }
+
+	// The text with everything filled in, like gui_parse_text()
+	const std::string& Evaluate();
+
+	// To be called whenever string resources are added or replaced
+	static void StringsChanged() { mStringsVersion++; }
+
+private:
+	struct Token {
+		std::string literal; // when var is INVALID_VAR_ID
+		VarID var;
+		uint64_t version; // of var when last filled in
+	};
+
+	void Compile();
+
+	std::string mText;
+	std::string mResult;
+	std::vector<Token> mTokens;
+	unsigned mCompiledVersion; // mStringsVersion when compiled, 0 if not yet
+	bool mEvaluated;
+
+	static std::atomic<unsigned> mStringsVersion;
+};
+
 class GUIObject
 {
 public:
@@ -129,25 +178,55 @@ public:
 	//  Returns 0 on success, <0 on error
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
 
+	// AddWatchedVariables - Adds the variables NotifyVarChange cares about that aren't named in the XML
+	virtual void AddWatchedVariables(std::set<std::string>& vars __unused) {}
+
 protected:
 	class Condition
 	{
 	public:
+		// What mCompareOp asks for, worked out when the condition is loaded
+		enum {
+			OP_EQUAL = 1,
+			OP_GREATER = 2,
+			OP_LESS = 4,
+			OP_NOT = 8,
+			OP_MODIFIED = 16,
+			OP_FILEEXISTS = 32, // var1 is "fileexists"
+			OP_MOUNTED = 64, // var1 is "mounted"
+			OP_RESOURCE = 128, // var2 is a {@resource} string
+		};
+
 		Condition() {
 			mLastResult = true;
+			mVar1ID = mVar2ID = INVALID_VAR_ID;
+			mFlags = OP_EQUAL;
+			mVar1Num = mVar2Num = 0;
+			mVar1Version = mVar2Version = 0;
 		}
 
 		std::string mVar1;
 		std::string mVar2;
+		VarID mVar1ID;
+		VarID mVar2ID;
 		std::string mCompareOp;
 		std::string mLastVal;
 		bool mLastResult;
+
+		unsigned mFlags;
+		double mVar1Num; // mVar1 and mVar2 as numbers, used when they aren't variables
+		double mVar2Num;
+		TextTemplate mVar2Text; // for OP_RESOURCE
+		uint64_t mVar1Version; // of the variables when mLastResult was worked out
+		uint64_t mVar2Version;
 	};
 
 	std::vector<Condition> mConditions;
 
 protected:
 	static void LoadConditions(xml_node<>* node, std::vector<Condition>& conditions);
+	static void ParseCondition(Condition& condition);
+	static bool IsConditionCurrent(const Condition& condition);
 	static bool isMounted(std::string vol);
 	static bool isConditionTrue(Condition* condition);
 	static bool UpdateConditions(std::vector<Condition>& conditions, const std::string& varName);
@@ -192,6 +271,9 @@ public:
 	// Retrieve the size of the current string (dynamic strings may change per call)
 	virtual int GetCurrentBounds(int& w, int& h);
 
+	// The text last rendered or updated, placed the way gr_textEx_scaleW() places it
+	virtual int GetRenderArea(int& x, int& y, int& w, int& h);
+
 	// Notify of a variable change
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
 
@@ -206,7 +288,7 @@ public:
 	unsigned maxWidth;
 
 protected:
-	std::string mText;
+	TextTemplate mText;
 	std::string mLastValue;
 	COLOR mColor;
 	COLOR mHighlightColor;
@@ -257,10 +339,11 @@ protected:
 // GUIAction - Used for standard actions
 class GUIAction : public GUIObject, public ActionObject
 {
-	friend class ActionThread;
+	friend class ActionJob;
 
 public:
 	GUIAction(xml_node<>* node);
+	virtual ~GUIAction();
 
 public:
 	virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
@@ -281,11 +364,12 @@ protected:
 	std::map<int, bool> mKeys;
 
 protected:
-	enum ThreadType { THREAD_NONE, THREAD_ACTION, THREAD_CANCEL };
+	enum ThreadType { THREAD_NONE, THREAD_ACTION, THREAD_CANCEL, THREAD_BACKGROUND };
 
 	int getKeyByName(std::string key);
 	int doAction(Action action);
 	ThreadType getThreadType(const Action& action);
+	void queueActions(GUIJobLane lane);
 	void simulate_progress_bar(void);
 	int flash_zip(std::string filename, int* wipe_cache);
 	void reinject_after_flash();
@@ -298,6 +382,7 @@ protected:
 	typedef std::map<std::string, execFunction> mapFunc;
 	static mapFunc mf;
 	static std::set<std::string> setActionsRunningInCallerThread;
+	static std::set<std::string> setActionsRunningInBackground;
 
 	// GUI actions
 	int reboot(std::string arg);
@@ -338,6 +423,7 @@ protected:
 	int fixpermissions(std::string arg);
 	int dd(std::string arg);
 	int partitionsd(std::string arg);
+	int storagebench(std::string arg);
 	int installhtcdumlock(std::string arg);
 	int htcdumlockrestoreboot(std::string arg);
 	int htcdumlockreflashrecovery(std::string arg);
@@ -429,6 +515,9 @@ public:
 	//  Return 0 on success, <0 on error
 	virtual int SetRenderPos(int x, int y, int w = 0, int h = 0);
 
+	// The check image and the label, which can be taller than the image
+	virtual int GetRenderArea(int& x, int& y, int& w, int& h);
+
 	// NotifyTouch - Notify of a touch event
 	//  Return 0 on success, >0 to ignore remainder of touch, and <0 on error
 	virtual int NotifyTouch(TOUCH_STATE state, int x, int y);
@@ -442,6 +531,7 @@ protected:
 	int mLastState;
 	bool mRendered;
 	std::string mVarName;
+	VarID mVarID;
 };
 
 class GUIScrollList : public GUIObject, public RenderObject, public ActionObject
@@ -512,7 +602,7 @@ protected:
 	// Header
 	COLOR mHeaderBackgroundColor;
 	COLOR mHeaderFontColor;
-	std::string mHeaderText; // Original header text without parsing any variables
+	TextTemplate mHeaderText; // Original header text without parsing any variables
 	std::string mLastHeaderValue; // Header text after parsing variables
 	bool mHeaderIsStatic; // indicates if the header is static (no need to check for changes in NotifyVarChange)
 	int mHeaderH; // actual header height including font, icon, padding, and separator heights
@@ -554,9 +644,11 @@ protected:
 	size_t selectedItem; // selected item index after the initial touch, set to -1 if we are scrolling
 	int touchDebounce; // debounce for touches, minimum of 6 pixels but may be larger calculated based actualItemHeight / 3
 	int lastY, last2Y; // last 2 touch locations, used for tracking kinetic scroll speed
+	uint64_t lastTime, last2Time; // and their event times
 	int fastScroll; // indicates that the inital touch was inside the fastscroll region - makes for easier fast scrolling as the touches don't have to stay within the fast scroll region and you drag your finger
 	int mUpdate; // indicates that a change took place and we need to re-render
 	bool AddLines(std::vector<std::string>* origText, std::vector<std::string>* origColor, size_t* lastCount, std::vector<std::string>* rText, std::vector<std::string>* rColor);
+	void WrapLine(std::string line, std::vector<std::string>* wrapped);
 };
 
 class GUIFileSelector : public GUIScrollList
@@ -593,13 +685,24 @@ protected:
 		time_t lastStatChange;	  // Uses time_t format from stat
 	};
 
+	// A folder being read on a worker thread, which hands over what it
+	// found in batches
+	struct FileListJob;
+
 protected:
+	// Starts reading folder in the background; the lists fill in as
+	// CollectFileList() picks up what was found
 	virtual int GetFileList(const std::string folder);
-	static bool fileSort(FileData d1, FileData d2);
+	bool CollectFileList();
+	void CancelFileList();
+	static void* FileListWorker(void* cookie);
+	static bool fileSort(const FileData& d1, const FileData& d2);
+	static void MergeSorted(std::vector<FileData>& list, std::vector<FileData>& batch);
 
 protected:
 	std::vector<FileData> mFolderList;
 	std::vector<FileData> mFileList;
+	std::shared_ptr<FileListJob> mFileListJob;
 	std::string mPathVar; // current path displayed, saved in the data manager
 	std::string mPathDefault; // default value for the path if none is set in mPathVar
 	std::string mExtn; // used for filtering the file list, for example, *.zip
@@ -759,17 +862,19 @@ protected:
 	};
 
 	ImageResource* mSlideoutImage;
-	size_t mLastCount; // lines from gConsole that are already split and copied into rConsole
+	uint64_t mLastSeq; // next line of the console log to split and copy into rConsole
+	unsigned mLogEpoch; // to notice when the console log was cleared
 	bool scrollToEnd; // true if we want to keep tracking the last line
 	int mSlideoutX, mSlideoutY, mSlideoutW, mSlideoutH;
 	int mSlideout;
 	SlideoutState mSlideoutState;
-	std::vector<std::string> rConsole;
-	std::vector<std::string> rConsoleColor;
+	std::deque<std::string> rConsole;
+	std::deque<std::string> rConsoleColor;
 
 protected:
 	int RenderSlideout(void);
 	int RenderConsole(void);
+	bool ReadNewLines(void);
 };
 
 class TerminalEngine;
@@ -801,12 +906,22 @@ public:
 	virtual size_t GetItemCount();
 	virtual void RenderItem(size_t itemindex, int yPos, bool selected);
 	virtual void NotifySelect(size_t item_selected);
+	virtual int GetDamageArea(int& x, int& y, int& w, int& h);
 protected:
 	void InitAndResize();
+	bool FindDamagedRows(int& first, int& last);
 
 	TerminalEngine* engine; // non-visual parts of the terminal (text buffer etc.), not owned
 	int updateCounter; // to track if anything changed in the back-end
 	bool lastCondition; // to track if the condition became true and we might need to resize the terminal engine
+
+	// What the last Render() drew, to redraw only the rows that changed
+	std::vector<uint32_t> drawnSerials; // Line::serial of each displayed row
+	int drawnFirstItem, drawnYOffset;
+	size_t drawnItemCount;
+	int drawnCursorX, drawnCursorY;
+	std::string drawnHeader;
+	int damageY, damageH; // rows to redraw after Update(), damageH == 0 for the whole list
 };
 
 // GUIAnimation - Used for animations
@@ -850,6 +965,7 @@ public:
 	// NotifyVarChange - Notify of a variable change
 	//  Returns 0 on success, <0 on error
 	virtual int NotifyVarChange(const std::string& varName, const std::string& value);
+	virtual void AddWatchedVariables(std::set<std::string>& vars);
 
 protected:
 	ImageResource* mEmptyBar;
@@ -857,6 +973,7 @@ protected:
 	std::string mMinValVar;
 	std::string mMaxValVar;
 	std::string mCurValVar;
+	VarID mMinValID, mMaxValID, mCurValID;
 	float mSlide;
 	float mSlideInc;
 	int mSlideFrames;
@@ -1110,6 +1227,7 @@ protected:
 	void loadValue(bool force = false);
 
 	std::string mVariable;
+	VarID mVariableID;
 	int mMax;
 	int mMin;
 	int mValue;
@@ -1156,6 +1274,7 @@ public:
 
 	void Move(int deltaX, int deltaY);
 	void GetPos(int& x, int& y);
+	bool IsPresent() { return m_present; }
 	void LoadData(xml_node<>* node);
 	void ResetData(int resX, int resY);
 
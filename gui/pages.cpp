@@ -55,6 +55,9 @@ extern "C" {
 #include "rapidxml.hpp"
 #include "objects.hpp"
 #include "blanktimer.hpp"
+#include "imagecache.hpp"
+#include "profiler.hpp"
+#include "../twrpStartupTrace.hpp"
 
 // version 2 requires theme to handle power button as action togglebacklight
 #define TW_THEME_VERSION 3
@@ -65,9 +68,15 @@ extern int gGuiRunning;
 
 std::map<std::string, PageSet*> PageManager::mPageSets;
 PageSet* PageManager::mCurrentSet;
+#ifndef PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP
+pthread_mutex_t PageManager::mSetLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER;
+#else
+pthread_mutex_t PageManager::mSetLock = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#endif
 MouseCursor *PageManager::mMouseCursor = NULL;
 HardwareKeyboard *PageManager::mHardwareKeyboard = NULL;
 bool PageManager::mReloadTheme = false;
+bool PageManager::mCursorUpdated = false;
 std::string PageManager::mStartPage = "main";
 std::vector<language_struct> Language_List;
 
@@ -287,6 +296,8 @@ int ActionObject::SetActionPos(int x, int y, int w, int h)
 Page::Page(xml_node<>* page, std::vector<xml_node<>*> *templates)
 {
 	mTouchStart = NULL;
+	mDamageX = mDamageY = mDamageW = mDamageH = 0;
+	mFullDamage = true;
 
 	// We can memset the whole structure, because the alpha channel is ignored
 	memset(&mBackground, 0, sizeof(COLOR));
@@ -298,6 +309,7 @@ Page::Page(xml_node<>* page, std::vector<xml_node<>*> *templates)
 
 		GUIConsole* element = new GUIConsole(NULL);
 		mRenders.push_back(element);
+		mRenderTypes.push_back(mName);
 		mActions.push_back(element);
 		return;
 	}
@@ -333,6 +345,7 @@ bool Page::ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates, in
 	for (xml_node<>* child = page->first_node(); child; child = child->next_sibling())
 	{
 		std::string type = child->name();
+		size_t objectCount = mObjects.size();
 
 		if (type == "background") {
 			mBackground = LoadAttrColor(child, "color", COLOR(0,0,0,0));
@@ -518,10 +531,72 @@ bool Page::ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates, in
 		{
 			LOGERR("Unknown object type: %s.\n", type.c_str());
 		}
+
+		// Templates have named their own objects already
+		while (mRenderTypes.size() < mRenders.size())
+			mRenderTypes.push_back(type);
+		if (type != "template")
+			for (size_t i = objectCount; i < mObjects.size(); i++)
+				WatchVariables(i, child);
 	}
 	return true;
 }
 
+// Adds every word of letters, digits, '_' and '.' in text
+static void AddNames(const char* text, std::set<std::string>& names)
+{
+	const char* p = text;
+	while (*p) {
+		if (!isalnum((unsigned char) *p) && *p != '_' && *p != '.') {
+			p++;
+			continue;
+		}
+		const char* start = p;
+		while (isalnum((unsigned char) *p) || *p == '_' || *p == '.')
+			p++;
+		names.insert(std::string(start, p - start));
+	}
+}
+
+// Collects the names in node and the styles it uses, the same way FindNode
+// looks them up. That is more than the variables it reads, but never fewer.
+static void AddNodeNames(xml_node<>* node, std::set<std::string>& names, int depth)
+{
+	if (!node || depth == 10)
+		return;
+
+	for (xml_attribute<>* attr = node->first_attribute(); attr; attr = attr->next_attribute())
+		AddNames(attr->value(), names);
+	AddNames(node->value(), names);
+
+	xml_node<>* style = node->first_node("style");
+	if (style) {
+		for (; style; style = style->next_sibling("style")) {
+			xml_attribute<>* name = style->first_attribute("name");
+			if (name)
+				AddNodeNames(PageManager::FindStyle(name->value()), names, depth + 1);
+		}
+	} else {
+		xml_attribute<>* attr = node->first_attribute("style");
+		if (!attr)
+			attr = node->first_attribute("type");
+		AddNodeNames(PageManager::FindStyle(attr ? attr->value() : node->name()), names, depth + 1);
+	}
+
+	for (xml_node<>* child = node->first_node(); child; child = child->next_sibling())
+		if (child->type() == node_element)
+			AddNodeNames(child, names, depth);
+}
+
+void Page::WatchVariables(size_t index, xml_node<>* node)
+{
+	std::set<std::string> names;
+	AddNodeNames(node, names, 0);
+	mObjects[index]->AddWatchedVariables(names);
+	for (std::set<std::string>::iterator it = names.begin(); it != names.end(); ++it)
+		mVarWatchers[*it].push_back(index);
+}
+
 int Page::Render(void)
 {
 	// Render background
@@ -529,12 +604,43 @@ int Page::Render(void)
 	gr_fill(0, 0, gr_fb_width(), gr_fb_height());
 
 	// Render remaining objects
-	std::vector<RenderObject*>::iterator iter;
-	for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
+	for (size_t i = 0; i < mRenders.size(); i++)
 	{
-		if ((*iter)->Render())
+		uint64_t start = GUIProfiler::Enabled() ? GUIProfiler::Now() : 0;
+		if (mRenders[i]->Render())
 			LOGERR("A render request has failed.\n");
+		if (start)
+			GUIProfiler::AddObjectTime(mRenderTypes[i], PROFILE_RENDER, GUIProfiler::Now() - start);
+		RecordArea(i);
 	}
+	mFullDamage = false;
+	mDamageW = mDamageH = 0;
+	return 0;
+}
+
+int Page::RenderRegion(int x, int y, int w, int h)
+{
+	gr_set_region(x, y, w, h);
+	gr_color(mBackground.red, mBackground.green, mBackground.blue, mBackground.alpha);
+	gr_fill(x, y, w, h);
+
+	// Everything that overlaps the region is drawn again, in the same order, so
+	// whatever lies on top of the objects that changed stays on top
+	for (size_t i = 0; i < mRenders.size(); i++)
+	{
+		RecordArea(i);
+		const RenderArea& area = mRenderAreas[i];
+		if (area.known && (area.x >= x + w || area.x + area.w <= x || area.y >= y + h || area.y + area.h <= y))
+			continue;
+		uint64_t start = GUIProfiler::Enabled() ? GUIProfiler::Now() : 0;
+		if (mRenders[i]->Render())
+			LOGERR("A render request has failed.\n");
+		if (start)
+			GUIProfiler::AddObjectTime(mRenderTypes[i], PROFILE_RENDER, GUIProfiler::Now() - start);
+	}
+	gr_clear_region();
+	mFullDamage = false;
+	mDamageW = mDamageH = 0;
 	return 0;
 }
 
@@ -542,19 +648,93 @@ int Page::Update(void)
 {
 	int retCode = 0;
 
-	std::vector<RenderObject*>::iterator iter;
-	for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
+	for (size_t i = 0; i < mRenders.size(); i++)
 	{
-		int ret = (*iter)->Update();
+		uint64_t start = GUIProfiler::Enabled() ? GUIProfiler::Now() : 0;
+		int ret = mRenders[i]->Update();
+		if (start)
+			GUIProfiler::AddObjectTime(mRenderTypes[i], PROFILE_UPDATE, GUIProfiler::Now() - start);
 		if (ret < 0)
 			LOGERR("An update request has failed.\n");
 		else if (ret > retCode)
 			retCode = ret;
+
+		if (ret > 0 && !mFullDamage)
+		{
+			// Where the object was drawn last and where it will be drawn now
+			RenderArea area;
+			area.known = (mRenders[i]->GetRenderArea(area.x, area.y, area.w, area.h) == 0);
+			if (i >= mRenderAreas.size())
+				mFullDamage = true;
+			else if (area.known && mRenderAreas[i].known && area.x == mRenderAreas[i].x && area.y == mRenderAreas[i].y
+				&& area.w == mRenderAreas[i].w && area.h == mRenderAreas[i].h)
+			{
+				// Still in the same place, so only what changed inside needs redrawing
+				RenderArea damage;
+				damage.known = true;
+				if (mRenders[i]->GetDamageArea(damage.x, damage.y, damage.w, damage.h) == 0)
+					AddDamage(damage);
+				else
+					AddDamage(area);
+			}
+			else
+			{
+				AddDamage(area);
+				AddDamage(mRenderAreas[i]);
+			}
+		}
 	}
 
 	return retCode;
 }
 
+bool Page::GetDamage(int& x, int& y, int& w, int& h)
+{
+	if (mFullDamage)
+		return false;
+
+	x = mDamageX;
+	y = mDamageY;
+	w = mDamageW;
+	h = mDamageH;
+	return true;
+}
+
+void Page::AddDamage(const RenderArea& area)
+{
+	if (!area.known)
+	{
+		mFullDamage = true;
+		return;
+	}
+	if (area.w <= 0 || area.h <= 0)
+		return;
+
+	if (mDamageW <= 0 || mDamageH <= 0)
+	{
+		mDamageX = area.x;
+		mDamageY = area.y;
+		mDamageW = area.w;
+		mDamageH = area.h;
+		return;
+	}
+	int right = std::max(mDamageX + mDamageW, area.x + area.w);
+	int bottom = std::max(mDamageY + mDamageH, area.y + area.h);
+	mDamageX = std::min(mDamageX, area.x);
+	mDamageY = std::min(mDamageY, area.y);
+	mDamageW = right - mDamageX;
+	mDamageH = bottom - mDamageY;
+}
+
+void Page::RecordArea(size_t index)
+{
+	if (mRenderAreas.size() < mRenders.size())
+		mRenderAreas.resize(mRenders.size());
+
+	RenderArea& area = mRenderAreas[index];
+	area.known = (mRenders[index]->GetRenderArea(area.x, area.y, area.w, area.h) == 0);
+}
+
 int Page::NotifyTouch(TOUCH_STATE state, int x, int y)
 {
 	// By default, return 1 to ignore further touches if nobody is listening
@@ -651,20 +831,41 @@ void Page::SetPageFocus(int inFocus)
 	for (iter = mRenders.begin(); iter != mRenders.end(); iter++)
 		(*iter)->SetPageFocus(inFocus);
 
+	// Whatever is on the screen now isn't this page
+	mFullDamage = true;
 	return;
 }
 
 int Page::NotifyVarChange(std::string varName, std::string value)
 {
-	std::vector<GUIObject*>::iterator iter;
-	for (iter = mObjects.begin(); iter != mObjects.end(); ++iter)
+	if (varName.empty())
 	{
-		if ((*iter)->NotifyVarChange(varName, value))
-			LOGERR("An action handler errored on NotifyVarChange.\n");
+		// Everything is checked again
+		std::vector<GUIObject*>::iterator iter;
+		for (iter = mObjects.begin(); iter != mObjects.end(); ++iter)
+			NotifyObject(*iter, varName, value);
+		return 0;
 	}
+
+	std::map<std::string, std::vector<size_t> >::const_iterator watchers = mVarWatchers.find(varName);
+	if (watchers == mVarWatchers.end())
+		return 0;
+	const std::vector<size_t>& indexes = watchers->second;
+	for (size_t i = 0; i < indexes.size(); i++)
+		NotifyObject(mObjects[indexes[i]], varName, value);
 	return 0;
 }
 
+void Page::NotifyObject(GUIObject* object, const std::string& varName, const std::string& value)
+{
+	bool visible = object->isConditionTrue();
+	if (object->NotifyVarChange(varName, value))
+		LOGERR("An action handler errored on NotifyVarChange.\n");
+	// Objects that appear or disappear may not report it in Update()
+	if (object->isConditionTrue() != visible)
+		mFullDamage = true;
+}
+
 
 // transient data for loading themes
 struct LoadingContext
@@ -1122,6 +1323,20 @@ int PageSet::Render(void)
 	return ret;
 }
 
+bool PageSet::GetDamage(int& x, int& y, int& w, int& h)
+{
+	// Overlays are drawn on top of the page and aren't tracked
+	if (!mCurrentPage || !mOverlays.empty())
+		return false;
+
+	return mCurrentPage->GetDamage(x, y, w, h);
+}
+
+int PageSet::RenderRegion(int x, int y, int w, int h)
+{
+	return (mCurrentPage ? mCurrentPage->RenderRegion(x, y, w, h) : -1);
+}
+
 int PageSet::Update(void)
 {
 	int ret;
@@ -1332,6 +1547,7 @@ void PageManager::LoadLanguage(string filename) {
 
 int PageManager::LoadPackage(std::string name, std::string package, std::string startpage)
 {
+	twrpStartupTrace::Scope trace("load package");
 	std::string mainxmlfilename = package;
 	ZipWrap zip;
 	char* languageFile = NULL;
@@ -1339,6 +1555,7 @@ int PageManager::LoadPackage(std::string name, std::string package, std::string
 	PageSet* pageSet = NULL;
 	int ret;
 	MemMapping map;
+	ScaledImageCache imageCache;
 
 	mReloadTheme = false;
 	mStartPage = startpage;
@@ -1373,7 +1590,7 @@ int PageManager::LoadPackage(std::string name, std::string package, std::string
 #ifdef USE_MINZIP
 		if (sysMapFile(package.c_str(), &map) != 0) {
 #else
-		if (!map.MapFile(package)) {
+		if (!map.MapFile(package, MemMapping::Policy::kPopulate)) {
 #endif
 			LOGERR("Failed to map '%s'\n", package.c_str());
 			goto error;
@@ -1386,6 +1603,7 @@ int PageManager::LoadPackage(std::string name, std::string package, std::string
 			goto error;
 		}
 		ctx.zip = &zip;
+		imageCache.Open(TWFunc::Get_Path(package) + ".ui_scaled.cache", map.addr, map.length);
 		mainxmlfilename = "ui.xml";
 		LoadLanguageList(ctx.zip);
 		languageFile = LoadFileToBuffer("languages/en.xml", ctx.zip);
@@ -1393,8 +1611,10 @@ int PageManager::LoadPackage(std::string name, std::string package, std::string
 	}
 
 	// Before loading, mCurrentSet must be the loading package so we can find resources
+	pthread_mutex_lock(&mSetLock);
 	pageSet = mCurrentSet;
 	mCurrentSet = new PageSet();
+	TextTemplate::StringsChanged();
 
 	if (baseLanguageFile) {
 		mCurrentSet->LoadLanguage(baseLanguageFile, NULL);
@@ -1408,10 +1628,13 @@ int PageManager::LoadPackage(std::string name, std::string package, std::string
 
 	// Load and parse the XML and all includes
 	currentLoadingContext = &ctx; // required to find styles
+	ScaledImageCache::current = ctx.zip ? &imageCache : NULL;
 	ret = mCurrentSet->Load(ctx, mainxmlfilename);
+	ScaledImageCache::current = NULL;
 	currentLoadingContext = NULL;
 
 	if (ret == 0) {
+		imageCache.Close();
 		mCurrentSet->SetPage(startpage);
 		mPageSets.insert(std::pair<std::string, PageSet*>(name, mCurrentSet));
 	} else {
@@ -1421,6 +1644,8 @@ int PageManager::LoadPackage(std::string name, std::string package, std::string
 
 	// reset to previous pageset
 	mCurrentSet = pageSet;
+	TextTemplate::StringsChanged();
+	pthread_mutex_unlock(&mSetLock);
 
 	if (ctx.zip) {
 		ctx.zip->Close();
@@ -1458,17 +1683,21 @@ PageSet* PageManager::SelectPackage(std::string name)
 	LOGINFO("Switching packages (%s)\n", name.c_str());
 	PageSet* tmp;
 
+	pthread_mutex_lock(&mSetLock);
 	tmp = FindPackage(name);
 	if (tmp)
 	{
 		mCurrentSet = tmp;
+		TextTemplate::StringsChanged();
 		mCurrentSet->MakeEmergencyConsoleIfNeeded();
 		mCurrentSet->NotifyVarChange("", "");
 	}
 	else
 		LOGERR("Unable to find package.\n");
+	tmp = mCurrentSet;
+	pthread_mutex_unlock(&mSetLock);
 
-	return mCurrentSet;
+	return tmp;
 }
 
 int PageManager::ReloadPackage(std::string name, std::string package)
@@ -1504,15 +1733,19 @@ void PageManager::ReleasePackage(std::string name)
 {
 	std::map<std::string, PageSet*>::iterator iter;
 
+	pthread_mutex_lock(&mSetLock);
 	iter = mPageSets.find(name);
-	if (iter == mPageSets.end())
+	if (iter == mPageSets.end()) {
+		pthread_mutex_unlock(&mSetLock);
 		return;
+	}
 
 	PageSet* set = (*iter).second;
 	mPageSets.erase(iter);
 	delete set;
 	if (set == mCurrentSet)
 		mCurrentSet = NULL;
+	pthread_mutex_unlock(&mSetLock);
 	return;
 }
 
@@ -1590,6 +1823,20 @@ const ResourceManager* PageManager::GetResources()
 	return (mCurrentSet ? mCurrentSet->GetResources() : NULL);
 }
 
+bool PageManager::LookupString(const std::string& name, const std::string& default_value, std::string& value)
+{
+	pthread_mutex_lock(&mSetLock);
+	const ResourceManager* res = GetResources();
+	if (res) {
+		if (default_value.empty())
+			value = res->FindString(name);
+		else
+			value = res->FindString(name, default_value);
+	}
+	pthread_mutex_unlock(&mSetLock);
+	return res != NULL;
+}
+
 int PageManager::IsCurrentPage(Page* page)
 {
 	return (mCurrentSet ? mCurrentSet->IsCurrentPage(page) : 0);
@@ -1606,6 +1853,42 @@ int PageManager::Render(void)
 	return res;
 }
 
+bool PageManager::GetDamage(int& x, int& y, int& w, int& h)
+{
+#ifdef TW_NO_PARTIAL_RENDER
+	return false;
+#else
+	if (blankTimer.isScreenOff() || !mCurrentSet || !gr_flip_region_supported())
+		return false;
+
+	// The cursor is drawn over everything and isn't tracked
+	if (mMouseCursor && (mCursorUpdated || mMouseCursor->IsPresent()))
+		return false;
+
+	if (!mCurrentSet->GetDamage(x, y, w, h))
+		return false;
+
+	// A little extra for anti-aliased edges
+	int right = std::min(x + w + 2, gr_fb_width());
+	int bottom = std::min(y + h + 2, gr_fb_height());
+	x = std::max(x - 2, 0);
+	y = std::max(y - 2, 0);
+	w = std::max(right - x, 0);
+	h = std::max(bottom - y, 0);
+
+	// Past about 60% of the screen, a full redraw costs about the same
+	return (long long) w * h * 10 < (long long) gr_fb_width() * gr_fb_height() * 6;
+#endif
+}
+
+int PageManager::RenderRegion(int x, int y, int w, int h)
+{
+	if (blankTimer.isScreenOff())
+		return 0;
+
+	return (mCurrentSet ? mCurrentSet->RenderRegion(x, y, w, h) : -1);
+}
+
 HardwareKeyboard *PageManager::GetHardwareKeyboard()
 {
 	if (!mHardwareKeyboard)
@@ -1666,6 +1949,7 @@ int PageManager::Update(void)
 		int c_res = mMouseCursor->Update();
 		if (c_res > res)
 			res = c_res;
+		mCursorUpdated = (c_res > 0);
 	}
 	return res;
 }
@@ -1707,4 +1991,5 @@ extern "C" void gui_notifyVarChange(const char *name, const char* value)
 		return;
 
 	PageManager::NotifyVarChange(name, value);
+	gui_wake();
 }
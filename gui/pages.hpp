@@ -22,6 +22,8 @@
 #define _PAGES_HEADER_HPP
 
 #include "../zipwrap.hpp"
+#include <stdint.h>
+#include <pthread.h>
 #include <vector>
 #include <map>
 #include <string>
@@ -64,6 +66,10 @@ int ConvertStrToColor(std::string str, COLOR* color);
 int gui_forceRender(void);
 int gui_changePage(std::string newPage);
 int gui_changeOverlay(std::string newPage);
+// Wakes the GUI main loop up to show a change made from another thread
+void gui_wake(void);
+// Event time of the touch position being handed out, in microseconds
+uint64_t gui_touch_time(void);
 
 class Resource;
 class ResourceManager;
@@ -92,18 +98,42 @@ public:
 	virtual int NotifyVarChange(std::string varName, std::string value);
 	virtual void SetPageFocus(int inFocus);
 
+	// The part of the screen that changed since the last render, false when
+	// it has to be redrawn in full
+	bool GetDamage(int& x, int& y, int& w, int& h);
+	// Redraws only the objects in the given part of the screen
+	int RenderRegion(int x, int y, int w, int h);
+
 protected:
+	// Where each of mRenders was drawn last
+	struct RenderArea {
+		int x, y, w, h;
+		bool known;
+	};
+
 	std::string mName;
 	std::vector<GUIObject*> mObjects;
 	std::vector<RenderObject*> mRenders;
 	std::vector<ActionObject*> mActions;
 	std::vector<InputObject*> mInputs;
+	std::vector<RenderArea> mRenderAreas;
+	// The XML type of each of mRenders, for the profiler
+	std::vector<std::string> mRenderTypes;
+	// Which of mObjects may care about a variable, by the names in their XML
+	std::map<std::string, std::vector<size_t> > mVarWatchers;
 
 	ActionObject* mTouchStart;
 	COLOR mBackground;
 
+	int mDamageX, mDamageY, mDamageW, mDamageH;
+	bool mFullDamage;
+
 protected:
 	bool ProcessNode(xml_node<>* page, std::vector<xml_node<>*> *templates, int depth);
+	void AddDamage(const RenderArea& area);
+	void RecordArea(size_t index);
+	void WatchVariables(size_t index, xml_node<>* node);
+	void NotifyObject(GUIObject* object, const std::string& varName, const std::string& value);
 };
 
 struct LoadingContext;
@@ -131,6 +161,8 @@ public:
 	// These are routing routines
 	int Render(void);
 	int Update(void);
+	bool GetDamage(int& x, int& y, int& w, int& h);
+	int RenderRegion(int x, int y, int w, int h);
 	int NotifyTouch(TOUCH_STATE state, int x, int y);
 	int NotifyKey(int key, bool down);
 	int NotifyCharInput(int ch);
@@ -170,6 +202,8 @@ public:
 	static int ChangePage(std::string name);
 	static int ChangeOverlay(std::string name);
 	static const ResourceManager* GetResources();
+	// Finds a string in the current package from any thread; false if no package is current
+	static bool LookupString(const std::string& name, const std::string& default_value, std::string& value);
 	static std::string GetCurrentPage();
 
 	// Helper to identify if a particular page is the active page
@@ -178,6 +212,9 @@ public:
 	// These are routing routines
 	static int Render(void);
 	static int Update(void);
+	// Whether only part of the screen needs to be redrawn after Update(), and which
+	static bool GetDamage(int& x, int& y, int& w, int& h);
+	static int RenderRegion(int x, int y, int w, int h);
 	static int NotifyTouch(TOUCH_STATE state, int x, int y);
 	static int NotifyKey(int key, bool down);
 	static int NotifyCharInput(int ch);
@@ -205,8 +242,10 @@ protected:
 	static MouseCursor *mMouseCursor;
 	static HardwareKeyboard *mHardwareKeyboard;
 	static bool mReloadTheme;
+	static bool mCursorUpdated;
 	static std::string mStartPage;
 	static LoadingContext* currentLoadingContext;
+	static pthread_mutex_t mSetLock; // held while packages load or change, as messages may be translated on another thread meanwhile
 };
 
 #endif  // _PAGES_HEADER_HPP
@@ -264,10 +264,8 @@ void GUIPartitionList::NotifySelect(size_t item_selected)
 					DataManager::SetValue(mVariable, str);
 				}
 			} else {
-				if (ListType == "flashimg") { // only one item can be selected for flashing images
-					for (int i=0; i<listSize; i++)
-						mList.at(i).selected = 0;
-				}
+				// Several partitions can be selected for flashing images, the
+				// image is written to all of them at once
 				if (mList.at(item_selected).selected)
 					mList.at(item_selected).selected = 0;
 				else
@@ -0,0 +1,200 @@
+/*
+	Copyright 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// profiler.cpp - Frame timing of the GUI, switched on at runtime
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "../twcommon.h"
+#include "../data.hpp"
+#include "../minuitwrp/minui.h"
+#include "rapidxml.hpp"
+#include "objects.hpp"
+#include "profiler.hpp"
+
+int GUIProfiler::mMode = 0;
+uint64_t GUIProfiler::mLast[PROFILE_PHASES];
+std::map<std::string, GUIProfiler::Timings> GUIProfiler::mPages;
+std::map<std::string, GUIProfiler::Timings> GUIProfiler::mObjects;
+pthread_mutex_t GUIProfiler::mLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char* const phase_names[PROFILE_PHASES] = { "update", "render", "flip" };
+
+GUIProfiler::Histogram::Histogram()
+{
+	count = total_us = max_us = 0;
+	memset(buckets, 0, sizeof(buckets));
+}
+
+void GUIProfiler::Histogram::Add(uint64_t us)
+{
+	int bucket = 0;
+	while (bucket < BUCKETS - 1 && (us >> (bucket + 1)) != 0)
+		bucket++;
+	buckets[bucket]++;
+	count++;
+	total_us += us;
+	if (us > max_us)
+		max_us = us;
+}
+
+uint64_t GUIProfiler::Now()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void GUIProfiler::CheckMode()
+{
+	int mode = DataManager::GetIntValue("tw_gui_profile");
+	if (mode == mMode)
+		return;
+
+	if (mode == 0) {
+		if (WriteJson(GUI_PROFILE_FILE))
+			LOGINFO("GUI profile written to %s\n", GUI_PROFILE_FILE);
+		else
+			LOGINFO("Unable to write GUI profile to %s\n", GUI_PROFILE_FILE);
+		Reset();
+	} else if (mMode == 0) {
+		LOGINFO("GUI profiling started\n");
+	}
+	mMode = mode;
+}
+
+void GUIProfiler::AddPageTime(const std::string& page, GUIProfilePhase phase, uint64_t us)
+{
+	pthread_mutex_lock(&mLock);
+	mPages[page].phase[phase].Add(us);
+	mLast[phase] = us;
+	pthread_mutex_unlock(&mLock);
+}
+
+void GUIProfiler::AddObjectTime(const std::string& type, GUIProfilePhase phase, uint64_t us)
+{
+	pthread_mutex_lock(&mLock);
+	mObjects[type].phase[phase].Add(us);
+	pthread_mutex_unlock(&mLock);
+}
+
+void GUIProfiler::RenderOverlay(const std::string& page)
+{
+	const ResourceManager* resources = PageManager::GetResources();
+	FontResource* font = resources ? resources->FindFont("fixed") : NULL;
+	if (!font || !font->GetResource())
+		return;
+
+	char lines[3][128];
+	pthread_mutex_lock(&mLock);
+	const Timings& timings = mPages[page];
+	snprintf(lines[0], sizeof(lines[0]), "%s", page.c_str());
+	snprintf(lines[1], sizeof(lines[1]), "upd %.1f  rnd %.1f  flip %.1f ms",
+		mLast[PROFILE_UPDATE] / 1000.0, mLast[PROFILE_RENDER] / 1000.0, mLast[PROFILE_FLIP] / 1000.0);
+	double avg[PROFILE_PHASES];
+	for (int i = 0; i < PROFILE_PHASES; i++) {
+		const Histogram& h = timings.phase[i];
+		avg[i] = h.count ? h.total_us / 1000.0 / h.count : 0;
+	}
+	snprintf(lines[2], sizeof(lines[2]), "avg %.1f / %.1f / %.1f ms", avg[PROFILE_UPDATE], avg[PROFILE_RENDER], avg[PROFILE_FLIP]);
+	pthread_mutex_unlock(&mLock);
+
+	int height = font->GetHeight();
+	int width = 0;
+	for (int i = 0; i < 3; i++)
+		width = std::max(width, gr_ttf_measureEx(lines[i], font->GetResource()));
+	gr_color(0, 0, 0, 192);
+	gr_fill(0, 0, width + 8, height * 3 + 8);
+	gr_color(255, 255, 0, 255);
+	for (int i = 0; i < 3; i++)
+		gr_textEx_scaleW(4, 4 + height * i, lines[i], font->GetResource(), gr_fb_width() - 8, TOP_LEFT, 0);
+}
+
+void GUIProfiler::WriteTimings(FILE* f, const Timings& timings)
+{
+	fprintf(f, "{");
+	for (int i = 0; i < PROFILE_PHASES; i++) {
+		const Histogram& h = timings.phase[i];
+		fprintf(f, "%s\"%s\": {\"count\": %llu, \"total_us\": %llu, \"max_us\": %llu, \"buckets_us\": {",
+			i ? ", " : "", phase_names[i], (unsigned long long) h.count,
+			(unsigned long long) h.total_us, (unsigned long long) h.max_us);
+		bool first = true;
+		for (int b = 0; b < BUCKETS; b++) {
+			if (!h.buckets[b])
+				continue;
+			fprintf(f, "%s\"%llu\": %llu", first ? "" : ", ", 1ULL << b, (unsigned long long) h.buckets[b]);
+			first = false;
+		}
+		fprintf(f, "}}");
+	}
+	fprintf(f, "}");
+}
+
+// Page names come from the theme, so they are escaped
+static void WriteJsonString(FILE* f, const std::string& s)
+{
+	fputc('"', f);
+	for (size_t i = 0; i < s.size(); i++) {
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+bool GUIProfiler::WriteJson(const std::string& filename)
+{
+	FILE* f = fopen(filename.c_str(), "we");
+	if (!f)
+		return false;
+
+	pthread_mutex_lock(&mLock);
+	fprintf(f, "{\n  \"pages\": {");
+	for (std::map<std::string, Timings>::const_iterator it = mPages.begin(); it != mPages.end(); ++it) {
+		fprintf(f, "%s\n    ", it == mPages.begin() ? "" : ",");
+		WriteJsonString(f, it->first);
+		fprintf(f, ": ");
+		WriteTimings(f, it->second);
+	}
+	fprintf(f, "\n  },\n  \"objects\": {");
+	for (std::map<std::string, Timings>::const_iterator it = mObjects.begin(); it != mObjects.end(); ++it) {
+		fprintf(f, "%s\n    ", it == mObjects.begin() ? "" : ",");
+		WriteJsonString(f, it->first);
+		fprintf(f, ": ");
+		WriteTimings(f, it->second);
+	}
+	fprintf(f, "\n  }\n}\n");
+	pthread_mutex_unlock(&mLock);
+
+	return fclose(f) == 0;
+}
+
+void GUIProfiler::Reset()
+{
+	pthread_mutex_lock(&mLock);
+	mPages.clear();
+	mObjects.clear();
+	memset(mLast, 0, sizeof(mLast));
+	pthread_mutex_unlock(&mLock);
+}
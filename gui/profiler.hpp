@@ -0,0 +1,91 @@
+/*
+	Copyright 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// profiler.hpp - Frame timing of the GUI, switched on at runtime
+
+#ifndef _PROFILER_HEADER
+#define _PROFILER_HEADER
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <map>
+
+// Where the profile is written when profiling is switched off
+#define GUI_PROFILE_FILE "/tmp/twrp_gui_profile.json"
+
+enum GUIProfilePhase {
+	PROFILE_UPDATE,
+	PROFILE_RENDER,
+	PROFILE_FLIP,
+	PROFILE_PHASES
+};
+
+// Collects how long Update(), Render() and flips take, per page and per
+// object type. The data manager variable tw_gui_profile switches it: 0 is
+// off, 1 collects, 2 also draws the numbers in a corner of the screen.
+// Going back to 0 writes everything collected to GUI_PROFILE_FILE.
+class GUIProfiler
+{
+public:
+	// Follows tw_gui_profile; called once per frame
+	static void CheckMode();
+	static bool Enabled() { return mMode != 0; }
+	static bool OverlayEnabled() { return mMode > 1; }
+
+	// Microseconds on the monotonic clock
+	static uint64_t Now();
+
+	static void AddPageTime(const std::string& page, GUIProfilePhase phase, uint64_t us);
+	static void AddObjectTime(const std::string& type, GUIProfilePhase phase, uint64_t us);
+
+	// Draws the last frame's times and the page averages over the frame
+	static void RenderOverlay(const std::string& page);
+
+	static bool WriteJson(const std::string& filename);
+	static void Reset();
+
+private:
+	// Powers of two of microseconds: 1, 2, 4 ... up to about 2 seconds
+	enum { BUCKETS = 22 };
+
+	struct Histogram {
+		uint64_t count;
+		uint64_t total_us;
+		uint64_t max_us;
+		uint64_t buckets[BUCKETS];
+
+		Histogram();
+		void Add(uint64_t us);
+	};
+
+	struct Timings {
+		Histogram phase[PROFILE_PHASES];
+	};
+
+	static void WriteTimings(FILE* f, const Timings& timings);
+
+	static int mMode;
+	static uint64_t mLast[PROFILE_PHASES];
+	static std::map<std::string, Timings> mPages;
+	static std::map<std::string, Timings> mObjects;
+	static pthread_mutex_t mLock;
+};
+
+#endif // _PROFILER_HEADER
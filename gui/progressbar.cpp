@@ -52,6 +52,7 @@ GUIProgressBar::GUIProgressBar(xml_node<>* node) : GUIObject(node)
 	mLastPos = 0;
 	mSlide = 0.0;
 	mSlideInc = 0.0;
+	mMinValID = mMaxValID = mCurValID = INVALID_VAR_ID;
 
 	if (!node)
 	{
@@ -76,6 +77,9 @@ GUIProgressBar::GUIProgressBar(xml_node<>* node) : GUIObject(node)
 		mMinValVar = LoadAttrString(child, "min");
 		mMaxValVar = LoadAttrString(child, "max");
 		mCurValVar = LoadAttrString(child, "name");
+		mMinValID = DataManager::GetVarID(mMinValVar);
+		mMaxValID = DataManager::GetVarID(mMaxValVar);
+		mCurValID = DataManager::GetVarID(mCurValVar);
 	}
 
 	if (mEmptyBar && mEmptyBar->GetResource()) {
@@ -125,7 +129,7 @@ int GUIProgressBar::Update(void)
 		if (atoi(mMinValVar.c_str()) != 0)
 			str = mMinValVar;
 		else
-			DataManager::GetValue(mMinValVar, str);
+			DataManager::GetValue(mMinValID, str);
 		min = atoi(str.c_str());
 	}
 
@@ -137,12 +141,12 @@ int GUIProgressBar::Update(void)
 		if (atoi(mMaxValVar.c_str()) != 0)
 			str = mMaxValVar;
 		else
-			DataManager::GetValue(mMaxValVar, str);
+			DataManager::GetValue(mMaxValID, str);
 		max = atoi(str.c_str());
 	}
 
 	str.clear();
-	DataManager::GetValue(mCurValVar, str);
+	DataManager::GetValue(mCurValID, str);
 	cur = atoi(str.c_str());
 
 	// Do slide, if needed
@@ -182,6 +186,13 @@ int GUIProgressBar::Update(void)
 	return 2;
 }
 
+void GUIProgressBar::AddWatchedVariables(std::set<std::string>& vars)
+{
+	// DataManager::ShowProgress sets these
+	vars.insert("ui_progress_portion");
+	vars.insert("ui_progress_frames");
+}
+
 int GUIProgressBar::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
@@ -236,7 +247,7 @@ int GUIProgressBar::NotifyVarChange(const std::string& varName, const std::strin
 		{
 			// Get the current position
 			str.clear();
-			DataManager::GetValue(mCurValVar, str);
+			DataManager::GetValue(mCurValID, str);
 			cur = atoi(str.c_str());
 
 			mSlideInc = (float) mSlide / (float) mSlideFrames;
@@ -25,10 +25,13 @@
 #include <unistd.h>
 
 #include <string>
+#include <vector>
 #include <sstream>
 #include <iostream>
 #include <iomanip>
+#include <algorithm>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "../zipwrap.hpp"
 extern "C" {
@@ -39,8 +42,7 @@ extern "C" {
 
 #include "rapidxml.hpp"
 #include "objects.hpp"
-
-#define TMP_RESOURCE_NAME   "/tmp/extract.bin"
+#include "imagecache.hpp"
 
 Resource::Resource(xml_node<>* node, ZipWrap* pZip __unused)
 {
@@ -59,19 +61,34 @@ int Resource::ExtractResource(ZipWrap* pZip, std::string folderName, std::string
 	return 0;
 }
 
+int Resource::DecodeImageResource(ZipWrap* pZip, std::string src, gr_surface* surface)
+{
+	// Stored entries are decoded straight from the mapped zip, deflated
+	// ones from a buffer they are inflated into
+	ZipWrapEntry entry;
+	if (pZip->GetEntryData(src, &entry) && !entry.deflated && entry.compressed_length == entry.uncompressed_length)
+		return res_create_surface_mem(entry.data, entry.uncompressed_length, surface);
+
+	long len = pZip->GetUncompressedSize(src);
+	if (len <= 0)
+		return -1;
+	std::vector<unsigned char> buffer(len);
+	if (!pZip->ExtractToBuffer(src, buffer.data()))
+		return -1;
+	return res_create_surface_mem(buffer.data(), buffer.size(), surface);
+}
+
 void Resource::LoadImage(ZipWrap* pZip, std::string file, gr_surface* surface)
 {
 	int rc = 0;
-	if (ExtractResource(pZip, "images", file, ".png", TMP_RESOURCE_NAME) == 0)
+	if (pZip && pZip->EntryExists("images/" + file + ".png"))
 	{
-		rc = res_create_surface(TMP_RESOURCE_NAME, surface);
-		unlink(TMP_RESOURCE_NAME);
+		rc = DecodeImageResource(pZip, "images/" + file + ".png", surface);
 	}
-	else if (ExtractResource(pZip, "images", file, "", TMP_RESOURCE_NAME) == 0)
+	else if (pZip && pZip->EntryExists("images/" + file))
 	{
 		// JPG includes the .jpg extension in the filename so extension should be blank
-		rc = res_create_surface(TMP_RESOURCE_NAME, surface);
-		unlink(TMP_RESOURCE_NAME);
+		rc = DecodeImageResource(pZip, "images/" + file, surface);
 	}
 	else if (!pZip)
 	{
@@ -82,29 +99,56 @@ void Resource::LoadImage(ZipWrap* pZip, std::string file, gr_surface* surface)
 		LOGINFO("Failed to load image from %s%s, error %d\n", file.c_str(), pZip ? " (zip)" : "", rc);
 }
 
-void Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, int retain_aspect)
+bool Resource::GetImageScale(int retain_aspect, float* scale_w, float* scale_h)
+{
+	*scale_w = get_scale_w();
+	*scale_h = get_scale_h();
+	if (*scale_w == 0 || *scale_h == 0)
+		return false;
+	if (retain_aspect) {
+		if (*scale_w < *scale_h)
+			*scale_h = *scale_w;
+		else
+			*scale_w = *scale_h;
+	}
+	return true;
+}
+
+bool Resource::CheckAndScaleImage(gr_surface source, gr_surface* destination, int retain_aspect)
 {
+	float scale_w, scale_h;
 	if (!source) {
 		*destination = NULL;
-		return;
+		return false;
 	}
-	if (get_scale_w() != 0 && get_scale_h() != 0) {
-		float scale_w = get_scale_w(), scale_h = get_scale_h();
-		if (retain_aspect) {
-			if (scale_w < scale_h)
-				scale_h = scale_w;
-			else
-				scale_w = scale_h;
-		}
+	if (GetImageScale(retain_aspect, &scale_w, &scale_h)) {
 		if (res_scale_surface(source, destination, scale_w, scale_h)) {
 			LOGINFO("Error scaling image, using regular size.\n");
 			*destination = source;
+			return false;
 		}
+		return true;
 	} else {
 		*destination = source;
+		return false;
 	}
 }
 
+void Resource::LoadScaledImage(ZipWrap* pZip, std::string file, gr_surface* surface, int retain_aspect)
+{
+	ScaledImageCache* cache = pZip ? ScaledImageCache::current : NULL;
+	gr_surface temp_surface = NULL;
+	float scale_w, scale_h;
+
+	bool scaled = GetImageScale(retain_aspect, &scale_w, &scale_h);
+	if (cache && scaled && cache->Find(file, scale_w, scale_h, surface))
+		return;
+
+	LoadImage(pZip, file, &temp_surface);
+	if (CheckAndScaleImage(temp_surface, surface, retain_aspect) && cache)
+		cache->Add(file, scale_w, scale_h, *surface);
+}
+
 FontResource::FontResource(xml_node<>* node, ZipWrap* pZip)
  : Resource(node, pZip)
 {
@@ -151,7 +195,7 @@ void FontResource::LoadFont(xml_node<>* node, ZipWrap* pZip)
 		if (attr)
 			dpi = atoi(attr->value());
 
-		// we can't use TMP_RESOURCE_NAME here because the ttf subsystem is caching the name and scaling needs to reload the font
+		// fonts get a file of their own because the ttf subsystem is caching the name and scaling needs to reload the font
 		std::string tmpname = "/tmp/" + file;
 		if (ExtractResource(pZip, "fonts", file, "", tmpname) == 0)
 		{
@@ -197,7 +241,6 @@ ImageResource::ImageResource(xml_node<>* node, ZipWrap* pZip)
  : Resource(node, pZip)
 {
 	std::string file;
-	gr_surface temp_surface = NULL;
 
 	mSurface = NULL;
 	if (!node) {
@@ -214,8 +257,7 @@ ImageResource::ImageResource(xml_node<>* node, ZipWrap* pZip)
 
 	bool retain_aspect = (node->first_attribute("retainaspect") != NULL);
 	// the value does not matter, if retainaspect is present, we assume that we want to retain it
-	LoadImage(pZip, file, &temp_surface);
-	CheckAndScaleImage(temp_surface, &mSurface, retain_aspect);
+	LoadScaledImage(pZip, file, &mSurface, retain_aspect);
 }
 
 ImageResource::~ImageResource()
@@ -247,9 +289,8 @@ AnimationResource::AnimationResource(xml_node<>* node, ZipWrap* pZip)
 		std::ostringstream fileName;
 		fileName << file << std::setfill ('0') << std::setw (3) << fileNum;
 
-		gr_surface surface, temp_surface = NULL;
-		LoadImage(pZip, fileName.str(), &temp_surface);
-		CheckAndScaleImage(temp_surface, &surface, retain_aspect);
+		gr_surface surface = NULL;
+		LoadScaledImage(pZip, fileName.str(), &surface, retain_aspect);
 		if (surface) {
 			mSurfaces.push_back(surface);
 			fileNum++;
@@ -343,6 +384,82 @@ void ResourceManager::AddStringResource(std::string resource_source, std::string
 	res.source = resource_source;
 	res.value = value;
 	mStrings[resource_name] = res;
+	TextTemplate::StringsChanged();
+}
+
+// The most threads decoding and scaling images during a theme load
+#define MAX_RESOURCE_LOADERS 4
+
+// An image or animation of the theme, built by whichever loader thread
+// gets to it first
+struct ResourceLoadJob {
+	xml_node<>* node;
+	std::string type;
+	Resource* res;
+};
+
+struct ResourceLoadQueue {
+	std::vector<ResourceLoadJob>* jobs;
+	ZipWrap* pZip;
+	size_t next;
+	pthread_mutex_t lock;
+};
+
+static void* LoadResourceWorker(void* cookie)
+{
+	ResourceLoadQueue* queue = (ResourceLoadQueue*) cookie;
+	for (;;) {
+		pthread_mutex_lock(&queue->lock);
+		size_t i = queue->next++;
+		pthread_mutex_unlock(&queue->lock);
+		if (i >= queue->jobs->size())
+			return NULL;
+
+		ResourceLoadJob& job = (*queue->jobs)[i];
+		if (job.type == "image")
+			job.res = new ImageResource(job.node, queue->pZip);
+		else
+			job.res = new AnimationResource(job.node, queue->pZip);
+	}
+}
+
+// Runs the jobs on up to MAX_RESOURCE_LOADERS threads, this one included,
+// and returns once all of them are done
+static void LoadResourceJobs(std::vector<ResourceLoadJob>& jobs, ZipWrap* pZip)
+{
+	ResourceLoadQueue queue;
+	queue.jobs = &jobs;
+	queue.pZip = pZip;
+	queue.next = 0;
+	pthread_mutex_init(&queue.lock, NULL);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t threads = std::min<size_t>(std::min<long>(std::max(cpus, 1L), MAX_RESOURCE_LOADERS), jobs.size());
+	std::vector<pthread_t> helpers;
+	for (size_t i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, LoadResourceWorker, &queue) == 0)
+			helpers.push_back(thread);
+	}
+	LoadResourceWorker(&queue);
+	for (size_t i = 0; i < helpers.size(); i++)
+		pthread_join(helpers[i], NULL);
+
+	pthread_mutex_destroy(&queue.lock);
+}
+
+static void LogResourceError(xml_node<>* child, const std::string& type)
+{
+	std::string res_name;
+	if (child->first_attribute("name"))
+		res_name = child->first_attribute("name")->value();
+	if (res_name.empty() && child->first_attribute("filename"))
+		res_name = child->first_attribute("filename")->value();
+
+	if (!res_name.empty()) {
+		LOGERR("Resource (%s)-(%s) failed to load\n", type.c_str(), res_name.c_str());
+	} else
+		LOGERR("Resource type (%s) failed to load\n", type.c_str());
 }
 
 void ResourceManager::LoadResources(xml_node<>* resList, ZipWrap* pZip, std::string resource_source)
@@ -350,6 +467,11 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipWrap* pZip, std::str
 	if (!resList)
 		return;
 
+	// Fonts and strings are quick and FreeType wants one thread, so they are
+	// done here. Images and animations are collected and decoded in parallel
+	// afterwards, then added in the order the theme lists them.
+	std::vector<ResourceLoadJob> jobs;
+
 	for (xml_node<>* child = resList->first_node(); child; child = child->next_sibling())
 	{
 		std::string type = child->name();
@@ -390,25 +512,13 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipWrap* pZip, std::str
 			} else if (mFonts.size() != 0)
 				LOGERR("Unable to locate font name for type fontoverride.\n");
 		}
-		else if (type == "image")
+		else if (type == "image" || type == "animation")
 		{
-			ImageResource* res = new ImageResource(child, pZip);
-			if (res && res->GetResource())
-				mImages.push_back(res);
-			else {
-				error = true;
-				delete res;
-			}
-		}
-		else if (type == "animation")
-		{
-			AnimationResource* res = new AnimationResource(child, pZip);
-			if (res && res->GetResourceCount())
-				mAnimations.push_back(res);
-			else {
-				error = true;
-				delete res;
-			}
+			ResourceLoadJob job;
+			job.node = child;
+			job.type = type;
+			job.res = NULL;
+			jobs.push_back(job);
 		}
 		else if (type == "string")
 		{
@@ -417,6 +527,7 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipWrap* pZip, std::str
 				res.source = resource_source;
 				res.value = child->value();
 				mStrings[attr->value()] = res;
+				TextTemplate::StringsChanged();
 			} else
 				error = true;
 		}
@@ -427,17 +538,32 @@ void ResourceManager::LoadResources(xml_node<>* resList, ZipWrap* pZip, std::str
 		}
 
 		if (error)
+			LogResourceError(child, type);
+	}
+
+	LoadResourceJobs(jobs, pZip);
+
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		if (jobs[i].type == "image")
 		{
-			std::string res_name;
-			if (child->first_attribute("name"))
-				res_name = child->first_attribute("name")->value();
-			if (res_name.empty() && child->first_attribute("filename"))
-				res_name = child->first_attribute("filename")->value();
-
-			if (!res_name.empty()) {
-				LOGERR("Resource (%s)-(%s) failed to load\n", type.c_str(), res_name.c_str());
-			} else
-				LOGERR("Resource type (%s) failed to load\n", type.c_str());
+			ImageResource* res = static_cast<ImageResource*>(jobs[i].res);
+			if (res && res->GetResource())
+				mImages.push_back(res);
+			else {
+				LogResourceError(jobs[i].node, jobs[i].type);
+				delete res;
+			}
+		}
+		else
+		{
+			AnimationResource* res = static_cast<AnimationResource*>(jobs[i].res);
+			if (res && res->GetResourceCount())
+				mAnimations.push_back(res);
+			else {
+				LogResourceError(jobs[i].node, jobs[i].type);
+				delete res;
+			}
 		}
 	}
 }
@@ -46,8 +46,11 @@ private:
 
 protected:
 	static int ExtractResource(ZipWrap* pZip, std::string folderName, std::string fileName, std::string fileExtn, std::string destFile);
+	static int DecodeImageResource(ZipWrap* pZip, std::string src, gr_surface* surface);
 	static void LoadImage(ZipWrap* pZip, std::string file, gr_surface* surface);
-	static void CheckAndScaleImage(gr_surface source, gr_surface* destination, int retain_aspect);
+	static bool GetImageScale(int retain_aspect, float* scale_w, float* scale_h);
+	static bool CheckAndScaleImage(gr_surface source, gr_surface* destination, int retain_aspect);
+	static void LoadScaledImage(ZipWrap* pZip, std::string file, gr_surface* surface, int retain_aspect);
 };
 
 class FontResource : public Resource
@@ -29,6 +29,9 @@ extern "C" {
 
 const float SCROLLING_SPEED_DECREMENT = 0.9; // friction
 const int SCROLLING_FLOOR = 2; // minimum pixels for scrolling to stop
+const int64_t KINETIC_FRAME_US = 33333; // kinetic scrolling moves once per frame
+const int64_t KINETIC_MIN_US = 8000; // shorter gaps between drags are too noisy to go by
+const uint64_t KINETIC_IDLE_US = 100000; // no fling if the finger rested this long before letting go
 
 GUIScrollList::GUIScrollList(xml_node<>* node) : GUIObject(node)
 {
@@ -43,6 +46,7 @@ GUIScrollList::GUIScrollList(xml_node<>* node) : GUIObject(node)
 	mFastScrollW = mFastScrollLineW = mFastScrollRectW = mFastScrollRectH = 0;
 	mFastScrollRectCurrentY = mFastScrollRectCurrentH = mFastScrollRectTouchY = 0;
 	lastY = last2Y = fastScroll = 0;
+	lastTime = last2Time = 0;
 	mUpdate = 0;
 	touchDebounce = 6;
 	ConvertStrToColor("black", &mBackgroundColor);
@@ -60,10 +64,10 @@ GUIScrollList::GUIScrollList(xml_node<>* node) : GUIObject(node)
 	// Load header text
 	// note: node can be NULL for the emergency console
 	child = node ? node->first_node("text") : NULL;
-	if (child)  mHeaderText = child->value();
+	if (child)  mHeaderText.SetText(child->value());
 	// Simple way to check for static state
-	mLastHeaderValue = gui_parse_text(mHeaderText);
-	mHeaderIsStatic = (mLastHeaderValue == mHeaderText);
+	mLastHeaderValue = mHeaderText.Evaluate();
+	mHeaderIsStatic = (mLastHeaderValue == mHeaderText.GetText());
 
 	mHighlightColor = LoadAttrColor(FindNode(node, "highlight"), "color", &hasHighlightColor);
 
@@ -230,6 +234,10 @@ int GUIScrollList::Render(void)
 
 	int yPos = mRenderY + mHeaderH + y_offset;
 
+	// rows outside of a partial redraw would be clipped away anyway
+	int regionX, regionY, regionW, regionH;
+	bool hasRegion = gr_get_region(&regionX, &regionY, &regionW, &regionH);
+
 	// render all visible items
 	for (size_t line = 0; line < lines; line++)
 	{
@@ -237,6 +245,11 @@ int GUIScrollList::Render(void)
 		if (itemindex >= listSize)
 			break;
 
+		if (hasRegion && (yPos + actualItemHeight <= regionY || yPos >= regionY + regionH)) {
+			yPos += actualItemHeight;
+			continue;
+		}
+
 		RenderItem(itemindex, yPos, itemindex == selectedItem);
 
 		// Add the separator
@@ -359,7 +372,7 @@ int GUIScrollList::Update(void)
 		return 0;
 
 	if (!mHeaderIsStatic) {
-		std::string newValue = gui_parse_text(mHeaderText);
+		const std::string& newValue = mHeaderText.Evaluate();
 		if (mLastHeaderValue != newValue) {
 			mLastHeaderValue = newValue;
 			mUpdate = 1;
@@ -454,6 +467,7 @@ int GUIScrollList::NotifyTouch(TOUCH_STATE state, int x, int y)
 		if (selectedItem != NO_ITEM)
 			mUpdate = 1;
 		lastY = last2Y = y;
+		lastTime = last2Time = gui_touch_time();
 		break;
 
 	case TOUCH_DRAG:
@@ -492,6 +506,8 @@ int GUIScrollList::NotifyTouch(TOUCH_STATE state, int x, int y)
 			y_offset += y - lastY; // adjust the scrolling offset based on the difference between the starting touch and the current touch
 			last2Y = lastY; // keep track of previous y locations so that we can tell how fast to scroll for kinetic scrolling
 			lastY = y; // update last touch to the current touch so we can tell how far and what direction we scroll for the next touch event
+			last2Time = lastTime;
+			lastTime = gui_touch_time();
 
 			HandleScrolling();
 		} else
@@ -516,6 +532,15 @@ int GUIScrollList::NotifyTouch(TOUCH_STATE state, int x, int y)
 		} else {
 			// Start kinetic scrolling
 			scrollingSpeed = lastY - last2Y;
+			if (last2Time && lastTime > last2Time) {
+				// The last drags may be more or less than a frame apart, and
+				// a finger that stopped before letting go doesn't fling
+				uint64_t releaseTime = gui_touch_time();
+				if (releaseTime > lastTime + KINETIC_IDLE_US)
+					scrollingSpeed = 0;
+				else
+					scrollingSpeed = scrollingSpeed * KINETIC_FRAME_US / std::max<int64_t>(lastTime - last2Time, KINETIC_MIN_US);
+			}
 			if (abs(scrollingSpeed) < touchDebounce)
 				scrollingSpeed = 0;
 		}
@@ -579,7 +604,7 @@ int GUIScrollList::NotifyVarChange(const std::string& varName, const std::string
 		return 0;
 
 	if (!mHeaderIsStatic) {
-		std::string newValue = gui_parse_text(mHeaderText);
+		const std::string& newValue = mHeaderText.Evaluate();
 		if (mLastHeaderValue != newValue) {
 			mLastHeaderValue = newValue;
 			firstDisplayedItem = 0;
@@ -627,34 +652,35 @@ bool GUIScrollList::AddLines(std::vector<std::string>* origText, std::vector<std
 	// Due to word wrap, figure out what / how the newly added text needs to be added to the render vector that is word wrapped
 	// Note, that multiple consoles on different GUI pages may be different widths or use different fonts, so the word wrapping
 	// may different in different console windows
+	std::vector<std::string> wrapped;
 	for (size_t i = prevCount; i < *lastCount; i++) {
-		string curr_line = origText->at(i);
-		string curr_color;
+		wrapped.clear();
+		WrapLine(origText->at(i), &wrapped);
+		rText->insert(rText->end(), wrapped.begin(), wrapped.end());
 		if (origColor)
-			curr_color = origColor->at(i);
-		for (;;) {
-			size_t line_char_width = gr_ttf_maxExW(curr_line.c_str(), mFont->GetResource(), mRenderW);
-			if (line_char_width < curr_line.size()) {
-				//string left = curr_line.substr(0, line_char_width);
-				size_t wrap_pos = curr_line.find_last_of(" ,./:-_;", line_char_width - 1);
-				if (wrap_pos == string::npos)
-					wrap_pos = line_char_width;
-				else if (wrap_pos < line_char_width - 1)
-					wrap_pos++;
-				rText->push_back(curr_line.substr(0, wrap_pos));
-				if (origColor)
-					rColor->push_back(curr_color);
-				curr_line = curr_line.substr(wrap_pos);
-				/* After word wrapping, delete any leading spaces. Note that the word wrapping is not smart enough to know not
-				 * to wrap in the middle of something like ... so some of the ... could appear on the following line. */
-				curr_line.erase(0, curr_line.find_first_not_of(" "));
-			} else {
-				rText->push_back(curr_line);
-				if (origColor)
-					rColor->push_back(curr_color);
-				break;
-			}
-		}
+			rColor->insert(rColor->end(), wrapped.size(), origColor->at(i));
 	}
 	return true;
 }
+
+void GUIScrollList::WrapLine(std::string line, std::vector<std::string>* wrapped)
+{
+	for (;;) {
+		size_t line_char_width = gr_ttf_maxExW(line.c_str(), mFont->GetResource(), mRenderW);
+		if (line_char_width < line.size()) {
+			size_t wrap_pos = line.find_last_of(" ,./:-_;", line_char_width - 1);
+			if (wrap_pos == string::npos)
+				wrap_pos = line_char_width;
+			else if (wrap_pos < line_char_width - 1)
+				wrap_pos++;
+			wrapped->push_back(line.substr(0, wrap_pos));
+			line = line.substr(wrap_pos);
+			/* After word wrapping, delete any leading spaces. Note that the word wrapping is not smart enough to know not
+			 * to wrap in the middle of something like ... so some of the ... could appear on the following line. */
+			line.erase(0, line.find_first_not_of(" "));
+		} else {
+			wrapped->push_back(line);
+			break;
+		}
+	}
+}
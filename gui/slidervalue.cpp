@@ -59,6 +59,7 @@ GUISliderValue::GUISliderValue(xml_node<>* node) : GUIObject(node)
 	mLineY = 0;
 	mValueStr = NULL;
 	mAction = NULL;
+	mVariableID = INVALID_VAR_ID;
 	mShowCurr = true;
 	mShowRange = false;
 	mChangeOnDrag = false;
@@ -117,8 +118,10 @@ GUISliderValue::GUISliderValue(xml_node<>* node) : GUIObject(node)
 	if (child)
 	{
 		attr = child->first_attribute("variable");
-		if (attr)
+		if (attr) {
 			mVariable = attr->value();
+			mVariableID = DataManager::GetVarID(mVariable);
+		}
 
 		attr = child->first_attribute("min");
 		if (attr)
@@ -205,7 +208,7 @@ void GUISliderValue::loadValue(bool force)
 {
 	if (!mVariable.empty())
 	{
-		int value = DataManager::GetIntValue(mVariable);
+		int value = DataManager::GetIntValue(mVariableID);
 		if (mValue == value && !force)
 			return;
 
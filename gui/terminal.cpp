@@ -22,6 +22,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <termio.h>
 
@@ -47,6 +48,12 @@ extern "C" {
 
 extern int g_pty_fd; // in gui.cpp where the select is
 
+// Lines kept in the scrollback; older ones are dropped
+#define TERMINAL_SCROLLBACK_LINES 2000
+
+// Most pty output taken in one go, so a flood can't hold up the next frame
+#define TERMINAL_READ_MAX (64 * 1024)
+
 /*
 Pseudoterminal handler.
 */
@@ -135,6 +142,15 @@ public:
 		return rc;
 	}
 
+	// Whether read() would return right away
+	bool readable()
+	{
+		if (!started())
+			return false;
+		struct pollfd pfd = { fdMaster, POLLIN, 0 };
+		return poll(&pfd, 1, 0) > 0;
+	}
+
 	int write(const char* buffer, size_t size)
 	{
 		if (!started()) {
@@ -284,7 +300,8 @@ public:
 	{
 		std::string text; // in UTF-8 format
 //		std::vector<AttributeRange> attrs;
-		Line() {}
+		uint32_t serial; // changes whenever the line does, so views know what to redraw
+		Line() : serial(0) {}
 		size_t utf8forward(size_t start) const
 		{
 			if (start >= text.size())
@@ -344,12 +361,44 @@ public:
 		}
 	};
 
+	// The text buffer: the last TERMINAL_SCROLLBACK_LINES lines, in a ring
+	class LineBuffer
+	{
+	public:
+		LineBuffer() : first(0), count(0) { ring.resize(TERMINAL_SCROLLBACK_LINES); }
+		size_t size() const { return count; }
+		bool full() const { return count == ring.size(); }
+		Line& operator[](size_t n) { return ring[(first + n) % ring.size()]; }
+		void push_back(const Line& line) { ring[(first + count) % ring.size()] = line; ++count; }
+		void pop_front(size_t n)
+		{
+			for (n = min(n, count); n; --n) {
+				ring[first] = Line();
+				first = (first + 1) % ring.size();
+				--count;
+			}
+		}
+		void truncate(size_t n)
+		{
+			while (count > n)
+				ring[(first + --count) % ring.size()] = Line();
+		}
+		void clear() { truncate(0); first = 0; }
+
+	private:
+		std::vector<Line> ring;
+		size_t first; // index in ring of line 0
+		size_t count;
+	};
+
 	TerminalEngine()
 	{
 		// the default size will be overwritten by the GUI window when the size is known
 		width = 40;
 		height = 10;
 
+		lineSerial = 0;
+		unpackedY = NO_LINE;
 		clear();
 		updateCounter = 0;
 		state = kStateGround;
@@ -376,20 +425,30 @@ public:
 
 	void readPty()
 	{
-		char buffer[1024];
-		int rc = pty.read(buffer, sizeof(buffer));
-		debug_printf("readPty: %d bytes\n", rc);
-		if (rc < 0)
-			output("\r\nChild process exited.\r\n");	// TODO: maybe exit terminal here
-		else
+		// Everything that is there, so it shows up in one frame instead of
+		// a wakeup per buffer
+		char buffer[4096];
+		size_t total = 0;
+		do {
+			int rc = pty.read(buffer, sizeof(buffer));
+			debug_printf("readPty: %d bytes\n", rc);
+			if (rc < 0) {
+				output("\r\nChild process exited.\r\n");	// TODO: maybe exit terminal here
+				return;
+			}
 			for (int i = 0; i < rc; ++i)
 				output(buffer[i]);
+			if (rc < (int) sizeof(buffer))
+				return;
+			total += rc;
+		} while (total < TERMINAL_READ_MAX && pty.readable());
 	}
 
 	void clear()
 	{
 		cursorX = cursorY = 0;
 		lines.clear();
+		unpackedY = NO_LINE;
 		setY(0);
 		unpackLine(0);
 		linewrap = false;
@@ -461,6 +520,7 @@ public:
 
 	size_t getLinesCount() const { return lines.size(); }
 	const Line& getLine(size_t n) { if (unpackedY == n) packLine(); return lines[n]; }
+	uint32_t getLineSerial(size_t n) { return lines[n].serial; }
 	int getCursorX() const { return cursorX; }
 	int getCursorY() const { return cursorY; }
 	int getUpdateCounter() const { return updateCounter; }
@@ -477,10 +537,17 @@ public:
 	{
 		//y = min(height, max(y, 0));
 		y = max(y, 0);
+		while (lines.size() <= (size_t) y) {
+			if (lines.full()) {
+				dropOldestLine();
+				--y;
+			}
+			Line line;
+			line.serial = ++lineSerial;
+			lines.push_back(line);
+		}
 		cursorY = y;
 		linewrap = false;
-		while (lines.size() <= (size_t) y)
-			lines.push_back(Line());
 		++updateCounter;
 	}
 
@@ -490,8 +557,12 @@ public:
 	void right(int n = 1) { setX(cursorX + n); }
 
 private:
+	enum { NO_LINE = (size_t)-1 };
+
 	void packLine()
 	{
+		if (unpackedY == NO_LINE)
+			return;
 		std::string& s = lines[unpackedY].text;
 		s.clear();
 		for (size_t i = 0; i < unpackedLine.cells.size(); ++i) {
@@ -525,6 +596,24 @@ private:
 		}
 	}
 
+	// Unpacks line y for a change to it
+	void editLine(size_t y)
+	{
+		ensureUnpacked(y);
+		lines[y].serial = ++lineSerial;
+	}
+
+	// Makes room at the end of a full scrollback; line numbers drop by one
+	void dropOldestLine()
+	{
+		if (unpackedY == 0) {
+			packLine();
+			unpackedY = NO_LINE;
+		} else if (unpackedY != NO_LINE)
+			--unpackedY;
+		lines.pop_front(1);
+	}
+
 	void processC0(char ch)
 	{
 		switch (ch)
@@ -595,7 +684,7 @@ private:
 			down();
 			setX(0);
 		}
-		ensureUnpacked(cursorY);
+		editLine(cursorY);
 		// extend unpackedLine if needed, write ch into cell
 		if (unpackedLine.cells.size() <= (size_t)cursorX)
 			unpackedLine.cells.resize(cursorX+1);
@@ -703,18 +792,18 @@ private:
 			case 'J': // ED - erase in page
 				{
 					int param = parseArg(ctlseq, 0);
-					ensureUnpacked(cursorY);
+					editLine(cursorY);
 					switch (param) {
 						default:
 						case 0:
 							unpackedLine.eraseFrom(cursorX);
-							if (lines.size() > (size_t)cursorY+1)
-								lines.erase(lines.begin() + cursorY+1, lines.end());
+							lines.truncate(cursorY+1);
 							break;
 						case 1:
 							unpackedLine.eraseTo(cursorX);
-							if (cursorY > 0) {
-								lines.erase(lines.begin(), lines.begin() + cursorY-1);
+							if (cursorY > 1) {
+								lines.pop_front(cursorY-1);
+								unpackedY -= cursorY-1;
 								cursorY = 0;
 							}
 							break;
@@ -728,7 +817,7 @@ private:
 			case 'K': // EL - erase in line
 				{
 					int param = parseArg(ctlseq, 0);
-					ensureUnpacked(cursorY);
+					editLine(cursorY);
 					switch (param) {
 						default:
 						case 0:
@@ -755,10 +844,11 @@ private:
 	int cursorX, cursorY; // 0-based, char based. TODO: decide how to handle scrollback
 	bool linewrap; // true to put next character into next line
 	int width, height; // window size in chars
-	std::vector<Line> lines; // the text buffer
+	LineBuffer lines; // the text buffer
 	UnpackedLine unpackedLine; // current line for editing
-	size_t unpackedY; // number of current line
+	size_t unpackedY; // number of current line, NO_LINE if none
 	int updateCounter; // changes whenever terminal could require redraw
+	uint32_t lineSerial; // last Line::serial handed out
 
 	Pseudoterminal pty;
 	enum { kStateGround, kStateEsc, kStateCsi } state;
@@ -794,6 +884,10 @@ GUITerminal::GUITerminal(xml_node<>* node) : GUIScrollList(node)
 
 	engine = &gEngine;
 	updateCounter = 0;
+	drawnFirstItem = drawnYOffset = -1;
+	drawnItemCount = 0;
+	drawnCursorX = drawnCursorY = -1;
+	damageY = damageH = 0;
 }
 
 int GUITerminal::Update(void)
@@ -819,9 +913,75 @@ int GUITerminal::Update(void)
 
 	if (mUpdate) {
 		mUpdate = 0;
-		if (Render() == 0)
-			return 2;
+		int first, last;
+		if (FindDamagedRows(first, last)) {
+			if (first > last)
+				return 0; // nothing visible changed
+			int rowY = mRenderY + mHeaderH + y_offset;
+			damageY = max(rowY + first * actualItemHeight, mRenderY + mHeaderH);
+			damageH = min(rowY + (last + 1) * actualItemHeight, mRenderY + mRenderH) - damageY;
+			if (damageH <= 0)
+				return 0;
+		} else
+			damageH = 0;
+		return 2;
+	}
+	return 0;
+}
+
+// Compares what will be drawn with what was drawn last and remembers it.
+// Returns false if the rows moved and the whole list has to be redrawn.
+bool GUITerminal::FindDamagedRows(int& first, int& last)
+{
+	size_t count = engine->getLinesCount();
+	size_t rows = GetDisplayItemCount() + 2;
+	int cursorX = engine->getCursorX();
+	int cursorY = engine->getCursorY();
+
+	bool moved = (drawnFirstItem != firstDisplayedItem || drawnYOffset != y_offset
+		|| drawnSerials.size() != rows || mLastHeaderValue != drawnHeader
+		// the fast scroll bar depends on the line count
+		|| (count != drawnItemCount && max(count, drawnItemCount) > (size_t) GetDisplayItemCount()));
+
+	first = (int) rows;
+	last = -1;
+	drawnSerials.resize(rows);
+	for (size_t row = 0; row < rows; row++) {
+		size_t item = firstDisplayedItem + row;
+		uint32_t serial = item < count ? engine->getLineSerial(item) : 0;
+		if (drawnSerials[row] != serial) {
+			drawnSerials[row] = serial;
+			first = min(first, (int) row);
+			last = max(last, (int) row);
+		}
+	}
+	if (cursorX != drawnCursorX || cursorY != drawnCursorY) {
+		// both where the cursor was and where it is now
+		int oldRow = drawnCursorY - drawnFirstItem;
+		int newRow = cursorY - firstDisplayedItem;
+		first = min(first, min(oldRow, newRow));
+		last = max(last, max(oldRow, newRow));
+		first = max(first, 0);
+		last = min(last, (int) rows - 1);
 	}
+
+	drawnFirstItem = firstDisplayedItem;
+	drawnYOffset = y_offset;
+	drawnItemCount = count;
+	drawnCursorX = cursorX;
+	drawnCursorY = cursorY;
+	drawnHeader = mLastHeaderValue;
+	return !moved;
+}
+
+int GUITerminal::GetDamageArea(int& x, int& y, int& w, int& h)
+{
+	if (damageH <= 0)
+		return -1;
+	x = mRenderX;
+	y = damageY;
+	w = mRenderW;
+	h = damageH;
 	return 0;
 }
 
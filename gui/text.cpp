@@ -53,7 +53,6 @@ GUIText::GUIText(xml_node<>* node)
 	maxWidth = 0;
 	scaleWidth = true;
 	isHighlighted = false;
-	mText = "";
 
 	if (!node)
 		return;
@@ -73,7 +72,7 @@ GUIText::GUIText(xml_node<>* node)
 	LoadPlacement(FindNode(node, "placement"), &mRenderX, &mRenderY, &mRenderW, &mRenderH, &mPlacement);
 
 	xml_node<>* child = FindNode(node, "text");
-	if (child)  mText = child->value();
+	if (child)  mText.SetText(child->value());
 
 	child = FindNode(node, "noscaling");
 	if (child) {
@@ -93,8 +92,8 @@ GUIText::GUIText(xml_node<>* node)
 	}
 
 	// Simple way to check for static state
-	mLastValue = gui_parse_text(mText);
-	if (mLastValue != mText)   mIsStatic = 0;
+	mLastValue = mText.Evaluate();
+	if (mLastValue != mText.GetText())   mIsStatic = 0;
 
 	mFontHeight = mFont->GetHeight();
 }
@@ -110,7 +109,7 @@ int GUIText::Render(void)
 	else
 		return -1;
 
-	mLastValue = gui_parse_text(mText);
+	mLastValue = mText.Evaluate();
 
 	mVarChanged = 0;
 
@@ -142,7 +141,7 @@ int GUIText::Update(void)
 	if (mIsStatic || !mVarChanged)
 		return 0;
 
-	std::string newValue = gui_parse_text(mText);
+	const std::string& newValue = mText.Evaluate();
 	if (mLastValue == newValue)
 		return 0;
 	else
@@ -158,11 +157,44 @@ int GUIText::GetCurrentBounds(int& w, int& h)
 		fontResource = mFont->GetResource();
 
 	h = mFontHeight;
-	mLastValue = gui_parse_text(mText);
+	mLastValue = mText.Evaluate();
 	w = gr_ttf_measureEx(mLastValue.c_str(), fontResource);
 	return 0;
 }
 
+int GUIText::GetRenderArea(int& x, int& y, int& w, int& h)
+{
+	void* fontResource = mFont ? mFont->GetResource() : NULL;
+	if (!fontResource)
+		return -1;
+
+	w = mLastValue.empty() ? 0 : gr_ttf_measureEx(mLastValue.c_str(), fontResource);
+	h = mFontHeight;
+	// Scaled down text fits in maxWidth, the placement only moves it by as much
+	int adj = w;
+	if (w > (int) maxWidth) {
+		adj = maxWidth;
+		if (scaleWidth)
+			w = maxWidth;
+	}
+
+	x = mRenderX;
+	y = mRenderY;
+	if (mPlacement != TOP_LEFT && mPlacement != BOTTOM_LEFT && mPlacement != TEXT_ONLY_RIGHT) {
+		if (mPlacement == CENTER || mPlacement == CENTER_X_ONLY)
+			x -= adj / 2;
+		else
+			x -= adj;
+	}
+	if (mPlacement != TOP_LEFT && mPlacement != TOP_RIGHT) {
+		if (mPlacement == CENTER || mPlacement == TEXT_ONLY_RIGHT)
+			y -= h / 2;
+		else if (mPlacement == BOTTOM_LEFT || mPlacement == BOTTOM_RIGHT)
+			y -= h;
+	}
+	return 0;
+}
+
 int GUIText::NotifyVarChange(const std::string& varName, const std::string& value)
 {
 	GUIObject::NotifyVarChange(varName, value);
@@ -182,5 +214,5 @@ int GUIText::SetMaxWidth(unsigned width)
 
 void GUIText::SetText(string newtext)
 {
-	mText = newtext;
+	mText.SetText(newtext);
 }
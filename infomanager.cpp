@@ -16,6 +16,8 @@
 	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdio.h>
+#include <unistd.h>
 #include <string>
 #include <map>
 #include <fstream>
@@ -119,25 +121,46 @@ int InfoManager::SaveValues(void) {
 
 	PartitionManager.Mount_By_Path(File, true);
 	LOGINFO("InfoManager saving '%s'\n", File.c_str());
-	FILE* out = fopen(File.c_str(), "wb");
-	if (!out)
-		return -1;
+	return WriteValues(File, SerializeValues());
+}
+
+string InfoManager::SerializeValues(void) {
+	string data;
 
 	if (file_version) {
-		fwrite(&file_version, 1, sizeof(int), out);
+		data.append((const char*) &file_version, sizeof(int));
 	}
 
 	map<string, string>::iterator iter;
 	for (iter = mValues.begin(); iter != mValues.end(); ++iter) {
 		unsigned short length = (unsigned short) iter->first.length() + 1;
-		fwrite(&length, 1, sizeof(unsigned short), out);
-		fwrite(iter->first.c_str(), 1, length, out);
+		data.append((const char*) &length, sizeof(unsigned short));
+		data.append(iter->first.c_str(), length);
 		length = (unsigned short) iter->second.length() + 1;
-		fwrite(&length, 1, sizeof(unsigned short), out);
-		fwrite(iter->second.c_str(), 1, length, out);
+		data.append((const char*) &length, sizeof(unsigned short));
+		data.append(iter->second.c_str(), length);
+	}
+	return data;
+}
+
+// Writes a new file next to the old one and renames it over, so that a
+// reset or a pulled card leaves either the old or the new values behind
+int InfoManager::WriteValues(const string& filename, const string& data) {
+	string temp = filename + ".tmp";
+	FILE* out = fopen(temp.c_str(), "wb");
+	if (!out)
+		return -1;
+
+	bool ok = fwrite(data.data(), 1, data.size(), out) == data.size();
+	ok = fflush(out) == 0 && ok;
+	ok = fsync(fileno(out)) == 0 && ok;
+	ok = fclose(out) == 0 && ok;
+	if (!ok || rename(temp.c_str(), filename.c_str()) != 0) {
+		LOGINFO("InfoManager unable to write '%s'\n", filename.c_str());
+		unlink(temp.c_str());
+		return -1;
 	}
-	fclose(out);
-	tw_set_default_metadata(File.c_str());
+	tw_set_default_metadata(filename.c_str());
 	return 0;
 }
 
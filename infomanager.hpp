@@ -38,6 +38,11 @@ public:
 	int LoadValues();
 	int SaveValues();
 
+	// SaveValues() in two steps, so that the values can be copied out under
+	// a lock and written without it
+	string SerializeValues();
+	static int WriteValues(const string& filename, const string& data);
+
 	// Core get routines
 	int GetValue(const string& varName, string& value);
 	int GetValue(const string& varName, int& value);
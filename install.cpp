@@ -561,7 +561,7 @@ static int really_install_package(const std::string& path, bool* wipe_cache, boo
   }
 
   MemMapping map;
-  if (!map.MapFile(path)) {
+  if (!map.MapFile(path, MemMapping::Policy::kSequential)) {
     LOG(ERROR) << "failed to map file";
     log_buffer->push_back(android::base::StringPrintf("error: %d", kMapFileFailure));
     return INSTALL_CORRUPT;
@@ -333,6 +333,50 @@ int blkid_superblocks_get_name(size_t idx, const char **name, int *usage)
 /*
  * The blkid_do_probe() backend.
  */
+/*
+ * Magics and the superblocks around them that live below this offset are
+ * read in one go before the probers run.
+ */
+#define SUPERBLOCKS_PREFETCH_MAX	(256 * 1024)
+
+/*
+ * Reads the start of the device that holds the magics of all the probers
+ * allowed by the filter. The probers then find their buffers in the one
+ * read rather than seeking around the device for each of them. If the read
+ * fails the probers read their buffers themselves as usual.
+ */
+static void superblocks_prefetch(blkid_probe pr, struct blkid_chain *chn)
+{
+	blkid_loff_t end = 0;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(idinfos); i++) {
+		const struct blkid_idinfo *id = idinfos[i];
+		const struct blkid_idmag *mag;
+
+		if (chn->fltr && blkid_bmp_get_item(chn->fltr, i))
+			continue;
+		if (id->minsz && id->minsz > pr->size)
+			continue;
+
+		for (mag = &id->magics[0]; mag->magic; mag++) {
+			/* blkid_probe_get_idmag() reads the 1 KiB around the magic */
+			blkid_loff_t off = ((mag->kboff + (mag->sboff >> 10)) << 10) + 1024;
+
+			if (off > end && off <= SUPERBLOCKS_PREFETCH_MAX)
+				end = off;
+		}
+	}
+
+	if (end > pr->size)
+		end = pr->size & ~((blkid_loff_t) 1023);
+	if (end <= 1024)
+		return;
+
+	DBG(LOWPROBE, ul_debug("	prefetch superblocks: len=%jd", end));
+	blkid_probe_get_buffer(pr, 0, end);
+}
+
 static int superblocks_probe(blkid_probe pr, struct blkid_chain *chn)
 {
 	size_t i;
@@ -355,6 +399,9 @@ static int superblocks_probe(blkid_probe pr, struct blkid_chain *chn)
 	DBG(LOWPROBE, ul_debug("--> starting probing loop [SUBLKS idx=%d]",
 		chn->idx));
 
+	if (chn->idx < 0)
+		superblocks_prefetch(pr, chn);
+
 	i = chn->idx < 0 ? 0 : chn->idx + 1U;
 
 	for ( ; i < ARRAY_SIZE(idinfos); i++) {
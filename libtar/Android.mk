@@ -5,7 +5,7 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := libtar
 LOCAL_MODULE_TAGS := eng optional
-LOCAL_SRC_FILES := append.c block.c decode.c encode.c extract.c handle.c output.c util.c wrapper.c basename.c strmode.c libtar_hash.c libtar_list.c dirname.c android_utils.c
+LOCAL_SRC_FILES := append.c block.c decode.c encode.c extract.c handle.c output.c util.c wrapper.c basename.c strmode.c libtar_hash.c libtar_list.c dirname.c android_utils.c prefetch.c
 LOCAL_C_INCLUDES += $(LOCAL_PATH) \
                     external/zlib
 LOCAL_SHARED_LIBRARIES += libz libc
@@ -19,6 +19,11 @@ ifeq ($(TW_INCLUDE_CRYPTO_FBE), true)
     LOCAL_C_INCLUDES += $(LOCAL_PATH)/../crypto/ext4crypt
 endif
 
+# io_uring with openat, statx and read needs the 5.6+ uapi headers of S
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -ge 31; echo $$?),0)
+    LOCAL_CFLAGS += -DHAVE_IO_URING
+endif
+
 include $(BUILD_SHARED_LIBRARY)
 
 # Build static library
@@ -26,7 +31,7 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE := libtar_static
 LOCAL_MODULE_TAGS := eng optional
-LOCAL_SRC_FILES := append.c block.c decode.c encode.c extract.c handle.c output.c util.c wrapper.c basename.c strmode.c libtar_hash.c libtar_list.c dirname.c android_utils.c
+LOCAL_SRC_FILES := append.c block.c decode.c encode.c extract.c handle.c output.c util.c wrapper.c basename.c strmode.c libtar_hash.c libtar_list.c dirname.c android_utils.c prefetch.c
 LOCAL_C_INCLUDES += $(LOCAL_PATH) \
                     external/zlib
 LOCAL_STATIC_LIBRARIES += libz libc
@@ -40,4 +45,9 @@ ifeq ($(TW_INCLUDE_CRYPTO_FBE), true)
     LOCAL_C_INCLUDES += $(LOCAL_PATH)/../crypto/ext4crypt
 endif
 
+# io_uring with openat, statx and read needs the 5.6+ uapi headers of S
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -ge 31; echo $$?),0)
+    LOCAL_CFLAGS += -DHAVE_IO_URING
+endif
+
 include $(BUILD_STATIC_LIBRARY)
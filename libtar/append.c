@@ -42,27 +42,160 @@
 #endif
 #include "android_utils.h"
 
-struct tar_dev
+/* slot for dev/ino in the link table, either its entry or a free one */
+static struct tar_link *
+tar_link_slot(struct tar_link *links, size_t size, dev_t dev, ino_t ino)
 {
-	dev_t td_dev;
-	libtar_hash_t *td_h;
-};
-typedef struct tar_dev tar_dev_t;
+	uint64_t h;
+	size_t i;
+
+	h = ((uint64_t)ino ^ ((uint64_t)dev << 32 | (uint64_t)dev >> 32))
+	    * 0x9e3779b97f4a7c15ULL;
+	for (i = (size_t)(h >> 32) & (size - 1); ; i = (i + 1) & (size - 1))
+		if (links[i].name == 0
+		    || (links[i].ino == ino && links[i].dev == dev))
+			return &links[i];
+}
+
+
+/* the name dev/ino was first archived as, NULL if it was not */
+static const char *
+tar_link_find(TAR *t, dev_t dev, ino_t ino)
+{
+	struct tar_link *link;
+
+	if (t->link_count == 0)
+		return NULL;
+	link = tar_link_slot(t->links, t->link_size, dev, ino);
+	return link->name ? t->link_names + link->name - 1 : NULL;
+}
 
-struct tar_ino
+
+/* remember that dev/ino was archived as name, the table stays at most
+   half full */
+static int
+tar_link_add(TAR *t, dev_t dev, ino_t ino, const char *name)
 {
-	ino_t ti_ino;
-	char ti_name[MAXPATHLEN];
-};
-typedef struct tar_ino tar_ino_t;
+	struct tar_link *links, *link;
+	size_t size, i, len;
+	char *names;
+
+	if ((t->link_count + 1) * 2 > t->link_size)
+	{
+		size = t->link_size ? t->link_size * 2 : 256;
+		links = (struct tar_link *)calloc(size, sizeof(*links));
+		if (links == NULL)
+			return -1;
+		for (i = 0; i < t->link_size; i++)
+			if (t->links[i].name != 0)
+				*tar_link_slot(links, size, t->links[i].dev,
+					       t->links[i].ino) = t->links[i];
+		free(t->links);
+		t->links = links;
+		t->link_size = size;
+	}
+
+	len = strlen(name) + 1;
+	if (t->link_names_len + len > t->link_names_size)
+	{
+		size = t->link_names_size ? t->link_names_size * 2 : 16384;
+		while (size < t->link_names_len + len)
+			size *= 2;
+		names = (char *)realloc(t->link_names, size);
+		if (names == NULL)
+			return -1;
+		t->link_names = names;
+		t->link_names_size = size;
+	}
+	memcpy(t->link_names + t->link_names_len, name, len);
+
+	link = tar_link_slot(t->links, t->link_size, dev, ino);
+	link->dev = dev;
+	link->ino = ino;
+	link->name = t->link_names_len + 1;
+	t->link_names_len += len;
+	t->link_count++;
+
+	return 0;
+}
 
 
-/* free memory associated with a tar_dev_t */
 void
-tar_dev_free(tar_dev_t *tdp)
+tar_free_links(TAR *t)
+{
+	free(t->links);
+	free(t->link_names);
+	t->links = NULL;
+	t->link_names = NULL;
+	t->link_count = t->link_size = 0;
+	t->link_names_len = t->link_names_size = 0;
+}
+
+
+static int tar_append_regfile_fd(TAR *t, int filefd);
+static int tar_append_regfile_data(TAR *t, const char *data);
+
+
+/* true if the filesystem on dev is known to have no xattrs */
+static int
+tar_noxattr(TAR *t, dev_t dev)
+{
+	return t->noxattr_valid && t->noxattr_dev == dev;
+}
+
+
+/* remember dev when an xattr lookup shows its filesystem has none; the
+   SELinux context comes from the LSM even there, so it is always read */
+static void
+tar_xattr_failed(TAR *t, dev_t dev)
 {
-	libtar_hash_free(tdp->td_h, free);
-	free(tdp);
+	if (errno == ENOTSUP || errno == EOPNOTSUPP)
+	{
+		t->noxattr_dev = dev;
+		t->noxattr_valid = 1;
+	}
+}
+
+
+/* set the android user.* flags of the header from one listxattr() */
+static void
+tar_get_user_xattrs(TAR *t, const char *realname, dev_t dev)
+{
+	char list[4096];
+	ssize_t len, i;
+
+	len = llistxattr(realname, list, sizeof(list));
+	if (len == -1 && errno == ERANGE)
+	{
+		/* too many to list, ask for each one */
+		t->th_buf.has_user_default = lgetxattr(realname, "user.default", NULL, 0) >= 0;
+		t->th_buf.has_user_cache = lgetxattr(realname, "user.inode_cache", NULL, 0) >= 0;
+		t->th_buf.has_user_code_cache = lgetxattr(realname, "user.inode_code_cache", NULL, 0) >= 0;
+	}
+	else if (len == -1)
+	{
+		tar_xattr_failed(t, dev);
+		return;
+	}
+
+	for (i = 0; i < len; i += strlen(list + i) + 1)
+	{
+		if (strcmp(list + i, "user.default") == 0)
+			t->th_buf.has_user_default = 1;
+		else if (strcmp(list + i, "user.inode_cache") == 0)
+			t->th_buf.has_user_cache = 1;
+		else if (strcmp(list + i, "user.inode_code_cache") == 0)
+			t->th_buf.has_user_code_cache = 1;
+	}
+
+#if 1 //def DEBUG
+	if (t->th_buf.has_user_default)
+		printf("storing xattr user.default\n");
+	if (t->th_buf.has_user_cache)
+		printf("storing xattr user.inode_cache\n");
+	if (t->th_buf.has_user_code_cache)
+		printf("storing xattr user.inode_code_cache\n");
+#endif
 }
 
 
@@ -72,10 +205,12 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 {
 	struct stat s;
 	int i;
-	libtar_hashptr_t hp;
-	tar_dev_t *td = NULL;
-	tar_ino_t *ti = NULL;
+	ssize_t j;
+	const char *link;
 	char path[MAXPATHLEN];
+	int filefd = -1;
+	const char *data = NULL;
+	int rv = -1;
 
 #ifdef DEBUG
 	printf("==> tar_append_file(TAR=0x%lx (\"%s\"), realname=\"%s\", "
@@ -83,7 +218,9 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 	       (savename ? savename : "[NULL]"));
 #endif
 
-	if (lstat(realname, &s) != 0)
+	/* a prefetched file comes with its stat, fd and maybe contents */
+	if (!tar_prefetch_take(t, realname, &s, &filefd, &data)
+	    && lstat(realname, &s) != 0)
 	{
 #ifdef DEBUG
 		perror("lstat()");
@@ -104,21 +241,31 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 #endif
 	th_set_path(t, (savename ? savename : realname));
 
-	/* get selinux context */
-	if (t->options & TAR_STORE_SELINUX)
+	/* the contents are read through the same fd the xattrs come from */
+	if (S_ISREG(s.st_mode) && filefd == -1)
 	{
-		if (t->th_buf.selinux_context != NULL)
+		filefd = open(realname, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+		if (filefd == -1)
 		{
-			free(t->th_buf.selinux_context);
-			t->th_buf.selinux_context = NULL;
+#ifdef DEBUG
+			perror("open()");
+#endif
+			return -1;
 		}
+	}
 
-		security_context_t selinux_context = NULL;
-		if (lgetfilecon(realname, &selinux_context) >= 0)
+	/* get selinux context, straight into the header buffer */
+	if (t->options & TAR_STORE_SELINUX)
+	{
+		j = filefd != -1
+		    ? fgetxattr(filefd, XATTR_NAME_SELINUX, t->context_buf, sizeof(t->context_buf) - 1)
+		    : lgetxattr(realname, XATTR_NAME_SELINUX, t->context_buf, sizeof(t->context_buf) - 1);
+		if (j > 0)
 		{
-			t->th_buf.selinux_context = strdup(selinux_context);
-			printf("  ==> set selinux context: %s\n", selinux_context);
-			freecon(selinux_context);
+			t->context_buf[j] = '\0';
+			t->th_buf.selinux_context = t->context_buf;
+			if (tar_file_msg(t))
+				printf("  ==> set selinux context: %s\n", t->context_buf);
 		}
 		else
 		{
@@ -131,18 +278,14 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 #ifdef HAVE_EXT4_CRYPT
 	if (TH_ISDIR(t) && t->options & TAR_STORE_EXT4_POL)
 	{
-		if (t->th_buf.eep != NULL)
+		t->th_buf.eep = &t->eep_buf;
+		struct tar_policy_dir *parent = tar_policy_parent(t, realname);
+		if (parent != NULL)
 		{
-			free(t->th_buf.eep);
-			t->th_buf.eep = NULL;
-		}
-
-		t->th_buf.eep = (struct ext4_encryption_policy*)malloc(sizeof(struct ext4_encryption_policy));
-		if (!t->th_buf.eep) {
-			printf("malloc ext4_encryption_policy\n");
-			return -1;
+			// the kernel gives every directory in an encrypted one its policy
+			memcpy(t->th_buf.eep, &parent->eep, sizeof(struct ext4_encryption_policy));
 		}
-		if (e4crypt_policy_get_struct(realname, t->th_buf.eep))
+		else if (e4crypt_policy_get_struct(realname, t->th_buf.eep))
 		{
 			char tar_policy[EXT4_KEY_DESCRIPTOR_SIZE];
 			memset(tar_policy, 0, sizeof(tar_policy));
@@ -153,112 +296,67 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 				memcpy(t->th_buf.eep->master_key_descriptor, tar_policy, EXT4_KEY_DESCRIPTOR_SIZE);
 			} else {
 				printf("failed to lookup tar policy for '%s' - '%s'\n", realname, policy_hex);
-				free(t->th_buf.eep);
 				t->th_buf.eep = NULL;
-				return -1;
+				goto fail;
 			}
 		}
 		else
 		{
 			// no policy found, but this is not an error as not all dirs will have a policy
-			free(t->th_buf.eep);
 			t->th_buf.eep = NULL;
 		}
+		if (t->th_buf.eep != NULL && tar_policy_push(t, realname, t->th_buf.eep))
+			goto fail;
 	}
 #endif
 
 	/* get posix file capabilities */
-	if (TH_ISREG(t) && t->options & TAR_STORE_POSIX_CAP)
+	if (TH_ISREG(t) && t->options & TAR_STORE_POSIX_CAP
+	    && !tar_noxattr(t, s.st_dev))
 	{
-		if (t->th_buf.has_cap_data)
-		{
-			memset(&t->th_buf.cap_data, 0, sizeof(struct vfs_cap_data));
-			t->th_buf.has_cap_data = 0;
-		}
-
-		if (getxattr(realname, XATTR_NAME_CAPS, &t->th_buf.cap_data, sizeof(struct vfs_cap_data)) >= 0)
+		if (fgetxattr(filefd, XATTR_NAME_CAPS, &t->th_buf.cap_data, sizeof(struct vfs_cap_data)) >= 0)
 		{
 			t->th_buf.has_cap_data = 1;
 #if 1 //def DEBUG
 			print_caps(&t->th_buf.cap_data);
 #endif
 		}
+		else
+			tar_xattr_failed(t, s.st_dev);
 	}
 
-	/* get android user.default xattr */
-	if (TH_ISDIR(t) && t->options & TAR_STORE_ANDROID_USER_XATTR)
-	{
-		if (getxattr(realname, "user.default", NULL, 0) >= 0)
-		{
-			t->th_buf.has_user_default = 1;
-#if 1 //def DEBUG
-			printf("storing xattr user.default\n");
-#endif
-		}
-		if (getxattr(realname, "user.inode_cache", NULL, 0) >= 0)
-		{
-			t->th_buf.has_user_cache = 1;
-#if 1 //def DEBUG
-			printf("storing xattr user.inode_cache\n");
-#endif
-		}
-		if (getxattr(realname, "user.inode_code_cache", NULL, 0) >= 0)
-		{
-			t->th_buf.has_user_code_cache = 1;
-#if 1 //def DEBUG
-			printf("storing xattr user.inode_code_cache\n");
-#endif
-		}
-	}
+	/* get android user.* xattrs, one listing answers all three */
+	if (TH_ISDIR(t) && t->options & TAR_STORE_ANDROID_USER_XATTR
+	    && !tar_noxattr(t, s.st_dev))
+		tar_get_user_xattrs(t, realname, s.st_dev);
 
-	/* check if it's a hardlink */
-#ifdef DEBUG
-	puts("tar_append_file(): checking inode cache for hardlink...");
-#endif
-	libtar_hashptr_reset(&hp);
-	if (libtar_hash_getkey(t->h, &hp, &(s.st_dev),
-			       (libtar_matchfunc_t)dev_match) != 0)
-		td = (tar_dev_t *)libtar_hashptr_data(&hp);
-	else
+	/* check if it's a hardlink, only files with several links can be */
+	if (!S_ISDIR(s.st_mode) && s.st_nlink > 1)
 	{
 #ifdef DEBUG
-		printf("+++ adding hash for device (0x%lx, 0x%lx)...\n",
-		       major(s.st_dev), minor(s.st_dev));
+		puts("tar_append_file(): checking link table for hardlink...");
 #endif
-		td = (tar_dev_t *)calloc(1, sizeof(tar_dev_t));
-		td->td_dev = s.st_dev;
-		td->td_h = libtar_hash_new(256, (libtar_hashfunc_t)ino_hash);
-		if (td->td_h == NULL)
-			return -1;
-		if (libtar_hash_add(t->h, td) == -1)
-			return -1;
-	}
-	libtar_hashptr_reset(&hp);
-	if (libtar_hash_getkey(td->td_h, &hp, &(s.st_ino),
-			       (libtar_matchfunc_t)ino_match) != 0)
-	{
-		ti = (tar_ino_t *)libtar_hashptr_data(&hp);
+		link = tar_link_find(t, s.st_dev, s.st_ino);
+		if (link != NULL)
+		{
 #ifdef DEBUG
-		printf("    tar_append_file(): encoding hard link \"%s\" "
-		       "to \"%s\"...\n", realname, ti->ti_name);
+			printf("    tar_append_file(): encoding hard link \"%s\" "
+			       "to \"%s\"...\n", realname, link);
 #endif
-		t->th_buf.typeflag = LNKTYPE;
-		th_set_link(t, ti->ti_name);
-	}
-	else
-	{
+			t->th_buf.typeflag = LNKTYPE;
+			th_set_link(t, link);
+		}
+		else
+		{
 #ifdef DEBUG
-		printf("+++ adding entry: device (0x%lx,0x%lx), inode %ld "
-		       "(\"%s\")...\n", major(s.st_dev), minor(s.st_dev),
-		       s.st_ino, realname);
+			printf("+++ adding entry: device (0x%lx,0x%lx), inode %ld "
+			       "(\"%s\")...\n", major(s.st_dev), minor(s.st_dev),
+			       s.st_ino, realname);
 #endif
-		ti = (tar_ino_t *)calloc(1, sizeof(tar_ino_t));
-		if (ti == NULL)
-			return -1;
-		ti->ti_ino = s.st_ino;
-		snprintf(ti->ti_name, sizeof(ti->ti_name), "%s",
-			 savename ? savename : realname);
-		libtar_hash_add(td->td_h, ti);
+			if (tar_link_add(t, s.st_dev, s.st_ino,
+					 savename ? savename : realname) == -1)
+				goto fail;
+		}
 	}
 
 	/* check if it's a symlink */
@@ -266,7 +364,7 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 	{
 		i = readlink(realname, path, sizeof(path));
 		if (i == -1)
-			return -1;
+			goto fail;
 		if (i >= MAXPATHLEN)
 			i = MAXPATHLEN - 1;
 		path[i] = '\0';
@@ -290,17 +388,23 @@ tar_append_file(TAR *t, const char *realname, const char *savename)
 #ifdef DEBUG
 		printf("t->fd = %d\n", t->fd);
 #endif
-		return -1;
+		goto fail;
 	}
 #ifdef DEBUG
 	puts("tar_append_file(): back from th_write()");
 #endif
 
 	/* if it's a regular file, write the contents as well */
-	if (TH_ISREG(t) && tar_append_regfile(t, realname) != 0)
-		return -1;
+	if (TH_ISREG(t) && (data != NULL
+			    ? tar_append_regfile_data(t, data)
+			    : tar_append_regfile_fd(t, filefd)) != 0)
+		goto fail;
 
-	return 0;
+	rv = 0;
+fail:
+	if (filefd != -1)
+		tar_prefetch_close(t, filefd);
+	return rv;
 }
 
 
@@ -327,56 +431,137 @@ tar_append_eof(TAR *t)
 }
 
 
-/* add file contents to a tarchive */
-int
-tar_append_regfile(TAR *t, const char *realname)
+/* read exactly len bytes from a regular file */
+static ssize_t
+read_full(int fd, char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t j;
+
+	while (done < len)
+	{
+		j = read(fd, buf + done, len - done);
+		if (j == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (j == 0)
+			break;
+		done += j;
+	}
+
+	return done;
+}
+
+
+/* add the contents of the open file to a tarchive */
+static int
+tar_append_regfile_fd(TAR *t, int filefd)
 {
 	char block[T_BLOCKSIZE];
-	int filefd;
+	char *bulk = NULL;
 	int64_t i, size;
+	size_t chunk;
 	ssize_t j;
-	int rv = -1;
 
-#if defined(O_BINARY)
-	filefd = open(realname, O_RDONLY|O_BINARY);
-#else
-	filefd = open(realname, O_RDONLY);
-#endif
-	if (filefd == -1)
+	size = th_get_size(t);
+
+	/* move all whole blocks in T_BULKSIZE chunks */
+	i = size - (size % T_BLOCKSIZE);
+	if (i > 0)
 	{
-#ifdef DEBUG
-		perror("open()");
+		bulk = tar_bulk_buffer(t);
+		if (bulk == NULL)
+			return -1;
+#ifdef POSIX_FADV_SEQUENTIAL
+		posix_fadvise(filefd, 0, 0, POSIX_FADV_SEQUENTIAL);
 #endif
-		return -1;
 	}
-
-	size = th_get_size(t);
-	for (i = size; i > T_BLOCKSIZE; i -= T_BLOCKSIZE)
+	while (i > 0)
 	{
-		j = read(filefd, &block, T_BLOCKSIZE);
-		if (j != T_BLOCKSIZE)
+		chunk = (i > T_BULKSIZE) ? T_BULKSIZE : (size_t)i;
+		j = read_full(filefd, bulk, chunk);
+		if (j != (ssize_t)chunk)
 		{
 			if (j != -1)
 				errno = EINVAL;
-			goto fail;
+			return -1;
 		}
-		if (tar_block_write(t, &block) == -1)
-			goto fail;
+		if (t->data_hook != NULL)
+			(*(t->data_hook))(t->data_hook_arg, bulk, chunk);
+		if (tar_block_write_n(t, bulk, chunk) != (ssize_t)chunk)
+			return -1;
+		i -= chunk;
 	}
 
+	/* final partial block is padded with zeros */
+	i = size % T_BLOCKSIZE;
 	if (i > 0)
 	{
-		j = read(filefd, &block, i);
+		j = read_full(filefd, block, i);
 		if (j == -1)
-			goto fail;
+			return -1;
+		if (t->data_hook != NULL)
+			(*(t->data_hook))(t->data_hook_arg, block, j);
 		memset(&(block[i]), 0, T_BLOCKSIZE - i);
 		if (tar_block_write(t, &block) == -1)
-			goto fail;
+			return -1;
 	}
 
-	/* success! */
-	rv = 0;
-fail:
+	return 0;
+}
+
+
+/* add contents already read into memory to a tarchive */
+static int
+tar_append_regfile_data(TAR *t, const char *data)
+{
+	char block[T_BLOCKSIZE];
+	int64_t size, whole;
+
+	size = th_get_size(t);
+	if (t->data_hook != NULL)
+		(*(t->data_hook))(t->data_hook_arg, data, size);
+	whole = size - (size % T_BLOCKSIZE);
+	if (whole > 0 && tar_block_write_n(t, data, whole) != (ssize_t)whole)
+		return -1;
+
+	/* final partial block is padded with zeros */
+	if (size > whole)
+	{
+		memcpy(block, data + whole, size - whole);
+		memset(&(block[size - whole]), 0, T_BLOCKSIZE - (size - whole));
+		if (tar_block_write(t, &block) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/* add file contents to a tarchive */
+int
+tar_append_regfile(TAR *t, const char *realname)
+{
+	int filefd;
+	int rv;
+
+#if defined(O_BINARY)
+	filefd = open(realname, O_RDONLY|O_BINARY);
+#else
+	filefd = open(realname, O_RDONLY);
+#endif
+	if (filefd == -1)
+	{
+#ifdef DEBUG
+		perror("open()");
+#endif
+		return -1;
+	}
+
+	rv = tar_append_regfile_fd(t, filefd);
 	close(filefd);
 
 	return rv;
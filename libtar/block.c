@@ -13,6 +13,10 @@
 #include <internal.h>
 #include <errno.h>
 
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
 #ifdef STDC_HEADERS
 # include <string.h>
 # include <stdlib.h>
@@ -123,6 +127,102 @@ th_read_internal(TAR *t)
 }
 
 
+/* apply one extended header record, key is len bytes long up to the newline
+   and holds "key=value" or just "key" */
+static void
+th_read_ext_record(TAR *t, char *key, size_t len)
+{
+	char *value;
+	size_t vlen;
+
+	// posix capabilities
+	if (len > CAPABILITIES_TAG_LEN
+	    && memcmp(key, CAPABILITIES_TAG, CAPABILITIES_TAG_LEN) == 0)
+	{
+		value = key + CAPABILITIES_TAG_LEN;
+		vlen = len - CAPABILITIES_TAG_LEN;
+		memcpy(&t->th_buf.cap_data, value,
+		       vlen < sizeof(struct vfs_cap_data) ? vlen : sizeof(struct vfs_cap_data));
+		t->th_buf.has_cap_data = 1;
+#ifdef DEBUG
+		printf("    th_read(): Posix capabilities detected\n");
+#endif
+	}
+	// selinux contexts
+	else if (len > SELINUX_TAG_LEN
+		 && memcmp(key, SELINUX_TAG, SELINUX_TAG_LEN) == 0)
+	{
+		/* a record fits in a block, and so in context_buf */
+		vlen = len - SELINUX_TAG_LEN;
+		memcpy(t->context_buf, key + SELINUX_TAG_LEN, vlen);
+		t->context_buf[vlen] = '\0';
+		t->th_buf.selinux_context = t->context_buf;
+#ifdef DEBUG
+		printf("    th_read(): SELinux context xattr detected: %s\n", t->th_buf.selinux_context);
+#endif
+	}
+	// android user xattrs
+	else if (len == ANDROID_USER_DEFAULT_TAG_LEN
+		 && memcmp(key, ANDROID_USER_DEFAULT_TAG, len) == 0)
+	{
+		t->th_buf.has_user_default = 1;
+#ifdef DEBUG
+		printf("    th_read(): android user.default xattr detected\n");
+#endif
+	}
+	else if (len == ANDROID_USER_CACHE_TAG_LEN
+		 && memcmp(key, ANDROID_USER_CACHE_TAG, len) == 0)
+	{
+		t->th_buf.has_user_cache = 1;
+#ifdef DEBUG
+		printf("    th_read(): android user.inode_cache xattr detected\n");
+#endif
+	}
+	else if (len == ANDROID_USER_CODE_CACHE_TAG_LEN
+		 && memcmp(key, ANDROID_USER_CODE_CACHE_TAG, len) == 0)
+	{
+		t->th_buf.has_user_code_cache = 1;
+#ifdef DEBUG
+		printf("    th_read(): android user.inode_code_cache xattr detected\n");
+#endif
+	}
+#ifdef HAVE_EXT4_CRYPT
+	else if (len > E4CRYPT_TAG_LEN
+		 && memcmp(key, E4CRYPT_TAG, E4CRYPT_TAG_LEN) == 0)
+	{
+		value = key + E4CRYPT_TAG_LEN;
+		vlen = len - E4CRYPT_TAG_LEN;
+		t->th_buf.eep = &t->eep_buf;
+		if (*value == '2')
+		{
+			if (vlen != 1 + sizeof(struct ext4_encryption_policy))
+				printf("did not find newline char in expected location, continuing anyway...\n");
+			memset(t->th_buf.eep, 0, sizeof(struct ext4_encryption_policy));
+			memcpy(t->th_buf.eep, value + 1,
+			       vlen - 1 < sizeof(struct ext4_encryption_policy) ? vlen - 1 : sizeof(struct ext4_encryption_policy));
+#ifdef DEBUG
+			printf("    th_read(): E4Crypt policy v2 detected: %i %i %i %i %s\n",
+				(int)t->th_buf.eep->version,
+				(int)t->th_buf.eep->contents_encryption_mode,
+				(int)t->th_buf.eep->filenames_encryption_mode,
+				(int)t->th_buf.eep->flags,
+				t->th_buf.eep->master_key_descriptor);
+#endif
+		}
+		else
+		{
+			e4crypt_policy_fill_default_struct(t->th_buf.eep);
+			strncpy(t->th_buf.eep->master_key_descriptor, value,
+				vlen < EXT4_KEY_DESCRIPTOR_SIZE ? vlen : EXT4_KEY_DESCRIPTOR_SIZE);
+#ifdef DEBUG
+			printf("    th_read(): E4Crypt policy v1 detected: %s\n", t->th_buf.eep->master_key_descriptor);
+#endif
+		}
+	}
+#endif // HAVE_EXT4_CRYPT
+}
+
+
 /* wrapper function for th_read_internal() to handle GNU extensions */
 int
 th_read(TAR *t)
@@ -135,25 +235,7 @@ th_read(TAR *t)
 	printf("==> th_read(t=0x%lx)\n", t);
 #endif
 
-	if (t->th_buf.gnu_longname != NULL)
-		free(t->th_buf.gnu_longname);
-	if (t->th_buf.gnu_longlink != NULL)
-		free(t->th_buf.gnu_longlink);
-	if (t->th_buf.selinux_context != NULL)
-		free(t->th_buf.selinux_context);
-#ifdef HAVE_EXT4_CRYPT
-	if (t->th_buf.eep != NULL)
-		free(t->th_buf.eep);
-#endif
-	if (t->th_buf.has_cap_data)
-	{
-		memset(&t->th_buf.cap_data, 0, sizeof(struct vfs_cap_data));
-		t->th_buf.has_cap_data = 0;
-	}
-	t->th_buf.has_user_default = 0;
-	t->th_buf.has_user_cache = 0;
-	t->th_buf.has_user_code_cache = 0;
-
+	/* the pointers in th_buf only refer to the scratch buffers in t */
 	memset(&(t->th_buf), 0, sizeof(struct tar_header));
 
 	i = th_read_internal(t);
@@ -180,9 +262,11 @@ th_read(TAR *t)
 		printf("    th_read(): GNU long linkname detected "
 		       "(%ld bytes, %d blocks)\n", sz, blocks);
 #endif
-		t->th_buf.gnu_longlink = (char *)malloc(blocks * T_BLOCKSIZE);
+		t->th_buf.gnu_longlink = tar_scratch_buffer(&t->longlink_buf,
+				&t->longlink_size, blocks * T_BLOCKSIZE + 1);
 		if (t->th_buf.gnu_longlink == NULL)
 			return -1;
+		t->th_buf.gnu_longlink[blocks * T_BLOCKSIZE] = '\0';
 
 		for (j = 0, ptr = t->th_buf.gnu_longlink; j < blocks;
 		     j++, ptr += T_BLOCKSIZE)
@@ -230,9 +314,11 @@ th_read(TAR *t)
 		printf("    th_read(): GNU long filename detected "
 		       "(%ld bytes, %d blocks)\n", sz, blocks);
 #endif
-		t->th_buf.gnu_longname = (char *)malloc(blocks * T_BLOCKSIZE);
+		t->th_buf.gnu_longname = tar_scratch_buffer(&t->longname_buf,
+				&t->longname_size, blocks * T_BLOCKSIZE + 1);
 		if (t->th_buf.gnu_longname == NULL)
 			return -1;
+		t->th_buf.gnu_longname[blocks * T_BLOCKSIZE] = '\0';
 
 		for (j = 0, ptr = t->th_buf.gnu_longname; j < blocks;
 		     j++, ptr += T_BLOCKSIZE)
@@ -288,104 +374,27 @@ th_read(TAR *t)
 				return -1;
 			}
 
-			// To be sure
-			buf[T_BLOCKSIZE-1] = 0;
-
-			int len = strlen(buf);
-			// posix capabilities
-			char *start = strstr(buf, CAPABILITIES_TAG);
-			if (start && start+CAPABILITIES_TAG_LEN < buf+len)
+			/* records are "<length> <key>[=<value>]\n", walk them by
+			   length since capabilities and policies are binary */
+			for (ptr = buf; ptr < buf + sz; ptr += j)
 			{
-				start += CAPABILITIES_TAG_LEN;
-				memcpy(&t->th_buf.cap_data, start, sizeof(struct vfs_cap_data));
-				t->th_buf.has_cap_data = 1;
-#ifdef DEBUG
-				printf("    th_read(): Posix capabilities detected\n");
-#endif
-			} // end posix capabilities
-			// selinux contexts
-			start = strstr(buf, SELINUX_TAG);
-			if (start && start+SELINUX_TAG_LEN < buf+len)
-			{
-				start += SELINUX_TAG_LEN;
-				char *end = strchr(start, '\n');
-				if(end)
+				char *key;
+
+				for (j = 0, key = ptr; key < buf + sz
+				     && *key >= '0' && *key <= '9'; key++)
+					j = j * 10 + (*key - '0');
+				if (key == ptr || key >= buf + sz || *key != ' '
+				    || j > (size_t)(buf + sz - ptr)
+				    || ptr + j <= key + 1)
 				{
-					t->th_buf.selinux_context = strndup(start, end-start);
 #ifdef DEBUG
-					printf("    th_read(): SELinux context xattr detected: %s\n", t->th_buf.selinux_context);
+					printf("    th_read(): malformed extended record\n");
 #endif
+					break;
 				}
-			} // end selinux contexts
-			// android user.default xattr
-			start = strstr(buf, ANDROID_USER_DEFAULT_TAG);
-			if (start)
-			{
-				t->th_buf.has_user_default = 1;
-#ifdef DEBUG
-				printf("    th_read(): android user.default xattr detected\n");
-#endif
-			} // end android user.default xattr
-			// android user.inode_cache xattr
-			start = strstr(buf, ANDROID_USER_CACHE_TAG);
-			if (start)
-			{
-				t->th_buf.has_user_cache = 1;
-#ifdef DEBUG
-				printf("    th_read(): android user.inode_cache xattr detected\n");
-#endif
-			} // end android user.inode_cache xattr
-			// android user.inode_code_cache xattr
-			start = strstr(buf, ANDROID_USER_CODE_CACHE_TAG);
-			if (start)
-			{
-				t->th_buf.has_user_code_cache = 1;
-#ifdef DEBUG
-				printf("    th_read(): android user.inode_code_cache xattr detected\n");
-#endif
-			} // end android user.inode_code_cache xattr
-#ifdef HAVE_EXT4_CRYPT
-			start = strstr(buf, E4CRYPT_TAG);
-			if (start && start+E4CRYPT_TAG_LEN < buf+len)
-			{
-				t->th_buf.eep = (struct ext4_encryption_policy*)malloc(sizeof(struct ext4_encryption_policy));
-				if (!t->th_buf.eep) {
-					printf("malloc ext4_encryption_policy\n");
-					return -1;
-				}
-				start += E4CRYPT_TAG_LEN;
-				if (*start == '2')
-				{
-					start++;
-					char *newline_check = start + sizeof(struct ext4_encryption_policy);
-					if (*newline_check != '\n')
-						printf("did not find newline char in expected location, continuing anyway...\n");
-					memcpy(t->th_buf.eep, start, sizeof(struct ext4_encryption_policy));
-#ifdef DEBUG
-					printf("    th_read(): E4Crypt policy v2 detected: %i %i %i %i %s\n",
-						(int)t->th_buf.eep->version,
-						(int)t->th_buf.eep->contents_encryption_mode,
-						(int)t->th_buf.eep->filenames_encryption_mode,
-						(int)t->th_buf.eep->flags,
-						t->th_buf.eep->master_key_descriptor);
-#endif
-				}
-				else
-				{
-					e4crypt_policy_fill_default_struct(t->th_buf.eep);
-					char *end = strchr(start, '\n');
-					if(!end)
-						end = strchr(start, '\0');
-					if(end)
-					{
-						strncpy(t->th_buf.eep->master_key_descriptor, start, end-start);
-#ifdef DEBUG
-						printf("    th_read(): E4Crypt policy v1 detected: %s\n", t->th_buf.eep->master_key_descriptor);
-#endif
-					}
-				}
+				key++;
+				th_read_ext_record(t, key, ptr + j - 1 - key);
 			}
-#endif // HAVE_EXT4_CRYPT
 		}
 
 		i = th_read_internal(t);
@@ -733,3 +742,100 @@ th_write(TAR *t)
 }
 
 
+
+
+/* read a run of whole blocks */
+ssize_t
+tar_block_read_n(TAR *t, void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t i;
+
+	while (done < len)
+	{
+		i = (*(t->type->readfunc))(t->fd, (char *)buf + done,
+					   len - done);
+		if (i == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (i == 0)
+			break;	/* short archive, caller decides */
+		done += i;
+	}
+
+	return done;
+}
+
+
+/* write a run of whole blocks */
+ssize_t
+tar_block_write_n(TAR *t, const void *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t i;
+
+	while (done < len)
+	{
+		i = (*(t->type->writefunc))(t->fd, (const char *)buf + done,
+					    len - done);
+		if (i == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (i == 0)
+		{
+			errno = EIO;
+			return -1;
+		}
+		done += i;
+	}
+
+	return done;
+}
+
+
+/* get the bulk payload buffer, page aligned so O_DIRECT writers can use it */
+char *
+tar_bulk_buffer(TAR *t)
+{
+	void *ptr;
+
+	if (t->bulk_buf == NULL)
+	{
+		if (posix_memalign(&ptr, 4096, T_BULKSIZE) != 0)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+		t->bulk_buf = (char *)ptr;
+	}
+
+	return t->bulk_buf;
+}
+
+
+char *
+tar_scratch_buffer(char **buf, size_t *size, size_t len)
+{
+	char *ptr;
+
+	if (len > *size)
+	{
+		ptr = (char *)malloc(len);
+		if (ptr == NULL)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+		free(*buf);
+		*buf = ptr;
+		*size = len;
+	}
+
+	return *buf;
+}
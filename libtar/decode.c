@@ -27,6 +27,8 @@
 char *
 th_get_pathname(TAR *t)
 {
+	size_t len, n;
+
 	if (t->th_buf.gnu_longname)
 		return t->th_buf.gnu_longname;
 
@@ -39,15 +41,17 @@ th_get_pathname(TAR *t)
 			return NULL;
 	}
 
-	if (t->th_buf.prefix[0] == '\0')
-	{
-		snprintf(t->th_pathname, MAXPATHLEN, "%.100s", t->th_buf.name);
-	}
-	else
+	/* "prefix/name", each field NUL terminated only if it is not full */
+	len = 0;
+	if (t->th_buf.prefix[0] != '\0')
 	{
-		snprintf(t->th_pathname, MAXPATHLEN, "%.155s/%.100s",
-			 t->th_buf.prefix, t->th_buf.name);
+		len = strnlen(t->th_buf.prefix, sizeof(t->th_buf.prefix));
+		memcpy(t->th_pathname, t->th_buf.prefix, len);
+		t->th_pathname[len++] = '/';
 	}
+	n = strnlen(t->th_buf.name, sizeof(t->th_buf.name));
+	memcpy(t->th_pathname + len, t->th_buf.name, n);
+	t->th_pathname[len + n] = '\0';
 
 	/* will be deallocated in tar_close() */
 	return t->th_pathname;
@@ -57,7 +61,6 @@ th_get_pathname(TAR *t)
 uid_t
 th_get_uid(TAR *t)
 {
-	int uid;
 	struct passwd *pw;
 
 	if (!(t->options & TAR_USE_NUMERIC_ID)) {
@@ -67,15 +70,13 @@ th_get_uid(TAR *t)
 	}
 
 	/* if the password entry doesn't exist */
-	sscanf(t->th_buf.uid, "%o", &uid);
-	return uid;
+	return (uid_t)oct_to_int(t->th_buf.uid, sizeof(t->th_buf.uid));
 }
 
 
 gid_t
 th_get_gid(TAR *t)
 {
-	int gid;
 	struct group *gr;
 
 	if (!(t->options & TAR_USE_NUMERIC_ID)) {
@@ -85,8 +86,7 @@ th_get_gid(TAR *t)
 	}
 
 	/* if the group entry doesn't exist */
-	sscanf(t->th_buf.gid, "%o", &gid);
-	return gid;
+	return (gid_t)oct_to_int(t->th_buf.gid, sizeof(t->th_buf.gid));
 }
 
 
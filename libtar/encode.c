@@ -79,8 +79,6 @@ th_set_path(TAR *t, const char *pathname)
 	printf("in th_set_path(th, pathname=\"%s\")\n", pathname);
 #endif
 
-	if (t->th_buf.gnu_longname != NULL)
-		free(t->th_buf.gnu_longname);
 	t->th_buf.gnu_longname = NULL;
 
 	/* old archive compatibility (not needed for gnu): add trailing / to directories */
@@ -90,7 +88,14 @@ th_set_path(TAR *t, const char *pathname)
 	if (pathname_len >= T_NAMELEN && (t->options & TAR_GNU))
 	{
 		/* GNU-style long name (no file name length limit) */
-		t->th_buf.gnu_longname = strdup(pathname);
+		t->th_buf.gnu_longname = tar_scratch_buffer(&t->longname_buf,
+				&t->longname_size, pathname_len + 1);
+		if (t->th_buf.gnu_longname == NULL)
+		{
+			printf("!!! no memory for long name \"%s\"\n", pathname);
+			return;
+		}
+		memcpy(t->th_buf.gnu_longname, pathname, pathname_len + 1);
 		strncpy(t->th_buf.name, t->th_buf.gnu_longname, T_NAMELEN);
 	}
 	else if (pathname_len >= T_NAMELEN)
@@ -141,25 +146,30 @@ th_set_link(TAR *t, const char *linkname)
 	printf("==> th_set_link(th, linkname=\"%s\")\n", linkname);
 #endif
 
-	if (strlen(linkname) >= T_NAMELEN && (t->options & TAR_GNU))
+	size_t linkname_len = strlen(linkname);
+
+	t->th_buf.gnu_longlink = NULL;
+
+	if (linkname_len >= T_NAMELEN && (t->options & TAR_GNU))
 	{
 		/* --format=gnu: GNU-style long name (no file name length limit) */
-		t->th_buf.gnu_longlink = strdup(linkname);
+		t->th_buf.gnu_longlink = tar_scratch_buffer(&t->longlink_buf,
+				&t->longlink_size, linkname_len + 1);
+		if (t->th_buf.gnu_longlink == NULL)
+		{
+			printf("!!! no memory for long link \"%s\"\n", linkname);
+			return;
+		}
+		memcpy(t->th_buf.gnu_longlink, linkname, linkname_len + 1);
 		strcpy(t->th_buf.linkname, "././@LongLink");
 	}
-	else if (strlen(linkname) >= T_NAMELEN)
+	else if (linkname_len >= T_NAMELEN)
 	{
 		/* --format=ustar: 100 chars max limit for symbolic links */
 		strncpy(t->th_buf.linkname, linkname, T_NAMELEN);
-		if (t->th_buf.gnu_longlink != NULL)
-			free(t->th_buf.gnu_longlink);
-		t->th_buf.gnu_longlink = NULL;
 	} else {
 		/* all short links or v7 tar format: The maximum length of a symbolic link name is limited to 99 characters */
-		snprintf(t->th_buf.linkname, T_NAMELEN, "%s", linkname);
-		if (t->th_buf.gnu_longlink != NULL)
-			free(t->th_buf.gnu_longlink);
-		t->th_buf.gnu_longlink = NULL;
+		memcpy(t->th_buf.linkname, linkname, linkname_len + 1);
 	}
 }
 
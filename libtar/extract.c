@@ -24,6 +24,7 @@
 #include <sys/capability.h>
 #include <sys/xattr.h>
 #include <linux/xattr.h>
+#include <linux/falloc.h>
 
 #ifdef STDC_HEADERS
 # include <stdlib.h>
@@ -40,8 +41,6 @@
 #endif
 #include "android_utils.h"
 
-const unsigned long long progress_size = (unsigned long long)(T_BLOCKSIZE);
-
 static int
 tar_set_file_perms(TAR *t, const char *realname)
 {
@@ -106,17 +105,549 @@ tar_set_file_perms(TAR *t, const char *realname)
 }
 
 
+/* same as tar_set_file_perms() plus the SELinux context and capabilities
+   of tar_extract_file(), through the open fd of a regular file */
+static int
+tar_set_fd_perms(TAR *t, int fd, const char *filename)
+{
+	struct timespec times[2];
+
+	if (geteuid() == 0 && fchown(fd, th_get_uid(t), th_get_gid(t)) == -1)
+	{
+#ifdef DEBUG
+		perror("fchown()");
+#endif
+		return -1;
+	}
+
+	times[0].tv_sec = times[1].tv_sec = th_get_mtime(t);
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	if (futimens(fd, times) == -1)
+	{
+#ifdef DEBUG
+		perror("futimens()");
+#endif
+		return -1;
+	}
+
+	if (fchmod(fd, th_get_mode(t)) == -1)
+	{
+#ifdef DEBUG
+		perror("fchmod()");
+#endif
+		return -1;
+	}
+
+	if((t->options & TAR_STORE_SELINUX) && t->th_buf.selinux_context != NULL)
+	{
+		if (fsetfilecon(fd, t->th_buf.selinux_context) < 0)
+			fprintf(stderr, "tar_extract_file(): failed to restore SELinux context %s to file %s !!!\n", t->th_buf.selinux_context, filename);
+	}
+
+	if((t->options & TAR_STORE_POSIX_CAP) && t->th_buf.has_cap_data)
+	{
+		printf("tar_extract_file(): restoring posix capabilities to file %s\n", filename);
+		print_caps(&t->th_buf.cap_data);
+		if (fsetxattr(fd, XATTR_NAME_CAPS, &t->th_buf.cap_data, sizeof(struct vfs_cap_data), 0) < 0)
+			fprintf(stderr, "tar_extract_file(): failed to restore posix capabilities to file %s !!!\n", filename);
+	}
+
+	return 0;
+}
+
+
+/* same as tar_set_file_perms(), relative to the directory the entry was
+   created in, for the entries that have no fd of their own */
+static int
+tar_set_at_perms(TAR *t, const char *realname)
+{
+	struct timespec times[2];
+	const char *base;
+	int dir_fd;
+
+	dir_fd = tar_parent_dir(t, realname, &base);
+	if (dir_fd == -1)
+		return -1;
+
+	if (geteuid() == 0 && fchownat(dir_fd, base, th_get_uid(t), th_get_gid(t), AT_SYMLINK_NOFOLLOW) == -1)
+	{
+#ifdef DEBUG
+		perror("fchownat()");
+#endif
+		return -1;
+	}
+
+	if (TH_ISSYM(t))
+		return 0;
+
+	times[0].tv_sec = times[1].tv_sec = th_get_mtime(t);
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	if (utimensat(dir_fd, base, times, 0) == -1)
+	{
+#ifdef DEBUG
+		perror("utimensat()");
+#endif
+		return -1;
+	}
+
+	if (fchmodat(dir_fd, base, th_get_mode(t), 0) == -1)
+	{
+#ifdef DEBUG
+		perror("fchmodat()");
+#endif
+		return -1;
+	}
+
+	return 0;
+}
+
+
+void
+tar_free_parent(TAR *t)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->parent_count; i++)
+	{
+		close(t->parents[i].fd);
+		free(t->parents[i].name);
+	}
+	t->parent_count = 0;
+
+	free(t->known);
+	free(t->known_names);
+	t->known = NULL;
+	t->known_names = NULL;
+	t->known_count = t->known_size = 0;
+	t->known_names_len = t->known_names_size = 0;
+}
+
+
+/* the open directory named by the first len bytes of path, or NULL */
+static struct tar_parent *
+tar_find_parent(TAR *t, const char *path, size_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->parent_count; i++)
+		if (t->parents[i].len == len
+		    && memcmp(t->parents[i].name, path, len) == 0)
+		{
+			t->parents[i].used = ++t->parent_tick;
+			return &t->parents[i];
+		}
+
+	return NULL;
+}
+
+
+/* keep fd open as the directory name, which is then owned by t; the
+   directory used longest ago is closed to make room */
+static void
+tar_keep_parent(TAR *t, char *name, int fd)
+{
+	struct tar_parent *parent;
+	size_t len = strlen(name);
+	unsigned int i;
+
+	parent = tar_find_parent(t, name, len);
+	if (parent == NULL && t->parent_count < TAR_PARENT_CACHE)
+		parent = &t->parents[t->parent_count++];
+	else
+	{
+		if (parent == NULL)
+		{
+			parent = &t->parents[0];
+			for (i = 1; i < t->parent_count; i++)
+				if (t->parents[i].used < parent->used)
+					parent = &t->parents[i];
+		}
+		if (parent->fd != fd)
+			close(parent->fd);
+		free(parent->name);
+	}
+	parent->name = name;
+	parent->len = len;
+	parent->fd = fd;
+	parent->used = ++t->parent_tick;
+}
+
+
+static size_t
+tar_known_hash(const char *path, size_t len)
+{
+	size_t h = 2166136261u;
+
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*path++) * 16777619u;
+	return h;
+}
+
+
+/* slot for the len bytes of path in the known directory set, either its
+   entry or a free one */
+static struct tar_known_dir *
+tar_known_slot(TAR *t, struct tar_known_dir *known, size_t size, size_t hash,
+	       const char *path, size_t len)
+{
+	const char *name;
+	size_t i;
+
+	for (i = hash & (size - 1); ; i = (i + 1) & (size - 1))
+	{
+		if (known[i].name == 0)
+			return &known[i];
+		name = t->known_names + known[i].name - 1;
+		if (known[i].hash == hash && strncmp(name, path, len) == 0
+		    && name[len] == '\0')
+			return &known[i];
+	}
+}
+
+
+/* true if the directory named by the first len bytes of path was created
+   or opened during this extraction */
+static int
+tar_is_known_dir(TAR *t, const char *path, size_t len)
+{
+	if (t->known_count == 0)
+		return 0;
+	return tar_known_slot(t, t->known, t->known_size,
+			      tar_known_hash(path, len), path, len)->name != 0;
+}
+
+
+/* remember that the directory named by the first len bytes of path
+   exists, the set stays at most half full */
+static void
+tar_add_known_dir(TAR *t, const char *path, size_t len)
+{
+	struct tar_known_dir *known, *slot;
+	size_t size, i, hash;
+	char *names;
+
+	if ((t->known_count + 1) * 2 > t->known_size)
+	{
+		size = t->known_size ? t->known_size * 2 : 256;
+		known = (struct tar_known_dir *)calloc(size, sizeof(*known));
+		if (known == NULL)
+			return;
+		for (i = 0; i < t->known_size; i++)
+		{
+			if (t->known[i].name == 0)
+				continue;
+			for (hash = t->known[i].hash & (size - 1);
+			     known[hash].name != 0; hash = (hash + 1) & (size - 1))
+				;
+			known[hash] = t->known[i];
+		}
+		free(t->known);
+		t->known = known;
+		t->known_size = size;
+	}
+
+	hash = tar_known_hash(path, len);
+	slot = tar_known_slot(t, t->known, t->known_size, hash, path, len);
+	if (slot->name != 0)
+		return;
+
+	if (t->known_names_len + len + 1 > t->known_names_size)
+	{
+		size = t->known_names_size ? t->known_names_size * 2 : 16384;
+		while (size < t->known_names_len + len + 1)
+			size *= 2;
+		names = (char *)realloc(t->known_names, size);
+		if (names == NULL)
+			return;
+		t->known_names = names;
+		t->known_names_size = size;
+	}
+	memcpy(t->known_names + t->known_names_len, path, len);
+	t->known_names[t->known_names_len + len] = '\0';
+
+	slot->hash = hash;
+	slot->name = t->known_names_len + 1;
+	t->known_names_len += len + 1;
+	t->known_count++;
+}
+
+
+/* open the directory name of len bytes, creating what is missing of it
+   below its nearest open or known ancestor, like mkdirhier() does from the
+   root */
+static int
+tar_open_dir(TAR *t, const char *name, size_t len)
+{
+	struct tar_parent *parent;
+	const char *rest, *end;
+	char comp[MAXPATHLEN];
+	size_t plen, alen, clen;
+	int dir_fd, fd, own = 0;
+
+	/* it exists, one walk of its path will do */
+	if (tar_is_known_dir(t, name, len))
+	{
+		fd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd != -1 || errno != ENOENT)
+			return fd;
+	}
+
+	/* otherwise start from the nearest ancestor that is open or known */
+	dir_fd = AT_FDCWD;
+	rest = name;
+	for (plen = len; plen > 0; plen--)
+	{
+		if (name[plen - 1] != '/')
+			continue;
+		alen = (plen == 1 ? 1 : plen - 1);
+		parent = tar_find_parent(t, name, alen);
+		if (parent != NULL)
+			dir_fd = parent->fd;
+		else if (alen < sizeof(comp) && tar_is_known_dir(t, name, alen))
+		{
+			memcpy(comp, name, alen);
+			comp[alen] = '\0';
+			dir_fd = open(comp, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (dir_fd == -1)
+			{
+				dir_fd = AT_FDCWD;
+				continue;
+			}
+			own = 1;
+		}
+		else
+			continue;
+		for (rest = name + plen; *rest == '/'; rest++)
+			;
+		break;
+	}
+
+	fd = openat(dir_fd, *rest ? rest : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd != -1 || errno != ENOENT)
+		goto done;
+
+	/* create the missing components one at a time, each relative to the
+	   one before it */
+	if (dir_fd == AT_FDCWD && rest[0] == '/')
+	{
+		dir_fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir_fd == -1)
+			return -1;
+		own = 1;
+	}
+	for (end = rest; ; )
+	{
+		while (*end == '/')
+			end++;
+		if (*end == '\0')
+			break;
+		clen = strcspn(end, "/");
+		if (clen >= sizeof(comp))
+		{
+			errno = ENAMETOOLONG;
+			fd = -1;
+			break;
+		}
+		memcpy(comp, end, clen);
+		comp[clen] = '\0';
+		end += clen;
+
+		if (mkdirat(dir_fd, comp, 0777) == -1 && errno != EEXIST)
+		{
+			fd = -1;
+			break;
+		}
+		fd = openat(dir_fd, comp, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd == -1)
+			break;
+		if (own)
+			close(dir_fd);
+		dir_fd = fd;
+		own = 1;
+		tar_add_known_dir(t, name, end - name);
+	}
+	if (fd == dir_fd)
+		own = 0;
+
+done:
+	if (own)
+		close(dir_fd);
+	if (fd != -1)
+		tar_add_known_dir(t, name, len);
+	return fd;
+}
+
+
+int
+tar_parent_dir(TAR *t, const char *filename, const char **base)
+{
+	struct tar_parent *parent;
+	const char *slash;
+	size_t len;
+	char *name;
+	int fd;
+
+	slash = strrchr(filename, '/');
+	if (slash == NULL)
+	{
+		*base = filename;
+		return AT_FDCWD;
+	}
+	*base = slash + 1;
+	len = (slash == filename ? 1 : (size_t)(slash - filename));
+
+	parent = tar_find_parent(t, filename, len);
+	if (parent != NULL)
+		return parent->fd;
+
+	name = strndup(filename, len);
+	if (name == NULL)
+		return -1;
+	fd = tar_open_dir(t, name, len);
+	if (fd == -1)
+	{
+		free(name);
+		return -1;
+	}
+	tar_keep_parent(t, name, fd);
+	return fd;
+}
+
+
+/* fd of the directory realname if tar_extract_dir() just created it, or -1 */
+static int
+tar_dir_fd(TAR *t, const char *realname)
+{
+	struct tar_parent *parent;
+
+	parent = tar_find_parent(t, realname, strlen(realname));
+	return parent != NULL ? parent->fd : -1;
+}
+
+
+/* set the owner of a directory now, its mode and times in tar_extract_finish()
+   so the files extracted into it don't change them again */
+static int
+tar_defer_dir_perms(TAR *t, const char *realname)
+{
+	struct tar_deferred_dir *dirs;
+	size_t size;
+	int fd = tar_dir_fd(t, realname);
+
+	if (geteuid() == 0 && (fd != -1 ? fchown(fd, th_get_uid(t), th_get_gid(t))
+				        : lchown(realname, th_get_uid(t), th_get_gid(t))) == -1)
+	{
+#ifdef DEBUG
+		perror("lchown()");
+#endif
+		return -1;
+	}
+
+	if (t->deferred_count == t->deferred_size)
+	{
+		size = t->deferred_size ? t->deferred_size * 2 : 64;
+		dirs = (struct tar_deferred_dir *)realloc(t->deferred_dirs, size * sizeof(*dirs));
+		if (dirs == NULL)
+			return -1;
+		t->deferred_dirs = dirs;
+		t->deferred_size = size;
+	}
+	dirs = &t->deferred_dirs[t->deferred_count];
+	dirs->name = strdup(realname);
+	if (dirs->name == NULL)
+		return -1;
+	dirs->mode = th_get_mode(t);
+	dirs->mtime = th_get_mtime(t);
+	t->deferred_count++;
+
+	return 0;
+}
+
+
+void
+tar_free_deferred(TAR *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->deferred_count; i++)
+		free(t->deferred_dirs[i].name);
+	free(t->deferred_dirs);
+	t->deferred_dirs = NULL;
+	t->deferred_count = 0;
+	t->deferred_size = 0;
+}
+
+
+int
+tar_extract_finish(TAR *t)
+{
+	struct tar_deferred_dir *dir;
+	struct utimbuf ut;
+	size_t i;
+	int ret = 0;
+
+	/* deepest first, a parent made read-only must not block its children */
+	for (i = t->deferred_count; i > 0; i--)
+	{
+		dir = &t->deferred_dirs[i - 1];
+		ut.modtime = ut.actime = dir->mtime;
+		if (utime(dir->name, &ut) == -1 || chmod(dir->name, dir->mode) == -1)
+		{
+			fprintf(stderr, "tar_extract_finish(): failed to set permissions on %s !!!\n", dir->name);
+			ret = -1;
+		}
+	}
+	tar_free_deferred(t);
+	tar_free_parent(t);
+
+	return ret;
+}
+
+
+void
+tar_preallocate(int fd, const char *filename, int64_t size)
+{
+	if (size < T_PREALLOC_MIN || (int64_t)(off_t)size != size)
+		return;
+
+	/* the size is still set by the writes, a short archive leaves no hole */
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == -1
+	    && errno != EOPNOTSUPP && errno != ENOSYS)
+		fprintf(stderr, "tar_preallocate(): unable to preallocate %s: %s\n",
+			filename, strerror(errno));
+}
+
+
+/* report progress */
+void
+tar_extract_progress(TAR *t, unsigned long long *progress, unsigned long long size)
+{
+	/* a relaxed add is enough, the reader only wants a recent total */
+	if (progress != NULL)
+		__atomic_fetch_add(progress, size, __ATOMIC_RELAXED);
+}
+
+
 /* switchboard */
 int
-tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *progress_fd)
+tar_extract_file(TAR *t, const char *realname, const char *prefix, unsigned long long *progress)
 {
 	int i;
-#ifdef LIBTAR_FILE_HASH
-	char *lnp;
-	char *pn;
-	int pathname_len;
-	int realname_len;
-#endif
+	int fd_perms = 0;
+	int dir_fd;
+	char trimmed[MAXPATHLEN];
+	size_t len;
+
+	/* directories may end in a slash, which has no name inside the parent */
+	len = strlen(realname);
+	if (len > 1 && realname[len - 1] == '/' && len < sizeof(trimmed))
+	{
+		while (len > 1 && realname[len - 1] == '/')
+			len--;
+		memcpy(trimmed, realname, len);
+		trimmed[len] = '\0';
+		realname = trimmed;
+	}
 
 	if (t->options & TAR_NOOVERWRITE)
 	{
@@ -146,14 +677,26 @@ tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *pr
 	else if (TH_ISFIFO(t))
 		i = tar_extract_fifo(t, realname);
 	else /* if (TH_ISREG(t)) */
-		i = tar_extract_regfile(t, realname, progress_fd);
+	{
+		i = tar_extract_regfile(t, realname, progress);
+		fd_perms = (t->options & TAR_DEFER_METADATA);
+	}
 
 	if (i != 0) {
 		fprintf(stderr, "tar_extract_file(): failed to extract %s !!!\n", realname);
 		return i;
 	}
 
-	i = tar_set_file_perms(t, realname);
+	/* tar_extract_regfile() already set everything through the fd */
+	if (fd_perms)
+		return 0;
+
+	if ((t->options & TAR_DEFER_METADATA) && TH_ISDIR(t))
+		i = tar_defer_dir_perms(t, realname);
+	else if (t->options & TAR_DEFER_METADATA)
+		i = tar_set_at_perms(t, realname);
+	else
+		i = tar_set_file_perms(t, realname);
 	if (i != 0) {
 		fprintf(stderr, "tar_extract_file(): failed to set permissions on %s !!!\n", realname);
 		return i;
@@ -164,7 +707,9 @@ tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *pr
 #ifdef DEBUG
 		printf("tar_extract_file(): restoring SELinux context %s to file %s\n", t->th_buf.selinux_context, realname);
 #endif
-		if (lsetfilecon(realname, t->th_buf.selinux_context) < 0)
+		dir_fd = TH_ISDIR(t) ? tar_dir_fd(t, realname) : -1;
+		if ((dir_fd != -1 ? fsetfilecon(dir_fd, t->th_buf.selinux_context)
+				  : lsetfilecon(realname, t->th_buf.selinux_context)) < 0)
 			fprintf(stderr, "tar_extract_file(): failed to restore SELinux context %s to file %s !!!\n", t->th_buf.selinux_context, realname);
 	}
 
@@ -174,41 +719,26 @@ tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *pr
 		printf("tar_extract_file(): restoring posix capabilities to file %s\n", realname);
 		print_caps(&t->th_buf.cap_data);
 #endif
-		if (setxattr(realname, XATTR_NAME_CAPS, &t->th_buf.cap_data, sizeof(struct vfs_cap_data), 0) < 0)
+		dir_fd = TH_ISDIR(t) ? tar_dir_fd(t, realname) : -1;
+		if ((dir_fd != -1 ? fsetxattr(dir_fd, XATTR_NAME_CAPS, &t->th_buf.cap_data, sizeof(struct vfs_cap_data), 0)
+				  : setxattr(realname, XATTR_NAME_CAPS, &t->th_buf.cap_data, sizeof(struct vfs_cap_data), 0)) < 0)
 			fprintf(stderr, "tar_extract_file(): failed to restore posix capabilities to file %s !!!\n", realname);
 	}
 
-#ifdef LIBTAR_FILE_HASH
-	pn = th_get_pathname(t);
-	pathname_len = strlen(pn) + 1;
-	realname_len = strlen(realname) + 1;
-	lnp = (char *)calloc(1, pathname_len + realname_len);
-	if (lnp == NULL)
-		return -1;
-	strcpy(&lnp[0], pn);
-	strcpy(&lnp[pathname_len], realname);
-#ifdef DEBUG
-	printf("tar_extract_file(): calling libtar_hash_add(): key=\"%s\", "
-	       "value=\"%s\"\n", pn, realname);
-#endif
-	if (libtar_hash_add(t->h, lnp) != 0)
-		return -1;
-	free(lnp);
-#endif
-
 	return 0;
 }
 
 
 /* extract regular file */
 int
-tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
+tar_extract_regfile(TAR *t, const char *realname, unsigned long long *progress)
 {
 	int64_t size, i;
 	ssize_t k;
-	int fdout;
-	char buf[T_BLOCKSIZE];
-	const char *filename;
+	size_t chunk, blocks;
+	int fdout, dir_fd;
+	char *bulk = NULL;
+	const char *filename, *base;
 	char *pn;
 
 #ifdef DEBUG
@@ -225,13 +755,15 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 	filename = (realname ? realname : pn);
 	size = th_get_size(t);
 
-	if (mkdirhier(dirname(filename)) == -1)
+	dir_fd = tar_parent_dir(t, filename, &base);
+	if (dir_fd == -1)
 		return -1;
 
-	printf("  ==> extracting: %s (file size %" PRId64 " bytes)\n",
-			filename, size);
+	if (tar_file_msg(t))
+		printf("  ==> extracting: %s (file size %" PRId64 " bytes)\n",
+				filename, size);
 
-	fdout = open(filename, O_WRONLY | O_CREAT | O_TRUNC
+	fdout = openat(dir_fd, base, O_WRONLY | O_CREAT | O_TRUNC
 #ifdef O_BINARY
 		     | O_BINARY
 #endif
@@ -244,11 +776,25 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 		return -1;
 	}
 
-	/* extract the file */
-	for (i = size; i > 0; i -= T_BLOCKSIZE)
+	tar_preallocate(fdout, filename, size);
+
+	/* extract the file, T_BULKSIZE at a time */
+	if (size > 0)
 	{
-		k = tar_block_read(t, buf);
-		if (k != T_BLOCKSIZE)
+		bulk = tar_bulk_buffer(t);
+		if (bulk == NULL)
+		{
+			close(fdout);
+			return -1;
+		}
+	}
+	for (i = size; i > 0; i -= chunk)
+	{
+		/* whole blocks are read, only the file's bytes are written */
+		chunk = (i > T_BULKSIZE) ? T_BULKSIZE : (size_t)i;
+		blocks = (chunk + T_BLOCKSIZE - 1) & ~((size_t)T_BLOCKSIZE - 1);
+		k = tar_block_read_n(t, bulk, blocks);
+		if (k != (ssize_t)blocks)
 		{
 			if (k != -1)
 				errno = EINVAL;
@@ -256,20 +802,25 @@ tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd)
 			return -1;
 		}
 
-		/* write block to output file */
-		if (write(fdout, buf,
-			  ((i > T_BLOCKSIZE) ? T_BLOCKSIZE : i)) == -1)
+		/* write chunk to output file */
+		if (write(fdout, bulk, chunk) != (ssize_t)chunk)
 		{
 			close(fdout);
 			return -1;
 		}
 		else
 		{
-			if (*progress_fd != 0)
-				write(*progress_fd, &progress_size, sizeof(progress_size));
+			tar_extract_progress(t, progress, blocks);
 		}
 	}
 
+	if ((t->options & TAR_DEFER_METADATA) && tar_set_fd_perms(t, fdout, filename) != 0)
+	{
+		fprintf(stderr, "tar_extract_file(): failed to set permissions on %s !!!\n", filename);
+		close(fdout);
+		return -1;
+	}
+
 	/* close output file */
 	if (close(fdout) == -1)
 		return -1;
@@ -288,7 +839,8 @@ tar_skip_regfile(TAR *t)
 {
 	int64_t size, i;
 	ssize_t k;
-	char buf[T_BLOCKSIZE];
+	size_t blocks;
+	char *bulk;
 
 	if (!TH_ISREG(t))
 	{
@@ -297,10 +849,19 @@ tar_skip_regfile(TAR *t)
 	}
 
 	size = th_get_size(t);
-	for (i = size; i > 0; i -= T_BLOCKSIZE)
+	if (size <= 0)
+		return 0;
+
+	bulk = tar_bulk_buffer(t);
+	if (bulk == NULL)
+		return -1;
+
+	/* archives may come from a pipe, so read past the data rather than seek */
+	for (i = (size + T_BLOCKSIZE - 1) & ~((int64_t)T_BLOCKSIZE - 1); i > 0; i -= blocks)
 	{
-		k = tar_block_read(t, buf);
-		if (k != T_BLOCKSIZE)
+		blocks = (i > T_BULKSIZE) ? T_BULKSIZE : (size_t)i;
+		k = tar_block_read_n(t, bulk, blocks);
+		if (k != (ssize_t)blocks)
 		{
 			if (k != -1)
 				errno = EINVAL;
@@ -318,10 +879,9 @@ tar_extract_hardlink(TAR * t, const char *realname, const char *prefix)
 {
 	const char *filename;
 	char *pn;
-	char *linktgt = NULL;
-	char *newtgt = NULL;
-	char *lnp;
-	libtar_hashptr_t hp;
+	char linktgt[MAXPATHLEN];
+	const char *base;
+	int dir_fd;
 
 	if (!TH_ISLNK(t))
 	{
@@ -331,26 +891,22 @@ tar_extract_hardlink(TAR * t, const char *realname, const char *prefix)
 
 	pn = th_get_pathname(t);
 	filename = (realname ? realname : pn);
-	if (mkdirhier(dirname(filename)) == -1)
+	dir_fd = tar_parent_dir(t, filename, &base);
+	if (dir_fd == -1)
 		return -1;
-	if (unlink(filename) == -1 && errno != ENOENT)
+	if (unlinkat(dir_fd, base, 0) == -1 && errno != ENOENT)
 		return -1;
-	libtar_hashptr_reset(&hp);
-	if (libtar_hash_getkey(t->h, &hp, th_get_linkname(t),
-			       (libtar_matchfunc_t)libtar_str_match) != 0)
+	if (snprintf(linktgt, sizeof(linktgt), "%s/%s", prefix,
+		     th_get_linkname(t)) >= (int)sizeof(linktgt))
 	{
-		lnp = (char *)libtar_hashptr_data(&hp);
-		linktgt = &lnp[strlen(lnp) + 1];
+		fprintf(stderr, "tar_extract_hardlink(): failed restore of hardlink '%s' but returning as if nothing bad happened\n", filename);
+		return 0;
 	}
-	else
-		linktgt = th_get_linkname(t);
 
-	newtgt = strdup(linktgt);
-	sprintf(linktgt, "%s/%s", prefix, newtgt);
+	if (tar_file_msg(t))
+		printf("  ==> extracting: %s (link to %s)\n", filename, linktgt);
 
-	printf("  ==> extracting: %s (link to %s)\n", filename, linktgt);
-
-	if (link(linktgt, filename) == -1)
+	if (linkat(AT_FDCWD, linktgt, dir_fd, base, 0) == -1)
 	{
 		fprintf(stderr, "tar_extract_hardlink(): failed restore of hardlink '%s' but returning as if nothing bad happened\n", filename);
 		return 0; // Used to be -1
@@ -364,8 +920,9 @@ tar_extract_hardlink(TAR * t, const char *realname, const char *prefix)
 int
 tar_extract_symlink(TAR *t, const char *realname)
 {
-	const char *filename;
+	const char *filename, *base;
 	char *pn;
+	int dir_fd;
 
 	if (!TH_ISSYM(t))
 	{
@@ -375,16 +932,18 @@ tar_extract_symlink(TAR *t, const char *realname)
 
 	pn = th_get_pathname(t);
 	filename = (realname ? realname : pn);
-	if (mkdirhier(dirname(filename)) == -1)
+	dir_fd = tar_parent_dir(t, filename, &base);
+	if (dir_fd == -1)
 		return -1;
 
-	if (unlink(filename) == -1 && errno != ENOENT)
+	if (unlinkat(dir_fd, base, 0) == -1 && errno != ENOENT)
 		return -1;
 
-	printf("  ==> extracting: %s (symlink to %s)\n",
-	       filename, th_get_linkname(t));
+	if (tar_file_msg(t))
+		printf("  ==> extracting: %s (symlink to %s)\n",
+		       filename, th_get_linkname(t));
 
-	if (symlink(th_get_linkname(t), filename) == -1)
+	if (symlinkat(th_get_linkname(t), dir_fd, base) == -1)
 	{
 #ifdef DEBUG
 		perror("symlink()");
@@ -402,8 +961,9 @@ tar_extract_chardev(TAR *t, const char *realname)
 {
 	mode_t mode;
 	unsigned long devmaj, devmin;
-	const char *filename;
+	const char *filename, *base;
 	char *pn;
+	int dir_fd;
 
 	if (!TH_ISCHR(t))
 	{
@@ -417,13 +977,15 @@ tar_extract_chardev(TAR *t, const char *realname)
 	devmaj = th_get_devmajor(t);
 	devmin = th_get_devminor(t);
 
-	if (mkdirhier(dirname(filename)) == -1)
+	dir_fd = tar_parent_dir(t, filename, &base);
+	if (dir_fd == -1)
 		return -1;
 
-	printf("  ==> extracting: %s (character device %ld,%ld)\n",
-	       filename, devmaj, devmin);
+	if (tar_file_msg(t))
+		printf("  ==> extracting: %s (character device %ld,%ld)\n",
+		       filename, devmaj, devmin);
 
-	if (mknod(filename, mode | S_IFCHR,
+	if (mknodat(dir_fd, base, mode | S_IFCHR,
 		  compat_makedev(devmaj, devmin)) == -1)
 	{
 		fprintf(stderr, "tar_extract_chardev(): failed restore of character device '%s' but returning as if nothing bad happened\n", filename);
@@ -440,8 +1002,9 @@ tar_extract_blockdev(TAR *t, const char *realname)
 {
 	mode_t mode;
 	unsigned long devmaj, devmin;
-	const char *filename;
+	const char *filename, *base;
 	char *pn;
+	int dir_fd;
 
 	if (!TH_ISBLK(t))
 	{
@@ -455,13 +1018,15 @@ tar_extract_blockdev(TAR *t, const char *realname)
 	devmaj = th_get_devmajor(t);
 	devmin = th_get_devminor(t);
 
-	if (mkdirhier(dirname(filename)) == -1)
+	dir_fd = tar_parent_dir(t, filename, &base);
+	if (dir_fd == -1)
 		return -1;
 
-	printf("  ==> extracting: %s (block device %ld,%ld)\n",
-	       filename, devmaj, devmin);
+	if (tar_file_msg(t))
+		printf("  ==> extracting: %s (block device %ld,%ld)\n",
+		       filename, devmaj, devmin);
 
-	if (mknod(filename, mode | S_IFBLK,
+	if (mknodat(dir_fd, base, mode | S_IFBLK,
 		  compat_makedev(devmaj, devmin)) == -1)
 	{
 		fprintf(stderr, "tar_extract_blockdev(): failed restore of block device '%s' but returning as if nothing bad happened\n", filename);
@@ -476,8 +1041,9 @@ int
 tar_extract_dir(TAR *t, const char *realname)
 {
 	mode_t mode;
-	const char *filename;
-	char *pn;
+	const char *filename, *base;
+	char *pn, *name;
+	int dir_fd, fd, ret = 0;
 
 	if (!TH_ISDIR(t))
 	{
@@ -488,20 +1054,22 @@ tar_extract_dir(TAR *t, const char *realname)
 	filename = (realname ? realname : pn);
 	mode = th_get_mode(t);
 
-	if (mkdirhier(dirname(filename)) == -1)
+	dir_fd = tar_parent_dir(t, filename, &base);
+	if (dir_fd == -1)
 		return -1;
 
-	printf("  ==> extracting: %s (mode %04o, directory)\n", filename,
-	       mode);
+	if (tar_file_msg(t))
+		printf("  ==> extracting: %s (mode %04o, directory)\n", filename,
+		       mode);
 
-	if (mkdir(filename, mode) == -1)
+	if (mkdirat(dir_fd, base, mode) == -1)
 	{
 		if (errno == EEXIST)
 		{
-			if (chmod(filename, mode) == -1)
+			if (fchmodat(dir_fd, base, mode, 0) == -1)
 			{
 #ifdef DEBUG
-				perror("chmod()");
+				perror("fchmodat()");
 #endif
 				return -1;
 			}
@@ -510,25 +1078,44 @@ tar_extract_dir(TAR *t, const char *realname)
 #if 1 //def DEBUG
 				puts("  *** using existing directory");
 #endif
-				return 1;
+				ret = 1;
 			}
 		}
 		else
 		{
 #ifdef DEBUG
-			perror("mkdir()");
+			perror("mkdirat()");
 #endif
 			return -1;
 		}
 	}
 
+	/* the entries after a directory are mostly inside it, keep it open for
+	   them and for setting its own metadata */
+	fd = openat(dir_fd, base, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd != -1)
+	{
+		name = strdup(filename);
+		if (name != NULL)
+		{
+			tar_add_known_dir(t, name, strlen(name));
+			tar_keep_parent(t, name, fd);
+		}
+		else
+			close(fd);
+	}
+	if (ret == 1)
+		return 1;
+
 	if (t->options & TAR_STORE_ANDROID_USER_XATTR)
 	{
 		if (t->th_buf.has_user_default) {
 #if 1 //def DEBUG
 			printf("tar_extract_file(): restoring android user.default xattr to %s\n", realname);
 #endif
-			if (setxattr(realname, "user.default", NULL, 0, 0) < 0) {
+			fd = tar_dir_fd(t, realname);
+			if ((fd != -1 ? fsetxattr(fd, "user.default", NULL, 0, 0)
+				      : setxattr(realname, "user.default", NULL, 0, 0)) < 0) {
 				fprintf(stderr, "tar_extract_file(): failed to restore android user.default to file %s !!!\n", realname);
 				return -1;
 			}
@@ -560,14 +1147,26 @@ tar_extract_dir(TAR *t, const char *realname)
 			printf("error looking up proper e4crypt policy for '%s' - %s\n", realname, t->th_buf.eep->master_key_descriptor);
 			return -1;
 		}
-		char policy_hex[EXT4_KEY_DESCRIPTOR_SIZE_HEX];
-		policy_to_hex(binary_policy, policy_hex);
-		printf("restoring policy %s > '%s' to '%s'\n", t->th_buf.eep->master_key_descriptor, policy_hex, realname);
 		memcpy(&t->th_buf.eep->master_key_descriptor, binary_policy, EXT4_KEY_DESCRIPTOR_SIZE);
-		if (!e4crypt_policy_set_struct(realname, t->th_buf.eep))
+		struct tar_policy_dir *parent = tar_policy_parent(t, realname);
+		if (parent != NULL && memcmp(&parent->eep, t->th_buf.eep, sizeof(struct ext4_encryption_policy)) == 0)
 		{
-			printf("tar_extract_file(): failed to restore EXT4 crypt policy to dir '%s' '%s'!!!\n", realname, policy_hex);
-			//return -1; // This may not be an error in some cases, so log and ignore
+			// created in a directory with the same policy, so it has it already
+			if (tar_policy_push(t, realname, t->th_buf.eep))
+				return -1;
+		}
+		else
+		{
+			char policy_hex[EXT4_KEY_DESCRIPTOR_SIZE_HEX];
+			policy_to_hex(binary_policy, policy_hex);
+			printf("restoring policy '%s' to '%s'\n", policy_hex, realname);
+			if (!e4crypt_policy_set_struct(realname, t->th_buf.eep))
+			{
+				printf("tar_extract_file(): failed to restore EXT4 crypt policy to dir '%s' '%s'!!!\n", realname, policy_hex);
+				//return -1; // This may not be an error in some cases, so log and ignore
+			}
+			else if (tar_policy_push(t, realname, t->th_buf.eep))
+				return -1;
 		}
 	}
 #endif
@@ -581,8 +1180,9 @@ int
 tar_extract_fifo(TAR *t, const char *realname)
 {
 	mode_t mode;
-	const char *filename;
+	const char *filename, *base;
 	char *pn;
+	int dir_fd;
 
 	if (!TH_ISFIFO(t))
 	{
@@ -594,13 +1194,15 @@ tar_extract_fifo(TAR *t, const char *realname)
 	filename = (realname ? realname : pn);
 	mode = th_get_mode(t);
 
-	if (mkdirhier(dirname(filename)) == -1)
+	dir_fd = tar_parent_dir(t, filename, &base);
+	if (dir_fd == -1)
 		return -1;
 
 
-	printf("  ==> extracting: %s (fifo)\n", filename);
+	if (tar_file_msg(t))
+		printf("  ==> extracting: %s (fifo)\n", filename);
 
-	if (mkfifo(filename, mode) == -1)
+	if (mkfifoat(dir_fd, base, mode) == -1)
 	{
 #ifdef DEBUG
 		perror("mkfifo()");
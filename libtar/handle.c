@@ -49,17 +49,6 @@ tar_init(TAR **t, const char *pathname, tartype_t *type,
 	(*t)->type = (type ? type : &default_type);
 	(*t)->oflags = oflags;
 
-	if ((oflags & O_ACCMODE) == O_RDONLY)
-		(*t)->h = libtar_hash_new(256,
-					  (libtar_hashfunc_t)path_hashfunc);
-	else
-		(*t)->h = libtar_hash_new(16, (libtar_hashfunc_t)dev_hash);
-	if ((*t)->h == NULL)
-	{
-		free(*t);
-		return -1;
-	}
-
 	return 0;
 }
 
@@ -82,7 +71,6 @@ tar_open(TAR **t, const char *pathname, tartype_t *type,
 	(*t)->fd = (*((*t)->type->openfunc))(pathname, oflags, mode);
 	if ((*t)->fd == -1)
 	{
-		libtar_hash_free((*t)->h, NULL);
 		free(*t);
 		return -1;
 	}
@@ -118,12 +106,19 @@ tar_close(TAR *t)
 
 	i = (*(t->type->closefunc))(t->fd);
 
-	if (t->h != NULL)
-		libtar_hash_free(t->h, ((t->oflags & O_ACCMODE) == O_RDONLY
-					? free
-					: (libtar_freefunc_t)tar_dev_free));
+	tar_free_links(t);
+	tar_prefetch_free(t);
 	if (t->th_pathname != NULL)
 		free(t->th_pathname);
+	if (t->bulk_buf != NULL)
+		free(t->bulk_buf);
+	free(t->longname_buf);
+	free(t->longlink_buf);
+	tar_free_deferred(t);
+	tar_free_parent(t);
+#ifdef HAVE_EXT4_CRYPT
+	tar_free_policy_dirs(t);
+#endif
 	free(t);
 
 	return i;
@@ -15,3 +15,38 @@
 
 #include <libtar.h>
 
+/* grow the scratch buffer *buf of *size bytes to hold len bytes; its
+   contents are not kept.  returns NULL on ENOMEM */
+char *tar_scratch_buffer(char **buf, size_t *size, size_t len);
+
+/* whether to print the next message about a single file */
+#define tar_file_msg(t)	((t)->file_msg == NULL || (t)->file_msg())
+
+/* free the table of archived files with several links */
+void tar_free_links(TAR *t);
+
+/* free the directories held for tar_extract_finish() */
+void tar_free_deferred(TAR *t);
+
+/* the stat, open fd and, if it was read completely, the contents of
+   realname when it is the next prefetched file.  returns 0 if it is not */
+int tar_prefetch_take(TAR *t, const char *realname, struct stat *s, int *fd,
+		      const char **data);
+
+/* close an fd, batched with the prefetch submissions if there are any */
+void tar_prefetch_close(TAR *t, int fd);
+
+/* wait for the prefetch submissions and free them */
+void tar_prefetch_free(TAR *t);
+
+
+#ifdef HAVE_EXT4_CRYPT
+/* the encrypted directory holding path, NULL if it is not known; forgets
+   the directories path is not below */
+struct tar_policy_dir *tar_policy_parent(TAR *t, const char *path);
+
+/* remember that directory path has policy eep */
+int tar_policy_push(TAR *t, const char *path, const struct ext4_encryption_policy *eep);
+
+void tar_free_policy_dirs(TAR *t);
+#endif
@@ -15,6 +15,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <linux/capability.h>
 #include "tar.h"
 
@@ -37,6 +38,12 @@ extern "C"
 #define T_PREFIXLEN		155
 #define T_MAXPATHLEN		(T_NAMELEN + T_PREFIXLEN)
 
+/* regular file payloads are moved in chunks of up to this many bytes */
+#define T_BULKSIZE		(2 * 1024 * 1024)
+
+/* regular files at least this big are preallocated before they are written */
+#define T_PREALLOC_MIN		(64 * 1024)
+
 /* GNU extensions for typeflag */
 #define GNU_LONGNAME_TYPE	'L'
 #define GNU_LONGLINK_TYPE	'K'
@@ -95,6 +102,53 @@ typedef struct
 }
 tartype_t;
 
+/* directory whose mode and times are set by tar_extract_finish() */
+struct tar_deferred_dir
+{
+	char *name;
+	mode_t mode;
+	time_t mtime;
+};
+
+/* file with several links that has been archived, see tar_append_file() */
+struct tar_link
+{
+	dev_t dev;
+	ino_t ino;
+	size_t name;	/* offset of its archived name in link_names plus one,
+			   0 for an unused slot */
+};
+
+/* directories tar_parent_dir() keeps open */
+#define TAR_PARENT_CACHE	16
+
+struct tar_parent
+{
+	char *name;
+	size_t len;
+	int fd;
+	unsigned long used;	/* parent_tick of the last lookup */
+};
+
+struct tar_known_dir
+{
+	size_t hash;
+	size_t name;	/* offset of the path in known_names plus one, 0 for an
+			   unused slot */
+};
+
+#ifdef HAVE_EXT4_CRYPT
+/* encrypted directory whose policy the directories below it share */
+struct tar_policy_dir
+{
+	char *name;
+	struct ext4_encryption_policy eep;
+};
+#endif
+
+/* the files tar_prefetch_add() queued, private to prefetch.c */
+struct tar_prefetch;
+
 typedef struct
 {
 	tartype_t *type;
@@ -103,10 +157,77 @@ typedef struct
 	int oflags;
 	int options;
 	struct tar_header th_buf;
-	libtar_hash_t *h;
 
 	/* introduced in libtar 1.2.21 */
 	char *th_pathname;
+
+	/* T_BULKSIZE payload buffer, allocated on first use */
+	char *bulk_buf;
+
+	/* the long name, long link, SELinux context and policy of th_buf
+	   point into these, they are reused for every header */
+	char *longname_buf;
+	size_t longname_size;
+	char *longlink_buf;
+	size_t longlink_size;
+	char context_buf[T_BLOCKSIZE];
+#ifdef HAVE_EXT4_CRYPT
+	struct ext4_encryption_policy eep_buf;
+#endif
+
+	/* open addressing table of the files with several links archived so
+	   far, link_size is 0 or a power of two */
+	struct tar_link *links;
+	size_t link_count;
+	size_t link_size;
+	char *link_names;
+	size_t link_names_len;
+	size_t link_names_size;
+
+	/* device whose filesystem answered ENOTSUP for an xattr, valid if
+	   noxattr_valid is set */
+	dev_t noxattr_dev;
+	int noxattr_valid;
+
+	/* directories waiting for tar_extract_finish(), in archive order */
+	struct tar_deferred_dir *deferred_dirs;
+	size_t deferred_count;
+	size_t deferred_size;
+
+	/* the directories extracted into most recently, kept open by
+	   tar_parent_dir(), the first parent_count are in use */
+	struct tar_parent parents[TAR_PARENT_CACHE];
+	unsigned int parent_count;
+	unsigned long parent_tick;
+
+	/* open addressing set of the directories known to exist, known_size is
+	   0 or a power of two */
+	struct tar_known_dir *known;
+	size_t known_count;
+	size_t known_size;
+	char *known_names;
+	size_t known_names_len;
+	size_t known_names_size;
+
+	/* files read ahead for tar_append_file(), NULL unless
+	   tar_prefetch_init() succeeded */
+	struct tar_prefetch *prefetch;
+
+	/* asked before each message about a single file, which is left out
+	   if it returns 0.  NULL prints them all */
+	int (*file_msg)(void);
+
+	/* given the contents of each regular file as they are archived,
+	   without the padding.  NULL leaves them alone */
+	void (*data_hook)(void *arg, const void *buf, size_t len);
+	void *data_hook_arg;
+
+#ifdef HAVE_EXT4_CRYPT
+	/* encrypted directories above the current entry, outermost first */
+	struct tar_policy_dir *policy_dirs;
+	size_t policy_count;
+	size_t policy_size;
+#endif
 }
 TAR;
 
@@ -123,6 +244,8 @@ TAR;
 #define TAR_STORE_EXT4_POL	512	/* store ext4 crypto policy */
 #define TAR_STORE_POSIX_CAP	1024	/* store posix file capabilities */
 #define TAR_STORE_ANDROID_USER_XATTR	2048	/* store android user.* xattr */
+#define TAR_DEFER_METADATA	4096	/* set file metadata through the open fd,
+					   directory modes and times at the end */
 
 /* this is obsolete - it's here for backwards-compatibility only */
 #define TAR_IGNORE_MAGIC	0
@@ -147,12 +270,6 @@ int tar_close(TAR *t);
 
 /***** append.c ************************************************************/
 
-/* forward declaration to appease the compiler */
-struct tar_dev;
-
-/* cleanup function */
-void tar_dev_free(struct tar_dev *tdp);
-
 /* Appends a file to the tar archive.
  * Arguments:
  *    t        = TAR handle to append to
@@ -181,6 +298,19 @@ int tar_append_file_contents(TAR *t, const char *savename, mode_t mode,
 /* add buffer to a tarchive */
 int tar_append_buffer(TAR *t, void *buf, size_t len);
 
+/***** prefetch.c **********************************************************/
+
+/* Reads up to depth upcoming small files ahead of tar_append_file() with
+ * io_uring.  Returns -1 if the kernel can't, appending is then synchronous.
+ */
+int tar_prefetch_init(TAR *t, unsigned int depth);
+
+/* Queues the regular file realname of size bytes, to be appended next after
+ * the files queued before it.  Returns 0 if it was queued or is not worth
+ * reading ahead, -1 if the queue is full.
+ */
+int tar_prefetch_add(TAR *t, const char *realname, unsigned long long size);
+
 /***** block.c *************************************************************/
 
 /* macros for reading/writing tarchive blocks */
@@ -193,6 +323,14 @@ int tar_append_buffer(TAR *t, void *buf, size_t len);
 int th_read(TAR *t);
 int th_write(TAR *t);
 
+/* read/write len bytes (a multiple of T_BLOCKSIZE), retrying short
+   transfers; returns the number of bytes moved or -1 on error */
+ssize_t tar_block_read_n(TAR *t, void *buf, size_t len);
+ssize_t tar_block_write_n(TAR *t, const void *buf, size_t len);
+
+/* returns the T_BULKSIZE payload buffer for t, or NULL on ENOMEM */
+char *tar_bulk_buffer(TAR *t);
+
 
 /***** decode.c ************************************************************/
 
@@ -261,7 +399,7 @@ void th_finish(TAR *t);
 /***** extract.c ***********************************************************/
 
 /* sequentially extract next file from t */
-int tar_extract_file(TAR *t, const char *realname, const char *prefix, const int *progress_fd);
+int tar_extract_file(TAR *t, const char *realname, const char *prefix, unsigned long long *progress);
 
 /* extract different file types */
 int tar_extract_dir(TAR *t, const char *realname);
@@ -272,12 +410,37 @@ int tar_extract_blockdev(TAR *t, const char *realname);
 int tar_extract_fifo(TAR *t, const char *realname);
 
 /* for regfiles, we need to extract the content blocks as well */
-int tar_extract_regfile(TAR *t, const char *realname, const int *progress_fd);
+int tar_extract_regfile(TAR *t, const char *realname, unsigned long long *progress);
 int tar_skip_regfile(TAR *t);
 
 /* extract regfile to buffer */
 int tar_extract_file_contents(TAR *t, void *buf, size_t *lenp);
 
+/* add extracted bytes to the counter at progress, which other threads
+   and processes may read at any time; NULL counts nothing */
+void tar_extract_progress(TAR *t, unsigned long long *progress,
+			  unsigned long long size);
+
+/* reserve size bytes for a file opened for extraction, if the filesystem
+   supports it, so large files are not fragmented */
+void tar_preallocate(int fd, const char *filename, int64_t size);
+
+/* with TAR_DEFER_METADATA, set the modes and times of the extracted
+   directories, returns -1 if any of them failed */
+int tar_extract_finish(TAR *t);
+
+/* open the directory filename goes in, creating it if needed, and point
+   base at the name inside it. The most recently used directories stay
+   open, so the entries that follow are created with the *at() calls
+   instead of walking their whole path again, and a missing directory is
+   created from its nearest open ancestor. Returns the directory fd,
+   AT_FDCWD for a name without a directory or -1 on error. */
+int tar_parent_dir(TAR *t, const char *filename, const char **base);
+
+/* close the directories kept open by tar_parent_dir() and forget the ones
+   known to exist */
+void tar_free_parent(TAR *t);
+
 /***** output.c ************************************************************/
 
 /* print the tar header */
@@ -289,21 +452,6 @@ void th_print_long_ls(TAR *t);
 
 /***** util.c *************************************************************/
 
-/* hashing function for pathnames */
-int path_hashfunc(char *key, int numbuckets);
-
-/* matching function for dev_t's */
-int dev_match(dev_t *dev1, dev_t *dev2);
-
-/* matching function for ino_t's */
-int ino_match(ino_t *ino1, ino_t *ino2);
-
-/* hashing function for dev_t's */
-int dev_hash(dev_t *dev);
-
-/* hashing function for ino_t's */
-int ino_hash(ino_t *inode);
-
 /* create any necessary dirs */
 int mkdirhier(char *path);
 
@@ -336,7 +484,7 @@ void print_caps(struct vfs_cap_data *cap_data);
 
 /* extract groups of files */
 int tar_extract_glob(TAR *t, char *globname, char *prefix);
-int tar_extract_all(TAR *t, char *prefix, const int *progress_fd);
+int tar_extract_all(TAR *t, char *prefix, unsigned long long *progress);
 
 /* add a whole tree of files */
 int tar_append_tree(TAR *t, char *realdir, char *savedir);
@@ -0,0 +1,545 @@
+/*
+**  prefetch.c - read small files ahead of tar_append_file() with io_uring
+**
+**  The caller queues the regular files it is about to append.  Their
+**  open, statx and read go to the kernel as one batch, and
+**  tar_append_file() takes the results in list order instead of making
+**  the calls itself.  Without io_uring tar_prefetch_init() fails and
+**  everything stays synchronous.
+*/
+
+#include <internal.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+
+#ifdef HAVE_IO_URING
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/sysmacros.h>
+# include <linux/io_uring.h>
+
+/* files larger than this are read by tar_append_file() as before */
+#define TAR_PREFETCH_MAX	(64 * 1024)
+
+/* what a completion is for, in the low bits of its user_data */
+#define PF_OPEN		0
+#define PF_STATX	1
+#define PF_READ		2
+#define PF_CLOSE	3
+
+struct tar_prefetch_slot
+{
+	char name[MAXPATHLEN];
+	int fd;
+	int error;		/* errno of the first failed step */
+	int pending;		/* submissions not completed yet */
+	ssize_t got;		/* bytes read, -1 until the read completes */
+	struct statx stx;
+	char *buf;
+};
+
+struct tar_prefetch
+{
+	int ring_fd;
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_entries;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned to_submit;	/* queued but not passed to the kernel */
+	unsigned inflight;	/* passed or queued, not completed */
+
+	/* depth + 1 slots: the one before head is lent to the caller of
+	   tar_prefetch_take() until the next take */
+	struct tar_prefetch_slot *slots;
+	unsigned nslots;
+	unsigned head;
+	unsigned count;
+	char *bufs;
+};
+
+
+static int
+pf_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int
+pf_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		       NULL, 0);
+}
+
+
+/* true if the kernel knows every operation the prefetch uses */
+static int
+pf_probe(int ring_fd)
+{
+	struct io_uring_probe *probe;
+	size_t len;
+	int ok;
+
+	len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = (struct io_uring_probe *)calloc(1, len);
+	if (probe == NULL)
+		return 0;
+	ok = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+		     probe, 256) == 0
+	     && probe->last_op >= IORING_OP_STATX
+	     && probe->last_op >= IORING_OP_OPENAT
+	     && probe->last_op >= IORING_OP_READ
+	     && probe->last_op >= IORING_OP_CLOSE
+	     && (probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED)
+	     && (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED)
+	     && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)
+	     && (probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+
+	return ok;
+}
+
+
+/* a zeroed submission entry, NULL if the ring is full */
+static struct io_uring_sqe *
+pf_get_sqe(struct tar_prefetch *pf)
+{
+	unsigned tail = *pf->sq_tail;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(pf->sq_head, __ATOMIC_ACQUIRE)
+	    >= *pf->sq_entries)
+		return NULL;
+	sqe = &pf->sqes[tail & *pf->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	pf->sq_array[tail & *pf->sq_mask] = tail & *pf->sq_mask;
+	__atomic_store_n(pf->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	pf->to_submit++;
+	pf->inflight++;
+
+	return sqe;
+}
+
+
+static void
+pf_queue_read(struct tar_prefetch *pf, unsigned i)
+{
+	struct tar_prefetch_slot *slot = &pf->slots[i];
+	struct io_uring_sqe *sqe;
+
+	sqe = pf_get_sqe(pf);
+	if (sqe == NULL)
+	{
+		/* tar_append_file() reads it itself */
+		slot->error = EAGAIN;
+		return;
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = slot->fd;
+	sqe->addr = (unsigned long)slot->buf;
+	sqe->len = slot->stx.stx_size;
+	sqe->off = 0;
+	sqe->user_data = (uint64_t)i << 2 | PF_READ;
+	slot->pending++;
+}
+
+
+/* handle the completions the kernel has posted */
+static void
+pf_reap(struct tar_prefetch *pf)
+{
+	unsigned head = *pf->cq_head;
+	struct io_uring_cqe *cqe;
+	struct tar_prefetch_slot *slot;
+	unsigned i;
+
+	while (head != __atomic_load_n(pf->cq_tail, __ATOMIC_ACQUIRE))
+	{
+		cqe = &pf->cqes[head & *pf->cq_mask];
+		head++;
+		pf->inflight--;
+		if ((cqe->user_data & 3) == PF_CLOSE)
+			continue;
+
+		i = cqe->user_data >> 2;
+		slot = &pf->slots[i];
+		slot->pending--;
+		switch (cqe->user_data & 3)
+		{
+		case PF_OPEN:
+			if (cqe->res >= 0)
+				slot->fd = cqe->res;
+			else if (slot->error == 0)
+				slot->error = -cqe->res;
+			break;
+		case PF_STATX:
+			if (cqe->res < 0 && slot->error == 0)
+				slot->error = -cqe->res;
+			break;
+		case PF_READ:
+			/* a failed read is redone by tar_append_file() */
+			slot->got = cqe->res > 0 ? cqe->res : 0;
+			break;
+		}
+
+		/* open and statx are both in, read what statx found */
+		if (slot->pending == 0 && slot->got == -1 && slot->error == 0
+		    && S_ISREG(slot->stx.stx_mode) && slot->stx.stx_size > 0
+		    && slot->stx.stx_size <= TAR_PREFETCH_MAX)
+			pf_queue_read(pf, i);
+	}
+	__atomic_store_n(pf->cq_head, head, __ATOMIC_RELEASE);
+}
+
+
+/* pass the queued entries to the kernel, waiting for at least wait
+   completions */
+static int
+pf_submit(struct tar_prefetch *pf, unsigned wait)
+{
+	int i;
+
+	do
+	{
+		i = pf_enter(pf->ring_fd, pf->to_submit, wait,
+			     wait ? IORING_ENTER_GETEVENTS : 0);
+	}
+	while (i == -1 && errno == EINTR);
+	if (i == -1)
+		return -1;
+	pf->to_submit -= i;
+	pf_reap(pf);
+
+	return 0;
+}
+
+
+static void
+pf_stat(const struct statx *stx, struct stat *s)
+{
+	memset(s, 0, sizeof(*s));
+	s->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	s->st_ino = stx->stx_ino;
+	s->st_mode = stx->stx_mode;
+	s->st_nlink = stx->stx_nlink;
+	s->st_uid = stx->stx_uid;
+	s->st_gid = stx->stx_gid;
+	s->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	s->st_size = stx->stx_size;
+	s->st_blksize = stx->stx_blksize;
+	s->st_blocks = stx->stx_blocks;
+	s->st_atime = stx->stx_atime.tv_sec;
+	s->st_mtime = stx->stx_mtime.tv_sec;
+	s->st_ctime = stx->stx_ctime.tv_sec;
+}
+
+
+int
+tar_prefetch_init(TAR *t, unsigned int depth)
+{
+	struct tar_prefetch *pf;
+	struct io_uring_params p;
+	unsigned i;
+
+	if (t->prefetch != NULL)
+		return 0;
+	if (depth == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	pf = (struct tar_prefetch *)calloc(1, sizeof(*pf));
+	if (pf == NULL)
+		return -1;
+	pf->ring_fd = -1;
+	pf->nslots = depth + 1;
+	pf->slots = (struct tar_prefetch_slot *)calloc(pf->nslots,
+						       sizeof(*pf->slots));
+	pf->bufs = (char *)malloc((size_t)pf->nslots * TAR_PREFETCH_MAX);
+	if (pf->slots == NULL || pf->bufs == NULL)
+		goto fail;
+	for (i = 0; i < pf->nslots; i++)
+	{
+		pf->slots[i].fd = -1;
+		pf->slots[i].buf = pf->bufs + (size_t)i * TAR_PREFETCH_MAX;
+	}
+
+	/* open, statx and read for every slot, and the closes behind them */
+	memset(&p, 0, sizeof(p));
+	pf->ring_fd = pf_setup(pf->nslots * 4, &p);
+	if (pf->ring_fd == -1)
+		goto fail;
+	if (!pf_probe(pf->ring_fd))
+		goto fail;
+
+	pf->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	pf->cq_map_size = p.cq_off.cqes
+			  + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (pf->cq_map_size > pf->sq_map_size)
+			pf->sq_map_size = pf->cq_map_size;
+		pf->cq_map_size = 0;
+	}
+	pf->sq_map = mmap(NULL, pf->sq_map_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, pf->ring_fd,
+			  IORING_OFF_SQ_RING);
+	if (pf->sq_map == MAP_FAILED)
+	{
+		pf->sq_map = NULL;
+		goto fail;
+	}
+	if (pf->cq_map_size == 0)
+		pf->cq_map = pf->sq_map;
+	else
+	{
+		pf->cq_map = mmap(NULL, pf->cq_map_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, pf->ring_fd,
+				  IORING_OFF_CQ_RING);
+		if (pf->cq_map == MAP_FAILED)
+		{
+			pf->cq_map = NULL;
+			goto fail;
+		}
+	}
+	pf->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	pf->sqes = (struct io_uring_sqe *)mmap(NULL, pf->sqes_size,
+					       PROT_READ | PROT_WRITE,
+					       MAP_SHARED | MAP_POPULATE,
+					       pf->ring_fd, IORING_OFF_SQES);
+	if (pf->sqes == MAP_FAILED)
+	{
+		pf->sqes = NULL;
+		goto fail;
+	}
+
+	pf->sq_head = (unsigned *)((char *)pf->sq_map + p.sq_off.head);
+	pf->sq_tail = (unsigned *)((char *)pf->sq_map + p.sq_off.tail);
+	pf->sq_mask = (unsigned *)((char *)pf->sq_map + p.sq_off.ring_mask);
+	pf->sq_entries = (unsigned *)((char *)pf->sq_map + p.sq_off.ring_entries);
+	pf->sq_array = (unsigned *)((char *)pf->sq_map + p.sq_off.array);
+	pf->cq_head = (unsigned *)((char *)pf->cq_map + p.cq_off.head);
+	pf->cq_tail = (unsigned *)((char *)pf->cq_map + p.cq_off.tail);
+	pf->cq_mask = (unsigned *)((char *)pf->cq_map + p.cq_off.ring_mask);
+	pf->cqes = (struct io_uring_cqe *)((char *)pf->cq_map + p.cq_off.cqes);
+
+	t->prefetch = pf;
+	return 0;
+
+fail:
+	t->prefetch = pf;
+	tar_prefetch_free(t);
+	return -1;
+}
+
+
+int
+tar_prefetch_add(TAR *t, const char *realname, unsigned long long size)
+{
+	struct tar_prefetch *pf = t->prefetch;
+	struct tar_prefetch_slot *slot;
+	struct io_uring_sqe *sqe;
+	unsigned i;
+
+	if (pf == NULL)
+		return -1;
+	if (size == 0 || size > TAR_PREFETCH_MAX
+	    || strlen(realname) >= sizeof(slot->name))
+		return 0;
+	if (pf->count + 1 >= pf->nslots
+	    || *pf->sq_tail - __atomic_load_n(pf->sq_head, __ATOMIC_ACQUIRE)
+	       + 2 > *pf->sq_entries)
+		return -1;
+
+	i = (pf->head + pf->count) % pf->nslots;
+	slot = &pf->slots[i];
+	strcpy(slot->name, realname);
+	slot->fd = -1;
+	slot->error = 0;
+	slot->got = -1;
+	slot->pending = 2;
+
+	sqe = pf_get_sqe(pf);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)slot->name;
+	sqe->open_flags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+	sqe->user_data = (uint64_t)i << 2 | PF_OPEN;
+
+	sqe = pf_get_sqe(pf);
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (unsigned long)slot->name;
+	sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+	sqe->len = STATX_BASIC_STATS;
+	sqe->off = (unsigned long)&slot->stx;
+	sqe->user_data = (uint64_t)i << 2 | PF_STATX;
+
+	pf->count++;
+
+	return 0;
+}
+
+
+int
+tar_prefetch_take(TAR *t, const char *realname, struct stat *s, int *fd,
+		  const char **data)
+{
+	struct tar_prefetch *pf = t->prefetch;
+	struct tar_prefetch_slot *slot;
+
+	if (pf == NULL || pf->count == 0)
+		return 0;
+
+	/* start on the rest of the batch before waiting for this one */
+	if (pf->to_submit > 0 && pf_submit(pf, 0) == -1)
+		return 0;
+
+	slot = &pf->slots[pf->head];
+	if (strcmp(slot->name, realname) != 0)
+		return 0;
+	while (slot->pending > 0)
+		if (pf_submit(pf, 1) == -1)
+			return 0;
+	pf->head = (pf->head + 1) % pf->nslots;
+	pf->count--;
+
+	if (slot->error != 0 || !S_ISREG(slot->stx.stx_mode))
+	{
+		if (slot->fd != -1)
+			tar_prefetch_close(t, slot->fd);
+		return 0;
+	}
+
+	pf_stat(&slot->stx, s);
+	*fd = slot->fd;
+	*data = NULL;
+	if (slot->got == (ssize_t)slot->stx.stx_size)
+		*data = slot->buf;
+	else if (slot->got > 0 && lseek(slot->fd, 0, SEEK_SET) == -1)
+	{
+		/* the file changed under the read, let the caller redo it */
+		tar_prefetch_close(t, slot->fd);
+		return 0;
+	}
+	slot->fd = -1;
+
+	return 1;
+}
+
+
+void
+tar_prefetch_close(TAR *t, int fd)
+{
+	struct tar_prefetch *pf = t->prefetch;
+	struct io_uring_sqe *sqe;
+
+	sqe = pf != NULL ? pf_get_sqe(pf) : NULL;
+	if (sqe == NULL)
+	{
+		close(fd);
+		return;
+	}
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = fd;
+	sqe->user_data = PF_CLOSE;
+}
+
+
+void
+tar_prefetch_free(TAR *t)
+{
+	struct tar_prefetch *pf = t->prefetch;
+	unsigned i;
+
+	if (pf == NULL)
+		return;
+	t->prefetch = NULL;
+
+	/* the kernel may still be writing into the slots */
+	if (pf->sqes != NULL)
+		while (pf->inflight > 0)
+			if (pf_submit(pf, 1) == -1)
+				break;
+
+	if (pf->slots != NULL)
+		for (i = 0; i < pf->nslots; i++)
+			if (pf->slots[i].fd != -1)
+				close(pf->slots[i].fd);
+	if (pf->sqes != NULL)
+		munmap(pf->sqes, pf->sqes_size);
+	if (pf->cq_map != NULL && pf->cq_map != pf->sq_map)
+		munmap(pf->cq_map, pf->cq_map_size);
+	if (pf->sq_map != NULL)
+		munmap(pf->sq_map, pf->sq_map_size);
+	if (pf->ring_fd != -1)
+		close(pf->ring_fd);
+	free(pf->bufs);
+	free(pf->slots);
+	free(pf);
+}
+
+#else /* !HAVE_IO_URING */
+
+int
+tar_prefetch_init(TAR *t, unsigned int depth)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+
+int
+tar_prefetch_add(TAR *t, const char *realname, unsigned long long size)
+{
+	return -1;
+}
+
+
+int
+tar_prefetch_take(TAR *t, const char *realname, struct stat *s, int *fd,
+		  const char **data)
+{
+	return 0;
+}
+
+
+void
+tar_prefetch_close(TAR *t, int fd)
+{
+	close(fd);
+}
+
+
+void
+tar_prefetch_free(TAR *t)
+{
+}
+
+#endif /* HAVE_IO_URING */
@@ -22,52 +22,6 @@
 #endif
 
 
-/* hashing function for pathnames */
-int
-path_hashfunc(char *key, int numbuckets)
-{
-	char buf[MAXPATHLEN];
-	char *p;
-
-	strcpy(buf, key);
-	p = basename(buf);
-
-	return (((unsigned int)p[0]) % numbuckets);
-}
-
-
-/* matching function for dev_t's */
-int
-dev_match(dev_t *dev1, dev_t *dev2)
-{
-	return !memcmp(dev1, dev2, sizeof(dev_t));
-}
-
-
-/* matching function for ino_t's */
-int
-ino_match(ino_t *ino1, ino_t *ino2)
-{
-	return !memcmp(ino1, ino2, sizeof(ino_t));
-}
-
-
-/* hashing function for dev_t's */
-int
-dev_hash(dev_t *dev)
-{
-	return *dev % 16;
-}
-
-
-/* hashing function for ino_t's */
-int
-ino_hash(ino_t *inode)
-{
-	return *inode % 256;
-}
-
-
 /*
 ** mkdirhier() - create all directories in a given path
 ** returns:
@@ -141,16 +95,19 @@ th_signed_crc_calc(TAR *t)
 	return sum;
 }
 
-/* string-octal to integer conversion */
+/* string-octal to integer conversion, reading at most octlen bytes */
 int64_t
 oct_to_int(char *oct, size_t octlen)
 {
-	long long int val;
-	char tmp[octlen + 1];
+	uint64_t val = 0;
+	size_t i = 0;
 
-	memcpy(tmp, oct, octlen);
-	tmp[octlen] = '\0';
-	return sscanf(oct, "%llo", &val) == 1 ? (int64_t)val : 0;
+	while (i < octlen && (oct[i] == ' ' || (oct[i] >= '\t' && oct[i] <= '\r')))
+		i++;
+	for (; i < octlen && oct[i] >= '0' && oct[i] <= '7'; i++)
+		val = (val << 3) | (oct[i] - '0');
+
+	return (int64_t)val;
 }
 
 
@@ -176,14 +133,19 @@ int64_t oct_to_int_ex(char *oct, size_t octlen)
 }
 
 
-/* integer to NULL-terminated string-octal conversion */
+/* integer to NULL-terminated string-octal conversion, keeping the low
+   octlen - 1 digits */
 void int_to_oct(int64_t num, char *oct, size_t octlen)
 {
-	char tmp[sizeof(num)*3 + 1];
-	int olen;
+	uint64_t val = (uint64_t)num;
+	size_t i = octlen - 1;
 
-	olen = sprintf(tmp, "%0*llo", (int)octlen, (long long)num);
-	memcpy(oct, tmp + olen - octlen + 1, octlen);
+	oct[i] = '\0';
+	while (i > 0)
+	{
+		oct[--i] = '0' + (val & 7);
+		val >>= 3;
+	}
 }
 
 
@@ -219,3 +181,83 @@ void print_caps(struct vfs_cap_data *cap_data) {
 	printf("     data[1].permitted=%u \n", cap_data->data[1].permitted);
 	printf("     data[1].inheritable=%u \n", cap_data->data[1].inheritable);
 }
+
+#ifdef HAVE_EXT4_CRYPT
+/* length of path without trailing slashes */
+static size_t
+policy_path_len(const char *path)
+{
+	size_t len = strlen(path);
+
+	while (len > 1 && path[len - 1] == '/')
+		len--;
+	return len;
+}
+
+
+/* Entries come after the directory they are in, so the directories that
+   matter form a stack: the ones path is not below are done with. */
+struct tar_policy_dir *
+tar_policy_parent(TAR *t, const char *path)
+{
+	struct tar_policy_dir *dir;
+	size_t len, dir_len;
+
+	len = policy_path_len(path);
+	while (t->policy_count > 0)
+	{
+		dir = &t->policy_dirs[t->policy_count - 1];
+		dir_len = strlen(dir->name);
+		if (dir_len < len && path[dir_len] == '/'
+		    && strncmp(path, dir->name, dir_len) == 0)
+		{
+			if (memchr(path + dir_len + 1, '/', len - dir_len - 1) == NULL)
+				return dir;
+			return NULL;
+		}
+		free(dir->name);
+		t->policy_count--;
+	}
+	return NULL;
+}
+
+
+int
+tar_policy_push(TAR *t, const char *path, const struct ext4_encryption_policy *eep)
+{
+	struct tar_policy_dir *dirs;
+	size_t size;
+
+	if (t->policy_count == t->policy_size)
+	{
+		size = t->policy_size ? t->policy_size * 2 : 16;
+		dirs = (struct tar_policy_dir *)realloc(t->policy_dirs, size * sizeof(*dirs));
+		if (dirs == NULL)
+			return -1;
+		t->policy_dirs = dirs;
+		t->policy_size = size;
+	}
+	dirs = &t->policy_dirs[t->policy_count];
+	dirs->name = strndup(path, policy_path_len(path));
+	if (dirs->name == NULL)
+		return -1;
+	memcpy(&dirs->eep, eep, sizeof(dirs->eep));
+	t->policy_count++;
+
+	return 0;
+}
+
+
+void
+tar_free_policy_dirs(TAR *t)
+{
+	size_t i;
+
+	for (i = 0; i < t->policy_count; i++)
+		free(t->policy_dirs[i].name);
+	free(t->policy_dirs);
+	t->policy_dirs = NULL;
+	t->policy_count = 0;
+	t->policy_size = 0;
+}
+#endif
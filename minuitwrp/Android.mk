@@ -8,6 +8,7 @@ LOCAL_SRC_FILES := \
     resources.cpp \
     truetype.cpp \
     graphics_utils.cpp \
+    graphics_kernels.cpp \
     events.cpp
 
 ifneq ($(TW_BOARD_CUSTOM_GRAPHICS),)
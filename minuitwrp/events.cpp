@@ -18,6 +18,8 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
 #include <sys/poll.h>
 #include <limits.h>
 #include <linux/input.h>
@@ -36,6 +38,10 @@
 
 #define MAX_DEVICES         32
 
+// Events read from a device with one read(); a touch report at a high rate
+// is a handful of events, so this holds several of them
+#define EV_BATCH            64
+
 #define VIBRATOR_TIMEOUT_FILE	"/sys/class/timed_output/vibrator/enable"
 #define VIBRATOR_TIME_MS    50
 
@@ -103,9 +109,15 @@ struct ev {
 static struct pollfd ev_fds[MAX_DEVICES];
 static struct ev evs[MAX_DEVICES];
 static unsigned ev_count = 0;
+static struct input_event ev_batch[MAX_DEVICES][EV_BATCH];
+static unsigned ev_batch_pos[MAX_DEVICES], ev_batch_len[MAX_DEVICES];
 static struct timeval lastInputStat;
 static time_t lastInputMTime;
 static int has_mouse = 0;
+// Lives across reloads, so ev_fd() stays valid; holds the devices and ev_inotify_fd
+static int ev_epoll_fd = -1;
+// Watches /dev/input for devices coming and going, -1 to fall back to a stat() every 2 seconds
+static int ev_inotify_fd = -1;
 
 static inline int ABS(int x) {
     return x<0?-x:x;
@@ -309,6 +321,11 @@ static void check_mouse(int fd, const char* deviceName)
 	has_mouse = 1;
 }
 
+int ev_fd(void)
+{
+	return ev_epoll_fd;
+}
+
 int ev_has_mouse(void)
 {
 	return has_mouse;
@@ -322,6 +339,21 @@ int ev_init(void)
 
     has_mouse = 0;
 
+    if (ev_epoll_fd < 0) {
+        ev_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        ev_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (ev_inotify_fd >= 0 && inotify_add_watch(ev_inotify_fd, "/dev/input", IN_CREATE | IN_DELETE) < 0) {
+            close(ev_inotify_fd);
+            ev_inotify_fd = -1;
+        }
+        if (ev_epoll_fd >= 0 && ev_inotify_fd >= 0) {
+            struct epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.fd = ev_inotify_fd;
+            epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, ev_inotify_fd, &event);
+        }
+    }
+
 	dir = opendir("/dev/input");
     if(dir != 0) {
         while((de = readdir(dir))) {
@@ -342,6 +374,14 @@ int ev_init(void)
             if (!evs[ev_count].ignored)
                 check_mouse(fd, evs[ev_count].deviceName);
 
+            if (ev_epoll_fd >= 0) {
+                // Closing the device in ev_exit() takes it out of the set again
+                struct epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.fd = fd;
+                epoll_ctl(ev_epoll_fd, EPOLL_CTL_ADD, fd, &event);
+            }
+
             ev_count++;
             if(ev_count == MAX_DEVICES) break;
         }
@@ -364,6 +404,7 @@ void ev_exit(void)
 			evs[ev_count].vk_count = 0;
 		}
 		close(ev_fds[ev_count].fd);
+		ev_batch_pos[ev_count] = ev_batch_len[ev_count] = 0;
 	}
 	ev_count = 0;
 }
@@ -753,40 +794,82 @@ static int vk_modify(struct ev *e, struct input_event *ev)
     return 0;
 }
 
+// Hands out the next event that was read but not handled yet. 0 if there
+// was one to report, -1 if the batches ran out first.
+static int ev_get_batched(struct input_event *ev)
+{
+    for (unsigned n = 0; n < ev_count; n++) {
+        while (ev_batch_pos[n] < ev_batch_len[n]) {
+            *ev = ev_batch[n][ev_batch_pos[n]++];
+            if (!vk_modify(&evs[n], ev))
+                return 0;
+        }
+    }
+    return -1;
+}
+
+int ev_batched(void)
+{
+    for (unsigned n = 0; n < ev_count; n++) {
+        if (ev_batch_pos[n] < ev_batch_len[n])
+            return 1;
+    }
+    return 0;
+}
+
 int ev_get(struct input_event *ev, int timeout_ms)
 {
     int r;
     unsigned n;
     struct timeval curr;
 
-    gettimeofday(&curr, NULL);
-    if(curr.tv_sec - lastInputStat.tv_sec >= 2)
+    if (ev_batched())
+        return ev_get_batched(ev);
+
+    if (ev_inotify_fd >= 0)
     {
-        struct stat st;
-        stat("/dev/input", &st);
-        if (st.st_mtime > lastInputMTime)
+        char buf[512];
+        bool changed = false;
+        while (read(ev_inotify_fd, buf, sizeof(buf)) > 0)
+            changed = true;
+        if (changed)
         {
             LOGI("Reloading input devices\n");
             ev_exit();
             ev_init();
-            lastInputMTime = st.st_mtime;
         }
-        lastInputStat = curr;
+    }
+    else
+    {
+        gettimeofday(&curr, NULL);
+        if(curr.tv_sec - lastInputStat.tv_sec >= 2)
+        {
+            struct stat st;
+            stat("/dev/input", &st);
+            if (st.st_mtime > lastInputMTime)
+            {
+                LOGI("Reloading input devices\n");
+                ev_exit();
+                ev_init();
+                lastInputMTime = st.st_mtime;
+            }
+            lastInputStat = curr;
+        }
     }
 
     r = poll(ev_fds, ev_count, timeout_ms);
 
     if(r > 0) {
+        // Everything each device has queued comes in with one read
         for(n = 0; n < ev_count; n++) {
+            ev_batch_pos[n] = ev_batch_len[n] = 0;
             if(ev_fds[n].revents & POLLIN) {
-                r = read(ev_fds[n].fd, ev, sizeof(*ev));
-                if(r == sizeof(*ev)) {
-                    if (!vk_modify(&evs[n], ev))
-                        return 0;
-                }
+                r = read(ev_fds[n].fd, ev_batch[n], sizeof(ev_batch[n]));
+                if(r > 0)
+                    ev_batch_len[n] = r / sizeof(struct input_event);
             }
         }
-        return -1;
+        return ev_get_batched(ev);
     }
 
     return -2;
@@ -35,6 +35,7 @@
 #include "../gui/placement.h"
 #include "minui.h"
 #include "graphics.h"
+#include "graphics_kernels.h"
 // For std::min and std::max
 #include <algorithm>
 
@@ -50,6 +51,10 @@ static int overscan_percent = OVERSCAN_PERCENT;
 static int overscan_offset_x = 0;
 static int overscan_offset_y = 0;
 
+// The region being redrawn, see gr_set_region()
+static bool gr_region_set = false;
+static int gr_region_x, gr_region_y, gr_region_w, gr_region_h;
+
 static unsigned char gr_current_r = 255;
 static unsigned char gr_current_g = 255;
 static unsigned char gr_current_b = 255;
@@ -60,6 +65,15 @@ static GGLContext *gr_context = 0;
 GGLSurface gr_mem_surface;
 static int gr_is_curr_clr_opaque = 0;
 
+// The pixel loops for gr_draw, NULL when its format has none. They take the
+// common cases of gr_fill(), gr_blit() and text; the rest goes to pixelflinger.
+static const gr_kernels* gr_kernel = NULL;
+static uint32_t gr_kernel_color = 0;
+static unsigned char gr_kernel_alpha = 255;
+
+// The scissor, in display coordinates
+static int gr_clip_l, gr_clip_t, gr_clip_r, gr_clip_b;
+
 int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, int placement, int scale)
 {
     GGLContext *gl = gr_context;
@@ -110,31 +124,114 @@ int gr_textEx_scaleW(int x, int y, const char *s, void* pFont, int max_width, in
     return gr_ttf_textExWH(gl, x, y + y_scale, s, vfont, measured_width + x, -1, gr_draw);
 }
 
-void gr_clip(int x, int y, int w, int h)
+static void set_scissor(int x, int y, int w, int h)
 {
     GGLContext *gl = gr_context;
 
 #if TW_ROTATION == 0
-    gl->scissor(gl, x, y, w, h);
+    int l_disp = x, t_disp = y, w_disp = w, h_disp = h;
 #elif TW_ROTATION == 90
-    gl->scissor(gl, gr_draw->width - y - h, x, h, w);
+    int l_disp = gr_draw->width - y - h, t_disp = x, w_disp = h, h_disp = w;
 #elif TW_ROTATION == 270
-    gl->scissor(gl, y, gr_draw->height - x - w, h, w);
+    int l_disp = y, t_disp = gr_draw->height - x - w, w_disp = h, h_disp = w;
 #else
-    int t_disp = gr_draw->height - y - h;
-    int l_disp = gr_draw->width - x - w;
-    gl->scissor(gl, l_disp, t_disp, w, h);
+    int l_disp = gr_draw->width - x - w, t_disp = gr_draw->height - y - h, w_disp = w, h_disp = h;
 #endif
+    gl->scissor(gl, l_disp, t_disp, w_disp, h_disp);
     gl->enable(gl, GGL_SCISSOR_TEST);
+
+    gr_clip_l = std::max(l_disp, 0);
+    gr_clip_t = std::max(t_disp, 0);
+    gr_clip_r = std::min(l_disp + w_disp, gr_draw->width);
+    gr_clip_b = std::min(t_disp + h_disp, gr_draw->height);
+}
+
+// Clips a rectangle in display coordinates to the scissor. False when
+// nothing is left.
+static bool clip_disp(int* l, int* t, int* r, int* b)
+{
+    *l = std::max(*l, gr_clip_l);
+    *t = std::max(*t, gr_clip_t);
+    *r = std::min(*r, gr_clip_r);
+    *b = std::min(*b, gr_clip_b);
+    return *l < *r && *t < *b;
+}
+
+static unsigned char* disp_pixel(int x, int y)
+{
+    return gr_draw->data + y * gr_draw->row_bytes + x * gr_draw->pixel_bytes;
+}
+
+void gr_clip(int x, int y, int w, int h)
+{
+    if (gr_region_set) {
+        // Keep the clip inside the region being redrawn
+        int r = std::min(x + w, gr_region_x + gr_region_w);
+        int b = std::min(y + h, gr_region_y + gr_region_h);
+        x = std::max(x, gr_region_x);
+        y = std::max(y, gr_region_y);
+        w = std::max(r - x, 0);
+        h = std::max(b - y, 0);
+    }
+    set_scissor(x, y, w, h);
 }
 
 void gr_noclip()
 {
     GGLContext *gl = gr_context;
+
+    if (gr_region_set) {
+        set_scissor(gr_region_x, gr_region_y, gr_region_w, gr_region_h);
+        return;
+    }
     gl->scissor(gl, 0, 0,
                 gr_draw->width - 2 * overscan_offset_x,
                 gr_draw->height - 2 * overscan_offset_y);
     gl->disable(gl, GGL_SCISSOR_TEST);
+
+    gr_clip_l = 0;
+    gr_clip_t = 0;
+    gr_clip_r = gr_draw->width;
+    gr_clip_b = gr_draw->height;
+}
+
+void gr_dump_frame_stats(void)
+{
+    if (gr_backend->dump_stats)
+        gr_backend->dump_stats(gr_backend);
+}
+
+int gr_flip_region_supported(void)
+{
+    return gr_backend->flip_region != NULL;
+}
+
+void gr_set_region(int x, int y, int w, int h)
+{
+    gr_region_set = false;
+    gr_clip(x, y, w, h);
+    gr_region_x = x;
+    gr_region_y = y;
+    gr_region_w = w;
+    gr_region_h = h;
+    gr_region_set = true;
+}
+
+int gr_get_region(int* x, int* y, int* w, int* h)
+{
+    if (!gr_region_set)
+        return 0;
+    *x = gr_region_x;
+    *y = gr_region_y;
+    *w = gr_region_w;
+    *h = gr_region_h;
+    return 1;
+}
+
+void gr_clear_region(void)
+{
+    gr_region_set = false;
+    gr_noclip();
 }
 
 void gr_line(int x0, int y0, int x1, int y1, int width)
@@ -210,6 +307,16 @@ void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a
     gl->color4xv(gl, color);
 
     gr_is_curr_clr_opaque = (a == 255);
+
+    // The same color as the pixel kernels want it, in the byte order of gr_draw
+#if defined(RECOVERY_ABGR) || defined(RECOVERY_BGRA)
+    std::swap(r, b);
+#endif
+    if (gr_draw && gr_draw->format == GGL_PIXEL_FORMAT_BGRA_8888)
+        std::swap(r, b);
+    unsigned char px[4] = { r, g, b, a };
+    memcpy(&gr_kernel_color, px, sizeof(px));
+    gr_kernel_alpha = a;
 }
 
 void gr_clear()
@@ -254,6 +361,18 @@ void gr_fill(int x, int y, int w, int h)
     t_disp = std::min(y0_disp, y1_disp);
     b_disp = std::max(y0_disp, y1_disp);
 
+    if (gr_kernel) {
+        if (gr_kernel_alpha != 0 && clip_disp(&l_disp, &t_disp, &r_disp, &b_disp)) {
+            if (gr_is_curr_clr_opaque)
+                gr_kernel->fill(disp_pixel(l_disp, t_disp), gr_draw->row_bytes,
+                                r_disp - l_disp, b_disp - t_disp, gr_kernel_color);
+            else
+                gr_kernel->fill_blend(disp_pixel(l_disp, t_disp), gr_draw->row_bytes,
+                                      r_disp - l_disp, b_disp - t_disp, gr_kernel_color);
+        }
+        return;
+    }
+
     gl->recti(gl, l_disp, t_disp, r_disp, b_disp);
 
     if(gr_is_curr_clr_opaque)
@@ -269,6 +388,26 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
     GGLContext *gl = gr_context;
     GGLSurface *surface = (GGLSurface*)source;
 
+#if TW_ROTATION == 0
+    bool opaque = surface->format == GGL_PIXEL_FORMAT_RGBX_8888;
+    if (gr_kernel && (opaque || surface->format == GGL_PIXEL_FORMAT_RGBA_8888) &&
+            sx >= 0 && sy >= 0 && w >= 0 && h >= 0 &&
+            sx + w <= (int)surface->width && sy + h <= (int)surface->height) {
+        int l = dx, t = dy, r = dx + w, b = dy + h;
+        if (clip_disp(&l, &t, &r, &b)) {
+            const uint8_t* src = surface->data + (sy + t - dy) * surface->stride * 4 +
+                                 (sx + l - dx) * 4;
+            if (opaque)
+                gr_kernel->copy(disp_pixel(l, t), gr_draw->row_bytes, src, surface->stride * 4,
+                                r - l, b - t);
+            else
+                gr_kernel->blend(disp_pixel(l, t), gr_draw->row_bytes, src, surface->stride * 4,
+                                 r - l, b - t);
+        }
+        return;
+    }
+#endif
+
     if(surface->format == GGL_PIXEL_FORMAT_RGBX_8888)
         gl->disable(gl, GGL_BLEND);
 
@@ -320,6 +459,19 @@ void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy)
         gl->enable(gl, GGL_BLEND);
 }
 
+int gr_kernel_glyph(const unsigned char* mask, int mask_stride, int x, int y, int w, int h)
+{
+    if (!gr_kernel)
+        return -1;
+
+    int l = x, t = y, r = x + w, b = y + h;
+    if (clip_disp(&l, &t, &r, &b))
+        gr_kernel->glyph(disp_pixel(l, t), gr_draw->row_bytes,
+                         mask + (t - y) * mask_stride + (l - x), mask_stride,
+                         r - l, b - t, gr_kernel_color);
+    return 0;
+}
+
 unsigned int gr_get_width(gr_surface surface) {
     if (surface == NULL) {
         return 0;
@@ -342,6 +494,31 @@ void gr_flip() {
     gr_context->colorBuffer(gr_context, &gr_mem_surface);
 }
 
+void gr_flip_region(int x, int y, int w, int h) {
+    if (!gr_backend->flip_region) {
+        gr_flip();
+        return;
+    }
+
+    // The rectangle on the surface, a pixel larger on each side to cover the
+    // rounding of the rotated coordinates
+    int x0_disp = ROTATION_X_DISP(x, y, gr_draw);
+    int y0_disp = ROTATION_Y_DISP(x, y, gr_draw);
+    int x1_disp = ROTATION_X_DISP(x + w, y + h, gr_draw);
+    int y1_disp = ROTATION_Y_DISP(x + w, y + h, gr_draw);
+    int l_disp = std::max(std::min(x0_disp, x1_disp) - 1, 0);
+    int r_disp = std::min(std::max(x0_disp, x1_disp) + 1, gr_draw->width);
+    int t_disp = std::max(std::min(y0_disp, y1_disp) - 1, 0);
+    int b_disp = std::min(std::max(y0_disp, y1_disp) + 1, gr_draw->height);
+    if (l_disp >= r_disp || t_disp >= b_disp) {
+        l_disp = t_disp = r_disp = b_disp = 0;
+    }
+
+    gr_draw = gr_backend->flip_region(gr_backend, l_disp, t_disp, r_disp - l_disp, b_disp - t_disp);
+    gr_mem_surface.data = (GGLubyte*)gr_draw->data;
+    gr_context->colorBuffer(gr_context, &gr_mem_surface);
+}
+
 static void get_memory_surface(GGLSurface* ms) {
     ms->version = sizeof(*ms);
     ms->width = gr_draw->width;
@@ -418,6 +595,17 @@ int gr_init(void)
     gl->enable(gl, GGL_BLEND);
     gl->blendFunc(gl, GGL_SRC_ALPHA, GGL_ONE_MINUS_SRC_ALPHA);
 
+    if ((gr_draw->format == GGL_PIXEL_FORMAT_RGBX_8888 ||
+            gr_draw->format == GGL_PIXEL_FORMAT_RGBA_8888) && gr_draw->pixel_bytes == 4)
+        gr_kernel = gr_get_kernels(GR_KERNEL_RGBX_8888, true);
+    else if (gr_draw->format == GGL_PIXEL_FORMAT_BGRA_8888 && gr_draw->pixel_bytes == 4)
+        gr_kernel = gr_get_kernels(GR_KERNEL_BGRA_8888, true);
+    else if (gr_draw->format == GGL_PIXEL_FORMAT_RGB_565 && gr_draw->pixel_bytes == 2)
+        gr_kernel = gr_get_kernels(GR_KERNEL_RGB_565, true);
+    if (gr_kernel)
+        printf("Using %s pixel kernels.\n", gr_kernel->name);
+    gr_noclip();
+
     gr_flip();
     gr_flip();
 
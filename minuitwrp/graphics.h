@@ -34,8 +34,28 @@ struct minui_backend {
 
     // Device cleanup when drawing is done.
     void (*exit)(minui_backend*);
+
+    // Like flip(), when only the given rectangle of the drawing surface
+    // changed since the previous flip. The surface returned must still hold
+    // the frame just displayed. NULL when the backend can't do that.
+    GRSurface* (*flip_region)(minui_backend*, int x, int y, int w, int h);
+
+    // Prints how presenting frames has gone so far. May be NULL.
+    void (*dump_stats)(minui_backend*);
 };
 
+// Copies the w x h rectangle at x, y of src to the same place in dst.
+void gr_copy_region(GRSurface* dst, const GRSurface* src, int x, int y, int w, int h);
+
+// Grows the rectangle x, y, w, h to also cover x2, y2, w2, h2. Empty rectangles
+// cover nothing.
+void gr_union_region(int* x, int* y, int* w, int* h, int x2, int y2, int w2, int h2);
+
+// Draws an 8 bit coverage mask at x, y of the display in the current color
+// and clip, the way text is drawn. Returns -1, without drawing, when gr_draw
+// has no pixel kernels.
+int gr_kernel_glyph(const unsigned char* mask, int mask_stride, int x, int y, int w, int h);
+
 minui_backend* open_fbdev();
 minui_backend* open_adf();
 minui_backend* open_drm();
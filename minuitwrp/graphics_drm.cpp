@@ -15,7 +15,9 @@
  */
 
 #include <drm_fourcc.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,6 +26,7 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
@@ -40,15 +43,57 @@ struct drm_surface {
     uint32_t handle;
 };
 
-static drm_surface *drm_surfaces[2];
+// With three buffers the next frame is copied out while the one before it
+// waits for vsync; two are enough if there isn't memory for the third
+#define DRM_MAX_BUFFERS 3
+
+// How long a flip may take before we stop waiting for it
+#define DRM_FLIP_TIMEOUT_MS 100
+
+struct drm_rect {
+    int x, y, w, h;
+};
+
+static drm_surface *drm_surfaces[DRM_MAX_BUFFERS];
+static int buffer_count;
+// The buffer the next frame goes into, the one on screen, and the one
+// queued to be shown at the next vsync (-1 when none is)
 static int current_buffer;
+static int front_buffer;
+static int pending_buffer = -1;
 static GRSurface *draw_buf = NULL;
+// What changed in the previous flips, newest first, which the buffer drawn
+// next missed
+static drm_rect last_regions[DRM_MAX_BUFFERS - 1];
 
 static drmModeCrtc *main_monitor_crtc;
 static drmModeConnector *main_monitor_connector;
 
 static int drm_fd = -1;
 
+// The primary plane of the crtc and its FB_ID property when flips are
+// atomic commits; 0 when they are legacy page flips
+static uint32_t primary_plane_id;
+static uint32_t fb_id_property;
+
+static struct {
+    unsigned frames;          // flips that reached the screen
+    unsigned intervals;       // ...that followed the previous one closely
+    unsigned late;            // ...and came more than a refresh after it
+    uint64_t interval_us;
+    uint64_t max_interval_us;
+    uint64_t last_present_us;
+    unsigned waits;           // flips that had to wait for the one before
+    uint64_t wait_us;
+    uint64_t refresh_us;
+} frame_stats;
+
+static uint64_t drm_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void drm_disable_crtc(int drm_fd, drmModeCrtc *crtc) {
     if (crtc) {
         drmModeSetCrtc(drm_fd, crtc->crtc_id,
@@ -75,12 +120,93 @@ static void drm_enable_crtc(int drm_fd, drmModeCrtc *crtc,
         printf("drmModeSetCrtc failed ret=%d\n", ret);
 }
 
+static void drm_page_flip_handler(int fd __unused, unsigned int frame __unused,
+                                  unsigned int sec, unsigned int usec, void* data __unused) {
+    uint64_t now = (uint64_t) sec * 1000000 + usec;
+
+    front_buffer = pending_buffer;
+    pending_buffer = -1;
+
+    frame_stats.frames++;
+    // Gaps of a few refreshes are animation frames that came late; longer
+    // ones are the GUI sitting idle
+    uint64_t interval = now - frame_stats.last_present_us;
+    if (frame_stats.last_present_us && interval < 4 * frame_stats.refresh_us) {
+        frame_stats.intervals++;
+        frame_stats.interval_us += interval;
+        if (interval > frame_stats.max_interval_us)
+            frame_stats.max_interval_us = interval;
+        if (interval > frame_stats.refresh_us * 3 / 2)
+            frame_stats.late++;
+    }
+    frame_stats.last_present_us = now;
+}
+
+// Waits until the queued flip is on screen, which frees the buffer that was
+// on screen before it
+static void drm_wait_for_flip() {
+    drmEventContext ev;
+    uint64_t start;
+
+    if (pending_buffer < 0)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.version = 2;
+    ev.page_flip_handler = drm_page_flip_handler;
+
+    start = drm_now_us();
+    while (pending_buffer >= 0) {
+        struct pollfd pfd = { drm_fd, POLLIN, 0 };
+        int ret = poll(&pfd, 1, DRM_FLIP_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            printf("page flip did not complete\n");
+            front_buffer = pending_buffer;
+            pending_buffer = -1;
+            break;
+        }
+        drmHandleEvent(drm_fd, &ev);
+    }
+    frame_stats.waits++;
+    frame_stats.wait_us += drm_now_us() - start;
+}
+
+// Shows the buffer at the next vsync, without waiting for it
+static int drm_queue_flip(int buffer) {
+    uint32_t fb_id = drm_surfaces[buffer]->fb_id;
+    int ret;
+
+#ifdef DRM_MODE_ATOMIC_NONBLOCK
+    if (primary_plane_id) {
+        drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+        ret = -1;
+        if (req && drmModeAtomicAddProperty(req, primary_plane_id, fb_id_property, fb_id) >= 0)
+            ret = drmModeAtomicCommit(drm_fd, req,
+                                      DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, NULL);
+        drmModeAtomicFree(req);
+        if (ret == 0)
+            return 0;
+        printf("drmModeAtomicCommit failed ret=%d, using page flips\n", ret);
+        primary_plane_id = 0;
+    }
+#endif
+
+    ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id, fb_id,
+                          DRM_MODE_PAGE_FLIP_EVENT, NULL);
+    if (ret < 0)
+        printf("drmModePageFlip failed ret=%d\n", ret);
+    return ret;
+}
+
 static void drm_blank(minui_backend* backend __unused, bool blank) {
+    drm_wait_for_flip();
     if (blank)
         drm_disable_crtc(drm_fd, main_monitor_crtc);
     else
         drm_enable_crtc(drm_fd, main_monitor_crtc,
-                        drm_surfaces[current_buffer]);
+                        drm_surfaces[front_buffer]);
 }
 
 static void drm_destroy_surface(struct drm_surface *surface) {
@@ -363,6 +489,68 @@ static void disable_non_main_crtcs(int fd,
     }
 }
 
+#ifdef DRM_MODE_ATOMIC_NONBLOCK
+// Looks for the primary plane of the main crtc, so that a flip can be an
+// atomic commit of just its FB_ID
+static void drm_init_atomic(drmModeRes *resources) {
+    drmModePlaneRes *planes;
+    int crtc_index = -1;
+    int i;
+
+    if (drmSetClientCap(drm_fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+            drmSetClientCap(drm_fd, DRM_CLIENT_CAP_ATOMIC, 1))
+        return;
+
+    for (i = 0; i < resources->count_crtcs; i++) {
+        if (resources->crtcs[i] == main_monitor_crtc->crtc_id)
+            crtc_index = i;
+    }
+    planes = drmModeGetPlaneResources(drm_fd);
+    if (crtc_index < 0 || !planes) {
+        drmModeFreePlaneResources(planes);
+        return;
+    }
+
+    for (uint32_t p = 0; p < planes->count_planes && !primary_plane_id; p++) {
+        drmModePlane *plane = drmModeGetPlane(drm_fd, planes->planes[p]);
+        if (!plane)
+            continue;
+        if (plane->possible_crtcs & (1 << crtc_index)) {
+            drmModeObjectProperties *props = drmModeObjectGetProperties(drm_fd,
+                    plane->plane_id, DRM_MODE_OBJECT_PLANE);
+            bool primary = false;
+            uint32_t fb_prop = 0;
+
+            for (uint32_t j = 0; props && j < props->count_props; j++) {
+                drmModePropertyRes *prop = drmModeGetProperty(drm_fd, props->props[j]);
+                if (!prop)
+                    continue;
+                if (!strcmp(prop->name, "type"))
+                    primary = props->prop_values[j] == DRM_PLANE_TYPE_PRIMARY;
+                else if (!strcmp(prop->name, "FB_ID"))
+                    fb_prop = prop->prop_id;
+                drmModeFreeProperty(prop);
+            }
+            drmModeFreeObjectProperties(props);
+            if (primary && fb_prop) {
+                primary_plane_id = plane->plane_id;
+                fb_id_property = fb_prop;
+            }
+        }
+        drmModeFreePlane(plane);
+    }
+    drmModeFreePlaneResources(planes);
+}
+#endif
+
+static void drm_destroy_surfaces() {
+    for (int i = 0; i < DRM_MAX_BUFFERS; i++) {
+        drm_destroy_surface(drm_surfaces[i]);
+        drm_surfaces[i] = NULL;
+    }
+    buffer_count = 0;
+}
+
 static GRSurface* drm_init(minui_backend* backend __unused) {
     drmModeRes *res = NULL;
     uint32_t selected_mode;
@@ -439,14 +627,20 @@ static GRSurface* drm_init(minui_backend* backend __unused) {
     width = main_monitor_crtc->mode.hdisplay;
     height = main_monitor_crtc->mode.vdisplay;
 
+#ifdef DRM_MODE_ATOMIC_NONBLOCK
+    drm_init_atomic(res);
+#endif
+    printf("DRM flips are %s\n", primary_plane_id ? "atomic commits" : "page flips");
+
     drmModeFreeResources(res);
 
-    drm_surfaces[0] = drm_create_surface(width, height);
-    drm_surfaces[1] = drm_create_surface(width, height);
-    if (!drm_surfaces[0] || !drm_surfaces[1]) {
-        drm_destroy_surface(drm_surfaces[0]);
-        drm_destroy_surface(drm_surfaces[1]);
-        drmModeFreeResources(res);
+    for (buffer_count = 0; buffer_count < DRM_MAX_BUFFERS; buffer_count++) {
+        drm_surfaces[buffer_count] = drm_create_surface(width, height);
+        if (!drm_surfaces[buffer_count])
+            break;
+    }
+    if (buffer_count < 2) {
+        drm_destroy_surfaces();
         close(drm_fd);
         return NULL;
     }
@@ -454,9 +648,7 @@ static GRSurface* drm_init(minui_backend* backend __unused) {
     draw_buf = (GRSurface *)malloc(sizeof(GRSurface));
     if (!draw_buf) {
         printf("failed to alloc draw_buf\n");
-        drm_destroy_surface(drm_surfaces[0]);
-        drm_destroy_surface(drm_surfaces[1]);
-        drmModeFreeResources(res);
+        drm_destroy_surfaces();
         close(drm_fd);
         return NULL;
     }
@@ -466,40 +658,81 @@ static GRSurface* drm_init(minui_backend* backend __unused) {
     if (!draw_buf->data) {
         printf("failed to alloc draw_buf surface\n");
         free(draw_buf);
-        drm_destroy_surface(drm_surfaces[0]);
-        drm_destroy_surface(drm_surfaces[1]);
-        drmModeFreeResources(res);
+        drm_destroy_surfaces();
         close(drm_fd);
         return NULL;
     }
 
+    memset(&frame_stats, 0, sizeof(frame_stats));
+    frame_stats.refresh_us = 1000000 / (main_monitor_crtc->mode.vrefresh ? main_monitor_crtc->mode.vrefresh : 60);
+    memset(last_regions, 0, sizeof(last_regions));
     current_buffer = 0;
+    front_buffer = buffer_count - 1;
+    pending_buffer = -1;
 
-    drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[1]);
+    drm_enable_crtc(drm_fd, main_monitor_crtc, drm_surfaces[front_buffer]);
 
     return draw_buf;
 }
 
-static GRSurface* drm_flip(minui_backend* backend __unused) {
-    int ret;
-    memcpy(drm_surfaces[current_buffer]->base.data,
-            draw_buf->data, draw_buf->height * draw_buf->row_bytes);
+// Copies the changed part of the frame into the next buffer and queues it.
+// The copy overlaps the scanout of the frame before; only queueing the flip
+// waits for vsync, so no more frames are made than the screen can show.
+static GRSurface* drm_present(int x, int y, int w, int h) {
+    int l = x, t = y, cw = w, ch = h;
+    int i;
 
+    // With two buffers the next one is on screen until the queued flip lands
+    if (current_buffer == front_buffer || current_buffer == pending_buffer)
+        drm_wait_for_flip();
 
-    ret = drmModePageFlip(drm_fd, main_monitor_crtc->crtc_id,
-                          drm_surfaces[current_buffer]->fb_id, 0, NULL);
-    if (ret < 0) {
-        printf("drmModePageFlip failed ret=%d\n", ret);
+    // The buffer was last written buffer_count flips ago
+    for (i = 0; i < buffer_count - 1; i++)
+        gr_union_region(&l, &t, &cw, &ch, last_regions[i].x, last_regions[i].y,
+                        last_regions[i].w, last_regions[i].h);
+    if (cw > 0 && ch > 0)
+        gr_copy_region(&drm_surfaces[current_buffer]->base, draw_buf, l, t, cw, ch);
+
+    drm_wait_for_flip();
+    if (drm_queue_flip(current_buffer) < 0)
         return NULL;
-    }
-    current_buffer = 1 - current_buffer;
+    pending_buffer = current_buffer;
+    current_buffer = (current_buffer + 1) % buffer_count;
+
+    for (i = DRM_MAX_BUFFERS - 2; i > 0; i--)
+        last_regions[i] = last_regions[i - 1];
+    last_regions[0].x = x;
+    last_regions[0].y = y;
+    last_regions[0].w = w;
+    last_regions[0].h = h;
     return draw_buf;
 }
 
-static void drm_exit(minui_backend* backend __unused) {
+static GRSurface* drm_flip(minui_backend* backend __unused) {
+    return drm_present(0, 0, draw_buf->width, draw_buf->height);
+}
+
+static GRSurface* drm_flip_region(minui_backend* backend __unused, int x, int y, int w, int h) {
+    return drm_present(x, y, w, h);
+}
+
+static void drm_dump_stats(minui_backend* backend __unused) {
+    printf("DRM frame stats: %u frames shown with %d buffers and %s\n", frame_stats.frames,
+           buffer_count, primary_plane_id ? "atomic commits" : "page flips");
+    if (frame_stats.intervals)
+        printf("  Frame time: avg %.2f ms, max %.2f ms, %u of %u later than one refresh (%.2f ms)\n",
+               frame_stats.interval_us / 1000.0 / frame_stats.intervals,
+               frame_stats.max_interval_us / 1000.0, frame_stats.late, frame_stats.intervals,
+               frame_stats.refresh_us / 1000.0);
+    printf("  Waited for vsync %u times, %.2f ms in total\n", frame_stats.waits,
+           frame_stats.wait_us / 1000.0);
+}
+
+static void drm_exit(minui_backend* backend) {
+    drm_wait_for_flip();
+    drm_dump_stats(backend);
     drm_disable_crtc(drm_fd, main_monitor_crtc);
-    drm_destroy_surface(drm_surfaces[0]);
-    drm_destroy_surface(drm_surfaces[1]);
+    drm_destroy_surfaces();
     drmModeFreeCrtc(main_monitor_crtc);
     drmModeFreeConnector(main_monitor_connector);
     close(drm_fd);
@@ -511,6 +744,8 @@ static minui_backend drm_backend = {
     .flip = drm_flip,
     .blank = drm_blank,
     .exit = drm_exit,
+    .flip_region = drm_flip_region,
+    .dump_stats = drm_dump_stats,
 };
 
 minui_backend* open_drm() {
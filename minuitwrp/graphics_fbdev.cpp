@@ -36,6 +36,9 @@
 
 static GRSurface* fbdev_init(minui_backend*);
 static GRSurface* fbdev_flip(minui_backend*);
+#if !defined(RECOVERY_BGRA)
+static GRSurface* fbdev_flip_region(minui_backend*, int x, int y, int w, int h);
+#endif
 static void fbdev_blank(minui_backend*, bool);
 static void fbdev_exit(minui_backend*);
 
@@ -43,6 +46,9 @@ static GRSurface gr_framebuffer[2];
 static bool double_buffered;
 static GRSurface* gr_draw = NULL;
 static int displayed_buffer;
+// What changed in the previous flip; with double buffering the framebuffer
+// drawn next missed it
+static int last_x, last_y, last_w, last_h;
 
 static fb_var_screeninfo vi;
 static int fb_fd = -1;
@@ -53,6 +59,11 @@ static minui_backend my_backend = {
     .flip = fbdev_flip,
     .blank = fbdev_blank,
     .exit = fbdev_exit,
+#if !defined(RECOVERY_BGRA)
+    // BGRA swaps the bytes of the drawing surface in place, so it has to be
+    // redrawn in full every time
+    .flip_region = fbdev_flip_region,
+#endif
 };
 
 minui_backend* open_fbdev() {
@@ -303,9 +314,31 @@ static GRSurface* fbdev_flip(minui_backend* backend __unused) {
         memcpy(gr_framebuffer[0].data, gr_draw->data,
                gr_draw->height * gr_draw->row_bytes);
     }
+    last_x = last_y = 0;
+    last_w = gr_draw->width;
+    last_h = gr_draw->height;
     return gr_draw;
 }
 
+#if !defined(RECOVERY_BGRA)
+static GRSurface* fbdev_flip_region(minui_backend* backend __unused, int x, int y, int w, int h) {
+    if (double_buffered) {
+        int l = x, t = y, cw = w, ch = h;
+        gr_union_region(&l, &t, &cw, &ch, last_x, last_y, last_w, last_h);
+        if (cw > 0 && ch > 0)
+            gr_copy_region(&gr_framebuffer[1-displayed_buffer], gr_draw, l, t, cw, ch);
+        set_displayed_framebuffer(1-displayed_buffer);
+    } else if (w > 0 && h > 0) {
+        gr_copy_region(&gr_framebuffer[0], gr_draw, x, y, w, h);
+    }
+    last_x = x;
+    last_y = y;
+    last_w = w;
+    last_h = h;
+    return gr_draw;
+}
+#endif
+
 static void fbdev_exit(minui_backend* backend __unused) {
     close(fb_fd);
     fb_fd = -1;
@@ -0,0 +1,633 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "graphics_kernels.h"
+
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GR_KERNELS_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define GR_KERNELS_SSE2 1
+#endif
+
+// Everything below computes exactly the same values, so the SIMD loops can
+// hand their leftover pixels to the plain C ones.
+
+// x / 255, rounded, for x up to 255 * 255
+static inline uint8_t div255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static inline uint8_t mix(uint8_t s, uint8_t d, uint8_t a) {
+    return div255(s * a + d * (255 - a));
+}
+
+static inline void unpack_565(uint16_t p, uint8_t* c) {
+    uint8_t r = p >> 11, g = (p >> 5) & 0x3f, b = p & 0x1f;
+    c[0] = (r << 3) | (r >> 2);
+    c[1] = (g << 2) | (g >> 4);
+    c[2] = (b << 3) | (b >> 2);
+}
+
+static inline uint16_t pack_565(uint8_t r, uint8_t g, uint8_t b) {
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+}
+
+// Images are R, G, B, A; BGRA surfaces want the first and third swapped.
+template <bool swap>
+static inline void blend_pixel_32(uint8_t* d, const uint8_t* s, uint8_t a) {
+    uint8_t r = s[swap ? 2 : 0], b = s[swap ? 0 : 2];
+    d[0] = mix(r, d[0], a);
+    d[1] = mix(s[1], d[1], a);
+    d[2] = mix(b, d[2], a);
+    d[3] = mix(s[3], d[3], a);
+}
+
+static inline void blend_pixel_565(uint16_t* d, const uint8_t* s, uint8_t a) {
+    uint8_t c[3];
+    unpack_565(*d, c);
+    *d = pack_565(mix(s[0], c[0], a), mix(s[1], c[1], a), mix(s[2], c[2], a));
+}
+
+static void fill_32_c(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        uint32_t* p = reinterpret_cast<uint32_t*>(dst);
+        for (int x = 0; x < w; x++) p[x] = color;
+    }
+}
+
+static void fill_blend_32_c(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        for (int x = 0; x < w; x++) blend_pixel_32<false>(dst + x * 4, c, c[3]);
+    }
+}
+
+template <bool swap>
+static void copy_32_c(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                      int h) {
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        if (!swap) {
+            memcpy(dst, src, w * 4);
+            continue;
+        }
+        for (int x = 0; x < w; x++) {
+            dst[x * 4] = src[x * 4 + 2];
+            dst[x * 4 + 1] = src[x * 4 + 1];
+            dst[x * 4 + 2] = src[x * 4];
+            dst[x * 4 + 3] = src[x * 4 + 3];
+        }
+    }
+}
+
+template <bool swap>
+static void blend_32_c(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                       int h) {
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        for (int x = 0; x < w; x++) blend_pixel_32<swap>(dst + x * 4, src + x * 4, src[x * 4 + 3]);
+    }
+}
+
+static void glyph_32_c(uint8_t* dst, int dst_stride, const uint8_t* mask, int mask_stride, int w,
+                       int h, uint32_t color) {
+    uint8_t c[4];
+    memcpy(c, &color, sizeof(c));
+    for (int y = 0; y < h; y++, dst += dst_stride, mask += mask_stride) {
+        for (int x = 0; x < w; x++) {
+            // The coverage takes the place of the alpha
+            c[3] = mask[x];
+            blend_pixel_32<false>(dst + x * 4, c, mask[x]);
+        }
+    }
+}
+
+static void fill_565_c(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    uint16_t pixel = pack_565(c[0], c[1], c[2]);
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        uint16_t* p = reinterpret_cast<uint16_t*>(dst);
+        for (int x = 0; x < w; x++) p[x] = pixel;
+    }
+}
+
+static void fill_blend_565_c(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        uint16_t* p = reinterpret_cast<uint16_t*>(dst);
+        for (int x = 0; x < w; x++) blend_pixel_565(p + x, c, c[3]);
+    }
+}
+
+static void copy_565_c(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                       int h) {
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        uint16_t* p = reinterpret_cast<uint16_t*>(dst);
+        for (int x = 0; x < w; x++) p[x] = pack_565(src[x * 4], src[x * 4 + 1], src[x * 4 + 2]);
+    }
+}
+
+static void blend_565_c(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                        int h) {
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        uint16_t* p = reinterpret_cast<uint16_t*>(dst);
+        for (int x = 0; x < w; x++) blend_pixel_565(p + x, src + x * 4, src[x * 4 + 3]);
+    }
+}
+
+static void glyph_565_c(uint8_t* dst, int dst_stride, const uint8_t* mask, int mask_stride, int w,
+                        int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    for (int y = 0; y < h; y++, dst += dst_stride, mask += mask_stride) {
+        uint16_t* p = reinterpret_cast<uint16_t*>(dst);
+        for (int x = 0; x < w; x++) blend_pixel_565(p + x, c, mask[x]);
+    }
+}
+
+static const gr_kernels kernels_rgbx_c = {
+    "c", fill_32_c, fill_blend_32_c, copy_32_c<false>, blend_32_c<false>, glyph_32_c,
+};
+static const gr_kernels kernels_bgra_c = {
+    "c", fill_32_c, fill_blend_32_c, copy_32_c<true>, blend_32_c<true>, glyph_32_c,
+};
+static const gr_kernels kernels_565_c = {
+    "c", fill_565_c, fill_blend_565_c, copy_565_c, blend_565_c, glyph_565_c,
+};
+
+#if defined(GR_KERNELS_NEON)
+
+// Eight pixels at a time, with the channels in separate registers
+
+static inline uint8x8_t mix_neon(uint8x8_t s, uint8x8_t d, uint8x8_t a) {
+    uint16x8_t x = vmlal_u8(vmull_u8(s, a), d, vmvn_u8(a));
+    x = vaddq_u16(x, vdupq_n_u16(128));
+    x = vaddq_u16(x, vshrq_n_u16(x, 8));
+    return vshrn_n_u16(x, 8);
+}
+
+static inline uint8x8x3_t unpack_565_neon(uint16x8_t p) {
+    uint8x8x3_t c;
+    uint8x8_t r = vmovn_u16(vshrq_n_u16(p, 11));
+    uint8x8_t g = vmovn_u16(vandq_u16(vshrq_n_u16(p, 5), vdupq_n_u16(0x3f)));
+    uint8x8_t b = vmovn_u16(vandq_u16(p, vdupq_n_u16(0x1f)));
+    c.val[0] = vorr_u8(vshl_n_u8(r, 3), vshr_n_u8(r, 2));
+    c.val[1] = vorr_u8(vshl_n_u8(g, 2), vshr_n_u8(g, 4));
+    c.val[2] = vorr_u8(vshl_n_u8(b, 3), vshr_n_u8(b, 2));
+    return c;
+}
+
+static inline uint16x8_t pack_565_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b) {
+    uint16x8_t p = vshlq_n_u16(vmovl_u8(vshr_n_u8(r, 3)), 11);
+    p = vorrq_u16(p, vshlq_n_u16(vmovl_u8(vshr_n_u8(g, 2)), 5));
+    return vorrq_u16(p, vmovl_u8(vshr_n_u8(b, 3)));
+}
+
+static void fill_32_neon(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    uint32x4_t v = vdupq_n_u32(color);
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        uint32_t* p = reinterpret_cast<uint32_t*>(dst);
+        int x = 0;
+        for (; x + 4 <= w; x += 4) vst1q_u32(p + x, v);
+        for (; x < w; x++) p[x] = color;
+    }
+}
+
+static void fill_blend_32_neon(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    uint8x8_t s0 = vdup_n_u8(c[0]), s1 = vdup_n_u8(c[1]), s2 = vdup_n_u8(c[2]);
+    uint8x8_t a = vdup_n_u8(c[3]);
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            uint8x8x4_t d = vld4_u8(dst + x * 4);
+            d.val[0] = mix_neon(s0, d.val[0], a);
+            d.val[1] = mix_neon(s1, d.val[1], a);
+            d.val[2] = mix_neon(s2, d.val[2], a);
+            d.val[3] = mix_neon(a, d.val[3], a);
+            vst4_u8(dst + x * 4, d);
+        }
+        fill_blend_32_c(dst + x * 4, dst_stride, w - x, 1, color);
+    }
+}
+
+template <bool swap>
+static void copy_32_neon(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                         int h) {
+    if (!swap) {
+        copy_32_c<false>(dst, dst_stride, src, src_stride, w, h);
+        return;
+    }
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            uint8x8x4_t s = vld4_u8(src + x * 4);
+            uint8x8_t r = s.val[0];
+            s.val[0] = s.val[2];
+            s.val[2] = r;
+            vst4_u8(dst + x * 4, s);
+        }
+        copy_32_c<true>(dst + x * 4, dst_stride, src + x * 4, src_stride, w - x, 1);
+    }
+}
+
+template <bool swap>
+static void blend_32_neon(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                          int h) {
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            uint8x8x4_t s = vld4_u8(src + x * 4);
+            uint8x8x4_t d = vld4_u8(dst + x * 4);
+            uint8x8_t a = s.val[3];
+            d.val[0] = mix_neon(s.val[swap ? 2 : 0], d.val[0], a);
+            d.val[1] = mix_neon(s.val[1], d.val[1], a);
+            d.val[2] = mix_neon(s.val[swap ? 0 : 2], d.val[2], a);
+            d.val[3] = mix_neon(a, d.val[3], a);
+            vst4_u8(dst + x * 4, d);
+        }
+        blend_32_c<swap>(dst + x * 4, dst_stride, src + x * 4, src_stride, w - x, 1);
+    }
+}
+
+static void glyph_32_neon(uint8_t* dst, int dst_stride, const uint8_t* mask, int mask_stride,
+                          int w, int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    uint8x8_t s0 = vdup_n_u8(c[0]), s1 = vdup_n_u8(c[1]), s2 = vdup_n_u8(c[2]);
+    for (int y = 0; y < h; y++, dst += dst_stride, mask += mask_stride) {
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            uint8x8_t k = vld1_u8(mask + x);
+            uint8x8x4_t d = vld4_u8(dst + x * 4);
+            d.val[0] = mix_neon(s0, d.val[0], k);
+            d.val[1] = mix_neon(s1, d.val[1], k);
+            d.val[2] = mix_neon(s2, d.val[2], k);
+            d.val[3] = mix_neon(k, d.val[3], k);
+            vst4_u8(dst + x * 4, d);
+        }
+        glyph_32_c(dst + x * 4, dst_stride, mask + x, mask_stride, w - x, 1, color);
+    }
+}
+
+static void fill_565_neon(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    uint16_t pixel = pack_565(c[0], c[1], c[2]);
+    uint16x8_t v = vdupq_n_u16(pixel);
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        uint16_t* p = reinterpret_cast<uint16_t*>(dst);
+        int x = 0;
+        for (; x + 8 <= w; x += 8) vst1q_u16(p + x, v);
+        for (; x < w; x++) p[x] = pixel;
+    }
+}
+
+static void fill_blend_565_neon(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    uint8x8_t s0 = vdup_n_u8(c[0]), s1 = vdup_n_u8(c[1]), s2 = vdup_n_u8(c[2]);
+    uint8x8_t a = vdup_n_u8(c[3]);
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        uint16_t* p = reinterpret_cast<uint16_t*>(dst);
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            uint8x8x3_t d = unpack_565_neon(vld1q_u16(p + x));
+            vst1q_u16(p + x, pack_565_neon(mix_neon(s0, d.val[0], a), mix_neon(s1, d.val[1], a),
+                                           mix_neon(s2, d.val[2], a)));
+        }
+        fill_blend_565_c(dst + x * 2, dst_stride, w - x, 1, color);
+    }
+}
+
+static void copy_565_neon(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                          int h) {
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        uint16_t* p = reinterpret_cast<uint16_t*>(dst);
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            uint8x8x4_t s = vld4_u8(src + x * 4);
+            vst1q_u16(p + x, pack_565_neon(s.val[0], s.val[1], s.val[2]));
+        }
+        copy_565_c(dst + x * 2, dst_stride, src + x * 4, src_stride, w - x, 1);
+    }
+}
+
+static void blend_565_neon(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                           int h) {
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        uint16_t* p = reinterpret_cast<uint16_t*>(dst);
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            uint8x8x4_t s = vld4_u8(src + x * 4);
+            uint8x8x3_t d = unpack_565_neon(vld1q_u16(p + x));
+            uint8x8_t a = s.val[3];
+            vst1q_u16(p + x, pack_565_neon(mix_neon(s.val[0], d.val[0], a),
+                                           mix_neon(s.val[1], d.val[1], a),
+                                           mix_neon(s.val[2], d.val[2], a)));
+        }
+        blend_565_c(dst + x * 2, dst_stride, src + x * 4, src_stride, w - x, 1);
+    }
+}
+
+static void glyph_565_neon(uint8_t* dst, int dst_stride, const uint8_t* mask, int mask_stride,
+                           int w, int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    uint8x8_t s0 = vdup_n_u8(c[0]), s1 = vdup_n_u8(c[1]), s2 = vdup_n_u8(c[2]);
+    for (int y = 0; y < h; y++, dst += dst_stride, mask += mask_stride) {
+        uint16_t* p = reinterpret_cast<uint16_t*>(dst);
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            uint8x8_t k = vld1_u8(mask + x);
+            uint8x8x3_t d = unpack_565_neon(vld1q_u16(p + x));
+            vst1q_u16(p + x, pack_565_neon(mix_neon(s0, d.val[0], k), mix_neon(s1, d.val[1], k),
+                                           mix_neon(s2, d.val[2], k)));
+        }
+        glyph_565_c(dst + x * 2, dst_stride, mask + x, mask_stride, w - x, 1, color);
+    }
+}
+
+static const gr_kernels kernels_rgbx_simd = {
+    "neon",           fill_32_neon,        fill_blend_32_neon, copy_32_neon<false>,
+    blend_32_neon<false>, glyph_32_neon,
+};
+static const gr_kernels kernels_bgra_simd = {
+    "neon",          fill_32_neon,       fill_blend_32_neon, copy_32_neon<true>,
+    blend_32_neon<true>, glyph_32_neon,
+};
+static const gr_kernels kernels_565_simd = {
+    "neon", fill_565_neon, fill_blend_565_neon, copy_565_neon, blend_565_neon, glyph_565_neon,
+};
+
+#elif defined(GR_KERNELS_SSE2)
+
+// Four pixels at a time for 32 bit surfaces, eight for 565. Channels are
+// widened to 16 bit lanes for the arithmetic.
+
+static inline __m128i mix_sse2(__m128i s, __m128i d, __m128i a) {
+    __m128i ia = _mm_xor_si128(a, _mm_set1_epi16(255));
+    __m128i x = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, ia));
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    x = _mm_add_epi16(x, _mm_srli_epi16(x, 8));
+    return _mm_srli_epi16(x, 8);
+}
+
+// Lanes 0-3 and 4-7 of a widened pixel pair: the alpha of each pixel in all
+// four lanes, or the first and third channel swapped
+static inline __m128i alpha_sse2(__m128i p) {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 3, 3, 3)),
+                               _MM_SHUFFLE(3, 3, 3, 3));
+}
+
+static inline __m128i swap_sse2(__m128i p) {
+    return _mm_shufflehi_epi16(_mm_shufflelo_epi16(p, _MM_SHUFFLE(3, 0, 1, 2)),
+                               _MM_SHUFFLE(3, 0, 1, 2));
+}
+
+// The three color channels of eight 565 pixels, widened to 8 bits in 16 bit lanes
+static inline void unpack_565_sse2(__m128i p, __m128i* r, __m128i* g, __m128i* b) {
+    __m128i r5 = _mm_srli_epi16(p, 11);
+    __m128i g6 = _mm_and_si128(_mm_srli_epi16(p, 5), _mm_set1_epi16(0x3f));
+    __m128i b5 = _mm_and_si128(p, _mm_set1_epi16(0x1f));
+    *r = _mm_or_si128(_mm_slli_epi16(r5, 3), _mm_srli_epi16(r5, 2));
+    *g = _mm_or_si128(_mm_slli_epi16(g6, 2), _mm_srli_epi16(g6, 4));
+    *b = _mm_or_si128(_mm_slli_epi16(b5, 3), _mm_srli_epi16(b5, 2));
+}
+
+static inline __m128i pack_565_sse2(__m128i r, __m128i g, __m128i b) {
+    __m128i p = _mm_slli_epi16(_mm_srli_epi16(r, 3), 11);
+    p = _mm_or_si128(p, _mm_slli_epi16(_mm_srli_epi16(g, 2), 5));
+    return _mm_or_si128(p, _mm_srli_epi16(b, 3));
+}
+
+// One channel of eight R, G, B, A pixels in 16 bit lanes
+static inline __m128i channel_sse2(__m128i lo, __m128i hi, int shift) {
+    __m128i mask = _mm_set1_epi32(0xff);
+    return _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, shift), mask),
+                           _mm_and_si128(_mm_srli_epi32(hi, shift), mask));
+}
+
+static void fill_32_sse2(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    __m128i v = _mm_set1_epi32(color);
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        int x = 0;
+        for (; x + 4 <= w; x += 4) _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), v);
+        fill_32_c(dst + x * 4, dst_stride, w - x, 1, color);
+    }
+}
+
+static void fill_blend_32_sse2(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i s = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+    __m128i a = alpha_sse2(s);
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        int x = 0;
+        for (; x + 4 <= w; x += 4) {
+            __m128i* p = reinterpret_cast<__m128i*>(dst + x * 4);
+            __m128i d = _mm_loadu_si128(p);
+            __m128i lo = mix_sse2(s, _mm_unpacklo_epi8(d, zero), a);
+            __m128i hi = mix_sse2(s, _mm_unpackhi_epi8(d, zero), a);
+            _mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+        }
+        fill_blend_32_c(dst + x * 4, dst_stride, w - x, 1, color);
+    }
+}
+
+template <bool swap>
+static void copy_32_sse2(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                         int h) {
+    if (!swap) {
+        copy_32_c<false>(dst, dst_stride, src, src_stride, w, h);
+        return;
+    }
+    __m128i keep = _mm_set1_epi32(0xff00ff00), low = _mm_set1_epi32(0xff);
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        int x = 0;
+        for (; x + 4 <= w; x += 4) {
+            __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4));
+            __m128i p = _mm_and_si128(s, keep);
+            p = _mm_or_si128(p, _mm_and_si128(_mm_srli_epi32(s, 16), low));
+            p = _mm_or_si128(p, _mm_slli_epi32(_mm_and_si128(s, low), 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), p);
+        }
+        copy_32_c<true>(dst + x * 4, dst_stride, src + x * 4, src_stride, w - x, 1);
+    }
+}
+
+template <bool swap>
+static void blend_32_sse2(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                          int h) {
+    __m128i zero = _mm_setzero_si128();
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        int x = 0;
+        for (; x + 4 <= w; x += 4) {
+            __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4));
+            __m128i* p = reinterpret_cast<__m128i*>(dst + x * 4);
+            __m128i d = _mm_loadu_si128(p);
+            __m128i s_lo = _mm_unpacklo_epi8(s, zero), s_hi = _mm_unpackhi_epi8(s, zero);
+            __m128i a_lo = alpha_sse2(s_lo), a_hi = alpha_sse2(s_hi);
+            if (swap) {
+                s_lo = swap_sse2(s_lo);
+                s_hi = swap_sse2(s_hi);
+            }
+            __m128i lo = mix_sse2(s_lo, _mm_unpacklo_epi8(d, zero), a_lo);
+            __m128i hi = mix_sse2(s_hi, _mm_unpackhi_epi8(d, zero), a_hi);
+            _mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+        }
+        blend_32_c<swap>(dst + x * 4, dst_stride, src + x * 4, src_stride, w - x, 1);
+    }
+}
+
+static void glyph_32_sse2(uint8_t* dst, int dst_stride, const uint8_t* mask, int mask_stride,
+                          int w, int h, uint32_t color) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i c = _mm_unpacklo_epi8(_mm_set1_epi32(color), zero);
+    __m128i color_lanes = _mm_set_epi16(0, -1, -1, -1, 0, -1, -1, -1);
+    c = _mm_and_si128(c, color_lanes);
+    for (int y = 0; y < h; y++, dst += dst_stride, mask += mask_stride) {
+        int x = 0;
+        for (; x + 4 <= w; x += 4) {
+            int32_t m;
+            memcpy(&m, mask + x, sizeof(m));
+            __m128i k = _mm_unpacklo_epi8(_mm_cvtsi32_si128(m), zero);
+            k = _mm_unpacklo_epi16(k, k);
+            __m128i a_lo = _mm_unpacklo_epi32(k, k), a_hi = _mm_unpackhi_epi32(k, k);
+            // The coverage takes the place of the alpha
+            __m128i s_lo = _mm_or_si128(c, _mm_andnot_si128(color_lanes, a_lo));
+            __m128i s_hi = _mm_or_si128(c, _mm_andnot_si128(color_lanes, a_hi));
+            __m128i* p = reinterpret_cast<__m128i*>(dst + x * 4);
+            __m128i d = _mm_loadu_si128(p);
+            __m128i lo = mix_sse2(s_lo, _mm_unpacklo_epi8(d, zero), a_lo);
+            __m128i hi = mix_sse2(s_hi, _mm_unpackhi_epi8(d, zero), a_hi);
+            _mm_storeu_si128(p, _mm_packus_epi16(lo, hi));
+        }
+        glyph_32_c(dst + x * 4, dst_stride, mask + x, mask_stride, w - x, 1, color);
+    }
+}
+
+static void fill_565_sse2(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    __m128i v = _mm_set1_epi16(pack_565(c[0], c[1], c[2]));
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        int x = 0;
+        for (; x + 8 <= w; x += 8) _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 2), v);
+        fill_565_c(dst + x * 2, dst_stride, w - x, 1, color);
+    }
+}
+
+static void fill_blend_565_sse2(uint8_t* dst, int dst_stride, int w, int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    __m128i s0 = _mm_set1_epi16(c[0]), s1 = _mm_set1_epi16(c[1]), s2 = _mm_set1_epi16(c[2]);
+    __m128i a = _mm_set1_epi16(c[3]);
+    for (int y = 0; y < h; y++, dst += dst_stride) {
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            __m128i* p = reinterpret_cast<__m128i*>(dst + x * 2);
+            __m128i r, g, b;
+            unpack_565_sse2(_mm_loadu_si128(p), &r, &g, &b);
+            _mm_storeu_si128(p, pack_565_sse2(mix_sse2(s0, r, a), mix_sse2(s1, g, a),
+                                              mix_sse2(s2, b, a)));
+        }
+        fill_blend_565_c(dst + x * 2, dst_stride, w - x, 1, color);
+    }
+}
+
+static void copy_565_sse2(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                          int h) {
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4));
+            __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4 + 16));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 2),
+                             pack_565_sse2(channel_sse2(lo, hi, 0), channel_sse2(lo, hi, 8),
+                                           channel_sse2(lo, hi, 16)));
+        }
+        copy_565_c(dst + x * 2, dst_stride, src + x * 4, src_stride, w - x, 1);
+    }
+}
+
+static void blend_565_sse2(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w,
+                           int h) {
+    for (int y = 0; y < h; y++, dst += dst_stride, src += src_stride) {
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4));
+            __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x * 4 + 16));
+            __m128i a = channel_sse2(lo, hi, 24);
+            __m128i* p = reinterpret_cast<__m128i*>(dst + x * 2);
+            __m128i r, g, b;
+            unpack_565_sse2(_mm_loadu_si128(p), &r, &g, &b);
+            _mm_storeu_si128(p, pack_565_sse2(mix_sse2(channel_sse2(lo, hi, 0), r, a),
+                                              mix_sse2(channel_sse2(lo, hi, 8), g, a),
+                                              mix_sse2(channel_sse2(lo, hi, 16), b, a)));
+        }
+        blend_565_c(dst + x * 2, dst_stride, src + x * 4, src_stride, w - x, 1);
+    }
+}
+
+static void glyph_565_sse2(uint8_t* dst, int dst_stride, const uint8_t* mask, int mask_stride,
+                           int w, int h, uint32_t color) {
+    const uint8_t* c = reinterpret_cast<const uint8_t*>(&color);
+    __m128i s0 = _mm_set1_epi16(c[0]), s1 = _mm_set1_epi16(c[1]), s2 = _mm_set1_epi16(c[2]);
+    __m128i zero = _mm_setzero_si128();
+    for (int y = 0; y < h; y++, dst += dst_stride, mask += mask_stride) {
+        int x = 0;
+        for (; x + 8 <= w; x += 8) {
+            __m128i k = _mm_unpacklo_epi8(
+                _mm_loadl_epi64(reinterpret_cast<const __m128i*>(mask + x)), zero);
+            __m128i* p = reinterpret_cast<__m128i*>(dst + x * 2);
+            __m128i r, g, b;
+            unpack_565_sse2(_mm_loadu_si128(p), &r, &g, &b);
+            _mm_storeu_si128(p, pack_565_sse2(mix_sse2(s0, r, k), mix_sse2(s1, g, k),
+                                              mix_sse2(s2, b, k)));
+        }
+        glyph_565_c(dst + x * 2, dst_stride, mask + x, mask_stride, w - x, 1, color);
+    }
+}
+
+static const gr_kernels kernels_rgbx_simd = {
+    "sse2",           fill_32_sse2,        fill_blend_32_sse2, copy_32_sse2<false>,
+    blend_32_sse2<false>, glyph_32_sse2,
+};
+static const gr_kernels kernels_bgra_simd = {
+    "sse2",          fill_32_sse2,       fill_blend_32_sse2, copy_32_sse2<true>,
+    blend_32_sse2<true>, glyph_32_sse2,
+};
+static const gr_kernels kernels_565_simd = {
+    "sse2", fill_565_sse2, fill_blend_565_sse2, copy_565_sse2, blend_565_sse2, glyph_565_sse2,
+};
+
+#endif
+
+const gr_kernels* gr_get_kernels(gr_kernel_format format, bool simd) {
+#if defined(GR_KERNELS_NEON) || defined(GR_KERNELS_SSE2)
+    if (simd) {
+        switch (format) {
+            case GR_KERNEL_RGBX_8888: return &kernels_rgbx_simd;
+            case GR_KERNEL_BGRA_8888: return &kernels_bgra_simd;
+            case GR_KERNEL_RGB_565: return &kernels_565_simd;
+        }
+    }
+#else
+    (void)simd;
+#endif
+    switch (format) {
+        case GR_KERNEL_RGBX_8888: return &kernels_rgbx_c;
+        case GR_KERNEL_BGRA_8888: return &kernels_bgra_c;
+        case GR_KERNEL_RGB_565: return &kernels_565_c;
+    }
+    return nullptr;
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _GRAPHICS_KERNELS_H_
+#define _GRAPHICS_KERNELS_H_
+
+#include <stdint.h>
+
+// Pixel loops for the common cases of gr_fill(), gr_blit() and text, so they
+// don't have to go through the generic pixelflinger paths. There are NEON
+// (arm, arm64) and SSE2 (x86) versions, and plain C for everything else.
+//
+// Colors are four bytes as they sit in memory: the three color channels in
+// the order the drawing surface keeps them (R, G, B for 565), then alpha.
+// Images are R, G, B, A bytes, like the surfaces res_create_surface() makes.
+// Blending is what pixelflinger does with GGL_SRC_ALPHA and
+// GGL_ONE_MINUS_SRC_ALPHA, on all four channels.
+
+enum gr_kernel_format {
+    GR_KERNEL_RGBX_8888,  // also RGBA_8888
+    GR_KERNEL_BGRA_8888,
+    GR_KERNEL_RGB_565,
+};
+
+struct gr_kernels {
+    const char* name;
+
+    // Sets w x h pixels to color.
+    void (*fill)(uint8_t* dst, int dst_stride, int w, int h, uint32_t color);
+
+    // Blends color over w x h pixels with the alpha of color.
+    void (*fill_blend)(uint8_t* dst, int dst_stride, int w, int h, uint32_t color);
+
+    // Copies an image, ignoring its alpha.
+    void (*copy)(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w, int h);
+
+    // Blends an image over the pixels with its own alpha.
+    void (*blend)(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride, int w, int h);
+
+    // Blends color over the pixels with the alpha of an 8 bit coverage mask,
+    // the way text is drawn. The alpha of color isn't used.
+    void (*glyph)(uint8_t* dst, int dst_stride, const uint8_t* mask, int mask_stride, int w, int h,
+                  uint32_t color);
+};
+
+// The kernels for surfaces of the given format: the SIMD ones if this build
+// has them and simd is true, the plain C ones otherwise.
+const gr_kernels* gr_get_kernels(gr_kernel_format format, bool simd);
+
+#endif
@@ -21,7 +21,10 @@
 #include <linux/fb.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "minui.h"
+#include "graphics.h"
 
 struct fb_var_screeninfo vi;
 extern GGLSurface gr_mem_surface;
@@ -90,6 +93,10 @@ int gr_save_screenshot(const char *dest)
         goto exit;
 
     png_init_io(png_ptr, fp);
+    // The GUI is stuck until the file is written: encode for speed, the
+    // "up" filter alone does well on flat UI areas at zlib's fastest level
+    png_set_compression_level(png_ptr, 1);
+    png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_UP);
     png_set_IHDR(png_ptr, info_ptr, surface.width, surface.height,
          8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
          PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
@@ -166,3 +173,34 @@ void surface_ROTATION_transform(gr_surface dst_ptr, const gr_surface src_ptr,
         DO_MATRIX_ROTATION(8, 1);
     }
 }
+
+void gr_copy_region(GRSurface* dst, const GRSurface* src, int x, int y, int w, int h)
+{
+    unsigned char* to = dst->data + y * dst->row_bytes + x * dst->pixel_bytes;
+    const unsigned char* from = src->data + y * src->row_bytes + x * src->pixel_bytes;
+
+    for (int row = 0; row < h; row++) {
+        memcpy(to, from, w * src->pixel_bytes);
+        to += dst->row_bytes;
+        from += src->row_bytes;
+    }
+}
+
+void gr_union_region(int* x, int* y, int* w, int* h, int x2, int y2, int w2, int h2)
+{
+    if (w2 <= 0 || h2 <= 0)
+        return;
+    if (*w <= 0 || *h <= 0) {
+        *x = x2;
+        *y = y2;
+        *w = w2;
+        *h = h2;
+        return;
+    }
+    int r = std::max(*x + *w, x2 + w2);
+    int b = std::max(*y + *h, y2 + h2);
+    *x = std::min(*x, x2);
+    *y = std::min(*y, y2);
+    *w = r - *x;
+    *h = b - *y;
+}
@@ -19,6 +19,7 @@
 
 #include "../gui/placement.h"
 #include <stdbool.h>
+#include <stddef.h>
 
 struct GRSurface {
     int width;
@@ -43,6 +44,19 @@ int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
 void gr_flip(void);
 void gr_fb_blank(bool blank);
+// Prints frame timing of the display backend, if it keeps any
+void gr_dump_frame_stats(void);
+
+// Partial updates: while a region is set, all drawing stays inside it, and
+// gr_flip_region() presents only that part of the frame. Only worth doing
+// when gr_flip_region_supported(); otherwise the drawing surface may not hold
+// the previous frame and gr_flip_region() presents the whole frame.
+int gr_flip_region_supported(void);
+void gr_set_region(int x, int y, int w, int h);
+// Returns 1 and the region while one is set, so callers can skip what's outside
+int gr_get_region(int* x, int* y, int* w, int* h);
+void gr_clear_region(void);
+void gr_flip_region(int x, int y, int w, int h);
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
 void gr_clip(int x, int y, int w, int h);
@@ -64,6 +78,7 @@ int gr_ttf_measureEx(const char *s, void *font);
 int gr_ttf_maxExW(const char *s, void *font, int max_width);
 int gr_ttf_getMaxFontHeight(void *font);
 void gr_ttf_dump_stats(void);
+void gr_ttf_set_string_cache_size(size_t bytes); // Per font, STRING_CACHE_MAX_BYTES until set
 
 void gr_blit(gr_surface source, int sx, int sy, int w, int h, int dx, int dy);
 unsigned int gr_get_width(gr_surface surface);
@@ -96,12 +111,23 @@ struct input_event;
 int ev_init(void);
 void ev_exit(void);
 int ev_get(struct input_event *ev, int timeout_ms);
+// Whether ev_get() has events that were read already; ev_fd() doesn't
+// show those
+int ev_batched(void);
+// An epoll fd that is readable whenever ev_get() has something to do; it
+// stays the same when the devices are reloaded
+int ev_fd(void);
 int ev_has_mouse(void);
 
 // Resources
 
 // Returns 0 if no error, else negative.
 int res_create_surface(const char* name, gr_surface* pSurface);
+// Like res_create_surface(), for a PNG or JPEG image that is already in memory
+int res_create_surface_mem(const unsigned char* data, size_t size, gr_surface* pSurface);
+// A width x height surface of the given GGL format with a copy of pixels,
+// which are 4 bytes each with no padding between rows
+int res_create_surface_raw(int width, int height, int format, const void* pixels, gr_surface* pSurface);
 void res_free_surface(gr_surface surface);
 int res_scale_surface(gr_surface source, gr_surface* destination, float scale_w, float scale_h);
 
@@ -37,6 +37,8 @@ extern "C" {
 }
 #endif
 #include "minui.h"
+// For std::min
+#include <algorithm>
 
 #define SURFACE_DATA_ALIGNMENT 8
 
@@ -50,26 +52,51 @@ static GGLSurface* malloc_surface(size_t data_size) {
     return surface;
 }
 
-static int open_png(const char* name, png_structp* png_ptr, png_infop* info_ptr,
+// An image that is already in memory, such as an entry of the theme zip,
+// for the decoders to read in place of a file
+struct mem_source {
+    const unsigned char* data;
+    size_t size;
+    size_t pos;
+};
+
+static void png_read_mem(png_structp png_ptr, png_bytep out, png_size_t length) {
+    mem_source* mem = reinterpret_cast<mem_source*>(png_get_io_ptr(png_ptr));
+    if (length > mem->size - mem->pos) {
+        png_error(png_ptr, "read past the end of the image");
+    }
+    memcpy(out, mem->data + mem->pos, length);
+    mem->pos += length;
+}
+
+// Opens the PNG called name, or the one in mem when mem isn't NULL.
+static int open_png(const char* name, mem_source* mem, png_structp* png_ptr, png_infop* info_ptr,
                     png_uint_32* width, png_uint_32* height, png_byte* channels, FILE** fpp) {
     char resPath[256];
     unsigned char header[8];
     int result = 0;
     int color_type, bit_depth;
     size_t bytesRead;
+    FILE* fp = NULL;
 
-    snprintf(resPath, sizeof(resPath)-1, TWRES "images/%s.png", name);
-    resPath[sizeof(resPath)-1] = '\0';
-    FILE* fp = fopen(resPath, "rb");
-    if (fp == NULL) {
-        fp = fopen(name, "rb");
+    if (mem) {
+        bytesRead = std::min(sizeof(header), mem->size);
+        memcpy(header, mem->data, bytesRead);
+        mem->pos = bytesRead;
+    } else {
+        snprintf(resPath, sizeof(resPath)-1, TWRES "images/%s.png", name);
+        resPath[sizeof(resPath)-1] = '\0';
+        fp = fopen(resPath, "rb");
         if (fp == NULL) {
-            result = -1;
-            goto exit;
+            fp = fopen(name, "rb");
+            if (fp == NULL) {
+                result = -1;
+                goto exit;
+            }
         }
+        bytesRead = fread(header, 1, sizeof(header), fp);
     }
 
-    bytesRead = fread(header, 1, sizeof(header), fp);
     if (bytesRead != sizeof(header)) {
         result = -2;
         goto exit;
@@ -97,7 +124,10 @@ static int open_png(const char* name, png_structp* png_ptr, png_infop* info_ptr,
         goto exit;
     }
 
-    png_init_io(*png_ptr, fp);
+    if (mem)
+        png_set_read_fn(*png_ptr, mem, png_read_mem);
+    else
+        png_init_io(*png_ptr, fp);
     png_set_sig_bytes(*png_ptr, sizeof(header));
     png_read_info(*png_ptr, *info_ptr);
 
@@ -202,20 +232,20 @@ static void transform_rgb_to_draw(unsigned char* input_row,
     }
 }
 
-int res_create_surface_png(const char* name, gr_surface* pSurface) {
+static int create_surface_png(const char* name, mem_source* mem, gr_surface* pSurface) {
     GGLSurface* surface = NULL;
     int result = 0;
     png_structp png_ptr = NULL;
     png_infop info_ptr = NULL;
     png_uint_32 width, height;
     png_byte channels;
-    FILE* fp;
-    unsigned char* p_row;
+    FILE* fp = NULL;
+    unsigned char* p_row = NULL;
     unsigned int y;
 
     *pSurface = NULL;
 
-    result = open_png(name, &png_ptr, &info_ptr, &width, &height, &channels, &fp);
+    result = open_png(name, mem, &png_ptr, &info_ptr, &width, &height, &channels, &fp);
     if (result < 0) return result;
 
     surface = init_display_surface(width, height);
@@ -233,11 +263,16 @@ int res_create_surface_png(const char* name, gr_surface* pSurface) {
         result = -9;
         goto exit;
     }
+    // A truncated or corrupt image ends up here instead of in open_png(),
+    // which has returned by now
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        result = -10;
+        goto exit;
+    }
     for (y = 0; y < height; ++y) {
         png_read_row(png_ptr, p_row, NULL);
         transform_rgb_to_draw(p_row, surface->data + y * width * 4, channels, width);
     }
-    free(p_row);
 
     if (channels == 3)
         surface->format = GGL_PIXEL_FORMAT_RGBX_8888;
@@ -247,39 +282,90 @@ int res_create_surface_png(const char* name, gr_surface* pSurface) {
     *pSurface = (gr_surface) surface;
 
   exit:
-    fclose(fp);
+    free(p_row);
+    if (fp != NULL)
+        fclose(fp);
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
     if (result < 0 && surface != NULL) free(surface);
     return result;
 }
 
+int res_create_surface_png(const char* name, gr_surface* pSurface) {
+    return create_surface_png(name, NULL, pSurface);
+}
+
 #ifdef TW_INCLUDE_JPEG
-int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
+static void jpeg_mem_init_source(j_decompress_ptr cinfo __unused) {
+}
+
+static boolean jpeg_mem_fill_input_buffer(j_decompress_ptr cinfo) {
+    // The whole image was handed over up front, so this only happens past
+    // its end. Feed an EOI marker, like jpeg_stdio_src() does at the end of
+    // a file, so a truncated image ends instead of failing.
+    static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = sizeof(eoi);
+    return TRUE;
+}
+
+static void jpeg_mem_skip_input_data(j_decompress_ptr cinfo, long num_bytes) {
+    if (num_bytes <= 0)
+        return;
+    if ((size_t) num_bytes > cinfo->src->bytes_in_buffer) {
+        jpeg_mem_fill_input_buffer(cinfo);
+        return;
+    }
+    cinfo->src->next_input_byte += num_bytes;
+    cinfo->src->bytes_in_buffer -= num_bytes;
+}
+
+static void jpeg_mem_term_source(j_decompress_ptr cinfo __unused) {
+}
+
+// Decodes the JPEG called name, or the one in mem when mem isn't NULL.
+static int create_surface_jpg(const char* name, mem_source* mem, gr_surface* pSurface) {
     GGLSurface* surface = NULL;
     int result = 0, y;
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
+    struct jpeg_source_mgr mem_src;
+    bool created = false;
     unsigned char* pData;
     size_t width, height, stride, pixelSize;
+    FILE* fp = NULL;
 
-    FILE* fp = fopen(name, "rb");
-    if (fp == NULL) {
-        char resPath[256];
-
-        snprintf(resPath, sizeof(resPath)-1, TWRES "images/%s", name);
-        resPath[sizeof(resPath)-1] = '\0';
-        fp = fopen(resPath, "rb");
+    if (!mem) {
+        fp = fopen(name, "rb");
         if (fp == NULL) {
-            result = -1;
-            goto exit;
+            char resPath[256];
+
+            snprintf(resPath, sizeof(resPath)-1, TWRES "images/%s", name);
+            resPath[sizeof(resPath)-1] = '\0';
+            fp = fopen(resPath, "rb");
+            if (fp == NULL) {
+                result = -1;
+                goto exit;
+            }
         }
     }
 
     cinfo.err = jpeg_std_error(&jerr);
     jpeg_create_decompress(&cinfo);
+    created = true;
 
     /* Specify data source for decompression */
-    jpeg_stdio_src(&cinfo, fp);
+    if (mem) {
+        mem_src.next_input_byte = mem->data;
+        mem_src.bytes_in_buffer = mem->size;
+        mem_src.init_source = jpeg_mem_init_source;
+        mem_src.fill_input_buffer = jpeg_mem_fill_input_buffer;
+        mem_src.skip_input_data = jpeg_mem_skip_input_data;
+        mem_src.resync_to_restart = jpeg_resync_to_restart;
+        mem_src.term_source = jpeg_mem_term_source;
+        cinfo.src = &mem_src;
+    } else {
+        jpeg_stdio_src(&cinfo, fp);
+    }
 
     /* Read file header, set default decompression parameters */
     if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK)
@@ -336,7 +422,7 @@ int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
     *pSurface = (gr_surface) surface;
 
 exit:
-    if (fp != NULL)
+    if (created)
     {
         if (surface)
         {
@@ -347,10 +433,15 @@ exit:
             }
         }
         jpeg_destroy_decompress(&cinfo);
-        fclose(fp);
     }
+    if (fp != NULL)
+        fclose(fp);
     return result;
 }
+
+int res_create_surface_jpg(const char* name, gr_surface* pSurface) {
+    return create_surface_jpg(name, NULL, pSurface);
+}
 #endif
 
 int res_create_surface(const char* name, gr_surface* pSurface) {
@@ -372,6 +463,33 @@ int res_create_surface(const char* name, gr_surface* pSurface) {
     return ret;
 }
 
+int res_create_surface_mem(const unsigned char* data, size_t size, gr_surface* pSurface) {
+    mem_source mem = { data, size, 0 };
+
+    *pSurface = NULL;
+    if (!data)      return -1;
+
+    if (size >= 8 && png_sig_cmp(const_cast<unsigned char*>(data), 0, 8) == 0)
+        return create_surface_png(NULL, &mem, pSurface);
+#ifdef TW_INCLUDE_JPEG
+    if (size >= 2 && data[0] == 0xFF && data[1] == 0xD8)
+        return create_surface_jpg(NULL, &mem, pSurface);
+#endif
+    return -3;
+}
+
+int res_create_surface_raw(int width, int height, int format, const void* pixels, gr_surface* pSurface) {
+    *pSurface = NULL;
+    if (width <= 0 || height <= 0 || !pixels) return -1;
+
+    GGLSurface* surface = init_display_surface(width, height);
+    if (surface == NULL) return -8;
+    surface->format = format;
+    memcpy(surface->data, pixels, (size_t) width * height * 4);
+    *pSurface = (gr_surface) surface;
+    return 0;
+}
+
 void res_free_surface(gr_surface surface) {
     GGLSurface* pSurface = (GGLSurface*) surface;
     if (pSurface) {
@@ -6,6 +6,7 @@
 #include <stdio.h>
 
 #include "minui.h"
+#include "graphics.h"
 
 #include <cutils/hashmap.h>
 #include <ft2build.h>
@@ -17,8 +18,14 @@
 // For std::min and std::max
 #include <algorithm>
 
+// Least recently used strings are dropped once a font's string cache holds
+// more than this many entries or bytes. The bytes can be changed with
+// gr_ttf_set_string_cache_size().
 #define STRING_CACHE_MAX_ENTRIES 400
-#define STRING_CACHE_TRUNCATE_ENTRIES 150
+#define STRING_CACHE_MAX_BYTES (512*1024)
+
+// Width and height of the A8 texture each font packs its glyphs into
+#define GLYPH_ATLAS_SIZE 512
 
 typedef struct
 {
@@ -40,6 +47,21 @@ typedef struct
     Hashmap *string_cache;
     struct StringCacheEntry *string_cache_head;
     struct StringCacheEntry *string_cache_tail;
+    size_t string_cache_bytes;
+    // Glyphs are packed into the atlas in rows, left to right. When it is
+    // full it is emptied and atlas_generation goes up, which tells the
+    // glyphs they have to be placed again.
+    GGLSurface atlas;
+    int atlas_x;
+    int atlas_y;
+    int atlas_row_height;
+    unsigned atlas_generation;
+    // For gr_ttf_dump_stats()
+    unsigned string_hits;
+    unsigned string_misses;
+    unsigned glyph_hits;
+    unsigned glyph_misses;
+    unsigned atlas_resets;
     pthread_mutex_t mutex;
     TrueTypeFontKey *key;
 } TrueTypeFont;
@@ -48,6 +70,9 @@ typedef struct
 {
     FT_BBox bbox;
     FT_BitmapGlyph glyph;
+    int atlas_x;
+    int atlas_y;
+    unsigned atlas_generation; // 0 when not in the atlas
 } TrueTypeCacheEntry;
 
 typedef struct
@@ -56,10 +81,24 @@ typedef struct
     int max_width;
 } StringCacheKey;
 
+typedef struct
+{
+    TrueTypeCacheEntry *ent;
+    int x; // pen position in the string
+} StringCacheGlyph;
+
+// A laid out string: its glyphs and where they go. Drawing one blits the
+// glyphs from the atlas; the string is only rendered into a surface of its
+// own when it has to be rotated.
 struct StringCacheEntry
 {
-    GGLSurface surface;
+    GGLSurface surface; // data is NULL until gr_ttf_string_surface()
+    int width;
+    int height;
     int rendered_bytes; // number of bytes from C string rendered, not number of UTF8 characters!
+    StringCacheGlyph *glyphs;
+    int glyph_count;
+    size_t bytes; // memory held by the entry, for string_cache_max_bytes
     StringCacheKey *key;
     struct StringCacheEntry *prev;
     struct StringCacheEntry *next;
@@ -80,6 +119,8 @@ static FontData font_data = {
     .mutex = PTHREAD_MUTEX_INITIALIZER,
 };
 
+static size_t string_cache_max_bytes = STRING_CACHE_MAX_BYTES;
+
 #define MIN(X,Y) ((X) < (Y) ? (X) : (Y))
 #define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
 
@@ -300,6 +341,7 @@ static bool gr_ttf_freeStringCache(void *key, void *value, void *context __unuse
 
     StringCacheEntry *e = (StringCacheEntry *)value;
     free(e->surface.data);
+    free(e->glyphs);
     free(e);
     return true;
 }
@@ -328,6 +370,7 @@ void gr_ttf_freeFont(void *font)
         hashmapFree(d->string_cache);
         hashmapForEach(d->glyph_cache, gr_ttf_freeFontCache, NULL);
         hashmapFree(d->glyph_cache);
+        free(d->atlas.data);
         pthread_mutex_destroy(&d->mutex);
         free(d);
     }
@@ -343,8 +386,11 @@ static TrueTypeCacheEntry *gr_ttf_glyph_cache_peek(TrueTypeFont *font, int char_
 static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_index)
 {
     TrueTypeCacheEntry *res = (TrueTypeCacheEntry *)hashmapGet(font->glyph_cache, &char_index);
-    if(!res)
+    if(res)
+        ++font->glyph_hits;
+    else
     {
+        ++font->glyph_misses;
         int error = FT_Load_Glyph(font->face, char_index, FT_LOAD_RENDER);
         if(error)
         {
@@ -374,6 +420,7 @@ static TrueTypeCacheEntry *gr_ttf_glyph_cache_get(TrueTypeFont *font, int char_i
     return res;
 }
 
+#if TW_ROTATION != 0
 static int gr_ttf_copy_glyph_to_surface(GGLSurface *dest, FT_BitmapGlyph glyph, int offX, int offY, int base)
 {
     unsigned y;
@@ -401,6 +448,7 @@ static int gr_ttf_copy_glyph_to_surface(GGLSurface *dest, FT_BitmapGlyph glyph,
     }
     return 0;
 }
+#endif
 
 static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
 {
@@ -454,23 +502,79 @@ static void gr_ttf_calcMaxFontHeight(TrueTypeFont *f)
     f->base += f->size / 4;
 }
 
-// returns number of bytes from const char *text rendered to fit max_width, not number of UTF8 characters!
-static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const char *text, int max_width)
+#if TW_ROTATION == 0
+// Places the glyph in the font's atlas, emptying the atlas first if it is
+// full. Returns false for glyphs that can't go in the atlas at all.
+static bool gr_ttf_atlas_place(TrueTypeFont *font, TrueTypeCacheEntry *ent)
+{
+    FT_Bitmap *bitmap = &ent->glyph->bitmap;
+    int w = bitmap->width;
+    int h = bitmap->rows;
+    unsigned y;
+
+    if(font->atlas.data && ent->atlas_generation == font->atlas_generation)
+        return true;
+
+    if(bitmap->pixel_mode != FT_PIXEL_MODE_GRAY || w > GLYPH_ATLAS_SIZE || h > GLYPH_ATLAS_SIZE)
+        return false;
+
+    if(!font->atlas.data)
+    {
+        font->atlas.version = sizeof(font->atlas);
+        font->atlas.width = GLYPH_ATLAS_SIZE;
+        font->atlas.height = GLYPH_ATLAS_SIZE;
+        font->atlas.stride = GLYPH_ATLAS_SIZE;
+        font->atlas.format = GGL_PIXEL_FORMAT_A_8;
+        font->atlas.data = (GGLubyte*)calloc(GLYPH_ATLAS_SIZE, GLYPH_ATLAS_SIZE);
+        if(!font->atlas.data)
+            return false;
+        font->atlas_generation = 1;
+    }
+
+    if(font->atlas_x + w > GLYPH_ATLAS_SIZE)
+    {
+        font->atlas_x = 0;
+        font->atlas_y += font->atlas_row_height;
+        font->atlas_row_height = 0;
+    }
+
+    if(font->atlas_y + h > GLYPH_ATLAS_SIZE)
+    {
+        font->atlas_x = font->atlas_y = font->atlas_row_height = 0;
+        ++font->atlas_generation;
+        ++font->atlas_resets;
+    }
+
+    for(y = 0; y < bitmap->rows; ++y)
+    {
+        memcpy(font->atlas.data + (font->atlas_y + y)*GLYPH_ATLAS_SIZE + font->atlas_x,
+                bitmap->buffer + y*bitmap->pitch, w);
+    }
+
+    ent->atlas_x = font->atlas_x;
+    ent->atlas_y = font->atlas_y;
+    ent->atlas_generation = font->atlas_generation;
+    font->atlas_x += w;
+    font->atlas_row_height = MAX(font->atlas_row_height, h);
+    return true;
+}
+#endif
+
+// Lays out as much of text as fits max_width into e. Returns the number of
+// bytes from const char *text rendered, not number of UTF8 characters!
+static int gr_ttf_layout_text(TrueTypeFont *font, StringCacheEntry *e, const char *text, int max_width)
 {
     TrueTypeFont *f = font;
     TrueTypeCacheEntry *ent;
     int bytes_rendered = 0, total_w = 0;
     int utf_bytes = 0;
     unsigned int unicode = 0;
-    int i, x, diff, char_idx, prev_idx = 0;
-    int height;
+    int diff, kerning, char_idx, prev_idx = 0;
     FT_Vector delta;
-    uint8_t *data = NULL;
     const char *text_itr = text;
-    int *char_idxs;
-    int char_idxs_len = 0;
 
-    char_idxs = (int *)malloc(strlen(text) * sizeof(int));
+    e->glyphs = (StringCacheGlyph *)malloc(strlen(text) * sizeof(StringCacheGlyph));
+    e->glyph_count = 0;
 
     while(*text_itr)
     {
@@ -479,26 +583,27 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
         bytes_rendered += utf_bytes;
 
         char_idx = FT_Get_Char_Index(f->face, unicode);
-        char_idxs[char_idxs_len] = char_idx;
 
         ent = gr_ttf_glyph_cache_get(f, char_idx);
         if(ent)
         {
-            diff = ent->glyph->root.advance.x >> 16;
-
+            kerning = 0;
             if(FT_HAS_KERNING(f->face) && prev_idx && char_idx)
             {
                 FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-                diff += delta.x >> 6;
+                kerning = delta.x >> 6;
             }
+            diff = (ent->glyph->root.advance.x >> 16) + kerning;
 
             if(max_width != -1 && total_w + diff > max_width)
                 break;
 
+            e->glyphs[e->glyph_count].ent = ent;
+            e->glyphs[e->glyph_count].x = total_w + kerning;
+            ++e->glyph_count;
             total_w += diff;
         }
         prev_idx = char_idx;
-        ++char_idxs_len;
     }
 
     if(font->max_height == -1)
@@ -506,46 +611,41 @@ static int gr_ttf_render_text(TrueTypeFont *font, GGLSurface *surface, const cha
 
     if(font->max_height == -1)
     {
-        free(char_idxs);
+        free(e->glyphs);
+        e->glyphs = NULL;
         return -1;
     }
 
-    height = font->max_height;
+    e->width = total_w;
+    e->height = font->max_height;
+    return bytes_rendered;
+}
+
+#if TW_ROTATION != 0
+// The laid out string rendered into an A8 surface of its own
+static GGLSurface *gr_ttf_string_surface(TrueTypeFont *font, StringCacheEntry *e)
+{
+    GGLSurface *surface = &e->surface;
+    int i;
 
-    data = (uint8_t *)malloc(total_w*height);
-    memset(data, 0, total_w*height);
-    x = 0;
-    prev_idx = 0;
+    if(surface->data)
+        return surface;
 
     surface->version = sizeof(*surface);
-    surface->width = total_w;
-    surface->height = height;
-    surface->stride = total_w;
-    surface->data = (GGLubyte*)data;
+    surface->width = e->width;
+    surface->height = e->height;
+    surface->stride = e->width;
+    surface->data = (GGLubyte*)calloc(e->width*e->height, 1);
     surface->format = GGL_PIXEL_FORMAT_A_8;
 
-    for(i = 0; i < char_idxs_len; ++i)
-    {
-        char_idx = char_idxs[i];
-        if(FT_HAS_KERNING(f->face) && prev_idx && char_idx)
-        {
-            FT_Get_Kerning(f->face, prev_idx, char_idx, FT_KERNING_DEFAULT, &delta);
-            x += delta.x >> 6;
-        }
+    for(i = 0; i < e->glyph_count; ++i)
+        gr_ttf_copy_glyph_to_surface(surface, e->glyphs[i].ent->glyph, e->glyphs[i].x, 0, font->base);
 
-        ent = gr_ttf_glyph_cache_get(f, char_idx);
-        if(ent)
-        {
-            gr_ttf_copy_glyph_to_surface(surface, ent->glyph, x, 0, font->base);
-            x += ent->glyph->root.advance.x >> 16;
-        }
-
-        prev_idx = char_idx;
-    }
-
-    free(char_idxs);
-    return bytes_rendered;
+    e->bytes += e->width*e->height;
+    font->string_cache_bytes += e->width*e->height;
+    return surface;
 }
+#endif
 
 static StringCacheEntry *gr_ttf_string_cache_peek(TrueTypeFont *font, const char *text, int max_width)
 {
@@ -557,6 +657,27 @@ static StringCacheEntry *gr_ttf_string_cache_peek(TrueTypeFont *font, const char
     return (StringCacheEntry *)hashmapGet(font->string_cache, &k);
 }
 
+// Drops the least recently used strings until the cache is within its
+// limits. keep, the entry being handed out, always stays.
+static void gr_ttf_string_cache_trim(TrueTypeFont *font, StringCacheEntry *keep)
+{
+    StringCacheEntry *ent;
+
+    while(font->string_cache_head != keep &&
+            (hashmapSize(font->string_cache) > STRING_CACHE_MAX_ENTRIES ||
+            font->string_cache_bytes > string_cache_max_bytes))
+    {
+        ent = font->string_cache_head;
+        font->string_cache_head = ent->next;
+        font->string_cache_head->prev = NULL;
+
+        hashmapRemove(font->string_cache, ent->key);
+
+        font->string_cache_bytes -= ent->bytes;
+        gr_ttf_freeStringCache(ent->key, ent, NULL);
+    }
+}
+
 static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char *text, int max_width)
 {
     StringCacheEntry *res;
@@ -568,9 +689,10 @@ static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char
     res = (StringCacheEntry *)hashmapGet(font->string_cache, &k);
     if(!res)
     {
+        ++font->string_misses;
         res = (StringCacheEntry *)malloc(sizeof(StringCacheEntry));
         memset(res, 0, sizeof(StringCacheEntry));
-        res->rendered_bytes = gr_ttf_render_text(font, &res->surface, text, max_width);
+        res->rendered_bytes = gr_ttf_layout_text(font, res, text, max_width);
         if(res->rendered_bytes < 0)
         {
             free(res);
@@ -583,6 +705,9 @@ static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char
         new_key->text = strdup(text);
 
         res->key = new_key;
+        res->bytes = sizeof(StringCacheEntry) + sizeof(StringCacheKey) + strlen(text) + 1 +
+                res->glyph_count*sizeof(StringCacheGlyph);
+        font->string_cache_bytes += res->bytes;
 
         if(font->string_cache_tail)
         {
@@ -594,40 +719,27 @@ static StringCacheEntry *gr_ttf_string_cache_get(TrueTypeFont *font, const char
         font->string_cache_tail = res;
 
         hashmapPut(font->string_cache, new_key, res);
+        gr_ttf_string_cache_trim(font, res);
     }
-    else if(res->next)
+    else
     {
-        // move this entry to the tail of the linked list
-        // if it isn't already there
-        if(res->prev)
-            res->prev->next = res->next;
-
-        res->next->prev = res->prev;
-
-        if(!res->prev)
-            font->string_cache_head = res->next;
-
-        res->next = NULL;
-        res->prev = font->string_cache_tail;
-        res->prev->next = res;
-        font->string_cache_tail = res;
-
-        // truncate old entries
-        if(hashmapSize(font->string_cache) >= STRING_CACHE_MAX_ENTRIES)
+        ++font->string_hits;
+        if(res->next)
         {
-            printf("Truncating string cache entries.\n");
-            int i;
-            StringCacheEntry *ent;
-            for(i = 0; i < STRING_CACHE_TRUNCATE_ENTRIES; ++i)
-            {
-                ent = font->string_cache_head;
-                font->string_cache_head = ent->next;
-                font->string_cache_head->prev = NULL;
+            // move this entry to the tail of the linked list
+            // if it isn't already there
+            if(res->prev)
+                res->prev->next = res->next;
 
-                hashmapRemove(font->string_cache, ent->key);
+            res->next->prev = res->prev;
 
-                gr_ttf_freeStringCache(ent->key, ent, NULL);
-            }
+            if(!res->prev)
+                font->string_cache_head = res->next;
+
+            res->next = NULL;
+            res->prev = font->string_cache_tail;
+            res->prev->next = res;
+            font->string_cache_tail = res;
         }
     }
     return res;
@@ -641,7 +753,7 @@ int gr_ttf_measureEx(const char *s, void *font)
     pthread_mutex_lock(&f->mutex);
     StringCacheEntry *e = gr_ttf_string_cache_get(f, s, -1);
     if(e)
-        res = e->surface.width;
+        res = e->width;
     pthread_mutex_unlock(&f->mutex);
 
     return res;
@@ -699,6 +811,71 @@ int gr_ttf_maxExW(const char *s, void *font, int max_width)
     return max_bytes;
 }
 
+#if TW_ROTATION == 0
+// Draws the w x h glyph found at sx, sy of src with its top left corner at
+// gx, gy, clipped to the l, t, r, b box of the string
+static void gr_ttf_draw_glyph(GGLContext *gl, const GGLSurface *src, int sx, int sy, int w, int h,
+        int gx, int gy, int l, int t, int r, int b)
+{
+    l = std::max(l, gx);
+    t = std::max(t, gy);
+    r = std::min(r, gx + w);
+    b = std::min(b, gy + h);
+    if(l >= r || t >= b)
+        return;
+
+    sx += l - gx;
+    sy += t - gy;
+    if(gr_kernel_glyph(src->data + sy*src->stride + sx, src->stride, l, t, r - l, b - t) == 0)
+        return;
+
+    gl->bindTexture(gl, (GGLSurface*)src);
+    gl->texCoord2i(gl, sx - l, sy - t);
+    gl->recti(gl, l, t, r, b);
+}
+
+// Draws the laid out string glyph by glyph, from the atlas where possible
+static void gr_ttf_draw_string(GGLContext *gl, TrueTypeFont *font, StringCacheEntry *e,
+        int x, int y, int y_bottom)
+{
+    int i;
+
+    gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
+    gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
+    gl->enable(gl, GGL_TEXTURE_2D);
+
+    for(i = 0; i < e->glyph_count; ++i)
+    {
+        TrueTypeCacheEntry *ent = e->glyphs[i].ent;
+        FT_BitmapGlyph glyph = ent->glyph;
+        int gx = x + e->glyphs[i].x + glyph->left;
+        int gy = y + font->base - glyph->top;
+
+        if(gr_ttf_atlas_place(font, ent))
+        {
+            gr_ttf_draw_glyph(gl, &font->atlas, ent->atlas_x, ent->atlas_y,
+                    glyph->bitmap.width, glyph->bitmap.rows, gx, gy, x, y, x + e->width, y_bottom);
+        }
+        else if(glyph->bitmap.pixel_mode == FT_PIXEL_MODE_GRAY)
+        {
+            // Too big for the atlas, draw straight from the glyph bitmap
+            GGLSurface bitmap;
+            bitmap.version = sizeof(bitmap);
+            bitmap.width = glyph->bitmap.width;
+            bitmap.height = glyph->bitmap.rows;
+            bitmap.stride = glyph->bitmap.pitch;
+            bitmap.data = glyph->bitmap.buffer;
+            bitmap.format = GGL_PIXEL_FORMAT_A_8;
+            gr_ttf_draw_glyph(gl, &bitmap, 0, 0, bitmap.width, bitmap.height,
+                    gx, gy, x, y, x + e->width, y_bottom);
+        }
+    }
+
+    gl->disable(gl, GGL_TEXTURE_2D);
+}
+#endif
+
 int gr_ttf_textExWH(void *context, int x, int y,
                     const char *s, void *pFont,
                     int max_width, int max_height,
@@ -725,22 +902,7 @@ int gr_ttf_textExWH(void *context, int x, int y,
         return -1;
     }
 
-#if TW_ROTATION != 0
-    // Do not perform relatively expensive operation if not needed
-    GGLSurface string_surface_rotated;
-    string_surface_rotated.version = sizeof(string_surface_rotated);
-    // Skip the **(TW_ROTATION == 0)** || (TW_ROTATION == 180) check
-    // because we are under a TW_ROTATION != 0 conditional compilation statement
-    string_surface_rotated.width   = (TW_ROTATION == 180) ? e->surface.width  : e->surface.height;
-    string_surface_rotated.height  = (TW_ROTATION == 180) ? e->surface.height : e->surface.width;
-    string_surface_rotated.stride  = string_surface_rotated.width;
-    string_surface_rotated.format  = e->surface.format;
-    // e->surface.format is GGL_PIXEL_FORMAT_A_8 (grayscale)
-    string_surface_rotated.data    = (GGLubyte*) malloc(string_surface_rotated.stride * string_surface_rotated.height * 1);
-    surface_ROTATION_transform((gr_surface) &string_surface_rotated, (const gr_surface) &e->surface, 1);
-#endif
-
-    int y_bottom = y + e->surface.height;
+    int y_bottom = y + e->height;
     int res = e->rendered_bytes;
 
     if(max_height != -1 && max_height < y_bottom)
@@ -753,26 +915,37 @@ int gr_ttf_textExWH(void *context, int x, int y,
         }
     }
 
-    // Figuring out display coordinates works for TW_ROTATION == 0 too,
-    // and isn't as expensive as allocating and rotating another surface,
-    // so we do this anyway.
+#if TW_ROTATION == 0
+    (void)gr_draw;
+    gr_ttf_draw_string(gl, font, e, x, y, y_bottom);
+#else
+    // Do not perform relatively expensive operation if not needed
+    GGLSurface *string_surface = gr_ttf_string_surface(font, e);
+    GGLSurface string_surface_rotated;
+    string_surface_rotated.version = sizeof(string_surface_rotated);
+    // Skip the **(TW_ROTATION == 0)** || (TW_ROTATION == 180) check
+    // because we are under a TW_ROTATION != 0 conditional compilation statement
+    string_surface_rotated.width   = (TW_ROTATION == 180) ? string_surface->width  : string_surface->height;
+    string_surface_rotated.height  = (TW_ROTATION == 180) ? string_surface->height : string_surface->width;
+    string_surface_rotated.stride  = string_surface_rotated.width;
+    string_surface_rotated.format  = string_surface->format;
+    // string_surface->format is GGL_PIXEL_FORMAT_A_8 (grayscale)
+    string_surface_rotated.data    = (GGLubyte*) malloc(string_surface_rotated.stride * string_surface_rotated.height * 1);
+    surface_ROTATION_transform((gr_surface) &string_surface_rotated, (const gr_surface) string_surface, 1);
+
     int x0_disp, y0_disp, x1_disp, y1_disp;
     int l_disp, r_disp, t_disp, b_disp;
 
     x0_disp = ROTATION_X_DISP(x, y, gr_draw);
     y0_disp = ROTATION_Y_DISP(x, y, gr_draw);
-    x1_disp = ROTATION_X_DISP(x + e->surface.width, y_bottom, gr_draw);
-    y1_disp = ROTATION_Y_DISP(x + e->surface.width, y_bottom, gr_draw);
+    x1_disp = ROTATION_X_DISP(x + string_surface->width, y_bottom, gr_draw);
+    y1_disp = ROTATION_Y_DISP(x + string_surface->width, y_bottom, gr_draw);
     l_disp = std::min(x0_disp, x1_disp);
     r_disp = std::max(x0_disp, x1_disp);
     t_disp = std::min(y0_disp, y1_disp);
     b_disp = std::max(y0_disp, y1_disp);
 
-#if TW_ROTATION != 0
     gl->bindTexture(gl, &string_surface_rotated);
-#else
-    gl->bindTexture(gl, &e->surface);
-#endif
     gl->texEnvi(gl, GGL_TEXTURE_ENV, GGL_TEXTURE_ENV_MODE, GGL_REPLACE);
     gl->texGeni(gl, GGL_S, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
     gl->texGeni(gl, GGL_T, GGL_TEXTURE_GEN_MODE, GGL_ONE_TO_ONE);
@@ -782,7 +955,6 @@ int gr_ttf_textExWH(void *context, int x, int y,
     gl->recti(gl, l_disp, t_disp, r_disp, b_disp);
     gl->disable(gl, GGL_TEXTURE_2D);
 
-#if TW_ROTATION != 0
     free(string_surface_rotated.data);
 #endif
 
@@ -805,39 +977,37 @@ int gr_ttf_getMaxFontHeight(void *font)
     return res;
 }
 
-static bool gr_ttf_dump_stats_count_string_cache(void *key __unused, void *value, void *context)
+static double gr_ttf_hit_rate(unsigned hits, unsigned misses)
 {
-    int *string_cache_size = (int *)context;
-    StringCacheEntry *e = (StringCacheEntry *)value;
-    *string_cache_size += e->surface.height*e->surface.width + sizeof(StringCacheEntry);
-    return true;
+    return (hits + misses) ? 100.0*hits/(hits + misses) : 0.0;
 }
 
 static bool gr_ttf_dump_stats_font(void *key, void *value, void *context)
 {
     TrueTypeFontKey *k = (TrueTypeFontKey *)key;
     TrueTypeFont *f = (TrueTypeFont *)value;
-    int *total_string_cache_size = (int *)context;
-    int string_cache_size = 0;
+    int *total_cache_size = (int *)context;
+    int atlas_size = f->atlas.data ? GLYPH_ATLAS_SIZE*GLYPH_ATLAS_SIZE : 0;
 
     pthread_mutex_lock(&f->mutex);
 
-    hashmapForEach(f->string_cache, gr_ttf_dump_stats_count_string_cache, &string_cache_size);
-
     printf("  Font %s (size %d, dpi %d):\n"
             "    refcount: %d\n"
             "    max_height: %d\n"
             "    base: %d\n"
-            "    glyph_cache: %zu entries\n"
-            "    string_cache: %zu entries (%.2f kB)\n",
+            "    glyph_cache: %zu entries, %.1f%% hits\n"
+            "    glyph_atlas: %.2f kB, %u resets\n"
+            "    string_cache: %zu entries (%.2f kB), %.1f%% hits\n",
             k->path, k->size, k->dpi,
             f->refcount, f->max_height, f->base,
-            hashmapSize(f->glyph_cache),
-            hashmapSize(f->string_cache), ((double)string_cache_size)/1024);
+            hashmapSize(f->glyph_cache), gr_ttf_hit_rate(f->glyph_hits, f->glyph_misses),
+            ((double)atlas_size)/1024, f->atlas_resets,
+            hashmapSize(f->string_cache), ((double)f->string_cache_bytes)/1024,
+            gr_ttf_hit_rate(f->string_hits, f->string_misses));
 
-    pthread_mutex_unlock(&f->mutex);
+    *total_cache_size += f->string_cache_bytes + atlas_size;
 
-    *total_string_cache_size += string_cache_size;
+    pthread_mutex_unlock(&f->mutex);
     return true;
 }
 
@@ -850,11 +1020,16 @@ void gr_ttf_dump_stats(void)
         printf("no truetype fonts loaded.\n");
     else
     {
-        int total_string_cache_size = 0;
+        int total_cache_size = 0;
         printf("%zu fonts loaded.\n", hashmapSize(font_data.fonts));
-        hashmapForEach(font_data.fonts, gr_ttf_dump_stats_font, &total_string_cache_size);
-        printf("  Total string cache size: %.2f kB\n", ((double)total_string_cache_size)/1024);
+        hashmapForEach(font_data.fonts, gr_ttf_dump_stats_font, &total_cache_size);
+        printf("  Total string cache and atlas size: %.2f kB\n", ((double)total_cache_size)/1024);
     }
 
     pthread_mutex_unlock(&font_data.mutex);
 }
+
+void gr_ttf_set_string_cache_size(size_t bytes)
+{
+    string_cache_max_bytes = bytes;
+}
@@ -23,8 +23,6 @@
 #undef NDEBUG   // do this after including Log.h
 #include <assert.h>
 
-#define SORT_ENTRIES 1
-
 /*
  * Offset and length constants (java.util.zip naming convention).
  */
@@ -97,34 +95,34 @@ static void dumpEntry(const ZipEntry* pEntry)
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * Compare two ZipEntry structs, by name.
+ * Compare a name with the first "len" bytes of another, then by length,
+ * so that every name starting with a given prefix sorts right after it.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
+static int compareNames(const char* name1, unsigned int len1,
+        const char* name2, unsigned int len2)
 {
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
-
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
+    int diff = memcmp(name1, name2, len1 < len2 ? len1 : len2);
+    if (diff != 0)
+        return diff;
+    return (len1 > len2) - (len1 < len2);
 }
 
 /*
- * (This is a mzHashTableLookup callback.)
+ * (This is a qsort callback.)
  *
- * find a ZipEntry struct by name.
+ * Order ZipEntry structs by name.  Duplicate names keep the order of the
+ * central directory.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+static int compareZipEntries(const void* ventry1, const void* ventry2)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
-
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
+    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
+    int diff = compareNames(entry1->fileName, entry1->fileNameLen,
+            entry2->fileName, entry2->fileNameLen);
+    if (diff != 0)
+        return diff;
+    return (entry1->fileName > entry2->fileName) -
+            (entry1->fileName < entry2->fileName);
 }
 
 /*
@@ -143,18 +141,46 @@ static unsigned int computeHash(const char* name, int nameLen)
     return hash;
 }
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
+/*
+ * Build the name index over the sorted entries.  It's an open-addressed
+ * table with linear probing, at most half full, that keeps the hash next
+ * to the entry so that a probe only touches the entry it's likely to
+ * match.  Nothing is ever removed, so there are no tombstones.
+ */
+static bool buildIndex(ZipArchive* pArchive)
 {
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
-
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
+    unsigned int size = 1;
+    unsigned int i;
+
+    while (size < pArchive->numEntries * 2)
+        size <<= 1;
+    pArchive->pIndex = (ZipIndexSlot*) calloc(size, sizeof(ZipIndexSlot));
+    if (pArchive->pIndex == NULL)
+        return false;
+    pArchive->indexMask = size - 1;
+
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        unsigned int hash = computeHash(pEntry->fileName, pEntry->fileNameLen);
+
+        /* Duplicates sort next to each other, so the first one of each
+         * name is already in the index.
+         */
+        if (i > 0 && compareNames(pEntry->fileName, pEntry->fileNameLen,
+                pEntry[-1].fileName, pEntry[-1].fileNameLen) == 0) {
+            LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                pEntry->fileNameLen, pEntry->fileName);
+            /* keep going */
+            continue;
+        }
+
+        unsigned int slot = hash & pArchive->indexMask;
+        while (pArchive->pIndex[slot].entry != 0)
+            slot = (slot + 1) & pArchive->indexMask;
+        pArchive->pIndex[slot].hash = hash;
+        pArchive->pIndex[slot].entry = i + 1;
     }
+    return true;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -180,7 +206,7 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
- * store it in a hash table.
+ * index it by name.
  *
  * Returns "true" on success.
  */
@@ -241,8 +267,7 @@ static bool parseZipArchive(ZipArchive* pArchive)
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
         goto bail;
 
     ptr = pArchive->addr + cdOffset;
@@ -275,58 +300,7 @@ static bool parseZipArchive(ZipArchive* pArchive)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
         pEntry->fileNameLen = fileNameLen;
         pEntry->fileName = fileName;
 
@@ -375,36 +349,23 @@ static bool parseZipArchive(ZipArchive* pArchive)
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
-#if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort the entries once they're all in, so that the entries under a
+     * directory are a range of them, then index them by name.
      */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
-    }
-#endif
+    qsort(pArchive->pEntries, numEntries, sizeof(ZipEntry), compareZipEntries);
+    if (!buildIndex(pArchive))
+        goto bail;
 
     result = true;
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
+        free(pArchive->pIndex);
+        pArchive->pIndex = NULL;
     }
     return result;
 }
@@ -463,9 +424,9 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 
     free(pArchive->pEntries);
 
-    mzHashTableFree(pArchive->pHash);
+    free(pArchive->pIndex);
 
-    pArchive->pHash = NULL;
+    pArchive->pIndex = NULL;
     pArchive->pEntries = NULL;
 }
 
@@ -477,10 +438,57 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    unsigned int nameLen = strlen(entryName);
+    unsigned int hash = computeHash(entryName, nameLen);
+    unsigned int slot;
+
+    if (pArchive->pIndex == NULL)
+        return NULL;
+    for (slot = hash & pArchive->indexMask; pArchive->pIndex[slot].entry != 0;
+            slot = (slot + 1) & pArchive->indexMask) {
+        const ZipEntry* pEntry;
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+        if (pArchive->pIndex[slot].hash != hash)
+            continue;
+        pEntry = &pArchive->pEntries[pArchive->pIndex[slot].entry - 1];
+        if (pEntry->fileNameLen == nameLen &&
+                memcmp(pEntry->fileName, entryName, nameLen) == 0)
+            return pEntry;
+    }
+    return NULL;
+}
+
+/*
+ * Find the range of entries starting with a prefix, with a binary search
+ * for the first one.
+ */
+unsigned int mzFindZipEntryRange(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* pCount)
+{
+    unsigned int prefixLen = strlen(prefix);
+    unsigned int low = 0, high = pArchive->numEntries;
+    unsigned int end;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        const ZipEntry* pEntry = &pArchive->pEntries[mid];
+
+        if (compareNames(pEntry->fileName, pEntry->fileNameLen,
+                prefix, prefixLen) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (end = low; end < pArchive->numEntries; end++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[end];
+
+        if (pEntry->fileNameLen < prefixLen ||
+                memcmp(pEntry->fileName, prefix, prefixLen) != 0)
+            break;
+    }
+    *pCount = end - low;
+    return low;
 }
 
 /*
@@ -867,51 +875,16 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-    //TODO: since the entries are sorted, binary search for the first match
-    //      and stop after the first non-match.
+    /* The entries are sorted, so the ones whose path begins with zpath
+     * are a range of them.  If zpath is empty, that's all of them, which
+     * is what we want.
      */
-    unsigned int i;
-    bool seenMatch = false;
+    unsigned int i, first, count;
     int ok = true;
     int extractCount = 0;
-    for (i = 0; i < pArchive->numEntries; i++) {
+    first = mzFindZipEntryRange(pArchive, zpath, &count);
+    for (i = first; i < first + count; i++) {
         ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
-       //TODO: look out for a single empty directory entry that matches zpath, but
-       //      missing the trailing slash.  Most zip files seem to include
-       //      the trailing slash, but I think it's legal to leave it off.
-       //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
-         */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
 
         /* Find the target location of the entry.
          */
@@ -8,10 +8,10 @@
 
 #include "inline_magic.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <utime.h>
 
-#include "Hash.h"
 #include "SysUtil.h"
 
 #ifdef __cplusplus
@@ -42,13 +42,23 @@ typedef struct ZipEntry {
     long         externalFileAttributes;
 } ZipEntry;
 
+/*
+ * One slot of the name index: the hash of an entry's file name, and the
+ * entry's position in pEntries plus one (zero marks an empty slot).
+ */
+typedef struct ZipIndexSlot {
+    unsigned int hash;
+    unsigned int entry;
+} ZipIndexSlot;
+
 /*
  * One Zip archive.  Treat as opaque.
  */
 typedef struct ZipArchive {
     unsigned int   numEntries;
-    ZipEntry*      pEntries;
-    HashTable*     pHash;          // maps file name to ZipEntry
+    ZipEntry*      pEntries;       // sorted by file name
+    ZipIndexSlot*  pIndex;         // maps file name to ZipEntry
+    unsigned int   indexMask;      // number of slots in pIndex, minus one
     unsigned char* addr;
     size_t         length;
 } ZipArchive;
@@ -85,6 +95,15 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Find the entries whose names start with "prefix" (all of them for an
+ * empty prefix).  They sit next to each other in pArchive->pEntries, so
+ * this returns the index of the first one and stores how many there are
+ * in "pCount".
+ */
+unsigned int mzFindZipEntryRange(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* pCount);
+
 INLINE loff_t mzGetZipEntryOffset(const ZipEntry* pEntry) {
     return pEntry->offset;
 }
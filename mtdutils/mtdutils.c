@@ -53,20 +53,58 @@ struct MtdWriteContext {
     off_t* bad_block_offsets;
     int bad_block_alloc;
     int bad_block_count;
+
+    off_t erased_start;     // blocks in [erased_start, erased_end) were
+    off_t erased_end;       // erased by mtd_erase_blocks and not written since
+    int single_erase;       // the driver only erases one block per MEMERASE
+    int verify;             // read back each block after writing it
 };
 
 typedef struct {
     MtdPartition *partitions;
     int partitions_allocd;
     int partition_count;
+    unsigned char **bad_blocks;     // per partition, see block_state()
 } MtdState;
 
 static MtdState g_mtd_state = {
     NULL,   // partitions
     0,      // partitions_allocd
-    -1      // partition_count
+    -1,     // partition_count
+    NULL    // bad_blocks
 };
 
+/* What MEMGETBADBLOCK said about an erase block. Each is asked once per
+ * partition scan rather than before every erase and write of the block.
+ */
+#define BLOCK_UNKNOWN   0
+#define BLOCK_GOOD      1
+#define BLOCK_BAD       2
+#define BLOCK_ERROR     3   // the ioctl failed, not known to be bad
+
+static int block_state(const MtdPartition *partition, int fd, off_t pos)
+{
+    unsigned char **table = &g_mtd_state.bad_blocks[partition->device_index];
+    size_t block = pos / partition->erase_size;
+
+    if (*table == NULL) {
+        *table = calloc(partition->size / partition->erase_size + 1, 1);
+        if (*table == NULL) {
+            loff_t bpos = pos;
+            int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+            return ret > 0 ? BLOCK_BAD :
+                   ret == 0 || errno == EOPNOTSUPP ? BLOCK_GOOD : BLOCK_ERROR;
+        }
+    }
+    if ((*table)[block] == BLOCK_UNKNOWN) {
+        loff_t bpos = pos;
+        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
+        (*table)[block] = ret > 0 ? BLOCK_BAD :
+                          ret == 0 || errno == EOPNOTSUPP ? BLOCK_GOOD : BLOCK_ERROR;
+    }
+    return (*table)[block];
+}
+
 #define MTD_PROC_FILENAME   "/proc/mtd"
 
 int
@@ -81,11 +119,15 @@ mtd_scan_partitions()
     if (g_mtd_state.partitions == NULL) {
         const int nump = 32;
         MtdPartition *partitions = malloc(nump * sizeof(*partitions));
-        if (partitions == NULL) {
+        unsigned char **bad_blocks = calloc(nump, sizeof(*bad_blocks));
+        if (partitions == NULL || bad_blocks == NULL) {
+            free(partitions);
+            free(bad_blocks);
             errno = ENOMEM;
             return -1;
         }
         g_mtd_state.partitions = partitions;
+        g_mtd_state.bad_blocks = bad_blocks;
         g_mtd_state.partitions_allocd = nump;
         memset(partitions, 0, nump * sizeof(*partitions));
     }
@@ -102,6 +144,8 @@ mtd_scan_partitions()
             p->name = NULL;
         }
         p->device_index = -1;
+        free(g_mtd_state.bad_blocks[i]);
+        g_mtd_state.bad_blocks[i] = NULL;
     }
 
     /* Open and read the file contents.
@@ -402,9 +446,54 @@ MtdWriteContext *mtd_write_partition(const MtdPartition *partition)
 
     ctx->partition = partition;
     ctx->stored = 0;
+    ctx->erased_start = 0;
+    ctx->erased_end = 0;
+    ctx->single_erase = 0;
+    ctx->verify = 1;
     return ctx;
 }
 
+void mtd_write_set_verify(MtdWriteContext *ctx, int verify)
+{
+    ctx->verify = verify;
+}
+
+/* Erases count blocks from pos, none of them known to be bad. Drivers that
+ * can erase a whole range in one MEMERASE get it in one; the others, and
+ * any range that fails, go block by block so that failures are reported
+ * for the block they happen in.
+ */
+static void erase_range(MtdWriteContext *ctx, off_t pos, int count)
+{
+    const size_t erase_size = ctx->partition->erase_size;
+    struct erase_info_user erase_info;
+
+#ifndef RK3X
+    if (count > 1 && !ctx->single_erase) {
+        erase_info.start = pos;
+        erase_info.length = count * erase_size;
+        if (ioctl(ctx->fd, MEMERASE, &erase_info) == 0)
+            return;
+        if (errno == EINVAL)
+            ctx->single_erase = 1;
+    }
+#endif
+    while (count-- > 0) {
+#ifdef RK3X
+        if (rk30_zero_out(ctx->fd, pos, erase_size) < 0) {
+            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
+        }
+#else
+        erase_info.start = pos;
+        erase_info.length = erase_size;
+        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
+            printf("mtd: erase failure at 0x%08lx\n", pos);
+        }
+#endif
+        pos += erase_size;
+    }
+}
+
 static void add_bad_block_offset(MtdWriteContext *ctx, off_t pos) {
     if (ctx->bad_block_count + 1 > ctx->bad_block_alloc) {
         ctx->bad_block_alloc = (ctx->bad_block_alloc*2) + 1;
@@ -427,13 +516,11 @@ static int write_block(MtdWriteContext *ctx, const char *data)
 
     ssize_t size = partition->erase_size;
     while (pos + size <= (int) partition->size) {
-        loff_t bpos = pos;
-        int ret = ioctl(fd, MEMGETBADBLOCK, &bpos);
-        if (ret != 0 && !(ret == -1 && errno == EOPNOTSUPP)) {
+        int state = block_state(partition, fd, pos);
+        if (state == BLOCK_BAD || state == BLOCK_ERROR) {
             add_bad_block_offset(ctx, pos);
             fprintf(stderr,
-                    "mtd: not writing bad block at 0x%08lx (ret %d): %s\n",
-                    pos, ret, strerror(errno));
+                    "mtd: not writing bad block at 0x%08lx\n", pos);
             pos += partition->erase_size;
             continue;  // Don't try to erase known factory-bad blocks.
         }
@@ -443,23 +530,37 @@ static int write_block(MtdWriteContext *ctx, const char *data)
         erase_info.length = size;
         int retry;
         for (retry = 0; retry < 2; ++retry) {
+            // A block mtd_erase_blocks() erased ahead needs no erase the
+            // first time round
+            if (retry > 0 || pos < ctx->erased_start ||
+                    pos >= ctx->erased_end) {
 #ifdef RK3X
-            if (rk30_zero_out(fd, pos, size) < 0) {
-                fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
+                if (rk30_zero_out(fd, pos, size) < 0) {
+                    fprintf(stderr, "mtd: erase failure at 0x%08lx (%s)\n",
+                            pos, strerror(errno));
+                    continue;
+                }
 #else
-            if (ioctl(fd, MEMERASE, &erase_info) < 0) {
-                printf("mtd: erase failure at 0x%08lx (%s)\n",
-                        pos, strerror(errno));
-                continue;
-            }
+                if (ioctl(fd, MEMERASE, &erase_info) < 0) {
+                    printf("mtd: erase failure at 0x%08lx (%s)\n",
+                            pos, strerror(errno));
+                    continue;
+                }
 #endif
+            }
             if (TEMP_FAILURE_RETRY(lseek(fd, pos, SEEK_SET)) != pos ||
                 TEMP_FAILURE_RETRY(write(fd, data, size)) != size) {
                 printf("mtd: write error at 0x%08lx (%s)\n",
                         pos, strerror(errno));
+                if (!ctx->verify)
+                    continue;
+            }
+
+            if (!ctx->verify) {
+                if (retry > 0) {
+                    printf("mtd: wrote block after %d retries\n", retry);
+                }
+                return 0;
             }
 
             char verify[size];
@@ -551,30 +652,30 @@ off_t mtd_erase_blocks(MtdWriteContext *ctx, int blocks)
         return -1;
     }
 
-    // Erase the specified number of blocks
+    // Erase the specified number of blocks, each run of good blocks that
+    // isn't still erased from an earlier call at once
+    const off_t start = pos;
+    off_t run = pos;
     while (blocks-- > 0) {
-        loff_t bpos = pos;
-        if (ioctl(ctx->fd, MEMGETBADBLOCK, &bpos) > 0) {
+        int skip = pos >= ctx->erased_start && pos < ctx->erased_end;
+        if (!skip && block_state(ctx->partition, ctx->fd, pos) == BLOCK_BAD) {
             printf("mtd: not erasing bad block at 0x%08lx\n", pos);
-            pos += ctx->partition->erase_size;
-            continue;  // Don't try to erase known factory-bad blocks.
+            skip = 1;  // Don't try to erase known factory-bad blocks.
         }
-
-        struct erase_info_user erase_info;
-        erase_info.start = pos;
-        erase_info.length = ctx->partition->erase_size;
-#ifdef RK3X
-        if (rk30_zero_out(ctx->fd, pos, ctx->partition->erase_size) < 0) {
-            fprintf(stderr, "mtd: erase failure at 0x%08lx\n", pos);
+        if (skip) {
+            if (pos > run)
+                erase_range(ctx, run, (pos - run) / ctx->partition->erase_size);
+            run = pos + ctx->partition->erase_size;
         }
-#else
-        if (ioctl(ctx->fd, MEMERASE, &erase_info) < 0) {
-            printf("mtd: erase failure at 0x%08lx\n", pos);
-        }
-#endif
         pos += ctx->partition->erase_size;
     }
+    if (pos > run)
+        erase_range(ctx, run, (pos - run) / ctx->partition->erase_size);
 
+    if (pos > start) {
+        ctx->erased_start = start;
+        ctx->erased_end = pos;
+    }
     return pos;
 }
 
@@ -53,6 +53,8 @@ void mtd_read_close(MtdReadContext *);
 MtdWriteContext *mtd_write_partition(const MtdPartition *);
 ssize_t mtd_write_data(MtdWriteContext *, const char *data, size_t data_len);
 off_t mtd_erase_blocks(MtdWriteContext *, int blocks);  /* 0 ok, -1 for all */
+/* read each block back after writing it, on unless turned off */
+void mtd_write_set_verify(MtdWriteContext *, int verify);
 int mtd_write_close(MtdWriteContext *);
 
 struct MtdPartition {
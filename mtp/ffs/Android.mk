@@ -27,6 +27,7 @@ LOCAL_SRC_FILES = \
     MtpRequestPacket.cpp \
     MtpResponsePacket.cpp \
     MtpServer.cpp \
+    MtpStats.cpp \
     MtpStorage.cpp \
     MtpStorageInfo.cpp \
     MtpStringBuffer.cpp \
@@ -63,6 +64,9 @@ LOCAL_C_INCLUDES += bootable/recovery/twrplibusbhost/include
 ifneq ($(TW_MTP_DEVICE),)
 	LOCAL_CFLAGS += -DUSB_MTP_DEVICE=$(TW_MTP_DEVICE)
 endif
+ifneq ($(TW_MTP_FILE_CHUNK_SIZE),)
+	LOCAL_CFLAGS += -DMTP_FILE_CHUNK_SIZE=$(TW_MTP_FILE_CHUNK_SIZE)
+endif
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -gt 25; echo $$?),0)
     LOCAL_CFLAGS += -DHAS_USBHOST_TIMEOUT
 endif
@@ -36,6 +36,9 @@ public:
 
 	virtual void close() = 0;
 
+	// Log where the file transfers spent their time since the last call
+	virtual void dumpStats() {}
+
 	virtual ~IMtpHandle() {}
 };
 
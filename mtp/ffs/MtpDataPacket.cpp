@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #include <usbhost/usbhost.h>
 #include "MtpStringBuffer.h"
@@ -418,6 +419,14 @@ void MtpDataPacket::putString(const MtpStringBuffer& string) {
 	string.writeToPacket(this);
 }
 
+void MtpDataPacket::putData(const void* data, size_t length) {
+	allocate(mOffset + length);
+	memcpy(mBuffer + mOffset, data, length);
+	mOffset += length;
+	if (mPacketSize < mOffset)
+		mPacketSize = mOffset;
+}
+
 void MtpDataPacket::putString(const char* s) {
 	MtpStringBuffer string(s);
 	string.writeToPacket(this);
@@ -91,6 +91,12 @@ public:
 	void				putString(const uint16_t* string);
 	inline void			putEmptyString() { putUInt8(0); }
 	inline void			putEmptyArray() { putUInt32(0); }
+	void				putData(const void* data, size_t length);
+
+	// for copying out what was just put, or filling in a count put before it
+	inline size_t		getOffset() const { return mOffset; }
+	inline const uint8_t*	  getBufferAt(size_t offset) const { return mBuffer + offset; }
+	inline void			setUInt32(size_t offset, uint32_t value) { MtpPacket::putUInt32(offset, value); }
 
 #ifdef MTP_DEVICE
 	// fill our buffer with data from the given usb handle
@@ -41,7 +41,11 @@
 namespace {
 
 // Must be divisible by all max packet size values
+#ifdef MTP_FILE_CHUNK_SIZE
+constexpr int MAX_FILE_CHUNK_SIZE = (MTP_FILE_CHUNK_SIZE + 16383) / 16384 * 16384;
+#else
 constexpr int MAX_FILE_CHUNK_SIZE = 3145728;
+#endif
 
 // Safe values since some devices cannot handle large DMAs
 // To get good performance, override these with
@@ -112,7 +116,8 @@ int MtpFfsCompatHandle::start(bool ptp) {
 	if (!openEndpoints(ptp))
 		return -1;
 
-	for (unsigned i = 0; i < NUM_IO_BUFS; i++) {
+	// Only the first two buffers are used, the transfers alternate between them
+	for (unsigned i = 0; i < 2; i++) {
 		mIobuf[i].bufs.resize(MAX_FILE_CHUNK_SIZE);
 		posix_madvise(mIobuf[i].bufs.data(), MAX_FILE_CHUNK_SIZE,
 				POSIX_MADV_SEQUENTIAL | POSIX_MADV_WILLNEED);
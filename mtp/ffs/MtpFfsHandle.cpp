@@ -40,11 +40,18 @@
 
 namespace {
 
-constexpr unsigned AIO_BUFS_MAX = 128;
 constexpr unsigned AIO_BUF_LEN = 16384;
+#ifdef MTP_FILE_CHUNK_SIZE
+// Set with TW_MTP_FILE_CHUNK_SIZE, in bytes
+constexpr unsigned AIO_BUFS_MAX = (MTP_FILE_CHUNK_SIZE + AIO_BUF_LEN - 1) / AIO_BUF_LEN;
+#else
+constexpr unsigned AIO_BUFS_MAX = 128;
+#endif
 
 constexpr unsigned FFS_NUM_EVENTS = 5;
 
+constexpr int SPLICE_PIPE_SIZE = 1024 * 1024;
+
 constexpr unsigned MAX_FILE_CHUNK_SIZE = AIO_BUFS_MAX * AIO_BUF_LEN;
 
 constexpr uint32_t MAX_MTP_FILE_SIZE = 0xFFFFFFFF;
@@ -70,6 +77,7 @@ int MtpFfsHandle::getPacketSize(int ffs_fd) {
 
 MtpFfsHandle::MtpFfsHandle(int controlFd) {
 	mControl.reset(controlFd);
+	mNoSplice = false;
 }
 
 MtpFfsHandle::~MtpFfsHandle() {}
@@ -78,6 +86,8 @@ void MtpFfsHandle::closeEndpoints() {
 	mIntr.reset();
 	mBulkIn.reset();
 	mBulkOut.reset();
+	mPipeRead.reset();
+	mPipeWrite.reset();
 }
 
 bool MtpFfsHandle::openEndpoints(bool ptp) {
@@ -298,6 +308,19 @@ void MtpFfsHandle::close() {
 	closeConfig();
 }
 
+void MtpFfsHandle::dumpStats() {
+	mSendFileStat.log("ffs send file");
+	mSpliceStat.log("ffs  spliced");
+	mReceiveFileStat.log("ffs receive file");
+	mUsbWaitStat.log("ffs  usb wait");
+	mDiskWaitStat.log("ffs  disk wait");
+	mSendFileStat.clear();
+	mSpliceStat.clear();
+	mReceiveFileStat.clear();
+	mUsbWaitStat.clear();
+	mDiskWaitStat.clear();
+}
+
 int MtpFfsHandle::waitEvents(__attribute__((unused)) struct io_buffer *buf, int min_events, struct io_event *events,
 		int *counter) {
 	int num_events = 0;
@@ -437,110 +460,136 @@ int MtpFfsHandle::receiveFile(mtp_file_range mfr, bool zero_packet) {
 	// A >=4G file is given as 0xFFFFFFFF
 	uint32_t file_length = mfr.length;
 	uint64_t offset = mfr.offset;
-
-	struct aiocb aio;
-	aio.aio_fildes = mfr.fd;
-	aio.aio_buf = nullptr;
-	struct aiocb *aiol[] = {&aio};
+	uint64_t start = MtpStat::now();
+
+	// One write per buffer can be in flight, so up to NUM_IO_BUFS - 1 chunks
+	// are written to disk while the next one is received
+	struct aiocb aio[NUM_IO_BUFS];
+	bool has_write[NUM_IO_BUFS];
+	for (unsigned j = 0; j < NUM_IO_BUFS; j++) {
+		aio[j].aio_fildes = mfr.fd;
+		aio[j].aio_buf = nullptr;
+		has_write[j] = false;
+	}
 
 	int ret = -1;
 	unsigned i = 0;
 	size_t length;
 	struct io_event ioevs[AIO_BUFS_MAX];
-	bool has_write = false;
-	bool error = false;
 	bool write_error = false;
 	int packet_size = getPacketSize(mBulkOut);
 	bool short_packet = false;
 	advise(mfr.fd);
 
-	// Break down the file into pieces that fit in buffers
-	while (file_length > 0 || has_write) {
-		// Queue an asynchronous read from USB.
-		if (file_length > 0) {
-			length = std::min(static_cast<uint32_t>(MAX_FILE_CHUNK_SIZE), file_length);
-			if (iobufSubmit(&mIobuf[i], mBulkOut, length, true) == -1)
-				error = true;
+	// Get the return status of the write request of a buffer.
+	auto waitWrite = [&](unsigned j) {
+		struct aiocb *aiol[] = {&aio[j]};
+		uint64_t wait_start = MtpStat::now();
+		aio_suspend(aiol, 1, nullptr);
+		has_write[j] = false;
+		int written = aio_return(&aio[j]);
+		mDiskWaitStat.add(written > 0 ? written : 0, MtpStat::now() - wait_start);
+		if (static_cast<size_t>(written) < aio[j].aio_nbytes) {
+			errno = written == -1 ? aio_error(&aio[j]) : EIO;
+			MTPE("Mtp error writing to disk\n");
+			return false;
 		}
-
-		// Get the return status of the last write request.
-		if (has_write) {
-			aio_suspend(aiol, 1, nullptr);
-			int written = aio_return(&aio);
-			if (static_cast<size_t>(written) < aio.aio_nbytes) {
-				errno = written == -1 ? aio_error(&aio) : EIO;
-				MTPE("Mtp error writing to disk\n");
-				write_error = true;
-			}
-			has_write = false;
+		return true;
+	};
+	// The buffers have to stay until all writes are done, even on errors
+	auto waitWrites = [&]() {
+		bool ok = true;
+		int saved_errno = errno;
+		for (unsigned j = 0; j < NUM_IO_BUFS; j++) {
+			if (has_write[j] && !waitWrite(j))
+				ok = false;
 		}
+		if (ok)
+			errno = saved_errno;
+		return ok;
+	};
 
-		if (error) {
+	// Break down the file into pieces that fit in buffers
+	while (file_length > 0) {
+		// The buffer is reused once what it held is on disk.
+		if (has_write[i] && !waitWrite(i))
+			write_error = true;
+
+		// Queue an asynchronous read from USB.
+		length = std::min(static_cast<uint32_t>(MAX_FILE_CHUNK_SIZE), file_length);
+		if (iobufSubmit(&mIobuf[i], mBulkOut, length, true) == -1) {
+			waitWrites();
 			return -1;
 		}
 
 		// Get the result of the read request, and queue a write to disk.
-		if (file_length > 0) {
-			unsigned num_events = 0;
-			ret = 0;
-			unsigned short_i = mIobuf[i].actual;
-			while (num_events < short_i) {
-				// Get all events up to the short read, if there is one.
-				// We must wait for each event since data transfer could end at any time.
-				int this_events = 0;
-				int event_ret = waitEvents(&mIobuf[i], 1, ioevs, &this_events);
-				num_events += this_events;
-
-				if (event_ret == -1) {
-					cancelEvents(mIobuf[i].iocb.data(), ioevs, num_events, mIobuf[i].actual);
-					return -1;
-				}
-				ret += event_ret;
-				for (int j = 0; j < this_events; j++) {
-					// struct io_event contains a pointer to the associated struct iocb as a __u64.
-					if (static_cast<__u64>(ioevs[j].res) <
-							reinterpret_cast<struct iocb*>(ioevs[j].obj)->aio_nbytes) {
-						// We've found a short event. Store the index since
-						// events won't necessarily arrive in the order they are queued.
-						short_i = (ioevs[j].obj - reinterpret_cast<uint64_t>(mIobuf[i].iocbs.data()))
-							/ sizeof(struct iocb) + 1;
-						short_packet = true;
-					}
-				}
+		unsigned num_events = 0;
+		ret = 0;
+		unsigned short_i = mIobuf[i].actual;
+		while (num_events < short_i) {
+			// Get all events up to the short read, if there is one.
+			// We must wait for each event since data transfer could end at any time.
+			int this_events = 0;
+			uint64_t wait_start = MtpStat::now();
+			int event_ret = waitEvents(&mIobuf[i], 1, ioevs, &this_events);
+			mUsbWaitStat.add(event_ret > 0 ? event_ret : 0, MtpStat::now() - wait_start);
+			num_events += this_events;
+
+			if (event_ret == -1) {
+				cancelEvents(mIobuf[i].iocb.data(), ioevs, num_events, mIobuf[i].actual);
+				waitWrites();
+				return -1;
 			}
-			if (short_packet) {
-				if (cancelEvents(mIobuf[i].iocb.data(), ioevs, short_i, mIobuf[i].actual)) {
-					write_error = true;
+			ret += event_ret;
+			for (int j = 0; j < this_events; j++) {
+				// struct io_event contains a pointer to the associated struct iocb as a __u64.
+				if (static_cast<__u64>(ioevs[j].res) <
+						reinterpret_cast<struct iocb*>(ioevs[j].obj)->aio_nbytes) {
+					// We've found a short event. Store the index since
+					// events won't necessarily arrive in the order they are queued.
+					short_i = (ioevs[j].obj - reinterpret_cast<uint64_t>(mIobuf[i].iocbs.data()))
+						/ sizeof(struct iocb) + 1;
+					short_packet = true;
 				}
 			}
-			if (file_length == MAX_MTP_FILE_SIZE) {
-				// For larger files, receive until a short packet is received.
-				if (static_cast<size_t>(ret) < length) {
-					file_length = 0;
-				}
-			} else if (ret < static_cast<int>(length)) {
-				// If file is less than 4G and we get a short packet, it's an error.
-				errno = EIO;
-				MTPE("Mtp got unexpected short packet\n");
-				return -1;
-			} else {
-				file_length -= ret;
+		}
+		if (short_packet) {
+			if (cancelEvents(mIobuf[i].iocb.data(), ioevs, short_i, mIobuf[i].actual)) {
+				write_error = true;
 			}
-
-			if (write_error) {
-				cancelTransaction();
-				return -1;
+		}
+		if (file_length == MAX_MTP_FILE_SIZE) {
+			// For larger files, receive until a short packet is received.
+			if (static_cast<size_t>(ret) < length) {
+				file_length = 0;
 			}
+		} else if (ret < static_cast<int>(length)) {
+			// If file is less than 4G and we get a short packet, it's an error.
+			errno = EIO;
+			MTPE("Mtp got unexpected short packet\n");
+			waitWrites();
+			return -1;
+		} else {
+			file_length -= ret;
+		}
 
-			// Enqueue a new write request
-			aio_prepare(&aio, mIobuf[i].bufs.data(), ret, offset);
-			aio_write(&aio);
-
-			offset += ret;
-			i = (i + 1) % NUM_IO_BUFS;
-			has_write = true;
+		if (write_error) {
+			waitWrites();
+			cancelTransaction();
+			return -1;
 		}
+
+		// Enqueue a new write request
+		aio_prepare(&aio[i], mIobuf[i].bufs.data(), ret, offset);
+		aio_write(&aio[i]);
+
+		offset += ret;
+		has_write[i] = true;
+		i = (i + 1) % NUM_IO_BUFS;
 	}
+	if (!waitWrites())
+		write_error = true;
+
 	if ((ret % packet_size == 0 && !short_packet) || zero_packet) {
 		// Receive an empty packet if size is a multiple of the endpoint size
 		// and we didn't already get an empty packet from the header or large file.
@@ -548,6 +597,11 @@ int MtpFfsHandle::receiveFile(mtp_file_range mfr, bool zero_packet) {
 			return -1;
 		}
 	}
+	if (write_error) {
+		errno = EIO;
+		return -1;
+	}
+	mReceiveFileStat.add(offset - mfr.offset, MtpStat::now() - start);
 	return 0;
 }
 
@@ -557,6 +611,7 @@ int MtpFfsHandle::sendFile(mtp_file_range mfr) {
 			file_length + sizeof(mtp_data_header));
 	uint64_t offset = mfr.offset;
 	int packet_size = getPacketSize(mBulkIn);
+	uint64_t start = MtpStat::now();
 
 	// If file_length is larger than a size_t, truncating would produce the wrong comparison.
 	// Instead, promote the left side to 64 bits, then truncate the small result.
@@ -594,6 +649,16 @@ int MtpFfsHandle::sendFile(mtp_file_range mfr) {
 	offset += init_read_len;
 	ret = init_read_len + sizeof(mtp_data_header);
 
+	if (file_length > 0 && !mNoSplice) {
+		uint64_t splice_start = MtpStat::now();
+		int64_t sent = spliceFile(mfr.fd, offset, file_length, packet_size);
+		if (sent == -1)
+			return -1;
+		mSpliceStat.add(sent, MtpStat::now() - splice_start);
+		file_length -= sent;
+		offset += sent;
+	}
+
 	// Break down the file into pieces that fit in buffers
 	while(file_length > 0 || has_write) {
 		if (file_length > 0) {
@@ -606,8 +671,11 @@ int MtpFfsHandle::sendFile(mtp_file_range mfr) {
 		if (has_write) {
 			// Wait for usb write. Cancel unwritten portion if there's an error.
 			int num_events = 0;
-			if (waitEvents(&mIobuf[(i-1)%NUM_IO_BUFS], mIobuf[(i-1)%NUM_IO_BUFS].actual, ioevs,
-						&num_events) != ret) {
+			uint64_t wait_start = MtpStat::now();
+			int written = waitEvents(&mIobuf[(i-1)%NUM_IO_BUFS], mIobuf[(i-1)%NUM_IO_BUFS].actual, ioevs,
+					&num_events);
+			mUsbWaitStat.add(written > 0 ? written : 0, MtpStat::now() - wait_start);
+			if (written != ret) {
 				error = true;
 				cancelEvents(mIobuf[(i-1)%NUM_IO_BUFS].iocb.data(), ioevs, num_events,
 						mIobuf[(i-1)%NUM_IO_BUFS].actual);
@@ -617,8 +685,10 @@ int MtpFfsHandle::sendFile(mtp_file_range mfr) {
 
 		if (file_length > 0) {
 			// Wait for the previous read to finish
+			uint64_t wait_start = MtpStat::now();
 			aio_suspend(aiol, 1, nullptr);
 			num_read = aio_return(&aio);
+			mDiskWaitStat.add(num_read > 0 ? num_read : 0, MtpStat::now() - wait_start);
 			if (static_cast<size_t>(num_read) < aio.aio_nbytes) {
 				errno = num_read == -1 ? aio_error(&aio) : EIO;
 				MTPE("Mtp error reading from disk\n");
@@ -644,15 +714,86 @@ int MtpFfsHandle::sendFile(mtp_file_range mfr) {
 		i = (i + 1) % NUM_IO_BUFS;
 	}
 
-	if (ret % packet_size == 0) {
+	if ((sizeof(mtp_data_header) + mfr.length) % packet_size == 0) {
 		// If the last packet wasn't short, send a final empty packet
 		if (write(mIobuf[0].bufs.data(), 0) != 0) {
 			return -1;
 		}
 	}
+	mSendFileStat.add(mfr.length, MtpStat::now() - start);
 	return 0;
 }
 
+int64_t MtpFfsHandle::spliceFile(int fd, uint64_t offset, uint64_t length, int packet_size) {
+	if (mPipeWrite < 0) {
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) == -1) {
+			MTPE("Unable to create splice pipe: %s\n", strerror(errno));
+			return 0;
+		}
+		mPipeRead.reset(fds[0]);
+		mPipeWrite.reset(fds[1]);
+		// A bigger pipe means fewer, bigger USB requests; the default is fine too
+		fcntl(mPipeWrite, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+	}
+
+	// Every write to the endpoint ends in a short packet unless it is made of
+	// whole packets, so each chunk is put in the pipe completely and then
+	// written at once. A page is left for the file data not being page aligned.
+	int pipe_size = fcntl(mPipeWrite, F_GETPIPE_SZ);
+	int64_t chunk = (pipe_size - static_cast<int64_t>(getpagesize())) / packet_size * packet_size;
+	if (pipe_size == -1 || chunk <= 0)
+		return 0;
+
+	uint64_t sent = 0;
+	while (sent < length) {
+		size_t this_len = std::min(static_cast<uint64_t>(chunk), length - sent);
+		size_t in_pipe = 0;
+		while (in_pipe < this_len) {
+			loff_t file_offset = offset + sent + in_pipe;
+			ssize_t ret = TEMP_FAILURE_RETRY(splice(fd, &file_offset, mPipeWrite, nullptr,
+						this_len - in_pipe, SPLICE_F_MOVE));
+			if (ret == -1 && in_pipe == 0 && (errno == EINVAL || errno == ENOSYS)) {
+				// Not supported by this filesystem, read the rest of the file
+				return sent;
+			}
+			if (ret <= 0) {
+				errno = ret == -1 ? errno : EIO;
+				MTPE("Mtp error reading from disk\n");
+				mPipeRead.reset();
+				mPipeWrite.reset();
+				cancelTransaction();
+				return -1;
+			}
+			in_pipe += ret;
+		}
+
+		size_t out = 0;
+		while (out < this_len) {
+			ssize_t ret = TEMP_FAILURE_RETRY(splice(mPipeRead, nullptr, mBulkIn, nullptr,
+						this_len - out, SPLICE_F_MOVE));
+			if (ret == -1 && out == 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+				MTPI("Gadget driver can't splice to the endpoint, copying file data\n");
+				mNoSplice = true;
+				// drop what is left in the pipe
+				mPipeRead.reset();
+				mPipeWrite.reset();
+				return sent;
+			}
+			if (ret <= 0) {
+				errno = ret == -1 ? errno : EIO;
+				MTPE("Mtp error splicing to usb: %s\n", strerror(errno));
+				mPipeRead.reset();
+				mPipeWrite.reset();
+				return -1;
+			}
+			out += ret;
+		}
+		sent += this_len;
+	}
+	return sent;
+}
+
 int MtpFfsHandle::sendEvent(mtp_event me) {
 	// Mimic the behavior of f_mtp by sending the event async.
 	// Events aren't critical to the connection, so we don't need to check the return value.
@@ -26,8 +26,9 @@
 #include <vector>
 
 #include <IMtpHandle.h>
+#include "MtpStats.h"
 
-constexpr int NUM_IO_BUFS = 2;
+constexpr int NUM_IO_BUFS = 4;
 
 struct io_buffer {
 	std::vector<struct iocb> iocbs;		// Holds memory for all iocbs. Not used directly.
@@ -54,7 +55,13 @@ protected:
 
 	static int getPacketSize(int ffs_fd);
 
+	// Send file data to the bulk in endpoint without copying it to user space.
+	// Returns the amount sent, less than length if the splice isn't supported,
+	// or -1.
+	int64_t spliceFile(int fd, uint64_t offset, uint64_t length, int packet_size);
+
 	bool mCanceled;
+	bool mNoSplice;		// the gadget driver refused a splice to the endpoint
 
 	android::base::unique_fd mControl;
 	// "in" from the host's perspective => sink for mtp server
@@ -62,6 +69,9 @@ protected:
 	// "out" from the host's perspective => source for mtp server
 	android::base::unique_fd mBulkOut;
 	android::base::unique_fd mIntr;
+	// pipe for splicing file data to mBulkIn
+	android::base::unique_fd mPipeRead;
+	android::base::unique_fd mPipeWrite;
 
 	aio_context_t mCtx;
 
@@ -70,6 +80,13 @@ protected:
 
 	struct io_buffer mIobuf[NUM_IO_BUFS];
 
+	// whole file transfers, and the time within them spent waiting
+	MtpStat mSendFileStat;
+	MtpStat mReceiveFileStat;
+	MtpStat mSpliceStat;
+	MtpStat mUsbWaitStat;
+	MtpStat mDiskWaitStat;
+
 	// Submit an io request of given length. Return amount submitted or -1.
 	int iobufSubmit(struct io_buffer *buf, int fd, unsigned length, bool read);
 
@@ -90,6 +107,7 @@ public:
 
 	int start(bool ptp) override;
 	void close() override;
+	void dumpStats() override;
 
 	bool writeDescriptors(bool ptp);
 
@@ -40,6 +40,7 @@
 #include "MtpObjectInfo.h"
 #include "MtpProperty.h"
 #include "MtpServer.h"
+#include "MtpStats.h"
 #include "MtpStorage.h"
 #include "MtpStringBuffer.h"
 
@@ -115,7 +116,8 @@ MtpServer::MtpServer(IMtpDatabase* database, int controlFd, bool ptp,
 		mSendObjectHandle(kInvalidObjectHandle),
 		mSendObjectFormat(0),
 		mSendObjectFileSize(0),
-		mSendObjectModifiedTime(0)
+		mSendObjectModifiedTime(0),
+		mFileBytes(0)
 {
 	bool ffs_ok = access(FFS_MTP_EP0, W_OK) == 0;
 	if (ffs_ok) {
@@ -127,11 +129,34 @@ MtpServer::MtpServer(IMtpDatabase* database, int controlFd, bool ptp,
 	}
 }
 
+MtpServer::MtpServer(IMtpDatabase* database, IMtpHandle* handle, bool ptp,
+					const char *deviceInfoManufacturer,
+					const char *deviceInfoModel,
+					const char *deviceInfoDeviceVersion,
+					const char *deviceInfoSerialNumber)
+	:	mDatabase(database),
+		mPtp(ptp),
+		mDeviceInfoManufacturer(deviceInfoManufacturer),
+		mDeviceInfoModel(deviceInfoModel),
+		mDeviceInfoDeviceVersion(deviceInfoDeviceVersion),
+		mDeviceInfoSerialNumber(deviceInfoSerialNumber),
+		mSessionID(0),
+		mSessionOpen(false),
+		mHandle(handle),
+		mSendObjectHandle(kInvalidObjectHandle),
+		mSendObjectFormat(0),
+		mSendObjectFileSize(0),
+		mSendObjectModifiedTime(0),
+		mFileBytes(0)
+{
+}
+
 MtpServer::~MtpServer() {
 }
 
 void MtpServer::addStorage(MtpStorage* storage) {
 	std::lock_guard<std::mutex> lg(mMutex);
+	// quick, the folders are read on the storage's own thread
 	mDatabase->createDB(storage, storage->getStorageID());
 	mStorages.push_back(storage);
 	sendStoreAdded(storage->getStorageID());
@@ -181,6 +206,8 @@ void MtpServer::run() {
 		}
 		MtpOperationCode operation = mRequest.getOperationCode();
 		MtpTransactionID transaction = mRequest.getTransactionID();
+		uint64_t start = MtpStat::now();
+		mFileBytes = 0;
 
 		MTPD("operation: %s\n", MtpDebug::getOperationCodeName(operation));
 		// FIXME need to generalize this
@@ -231,6 +258,7 @@ void MtpServer::run() {
 				}
 				break;
 			}
+			recordStat(operation, MtpStat::now() - start);
 		} else {
 			MTPD("skipping response\n");
 		}
@@ -245,9 +273,57 @@ void MtpServer::run() {
 	}
 	mObjectEditList.clear();
 
+	// the host went away without closing the session
+	if (mSessionOpen)
+		dumpStats();
+
 	mHandle->close();
 }
 
+void MtpServer::recordStat(MtpOperationCode operation, uint64_t usec) {
+	uint64_t bytes = mFileBytes;
+	if (bytes == 0 && mData.hasData())
+		bytes = mData.getContainerLength();
+	switch (operation) {
+		case MTP_OPERATION_GET_OBJECT:
+			mGetObjectStat.add(bytes, usec);
+			break;
+		case MTP_OPERATION_SEND_OBJECT:
+			mSendObjectStat.add(bytes, usec);
+			break;
+		case MTP_OPERATION_GET_OBJECT_PROP_LIST:
+			mGetObjectPropListStat.add(bytes, usec);
+			break;
+		case MTP_OPERATION_GET_OBJECT_HANDLES:
+			mGetObjectHandlesStat.add(bytes, usec);
+			break;
+		case MTP_OPERATION_GET_PARTIAL_OBJECT:
+		case MTP_OPERATION_GET_PARTIAL_OBJECT_64:
+			mGetPartialObjectStat.add(bytes, usec);
+			break;
+		case MTP_OPERATION_GET_THUMB:
+			mGetThumbStat.add(bytes, usec);
+			break;
+	}
+}
+
+void MtpServer::dumpStats() {
+	MTPI("Session %u:\n", mSessionID);
+	mGetObjectStat.log("GetObject");
+	mSendObjectStat.log("SendObject");
+	mGetObjectPropListStat.log("GetObjectPropList");
+	mGetObjectHandlesStat.log("GetObjectHandles");
+	mGetPartialObjectStat.log("GetPartialObject");
+	mGetThumbStat.log("GetThumb");
+	mHandle->dumpStats();
+	mGetObjectStat.clear();
+	mSendObjectStat.clear();
+	mGetObjectPropListStat.clear();
+	mGetObjectHandlesStat.clear();
+	mGetPartialObjectStat.clear();
+	mGetThumbStat.clear();
+}
+
 void MtpServer::sendObjectAdded(MtpObjectHandle handle) {
 	MTPD("MtpServer::sendObjectAdded %d\n", handle);
 	sendEvent(MTP_EVENT_OBJECT_ADDED, handle);
@@ -519,6 +595,7 @@ MtpResponseCode MtpServer::doOpenSession() {
 MtpResponseCode MtpServer::doCloseSession() {
 	if (!mSessionOpen)
 		return MTP_RESPONSE_SESSION_NOT_OPEN;
+	dumpStats();
 	mSessionID = 0;
 	mSessionOpen = false;
 	return MTP_RESPONSE_OK;
@@ -809,6 +886,7 @@ MtpResponseCode MtpServer::doGetObject() {
 		}
 	} else {
 		result = MTP_RESPONSE_OK;
+		mFileBytes = fileLength;
 	}
 
 	auto end = std::chrono::steady_clock::now();
@@ -870,12 +948,15 @@ MtpResponseCode MtpServer::doGetPartialObject(MtpOperationCode operation) {
 	int result = mDatabase->getObjectFilePath(handle, pathBuf, fileLength, format);
 	if (result != MTP_RESPONSE_OK)
 		return result;
-	if (offset + length > (uint64_t)fileLength)
+	if (offset >= (uint64_t)fileLength)
+		length = 0;
+	else if (offset + length > (uint64_t)fileLength)
 		length = fileLength - offset;
 
 	const char* filePath = (const char *)pathBuf;
 	MTPD("sending partial %s\n %" PRIu64 " %" PRIu32, filePath, offset, length);
 	mtp_file_range	mfr;
+	// sendFile reads straight from the offset, spliced like a whole GetObject
 	mfr.fd = open(filePath, O_RDONLY);
 	if (mfr.fd < 0) {
 		return MTP_RESPONSE_GENERAL_ERROR;
@@ -895,6 +976,8 @@ MtpResponseCode MtpServer::doGetPartialObject(MtpOperationCode operation) {
 			result = MTP_RESPONSE_TRANSACTION_CANCELLED;
 		else
 			result = MTP_RESPONSE_GENERAL_ERROR;
+	} else {
+		mFileBytes = length;
 	}
 	closeObjFd(mfr.fd, filePath);
 	return result;
@@ -1199,6 +1282,20 @@ MtpResponseCode MtpServer::doSendObject() {
 	fchmod(mfr.fd, FILE_PERM);
 	umask(mask);
 
+	// Reserve the space up front, so the filesystem can lay the file out in
+	// one piece and a full storage shows before anything is transferred
+	if (mSendObjectFileSize != 0xFFFFFFFF && mSendObjectFileSize > 0 &&
+			fallocate(mfr.fd, FALLOC_FL_KEEP_SIZE, 0, mSendObjectFileSize) < 0) {
+		if (errno == ENOSPC) {
+			MTPE("no space for %s\n", (const char*)mSendObjectFilePath);
+			closeObjFd(mfr.fd, mSendObjectFilePath);
+			unlink(mSendObjectFilePath);
+			result = MTP_RESPONSE_STORAGE_FULL;
+			goto done;
+		}
+		MTPD("fallocate not supported here: %s\n", strerror(errno));
+	}
+
 	if (initialData > 0) {
 		ret = write(mfr.fd, mData.getData(), initialData);
 	}
@@ -1246,6 +1343,8 @@ MtpResponseCode MtpServer::doSendObject() {
 			result = MTP_RESPONSE_TRANSACTION_CANCELLED;
 		else
 			result = MTP_RESPONSE_GENERAL_ERROR;
+	} else {
+		mFileBytes = sstat.st_size;
 	}
 
 done:
@@ -24,6 +24,7 @@
 #include "MtpStringBuffer.h"
 #include "mtp.h"
 #include "MtpUtils.h"
+#include "MtpStats.h"
 #include "IMtpHandle.h"
 
 #include <memory>
@@ -74,6 +75,16 @@ private:
 
 	std::mutex			mMutex;
 
+	// the operations a host waits on most, logged when the session ends
+	MtpStat				mGetObjectStat;
+	MtpStat				mSendObjectStat;
+	MtpStat				mGetObjectPropListStat;
+	MtpStat				mGetObjectHandlesStat;
+	MtpStat				mGetPartialObjectStat;
+	MtpStat				mGetThumbStat;
+	// file data moved by the operation being handled
+	uint64_t			mFileBytes;
+
 	// represents an MTP object that is being edited using the android extensions
 	// for direct editing (BeginEditObject, SendPartialObject, TruncateObject and EndEditObject)
 	class ObjectEdit {
@@ -101,6 +112,13 @@ public:
 									const char *deviceInfoModel,
 									const char *deviceInfoDeviceVersion,
 									const char *deviceInfoSerialNumber);
+	// Serves the requests that come from handle instead of the USB gadget,
+	// for driving the server without a host. The handle isn't deleted.
+						MtpServer(IMtpDatabase* database, IMtpHandle* handle, bool ptp,
+									const char *deviceInfoManufacturer,
+									const char *deviceInfoModel,
+									const char *deviceInfoDeviceVersion,
+									const char *deviceInfoSerialNumber);
 	virtual				~MtpServer();
 
 	MtpStorage*			getStorage(MtpStorageID id);
@@ -130,6 +148,8 @@ private:
 	void				commitEdit(ObjectEdit* edit);
 
 	bool				handleRequest();
+	void				recordStat(MtpOperationCode operation, uint64_t usec);
+	void				dumpStats();
 
 	MtpResponseCode		doGetDeviceInfo();
 	MtpResponseCode		doOpenSession();
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "MtpDebug.h"
+#include "MtpStats.h"
+
+void MtpStat::add(uint64_t bytes, uint64_t usec) {
+	mCount++;
+	mBytes += bytes;
+	mUsec += usec;
+	if (usec > mMaxUsec)
+		mMaxUsec = usec;
+}
+
+void MtpStat::clear() {
+	mCount = 0;
+	mBytes = 0;
+	mUsec = 0;
+	mMaxUsec = 0;
+}
+
+void MtpStat::log(const char* name) const {
+	if (mCount == 0)
+		return;
+	// bytes per usec is MB/s
+	double rate = mUsec ? (double) mBytes / mUsec : 0;
+	MTPI("%-20s %6llu ops %12llu bytes %8llu ms (avg %llu us, max %llu us) %.1f MB/s\n", name,
+			(unsigned long long) mCount, (unsigned long long) mBytes,
+			(unsigned long long) mUsec / 1000, (unsigned long long) (mUsec / mCount),
+			(unsigned long long) mMaxUsec, rate);
+}
+
+uint64_t MtpStat::now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *		http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_STATS_H
+#define _MTP_STATS_H
+
+#include <stdint.h>
+
+// Counts how often something was done, how much data it moved and how long
+// it took. Only touched by the MTP thread, so there is no locking.
+class MtpStat {
+public:
+	MtpStat() { clear(); }
+
+	void add(uint64_t bytes, uint64_t usec);
+	void clear();
+
+	// One line in the log with the totals, nothing if it never happened
+	void log(const char* name) const;
+
+	inline uint64_t getCount() const { return mCount; }
+	inline uint64_t getBytes() const { return mBytes; }
+	inline uint64_t getUsec() const { return mUsec; }
+
+	// Monotonic time in microseconds, for timing what is added
+	static uint64_t now();
+
+private:
+	uint64_t mCount;
+	uint64_t mBytes;
+	uint64_t mUsec;
+	uint64_t mMaxUsec;
+};
+
+#endif // _MTP_STATS_H
@@ -18,6 +18,7 @@
 
 #include "MtpDebug.h"
 #include "MtpStorage.h"
+#include "MtpUtils.h"
 #include "btree.hpp"
 
 #include <sys/types.h>
@@ -26,14 +27,21 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
 #include <limits.h>
+#include <atomic>
+#include <deque>
 #include <iterator>
 #include <sys/inotify.h>
 
 #define WATCH_FLAGS ( IN_CREATE | IN_DELETE | IN_MOVE | IN_MODIFY )
 
+#ifndef FUSE_SUPER_MAGIC
+#define FUSE_SUPER_MAGIC 0x65735546
+#endif
+
 MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
 		const char* description, bool removable, uint64_t maxFileSize, MtpServer* refserver)
 	:	mStorageID(id),
@@ -49,21 +57,19 @@ MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
 	inotify_fd = -1;
 	// Threading has not started yet so we should be safe to set these directly instead of using atomics
 	inotify_thread_kill.set_value(0);
+	scan_thread = 0;
+	scan_thread_kill.set_value(0);
 	sendEvents = false;
 	handleCurrentlySending = 0;
-	use_mutex = true;
-	if (pthread_mutex_init(&mtpMutex, NULL) != 0) {
-			MTPE("Failed to init mtpMutex\n");
-			use_mutex = false;
-	}
-	if (pthread_mutex_init(&inMutex, NULL) != 0) {
-			MTPE("Failed to init inMutex\n");
-			pthread_mutex_destroy(&mtpMutex);
-			use_mutex = false;
-	}
+	trustDirentType = false;
 }
 
 MtpStorage::~MtpStorage() {
+	if (scan_thread) {
+			scan_thread_kill.set_value(1);
+			pthread_join(scan_thread, NULL);
+			scan_thread = 0;
+	}
 	if (inotify_thread) {
 			inotify_thread_kill.set_value(1);
 			MTPD("joining inotify_thread after sending the kill notification.\n");
@@ -78,15 +84,9 @@ MtpStorage::~MtpStorage() {
 	}
 		// Deleting the root tree causes a cascade in btree.cpp that ends up
 		// deleting all of the trees and nodes.
-		delete mtpmap[0];
-		mtpmap.clear();
-		if (use_mutex) {
-				use_mutex = false;
-				MTPD("~MtpStorage destroying mutexes\n");
-				pthread_mutex_destroy(&mtpMutex);
-				pthread_mutex_destroy(&inMutex);
-		}
-
+		if (!mNodes.empty())
+				delete mNodes[0];
+		mNodes.clear();
 }
 
 int MtpStorage::getType() const {
@@ -124,24 +124,23 @@ const char* MtpStorage::getDescription() const {
 
 int MtpStorage::renameObject(MtpObjectHandle handle, std::string newName) {
 		MTPD("MtpStorage::renameObject, handle: %u, new name: '%s'\n", handle, newName.c_str());
+		std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
 		if (handle == MTP_PARENT_ROOT) {
 				MTPE("parent == MTP_PARENT_ROOT, cannot rename root\n");
 				return -1;
 		} else {
-				for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-						Node* node = i->second->findNode(handle);
-						if (node != NULL) {
-				std::string oldName = getNodePath(node);
-								std::string parentdir = oldName.substr(0, oldName.find_last_of('/'));
-								std::string newFullName = parentdir + "/" + newName;
-								MTPD("old: '%s', new: '%s'\n", oldName.c_str(), newFullName.c_str());
-								if (rename(oldName.c_str(), newFullName.c_str()) == 0) {
-										node->rename(newName);
-										return 0;
-								} else {
-										MTPE("MtpStorage::renameObject failed, handle: %u, new name: '%s'\n", handle, newName.c_str());
-										return -1;
-								}
+				Node* node = findNode(handle);
+				if (node != NULL) {
+						std::string oldName = getNodePath(node);
+						std::string parentdir = oldName.substr(0, oldName.find_last_of('/'));
+						std::string newFullName = parentdir + "/" + newName;
+						MTPD("old: '%s', new: '%s'\n", oldName.c_str(), newFullName.c_str());
+						if (rename(oldName.c_str(), newFullName.c_str()) == 0) {
+								node->rename(newName);
+								return 0;
+						} else {
+								MTPE("MtpStorage::renameObject failed, handle: %u, new name: '%s'\n", handle, newName.c_str());
+								return -1;
 						}
 				}
 		}
@@ -155,12 +154,12 @@ MtpObjectHandle MtpStorage::beginSendObject(const char* path,
 																						__attribute__((unused)) uint64_t size,
 																						__attribute__((unused)) time_t modified) {
 		MTPD("MtpStorage::beginSendObject(), path: '%s', parent: %u, format: %04x\n", path, parent, format);
-		iter it = mtpmap.find(parent);
-		if (it == mtpmap.end()) {
+		std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
+		Tree* tree = findTree(parent);
+		if (tree == NULL) {
 				MTPE("parent node not found, returning error\n");
 				return kInvalidObjectHandle;
 		}
-		Tree* tree = it->second;
 
 		std::string pathstr(path);
 		size_t slashpos = pathstr.find_last_of('/');
@@ -187,44 +186,61 @@ MtpObjectHandle MtpStorage::beginSendObject(const char* path,
 int MtpStorage::createDB() {
 		std::string mtpParent = "";
 		mtpstorageparent = getPath();
+		// exfat-fuse doesn't fill in d_type properly, kernel filesystems do
+		struct statfs fs;
+		trustDirentType = statfs(mtpstorageparent.c_str(), &fs) == 0 && fs.f_type != FUSE_SUPER_MAGIC;
+		MTPD("MtpStorage::createDB %s d_type\n", trustDirentType ? "trusting" : "not trusting");
+		std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
 		// root directory is special: handle 0, parent 0, and empty path
-		mtpmap[0] = new Tree(0, 0, "");
-		if (use_mutex) {
-				sendEvents = true;
-				MTPD("inotify_init\n");
-				inotify_fd = inotify_init();
-				if (inotify_fd < 0) {
-						MTPE("Can't run inotify_init for mtp server: %s\n", strerror(errno));
-				} else {
-						MTPD("Starting inotify thread\n");
-						inotify_thread = inotify();
-				}
+		mNodes.assign(1, new Tree(0, 0, ""));
+		sendEvents = true;
+		MTPD("inotify_init\n");
+		inotify_fd = inotify_init();
+		if (inotify_fd < 0) {
+				MTPE("Can't run inotify_init for mtp server: %s\n", strerror(errno));
 		} else {
-				MTPD("NOT starting inotify thread\n");
+				MTPD("Starting inotify thread\n");
+				inotify_thread = inotify();
 		}
-		// for debugging and caching purposes, read the root dir already now
-		readDir(mtpstorageparent, mtpmap[0]);
-		// all other dirs are read on demand
-	//
+		// The folders are read ahead on this storage's own thread, so a slow
+		// card doesn't hold up adding it or the requests for other storages.
+		// Folders the host opens before the scan gets to them are read on demand.
+		scan_thread = startThread(&MtpStorage::scan_t);
+		if (!scan_thread)
+				readDir(mtpstorageparent, findTree(0));
 		MTPD("MtpStorage::createDB DONE\n");
 		return 0;
 }
 
 Node* MtpStorage::findNode(MtpObjectHandle handle) {
-		for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-				Node* node = i->second->findNode(handle);
-				if (node != NULL) {
-						MTPD("findNode: found node %p for handle %u, name: %s\n", node, handle, node->getName().c_str());
-						if (node->Mtpid() != handle)
-						{
-								MTPE("BUG: entry for handle %u points to node with handle %u\n", handle, node->Mtpid());
-						}
-						return node;
-				}
+		Node* node = handle < mNodes.size() ? mNodes[handle] : NULL;
+		if (node == NULL) {
+				// Item is not on this storage device
+				MTPD("MtpStorage::findNode: no node found for handle %u on storage %u\n", handle, mStorageID);
+				return NULL;
 		}
-		// Item is not on this storage device
-		MTPD("MtpStorage::findNode: no node found for handle %u on storage %u, searched %u trees\n", handle, mStorageID, mtpmap.size());
-		return NULL;
+		if (node->Mtpid() != handle)
+				MTPE("BUG: entry for handle %u points to node with handle %u\n", handle, node->Mtpid());
+		return node;
+}
+
+Tree* MtpStorage::findTree(MtpObjectHandle handle) {
+		Node* node = findNode(handle);
+		if (node == NULL || !node->isDir())
+				return NULL;
+		return static_cast<Tree*>(node);
+}
+
+// Drops a node and everything below it from the handle table, before the
+// node itself is deleted
+void MtpStorage::forgetNodes(Node* node) {
+		if (node->isDir()) {
+				const std::vector<Node*>& entries = static_cast<Tree*>(node)->getEntries();
+				for (size_t i = 0; i < entries.size(); ++i)
+						forgetNodes(entries[i]);
+		}
+		if (node->Mtpid() < mNodes.size())
+				mNodes[node->Mtpid()] = NULL;
 }
 
 std::string MtpStorage::getNodePath(Node* node) {
@@ -245,6 +261,7 @@ std::string MtpStorage::getNodePath(Node* node) {
 
 MtpObjectHandleList* MtpStorage::getObjectList(__attribute__((unused)) MtpStorageID storageID, MtpObjectHandle parent) {
 		MTPD("MtpStorage::getObjectList, parent: %u\n", parent);
+		std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
 		//append object id	(numerical #s) of database to int array
 		MtpObjectHandleList* list = new MtpObjectHandleList();
 		if (parent == MTP_PARENT_ROOT) {
@@ -252,12 +269,12 @@ MtpObjectHandleList* MtpStorage::getObjectList(__attribute__((unused)) MtpStorag
 				parent = 0;
 		}
 
-		if (mtpmap.find(parent) == mtpmap.end()) {
+		Tree* tree = findTree(parent);
+		if (tree == NULL) {
 				MTPE("parent handle not found, returning empty list\n");
 				return list;
 		}
 
-		Tree* tree = mtpmap[parent];
 		if (!tree->wasAlreadyRead())
 		{
 				std::string path = getNodePath(tree);
@@ -265,66 +282,150 @@ MtpObjectHandleList* MtpStorage::getObjectList(__attribute__((unused)) MtpStorag
 				readDir(path, tree);
 		}
 
-		mtpmap[parent]->getmtpids(list);
+		tree->getmtpids(list);
 		MTPD("returning %u objects in %s.\n", list->size(), tree->getName().c_str());
 		return list;
 }
 
 Node* MtpStorage::addNewNode(bool isDir, Tree* tree, const std::string& name)
 {
-		// global counter for new object handles
-		static MtpObjectHandle mtpid = 0;
+		// global counter for new object handles, shared by the storages
+		static std::atomic<MtpObjectHandle> nextMtpid(0);
 
-		++mtpid;
+		MtpObjectHandle mtpid = ++nextMtpid;
 		MTPD("adding new %s node for %s, new handle: %u\n", isDir ? "dir" : "file", name.c_str(), mtpid);
 		MtpObjectHandle parent = tree->Mtpid();
 		MTPD("parent tree: %x, handle: %u, name: %s\n", tree, parent, tree->getName().c_str());
 		Node* node;
 		if (isDir)
-				node = mtpmap[mtpid] = new Tree(mtpid, parent, name);
+				node = new Tree(mtpid, parent, name);
 		else
 				node = new Node(mtpid, parent, name);
+		if (mtpid >= mNodes.size())
+				mNodes.resize(mtpid + 1, NULL);
+		mNodes[mtpid] = node;
 		tree->addEntry(node);
 		return node;
 }
 
+// Properties need an lstat, which is most of the time of reading a big
+// folder, so they're only read once a host asks for them
+void MtpStorage::loadProperties(Node* node)
+{
+		if (!node->hasProperties())
+				node->readProperties(getNodePath(node));
+}
+
 int MtpStorage::readDir(const std::string& path, Tree* tree)
+{
+		std::vector<DirEntry> entries;
+		if (listDir(path, entries, false) < 0)
+				return -1;
+		addEntries(tree, entries);
+		return 0;
+}
+
+// Only touches the filesystem, so it can run without the tree lock
+int MtpStorage::listDir(const std::string& path, std::vector<DirEntry>& entries, bool statAll)
 {
 		struct dirent *de;
-		int storageID = getStorageID();
-		MtpObjectHandle parent = tree->Mtpid();
 
 		DIR *d = opendir(path.c_str());
-		MTPD("reading dir '%s', parent handle %u\n", path.c_str(), parent);
+		MTPD("reading dir '%s'\n", path.c_str());
 		if (d == NULL) {
 				MTPE("error opening '%s' -- error: %s\n", path.c_str(), strerror(errno));
 				return -1;
 		}
-		// TODO: for refreshing dirs: capture old entries here
 		while ((de = readdir(d)) != NULL) {
-				// Because exfat-fuse causes issues with dirent, we will use stat
-				// for some things that dirent should be able to do
-				std::string item = path + "/" + de->d_name;
-				struct stat st;
-				if (lstat(item.c_str(), &st)) {
-						MTPE("Error running lstat on '%s'\n", item.c_str());
-						return -1;
-				}
-				// TODO: if we want to use this for refreshing dirs too, first find existing name and overwrite
 				if (strcmp(de->d_name, ".") == 0)
 						continue;
 				if (strcmp(de->d_name, "..") == 0)
 						continue;
-				Node* node = addNewNode(st.st_mode & S_IFDIR, tree, de->d_name);
-				node->addProperties(item, storageID);
+				DirEntry entry;
+				entry.name = de->d_name;
+				entry.isDir = de->d_type == DT_DIR;
+				entry.hasStat = false;
+				if (statAll || !trustDirentType || de->d_type == DT_UNKNOWN) {
+						// Because exfat-fuse causes issues with dirent, we will use stat
+						// for some things that dirent should be able to do
+						std::string item = path + "/" + de->d_name;
+						struct stat st;
+						if (lstat(item.c_str(), &st)) {
+								MTPE("Error running lstat on '%s'\n", item.c_str());
+								continue;
+						}
+						entry.isDir = S_ISDIR(st.st_mode);
+						entry.hasStat = true;
+						entry.size = st.st_size;
+						entry.modified = st.st_mtime;
+				}
+				entries.push_back(entry);
+		}
+		closedir(d);
+		return 0;
+}
+
+void MtpStorage::addEntries(Tree* tree, const std::vector<DirEntry>& entries)
+{
+		// TODO: for refreshing dirs: capture old entries here
+		for (size_t i = 0; i < entries.size(); ++i) {
+				// TODO: if we want to use this for refreshing dirs too, first find existing name and overwrite
+				Node* node = addNewNode(entries[i].isDir, tree, entries[i].name);
+				// the lstat is most of the cost of the properties, don't throw it away
+				if (entries[i].hasStat)
+						node->setProperties(entries[i].size, entries[i].modified);
 				//if (sendEvents)
 				//		mServer->sendObjectAdded(node->Mtpid());
 				//		sending events here makes simple-mtpfs very slow, and it is probably the wrong thing to do anyway
 		}
-		closedir(d);
 		// TODO: for refreshing dirs: remove entries that no longer exist (with their nodes)
 		tree->setAlreadyRead(true);
 		addInotify(tree);
+}
+
+// Folders read ahead per storage. Enough for what a host shows right after
+// connecting, without walking all of a big card.
+#define MAX_SCAN_DIRS 256
+
+int MtpStorage::scan_t(void) {
+		MTPD("scan thread starting for %s\n", mtpstorageparent.c_str());
+		std::deque<MtpObjectHandle> pending(1, 0);
+		int scanned = 0;
+		while (!pending.empty() && scanned < MAX_SCAN_DIRS && scan_thread_kill.get_value() == 0) {
+				MtpObjectHandle handle = pending.front();
+				pending.pop_front();
+				std::vector<DirEntry> entries;
+				bool haveEntries = false;
+				std::string path;
+				{
+						std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
+						Tree* tree = findTree(handle);
+						if (!tree)
+								continue;
+						if (!tree->wasAlreadyRead())
+								path = handle ? getNodePath(tree) : mtpstorageparent;
+				}
+				// the slow part is done without the lock, so the host can keep
+				// browsing this storage while it runs
+				if (!path.empty()) {
+						haveEntries = listDir(path, entries, true) == 0;
+						scanned++;
+				}
+
+				std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
+				Tree* tree = findTree(handle);
+				if (!tree)
+						continue;
+				// read on demand in the meantime, or deleted and made again
+				if (haveEntries && !tree->wasAlreadyRead())
+						addEntries(tree, entries);
+				const std::vector<Node*>& children = tree->getEntries();
+				for (size_t i = 0; i < children.size(); ++i) {
+						if (children[i]->isDir())
+								pending.push_back(children[i]->Mtpid());
+				}
+		}
+		MTPD("scan thread done for %s, %d folders read\n", mtpstorageparent.c_str(), scanned);
 		return 0;
 }
 
@@ -345,6 +446,10 @@ int MtpStorage::addInotify(Tree* tree) {
 }
 
 pthread_t MtpStorage::inotify(void) {
+		return startThread(&MtpStorage::inotify_t);
+}
+
+pthread_t MtpStorage::startThread(ThreadPtr func) {
 		pthread_t thread;
 		pthread_attr_t tattr;
 
@@ -356,12 +461,15 @@ pthread_t MtpStorage::inotify(void) {
 				MTPE("Error setting pthread_attr_setdetachstate\n");
 				return 0;
 		}
-		ThreadPtr inotifyptr = &MtpStorage::inotify_t;
-		PThreadPtr p = *(PThreadPtr*)&inotifyptr;
-		pthread_create(&thread, &tattr, p, this);
+		PThreadPtr p = *(PThreadPtr*)&func;
+		int ret = pthread_create(&thread, &tattr, p, this);
 		if (pthread_attr_destroy(&tattr)) {
 				MTPE("Failed to pthread_attr_destroy\n");
 		}
+		if (ret) {
+				MTPE("Unable to start thread: %s\n", strerror(ret));
+				return 0;
+		}
 		return thread;
 }
 
@@ -392,16 +500,21 @@ int MtpStorage::inotify_t(void) {
 						MTPE("inotify_t Can't read inotify events\n");
 				}
 
+				// apply everything from one read at once, and tell the host
+				// after the lock is dropped so it can ask about the changes
+				std::vector<std::pair<uint16_t, MtpObjectHandle> > events;
+				lockMutex(1);
 				while (i < len && inotify_thread_kill.get_value() == 0) {
 						struct inotify_event *event = (struct inotify_event *) &buf[i];
 						if (event->len) {
 								MTPD("inotify event: wd: %i, mask: %x, name: %s\n", event->wd, event->mask, event->name);
-								lockMutex(1);
 								handleInotifyEvent(event);
-								unlockMutex(1);
 						}
 						i += EVENT_SIZE + event->len;
 				}
+				events.swap(mPendingEvents);
+				unlockMutex(1);
+				flushEvents(events);
 		}
 		MTPD("inotify_thread_kill received!\n");
 		// This cleanup is handled in the destructor.
@@ -434,9 +547,7 @@ void MtpStorage::handleInotifyEvent(struct inotify_event* event)
 				}
 				if (node == NULL) {
 						node = addNewNode(event->mask & IN_ISDIR, tree, event->name);
-						std::string item = getNodePath(tree) + "/" + event->name;
-						node->addProperties(item, getStorageID());
-						mServer->sendObjectAdded(node->Mtpid());
+						queueEvent(MTP_EVENT_OBJECT_ADDED, node->Mtpid());
 				} else {
 						MTPD("inotify_t item already exists.\n");
 				}
@@ -464,22 +575,24 @@ void MtpStorage::handleInotifyEvent(struct inotify_event* event)
 						}
 						MtpObjectHandle handle = node->Mtpid();
 						deleteFile(handle);
-						mServer->sendObjectRemoved(handle);
+						queueEvent(MTP_EVENT_OBJECT_REMOVED, handle);
 				} else {
 						MTPD("inotify_t already removed.\n");
 				}
 		} else if (event->mask & IN_MODIFY) {
 				MTPD("inotify_t item %s modified.\n", event->name);
-				if (node != NULL) {
-						uint64_t orig_size = node->getProperty(MTP_PROPERTY_OBJECT_SIZE).valueInt;
+				if (node != NULL && !node->hasProperties()) {
+						MTPD("inotify_t properties not read yet, nothing to update\n");
+				} else if (node != NULL) {
+						uint64_t orig_size = node->getSize();
 						struct stat st;
 						uint64_t new_size = 0;
 						if (lstat(getNodePath(node).c_str(), &st) == 0)
 								new_size = (uint64_t)st.st_size;
 						if (orig_size != new_size) {
 								MTPD("size changed from %llu to %llu on mtpid: %u\n", orig_size, new_size, node->Mtpid());
-								node->updateProperty(MTP_PROPERTY_OBJECT_SIZE, new_size, "", MTP_TYPE_UINT64);
-								mServer->sendObjectUpdated(node->Mtpid());
+								node->setSize(new_size);
+								queueEvent(MTP_EVENT_OBJECT_PROP_CHANGED, node->Mtpid());
 						}
 				} else {
 						MTPE("inotify_t modified item not found\n");
@@ -489,79 +602,179 @@ void MtpStorage::handleInotifyEvent(struct inotify_event* event)
 		}
 }
 
-void MtpStorage::lockMutex(int thread_type) {
-		if (!use_mutex)
-				return; // mutex is disabled
-		if (thread_type) {
-				// inotify thread
-				pthread_mutex_lock(&inMutex);
-				while (pthread_mutex_trylock(&mtpMutex)) {
-						pthread_mutex_unlock(&inMutex);
-						usleep(32000);
-						pthread_mutex_lock(&inMutex);
+// Events from one inotify batch are merged before they go out: an object
+// added and removed again was never seen by the host, and an object that is
+// added or already updated needs no further update
+void MtpStorage::queueEvent(uint16_t code, MtpObjectHandle handle)
+{
+		bool added = false;
+		for (size_t i = 0; i < mPendingEvents.size(); ) {
+				if (mPendingEvents[i].second != handle) {
+						++i;
+						continue;
 				}
-		} else {
-				// main mtp thread
-				pthread_mutex_lock(&mtpMutex);
-				while (pthread_mutex_trylock(&inMutex)) {
-						pthread_mutex_unlock(&mtpMutex);
-						usleep(13000);
-						pthread_mutex_lock(&mtpMutex);
+				if (code == MTP_EVENT_OBJECT_PROP_CHANGED)
+						return;
+				if (mPendingEvents[i].first == MTP_EVENT_OBJECT_ADDED)
+						added = true;
+				// a removal replaces whatever was queued for the object
+				mPendingEvents.erase(mPendingEvents.begin() + i);
+		}
+		if (code == MTP_EVENT_OBJECT_REMOVED && added)
+				return;
+		mPendingEvents.push_back(std::make_pair(code, handle));
+}
+
+void MtpStorage::flushEvents(const std::vector<std::pair<uint16_t, MtpObjectHandle> >& events)
+{
+		for (size_t i = 0; i < events.size(); ++i) {
+				switch (events[i].first) {
+						case MTP_EVENT_OBJECT_ADDED:
+								mServer->sendObjectAdded(events[i].second);
+								break;
+						case MTP_EVENT_OBJECT_REMOVED:
+								mServer->sendObjectRemoved(events[i].second);
+								break;
+						case MTP_EVENT_OBJECT_PROP_CHANGED:
+								mServer->sendObjectUpdated(events[i].second);
+								break;
 				}
 		}
 }
 
-void MtpStorage::unlockMutex( __attribute__((unused)) int thread_type) {
-		if (!use_mutex)
-				return; // mutex is disabled
-		pthread_mutex_unlock(&inMutex);
-		pthread_mutex_unlock(&mtpMutex);
+// Every entry point takes the tree lock itself, so this is only for callers
+// that need several calls to see the same tree; the lock is recursive
+void MtpStorage::lockMutex(__attribute__((unused)) int thread_type) {
+		mTreeMutex.lock();
+}
+
+void MtpStorage::unlockMutex(__attribute__((unused)) int thread_type) {
+		mTreeMutex.unlock();
 }
 
 int MtpStorage::getObjectPropertyValue(MtpObjectHandle handle, MtpObjectProperty property, MtpStorage::PropEntry& pe) {
-		Node *node;
-		for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-				node = i->second->findNode(handle);
-				if (node != NULL) {
-						const Node::mtpProperty& prop = node->getProperty(property);
-						if (prop.property != property) {
-								MTPD("getObjectPropertyValue: unknown property %x for handle %u\n", property, handle);
-								return -1;
-						}
-						pe.datatype = prop.dataType;
-						pe.intvalue = prop.valueInt;
-						pe.strvalue = prop.valueStr;
-						pe.handle = handle;
-						pe.property = property;
-						return 0;
-				}
+		std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
+		Node* node = findNode(handle);
+		if (node == NULL) {
+				// handle not found on this storage
+				return -1;
 		}
-		// handle not found on this storage
-		return -1;
+		loadProperties(node);
+		Node::mtpProperty prop;
+		if (!node->getProperty(property, mStorageID, prop)) {
+				MTPD("getObjectPropertyValue: unknown property %x for handle %u\n", property, handle);
+				return -1;
+		}
+		pe.datatype = prop.dataType;
+		pe.intvalue = prop.valueInt;
+		pe.strvalue = prop.valueStr;
+		pe.handle = handle;
+		pe.property = property;
+		return 0;
 }
 
 void MtpStorage::endSendObject(const char* path, MtpObjectHandle handle, __attribute__((unused)) MtpObjectFormat format, __attribute__((unused)) bool succeeded)
 {
+		std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
 		Node* node = findNode(handle);
 		if (!node)
 				return; // just ignore if this is for another storage
 
-		node->addProperties(path, mStorageID);
+		// read again when a host asks, with the size and time of the new file
+		node->clearProperties();
 		handleCurrentlySending = 0;
 		// TODO: are we supposed to send an event about an upload by the initiator?
 		if (sendEvents)
 				mServer->sendObjectAdded(node->Mtpid());
 }
 
-int MtpStorage::getObjectPropertyList(MtpObjectHandle handle, uint32_t format, uint32_t property, int groupCode, __attribute__((unused)) int depth, MtpDataPacket& packet) {
-		MTPD("MtpStorage::getObjectPropertyList handle: %u, format: %x, property: %x\n", handle, format, property);
+static void putPropEntry(MtpDataPacket& packet, const MtpStorage::PropEntry& p)
+{
+		MTPD("handle: %u, propertyCode: %x = %s, datatype: %x, value: %llu\n",
+						p.handle, p.property, MtpDebug::getObjectPropCodeName(p.property),
+						p.datatype, p.intvalue);
+		packet.putUInt32(p.handle);
+		packet.putUInt16(p.property);
+		packet.putUInt16(p.datatype);
+		switch (p.datatype) {
+				case MTP_TYPE_INT8:
+						MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_INT8\n");
+						packet.putInt8(p.intvalue);
+						break;
+				case MTP_TYPE_UINT8:
+						MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_UINT8\n");
+						packet.putUInt8(p.intvalue);
+						break;
+				case MTP_TYPE_INT16:
+						MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_INT16\n");
+						packet.putInt16(p.intvalue);
+						break;
+				case MTP_TYPE_UINT16:
+						MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_UINT16\n");
+						packet.putUInt16(p.intvalue);
+						break;
+				case MTP_TYPE_INT32:
+						MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_INT32\n");
+						packet.putInt32(p.intvalue);
+						break;
+				case MTP_TYPE_UINT32:
+						MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_UINT32\n");
+						packet.putUInt32(p.intvalue);
+						break;
+				case MTP_TYPE_INT64:
+						MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_INT64\n");
+						packet.putInt64(p.intvalue);
+						break;
+				case MTP_TYPE_UINT64:
+						MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_UINT64\n");
+						packet.putUInt64(p.intvalue);
+						break;
+				case MTP_TYPE_INT128:
+						MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_INT128\n");
+						packet.putInt128(p.intvalue);
+						break;
+				case MTP_TYPE_UINT128:
+						MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_UINT128\n");
+						packet.putUInt128(p.intvalue);
+						break;
+				case MTP_TYPE_STR:
+						MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_STR: %s\n", p.strvalue.c_str());
+						packet.putString(p.strvalue.c_str());
+						break;
+				default:
+						MTPE("bad or unsupported data type: %x in MyMtpDatabase::getObjectPropertyList", p.datatype);
+						break;
+		}
+}
+
+// Windows asks for the properties of every object in a folder each time it
+// shows the folder, so the encoded list of a node is kept until it changes
+uint32_t MtpStorage::putNodeProperties(MtpDataPacket& packet, Node* node, uint32_t property, int groupCode)
+{
+		uint32_t count = 0;
+		const std::string* cached = node->getPropCache(property, count);
+		if (cached) {
+				packet.putData(cached->data(), cached->size());
+				return count;
+		}
+
+		std::vector<PropEntry> results;
+		queryNodeProperties(results, node, property, groupCode, mStorageID);
+		size_t start = packet.getOffset();
+		for (size_t i = 0; i < results.size(); ++i)
+				putPropEntry(packet, results[i]);
+		node->setPropCache(property, results.size(), packet.getBufferAt(start), packet.getOffset() - start);
+		return results.size();
+}
+
+int MtpStorage::getObjectPropertyList(MtpObjectHandle handle, uint32_t format, uint32_t property, int groupCode, int depth, MtpDataPacket& packet) {
+		MTPD("MtpStorage::getObjectPropertyList handle: %u, format: %x, property: %x, depth: %d\n", handle, format, property, depth);
 		if (groupCode != 0)
 		{
 				MTPE("getObjectPropertyList: groupCode unsupported\n");
 				return -1; // TODO: RESPONSE_SPECIFICATION_BY_GROUP_UNSUPPORTED
 		}
 		// TODO: support all the special stuff, like:
-		// handle == 0 -> all objects at the root level
 		// handle == 0xffffffff -> all objects (on all storages? how could we support that?)
 		// format == 0 -> all formats, otherwise filter by ObjectFormatCode
 		// property == 0xffffffff -> all properties except those with group code 0xffffffff
@@ -569,94 +782,40 @@ int MtpStorage::getObjectPropertyList(MtpObjectHandle handle, uint32_t format, u
 		//	 groupCode == 0 -> return Specification_By_Group_Unsupported
 		// depth == 0xffffffff -> all objects incl. and below handle
 
-		std::vector<PropEntry> results;
+		std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
+		Node* node = NULL;
+		if (handle != 0xffffffff) {
+				node = findNode(handle);
+				if (!node) {
+						// Item is not on this storage device
+						return -1;
+				}
+		}
+
+		// the count goes first, it's filled in once the items are put
+		size_t countOffset = packet.getOffset();
+		uint32_t count = 0;
+		packet.putUInt32(0);
 
 		if (handle == 0xffffffff) {
 				// TODO: all object on all storages (needs a different design, result packet needs to be built by server instead of storage)
-		} else if (handle == 0) {
-				// all objects at the root level
-				Tree* root = mtpmap[0];
-				MtpObjectHandleList list;
-				root->getmtpids(&list);
-				for (MtpObjectHandleList::iterator it = list.begin(); it != list.end(); ++it) {
-						Node* node = root->findNode(*it);
-						if (!node) {
-								MTPE("BUG: node not found for root entry with handle %u\n", *it);
-								break;
-						}
-						queryNodeProperties(results, node, property, groupCode, mStorageID);
+		} else if (handle == 0 || depth == 1) {
+				// all objects in a folder, handle 0 is the root
+				if (node->isDir()) {
+						Tree* tree = static_cast<Tree*>(node);
+						if (!tree->wasAlreadyRead())
+								readDir(getNodePath(tree), tree);
+						const std::vector<Node*>& entries = tree->getEntries();
+						for (size_t i = 0; i < entries.size(); ++i)
+								count += putNodeProperties(packet, entries[i], property, groupCode);
 				}
 		} else {
 				// single object
-				Node* node = findNode(handle);
-				if (!node) {
-						// Item is not on this storage device
-						return -1;
-				}
-				queryNodeProperties(results, node, property, groupCode, mStorageID);
-		}
-
-		MTPD("MtpStorage::getObjectPropertyList::count: %u\n", results.size());
-		packet.putUInt32(results.size());
-
-		for (size_t i = 0; i < results.size(); ++i) {
-				PropEntry& p = results[i];
-				MTPD("handle: %u, propertyCode: %x = %s, datatype: %x, value: %llu\n",
-								p.handle, p.property, MtpDebug::getObjectPropCodeName(p.property),
-								p.datatype, p.intvalue);
-				packet.putUInt32(p.handle);
-				packet.putUInt16(p.property);
-				packet.putUInt16(p.datatype);
-				switch (p.datatype) {
-						case MTP_TYPE_INT8:
-								MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_INT8\n");
-								packet.putInt8(p.intvalue);
-								break;
-						case MTP_TYPE_UINT8:
-								MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_UINT8\n");
-								packet.putUInt8(p.intvalue);
-								break;
-						case MTP_TYPE_INT16:
-								MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_INT16\n");
-								packet.putInt16(p.intvalue);
-								break;
-						case MTP_TYPE_UINT16:
-								MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_UINT16\n");
-								packet.putUInt16(p.intvalue);
-								break;
-						case MTP_TYPE_INT32:
-								MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_INT32\n");
-								packet.putInt32(p.intvalue);
-								break;
-						case MTP_TYPE_UINT32:
-								MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_UINT32\n");
-								packet.putUInt32(p.intvalue);
-								break;
-						case MTP_TYPE_INT64:
-								MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_INT64\n");
-								packet.putInt64(p.intvalue);
-								break;
-						case MTP_TYPE_UINT64:
-								MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_UINT64\n");
-								packet.putUInt64(p.intvalue);
-								break;
-						case MTP_TYPE_INT128:
-								MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_INT128\n");
-								packet.putInt128(p.intvalue);
-								break;
-						case MTP_TYPE_UINT128:
-								MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_UINT128\n");
-								packet.putUInt128(p.intvalue);
-								break;
-						case MTP_TYPE_STR:
-								MTPD("MtpStorage::getObjectPropertyList::MTP_TYPE_STR: %s\n", p.strvalue.c_str());
-								packet.putString(p.strvalue.c_str());
-								break;
-						default:
-								MTPE("bad or unsupported data type: %x in MyMtpDatabase::getObjectPropertyList", p.datatype);
-								break;
-				}
+				count = putNodeProperties(packet, node, property, groupCode);
 		}
+
+		MTPD("MtpStorage::getObjectPropertyList::count: %u\n", count);
+		packet.setUInt32(countOffset, count);
 		return 0;
 }
 
@@ -664,6 +823,7 @@ int MtpStorage::getObjectInfo(MtpObjectHandle handle, MtpObjectInfo& info) {
 		struct stat st;
 		uint64_t size = 0;
 		MTPD("MtpStorage::getObjectInfo, handle: %u\n", handle);
+		std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
 		Node* node = findNode(handle);
 		if (!node) {
 				// Item is not on this storage device
@@ -683,6 +843,17 @@ int MtpStorage::getObjectInfo(MtpObjectHandle handle, MtpObjectInfo& info) {
 		if (S_ISDIR(st.st_mode)) {
 				info.mFormat = MTP_FORMAT_ASSOCIATION;
 		}
+		else if (isJpegName(node->getName())) {
+				info.mFormat = MTP_FORMAT_EXIF_JPEG;
+				// Let the host show a preview without reading the whole picture
+				const Thumbnail* thumb = findThumbnail(node, st);
+				if (thumb && !thumb->data.empty()) {
+						info.mThumbFormat = MTP_FORMAT_EXIF_JPEG;
+						info.mThumbCompressedSize = thumb->data.size();
+						info.mThumbPixWidth = thumb->width;
+						info.mThumbPixHeight = thumb->height;
+				}
+		}
 		else {
 				info.mFormat = MTP_FORMAT_UNDEFINED;
 		}
@@ -691,8 +862,65 @@ int MtpStorage::getObjectInfo(MtpObjectHandle handle, MtpObjectInfo& info) {
 		return 0;
 }
 
+// Hosts ask for the info and then the thumbnail of every picture in a folder,
+// so keep the last few around instead of reading each file twice
+#define MAX_THUMBNAILS 64
+
+const MtpStorage::Thumbnail* MtpStorage::findThumbnail(Node* node, const struct stat& st) {
+		MtpObjectHandle handle = node->Mtpid();
+		for (std::list<Thumbnail>::iterator i = mThumbnails.begin(); i != mThumbnails.end(); i++) {
+				if (i->handle != handle)
+						continue;
+				if (i->size == st.st_size && i->modified == st.st_mtime) {
+						mThumbnails.splice(mThumbnails.begin(), mThumbnails, i);
+						return &mThumbnails.front();
+				}
+				mThumbnails.erase(i);
+				break;
+		}
+
+		Thumbnail thumb;
+		thumb.handle = handle;
+		thumb.size = st.st_size;
+		thumb.modified = st.st_mtime;
+		thumb.width = thumb.height = 0;
+		int fd = open(getNodePath(node).c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+				return NULL;
+		if (!readExifThumbnail(fd, thumb.data, thumb.width, thumb.height))
+				thumb.data.clear();
+		close(fd);
+		// Files without one are remembered too, so they are not read again
+		mThumbnails.push_front(thumb);
+		if (mThumbnails.size() > MAX_THUMBNAILS)
+				mThumbnails.pop_back();
+		return &mThumbnails.front();
+}
+
+void* MtpStorage::getThumbnail(MtpObjectHandle handle, size_t& outThumbSize) {
+		MTPD("MtpStorage::getThumbnail handle: %u\n", handle);
+		std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
+		Node* node = findNode(handle);
+		if (!node || node->isDir() || !isJpegName(node->getName()))
+				return NULL;
+		struct stat st;
+		if (lstat(getNodePath(node).c_str(), &st) != 0)
+				return NULL;
+		const Thumbnail* thumb = findThumbnail(node, st);
+		if (!thumb || thumb->data.empty())
+				return NULL;
+		// The caller frees it
+		void* result = malloc(thumb->data.size());
+		if (!result)
+				return NULL;
+		memcpy(result, thumb->data.data(), thumb->data.size());
+		outThumbSize = thumb->data.size();
+		return result;
+}
+
 int MtpStorage::getObjectFilePath(MtpObjectHandle handle, MtpStringBuffer& outFilePath, int64_t& outFileLength, MtpObjectFormat& outFormat) {
 		MTPD("MtpStorage::getObjectFilePath handle: %u\n", handle);
+		std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
 		Node* node = findNode(handle);
 		if (!node)
 		{
@@ -707,27 +935,28 @@ int MtpStorage::getObjectFilePath(MtpObjectHandle handle, MtpStringBuffer& outFi
 				outFileLength = 0;
 		outFilePath.set(getNodePath(node).c_str());
 		MTPD("outFilePath: %s\n", (const char*) outFilePath);
-		outFormat = node->isDir() ? MTP_FORMAT_ASSOCIATION : MTP_FORMAT_UNDEFINED;
+		if (node->isDir())
+				outFormat = MTP_FORMAT_ASSOCIATION;
+		else
+				outFormat = isJpegName(node->getName()) ? MTP_FORMAT_EXIF_JPEG : MTP_FORMAT_UNDEFINED;
 		return 0;
 }
 
 int MtpStorage::deleteFile(MtpObjectHandle handle) {
 		MTPD("MtpStorage::deleteFile handle: %u\n", handle);
+		std::lock_guard<std::recursive_mutex> lock(mTreeMutex);
 		Node* node = findNode(handle);
 		if (!node) {
 				// Item is not on this storage device
 				return -1;
 		}
 		MtpObjectHandle parent = node->getMtpParentId();
-		Tree* tree = mtpmap[parent];
+		Tree* tree = findTree(parent);
 		if (!tree) {
 				MTPE("parent tree for handle %u not found\n", parent);
 				return -1;
 		}
-		if (node->isDir()) {
-				MTPD("deleting tree from mtpmap: %u\n", handle);
-				mtpmap.erase(handle);
-		}
+		forgetNodes(node);
 
 		MTPD("deleting handle: %u\n", handle);
 		tree->deleteNode(handle);
@@ -746,7 +975,9 @@ void MtpStorage::queryNodeProperties(std::vector<MtpStorage::PropEntry>& results
 		{
 				// add all properties
 				MTPD("MtpStorage::queryNodeProperties for all properties\n");
-				std::vector<Node::mtpProperty> mtpprop = node->getMtpProps();
+				loadProperties(node);
+				std::vector<Node::mtpProperty> mtpprop;
+				node->getMtpProps(storageID, mtpprop);
 				for (size_t i = 0; i < mtpprop.size(); ++i) {
 						pe.property = mtpprop[i].property;
 						pe.datatype = mtpprop[i].dataType;
@@ -791,8 +1022,9 @@ void MtpStorage::queryNodeProperties(std::vector<MtpStorage::PropEntry>& results
 
 				default:
 				{
-						const Node::mtpProperty& prop = node->getProperty(property);
-						if (prop.property != property)
+						loadProperties(node);
+						Node::mtpProperty prop;
+						if (!node->getProperty(property, storageID, prop))
 						{
 								MTPD("queryNodeProperties: unknown property %x\n", property);
 								return;
@@ -17,6 +17,10 @@
 #ifndef _MTP_STORAGE_H
 #define _MTP_STORAGE_H
 
+#include <list>
+#include <map>
+#include <mutex>
+#include <vector>
 #include "MtpObjectInfo.h"
 #include "MtpServer.h"
 #include "MtpStringBuffer.h"
@@ -45,28 +49,55 @@ private:
 	uint64_t				mMaxCapacity;
 	uint64_t				mMaxFileSize;
 	bool					mRemovable;
-	typedef					std::map<int, Tree*> maptree;
-	typedef					maptree::iterator iter;
-	maptree					mtpmap;
+	std::vector<Node*>		mNodes;			   // handle -> node, NULL for handles that aren't on this storage
 	std::string				mtpstorageparent;
 	MtpObjectHandle			handleCurrentlySending;
+	bool					trustDirentType;	// d_type from readdir() is right on this filesystem
 	int						inotify_fd;
 	std::map<int, Tree*>	inotifymap;		   // inotify wd -> tree
 	bool					sendEvents;
 	MtpServer*				mServer;
 	typedef					int (MtpStorage::*ThreadPtr)(void);
 	typedef					void* (*PThreadPtr)(void *);
-	bool					use_mutex;
-	pthread_mutex_t			inMutex; // inotify mutex
-	pthread_mutex_t			mtpMutex; // main mtp mutex
+	std::recursive_mutex	mTreeMutex;		   // guards the nodes, inotifymap and handleCurrentlySending
+	std::vector<std::pair<uint16_t, MtpObjectHandle> > mPendingEvents; // events of the inotify batch being applied
+	struct Thumbnail {
+		MtpObjectHandle handle;
+		off_t size;					// of the file it came from, to notice changes
+		time_t modified;
+		std::string data;			// empty if the file has no thumbnail
+		uint32_t width;
+		uint32_t height;
+	};
+	std::list<Thumbnail>	mThumbnails;	   // most recently used first
+	struct DirEntry {
+		std::string name;
+		bool isDir;
+		bool hasStat;				// size and modified are known
+		uint64_t size;
+		uint64_t modified;
+	};
 	TWAtomicInt				inotify_thread_kill;
 	pthread_t				inotify_thread;
+	TWAtomicInt				scan_thread_kill;
+	pthread_t				scan_thread;
 	Node*					findNode(MtpObjectHandle handle);
+	Tree*					findTree(MtpObjectHandle handle);
+	void					forgetNodes(Node* node);
 	std::string				getNodePath(Node* node);
 	Node*					addNewNode(bool isDir, Tree* tree, const std::string& name);
+	int						listDir(const std::string& path, std::vector<DirEntry>& entries, bool statAll);
+	void					addEntries(Tree* tree, const std::vector<DirEntry>& entries);
+	pthread_t				startThread(ThreadPtr func);
+	int						scan_t();
+	void					loadProperties(Node* node);
+	uint32_t				putNodeProperties(MtpDataPacket& packet, Node* node, uint32_t property, int groupCode);
 	void					queryNodeProperties(std::vector<PropEntry>& results, Node* node, uint32_t property, int groupCode, MtpStorageID storageID);
 	int						addInotify(Tree* tree);
 	void					handleInotifyEvent(struct inotify_event* event);
+	void					queueEvent(uint16_t code, MtpObjectHandle handle);
+	void					flushEvents(const std::vector<std::pair<uint16_t, MtpObjectHandle> >& events);
+	const Thumbnail*		findThumbnail(Node* node, const struct stat& st);
 
 public:
 	MtpStorage(MtpStorageID id, const char* filePath,
@@ -90,6 +121,7 @@ public:
 	int						readDir(const std::string& path, Tree* tree);
 	int						getObjectPropertyValue(MtpObjectHandle handle, MtpObjectProperty property, PropEntry& prop);
 	int						getObjectInfo(MtpObjectHandle handle, MtpObjectInfo& info);
+	void*					getThumbnail(MtpObjectHandle handle, size_t& outThumbSize);
 	void					endSendObject(const char* path, MtpObjectHandle handle, MtpObjectFormat format, bool succeeded);
 	int						getObjectFilePath(MtpObjectHandle handle, MtpStringBuffer& outFilePath, int64_t& outFileLength, MtpObjectFormat& outFormat);
 	int						deleteFile(MtpObjectHandle handle);
@@ -25,6 +25,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdio.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -261,3 +262,93 @@ void closeObjFd(int fd, const char *path) {
 	close(fd);
 	access_ok(path);
 }
+
+bool isJpegName(const std::string& name) {
+	size_t dot = name.find_last_of('.');
+	if (dot == std::string::npos)
+		return false;
+	const char* ext = name.c_str() + dot + 1;
+	return strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0;
+}
+
+// Size of a JPEG from its frame header
+static bool jpegSize(const std::string& jpeg, uint32_t& width, uint32_t& height) {
+	size_t pos = 2;
+	while (pos + 9 <= jpeg.size()) {
+		if ((uint8_t) jpeg[pos] != 0xFF)
+			return false;
+		uint8_t marker = jpeg[pos + 1];
+		if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			height = (uint8_t) jpeg[pos + 5] << 8 | (uint8_t) jpeg[pos + 6];
+			width = (uint8_t) jpeg[pos + 7] << 8 | (uint8_t) jpeg[pos + 8];
+			return true;
+		}
+		pos += 2 + ((uint8_t) jpeg[pos + 2] << 8 | (uint8_t) jpeg[pos + 3]);
+	}
+	return false;
+}
+
+bool readExifThumbnail(int fd, std::string& thumb, uint32_t& width, uint32_t& height) {
+	// The EXIF block is an APP1 segment near the start, at most 64k long
+	uint8_t head[4];
+	if (pread(fd, head, 2, 0) != 2 || head[0] != 0xFF || head[1] != 0xD8)
+		return false;
+	off_t pos = 2;
+	std::string exif;
+	for (int i = 0; i < 16 && exif.empty(); i++) {
+		if (pread(fd, head, 4, pos) != 4 || head[0] != 0xFF)
+			return false;
+		size_t len = head[2] << 8 | head[3];
+		if (head[1] == 0xE1 && len > 8) {
+			std::string segment(len - 2, '\0');
+			if (pread(fd, &segment[0], segment.size(), pos + 4) != (ssize_t) segment.size())
+				return false;
+			if (segment.compare(0, 6, std::string("Exif\0\0", 6)) == 0)
+				exif = segment.substr(6);
+		} else if (head[1] < 0xE0 || head[1] > 0xEF) {
+			// only the APPn segments come before the image
+			return false;
+		}
+		pos += 2 + len;
+	}
+	if (exif.size() < 8)
+		return false;
+
+	// TIFF structure: IFD0 describes the image, IFD1 the thumbnail
+	const uint8_t* tiff = (const uint8_t*) exif.data();
+	size_t size = exif.size();
+	bool le = tiff[0] == 'I' && tiff[1] == 'I';
+	if (!le && !(tiff[0] == 'M' && tiff[1] == 'M'))
+		return false;
+	auto get16 = [&](size_t off) -> uint32_t {
+		if (off + 2 > size) return 0;
+		return le ? tiff[off] | tiff[off + 1] << 8 : tiff[off] << 8 | tiff[off + 1];
+	};
+	auto get32 = [&](size_t off) -> uint32_t {
+		if (off + 4 > size) return 0;
+		return le ? get16(off) | get16(off + 2) << 16 : get16(off) << 16 | get16(off + 2);
+	};
+	if (get16(2) != 42)
+		return false;
+	uint32_t ifd0 = get32(4);
+	uint32_t ifd1 = get32(ifd0 + 2 + 12 * get16(ifd0));
+	if (ifd0 == 0 || ifd1 == 0)
+		return false;
+	uint32_t offset = 0, length = 0;
+	uint32_t count = get16(ifd1);
+	for (uint32_t i = 0; i < count; i++) {
+		size_t entry = ifd1 + 2 + 12 * i;
+		if (get16(entry) == 0x0201)			// JPEGInterchangeFormat
+			offset = get32(entry + 8);
+		else if (get16(entry) == 0x0202)	// JPEGInterchangeFormatLength
+			length = get32(entry + 8);
+	}
+	if (offset == 0 || length < 4 || offset > size || length > size - offset)
+		return false;
+	if (tiff[offset] != 0xFF || tiff[offset + 1] != 0xD8)
+		return false;
+	thumb.assign((const char*) tiff + offset, length);
+	width = height = 0;
+	jpegSize(thumb, width, height);
+	return true;
+}
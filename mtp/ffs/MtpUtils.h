@@ -20,6 +20,7 @@
 #include "private/android_filesystem_config.h"
 
 #include <stdint.h>
+#include <string>
 
 constexpr int FILE_GROUP = AID_MEDIA_RW;
 constexpr int FILE_PERM = 0664;
@@ -35,4 +36,9 @@ bool deletePath(const char* path);
 int renameTo(const char *oldPath, const char *newPath);
 
 void closeObjFd(int fd, const char *path);
+
+bool isJpegName(const std::string& name);
+// Reads the thumbnail a camera keeps in the EXIF block of a JPEG, with its
+// size in pixels. Returns false if the file has none.
+bool readExifThumbnail(int fd, std::string& thumb, uint32_t& width, uint32_t& height);
 #endif // _MTP_UTILS_H
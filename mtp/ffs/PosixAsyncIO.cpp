@@ -16,15 +16,27 @@
 
 #include <android-base/logging.h>
 #include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <thread>
 #include <unistd.h>
 
 #include "PosixAsyncIO.h"
 
 namespace {
 
+// File io runs next to the USB transfer of the previous chunk, so there is
+// never more than a request or two in flight
+constexpr int NUM_THREADS = 2;
+
+struct pool {
+	std::mutex lock;
+	std::condition_variable queue_cond;
+	std::condition_variable done_cond;
+	std::deque<struct aiocb*> queue;
+};
+
 void read_func(struct aiocb *aiocbp) {
 	aiocbp->ret = TEMP_FAILURE_RETRY(pread(aiocbp->aio_fildes,
 				aiocbp->aio_buf, aiocbp->aio_nbytes, aiocbp->aio_offset));
@@ -37,20 +49,61 @@ void write_func(struct aiocb *aiocbp) {
 	if (aiocbp->ret == -1) aiocbp->error = errno;
 }
 
+void pool_func(struct pool *p) {
+	std::unique_lock<std::mutex> lk(p->lock);
+	while (1) {
+		p->queue_cond.wait(lk, [p]{return !p->queue.empty();});
+		struct aiocb *aiocbp = p->queue.front();
+		p->queue.pop_front();
+		lk.unlock();
+		if (aiocbp->read)
+			read_func(aiocbp);
+		else
+			write_func(aiocbp);
+		lk.lock();
+		aiocbp->queued = false;
+		p->done_cond.notify_all();
+	}
+}
+
+// Started on first use and never freed, the threads wait on it until the
+// process exits
+struct pool& get_pool() {
+	static struct pool *p = [] {
+		struct pool *np = new struct pool;
+		for (int i = 0; i < NUM_THREADS; i++)
+			std::thread(pool_func, np).detach();
+		return np;
+	}();
+	return *p;
+}
+
+int submit(struct aiocb *aiocbp, bool read) {
+	struct pool& p = get_pool();
+	std::lock_guard<std::mutex> lk(p.lock);
+	CHECK(!aiocbp->queued);
+	aiocbp->read = read;
+	aiocbp->queued = true;
+	aiocbp->ret = 0;
+	aiocbp->error = 0;
+	p.queue.push_back(aiocbp);
+	p.queue_cond.notify_one();
+	return 0;
+}
+
 } // end anonymous namespace
 
 aiocb::~aiocb() {
-	CHECK(!thread.joinable());
+	// aio_suspend() took the pool lock after the request was done
+	CHECK(!queued);
 }
 
 int aio_read(struct aiocb *aiocbp) {
-	aiocbp->thread = std::thread(read_func, aiocbp);
-	return 0;
+	return submit(aiocbp, true);
 }
 
 int aio_write(struct aiocb *aiocbp) {
-	aiocbp->thread = std::thread(write_func, aiocbp);
-	return 0;
+	return submit(aiocbp, false);
 }
 
 int aio_error(const struct aiocb *aiocbp) {
@@ -63,8 +116,11 @@ ssize_t aio_return(struct aiocb *aiocbp) {
 
 int aio_suspend(struct aiocb *aiocbp[], int n,
 		const struct timespec *) {
+	struct pool& p = get_pool();
+	std::unique_lock<std::mutex> lk(p.lock);
 	for (int i = 0; i < n; i++) {
-		aiocbp[i]->thread.join();
+		struct aiocb *aiocb = aiocbp[i];
+		p.done_cond.wait(lk, [aiocb]{return !aiocb->queued;});
 	}
 	return 0;
 }
@@ -20,11 +20,11 @@
 #include <sys/cdefs.h>
 #include <sys/types.h>
 #include <time.h>
-#include <thread>
 #include <unistd.h>
 
 /**
- * Provides a subset of POSIX aio operations.
+ * Provides a subset of POSIX aio operations. Requests are run by a few
+ * threads that are started with the first one and kept afterwards.
  */
 
 struct aiocb {
@@ -35,7 +35,8 @@ struct aiocb {
 	size_t aio_nbytes;
 
 	// Used internally
-	std::thread thread;
+	bool read = false;
+	bool queued = false;
 	ssize_t ret;
 	int error;
 
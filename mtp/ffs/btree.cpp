@@ -23,8 +23,8 @@ Tree::Tree(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& na
 }
 
 Tree::~Tree() {
-	for (std::map<MtpObjectHandle, Node*>::iterator it = entries.begin(); it != entries.end(); ++it)
-		delete it->second;
+	for (size_t i = 0; i < entries.size(); ++i)
+		delete entries[i];
 	entries.clear();
 }
 
@@ -43,35 +43,31 @@ void Tree::addEntry(Node* node) {
 		MTPE("Tree::addEntry: not adding node with handle %u == parent.\n", node->Mtpid());
 		return;
 	}
-	entries[node->Mtpid()] = node;
+	entries.push_back(node);
 }
 
 Node* Tree::findEntryByName(std::string name) {
-	for (std::map<MtpObjectHandle, Node*>::iterator it = entries.begin(); it != entries.end(); ++it)
+	for (size_t i = 0; i < entries.size(); ++i)
 	{
-		Node* node = it->second;
+		Node* node = entries[i];
 		if (node->getName().compare(name) == 0 && node->Mtpid() > 0)
 			return node;
 	}
 	return NULL;
 }
 
-Node* Tree::findNode(MtpObjectHandle handle) {
-	std::map<MtpObjectHandle, Node*>::iterator it = entries.find(handle);
-	if (it != entries.end())
-		return it->second;
-	return NULL;
-}
-
 void Tree::getmtpids(MtpObjectHandleList* mtpids) {
-	for (std::map<MtpObjectHandle, Node*>::iterator it = entries.begin(); it != entries.end(); ++it)
-		mtpids->push_back(it->second->Mtpid());
+	mtpids->reserve(mtpids->size() + entries.size());
+	for (size_t i = 0; i < entries.size(); ++i)
+		mtpids->push_back(entries[i]->Mtpid());
 }
 
 void Tree::deleteNode(MtpObjectHandle handle) {
-	std::map<MtpObjectHandle, Node*>::iterator it = entries.find(handle);
-	if (it != entries.end()) {
-		delete it->second;
-		entries.erase(it);
+	for (size_t i = 0; i < entries.size(); ++i) {
+		if (entries[i]->Mtpid() == handle) {
+			delete entries[i];
+			entries.erase(entries.begin() + i);
+			return;
+		}
 	}
 }
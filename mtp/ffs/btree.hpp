@@ -19,14 +19,21 @@
 
 #include <vector>
 #include <string>
-#include <map>
+#include <stdint.h>
 #include "MtpTypes.h"
 
-// A directory entry
+// A directory entry. Only the property values that differ between objects
+// are kept, as plain fields; the others are filled in when a host asks.
 class Node {
 	MtpObjectHandle handle;
 	MtpObjectHandle parent;
 	std::string name;	// name only without path
+	bool propsLoaded;	// properties are read the first time they're asked for
+	uint64_t size;
+	uint64_t modified;
+	uint32_t propCacheCode;		// property the cached list is for
+	uint32_t propCacheCount;
+	std::string propCache;		// GetObjectPropList items, encoded like in the data packet
 
 public:
 	Node();
@@ -40,10 +47,12 @@ public:
 	MtpObjectHandle getMtpParentId() const;
 	const std::string& getName() const;
 
-	void addProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
-	void updateProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
-	void addProperties(const std::string& path, int storageID);
-	uint64_t getIntProperty(MtpPropertyCode property);
+	void readProperties(const std::string& path);
+	void setProperties(uint64_t newSize, uint64_t newModified);
+	bool hasProperties() const { return propsLoaded; }
+	void clearProperties();
+	uint64_t getSize() const { return size; }
+	void setSize(uint64_t newSize) { size = newSize; clearPropCache(); }
 	struct mtpProperty {
 		MtpPropertyCode property;
 		MtpDataType dataType;
@@ -51,14 +60,16 @@ public:
 		std::string valueStr;
 		mtpProperty() : property(0), dataType(0), valueInt(0) {}
 	};
-	std::vector<mtpProperty>& getMtpProps();
-	std::vector<mtpProperty> mtpProp;
-	const mtpProperty& getProperty(MtpPropertyCode property);
+	bool getProperty(MtpPropertyCode property, MtpStorageID storageID, mtpProperty& prop) const;
+	void getMtpProps(MtpStorageID storageID, std::vector<mtpProperty>& props) const;
+	const std::string* getPropCache(uint32_t property, uint32_t& count) const;
+	void setPropCache(uint32_t property, uint32_t count, const uint8_t* data, size_t length);
+	void clearPropCache();
 };
 
 // A directory
 class Tree : public Node {
-	std::map<MtpObjectHandle, Node*> entries;
+	std::vector<Node*> entries;
 	bool alreadyRead;
 public:
 	Tree(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& name);
@@ -67,12 +78,10 @@ public:
 	virtual bool isDir() const { return true; }
 
 	void addEntry(Node* node);
-	Node* findNode(MtpObjectHandle handle);
+	const std::vector<Node*>& getEntries() const { return entries; }
 	void getmtpids(MtpObjectHandleList* mtpids);
 	void deleteNode(MtpObjectHandle handle);
-	std::string getPath(Node* node);
 	int getMtpParentId() { return Node::getMtpParentId(); }
-	int getMtpParentId(Node* node);
 	Node* findEntryByName(std::string name);
 	int getCount();
 	bool wasAlreadyRead() const { return alreadyRead; }
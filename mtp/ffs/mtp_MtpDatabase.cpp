@@ -594,10 +594,15 @@ MtpResponseCode IMtpDatabase::getObjectInfo(MtpObjectHandle handle, MtpObjectInf
   return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 }
 
-void* IMtpDatabase::getThumbnail(__attribute__((unused)) MtpObjectHandle handle,
-								 __attribute__((unused)) size_t& outThumbSize) {
-  MTPE("IMtpDatabase::getThumbnail not implemented, returning 0\n");
-  return 0;
+void* IMtpDatabase::getThumbnail(MtpObjectHandle handle, size_t& outThumbSize) {
+  std::map<int, MtpStorage*>::iterator storit;
+  for (storit = storagemap.begin(); storit != storagemap.end(); storit++) {
+	void* thumb = storit->second->getThumbnail(handle, outThumbSize);
+	if (thumb)
+	  return thumb;
+  }
+  MTPD("IMtpDatabase::getThumbnail no thumbnail for %i\n", handle);
+  return NULL;
 }
 
 MtpResponseCode IMtpDatabase::getObjectFilePath(MtpObjectHandle handle,
@@ -29,15 +29,18 @@
 #include "btree.hpp"
 #include "mtp.h"
 #include "MtpDebug.h"
+#include "MtpUtils.h"
 
 
 Node::Node()
-	: handle(-1), parent(0), name("")
+	: handle(-1), parent(0), name(""), propsLoaded(false), size(0), modified(0),
+	  propCacheCode(0), propCacheCount(0)
 {
 }
 
 Node::Node(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& name)
-	: handle(handle), parent(parent), name(name)
+	: handle(handle), parent(parent), name(name), propsLoaded(false), size(0), modified(0),
+	  propCacheCode(0), propCacheCount(0)
 {
 				MTPD("handle: %d\n", handle);
 				MTPD("parent: %d\n", parent);
@@ -46,101 +49,153 @@ Node::Node(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& na
 
 void Node::rename(const std::string& newName) {
 	name = newName;
-	updateProperty(MTP_PROPERTY_OBJECT_FILE_NAME, 0, name.c_str(), MTP_TYPE_STR);
-	updateProperty(MTP_PROPERTY_NAME, 0, name.c_str(), MTP_TYPE_STR);
-	updateProperty(MTP_PROPERTY_DISPLAY_NAME, 0, name.c_str(), MTP_TYPE_STR);
+	clearPropCache();
 }
 
 MtpObjectHandle Node::Mtpid() const { return handle; }
 MtpObjectHandle Node::getMtpParentId() const { return parent; }
 const std::string& Node::getName() const { return name; }
 
-uint64_t Node::getIntProperty(MtpPropertyCode property) {
-	for (unsigned index = 0; index < mtpProp.size(); ++index) {
-		if (mtpProp[index].property == property)
-			return mtpProp[index].valueInt;
+// Properties reported for every object, in the order they are listed
+static const MtpPropertyCode nodeProperties[] = {
+	MTP_PROPERTY_STORAGE_ID,
+	MTP_PROPERTY_OBJECT_FORMAT,
+	MTP_PROPERTY_PROTECTION_STATUS,
+	MTP_PROPERTY_OBJECT_SIZE,
+	MTP_PROPERTY_OBJECT_FILE_NAME,
+	MTP_PROPERTY_DATE_MODIFIED,
+	MTP_PROPERTY_PARENT_OBJECT,
+	MTP_PROPERTY_PERSISTENT_UID,
+	MTP_PROPERTY_NAME,
+	MTP_PROPERTY_DISPLAY_NAME,
+	MTP_PROPERTY_DATE_ADDED,
+	MTP_PROPERTY_DESCRIPTION,
+	MTP_PROPERTY_ARTIST,
+	MTP_PROPERTY_ALBUM_NAME,
+	MTP_PROPERTY_ALBUM_ARTIST,
+	MTP_PROPERTY_TRACK,
+	MTP_PROPERTY_ORIGINAL_RELEASE_DATE,
+	MTP_PROPERTY_DURATION,
+	MTP_PROPERTY_GENRE,
+	MTP_PROPERTY_COMPOSER,
+};
+
+bool Node::getProperty(MtpPropertyCode property, MtpStorageID storageID, mtpProperty& prop) const {
+	prop.property = property;
+	prop.valueInt = 0;
+	prop.valueStr.clear();
+	switch (property) {
+		case MTP_PROPERTY_STORAGE_ID:
+			prop.dataType = MTP_TYPE_UINT32;
+			prop.valueInt = storageID;
+			break;
+		case MTP_PROPERTY_OBJECT_FORMAT:
+			prop.dataType = MTP_TYPE_UINT16;
+			if (isDir())
+				prop.valueInt = MTP_FORMAT_ASSOCIATION;
+			else
+				prop.valueInt = isJpegName(getName()) ? MTP_FORMAT_EXIF_JPEG : MTP_FORMAT_UNDEFINED;
+			break;
+		case MTP_PROPERTY_PROTECTION_STATUS:
+		case MTP_PROPERTY_TRACK:
+			prop.dataType = MTP_TYPE_UINT16;
+			break;
+		case MTP_PROPERTY_OBJECT_SIZE:
+			prop.dataType = MTP_TYPE_UINT64;
+			prop.valueInt = size;
+			break;
+		case MTP_PROPERTY_OBJECT_FILE_NAME:
+		case MTP_PROPERTY_NAME:
+		case MTP_PROPERTY_DISPLAY_NAME:
+			prop.dataType = MTP_TYPE_STR;
+			prop.valueStr = name;
+			break;
+		case MTP_PROPERTY_DATE_MODIFIED:
+		case MTP_PROPERTY_DATE_ADDED:
+			prop.dataType = MTP_TYPE_UINT64;
+			prop.valueInt = modified;
+			break;
+		case MTP_PROPERTY_PARENT_OBJECT:
+			prop.dataType = MTP_TYPE_UINT32;
+			prop.valueInt = parent;
+			break;
+		case MTP_PROPERTY_PERSISTENT_UID:
+			// TODO: we can't really support persistent UIDs without a persistent DB.
+			// probably a combination of volume UUID + st_ino would come close.
+			// doesn't help for fs with no native inodes numbers like fat though...
+			// however, Microsoft's own impl (Zune, etc.) does not support persistent UIDs either
+			prop.dataType = MTP_TYPE_UINT128;
+			prop.valueInt = ((uint64_t)storageID << 32) + handle;
+			break;
+		case MTP_PROPERTY_DESCRIPTION:
+		case MTP_PROPERTY_ARTIST:
+		case MTP_PROPERTY_ALBUM_NAME:
+		case MTP_PROPERTY_ALBUM_ARTIST:
+		case MTP_PROPERTY_GENRE:
+		case MTP_PROPERTY_COMPOSER:
+			prop.dataType = MTP_TYPE_STR;
+			break;
+		case MTP_PROPERTY_ORIGINAL_RELEASE_DATE:
+			prop.dataType = MTP_TYPE_UINT64;
+			prop.valueInt = 2014;	// TODO: extract year from the modification time?
+			break;
+		case MTP_PROPERTY_DURATION:
+			prop.dataType = MTP_TYPE_UINT32;
+			break;
+		default:
+			MTPE("Node::getProperty unsupported property %x\n", (unsigned)property);
+			prop.property = 0;
+			prop.dataType = 0;
+			return false;
 	}
-	MTPE("Node::getIntProperty failed to find property %x, returning -1\n", (unsigned)property);
-	return -1;
+	return true;
 }
 
-const Node::mtpProperty& Node::getProperty(MtpPropertyCode property) {
-	static const mtpProperty dummyProp;
-	for (size_t i = 0; i < mtpProp.size(); ++i) {
-		if (mtpProp[i].property == property)
-			return mtpProp[i];
-	}
-	MTPE("Node::getProperty failed to find property %x, returning dummy property\n", (unsigned)property);
-	return dummyProp;
+void Node::getMtpProps(MtpStorageID storageID, std::vector<mtpProperty>& props) const {
+	size_t count = sizeof(nodeProperties) / sizeof(nodeProperties[0]);
+	props.resize(count);
+	for (size_t i = 0; i < count; ++i)
+		getProperty(nodeProperties[i], storageID, props[i]);
 }
 
-void Node::addProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType) {
-//	MTPD("adding property: %lld, valueInt: %lld, valueStr: %s, dataType: %d\n", property, valueInt, valueStr.c_str(), dataType);
-	struct mtpProperty prop;
-	prop.property = property;
-	prop.valueInt = valueInt;
-	prop.valueStr = valueStr;
-	prop.dataType = dataType;
-	mtpProp.push_back(prop);
+void Node::clearProperties() {
+	propsLoaded = false;
+	clearPropCache();
 }
 
-void Node::updateProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType) {
-	for (unsigned i = 0; i < mtpProp.size(); i++) {
-		if (mtpProp[i].property == property) {
-			mtpProp[i].valueInt = valueInt;
-			mtpProp[i].valueStr = valueStr;
-			mtpProp[i].dataType = dataType;
-			return;
-		}
-	}
-	addProperty(property, valueInt, valueStr, dataType);
+// Returns NULL if the list for this property isn't cached
+const std::string* Node::getPropCache(uint32_t property, uint32_t& count) const {
+	if (propCacheCode != property || propCacheCount == 0)
+		return NULL;
+	count = propCacheCount;
+	return &propCache;
 }
 
-std::vector<Node::mtpProperty>& Node::getMtpProps() {
-	return mtpProp;
+void Node::setPropCache(uint32_t property, uint32_t count, const uint8_t* data, size_t length) {
+	propCacheCode = property;
+	propCacheCount = count;
+	propCache.assign((const char*)data, length);
 }
 
-void Node::addProperties(const std::string& path, int storageID) {
-	MTPD("addProperties: handle: %u, filename: '%s'\n", handle, getName().c_str());
+void Node::clearPropCache() {
+	propCacheCode = 0;
+	propCacheCount = 0;
+	std::string().swap(propCache);
+}
+
+void Node::readProperties(const std::string& path) {
+	MTPD("readProperties: handle: %u, filename: '%s'\n", handle, getName().c_str());
 	struct stat st;
-	int mFormat = 0;
-	uint64_t puid = ((uint64_t)storageID << 32) + handle;
-	off_t file_size = 0;
-
-	mFormat = MTP_FORMAT_UNDEFINED;   // file
-	if (lstat(path.c_str(), &st) == 0) {
-		file_size = st.st_size;
-		if (S_ISDIR(st.st_mode))
-			mFormat = MTP_FORMAT_ASSOCIATION; // folder
-	}
 
-	// TODO: don't store properties with constant values at all, add them at query time instead
-	addProperty(MTP_PROPERTY_STORAGE_ID, storageID, "", MTP_TYPE_UINT32);
-	addProperty(MTP_PROPERTY_OBJECT_FORMAT, mFormat, "", MTP_TYPE_UINT16);
-	addProperty(MTP_PROPERTY_PROTECTION_STATUS, 0, "", MTP_TYPE_UINT16);
-	addProperty(MTP_PROPERTY_OBJECT_SIZE, file_size, "", MTP_TYPE_UINT64);
-	addProperty(MTP_PROPERTY_OBJECT_FILE_NAME, 0, getName().c_str(), MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_DATE_MODIFIED, st.st_mtime, "", MTP_TYPE_UINT64);
-	addProperty(MTP_PROPERTY_PARENT_OBJECT, parent, "", MTP_TYPE_UINT32);
-	addProperty(MTP_PROPERTY_PERSISTENT_UID, puid, "", MTP_TYPE_UINT128);
-		// TODO: we can't really support persistent UIDs without a persistent DB.
-		// probably a combination of volume UUID + st_ino would come close.
-		// doesn't help for fs with no native inodes numbers like fat though...
-		// however, Microsoft's own impl (Zune, etc.) does not support persistent UIDs either
-	addProperty(MTP_PROPERTY_NAME, 0, getName().c_str(), MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_DISPLAY_NAME, 0, getName().c_str(), MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_DATE_ADDED, st.st_mtime, "", MTP_TYPE_UINT64);
-	addProperty(MTP_PROPERTY_DESCRIPTION, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ARTIST, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ALBUM_NAME, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ALBUM_ARTIST, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_TRACK, 0, "", MTP_TYPE_UINT16);
-	addProperty(MTP_PROPERTY_ORIGINAL_RELEASE_DATE, 2014, "", MTP_TYPE_UINT64);	// TODO: extract year from st.st_mtime?
-	addProperty(MTP_PROPERTY_DURATION, 0, "", MTP_TYPE_UINT32);
-	addProperty(MTP_PROPERTY_GENRE, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_COMPOSER, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ARTIST, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_ALBUM_NAME, 0, "", MTP_TYPE_STR);
-	addProperty(MTP_PROPERTY_DURATION, 0, "", MTP_TYPE_UINT32);
-	addProperty(MTP_PROPERTY_DESCRIPTION, 0, "", MTP_TYPE_STR);
+	if (lstat(path.c_str(), &st) == 0)
+		setProperties(st.st_size, st.st_mtime);
+	else
+		setProperties(0, 0);
+}
+
+void Node::setProperties(uint64_t newSize, uint64_t newModified) {
+	propsLoaded = true;
+	clearPropCache();
+	size = newSize;
+	modified = newModified;
 }
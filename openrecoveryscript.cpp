@@ -52,6 +52,8 @@
 #include "gui/pages.hpp"
 #include "orscmd/orscmd.h"
 #include "twinstall.h"
+#include "twrpZipPrefetch.hpp"
+#include "twrpPerfProfile.hpp"
 extern "C" {
 	#include "gui/gui.h"
 	#include "cutils/properties.h"
@@ -93,70 +95,127 @@ int OpenRecoveryScript::copy_script_file(string filename) {
 	return 0;
 }
 
-int OpenRecoveryScript::run_script_file(void) {
-	int ret_val = 0, cindex, line_len, i, remove_nl, install_cmd = 0, sideload = 0;
+void OpenRecoveryScript::parse_script_file(FILE* fp, vector<Script_Command>* Plan) {
+	int cindex, line_len, i, remove_nl;
 	char script_line[SCRIPT_COMMAND_SIZE], command[SCRIPT_COMMAND_SIZE],
+	     value[SCRIPT_COMMAND_SIZE];
+	char *val_start;
+
+	while (fgets(script_line, SCRIPT_COMMAND_SIZE, fp) != NULL) {
+		cindex = 0;
+		line_len = strlen(script_line);
+		if (line_len < 2)
+			continue; // there's a blank line or line is too short to contain a command
+		//gui_print("script line: '%s'\n", script_line);
+		for (i=0; i<line_len; i++) {
+			if ((int)script_line[i] == 32) {
+				cindex = i;
+				i = line_len;
+			}
+		}
+		memset(command, 0, sizeof(command));
+		memset(value, 0, sizeof(value));
+		if ((int)script_line[line_len - 1] == 10)
+			remove_nl = 2;
+		else
+			remove_nl = 1;
+		if (cindex != 0) {
+			strncpy(command, script_line, cindex);
+			LOGINFO("command is: '%s'\n", command);
+			val_start = script_line;
+			val_start += cindex + 1;
+			if ((int) *val_start == 32)
+				val_start++; //get rid of space
+			if ((int) *val_start == 51)
+				val_start++; //get rid of = at the beginning
+			if ((int) *val_start == 32)
+				val_start++; //get rid of space
+			strncpy(value, val_start, line_len - cindex - remove_nl);
+			LOGINFO("value is: '%s'\n", value);
+		} else {
+			strncpy(command, script_line, line_len - remove_nl + 1);
+			gui_print("command is: '%s' and there is no value\n", command);
+		}
+		// Wipe lines in a row become one wipe of all their targets, which
+		// wipes the partitions on different block devices at once
+		if (strcmp(command, "wipe") == 0 && !Plan->empty() && Plan->back().command == "wipe" && cindex != 0) {
+			Plan->back().value += " ";
+			Plan->back().value += value;
+			LOGINFO("Wiping '%s' together with the wipe before it\n", value);
+			continue;
+		}
+		Script_Command cmd;
+		cmd.command = command;
+		cmd.value = value;
+		cmd.has_value = cindex != 0;
+		Plan->push_back(cmd);
+	}
+}
+
+int OpenRecoveryScript::run_script_file(void) {
+	int ret_val = 0, line_len, i, remove_nl, install_cmd = 0, sideload = 0;
+	char command[SCRIPT_COMMAND_SIZE],
 	     value[SCRIPT_COMMAND_SIZE], mount[SCRIPT_COMMAND_SIZE],
 	     value1[SCRIPT_COMMAND_SIZE], value2[SCRIPT_COMMAND_SIZE];
-	char *val_start, *tok;
+	char *tok;
+	vector<Script_Command> plan;
+	std::vector<string> installs;
+	size_t install_count = 0;
 
 	FILE *fp = fopen(SCRIPT_FILE_TMP, "r");
 	if (fp != NULL) {
 		DataManager::SetValue(TW_SIMULATE_ACTIONS, 0);
 		DataManager::SetValue("ui_progress", 0); // Reset the progress bar
-		while (fgets(script_line, SCRIPT_COMMAND_SIZE, fp) != NULL && ret_val == 0) {
-			cindex = 0;
-			line_len = strlen(script_line);
-			if (line_len < 2)
-				continue; // there's a blank line or line is too short to contain a command
-			//gui_print("script line: '%s'\n", script_line);
-			for (i=0; i<line_len; i++) {
-				if ((int)script_line[i] == 32) {
-					cindex = i;
-					i = line_len;
-				}
-			}
-			memset(command, 0, sizeof(command));
-			memset(value, 0, sizeof(value));
-			if ((int)script_line[line_len - 1] == 10)
-				remove_nl = 2;
-			else
-				remove_nl = 1;
-			if (cindex != 0) {
-				strncpy(command, script_line, cindex);
-				LOGINFO("command is: '%s'\n", command);
-				val_start = script_line;
-				val_start += cindex + 1;
-				if ((int) *val_start == 32)
-					val_start++; //get rid of space
-				if ((int) *val_start == 51)
-					val_start++; //get rid of = at the beginning
-				if ((int) *val_start == 32)
-					val_start++; //get rid of space
-				strncpy(value, val_start, line_len - cindex - remove_nl);
-				LOGINFO("value is: '%s'\n", value);
-			} else {
-				strncpy(command, script_line, line_len - remove_nl + 1);
-				gui_print("command is: '%s' and there is no value\n", command);
-			}
+		parse_script_file(fp, &plan);
+		fclose(fp);
+		// Collect the zips of the install commands, so the next one can be
+		// read ahead while one installs
+		for (size_t c = 0; c < plan.size(); c++) {
+			if (plan[c].command == "install")
+				installs.push_back(plan[c].value);
+		}
+		// The partition details are updated once after the script, not
+		// after each backup and restore in it
+		PartitionManager.Hold_System_Details(true);
+		for (size_t c = 0; c < plan.size() && ret_val == 0; c++) {
+			snprintf(command, sizeof(command), "%s", plan[c].command.c_str());
+			snprintf(value, sizeof(value), "%s", plan[c].value.c_str());
 			if (strcmp(command, "install") == 0) {
 				// Install Zip
 				DataManager::SetValue("tw_action_text2", "Installing Zip");
+				if (++install_count < installs.size())
+					twrpZipPrefetch::Get()->Start(installs[install_count]);
 				ret_val = Install_Command(value);
 				install_cmd = -1;
 			} else if (strcmp(command, "wipe") == 0) {
-				// Wipe
-				if (strcmp(value, "cache") == 0 || strcmp(value, "/cache") == 0) {
-					PartitionManager.Wipe_By_Path("/cache");
-				} else if (strcmp(value, PartitionManager.Get_Android_Root_Path().c_str()) == 0 || strcmp(value, PartitionManager.Get_Android_Root_Path().c_str()) == 0) {
-					PartitionManager.Wipe_By_Path(PartitionManager.Get_Android_Root_Path());
-				} else if (strcmp(value, "dalvik") == 0 || strcmp(value, "dalvick") == 0 || strcmp(value, "dalvikcache") == 0 || strcmp(value, "dalvickcache") == 0) {
-					PartitionManager.Wipe_Dalvik_Cache();
-				} else if (strcmp(value, "data") == 0 || strcmp(value, "/data") == 0 || strcmp(value, "factory") == 0 || strcmp(value, "factoryreset") == 0) {
-					PartitionManager.Factory_Reset();
-				} else {
-					LOGERR("Error with wipe command value: '%s'\n", value);
-					ret_val = 1;
+				// Wipe, several targets separated by spaces are wiped at once
+				std::vector<string> targets = TWFunc::Split_String(plan[c].value, " ");
+				string batch;
+				bool factory_reset = false, dalvik = false;
+				for (size_t i = 0; i < targets.size(); i++) {
+					const string& target = targets[i];
+					if (target == "cache" || target == "/cache") {
+						batch += "/cache;";
+					} else if (target == PartitionManager.Get_Android_Root_Path()) {
+						batch += PartitionManager.Get_Android_Root_Path() + ";";
+					} else if (target == "dalvik" || target == "dalvick" || target == "dalvikcache" || target == "dalvickcache") {
+						dalvik = true;
+					} else if (target == "data" || target == "/data" || target == "factory" || target == "factoryreset") {
+						factory_reset = true;
+					} else {
+						LOGERR("Error with wipe command value: '%s'\n", target.c_str());
+						ret_val = 1;
+					}
+				}
+				if (ret_val == 0) {
+					twrpPerfProfile::Get()->Enter(PERF_WIPE);
+					if (dalvik)
+						PartitionManager.Wipe_Dalvik_Cache();
+					if (factory_reset)
+						PartitionManager.Factory_Reset(batch);
+					else if (!batch.empty())
+						PartitionManager.Wipe_By_Path(batch);
+					twrpPerfProfile::Get()->Leave(PERF_WIPE);
 				}
 			} else if (strcmp(command, "backup") == 0) {
 				// Backup
@@ -291,6 +350,57 @@ int OpenRecoveryScript::run_script_file(void) {
 					ret_val = 1;
 				else
 					gui_msg("done=Done.");
+			} else if (strcmp(command, "restorepath") == 0) {
+				// Restore one file or folder: restorepath <backup folder> <path>
+				DataManager::SetValue("tw_action_text2", gui_parse_text("{@restore}"));
+				PartitionManager.Mount_All_Storage();
+				string val = value, restore_folder, restore_path;
+				size_t pos = val.find(" /", 1);
+				if (pos == string::npos) {
+					gui_err("restore_path_usage=Usage: restorepath <backup folder> <path>");
+					ret_val = 1;
+					continue;
+				}
+				restore_folder = val.substr(0, pos);
+				restore_path = val.substr(pos + 1);
+				if (restore_folder[0] != '/') {
+					string folder_var;
+					DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, folder_var);
+					restore_folder = folder_var + "/" + restore_folder;
+				}
+				if (!TWFunc::Path_Exists(restore_folder)) {
+					gui_msg(Msg(msg::kError, "locate_backup_err=Unable to locate backup '{1}'")(restore_folder));
+					ret_val = 1;
+				} else if (!PartitionManager.Run_Restore_Path(restore_folder, restore_path)) {
+					ret_val = 1;
+				} else {
+					gui_msg("done=Done.");
+				}
+			} else if (strcmp(command, "verify") == 0) {
+				// Read a whole backup without restoring it: verify <backup folder>
+				DataManager::SetValue("tw_action_text2", gui_parse_text("{@verifying_hdr}"));
+				PartitionManager.Mount_All_Storage();
+				DataManager::SetValue(TW_SKIP_DIGEST_CHECK_VAR, 1);
+				string verify_folder = value;
+				if (verify_folder[0] != '/') {
+					string folder_var;
+					DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, folder_var);
+					verify_folder = folder_var + "/" + verify_folder;
+				}
+				if (!TWFunc::Path_Exists(verify_folder)) {
+					gui_msg(Msg(msg::kError, "locate_backup_err=Unable to locate backup '{1}'")(verify_folder));
+					ret_val = 1;
+				} else if (!PartitionManager.Run_Verify(verify_folder)) {
+					ret_val = 1;
+				} else {
+					gui_msg("done=Done.");
+				}
+			} else if (strcmp(command, "benchmark") == 0) {
+				// Measure every storage and tune later backups to it
+				DataManager::SetValue("tw_action_text2", gui_parse_text("{@bench_hdr}"));
+				PartitionManager.Mount_All_Storage();
+				if (!PartitionManager.Run_Storage_Benchmark())
+					ret_val = 1;
 			} else if (strcmp(command, "remountrw") == 0) {
 				ret_val = remountrw();
 			} else if (strcmp(command, "mount") == 0) {
@@ -334,6 +444,23 @@ int OpenRecoveryScript::run_script_file(void) {
 					// error message already displayed by Recursive_Mkdir
 					ret_val = 1;
 				}
+			} else if (strcmp(command, "flashimage") == 0) {
+				// Flash an image straight out of a zip: partition zip entry
+				DataManager::SetValue("tw_action_text2", gui_parse_text("{@flashing_image}"));
+				string args = value, part_path, zip_path, entry;
+				size_t first = args.find(' '), last = args.rfind(' ');
+				if (first == string::npos || last == first) {
+					LOGERR("Error with flashimage command value: '%s'\n", value);
+					ret_val = 1;
+				} else {
+					part_path = args.substr(0, first);
+					zip_path = args.substr(first + 1, last - first - 1);
+					entry = args.substr(last + 1);
+					if (part_path[0] != '/')
+						part_path = "/" + part_path;
+					if (!PartitionManager.Flash_Image_From_Zip(zip_path, entry, part_path))
+						ret_val = 1;
+				}
 			} else if (strcmp(command, "reboot") == 0) {
 				if (strlen(value) && strcmp(value, "recovery") == 0)
 					TWFunc::tw_reboot(rb_recovery);
@@ -349,7 +476,7 @@ int OpenRecoveryScript::run_script_file(void) {
 					TWFunc::tw_reboot(rb_system);
 			} else if (strcmp(command, "cmd") == 0) {
 				DataManager::SetValue("tw_action_text2", gui_parse_text("{@running_command}"));
-				if (cindex != 0) {
+				if (plan[c].has_value) {
 					TWFunc::Exec_Cmd(value);
 				} else {
 					LOGERR("No value given for cmd\n");
@@ -408,7 +535,8 @@ int OpenRecoveryScript::run_script_file(void) {
 				ret_val = 1;
 			}
 		}
-		fclose(fp);
+		PartitionManager.Hold_System_Details(false);
+		twrpZipPrefetch::Get()->Clear();
 		unlink(SCRIPT_FILE_TMP);
 		gui_msg("done_ors=Done processing script file");
 	} else {
@@ -491,7 +619,9 @@ int OpenRecoveryScript::Install_Command(string Zip) {
 			gui_msg(Msg("installing_zip=Installing zip file '{1}'")(Zip));
 	}
 
+	twrpPerfProfile::Get()->Enter(PERF_INSTALL);
 	ret_val = TWinstall_zip(Zip.c_str(), &wipe_cache);
+	twrpPerfProfile::Get()->Leave(PERF_INSTALL);
 	if (ret_val != 0) {
 		gui_msg(Msg(msg::kError, "zip_err=Error installing zip file '{1}'")(Zip));
 		ret_val = 1;
@@ -533,6 +663,9 @@ int OpenRecoveryScript::Backup_Command(string Options) {
 	strcpy(value1, Options.c_str());
 
 	DataManager::SetValue(TW_USE_COMPRESSION_VAR, 0);
+	DataManager::SetValue(TW_COMPRESSION_TYPE_VAR, "gzip");
+	DataManager::SetValue(TW_INCREMENTAL_BACKUP_VAR, 0);
+	DataManager::SetValue(TW_DEDUP_BACKUP_VAR, 0);
 	DataManager::SetValue(TW_SKIP_DIGEST_GENERATE_VAR, 0);
 
 	gui_msg("select_backup_opt=Setting backup options:");
@@ -568,6 +701,20 @@ int OpenRecoveryScript::Backup_Command(string Options) {
 		} else if (Options.substr(i, 1) == "O" || Options.substr(i, 1) == "o") {
 			DataManager::SetValue(TW_USE_COMPRESSION_VAR, 1);
 			gui_msg("compression_on=Compression is on");
+		} else if (Options.substr(i, 1) == "Z" || Options.substr(i, 1) == "z") {
+			DataManager::SetValue(TW_USE_COMPRESSION_VAR, 1);
+			DataManager::SetValue(TW_COMPRESSION_TYPE_VAR, "zstd");
+			gui_msg("compression_zstd_on=zstd compression is on");
+		} else if (Options.substr(i, 1) == "L" || Options.substr(i, 1) == "l") {
+			DataManager::SetValue(TW_USE_COMPRESSION_VAR, 1);
+			DataManager::SetValue(TW_COMPRESSION_TYPE_VAR, "lz4");
+			gui_msg("compression_lz4_on=lz4 compression is on");
+		} else if (Options.substr(i, 1) == "I" || Options.substr(i, 1) == "i") {
+			DataManager::SetValue(TW_INCREMENTAL_BACKUP_VAR, 1);
+			gui_msg("incremental_on=Incremental backup is on");
+		} else if (Options.substr(i, 1) == "X" || Options.substr(i, 1) == "x") {
+			DataManager::SetValue(TW_DEDUP_BACKUP_VAR, 1);
+			gui_msg("dedup_on=Deduplicated backup is on");
 		} else if (Options.substr(i, 1) == "M" || Options.substr(i, 1) == "m") {
 			DataManager::SetValue(TW_SKIP_DIGEST_GENERATE_VAR, 1);
 			gui_msg("digest_off=Digest Generation is off");
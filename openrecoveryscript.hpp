@@ -19,7 +19,9 @@
 #ifndef _OPENRECOVERYSCRIPT_HPP
 #define _OPENRECOVERYSCRIPT_HPP
 
+#include <stdio.h>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -28,8 +30,15 @@ class OpenRecoveryScript
 	typedef void (*VoidFunction)();
 	static VoidFunction call_after_cli_command;                                    // callback to GUI after Run_CLI_Command
 
+	struct Script_Command {
+		string command;
+		string value;
+		bool has_value;                                                        // The line had a space after the command
+	};
+
 	static int check_for_script_file();                                            // Checks to see if the ORS file is present in /cache
 	static int copy_script_file(string filename);                                  // Copies a script file to the temp folder
+	static void parse_script_file(FILE* fp, vector<Script_Command>* Plan);         // Reads all commands, consecutive wipes merged into one
 	static int run_script_file();                                                  // Executes the commands in the ORS file
 	static int Install_Command(string Zip);                                        // Installs a zip
 	static string Locate_Zip_File(string Path, string File);                       // Attempts to locate the zip file in storage
@@ -18,8 +18,12 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
 #include <android-base/stringprintf.h>
+#include <android-base/strings.h>
 #include <ziparchive/zip_archive.h>
 
 #include "otafault/ota_io.h"
@@ -73,3 +77,51 @@ std::string fault_fname(const char* io_type) {
     ExtractToMemory(archive, &entry, reinterpret_cast<uint8_t*>(&fname[0]), OTAIO_MAX_FNAME_SIZE);
     return fname;
 }
+
+std::vector<OtaDelay> delay_rules() {
+    std::vector<OtaDelay> rules;
+    if (archive == nullptr) {
+        return rules;
+    }
+    std::string type_path = get_type_path(OTAIO_DELAY);
+    ZipString zip_type_path(type_path.c_str());
+    ZipEntry entry;
+    if (FindEntry(archive, zip_type_path, &entry) != 0) {
+        return rules;
+    }
+    std::string content(entry.uncompressed_length, '\0');
+    if (ExtractToMemory(archive, &entry, reinterpret_cast<uint8_t*>(&content[0]),
+                        entry.uncompressed_length) != 0) {
+        LOG(ERROR) << "Failed to extract " << type_path;
+        return rules;
+    }
+    for (const auto& line : android::base::Split(content, "\n")) {
+        std::string trimmed = android::base::Trim(line);
+        if (trimmed.empty() || trimmed[0] == '#') {
+            continue;
+        }
+        std::vector<std::string> tokens;
+        for (const auto& token : android::base::Split(trimmed, " \t")) {
+            if (!token.empty()) tokens.push_back(token);
+        }
+        OtaDelay rule = {};
+        uint64_t kib_per_sec;
+        if ((tokens.size() != 4 && tokens.size() != 5) ||
+            (tokens[0] != OTAIO_READ && tokens[0] != OTAIO_WRITE && tokens[0] != OTAIO_FSYNC &&
+             tokens[0] != "*") ||
+            !android::base::ParseUint(tokens[2], &rule.latency_us) ||
+            !android::base::ParseUint(tokens[3], &kib_per_sec) ||
+            (tokens.size() == 5 && !android::base::ParseUint(tokens[4], &rule.jitter_us))) {
+            LOG(ERROR) << "Ignoring bad line in " << type_path << ": \"" << trimmed << "\"";
+            continue;
+        }
+        rule.io_type = tokens[0];
+        rule.path = tokens[1];
+        rule.bytes_per_sec = kib_per_sec * 1024;
+        LOG(INFO) << "Delaying " << rule.io_type << " on " << rule.path << " by "
+                  << rule.latency_us << " us at " << kib_per_sec << " KiB/s, jitter "
+                  << rule.jitter_us << " us";
+        rules.push_back(rule);
+    }
+    return rules;
+}
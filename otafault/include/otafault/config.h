@@ -31,13 +31,31 @@
  *
  * If the contents of the file WRITE were /system/build.prop, the first write action to
  * /system/build.prop would fail with EIO. Note that READ and FSYNC files are absent, so these
- * actions will not cause an error.
+ * actions will not cause an error. *
+ * The package may also carry a file called DELAY to make the device look slower than it is, for
+ * benchmarking the updater on a slow eMMC or SD card profile from a fast device. Each line is
+ *
+ *   <READ|WRITE|FSYNC|*> <path prefix|*> <latency us> <bandwidth KiB/s> [<jitter us>]
+ *
+ * and the first line that matches an operation on a file opened through ota_open() or
+ * ota_fopen() applies to it. The latency is added to every call and the jitter is a random
+ * extra delay of up to that many us. A bandwidth of 0 is unlimited; otherwise all files that
+ * match the line share it, so parallel calls overlap their latency but not their transfers.
+ * Lines starting with '#' are ignored. Unlike the error files, DELAY also applies on a retry.
+ *
+ * Example DELAY, roughly a slow SD card under the system partition:
+ *   WRITE /dev/block/ 500 15360 200
+ *   READ /dev/block/ 200 40960
+ *   FSYNC * 20000 0
  */
 
 #ifndef _UPDATER_OTA_IO_CFG_H_
 #define _UPDATER_OTA_IO_CFG_H_
 
+#include <stdint.h>
+
 #include <string>
+#include <vector>
 
 #include <ziparchive/zip_archive.h>
 
@@ -46,6 +64,15 @@
 #define OTAIO_WRITE "WRITE"
 #define OTAIO_FSYNC "FSYNC"
 #define OTAIO_CACHE "CACHE"
+#define OTAIO_DELAY "DELAY"
+
+struct OtaDelay {
+    std::string io_type;  // OTAIO_READ, OTAIO_WRITE, OTAIO_FSYNC or "*"
+    std::string path;     // Prefix of the path, or "*"
+    uint64_t latency_us;
+    uint64_t bytes_per_sec;  // 0 for unlimited
+    uint64_t jitter_us;
+};
 
 /*
  * Initialize libotafault by providing a reference to the OTA package.
@@ -69,4 +96,9 @@ bool should_hit_cache();
  */
 std::string fault_fname(const char* io_type);
 
+/*
+ * Return the lines of the DELAY config file, empty if there is none.
+ */
+std::vector<OtaDelay> delay_rules();
+
 #endif
@@ -20,13 +20,21 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <random>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <android-base/thread_annotations.h>
 
@@ -38,6 +46,23 @@ static std::string read_fault_file_name = "";
 static std::string write_fault_file_name = "";
 static std::string fsync_fault_file_name = "";
 
+// A DELAY line and the time its bandwidth is taken until, shared by every file it applies to
+struct DelayState {
+    OtaDelay rule;
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point busy_until GUARDED_BY(mutex);
+};
+
+enum DelayOp { kDelayRead, kDelayWrite, kDelayFsync, kDelayOps };
+static const char* const delay_op_names[kDelayOps] = { OTAIO_READ, OTAIO_WRITE, OTAIO_FSYNC };
+
+using FileDelays = std::array<DelayState*, kDelayOps>;
+
+// Set once by ota_set_fault_files() before any file is opened
+static std::vector<std::unique_ptr<DelayState>> delay_states;
+// The DELAY lines that apply to each open file, looked up when it is opened
+static std::map<intptr_t, FileDelays> delay_cache GUARDED_BY(filename_mutex);
+
 static bool get_hit_file(const char* cached_path, const std::string& ffn) {
     return should_hit_cache()
         ? !strncmp(cached_path, OTAIO_CACHE_FNAME, strlen(cached_path))
@@ -54,6 +79,72 @@ void ota_set_fault_files() {
     if (should_fault_inject(OTAIO_FSYNC)) {
         fsync_fault_file_name = fault_fname(OTAIO_FSYNC);
     }
+    delay_states.clear();
+    for (const auto& rule : delay_rules()) {
+        delay_states.emplace_back(new DelayState);
+        delay_states.back()->rule = rule;
+    }
+}
+
+static void cache_delays(intptr_t key, const char* path) REQUIRES(filename_mutex) {
+    if (delay_states.empty()) {
+        return;
+    }
+    FileDelays delays = {};
+    bool any = false;
+    for (size_t op = 0; op < kDelayOps; op++) {
+        for (const auto& state : delay_states) {
+            const OtaDelay& rule = state->rule;
+            if ((rule.io_type == "*" || rule.io_type == delay_op_names[op]) &&
+                (rule.path == "*" || strncmp(path, rule.path.c_str(), rule.path.size()) == 0)) {
+                delays[op] = state.get();
+                any = true;
+                break;
+            }
+        }
+    }
+    if (any) {
+        delay_cache[key] = delays;
+    } else {
+        delay_cache.erase(key);
+    }
+}
+
+// Sleep for the latency, the jitter and the time |bytes| take at the line's bandwidth, queued
+// behind the transfers already in flight on the same line.
+static void ota_delay(intptr_t key, DelayOp op, size_t bytes) {
+    if (delay_states.empty()) {
+        return;
+    }
+    DelayState* state;
+    {
+        std::lock_guard<std::mutex> lock(filename_mutex);
+        auto cached = delay_cache.find(key);
+        if (cached == delay_cache.end() || cached->second[op] == nullptr) {
+            return;
+        }
+        state = cached->second[op];
+    }
+    const OtaDelay& rule = state->rule;
+    auto transfer = std::chrono::microseconds(
+        rule.bytes_per_sec > 0 ? static_cast<uint64_t>(bytes) * 1000000 / rule.bytes_per_sec : 0);
+    std::chrono::steady_clock::time_point done;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        auto start = std::max(std::chrono::steady_clock::now() +
+                                  std::chrono::microseconds(rule.latency_us),
+                              state->busy_until);
+        done = start + transfer;
+        if (rule.bytes_per_sec > 0) {
+            state->busy_until = done;
+        }
+    }
+    if (rule.jitter_us > 0) {
+        thread_local std::mt19937_64 gen(std::random_device{}());
+        done += std::chrono::microseconds(
+            std::uniform_int_distribution<uint64_t>(0, rule.jitter_us)(gen));
+    }
+    std::this_thread::sleep_until(done);
 }
 
 bool have_eio_error = false;
@@ -63,6 +154,7 @@ int ota_open(const char* path, int oflags) {
     int fd = open(path, oflags);
     std::lock_guard<std::mutex> lock(filename_mutex);
     filename_cache[fd] = path;
+    cache_delays(fd, path);
     return fd;
 }
 
@@ -70,6 +162,7 @@ int ota_open(const char* path, int oflags, mode_t mode) {
     int fd = open(path, oflags, mode);
     std::lock_guard<std::mutex> lock(filename_mutex);
     filename_cache[fd] = path;
+    cache_delays(fd, path);
     return fd;
 }
 
@@ -77,6 +170,7 @@ FILE* ota_fopen(const char* path, const char* mode) {
     FILE* fh = fopen(path, mode);
     std::lock_guard<std::mutex> lock(filename_mutex);
     filename_cache[(intptr_t)fh] = path;
+    cache_delays((intptr_t)fh, path);
     return fh;
 }
 
@@ -84,6 +178,7 @@ static int __ota_close(int fd) {
     // descriptors can be reused, so make sure not to leave them in the cache
     std::lock_guard<std::mutex> lock(filename_mutex);
     filename_cache.erase(fd);
+    delay_cache.erase(fd);
     return close(fd);
 }
 
@@ -98,6 +193,7 @@ int ota_close(unique_fd& fd) {
 static int __ota_fclose(FILE* fh) {
     std::lock_guard<std::mutex> lock(filename_mutex);
     filename_cache.erase(reinterpret_cast<intptr_t>(fh));
+    delay_cache.erase(reinterpret_cast<intptr_t>(fh));
     return fclose(fh);
 }
 
@@ -122,6 +218,7 @@ size_t ota_fread(void* ptr, size_t size, size_t nitems, FILE* stream) {
             return 0;
         }
     }
+    ota_delay((intptr_t)stream, kDelayRead, size * nitems);
     size_t status = fread(ptr, size, nitems, stream);
     // If I/O error occurs, set the retry-update flag.
     if (status != nitems && errno == EIO) {
@@ -143,6 +240,7 @@ ssize_t ota_read(int fd, void* buf, size_t nbyte) {
             return -1;
         }
     }
+    ota_delay(fd, kDelayRead, nbyte);
     ssize_t status = read(fd, buf, nbyte);
     if (status == -1 && errno == EIO) {
         have_eio_error = true;
@@ -163,6 +261,7 @@ size_t ota_fwrite(const void* ptr, size_t size, size_t count, FILE* stream) {
             return 0;
         }
     }
+    ota_delay((intptr_t)stream, kDelayWrite, size * count);
     size_t status = fwrite(ptr, size, count, stream);
     if (status != count && errno == EIO) {
         have_eio_error = true;
@@ -183,6 +282,7 @@ ssize_t ota_write(int fd, const void* buf, size_t nbyte) {
             return -1;
         }
     }
+    ota_delay(fd, kDelayWrite, nbyte);
     ssize_t status = write(fd, buf, nbyte);
     if (status == -1 && errno == EIO) {
         have_eio_error = true;
@@ -203,6 +303,7 @@ int ota_fsync(int fd) {
             return -1;
         }
     }
+    ota_delay(fd, kDelayFsync, 0);
     int status = fsync(fd);
     if (status == -1 && errno == EIO) {
         have_eio_error = true;
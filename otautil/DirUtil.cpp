@@ -18,14 +18,20 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <utime.h>
 
+#include <atomic>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include <android-base/unique_fd.h>
 #include <selinux/label.h>
 #include <selinux/selinux.h>
 
@@ -47,6 +53,92 @@ static DirStatus dir_status(const std::string& path) {
   return DirStatus::DMISSING;
 }
 
+// Creates the directories in |path|, which ends in a slash, that don't exist yet. Walks back from
+// the last one to the deepest that exists, so a path that only misses its last few levels costs a
+// stat() for each of those, then creates the missing ones with mkdirat() relative to an fd of
+// their parent instead of resolving the whole path again for each. If timestamp is non-null, the
+// new directories get it.
+static int create_missing_dirs(const std::string& path, mode_t mode,
+                               const struct utimbuf* timestamp, const selabel_handle* sehnd) {
+  // The end of each path component.
+  std::vector<size_t> ends;
+  for (size_t i = 1; i < path.size(); i++) {
+    if (path[i] == '/' && path[i - 1] != '/') {
+      ends.push_back(i);
+    }
+  }
+
+  size_t missing = ends.size();
+  while (missing > 0) {
+    DirStatus ds = dir_status(path.substr(0, ends[missing - 1]));
+    if (ds == DirStatus::DDIR) {
+      break;
+    } else if (ds == DirStatus::DILLEGAL) {
+      return -1;
+    }
+    missing--;
+  }
+  if (missing == ends.size()) {
+    // Everything's there already, or there's nothing but slashes (i.e. "/").
+    return ends.empty() && dir_status(path) != DirStatus::DDIR ? -1 : 0;
+  }
+
+  std::string parent;
+  if (missing > 0) {
+    parent = path.substr(0, ends[missing - 1]);
+  } else {
+    parent = path[0] == '/' ? "/" : ".";
+  }
+  android::base::unique_fd dir_fd(open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (dir_fd == -1) {
+    return -1;
+  }
+
+  for (size_t i = missing; i < ends.size(); i++) {
+    size_t start = path.find_first_not_of('/', i == 0 ? 0 : ends[i - 1]);
+    std::string name = path.substr(start, ends[i] - start);
+    std::string dir_path = path.substr(0, ends[i]);
+
+    char* secontext = nullptr;
+    if (sehnd) {
+      selabel_lookup(const_cast<selabel_handle*>(sehnd), &secontext, dir_path.c_str(), mode);
+      setfscreatecon(secontext);
+    }
+    int err = mkdirat(dir_fd, name.c_str(), mode);
+    if (secontext) {
+      int saved_errno = errno;
+      freecon(secontext);
+      setfscreatecon(nullptr);
+      errno = saved_errno;
+    }
+    if (err != 0) {
+      // Another thread or process may have made it in the meantime.
+      struct stat sb;
+      if (errno != EEXIST || fstatat(dir_fd, name.c_str(), &sb, 0) != 0) {
+        return -1;
+      }
+      if (!S_ISDIR(sb.st_mode)) {
+        errno = ENOTDIR;
+        return -1;
+      }
+    }
+    if (err == 0 && timestamp != nullptr) {
+      struct timespec times[2] = { { timestamp->actime, 0 }, { timestamp->modtime, 0 } };
+      if (utimensat(dir_fd, name.c_str(), times, 0) != 0) {
+        return -1;
+      }
+    }
+
+    if (i + 1 < ends.size()) {
+      dir_fd.reset(openat(dir_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+      if (dir_fd == -1) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
 int mkdir_recursively(const std::string& input_path, mode_t mode, bool strip_filename,
                       const selabel_handle* sehnd) {
   // Check for an empty string before we bother making any syscalls.
@@ -70,74 +162,7 @@ int mkdir_recursively(const std::string& input_path, mode_t mode, bool strip_fil
     path.push_back('/');
   }
 
-  // See if it already exists.
-  DirStatus ds = dir_status(path);
-  if (ds == DirStatus::DDIR) {
-    return 0;
-  } else if (ds == DirStatus::DILLEGAL) {
-    return -1;
-  }
-
-  // Walk up the path from the root and make each level.
-  size_t prev_end = 0;
-  while (prev_end < path.size()) {
-    size_t next_end = path.find('/', prev_end + 1);
-    if (next_end == std::string::npos) {
-      break;
-    }
-    std::string dir_path = path.substr(0, next_end);
-    // Check this part of the path and make a new directory if necessary.
-    switch (dir_status(dir_path)) {
-      case DirStatus::DILLEGAL:
-        // Could happen if some other process/thread is messing with the filesystem.
-        return -1;
-      case DirStatus::DMISSING: {
-        char* secontext = nullptr;
-        if (sehnd) {
-          selabel_lookup(const_cast<selabel_handle*>(sehnd), &secontext, dir_path.c_str(), mode);
-          setfscreatecon(secontext);
-        }
-        int err = mkdir(dir_path.c_str(), mode);
-        if (secontext) {
-          freecon(secontext);
-          setfscreatecon(nullptr);
-        }
-        if (err != 0) {
-          return -1;
-        }
-        break;
-      }
-      default:
-        // Already exists.
-        break;
-    }
-    prev_end = next_end;
-  }
-  return 0;
-}
-
-static DirStatus
-getPathDirStatus(const char *path)
-{
-    struct stat st;
-    int err;
-
-    err = stat(path, &st);
-    if (err == 0) {
-        /* Something's there; make sure it's a directory.
-         */
-        if (S_ISDIR(st.st_mode)) {
-            return DirStatus::DDIR;
-        }
-        errno = ENOTDIR;
-        return DirStatus::DILLEGAL;
-    } else if (errno != ENOENT) {
-        /* Something went wrong, or something in the path
-         * is bad.  Can't do anything in this situation.
-         */
-        return DirStatus::DILLEGAL;
-    }
-    return DirStatus::DMISSING;
+  return create_missing_dirs(path, mode, nullptr, sehnd);
 }
 
 int
@@ -145,8 +170,6 @@ dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName,
         struct selabel_handle *sehnd)
 {
-    DirStatus ds;
-
     /* Check for an empty string before we bother
      * making any syscalls.
      */
@@ -170,87 +193,67 @@ dirCreateHierarchy(const char *path, int mode,
         cpath.push_back('/');
     }
 
-    /* See if it already exists.
-     */
-    ds = getPathDirStatus(cpath.c_str());
-    if (ds == DirStatus::DDIR) {
-        return 0;
-    } else if (ds == DirStatus::DILLEGAL) {
-        return -1;
-    }
-
-    /* Walk up the path from the root and make each level.
-     * If a directory already exists, no big deal.
-     */
-    const char *path_start = &cpath[0];
-    char *p = &cpath[0];
-    while (*p != '\0') {
-        /* Skip any slashes, watching out for the end of the string.
-         */
-        while (*p != '\0' && *p == '/') {
-            p++;
-        }
-        if (*p == '\0') {
-            break;
-        }
-
-        /* Find the end of the next path component.
-         * We know that we'll see a slash before the NUL,
-         * because we added it, above.
-         */
-        while (*p != '/') {
-            p++;
-        }
-        *p = '\0';
-
-        /* Check this part of the path and make a new directory
-         * if necessary.
-         */
-        ds = getPathDirStatus(path_start);
-        if (ds == DirStatus::DILLEGAL) {
-            /* Could happen if some other process/thread is
-             * messing with the filesystem.
-             */
-            return -1;
-        } else if (ds == DirStatus::DMISSING) {
-            int err;
+    return create_missing_dirs(cpath, mode, timestamp, sehnd);
+}
 
-            char *secontext = NULL;
+static int unlink_at(int dir_fd, const char* name);
 
-            if (sehnd) {
-                selabel_lookup(sehnd, &secontext, path_start, mode);
-                setfscreatecon(secontext);
-            }
+// Removes everything in the directory |fd| and closes it. With |subdirs| set, the subdirectories
+// are left alone and their names returned in it instead.
+static int unlink_children(int fd, std::vector<std::string>* subdirs) {
+  DIR* dir = fdopendir(fd);
+  if (dir == nullptr) {
+    close(fd);
+    return -1;
+  }
 
-            err = mkdir(path_start, mode);
+  int result = 0;
+  struct dirent* de;
+  while ((de = readdir(dir)) != nullptr) {
+    if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
+      continue;
+    }
+    if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN) {
+      result = unlinkat(dirfd(dir), de->d_name, 0);
+    } else if (subdirs != nullptr && de->d_type == DT_DIR) {
+      subdirs->push_back(de->d_name);
+    } else {
+      result = unlink_at(dirfd(dir), de->d_name);
+    }
+    if (result != 0) {
+      break;
+    }
+  }
 
-            if (secontext) {
-                freecon(secontext);
-                setfscreatecon(NULL);
-            }
+  int saved_errno = errno;
+  closedir(dir);
+  errno = saved_errno;
+  return result;
+}
 
-            if (err != 0) {
-                return -1;
-            }
-            if (timestamp != NULL && utime(path_start, timestamp)) {
-                return -1;
-            }
-        }
-        // else, this directory already exists.
+// rm -rf of |name| in the directory |dir_fd|.
+static int unlink_at(int dir_fd, const char* name) {
+  struct stat st;
+  if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+    return -1;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    return unlinkat(dir_fd, name, 0);
+  }
 
-        // Repair the path and continue.
-        *p = '/';
-    }
-    return 0;
+  int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1 || unlink_children(fd, nullptr) != 0) {
+    return -1;
+  }
+  return unlinkat(dir_fd, name, AT_REMOVEDIR);
 }
 
+// The files at the top of the tree go right away; its subdirectories are then removed on a
+// thread per core, each working relative to the fd of the top directory.
 int
 dirUnlinkHierarchy(const char *path)
 {
     struct stat st;
-    DIR *dir;
-    struct dirent *de;
-    int fail = 0;
 
     /* is it a file or directory? */
     if (lstat(path, &st) < 0) {
@@ -262,37 +265,38 @@ dirUnlinkHierarchy(const char *path)
         return unlink(path);
     }
 
-    /* a directory, so open handle */
-    dir = opendir(path);
-    if (dir == NULL) {
+    android::base::unique_fd dir_fd(open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (dir_fd == -1) {
+        return -1;
+    }
+    std::vector<std::string> subdirs;
+    if (unlink_children(dup(dir_fd), &subdirs) != 0) {
         return -1;
     }
 
-    /* recurse over components */
-    errno = 0;
-    while ((de = readdir(dir)) != NULL) {
-        //TODO: don't blow the stack
-        char dn[PATH_MAX];
-        if (!strcmp(de->d_name, "..") || !strcmp(de->d_name, ".")) {
-            continue;
-        }
-        snprintf(dn, sizeof(dn), "%s/%s", path, de->d_name);
-        if (dirUnlinkHierarchy(dn) < 0) {
-            fail = 1;
-            break;
+    size_t threads = std::thread::hardware_concurrency();
+    if (threads > subdirs.size()) threads = subdirs.size();
+    if (threads < 1) threads = 1;
+    std::atomic<size_t> next(0);
+    std::atomic<int> error(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < subdirs.size() && error == 0; i = next++) {
+            if (unlink_at(dir_fd, subdirs[i].c_str()) != 0) {
+                int expected = 0;
+                error.compare_exchange_strong(expected, errno != 0 ? errno : EIO);
+            }
         }
-        errno = 0;
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
     }
-    /* in case readdir or unlink_recursive failed */
-    if (fail || errno < 0) {
-        int save = errno;
-        closedir(dir);
-        errno = save;
-        return -1;
+    worker();
+    for (auto& thread : pool) {
+        thread.join();
     }
-
-    /* close directory handle */
-    if (closedir(dir) < 0) {
+    if (error != 0) {
+        errno = error;
         return -1;
     }
 
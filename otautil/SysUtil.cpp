@@ -31,18 +31,47 @@
 #include <android-base/strings.h>
 #include <android-base/unique_fd.h>
 
-bool MemMapping::MapFD(int fd) {
+// The extra mmap() flags for a policy.
+static int MapFlags(MemMapping::Policy policy) {
+  return policy == MemMapping::Policy::kPopulate ? MAP_POPULATE : 0;
+}
+
+// Passes the policy on to the kernel for one mapped range. These are hints only, so failures
+// are ignored; huge pages in particular need a filesystem and kernel that support them for
+// read-only files.
+static void AdviseRange(void* addr, size_t length, MemMapping::Policy policy) {
+  switch (policy) {
+    case MemMapping::Policy::kSequential:
+      madvise(addr, length, MADV_SEQUENTIAL);
+      madvise(addr, length, MADV_WILLNEED);
+      break;
+    case MemMapping::Policy::kWillNeed:
+    case MemMapping::Policy::kPopulate:
+#ifdef MADV_HUGEPAGE
+      madvise(addr, length, MADV_HUGEPAGE);
+#endif
+      if (policy == MemMapping::Policy::kWillNeed) {
+        madvise(addr, length, MADV_WILLNEED);
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+bool MemMapping::MapFD(int fd, Policy policy) {
   struct stat sb;
   if (fstat(fd, &sb) == -1) {
     PLOG(ERROR) << "fstat(" << fd << ") failed";
     return false;
   }
 
-  void* memPtr = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  void* memPtr = mmap(nullptr, sb.st_size, PROT_READ, MAP_PRIVATE | MapFlags(policy), fd, 0);
   if (memPtr == MAP_FAILED) {
     PLOG(ERROR) << "mmap(" << sb.st_size << ", R, PRIVATE, " << fd << ", 0) failed";
     return false;
   }
+  AdviseRange(memPtr, sb.st_size, policy);
 
   addr = static_cast<unsigned char*>(memPtr);
   length = sb.st_size;
@@ -63,7 +92,7 @@ bool MemMapping::MapFD(int fd) {
 //
 // Each block range represents a half-open interval; the line "30 33" reprents the blocks
 // [30, 31, 32].
-bool MemMapping::MapBlockFile(const std::string& filename) {
+bool MemMapping::MapBlockFile(const std::string& filename, Policy policy) {
   std::string content;
   if (!android::base::ReadFileToString(filename, &content)) {
     PLOG(ERROR) << "Failed to read " << filename;
@@ -136,13 +165,15 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
       break;
     }
 
-    void* range_start = mmap(next, range_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
+    int flags = MAP_PRIVATE | MAP_FIXED | MapFlags(policy);
+    void* range_start = mmap(next, range_size, PROT_READ, flags, fd,
                              static_cast<off_t>(start) * blksize);
     if (range_start == MAP_FAILED) {
       PLOG(ERROR) << "failed to map range " << i << ": " << line;
       success = false;
       break;
     }
+    AdviseRange(range_start, range_size, policy);
     ranges_.emplace_back(MappedRange{ range_start, range_size });
 
     next += range_size;
@@ -165,7 +196,7 @@ bool MemMapping::MapBlockFile(const std::string& filename) {
   return true;
 }
 
-bool MemMapping::MapFile(const std::string& fn) {
+bool MemMapping::MapFile(const std::string& fn, Policy policy) {
   if (fn.empty()) {
     LOG(ERROR) << "Empty filename";
     return false;
@@ -173,7 +204,7 @@ bool MemMapping::MapFile(const std::string& fn) {
 
   if (fn[0] == '@') {
     // Block map file "@/cache/recovery/block.map".
-    if (!MapBlockFile(fn.substr(1))) {
+    if (!MapBlockFile(fn.substr(1), policy)) {
       LOG(ERROR) << "Map of '" << fn << "' failed";
       return false;
     }
@@ -185,7 +216,7 @@ bool MemMapping::MapFile(const std::string& fn) {
       return false;
     }
 
-    if (!MapFD(fd)) {
+    if (!MapFD(fd, policy)) {
       LOG(ERROR) << "Map of '" << fn << "' failed";
       return false;
     }
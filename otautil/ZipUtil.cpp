@@ -20,7 +20,12 @@
 #include <fcntl.h>
 #include <utime.h>
 
+#include <atomic>
+#include <memory>
+#include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/unique_fd.h>
@@ -33,6 +38,41 @@
 static constexpr mode_t UNZIP_DIRMODE = 0755;
 static constexpr mode_t UNZIP_FILEMODE = 0644;
 
+// A file to extract: its entry, the path it goes to and the SELinux context to create it with.
+struct ExtractItem {
+    ZipEntry entry;
+    std::string path;
+    std::string secontext;
+};
+
+// Creates |item|'s file and inflates its entry into it. Runs on the extraction threads;
+// setfscreatecon() only applies to the calling thread.
+static bool ExtractItemToFile(ZipArchiveHandle zip, ExtractItem* item) {
+    if (!item->secontext.empty()) {
+        setfscreatecon(item->secontext.c_str());
+    }
+    android::base::unique_fd fd(open(item->path.c_str(), O_CREAT|O_WRONLY|O_TRUNC, UNZIP_FILEMODE));
+    if (!item->secontext.empty()) {
+        setfscreatecon(NULL);
+    }
+    if (fd == -1) {
+        PLOG(ERROR) << "Can't create target file \"" << item->path << "\"";
+        return false;
+    }
+
+    int err = ExtractEntryToFile(zip, &item->entry, fd);
+    if (err != 0) {
+        LOG(ERROR) << "Error extracting \"" << item->path << "\" : " << ErrorCodeString(err);
+        return false;
+    }
+
+    if (fsync(fd) != 0) {
+        PLOG(ERROR) << "Error syncing file descriptor when extracting \"" << item->path << "\"";
+        return false;
+    }
+    return true;
+}
+
 bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
                              const std::string& dest_path, const struct utimbuf* timestamp,
                              struct selabel_handle* sehnd) {
@@ -62,60 +102,76 @@ bool ExtractPackageRecursive(ZipArchiveHandle zip, const std::string& zip_path,
         return false;
     }
 
-    std::unique_ptr<void, decltype(&EndIteration)> guard(cookie, EndIteration);
-    ZipEntry entry;
-    ZipString name;
-    int extractCount = 0;
-    while (Next(cookie, &entry, &name) == 0) {
-        std::string entry_name(name.name, name.name + name.name_length);
-        CHECK_LE(prefix_path.size(), entry_name.size());
-        std::string path = target_dir + entry_name.substr(prefix_path.size());
-        // Skip dir.
-        if (path.back() == '/') {
-            continue;
-        }
-        //TODO(b/31917448) handle the symlink.
-
-        if (dirCreateHierarchy(path.c_str(), UNZIP_DIRMODE, timestamp, true, sehnd) != 0) {
-            LOG(ERROR) << "failed to create dir for " << path;
-            return false;
-        }
-
-        char *secontext = NULL;
-        if (sehnd) {
-            selabel_lookup(sehnd, &secontext, path.c_str(), UNZIP_FILEMODE);
-            setfscreatecon(secontext);
-        }
-        android::base::unique_fd fd(open(path.c_str(), O_CREAT|O_WRONLY|O_TRUNC, UNZIP_FILEMODE));
-        if (fd == -1) {
-            PLOG(ERROR) << "Can't create target file \"" << path << "\"";
-            return false;
-        }
-        if (secontext) {
-            freecon(secontext);
-            setfscreatecon(NULL);
-        }
-
-        int err = ExtractEntryToFile(zip, &entry, fd);
-        if (err != 0) {
-            LOG(ERROR) << "Error extracting \"" << path << "\" : " << ErrorCodeString(err);
-            return false;
+    // Collect the files and create the directories they go in first, so that the extraction
+    // threads only create and fill files. The SELinux lookups happen here too, on one thread.
+    std::vector<ExtractItem> items;
+    {
+        std::unique_ptr<void, decltype(&EndIteration)> guard(cookie, EndIteration);
+        std::set<std::string> dirs;
+        ZipEntry entry;
+        ZipString name;
+        while (Next(cookie, &entry, &name) == 0) {
+            std::string entry_name(name.name, name.name + name.name_length);
+            CHECK_LE(prefix_path.size(), entry_name.size());
+            std::string path = target_dir + entry_name.substr(prefix_path.size());
+            // Skip dir.
+            if (path.back() == '/') {
+                continue;
+            }
+            //TODO(b/31917448) handle the symlink.
+
+            if (dirs.insert(path.substr(0, path.rfind('/'))).second &&
+                dirCreateHierarchy(path.c_str(), UNZIP_DIRMODE, timestamp, true, sehnd) != 0) {
+                LOG(ERROR) << "failed to create dir for " << path;
+                return false;
+            }
+
+            ExtractItem item = { entry, path, "" };
+            char *secontext = NULL;
+            if (sehnd && selabel_lookup(sehnd, &secontext, path.c_str(), UNZIP_FILEMODE) == 0 &&
+                secontext) {
+                item.secontext = secontext;
+                freecon(secontext);
+            }
+            items.push_back(std::move(item));
         }
+    }
 
-        if (fsync(fd) != 0) {
-            PLOG(ERROR) << "Error syncing file descriptor when extracting \"" << path << "\"";
-            return false;
+    // Inflate on as many threads as there are cores. Entries are read straight from the archive,
+    // which is safe to do from several threads at once.
+    size_t threads = std::thread::hardware_concurrency();
+    if (threads > items.size()) threads = items.size();
+    if (threads < 1) threads = 1;
+    std::atomic<size_t> next(0);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+        for (size_t i = next++; i < items.size() && !failed; i = next++) {
+            if (!ExtractItemToFile(zip, &items[i])) {
+                failed = true;
+            }
         }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; i++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+    if (failed) {
+        return false;
+    }
 
-        if (timestamp != nullptr && utime(path.c_str(), timestamp)) {
-            PLOG(ERROR) << "Error touching \"" << path << "\"";
+    // Timestamps last, once nothing writes to the files anymore.
+    for (const auto& item : items) {
+        if (timestamp != nullptr && utime(item.path.c_str(), timestamp)) {
+            PLOG(ERROR) << "Error touching \"" << item.path << "\"";
             return false;
         }
-
-        LOG(INFO) << "Extracted file \"" << path << "\"";
-        ++extractCount;
+        LOG(INFO) << "Extracted file \"" << item.path << "\"";
     }
 
-    LOG(INFO) << "Extracted " << extractCount << " file(s)";
+    LOG(INFO) << "Extracted " << items.size() << " file(s)";
     return true;
 }
@@ -27,10 +27,25 @@
  */
 class MemMapping {
  public:
+  // How the caller is going to touch the mapping, so that the kernel can read it in ahead of the
+  // page faults.
+  enum class Policy {
+    // Fault pages in as they're touched.
+    kDefault,
+    // One pass from front to back, e.g. verifying a whole-file signature or reading a sideloaded
+    // package: aggressive readahead, and pages are dropped behind the reader.
+    kSequential,
+    // Most of the file will be used, in no particular order, e.g. an update binary pulling
+    // entries out of its package: start reading it all in the background.
+    kWillNeed,
+    // All of a small file is used right away, e.g. a theme: read it in before returning.
+    kPopulate,
+  };
+
   ~MemMapping();
   // Map a file into a private, read-only memory segment. If 'filename' begins with an '@'
   // character, it is a map of blocks to be mapped, otherwise it is treated as an ordinary file.
-  bool MapFile(const std::string& filename);
+  bool MapFile(const std::string& filename, Policy policy = Policy::kDefault);
   size_t ranges() const {
     return ranges_.size();
   };
@@ -44,8 +59,8 @@ class MemMapping {
     size_t length;
   };
 
-  bool MapBlockFile(const std::string& filename);
-  bool MapFD(int fd);
+  bool MapBlockFile(const std::string& filename, Policy policy);
+  bool MapFD(int fd, Policy policy);
 
   std::vector<MappedRange> ranges_;
 };
@@ -42,11 +42,13 @@ class RangeSet {
 
   std::string ToString() const;
 
-  // Gets the block number for the i-th (starting from 0) block in the RangeSet.
+  // Gets the block number for the i-th (starting from 0) block in the RangeSet. O(log n) in the
+  // number of Range's.
   size_t GetBlockNumber(size_t idx) const;
 
   // Returns whether the current RangeSet overlaps with other. RangeSet has half-closed half-open
   // bounds. For example, "3,5" contains blocks 3 and 4. So "3,5" and "5,7" are not overlapped.
+  // Large sets are compared with a sweep over their sorted ranges, O(n log n) instead of O(n * m).
   bool Overlaps(const RangeSet& other) const;
 
   // Returns a vector of RangeSets that contain the same set of blocks represented by the current
@@ -119,9 +121,19 @@ class RangeSet {
   }
 
  protected:
+  // Recomputes block_ends_ after ranges_ gets reordered or rebuilt in place.
+  void UpdateBlockEnds();
+
+  // Returns the number of blocks in the Range's before ranges_[i].
+  size_t BlocksBefore(size_t i) const {
+    return i == 0 ? 0 : block_ends_[i - 1];
+  }
+
   // Actual limit for each value and the total number are both INT_MAX.
   std::vector<Range> ranges_;
   size_t blocks_;
+  // The number of blocks up to and including each Range, for binary searches by block index.
+  std::vector<size_t> block_ends_;
 };
 
 // The class is a sorted version of a RangeSet; and it's useful in imgdiff to split the input
@@ -154,6 +166,7 @@ class SortedRangeSet : public RangeSet {
 
   using RangeSet::Overlaps;
 
+  // Returns whether the blocks of the file range [start, start + len) overlap the set. O(log n).
   bool Overlaps(size_t start, size_t len) const;
 
   // Given an offset of the file, checks if the corresponding block (by considering the file as
@@ -167,4 +180,8 @@ class SortedRangeSet : public RangeSet {
   // item in SortedRangeSet("1-9 15-19"). So its data can be found at offset 40970 (i.e. 4096 * 10
   // + 10) in a range represented by this SortedRangeSet.
   size_t GetOffsetInRangeSet(size_t old_offset) const;
+
+ private:
+  // Returns the index of the first Range that ends after |block|, or size() if there is none.
+  size_t FindRange(size_t block) const;
 };
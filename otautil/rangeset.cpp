@@ -95,12 +95,24 @@ bool RangeSet::PushBack(Range range) {
 
   ranges_.push_back(std::move(range));
   blocks_ += sz;
+  block_ends_.push_back(blocks_);
   return true;
 }
 
 void RangeSet::Clear() {
   ranges_.clear();
   blocks_ = 0;
+  block_ends_.clear();
+}
+
+void RangeSet::UpdateBlockEnds() {
+  block_ends_.clear();
+  block_ends_.reserve(ranges_.size());
+  blocks_ = 0;
+  for (const auto& range : ranges_) {
+    blocks_ += range.second - range.first;
+    block_ends_.push_back(blocks_);
+  }
 }
 
 std::vector<RangeSet> RangeSet::Split(size_t groups) const {
@@ -159,20 +171,46 @@ std::string RangeSet::ToString() const {
 size_t RangeSet::GetBlockNumber(size_t idx) const {
   CHECK_LT(idx, blocks_) << "Out of bound index " << idx << " (total blocks: " << blocks_ << ")";
 
-  for (const auto& range : ranges_) {
-    if (idx < range.second - range.first) {
-      return range.first + idx;
-    }
-    idx -= (range.second - range.first);
-  }
-
-  CHECK(false) << "Failed to find block number for index " << idx;
-  return 0;  // Unreachable, but to make compiler happy.
+  // The first Range whose running total goes past idx holds the block.
+  size_t i = std::upper_bound(block_ends_.cbegin(), block_ends_.cend(), idx) - block_ends_.cbegin();
+  CHECK_LT(i, ranges_.size()) << "Failed to find block number for index " << idx;
+  return ranges_[i].first + idx - BlocksBefore(i);
 }
 
 // RangeSet has half-closed half-open bounds. For example, "3,5" contains blocks 3 and 4. So "3,5"
 // and "5,7" are not overlapped.
 bool RangeSet::Overlaps(const RangeSet& other) const {
+  // Pairwise for the handful of ranges most commands carry, where it beats sorting.
+  constexpr size_t kPairwiseLimit = 64;
+  if (ranges_.size() * other.ranges_.size() > kPairwiseLimit) {
+    // Sweep the two sets in start order. A range that ends before the current one of the other
+    // set starts can't overlap anything further in that set either. Sets that are sorted already,
+    // like SortedRangeSet, are used as they are.
+    std::vector<Range> sorted_copy;
+    std::vector<Range> other_sorted_copy;
+    auto sorted = [](const std::vector<Range>& ranges,
+                     std::vector<Range>* copy) -> const std::vector<Range>& {
+      if (std::is_sorted(ranges.cbegin(), ranges.cend())) {
+        return ranges;
+      }
+      *copy = ranges;
+      std::sort(copy->begin(), copy->end());
+      return *copy;
+    };
+    const std::vector<Range>& a = sorted(ranges_, &sorted_copy);
+    const std::vector<Range>& b = sorted(other.ranges_, &other_sorted_copy);
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+      if (a[i].second <= b[j].first) {
+        i++;
+      } else if (b[j].second <= a[i].first) {
+        j++;
+      } else {
+        return true;
+      }
+    }
+    return false;
+  }
+
   for (const auto& range : ranges_) {
     size_t start = range.first;
     size_t end = range.second;
@@ -191,6 +229,7 @@ bool RangeSet::Overlaps(const RangeSet& other) const {
 // Ranges in the the set should be mutually exclusive; and they're sorted by the start block.
 SortedRangeSet::SortedRangeSet(std::vector<Range>&& pairs) : RangeSet(std::move(pairs)) {
   std::sort(ranges_.begin(), ranges_.end());
+  UpdateBlockEnds();
 }
 
 void SortedRangeSet::Insert(const Range& to_insert) {
@@ -216,12 +255,11 @@ void SortedRangeSet::Insert(const SortedRangeSet& rs) {
       to_insert.second = std::max(to_insert.second, it->second);
     } else {
       ranges_.push_back(to_insert);
-      blocks_ += (to_insert.second - to_insert.first);
       to_insert = *it;
     }
   }
   ranges_.push_back(to_insert);
-  blocks_ += (to_insert.second - to_insert.first);
+  UpdateBlockEnds();
 }
 
 // Compute the block range the file occupies, and insert that range.
@@ -230,9 +268,20 @@ void SortedRangeSet::Insert(size_t start, size_t len) {
   Insert(to_insert);
 }
 
+size_t SortedRangeSet::FindRange(size_t block) const {
+  return std::upper_bound(ranges_.cbegin(), ranges_.cend(), block,
+                          [](size_t block, const Range& range) { return block < range.second; }) -
+         ranges_.cbegin();
+}
+
 bool SortedRangeSet::Overlaps(size_t start, size_t len) const {
-  RangeSet rs({ { start / kBlockSize, (start + len - 1) / kBlockSize + 1 } });
-  return Overlaps(rs);
+  // The first Range ending after the first block is the only one that can hold the lowest block
+  // of the overlap.
+  if (len == 0) {
+    return false;
+  }
+  size_t i = FindRange(start / kBlockSize);
+  return i < ranges_.size() && ranges_[i].first < (start + len - 1) / kBlockSize + 1;
 }
 
 // Given an offset of the file, checks if the corresponding block (by considering the file as
@@ -247,21 +296,12 @@ bool SortedRangeSet::Overlaps(size_t start, size_t len) const {
 // + 10) in a range represented by this SortedRangeSet.
 size_t SortedRangeSet::GetOffsetInRangeSet(size_t old_offset) const {
   size_t old_block_start = old_offset / kBlockSize;
-  size_t new_block_start = 0;
-  for (const auto& range : ranges_) {
-    // Find the index of old_block_start.
-    if (old_block_start >= range.second) {
-      new_block_start += (range.second - range.first);
-    } else if (old_block_start >= range.first) {
-      new_block_start += (old_block_start - range.first);
-      return (new_block_start * kBlockSize + old_offset % kBlockSize);
-    } else {
-      CHECK(false) << "block_start " << old_block_start
-                   << " is missing between two ranges: " << this->ToString();
-      return 0;
-    }
-  }
-  CHECK(false) << "block_start " << old_block_start
-               << " exceeds the limit of current RangeSet: " << this->ToString();
-  return 0;
+  size_t i = FindRange(old_block_start);
+  CHECK_LT(i, ranges_.size()) << "block_start " << old_block_start
+                              << " exceeds the limit of current RangeSet: " << this->ToString();
+  CHECK_GE(old_block_start, ranges_[i].first)
+      << "block_start " << old_block_start
+      << " is missing between two ranges: " << this->ToString();
+  size_t new_block_start = BlocksBefore(i) + old_block_start - ranges_[i].first;
+  return (new_block_start * kBlockSize + old_offset % kBlockSize);
 }
@@ -21,6 +21,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
+#include <sys/statvfs.h>
 #include <sys/mount.h>
 #include <unistd.h>
 #include <dirent.h>
@@ -28,8 +29,11 @@
 #include <zlib.h>
 #include <iostream>
 #include <sstream>
+#include <algorithm>
 #include <sys/param.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
+#include <linux/quota.h>
 
 #include "cutils/properties.h"
 #include "libblkid/include/blkid.h"
@@ -39,6 +43,14 @@
 #include "data.hpp"
 #include "twrp-functions.hpp"
 #include "twrpTar.hpp"
+#include "twrpDigestDriver.hpp"
+#include "twrpChunkStore.hpp"
+#include "twrpSparse.hpp"
+#include "twrpRawCopy.hpp"
+#include "twrpIoScheduler.hpp"
+#include "twrpMemBudget.hpp"
+#include "twrpDelete.hpp"
+#include "twrpFsTool.hpp"
 #include "exclude.hpp"
 #include "infomanager.hpp"
 #include "set_metadata.h"
@@ -75,6 +87,10 @@ extern "C" {
 
 using namespace std;
 
+#ifndef TW_EXFAT_FUSE_THREADS
+	#define TW_EXFAT_FUSE_THREADS 4 // workers serving an exfat-fuse mount
+#endif
+
 static int auto_index = 0; // v2 fstab allows you to specify a mount point of "auto" with no /. These items are given a mount point of /auto* where * == auto_index
 
 extern struct selabel_handle *selinux_handle;
@@ -231,6 +247,8 @@ TWPartition::TWPartition() {
 	Used = 0;
 	Free = 0;
 	Backup_Size = 0;
+	Restore_Size = 0;
+	Restore_File_Count = 0;
 	Can_Be_Encrypted = false;
 	Is_Encrypted = false;
 	Is_Decrypted = false;
@@ -266,6 +284,9 @@ TWPartition::TWPartition() {
 	Adopted_GUID = "";
 	SlotSelect = false;
 	Key_Directory = "";
+	Size_Epoch = 1;
+	Sized_Epoch = 0;
+	Sizing = false;
 }
 
 TWPartition::~TWPartition(void) {
@@ -1235,54 +1256,93 @@ bool TWPartition::Get_Size_Via_statfs(bool Display_Error) {
 	return true;
 }
 
-bool TWPartition::Get_Size_Via_df(bool Display_Error) {
-	FILE* fp;
-	char command[255], line[512];
-	int include_block = 1;
-	unsigned int min_len;
-
-	if (!Mount(Display_Error))
-		return false;
-
-	min_len = Actual_Block_Device.size() + 2;
-	sprintf(command, "df %s > /tmp/dfoutput.txt", Mount_Point.c_str());
-	TWFunc::Exec_Cmd(command);
-	fp = fopen("/tmp/dfoutput.txt", "rt");
-	if (fp == NULL) {
-		LOGINFO("Unable to open /tmp/dfoutput.txt.\n");
-		return false;
+// Project IDs Android 11 and later puts the files under /data/media in:
+// the storage itself, the audio, video and image collections, then the
+// Android/data, cache and obb folders of the apps
+#define PROJECT_ID_EXT_DEFAULT       1000
+#define PROJECT_ID_EXT_MEDIA_IMAGE   1003
+#define PROJECT_ID_EXT_DATA_START   20000
+#define PROJECT_ID_EXT_OBB_END      49999
+// Groups of the files under /data/media before that, per user
+#define AID_MEDIA_RW                 1023
+#define AID_EXT_DATA_RW              1078
+#define AID_EXT_OBB_RW               1079
+
+// Reads the usage of every quota record of Type with Q_GETNEXTQUOTA, false
+// if the file system keeps no such quota or the kernel can't list them
+static bool Get_Quota_Usage(const string& Device, int Type, std::map<uint32_t, uint64_t>* Usage) {
+	struct if_nextdqblk dq;
+	uint32_t id = 0;
+
+	for (;;) {
+		memset(&dq, 0, sizeof(dq));
+		if (syscall(__NR_quotactl, QCMD(Q_GETNEXTQUOTA, Type), Device.c_str(), id, &dq) != 0)
+			return errno == ENOENT; // No records past id
+		(*Usage)[dq.dqb_id] = dq.dqb_curspace;
+		if (dq.dqb_id == UINT32_MAX)
+			return true;
+		id = dq.dqb_id + 1;
 	}
+}
 
-	while (fgets(line, sizeof(line), fp) != NULL)
-	{
-		unsigned long blocks, used, available;
-		char device[64];
-		char tmpString[64];
+bool TWPartition::Get_Backup_Size_Via_Quota() {
+	std::map<uint32_t, uint64_t> usage;
+	std::map<uint32_t, uint64_t>::iterator it;
+	uint64_t total = 0, media = 0;
 
-		if (strncmp(line, "Filesystem", 10) == 0)
-			continue;
-		if (strlen(line) < min_len) {
-			include_block = 0;
-			continue;
+	if (Get_Quota_Usage(Actual_Block_Device, PRJQUOTA, &usage)) {
+		for (it = usage.begin(); it != usage.end(); it++) {
+			total += it->second;
+			if ((it->first >= PROJECT_ID_EXT_DEFAULT && it->first <= PROJECT_ID_EXT_MEDIA_IMAGE)
+			    || (it->first >= PROJECT_ID_EXT_DATA_START && it->first <= PROJECT_ID_EXT_OBB_END))
+				media += it->second;
 		}
-		if (include_block) {
-			sscanf(line, "%s %lu %lu %lu", device, &blocks, &used, &available);
-		} else {
-			// The device block string is so long that the df information is on the next line
-			int space_count = 0;
-			sprintf(tmpString, "/dev/block/%s", Actual_Block_Device.c_str());
-			while (tmpString[space_count] == 32)
-				space_count++;
-			sscanf(line + space_count, "%lu %lu %lu", &blocks, &used, &available);
+	}
+	if (media == 0) {
+		// No media projects, try the owners instead
+		std::map<uint32_t, uint64_t> groups;
+		usage.clear();
+		total = 0;
+		if (!Get_Quota_Usage(Actual_Block_Device, USRQUOTA, &usage) || !Get_Quota_Usage(Actual_Block_Device, GRPQUOTA, &groups))
+			return false;
+		for (it = usage.begin(); it != usage.end(); it++)
+			total += it->second;
+		for (it = groups.begin(); it != groups.end(); it++) {
+			uint32_t app_id = it->first % 100000;
+			if (app_id == AID_MEDIA_RW || app_id == AID_EXT_DATA_RW || app_id == AID_EXT_OBB_RW)
+				media += it->second;
 		}
+	}
+	// Nothing under media at all is more likely quota that doesn't track
+	// it than an empty storage, the walk is cheap in that case anyway
+	if (media == 0 || media > total)
+		return false;
+	Backup_Size = total - media;
+	LOGINFO("Backup size of '%s' from quota is %lluMB, media %lluMB\n", Mount_Point.c_str(), (unsigned long long)(Backup_Size / 1048576LLU), (unsigned long long)(media / 1048576LLU));
+	return true;
+}
 
-		// Adjust block size to byte size
-		Size = blocks * 1024ULL;
-		Used = used * 1024ULL;
-		Free = available * 1024ULL;
-		Backup_Size = Used;
+bool TWPartition::Get_Size_Via_statvfs(bool Display_Error) {
+	struct statvfs st;
+	string Local_Path = Mount_Point + "/.";
+
+	if (!Mount(Display_Error))
+		return false;
+
+	// What df shows: some FUSE filesystems count their blocks in fragments
+	// and leave f_bsize at something else
+	if (statvfs(Local_Path.c_str(), &st) != 0) {
+		LOGINFO("Unable to statvfs '%s'\n", Local_Path.c_str());
+		return false;
 	}
-	fclose(fp);
+	unsigned long long frsize = st.f_frsize ? st.f_frsize : st.f_bsize;
+	Size = st.f_blocks * frsize;
+	Used = (st.f_blocks - st.f_bfree) * frsize;
+	Free = st.f_bavail * frsize;
+	// Without block counts at all, the size of the block device at least
+	if (Size == 0 && !Actual_Block_Device.empty())
+		Size = TWFunc::IOCTL_Get_Block_Size(Actual_Block_Device.c_str());
+	Backup_Size = Used;
 	return true;
 }
 
@@ -1356,21 +1416,7 @@ bool TWPartition::Is_Mounted(void) {
 	if (!Can_Be_Mounted)
 		return false;
 
-	struct stat st1, st2;
-	string test_path;
-
-	// Check to see if the mount point directory exists
-	test_path = Mount_Point + "/.";
-	if (stat(test_path.c_str(), &st1) != 0)  return false;
-
-	// Check to see if the directory above the mount point exists
-	test_path = Mount_Point + "/../.";
-	if (stat(test_path.c_str(), &st2) != 0)  return false;
-
-	// Compare the device IDs -- if they match then we're (probably) using tmpfs instead of an actual device
-	int ret = (st1.st_dev != st2.st_dev) ? true : false;
-
-	return ret;
+	return PartitionManager.Is_Path_Mounted(Mount_Point);
 }
 
 bool TWPartition::Is_File_System_Writable(void) {
@@ -1391,15 +1437,21 @@ bool TWPartition::Mount(bool Display_Error) {
 		return false;
 	}
 
+	if (!Sizing)
+		Invalidate_Size();
 	Find_Actual_Block_Device();
 
-	// Check the current file system before mounting
-	Check_FS_Type();
+	// Check the current file system before mounting, unless it was just probed
+	if (Probed_Block_Device.empty() || Probed_Block_Device != Actual_Block_Device)
+		Check_FS_Type();
+	Probed_Block_Device.clear();
 	if (Current_File_System == "exfat" && TWFunc::Path_Exists("/sbin/exfat-fuse")) {
-		string cmd = "/sbin/exfat-fuse -o big_writes,max_read=131072,max_write=131072 " + Actual_Block_Device + " " + Mount_Point;
-		LOGINFO("cmd: %s\n", cmd.c_str());
+		// max_read and max_write are left to the FUSE init negotiation, which picks the most the kernel takes
+		twrpFsTool tool("/sbin/exfat-fuse");
 		string result;
-		if (TWFunc::Exec_Cmd(cmd, result) != 0) {
+		tool.Arg("-o").Arg("big_writes").Arg("-t").Arg(TWFunc::to_string(TW_EXFAT_FUSE_THREADS)).Arg(Actual_Block_Device).Arg(Mount_Point);
+		tool.Set_Output([&](const string& line) { result += line + "\n"; });
+		if (tool.Run() != 0) {
 			LOGINFO("exfat-fuse failed to mount with result '%s', trying vfat\n", result.c_str());
 			Current_File_System = "vfat";
 		} else {
@@ -1414,7 +1466,6 @@ bool TWPartition::Mount(bool Display_Error) {
 	}
 
 	if (Current_File_System == "ntfs" && (TWFunc::Path_Exists("/sbin/ntfs-3g") || TWFunc::Path_Exists("/sbin/mount.ntfs"))) {
-		string cmd;
 		string Ntfsmount_Binary = "";
 
 		if (TWFunc::Path_Exists("/sbin/ntfs-3g"))
@@ -1422,13 +1473,9 @@ bool TWPartition::Mount(bool Display_Error) {
 		else if (TWFunc::Path_Exists("/sbin/mount.ntfs"))
 			Ntfsmount_Binary = "mount.ntfs";
 
-		if (Mount_Read_Only)
-			cmd = "/sbin/" + Ntfsmount_Binary + " -o ro " + Actual_Block_Device + " " + Mount_Point;
-		else
-			cmd = "/sbin/" + Ntfsmount_Binary + " " + Actual_Block_Device + " " + Mount_Point;
-		LOGINFO("cmd: '%s'\n", cmd.c_str());
-
-		if (TWFunc::Exec_Cmd(cmd) == 0) {
+		twrpFsTool tool("/sbin/" + Ntfsmount_Binary);
+		tool.Arg("-o").Arg(Mount_Read_Only ? "ro,big_writes" : "big_writes").Arg(Actual_Block_Device).Arg(Mount_Point);
+		if (tool.Run() == 0) {
 			return true;
 		} else {
 			LOGINFO("ntfs-3g failed to mount, trying regular mount method.\n");
@@ -1510,12 +1557,13 @@ bool TWPartition::Mount(bool Display_Error) {
 #endif
 	}
 
+	PartitionManager.Invalidate_Mount_Table();
 	if (Removable)
 		Update_Size(Display_Error);
 
 	if (!Symlink_Mount_Point.empty() && TWFunc::Path_Exists(Symlink_Path)) {
-		string Command = "mount -o bind '" + Symlink_Path + "' '" + Symlink_Mount_Point + "'";
-		TWFunc::Exec_Cmd(Command);
+		if (mount(Symlink_Path.c_str(), Symlink_Mount_Point.c_str(), "", MS_BIND, NULL) != 0)
+			LOGINFO("Unable to bind mount '%s' to '%s': %s\n", Symlink_Path.c_str(), Symlink_Mount_Point.c_str(), strerror(errno));
 	}
 	return true;
 }
@@ -1535,6 +1583,7 @@ bool TWPartition::UnMount(bool Display_Error) {
 			umount(Symlink_Mount_Point.c_str());
 
 		umount(Mount_Point.c_str());
+		PartitionManager.Invalidate_Mount_Table();
 		if (Is_Mounted()) {
 			if (Display_Error)
 				gui_msg(Msg(msg::kError, "fail_unmount=Failed to unmount '{1}' ({2})")(Mount_Point)(strerror(errno)));
@@ -1542,6 +1591,8 @@ bool TWPartition::UnMount(bool Display_Error) {
 				LOGINFO("Unable to unmount '%s'\n", Mount_Point.c_str());
 			return false;
 		} else {
+			if (!Sizing)
+				Invalidate_Size();
 			return true;
 		}
 	} else {
@@ -1578,19 +1629,26 @@ bool TWPartition::Wipe(string New_File_System) {
 	bool wiped = false, update_crypt = false, recreate_media = true;
 	int check;
 	string Layout_Filename = Mount_Point + "/.layout_version";
+	// Partitions may be wiped at once, each keeps its copy apart
+	string Layout_Copy = "/.layout_version_" + Backup_Name;
 
 	if (!Can_Be_Wiped) {
 		gui_msg(Msg(msg::kError, "cannot_wipe=Partition {1} cannot be wiped.")(Display_Name));
 		return false;
 	}
+	Invalidate_Size();
+	// An interrupted adb restore has to restore everything again, unless
+	// the wipe is part of the adb restore itself
+	if (access(TW_ADB_RESTORE, F_OK) != 0)
+		unlink(TW_ADB_RESTORE_SESSION);
 
 	if (Mount_Point == "/cache")
 		Log_Offset = 0;
 
 	if (Retain_Layout_Version && Mount(false) && TWFunc::Path_Exists(Layout_Filename))
-		TWFunc::copy_file(Layout_Filename, "/.layout_version", 0600);
+		TWFunc::copy_file(Layout_Filename, Layout_Copy, 0600);
 	else
-		unlink("/.layout_version");
+		unlink(Layout_Copy.c_str());
 
 	if (Has_Data_Media && Current_File_System == New_File_System) {
 		wiped = Wipe_Data_Without_Wiping_Media();
@@ -1616,7 +1674,7 @@ bool TWPartition::Wipe(string New_File_System) {
 			wiped = Wipe_NTFS();
 		else {
 			LOGERR("Unable to wipe '%s' -- unknown file system '%s'\n", Mount_Point.c_str(), New_File_System.c_str());
-			unlink("/.layout_version");
+			unlink(Layout_Copy.c_str());
 			return false;
 		}
 		update_crypt = wiped;
@@ -1626,8 +1684,8 @@ bool TWPartition::Wipe(string New_File_System) {
 		if (Mount_Point == "/cache")
 			DataManager::Output_Version();
 
-		if (TWFunc::Path_Exists("/.layout_version") && Mount(false))
-			TWFunc::copy_file("/.layout_version", Layout_Filename, 0600);
+		if (TWFunc::Path_Exists(Layout_Copy) && Mount(false))
+			TWFunc::copy_file(Layout_Copy, Layout_Filename, 0600);
 
 		if (update_crypt) {
 			Setup_File_System(false);
@@ -1672,6 +1730,32 @@ bool TWPartition::Wipe_AndSec(void) {
 	return true;
 }
 
+int TWPartition::Run_Fs_Tool(twrpFsTool& Tool, const twrpFsProgress& Progress) {
+	if (Progress) {
+		Tool.Set_Progress(Progress);
+		return Tool.Run();
+	}
+	if (Wipe_Progress) {
+		Tool.Set_Progress(Wipe_Progress);
+		return Tool.Run();
+	}
+
+	// Nobody else follows the tool, so its progress goes to the progress bar
+	unsigned long long size = Size ? Size : 1, shown = 0;
+	ProgressTracking progress(size);
+	Tool.Set_Progress([&](float done) {
+		unsigned long long now = size * done;
+		if (now > shown) {
+			progress.AddBackgroundSize(now - shown);
+			shown = now;
+		}
+		progress.UpdateDisplayDetails(false);
+	});
+	int ret = Tool.Run();
+	progress.UpdateDisplayDetails(true);
+	return ret;
+}
+
 bool TWPartition::Can_Repair() {
 	if (Mount_Read_Only)
 		return false;
@@ -1688,8 +1772,8 @@ bool TWPartition::Can_Repair() {
 	return false;
 }
 
-bool TWPartition::Repair() {
-	string command;
+bool TWPartition::Repair(const twrpFsProgress& Progress) {
+	Invalidate_Size();
 
 	if (Current_File_System == "vfat") {
 		if (!TWFunc::Path_Exists("/sbin/fsck.fat")) {
@@ -1700,9 +1784,10 @@ bool TWPartition::Repair() {
 			return false;
 		gui_msg(Msg("repairing_using=Repairing {1} using {2}...")(Display_Name)("fsck.fat"));
 		Find_Actual_Block_Device();
-		command = "/sbin/fsck.fat -y " + Actual_Block_Device;
-		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		twrpFsTool tool("/sbin/fsck.fat");
+		tool.Arg("-y").Arg(Actual_Block_Device);
+		LOGINFO("Repair command: %s\n", tool.Command().c_str());
+		if (Run_Fs_Tool(tool, Progress) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1719,9 +1804,10 @@ bool TWPartition::Repair() {
 			return false;
 		gui_msg(Msg("repairing_using=Repairing {1} using {2}...")(Display_Name)("e2fsck"));
 		Find_Actual_Block_Device();
-		command = "/sbin/e2fsck -fp " + Actual_Block_Device;
-		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		twrpFsTool tool("/sbin/e2fsck");
+		tool.Arg("-fp").Arg(Actual_Block_Device);
+		LOGINFO("Repair command: %s\n", tool.Command().c_str());
+		if (Run_Fs_Tool(tool, Progress) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1738,9 +1824,10 @@ bool TWPartition::Repair() {
 			return false;
 		gui_msg(Msg("repairing_using=Repairing {1} using {2}...")(Display_Name)("fsck.exfat"));
 		Find_Actual_Block_Device();
-		command = "/sbin/fsck.exfat " + Actual_Block_Device;
-		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		twrpFsTool tool("/sbin/fsck.exfat");
+		tool.Arg(Actual_Block_Device);
+		LOGINFO("Repair command: %s\n", tool.Command().c_str());
+		if (Run_Fs_Tool(tool, Progress) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1757,9 +1844,10 @@ bool TWPartition::Repair() {
 			return false;
 		gui_msg(Msg("repairing_using=Repairing {1} using {2}...")(Display_Name)("fsck.f2fs"));
 		Find_Actual_Block_Device();
-		command = "/sbin/fsck.f2fs " + Actual_Block_Device;
-		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		twrpFsTool tool("/sbin/fsck.f2fs");
+		tool.Arg(Actual_Block_Device);
+		LOGINFO("Repair command: %s\n", tool.Command().c_str());
+		if (Run_Fs_Tool(tool, Progress) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1781,9 +1869,10 @@ bool TWPartition::Repair() {
 			return false;
 		gui_msg(Msg("repairing_using=Repairing {1} using {2}...")(Display_Name)(Ntfsfix_Binary));
 		Find_Actual_Block_Device();
-		command = "/sbin/" + Ntfsfix_Binary + " " + Actual_Block_Device;
-		LOGINFO("Repair command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		twrpFsTool tool("/sbin/" + Ntfsfix_Binary);
+		tool.Arg(Actual_Block_Device);
+		LOGINFO("Repair command: %s\n", tool.Command().c_str());
+		if (Run_Fs_Tool(tool, Progress) == 0) {
 			gui_msg("done=Done.");
 			return true;
 		} else {
@@ -1803,7 +1892,7 @@ bool TWPartition::Can_Resize() {
 }
 
 bool TWPartition::Resize() {
-	string command;
+	Invalidate_Size();
 
 	if (Current_File_System == "ext2" || Current_File_System == "ext3" || Current_File_System == "ext4") {
 		if (!Can_Repair()) {
@@ -1822,7 +1911,8 @@ bool TWPartition::Resize() {
 			return false;
 		gui_msg(Msg("resizing=Resizing {1} using {2}...")(Display_Name)("resize2fs"));
 		Find_Actual_Block_Device();
-		command = "/sbin/resize2fs " + Actual_Block_Device;
+		twrpFsTool tool("/sbin/resize2fs");
+		tool.Arg(Actual_Block_Device);
 		if (Length != 0) {
 			unsigned long long Actual_Size = IOCTL_Get_Block_Size();
 			if (Actual_Size == 0)
@@ -1836,14 +1926,10 @@ bool TWPartition::Resize() {
 				// This is the size, not a size reduction
 				Block_Count = ((unsigned long long)(Length) / 1024LLU);
 			}
-			char temp[256];
-			sprintf(temp, "%llu", Block_Count);
-			command += " ";
-			command += temp;
-			command += "K";
-		}
-		LOGINFO("Resize command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+			tool.Arg(std::to_string(Block_Count) + "K");
+		}
+		LOGINFO("Resize command: %s\n", tool.Command().c_str());
+		if (Run_Fs_Tool(tool) == 0) {
 			Update_Size(true);
 			gui_msg("done=Done.");
 			return true;
@@ -1873,6 +1959,7 @@ bool TWPartition::Restore(PartitionSettings *part_settings) {
 
 	string Restore_File_System = Get_Restore_File_System(part_settings);
 
+	Invalidate_Size();
 	if (Is_File_System(Restore_File_System))
 		return Restore_Tar(part_settings);
 	else if (Is_Image(Restore_File_System))
@@ -1882,6 +1969,45 @@ bool TWPartition::Restore(PartitionSettings *part_settings) {
 	return false;
 }
 
+bool TWPartition::Verify_Backup(PartitionSettings *part_settings) {
+	string Restore_File_System = Get_Restore_File_System(part_settings);
+
+	// Images have nothing to parse, the digest check covers them
+	if (!Is_File_System(Restore_File_System))
+		return true;
+	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Backup_Display_Name, gui_parse_text("{@verifying_hdr}"));
+	gui_msg(Msg("verifying=Verifying {1}...")(Backup_Display_Name));
+
+	// Only the archives of this folder, the backups an incremental one is
+	// based on are verified on their own
+	twrpTar tar;
+	tar.part_settings = part_settings;
+	tar.setdir(Backup_Path);
+	tar.setfn(part_settings->Backup_Folder + "/" + Backup_FileName);
+	tar.backup_name = Backup_Name;
+	tar.verify_only = true;
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	string Password;
+	DataManager::GetValue("tw_restore_password", Password);
+	if (!Password.empty())
+		tar.setpassword(Password);
+#endif
+	InfoManager backup_info(part_settings->Backup_Folder + "/" + Backup_Name + ".info");
+	unsigned long long Backup_Size = 0, Backup_Files = 0;
+	if (backup_info.LoadValues() == 0) {
+		backup_info.GetValue("backup_size", Backup_Size);
+		backup_info.GetValue("file_count", Backup_Files);
+	}
+	if (Backup_Size == 0)
+		Backup_Size = Get_Restore_Size(part_settings);
+	if (Backup_Files != 0) {
+		part_settings->progress->SetSizeCount(Backup_Size, Backup_Files);
+		tar.restore_file_count = Backup_Files;
+	} else
+		part_settings->progress->SetPartitionSize(Backup_Size);
+	return tar.extractTarFork() == 0;
+}
+
 string TWPartition::Get_Restore_File_System(PartitionSettings *part_settings) {
 	size_t first_period, second_period;
 	string Restore_File_System;
@@ -1987,8 +2113,13 @@ bool TWPartition::Wipe_Encryption() {
 		}
 	} else {
 		if (TWFunc::IOCTL_Get_Block_Size(Crypto_Key_Location.c_str()) >= 16384LLU) {
-			string Command = "dd of='" + Crypto_Key_Location + "' if=/dev/zero bs=16384 count=1";
-			TWFunc::Exec_Cmd(Command);
+			char zeros[16384];
+			int fd = open(Crypto_Key_Location.c_str(), O_WRONLY);
+			memset(zeros, 0, sizeof(zeros));
+			if (fd < 0 || write(fd, zeros, sizeof(zeros)) != (ssize_t) sizeof(zeros) || fsync(fd) != 0)
+				LOGINFO("Unable to wipe crypto footer '%s': %s\n", Crypto_Key_Location.c_str(), strerror(errno));
+			if (fd >= 0)
+				close(fd);
 		} else {
 			LOGINFO("Crypto key location reports size < 16K so not wiping crypto footer.\n");
 		}
@@ -2022,6 +2153,10 @@ exit:
 	return ret;
 }
 
+// The file systems Check_FS_Type() looks for, those in Is_File_System()
+// that blkid can tell apart
+static const char* probe_fs_types[] = { "ext2", "ext3", "ext4", "vfat", "ntfs", "exfat", "f2fs", "squashfs", NULL };
+
 void TWPartition::Check_FS_Type() {
 	const char* type;
 	blkid_probe pr;
@@ -2034,6 +2169,14 @@ void TWPartition::Check_FS_Type() {
 		return;
 
 	pr = blkid_new_probe_from_filename(Actual_Block_Device.c_str());
+	if (!pr) {
+		LOGINFO("Can't probe device %s\n", Actual_Block_Device.c_str());
+		return;
+	}
+	// Only run the probers for file systems TWRP can mount or format, so
+	// that each device is probed with a read or two from its start instead
+	// of a seek to every RAID and exotic superblock location.
+	blkid_probe_filter_superblocks_type(pr, BLKID_FLTR_ONLYIN, const_cast<char**>(probe_fs_types));
 	if (blkid_do_fullprobe(pr)) {
 		blkid_free_probe(pr);
 		LOGINFO("Can't probe device %s\n", Actual_Block_Device.c_str());
@@ -2067,18 +2210,71 @@ void TWPartition::Check_FS_Type() {
 	}
 }
 
+bool TWPartition::Discard_Block_Device() {
+	int discard = 1, secure = 0, fd, ret = -1;
+	uint64_t size = 0, range[2];
+	timespec start, end;
+
+	DataManager::GetValue(TW_WIPE_DISCARD_VAR, discard);
+	if (!discard)
+		return false;
+	DataManager::GetValue(TW_WIPE_SECURE_DISCARD_VAR, secure);
+
+	fd = open(Actual_Block_Device.c_str(), O_RDWR);
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s' to discard it: %s\n", Actual_Block_Device.c_str(), strerror(errno));
+		return false;
+	}
+	if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+		LOGINFO("Unable to get the size of '%s' to discard it: %s\n", Actual_Block_Device.c_str(), strerror(errno));
+		close(fd);
+		return false;
+	}
+	// The space reserved after the file system, like a crypto footer, is kept
+	if (Length < 0 && (uint64_t) -Length < size)
+		size += Length;
+	else if (Length > 0 && (uint64_t) Length < size)
+		size = Length;
+	else if (Length == 0 && Crypto_Key_Location == "footer" && size > CRYPT_FOOTER_OFFSET)
+		size -= CRYPT_FOOTER_OFFSET;
+	range[0] = 0;
+	range[1] = size & ~4095ULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (secure) {
+		ret = ioctl(fd, BLKSECDISCARD, &range);
+		if (ret != 0)
+			LOGINFO("Secure discard of '%s' failed (%s), using a discard\n", Actual_Block_Device.c_str(), strerror(errno));
+	}
+	if (ret != 0)
+		ret = ioctl(fd, BLKDISCARD, &range);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(fd);
+	if (ret != 0) {
+		LOGINFO("Unable to discard '%s': %s\n", Actual_Block_Device.c_str(), strerror(errno));
+		return false;
+	}
+	LOGINFO("Discarded %llu MB of '%s' in %i ms\n", (unsigned long long) range[1] / 1048576, Actual_Block_Device.c_str(), TWFunc::timespec_diff_ms(start, end));
+	return true;
+}
+
 bool TWPartition::Wipe_EXT23(string File_System) {
 	if (!UnMount(true))
 		return false;
 
 	if (TWFunc::Path_Exists("/sbin/mke2fs")) {
-		string command;
+		twrpFsTool tool("mke2fs");
 
 		gui_msg(Msg("formatting_using=Formatting {1} using {2}...")(Display_Name)("mke2fs"));
 		Find_Actual_Block_Device();
-		command = "mke2fs -t " + File_System + " -m 0 " + Actual_Block_Device;
-		LOGINFO("mke2fs command: %s\n", command.c_str());
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		tool.Arg("-t").Arg(File_System).Arg("-m").Arg("0");
+		// After a discard the inode tables and journal read back as zeroes,
+		// so the kernel initializes them in the background
+		if (Discard_Block_Device())
+			tool.Arg("-E").Arg("lazy_itable_init=1,lazy_journal_init=1,nodiscard");
+		tool.Arg(Actual_Block_Device);
+		LOGINFO("mke2fs command: %s\n", tool.Command().c_str());
+		if (Run_Fs_Tool(tool) == 0) {
 			Current_File_System = File_System;
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
@@ -2108,6 +2304,7 @@ bool TWPartition::Wipe_EXT4() {
 	char *secontext = NULL;
 
 	gui_msg(Msg("formatting_using=Formatting {1} using {2}...")(Display_Name)("make_ext4fs"));
+	Discard_Block_Device();
 
 	if (!selinux_handle || selabel_lookup(selinux_handle, &secontext, Mount_Point.c_str(), S_IFDIR) < 0) {
 		LOGINFO("Cannot lookup security context for '%s'\n", Mount_Point.c_str());
@@ -2127,24 +2324,21 @@ bool TWPartition::Wipe_EXT4() {
 	}
 #else
 	if (TWFunc::Path_Exists("/sbin/make_ext4fs")) {
-		string Command;
+		twrpFsTool tool("make_ext4fs");
 
 		gui_msg(Msg("formatting_using=Formatting {1} using {2}...")(Display_Name)("make_ext4fs"));
 		Find_Actual_Block_Device();
-		Command = "make_ext4fs";
+		Discard_Block_Device();
 		if (!Is_Decrypted && Length != 0) {
 			// Only use length if we're not decrypted
-			char len[32];
-			sprintf(len, "%i", Length);
-			Command += " -l ";
-			Command += len;
+			tool.Arg("-l").Arg(std::to_string(Length));
 		}
 		if (TWFunc::Path_Exists("/file_contexts")) {
-			Command += " -S /file_contexts";
+			tool.Arg("-S").Arg("/file_contexts");
 		}
-		Command += " -a " + Mount_Point + " " + Actual_Block_Device;
-		LOGINFO("make_ext4fs command: %s\n", Command.c_str());
-		if (TWFunc::Exec_Cmd(Command) == 0) {
+		tool.Arg("-a").Arg(Mount_Point).Arg(Actual_Block_Device);
+		LOGINFO("make_ext4fs command: %s\n", tool.Command().c_str());
+		if (Run_Fs_Tool(tool) == 0) {
 			Current_File_System = "ext4";
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
@@ -2160,16 +2354,16 @@ bool TWPartition::Wipe_EXT4() {
 }
 
 bool TWPartition::Wipe_FAT() {
-	string command;
-
 	if (TWFunc::Path_Exists("/sbin/mkfs.fat")) {
 		if (!UnMount(true))
 			return false;
 
 		gui_msg(Msg("formatting_using=Formatting {1} using {2}...")(Display_Name)("mkfs.fat"));
 		Find_Actual_Block_Device();
-		command = "mkfs.fat " + Actual_Block_Device;
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		twrpFsTool tool("mkfs.fat");
+		tool.Arg("--fast");
+		tool.Arg(Actual_Block_Device);
+		if (Run_Fs_Tool(tool) == 0) {
 			Current_File_System = "vfat";
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
@@ -2187,16 +2381,16 @@ bool TWPartition::Wipe_FAT() {
 }
 
 bool TWPartition::Wipe_EXFAT() {
-	string command;
-
 	if (TWFunc::Path_Exists("/sbin/mkexfatfs")) {
 		if (!UnMount(true))
 			return false;
 
 		gui_msg(Msg("formatting_using=Formatting {1} using {2}...")(Display_Name)("mkexfatfs"));
 		Find_Actual_Block_Device();
-		command = "mkexfatfs " + Actual_Block_Device;
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		twrpFsTool tool("mkexfatfs");
+		tool.Arg("-f");
+		tool.Arg(Actual_Block_Device);
+		if (Run_Fs_Tool(tool) == 0) {
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
 			return true;
@@ -2242,7 +2436,17 @@ bool TWPartition::Wipe_MTD() {
 	return true;
 }
 
+static void Wipe_Progress(uint64_t removed) {
+	string removed_prog = gui_lookup("removed_progress", "%llu items removed");
+	char removed_progress[1024];
+
+	sprintf(removed_progress, removed_prog.c_str(), (unsigned long long) removed);
+	DataManager::SetValue("tw_file_progress", removed_progress);
+}
+
 bool TWPartition::Wipe_RMRF() {
+	twrpDelete del;
+
 	if (!Mount(true))
 		return false;
 	// This is the only wipe that leaves the partition mounted, so we
@@ -2252,38 +2456,48 @@ bool TWPartition::Wipe_RMRF() {
 		PartitionManager.Remove_MTP_Storage(MTP_Storage_ID);
 
 	gui_msg(Msg("remove_all=Removing all files under '{1}'")(Mount_Point));
-	TWFunc::removeDir(Mount_Point, true);
+	del.Set_Progress(Wipe_Progress);
+	del.Remove(Mount_Point, true);
+	DataManager::SetValue("tw_file_progress", "");
 	Recreate_AndSec_Folder();
 	return true;
 }
 
 bool TWPartition::Wipe_F2FS() {
-	string command;
-
 	if (TWFunc::Path_Exists("/sbin/mkfs.f2fs")) {
 		if (!UnMount(true))
 			return false;
 
 		gui_msg(Msg("formatting_using=Formatting {1} using {2}...")(Display_Name)("mkfs.f2fs"));
 		Find_Actual_Block_Device();
-		if (!TWFunc::Path_Exists("/sbin/sload.f2fs")) {
-			command = "mkfs.f2fs -t 0";
+		bool discarded = Discard_Block_Device();
+		twrpFsTool tool("mkfs.f2fs");
+		bool sload = TWFunc::Path_Exists("/sbin/sload.f2fs");
+		if (!sload) {
+			tool.Arg("-t").Arg("0");
 			if (!Is_Decrypted && Length != 0) {
 				// Only use length if we're not decrypted
-				char len[32];
 				int mod_length = Length;
 				if (Length < 0)
 					mod_length *= -1;
-				sprintf(len, "%i", mod_length);
-				command += " -r ";
-				command += len;
+				tool.Arg("-r").Arg(std::to_string(mod_length));
 			}
-			command += " " + Actual_Block_Device;
+			tool.Arg(Actual_Block_Device);
 		} else {
 			unsigned long long size = IOCTL_Get_Block_Size() + Length;
-			command = "mkfs.f2fs -d1 -f -O encrypt -O quota -O verity -w 4096 " + Actual_Block_Device + " " + std::to_string(size / 4096) + " && sload.f2fs -t /data " + Actual_Block_Device;
+			tool.Arg("-d1").Arg("-f").Arg("-O").Arg("encrypt").Arg("-O").Arg("quota").Arg("-O").Arg("verity").Arg("-w").Arg("4096");
+			if (discarded)
+				tool.Arg("-t").Arg("0");
+			tool.Arg(Actual_Block_Device).Arg(std::to_string(size / 4096));
+		}
+		LOGINFO("mkfs.f2fs command: %s\n", tool.Command().c_str());
+		int ret = Run_Fs_Tool(tool);
+		if (ret == 0 && sload) {
+			twrpFsTool load("sload.f2fs");
+			load.Arg("-t").Arg("/data").Arg(Actual_Block_Device);
+			ret = Run_Fs_Tool(load);
 		}
-		if (TWFunc::Exec_Cmd(command) == 0) {
+		if (ret == 0) {
 			Recreate_AndSec_Folder();
 			gui_msg("done=Done.");
 			return true;
@@ -2300,7 +2514,6 @@ bool TWPartition::Wipe_F2FS() {
 }
 
 bool TWPartition::Wipe_NTFS() {
-	string command;
 	string Ntfsmake_Binary;
 
 	if (TWFunc::Path_Exists("/sbin/mkntfs"))
@@ -2315,8 +2528,9 @@ bool TWPartition::Wipe_NTFS() {
 
 	gui_msg(Msg("formatting_using=Formatting {1} using {2}...")(Display_Name)(Ntfsmake_Binary));
 	Find_Actual_Block_Device();
-	command = "/sbin/" + Ntfsmake_Binary + " " + Actual_Block_Device;
-	if (TWFunc::Exec_Cmd(command) == 0) {
+	twrpFsTool tool("/sbin/" + Ntfsmake_Binary);
+	tool.Arg(Actual_Block_Device);
+	if (Run_Fs_Tool(tool) == 0) {
 		Recreate_AndSec_Folder();
 		gui_msg("done=Done.");
 		return true;
@@ -2346,39 +2560,18 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media() {
 }
 
 bool TWPartition::Wipe_Data_Without_Wiping_Media_Func(const string& parent __unused) {
-	string dir;
-
-	DIR* d;
-	d = opendir(parent.c_str());
-	if (d != NULL) {
-		struct dirent* de;
-		while ((de = readdir(d)) != NULL) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)	 continue;
-
-			dir = parent;
-			dir.append(de->d_name);
-			if (wipe_exclusions.check_skip_dirs(dir)) {
-				LOGINFO("skipped '%s'\n", dir.c_str());
-				continue;
-			}
-			if (de->d_type == DT_DIR) {
-				dir.append("/");
-				if (!Wipe_Data_Without_Wiping_Media_Func(dir)) {
-					closedir(d);
-					return false;
-				}
-				rmdir(dir.c_str());
-			} else if (de->d_type == DT_REG || de->d_type == DT_LNK || de->d_type == DT_FIFO || de->d_type == DT_SOCK) {
-				if (unlink(dir.c_str()) != 0)
-					LOGINFO("Unable to unlink '%s': %s\n", dir.c_str(), strerror(errno));
-			}
-		}
-		closedir(d);
+	twrpDelete del;
 
-		return true;
+	if (!TWFunc::Path_Exists(parent)) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Mount_Point)(strerror(errno)));
+		return false;
 	}
-	gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Mount_Point)(strerror(errno)));
-	return false;
+	del.Set_Skip([this](const string& path) { return wipe_exclusions.check_skip_dirs(path); });
+	del.Set_Progress(Wipe_Progress);
+	// Items that can't be removed are logged and left behind, as before
+	del.Remove(parent, true);
+	DataManager::SetValue("tw_file_progress", "");
+	return true;
 }
 
 bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_pid) {
@@ -2392,6 +2585,39 @@ bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_p
 	gui_msg(Msg("backing_up=Backing up {1}...")(Backup_Display_Name));
 
 	DataManager::GetValue(TW_USE_COMPRESSION_VAR, tar.use_compression);
+	if (tar.use_compression && part_settings->adbbackup) {
+		// The adb backup command picked the codec of the stream
+		int adb_compression;
+		DataManager::GetValue(TW_ADB_COMPRESSION_VAR, adb_compression);
+		tar.compression_type = (Archive_Type) adb_compression;
+		if (tar.compression_type == COMPRESSED_ZSTD)
+			DataManager::GetValue(TW_ZSTD_LEVEL_VAR, tar.compression_level);
+	} else if (tar.use_compression) {
+		string Compression_Type;
+		DataManager::GetValue(TW_COMPRESSION_TYPE_VAR, Compression_Type);
+		if (Compression_Type == "zstd") {
+			tar.compression_type = COMPRESSED_ZSTD;
+			DataManager::GetValue(TW_ZSTD_LEVEL_VAR, tar.compression_level);
+			if (part_settings->zstd_level > 0)
+				tar.compression_level = part_settings->zstd_level;
+		} else if (Compression_Type == "lz4") {
+			tar.compression_type = COMPRESSED_LZ4;
+		}
+	}
+	DataManager::GetValue(TW_BACKUP_THREADS_VAR, tar.backup_threads);
+	if (tar.backup_threads == 0)
+		tar.backup_threads = part_settings->backup_threads;
+	DataManager::GetValue(TW_BACKUP_READ_ORDER_VAR, tar.read_order);
+	tar.use_dedup = part_settings->dedup;
+	tar.io_lanes = twrpIoScheduler::Get()->Lanes(Actual_Block_Device);
+	if (!part_settings->adbbackup) {
+		TWPartition* storage = PartitionManager.Find_Partition_By_Path(part_settings->Backup_Folder);
+		if (storage != NULL) {
+			unsigned storage_lanes = twrpIoScheduler::Get()->Lanes(storage->Actual_Block_Device);
+			if (storage_lanes < tar.io_lanes)
+				tar.io_lanes = storage_lanes;
+		}
+	}
 
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	if (Can_Encrypt_Backup) {
@@ -2402,6 +2628,8 @@ bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_p
 			string Password;
 			DataManager::GetValue("tw_backup_password", Password);
 			tar.setpassword(Password);
+			// openaes archives for older TWRP builds, AES-GCM ones otherwise
+			tar.legacy_encryption = DataManager::GetIntValue(TW_ENCRYPT_LEGACY_VAR) != 0;
 		} else {
 			tar.use_encryption = 0;
 		}
@@ -2414,13 +2642,111 @@ bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_p
 		gui_msg(Msg(msg::kWarning, "backup_storage_warning=Backups of {1} do not include any files in internal storage such as pictures or downloads.")(Display_Name));
 	tar.part_settings = part_settings;
 	tar.backup_exclusions = &backup_exclusions;
+	tar.backup_scan = &backup_scan;
 	tar.setdir(Backup_Path);
 	tar.setfn(Full_FileName);
 	tar.setsize(Backup_Size);
 	tar.partition_name = Backup_Name;
 	tar.backup_folder = part_settings->Backup_Folder;
+	if (part_settings->incremental && !part_settings->adbbackup) {
+		tar.write_manifest = true;
+		tar.incremental_base = Find_Incremental_Base(part_settings->Backup_Folder);
+		if (tar.incremental_base.empty())
+			gui_msg(Msg("incremental_full=No earlier backup of {1} to compare against, making a full backup")(Backup_Display_Name));
+		else
+			gui_msg(Msg("incremental_base=Backing up changes since '{1}'")(TWFunc::Get_Filename(tar.incremental_base)));
+	}
+	tar.write_digest = part_settings->generate_digest && !part_settings->adbbackup;
+	// Deduplicated archives are rebuilt from the chunk store, offsets into them are no use
+	tar.write_index = part_settings->write_index && !part_settings->dedup;
 	if (tar.createTarFork(tar_fork_pid) != 0)
 		return false;
+	part_settings->digest_written = tar.write_digest;
+	return true;
+}
+
+string TWPartition::Find_Incremental_Base(const string& Backup_Folder) {
+	string Parent = TWFunc::Get_Path(Backup_Folder), Current = TWFunc::Get_Filename(Backup_Folder);
+	std::vector<std::pair<time_t, string> > Candidates;
+	std::vector<string> Chain, Chain_Files;
+	struct dirent* de;
+	struct stat st;
+	size_t i;
+
+	DIR* d = opendir(Parent.c_str());
+	if (d == NULL)
+		return "";
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") || Current == de->d_name)
+			continue;
+		string Manifest = Parent + de->d_name + "/" + Backup_Name + ".manifest";
+		if (stat(Manifest.c_str(), &st) == 0)
+			Candidates.push_back(std::make_pair(st.st_mtime, Parent + de->d_name));
+	}
+	closedir(d);
+
+	// The newest backup whose own chain is still complete
+	std::sort(Candidates.rbegin(), Candidates.rend());
+	for (i = 0; i < Candidates.size(); i++) {
+		if (Get_Incremental_Chain(Candidates[i].second, &Chain, &Chain_Files, false))
+			return Candidates[i].second;
+		LOGINFO("Not using '%s' as incremental base, its chain is incomplete\n", Candidates[i].second.c_str());
+	}
+	return "";
+}
+
+bool TWPartition::Get_Incremental_Chain(const string& Backup_Folder, std::vector<string> *Chain, std::vector<string> *Files, bool Display_Error) {
+	Chain->clear();
+	Files->clear();
+	Chain->push_back(Backup_Folder);
+	Files->push_back(Backup_FileName);
+	while (true) {
+		InfoManager info(Chain->back() + "/" + Backup_Name + ".info");
+		string Base, File;
+
+		if (info.LoadValues() != 0 || info.GetValue("incremental_base", Base) != 0 || Base.empty())
+			break;
+		Base = TWFunc::Get_Path(Chain->back()) + Base;
+		InfoManager base_info(Base + "/" + Backup_Name + ".info");
+		if (std::find(Chain->begin(), Chain->end(), Base) != Chain->end() || base_info.LoadValues() != 0 || base_info.GetValue("backup_file", File) != 0) {
+			if (Display_Error)
+				gui_msg(Msg(msg::kError, "incremental_missing=Backup '{1}' needed to restore {2} is missing or damaged")(TWFunc::Get_Filename(Base))(Backup_Display_Name));
+			return false;
+		}
+		Chain->push_back(Base);
+		Files->push_back(File);
+	}
+	std::reverse(Chain->begin(), Chain->end());
+	std::reverse(Files->begin(), Files->end());
+	return true;
+}
+
+bool TWPartition::Apply_Deleted_List(const string& Filename) {
+	std::vector<string> Deleted;
+	struct stat st;
+	size_t i;
+
+	if (!twrpManifest::Load_List(Filename, &Deleted)) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Filename)(strerror(errno)));
+		return false;
+	}
+	LOGINFO("Removing %zu items listed in '%s'\n", Deleted.size(), Filename.c_str());
+	for (i = 0; i < Deleted.size(); i++) {
+		const string& Path = Deleted[i];
+		if (Path.size() <= Backup_Path.size() || Path.compare(0, Backup_Path.size(), Backup_Path) != 0 || Path[Backup_Path.size()] != '/') {
+			LOGINFO("Skipping '%s', it is not in '%s'\n", Path.c_str(), Backup_Path.c_str());
+			continue;
+		}
+		// Items below a deleted folder are listed too and may already be gone
+		if (lstat(Path.c_str(), &st) != 0)
+			continue;
+		if (S_ISDIR(st.st_mode)) {
+			if (TWFunc::removeDir(Path, false) != 0)
+				LOGINFO("Unable to remove '%s'\n", Path.c_str());
+		} else if (unlink(Path.c_str()) != 0) {
+			LOGINFO("Unable to unlink '%s': %s\n", Path.c_str(), strerror(errno));
+		}
+	}
 	return true;
 }
 
@@ -2442,11 +2768,20 @@ bool TWPartition::Backup_Image(PartitionSettings *part_settings) {
 	part_settings->total_restore_size = Backup_Size;
 
 	if (part_settings->adbbackup) {
-		if (!twadbbu::Write_TWIMG(adb_file_name, Backup_Size))
+		// Images are compressed with the codec of the adb stream
+		int use_compression, adb_compression = UNCOMPRESSED;
+		DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
+		if (use_compression)
+			DataManager::GetValue(TW_ADB_COMPRESSION_VAR, adb_compression);
+		part_settings->adb_compression = adb_compression;
+		if (!twadbbu::Write_TWIMG(adb_file_name, Backup_Size, adb_compression))
 			return false;
 	}
 
-	if (!Raw_Read_Write(part_settings))
+	if (part_settings->sparse && !part_settings->adbbackup && !part_settings->dedup) {
+		if (!Backup_Sparse_Image(part_settings))
+			return false;
+	} else if (!Raw_Read_Write(part_settings))
 		return false;
 
 	if (part_settings->adbbackup) {
@@ -2456,14 +2791,143 @@ bool TWPartition::Backup_Image(PartitionSettings *part_settings) {
 	return true;
 }
 
+bool TWPartition::Backup_Sparse_Image(PartitionSettings *part_settings) {
+	const unsigned long long RW_Block_Size = 1048576LLU; // 1MB
+	unsigned long long Pos = 0, Len, block, first, count, i, run;
+	int src_fd = -1, dest_fd = -1;
+	bool ret = false, any_used;
+	void* buffer = NULL;
+	string destfn = part_settings->Backup_Folder + "/" + Backup_FileName;
+	twrpBlockMap block_map;
+	uint32_t block_size;
+
+	src_fd = open(Actual_Block_Device.c_str(), O_RDONLY | O_LARGEFILE);
+	if (src_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Actual_Block_Device)(strerror(errno)));
+		return false;
+	}
+	// Without a file system that can be read only unchanging runs get smaller
+	if (!block_map.Load(src_fd, Backup_Size))
+		LOGINFO("No block bitmap for '%s', only storing repeated blocks as fills\n", Actual_Block_Device.c_str());
+	block_size = block_map.Block_Size();
+	if (Backup_Size % block_size != 0 || RW_Block_Size % block_size != 0) {
+		LOGINFO("Size of '%s' is not a multiple of %u, making a full image\n", Actual_Block_Device.c_str(), block_size);
+		close(src_fd);
+		return Raw_Read_Write(part_settings);
+	}
+
+	dest_fd = open(destfn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR);
+	if (dest_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(destfn)(strerror(errno)));
+		close(src_fd);
+		return false;
+	}
+	LOGINFO("Reading '%s', writing sparse image '%s'\n", Actual_Block_Device.c_str(), destfn.c_str());
+
+	buffer = malloc((size_t)RW_Block_Size);
+	if (!buffer) {
+		LOGINFO("Backup_Sparse_Image failed to malloc\n");
+		goto exit;
+	}
+
+	{
+		twrpSparseWriter sparse(dest_fd, block_size);
+		if (!sparse.Start(Backup_Size))
+			goto exit;
+		if (part_settings->progress)
+			part_settings->progress->SetPartitionSize(part_settings->total_restore_size);
+
+		while (Pos < Backup_Size) {
+			Len = Backup_Size - Pos;
+			if (Len > RW_Block_Size)
+				Len = RW_Block_Size;
+			first = Pos / block_size;
+			count = Len / block_size;
+
+			// Free space is never read
+			any_used = false;
+			for (block = first; block < first + count && !any_used; block++)
+				any_used = block_map.Used(block);
+			if (!any_used) {
+				if (!sparse.Skip(Len))
+					goto exit;
+			} else {
+				if (pread(src_fd, buffer, Len, Pos) != (ssize_t)Len) {
+					LOGINFO("Error reading source fd (%s)\n", strerror(errno));
+					goto exit;
+				}
+				for (i = 0; i < count; i += run) {
+					bool used = block_map.Used(first + i);
+					for (run = 1; i + run < count && block_map.Used(first + i + run) == used; run++)
+						;
+					unsigned char* data = (unsigned char*)buffer + i * block_size;
+					if (!(used ? sparse.Write(data, run * block_size) : sparse.Skip(run * block_size)))
+						goto exit;
+				}
+			}
+			Pos += Len;
+			if (part_settings->progress)
+				part_settings->progress->UpdateSize(Pos);
+			if (PartitionManager.Check_Backup_Cancel() != 0)
+				goto exit;
+		}
+		if (!sparse.Finish())
+			goto exit;
+		LOGINFO("Stored %llu of %llu bytes of '%s'\n", (unsigned long long)sparse.Stored_Size(), Backup_Size, Actual_Block_Device.c_str());
+	}
+	if (part_settings->progress)
+		part_settings->progress->UpdateDisplayDetails(true);
+	fsync(dest_fd);
+	tw_set_default_metadata(destfn.c_str());
+	{
+		// The restore flashes it as a sparse image only when this says so
+		InfoManager backup_info(part_settings->Backup_Folder + "/" + Backup_Name + ".info");
+		backup_info.SetValue("backup_size", Backup_Size);
+		backup_info.SetValue("backup_type", SPARSE);
+		backup_info.SaveValues();
+	}
+	ret = true;
+exit:
+	close(src_fd);
+	close(dest_fd);
+	free(buffer);
+	return ret;
+}
+
+Archive_Type TWPartition::Get_Image_Type(PartitionSettings *part_settings) {
+	// Taken from the .info file, a raw image can start with any magic
+	InfoManager image_info(part_settings->Backup_Folder + "/" + Backup_Name + ".info");
+	int type = UNCOMPRESSED;
+
+	if (image_info.LoadValues() != 0 || image_info.GetValue("backup_type", type) != 0)
+		return UNCOMPRESSED;
+	if (type == COMPRESSED || type == COMPRESSED_ZSTD || type == COMPRESSED_LZ4 || type == CHUNKED || type == SPARSE)
+		return (Archive_Type) type;
+	return UNCOMPRESSED;
+}
+
+Archive_Type TWPartition::Get_Image_Compression(PartitionSettings *part_settings) {
+	Archive_Type type = Get_Image_Type(part_settings);
+
+	if (type == COMPRESSED || type == COMPRESSED_ZSTD || type == COMPRESSED_LZ4)
+		return type;
+	return UNCOMPRESSED;
+}
+
 bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 	unsigned long long RW_Block_Size, Remain = Backup_Size;
-	int src_fd = -1, dest_fd = -1;
-	ssize_t bs;
+	int src_fd = -1, dest_fd = -1, direct_io = 0;
 	bool ret = false;
-	void* buffer = NULL;
-	unsigned long long backedup_size = 0;
 	string srcfn, destfn;
+	twrpStreamWriter* chunk_writer = NULL;
+	twrpStreamReader* chunk_reader = NULL;
+	twrpStreamWriter* codec_writer = NULL;
+	twrpStreamReader* codec_reader = NULL;
+	twrpStreamWriter* writer = NULL;
+	twrpStreamReader* reader = NULL;
+	twrpFdWriter* fd_writer = NULL;
+	twrpBackupDigest* digest = NULL;
+	Archive_Type codec = UNCOMPRESSED;
 
 	if (part_settings->PM_Method == PM_BACKUP) {
 		srcfn = Actual_Block_Device;
@@ -2497,64 +2961,166 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 
 	LOGINFO("Reading '%s', writing '%s'\n", srcfn.c_str(), destfn.c_str());
 
+	// Deduplicated images are written to and read from the chunk store, the
+	// file in the backup folder only has the chunk index
+	if (!part_settings->adbbackup) {
+		if (part_settings->PM_Method == PM_BACKUP && part_settings->dedup) {
+			chunk_writer = twrpChunk_New_Writer(dest_fd, twrpChunk_Store_Path(part_settings->Backup_Folder));
+			if (!chunk_writer) {
+				gui_err("backup_error=Error creating backup.");
+				goto exit;
+			}
+		} else if (part_settings->PM_Method != PM_BACKUP && Get_Image_Type(part_settings) == CHUNKED) {
+			Remain = twrpChunk_Index_Size(srcfn);
+			chunk_reader = twrpChunk_New_Reader(src_fd, twrpChunk_Store_Path(part_settings->Backup_Folder));
+			if (!chunk_reader) {
+				gui_err("restore_error=Error during restore process.");
+				goto exit;
+			}
+		}
+	}
+
+	// The adb relay frames the stream itself, so the adb fifos are copied in
+	// the same blocks as a backup file
+	RW_Block_Size = 1048576LLU; // 1MB
+	// Image files are written in the size the storage benchmark found fastest
+	if (part_settings->PM_Method == PM_BACKUP && !part_settings->adbbackup && part_settings->rw_block_size > 0)
+		RW_Block_Size = part_settings->rw_block_size;
+
+	// A compressed adb image goes through the codec of the stream, a
+	// compressed image file through the codec it was written with
 	if (part_settings->adbbackup) {
-		RW_Block_Size = MAX_ADB_READ;
-		bs = MAX_ADB_READ;
+		codec = (Archive_Type) part_settings->adb_compression;
+	} else if (part_settings->PM_Method == PM_BACKUP) {
+		if (!chunk_writer)
+			codec = (Archive_Type) part_settings->image_compression;
+		if (codec != UNCOMPRESSED && !twrpCompress_Supported(codec))
+			codec = COMPRESSED;
+	} else if (!chunk_reader) {
+		codec = Get_Image_Compression(part_settings);
+		if (codec != UNCOMPRESSED) {
+			// The backup wrote the size of the image before it was compressed
+			InfoManager image_info(part_settings->Backup_Folder + "/" + Backup_Name + ".info");
+			if (image_info.LoadValues() != 0 || image_info.GetValue("backup_size", Remain) != 0)
+				Remain = Backup_Size;
+		}
+	}
+	if (codec != UNCOMPRESSED) {
+		if (part_settings->PM_Method == PM_BACKUP) {
+			int level = 0;
+			if (codec == COMPRESSED_ZSTD)
+				DataManager::GetValue(TW_ZSTD_LEVEL_VAR, level);
+			if (codec == COMPRESSED_ZSTD && part_settings->zstd_level > 0)
+				level = part_settings->zstd_level;
+			codec_writer = twrpCompress_New_Writer(codec, dest_fd, level, twrpCompress_Default_Threads());
+			if (!codec_writer) {
+				gui_err("backup_error=Error creating backup.");
+				goto exit;
+			}
+		} else {
+			codec_reader = twrpCompress_New_Reader(codec, src_fd);
+			if (!codec_reader) {
+				gui_msg(Msg(msg::kError, "unsupported_compression=Compression used by '{1}' is not supported by this TWRP build")(Display_Name));
+				goto exit;
+			}
+		}
 	}
-	else {
-		RW_Block_Size = 1048576LLU; // 1MB
-		bs = (ssize_t)(RW_Block_Size);
+
+	// The block device side can bypass the page cache, the backup file and
+	// the adb stream always use cached I/O
+	if (!part_settings->adbbackup)
+		DataManager::GetValue(TW_RAW_DIRECT_IO_VAR, direct_io);
+	reader = chunk_reader ? chunk_reader : codec_reader;
+	if (!reader)
+		reader = new twrpFdReader(src_fd, direct_io && part_settings->PM_Method == PM_BACKUP);
+	writer = chunk_writer ? chunk_writer : codec_writer;
+	if (!writer) {
+		fd_writer = new twrpFdWriter(dest_fd, direct_io && part_settings->PM_Method != PM_BACKUP);
+		// Blocks of zeros, common in images, are zeroed by the device
+		if (part_settings->PM_Method != PM_BACKUP)
+			fd_writer->Zero_Blocks(true);
+		writer = fd_writer;
 	}
 
-	buffer = malloc((size_t)bs);
-	if (!buffer) {
-		LOGINFO("Raw_Read_Write failed to malloc\n");
-		goto exit;
+	// The image or chunk index is digested as it is written instead of being read back
+	if (part_settings->PM_Method == PM_BACKUP && part_settings->generate_digest && !part_settings->adbbackup) {
+		digest = twrpDigestDriver::New_Backup_Digest();
+		if (!twrpCompress_Attach_Digest(dest_fd, digest)) {
+			delete digest;
+			digest = NULL;
+		}
 	}
 
 	if (part_settings->progress)
 		part_settings->progress->SetPartitionSize(part_settings->total_restore_size);
 
-	while (Remain > 0) {
-		if (Remain < RW_Block_Size)
-			bs = (ssize_t)(Remain);
-		if (read(src_fd, buffer, bs) != bs) {
-			LOGINFO("Error reading source fd (%s)\n", strerror(errno));
-			goto exit;
-		}
-		if (write(dest_fd, buffer, bs) != bs) {
-			LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
-			goto exit;
-		}
-		backedup_size += (unsigned long long)(bs);
-		Remain -= (unsigned long long)(bs);
-		if (part_settings->progress)
-			part_settings->progress->UpdateSize(backedup_size);
-		if (PartitionManager.Check_Backup_Cancel() != 0)
+	{
+		// The next buffers are read while the current one is written
+		twrpMemGrant ring_grant;
+		unsigned buffers = ring_grant.Take_Units("raw copy", (size_t)RW_Block_Size, twrpIoScheduler::Get()->Depth(Actual_Block_Device), 2);
+		twrpRawCopy raw_copy((size_t)RW_Block_Size, buffers);
+		if (!raw_copy.Copy(reader, writer, Remain, [part_settings](uint64_t backedup_size) {
+			if (part_settings->progress)
+				part_settings->progress->UpdateSize(backedup_size);
+			return PartitionManager.Check_Backup_Cancel() == 0;
+		}))
 			goto exit;
 	}
 	if (part_settings->progress)
 		part_settings->progress->UpdateDisplayDetails(true);
+	if (chunk_writer && chunk_writer->Finish() != 0) {
+		LOGINFO("Error writing chunk index '%s'\n", destfn.c_str());
+		goto exit;
+	}
+	if (codec_writer && codec_writer->Finish() != 0) {
+		LOGINFO("Error compressing '%s'\n", destfn.c_str());
+		goto exit;
+	}
 	fsync(dest_fd);
 
 	if (!part_settings->adbbackup && part_settings->PM_Method == PM_BACKUP) {
 		tw_set_default_metadata(destfn.c_str());
 		LOGINFO("Restored default metadata for %s\n", destfn.c_str());
+		// The restore needs the size of the image before it was compressed
+		// and takes the format of the file from here instead of its magic
+		InfoManager backup_info(part_settings->Backup_Folder + "/" + Backup_Name + ".info");
+		backup_info.SetValue("backup_size", Backup_Size);
+		backup_info.SetValue("backup_type", chunk_writer ? CHUNKED : codec);
+		backup_info.SaveValues();
+		if (codec != UNCOMPRESSED)
+			LOGINFO("Compressed %s from %lluMB to %luMB\n", Backup_Display_Name.c_str(), Backup_Size / 1048576, TWFunc::Get_File_Size(destfn) / 1048576);
+	}
+	if (digest) {
+		twrpCompress_Detach_Digest(dest_fd, digest);
+		if (!twrpDigestDriver::Write_Digest_File(destfn, digest)) {
+			gui_err("digest_error= * Digest Error!");
+			goto exit;
+		}
+		part_settings->digest_written = true;
 	}
 
 	ret = true;
 exit:
+	if (digest)
+		twrpCompress_Detach_Digest(dest_fd, digest);
 	if (src_fd >= 0)
 		close(src_fd);
 	if (dest_fd >= 0)
 		close(dest_fd);
-	if (buffer)
-		free(buffer);
+	delete digest;
+	if (reader != chunk_reader && reader != codec_reader)
+		delete reader;
+	if (writer != chunk_writer && writer != codec_writer)
+		delete writer;
+	delete chunk_writer;
+	delete chunk_reader;
+	delete codec_writer;
+	delete codec_reader;
 	return ret;
 }
 
 bool TWPartition::Backup_Dump_Image(PartitionSettings *part_settings) {
-	string Full_FileName, Command;
+	string Full_FileName;
 
 	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, Display_Name, gui_parse_text("{@backing}"));
 	gui_msg(Msg("backing_up=Backing up {1}...")(Backup_Display_Name));
@@ -2565,10 +3131,9 @@ bool TWPartition::Backup_Dump_Image(PartitionSettings *part_settings) {
 	Backup_FileName = Backup_Name + "." + Current_File_System + ".win";
 	Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
 
-	Command = "dump_image " + MTD_Name + " '" + Full_FileName + "'";
-
-	LOGINFO("Backup command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
+	twrpFsTool tool("dump_image");
+	tool.Arg(MTD_Name).Arg(Full_FileName);
+	tool.Run();
 	tw_set_default_metadata(Full_FileName.c_str());
 	if (TWFunc::Get_File_Size(Full_FileName) == 0) {
 		// Actual size may not match backup size due to bad blocks on MTD devices so just check for 0 bytes
@@ -2582,21 +3147,52 @@ bool TWPartition::Backup_Dump_Image(PartitionSettings *part_settings) {
 }
 
 unsigned long long TWPartition::Get_Restore_Size(PartitionSettings *part_settings) {
+	string Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
+
+	Restore_Size_File = Full_FileName;
+	Restore_File_Count = 0;
 	if (!part_settings->adbbackup) {
+		// Backups store the size of the tar data and the file count, so the
+		// archives don't have to be decrypted or decompressed to measure them
 		InfoManager restore_info(part_settings->Backup_Folder + "/" + Backup_Name + ".info");
 		if (restore_info.LoadValues() == 0) {
 			if (restore_info.GetValue("backup_size", Restore_Size) == 0) {
-				LOGINFO("Read info file, restore size is %llu\n", Restore_Size);
+				std::vector<string> Chain, Chain_Files;
+				size_t i;
+
+				if (restore_info.GetValue("file_count", Restore_File_Count) != 0)
+					Restore_File_Count = 0;
+				// An incremental backup also restores every backup it is based on
+				if (Get_Incremental_Chain(part_settings->Backup_Folder, &Chain, &Chain_Files, false)) {
+					for (i = 0; i + 1 < Chain.size(); i++) {
+						InfoManager base_info(Chain[i] + "/" + Backup_Name + ".info");
+						unsigned long long Base_Size = 0, Base_Files = 0;
+						if (base_info.LoadValues() == 0 && base_info.GetValue("backup_size", Base_Size) == 0)
+							Restore_Size += Base_Size;
+						if (Restore_File_Count != 0 && base_info.GetValue("file_count", Base_Files) == 0)
+							Restore_File_Count += Base_Files;
+						else
+							Restore_File_Count = 0;
+					}
+				}
+				LOGINFO("Read info file, restore size is %llu, %llu files\n", Restore_Size, Restore_File_Count);
 				return Restore_Size;
 			}
 		}
 	}
 
-	string Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
+	// Backups from before the .info files had the sizes
 	string Restore_File_System = Get_Restore_File_System(part_settings);
 
 	if (Is_Image(Restore_File_System)) {
-		Restore_Size = TWFunc::Get_File_Size(Full_FileName);
+		uint64_t Sparse_Size;
+		Archive_Type Image_Type = part_settings->adbbackup ? UNCOMPRESSED : Get_Image_Type(part_settings);
+		if (Image_Type == CHUNKED)
+			Restore_Size = twrpChunk_Index_Size(Full_FileName);
+		else if (Image_Type == SPARSE && twrpSparse_Get_Size(Full_FileName, &Sparse_Size))
+			Restore_Size = Sparse_Size;
+		else
+			Restore_Size = TWFunc::Get_File_Size(Full_FileName);
 		return Restore_Size;
 	}
 
@@ -2618,9 +3214,32 @@ unsigned long long TWPartition::Get_Restore_Size(PartitionSettings *part_setting
 }
 
 bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
-	string Full_FileName;
-	bool ret = false;
+	bool ret = true;
 	string Restore_File_System = Get_Restore_File_System(part_settings);
+	std::vector<string> Chain, Chain_Files;
+	size_t i;
+	int check_digest = 0, digest_on_extract = 0;
+
+	// An incremental backup is restored on top of the backups it is based on
+	if (part_settings->adbbackup) {
+		Chain.push_back(part_settings->Backup_Folder);
+		Chain_Files.push_back(Backup_FileName);
+	} else if (!Get_Incremental_Chain(part_settings->Backup_Folder, &Chain, &Chain_Files, true)) {
+		return false;
+	}
+	DataManager::GetValue(TW_SKIP_DIGEST_CHECK_VAR, check_digest);
+	if (check_digest > 0 && !part_settings->adbbackup)
+		DataManager::GetValue(TW_DIGEST_ON_EXTRACT_VAR, digest_on_extract);
+	if (Chain.size() > 1) {
+		std::vector<string> Base_Files;
+
+		gui_msg(Msg("incremental_restore=Restoring {1} from a chain of {2} backups")(Backup_Display_Name)(Chain.size()));
+		// Run_Restore only checked the digest of the newest backup
+		for (i = 0; check_digest > 0 && !digest_on_extract && i + 1 < Chain.size(); i++)
+			Base_Files.push_back(Chain[i] + "/" + Chain_Files[i]);
+		if (!twrpDigestDriver::Check_Digests(Base_Files))
+			return false;
+	}
 
 	if (Has_Android_Secure) {
 		if (!Wipe_AndSec())
@@ -2643,23 +3262,54 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	if (!ReMount_RW(true))
 		return false;
 
-	Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
-	twrpTar tar;
-	tar.part_settings = part_settings;
-	tar.setdir(Backup_Path);
-	tar.setfn(Full_FileName);
-	tar.backup_name = Backup_Name;
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	string Password;
 	DataManager::GetValue("tw_restore_password", Password);
-	if (!Password.empty())
-		tar.setpassword(Password);
 #endif
-	part_settings->progress->SetPartitionSize(Get_Restore_Size(part_settings));
-	if (tar.extractTarFork() != 0)
-		ret = false;
-	else
-		ret = true;
+	for (i = 0; i < Chain.size(); i++) {
+		twrpTar tar;
+		tar.part_settings = part_settings;
+		tar.setdir(Backup_Path);
+		tar.setfn(Chain[i] + "/" + Chain_Files[i]);
+		tar.backup_name = Backup_Name;
+		tar.verify_digest = digest_on_extract != 0;
+		tar.io_lanes = twrpIoScheduler::Get()->Lanes(Actual_Block_Device);
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+		if (!Password.empty())
+			tar.setpassword(Password);
+#endif
+		if (Chain.size() == 1) {
+			// Run_Restore already read or measured the size, measuring an
+			// old encrypted backup again would decrypt all of it once more
+			if (Restore_Size_File != part_settings->Backup_Folder + "/" + Backup_FileName)
+				Get_Restore_Size(part_settings);
+			if (Restore_File_Count != 0) {
+				part_settings->progress->SetSizeCount(Restore_Size, Restore_File_Count);
+				tar.restore_file_count = Restore_File_Count;
+			} else
+				part_settings->progress->SetPartitionSize(Restore_Size);
+		} else {
+			InfoManager link_info(Chain[i] + "/" + Backup_Name + ".info");
+			unsigned long long Link_Size = 0, Link_Files = 0;
+			if (link_info.LoadValues() == 0) {
+				link_info.GetValue("backup_size", Link_Size);
+				link_info.GetValue("file_count", Link_Files);
+			}
+			if (Link_Files != 0) {
+				part_settings->progress->SetSizeCount(Link_Size, Link_Files);
+				tar.restore_file_count = Link_Files;
+			} else
+				part_settings->progress->SetPartitionSize(Link_Size);
+			if (i > 0 && !Apply_Deleted_List(Chain[i] + "/" + Backup_Name + ".deleted")) {
+				ret = false;
+				break;
+			}
+		}
+		if (tar.extractTarFork() != 0) {
+			ret = false;
+			break;
+		}
+	}
 #ifdef HAVE_CAPABILITIES
 	// Restore capabilities to the run-as binary
 	if (Mount_Point == PartitionManager.Get_Android_Root_Path() && Mount(true) && TWFunc::Path_Exists("/system/bin/run-as")) {
@@ -2686,6 +3336,50 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	return ret;
 }
 
+bool TWPartition::Restore_Paths(PartitionSettings *part_settings, const std::vector<string>& Paths) {
+	std::vector<string> Chain, Chain_Files;
+	unsigned long long restored, total = 0;
+	bool ret = true;
+	size_t i;
+
+	// Each backup in an incremental chain may hold a newer copy
+	if (!Get_Incremental_Chain(part_settings->Backup_Folder, &Chain, &Chain_Files, true))
+		return false;
+	if (!ReMount_RW(true))
+		return false;
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	string Password;
+	DataManager::GetValue("tw_restore_password", Password);
+#endif
+	for (i = 0; i < Chain.size(); i++) {
+		twrpTar tar;
+		tar.part_settings = part_settings;
+		tar.setdir(Backup_Path);
+		tar.setfn(Chain[i] + "/" + Chain_Files[i]);
+		tar.backup_name = Backup_Name;
+		tar.io_lanes = twrpIoScheduler::Get()->Lanes(Actual_Block_Device);
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+		if (!Password.empty())
+			tar.setpassword(Password);
+#endif
+		if (tar.extractPaths(Paths, &restored) != 0) {
+			ret = false;
+			break;
+		}
+		total += restored;
+	}
+	if (ret && total == 0) {
+		gui_msg(Msg(msg::kError, "restore_path_none=Nothing in the backup of {1} matched '{2}'")(Backup_Display_Name)(Paths[0]));
+		ret = false;
+	} else if (ret) {
+		gui_msg(Msg("restore_path_count=Restored {1} items to {2}")(total)(Backup_Display_Name));
+	}
+	if (Mount_Read_Only || Mount_Flags & MS_RDONLY)
+		ReMount(true);
+	return ret;
+}
+
 bool TWPartition::Restore_Image(PartitionSettings *part_settings) {
 	string Full_FileName;
 	string Restore_File_System = Get_Restore_File_System(part_settings);
@@ -2699,9 +3393,21 @@ bool TWPartition::Restore_Image(PartitionSettings *part_settings) {
 		Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
 
 	if (Restore_File_System == "emmc") {
-		if (!part_settings->adbbackup)
-			part_settings->total_restore_size = (uint64_t)(TWFunc::Get_File_Size(Full_FileName));
-		if (!Raw_Read_Write(part_settings))
+		// Images without a recorded format are raw, whatever their first bytes
+		Archive_Type Image_Type = part_settings->adbbackup ? UNCOMPRESSED : Get_Image_Type(part_settings);
+		if (!part_settings->adbbackup) {
+			if (Image_Type == CHUNKED)
+				part_settings->total_restore_size = twrpChunk_Index_Size(Full_FileName);
+			else if (Get_Image_Compression(part_settings) != UNCOMPRESSED)
+				part_settings->total_restore_size = Get_Restore_Size(part_settings);
+			else
+				part_settings->total_restore_size = (uint64_t)(TWFunc::Get_File_Size(Full_FileName));
+		}
+		if (Image_Type == SPARSE) {
+			// Blocks that were skipped during the backup are left as they are
+			if (!Flash_Sparse_Image(Full_FileName, part_settings->progress))
+				return false;
+		} else if (!Raw_Read_Write(part_settings))
 			return false;
 	} else if (Restore_File_System == "mtd" || Restore_File_System == "bml") {
 		if (!Flash_Image_FI(Full_FileName, part_settings->progress))
@@ -2715,7 +3421,36 @@ bool TWPartition::Restore_Image(PartitionSettings *part_settings) {
 	return true;
 }
 
+void TWPartition::Invalidate_Size() {
+	Size_Epoch++;
+	backup_scan.Invalidate();
+}
+
+bool TWPartition::Update_Size_If_Changed(bool Display_Error) {
+	if (Size_Epoch != Sized_Epoch)
+		return Update_Size(Display_Error);
+	// Unchanged, but files can still come and go through MTP, adb or the
+	// terminal while it is mounted, statfs keeps the free space honest
+	if (Can_Be_Mounted && Is_Mounted() && Get_Size_Via_statfs(false)) {
+		if (Has_Data_Media)
+			Used = Backup_Size;
+	}
+	return true;
+}
+
 bool TWPartition::Update_Size(bool Display_Error) {
+	unsigned long Epoch = Size_Epoch;
+	bool Was_Sizing = Sizing;
+
+	Sizing = true;
+	bool ret = Update_Size_Now(Display_Error);
+	Sizing = Was_Sizing;
+	if (ret && Epoch == Size_Epoch)
+		Sized_Epoch = Epoch;
+	return ret;
+}
+
+bool TWPartition::Update_Size_Now(bool Display_Error) {
 	bool ret = false, Was_Already_Mounted = false;
 
 	Find_Actual_Block_Device();
@@ -2738,7 +3473,7 @@ bool TWPartition::Update_Size(bool Display_Error) {
 
 	ret = Get_Size_Via_statfs(Display_Error);
 	if (!ret || Size == 0) {
-		if (!Get_Size_Via_df(Display_Error)) {
+		if (!Get_Size_Via_statvfs(Display_Error)) {
 			if (!Was_Already_Mounted)
 				UnMount(false);
 			return false;
@@ -2747,8 +3482,11 @@ bool TWPartition::Update_Size(bool Display_Error) {
 
 	if (Has_Data_Media) {
 		if (Mount(Display_Error)) {
-			Used = backup_exclusions.Get_Folder_Size(Mount_Point);
-			Backup_Size = Used;
+			if (!Get_Backup_Size_Via_Quota()) {
+				backup_scan.Scan(Mount_Point, &backup_exclusions);
+				Backup_Size = backup_scan.Get_Size();
+			}
+			Used = Backup_Size;
 			int bak = (int)(Used / 1048576LLU);
 			int fre = (int)(Free / 1048576LLU);
 			LOGINFO("Data backup size is %iMB, free: %iMB.\n", bak, fre);
@@ -2758,9 +3496,10 @@ bool TWPartition::Update_Size(bool Display_Error) {
 			return false;
 		}
 	} else if (Has_Android_Secure) {
-		if (Mount(Display_Error))
-			Backup_Size = backup_exclusions.Get_Folder_Size(Backup_Path);
-		else {
+		if (Mount(Display_Error)) {
+			backup_scan.Scan(Backup_Path, &backup_exclusions);
+			Backup_Size = backup_scan.Get_Size();
+		} else {
 			if (!Was_Already_Mounted)
 				UnMount(false);
 			return false;
@@ -2943,6 +3682,8 @@ uint64_t TWPartition::Get_Max_FileSize() {
 bool TWPartition::Flash_Image(PartitionSettings *part_settings) {
 	string Restore_File_System, full_filename;
 
+	Invalidate_Size();
+
 	full_filename = part_settings->Backup_Folder + "/" + Backup_FileName;
 
 	LOGINFO("Image filename is: %s\n", Backup_FileName.c_str());
@@ -2968,7 +3709,7 @@ bool TWPartition::Flash_Image(PartitionSettings *part_settings) {
 		if (Backup_Method == BM_DD) {
 			if (!part_settings->adbbackup) {
 				if (Is_Sparse_Image(full_filename)) {
-					return Flash_Sparse_Image(full_filename);
+					return Flash_Sparse_Image(full_filename, NULL);
 				}
 			}
 			return Raw_Read_Write(part_settings);
@@ -3000,19 +3741,61 @@ bool TWPartition::Is_Sparse_Image(const string& Filename) {
 	return false;
 }
 
-bool TWPartition::Flash_Sparse_Image(const string& Filename) {
-	string Command;
+bool TWPartition::Flash_Sparse_Image(const string& Filename, ProgressTracking *progress) {
+	uint64_t image_size = 0;
+	int src_fd, dest_fd, discard = 1;
+	timespec start, end;
+	bool ret;
 
 	gui_msg(Msg("flashing=Flashing {1}...")(Display_Name));
+	if (!twrpSparse_Get_Size(Filename, &image_size)) {
+		gui_msg(Msg(msg::kError, "sparse_flash_err=Unable to flash sparse image '{1}'")(Filename));
+		return false;
+	}
+	// Flashes outside of a restore get a progress bar of their own
+	ProgressTracking flash_progress(image_size);
+	if (!progress)
+		progress = &flash_progress;
+	else
+		progress->SetPartitionSize(image_size);
 
-	Command = "simg2img '" + Filename + "' '" + Actual_Block_Device + "'";
-	LOGINFO("Flash command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
+	src_fd = open(Filename.c_str(), O_RDONLY | O_LARGEFILE);
+	if (src_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Filename)(strerror(errno)));
+		return false;
+	}
+	dest_fd = open(Actual_Block_Device.c_str(), O_WRONLY | O_LARGEFILE);
+	if (dest_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Actual_Block_Device)(strerror(errno)));
+		close(src_fd);
+		return false;
+	}
+	// Don't care chunks are discarded like the blocks of a wipe
+	DataManager::GetValue(TW_WIPE_DISCARD_VAR, discard);
+	LOGINFO("Flashing sparse image '%s' (%llu bytes) to '%s'\n", Filename.c_str(), (unsigned long long) image_size, Actual_Block_Device.c_str());
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	{
+		twrpMemGrant ring_grant;
+		unsigned buffers = ring_grant.Take_Units("sparse flash", TW_SPARSE_FLASH_BUFFER, twrpIoScheduler::Get()->Depth(Actual_Block_Device), 2);
+		twrpSparseFlasher flasher(TW_SPARSE_FLASH_BUFFER, buffers);
+		ret = flasher.Flash(src_fd, dest_fd, discard != 0, [progress](uint64_t flashed_size) {
+			progress->UpdateSize(flashed_size);
+			return true;
+		});
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(dest_fd);
+	close(src_fd);
+	if (!ret) {
+		gui_msg(Msg(msg::kError, "sparse_flash_err=Unable to flash sparse image '{1}'")(Filename));
+		return false;
+	}
+	LOGINFO("Flashed sparse image in %i ms\n", TWFunc::timespec_diff_ms(start, end));
+	progress->UpdateSize(image_size);
 	return true;
 }
 
 bool TWPartition::Flash_Image_FI(const string& Filename, ProgressTracking *progress) {
-	string Command;
 	unsigned long long file_size;
 
 	gui_msg(Msg("flashing=Flashing {1}...")(Display_Name));
@@ -3020,18 +3803,84 @@ bool TWPartition::Flash_Image_FI(const string& Filename, ProgressTracking *progr
 		file_size = (unsigned long long)(TWFunc::Get_File_Size(Filename));
 		progress->SetPartitionSize(file_size);
 	}
+	if (Current_File_System == "mtd")
+		return Flash_MTD_Image(Filename, progress);
 	// Sometimes flash image doesn't like to flash due to the first 2KB matching, so we erase first to ensure that it flashes
-	Command = "erase_image " + MTD_Name;
-	LOGINFO("Erase command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
-	Command = "flash_image " + MTD_Name + " '" + Filename + "'";
-	LOGINFO("Flash command: '%s'\n", Command.c_str());
-	TWFunc::Exec_Cmd(Command);
+	twrpFsTool erase("erase_image");
+	erase.Arg(MTD_Name).Run();
+	twrpFsTool flash("flash_image");
+	flash.Arg(MTD_Name).Arg(Filename).Run();
 	if (progress)
 		progress->UpdateSize(file_size);
 	return true;
 }
 
+bool TWPartition::Flash_MTD_Image(const string& Filename, ProgressTracking *progress) {
+	struct timespec start, end;
+	int verify = 0;
+	bool ret = true;
+
+#ifdef TW_MTD_VERIFY_WRITES
+	verify = 1;
+#endif
+	mtd_scan_partitions();
+	const MtdPartition* mtd = mtd_find_partition_by_name(MTD_Name.c_str());
+	size_t erase_size;
+	if (mtd == NULL || mtd_partition_info(mtd, NULL, &erase_size, NULL) != 0) {
+		LOGERR("No mtd partition named '%s'", MTD_Name.c_str());
+		return false;
+	}
+	int src_fd = open(Filename.c_str(), O_RDONLY | O_LARGEFILE);
+	if (src_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Filename)(strerror(errno)));
+		return false;
+	}
+	MtdWriteContext* ctx = mtd_write_partition(mtd);
+	if (ctx == NULL) {
+		LOGERR("Can't write '%s', failed to flash.", MTD_Name.c_str());
+		close(src_fd);
+		return false;
+	}
+	mtd_write_set_verify(ctx, verify);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// One pass of multi-block erases up front, the writes then skip theirs.
+	// This also stands in for the erase_image that flash_image needs.
+	if (mtd_erase_blocks(ctx, -1) == -1) {
+		LOGERR("Failed to erase '%s'", MTD_Name.c_str());
+		ret = false;
+	}
+	// Reading whole erase blocks keeps mtd_write_data from buffering
+	size_t buf_size = erase_size * std::max<size_t>(1, (1024 * 1024) / erase_size);
+	std::vector<char> buf(buf_size);
+	unsigned long long written = 0;
+	while (ret) {
+		ssize_t len = TEMP_FAILURE_RETRY(read(src_fd, buf.data(), buf_size));
+		if (len < 0) {
+			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Filename)(strerror(errno)));
+			ret = false;
+		} else if (len == 0) {
+			break;
+		} else if (mtd_write_data(ctx, buf.data(), len) != len) {
+			LOGERR("Failed to write '%s'", MTD_Name.c_str());
+			ret = false;
+		} else {
+			written += len;
+			if (progress)
+				progress->UpdateSize(written);
+		}
+	}
+	if (mtd_write_close(ctx) != 0 && ret) {
+		LOGERR("Failed to close '%s'", MTD_Name.c_str());
+		ret = false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	close(src_fd);
+	if (ret)
+		LOGINFO("Flashed '%s' to mtd '%s' in %i ms%s\n", Filename.c_str(), MTD_Name.c_str(), TWFunc::timespec_diff_ms(start, end), verify ? " (verified)" : "");
+	return ret;
+}
+
 void TWPartition::Change_Mount_Read_Only(bool new_value) {
 	Mount_Read_Only = new_value;
 }
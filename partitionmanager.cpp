@@ -24,8 +24,10 @@
 #include <unistd.h>
 #include <map>
 #include <vector>
+#include <algorithm>
 #include <dirent.h>
 #include <time.h>
+#include <pthread.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <zlib.h>
@@ -52,6 +54,22 @@
 #include "gui/gui.hpp"
 #include "progresstracking.hpp"
 #include "twrpDigestDriver.hpp"
+#include "twrpChunkStore.hpp"
+#include "twrpIoScheduler.hpp"
+#include "twrpMemBudget.hpp"
+#include "twrpPerfProfile.hpp"
+#include "twrpPerfReport.hpp"
+#include "twrpStorageBench.hpp"
+#include "twrpThermal.hpp"
+#include "twrpFsTool.hpp"
+#include "twrpStartupTrace.hpp"
+#include "twrpRawCopy.hpp"
+#include "twrpCompress.hpp"
+#include "twrpSparse.hpp"
+#include "twrpZipEntry.hpp"
+#include "twrpLog.hpp"
+#include "zipwrap.hpp"
+#include "twrpEncrypt.hpp"
 #include "adbbu/libtwadbbu.hpp"
 
 #ifdef TW_HAS_MTP
@@ -73,10 +91,14 @@ extern "C" {
 
 #ifdef TW_INCLUDE_CRYPTO
 	#include "crypto/fde/cryptfs.h"
+	extern "C" {
+		#include "gpt/gpt.h"
+	}
 	#include "gui/rapidxml.hpp"
 	#include "gui/pages.hpp"
 	#ifdef TW_INCLUDE_FBE
 		#include "crypto/ext4crypt/Decrypt.h"
+		#include "crypto/ext4crypt/HalTiming.h"
 		#ifdef TW_INCLUDE_FBE_METADATA_DECRYPT
 			#include "crypto/ext4crypt/MetadataCrypt.h"
 		#endif
@@ -98,6 +120,11 @@ TWPartitionManager::TWPartitionManager(void) {
 	mtp_write_fd = -1;
 	uevent_pfd.fd = -1;
 	stop_backup.set_value(0);
+	mount_table_valid = false;
+	pthread_mutex_init(&mount_table_lock, NULL);
+	details_held = false;
+	details_pending = false;
+	mountinfo_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
 #ifdef AB_OTA_UPDATER
 	char slot_suffix[PROPERTY_VALUE_MAX];
 	property_get("ro.boot.slot_suffix", slot_suffix, "error");
@@ -224,6 +251,7 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error)
 		}
 	}
 	LOGINFO("Done processing fstab files\n");
+	Probe_Partitions();
 
 	std::vector<TWPartition*>::iterator iter;
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
@@ -344,6 +372,71 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error)
 	return true;
 }
 
+struct Probe_Job {
+	std::vector<TWPartition*> Parts;
+	size_t Next;
+	pthread_mutex_t Lock;
+};
+
+static void* Probe_Worker(void *cookie) {
+	Probe_Job* job = (Probe_Job*) cookie;
+
+	for (;;) {
+		pthread_mutex_lock(&job->Lock);
+		size_t i = job->Next++;
+		pthread_mutex_unlock(&job->Lock);
+		if (i >= job->Parts.size())
+			break;
+		job->Parts[i]->Check_FS_Type();
+	}
+	return NULL;
+}
+
+void TWPartitionManager::Probe_Partitions(void) {
+	std::vector<TWPartition*>::iterator iter;
+	std::vector<pthread_t> workers;
+	Probe_Job job;
+	timespec start, end;
+	size_t i, threads;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// Finding the block devices stays serial, wildcard devices add partitions
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		TWPartition* part = *iter;
+		if (!part->Can_Be_Mounted || part->Wildcard_Block_Device || !part->Sysfs_Entry.empty())
+			continue;
+		part->Find_Actual_Block_Device();
+		if (part->Is_Present)
+			job.Parts.push_back(part);
+	}
+	if (job.Parts.empty())
+		return;
+
+	job.Next = 0;
+	pthread_mutex_init(&job.Lock, NULL);
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = cores > 1 ? (size_t) cores : 1;
+	if (threads > job.Parts.size())
+		threads = job.Parts.size();
+	for (i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Probe_Worker, &job) != 0) {
+			LOGINFO("Unable to create probe thread %zu, continuing with %zu\n", i, i);
+			break;
+		}
+		workers.push_back(thread);
+	}
+	Probe_Worker(&job);
+	for (i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	pthread_mutex_destroy(&job.Lock);
+
+	for (iter = job.Parts.begin(); iter != job.Parts.end(); iter++)
+		(*iter)->Probed_Block_Device = (*iter)->Actual_Block_Device;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	LOGINFO("Probed %zu partitions with %zu threads in %i ms\n", job.Parts.size(), workers.size() + 1, TWFunc::timespec_diff_ms(start, end));
+}
+
 int TWPartitionManager::Write_Fstab(void) {
 	FILE *fp;
 	std::vector<TWPartition*>::iterator iter;
@@ -654,6 +747,35 @@ int TWPartitionManager::Check_Backup_Name(bool Display_Error) {
 	return 0;
 }
 
+// Times part_settings->Part for the performance report, until Report_End()
+static void Report_Begin(PartitionSettings *part_settings) {
+	const char* method;
+
+	if (part_settings->report == NULL)
+		return;
+	if (part_settings->Part->Backup_Method == BM_FILES)
+		method = "files";
+	else if (part_settings->Part->Backup_Method == BM_FLASH_UTILS)
+		method = "flash";
+	else
+		method = "image";
+	part_settings->report->Begin_Partition(part_settings->Part->Backup_Name, method);
+}
+
+static void Report_End(PartitionSettings *part_settings, unsigned long long Bytes, bool Ok) {
+	if (part_settings->report)
+		part_settings->report->End_Partition(Bytes, Ok);
+}
+
+static bool Report_Make_Digest(PartitionSettings *part_settings, const string& Filename) {
+	uint64_t start = twrpThermal::Now_Usec();
+	bool ret = twrpDigestDriver::Make_Digest(Filename);
+
+	if (part_settings->report)
+		part_settings->report->Add_Time(TW_PERF_TIME_DIGEST, twrpThermal::Now_Usec() - start);
+	return ret;
+}
+
 bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 	time_t start, stop;
 	int use_compression;
@@ -664,17 +786,22 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 
 	DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
 
-	TWFunc::SetPerformanceMode(true);
+	twrpPerfProfile::Get()->Enter(PERF_BACKUP);
 	time(&start);
 
+	part_settings->digest_written = false;
+	Report_Begin(part_settings);
 	if (part_settings->Part->Backup(part_settings, &tar_fork_pid)) {
 		sync();
 		sync();
 		string Full_Filename = part_settings->Backup_Folder + "/" + part_settings->Part->Backup_FileName;
 		if (!part_settings->adbbackup && part_settings->generate_digest) {
-			if (!twrpDigestDriver::Make_Digest(Full_Filename))
+			if (part_settings->digest_written)
+				gui_msg("digest_created= * Digest Created.");
+			else if (!Report_Make_Digest(part_settings, Full_Filename))
 				goto backup_error;
 		}
+		Report_End(part_settings, part_settings->Part->Backup_Size, true);
 
 		if (part_settings->Part->Has_SubPartition) {
 			std::vector<TWPartition*>::iterator subpart;
@@ -683,16 +810,21 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 			for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
 				if ((*subpart)->Can_Be_Backed_Up && (*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == parentPart->Mount_Point) {
 					part_settings->Part = *subpart;
+					part_settings->digest_written = false;
+					Report_Begin(part_settings);
 					if (!(*subpart)->Backup(part_settings, &tar_fork_pid)) {
 						goto backup_error;
 					}
 					sync();
 					sync();
 					if (!part_settings->adbbackup && part_settings->generate_digest) {
-						if (!twrpDigestDriver::Make_Digest(Full_Filename)) {
+						if (part_settings->digest_written)
+							gui_msg("digest_created= * Digest Created.");
+						else if (!Report_Make_Digest(part_settings, part_settings->Backup_Folder + "/" + (*subpart)->Backup_FileName)) {
 							goto backup_error;
 						}
 					}
+					Report_End(part_settings, (*subpart)->Backup_Size, true);
 				}
 			}
 		}
@@ -708,14 +840,16 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 
 		}
 
-		TWFunc::SetPerformanceMode(false);
+		twrpPerfProfile::Get()->Leave(PERF_BACKUP);
 		return true;
 	}
 backup_error:
+	Report_End(part_settings, 0, false);
 	Clean_Backup_Folder(part_settings->Backup_Folder);
+	twrpLog::Flush();
 	TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
 	tw_set_default_metadata(backup_log.c_str());
-	TWFunc::SetPerformanceMode(false);
+	twrpPerfProfile::Get()->Leave(PERF_BACKUP);
 	return false;
 }
 
@@ -730,6 +864,9 @@ void TWPartitionManager::Clean_Backup_Folder(string Backup_Folder) {
 	ext.push_back("md5");
 	ext.push_back("sha2");
 	ext.push_back("info");
+	ext.push_back("manifest");
+	ext.push_back("deleted");
+	ext.push_back("keycheck");
 
 	gui_msg("backup_clean=Backup Failed. Cleaning Backup Folder.");
 
@@ -783,13 +920,188 @@ int TWPartitionManager::Cancel_Backup() {
 	return 0;
 }
 
+struct Backup_Image_Job {
+	TWPartition* Part;
+	twrpIoGroup* Group;                                                       // Disk the partition is on
+	bool Started;
+};
+
+// Image backups run by worker threads next to the backup loop. A disk is
+// read by no more backups at a time than its twrpIoScheduler lanes, and the
+// workers plus the backup loop never write more than the
+// tw_backup_io_streams setting to the backup storage.
+struct Backup_Scheduler {
+	PartitionSettings Settings;                                               // Copied for each job, without progress tracking
+	ProgressTracking* Progress;
+	std::vector<Backup_Image_Job> Jobs;
+	std::map<twrpIoGroup*, unsigned> Busy;                                    // Backups reading each disk
+	std::vector<pthread_t> Workers;
+	uint64_t Img_Time;
+	bool Failed;
+	pthread_mutex_t Lock;
+	pthread_cond_t Cond;
+};
+
+static void* Backup_Image_Worker(void *cookie) {
+	Backup_Scheduler* sched = (Backup_Scheduler*) cookie;
+
+	pthread_mutex_lock(&sched->Lock);
+	while (!sched->Failed) {
+		Backup_Image_Job* job = NULL;
+		bool waiting = false;
+		for (size_t i = 0; i < sched->Jobs.size() && job == NULL; i++) {
+			if (sched->Jobs[i].Started)
+				continue;
+			if (sched->Busy[sched->Jobs[i].Group] >= twrpIoScheduler::Get()->Lanes(sched->Jobs[i].Group))
+				waiting = true;
+			else
+				job = &sched->Jobs[i];
+		}
+		if (job == NULL) {
+			if (!waiting)
+				break;
+			pthread_cond_wait(&sched->Cond, &sched->Lock);
+			continue;
+		}
+		job->Started = true;
+		unsigned streams = ++sched->Busy[job->Group];
+		PartitionSettings settings = sched->Settings;
+		pthread_mutex_unlock(&sched->Lock);
+
+		time_t start, stop;
+		pid_t tar_fork_pid = 0;
+		settings.Part = job->Part;
+		settings.progress = NULL;
+		settings.digest_written = false;
+		time(&start);
+		Report_Begin(&settings);
+		timespec copy_start, copy_end;
+		clock_gettime(CLOCK_MONOTONIC, &copy_start);
+		bool ret = job->Part->Backup(&settings, &tar_fork_pid);
+		clock_gettime(CLOCK_MONOTONIC, &copy_end);
+		if (ret)
+			twrpIoScheduler::Get()->Record(job->Group, job->Part->Backup_Size, (uint64_t) TWFunc::timespec_diff_ms(copy_start, copy_end) * 1000, streams);
+		if (ret) {
+			sync();
+			if (settings.generate_digest) {
+				if (settings.digest_written)
+					gui_msg("digest_created= * Digest Created.");
+				else
+					ret = Report_Make_Digest(&settings, settings.Backup_Folder + "/" + job->Part->Backup_FileName);
+			}
+		}
+		Report_End(&settings, job->Part->Backup_Size, ret);
+		time(&stop);
+		int backup_time = (int) difftime(stop, start);
+		LOGINFO("Partition Backup time: %d (%s, %s)\n", backup_time, job->Part->Backup_Display_Name.c_str(), job->Group->Disk.c_str());
+		if (ret && sched->Progress)
+			sched->Progress->AddBackgroundSize(job->Part->Backup_Size);
+
+		pthread_mutex_lock(&sched->Lock);
+		sched->Busy[job->Group]--;
+		if (ret)
+			sched->Img_Time += backup_time;
+		else
+			sched->Failed = true;
+		pthread_cond_broadcast(&sched->Cond);
+	}
+	pthread_mutex_unlock(&sched->Lock);
+	return NULL;
+}
+
+// Takes a lane of Group for the backup loop, waiting for the workers that
+// use all of them
+static void Backup_Scheduler_Acquire(Backup_Scheduler* sched, twrpIoGroup* Group) {
+	if (Group == NULL)
+		return;
+	pthread_mutex_lock(&sched->Lock);
+	while (sched->Busy[Group] >= twrpIoScheduler::Get()->Lanes(Group))
+		pthread_cond_wait(&sched->Cond, &sched->Lock);
+	sched->Busy[Group]++;
+	pthread_mutex_unlock(&sched->Lock);
+}
+
+static void Backup_Scheduler_Release(Backup_Scheduler* sched, twrpIoGroup* Group) {
+	if (Group == NULL)
+		return;
+	pthread_mutex_lock(&sched->Lock);
+	sched->Busy[Group]--;
+	pthread_cond_broadcast(&sched->Cond);
+	pthread_mutex_unlock(&sched->Lock);
+}
+
+static bool Backup_Scheduler_Has(Backup_Scheduler* sched, TWPartition* Part) {
+	for (size_t i = 0; i < sched->Jobs.size(); i++) {
+		if (sched->Jobs[i].Part == Part)
+			return true;
+	}
+	return false;
+}
+
+static bool Backup_Scheduler_Failed(Backup_Scheduler* sched) {
+	pthread_mutex_lock(&sched->Lock);
+	bool failed = sched->Failed;
+	pthread_mutex_unlock(&sched->Lock);
+	return failed;
+}
+
+// Starts up to Streams - 1 workers, the backup loop is the last stream
+static void Backup_Scheduler_Start(Backup_Scheduler* sched, int Streams) {
+	int i;
+
+	pthread_mutex_init(&sched->Lock, NULL);
+	pthread_cond_init(&sched->Cond, NULL);
+	sched->Img_Time = 0;
+	sched->Failed = false;
+	if (sched->Jobs.empty())
+		return;
+	if ((size_t) Streams - 1 > sched->Jobs.size())
+		Streams = sched->Jobs.size() + 1;
+	for (i = 1; i < Streams; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Backup_Image_Worker, sched) != 0) {
+			LOGINFO("Unable to create backup thread %i, continuing with %i\n", i, i - 1);
+			break;
+		}
+		sched->Workers.push_back(thread);
+	}
+	LOGINFO("Backing up %zu images with %zu threads next to the backup loop\n", sched->Jobs.size(), sched->Workers.size());
+}
+
+// Stops the workers once their jobs are done, or after the running ones if
+// the backup loop failed. The backup loop thread takes jobs that are left.
+static bool Backup_Scheduler_Finish(Backup_Scheduler* sched, bool Loop_Failed) {
+	size_t i;
+
+	pthread_mutex_lock(&sched->Lock);
+	if (Loop_Failed)
+		sched->Failed = true;
+	pthread_mutex_unlock(&sched->Lock);
+	if (!Loop_Failed && !sched->Jobs.empty()) {
+		twrpPerfProfile::Get()->Enter(PERF_BACKUP);
+		Backup_Image_Worker(sched);
+		twrpPerfProfile::Get()->Leave(PERF_BACKUP);
+	}
+	for (i = 0; i < sched->Workers.size(); i++)
+		pthread_join(sched->Workers[i], NULL);
+	sched->Workers.clear();
+	pthread_cond_destroy(&sched->Cond);
+	pthread_mutex_destroy(&sched->Lock);
+	return !sched->Failed;
+}
+
 int TWPartitionManager::Run_Backup(bool adbbackup) {
 	PartitionSettings part_settings;
-	int partition_count = 0, disable_free_space_check = 0, skip_digest = 0;
-	string Backup_Name, Backup_List, backup_path;
+	twrpPerfReport report("backup");
+	int partition_count = 0, disable_free_space_check = 0, skip_digest = 0, incremental = 0, dedup = 0, sparse = 0, write_index = 0, io_streams = 1;
+	int use_compression = 0, compress_images = 0;
+	string Backup_Name, Backup_List, backup_path, Compression_Type;
+	Archive_Type Codec;
+	Backup_Scheduler sched;
 	unsigned long long total_bytes = 0, free_space = 0;
 	TWPartition* storage = NULL;
 	std::vector<TWPartition*>::iterator subpart;
+	std::vector<TWPartition*>::iterator part_iter;
 	struct tm *t;
 	time_t seconds, total_start, total_stop;
 	size_t start_pos = 0, end_pos = 0;
@@ -803,11 +1115,35 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 	part_settings.file_time = 0;
 	part_settings.img_bytes = 0;
 	part_settings.file_bytes = 0;
+	part_settings.report = &report;
 	part_settings.PM_Method = PM_BACKUP;
 
 	part_settings.adbbackup = adbbackup;
 	time(&total_start);
-
+	report.Setting(TW_USE_COMPRESSION_VAR);
+	report.Setting(TW_COMPRESSION_TYPE_VAR);
+	report.Setting(TW_ZSTD_LEVEL_VAR);
+	report.Setting(TW_BACKUP_THREADS_VAR);
+	report.Setting(TW_BACKUP_IO_STREAMS_VAR);
+	report.Setting(TW_BACKUP_READ_ORDER_VAR);
+	report.Setting(TW_INCREMENTAL_BACKUP_VAR);
+	report.Setting(TW_DEDUP_BACKUP_VAR);
+	report.Setting(TW_SPARSE_BACKUP_VAR);
+	report.Setting(TW_COMPRESS_IMAGES_VAR);
+	report.Setting(TW_BACKUP_INDEX_VAR);
+	report.Setting(TW_BACKUP_AUTO_TUNE_VAR);
+	report.Setting(TW_SKIP_DIGEST_GENERATE_VAR);
+	report.Setting(TW_RAW_DIRECT_IO_VAR);
+	report.Setting("tw_encrypt_backup");
+	report.Setting(TW_ENCRYPT_LEGACY_VAR);
+	report.Setting("tw_enable_adb_backup");
+
+	// The tar lists come from the size scans, which must not miss files
+	// that came in through MTP, adb or the terminal while mounted
+	for (part_iter = Partitions.begin(); part_iter != Partitions.end(); part_iter++) {
+		if ((*part_iter)->Is_Mounted())
+			(*part_iter)->Invalidate_Size();
+	}
 	Update_System_Details();
 
 	if (!Mount_Current_Storage(true))
@@ -818,6 +1154,36 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		part_settings.generate_digest = true;
 	else
 		part_settings.generate_digest = false;
+	part_settings.digest_written = false;
+
+	DataManager::GetValue(TW_INCREMENTAL_BACKUP_VAR, incremental);
+	part_settings.incremental = (incremental != 0 && !adbbackup);
+	DataManager::GetValue(TW_DEDUP_BACKUP_VAR, dedup);
+	part_settings.dedup = (dedup != 0 && !adbbackup);
+	DataManager::GetValue(TW_SPARSE_BACKUP_VAR, sparse);
+	part_settings.sparse = (sparse != 0 && !adbbackup);
+	// Images that are not sparse or in the chunk store use the codec of the archives
+	DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
+	DataManager::GetValue(TW_COMPRESS_IMAGES_VAR, compress_images);
+	DataManager::GetValue(TW_COMPRESSION_TYPE_VAR, Compression_Type);
+	if (Compression_Type == "zstd")
+		Codec = COMPRESSED_ZSTD;
+	else if (Compression_Type == "lz4")
+		Codec = COMPRESSED_LZ4;
+	else
+		Codec = COMPRESSED;
+	// The GUI only lists the codecs of this build, but settings saved by
+	// another build or set by a script can still name a missing one
+	if (use_compression && !adbbackup && !twrpCompress_Supported(Codec))
+		gui_msg(Msg(msg::kWarning, "compression_fallback={1} compression is not supported by this TWRP build, using gzip")(Compression_Type));
+	part_settings.image_compression = UNCOMPRESSED;
+	if (use_compression && compress_images && !adbbackup && !part_settings.dedup)
+		part_settings.image_compression = Codec;
+	DataManager::GetValue(TW_BACKUP_INDEX_VAR, write_index);
+	part_settings.write_index = (write_index != 0 && !adbbackup);
+	part_settings.backup_threads = 0;
+	part_settings.zstd_level = 0;
+	part_settings.rw_block_size = 0;
 
 	DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, part_settings.Backup_Folder);
 	DataManager::GetValue(TW_BACKUP_NAME, Backup_Name);
@@ -872,7 +1238,10 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		return false;
 	}
 	if (adbbackup) {
-		if (twadbbu::Write_ADB_Stream_Header(partition_count) == false) {
+		int adb_compression;
+
+		DataManager::GetValue(TW_ADB_COMPRESSION_VAR, adb_compression);
+		if (twadbbu::Write_ADB_Stream_Header(partition_count, adb_compression) == false) {
 			return false;
 		}
 	}
@@ -891,6 +1260,18 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		return false;
 	}
 
+	// What the storage benchmark found best for this storage
+	if (!adbbackup && DataManager::GetIntValue(TW_BACKUP_AUTO_TUNE_VAR) != 0) {
+		twrpStorageBenchResult bench;
+		if (twrpStorageBench::Load(storage->Mount_Point, &bench)) {
+			part_settings.backup_threads = bench.Streams;
+			part_settings.zstd_level = bench.Zstd_Level;
+			part_settings.rw_block_size = bench.Block_Size;
+			LOGINFO("Tuned for %s from its benchmark: %u threads, zstd level %i, %uKB writes\n", storage->Mount_Point.c_str(),
+				bench.Streams, bench.Zstd_Level, bench.Block_Size / 1024);
+		}
+	}
+
 	DataManager::GetValue(TW_DISABLE_FREE_SPACE_VAR, disable_free_space_check);
 
 	if (adbbackup)
@@ -912,25 +1293,85 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		gui_err("fail_backup_folder=Failed to make backup folder.");
 		return false;
 	}
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	if (!adbbackup && DataManager::GetIntValue("tw_encrypt_backup") != 0) {
+		// Lets a restore check the password before it touches the archives
+		string Password;
+		DataManager::GetValue("tw_backup_password", Password);
+		if (!Password.empty() && !twrpKeyCheck_Write(part_settings.Backup_Folder, Password))
+			LOGINFO("No key check record for this backup, restores will try the archives\n");
+	}
+#endif
 
 	DataManager::SetProgress(0.0);
 
+	// Images are backed up next to the backup loop. The adb stream and the
+	// chunk store of deduplicated backups take one writer at a time.
+	sched.Settings = part_settings;
+	sched.Progress = &progress;
+	DataManager::GetValue(TW_BACKUP_IO_STREAMS_VAR, io_streams);
+	if (io_streams > 1 && !adbbackup && !part_settings.dedup) {
+		start_pos = 0;
+		end_pos = Backup_List.find(";", start_pos);
+		while (end_pos != string::npos && start_pos < Backup_List.size()) {
+			backup_path = Backup_List.substr(start_pos, end_pos - start_pos);
+			TWPartition* part = Find_Partition_By_Path(backup_path);
+			if (part != NULL && part->Backup_Method == BM_DD && !part->Has_SubPartition) {
+				Backup_Image_Job job;
+				job.Part = part;
+				job.Group = twrpIoScheduler::Get()->Group(part->Actual_Block_Device);
+				job.Started = false;
+				if (job.Group != NULL)
+					sched.Jobs.push_back(job);
+			}
+			start_pos = end_pos + 1;
+			end_pos = Backup_List.find(";", start_pos);
+		}
+	}
+	Backup_Scheduler_Start(&sched, io_streams);
+
 	start_pos = 0;
 	end_pos = Backup_List.find(";", start_pos);
 	while (end_pos != string::npos && start_pos < Backup_List.size()) {
-		if (stop_backup.get_value() != 0)
+		if (stop_backup.get_value() != 0) {
+			Backup_Scheduler_Finish(&sched, true);
 			return -1;
+		}
+		if (Backup_Scheduler_Failed(&sched))
+			break;
 		backup_path = Backup_List.substr(start_pos, end_pos - start_pos);
 		part_settings.Part = Find_Partition_By_Path(backup_path);
 		if (part_settings.Part != NULL) {
-			if (!Backup_Partition(&part_settings))
-				return false;
+			if (!Backup_Scheduler_Has(&sched, part_settings.Part)) {
+				twrpIoGroup* group = NULL;
+				if (!sched.Jobs.empty())
+					group = twrpIoScheduler::Get()->Group(part_settings.Part->Actual_Block_Device);
+				Backup_Scheduler_Acquire(&sched, group);
+				bool backed_up = Backup_Partition(&part_settings);
+				Backup_Scheduler_Release(&sched, group);
+				if (!backed_up) {
+					// Backup_Partition cleaned the folder before the workers stopped
+					Backup_Scheduler_Finish(&sched, true);
+					Clean_Backup_Folder(part_settings.Backup_Folder);
+					return false;
+				}
+			}
 		} else {
 			gui_msg(Msg(msg::kError, "unable_to_locate_partition=Unable to locate '{1}' partition for backup calculations.")(backup_path));
 		}
 		start_pos = end_pos + 1;
 		end_pos = Backup_List.find(";", start_pos);
 	}
+	if (!Backup_Scheduler_Finish(&sched, false)) {
+		string backup_log = part_settings.Backup_Folder + "/recovery.log";
+		Clean_Backup_Folder(part_settings.Backup_Folder);
+		twrpLog::Flush();
+		TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
+		tw_set_default_metadata(backup_log.c_str());
+		return false;
+	}
+	part_settings.img_time += sched.Img_Time;
+	progress.UpdateDisplayDetails(true);
 
 	// Average BPS
 	if (part_settings.img_time == 0)
@@ -956,7 +1397,7 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		actual_backup_size = part_settings.file_bytes + part_settings.img_bytes;
 	actual_backup_size /= (1024LLU * 1024LLU);
 
-	int prev_img_bps = 0, use_compression = 0;
+	int prev_img_bps = 0;
 	unsigned long long prev_file_bps = 0;
 	DataManager::GetValue(TW_BACKUP_AVG_IMG_RATE, prev_img_bps);
 	img_bps += (prev_img_bps * 4);
@@ -977,10 +1418,18 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		DataManager::SetValue(TW_BACKUP_AVG_FILE_RATE, file_bps);
 
 	gui_msg(Msg("total_backed_size=[{1} MB TOTAL BACKED UP]")(actual_backup_size));
-	Update_System_Details();
+	if (part_settings.dedup) {
+		// Drop the chunks of backups that were deleted since the last deduplicated backup
+		if (!twrpChunk_Collect_Garbage(TWFunc::Get_Path(part_settings.Backup_Folder)))
+			gui_msg(Msg(msg::kWarning, "dedup_cleanup_err=Unable to clean up unused chunks of deleted backups"));
+	}
+	Invalidate_Size_By_Path(part_settings.Backup_Folder);
+	Operation_System_Details();
 	UnMount_Main_Partitions();
 	gui_msg(Msg(msg::kHighlight, "backup_completed=[BACKUP COMPLETED IN {1} SECONDS]")(total_time)); // the end
+	report.Write(adbbackup ? "" : part_settings.Backup_Folder);
 	string backup_log = part_settings.Backup_Folder + "/recovery.log";
+	twrpLog::Flush();
 	TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
 	tw_set_default_metadata(backup_log.c_str());
 
@@ -1004,14 +1453,17 @@ bool TWPartitionManager::Restore_Partition(PartitionSettings *part_settings) {
 		part_settings->Part->Set_Backup_FileName(part_settings->Part->Backup_Name + "." + part_settings->Part->Current_File_System + ".win");
 	}
 
-	TWFunc::SetPerformanceMode(true);
+	twrpPerfProfile::Get()->Enter(PERF_RESTORE);
 
 	time(&Start);
 
+	Report_Begin(part_settings);
 	if (!part_settings->Part->Restore(part_settings)) {
-		TWFunc::SetPerformanceMode(false);
+		Report_End(part_settings, 0, false);
+		twrpPerfProfile::Get()->Leave(PERF_RESTORE);
 		return false;
 	}
+	Report_End(part_settings, part_settings->Part->Restore_Size, true);
 	if (part_settings->Part->Has_SubPartition && !part_settings->adbbackup) {
 		std::vector<TWPartition*>::iterator subpart;
 		TWPartition *parentPart = part_settings->Part;
@@ -1021,15 +1473,18 @@ bool TWPartitionManager::Restore_Partition(PartitionSettings *part_settings) {
 			if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == parentPart->Mount_Point) {
 				part_settings->Part = (*subpart);
 				part_settings->Part->Set_Backup_FileName(part_settings->Part->Backup_Name + "." + part_settings->Part->Current_File_System + ".win");
+				Report_Begin(part_settings);
 				if (!(*subpart)->Restore(part_settings)) {
-					TWFunc::SetPerformanceMode(false);
+					Report_End(part_settings, 0, false);
+					twrpPerfProfile::Get()->Leave(PERF_RESTORE);
 					return false;
 				}
+				Report_End(part_settings, (*subpart)->Restore_Size, true);
 			}
 		}
 	}
 	time(&Stop);
-	TWFunc::SetPerformanceMode(false);
+	twrpPerfProfile::Get()->Leave(PERF_RESTORE);
 	gui_msg(Msg("restore_part_done=[{1} done ({2} seconds)]")(part_settings->Part->Backup_Display_Name)((int)difftime(Stop, Start)));
 
 	return true;
@@ -1037,18 +1492,21 @@ bool TWPartitionManager::Restore_Partition(PartitionSettings *part_settings) {
 
 int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 	PartitionSettings part_settings;
-	int check_digest;
+	twrpPerfReport report("restore");
+	int check_digest, digest_on_extract = 0;
 
 	time_t rStart, rStop;
 	time(&rStart);
 	string Restore_List, restore_path;
 	size_t start_pos = 0, end_pos;
+	std::vector<string> Digest_Files;
 
 	part_settings.Backup_Folder = Restore_Name;
 	part_settings.Part = NULL;
 	part_settings.partition_count = 0;
 	part_settings.total_restore_size = 0;
 	part_settings.adbbackup = false;
+	part_settings.report = &report;
 	part_settings.PM_Method = PM_RESTORE;
 
 	gui_msg("restore_started=[RESTORE STARTED]");
@@ -1057,11 +1515,18 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 	if (!Mount_Current_Storage(true))
 		return false;
 
+	report.Setting(TW_SKIP_DIGEST_CHECK_VAR);
+	report.Setting(TW_DIGEST_ON_EXTRACT_VAR);
+	report.Setting(TW_BACKUP_IO_STREAMS_VAR);
+	report.Setting(TW_RAW_DIRECT_IO_VAR);
 	DataManager::GetValue(TW_SKIP_DIGEST_CHECK_VAR, check_digest);
 	if (check_digest > 0) {
 		// Check Digest files first before restoring to ensure that all of them match before starting a restore
 		TWFunc::GUI_Operation_Text(TW_VERIFY_DIGEST_TEXT, gui_parse_text("{@verifying_digest}"));
 		gui_msg("verifying_digest=Verifying Digest");
+		DataManager::GetValue(TW_DIGEST_ON_EXTRACT_VAR, digest_on_extract);
+		if (digest_on_extract)
+			gui_msg("digest_on_extract=Archives will be verified as they are restored");
 	} else {
 		gui_msg("skip_digest=Skipping Digest check based on user setting.");
 	}
@@ -1079,10 +1544,9 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 					return false;
 				}
 
-				string Full_Filename = part_settings.Backup_Folder + "/" + part_settings.Part->Backup_FileName;
-
-				if (check_digest > 0 && !twrpDigestDriver::Check_Digest(Full_Filename))
-					return false;
+				// File based backups are checked by the tar threads with digest_on_extract
+				if (check_digest > 0 && !(digest_on_extract && part_settings.Part->Backup_Method == BM_FILES))
+					Digest_Files.push_back(part_settings.Backup_Folder + "/" + part_settings.Part->Backup_FileName);
 				part_settings.partition_count++;
 				part_settings.total_restore_size += part_settings.Part->Get_Restore_Size(&part_settings);
 				if (part_settings.Part->Has_SubPartition) {
@@ -1092,8 +1556,8 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 					for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
 						part_settings.Part = *subpart;
 						if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == parentPart->Mount_Point) {
-							if (check_digest > 0 && !twrpDigestDriver::Check_Digest(Full_Filename))
-								return false;
+							if (check_digest > 0 && !(digest_on_extract && (*subpart)->Backup_Method == BM_FILES))
+								Digest_Files.push_back(part_settings.Backup_Folder + "/" + (*subpart)->Backup_FileName);
 							part_settings.total_restore_size += (*subpart)->Get_Restore_Size(&part_settings);
 						}
 					}
@@ -1111,6 +1575,17 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 		return false;
 	}
 
+	// Every archive of every selected partition is checked in one parallel pass
+	if (check_digest > 0 && !Digest_Files.empty()) {
+		uint64_t digest_start = twrpThermal::Now_Usec();
+		report.Begin_Partition("digests", "digest");
+		bool digests_ok = twrpDigestDriver::Check_Digests(Digest_Files);
+		report.Add_Time(TW_PERF_TIME_DIGEST, twrpThermal::Now_Usec() - digest_start);
+		report.End_Partition(0, digests_ok);
+		if (!digests_ok)
+			return false;
+	}
+
 	gui_msg(Msg("restore_part_count=Restoring {1} partitions...")(part_settings.partition_count));
 	gui_msg(Msg("total_restore_size=Total restore size is {1}MB")(part_settings.total_restore_size / 1048576));
 	DataManager::SetProgress(0.0);
@@ -1135,14 +1610,228 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 			end_pos = Restore_List.find(";", start_pos);
 		}
 	}
-	TWFunc::GUI_Operation_Text(TW_UPDATE_SYSTEM_DETAILS_TEXT, gui_parse_text("{@updating_system_details}"));
+	if (!details_held)
+		TWFunc::GUI_Operation_Text(TW_UPDATE_SYSTEM_DETAILS_TEXT, gui_parse_text("{@updating_system_details}"));
 	UnMount_By_Path(Get_Android_Root_Path(), false);
-	Update_System_Details();
+	Operation_System_Details();
 	UnMount_Main_Partitions();
 	time(&rStop);
 	gui_msg(Msg(msg::kHighlight, "restore_completed=[RESTORE COMPLETED IN {1} SECONDS]")((int)difftime(rStop,rStart)));
 	DataManager::SetValue("tw_file_progress", "");
+	// Only in /tmp, the backup being restored is left as it is
+	report.Write("");
+
+	return true;
+}
+
+int TWPartitionManager::Run_Restore_Path(const string& Restore_Name, const string& Path) {
+	PartitionSettings part_settings;
+	std::vector<TWPartition*>::iterator iter;
+	std::vector<string> Paths;
+	string Restore_Path = Path;
+	time_t rStart, rStop;
+
+	time(&rStart);
+	while (Restore_Path.size() > 1 && Restore_Path[Restore_Path.size() - 1] == '/')
+		Restore_Path.resize(Restore_Path.size() - 1);
+	gui_msg("restore_started=[RESTORE STARTED]");
+	gui_msg(Msg("restore_folder=Restore folder: '{1}'")(Restore_Name));
+	if (!Mount_Current_Storage(true))
+		return false;
+	Set_Restore_Files(Restore_Name);
+
+	// The file based backup with the deepest path that holds Path
+	part_settings.Part = NULL;
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		const string& Backup_Path = (*iter)->Backup_Path;
+		if ((*iter)->Backup_Method != BM_FILES || (*iter)->Backup_FileName.empty())
+			continue;
+		if (Restore_Path != Backup_Path && (Restore_Path.size() <= Backup_Path.size() || Restore_Path.compare(0, Backup_Path.size(), Backup_Path) != 0 || Restore_Path[Backup_Path.size()] != '/'))
+			continue;
+		string File = Restore_Name + "/" + (*iter)->Backup_FileName;
+		if (!TWFunc::Path_Exists(File) && !TWFunc::Path_Exists(File + "000"))
+			continue;
+		if (part_settings.Part == NULL || Backup_Path.size() > part_settings.Part->Backup_Path.size())
+			part_settings.Part = *iter;
+	}
+	if (part_settings.Part == NULL) {
+		gui_msg(Msg(msg::kError, "restore_path_no_part=No file based backup in '{1}' holds '{2}'")(Restore_Name)(Restore_Path));
+		return false;
+	}
+	if (part_settings.Part->Mount_Read_Only) {
+		gui_msg(Msg(msg::kError, "restore_read_only=Cannot restore {1} -- mounted read only.")(part_settings.Part->Backup_Display_Name));
+		return false;
+	}
 
+	part_settings.Backup_Folder = Restore_Name;
+	part_settings.partition_count = 1;
+	part_settings.total_restore_size = 0;
+	part_settings.adbbackup = false;
+	part_settings.report = NULL;
+	part_settings.PM_Method = PM_RESTORE;
+	// Only whole archives have digests, the few restored items are not checked
+	gui_msg(Msg("restore_path=Restoring '{1}' from {2}...")(Restore_Path)(part_settings.Part->Backup_Display_Name));
+	Paths.push_back(Restore_Path);
+	if (!part_settings.Part->Restore_Paths(&part_settings, Paths))
+		return false;
+	UnMount_Main_Partitions();
+	time(&rStop);
+	gui_msg(Msg(msg::kHighlight, "restore_completed=[RESTORE COMPLETED IN {1} SECONDS]")((int)difftime(rStop,rStart)));
+	return true;
+}
+
+int TWPartitionManager::Run_Verify(const string& Backup_Folder) {
+	PartitionSettings part_settings;
+	std::vector<TWPartition*> Verify_Parts;
+	std::vector<string> Digest_Files, Archive_Files;
+	string Verify_List, verify_path;
+	size_t start_pos = 0, end_pos, i;
+	unsigned long long Archive_Size = 0;
+	int check_digest, passes = 1;
+	bool ret = true;
+
+	part_settings.Backup_Folder = Backup_Folder;
+	part_settings.Part = NULL;
+	part_settings.partition_count = 0;
+	part_settings.total_restore_size = 0;
+	part_settings.adbbackup = false;
+	part_settings.report = NULL;
+	part_settings.PM_Method = PM_RESTORE;
+
+	gui_msg("verify_started=[VERIFY STARTED]");
+	gui_msg(Msg("restore_folder=Restore folder: '{1}'")(Backup_Folder));
+	if (!Mount_Current_Storage(true))
+		return false;
+	Set_Restore_Files(Backup_Folder);
+	DataManager::GetValue("tw_restore_list", Verify_List);
+	if (Verify_List == "ADB_Backup;") {
+		gui_err("verify_adb=ADB backups can't be verified on the device.");
+		return false;
+	}
+	if (DataManager::GetIntValue("tw_restore_encrypted") != 0 && DataManager::GetStrValue("tw_restore_password").empty()) {
+		gui_err("verify_encrypt_err=Enter the password of the encrypted backup to verify it.");
+		return false;
+	}
+
+	// Every partition in the folder, the subpartitions after their parent
+	end_pos = Verify_List.find(";", start_pos);
+	while (end_pos != string::npos && start_pos < Verify_List.size()) {
+		verify_path = Verify_List.substr(start_pos, end_pos - start_pos);
+		part_settings.Part = Find_Partition_By_Path(verify_path);
+		if (part_settings.Part != NULL) {
+			Verify_Parts.push_back(part_settings.Part);
+			if (part_settings.Part->Has_SubPartition) {
+				std::vector<TWPartition*>::iterator subpart;
+
+				for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
+					if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == part_settings.Part->Mount_Point)
+						Verify_Parts.push_back(*subpart);
+				}
+			}
+		} else {
+			gui_msg(Msg(msg::kError, "restore_unable_locate=Unable to locate '{1}' partition for restoring.")(verify_path));
+		}
+		start_pos = end_pos + 1;
+		end_pos = Verify_List.find(";", start_pos);
+	}
+	if (Verify_Parts.empty()) {
+		gui_err("no_part_verify=No backups found to verify.");
+		return false;
+	}
+	for (i = 0; i < Verify_Parts.size(); i++) {
+		Digest_Files.push_back(Backup_Folder + "/" + Verify_Parts[i]->Backup_FileName);
+		twrpDigestDriver::List_Archive_Files(Digest_Files.back(), &Archive_Files);
+	}
+	for (i = 0; i < Archive_Files.size(); i++)
+		Archive_Size += TWFunc::Get_File_Size(Archive_Files[i]);
+	part_settings.partition_count = Verify_Parts.size();
+
+	twrpPerfProfile::Get()->Enter(PERF_RESTORE);
+	uint64_t verify_start = twrpThermal::Now_Usec();
+
+	// Every archive of every partition in one parallel pass, the tree
+	// digests are checked chunk by chunk
+	DataManager::GetValue(TW_SKIP_DIGEST_CHECK_VAR, check_digest);
+	if (check_digest > 0) {
+		TWFunc::GUI_Operation_Text(TW_VERIFY_DIGEST_TEXT, gui_parse_text("{@verifying_digest}"));
+		gui_msg("verifying_digest=Verifying Digest");
+		ret = twrpDigestDriver::Check_Digests(Digest_Files);
+		passes++;
+	} else {
+		gui_msg("skip_digest=Skipping Digest check based on user setting.");
+	}
+
+	if (ret) {
+		for (i = 0; i < Verify_Parts.size(); i++)
+			part_settings.total_restore_size += Verify_Parts[i]->Get_Restore_Size(&part_settings);
+		DataManager::SetProgress(0.0);
+		ProgressTracking progress(part_settings.total_restore_size);
+		part_settings.progress = &progress;
+		for (i = 0; i < Verify_Parts.size() && ret; i++) {
+			uint64_t part_start = twrpThermal::Now_Usec();
+
+			part_settings.Part = Verify_Parts[i];
+			if (!Verify_Parts[i]->Verify_Backup(&part_settings)) {
+				gui_msg(Msg(msg::kError, "verify_part_fail=Backup of {1} failed to verify.")(Verify_Parts[i]->Backup_Display_Name));
+				ret = false;
+			} else if (Verify_Parts[i]->Backup_Method == BM_FILES) {
+				LOGINFO("Verified %s in %.1fs\n", Verify_Parts[i]->Backup_Display_Name.c_str(), (twrpThermal::Now_Usec() - part_start) / 1000000.0);
+			}
+		}
+		DataManager::SetValue("tw_file_progress", "");
+	}
+
+	double secs = (twrpThermal::Now_Usec() - verify_start) / 1000000.0;
+	twrpPerfProfile::Get()->Leave(PERF_RESTORE);
+	if (!ret)
+		return false;
+	// The digest pass and the tar pass each read all of the archives
+	gui_msg(Msg(msg::kHighlight, "verify_completed=[VERIFY COMPLETED IN {1} SECONDS]")((int)secs));
+	gui_msg(Msg("verify_rate=Read {1}MB of archives {2} times at {3}MB/s")(Archive_Size / 1048576)(passes)(secs > 0 ? (int)(Archive_Size * passes / 1048576 / secs) : 0));
+	return true;
+}
+
+bool TWPartitionManager::Run_Storage_Benchmark() {
+	std::vector<TWPartition*>::iterator iter;
+	string fastest;
+	uint64_t fastest_rate = 0;
+	bool ret = false;
+
+	gui_msg("bench_started=[STORAGE BENCHMARK STARTED]");
+	// Under the same CPU and writeback settings as a backup
+	twrpPerfProfile::Get()->Enter(PERF_BACKUP);
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		TWPartition* storage = *iter;
+		twrpStorageBenchResult result;
+
+		if (!storage->Is_Storage || !storage->Is_Present || !storage->Mount(false))
+			continue;
+		storage->Update_Size(false);
+		gui_msg(Msg("bench_storage=Benchmarking {1}...")(storage->Storage_Name));
+		if (!twrpStorageBench::Run(storage->Storage_Path, storage->Free, &result)) {
+			gui_msg(Msg(msg::kWarning, "bench_fail=Unable to benchmark {1}, it may be full.")(storage->Storage_Name));
+			continue;
+		}
+		gui_msg(Msg("bench_result= * Write {1}MB/s, read {2}MB/s, {3} files/s created, {4} files/s read")
+			(result.Write_Rate / 1048576)(result.Read_Rate / 1048576)(result.Create_Rate)(result.File_Read_Rate));
+		gui_msg(Msg("bench_tune= * Backups will use {1} threads and {2}KB writes")(result.Streams)(result.Block_Size / 1024));
+		if (result.Zstd_Level > 0)
+			gui_msg(Msg("bench_zstd= * zstd level {1} keeps up with the writes")(result.Zstd_Level));
+		if (!twrpStorageBench::Save(storage->Mount_Point, result))
+			LOGINFO("Unable to save the benchmark of %s\n", storage->Mount_Point.c_str());
+		if (result.Write_Rate > fastest_rate) {
+			fastest_rate = result.Write_Rate;
+			fastest = storage->Storage_Name;
+		}
+		ret = true;
+	}
+	twrpPerfProfile::Get()->Leave(PERF_BACKUP);
+	if (!ret) {
+		gui_err("bench_none=No storage could be benchmarked.");
+		return false;
+	}
+	gui_msg(Msg("bench_fastest=Fastest backup storage: {1}")(fastest));
+	gui_msg(Msg(msg::kHighlight, "bench_completed=[STORAGE BENCHMARK COMPLETED]"));
 	return true;
 }
 
@@ -1267,27 +1956,63 @@ void TWPartitionManager::Set_Restore_Files(string Restore_Name) {
 
 int TWPartitionManager::Wipe_By_Path(string Path) {
 	std::vector<TWPartition*>::iterator iter;
-	int ret = false;
-	bool found = false;
-	string Local_Path = TWFunc::Get_Root_Path(Path);
+	std::vector<TWPartition*> parts;
+	std::vector<bool> andsec, results;
+	std::vector<string> paths;
+	std::vector<size_t> main_parts;
+	std::vector<string> main_paths;
+	int ret = true;
+	size_t i, j;
 
-	// Iterate through all partitions
-	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		if ((*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path)) {
-			if (Path == "/and-sec")
-				ret = (*iter)->Wipe_AndSec();
-			else
-				ret = (*iter)->Wipe();
-			found = true;
-		} else if ((*iter)->Is_SubPartition && (*iter)->SubPartition_Of == Local_Path) {
-			(*iter)->Wipe();
+	// Several paths separated by ; are wiped together
+	paths = TWFunc::Split_String(Path, ";");
+	if (paths.empty())
+		paths.push_back(Path);
+	for (i = 0; i < paths.size(); i++) {
+		bool found = false;
+		string Local_Path = TWFunc::Get_Root_Path(paths[i]);
+
+		// Iterate through all partitions
+		for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+			if ((*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path)) {
+				bool wipe_andsec = paths[i] == "/and-sec";
+				for (j = 0; j < parts.size(); j++) {
+					if (parts[j] == *iter && andsec[j] == wipe_andsec)
+						break;
+				}
+				if (j == parts.size()) {
+					parts.push_back(*iter);
+					andsec.push_back(wipe_andsec);
+				}
+				main_parts.push_back(j);
+				main_paths.push_back(Local_Path);
+				found = true;
+			} else if ((*iter)->Is_SubPartition && (*iter)->SubPartition_Of == Local_Path) {
+				if (std::find(parts.begin(), parts.end(), *iter) == parts.end()) {
+					parts.push_back(*iter);
+					andsec.push_back(false);
+				}
+			}
+		}
+		if (!found) {
+			gui_msg(Msg(msg::kError, "unable_find_part_path=Unable to find partition for path '{1}'")(Local_Path));
+			ret = false;
 		}
 	}
-	if (found) {
-		return ret;
-	} else
-		gui_msg(Msg(msg::kError, "unable_find_part_path=Unable to find partition for path '{1}'")(Local_Path));
-	return false;
+	if (parts.empty())
+		return false;
+
+	// Sub-partitions are wiped along, but only the partitions that were
+	// asked for count for the result
+	results = Wipe_Partitions(parts, andsec);
+	for (j = 0; j < main_parts.size(); j++) {
+		if (!results[main_parts[j]]) {
+			if (paths.size() > 1)
+				gui_msg(Msg(msg::kError, "unable_to_wipe=Unable to wipe {1}.")(main_paths[j]));
+			ret = false;
+		}
+	}
+	return ret;
 }
 
 int TWPartitionManager::Wipe_By_Path(string Path, string New_File_System) {
@@ -1315,9 +2040,13 @@ int TWPartitionManager::Wipe_By_Path(string Path, string New_File_System) {
 	return false;
 }
 
-int TWPartitionManager::Factory_Reset(void) {
+int TWPartitionManager::Factory_Reset(const string& Also_Wipe) {
 	std::vector<TWPartition*>::iterator iter;
+	std::vector<TWPartition*> parts;
+	std::vector<bool> andsec, results;
+	std::vector<string> paths;
 	int ret = true;
+	size_t i;
 
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if ((*iter)->Wipe_During_Factory_Reset && (*iter)->Is_Present) {
@@ -1325,15 +2054,37 @@ int TWPartitionManager::Factory_Reset(void) {
 			if ((*iter)->Mount_Point == "/data") {
 				if (!(*iter)->Wipe_Encryption())
 					ret = false;
-			} else {
-#endif
-				if (!(*iter)->Wipe())
-					ret = false;
-#ifdef TW_OEM_BUILD
+				continue;
 			}
 #endif
+			parts.push_back(*iter);
+			andsec.push_back(false);
 		} else if ((*iter)->Has_Android_Secure) {
-			if (!(*iter)->Wipe_AndSec())
+			parts.push_back(*iter);
+			andsec.push_back(true);
+		}
+	}
+	paths = TWFunc::Split_String(Also_Wipe, ";");
+	for (i = 0; i < paths.size(); i++) {
+		TWPartition* Part = Find_Partition_By_Path(paths[i]);
+		if (Part == NULL) {
+			gui_msg(Msg(msg::kError, "unable_find_part_path=Unable to find partition for path '{1}'")(paths[i]));
+			ret = false;
+		} else {
+			size_t j;
+			for (j = 0; j < parts.size() && !(parts[j] == Part && !andsec[j]); j++)
+				;
+			if (j == parts.size()) {
+				parts.push_back(Part);
+				andsec.push_back(false);
+			}
+		}
+	}
+	// Partitions on different block devices are wiped at once
+	if (!parts.empty()) {
+		results = Wipe_Partitions(parts, andsec);
+		for (i = 0; i < results.size(); i++) {
+			if (!results[i])
 				ret = false;
 		}
 	}
@@ -1347,6 +2098,7 @@ int TWPartitionManager::Wipe_Dalvik_Cache(void) {
 
 	if (!Mount_By_Path("/data", true))
 		return false;
+	Invalidate_Size_By_Path("/data");
 
 	dir.push_back("/data/dalvik-cache");
 
@@ -1357,6 +2109,7 @@ int TWPartitionManager::Wipe_Dalvik_Cache(void) {
 		}
 		dir.push_back(cacheDir + "dalvik-cache");
 		dir.push_back(cacheDir + "/dc");
+		Invalidate_Size_By_Path(NON_AB_CACHE_DIR);
 	}
 
 	TWPartition* sdext = Find_Partition_By_Path("/sd-ext");
@@ -1365,6 +2118,7 @@ int TWPartitionManager::Wipe_Dalvik_Cache(void) {
 		if (stat("/sd-ext/dalvik-cache", &st) == 0)
 		{
 			dir.push_back("/sd-ext/dalvik-cache");
+			sdext->Invalidate_Size();
 		}
 	}
 
@@ -1392,6 +2146,7 @@ int TWPartitionManager::Wipe_Dalvik_Cache(void) {
 int TWPartitionManager::Wipe_Rotate_Data(void) {
 	if (!Mount_By_Path("/data", true))
 		return false;
+	Invalidate_Size_By_Path("/data");
 
 	unlink("/data/misc/akmd*");
 	unlink("/data/misc/rild*");
@@ -1404,6 +2159,7 @@ int TWPartitionManager::Wipe_Battery_Stats(void) {
 
 	if (!Mount_By_Path("/data", true))
 		return false;
+	Invalidate_Size_By_Path("/data");
 
 	if (0 != stat("/data/system/batterystats.bin", &st)) {
 		gui_print("No Battery Stats Found. No Need To Wipe.\n");
@@ -1460,6 +2216,7 @@ int TWPartitionManager::Wipe_Media_From_Data(void) {
 		if (!dat->Mount(true))
 			return false;
 
+		dat->Invalidate_Size();
 		gui_msg("wiping_datamedia=Wiping internal storage -- /data/media...");
 		Remove_MTP_Storage(dat->MTP_Storage_ID);
 		TWFunc::removeDir("/data/media", false);
@@ -1473,32 +2230,225 @@ int TWPartitionManager::Wipe_Media_From_Data(void) {
 	return false;
 }
 
-int TWPartitionManager::Repair_By_Path(string Path, bool Display_Error) {
-	std::vector<TWPartition*>::iterator iter;
-	int ret = false;
-	bool found = false;
-	string Local_Path = TWFunc::Get_Root_Path(Path);
+struct Partition_Job {
+	TWPartition* Part;
+	string Block_Device;
+	twrpIoGroup* Group;                                                       // Disk the partition is on, NULL if unknown
+	unsigned long long Size;                                                  // Share of the progress bar
+	unsigned long long Shown;                                                 // Part of Size already added to the progress bar
+	bool Started;
+	bool Ret;
+};
+
+// Repairs or wipes that run at once on worker threads. A disk is worked on
+// by no more jobs at a time than its twrpIoScheduler lanes, and one block
+// device by a single job.
+struct Partition_Scheduler {
+	std::vector<Partition_Job> Jobs;
+	std::map<twrpIoGroup*, unsigned> Busy;                                    // Jobs running on each disk
+	std::vector<string> Devices;                                              // Block devices being worked on
+	std::function<bool(size_t, const twrpFsProgress&)> Work;                  // Called with the index of the job
+	ProgressTracking* Progress;
+	size_t Left;                                                              // Jobs not finished yet
+	pthread_mutex_t Lock;
+	pthread_cond_t Cond;
+};
+
+static bool Partition_Job_Ready(Partition_Scheduler* sched, Partition_Job* job) {
+	if (std::find(sched->Devices.begin(), sched->Devices.end(), job->Block_Device) != sched->Devices.end())
+		return false;
+	return job->Group == NULL || sched->Busy[job->Group] < twrpIoScheduler::Get()->Lanes(job->Group);
+}
 
-	if (Local_Path == "/tmp" || Local_Path == "/")
-		return true;
+static void* Partition_Job_Worker(void *cookie) {
+	Partition_Scheduler* sched = (Partition_Scheduler*) cookie;
 
-	// Iterate through all partitions
-	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		if ((*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path)) {
-			ret = (*iter)->Repair();
-			found = true;
-		} else if ((*iter)->Is_SubPartition && (*iter)->SubPartition_Of == Local_Path) {
-			(*iter)->Repair();
+	pthread_mutex_lock(&sched->Lock);
+	for (;;) {
+		Partition_Job* job = NULL;
+		bool waiting = false;
+		for (size_t i = 0; i < sched->Jobs.size() && job == NULL; i++) {
+			if (sched->Jobs[i].Started)
+				continue;
+			if (Partition_Job_Ready(sched, &sched->Jobs[i]))
+				job = &sched->Jobs[i];
+			else
+				waiting = true;
 		}
-	}
-	if (found) {
-		return ret;
-	} else if (Display_Error) {
-		gui_msg(Msg(msg::kError, "unable_find_part_path=Unable to find partition for path '{1}'")(Local_Path));
+		if (job == NULL) {
+			if (!waiting)
+				break;
+			pthread_cond_wait(&sched->Cond, &sched->Lock);
+			continue;
+		}
+		job->Started = true;
+		if (job->Group)
+			sched->Busy[job->Group]++;
+		sched->Devices.push_back(job->Block_Device);
+		pthread_mutex_unlock(&sched->Lock);
+
+		job->Ret = sched->Work(job - &sched->Jobs[0], [sched, job](float done) {
+			unsigned long long now = job->Size * done;
+			if (now > job->Shown) {
+				sched->Progress->AddBackgroundSize(now - job->Shown);
+				job->Shown = now;
+			}
+		});
+		if (job->Shown < job->Size)
+			sched->Progress->AddBackgroundSize(job->Size - job->Shown);
+
+		pthread_mutex_lock(&sched->Lock);
+		if (job->Group)
+			sched->Busy[job->Group]--;
+		sched->Devices.erase(std::find(sched->Devices.begin(), sched->Devices.end(), job->Block_Device));
+		sched->Left--;
+		pthread_cond_broadcast(&sched->Cond);
+	}
+	pthread_mutex_unlock(&sched->Lock);
+	return NULL;
+}
+
+std::vector<bool> TWPartitionManager::Run_Partition_Jobs(const std::vector<TWPartition*>& Parts, const std::function<bool(size_t, const twrpFsProgress&)>& Work, const char* Verb) {
+	Partition_Scheduler sched;
+	std::vector<pthread_t> workers;
+	std::vector<bool> ret;
+	unsigned long long total = 0;
+	size_t i, threads;
+	timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < Parts.size(); i++) {
+		Partition_Job job;
+		Parts[i]->Find_Actual_Block_Device();
+		job.Part = Parts[i];
+		job.Block_Device = Parts[i]->Actual_Block_Device;
+		job.Group = twrpIoScheduler::Get()->Group(job.Block_Device);
+		job.Size = Parts[i]->Size ? Parts[i]->Size : 1;
+		job.Shown = 0;
+		job.Started = false;
+		job.Ret = false;
+		total += job.Size;
+		sched.Jobs.push_back(job);
+	}
+	ProgressTracking progress(total);
+	sched.Work = Work;
+	sched.Progress = &progress;
+	sched.Left = sched.Jobs.size();
+	pthread_mutex_init(&sched.Lock, NULL);
+	pthread_cond_init(&sched.Cond, NULL);
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = std::min(sched.Jobs.size(), (size_t) (cores > 1 ? cores : 1));
+	for (i = 0; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Partition_Job_Worker, &sched) != 0) {
+			LOGINFO("Unable to create %s thread %zu, continuing with %zu\n", Verb, i, i);
+			break;
+		}
+		workers.push_back(thread);
+	}
+	if (workers.empty()) {
+		Partition_Job_Worker(&sched);
 	} else {
-		LOGINFO("Repair: Unable to find partition for path '%s'\n", Local_Path.c_str());
+		pthread_mutex_lock(&sched.Lock);
+		while (sched.Left) {
+			timespec wake;
+			clock_gettime(CLOCK_REALTIME, &wake);
+			wake.tv_nsec += 250000000;
+			if (wake.tv_nsec >= 1000000000) {
+				wake.tv_sec++;
+				wake.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&sched.Cond, &sched.Lock, &wake);
+			pthread_mutex_unlock(&sched.Lock);
+			progress.UpdateDisplayDetails(false);
+			pthread_mutex_lock(&sched.Lock);
+		}
+		pthread_mutex_unlock(&sched.Lock);
+		for (i = 0; i < workers.size(); i++)
+			pthread_join(workers[i], NULL);
+	}
+	progress.UpdateDisplayDetails(true);
+	pthread_cond_destroy(&sched.Cond);
+	pthread_mutex_destroy(&sched.Lock);
+
+	for (i = 0; i < sched.Jobs.size(); i++)
+		ret.push_back(sched.Jobs[i].Ret);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	LOGINFO("Ran %s on %zu partitions with %zu threads in %i ms\n", Verb, Parts.size(), workers.size() ? workers.size() : 1, TWFunc::timespec_diff_ms(start, end));
+	return ret;
+}
+
+std::vector<bool> TWPartitionManager::Repair_Partitions(const std::vector<TWPartition*>& Parts) {
+	return Run_Partition_Jobs(Parts, [&Parts](size_t i, const twrpFsProgress& Progress) {
+		return Parts[i]->Repair(Progress);
+	}, "repair");
+}
+
+std::vector<bool> TWPartitionManager::Wipe_Partitions(const std::vector<TWPartition*>& Parts, const std::vector<bool>& AndSec) {
+	return Run_Partition_Jobs(Parts, [&Parts, &AndSec](size_t i, const twrpFsProgress& Progress) {
+		bool ret;
+
+		if (AndSec[i])
+			return Parts[i]->Wipe_AndSec();
+		// mkfs progress goes to the shared progress bar, not one of its own
+		Parts[i]->Wipe_Progress = Progress;
+		ret = Parts[i]->Wipe();
+		Parts[i]->Wipe_Progress = twrpFsProgress();
+		return ret;
+	}, "wipe");
+}
+
+int TWPartitionManager::Repair_By_Path(string Path, bool Display_Error) {
+	std::vector<TWPartition*>::iterator iter;
+	std::vector<TWPartition*> parts;
+	std::vector<bool> results;
+	std::vector<string> paths;
+	std::vector<size_t> main_parts;
+	int ret = true;
+	size_t i, j;
+
+	// Several paths separated by ; are repaired together
+	paths = TWFunc::Split_String(Path, ";");
+	for (i = 0; i < paths.size(); i++) {
+		bool found = false;
+		string Local_Path = TWFunc::Get_Root_Path(paths[i]);
+
+		if (Local_Path == "/tmp" || Local_Path == "/")
+			continue;
+
+		// Iterate through all partitions
+		for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+			if ((*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path)) {
+				if (std::find(parts.begin(), parts.end(), *iter) == parts.end()) {
+					main_parts.push_back(parts.size());
+					parts.push_back(*iter);
+				}
+				found = true;
+			} else if ((*iter)->Is_SubPartition && (*iter)->SubPartition_Of == Local_Path) {
+				if (std::find(parts.begin(), parts.end(), *iter) == parts.end())
+					parts.push_back(*iter);
+			}
+		}
+		if (!found) {
+			if (Display_Error)
+				gui_msg(Msg(msg::kError, "unable_find_part_path=Unable to find partition for path '{1}'")(Local_Path));
+			else
+				LOGINFO("Repair: Unable to find partition for path '%s'\n", Local_Path.c_str());
+			ret = false;
+		}
 	}
-	return false;
+	if (parts.empty())
+		return ret;
+
+	// Sub-partitions are repaired along, but only the partitions that were
+	// asked for count for the result
+	results = Repair_Partitions(parts);
+	for (j = 0; j < main_parts.size(); j++) {
+		if (!results[main_parts[j]])
+			ret = false;
+	}
+	return ret;
 }
 
 int TWPartitionManager::Resize_By_Path(string Path, bool Display_Error) {
@@ -1529,13 +2479,43 @@ int TWPartitionManager::Resize_By_Path(string Path, bool Display_Error) {
 	return false;
 }
 
+void TWPartitionManager::Invalidate_Size_By_Path(string Path) {
+	TWPartition* Part = Find_Partition_By_Path(Path);
+
+	if (Part)
+		Part->Invalidate_Size();
+}
+
+void TWPartitionManager::Invalidate_All_Sizes(void) {
+	std::vector<TWPartition*>::iterator iter;
+
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++)
+		(*iter)->Invalidate_Size();
+}
+
+void TWPartitionManager::Hold_System_Details(bool Hold) {
+	details_held = Hold;
+	if (!Hold && details_pending) {
+		details_pending = false;
+		Update_System_Details();
+	}
+}
+
+void TWPartitionManager::Operation_System_Details() {
+	if (details_held)
+		details_pending = true;
+	else
+		Update_System_Details();
+}
+
 void TWPartitionManager::Update_System_Details(void) {
+	twrpStartupTrace::Scope trace("system details");
 	std::vector<TWPartition*>::iterator iter;
 	int data_size = 0;
 
 	gui_msg("update_part_details=Updating partition details...");
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
-		(*iter)->Update_Size(true);
+		(*iter)->Update_Size_If_Changed(true);
 		if ((*iter)->Can_Be_Mounted) {
 			if ((*iter)->Mount_Point == Get_Android_Root_Path()) {
 				int backup_display_size = (int)((*iter)->Backup_Size / 1048576LLU);
@@ -1643,6 +2623,21 @@ void TWPartitionManager::Post_Decrypt(const string& Block_Device) {
 		LOGERR("Unable to locate data partition.\n");
 }
 
+#ifdef TW_INCLUDE_FBE
+// Logs the keymaster, weaver and gatekeeper calls of the last decrypt and
+// keeps their counts and times as tw_hal_<call>_calls and tw_hal_<call>_ms
+static void Publish_Hal_Timing() {
+	Hal_Timing_Log();
+	for (int i = 0; i < HAL_CALL_COUNT; i++) {
+		Hal_Call_Stats stats;
+		Hal_Timing_Get((Hal_Call)i, &stats);
+		string name = "tw_hal_" + string(Hal_Call_Name((Hal_Call)i));
+		DataManager::SetValue(name + "_calls", (int)stats.calls);
+		DataManager::SetValue(name + "_ms", (unsigned long long)(stats.total_usec / 1000));
+	}
+}
+#endif
+
 int TWPartitionManager::Decrypt_Device(string Password) {
 #ifdef TW_INCLUDE_CRYPTO
 	char crypto_state[PROPERTY_VALUE_MAX], crypto_blkdev[PROPERTY_VALUE_MAX];
@@ -1672,7 +2667,13 @@ int TWPartitionManager::Decrypt_Device(string Password) {
 			usleep(2000); // A small sleep is needed after mounting /data to ensure reliable decrypt... maybe because of DE?
 		int user_id = DataManager::GetIntValue("tw_decrypt_user_id");
 		LOGINFO("Decrypting FBE for user %i\n", user_id);
-		if (Decrypt_User(user_id, Password)) {
+		Hal_Timing_Reset();
+		if (DataManager::GetIntValue(TW_CRYPTO_HAL_TRACE))
+			Hal_Timing_Set_Trace("/tmp/crypto_hal_trace.log");
+		bool decrypted = Decrypt_User(user_id, Password);
+		Hal_Timing_Set_Trace(NULL);
+		Publish_Hal_Timing();
+		if (decrypted) {
 			Post_Decrypt("");
 			return 0;
 		}
@@ -1890,13 +2891,141 @@ int TWPartitionManager::usb_storage_disable(void) {
 	return true;
 }
 
+#define TW_MOUNT_THREADS 8                                                 // Most mounts or unmounts run at once
+
+// A mount or unmount run by Run_Mount_Jobs
+struct Mount_Job {
+	TWPartition* Part;
+	std::vector<size_t> After;                                                // Jobs that have to finish first
+	bool Started;
+	bool Done;
+};
+
+struct Mount_Scheduler {
+	std::vector<Mount_Job> Jobs;
+	bool Mount;
+	bool Display_Error;
+	pthread_mutex_t Lock;
+	pthread_cond_t Cond;
+};
+
+// True if Path is Dir or somewhere below it
+static bool Path_Is_Under(const string& Path, const string& Dir) {
+	if (Path.empty() || Dir.empty() || Path.compare(0, Dir.size(), Dir) != 0)
+		return false;
+	return Path.size() == Dir.size() || Path[Dir.size()] == '/';
+}
+
+// True if Child sits in the file system Parent mounts, its mount point, the
+// path /sdcard is bound to or an image file as its block device
+static bool Mount_Depends_On(TWPartition* Child, TWPartition* Parent) {
+	if (Child->Mount_Point == Parent->Mount_Point)
+		return false;
+	return Path_Is_Under(Child->Mount_Point, Parent->Mount_Point) ||
+		Path_Is_Under(Child->Symlink_Path, Parent->Mount_Point) ||
+		Path_Is_Under(Child->Actual_Block_Device, Parent->Mount_Point);
+}
+
+static void* Mount_Job_Worker(void *cookie) {
+	Mount_Scheduler* sched = (Mount_Scheduler*) cookie;
+
+	pthread_mutex_lock(&sched->Lock);
+	for (;;) {
+		Mount_Job* job = NULL;
+		bool waiting = false;
+		for (size_t i = 0; i < sched->Jobs.size() && job == NULL; i++) {
+			if (sched->Jobs[i].Started)
+				continue;
+			bool ready = true;
+			for (size_t a = 0; a < sched->Jobs[i].After.size() && ready; a++)
+				ready = sched->Jobs[sched->Jobs[i].After[a]].Done;
+			if (ready)
+				job = &sched->Jobs[i];
+			else
+				waiting = true;
+		}
+		if (job == NULL) {
+			if (!waiting)
+				break;
+			pthread_cond_wait(&sched->Cond, &sched->Lock);
+			continue;
+		}
+		job->Started = true;
+		pthread_mutex_unlock(&sched->Lock);
+
+		timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		bool ret = sched->Mount ? job->Part->Mount(sched->Display_Error) : job->Part->UnMount(sched->Display_Error);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		LOGINFO("%s '%s' %s in %i ms\n", sched->Mount ? "Mount" : "Unmount", job->Part->Mount_Point.c_str(), ret ? "done" : "failed",
+			TWFunc::timespec_diff_ms(start, end));
+
+		pthread_mutex_lock(&sched->Lock);
+		job->Done = true;
+		pthread_cond_broadcast(&sched->Cond);
+	}
+	pthread_mutex_unlock(&sched->Lock);
+	return NULL;
+}
+
+void TWPartitionManager::Run_Mount_Jobs(const std::vector<TWPartition*>& Parts, bool Mount, bool Display_Error) {
+	Mount_Scheduler sched;
+	std::vector<pthread_t> workers;
+	size_t i, j, threads;
+	timespec start, end;
+
+	if (Parts.empty())
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < Parts.size(); i++) {
+		Mount_Job job;
+		job.Part = Parts[i];
+		job.Started = false;
+		job.Done = false;
+		// Parents are mounted before their children and unmounted after them
+		for (j = 0; j < Parts.size(); j++) {
+			if (Mount ? Mount_Depends_On(Parts[i], Parts[j]) : Mount_Depends_On(Parts[j], Parts[i]))
+				job.After.push_back(j);
+		}
+		sched.Jobs.push_back(job);
+	}
+	sched.Mount = Mount;
+	sched.Display_Error = Display_Error;
+	pthread_mutex_init(&sched.Lock, NULL);
+	pthread_cond_init(&sched.Cond, NULL);
+
+	// Mounts mostly wait on a journal replay, a checkpoint recovery or a
+	// FUSE daemon starting rather than on the CPU, so they aren't held to
+	// one thread per core
+	threads = std::min(sched.Jobs.size(), (size_t) TW_MOUNT_THREADS);
+	for (i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Mount_Job_Worker, &sched) != 0) {
+			LOGINFO("Unable to create mount thread %zu, continuing with %zu\n", i, i);
+			break;
+		}
+		workers.push_back(thread);
+	}
+	Mount_Job_Worker(&sched);
+	for (i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	pthread_cond_destroy(&sched.Cond);
+	pthread_mutex_destroy(&sched.Lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	LOGINFO("%s %zu partitions with %zu threads in %i ms\n", Mount ? "Mounted" : "Unmounted", Parts.size(), workers.size() + 1,
+		TWFunc::timespec_diff_ms(start, end));
+}
+
 void TWPartitionManager::Mount_All_Storage(void) {
 	std::vector<TWPartition*>::iterator iter;
+	std::vector<TWPartition*> storage;
 
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if ((*iter)->Is_Storage)
-			(*iter)->Mount(false);
+			storage.push_back(*iter);
 	}
+	Run_Mount_Jobs(storage, true, false);
 }
 
 void TWPartitionManager::UnMount_Main_Partitions(void) {
@@ -1904,19 +3033,115 @@ void TWPartitionManager::UnMount_Main_Partitions(void) {
 	// Also unmounts boot if boot is mountable
 	LOGINFO("Unmounting main partitions...\n");
 
+	std::vector<TWPartition*> parts;
+	std::vector<string> paths;
+	std::vector<TWPartition*>::iterator iter;
 	TWPartition* Boot_Partition = Find_Partition_By_Path("/boot");
 
-	UnMount_By_Path(Get_Android_Root_Path(), true);
+	paths.push_back(Get_Android_Root_Path());
 	if (!datamedia)
-		UnMount_By_Path("/data", true);
+		paths.push_back("/data");
+	// The same partitions UnMount_By_Path() would unmount for each path
+	for (size_t i = 0; i < paths.size(); i++) {
+		string Local_Path = TWFunc::Get_Root_Path(paths[i]);
+		bool found = false;
+		for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+			bool match = (*iter)->Mount_Point == Local_Path || (!(*iter)->Symlink_Mount_Point.empty() && (*iter)->Symlink_Mount_Point == Local_Path);
+			if (match)
+				found = true;
+			if ((match || ((*iter)->Is_SubPartition && (*iter)->SubPartition_Of == Local_Path)) && std::find(parts.begin(), parts.end(), *iter) == parts.end())
+				parts.push_back(*iter);
+		}
+		if (!found)
+			gui_msg(Msg(msg::kError, "unable_find_part_path=Unable to find partition for path '{1}'")(Local_Path));
+	}
+	if (Boot_Partition != NULL && Boot_Partition->Can_Be_Mounted && std::find(parts.begin(), parts.end(), Boot_Partition) == parts.end())
+		parts.push_back(Boot_Partition);
+	Run_Mount_Jobs(parts, false, true);
+}
 
-	if (Boot_Partition != NULL && Boot_Partition->Can_Be_Mounted)
-		Boot_Partition->UnMount(true);
+#define SD_GPT_SECTORS 33                                                  // Backup GPT at the end of a card
+#define SD_NODE_WAIT_MS 2000                                               // Longest wait for the nodes of new partitions
+
+// One entry of the MBR that Partition_SDCard writes, in sectors
+struct SD_Partition {
+	SD_Partition(uint64_t Start, uint64_t Count, unsigned char Type) : start(Start), count(Count), type(Type) {}
+	uint64_t start;
+	uint64_t count;
+	unsigned char type;
+};
+
+// A format of a new SD card partition, run on its own thread
+struct SD_Format {
+	SD_Format(const string& Tool) : tool(Tool), started(false), ret(-1) {}
+	static void* Run(void *cookie) {
+		SD_Format* format = (SD_Format*) cookie;
+		format->ret = format->tool.Run();
+		return NULL;
+	}
+	twrpFsTool tool;
+	pthread_t thread;
+	bool started;
+	int ret;
+};
+
+// Discards the whole card ahead of the formats, if wipes are set to discard
+static bool Discard_SD(int fd, uint64_t Size) {
+	int discard = 1;
+	uint64_t range[2];
+
+	DataManager::GetValue(TW_WIPE_DISCARD_VAR, discard);
+	if (!discard)
+		return false;
+	range[0] = 0;
+	range[1] = Size & ~4095ULL;
+	if (ioctl(fd, BLKDISCARD, &range) != 0) {
+		LOGINFO("Unable to discard the sd card: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+// Replaces the partition table with an MBR of Table, the table sgdisk
+// --gpttombr ended up with. The MBR and the zeroed rest of the first MB,
+// where a GPT would be, go in one write; the backup GPT at the end of the
+// card is zeroed as well so nothing finds the old table.
+static bool Write_SD_Table(int fd, const std::vector<SD_Partition>& Table, int Sector_Size, uint64_t Total_Sectors) {
+	std::vector<unsigned char> head(1048576, 0), tail((size_t) SD_GPT_SECTORS * Sector_Size, 0);
+	uint32_t disk_id = (uint32_t) time(NULL);
+	size_t i;
+
+	if (Total_Sectors > 0xffffffffULL || Table.size() > 4) {
+		LOGINFO("The sd card is too large for an MBR\n");
+		return false;
+	}
+	memcpy(&head[440], &disk_id, sizeof(disk_id));
+	for (i = 0; i < Table.size(); i++) {
+		unsigned char* entry = &head[446 + i * 16];
+		uint32_t start = (uint32_t) Table[i].start, count = (uint32_t) Table[i].count;
+
+		// CHS addresses past what they can hold, only the LBA counts
+		entry[1] = entry[5] = 0xfe;
+		entry[2] = entry[3] = entry[6] = entry[7] = 0xff;
+		entry[4] = Table[i].type;
+		memcpy(&entry[8], &start, sizeof(start));
+		memcpy(&entry[12], &count, sizeof(count));
+	}
+	head[510] = 0x55;
+	head[511] = 0xaa;
+	if (Total_Sectors > SD_GPT_SECTORS && pwrite(fd, tail.data(), tail.size(), (off_t) ((Total_Sectors - SD_GPT_SECTORS) * Sector_Size)) != (ssize_t) tail.size()) {
+		LOGINFO("Unable to clear the backup GPT: %s\n", strerror(errno));
+		return false;
+	}
+	if (pwrite(fd, head.data(), head.size(), 0) != (ssize_t) head.size() || fsync(fd) != 0) {
+		LOGINFO("Unable to write the MBR: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
 }
 
 int TWPartitionManager::Partition_SDCard(void) {
-	char temp[255];
-	string Storage_Path, Command, Device, fat_str, ext_str, start_loc, end_loc, ext_format, sd_path, tmpdevice;
+	string Storage_Path, Device, ext_format, sd_path, tmpdevice;
 	int ext, swap, total_size = 0, fat_size;
 
 	gui_msg("start_partition_sd=Partitioning SD Card...");
@@ -1965,102 +3190,101 @@ int TWPartitionManager::Partition_SDCard(void) {
 	fat_size = total_size - ext - swap;
 	LOGINFO("sd card mount point %s block device is '%s', sdcard size is: %iMB, fat size: %iMB, ext size: %iMB, ext system: '%s', swap size: %iMB\n", DataManager::GetCurrentStoragePath().c_str(), Device.c_str(), total_size, fat_size, ext, ext_format.c_str(), swap);
 
-	// Determine partition sizes
-	if (swap == 0 && ext == 0) {
-		fat_str = "-0";
-	} else {
-		memset(temp, 0, sizeof(temp));
-		sprintf(temp, "%i", fat_size);
-		fat_str = temp;
-		fat_str += "MB";
-	}
-	if (swap == 0) {
-		ext_str = "-0";
-	} else {
-		memset(temp, 0, sizeof(temp));
-		sprintf(temp, "%i", ext);
-		ext_str = "+";
-		ext_str += temp;
-		ext_str += "MB";
-	}
-
 	if (ext + swap > total_size) {
 		gui_err("ext_swap_size=EXT + Swap size is larger than sdcard size.");
 		return false;
 	}
 
-	gui_msg("remove_part_table=Removing partition table...");
-	Command = "sgdisk --zap-all " + Device;
-	LOGINFO("Command is: '%s'\n", Command.c_str());
-	if (TWFunc::Exec_Cmd(Command) != 0) {
-		gui_err("unable_rm_part=Unable to remove partition table.");
-		Update_System_Details();
+	int fd = open(Device.c_str(), O_RDWR);
+	if (fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Device)(strerror(errno)));
 		return false;
 	}
-	gui_msg(Msg("create_part=Creating {1} partition...")("FAT32"));
-	Command = "sgdisk  --new=0:0:" + fat_str + " --change-name=0:\"Microsoft basic data\" --typecode=0:EBD0A0A2-B9E5-4433-87C0-68B6B72699C7 " + Device;
-	LOGINFO("Command is: '%s'\n", Command.c_str());
-	if (TWFunc::Exec_Cmd(Command) != 0) {
-		gui_msg(Msg(msg::kError, "unable_to_create_part=Unable to create {1} partition.")("FAT32"));
+	int sector_size = 512;
+	uint64_t device_bytes = 0;
+	if (ioctl(fd, BLKSSZGET, &sector_size) != 0 || sector_size < 512)
+		sector_size = 512;
+	if (ioctl(fd, BLKGETSIZE64, &device_bytes) != 0)
+		device_bytes = (uint64_t) total_size * 1048576;
+
+	// Laid out the way sgdisk did it, 1MB aligned and the last partition
+	// to the end of the card
+	uint64_t mb_sectors = 1048576 / sector_size, total_sectors = device_bytes / sector_size;
+	uint64_t fat_end = (swap == 0 && ext == 0) ? total_sectors : (uint64_t) fat_size * mb_sectors;
+	uint64_t ext_end = swap == 0 ? total_sectors : fat_end + (uint64_t) ext * mb_sectors;
+	std::vector<SD_Partition> Table;
+	if (fat_end <= mb_sectors || ext_end > total_sectors) {
+		gui_err("ext_swap_size=EXT + Swap size is larger than sdcard size.");
+		close(fd);
 		return false;
 	}
-	if (ext > 0) {
-		gui_msg(Msg("create_part=Creating {1} partition...")("EXT"));
-		Command = "sgdisk --new=0:0:" + ext_str + " --change-name=0:\"Linux filesystem\" " + Device;
-		LOGINFO("Command is: '%s'\n", Command.c_str());
-		if (TWFunc::Exec_Cmd(Command) != 0) {
-			gui_msg(Msg(msg::kError, "unable_to_create_part=Unable to create {1} partition.")("EXT"));
-			Update_System_Details();
-			return false;
-		}
-	}
-	if (swap > 0) {
-		gui_msg(Msg("create_part=Creating {1} partition...")("swap"));
-		Command = "sgdisk --new=0:0:-0 --change-name=0:\"Linux swap\" --typecode=0:0657FD6D-A4AB-43C4-84E5-0933C84B4F4F " + Device;
-		LOGINFO("Command is: '%s'\n", Command.c_str());
-		if (TWFunc::Exec_Cmd(Command) != 0) {
-			gui_msg(Msg(msg::kError, "unable_to_create_part=Unable to create {1} partition.")("swap"));
-			Update_System_Details();
-			return false;
-		}
+	Table.push_back(SD_Partition(mb_sectors, fat_end - mb_sectors, 0x0c)); // FAT32 with LBA
+	if (ext > 0)
+		Table.push_back(SD_Partition(fat_end, ext_end - fat_end, 0x83));
+	if (swap > 0)
+		Table.push_back(SD_Partition(ext_end, total_sectors - ext_end, 0x82));
+
+	Invalidate_All_Sizes();
+	// The whole card at once, so the formats below can skip their own
+	// discards and zeroing like the fast format of a partition
+	bool discarded = Discard_SD(fd, device_bytes);
+	gui_msg("write_part_table=Writing partition table...");
+	if (!Write_SD_Table(fd, Table, sector_size, total_sectors)) {
+		gui_err("unable_write_part_table=Unable to write partition table.");
+		close(fd);
+		Update_System_Details();
+		return false;
 	}
 
-	// Convert GPT to MBR
-	Command = "sgdisk --gpttombr " + Device;
-	if (TWFunc::Exec_Cmd(Command) != 0)
-		LOGINFO("Failed to covert partition GPT to MBR\n");
-
 	// Tell the kernel to rescan the partition table
-	int fd = open(Device.c_str(), O_RDONLY);
-	ioctl(fd, BLKRRPART, 0);
+	if (ioctl(fd, BLKRRPART, 0) != 0)
+		LOGINFO("Unable to rescan the partitions of '%s': %s\n", Device.c_str(), strerror(errno));
 	close(fd);
+#ifdef TW_INCLUDE_CRYPTO
+	gpt_disk_invalidate_cache();
+#endif
 
 	string format_device = Device;
 	if (Device.substr(0, 17) == "/dev/block/mmcblk")
 		format_device += "p";
+	// ueventd makes the nodes of the new partitions a moment later
+	string last_device = format_device + std::to_string(Table.size());
+	for (int i = 0; i < SD_NODE_WAIT_MS / 10 && !TWFunc::Path_Exists(last_device); i++)
+		usleep(10000);
 
-	// Format new partitions to proper file system
+	// Format new partitions to proper file system, all at once
+	std::vector<SD_Format*> Formats;
 	if (fat_size > 0) {
-		Command = "mkfs.fat " + format_device + "1";
-		TWFunc::Exec_Cmd(Command);
-	}
-	if (ext > 0) {
-		if (SDext == NULL) {
-			Command = "mke2fs -t " + ext_format + " -m 0 " + format_device + "2";
-			gui_msg(Msg("format_sdext_as=Formatting sd-ext as {1}...")(ext_format));
-			LOGINFO("Formatting sd-ext after partitioning, command: '%s'\n", Command.c_str());
-			TWFunc::Exec_Cmd(Command);
-		} else {
-			SDext->Wipe(ext_format);
-		}
+		Formats.push_back(new SD_Format("mkfs.fat"));
+		Formats.back()->tool.Arg(format_device + "1");
+	}
+	if (ext > 0 && SDext == NULL) {
+		gui_msg(Msg("format_sdext_as=Formatting sd-ext as {1}...")(ext_format));
+		Formats.push_back(new SD_Format("mke2fs"));
+		Formats.back()->tool.Arg("-t").Arg(ext_format).Arg("-m").Arg("0");
+		if (discarded)
+			Formats.back()->tool.Arg("-E").Arg("lazy_itable_init=1,lazy_journal_init=1,nodiscard");
+		Formats.back()->tool.Arg(format_device + "2");
 	}
 	if (swap > 0) {
-		Command = "mkswap " + format_device;
-		if (ext > 0)
-			Command += "3";
-		else
-			Command += "2";
-		TWFunc::Exec_Cmd(Command);
+		Formats.push_back(new SD_Format("mkswap"));
+		Formats.back()->tool.Arg(format_device + (ext > 0 ? "3" : "2"));
+	}
+	for (size_t i = 0; i < Formats.size(); i++) {
+		LOGINFO("Formatting: %s\n", Formats[i]->tool.Command().c_str());
+		Formats[i]->started = pthread_create(&Formats[i]->thread, NULL, SD_Format::Run, Formats[i]) == 0;
+		if (!Formats[i]->started)
+			SD_Format::Run(Formats[i]);
+	}
+	// The partition object formats sd-ext on this thread while the others run
+	if (ext > 0 && SDext != NULL)
+		SDext->Wipe(ext_format);
+	for (size_t i = 0; i < Formats.size(); i++) {
+		if (Formats[i]->started)
+			pthread_join(Formats[i]->thread, NULL);
+		if (Formats[i]->ret != 0)
+			LOGINFO("'%s' failed\n", Formats[i]->tool.Command().c_str());
+		delete Formats[i];
 	}
 
 	// recreate TWRP folder and rewrite settings - these will be gone after sdcard is partitioned
@@ -2477,9 +3701,367 @@ bool TWPartitionManager::Remove_MTP_Storage(unsigned int Storage_ID) {
 	return false;
 }
 
+bool TWPartitionManager::Flash_Image_To_All(const string& Filename, const std::vector<TWPartition*>& Parts, ProgressTracking *progress) {
+	std::vector<twrpStreamWriter*> writers;
+	std::vector<int> fds;
+	unsigned long long image_size = TWFunc::Get_File_Size(Filename);
+	unsigned depth = 0;
+	int src_fd, direct_io = 0;
+	bool ret = false;
+	timespec start, end;
+	size_t i;
+
+	for (i = 0; i < Parts.size(); i++) {
+		TWPartition* part = Parts[i];
+		part->Invalidate_Size();
+		if (!part->Can_Flash_Img) {
+			LOGERR("Cannot flash images to partitions %s\n", part->Display_Name.c_str());
+			return false;
+		}
+		if (!part->Find_Partition_Size()) {
+			LOGERR("Unable to find partition size for '%s'\n", part->Mount_Point.c_str());
+			return false;
+		}
+		if (image_size > part->Size) {
+			LOGINFO("Size (%llu bytes) of image '%s' is larger than target device '%s' (%llu bytes)\n",
+				image_size, Filename.c_str(), part->Actual_Block_Device.c_str(), part->Size);
+			gui_err("img_size_err=Size of image is larger than target device");
+			return false;
+		}
+		depth = std::max(depth, twrpIoScheduler::Get()->Depth(part->Actual_Block_Device));
+	}
+
+	src_fd = open(Filename.c_str(), O_RDONLY | O_LARGEFILE);
+	if (src_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Filename)(strerror(errno)));
+		return false;
+	}
+	DataManager::GetValue(TW_RAW_DIRECT_IO_VAR, direct_io);
+	for (i = 0; i < Parts.size(); i++) {
+		int fd = open(Parts[i]->Actual_Block_Device.c_str(), O_WRONLY | O_LARGEFILE);
+		if (fd < 0) {
+			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Parts[i]->Actual_Block_Device)(strerror(errno)));
+			goto exit;
+		}
+		fds.push_back(fd);
+		writers.push_back(new twrpFdWriter(fd, direct_io));
+		gui_msg(Msg("flashing=Flashing {1}...")(Parts[i]->Display_Name));
+	}
+
+	LOGINFO("Writing '%s' to %zu partitions at once\n", Filename.c_str(), Parts.size());
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	progress->SetPartitionSize(image_size);
+	{
+		twrpFdReader reader(src_fd, false);
+		twrpTeeWriter tee(writers);
+		twrpRawCopy raw_copy(1048576, depth);
+		ret = raw_copy.Copy(&reader, &tee, image_size, [progress](uint64_t flashed_size) {
+			progress->UpdateSize(flashed_size);
+			return true;
+		});
+	}
+	for (i = 0; ret && i < fds.size(); i++) {
+		if (fsync(fds[i]) != 0) {
+			LOGINFO("Error syncing '%s' (%s)\n", Parts[i]->Actual_Block_Device.c_str(), strerror(errno));
+			ret = false;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret)
+		LOGINFO("Flashed %zu partitions in %i ms\n", Parts.size(), TWFunc::timespec_diff_ms(start, end));
+	else
+		gui_msg(Msg(msg::kError, "flash_err=Unable to flash '{1}'")(Filename));
+
+exit:
+	for (i = 0; i < writers.size(); i++)
+		delete writers[i];
+	for (i = 0; i < fds.size(); i++)
+		close(fds[i]);
+	close(src_fd);
+	return ret;
+}
+
+bool TWPartitionManager::Flash_Image_From_Zip(const string& Zip_Path, const string& Entry, const string& Partition_Path) {
+	TWPartition* part = Find_Partition_By_Path(Partition_Path);
+	string display = Zip_Path + ":" + Entry;
+	ZipWrapEntry entry;
+	ZipWrap Zip;
+	MemMapping map;
+	int fd = -1, direct_io = 0;
+	bool ret = false;
+	timespec start, end;
+
+	gui_msg("image_flash_start=[IMAGE FLASH STARTED]");
+	gui_msg(Msg("img_to_flash=Image to flash: '{1}'")(display));
+	if (part == NULL) {
+		gui_msg(Msg(msg::kError, "flash_unable_locate=Unable to locate '{1}' partition for flashing.")(Partition_Path));
+		return false;
+	}
+	if (!part->Can_Flash_Img) {
+		LOGERR("Cannot flash images to partitions %s\n", part->Display_Name.c_str());
+		return false;
+	}
+	if (!TWFunc::Path_Exists(Zip_Path) && !Mount_By_Path(Zip_Path, true))
+		return false;
+	part->Invalidate_Size();
+	if (!part->Find_Partition_Size()) {
+		LOGERR("Unable to find partition size for '%s'\n", part->Mount_Point.c_str());
+		return false;
+	}
+
+#ifdef USE_MINZIP
+	if (sysMapFile(Zip_Path.c_str(), &map) != 0) {
+#else
+	if (!map.MapFile(Zip_Path)) {
+#endif
+		gui_msg(Msg(msg::kError, "fail_sysmap=Failed to map file '{1}'")(Zip_Path));
+		return false;
+	}
+	if (!Zip.Open(Zip_Path.c_str(), &map)) {
+		gui_err("zip_corrupt=Zip file is corrupt!");
+		goto exit;
+	}
+	if (!Zip.GetEntryData(Entry, &entry)) {
+		gui_msg(Msg(msg::kError, "unable_to_locate=Unable to locate {1}.")(display));
+		goto exit;
+	}
+	if (entry.uncompressed_length > part->Size) {
+		LOGINFO("Size (%llu bytes) of image '%s' is larger than target device '%s' (%llu bytes)\n",
+			(unsigned long long) entry.uncompressed_length, display.c_str(), part->Actual_Block_Device.c_str(), part->Size);
+		gui_err("img_size_err=Size of image is larger than target device");
+		goto exit;
+	}
+
+	fd = open(part->Actual_Block_Device.c_str(), O_WRONLY | O_LARGEFILE);
+	if (fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(part->Actual_Block_Device)(strerror(errno)));
+		goto exit;
+	}
+	gui_msg(Msg("flashing=Flashing {1}...")(part->Display_Name));
+	LOGINFO("Writing %s entry '%s' (%llu bytes) to '%s'\n", entry.deflated ? "deflated" : "stored", display.c_str(),
+		(unsigned long long) entry.uncompressed_length, part->Actual_Block_Device.c_str());
+	DataManager::GetValue(TW_RAW_DIRECT_IO_VAR, direct_io);
+	DataManager::SetProgress(0.0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	{
+		ProgressTracking progress(entry.uncompressed_length);
+		twrpZipEntryReader reader(entry);
+		twrpFdWriter writer(fd, direct_io);
+		twrpRawCopy raw_copy(1048576, twrpIoScheduler::Get()->Depth(part->Actual_Block_Device));
+		progress.SetPartitionSize(entry.uncompressed_length);
+		ret = raw_copy.Copy(&reader, &writer, entry.uncompressed_length, [&progress](uint64_t flashed_size) {
+			progress.UpdateSize(flashed_size);
+			return true;
+		});
+	}
+	if (ret && fsync(fd) != 0) {
+		LOGINFO("Error syncing '%s' (%s)\n", part->Actual_Block_Device.c_str(), strerror(errno));
+		ret = false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret) {
+		LOGINFO("Flashed '%s' in %i ms\n", display.c_str(), TWFunc::timespec_diff_ms(start, end));
+		gui_highlight("flash_done=IMAGE FLASH COMPLETED]");
+	} else {
+		gui_msg(Msg(msg::kError, "flash_err=Unable to flash '{1}'")(display));
+	}
+
+exit:
+	if (fd >= 0)
+		close(fd);
+	Zip.Close();
+#ifdef USE_MINZIP
+	sysReleaseMap(&map);
+#endif
+	return ret;
+}
+
+// Reads a dd number, like 4096, 8b or 1M
+static bool Parse_Dd_Number(const string& Value, uint64_t *Result) {
+	char* end = NULL;
+	uint64_t mult;
+
+	if (Value.empty() || Value[0] < '0' || Value[0] > '9')
+		return false;
+	errno = 0;
+	*Result = strtoull(Value.c_str(), &end, 10);
+	if (errno != 0)
+		return false;
+	string suffix = end;
+	if (suffix.empty() || suffix == "c")
+		mult = 1;
+	else if (suffix == "w")
+		mult = 2;
+	else if (suffix == "b")
+		mult = 512;
+	else if (suffix == "k" || suffix == "K")
+		mult = 1024;
+	else if (suffix == "M")
+		mult = 1048576;
+	else if (suffix == "G")
+		mult = 1073741824;
+	else
+		return false;
+	if (*Result > UINT64_MAX / mult)
+		return false;
+	*Result *= mult;
+	return true;
+}
+
+// Offsets and sizes in blocks end up in lseek64 and ftruncate64
+static bool Dd_Blocks_Fit(uint64_t Blocks, uint64_t Block_Size) {
+	return Blocks <= (uint64_t) INT64_MAX / Block_Size;
+}
+
+// Size of a block device or regular file, false for anything else
+static bool Get_Fd_Size(int fd, uint64_t *Size) {
+	struct stat st;
+
+	if (fstat(fd, &st) != 0)
+		return false;
+	if (S_ISREG(st.st_mode)) {
+		*Size = st.st_size;
+		return true;
+	}
+	return S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, Size) == 0;
+}
+
+// Only the block device side of a copy bypasses the page cache
+static bool Is_Block_Fd(int fd) {
+	struct stat st;
+
+	return fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+bool TWPartitionManager::Raw_Copy(const string& Args) {
+	std::vector<string> args = TWFunc::split_string(Args, ' ', true);
+	string in_path, out_path;
+	uint64_t block_size = 512, count = 0, skip = 0, seek = 0, in_size = 0, copy_size;
+	bool have_count = false, notrunc = false, parsed = true, sized, ret = false;
+	int src_fd = -1, dest_fd = -1, direct_io = 0;
+	unsigned depth;
+	timespec start, end;
+	struct stat st;
+
+	for (size_t i = 0; i < args.size() && parsed; i++) {
+		size_t eq = args[i].find('=');
+		string key = args[i].substr(0, eq), value = eq == string::npos ? "" : args[i].substr(eq + 1);
+		if (key == "if")
+			in_path = value;
+		else if (key == "of")
+			out_path = value;
+		else if (key == "bs")
+			parsed = Parse_Dd_Number(value, &block_size) && block_size > 0;
+		else if (key == "count")
+			parsed = have_count = Parse_Dd_Number(value, &count);
+		else if (key == "skip")
+			parsed = Parse_Dd_Number(value, &skip);
+		else if (key == "seek")
+			parsed = Parse_Dd_Number(value, &seek);
+		else if (key == "conv") {
+			// The copy is always synced at the end
+			std::vector<string> convs = TWFunc::split_string(value, ',', true);
+			for (size_t c = 0; c < convs.size() && parsed; c++) {
+				if (convs[c] == "notrunc")
+					notrunc = true;
+				else if (convs[c] != "fsync" && convs[c] != "fdatasync")
+					parsed = false;
+			}
+		} else
+			parsed = false;
+	}
+	if (parsed && (!Dd_Blocks_Fit(count, block_size) || !Dd_Blocks_Fit(skip, block_size) || !Dd_Blocks_Fit(seek, block_size)))
+		parsed = false;
+	// Anything not handled above, like ibs= or a copy from stdin, is left
+	// to the dd binary the way the action always ran it
+	if (!parsed || in_path.empty() || out_path.empty()) {
+		LOGINFO("Running 'dd %s'\n", Args.c_str());
+		return TWFunc::Exec_Cmd("dd " + Args) == 0;
+	}
+
+	src_fd = open(in_path.c_str(), O_RDONLY | O_LARGEFILE);
+	if (src_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(in_path)(strerror(errno)));
+		return false;
+	}
+	sized = Get_Fd_Size(src_fd, &in_size);
+	if (!sized && !have_count) {
+		// A stream like /dev/urandom has no end to copy up to
+		close(src_fd);
+		LOGINFO("Running 'dd %s', the size of '%s' is unknown\n", Args.c_str(), in_path.c_str());
+		return TWFunc::Exec_Cmd("dd " + Args) == 0;
+	}
+	copy_size = have_count ? count * block_size : in_size;
+	if (sized) {
+		// dd stops at the end of the input, whatever count says
+		uint64_t left = in_size > skip * block_size ? in_size - skip * block_size : 0;
+		copy_size = std::min(copy_size, left);
+	}
+	if (skip > 0 && lseek64(src_fd, skip * block_size, SEEK_SET) < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(in_path)(strerror(errno)));
+		goto exit;
+	}
+
+	dest_fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_LARGEFILE, 0644);
+	if (dest_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(out_path)(strerror(errno)));
+		goto exit;
+	}
+	// Like dd, a file is cut off where the copy starts unless notrunc is given
+	if (!notrunc && fstat(dest_fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate64(dest_fd, seek * block_size) != 0) {
+		LOGINFO("Unable to truncate '%s' (%s)\n", out_path.c_str(), strerror(errno));
+		goto exit;
+	}
+	if (seek > 0 && lseek64(dest_fd, seek * block_size, SEEK_SET) < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(out_path)(strerror(errno)));
+		goto exit;
+	}
+
+	LOGINFO("Copying %llu bytes from '%s' to '%s'\n", (unsigned long long) copy_size, in_path.c_str(), out_path.c_str());
+	DataManager::GetValue(TW_RAW_DIRECT_IO_VAR, direct_io);
+	depth = std::max(twrpIoScheduler::Get()->Depth(in_path), twrpIoScheduler::Get()->Depth(out_path));
+	stop_backup.set_value(0);
+	DataManager::SetProgress(0.0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	{
+		// bs= only places the copy, the data moves in the buffers image
+		// backups use
+		ProgressTracking progress(copy_size);
+		progress.SetPartitionSize(copy_size);
+		twrpFdReader reader(src_fd, direct_io && Is_Block_Fd(src_fd));
+		twrpFdWriter writer(dest_fd, direct_io && Is_Block_Fd(dest_fd));
+		writer.Zero_Blocks(true);
+		twrpMemGrant ring_grant;
+		unsigned buffers = ring_grant.Take_Units("raw copy", 1048576, depth, 2);
+		twrpRawCopy raw_copy(1048576, buffers);
+		ret = raw_copy.Copy(&reader, &writer, copy_size, [this, &progress](uint64_t copied_size) {
+			progress.UpdateSize(copied_size);
+			return Check_Backup_Cancel() == 0;
+		});
+		progress.UpdateDisplayDetails(true);
+	}
+	if (ret && fsync(dest_fd) != 0) {
+		LOGINFO("Error syncing '%s' (%s)\n", out_path.c_str(), strerror(errno));
+		ret = false;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (ret)
+		LOGINFO("Copied %lluMB in %i ms\n", (unsigned long long) copy_size / 1048576, TWFunc::timespec_diff_ms(start, end));
+	else if (Check_Backup_Cancel() != 0)
+		gui_msg("raw_copy_cancel=Copy cancelled");
+	else
+		gui_msg(Msg(msg::kError, "raw_copy_err=Unable to copy '{1}' to '{2}'")(in_path)(out_path));
+
+exit:
+	if (dest_fd >= 0)
+		close(dest_fd);
+	close(src_fd);
+	return ret;
+}
+
 bool TWPartitionManager::Flash_Image(string& path, string& filename) {
-	int partition_count = 0;
 	TWPartition* flash_part = NULL;
+	std::vector<TWPartition*> flash_parts;
 	string Flash_List, flash_path, full_filename;
 	size_t start_pos = 0, end_pos = 0;
 
@@ -2498,14 +4080,6 @@ bool TWPartitionManager::Flash_Image(string& path, string& filename) {
 		}
 	}
 
-	PartitionSettings part_settings;
-	part_settings.Backup_Folder = path;
-	unsigned long long total_bytes = TWFunc::Get_File_Size(full_filename);
-	ProgressTracking progress(total_bytes);
-	part_settings.progress = &progress;
-	part_settings.adbbackup = false;
-	part_settings.PM_Method = PM_RESTORE;
-
 	gui_msg("calc_restore=Calculating restore details...");
 	DataManager::GetValue("tw_flash_partition", Flash_List);
 	if (!Flash_List.empty()) {
@@ -2514,11 +4088,8 @@ bool TWPartitionManager::Flash_Image(string& path, string& filename) {
 			flash_path = Flash_List.substr(start_pos, end_pos - start_pos);
 			flash_part = Find_Partition_By_Path(flash_path);
 			if (flash_part != NULL) {
-				partition_count++;
-				if (partition_count > 1) {
-					gui_err("too_many_flash=Too many partitions selected for flashing.");
-					return false;
-				}
+				if (std::find(flash_parts.begin(), flash_parts.end(), flash_part) == flash_parts.end())
+					flash_parts.push_back(flash_part);
 			} else {
 				gui_msg(Msg(msg::kError, "flash_unable_locate=Unable to locate '{1}' partition for flashing.")(flash_path));
 				return false;
@@ -2528,19 +4099,40 @@ bool TWPartitionManager::Flash_Image(string& path, string& filename) {
 		}
 	}
 
-	if (partition_count == 0) {
+	if (flash_parts.empty()) {
 		gui_err("no_part_flash=No partitions selected for flashing.");
 		return false;
 	}
 
+	// A raw image for several raw partitions is read once and written to
+	// all of them at the same time, anything else is flashed one partition
+	// after the other
+	uint64_t sparse_size;
+	bool fan_out = flash_parts.size() > 1 && !twrpSparse_Get_Size(full_filename, &sparse_size);
+	for (size_t i = 0; fan_out && i < flash_parts.size(); i++) {
+		if (flash_parts[i]->Backup_Method != BM_DD)
+			fan_out = false;
+	}
+
+	PartitionSettings part_settings;
+	part_settings.Backup_Folder = path;
+	unsigned long long total_bytes = TWFunc::Get_File_Size(full_filename);
+	ProgressTracking progress(fan_out ? total_bytes : total_bytes * flash_parts.size());
+	part_settings.progress = &progress;
+	part_settings.adbbackup = false;
+	part_settings.report = NULL;
+	part_settings.PM_Method = PM_RESTORE;
+
 	DataManager::SetProgress(0.0);
-	if (flash_part) {
-		flash_part->Backup_FileName = filename;
-		if (!flash_part->Flash_Image(&part_settings))
+	if (fan_out) {
+		if (!Flash_Image_To_All(full_filename, flash_parts, &progress))
 			return false;
 	} else {
-		gui_err("invalid_flash=Invalid flash partition specified.");
-		return false;
+		for (size_t i = 0; i < flash_parts.size(); i++) {
+			flash_parts[i]->Backup_FileName = filename;
+			if (!flash_parts[i]->Flash_Image(&part_settings))
+				return false;
+		}
 	}
 	gui_highlight("flash_done=IMAGE FLASH COMPLETED]");
 	return true;
@@ -2783,6 +4375,95 @@ string TWPartitionManager::Get_Android_Root_Path() {
 	return Android_Root;
 }
 
+void TWPartitionManager::Read_Mount_Table(void) {
+	string table;
+	char buf[4096];
+	ssize_t len;
+	off_t offset = 0;
+	size_t pos, end;
+
+	mount_table.clear();
+	mount_table_valid = false;
+	if (mountinfo_fd < 0)
+		return;
+	while ((len = pread(mountinfo_fd, buf, sizeof(buf), offset)) > 0) {
+		table.append(buf, len);
+		offset += len;
+	}
+	if (len < 0) {
+		LOGINFO("Unable to read /proc/self/mountinfo: %s\n", strerror(errno));
+		return;
+	}
+	// The mount point is the fifth field, with spaces and the like escaped as \ooo
+	for (pos = 0; pos < table.size(); pos = end + 1) {
+		end = table.find('\n', pos);
+		if (end == string::npos)
+			end = table.size();
+		std::vector<string> fields = TWFunc::split_string(table.substr(pos, end - pos), ' ', true);
+		if (fields.size() < 5)
+			continue;
+		string mount_point;
+		const string& field = fields[4];
+		for (size_t i = 0; i < field.size(); i++) {
+			if (field[i] == '\\' && i + 3 < field.size()) {
+				mount_point += (char) strtol(field.substr(i + 1, 3).c_str(), NULL, 8);
+				i += 3;
+			} else {
+				mount_point += field[i];
+			}
+		}
+		mount_table.insert(mount_point);
+	}
+	mount_table_valid = true;
+}
+
+bool TWPartitionManager::Is_Path_Mounted(const string& Path) {
+	bool mounted;
+
+	pthread_mutex_lock(&mount_table_lock);
+	if (mountinfo_fd < 0)
+		mountinfo_fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+	if (mountinfo_fd >= 0) {
+		struct pollfd pfd;
+		pfd.fd = mountinfo_fd;
+		pfd.events = POLLPRI;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLPRI | POLLERR)))
+			mount_table_valid = false;
+		if (!mount_table_valid)
+			Read_Mount_Table();
+	}
+	if (mount_table_valid) {
+		mounted = mount_table.count(Path) != 0;
+		pthread_mutex_unlock(&mount_table_lock);
+		return mounted;
+	}
+	pthread_mutex_unlock(&mount_table_lock);
+
+	// Without mountinfo a mount point is on another device than its parent
+	struct stat st1, st2;
+	string test_path = Path + "/.";
+	if (stat(test_path.c_str(), &st1) != 0)
+		return false;
+	test_path = Path + "/../.";
+	if (stat(test_path.c_str(), &st2) != 0)
+		return false;
+	return st1.st_dev != st2.st_dev;
+}
+
+void TWPartitionManager::Invalidate_Mount_Table(void) {
+	pthread_mutex_lock(&mount_table_lock);
+	mount_table_valid = false;
+	pthread_mutex_unlock(&mount_table_lock);
+}
+
+void TWPartitionManager::Handle_Mountinfo_Change(void) {
+	// select() took the change, so the next lookup's poll() won't see it
+	pthread_mutex_lock(&mount_table_lock);
+	Read_Mount_Table();
+	pthread_mutex_unlock(&mount_table_lock);
+}
+
 void TWPartitionManager::Remove_Uevent_Devices(const string& Mount_Point) {
 	std::vector<TWPartition*>::iterator iter;
 
@@ -2803,6 +4484,11 @@ void TWPartitionManager::Remove_Uevent_Devices(const string& Mount_Point) {
 void TWPartitionManager::Handle_Uevent(const Uevent_Block_Data& uevent_data) {
 	std::vector<TWPartition*>::iterator iter;
 
+#ifdef TW_INCLUDE_CRYPTO
+	// A card may have been swapped for another one under the same device
+	gpt_disk_invalidate_cache();
+#endif
+
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if (!(*iter)->Sysfs_Entry.empty()) {
 			string device;
@@ -2814,6 +4500,7 @@ void TWPartitionManager::Handle_Uevent(const Uevent_Block_Data& uevent_data) {
 			}
 			if (device == uevent_data.sysfs_path.substr(0, device.size())) {
 				// Found a match
+				(*iter)->Invalidate_Size();
 				if (uevent_data.action == "add") {
 					(*iter)->Primary_Block_Device = "/dev/block/" + uevent_data.block_device;
 					(*iter)->Alternate_Block_Device = (*iter)->Primary_Block_Device;
@@ -2930,54 +4617,110 @@ void TWPartitionManager::Add_Partition(TWPartition* Part) {
 	Partitions.push_back(Part);
 }
 
-void TWPartitionManager::Coldboot_Scan(std::vector<string> *sysfs_entries, const string& Path, int depth) {
-	string Real_Path = Path;
-	char real_path[PATH_MAX];
-	if (realpath(Path.c_str(), &real_path[0])) {
-		string Real_Path = real_path;
-		std::vector<string>::iterator iter;
-		for (iter = sysfs_entries->begin(); iter != sysfs_entries->end(); iter++) {
-			if (Real_Path.find((*iter)) != string::npos) {
-				string Write_Path = Real_Path + "/uevent";
-				if (TWFunc::Path_Exists(Write_Path)) {
-					const char* write_val = "add\n";
-					TWFunc::write_to_file(Write_Path, write_val);
-					break;
-				}
-			}
-		}
+struct Coldboot_Job {
+	std::vector<string> Paths;                                                // uevent files to write "add" to
+	size_t Next;
+	pthread_mutex_t Lock;
+};
+
+static void* Coldboot_Worker(void *cookie) {
+	Coldboot_Job* job = (Coldboot_Job*) cookie;
+
+	for (;;) {
+		pthread_mutex_lock(&job->Lock);
+		size_t i = job->Next++;
+		pthread_mutex_unlock(&job->Lock);
+		if (i >= job->Paths.size())
+			break;
+		TWFunc::write_to_file(job->Paths[i], "add\n");
 	}
+	return NULL;
+}
 
-	DIR* d = opendir(Path.c_str());
-	if (d != NULL) {
-		struct dirent* de;
-		while ((de = readdir(d)) != NULL) {
-			if (de->d_name[0] == '.' || (de->d_type != DT_DIR && depth > 0))
-				continue;
-			if (strlen(de->d_name) >= 4 && (strncmp(de->d_name, "ram", 3) == 0 || strncmp(de->d_name, "loop", 4) == 0))
-				continue;
+// Writes the uevent files of job on a few threads, each write waits for the
+// kernel to send its event
+static void Coldboot_Trigger(Coldboot_Job* job) {
+	std::vector<pthread_t> workers;
+	size_t i, threads;
 
-			string item = Path + "/";
-			item.append(de->d_name);
-			Coldboot_Scan(sysfs_entries, item, depth + 1);
-		}
-		closedir(d);
+	if (job->Paths.empty())
+		return;
+	job->Next = 0;
+	pthread_mutex_init(&job->Lock, NULL);
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	threads = cores > 1 ? (size_t) cores : 1;
+	if (threads > job->Paths.size())
+		threads = job->Paths.size();
+	for (i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Coldboot_Worker, job) != 0)
+			break;
+		workers.push_back(thread);
 	}
+	Coldboot_Worker(job);
+	for (i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	pthread_mutex_destroy(&job->Lock);
 }
 
 void TWPartitionManager::Coldboot() {
+	twrpStartupTrace::Scope trace("coldboot");
 	std::vector<TWPartition*>::iterator iter;
 	std::vector<string> sysfs_entries;
+	Coldboot_Job disks, parts;
+	timespec start, end;
+	size_t i;
 
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if (!(*iter)->Sysfs_Entry.empty()) {
 			size_t wildcard_pos = (*iter)->Sysfs_Entry.find("*");
 			if (wildcard_pos == string::npos)
 				wildcard_pos = (*iter)->Sysfs_Entry.size();
-			sysfs_entries.push_back((*iter)->Sysfs_Entry.substr(0, wildcard_pos));
+			string entry = (*iter)->Sysfs_Entry.substr(0, wildcard_pos);
+			if (std::find(sysfs_entries.begin(), sysfs_entries.end(), entry) == sysfs_entries.end())
+				sysfs_entries.push_back(entry);
 		}
 	}
+	if (sysfs_entries.empty())
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// Every disk and partition has a link in /sys/class/block, so only those
+	// are resolved instead of walking the device tree below /sys/block
+	DIR* d = opendir("/sys/class/block");
+	if (d == NULL) {
+		LOGINFO("Unable to open /sys/class/block: %s\n", strerror(errno));
+		return;
+	}
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (strlen(de->d_name) >= 4 && (strncmp(de->d_name, "ram", 3) == 0 || strncmp(de->d_name, "loop", 4) == 0))
+			continue;
+
+		char real_path[PATH_MAX];
+		string item = "/sys/class/block/";
+		item.append(de->d_name);
+		if (!realpath(item.c_str(), real_path))
+			continue;
+		string Real_Path = real_path;
+		for (i = 0; i < sysfs_entries.size(); i++) {
+			if (Real_Path.find(sysfs_entries[i]) != string::npos)
+				break;
+		}
+		if (i == sysfs_entries.size() || !TWFunc::Path_Exists(Real_Path + "/uevent"))
+			continue;
+		// Disks are added ahead of their partitions
+		if (TWFunc::Path_Exists(Real_Path + "/partition"))
+			parts.Paths.push_back(Real_Path + "/uevent");
+		else
+			disks.Paths.push_back(Real_Path + "/uevent");
+	}
+	closedir(d);
 
-	if (sysfs_entries.size() > 0)
-		Coldboot_Scan(&sysfs_entries, "/sys/block", 0);
+	Coldboot_Trigger(&disks);
+	Coldboot_Trigger(&parts);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	LOGINFO("Coldboot added %zu disks and %zu partitions in %i ms\n", disks.Paths.size(), parts.Paths.size(), TWFunc::timespec_diff_ms(start, end));
 }
@@ -22,10 +22,15 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <unordered_set>
+#include <pthread.h>
 #include <sys/poll.h>
 #include "exclude.hpp"
+#include "twrpScan.hpp"
 #include "tw_atomic.hpp"
 #include "progresstracking.hpp"
+#include "twrpFsTool.hpp"
+#include "twrp-functions.hpp"
 
 #define MAX_FSTAB_LINE_LENGTH 2048
 
@@ -78,14 +83,26 @@ enum PartitionManager_Op {                                                    //
 };
 
 class TWPartition;
+class twrpPerfReport;
 
 struct PartitionSettings {                                                    // Settings for backup session
 	TWPartition* Part;                                                        // Partition to pass to the partition backup loop
 	std::string Backup_Folder;                                                // Path to restore folder
 	bool adbbackup;                                                           // tell the system we are backing up over adb
-	bool adb_compression;                                                     // 0 == uncompressed, 1 == compressed
+	unsigned adb_compression;                                                 // Archive_Type of the adb stream data, 0 == uncompressed
+	unsigned adb_streams;                                                     // streams the adb backup file being restored is split over
+	unsigned adb_encrypted_streams;                                           // bit n is set if stream n of the adb backup file is encrypted
 	bool generate_digest;                                                      // tell system to create digest for partitions
 	bool generate_md5;                                                        // tell system to create md5 for partitions
+	bool digest_written;                                                      // digest files of the last partition were written during its backup
+	bool incremental;                                                         // only back up files that changed since the last backup with a manifest
+	bool dedup;                                                               // store archives and images in the shared chunk store of the backups folder
+	bool sparse;                                                              // back up emmc memory types as sparse images
+	unsigned image_compression;                                               // Archive_Type of emmc images that are not sparse, 0 == uncompressed
+	bool write_index;                                                         // write a seek index next to each archive for restoring single paths
+	int backup_threads;                                                       // tar threads from the storage benchmark when tw_backup_threads is 0, 0 for none
+	int zstd_level;                                                           // zstd level from the storage benchmark in place of tw_zstd_level, 0 for none
+	unsigned rw_block_size;                                                   // image write size from the storage benchmark, 0 for the default
 	uint64_t total_restore_size;                                              // Total size of restored backup
 	uint64_t img_bytes_remaining;                                             // remaining img/emmc bytes to backup for progress indicator
 	uint64_t file_bytes_remaining;                                            // remaining file bytes to backup for progress indicator
@@ -95,6 +112,7 @@ struct PartitionSettings {                                                    //
 	uint64_t file_bytes;                                                      // total file bytes of all file based partitions
 	int partition_count;                                                      // Number of partitions to restore
 	ProgressTracking *progress;                                               // Keep track of progress in GUI
+	twrpPerfReport *report;                                                   // Performance report of the backup or restore, NULL for none
 	enum PartitionManager_Op PM_Method;                                       // Current operation of backup or restore
 };
 
@@ -124,17 +142,20 @@ public:
 	bool Wipe_AndSec();                                                       // Wipes android secure
 	bool Can_Repair();                                                        // Checks to see if we have everything needed to be able to repair the current file system
 	uint64_t Get_Max_FileSize();                                              // get partition maxFileSie
-	bool Repair();                                                            // Repairs the current file system
+	bool Repair(const twrpFsProgress& Progress = twrpFsProgress());          // Repairs the current file system, Progress follows the repair tool instead of the progress bar
 	bool Can_Resize();                                                        // Checks to see if we have everything needed to be able to resize the current file system
 	bool Resize();                                                            // Resizes the current file system
 	bool Backup(PartitionSettings *part_settings, pid_t *tar_fork_pid);       // Backs up the partition to the folder specified
 	bool Restore(PartitionSettings *part_settings);                           // Restores the partition using the backup folder provided
+	bool Verify_Backup(PartitionSettings *part_settings);                     // Reads the archives of the backup folder provided through libtar without writing anything
 	unsigned long long Get_Restore_Size(PartitionSettings *part_settings);    // Returns the overall restore size of the backup
 	string Backup_Method_By_Name();                                           // Returns a string of the backup method for human readable output
 	bool Decrypt(string Password);                                            // Decrypts the partition, return 0 for failure and -1 for success
 	bool Wipe_Encryption();                                                   // Ignores wipe commands for /data/media devices and formats the original block device
 	void Check_FS_Type();                                                     // Checks the fs type using blkid, does not do anything on MTD / yaffs2 because this crashes on some devices
 	bool Update_Size(bool Display_Error);                                     // Updates size information
+	bool Update_Size_If_Changed(bool Display_Error);                          // Updates size information if the partition changed since the last Update_Size
+	void Invalidate_Size();                                                   // Marks the sizes and the folder scan stale after a mount, unmount or write
 	void Recreate_Media_Folder();                                             // Recreates the /data/media folder
 	bool Flash_Image(PartitionSettings *part_settings);                                        // Flashes an image to the partition
 	void Change_Mount_Read_Only(bool new_value);                              // Changes Mount_Read_Only to new_value
@@ -181,6 +202,8 @@ private:
 	unsigned long long IOCTL_Get_Block_Size();                                // Finds the partition size using ioctl
 	bool Find_Partition_Size();                                               // Finds the partition size from /proc/partitions
 	unsigned long long Get_Size_Via_du(string Path, bool Display_Error);      // Uses du to get sizes
+	bool Discard_Block_Device();                                              // Discards the file system range of the block device ahead of a format, true if the device took it
+	int Run_Fs_Tool(twrpFsTool& Tool, const twrpFsProgress& Progress = twrpFsProgress()); // Runs a mkfs or fsck tool with its progress on the progress bar, or passed to Progress if set
 	bool Wipe_EXT23(string File_System);                                      // Formats as ext3 or ext2
 	bool Wipe_EXT4();                                                         // Formats using ext4, uses make_ext4fs when present
 	bool Wipe_FAT();                                                          // Formats as FAT if mkfs.fat exits otherwise rm -rf wipe
@@ -193,21 +216,31 @@ private:
 	bool Wipe_Data_Without_Wiping_Media_Func(const string& parent);           // Uses rm -rf to wipe but does not wipe /data/media
 	bool Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_pid);   // Backs up using tar for file systems
 	bool Backup_Image(PartitionSettings *part_settings);                      // Backs up using raw read/write for emmc memory types
+	bool Backup_Sparse_Image(PartitionSettings *part_settings);               // Backs up emmc memory types as a sparse image without their free blocks
 	bool Raw_Read_Write(PartitionSettings *part_settings);
+	Archive_Type Get_Image_Type(PartitionSettings *part_settings);            // Format of a backed up image from its .info file, UNCOMPRESSED for raw images and backups without one
+	Archive_Type Get_Image_Compression(PartitionSettings *part_settings);     // Codec of a backed up image, UNCOMPRESSED for images that are not compressed
 	bool Backup_Dump_Image(PartitionSettings *part_settings);                 // Backs up using dump_image for MTD memory types
 	string Get_Restore_File_System(PartitionSettings *part_settings);         // Returns the file system that was in place at the time of the backup
 	bool Restore_Tar(PartitionSettings *part_settings);                       // Restore using tar for file systems
+	bool Restore_Paths(PartitionSettings *part_settings, const std::vector<string>& Paths); // Restore only some files and folders from a tar backup without wiping
+	string Find_Incremental_Base(const string& Backup_Folder);                 // Returns the newest other backup folder with a manifest for this partition
+	bool Get_Incremental_Chain(const string& Backup_Folder, std::vector<string> *Chain, std::vector<string> *Files, bool Display_Error); // Lists the backups an incremental backup needs, oldest first
+	bool Apply_Deleted_List(const string& Filename);                          // Removes the paths an incremental backup recorded as deleted
 	bool Restore_Image(PartitionSettings *part_settings);                     // Restore using dd for images
 	bool Check_Restore_File_MD5(const string& Filename);                      // Verifies MD5 matches for a file before restoration
+	bool Update_Size_Now(bool Display_Error);                                 // Does the work of Update_Size
 	bool Get_Size_Via_statfs(bool Display_Error);                             // Get Partition size, used, and free space using statfs
-	bool Get_Size_Via_df(bool Display_Error);                                 // Get Partition size, used, and free space using df command
+	bool Get_Size_Via_statvfs(bool Display_Error);                            // Get Partition size, used, and free space the way df counts them
+	bool Get_Backup_Size_Via_Quota();                                         // Backup size of a data/media partition from its quota usage without /data/media, false if the file system has no usable quota
 	bool Make_Dir(string Path, bool Display_Error);                           // Creates a directory if it doesn't already exist
 	bool Find_MTD_Block_Device(string MTD_Name);                              // Finds the mtd block device based on the name from the fstab
 	void Recreate_AndSec_Folder(void);                                        // Recreates the .android_secure folder
 	bool Mount_Storage_Retry(bool Display_Error);                             // Tries multiple times with a half second delay to mount a device in case storage is slow to mount
 	bool Is_Sparse_Image(const string& Filename);                             // Determines if a file is in sparse image format
-	bool Flash_Sparse_Image(const string& Filename);                          // Flashes a sparse image using simg2img
+	bool Flash_Sparse_Image(const string& Filename, ProgressTracking *progress); // Flashes a sparse image with twrpSparseFlasher, progress may be NULL
 	bool Flash_Image_FI(const string& Filename, ProgressTracking *progress);  // Flashes an image to the partition using flash_image for mtd nand
+	bool Flash_MTD_Image(const string& Filename, ProgressTracking *progress); // Flashes an image to an mtd partition with libmtdutils, progress may be NULL
 	void ExcludeAll(const string& path);                                      // Adds an exclusion for path to both the backup and wipe exclusion lists
 
 private:
@@ -236,6 +269,8 @@ private:
 	unsigned long long Free;                                                  // Overall free space
 	unsigned long long Backup_Size;                                           // Backup size -- may be different than used space especially when /data/media is present
 	unsigned long long Restore_Size;                                          // Restore size of the current restore operation
+	unsigned long long Restore_File_Count;                                    // Files in the backup being restored, 0 if the .info has no count
+	string Restore_Size_File;                                                 // Backup that Restore_Size was read or measured for
 	bool Can_Be_Encrypted;                                                    // This partition might be encrypted, affects error handling, can only be true if crypto support is compiled in
 	bool Is_Encrypted;                                                        // This partition is thought to be encrypted -- it wouldn't mount for some reason, only avialble with crypto support
 	bool Is_Decrypted;                                                        // This partition has successfully been decrypted
@@ -263,8 +298,14 @@ private:
 	bool Is_Adopted_Storage;                                                  // Indicates that this partition is for adopted storage (android_expand)
 	bool SlotSelect;                                                          // Partition has A/B slots
 	TWExclude backup_exclusions;                                              // Exclusions for file based backups
+	twrpScan backup_scan;                                                     // Folder scan from the last size update, reused by the tar backup
 	TWExclude wipe_exclusions;                                                // Exclusions for file based wipes (data/media devices only)
 	string Key_Directory;                                                      // Metadata key directory needed for mounting FBE encrypted data partitions using metadata encryption
+	unsigned long Size_Epoch;                                                 // Bumped by Invalidate_Size()
+	unsigned long Sized_Epoch;                                                // Size_Epoch the current sizes were taken at
+	bool Sizing;                                                              // Update_Size is mounting, its own mount and unmount change nothing
+	string Probed_Block_Device;                                               // Block device TWPartitionManager::Probe_Partitions() ran blkid on, spares the first mount of it another probe
+	twrpFsProgress Wipe_Progress;                                             // Set while a batch wipe runs, follows the mkfs tools instead of the progress bar
 
 	struct partition_fs_flags_struct {                                        // This struct is used to store mount flags and options for different file systems for the same partition
 		string File_System;
@@ -302,25 +343,31 @@ public:
 	int Check_Backup_Name(bool Display_Error);                                // Checks the current backup name to ensure that it is valid
 	int Run_Backup(bool adbbackup);                                           // Initiates a backup in the current storage
 	int Run_Restore(const string& Restore_Name);                              // Restores a backup
+	int Run_Restore_Path(const string& Restore_Name, const string& Path);     // Restores one file or folder from a backup
+	int Run_Verify(const string& Backup_Folder);                              // Reads every archive of a backup through the restore pipeline without writing anything
+	bool Run_Storage_Benchmark();                                             // Measures every mounted storage with twrpStorageBench and saves the results
 	bool Write_ADB_Stream_Header(uint64_t partition_count);                   // Write ADB header over twrpbu FIFO
 	bool Write_ADB_Stream_Trailer();                                          // Write ADB trailer over twrpbu FIFO
 	void Set_Restore_Files(string Restore_Name);                              // Used to gather a list of available backup partitions for the user to select for a restore
-	int Wipe_By_Path(string Path);                                            // Wipes a partition based on path
+	int Wipe_By_Path(string Path);                                            // Wipes a partition based on path, or several separated by ; at once
 	int Wipe_By_Path(string Path, string New_File_System);                    // Wipes a partition based on path
-	int Factory_Reset();                                                      // Performs a factory reset
+	int Factory_Reset(const string& Also_Wipe = "");                          // Performs a factory reset, wiping the paths in Also_Wipe (separated by ;) along
 	int Wipe_Dalvik_Cache();                                                  // Wipes dalvik cache
 	int Wipe_Rotate_Data();                                                   // Wipes rotation data --
 	int Wipe_Battery_Stats();                                                 // Wipe battery stats -- /data/system/batterystats.bin
 	int Wipe_Android_Secure();                                                // Wipes android secure
 	int Format_Data();                                                        // Really formats data on /data/media devices -- also removes encryption
 	int Wipe_Media_From_Data();                                               // Removes and recreates the media folder on /data/media devices
-	int Repair_By_Path(string Path, bool Display_Error);                      // Repairs a partition based on path
+	int Repair_By_Path(string Path, bool Display_Error);                      // Repairs a partition based on path, or several separated by ; at once
 	int Resize_By_Path(string Path, bool Display_Error);                      // Resizes a partition based on path
-	void Update_System_Details();                                             // Updates fstab, file systems, sizes, etc.
+	void Update_System_Details();                                             // Updates fstab, file systems, sizes, etc. of the partitions that changed
+	void Hold_System_Details(bool Hold);                                      // While held, backups and restores leave the update at their end to the release, which does it once
+	void Invalidate_Size_By_Path(string Path);                                // Makes the next Update_System_Details() size this partition again
+	void Invalidate_All_Sizes();                                              // Makes the next Update_System_Details() size every partition again
 	int Decrypt_Device(string Password);                                      // Attempt to decrypt any encrypted partitions
 	int usb_storage_enable(void);                                             // Enable USB storage mode
 	int usb_storage_disable(void);                                            // Disable USB storage mode
-	void Mount_All_Storage(void);                                             // Mounts all storage locations
+	void Mount_All_Storage(void);                                             // Mounts all storage locations at once
 	void UnMount_Main_Partitions(void);                                       // Unmounts system and data if not data/media and boot if boot is mountable
 	int Partition_SDCard(void);                                               // Repartitions the sdcard
 	TWPartition *Get_Default_Storage_Partition();                             // Returns a pointer to a default storage partition
@@ -345,7 +392,10 @@ public:
 	bool Decrypt_Adopted();                                                   // Attempt to identy and decrypt any adopted storage partitions
 	void Remove_Partition_By_Path(string Path);                               // Removes / erases a partition entry from the partition list
 
-	bool Flash_Image(string& path, string& filename);                         // Flashes an image to a selected partition from the partition list
+	bool Flash_Image(string& path, string& filename);                         // Flashes an image to the partitions selected in the partition list
+	bool Flash_Image_To_All(const string& Filename, const std::vector<TWPartition*>& Parts, ProgressTracking *progress); // Reads a raw image once and writes it to all of Parts at the same time
+	bool Flash_Image_From_Zip(const string& Zip_Path, const string& Entry, const string& Partition_Path); // Streams a raw image out of a zip into a partition without extracting it
+	bool Raw_Copy(const string& Args);                                        // Copies like dd with if=, of=, bs=, count=, skip= and seek= through twrpRawCopy, with progress and cancel
 	bool Restore_Partition(struct PartitionSettings *part_settings);          // Restore the partitions based on type
 	TWAtomicInt stop_backup;
 	void Set_Active_Slot(const string& Slot);                                 // Sets the active slot to A or B
@@ -360,23 +410,38 @@ public:
 	void read_uevent();                                                       // Reads uevent data into a buffer
 	void close_uevent();                                                      // Closes the uevent netlink socket
 	void Add_Partition(TWPartition* Part);                                    // Adds a new partition to the Partitions vector
+	bool Is_Path_Mounted(const string& Path);                                 // Looks Path up in the mount table, rereads /proc/self/mountinfo first if it changed
+	void Invalidate_Mount_Table();                                            // Rereads the mount table on the next lookup, called when TWRP mounts or unmounts
+	void Handle_Mountinfo_Change();                                           // Called when select() reports an exception on mountinfo_fd
+	int mountinfo_fd;                                                         // /proc/self/mountinfo, poll() reports POLLPRI on it when the mounts change
 
 private:
 	void Setup_Settings_Storage_Partition(TWPartition* Part);                 // Sets up settings storage
 	void Setup_Android_Secure_Location(TWPartition* Part);                    // Sets up .android_secure if needed
+	void Probe_Partitions();                                                  // Checks the file systems of all present partitions at once with blkid
+	void Run_Mount_Jobs(const std::vector<TWPartition*>& Parts, bool Mount, bool Display_Error); // Mounts or unmounts Parts at once, each after the partitions it sits on are mounted or before they are unmounted
 	bool Backup_Partition(struct PartitionSettings *part_settings);           // Backup the partitions based on type
 	TWPartition* Find_Partition_By_MTP_Storage_ID(unsigned int Storage_ID);   // Returns a pointer to a partition based on MTP Storage ID
 	bool Add_Remove_MTP_Storage(TWPartition* Part, int message_type);         // Adds or removes an MTP Storage partition
 	TWPartition* Find_Next_Storage(string Path, bool Exclude_Data_Media);
 	int Open_Lun_File(string Partition_Path, string Lun_File);
 	void Post_Decrypt(const string& Block_Device);                            // Completes various post-decrypt tasks
-	void Coldboot_Scan(std::vector<string> *sysfs_entries, const string& Path, int depth); // Scans subfolders to find matches to the paths stored in sysfs_entries so we can trigger the uevent system to "re-add" devices
-	void Coldboot();                                                          // Starts the scan of the /sys/block folder
+	void Coldboot();                                                          // Triggers the uevent system to "re-add" the block devices that match the sysfs entries of the partitions
+	void Read_Mount_Table();                                                  // Fills mount_table from mountinfo_fd, mount_table_lock must be held
+	void Operation_System_Details();                                          // Update_System_Details() at the end of an operation, unless held
+	std::vector<bool> Run_Partition_Jobs(const std::vector<TWPartition*>& Parts, const std::function<bool(size_t, const twrpFsProgress&)>& Work, const char* Verb); // Runs Work(index) for Parts at once where they are on different block devices, returns the result of each
+	std::vector<bool> Repair_Partitions(const std::vector<TWPartition*>& Parts); // Repairs Parts at once where they are on different block devices, returns the result of each
+	std::vector<bool> Wipe_Partitions(const std::vector<TWPartition*>& Parts, const std::vector<bool>& AndSec); // Wipes Parts, or only their .android_secure where AndSec is set, at once where they are on different block devices
 	pid_t mtppid;
 	bool mtp_was_enabled;
 	int mtp_write_fd;
 	pid_t tar_fork_pid;                                                       // PID of twrpTar fork
+	std::unordered_set<string> mount_table;                                   // Mount points in /proc/self/mountinfo
+	bool mount_table_valid;
+	pthread_mutex_t mount_table_lock;
 	Backup_Method_enum Backup_Method;                                         // Method used for backup
+	bool details_held;
+	bool details_pending;                                                     // An operation ended while details_held
 
 private:
 	std::vector<TWPartition*> Partitions;                                     // Vector list of all partitions
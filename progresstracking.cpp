@@ -37,13 +37,21 @@ ProgressTracking::ProgressTracking(const unsigned long long backup_size) {
 	current_size = 0;
 	current_count = 0;
 	previous_partitions_size = 0;
+	background_size = 0;
+	rate = 0;
+	pthread_mutex_init(&background_lock, NULL);
 	display_file_count = false;
 	clock_gettime(CLOCK_MONOTONIC, &last_update);
 }
 
+ProgressTracking::~ProgressTracking() {
+	pthread_mutex_destroy(&background_lock);
+}
+
 void ProgressTracking::SetPartitionSize(const unsigned long long part_size) {
 	previous_partitions_size += partition_size;
 	partition_size = part_size;
+	rate = 0;
 	UpdateDisplayDetails(true);
 }
 
@@ -51,6 +59,7 @@ void ProgressTracking::SetSizeCount(const unsigned long long part_size, unsigned
 	previous_partitions_size += partition_size;
 	partition_size = part_size;
 	file_count = f_count;
+	rate = 0;
 	display_file_count = (file_count != 0);
 	UpdateDisplayDetails(true);
 }
@@ -66,11 +75,23 @@ void ProgressTracking::UpdateSizeCount(const unsigned long long size, const unsi
 	UpdateDisplayDetails(false);
 }
 
+void ProgressTracking::SetRate(const unsigned long long bytes_per_sec) {
+	rate = bytes_per_sec;
+	if (rate == 0)
+		UpdateDisplayDetails(true);
+}
+
 void ProgressTracking::DisplayFileCount(const bool display) {
 	display_file_count = display;
 	UpdateDisplayDetails(true);
 }
 
+void ProgressTracking::AddBackgroundSize(const unsigned long long size) {
+	pthread_mutex_lock(&background_lock);
+	background_size += size;
+	pthread_mutex_unlock(&background_lock);
+}
+
 void ProgressTracking::UpdateDisplayDetails(const bool force) {
 #ifndef BUILD_TWRPTAR_MAIN
 	if (!force) {
@@ -84,16 +105,31 @@ void ProgressTracking::UpdateDisplayDetails(const bool force) {
 	}
 	clock_gettime(CLOCK_MONOTONIC, &last_update);
 	double display_percent = 0.0, progress_percent;
+	unsigned long long done_size;
 	string size_prog = gui_lookup("size_progress", "%lluMB of %lluMB, %i%%");
 	char size_progress[1024];
 
+	pthread_mutex_lock(&background_lock);
+	done_size = current_size + previous_partitions_size + background_size;
+	pthread_mutex_unlock(&background_lock);
 	if (total_backup_size != 0) // prevent division by 0
-		display_percent = (double)(current_size + previous_partitions_size) / (double)(total_backup_size) * 100;
-	sprintf(size_progress, size_prog.c_str(), (current_size + previous_partitions_size) / 1048576, total_backup_size / 1048576, (int)(display_percent));
+		display_percent = (double)(done_size) / (double)(total_backup_size) * 100;
+	sprintf(size_progress, size_prog.c_str(), done_size / 1048576, total_backup_size / 1048576, (int)(display_percent));
 	DataManager::SetValue("tw_size_progress", size_progress);
 	progress_percent = (display_percent / 100);
 	DataManager::SetProgress((float)(progress_percent));
 
+	if (rate == 0) {
+		DataManager::SetValue("tw_rate_progress", "");
+	} else {
+		string rate_prog = gui_lookup("rate_progress", "%lluMB/s, %llu:%02llu left");
+		char rate_progress[1024];
+		unsigned long long left = done_size < total_backup_size ? (total_backup_size - done_size) / rate : 0;
+
+		sprintf(rate_progress, rate_prog.c_str(), rate / 1048576, left / 60, left % 60);
+		DataManager::SetValue("tw_rate_progress", rate_progress);
+	}
+
 	if (!display_file_count || file_count == 0) {
 		DataManager::SetValue("tw_file_progress", "");
 	} else {
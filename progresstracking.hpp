@@ -20,20 +20,24 @@
 #define __PROGRESSTRACKING_HPP
 
 #include <time.h>
+#include <pthread.h>
 
 // Progress tracking class for tracking backup progess and updating the progress bar as appropriate
 class ProgressTracking
 {
 public:
 	ProgressTracking(const unsigned long long backup_size);
+	~ProgressTracking();
 
 	void SetPartitionSize(const unsigned long long part_size);
 	void SetSizeCount(const unsigned long long part_size, unsigned long long f_count);
 
 	void UpdateSize(const unsigned long long size);
 	void UpdateSizeCount(const unsigned long long size, const unsigned long long count);
+	void SetRate(const unsigned long long bytes_per_sec);                      // Shows the rate and the time left, 0 to hide them
 
 	void DisplayFileCount(const bool display);
+	void AddBackgroundSize(const unsigned long long size);                     // Counts data backed up by another thread, safe to call from any thread
 	void UpdateDisplayDetails(const bool force);
 
 private:
@@ -46,6 +50,10 @@ private:
 	unsigned long long current_count;                  // Count of files that have already been backed up for the current partition
 
 	unsigned long long previous_partitions_size;       // Total data already backed up from previous partitions (for the progress bar)
+	unsigned long long background_size;                // Total data backed up by other threads, under background_lock
+	pthread_mutex_t background_lock;
+
+	unsigned long long rate;                           // Bytes per second of the current partition, 0 if unknown
 
 	bool display_file_count;                           // Inidicates if we will display the file count text
 	timespec last_update;                              // Tracks last update of the displayed progress (frequent updates tax the CPU and slow us down)
@@ -84,7 +84,8 @@ ScreenRecoveryUI::ScreenRecoveryUI()
       max_stage(-1),
       locale_(""),
       rtl_locale_(false),
-      updateMutex(PTHREAD_MUTEX_INITIALIZER) {}
+      updateMutex(PTHREAD_MUTEX_INITIALIZER),
+      progress_cond_(PTHREAD_COND_INITIALIZER) {}
 
 GRSurface* ScreenRecoveryUI::GetCurrentFrame() const {
   if (currentIcon == INSTALLING_UPDATE || currentIcon == ERASING) {
@@ -504,15 +505,15 @@ void* ScreenRecoveryUI::ProgressThreadStartRoutine(void* data) {
 
 void ScreenRecoveryUI::ProgressThreadLoop() {
   double interval = 1.0 / kAnimationFps;
+  pthread_mutex_lock(&updateMutex);
   while (true) {
     double start = now();
-    pthread_mutex_lock(&updateMutex);
-
     bool redraw = false;
 
     // update the installation animation, if active
     // skip this if we have a text overlay (too expensive to update)
-    if ((currentIcon == INSTALLING_UPDATE || currentIcon == ERASING) && !show_text) {
+    bool animating = (currentIcon == INSTALLING_UPDATE || currentIcon == ERASING) && !show_text;
+    if (animating) {
       if (!intro_done) {
         if (current_frame == intro_frames - 1) {
           intro_done = true;
@@ -529,6 +530,7 @@ void ScreenRecoveryUI::ProgressThreadLoop() {
 
     // move the progress bar forward on timed intervals, if configured
     int duration = progressScopeDuration;
+    bool timed = false;
     if (progressBarType == DETERMINATE && duration > 0) {
       double elapsed = now() - progressScopeTime;
       float p = 1.0 * elapsed / duration;
@@ -537,16 +539,27 @@ void ScreenRecoveryUI::ProgressThreadLoop() {
         progress = p;
         redraw = true;
       }
+      timed = p < 1.0;
     }
 
     if (redraw) update_progress_locked();
 
-    pthread_mutex_unlock(&updateMutex);
-    double end = now();
-    // minimum of 20ms delay between frames
-    double delay = interval - (end - start);
+    if (!animating && !timed) {
+      // Nothing moves on its own until the icon, the text overlay or the progress changes
+      pthread_cond_wait(&progress_cond_, &updateMutex);
+      continue;
+    }
+
+    // minimum of 20ms delay between frames, the frames don't speed up when woken
+    double delay = interval - (now() - start);
     if (delay < 0.02) delay = 0.02;
-    usleep(static_cast<useconds_t>(delay * 1000000));
+    double deadline = now() + delay;
+    struct timespec ts;
+    ts.tv_sec = static_cast<time_t>(deadline);
+    ts.tv_nsec = static_cast<long>((deadline - ts.tv_sec) * 1000000000);
+    while (now() < deadline) {
+      if (pthread_cond_timedwait(&progress_cond_, &updateMutex, &ts) == ETIMEDOUT) break;
+    }
   }
 }
 
@@ -679,6 +692,7 @@ void ScreenRecoveryUI::SetBackground(Icon icon) {
 
   currentIcon = icon;
   update_screen_locked();
+  pthread_cond_signal(&progress_cond_);
 
   pthread_mutex_unlock(&updateMutex);
 }
@@ -692,6 +706,7 @@ void ScreenRecoveryUI::SetProgressType(ProgressType type) {
   progressScopeSize = 0;
   progress = 0;
   update_progress_locked();
+  pthread_cond_signal(&progress_cond_);
   pthread_mutex_unlock(&updateMutex);
 }
 
@@ -704,6 +719,7 @@ void ScreenRecoveryUI::ShowProgress(float portion, float seconds) {
   progressScopeDuration = seconds;
   progress = 0;
   update_progress_locked();
+  pthread_cond_signal(&progress_cond_);
   pthread_mutex_unlock(&updateMutex);
 }
 
@@ -718,6 +734,7 @@ void ScreenRecoveryUI::SetProgress(float fraction) {
     if ((int)(progress * scale) != (int)(fraction * scale)) {
       progress = fraction;
       update_progress_locked();
+      pthread_cond_signal(&progress_cond_);
     }
   }
   pthread_mutex_unlock(&updateMutex);
@@ -923,6 +940,7 @@ void ScreenRecoveryUI::ShowText(bool visible) {
   show_text = visible;
   if (show_text) show_text_ever = true;
   update_screen_locked();
+  pthread_cond_signal(&progress_cond_);
   pthread_mutex_unlock(&updateMutex);
 }
 
@@ -211,6 +211,8 @@ class ScreenRecoveryUI : public RecoveryUI {
   bool rtl_locale_;
 
   pthread_mutex_t updateMutex;
+  // Wakes the progress thread when there may be something for it to animate.
+  pthread_cond_t progress_cond_;
 
  private:
   void SetLocale(const std::string&);
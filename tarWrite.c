@@ -19,17 +19,46 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "libtar/libtar.h"
 #include "twcommon.h"
 
-int flush = 0, eot_count = -1;
-unsigned char *write_buffer;
-unsigned buffer_size = 4096;
-unsigned buffer_loc = 0;
-int buffer_status = 0;
-int prog_pipe = -1;
-const unsigned long long progress_size = (unsigned long long)(T_BLOCKSIZE);
+/* Threaded backups run one tar per thread, so every thread gets its own
+   write buffer state.
+*/
+static __thread int flush = 0, eot_count = -1;
+static __thread unsigned char *write_buffer;
+static __thread unsigned buffer_size = 4096;
+static __thread unsigned buffer_loc = 0;
+static __thread int buffer_status = 0;
+
+/* Written bytes are added to the tar thread's own counter in the progress
+   block that the GUI process reads, see twrpTarProgress.
+*/
+static __thread unsigned long long *prog_bytes = NULL;
+
+void twrpTarProgress_Add_Write_Time(unsigned long long usec);
+
+static unsigned long long now_usec(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static ssize_t timed_write(int fd, const void *buffer, size_t size) {
+	unsigned long long start = now_usec();
+	ssize_t ret = write(fd, buffer, size);
+
+	twrpTarProgress_Add_Write_Time(now_usec() - start);
+	return ret;
+}
+
+void report_libtar_progress(unsigned long long size) {
+	if (prog_bytes != NULL)
+		__atomic_fetch_add(prog_bytes, size, __ATOMIC_RELAXED);
+}
 
 void reinit_libtar_buffer(void) {
 	flush = 0;
@@ -38,25 +67,52 @@ void reinit_libtar_buffer(void) {
 	buffer_status = 1;
 }
 
-void init_libtar_buffer(unsigned new_buff_size, int pipe_fd) {
+void init_libtar_buffer(unsigned new_buff_size, unsigned long long *progress) {
 	if (new_buff_size != 0)
 		buffer_size = new_buff_size;
 
 	reinit_libtar_buffer();
 	write_buffer = (unsigned char*) malloc(sizeof(char *) * buffer_size);
-	prog_pipe = pipe_fd;
+	prog_bytes = progress;
 }
 
 void free_libtar_buffer(void) {
 	if (buffer_status > 0)
 		free(write_buffer);
 	buffer_status = 0;
-	prog_pipe = -1;
+	prog_bytes = NULL;
+}
+
+static int write_buffer_out(int fd, const void *buffer, size_t size) {
+	if (timed_write(fd, buffer, size) != (ssize_t)size) {
+		LOGERR("Error writing tar file!\n");
+		return -1;
+	}
+	report_libtar_progress(size);
+	return 0;
 }
 
 ssize_t write_libtar_buffer(int fd, const void *buffer, size_t size) {
 	void* ptr;
 
+	if (flush == 0 && buffer_loc + size > buffer_size) {
+		/* libtar hands us bulk payload chunks that are larger than the
+		   buffer. Write out whatever is queued ahead of them, then send
+		   the chunk straight to the file instead of copying it.
+		*/
+		if (buffer_loc > 0) {
+			if (write_buffer_out(fd, write_buffer, buffer_loc) != 0) {
+				buffer_loc = 0;
+				return -1;
+			}
+			buffer_loc = 0;
+		}
+		if (size >= buffer_size) {
+			if (write_buffer_out(fd, buffer, size) != 0)
+				return -1;
+			return size;
+		}
+	}
 	if (flush == 0) {
 		ptr = write_buffer + buffer_loc;
 		memcpy(ptr, buffer, size);
@@ -78,13 +134,10 @@ ssize_t write_libtar_buffer(int fd, const void *buffer, size_t size) {
 			// nothing to write
 			return 0;
 		}
-		if (write(fd, write_buffer, buffer_loc) != (int)buffer_loc) {
-			LOGERR("Error writing tar file!\n");
+		if (write_buffer_out(fd, write_buffer, buffer_loc) != 0) {
 			buffer_loc = 0;
 			return -1;
 		} else {
-			unsigned long long fs = (unsigned long long)(buffer_loc);
-			write(prog_pipe, &fs, sizeof(fs));
 			buffer_loc = 0;
 			return size;
 		}
@@ -101,13 +154,15 @@ void flush_libtar_buffer(int fd) {
 		buffer_status = 2;
 }
 
-void init_libtar_no_buffer(int pipe_fd) {
+void init_libtar_no_buffer(unsigned long long *progress) {
 	buffer_size = T_BLOCKSIZE;
-	prog_pipe = pipe_fd;
+	prog_bytes = progress;
 	buffer_status = 0;
 }
 
 ssize_t write_libtar_no_buffer(int fd, const void *buffer, size_t size) {
-	write(prog_pipe, &progress_size, sizeof(progress_size));
-	return write(fd, buffer, size);
+	ssize_t ret = timed_write(fd, buffer, size);
+	if (ret > 0)
+		report_libtar_progress(ret);
+	return ret;
 }
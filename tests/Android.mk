@@ -37,10 +37,12 @@ LOCAL_SRC_FILES := \
     unit/asn1_decoder_test.cpp \
     unit/dirutil_test.cpp \
     unit/locale_test.cpp \
+    unit/minui_kernels_test.cpp \
     unit/rangeset_test.cpp \
     unit/sysutil_test.cpp \
     unit/zip_test.cpp \
-    unit/ziputil_test.cpp
+    unit/ziputil_test.cpp \
+    ../minuitwrp/graphics_kernels.cpp
 
 LOCAL_C_INCLUDES := $(commands_recovery_local_path)
 LOCAL_SHARED_LIBRARIES := liblog
@@ -195,6 +197,114 @@ LOCAL_PICKUP_FILES := $(testdata_continuous_zip_prefix)
 
 include $(BUILD_NATIVE_TEST)
 
+# Benchmarks
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := \
+    -Wall \
+    -Werror \
+    -D_FILE_OFFSET_BITS=64
+LOCAL_MODULE := recovery_benchmark
+LOCAL_C_INCLUDES := $(commands_recovery_local_path)
+LOCAL_SRC_FILES := \
+    benchmark/install_benchmark.cpp \
+    benchmark/sideload_benchmark.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libfusesideload \
+    librecovery \
+    libverifier \
+    libotautil \
+    libfs_mgr \
+    libvintf_recovery \
+    libvintf \
+    libhidl-gen-utils \
+    libtinyxml2 \
+    libselinux \
+    libcrypto_utils \
+    libcrypto \
+    libziparchive \
+    libutils \
+    libz \
+    libbase \
+    libcutils
+LOCAL_SHARED_LIBRARIES := \
+    libhidlbase \
+    liblog
+include $(BUILD_NATIVE_BENCHMARK)
+
+# Updater benchmark
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := \
+    -Wall \
+    -Werror
+LOCAL_MODULE := recovery_updater_benchmark
+LOCAL_C_INCLUDES := $(commands_recovery_local_path)
+LOCAL_SRC_FILES := \
+    benchmark/updater_benchmark.cpp
+LOCAL_STATIC_LIBRARIES := \
+    libapplypatch \
+    libedify \
+    libbsdiff \
+    libbspatch \
+    libotafault \
+    libupdater \
+    libotautil \
+    libmounts \
+    libdivsufsort \
+    libdivsufsort64 \
+    libfs_mgr \
+    libselinux \
+    libext4_utils \
+    libsparse \
+    libcrypto_utils \
+    libcrypto \
+    libbz \
+    libziparchive \
+    libutils \
+    libz \
+    libbase \
+    libtune2fs \
+    libfec \
+    libfec_rs \
+    libsquashfs_utils \
+    libcutils \
+    libbrotli \
+    $(tune2fs_static_libraries)
+LOCAL_SHARED_LIBRARIES := \
+    liblog
+include $(BUILD_NATIVE_BENCHMARK)
+
+# minuitwrp pixel kernel benchmark
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := \
+    -Wall \
+    -Werror
+LOCAL_MODULE := recovery_minui_kernels_benchmark
+LOCAL_C_INCLUDES := $(commands_recovery_local_path)
+LOCAL_SRC_FILES := \
+    benchmark/minui_kernels_benchmark.cpp \
+    ../minuitwrp/graphics_kernels.cpp
+include $(BUILD_NATIVE_BENCHMARK)
+
+# MTP loopback benchmark
+include $(CLEAR_VARS)
+LOCAL_CFLAGS := \
+    -Wall \
+    -Werror \
+    -DMTP_DEVICE \
+    -DMTP_HOST
+LOCAL_MODULE := recovery_mtp_benchmark
+LOCAL_C_INCLUDES := \
+    $(commands_recovery_local_path) \
+    system/core/include
+LOCAL_SRC_FILES := \
+    benchmark/mtp_benchmark.cpp
+LOCAL_SHARED_LIBRARIES := \
+    libtwrpmtp-ffs \
+    libcutils \
+    libbase \
+    liblog
+include $(BUILD_NATIVE_BENCHMARK)
+
 # Host tests
 include $(CLEAR_VARS)
 LOCAL_CFLAGS := -Wall -Werror
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/test_utils.h>
+#include <benchmark/benchmark.h>
+#include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
+
+#include "common/test_constants.h"
+#include "otautil/SysUtil.h"
+#include "private/install.h"
+#include "verifier.h"
+
+// The phases an install goes through before the update binary runs: map the package, check its
+// signature, open it as a zip and extract the update binary. Each phase is its own benchmark so
+// its latency shows up on its own line.
+
+struct Package {
+  std::string path;
+  std::string key;  // testkey_<key>.txt, empty for packages that are not signed
+};
+
+static constexpr size_t kSyntheticSizes[] = { 16, 128, 512 };  // MiB
+
+// The signed testdata packages, then synthetic ones with a small update binary and one large
+// entry, stored and deflated for each size. Synthetic packages are not signed.
+struct SyntheticDir {
+  ~SyntheticDir() {
+    for (const std::string& file : files) unlink(file.c_str());
+  }
+  TemporaryDir dir;
+  std::vector<std::string> files;
+};
+
+static const std::vector<Package>& Packages() {
+  static SyntheticDir synthetic;
+  static std::vector<Package> packages = [] {
+    std::vector<Package> result;
+    for (const char* key : { "v1", "v2", "v3", "v4", "v5" }) {
+      result.push_back({ from_testdata_base(std::string("otasigned_") + key + ".zip"), key });
+    }
+
+    std::mt19937 gen(0);
+    std::vector<uint8_t> chunk(1024 * 1024);
+    for (size_t size : kSyntheticSizes) {
+      for (bool deflated : { false, true }) {
+        std::string path = std::string(synthetic.dir.path) + "/synthetic_" + std::to_string(size) +
+                           (deflated ? "_deflated" : "_stored") + ".zip";
+        FILE* zip_file = fopen(path.c_str(), "w");
+        if (zip_file == nullptr) continue;
+        synthetic.files.push_back(path);
+        ZipWriter writer(zip_file);
+        writer.StartEntry("META-INF/com/google/android/update-binary", kCompressDeflated);
+        std::string binary(256 * 1024, '\x7f');
+        writer.WriteBytes(binary.data(), binary.size());
+        writer.FinishEntry();
+        writer.StartEntry("system.new.dat", deflated ? kCompressDeflated : 0);
+        for (size_t i = 0; i < size; i++) {
+          // Half random and half zeros, so deflate has something to do both ways
+          for (size_t j = 0; j < chunk.size() / 2; j += sizeof(uint32_t)) {
+            uint32_t value = gen();
+            memcpy(&chunk[j], &value, sizeof(value));
+          }
+          writer.WriteBytes(chunk.data(), chunk.size());
+        }
+        writer.FinishEntry();
+        writer.Finish();
+        fclose(zip_file);
+        result.push_back({ path, "" });
+      }
+    }
+    return result;
+  }();
+  return packages;
+}
+
+static void PackageArgs(benchmark::internal::Benchmark* b) {
+  size_t count = 5 + sizeof(kSyntheticSizes) / sizeof(kSyntheticSizes[0]) * 2;
+  for (size_t i = 0; i < count; i++) b->Arg(i);
+}
+
+static bool PickPackage(benchmark::State& state, const Package** package) {
+  const std::vector<Package>& packages = Packages();
+  if (static_cast<size_t>(state.range(0)) >= packages.size()) {
+    state.SkipWithError("Unable to create the package");
+    return false;
+  }
+  *package = &packages[state.range(0)];
+  state.SetLabel(android::base::Basename((*package)->path));
+  return true;
+}
+
+static void BM_MapPackage(benchmark::State& state) {
+  const Package* package;
+  if (!PickPackage(state, &package)) return;
+  size_t length = 0;
+  while (state.KeepRunning()) {
+    MemMapping map;
+    if (!map.MapFile(package->path)) {
+      state.SkipWithError("Unable to map the package");
+      return;
+    }
+    length = map.length;
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * length);
+}
+BENCHMARK(BM_MapPackage)->Apply(PackageArgs)->Unit(benchmark::kMicrosecond);
+
+static void BM_VerifyFile(benchmark::State& state) {
+  const Package* package;
+  if (!PickPackage(state, &package)) return;
+  if (package->key.empty()) {
+    state.SkipWithError("Not signed");
+    return;
+  }
+  std::vector<Certificate> certs;
+  MemMapping map;
+  if (!load_keys(from_testdata_base("testkey_" + package->key + ".txt").c_str(), certs) ||
+      !map.MapFile(package->path)) {
+    state.SkipWithError("Unable to load the package or its key");
+    return;
+  }
+  while (state.KeepRunning()) {
+    if (verify_file(map.addr, map.length, certs) != VERIFY_SUCCESS) {
+      state.SkipWithError("Verification failed");
+      return;
+    }
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * map.length);
+}
+BENCHMARK(BM_VerifyFile)->Apply(PackageArgs)->Unit(benchmark::kMicrosecond);
+
+static void BM_OpenArchive(benchmark::State& state) {
+  const Package* package;
+  if (!PickPackage(state, &package)) return;
+  MemMapping map;
+  if (!map.MapFile(package->path)) {
+    state.SkipWithError("Unable to map the package");
+    return;
+  }
+  while (state.KeepRunning()) {
+    ZipArchiveHandle zip;
+    int32_t err = OpenArchiveFromMemory(map.addr, map.length, package->path.c_str(), &zip);
+    CloseArchive(zip);
+    if (err != 0) {
+      state.SkipWithError("Unable to open the package");
+      return;
+    }
+  }
+}
+BENCHMARK(BM_OpenArchive)->Apply(PackageArgs)->Unit(benchmark::kMicrosecond);
+
+static void BM_ExtractUpdateBinary(benchmark::State& state) {
+  const Package* package;
+  if (!PickPackage(state, &package)) return;
+  MemMapping map;
+  ZipArchiveHandle zip;
+  if (!map.MapFile(package->path) ||
+      OpenArchiveFromMemory(map.addr, map.length, package->path.c_str(), &zip) != 0) {
+    state.SkipWithError("Unable to open the package");
+    return;
+  }
+  TemporaryDir dir;
+  std::string binary_path = std::string(dir.path) + "/update-binary";
+  while (state.KeepRunning()) {
+    std::vector<std::string> cmd;
+    if (update_binary_command(package->path, zip, binary_path, 0, 1, &cmd) != 0) {
+      state.SkipWithError("Unable to extract the update binary");
+      break;
+    }
+  }
+  unlink(binary_path.c_str());
+  CloseArchive(zip);
+}
+BENCHMARK(BM_ExtractUpdateBinary)->Apply(PackageArgs)->Unit(benchmark::kMicrosecond);
+
+// The large entry of the synthetic packages, the part of an install the update binary spends
+// its time on
+static void BM_ExtractLargeEntry(benchmark::State& state) {
+  const Package* package;
+  if (!PickPackage(state, &package)) return;
+  MemMapping map;
+  ZipArchiveHandle zip;
+  ZipEntry entry;
+  if (!map.MapFile(package->path) ||
+      OpenArchiveFromMemory(map.addr, map.length, package->path.c_str(), &zip) != 0) {
+    state.SkipWithError("Unable to open the package");
+    return;
+  }
+  if (FindEntry(zip, ZipString("system.new.dat"), &entry) != 0) {
+    CloseArchive(zip);
+    state.SkipWithError("No large entry");
+    return;
+  }
+  TemporaryFile out;
+  while (state.KeepRunning()) {
+    if (ftruncate(out.fd, 0) != 0 || lseek(out.fd, 0, SEEK_SET) != 0 || ExtractEntryToFile(zip, &entry, out.fd) != 0) {
+      state.SkipWithError("Unable to extract the entry");
+      break;
+    }
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * entry.uncompressed_length);
+  CloseArchive(zip);
+}
+BENCHMARK(BM_ExtractLargeEntry)->Apply(PackageArgs)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
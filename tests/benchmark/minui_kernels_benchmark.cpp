@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "minuitwrp/graphics_kernels.h"
+
+// The minuitwrp pixel kernels on a 1080 x 1920 screen: each kernel for each surface format, the
+// SIMD version next to the C one.
+
+static constexpr int kWidth = 1080;
+static constexpr int kHeight = 1920;
+
+enum Kernel { kFill, kFillBlend, kCopy, kBlend, kGlyph, kKernels };
+
+static const char* const kKernelNames[] = { "fill", "fill_blend", "copy", "blend", "glyph" };
+static const char* const kFormatNames[] = { "rgbx_8888", "bgra_8888", "rgb_565" };
+
+// Arguments: kernel, format and whether to use the SIMD version.
+static void BM_Kernel(benchmark::State& state) {
+  Kernel kernel = static_cast<Kernel>(state.range(0));
+  gr_kernel_format format = static_cast<gr_kernel_format>(state.range(1));
+  const gr_kernels* k = gr_get_kernels(format, state.range(2) != 0);
+  state.SetLabel(std::string(kKernelNames[kernel]) + "/" + kFormatNames[format] + "/" + k->name);
+
+  int dst_stride = kWidth * (format == GR_KERNEL_RGB_565 ? 2 : 4);
+  std::vector<uint8_t> dst(dst_stride * kHeight);
+  std::vector<uint8_t> src(kWidth * 4 * kHeight);
+  std::vector<uint8_t> mask(kWidth * kHeight);
+  std::mt19937 gen(0);
+  for (auto& b : dst) b = gen();
+  for (auto& b : src) b = gen();
+  for (auto& b : mask) b = gen();
+  uint32_t color = 0x80336699;
+
+  while (state.KeepRunning()) {
+    switch (kernel) {
+      case kFill: k->fill(dst.data(), dst_stride, kWidth, kHeight, color); break;
+      case kFillBlend: k->fill_blend(dst.data(), dst_stride, kWidth, kHeight, color); break;
+      case kCopy: k->copy(dst.data(), dst_stride, src.data(), kWidth * 4, kWidth, kHeight); break;
+      case kBlend: k->blend(dst.data(), dst_stride, src.data(), kWidth * 4, kWidth, kHeight); break;
+      case kGlyph:
+        k->glyph(dst.data(), dst_stride, mask.data(), kWidth, kWidth, kHeight, color);
+        break;
+      default: break;
+    }
+    benchmark::DoNotOptimize(dst.data());
+  }
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * kWidth * kHeight);
+}
+
+static void KernelArgs(benchmark::internal::Benchmark* b) {
+  for (int kernel = 0; kernel < kKernels; kernel++) {
+    for (int format : { GR_KERNEL_RGBX_8888, GR_KERNEL_BGRA_8888, GR_KERNEL_RGB_565 }) {
+      b->Args({ kernel, format, 0 });
+      b->Args({ kernel, format, 1 });
+    }
+  }
+}
+BENCHMARK(BM_Kernel)->Apply(KernelArgs)->Unit(benchmark::kMicrosecond);
+
+BENCHMARK_MAIN();
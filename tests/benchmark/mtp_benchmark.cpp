@@ -0,0 +1,319 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/test_utils.h>
+#include <benchmark/benchmark.h>
+
+#include "mtp/ffs/IMtpHandle.h"
+#include "mtp/ffs/MtpServer.h"
+#include "mtp/ffs/MtpStorage.h"
+#include "mtp/ffs/mtp.h"
+#include "mtp/ffs/mtp_MtpDatabase.hpp"
+
+static constexpr MtpStorageID kStorageId = 65537;
+static constexpr size_t kChunkSize = 1024 * 1024;
+
+// Stands in for the USB gadget. Requests come from the benchmark, what the server writes back is
+// dropped except for the last response, and file data goes to or comes from memory at no cost,
+// so only the server, the storage code and the disk are measured. The server's own counters are
+// logged when the session is closed at the end of each benchmark.
+class LoopbackHandle : public IMtpHandle {
+ public:
+  // Called when the server wants a request and none is queued. Returns false to end the session.
+  std::function<bool()> next;
+
+  void QueueRequest(uint16_t code, const std::vector<uint32_t>& params) {
+    std::vector<uint8_t> packet = Header(MTP_CONTAINER_TYPE_COMMAND, code,
+                                         MTP_CONTAINER_HEADER_SIZE + params.size() * 4);
+    for (uint32_t param : params) Put(packet, param);
+    packets_.push_back(packet);
+  }
+
+  // A data packet; length is what the header claims, the payload may be only its start
+  void QueueData(uint16_t code, const std::vector<uint8_t>& payload, uint32_t length) {
+    std::vector<uint8_t> packet = Header(MTP_CONTAINER_TYPE_DATA, code, length);
+    packet.insert(packet.end(), payload.begin(), payload.end());
+    packets_.push_back(packet);
+  }
+
+  uint16_t ResponseCode() const {
+    return response_.size() >= MTP_CONTAINER_HEADER_SIZE ? response_[6] | response_[7] << 8 : 0;
+  }
+
+  uint32_t ResponseParameter(size_t index) const {
+    size_t offset = MTP_CONTAINER_HEADER_SIZE + (index - 1) * 4;
+    if (offset + 4 > response_.size()) return 0;
+    uint32_t value;
+    memcpy(&value, &response_[offset], sizeof(value));
+    return value;
+  }
+
+  int read(void* data, size_t len) override {
+    if (packets_.empty() && (!next || !next())) {
+      errno = EIO;
+      return -1;
+    }
+    const std::vector<uint8_t>& packet = packets_.front();
+    size_t size = std::min(len, packet.size());
+    memcpy(data, packet.data(), size);
+    packets_.pop_front();
+    return size;
+  }
+
+  int write(const void* data, size_t len) override {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    if (len >= MTP_CONTAINER_HEADER_SIZE && bytes[4] == MTP_CONTAINER_TYPE_RESPONSE) {
+      response_.assign(bytes, bytes + len);
+    }
+    return len;
+  }
+
+  int receiveFile(mtp_file_range mfr, bool) override {
+    std::vector<uint8_t> chunk(kChunkSize, 0x5a);
+    uint64_t length = mfr.length;
+    for (uint64_t done = 0; done < length;) {
+      size_t size = std::min<uint64_t>(chunk.size(), length - done);
+      if (!android::base::WriteFully(mfr.fd, chunk.data(), size)) return -1;
+      done += size;
+    }
+    return 0;
+  }
+
+  int sendFile(mtp_file_range mfr) override {
+    std::vector<uint8_t> chunk(kChunkSize);
+    uint64_t length = mfr.length;
+    for (uint64_t done = 0; done < length;) {
+      size_t size = std::min<uint64_t>(chunk.size(), length - done);
+      if (pread(mfr.fd, chunk.data(), size, mfr.offset + done) != static_cast<ssize_t>(size)) {
+        return -1;
+      }
+      done += size;
+    }
+    return 0;
+  }
+
+  int sendEvent(mtp_event) override { return 0; }
+  int start(bool) override { return 0; }
+  bool writeDescriptors(bool) override { return true; }
+  void close() override {}
+
+ private:
+  static void Put(std::vector<uint8_t>& packet, uint32_t value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    packet.insert(packet.end(), bytes, bytes + sizeof(value));
+  }
+
+  std::vector<uint8_t> Header(uint16_t type, uint16_t code, uint32_t length) {
+    std::vector<uint8_t> packet;
+    Put(packet, length);
+    packet.push_back(type & 0xff);
+    packet.push_back(type >> 8);
+    packet.push_back(code & 0xff);
+    packet.push_back(code >> 8);
+    Put(packet, ++transaction_);
+    return packet;
+  }
+
+  std::deque<std::vector<uint8_t>> packets_;
+  std::vector<uint8_t> response_;
+  uint32_t transaction_ = 0;
+};
+
+// A server with one storage on a temporary directory that holds count files of size bytes.
+class LoopbackServer {
+ public:
+  LoopbackServer(int count, size_t size)
+      : database_(new IMtpDatabase()),
+        server_(database_, &handle_, false, "TWRP", "loopback", "1.0", "0") {
+    std::string content(size, 'x');
+    for (int i = 0; i < count; ++i) {
+      std::string path = android::base::StringPrintf("%s/file_%05d.bin", dir_.path, i);
+      android::base::WriteStringToFile(content, path);
+    }
+    MtpStorage* storage = new MtpStorage(kStorageId, dir_.path, "loopback", false, 0, &server_);
+    server_.addStorage(storage);
+  }
+
+  // The database deletes the storage, which stops its inotify thread before the server goes.
+  ~LoopbackServer() { delete database_; }
+
+  std::vector<MtpObjectHandle> RootHandles() {
+    MtpObjectHandleList* list = database_->getObjectList(kStorageId, 0, MTP_PARENT_ROOT);
+    std::vector<MtpObjectHandle> handles(list->begin(), list->end());
+    delete list;
+    return handles;
+  }
+
+  // Serves a session; step() queues the requests for one step and returns false when done
+  void Run(const std::function<bool()>& step) {
+    bool closed = false;
+    handle_.next = [this, &step, &closed]() {
+      if (closed) return false;
+      if (step()) return true;
+      handle_.QueueRequest(MTP_OPERATION_CLOSE_SESSION, {});
+      closed = true;
+      return true;
+    };
+    handle_.QueueRequest(MTP_OPERATION_OPEN_SESSION, { 1 });
+    server_.run();
+  }
+
+  LoopbackHandle& handle() { return handle_; }
+
+ private:
+  TemporaryDir dir_;
+  LoopbackHandle handle_;
+  IMtpDatabase* database_;
+  MtpServer server_;
+};
+
+static void PutString(std::vector<uint8_t>& data, const std::string& str) {
+  if (str.empty()) {
+    data.push_back(0);
+    return;
+  }
+  data.push_back(str.size() + 1);
+  for (char c : str) {
+    data.push_back(c);
+    data.push_back(0);
+  }
+  data.push_back(0);
+  data.push_back(0);
+}
+
+template <typename T>
+static void PutInt(std::vector<uint8_t>& data, T value) {
+  for (size_t i = 0; i < sizeof(T); ++i) data.push_back(static_cast<uint64_t>(value) >> (i * 8));
+}
+
+// The ObjectInfo dataset of SendObjectInfo, with the fields the server reads
+static std::vector<uint8_t> ObjectInfo(const std::string& name, uint32_t size) {
+  std::vector<uint8_t> data;
+  PutInt<uint32_t>(data, kStorageId);
+  PutInt<uint16_t>(data, MTP_FORMAT_UNDEFINED);
+  PutInt<uint16_t>(data, 0);  // protection status
+  PutInt<uint32_t>(data, size);
+  PutInt<uint16_t>(data, 0);  // thumb format
+  for (int i = 0; i < 6; ++i) PutInt<uint32_t>(data, 0);  // thumb and image sizes, bit depth
+  PutInt<uint32_t>(data, 0);  // parent
+  PutInt<uint16_t>(data, 0);  // association type
+  PutInt<uint32_t>(data, 0);  // association description
+  PutInt<uint32_t>(data, 0);  // sequence number
+  PutString(data, name);
+  PutString(data, "");  // date created
+  PutString(data, "");  // date modified
+  PutString(data, "");  // keywords
+  return data;
+}
+
+// Reads one file again and again. It stays in the page cache, so this is the server's overhead
+// per transfer. Argument: file size in KiB.
+static void BM_MtpGetObject(benchmark::State& state) {
+  size_t size = state.range(0) * 1024;
+  LoopbackServer server(1, size);
+  MtpObjectHandle handle = server.RootHandles().at(0);
+
+  server.Run([&]() {
+    if (!state.KeepRunning()) return false;
+    server.handle().QueueRequest(MTP_OPERATION_GET_OBJECT, { handle });
+    return true;
+  });
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * size);
+}
+BENCHMARK(BM_MtpGetObject)->Arg(4)->Arg(1024)->Arg(64 * 1024)->Unit(benchmark::kMillisecond);
+
+// Uploads a file and deletes it again, the way a host copies a file to the device.
+// Argument: file size in KiB.
+static void BM_MtpSendObject(benchmark::State& state) {
+  size_t size = state.range(0) * 1024;
+  LoopbackServer server(0, size);
+  LoopbackHandle& handle = server.handle();
+  int step = 0;
+  int count = 0;
+  MtpObjectHandle sent = 0;
+
+  server.Run([&]() {
+    switch (step++ % 3) {
+      case 0:
+        if (!state.KeepRunning()) return false;
+        handle.QueueRequest(MTP_OPERATION_SEND_OBJECT_INFO, { kStorageId, MTP_PARENT_ROOT });
+        {
+          std::vector<uint8_t> info =
+              ObjectInfo(android::base::StringPrintf("upload_%d.bin", count++), size);
+          handle.QueueData(MTP_OPERATION_SEND_OBJECT_INFO, info,
+                           MTP_CONTAINER_HEADER_SIZE + info.size());
+        }
+        break;
+      case 1:
+        if (handle.ResponseCode() != MTP_RESPONSE_OK) {
+          state.SkipWithError("SendObjectInfo failed");
+          return false;
+        }
+        sent = handle.ResponseParameter(3);
+        handle.QueueRequest(MTP_OPERATION_SEND_OBJECT, {});
+        handle.QueueData(MTP_OPERATION_SEND_OBJECT, {}, MTP_CONTAINER_HEADER_SIZE + size);
+        break;
+      case 2:
+        handle.QueueRequest(MTP_OPERATION_DELETE_OBJECT, { sent });
+        break;
+    }
+    return true;
+  });
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * size);
+}
+BENCHMARK(BM_MtpSendObject)->Arg(4)->Arg(1024)->Arg(64 * 1024)->Unit(benchmark::kMillisecond);
+
+// Lists all properties of every object in a folder, as Windows does each time it shows one.
+// Argument: number of files in the folder.
+static void BM_MtpGetObjectPropList(benchmark::State& state) {
+  LoopbackServer server(state.range(0), 0);
+
+  server.Run([&]() {
+    if (!state.KeepRunning()) return false;
+    server.handle().QueueRequest(MTP_OPERATION_GET_OBJECT_PROP_LIST,
+                                 { 0, 0, 0xFFFFFFFF, 0, 1 });
+    return true;
+  });
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+}
+BENCHMARK(BM_MtpGetObjectPropList)->Arg(100)->Arg(1000)->Arg(10000)->Unit(benchmark::kMillisecond);
+
+// Lists the handles in a folder. Argument: number of files in the folder.
+static void BM_MtpGetObjectHandles(benchmark::State& state) {
+  LoopbackServer server(state.range(0), 0);
+
+  server.Run([&]() {
+    if (!state.KeepRunning()) return false;
+    server.handle().QueueRequest(MTP_OPERATION_GET_OBJECT_HANDLES,
+                                 { kStorageId, 0, MTP_PARENT_ROOT });
+    return true;
+  });
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * state.range(0));
+}
+BENCHMARK(BM_MtpGetObjectHandles)->Arg(100)->Arg(1000)->Arg(10000)->Unit(benchmark::kMicrosecond);
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+
+#include "fuse_sideload.h"
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr size_t kPackageSize = 64 * 1024 * 1024;
+static constexpr size_t kReadSize = 1024 * 1024;
+
+// An in-memory package behind a link with a fixed latency per request and a fixed bandwidth,
+// roughly what adb over USB looks like to the sideload code. Requests that are asked for ahead
+// of time overlap their latency, the transfers themselves do not.
+class LinkProvider {
+ public:
+  LinkProvider(const std::string& content, uint32_t block_size, int64_t latency_us,
+               int64_t bandwidth_mbps)
+      : content_(content),
+        block_size_(block_size),
+        latency_(latency_us),
+        per_block_(bandwidth_mbps > 0 ? block_size * 1000000LL / (bandwidth_mbps << 20) : 0),
+        link_free_(Clock::now()) {}
+
+  int RequestBlock(uint32_t block) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Clock::time_point ready = std::max(Clock::now() + latency_, link_free_) + per_block_;
+    link_free_ = ready;
+    pending_.push_back(ready);
+    return 0;
+  }
+
+  int ReceiveBlock(uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    Clock::time_point ready;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (pending_.empty()) return -1;
+      ready = pending_.front();
+      pending_.pop_front();
+    }
+    std::this_thread::sleep_until(ready);
+    return Copy(block, buffer, fetch_size);
+  }
+
+  int ReadBlock(uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    std::this_thread::sleep_for(latency_ + per_block_);
+    return Copy(block, buffer, fetch_size);
+  }
+
+ private:
+  int Copy(uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+    uint64_t offset = static_cast<uint64_t>(block) * block_size_;
+    if (offset + fetch_size > content_.size()) return -1;
+    memcpy(buffer, content_.data() + offset, fetch_size);
+    return 0;
+  }
+
+  const std::string& content_;
+  uint32_t block_size_;
+  std::chrono::microseconds latency_;
+  std::chrono::microseconds per_block_;
+  std::mutex mutex_;
+  Clock::time_point link_free_;
+  std::deque<Clock::time_point> pending_;
+};
+
+static const std::string& PackageContent() {
+  static std::string content = [] {
+    std::string result(kPackageSize, '\0');
+    std::mt19937 gen(0);
+    for (size_t i = 0; i < result.size(); i += sizeof(uint32_t)) {
+      uint32_t value = gen();
+      memcpy(&result[i], &value, sizeof(value));
+    }
+    return result;
+  }();
+  return content;
+}
+
+static bool WaitForPackage(const std::string& package, pid_t pid) {
+  for (int i = 0; i < 1000; ++i) {
+    struct stat sb;
+    if (stat(package.c_str(), &sb) == 0) return true;
+    int status;
+    if (waitpid(pid, &status, WNOHANG) != 0) return false;
+    usleep(10000);
+  }
+  return false;
+}
+
+// Reads the whole package through the sideload mount the way the installer does, in large
+// sequential reads. Only the reads are timed, not the mount and unmount around them.
+// Arguments: block size in KiB, link latency in us, link bandwidth in MiB/s (0 for unlimited),
+// and whether the provider takes requests ahead of time.
+static void BM_Sideload(benchmark::State& state) {
+  const std::string& content = PackageContent();
+  uint32_t block_size = state.range(0) * 1024;
+  std::vector<char> buffer(kReadSize);
+
+  while (state.KeepRunning()) {
+    LinkProvider link(content, block_size, state.range(1), state.range(2));
+    provider_vtab vtab;
+    if (state.range(3)) {
+      vtab.request_block = [&link](uint32_t block) { return link.RequestBlock(block); };
+      vtab.receive_block = [&link](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+        return link.ReceiveBlock(block, buffer, fetch_size);
+      };
+    } else {
+      vtab.read_block = [&link](uint32_t block, uint8_t* buffer, uint32_t fetch_size) {
+        return link.ReadBlock(block, buffer, fetch_size);
+      };
+    }
+    vtab.close = [](void) {};
+
+    TemporaryDir mount_point;
+    pid_t pid = fork();
+    if (pid == 0) {
+      _exit(run_fuse_sideload(vtab, content.size(), block_size, mount_point.path) == 0
+                ? EXIT_SUCCESS
+                : EXIT_FAILURE);
+    }
+
+    std::string package = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_FILENAME;
+    if (!WaitForPackage(package, pid)) {
+      state.SkipWithError("The sideload package never showed up");
+      break;
+    }
+
+    Clock::time_point start = Clock::now();
+    android::base::unique_fd fd(open(package.c_str(), O_RDONLY));
+    size_t total = 0;
+    ssize_t n;
+    while (fd != -1 && (n = read(fd, buffer.data(), buffer.size())) > 0) total += n;
+    Clock::time_point end = Clock::now();
+    fd.reset();
+    state.SetIterationTime(std::chrono::duration<double>(end - start).count());
+
+    std::string exit_flag = std::string(mount_point.path) + "/" + FUSE_SIDELOAD_HOST_EXIT_FLAG;
+    struct stat sb;
+    stat(exit_flag.c_str(), &sb);
+    int status;
+    waitpid(pid, &status, 0);
+    if (total != content.size()) {
+      state.SkipWithError("Short read from the sideload package");
+      break;
+    }
+  }
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * content.size());
+}
+BENCHMARK(BM_Sideload)
+    ->Args({ 64, 0, 0, 1 })
+    ->Args({ 64, 1000, 40, 0 })
+    ->Args({ 64, 1000, 40, 1 })
+    ->Args({ 64, 250, 300, 1 })
+    ->Args({ 256, 1000, 40, 1 })
+    ->Args({ 256, 250, 300, 1 })
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
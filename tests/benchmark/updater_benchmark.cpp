@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <linux/loop.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+#include <android-base/test_utils.h>
+#include <android-base/unique_fd.h>
+#include <benchmark/benchmark.h>
+#include <bsdiff/bsdiff.h>
+#include <openssl/sha.h>
+#include <ziparchive/zip_archive.h>
+#include <ziparchive/zip_writer.h>
+
+#include "edify/expr.h"
+#include "otautil/SysUtil.h"
+#include "otautil/cache_location.h"
+#include "otautil/print_sha1.h"
+#include "updater/blockimg.h"
+#include "updater/install.h"
+#include "updater/updater.h"
+
+struct selabel_handle* sehandle = nullptr;
+
+// block_image_update() on generated transfer lists. Each benchmark runs one kind of command, so
+// the cost of each shows up on its own line, or all of them in turn for the total. The device is
+// put back to its source contents, untimed, before each run.
+
+static constexpr size_t kBlockSize = 4096;
+
+enum CommandType { kMove, kStash, kDiff, kNew, kZero, kErase, kMixed, kCommandTypes };
+
+static const char* const kCommandNames[] = {
+  "move", "stash", "bsdiff", "new", "zero", "erase", "mixed",
+};
+
+static std::string Sha1(const std::string& data) {
+  uint8_t digest[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const uint8_t*>(data.data()), data.size(), digest);
+  return print_sha1(digest);
+}
+
+static std::string Range(size_t start, size_t blocks) {
+  return android::base::StringPrintf("2,%zu,%zu", start, start + blocks);
+}
+
+// A loop device over |backing|, so that erase (BLKDISCARD) works the way it does on a partition.
+// Setting one up needs root; path() is empty without it.
+class LoopDevice {
+ public:
+  explicit LoopDevice(const std::string& backing) {
+    android::base::unique_fd control(open("/dev/loop-control", O_RDWR | O_CLOEXEC));
+    if (control == -1) return;
+    int number = ioctl(control, LOOP_CTL_GET_FREE);
+    if (number < 0) return;
+    for (const char* format : { "/dev/block/loop%d", "/dev/loop%d" }) {
+      std::string path = android::base::StringPrintf(format, number);
+      fd_.reset(open(path.c_str(), O_RDWR | O_CLOEXEC));
+      if (fd_ != -1) {
+        path_ = path;
+        break;
+      }
+    }
+    android::base::unique_fd backing_fd(open(backing.c_str(), O_RDWR | O_CLOEXEC));
+    if (fd_ == -1 || backing_fd == -1 || ioctl(fd_, LOOP_SET_FD, backing_fd.get()) == -1) {
+      path_.clear();
+    }
+  }
+
+  ~LoopDevice() {
+    if (!path_.empty()) ioctl(fd_, LOOP_CLR_FD, 0);
+  }
+
+  const std::string& path() const {
+    return path_;
+  }
+
+ private:
+  android::base::unique_fd fd_;
+  std::string path_;
+};
+
+// A generated update: the source contents of the device and a package with the transfer list,
+// new data and patch data for |commands| commands of |blocks| blocks each. Command i reads from
+// blocks [i * blocks, (i + 1) * blocks) of the first half of the device and writes the same
+// blocks of the second half, so no command depends on another.
+struct SyntheticUpdate {
+  bool Generate(CommandType type, size_t blocks, size_t commands) {
+    size_t half = blocks * commands;
+    std::mt19937 gen(0);
+    source.resize(2 * half * kBlockSize);
+    for (size_t i = 0; i < half * kBlockSize; i += sizeof(uint32_t)) {
+      uint32_t value = gen();
+      memcpy(&source[i], &value, sizeof(value));
+    }
+
+    std::string new_data;
+    std::string patch_data;
+    std::vector<std::string> transfer_list = {
+      "4", std::to_string(half), "1", std::to_string(blocks),
+    };
+    for (size_t i = 0; i < commands; i++) {
+      CommandType command = (type == kMixed) ? static_cast<CommandType>(i % kMixed) : type;
+      std::string src_data = source.substr(i * blocks * kBlockSize, blocks * kBlockSize);
+      std::string src_hash = Sha1(src_data);
+      std::string src = Range(i * blocks, blocks);
+      std::string tgt = Range(half + i * blocks, blocks);
+      switch (command) {
+        case kMove:
+          transfer_list.push_back("move " + src_hash + " " + tgt + " " + std::to_string(blocks) +
+                                  " " + src);
+          break;
+        case kStash:
+          transfer_list.push_back("stash " + src_hash + " " + src);
+          transfer_list.push_back("free " + src_hash);
+          break;
+        case kDiff: {
+          // One byte in 16 changes, roughly what a rebuilt binary looks like to bsdiff.
+          std::string tgt_data = src_data;
+          for (size_t j = 0; j < tgt_data.size(); j += 16) {
+            tgt_data[j] = static_cast<char>(gen());
+          }
+          std::string patch;
+          if (!MakePatch(src_data, tgt_data, &patch)) return false;
+          transfer_list.push_back(android::base::StringPrintf(
+              "bsdiff %zu %zu %s %s %s %zu %s", patch_data.size(), patch.size(), src_hash.c_str(),
+              Sha1(tgt_data).c_str(), tgt.c_str(), blocks, src.c_str()));
+          patch_data += patch;
+          break;
+        }
+        case kNew:
+          transfer_list.push_back("new " + tgt);
+          new_data += src_data;
+          break;
+        case kZero:
+          transfer_list.push_back("zero " + tgt);
+          break;
+        case kErase:
+          transfer_list.push_back("erase " + tgt);
+          break;
+        default:
+          return false;
+      }
+    }
+
+    FILE* zip_file_ptr = fdopen(dup(package.fd), "wb");
+    if (zip_file_ptr == nullptr) return false;
+    ZipWriter writer(zip_file_ptr);
+    std::string list = android::base::Join(transfer_list, '\n');
+    bool ok = AddEntry(&writer, "transfer_list", list) && AddEntry(&writer, "new_data", new_data) &&
+              AddEntry(&writer, "patch_data", patch_data) && writer.Finish() == 0;
+    return fclose(zip_file_ptr) == 0 && ok;
+  }
+
+  static bool MakePatch(const std::string& src, const std::string& tgt, std::string* patch) {
+    TemporaryFile patch_file;
+    return bsdiff::bsdiff(reinterpret_cast<const uint8_t*>(src.data()), src.size(),
+                          reinterpret_cast<const uint8_t*>(tgt.data()), tgt.size(),
+                          patch_file.path, nullptr) == 0 &&
+           android::base::ReadFileToString(patch_file.path, patch);
+  }
+
+  static bool AddEntry(ZipWriter* writer, const char* name, const std::string& data) {
+    return writer->StartEntry(name, 0) == 0 &&
+           (data.empty() || writer->WriteBytes(data.data(), data.size()) == 0) &&
+           writer->FinishEntry() == 0;
+  }
+
+  std::string source;
+  TemporaryFile package;
+};
+
+static bool ResetDevice(const std::string& device, const std::string& source) {
+  android::base::unique_fd fd(open(device.c_str(), O_WRONLY | O_CLOEXEC));
+  return fd != -1 && android::base::WriteFully(fd, source.data(), source.size()) && fsync(fd) == 0;
+}
+
+// Arguments: command type (see kCommandNames), blocks per command and number of commands.
+static void BM_BlockImageUpdate(benchmark::State& state) {
+  CommandType type = static_cast<CommandType>(state.range(0));
+  size_t blocks = state.range(1);
+  size_t commands = state.range(2);
+  state.SetLabel(kCommandNames[type]);
+
+  static bool registered = [] {
+    RegisterBuiltins();
+    RegisterInstallFunctions();
+    RegisterBlockImageFunctions();
+    return true;
+  }();
+  (void)registered;
+
+  TemporaryFile temp_saved_source;
+  TemporaryFile temp_last_command;
+  TemporaryDir temp_stash_base;
+  CacheLocation::location().set_cache_temp_source(temp_saved_source.path);
+  CacheLocation::location().set_last_command_file(temp_last_command.path);
+  CacheLocation::location().set_stash_directory_base(temp_stash_base.path);
+
+  SyntheticUpdate update;
+  if (!update.Generate(type, blocks, commands)) {
+    state.SkipWithError("Unable to generate the update");
+    return;
+  }
+
+  TemporaryFile backing;
+  if (!android::base::WriteStringToFile(update.source, backing.path)) {
+    state.SkipWithError("Unable to create the device");
+    return;
+  }
+  LoopDevice loop(backing.path);
+  std::string device = loop.path().empty() ? std::string(backing.path) : loop.path();
+  if (loop.path().empty() && (type == kErase || type == kMixed)) {
+    state.SkipWithError("erase needs a block device; run as root to get a loop device");
+    return;
+  }
+
+  MemMapping map;
+  ZipArchiveHandle handle;
+  if (!map.MapFile(update.package.path) ||
+      OpenArchiveFromMemory(map.addr, map.length, update.package.path, &handle) != 0) {
+    state.SkipWithError("Unable to open the package");
+    return;
+  }
+  UpdaterInfo updater_info;
+  updater_info.package_zip = handle;
+  TemporaryFile temp_pipe;
+  updater_info.cmd_pipe = fdopen(dup(temp_pipe.fd), "wbe");
+  updater_info.package_zip_addr = map.addr;
+  updater_info.package_zip_len = map.length;
+
+  std::string script = "block_image_update(\"" + device +
+                       R"(", package_extract_file("transfer_list"), "new_data", "patch_data"))";
+  std::unique_ptr<Expr> expr;
+  int error_count = 0;
+  bool parsed = parse_string(script.c_str(), &expr, &error_count) == 0 && error_count == 0;
+  if (!parsed) {
+    state.SkipWithError("Unable to parse the script");
+  }
+
+  while (parsed && state.KeepRunning()) {
+    state.PauseTiming();
+    unlink(temp_last_command.path);
+    bool reset = ResetDevice(device, update.source);
+    state.ResumeTiming();
+    if (!reset) {
+      state.SkipWithError("Unable to reset the device");
+      break;
+    }
+
+    State edify_state(script, &updater_info);
+    std::string result;
+    if (!Evaluate(&edify_state, expr, &result) || result != "t") {
+      state.SkipWithError("block_image_update failed");
+      break;
+    }
+  }
+
+  state.SetItemsProcessed(static_cast<int64_t>(state.iterations()) * commands);
+  state.SetBytesProcessed(static_cast<int64_t>(state.iterations()) * commands * blocks *
+                          kBlockSize);
+  fclose(updater_info.cmd_pipe);
+  CloseArchive(handle);
+}
+
+static void UpdateArgs(benchmark::internal::Benchmark* b) {
+  for (int type = 0; type < kCommandTypes; type++) {
+    // Many small commands, then a few large ones: 64 MiB in total each.
+    b->Args({ type, 16, 1024 });
+    b->Args({ type, 1024, 16 });
+  }
+}
+BENCHMARK(BM_BlockImageUpdate)->Apply(UpdateArgs)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
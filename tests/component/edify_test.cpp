@@ -168,3 +168,21 @@ TEST_F(EdifyTest, unknown_function) {
     EXPECT_EQ(1, parse_string(script3, &expr, &error_count));
     EXPECT_EQ(1, error_count);
 }
+
+TEST_F(EdifyTest, time_functions) {
+    const char* script = "concat(a, b); concat(c, d); ifelse(t, e, f)";
+    std::unique_ptr<Expr> expr;
+    int error_count = 0;
+    ASSERT_EQ(0, parse_string(script, &expr, &error_count));
+    ASSERT_EQ(0, error_count);
+
+    State state(script, nullptr);
+    state.time_functions = true;
+    std::string result;
+    ASSERT_TRUE(Evaluate(&state, expr, &result));
+    ASSERT_EQ("e", result);
+
+    ASSERT_EQ(2u, state.function_times.size());
+    ASSERT_EQ(2u, state.function_times["concat"].calls);
+    ASSERT_EQ(1u, state.function_times["ifelse"].calls);
+}
@@ -885,6 +885,36 @@ TEST(ImgdiffTest, zip_mode_deflate_large_apk) {
   GenerateAndCheckSplitTarget(debug_dir.path, 5, tgt);
 }
 
+TEST(ImgdiffTest, zip_mode_threads) {
+  std::string tgt_path = from_testdata_base("deflate_tgt.zip");
+  std::string src_path = from_testdata_base("deflate_src.zip");
+
+  // The patch doesn't depend on the number of threads computing it.
+  TemporaryFile patch_file;
+  std::vector<const char*> args = {
+    "imgdiff", "-z", src_path.c_str(), tgt_path.c_str(), patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(args.size(), args.data()));
+
+  TemporaryFile threads_patch_file;
+  std::vector<const char*> threads_args = {
+    "imgdiff", "-z", "--threads=4", src_path.c_str(), tgt_path.c_str(), threads_patch_file.path,
+  };
+  ASSERT_EQ(0, imgdiff(threads_args.size(), threads_args.data()));
+
+  std::string patch;
+  ASSERT_TRUE(android::base::ReadFileToString(patch_file.path, &patch));
+  std::string threads_patch;
+  ASSERT_TRUE(android::base::ReadFileToString(threads_patch_file.path, &threads_patch));
+  ASSERT_EQ(patch, threads_patch);
+
+  std::string src;
+  ASSERT_TRUE(android::base::ReadFileToString(src_path, &src));
+  std::string tgt;
+  ASSERT_TRUE(android::base::ReadFileToString(tgt_path, &tgt));
+  verify_patched_image(src, threads_patch, tgt);
+}
+
 TEST(ImgdiffTest, zip_mode_no_match_source) {
   // Generate 20 blocks of random data.
   std::string random_data;
@@ -20,6 +20,7 @@
 
 #include <string>
 
+#include <android-base/file.h>
 #include <android-base/test_utils.h>
 #include <gtest/gtest.h>
 #include <otautil/DirUtil.h>
@@ -106,3 +107,26 @@ TEST(DirUtilTest, create_mode) {
   ASSERT_EQ(0, rmdir((prefix + "/a/b").c_str()));
   ASSERT_EQ(0, rmdir((prefix + "/a").c_str()));
 }
+
+TEST(DirUtilTest, unlink_hierarchy) {
+  TemporaryDir td;
+  std::string prefix(td.path);
+  for (const char* dir : { "/a/b/c", "/a/d", "/e" }) {
+    ASSERT_EQ(0, mkdir_recursively(prefix + "/tree" + dir, 0755, false, nullptr));
+    std::string file = prefix + "/tree" + dir + "/file";
+    ASSERT_TRUE(android::base::WriteStringToFile("data", file));
+  }
+  ASSERT_TRUE(android::base::WriteStringToFile("data", prefix + "/tree/file"));
+  ASSERT_EQ(0, symlink(td.path, (prefix + "/tree/a/link").c_str()));
+
+  ASSERT_EQ(0, dirUnlinkHierarchy((prefix + "/tree").c_str()));
+  struct stat sb;
+  ASSERT_EQ(-1, stat((prefix + "/tree").c_str(), &sb));
+  ASSERT_EQ(ENOENT, errno);
+
+  // Symlinks are removed, not followed.
+  ASSERT_EQ(0, stat(td.path, &sb));
+
+  ASSERT_EQ(-1, dirUnlinkHierarchy((prefix + "/tree").c_str()));
+  ASSERT_EQ(ENOENT, errno);
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "minuitwrp/graphics_kernels.h"
+
+static constexpr gr_kernel_format kFormats[] = {
+  GR_KERNEL_RGBX_8888, GR_KERNEL_BGRA_8888, GR_KERNEL_RGB_565,
+};
+
+static uint32_t Color(uint8_t c0, uint8_t c1, uint8_t c2, uint8_t a) {
+  uint8_t bytes[4] = { c0, c1, c2, a };
+  uint32_t color;
+  memcpy(&color, bytes, sizeof(color));
+  return color;
+}
+
+TEST(MinuiKernelsTest, blend_32) {
+  const gr_kernels* k = gr_get_kernels(GR_KERNEL_RGBX_8888, false);
+  uint8_t dst[4] = { 10, 20, 30, 40 };
+  uint8_t opaque[4] = { 200, 100, 50, 255 };
+  k->blend(dst, 4, opaque, 4, 1, 1);
+  ASSERT_EQ(0, memcmp(dst, opaque, 4));
+
+  uint8_t clear[4] = { 1, 2, 3, 0 };
+  k->blend(dst, 4, clear, 4, 1, 1);
+  ASSERT_EQ(0, memcmp(dst, opaque, 4));
+
+  uint8_t half[4] = { 0, 0, 0, 128 };
+  k->blend(dst, 4, half, 4, 1, 1);
+  ASSERT_EQ(100, dst[0]);
+  ASSERT_EQ(50, dst[1]);
+  ASSERT_EQ(25, dst[2]);
+  ASSERT_EQ(191, dst[3]);
+}
+
+TEST(MinuiKernelsTest, copy_bgra) {
+  const gr_kernels* k = gr_get_kernels(GR_KERNEL_BGRA_8888, false);
+  uint8_t src[4] = { 1, 2, 3, 4 };
+  uint8_t dst[4] = {};
+  k->copy(dst, 4, src, 4, 1, 1);
+  uint8_t expected[4] = { 3, 2, 1, 4 };
+  ASSERT_EQ(0, memcmp(dst, expected, 4));
+}
+
+TEST(MinuiKernelsTest, fill_565) {
+  const gr_kernels* k = gr_get_kernels(GR_KERNEL_RGB_565, false);
+  uint16_t dst[3] = {};
+  k->fill(reinterpret_cast<uint8_t*>(dst), sizeof(dst), 3, 1, Color(255, 0, 255, 255));
+  for (uint16_t p : dst) ASSERT_EQ(0xf81f, p);
+}
+
+// The SIMD kernels, if this build has them, must give exactly what the C ones do, for every width
+// so the leftover pixels at the end of a row get covered too.
+TEST(MinuiKernelsTest, simd_matches_c) {
+  std::mt19937 gen(0);
+  for (gr_kernel_format format : kFormats) {
+    const gr_kernels* simd = gr_get_kernels(format, true);
+    const gr_kernels* c = gr_get_kernels(format, false);
+    int bpp = format == GR_KERNEL_RGB_565 ? 2 : 4;
+    for (int w = 1; w <= 40; w++) {
+      int h = 3;
+      int dst_stride = w * bpp + 12;
+      int src_stride = w * 4 + 8;
+      std::vector<uint8_t> dst(dst_stride * h), src(src_stride * h), mask(w * h);
+      for (auto& b : dst) b = gen();
+      for (auto& b : src) b = gen();
+      // Fully covered and uncovered pixels are the common case in text
+      for (auto& b : mask) b = (gen() % 3 == 0) ? 255 : (gen() % 2 == 0) ? 0 : gen();
+      uint32_t color = gen();
+
+      for (int kernel = 0; kernel < 5; kernel++) {
+        std::vector<uint8_t> expected = dst;
+        std::vector<uint8_t> actual = dst;
+        for (const gr_kernels* k : { c, simd }) {
+          uint8_t* out = (k == c) ? expected.data() : actual.data();
+          switch (kernel) {
+            case 0: k->fill(out, dst_stride, w, h, color); break;
+            case 1: k->fill_blend(out, dst_stride, w, h, color); break;
+            case 2: k->copy(out, dst_stride, src.data(), src_stride, w, h); break;
+            case 3: k->blend(out, dst_stride, src.data(), src_stride, w, h); break;
+            case 4: k->glyph(out, dst_stride, mask.data(), w, w, h, color); break;
+          }
+        }
+        ASSERT_EQ(expected, actual) << simd->name << " format " << format << " kernel " << kernel
+                                    << " width " << w;
+      }
+    }
+  }
+}
@@ -287,3 +287,22 @@ TEST(SortedRangeSetTest, file_range) {
   // block#10 not in range.
   ASSERT_EXIT(rs.GetOffsetInRangeSet(40970), ::testing::KilledBySignal(SIGABRT), "");
 }
+
+TEST(RangeSetTest, Overlaps_large) {
+  // Enough ranges on both sides to take the sorted sweep instead of the pairwise check.
+  std::vector<Range> even;
+  std::vector<Range> odd;
+  for (size_t i = 0; i < 100; i++) {
+    even.emplace_back(400 - i * 4, 402 - i * 4);
+    odd.emplace_back(i * 4 + 2, i * 4 + 4);
+  }
+  RangeSet r1(std::move(even));
+  RangeSet r2(std::move(odd));
+  ASSERT_FALSE(r1.Overlaps(r2));
+  ASSERT_FALSE(r2.Overlaps(r1));
+
+  ASSERT_TRUE(r2.PushBack({ 1000, 1001 }));
+  ASSERT_TRUE(r2.PushBack({ 201, 202 }));
+  ASSERT_TRUE(r1.Overlaps(r2));
+  ASSERT_TRUE(r2.Overlaps(r1));
+}
@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -53,6 +54,7 @@
 #include "data.hpp"
 #include "partitions.hpp"
 #include "twrpDigestDriver.hpp"
+#include "twrpZipPrefetch.hpp"
 #include "twrpDigest/twrpDigest.hpp"
 #include "twrpDigest/twrpMD5.hpp"
 #include "twrp-functions.hpp"
@@ -67,6 +69,21 @@ extern "C" {
 
 #define AB_OTA "payload_properties.txt"
 
+// file_contexts from the zip waits here until the signature is checked,
+// next to the /file_contexts it replaces so it can be renamed over it
+#define TMP_FILE_CONTEXTS_PATH "/file_contexts.zip"
+
+// The zip signature is checked on its own thread while the installer is
+// staged, and nothing from the zip runs before the check is over
+struct Verify_Job {
+	const unsigned char* addr;
+	size_t length;
+	int ret_val;
+	pthread_t thread;
+	bool running;
+	bool reported;                                                     // The result has been shown
+};
+
 #ifndef TW_NO_LEGACY_PROPS
 static const char* properties_path = "/dev/__properties__";
 static const char* properties_path_renamed = "/dev/__properties_kk__";
@@ -160,12 +177,14 @@ static int Prepare_Update_Binary(const char *path, ZipWrap *Zip, int* wipe_cache
 		return INSTALL_ERROR;
 	}
 
-	// If exists, extract file_contexts from the zip file
+	// If exists, extract file_contexts from the zip file. It replaces
+	// /file_contexts in Install_File_Contexts once the zip is verified.
+	unlink(TMP_FILE_CONTEXTS_PATH);
 	if (!Zip->EntryExists("file_contexts")) {
 		Zip->Close();
 		LOGINFO("Zip does not contain SELinux file_contexts file in its root.\n");
 	} else {
-		const string output_filename = "/file_contexts";
+		const string output_filename = TMP_FILE_CONTEXTS_PATH;
 		LOGINFO("Zip contains SELinux file_contexts file in its root. Extracting to %s\n", output_filename.c_str());
 		if (!Zip->ExtractEntry("file_contexts", output_filename, 0644)) {
 			Zip->Close();
@@ -177,6 +196,61 @@ static int Prepare_Update_Binary(const char *path, ZipWrap *Zip, int* wipe_cache
 	return INSTALL_SUCCESS;
 }
 
+static int Install_File_Contexts() {
+	if (!TWFunc::Path_Exists(TMP_FILE_CONTEXTS_PATH))
+		return INSTALL_SUCCESS;
+	if (rename(TMP_FILE_CONTEXTS_PATH, "/file_contexts") != 0) {
+		LOGERR("Could not move '%s' to '/file_contexts': %s\n", TMP_FILE_CONTEXTS_PATH, strerror(errno));
+		return INSTALL_ERROR;
+	}
+	return INSTALL_SUCCESS;
+}
+
+static void Discard_Update_Binary() {
+	unlink(TMP_UPDATER_BINARY_PATH);
+	unlink(TMP_FILE_CONTEXTS_PATH);
+}
+
+static void* Verify_Thread(void *cookie) {
+	Verify_Job* job = (Verify_Job*) cookie;
+
+	job->ret_val = twrpZipPrefetch::Verify(job->addr, job->length, std::bind(&DataManager::SetProgress, std::placeholders::_1));
+	return NULL;
+}
+
+static void Start_Verify(Verify_Job *job, MemMapping *map) {
+	gui_msg("verify_zip_sig=Verifying zip signature...");
+	job->addr = map->addr;
+	job->length = map->length;
+	job->running = false;
+	job->reported = false;
+	if (pthread_create(&job->thread, NULL, Verify_Thread, job) == 0) {
+		job->running = true;
+	} else {
+		LOGINFO("Unable to start verify thread, verifying first\n");
+		Verify_Thread(job);
+	}
+}
+
+// Waits for the signature check, true if it passed. Has to be called
+// before the map is released.
+static bool Finish_Verify(Verify_Job *job) {
+	if (job->running) {
+		pthread_join(job->thread, NULL);
+		job->running = false;
+	}
+	if (!job->reported) {
+		job->reported = true;
+		if (job->ret_val != VERIFY_SUCCESS) {
+			LOGINFO("Zip signature verification failed: %i\n", job->ret_val);
+			gui_err("verify_zip_fail=Zip signature verification failed!");
+		} else {
+			gui_msg("verify_zip_done=Zip signature verified successfully.");
+		}
+	}
+	return job->ret_val == VERIFY_SUCCESS;
+}
+
 #ifndef TW_NO_LEGACY_PROPS
 static bool update_binary_has_legacy_properties(const char *binary) {
 	const char str_to_match[] = "ANDROID_PROPERTY_WORKSPACE";
@@ -374,49 +448,40 @@ int TWinstall_zip(const char* path, int* wipe_cache) {
 	DataManager::GetValue(TW_SIGNED_ZIP_VERIFY_VAR, zip_verify);
 #endif
 	DataManager::SetProgress(0);
+	// The zip can write to any partition
+	PartitionManager.Invalidate_All_Sizes();
 
 	MemMapping map;
 #ifdef USE_MINZIP
 	if (sysMapFile(path, &map) != 0) {
 #else
-	if (!map.MapFile(path)) {
+	if (!map.MapFile(path, MemMapping::Policy::kSequential)) {
 #endif
 		gui_msg(Msg(msg::kError, "fail_sysmap=Failed to map file '{1}'")(path));
 		return -1;
 	}
 
-	if (zip_verify) {
+	Verify_Job verify_job;
+	verify_job.ret_val = VERIFY_SUCCESS;
+	verify_job.running = false;
+	verify_job.reported = true;
+	// A zip read ahead by the install queue may have its check done already
+	int prefetch_ret;
+	bool prefetched = twrpZipPrefetch::Get()->Take_Result(path, &prefetch_ret);
+	if (zip_verify && prefetched) {
 		gui_msg("verify_zip_sig=Verifying zip signature...");
-#ifdef USE_OLD_VERIFIER
-		ret_val = verify_file(map.addr, map.length);
-#else
-		std::vector<Certificate> loadedKeys;
-		if (!load_keys("/res/keys", loadedKeys)) {
-			LOGINFO("Failed to load keys");
-			gui_err("verify_zip_fail=Zip signature verification failed!");
-#ifdef USE_MINZIP
-			sysReleaseMap(&map);
-#endif
-			return -1;
-		}
-		ret_val = verify_file(map.addr, map.length, loadedKeys, std::bind(&DataManager::SetProgress, std::placeholders::_1));
-#endif
-		if (ret_val != VERIFY_SUCCESS) {
-			LOGINFO("Zip signature verification failed: %i\n", ret_val);
-			gui_err("verify_zip_fail=Zip signature verification failed!");
-#ifdef USE_MINZIP
-			sysReleaseMap(&map);
-#endif
-			return -1;
-		} else {
-			gui_msg("verify_zip_done=Zip signature verified successfully.");
-		}
+		verify_job.ret_val = prefetch_ret;
+		verify_job.reported = false;
+	} else if (zip_verify) {
+		Start_Verify(&verify_job, &map);
 	}
+
 	ZipWrap Zip;
 	if (!Zip.Open(path, &map)) {
 		gui_err("zip_corrupt=Zip file is corrupt!");
+		Finish_Verify(&verify_job);
 #ifdef USE_MINZIP
-			sysReleaseMap(&map);
+		sysReleaseMap(&map);
 #endif
 		return INSTALL_CORRUPT;
 	}
@@ -429,17 +494,26 @@ int TWinstall_zip(const char* path, int* wipe_cache) {
 		if (!verify_package_compatibility(&Zip)) {
 			gui_err("zip_compatible_err=Zip Treble compatibility error!");
 			Zip.Close();
-#ifdef USE_MINZIP
-			sysReleaseMap(&map);
-#endif
 			ret_val = INSTALL_CORRUPT;
 		} else {
+			// The updater is staged while the signature is checked, and
+			// only runs once the check has passed
 			ret_val = Prepare_Update_Binary(path, &Zip, wipe_cache);
-			if (ret_val == INSTALL_SUCCESS)
-				ret_val = Run_Update_Binary(path, &Zip, wipe_cache, UPDATE_BINARY_ZIP_TYPE);
+			if (!Finish_Verify(&verify_job)) {
+				Discard_Update_Binary();
+				ret_val = -1;
+			} else {
+				if (ret_val == INSTALL_SUCCESS)
+					ret_val = Install_File_Contexts();
+				if (ret_val == INSTALL_SUCCESS)
+					ret_val = Run_Update_Binary(path, &Zip, wipe_cache, UPDATE_BINARY_ZIP_TYPE);
+			}
 		}
 	} else {
-		if (Zip.EntryExists(AB_OTA)) {
+		if (!Finish_Verify(&verify_job)) {
+			Zip.Close();
+			ret_val = -1;
+		} else if (Zip.EntryExists(AB_OTA)) {
 			LOGINFO("AB zip\n");
 			ret_val = Run_Update_Binary(path, &Zip, wipe_cache, AB_OTA_ZIP_TYPE);
 		} else {
@@ -452,6 +526,7 @@ int TWinstall_zip(const char* path, int* wipe_cache) {
 			}
 		}
 	}
+	Finish_Verify(&verify_job);
 	time(&stop);
 	int total_time = (int) difftime(stop, start);
 	if (ret_val == INSTALL_CORRUPT) {
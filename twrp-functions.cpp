@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string>
 #include <unistd.h>
 #include <vector>
@@ -31,7 +32,10 @@
 #include <sys/stat.h>
 #include <sys/vfs.h>
 #include <sys/types.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
+#include <poll.h>
 #include <iostream>
 #include <fstream>
 #include <sstream>
@@ -48,10 +52,13 @@
 #include "bootloader_message_twrp/include/bootloader_message_twrp/bootloader_message.h"
 #include "cutils/properties.h"
 #include "cutils/android_reboot.h"
+#include "twrpDelete.hpp"
+#include "twrpLog.hpp"
 #include <sys/reboot.h>
 #endif // ndef BUILD_TWRPTAR_MAIN
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	#include "openaes/inc/oaes_lib.h"
+	#include "twrpRestorePipeline.hpp"
 #endif
 #include "set_metadata.h"
 
@@ -146,19 +153,54 @@ int TWFunc::Wait_For_Child(pid_t pid, int *status, string Child_Name) {
 	return 0;
 }
 
-int TWFunc::Wait_For_Child_Timeout(pid_t pid, int *status, const string& Child_Name, int timeout) {
-	pid_t retpid = waitpid(pid, status, WNOHANG);
-	for (; retpid == 0 && timeout; --timeout) {
-		sleep(1);
-		retpid = waitpid(pid, status, WNOHANG);
+// pidfd_open has the same number on every architecture, older headers
+// just don't know it
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
+
+int TWFunc::Pidfd_Open(pid_t pid) {
+	return syscall(__NR_pidfd_open, pid, 0);
+}
+
+pid_t TWFunc::Wait_For_Child_Ms(pid_t pid, int *status, int timeout_ms) {
+	struct timespec start, now;
+	int pidfd = Pidfd_Open(pid);
+	int poll_ms = 1;
+	pid_t retpid;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((retpid = waitpid(pid, status, WNOHANG)) == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int left = timeout_ms - timespec_diff_ms(start, now);
+		if (left <= 0)
+			break;
+		if (pidfd >= 0) {
+			// Readable once the child has exited
+			struct pollfd pfd;
+			pfd.fd = pidfd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			poll(&pfd, 1, left);
+		} else {
+			// Kernels before 5.3 have no pidfd, and waiting on SIGCHLD
+			// would take it from the rest of TWRP; naps that start
+			// short keep the latency low
+			usleep(std::min(poll_ms, left) * 1000);
+			poll_ms = std::min(poll_ms * 2, 50);
+		}
 	}
-	if (retpid == 0 && timeout == 0) {
+	if (pidfd >= 0)
+		close(pidfd);
+	return retpid;
+}
+
+int TWFunc::Wait_For_Child_Timeout(pid_t pid, int *status, const string& Child_Name, int timeout) {
+	pid_t retpid = Wait_For_Child_Ms(pid, status, timeout * 1000);
+	if (retpid == 0) {
 		LOGERR("%s took too long, killing process\n", Child_Name.c_str());
 		kill(pid, SIGKILL);
-		for (timeout = 5; retpid == 0 && timeout; --timeout) {
-			sleep(1);
-			retpid = waitpid(pid, status, WNOHANG);
-		}
+		retpid = Wait_For_Child_Ms(pid, status, 5000);
 		if (retpid)
 			LOGINFO("Child process killed successfully\n");
 		else
@@ -189,34 +231,74 @@ bool TWFunc::Path_Exists(string Path) {
 }
 
 Archive_Type TWFunc::Get_File_Type(string fn) {
-	string::size_type i = 0;
-	int firstbyte = 0, secondbyte = 0;
-	char header[3];
+	unsigned char header[4] = { 0, 0, 0, 0 };
 
 	ifstream f;
 	f.open(fn.c_str(), ios::in | ios::binary);
-	f.get(header, 3);
+	f.read((char*)header, sizeof(header));
 	f.close();
-	firstbyte = header[i] & 0xff;
-	secondbyte = header[++i] & 0xff;
 
-	if (firstbyte == 0x1f && secondbyte == 0x8b)
+	if (header[0] == 0x1f && header[1] == 0x8b)
 		return COMPRESSED;
-	else if (firstbyte == 0x4f && secondbyte == 0x41)
+	else if (header[0] == 0x4f && header[1] == 0x41)
 		return ENCRYPTED;
+	else if (header[0] == 'T' && header[1] == 'W' && header[2] == 'A' && header[3] == 'E')
+		return ENCRYPTED; // TW_GCM_MAGIC
+	else if (header[0] == 0x28 && header[1] == 0xb5 && header[2] == 0x2f && header[3] == 0xfd)
+		return COMPRESSED_ZSTD;
+	else if (header[0] == 0x04 && header[1] == 0x22 && header[2] == 0x4d && header[3] == 0x18)
+		return COMPRESSED_LZ4;
+	else if (header[0] == 'T' && header[1] == 'W' && header[2] == 'C' && header[3] == 'H')
+		return CHUNKED;
 	return UNCOMPRESSED; // default
 }
 
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+// What the decrypted start of fn holds, as Try_Decrypting_File() returns it
+static int Decrypted_File_Type(const string& fn, const uint8_t* buf, size_t len) {
+	if (len < 2) {
+		LOGINFO("Successfully decrypted '%s' but read length too small.\n", fn.c_str());
+		return 1; // Decrypted successfully
+	}
+	if (buf[0] == 0x1f && buf[1] == 0x8b) {
+		LOGINFO("Successfully decrypted '%s' and file is compressed.\n", fn.c_str());
+		return 3; // Compressed
+	}
+	if (len >= 262 && strncmp((const char*)buf + 257, "ustar", 5) == 0) {
+		LOGINFO("Successfully decrypted '%s' and file is tar format.\n", fn.c_str());
+		return 2; // Tar
+	}
+	LOGINFO("No errors decrypting '%s' but no known file format.\n", fn.c_str());
+	return 1; // Decrypted successfully
+}
+#endif
+
 int TWFunc::Try_Decrypting_File(string fn, string password) {
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	if (twrpGcm_Is_Archive(fn)) {
+		// The first chunk has to open with the key of the password
+		uint8_t start[512];
+		int fd = open(fn.c_str(), O_RDONLY);
+		if (fd < 0) {
+			LOGERR("Failed to open '%s' to try decrypt: %s\n", fn.c_str(), strerror(errno));
+			return -1;
+		}
+		twrpDecryptReader reader(fd, password, 1, NULL, NULL);
+		ssize_t len = reader.Start() ? reader.Read(start, sizeof(start)) : -1;
+		close(fd);
+		if (len < 0) {
+			LOGERR("Failed to decrypt file '%s'\n", fn.c_str());
+			return 0;
+		}
+		return Decrypted_File_Type(fn, start, len);
+	}
+
 	OAES_CTX * ctx = NULL;
 	uint8_t _key_data[32] = "";
 	FILE *f;
 	uint8_t buffer[4096];
 	uint8_t *buffer_out = NULL;
-	uint8_t *ptr = NULL;
 	size_t read_len = 0, out_len = 0;
-	int firstbyte = 0, secondbyte = 0;
 	size_t _j = 0;
 	size_t _key_data_len = 0;
 
@@ -275,31 +357,9 @@ int TWFunc::Try_Decrypting_File(string fn, string password) {
 	}
 	fclose(f);
 	oaes_free(&ctx);
-	if (out_len < 2) {
-		LOGINFO("Successfully decrypted '%s' but read length too small.\n", fn.c_str());
-		free(buffer_out);
-		return 1; // Decrypted successfully
-	}
-	ptr = buffer_out;
-	firstbyte = *ptr & 0xff;
-	ptr++;
-	secondbyte = *ptr & 0xff;
-	if (firstbyte == 0x1f && secondbyte == 0x8b) {
-		LOGINFO("Successfully decrypted '%s' and file is compressed.\n", fn.c_str());
-		free(buffer_out);
-		return 3; // Compressed
-	}
-	if (out_len >= 262) {
-		ptr = buffer_out + 257;
-		if (strncmp((char*)ptr, "ustar", 5) == 0) {
-			LOGINFO("Successfully decrypted '%s' and file is tar format.\n", fn.c_str());
-			free(buffer_out);
-			return 2; // Tar
-		}
-	}
+	int ret = Decrypted_File_Type(fn, buffer_out, out_len);
 	free(buffer_out);
-	LOGINFO("No errors decrypting '%s' but no known file format.\n", fn.c_str());
-	return 1; // Decrypted successfully
+	return ret;
 #else
 	LOGERR("Encrypted backup support not included.\n");
 	return -1;
@@ -389,6 +449,48 @@ int32_t TWFunc::timespec_diff_ms(timespec& start, timespec& end)
 			((start.tv_sec * 1000) + start.tv_nsec/1000000);
 }
 
+int TWFunc::read_file(string fn, string& results) {
+	ifstream file;
+	file.open(fn.c_str(), ios::in);
+
+	if (file.is_open()) {
+		file >> results;
+		file.close();
+		return 0;
+	}
+
+	LOGINFO("Cannot find file %s\n", fn.c_str());
+	return -1;
+}
+
+int TWFunc::read_file(string fn, vector<string>& results) {
+	ifstream file;
+	string line;
+	file.open(fn.c_str(), ios::in);
+	if (file.is_open()) {
+		while (getline(file, line))
+			results.push_back(line);
+		file.close();
+		return 0;
+	}
+	LOGINFO("Cannot find file %s\n", fn.c_str());
+	return -1;
+}
+
+int TWFunc::read_file(string fn, uint64_t& results) {
+	ifstream file;
+	file.open(fn.c_str(), ios::in);
+
+	if (file.is_open()) {
+		file >> results;
+		file.close();
+		return 0;
+	}
+
+	LOGINFO("Cannot find file %s\n", fn.c_str());
+	return -1;
+}
+
 #ifndef BUILD_TWRPTAR_MAIN
 
 // Returns "/path" from a full /path/to/file.name
@@ -507,6 +609,7 @@ void TWFunc::Copy_Log(string Source, string Destination) {
 	if (destination_log == NULL) {
 		LOGERR("TWFunc::Copy_Log -- Can't open destination log file: '%s'\n", Destination.c_str());
 	} else {
+		twrpLog::Flush();
 		FILE *source_log = fopen(Source.c_str(), "r");
 		if (source_log != NULL) {
 			fseek(source_log, Log_Offset, SEEK_SET);
@@ -540,7 +643,10 @@ void TWFunc::Update_Log_File(void) {
 
 	std::string logCopy = recoveryDir + "log";
 	std::string lastLogCopy = recoveryDir + "last_log";
-	copy_file(logCopy, lastLogCopy, 600);
+	// The log is appended to from where the last copy ended, so last_log
+	// only needs the copy from before the first one of this boot
+	if (Log_Offset == 0)
+		copy_file(logCopy, lastLogCopy, 600);
 	Copy_Log(TMP_LOG_FILE, logCopy);
 	chown(logCopy.c_str(), 1000, 1000);
 	chmod(logCopy.c_str(), 0600);
@@ -652,47 +758,18 @@ void TWFunc::check_and_run_script(const char* script_file, const char* display_n
 }
 
 int TWFunc::removeDir(const string path, bool skipParent) {
-	DIR *d = opendir(path.c_str());
-	int r = 0;
-	string new_path;
+	struct stat st;
+	twrpDelete del;
 
-	if (d == NULL) {
+	if (lstat(path.c_str(), &st) != 0) {
 		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
 		return -1;
 	}
-
-	if (d) {
-		struct dirent *p;
-		while (!r && (p = readdir(d))) {
-			if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-				continue;
-			new_path = path + "/";
-			new_path.append(p->d_name);
-			if (p->d_type == DT_DIR) {
-				r = removeDir(new_path, true);
-				if (!r) {
-					if (p->d_type == DT_DIR)
-						r = rmdir(new_path.c_str());
-					else
-						LOGINFO("Unable to removeDir '%s': %s\n", new_path.c_str(), strerror(errno));
-				}
-			} else if (p->d_type == DT_REG || p->d_type == DT_LNK || p->d_type == DT_FIFO || p->d_type == DT_SOCK) {
-				r = unlink(new_path.c_str());
-				if (r != 0) {
-					LOGINFO("Unable to unlink '%s: %s'\n", new_path.c_str(), strerror(errno));
-				}
-			}
-		}
-		closedir(d);
-
-		if (!r) {
-			if (skipParent)
-				return 0;
-			else
-				r = rmdir(path.c_str());
-		}
+	if (!S_ISDIR(st.st_mode)) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(ENOTDIR)));
+		return -1;
 	}
-	return r;
+	return del.Remove(path, skipParent) ? 0 : -1;
 }
 
 int TWFunc::copy_file(string src, string dst, int mode) {
@@ -728,48 +805,6 @@ unsigned int TWFunc::Get_D_Type_From_Stat(string Path) {
 	return DT_UNKNOWN;
 }
 
-int TWFunc::read_file(string fn, string& results) {
-	ifstream file;
-	file.open(fn.c_str(), ios::in);
-
-	if (file.is_open()) {
-		file >> results;
-		file.close();
-		return 0;
-	}
-
-	LOGINFO("Cannot find file %s\n", fn.c_str());
-	return -1;
-}
-
-int TWFunc::read_file(string fn, vector<string>& results) {
-	ifstream file;
-	string line;
-	file.open(fn.c_str(), ios::in);
-	if (file.is_open()) {
-		while (getline(file, line))
-			results.push_back(line);
-		file.close();
-		return 0;
-	}
-	LOGINFO("Cannot find file %s\n", fn.c_str());
-	return -1;
-}
-
-int TWFunc::read_file(string fn, uint64_t& results) {
-	ifstream file;
-	file.open(fn.c_str(), ios::in);
-
-	if (file.is_open()) {
-		file >> results;
-		file.close();
-		return 0;
-	}
-
-	LOGINFO("Cannot find file %s\n", fn.c_str());
-	return -1;
-}
-
 int TWFunc::write_to_file(const string& fn, const string& line) {
 	FILE *file;
 	file = fopen(fn.c_str(), "w");
@@ -787,6 +822,19 @@ bool TWFunc::Try_Decrypting_Backup(string Restore_Path, string Password) {
 
 	string Filename;
 	Restore_Path += "/";
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	// Backups with a key check record need one key derivation, not a decrypt per archive
+	int key_check = twrpKeyCheck_Verify(Restore_Path, Password);
+	if (key_check == 1) {
+		LOGINFO("Backup password matches the key check record\n");
+		return true;
+	} else if (key_check == 0) {
+		LOGINFO("Backup password does not match the key check record\n");
+		DataManager::SetValue("tw_restore_password", ""); // Clear the bad password
+		DataManager::SetValue("tw_restore_display", "");  // Also clear the display mask
+		return false;
+	}
+#endif
 	d = opendir(Restore_Path.c_str());
 	if (d == NULL) {
 		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Restore_Path)(strerror(errno)));
@@ -1090,16 +1138,6 @@ bool TWFunc::Toggle_MTP(bool enable) {
 #endif
 }
 
-void TWFunc::SetPerformanceMode(bool mode) {
-	if (mode) {
-		property_set("recovery.perf.mode", "1");
-	} else {
-		property_set("recovery.perf.mode", "0");
-	}
-	// Some time for events to catch up to init handlers
-	usleep(500000);
-}
-
 std::string TWFunc::to_string(unsigned long value) {
 	std::ostringstream os;
 	os << value;
@@ -1137,6 +1175,42 @@ unsigned long long TWFunc::IOCTL_Get_Block_Size(const char* block_device) {
 	return 0;
 }
 
+string TWFunc::Get_Block_Disk(const string& Block_Device) {
+	struct stat st;
+	char sysfs[PATH_MAX], real[PATH_MAX];
+	string path, name;
+	int depth;
+
+	if (stat(Block_Device.c_str(), &st) != 0 || !S_ISBLK(st.st_mode))
+		return "";
+	sprintf(sysfs, "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	// Device-mapper devices are followed to the first device under them
+	for (depth = 0; depth < 8; depth++) {
+		if (!realpath(sysfs, real))
+			return "";
+		path = real;
+		if (Path_Exists(path + "/partition"))
+			return Get_Filename(path.substr(0, path.find_last_of('/')));
+		name = Get_Filename(path);
+		DIR* d = opendir((path + "/slaves").c_str());
+		if (d == NULL)
+			return name;
+		struct dirent* de;
+		string slave;
+		while ((de = readdir(d)) != NULL) {
+			if (de->d_name[0] != '.') {
+				slave = de->d_name;
+				break;
+			}
+		}
+		closedir(d);
+		if (slave.empty())
+			return name;
+		snprintf(sysfs, sizeof(sysfs), "/sys/class/block/%s", slave.c_str());
+	}
+	return name;
+}
+
 void TWFunc::copy_kernel_log(string curr_storage) {
 	std::string dmesgDst = curr_storage + "/dmesg.log";
 	std::string dmesgCmd = "/sbin/dmesg";
@@ -44,7 +44,11 @@ enum Archive_Type {
 	UNCOMPRESSED = 0,
 	COMPRESSED,
 	ENCRYPTED,
-	COMPRESSED_ENCRYPTED
+	COMPRESSED_ENCRYPTED,
+	COMPRESSED_ZSTD,
+	COMPRESSED_LZ4,
+	CHUNKED,                                                                    // Index of a deduplicated archive, see twrpChunkStore.hpp
+	SPARSE                                                                      // Sparse image, only ever taken from a .info file
 };
 
 // Partition class
@@ -59,8 +63,10 @@ public:
 	static int Exec_Cmd(const string& cmd);                                     //execute a command
 	static int Wait_For_Child(pid_t pid, int *status, string Child_Name);       // Waits for pid to exit and checks exit status
 	static int Wait_For_Child_Timeout(pid_t pid, int *status, const string& Child_Name, int timeout); // Waits for a pid to exit until the timeout is hit. If timeout is hit, kill the chilld.
+	static pid_t Wait_For_Child_Ms(pid_t pid, int *status, int timeout_ms);   // waitpid() that gives up after timeout_ms, 0 if the child is still running
+	static int Pidfd_Open(pid_t pid);                                           // fd that polls readable when the child exits, -1 if the kernel has no pidfd
 	static bool Path_Exists(string Path);                                       // Returns true if the path exists
-	static Archive_Type Get_File_Type(string fn);                               // Determines file type, 0 for unknown, 1 for gzip, 2 for OAES encrypted
+	static Archive_Type Get_File_Type(string fn);                               // Determines file type, 0 for unknown, 1 for gzip, 2 for OAES or AES-GCM encrypted, 4 for zstd, 5 for lz4, 6 for a chunk index
 	static int Try_Decrypting_File(string fn, string password); // -1 for some error, 0 for failed to decrypt, 1 for decrypted, 3 for decrypted and found gzip format
 	static unsigned long Get_File_Size(const string& Path);                            // Returns the size of a file
 	static std::string Remove_Trailing_Slashes(const std::string& path, bool leaveLast = false); // Normalizes the path, e.g /data//media/ -> /data/media
@@ -68,6 +74,9 @@ public:
 	static vector<string> split_string(const string &in, char del, bool skip_empty);
 	static timespec timespec_diff(timespec& start, timespec& end);	            // Return a diff for 2 times
 	static int32_t timespec_diff_ms(timespec& start, timespec& end);            // Returns diff in ms
+	static int read_file(string fn, vector<string>& results); //read from file
+	static int read_file(string fn, string& results); //read from file
+	static int read_file(string fn, uint64_t& results); //read from file
 
 #ifndef BUILD_TWRPTAR_MAIN
 	static void install_htc_dumlock(void);                                      // Installs HTC Dumlock
@@ -83,9 +92,6 @@ public:
 	static int removeDir(const string path, bool removeParent); //recursively remove a directory
 	static int copy_file(string src, string dst, int mode); //copy file from src to dst with mode permissions
 	static unsigned int Get_D_Type_From_Stat(string Path);                      // Returns a dirent dt_type value using stat instead of dirent
-	static int read_file(string fn, vector<string>& results); //read from file
-	static int read_file(string fn, string& results); //read from file
-	static int read_file(string fn, uint64_t& results); //read from file
 	static int write_to_file(const string& fn, const string& line);             //write to file
 	static bool Try_Decrypting_Backup(string Restore_Path, string Password); // true for success, false for failed to decrypt
 	static string System_Property_Get(string Prop_Name);                // Returns value of Prop_Name from reading /system/build.prop
@@ -97,9 +103,9 @@ public:
 	static int Set_Brightness(std::string brightness_value); // Well, you can read, it does what it says, passing return int from TWFunc::Write_File ;)
 	static bool Toggle_MTP(bool enable);                                        // Disables MTP if enable is false and re-enables MTP if enable is true and it was enabled the last time it was toggled off
 	static std::string to_string(unsigned long value); //convert ul to string
-	static void SetPerformanceMode(bool mode); // support recovery.perf.mode
 	static void Disable_Stock_Recovery_Replace(); // Disable stock ROMs from replacing TWRP with stock recovery
 	static unsigned long long IOCTL_Get_Block_Size(const char* block_device);
+	static string Get_Block_Disk(const string& Block_Device);                   // Returns the name of the disk under a block device, e.g. sda for a partition on sda, "" if it can't be found
 	static void copy_kernel_log(string curr_storage); // Copy Kernel Log to Current Storage (PSTORE/KMSG)
 	static bool isNumber(string strtocheck); // return true if number, false if not a number
 	static int stream_adb_backup(string &Restore_Name); // Tell ADB Backup to Stream to TWRP from GUI selection
@@ -46,8 +46,14 @@ extern "C" {
 #include "openrecoveryscript.hpp"
 #include "variables.h"
 #include "twrpAdbBuFifo.hpp"
+#include "twrpLog.hpp"
+#include "twrpPerfProfile.hpp"
+#include "twrpStartupTasks.hpp"
+#include "twrpStartupTrace.hpp"
+#include "twrpMemBudget.hpp"
 #ifdef TW_USE_NEW_MINADBD
 #include "minadbd/minadbd.h"
+#include "fuse_sideload.h"
 #else
 extern "C" {
 #include "minadbd21/adb.h"
@@ -83,6 +89,7 @@ int main(int argc, char **argv) {
 	if (argc == 3 && strcmp(argv[1], "--adbd") == 0) {
 		property_set("ctl.stop", "adbd");
 #ifdef TW_USE_NEW_MINADBD
+		set_fuse_sideload_cache_size(twrpMemBudget::Get()->Grant("sideload cache", FUSE_SIDELOAD_CACHE_MAX, FUSE_SIDELOAD_CACHE_MIN));
 		//adb_server_main(0, DEFAULT_ADB_PORT, -1); TODO fix this for android8
 		minadbd_main();
 #else
@@ -91,6 +98,8 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 
+	twrpLog::Start();
+
 #ifdef RECOVERY_SDCARD_ON_DATA
 	datamedia = true;
 #endif
@@ -108,23 +117,42 @@ int main(int argc, char **argv) {
 	printf("Starting TWRP %s-%s on %s (pid %d)\n", TW_VERSION_STR, TW_GIT_REVISION, ctime(&StartupTime), getpid());
 
 	// Load default values to set DataManager constants and handle ifdefs
+	int phase = twrpStartupTrace::Begin("default values");
 	DataManager::SetDefaultValues();
-	printf("Starting the UI...\n");
-	gui_init();
+	twrpStartupTrace::End(phase);
 	printf("=> Linking mtab\n");
 	symlink("/proc/mounts", "/etc/mtab");
 	std::string fstab_filename = "/etc/twrp.fstab";
 	if (!TWFunc::Path_Exists(fstab_filename)) {
 		fstab_filename = "/etc/recovery.fstab";
 	}
-	printf("=> Processing %s\n", fstab_filename.c_str());
-	if (!PartitionManager.Process_Fstab(fstab_filename, 1)) {
+
+	// The display and the splash screen don't need the partitions, so they
+	// come up while the fstab is probed; the theme needs both, as it picks
+	// the decrypt page and loads from the settings storage
+	twrpStartupTasks startup;
+	int graphics = startup.Add("gui init", [] {
+		printf("Starting the UI...\n");
+		gui_init();
+		return true;
+	});
+	int fstab = startup.Add("fstab", [&fstab_filename] {
+		printf("=> Processing %s\n", fstab_filename.c_str());
+		if (!PartitionManager.Process_Fstab(fstab_filename, 1))
+			return false;
+		PartitionManager.Output_Partition_Logging();
+		return true;
+	});
+	int resources = startup.Add("gui resources", [] {
+		gui_loadResources();
+		return true;
+	}, {graphics, fstab});
+	startup.Start();
+	if (!startup.Wait(fstab)) {
 		LOGERR("Failing out of recovery due to problem with fstab.\n");
 		return -1;
 	}
-	PartitionManager.Output_Partition_Logging();
-	// Load up all the resources
-	gui_loadResources();
+	startup.Wait(resources);
 
 	bool Shutdown = false;
 	bool SkipDecryption = false;
@@ -214,8 +242,10 @@ int main(int argc, char **argv) {
 	}
 
 	// Check for and run startup script if script exists
+	phase = twrpStartupTrace::Begin("boot scripts");
 	TWFunc::check_and_run_script("/sbin/runatboot.sh", "boot");
 	TWFunc::check_and_run_script("/sbin/postrecoveryboot.sh", "boot");
+	twrpStartupTrace::End(phase);
 
 #ifdef TW_INCLUDE_INJECTTWRP
 	// Back up TWRP Ramdisk if needed:
@@ -236,7 +266,12 @@ int main(int argc, char **argv) {
 			LOGINFO("Skipping decryption\n");
 		} else {
 			LOGINFO("Is encrypted, do decrypt page first\n");
-			if (gui_startPage("decrypt", 1, 1) != 0) {
+			// Includes the time it takes to enter the password; the first
+			// frame of the page shows up as a mark
+			phase = twrpStartupTrace::Begin("decrypt page");
+			int decrypt_ret = gui_startPage("decrypt", 1, 1);
+			twrpStartupTrace::End(phase);
+			if (decrypt_ret != 0) {
 				LOGERR("Failed to start decrypt GUI page.\n");
 			} else {
 				// Check for and load custom theme if present
@@ -258,16 +293,20 @@ int main(int argc, char **argv) {
 		TWFunc::Fixup_Time_On_Boot();
 
 	// Read the settings file
+	phase = twrpStartupTrace::Begin("settings and language");
 	TWFunc::Update_Log_File();
 	DataManager::ReadSettingsFile();
 	PageManager::LoadLanguage(DataManager::GetStrValue("tw_language"));
 	GUIConsole::Translate_Now();
+	twrpStartupTrace::End(phase);
 
 	// Run any outstanding OpenRecoveryScript
 	std::string cacheDir = TWFunc::get_cache_dir();
 	std::string orsFile = cacheDir + "/recovery/openrecoveryscript";
 	if ((DataManager::GetIntValue(TW_IS_ENCRYPTED) == 0 || SkipDecryption) && (TWFunc::Path_Exists(SCRIPT_FILE_TMP) || TWFunc::Path_Exists(orsFile))) {
+		phase = twrpStartupTrace::Begin("openrecoveryscript");
 		OpenRecoveryScript::Run_OpenRecoveryScript();
+		twrpStartupTrace::End(phase);
 	}
 
 #ifdef TW_HAS_MTP
@@ -278,10 +317,12 @@ int main(int argc, char **argv) {
 			&& (!DataManager::GetIntValue(TW_IS_ENCRYPTED) || DataManager::GetIntValue(TW_IS_DECRYPTED))) {
 		property_set("mtp.crash_check", "1");
 		LOGINFO("Starting MTP\n");
+		phase = twrpStartupTrace::Begin("mtp");
 		if (!PartitionManager.Enable_MTP())
 			PartitionManager.Disable_MTP();
 		else
 			gui_msg("mtp_enabled=MTP Enabled");
+		twrpStartupTrace::End(phase);
 		property_set("mtp.crash_check", "0");
 	} else if (strcmp(mtp_crash_check, "0")) {
 		gui_warn("mtp_crash=MTP Crashed, not starting MTP on boot.");
@@ -322,7 +363,11 @@ int main(int argc, char **argv) {
 	twrpAdbBuFifo *adb_bu_fifo = new twrpAdbBuFifo();
 	adb_bu_fifo->threadAdbBuFifo();
 
-	// Launch the main GUI
+	// The profile the device runs at while the GUI waits for the user
+	twrpPerfProfile::Get()->Idle();
+
+	// Launch the main GUI; its first frame ends the startup trace
+	twrpStartupTrace::Begin("main page");
 	gui_start();
 
 #ifndef TW_OEM_BUILD
@@ -18,9 +18,14 @@
 
 #define __STDC_FORMAT_MACROS 1
 #include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <zlib.h>
 #include <inttypes.h>
 #include "twrpAdbBuFifo.hpp"
@@ -29,6 +34,7 @@
 #include "variables.h"
 #include "partitions.hpp"
 #include "twrp-functions.hpp"
+#include "twrpCompress.hpp"
 #include "gui/gui.hpp"
 #include "gui/objects.hpp"
 #include "gui/pages.hpp"
@@ -36,6 +42,7 @@
 #include "adbbu/libtwadbbu.hpp"
 
 twrpAdbBuFifo::twrpAdbBuFifo(void) {
+	main_page_time = 0;
 	unlink(TW_ADB_FIFO);
 }
 
@@ -45,6 +52,8 @@ void twrpAdbBuFifo::Check_Adb_Fifo_For_Events(void) {
 	memset(&cmd, 0, sizeof(cmd));
 
 	if (read(adb_fifo_fd, &cmd, sizeof(cmd)) > 0) {
+		// The new operation puts up its own page
+		main_page_time = 0;
 		LOGINFO("adb backup cmd: %s\n", cmd);
 		std::string cmdcheck(cmd);
 		cmdcheck = cmdcheck.substr(0, strlen(ADB_BACKUP_OP));
@@ -65,21 +74,55 @@ bool twrpAdbBuFifo::start(void) {
 		LOGINFO("Unable to mkfifo %s\n", TW_ADB_FIFO);
 		return false;
 	}
-	adb_fifo_fd = open(TW_ADB_FIFO, O_RDONLY | O_NONBLOCK);
+	// Opened for writing too, so the fifo always has a writer: twrpback's
+	// open doesn't wait for us, and poll() doesn't see a hangup each time
+	// twrpback closes its end
+	adb_fifo_fd = open(TW_ADB_FIFO, O_RDWR | O_NONBLOCK);
 	if (adb_fifo_fd < 0) {
 		LOGERR("Unable to open TW_ADB_FIFO for reading.\n");
 		close(adb_fifo_fd);
 		return false;
 	}
 	while (true) {
-		Check_Adb_Fifo_For_Events();
-		usleep(8000);
+		struct pollfd pfd;
+
+		pfd.fd = adb_fifo_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		int ready = poll(&pfd, 1, Main_Page_Wait());
+		if (ready > 0)
+			Check_Adb_Fifo_For_Events();
+		else if (ready == 0) {
+			main_page_time = 0;
+			gui_changePage("main");
+		} else if (errno != EINTR) {
+			LOGERR("Unable to poll TW_ADB_FIFO: %s\n", strerror(errno));
+			break;
+		}
 	}
 	//Shouldn't get here but cleanup anwyay
 	close(adb_fifo_fd);
 	return true;
 }
 
+int64_t twrpAdbBuFifo::Now_Ms(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void twrpAdbBuFifo::Return_To_Main_Page(void) {
+	main_page_time = Now_Ms() + TW_ADB_DONE_PAGE_MS;
+}
+
+int twrpAdbBuFifo::Main_Page_Wait(void) {
+	if (main_page_time == 0)
+		return -1;
+	int64_t left = main_page_time - Now_Ms();
+	return left > 0 ? (int) left : 0;
+}
+
 pthread_t twrpAdbBuFifo::threadAdbBuFifo(void) {
 	pthread_t thread;
 	ThreadPtr adbfifo = &twrpAdbBuFifo::start;
@@ -89,25 +132,55 @@ pthread_t twrpAdbBuFifo::threadAdbBuFifo(void) {
 }
 
 bool twrpAdbBuFifo::Backup_ADB_Command(std::string Options) {
-	std::vector<std::string> args;
+	std::vector<std::string> args, Sent_List;
 	std::string Backup_List;
-	bool adbbackup = true, ret = false;
+	bool adbbackup = true, ret = false, resume = false, listed = false;
 	std::string rmopt = "--";
 
 	std::replace(Options.begin(), Options.end(), ':', ' ');
 	args = TWFunc::Split_String(Options, " ");
 
 	DataManager::SetValue(TW_USE_COMPRESSION_VAR, 0);
+	DataManager::SetValue(TW_ADB_COMPRESSION_VAR, UNCOMPRESSED);
 	DataManager::SetValue(TW_SKIP_DIGEST_GENERATE_VAR, 0);
 
 	if (args[1].compare("--twrp") != 0) {
 		gui_err("twrp_adbbu_option=--twrp option is required to enable twrp adb backup");
 		if (!twadbbu::Write_TWERROR())
 			LOGERR("Unable to write to ADB Backup\n");
-		sleep(2);
 		return false;
 	}
 
+	// A resumed backup sends the partitions of the interrupted one that the
+	// host did not receive, with the options of the interrupted one
+	for (unsigned i = 2; i < args.size(); i++) {
+		if (args[i] == TWRP_RESUME_ARG || args[i] == rmopt + TWRP_RESUME_ARG)
+			resume = true;
+	}
+	if (resume) {
+		std::vector<std::string> session = twadbbu::Read_Session(TW_ADB_BACKUP_SESSION);
+		if (session.empty() || session[0].compare(0, 8, "options ") != 0) {
+			gui_err("adb_resume_none=No interrupted ADB backup to resume.");
+			if (!twadbbu::Write_TWERROR())
+				LOGERR("Unable to write to ADB Backup\n");
+			return false;
+		}
+		for (unsigned i = 1; i < session.size(); i++) {
+			std::istringstream record(session[i]);
+			std::string type, bytes, md5, name;
+
+			record >> type >> bytes >> md5;
+			std::getline(record >> std::ws, name);
+			if (type == "file") {
+				name = TWFunc::Get_Filename(name);
+				Sent_List.push_back("/" + name.substr(0, name.find('.')));
+			}
+		}
+		Options = session[0].substr(8);
+		std::replace(Options.begin(), Options.end(), ':', ' ');
+		args = TWFunc::Split_String(Options, " ");
+	}
+
 	for (unsigned i = 2; i < args.size(); i++) {
 		int compress;
 
@@ -115,15 +188,34 @@ bool twrpAdbBuFifo::Backup_ADB_Command(std::string Options) {
 		if (size != std::string::npos)
 			args[i].erase(size, rmopt.length());
 
-		if (args[i].compare("compress") == 0) {
+		// compress alone is gzip, compress=zstd or compress=lz4 asks for
+		// another codec and falls back to gzip when this build lacks it
+		if (args[i].compare(0, 8, "compress") == 0 && (args[i].size() == 8 || args[i][8] == '=')) {
+			std::string codec_name = args[i].size() > 9 ? args[i].substr(9) : "gzip";
+			Archive_Type codec = COMPRESSED;
+
+			if (codec_name == "zstd")
+				codec = COMPRESSED_ZSTD;
+			else if (codec_name == "lz4")
+				codec = COMPRESSED_LZ4;
+			if ((codec_name != "gzip" && codec == COMPRESSED) || !twrpCompress_Supported(codec)) {
+				gui_msg(Msg(msg::kWarning, "adb_codec_unsupported=Compression {1} is not supported, using gzip")(codec_name));
+				codec = COMPRESSED;
+			}
 			gui_msg("compression_on=Compression is on");
 			DataManager::SetValue(TW_USE_COMPRESSION_VAR, 1);
+			DataManager::SetValue(TW_ADB_COMPRESSION_VAR, codec);
 			continue;
 		}
 		DataManager::GetValue(TW_USE_COMPRESSION_VAR, compress);
 		gui_print("%s\n", args[i].c_str());
 		std::string path;
 		path = "/" + args[i];
+		listed = true;
+		if (std::find(Sent_List.begin(), Sent_List.end(), path) != Sent_List.end()) {
+			gui_msg(Msg("adb_resume_skip=Skipping {1}, the host already has it")(path));
+			continue;
+		}
 		TWPartition* part = PartitionManager.Find_Partition_By_Path(path);
 		if (part) {
 			Backup_List += path;
@@ -137,15 +229,30 @@ bool twrpAdbBuFifo::Backup_ADB_Command(std::string Options) {
 	}
 }
 
-	if (Backup_List.empty()) {
+	if (!listed) {
 		DataManager::GetValue("tw_backup_list", Backup_List);
-		if (Backup_List.empty()) {
-			gui_err("no_partition_selected=No partitions selected for backup.");
-			return false;
+		if (resume) {
+			std::vector<std::string> Selected = TWFunc::Split_String(Backup_List, ";");
+
+			Backup_List.clear();
+			for (unsigned i = 0; i < Selected.size(); i++) {
+				if (std::find(Sent_List.begin(), Sent_List.end(), Selected[i]) != Sent_List.end())
+					gui_msg(Msg("adb_resume_skip=Skipping {1}, the host already has it")(Selected[i]));
+				else
+					Backup_List += Selected[i] + ";";
+			}
 		}
 	}
-	else
-		DataManager::SetValue("tw_backup_list", Backup_List);
+	if (Backup_List.empty()) {
+		if (resume) {
+			gui_err("adb_resume_done=The host already has every partition of the interrupted ADB backup.");
+			if (!twadbbu::Write_TWERROR())
+				LOGERR("Unable to write to ADB Backup\n");
+		} else
+			gui_err("no_partition_selected=No partitions selected for backup.");
+		return false;
+	}
+	DataManager::SetValue("tw_backup_list", Backup_List);
 
 	DataManager::SetValue("tw_action", "clear");
 	DataManager::SetValue("tw_action_text1", gui_lookup("running_recovery_commands", "Running Recovery Commands"));
@@ -160,13 +267,13 @@ bool twrpAdbBuFifo::Backup_ADB_Command(std::string Options) {
 	}
 	gui_msg("backup_complete=Backup Complete");
 	DataManager::SetValue("ui_progress", 100);
-	sleep(2); //give time for user to see messages on console
-	gui_changePage("main");
+	Return_To_Main_Page();
 	return true;
 }
 
 bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 	int partition_count = 0;
+	uint64_t stream_version = ADB_BACKUP_VERSION;
 	std::string Restore_Name;
 	struct AdbBackupFileTrailer adbmd5;
 	struct PartitionSettings part_settings;
@@ -175,6 +282,7 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 	char cmd[512];
 
 	part_settings.total_restore_size = 0;
+	part_settings.report = NULL;
 
 	PartitionManager.Mount_All_Storage();
 	DataManager::SetValue(TW_SKIP_DIGEST_CHECK_VAR, 0);
@@ -182,6 +290,14 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 	adb_control_bu_fd = open(TW_ADB_BU_CONTROL, O_WRONLY | O_NONBLOCK);
 	LOGINFO("opening TW_ADB_TWRP_CONTROL\n");
 	adb_control_twrp_fd = open(TW_ADB_TWRP_CONTROL, O_RDONLY | O_NONBLOCK);
+	if (adb_control_bu_fd < 0 || adb_control_twrp_fd < 0) {
+		LOGERR("Unable to open the ADB Backup control fifos: %s\n", strerror(errno));
+		if (adb_control_bu_fd >= 0)
+			close(adb_control_bu_fd);
+		if (adb_control_twrp_fd >= 0)
+			close(adb_control_twrp_fd);
+		return false;
+	}
 	memset(&adbmd5, 0, sizeof(adbmd5));
 
 	DataManager::SetValue("tw_action", "clear");
@@ -190,6 +306,25 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 	gui_changePage("action_page");
 
 	while (true) {
+		struct pollfd pfd;
+
+		// twrpback keeps its end open until it is done, a hangup without
+		// data means it is gone
+		pfd.fd = adb_control_twrp_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGERR("Unable to poll TW_ADB_TWRP_CONTROL: %s\n", strerror(errno));
+			ret = false;
+			break;
+		}
+		if (!(pfd.revents & POLLIN)) {
+			LOGERR("ADB Backup closed TW_ADB_TWRP_CONTROL before the end of the restore\n");
+			ret = false;
+			break;
+		}
 		memset(&cmd, 0, sizeof(cmd));
 		if (read(adb_control_twrp_fd, cmd, sizeof(cmd)) > 0) {
 			struct AdbBackupControlType cmdstruct;
@@ -202,11 +337,20 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 				memcpy(&twhdr, cmd, sizeof(cmd));
 				LOGINFO("ADB Partition count: %" PRIu64 "\n", twhdr.partition_count);
 				LOGINFO("ADB version: %" PRIu64 "\n", twhdr.version);
-				if (twhdr.version != ADB_BACKUP_VERSION) {
+				if (twhdr.version < ADB_BACKUP_MIN_VERSION || twhdr.version > ADB_BACKUP_VERSION) {
 					LOGERR("Incompatible adb backup version!\n");
 					ret = false;
 					break;
 				}
+				if (twhdr.version >= ADB_CODEC_VERSION && twhdr.compression != UNCOMPRESSED) {
+					LOGINFO("ADB stream compression: %u\n", twhdr.compression);
+					if (!twrpCompress_Supported((Archive_Type) twhdr.compression)) {
+						gui_msg(Msg(msg::kError, "unsupported_compression=Compression used by '{1}' is not supported by this TWRP build")("adb backup"));
+						ret = false;
+						break;
+					}
+				}
+				stream_version = twhdr.version;
 				partition_count = twhdr.partition_count;
 			}
 			else if (cmdtype == MD5TRAILER) {
@@ -259,7 +403,7 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 					LOGINFO("ADB Type: %s\n", twimghdr.type);
 					LOGINFO("ADB Restore_Name: %s\n", Restore_Name.c_str());
 					LOGINFO("ADB Restore_size: %" PRIu64 "\n", part_settings.total_restore_size);
-					string compression = (twimghdr.compressed == 1) ? "compressed" : "uncompressed";
+					string compression = (twimghdr.compressed != UNCOMPRESSED) ? "compressed" : "uncompressed";
 					LOGINFO("ADB compression: %s\n", compression.c_str());
 					std::string Backup_FileName;
 					std::size_t pos = Restore_Name.find_last_of("/");
@@ -277,7 +421,11 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 					PartitionManager.Set_Restore_Files(path);
 					part_settings.partition_count = partition_count;
 					part_settings.adbbackup = true;
-					part_settings.adb_compression = twimghdr.compressed;
+					// Images were always sent uncompressed before the codec
+					// was negotiated, and their header was not cleared
+					part_settings.adb_compression = stream_version >= ADB_CODEC_VERSION ? twimghdr.compressed : UNCOMPRESSED;
+					part_settings.adb_streams = 1;
+					part_settings.adb_encrypted_streams = 0;
 					part_settings.PM_Method = PM_RESTORE;
 					ProgressTracking progress(part_settings.total_restore_size);
 					part_settings.progress = &progress;
@@ -291,7 +439,7 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 					LOGINFO("ADB Type: %s\n", twimghdr.type);
 					LOGINFO("ADB Restore_Name: %s\n", Restore_Name.c_str());
 					LOGINFO("ADB Restore_size: %" PRIi64 "\n", part_settings.total_restore_size);
-					string compression = (twimghdr.compressed == 1) ? "compressed" : "uncompressed";
+					string compression = (twimghdr.compressed != UNCOMPRESSED) ? "compressed" : "uncompressed";
 					LOGINFO("ADB compression: %s\n", compression.c_str());
 					std::string Backup_FileName;
 					std::size_t pos = Restore_Name.find_last_of("/");
@@ -321,7 +469,20 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 					}
 					part_settings.partition_count = partition_count;
 					part_settings.adbbackup = true;
-					part_settings.adb_compression = twimghdr.compressed;
+					part_settings.adb_compression = (uint32_t) twimghdr.compressed;
+					part_settings.adb_streams = twimghdr.streams > 0 ? twimghdr.streams : 1;
+					part_settings.adb_encrypted_streams = stream_version >= ADB_ENCRYPT_VERSION ? ADB_ENCRYPTED_STREAMS(twimghdr.compressed) : 0;
+					if (part_settings.adb_encrypted_streams) {
+						std::string Password;
+						DataManager::GetValue("tw_restore_password", Password);
+						if (Password.empty()) {
+							gui_err("adb_restore_password=The adb backup is encrypted, set the restore password in TWRP first.");
+							if (!twadbbu::Write_TWERROR())
+								LOGERR("Unable to write to TWRP ADB Backup.\n");
+							ret = false;
+							break;
+						}
+					}
 					part_settings.total_restore_size += part_settings.Part->Get_Restore_Size(&part_settings);
 					part_settings.PM_Method = PM_RESTORE;
 					ProgressTracking progress(part_settings.total_restore_size);
@@ -343,9 +504,9 @@ bool twrpAdbBuFifo::Restore_ADB_Backup(void) {
 
 	if (!twadbbu::Write_TWENDADB())
 		ret = false;
-	sleep(2); //give time for user to see messages on console
 	DataManager::SetValue("ui_progress", 100);
-	gui_changePage("main");
+	Return_To_Main_Page();
 	close(adb_control_bu_fd);
+	close(adb_control_twrp_fd);
 	return ret;
 }
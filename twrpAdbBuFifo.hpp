@@ -21,8 +21,10 @@
 
 #include <string>
 #include <pthread.h>
+#include <stdint.h>
 
 #define TW_ADB_FIFO "/tmp/twadbfifo"
+#define TW_ADB_DONE_PAGE_MS 2000                                     // How long the result of an operation stays on screen
 
 class twrpAdbBuFifo {
 	public:
@@ -33,8 +35,12 @@ class twrpAdbBuFifo {
 		bool Backup_ADB_Command(std::string Options);
 		void Check_Adb_Fifo_For_Events(void);
 		bool Restore_ADB_Backup(void);
+		void Return_To_Main_Page(void);                              // After TW_ADB_DONE_PAGE_MS, unless another operation starts
+		int Main_Page_Wait(void);                                    // poll() timeout until then, -1 if nothing is pending
+		static int64_t Now_Ms(void);
 		typedef bool (twrpAdbBuFifo::*ThreadPtr)(void);
 		typedef void* (*PThreadPtr)(void *);
 		int adb_fifo_fd;
+		int64_t main_page_time;                                      // Now_Ms() to go back to the main page at, 0 for none
 };
 #endif
@@ -0,0 +1,458 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <set>
+#include <string>
+#include <vector>
+#include "twrpChunkStore.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+#include "gui/gui.hpp"
+#include "twrpDigest/twrpDigest.hpp"
+#include "twrpDigest/twrpMD5.hpp"
+#ifndef TW_NO_SHA2_LIBRARY
+#include "twrpDigest/twrpSHA.hpp"
+#endif
+
+// Random values for the gear hash. They decide where chunks are cut, so
+// they must never change or existing chunks would stop matching.
+static uint64_t gear_table[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static void Init_Gear_Table() {
+	uint64_t seed = 0x5457525043484e4bULL;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		// splitmix64
+		uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear_table[i] = z ^ (z >> 31);
+	}
+}
+
+static twrpDigest* New_Chunk_Digest(size_t hash_len) {
+#ifndef TW_NO_SHA2_LIBRARY
+	if (hash_len == 0 || hash_len == SHA256_DIGEST_LENGTH * 2)
+		return new twrpSHA256();
+#endif
+	if (hash_len == 0 || hash_len == MD5LENGTH * 2)
+		return new twrpMD5();
+	return NULL;
+}
+
+static std::string Chunk_Path(const std::string& store, const std::string& hash) {
+	return store + "/" + hash.substr(0, 2) + "/" + hash;
+}
+
+static bool Write_All(int fd, const void *buf, size_t size) {
+	const unsigned char* p = (const unsigned char*) buf;
+	while (size > 0) {
+		ssize_t w = write(fd, p, size);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		twrpCompress_Digest_Output(fd, p, w);
+		p += w;
+		size -= w;
+	}
+	return true;
+}
+
+static bool Parse_Index(const std::string& index, std::vector<twrpChunkRef> *Chunks, uint64_t *Total_Size) {
+	size_t pos = 0, end;
+	uint64_t sum = 0;
+	bool header = false;
+
+	Chunks->clear();
+	while (pos < index.size()) {
+		end = index.find('\n', pos);
+		if (end == std::string::npos)
+			return false; // truncated
+		std::string line = index.substr(pos, end - pos);
+		pos = end + 1;
+		if (!header) {
+			if (line != TW_CHUNK_INDEX_HEADER)
+				return false;
+			header = true;
+			continue;
+		}
+
+		char hash[129];
+		unsigned long long size, count;
+		if (sscanf(line.c_str(), "end %llu %llu", &size, &count) == 2)
+			return size == sum && count == Chunks->size() && (*Total_Size = sum, true);
+		if (sscanf(line.c_str(), "%128s %llu", hash, &size) != 2)
+			return false;
+		twrpChunkRef Ref;
+		Ref.hash = hash;
+		Ref.size = size;
+		Chunks->push_back(Ref);
+		sum += size;
+	}
+	return false; // no end line
+}
+
+twrpChunkWriter::twrpChunkWriter(int out_fd, const std::string& store) {
+	fd = out_fd;
+	store_path = store;
+	gear_hash = 0;
+	total_size = 0;
+	new_size = 0;
+	chunk_count = 0;
+	new_count = 0;
+	failed = false;
+	finished = false;
+}
+
+twrpChunkWriter::~twrpChunkWriter() {
+}
+
+bool twrpChunkWriter::Start() {
+	pthread_once(&gear_once, Init_Gear_Table);
+	if (!TWFunc::Recursive_Mkdir(store_path)) {
+		LOGINFO("Unable to create chunk store '%s'\n", store_path.c_str());
+		return false;
+	}
+	chunk.reserve(TW_CHUNK_MAX_SIZE);
+	return Write_Index(TW_CHUNK_INDEX_HEADER);
+}
+
+ssize_t twrpChunkWriter::Write(const void *buf, size_t size) {
+	const unsigned char* p = (const unsigned char*) buf;
+	size_t left = size;
+
+	if (failed || finished)
+		return -1;
+	while (left > 0) {
+		size_t have = chunk.size(), i = 0;
+		bool cut = false;
+
+		// The gear hash only depends on the last 64 bytes, so hashing can
+		// start just before the smallest allowed cut
+		if (have + 64 < TW_CHUNK_MIN_SIZE) {
+			i = TW_CHUNK_MIN_SIZE - 64 - have;
+			if (i > left)
+				i = left;
+		}
+		for (; i < left; i++) {
+			gear_hash = (gear_hash << 1) + gear_table[p[i]];
+			if (have + i + 1 >= TW_CHUNK_MAX_SIZE || (have + i + 1 >= TW_CHUNK_MIN_SIZE && (gear_hash & TW_CHUNK_MASK) == 0)) {
+				i++;
+				cut = true;
+				break;
+			}
+		}
+		chunk.insert(chunk.end(), p, p + i);
+		p += i;
+		left -= i;
+		if (cut && !Store_Chunk())
+			return -1;
+	}
+	return size;
+}
+
+int twrpChunkWriter::Finish() {
+	char line[64];
+
+	if (finished)
+		return failed ? -1 : 0;
+	finished = true;
+	if (failed || (!chunk.empty() && !Store_Chunk()))
+		return -1;
+	sprintf(line, "end %llu %llu", (unsigned long long)total_size, (unsigned long long)chunk_count);
+	if (!Write_Index(line))
+		return -1;
+	LOGINFO("Chunked %llu bytes into %llu chunks, %llu new chunks with %llu bytes\n", (unsigned long long)total_size,
+		(unsigned long long)chunk_count, (unsigned long long)new_count, (unsigned long long)new_size);
+	return 0;
+}
+
+bool twrpChunkWriter::Store_Chunk() {
+	twrpDigest* digest = New_Chunk_Digest(0);
+	struct stat st;
+	char size_str[32];
+
+	digest->update(&chunk[0], chunk.size());
+	std::string hash = digest->return_digest_string();
+	delete digest;
+
+	std::string path = Chunk_Path(store_path, hash);
+	if (stat(path.c_str(), &st) != 0 || (uint64_t)st.st_size != chunk.size()) {
+		// Not stored yet. Written under a temporary name so a chunk never
+		// exists half written, other threads may store the same chunk.
+		std::string dir = store_path + "/" + hash.substr(0, 2);
+		if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+			LOGINFO("Unable to create '%s': %s\n", dir.c_str(), strerror(errno));
+			failed = true;
+			return false;
+		}
+		std::string temp = path + ".XXXXXX";
+		std::vector<char> temp_name(temp.begin(), temp.end());
+		temp_name.push_back(0);
+		int chunk_fd = mkstemp(&temp_name[0]);
+		if (chunk_fd < 0) {
+			LOGINFO("Unable to create chunk in '%s': %s\n", dir.c_str(), strerror(errno));
+			failed = true;
+			return false;
+		}
+		bool written = Write_All(chunk_fd, &chunk[0], chunk.size());
+		if (close(chunk_fd) != 0 || !written || rename(&temp_name[0], path.c_str()) != 0) {
+			LOGINFO("Unable to write chunk '%s': %s\n", path.c_str(), strerror(errno));
+			unlink(&temp_name[0]);
+			failed = true;
+			return false;
+		}
+		chmod(path.c_str(), 0644);
+		new_count++;
+		new_size += chunk.size();
+	}
+
+	sprintf(size_str, " %llu", (unsigned long long)chunk.size());
+	if (!Write_Index(hash + size_str))
+		return false;
+	total_size += chunk.size();
+	chunk_count++;
+	chunk.clear();
+	gear_hash = 0;
+	return true;
+}
+
+bool twrpChunkWriter::Write_Index(const std::string& line) {
+	std::string out = line + "\n";
+	if (!Write_All(fd, out.data(), out.size())) {
+		LOGINFO("Error writing chunk index: %s\n", strerror(errno));
+		failed = true;
+		return false;
+	}
+	return true;
+}
+
+twrpChunkReader::twrpChunkReader(int in_fd, const std::string& store) {
+	fd = in_fd;
+	store_path = store;
+	next_chunk = 0;
+	data_pos = 0;
+}
+
+bool twrpChunkReader::Start() {
+	std::string index;
+	char buf[4096];
+	ssize_t r;
+	uint64_t total;
+
+	while ((r = read(fd, buf, sizeof(buf))) != 0) {
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			LOGINFO("Error reading chunk index: %s\n", strerror(errno));
+			return false;
+		}
+		index.append(buf, r);
+	}
+	if (!Parse_Index(index, &chunks, &total)) {
+		LOGINFO("Chunk index is damaged or incomplete\n");
+		return false;
+	}
+	return true;
+}
+
+ssize_t twrpChunkReader::Read(void *buf, size_t size) {
+	unsigned char* p = (unsigned char*) buf;
+	size_t done = 0;
+
+	while (done < size) {
+		if (data_pos >= data.size()) {
+			if (next_chunk >= chunks.size())
+				break;
+			if (!Load_Chunk())
+				return -1;
+		}
+		size_t len = data.size() - data_pos;
+		if (len > size - done)
+			len = size - done;
+		memcpy(p + done, &data[data_pos], len);
+		data_pos += len;
+		done += len;
+	}
+	return done;
+}
+
+bool twrpChunkReader::Load_Chunk() {
+	const twrpChunkRef& Ref = chunks[next_chunk++];
+	std::string path = Chunk_Path(store_path, Ref.hash);
+	twrpDigest* digest;
+	size_t got = 0;
+	ssize_t r;
+
+	int chunk_fd = open(path.c_str(), O_RDONLY);
+	if (chunk_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
+		return false;
+	}
+	data.resize(Ref.size);
+	data_pos = 0;
+	while (got < Ref.size && (r = read(chunk_fd, &data[got], Ref.size - got)) != 0) {
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			break;
+		got += r;
+	}
+	close(chunk_fd);
+
+	digest = New_Chunk_Digest(Ref.hash.size());
+	if (digest == NULL || got != Ref.size) {
+		delete digest;
+		LOGINFO("Chunk '%s' is truncated\n", path.c_str());
+		gui_msg(Msg(msg::kError, "chunk_damaged=Chunk '{1}' of the backup is damaged")(Ref.hash));
+		return false;
+	}
+	digest->update(&data[0], data.size());
+	bool match = digest->return_digest_string() == Ref.hash;
+	delete digest;
+	if (!match) {
+		gui_msg(Msg(msg::kError, "chunk_damaged=Chunk '{1}' of the backup is damaged")(Ref.hash));
+		return false;
+	}
+	return true;
+}
+
+std::string twrpChunk_Store_Path(const std::string& Backup_Folder) {
+	std::string Folder = Backup_Folder;
+
+	while (Folder.size() > 1 && Folder[Folder.size() - 1] == '/')
+		Folder.resize(Folder.size() - 1);
+	return TWFunc::Get_Path(Folder) + TW_CHUNK_STORE_DIR;
+}
+
+twrpStreamWriter* twrpChunk_New_Writer(int fd, const std::string& store) {
+	twrpChunkWriter* writer = new twrpChunkWriter(fd, store);
+	if (writer->Start())
+		return writer;
+	delete writer;
+	return NULL;
+}
+
+twrpStreamReader* twrpChunk_New_Reader(int fd, const std::string& store) {
+	twrpChunkReader* reader = new twrpChunkReader(fd, store);
+	if (reader->Start())
+		return reader;
+	delete reader;
+	return NULL;
+}
+
+bool twrpChunk_Read_Index(const std::string& Filename, std::vector<twrpChunkRef> *Chunks, uint64_t *Total_Size) {
+	std::string index;
+
+	if (TWFunc::read_file(Filename, index) != 0)
+		return false;
+	return Parse_Index(index, Chunks, Total_Size);
+}
+
+uint64_t twrpChunk_Index_Size(const std::string& Filename) {
+	std::vector<twrpChunkRef> Chunks;
+	uint64_t Total_Size = 0;
+
+	if (!twrpChunk_Read_Index(Filename, &Chunks, &Total_Size))
+		return 0;
+	return Total_Size;
+}
+
+bool twrpChunk_Collect_Garbage(const std::string& Backups_Path) {
+	std::string Backups_Folder = Backups_Path;
+	std::set<std::string> used;
+	unsigned long long removed = 0, freed = 0;
+	DIR *d, *sub, *chunk_dir;
+	struct dirent *de, *file, *chunk;
+
+	while (Backups_Folder.size() > 1 && Backups_Folder[Backups_Folder.size() - 1] == '/')
+		Backups_Folder.resize(Backups_Folder.size() - 1);
+	std::string store = Backups_Folder + "/" + TW_CHUNK_STORE_DIR;
+
+	// Collect every chunk that an index in any backup folder refers to
+	d = opendir(Backups_Folder.c_str());
+	if (d == NULL)
+		return false;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue; // also skips the store
+		std::string folder = Backups_Folder + "/" + de->d_name;
+		sub = opendir(folder.c_str());
+		if (sub == NULL)
+			continue;
+		while ((file = readdir(sub)) != NULL) {
+			std::string fn = folder + "/" + file->d_name;
+			if (file->d_type != DT_REG || TWFunc::Get_File_Type(fn) != CHUNKED)
+				continue;
+			std::vector<twrpChunkRef> Chunks;
+			uint64_t Total_Size;
+			if (!twrpChunk_Read_Index(fn, &Chunks, &Total_Size)) {
+				// Better to keep too much than to break a backup
+				LOGINFO("Unable to read chunk index '%s', not cleaning the chunk store\n", fn.c_str());
+				closedir(sub);
+				closedir(d);
+				return false;
+			}
+			for (size_t i = 0; i < Chunks.size(); i++)
+				used.insert(Chunks[i].hash);
+		}
+		closedir(sub);
+	}
+	closedir(d);
+
+	d = opendir(store.c_str());
+	if (d == NULL)
+		return true; // no store yet
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+		std::string dir = store + "/" + de->d_name;
+		chunk_dir = opendir(dir.c_str());
+		if (chunk_dir == NULL)
+			continue;
+		while ((chunk = readdir(chunk_dir)) != NULL) {
+			struct stat st;
+			if (chunk->d_name[0] == '.' || used.find(chunk->d_name) != used.end())
+				continue;
+			// Also removes temporary files left by an interrupted backup
+			std::string path = dir + "/" + chunk->d_name;
+			if (lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && unlink(path.c_str()) == 0) {
+				removed++;
+				freed += st.st_size;
+			}
+		}
+		closedir(chunk_dir);
+		rmdir(dir.c_str()); // only succeeds if it is empty
+	}
+	closedir(d);
+	LOGINFO("Chunk store cleanup removed %llu chunks, %llu bytes, %zu chunks in use\n", removed, freed, used.size());
+	return true;
+}
@@ -0,0 +1,108 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_CHUNK_STORE_HPP
+#define __TWRP_CHUNK_STORE_HPP
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+#include "twrpCompress.hpp"
+
+// Deduplicated backups: the archive stream is cut into content defined
+// chunks and every chunk is stored once, named by its digest, in a store
+// shared by all backups in the same backups folder. The archive file in the
+// backup folder is only an index listing the chunks in stream order.
+
+// Folder of the store, next to the backup folders
+#define TW_CHUNK_STORE_DIR ".chunks"
+// First line of an index, Get_File_Type() looks for the first four bytes
+#define TW_CHUNK_INDEX_HEADER "TWCHUNKS 1"
+
+// Chunk size limits, the average is about TW_CHUNK_MIN_SIZE + 512KB
+#define TW_CHUNK_MIN_SIZE (128 * 1024)
+#define TW_CHUNK_MAX_SIZE (2 * 1024 * 1024)
+#define TW_CHUNK_MASK ((1ULL << 19) - 1)
+
+struct twrpChunkRef {
+	std::string hash;                                                  // Hex digest, also the file name in the store
+	uint64_t size;
+};
+
+// Cuts the stream into chunks, adds the new ones to the store and writes
+// the index to out_fd
+class twrpChunkWriter : public twrpStreamWriter {
+public:
+	twrpChunkWriter(int out_fd, const std::string& store);
+	~twrpChunkWriter();
+	bool Start();
+	ssize_t Write(const void *buf, size_t size);
+	int Finish();
+
+private:
+	bool Store_Chunk();
+	bool Write_Index(const std::string& line);
+
+	int fd;
+	std::string store_path;
+	std::vector<unsigned char> chunk;                                  // Chunk being filled
+	uint64_t gear_hash;
+	uint64_t total_size;
+	uint64_t new_size;                                                 // Bytes that were not in the store yet
+	uint64_t chunk_count;
+	uint64_t new_count;
+	bool failed;
+	bool finished;
+};
+
+// Streams the chunks listed in the index on in_fd back in order, checking
+// each one against its digest
+class twrpChunkReader : public twrpStreamReader {
+public:
+	twrpChunkReader(int in_fd, const std::string& store);
+	bool Start();
+	ssize_t Read(void *buf, size_t size);                              // Fills buf unless the stream ends
+
+private:
+	bool Load_Chunk();
+
+	int fd;
+	std::string store_path;
+	std::vector<twrpChunkRef> chunks;
+	size_t next_chunk;
+	std::vector<unsigned char> data;                                   // Current chunk
+	size_t data_pos;
+};
+
+// Store used by the archives in a backup folder
+std::string twrpChunk_Store_Path(const std::string& Backup_Folder);
+
+twrpStreamWriter* twrpChunk_New_Writer(int fd, const std::string& store);
+twrpStreamReader* twrpChunk_New_Reader(int fd, const std::string& store);
+
+// Reads an index file, false if it is not a complete index
+bool twrpChunk_Read_Index(const std::string& Filename, std::vector<twrpChunkRef> *Chunks, uint64_t *Total_Size);
+
+// Size of the data an index stands for, 0 on error
+uint64_t twrpChunk_Index_Size(const std::string& Filename);
+
+// Removes the chunks that no index below Backups_Folder uses any more
+bool twrpChunk_Collect_Garbage(const std::string& Backups_Path);
+
+#endif // __TWRP_CHUNK_STORE_HPP
@@ -0,0 +1,990 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include "twrpCompress.hpp"
+#include "twrpThermal.hpp"
+#include "twrpTarProgress.hpp"
+#include "twcommon.h"
+
+#define GZIP_BLOCK_SIZE (128 * 1024)                    // Input bytes per parallel deflate block, same as pigz
+#define GZIP_DICT_SIZE (32 * 1024)                      // Deflate window carried into the next block
+#define GZIP_READ_SIZE (256 * 1024)
+#define MAX_COMPRESS_THREADS 8
+#define GZIP_WORKER_MEMORY (1024 * 1024)                // Two blocks in flight per worker, their output and the deflate state
+#define ZSTD_WORKER_MEMORY (16 * 1024 * 1024)           // About what libzstd holds per worker at the backup levels
+#define STREAM_IO_SIZE (1024 * 1024)                    // Read and write size for the zstd and lz4 streams
+#define ZSTD_DEFAULT_LEVEL 3
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<int, twrpStreamWriter*> writers;
+static std::map<int, twrpStreamReader*> readers;
+static std::map<int, twrpDigest*> digests;
+static std::map<int, twrpTarIndex*> indexes;
+
+static bool Write_Fully(int fd, const void *buf, size_t size) {
+	const unsigned char* ptr = (const unsigned char*) buf;
+
+	while (size > 0) {
+		uint64_t start = twrpThermal::Now_Usec();
+		ssize_t ret = write(fd, ptr, size);
+		twrpTarProgress::Add_Time(TW_TAR_TIME_WRITE, twrpThermal::Now_Usec() - start);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			LOGINFO("twrpCompress: write failed: %s\n", strerror(errno));
+			return false;
+		}
+		twrpCompress_Digest_Output(fd, ptr, ret);
+		ptr += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+static ssize_t Read_Some(int fd, void *buf, size_t size) {
+	ssize_t ret;
+
+	do {
+		ret = read(fd, buf, size);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		LOGINFO("twrpCompress: read failed: %s\n", strerror(errno));
+	return ret;
+}
+
+bool twrpStreamWriter::Write_Output(int fd, const void *buf, size_t size) {
+	if (sink)
+		return sink->Write(buf, size) == (ssize_t) size;
+	return Write_Fully(fd, buf, size);
+}
+
+int twrpStreamWriter::Close() {
+	int ret = Finish();
+
+	if (sink && sink->Close() != 0)
+		ret = -1;
+	return ret;
+}
+
+ssize_t twrpStreamReader::Read_Input(int fd, void *buf, size_t size) {
+	if (source)
+		return source->Read(buf, size);
+	return Read_Some(fd, buf, size);
+}
+
+twrpGzipWriter::twrpGzipWriter(int out_fd, int compression_level, unsigned threads) {
+	fd = out_fd;
+	level = compression_level;
+	thread_count = threads;
+	index = NULL;
+	next_seq = 0;
+	crc = crc32(0L, Z_NULL, 0);
+	member_size = 0;
+	total_in = 0;
+	total_out = 0;
+	submitted = 0;
+	member_submitted = 0;
+	member_open = false;
+	stopping = false;
+	failed = false;
+	finished = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work_cond, NULL);
+	pthread_cond_init(&done_cond, NULL);
+	block.reserve(GZIP_BLOCK_SIZE);
+}
+
+twrpGzipWriter::~twrpGzipWriter() {
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&lock);
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	while (!in_flight.empty()) {
+		delete in_flight.front();
+		in_flight.pop_front();
+	}
+	pthread_cond_destroy(&done_cond);
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&lock);
+}
+
+bool twrpGzipWriter::Start() {
+	unsigned count = twrpThermal::Get()->Workers(thread_count);
+	count = thread_grant.Take_Units("gzip workers", GZIP_WORKER_MEMORY, count, 1);
+	for (unsigned i = 0; i < count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Worker, this) != 0) {
+			LOGINFO("twrpGzipWriter: unable to start compression thread %u, using %u\n", i, i);
+			break;
+		}
+		threads.push_back(thread);
+	}
+	return true;
+}
+
+bool twrpGzipWriter::Set_Index(twrpTarIndex *tar_index) {
+	if (total_in > 0)
+		return false;
+	index = tar_index;
+	return true;
+}
+
+bool twrpGzipWriter::Output(const void *buf, size_t size) {
+	if (!Write_Output(fd, buf, size))
+		return false;
+	total_out += size;
+	return true;
+}
+
+void* twrpGzipWriter::Worker(void *cookie) {
+	twrpGzipWriter* gz = (twrpGzipWriter*) cookie;
+
+	pthread_mutex_lock(&gz->lock);
+	for (;;) {
+		while (gz->queue.empty() && !gz->stopping)
+			pthread_cond_wait(&gz->work_cond, &gz->lock);
+		if (gz->queue.empty())
+			break;
+		Job* job = gz->queue.front();
+		gz->queue.pop_front();
+		pthread_mutex_unlock(&gz->lock);
+		uint64_t start = twrpThermal::Now_Usec();
+		gz->Compress(job);
+		uint64_t busy = twrpThermal::Now_Usec() - start;
+		twrpTarProgress::Add_Time(TW_TAR_TIME_COMPRESS, busy);
+		pthread_mutex_lock(&gz->lock);
+		job->done = true;
+		pthread_cond_broadcast(&gz->done_cond);
+		pthread_mutex_unlock(&gz->lock);
+		// Rest after the block is handed over so the writer isn't held up
+		twrpThermal::Get()->Pace(busy);
+		pthread_mutex_lock(&gz->lock);
+	}
+	pthread_mutex_unlock(&gz->lock);
+	return NULL;
+}
+
+void twrpGzipWriter::Compress(Job *job) {
+	z_stream strm;
+	int ret, flush = job->last ? Z_FINISH : Z_SYNC_FLUSH;
+
+	job->crc = crc32(0L, job->in.data(), job->in.size());
+	memset(&strm, 0, sizeof(strm));
+	if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		job->error = 1;
+		return;
+	}
+	if (!job->dict.empty())
+		deflateSetDictionary(&strm, job->dict.data(), job->dict.size());
+
+	// Every block but the last ends on a sync flush so the raw deflate
+	// streams can simply be concatenated behind one gzip header.
+	job->out.resize(deflateBound(&strm, job->in.size()) + 64);
+	strm.next_in = job->in.data();
+	strm.avail_in = job->in.size();
+	for (;;) {
+		strm.next_out = job->out.data() + strm.total_out;
+		strm.avail_out = job->out.size() - strm.total_out;
+		ret = deflate(&strm, flush);
+		if (ret == Z_STREAM_ERROR) {
+			job->error = 1;
+			break;
+		}
+		if (job->last ? ret == Z_STREAM_END : (strm.avail_in == 0 && strm.avail_out != 0))
+			break;
+		job->out.resize(job->out.size() * 2);
+	}
+	job->out.resize(strm.total_out);
+	deflateEnd(&strm);
+	std::vector<unsigned char>().swap(job->dict);
+}
+
+bool twrpGzipWriter::Submit(bool last) {
+	Job* job = new Job;
+	job->seq = next_seq++;
+	job->offset = submitted;
+	job->first = !member_open;
+	job->done = false;
+	job->crc = 0;
+	job->error = 0;
+	job->in.swap(block);
+	job->dict = window;
+	submitted += job->in.size();
+	member_submitted += job->in.size();
+	// An indexed stream starts a new member every frame, and a member
+	// can not use the window of the one before it
+	job->last = last || (index != NULL && member_submitted >= TW_TAR_INDEX_FRAME);
+	member_open = !job->last;
+	if (job->last) {
+		member_submitted = 0;
+		window.clear();
+	} else if (job->in.size() >= GZIP_DICT_SIZE) {
+		window.assign(job->in.end() - GZIP_DICT_SIZE, job->in.end());
+	} else {
+		window.insert(window.end(), job->in.begin(), job->in.end());
+	}
+	if (window.size() > GZIP_DICT_SIZE)
+		window.erase(window.begin(), window.end() - GZIP_DICT_SIZE);
+	block.clear();
+	block.reserve(GZIP_BLOCK_SIZE);
+
+	if (threads.empty()) {
+		// No worker threads could be started, deflate in this thread
+		Compress(job);
+		job->done = true;
+		in_flight.push_back(job);
+		return Drain(false);
+	}
+
+	pthread_mutex_lock(&lock);
+	queue.push_back(job);
+	in_flight.push_back(job);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+	return Drain(false);
+}
+
+bool twrpGzipWriter::Drain(bool wait_all) {
+	// fixed gzip header: deflate, no name, no mtime, unix
+	static const unsigned char header[10] = { 0x1f, 0x8b, 0x08, 0, 0, 0, 0, 0, 0, 0x03 };
+	unsigned char trailer[8];
+	size_t limit = threads.size() * 2;
+
+	pthread_mutex_lock(&lock);
+	while (!in_flight.empty()) {
+		Job* job = in_flight.front();
+		if (!job->done) {
+			// Keep up to two blocks per thread queued before blocking
+			if (!wait_all && in_flight.size() < limit)
+				break;
+			pthread_cond_wait(&done_cond, &lock);
+			continue;
+		}
+		in_flight.pop_front();
+		pthread_mutex_unlock(&lock);
+		if (job->error) {
+			LOGINFO("twrpGzipWriter: deflate failed on block %llu\n", job->seq);
+			failed = true;
+		}
+		if (!failed && job->first) {
+			if (index)
+				index->Add_Frame(job->offset, total_out);
+			crc = crc32(0L, Z_NULL, 0);
+			member_size = 0;
+			if (!Output(header, sizeof(header)))
+				failed = true;
+		}
+		if (!failed && !Output(job->out.data(), job->out.size()))
+			failed = true;
+		crc = crc32_combine(crc, job->crc, job->in.size());
+		member_size += job->in.size();
+		if (!failed && job->last) {
+			for (int i = 0; i < 4; i++) {
+				trailer[i] = (crc >> (8 * i)) & 0xff;
+				trailer[i + 4] = (member_size >> (8 * i)) & 0xff;
+			}
+			if (!Output(trailer, sizeof(trailer)))
+				failed = true;
+		}
+		delete job;
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return !failed;
+}
+
+ssize_t twrpGzipWriter::Write(const void *buf, size_t size) {
+	const unsigned char* ptr = (const unsigned char*) buf;
+	size_t left = size;
+
+	if (failed || finished)
+		return -1;
+	while (left > 0) {
+		size_t len = GZIP_BLOCK_SIZE - block.size();
+		if (len > left)
+			len = left;
+		block.insert(block.end(), ptr, ptr + len);
+		ptr += len;
+		left -= len;
+		if (block.size() >= GZIP_BLOCK_SIZE && !Submit(false))
+			return -1;
+	}
+	total_in += size;
+	if (index)
+		index->Add_Input(size);
+	return size;
+}
+
+int twrpGzipWriter::Finish() {
+	if (finished)
+		return failed ? -1 : 0;
+	finished = true;
+	// Don't add an empty member when the last frame just ended
+	if ((member_open || !block.empty() || next_seq == 0) && !Submit(true))
+		return -1;
+	return Drain(true) ? 0 : -1;
+}
+
+twrpGzipReader::twrpGzipReader(int in_fd) {
+	fd = in_fd;
+	initialized = false;
+	eof = false;
+	member_end = false;
+	memset(&strm, 0, sizeof(strm));
+}
+
+twrpGzipReader::~twrpGzipReader() {
+	if (initialized)
+		inflateEnd(&strm);
+}
+
+bool twrpGzipReader::Start() {
+	in.resize(GZIP_READ_SIZE);
+	if (inflateInit2(&strm, 15 + 16) != Z_OK) {
+		LOGINFO("twrpGzipReader: inflateInit2 failed\n");
+		return false;
+	}
+	initialized = true;
+	return true;
+}
+
+ssize_t twrpGzipReader::Read(void *buf, size_t size) {
+	strm.next_out = (Bytef*) buf;
+	strm.avail_out = size;
+	while (strm.avail_out > 0) {
+		if (strm.avail_in == 0) {
+			if (eof)
+				break;
+			ssize_t len = Read_Input(fd, in.data(), in.size());
+			if (len < 0)
+				return -1;
+			if (len == 0) {
+				eof = true;
+				// A member cut off by the end of the input is a truncated archive
+				if (!member_end) {
+					LOGINFO("twrpGzipReader: unexpected end of stream\n");
+					return -1;
+				}
+				break;
+			}
+			strm.next_in = in.data();
+			strm.avail_in = len;
+		}
+		int ret = inflate(&strm, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			// pigz -i and cat'ed archives contain several members
+			inflateReset(&strm);
+			member_end = true;
+			continue;
+		}
+		if (ret == Z_DATA_ERROR && member_end) {
+			// Trailing bytes that are not another member end the stream
+			eof = true;
+			strm.avail_in = 0;
+			break;
+		}
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			LOGINFO("twrpGzipReader: inflate failed: %i\n", ret);
+			return -1;
+		}
+		member_end = false;
+	}
+	return size - strm.avail_out;
+}
+
+#ifdef TW_INCLUDE_ZSTD
+twrpZstdWriter::twrpZstdWriter(int out_fd, int compression_level, unsigned threads) {
+	fd = out_fd;
+	level = compression_level ? compression_level : ZSTD_DEFAULT_LEVEL;
+	thread_count = threads;
+	index = NULL;
+	total_in = 0;
+	total_out = 0;
+	frame_in = 0;
+	cctx = NULL;
+	failed = false;
+	finished = false;
+}
+
+twrpZstdWriter::~twrpZstdWriter() {
+	if (cctx)
+		ZSTD_freeCCtx(cctx);
+}
+
+bool twrpZstdWriter::Start() {
+	cctx = ZSTD_createCCtx();
+	if (!cctx)
+		return false;
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+	unsigned workers = thread_count > 1 ? twrpThermal::Get()->Workers(thread_count) : 1;
+	if (workers > 1)
+		workers = worker_grant.Take_Units("zstd workers", ZSTD_WORKER_MEMORY, workers, 1);
+	if (workers > 1 && ZSTD_isError(ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, workers)))
+		LOGINFO("twrpZstdWriter: libzstd has no thread support, compressing in one thread\n");
+	out.resize(ZSTD_CStreamOutSize());
+	return true;
+}
+
+bool twrpZstdWriter::Compress(const void *buf, size_t size, ZSTD_EndDirective mode) {
+	ZSTD_inBuffer input = { buf, size, 0 };
+	size_t ret;
+
+	do {
+		ZSTD_outBuffer output = { out.data(), out.size(), 0 };
+		uint64_t start = twrpThermal::Now_Usec();
+		ret = ZSTD_compressStream2(cctx, &output, &input, mode);
+		twrpTarProgress::Add_Time(TW_TAR_TIME_COMPRESS, twrpThermal::Now_Usec() - start);
+		if (ZSTD_isError(ret)) {
+			LOGINFO("twrpZstdWriter: %s\n", ZSTD_getErrorName(ret));
+			return false;
+		}
+		if (output.pos && !Write_Output(fd, out.data(), output.pos))
+			return false;
+		total_out += output.pos;
+	} while (mode == ZSTD_e_end ? ret != 0 : input.pos < input.size);
+	return true;
+}
+
+bool twrpZstdWriter::Set_Index(twrpTarIndex *tar_index) {
+	if (total_in > 0)
+		return false;
+	index = tar_index;
+	return true;
+}
+
+ssize_t twrpZstdWriter::Write(const void *buf, size_t size) {
+	const unsigned char* ptr = (const unsigned char*) buf;
+	size_t left = size;
+
+	if (failed || finished)
+		return -1;
+	if (index == NULL) {
+		if (!Compress(buf, size, ZSTD_e_continue)) {
+			failed = true;
+			return -1;
+		}
+		total_in += size;
+		return size;
+	}
+	while (left > 0) {
+		size_t len = TW_TAR_INDEX_FRAME - frame_in;
+		if (len > left)
+			len = left;
+		if (frame_in == 0)
+			index->Add_Frame(total_in, total_out);
+		if (!Compress(ptr, len, ZSTD_e_continue)) {
+			failed = true;
+			return -1;
+		}
+		ptr += len;
+		left -= len;
+		frame_in += len;
+		total_in += len;
+		if (frame_in == TW_TAR_INDEX_FRAME) {
+			if (!Compress(NULL, 0, ZSTD_e_end)) {
+				failed = true;
+				return -1;
+			}
+			frame_in = 0;
+		}
+	}
+	index->Add_Input(size);
+	return size;
+}
+
+int twrpZstdWriter::Finish() {
+	if (finished)
+		return failed ? -1 : 0;
+	finished = true;
+	if (failed)
+		return -1;
+	// The last frame of an indexed stream may already be closed
+	if ((index == NULL || frame_in > 0 || total_in == 0) && !Compress(NULL, 0, ZSTD_e_end))
+		return -1;
+	return 0;
+}
+
+twrpZstdReader::twrpZstdReader(int in_fd) {
+	fd = in_fd;
+	dctx = NULL;
+	eof = false;
+	pending = 1;
+	input.src = NULL;
+	input.size = 0;
+	input.pos = 0;
+}
+
+twrpZstdReader::~twrpZstdReader() {
+	if (dctx)
+		ZSTD_freeDCtx(dctx);
+}
+
+bool twrpZstdReader::Start() {
+	dctx = ZSTD_createDCtx();
+	if (!dctx)
+		return false;
+	in.resize(STREAM_IO_SIZE);
+	input.src = in.data();
+	return true;
+}
+
+ssize_t twrpZstdReader::Read(void *buf, size_t size) {
+	ZSTD_outBuffer output = { buf, size, 0 };
+
+	while (output.pos < output.size) {
+		if (input.pos == input.size && !eof) {
+			ssize_t len = Read_Input(fd, in.data(), in.size());
+			if (len < 0)
+				return -1;
+			if (len == 0) {
+				eof = true;
+				continue;
+			}
+			input.size = len;
+			input.pos = 0;
+		}
+		if (input.pos == input.size && pending == 0)
+			break;
+		size_t out_pos = output.pos;
+		size_t ret = ZSTD_decompressStream(dctx, &output, &input);
+		if (ZSTD_isError(ret)) {
+			LOGINFO("twrpZstdReader: %s\n", ZSTD_getErrorName(ret));
+			return -1;
+		}
+		pending = ret;
+		// Past the end of the input the decoder can only flush what it holds,
+		// a frame that still wants more was cut off
+		if (eof && pending != 0 && output.pos == out_pos) {
+			LOGINFO("twrpZstdReader: unexpected end of stream\n");
+			return -1;
+		}
+	}
+	return output.pos;
+}
+#endif // TW_INCLUDE_ZSTD
+
+#ifdef TW_INCLUDE_LZ4
+twrpLz4Writer::twrpLz4Writer(int out_fd, int compression_level) {
+	fd = out_fd;
+	index = NULL;
+	total_in = 0;
+	total_out = 0;
+	frame_in = 0;
+	cctx = NULL;
+	failed = false;
+	finished = false;
+	memset(&prefs, 0, sizeof(prefs));
+	prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+	prefs.frameInfo.blockMode = LZ4F_blockIndependent;
+	prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+	prefs.compressionLevel = compression_level;
+}
+
+twrpLz4Writer::~twrpLz4Writer() {
+	if (cctx)
+		LZ4F_freeCompressionContext(cctx);
+}
+
+bool twrpLz4Writer::Start() {
+	if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)))
+		return false;
+	out.resize(LZ4F_compressBound(STREAM_IO_SIZE, &prefs));
+	size_t ret = LZ4F_compressBegin(cctx, out.data(), out.size(), &prefs);
+	if (LZ4F_isError(ret)) {
+		LOGINFO("twrpLz4Writer: %s\n", LZ4F_getErrorName(ret));
+		return false;
+	}
+	return Output(out.data(), ret);
+}
+
+bool twrpLz4Writer::Set_Index(twrpTarIndex *tar_index) {
+	if (total_in > 0)
+		return false;
+	index = tar_index;
+	index->Add_Frame(0, 0);
+	return true;
+}
+
+bool twrpLz4Writer::Output(const void *buf, size_t size) {
+	if (!Write_Output(fd, buf, size))
+		return false;
+	total_out += size;
+	return true;
+}
+
+bool twrpLz4Writer::Next_Frame() {
+	size_t ret = LZ4F_compressEnd(cctx, out.data(), out.size(), NULL);
+	if (LZ4F_isError(ret) || !Output(out.data(), ret))
+		return false;
+	index->Add_Frame(total_in, total_out);
+	ret = LZ4F_compressBegin(cctx, out.data(), out.size(), &prefs);
+	if (LZ4F_isError(ret)) {
+		LOGINFO("twrpLz4Writer: %s\n", LZ4F_getErrorName(ret));
+		return false;
+	}
+	frame_in = 0;
+	return Output(out.data(), ret);
+}
+
+ssize_t twrpLz4Writer::Write(const void *buf, size_t size) {
+	const char* ptr = (const char*) buf;
+	size_t left = size;
+
+	if (failed || finished)
+		return -1;
+	while (left > 0) {
+		size_t len = left > STREAM_IO_SIZE ? STREAM_IO_SIZE : left;
+		if (index && len > TW_TAR_INDEX_FRAME - frame_in)
+			len = TW_TAR_INDEX_FRAME - frame_in;
+		uint64_t start = twrpThermal::Now_Usec();
+		size_t ret = LZ4F_compressUpdate(cctx, out.data(), out.size(), ptr, len, NULL);
+		twrpTarProgress::Add_Time(TW_TAR_TIME_COMPRESS, twrpThermal::Now_Usec() - start);
+		if (LZ4F_isError(ret)) {
+			LOGINFO("twrpLz4Writer: %s\n", LZ4F_getErrorName(ret));
+			failed = true;
+			return -1;
+		}
+		if (ret && !Output(out.data(), ret)) {
+			failed = true;
+			return -1;
+		}
+		ptr += len;
+		left -= len;
+		total_in += len;
+		frame_in += len;
+		if (index && frame_in == TW_TAR_INDEX_FRAME && !Next_Frame()) {
+			failed = true;
+			return -1;
+		}
+	}
+	if (index)
+		index->Add_Input(size);
+	return size;
+}
+
+int twrpLz4Writer::Finish() {
+	if (finished)
+		return failed ? -1 : 0;
+	finished = true;
+	if (failed)
+		return -1;
+	size_t ret = LZ4F_compressEnd(cctx, out.data(), out.size(), NULL);
+	if (LZ4F_isError(ret)) {
+		LOGINFO("twrpLz4Writer: %s\n", LZ4F_getErrorName(ret));
+		return -1;
+	}
+	return Output(out.data(), ret) ? 0 : -1;
+}
+
+twrpLz4Reader::twrpLz4Reader(int in_fd) {
+	fd = in_fd;
+	dctx = NULL;
+	in_pos = 0;
+	in_len = 0;
+	eof = false;
+	pending = 1;
+}
+
+twrpLz4Reader::~twrpLz4Reader() {
+	if (dctx)
+		LZ4F_freeDecompressionContext(dctx);
+}
+
+bool twrpLz4Reader::Start() {
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+		return false;
+	in.resize(STREAM_IO_SIZE);
+	return true;
+}
+
+ssize_t twrpLz4Reader::Read(void *buf, size_t size) {
+	size_t done = 0;
+
+	while (done < size) {
+		if (in_pos == in_len && !eof) {
+			ssize_t len = Read_Input(fd, in.data(), in.size());
+			if (len < 0)
+				return -1;
+			if (len == 0) {
+				eof = true;
+				continue;
+			}
+			in_len = len;
+			in_pos = 0;
+		}
+		if (in_pos == in_len && pending == 0)
+			break;
+		size_t dst_size = size - done;
+		size_t src_size = in_len - in_pos;
+		size_t ret = LZ4F_decompress(dctx, (char*) buf + done, &dst_size, in.data() + in_pos, &src_size, NULL);
+		if (LZ4F_isError(ret)) {
+			LOGINFO("twrpLz4Reader: %s\n", LZ4F_getErrorName(ret));
+			return -1;
+		}
+		in_pos += src_size;
+		done += dst_size;
+		pending = ret;
+		// Same as zstd, a frame still wanting input at the end was cut off
+		if (eof && pending != 0 && dst_size == 0) {
+			LOGINFO("twrpLz4Reader: unexpected end of stream\n");
+			return -1;
+		}
+	}
+	return done;
+}
+#endif // TW_INCLUDE_LZ4
+
+bool twrpCompress_Supported(Archive_Type type) {
+	switch (type) {
+		case COMPRESSED:
+			return true;
+#ifdef TW_INCLUDE_ZSTD
+		case COMPRESSED_ZSTD:
+			return true;
+#endif
+#ifdef TW_INCLUDE_LZ4
+		case COMPRESSED_LZ4:
+			return true;
+#endif
+		default:
+			return false;
+	}
+}
+
+twrpStreamWriter* twrpCompress_New_Writer(Archive_Type type, int fd, int level, unsigned threads, twrpStreamWriter *sink) {
+	// The sink is set before Start(), which may already write a stream header
+	if (type == COMPRESSED) {
+		twrpGzipWriter* gz = new twrpGzipWriter(fd, level ? level : Z_DEFAULT_COMPRESSION, threads);
+		gz->Set_Sink(sink);
+		if (gz->Start())
+			return gz;
+		gz->Set_Sink(NULL);
+		delete gz;
+#ifdef TW_INCLUDE_ZSTD
+	} else if (type == COMPRESSED_ZSTD) {
+		twrpZstdWriter* zs = new twrpZstdWriter(fd, level, threads);
+		zs->Set_Sink(sink);
+		if (zs->Start())
+			return zs;
+		zs->Set_Sink(NULL);
+		delete zs;
+#endif
+#ifdef TW_INCLUDE_LZ4
+	} else if (type == COMPRESSED_LZ4) {
+		twrpLz4Writer* lz = new twrpLz4Writer(fd, level);
+		lz->Set_Sink(sink);
+		if (lz->Start())
+			return lz;
+		lz->Set_Sink(NULL);
+		delete lz;
+#endif
+	} else {
+		LOGINFO("twrpCompress: archive type %i is not supported in this build\n", type);
+	}
+	return NULL;
+}
+
+twrpStreamReader* twrpCompress_New_Reader(Archive_Type type, int fd, twrpStreamReader *source) {
+	if (type == COMPRESSED) {
+		twrpGzipReader* gz = new twrpGzipReader(fd);
+		if (gz->Start()) {
+			gz->Set_Source(source);
+			return gz;
+		}
+		delete gz;
+#ifdef TW_INCLUDE_ZSTD
+	} else if (type == COMPRESSED_ZSTD) {
+		twrpZstdReader* zs = new twrpZstdReader(fd);
+		if (zs->Start()) {
+			zs->Set_Source(source);
+			return zs;
+		}
+		delete zs;
+#endif
+#ifdef TW_INCLUDE_LZ4
+	} else if (type == COMPRESSED_LZ4) {
+		twrpLz4Reader* lz = new twrpLz4Reader(fd);
+		if (lz->Start()) {
+			lz->Set_Source(source);
+			return lz;
+		}
+		delete lz;
+#endif
+	} else {
+		LOGINFO("twrpCompress: archive type %i is not supported in this build\n", type);
+	}
+	return NULL;
+}
+
+unsigned twrpCompress_Default_Threads() {
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores < 1)
+		return 1;
+	if (cores > MAX_COMPRESS_THREADS)
+		return MAX_COMPRESS_THREADS;
+	return (unsigned) cores;
+}
+
+bool twrpCompress_Attach_Writer(int fd, twrpStreamWriter *writer) {
+	pthread_mutex_lock(&registry_lock);
+	bool ret = writers.insert(std::make_pair(fd, writer)).second;
+	pthread_mutex_unlock(&registry_lock);
+	return ret;
+}
+
+bool twrpCompress_Attach_Reader(int fd, twrpStreamReader *reader) {
+	pthread_mutex_lock(&registry_lock);
+	bool ret = readers.insert(std::make_pair(fd, reader)).second;
+	pthread_mutex_unlock(&registry_lock);
+	return ret;
+}
+
+static twrpStreamWriter* Find_Writer(int fd, bool remove) {
+	twrpStreamWriter* writer = NULL;
+
+	pthread_mutex_lock(&registry_lock);
+	std::map<int, twrpStreamWriter*>::iterator it = writers.find(fd);
+	if (it != writers.end()) {
+		writer = it->second;
+		if (remove)
+			writers.erase(it);
+	}
+	pthread_mutex_unlock(&registry_lock);
+	return writer;
+}
+
+static twrpStreamReader* Find_Reader(int fd, bool remove) {
+	twrpStreamReader* reader = NULL;
+
+	pthread_mutex_lock(&registry_lock);
+	std::map<int, twrpStreamReader*>::iterator it = readers.find(fd);
+	if (it != readers.end()) {
+		reader = it->second;
+		if (remove)
+			readers.erase(it);
+	}
+	pthread_mutex_unlock(&registry_lock);
+	return reader;
+}
+
+ssize_t twrpCompress_Write(int fd, const void *buf, size_t size) {
+	twrpStreamWriter* writer = Find_Writer(fd, false);
+	if (writer == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	return writer->Write(buf, size);
+}
+
+int twrpCompress_Close_Writer(int fd) {
+	twrpStreamWriter* writer = Find_Writer(fd, true);
+	if (writer == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	int ret = writer->Close();
+	delete writer;
+	return ret;
+}
+
+ssize_t twrpCompress_Read(int fd, void *buf, size_t size) {
+	twrpStreamReader* reader = Find_Reader(fd, false);
+	if (reader == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	return reader->Read(buf, size);
+}
+
+int twrpCompress_Close_Reader(int fd) {
+	twrpStreamReader* reader = Find_Reader(fd, true);
+	if (reader == NULL) {
+		errno = EBADF;
+		return -1;
+	}
+	delete reader;
+	return close(fd);
+}
+
+bool twrpCompress_Attach_Digest(int fd, twrpDigest *digest) {
+	pthread_mutex_lock(&registry_lock);
+	bool ret = digests.insert(std::make_pair(fd, digest)).second;
+	pthread_mutex_unlock(&registry_lock);
+	return ret;
+}
+
+void twrpCompress_Detach_Digest(int fd, twrpDigest *digest) {
+	pthread_mutex_lock(&registry_lock);
+	std::map<int, twrpDigest*>::iterator it = digests.find(fd);
+	if (it != digests.end() && it->second == digest)
+		digests.erase(it);
+	pthread_mutex_unlock(&registry_lock);
+}
+
+void twrpCompress_Digest_Output(int fd, const void *buf, size_t size) {
+	pthread_mutex_lock(&registry_lock);
+	std::map<int, twrpDigest*>::iterator it = digests.find(fd);
+	twrpDigest* digest = it != digests.end() ? it->second : NULL;
+	pthread_mutex_unlock(&registry_lock);
+	// Only the thread writing fd updates its digest
+	if (digest) {
+		uint64_t start = twrpThermal::Now_Usec();
+		digest->update((const unsigned char*) buf, size);
+		twrpTarProgress::Add_Time(TW_TAR_TIME_DIGEST, twrpThermal::Now_Usec() - start);
+	}
+}
+
+int twrpCompress_Close_Output(int fd) {
+	pthread_mutex_lock(&registry_lock);
+	digests.erase(fd);
+	indexes.erase(fd);
+	pthread_mutex_unlock(&registry_lock);
+	return close(fd);
+}
+
+bool twrpCompress_Attach_Index(int fd, twrpTarIndex *index) {
+	twrpStreamWriter* writer = Find_Writer(fd, false);
+	if (writer)
+		return writer->Set_Index(index);
+	pthread_mutex_lock(&registry_lock);
+	bool ret = indexes.insert(std::make_pair(fd, index)).second;
+	pthread_mutex_unlock(&registry_lock);
+	return ret;
+}
+
+void twrpCompress_Detach_Index(int fd) {
+	pthread_mutex_lock(&registry_lock);
+	indexes.erase(fd);
+	pthread_mutex_unlock(&registry_lock);
+}
+
+void twrpCompress_Index_Input(int fd, size_t size) {
+	pthread_mutex_lock(&registry_lock);
+	std::map<int, twrpTarIndex*>::iterator it = indexes.find(fd);
+	twrpTarIndex* index = it != indexes.end() ? it->second : NULL;
+	pthread_mutex_unlock(&registry_lock);
+	if (index)
+		index->Add_Input(size);
+}
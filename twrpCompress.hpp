@@ -0,0 +1,287 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_COMPRESS_HPP
+#define __TWRP_COMPRESS_HPP
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <deque>
+#include <vector>
+#ifdef TW_INCLUDE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef TW_INCLUDE_LZ4
+#include <lz4frame.h>
+#endif
+#include "twrp-functions.hpp"
+#include "twrpDigest/twrpDigest.hpp"
+#include "twrpMemBudget.hpp"
+#include "twrpTarIndex.hpp"
+
+// In-process compression stages for tar archives. A stream is attached to
+// an already open fd and libtar is pointed at the twrpCompress_* hooks
+// through its tartype_t, so the data never leaves the tar process.
+
+// Base class for a compressing writer attached to an output fd
+class twrpStreamWriter {
+public:
+	twrpStreamWriter() { sink = NULL; }
+	virtual ~twrpStreamWriter() { delete sink; }
+	virtual ssize_t Write(const void *buf, size_t size) = 0;           // Queue uncompressed data, returns size or -1
+	virtual int Finish() = 0;                                          // Flush everything and write the stream trailer
+	virtual bool Set_Index(twrpTarIndex *index) { return false; }     // Write independent frames of TW_TAR_INDEX_FRAME bytes and list them in index
+	void Set_Sink(twrpStreamWriter *dst) { sink = dst; }               // Write output to dst instead of the fd, dst is freed with this writer
+	int Close();                                                       // Finish this writer, then its sink
+
+protected:
+	bool Write_Output(int fd, const void *buf, size_t size);
+
+private:
+	twrpStreamWriter* sink;
+};
+
+// Base class for a decompressing reader attached to an input fd
+class twrpStreamReader {
+public:
+	twrpStreamReader() { source = NULL; }
+	virtual ~twrpStreamReader() { delete source; }
+	virtual ssize_t Read(void *buf, size_t size) = 0;                  // Returns uncompressed bytes, 0 at end of stream or -1
+	void Set_Source(twrpStreamReader *src) { source = src; }           // Read input from src instead of the fd, src is freed with this reader
+
+protected:
+	ssize_t Read_Input(int fd, void *buf, size_t size);
+
+private:
+	twrpStreamReader* source;
+};
+
+// Block-parallel gzip writer. Input is cut into independent blocks that a
+// pool of threads deflates, so the output is a single gzip member that
+// gzip and pigz -d can read, the same way pigz does it. With an index the
+// stream is split into one member per frame.
+class twrpGzipWriter : public twrpStreamWriter {
+public:
+	twrpGzipWriter(int out_fd, int level, unsigned threads);
+	~twrpGzipWriter();
+	bool Start();
+	ssize_t Write(const void *buf, size_t size);
+	int Finish();
+	bool Set_Index(twrpTarIndex *tar_index);
+
+private:
+	struct Job {
+		unsigned long long seq;
+		unsigned long long offset;                                 // Uncompressed offset of the block
+		bool first;                                                // Starts a gzip member
+		bool last;                                                 // Ends a gzip member
+		bool done;
+		std::vector<unsigned char> in;
+		std::vector<unsigned char> dict;
+		std::vector<unsigned char> out;
+		uLong crc;
+		int error;
+	};
+
+	static void* Worker(void *cookie);
+	void Compress(Job *job);
+	bool Submit(bool last);                                            // Hand the current block to the workers
+	bool Drain(bool wait_all);                                         // Write finished blocks in order
+	bool Output(const void *buf, size_t size);
+
+	int fd;
+	int level;
+	unsigned thread_count;
+	twrpTarIndex* index;
+	std::vector<pthread_t> threads;
+	twrpMemGrant thread_grant;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	std::deque<Job*> queue;                                            // Jobs waiting for a worker
+	std::deque<Job*> in_flight;                                        // All submitted jobs in stream order
+	std::vector<unsigned char> block;                                  // Block being filled by Write()
+	std::vector<unsigned char> window;                                 // Tail of the previous block, used as dictionary
+	unsigned long long next_seq;
+	uLong crc;                                                         // Of the member being written
+	unsigned long long member_size;
+	unsigned long long total_in;
+	unsigned long long total_out;
+	unsigned long long submitted;                                      // Input handed to Submit()
+	unsigned long long member_submitted;
+	bool member_open;                                                  // Submit() has started a member that it has not ended
+	bool stopping;
+	bool failed;
+	bool finished;
+};
+
+// Streaming gzip reader. Concatenated gzip members are read back to back.
+class twrpGzipReader : public twrpStreamReader {
+public:
+	twrpGzipReader(int in_fd);
+	~twrpGzipReader();
+	bool Start();
+	ssize_t Read(void *buf, size_t size);
+
+private:
+	int fd;
+	z_stream strm;
+	std::vector<unsigned char> in;
+	bool initialized;
+	bool eof;
+	bool member_end;                                                   // inflate() ended a member and no other has begun
+};
+
+#ifdef TW_INCLUDE_ZSTD
+// zstd writer, the library's own worker threads compress in parallel
+class twrpZstdWriter : public twrpStreamWriter {
+public:
+	twrpZstdWriter(int out_fd, int level, unsigned threads);
+	~twrpZstdWriter();
+	bool Start();
+	ssize_t Write(const void *buf, size_t size);
+	int Finish();
+	bool Set_Index(twrpTarIndex *tar_index);
+
+private:
+	bool Compress(const void *buf, size_t size, ZSTD_EndDirective mode);
+
+	int fd;
+	int level;
+	unsigned thread_count;
+	twrpTarIndex* index;
+	unsigned long long total_in;
+	unsigned long long total_out;
+	size_t frame_in;                                                   // Input in the current frame
+	ZSTD_CCtx* cctx;
+	twrpMemGrant worker_grant;
+	std::vector<unsigned char> out;
+	bool failed;
+	bool finished;
+};
+
+class twrpZstdReader : public twrpStreamReader {
+public:
+	twrpZstdReader(int in_fd);
+	~twrpZstdReader();
+	bool Start();
+	ssize_t Read(void *buf, size_t size);
+
+private:
+	int fd;
+	ZSTD_DCtx* dctx;
+	std::vector<unsigned char> in;
+	ZSTD_inBuffer input;
+	bool eof;
+	size_t pending;                                                    // Last ZSTD_decompressStream() hint, 0 once a frame is complete
+};
+#endif
+
+#ifdef TW_INCLUDE_LZ4
+// lz4 frame writer with independent blocks, tuned for restore speed
+class twrpLz4Writer : public twrpStreamWriter {
+public:
+	twrpLz4Writer(int out_fd, int level);
+	~twrpLz4Writer();
+	bool Start();
+	ssize_t Write(const void *buf, size_t size);
+	int Finish();
+	bool Set_Index(twrpTarIndex *tar_index);
+
+private:
+	bool Output(const void *buf, size_t size);
+	bool Next_Frame();                                                 // Ends the current frame and begins another
+
+	int fd;
+	twrpTarIndex* index;
+	unsigned long long total_in;
+	unsigned long long total_out;
+	size_t frame_in;
+	LZ4F_compressionContext_t cctx;
+	LZ4F_preferences_t prefs;
+	std::vector<unsigned char> out;
+	bool failed;
+	bool finished;
+};
+
+class twrpLz4Reader : public twrpStreamReader {
+public:
+	twrpLz4Reader(int in_fd);
+	~twrpLz4Reader();
+	bool Start();
+	ssize_t Read(void *buf, size_t size);
+
+private:
+	int fd;
+	LZ4F_decompressionContext_t dctx;
+	std::vector<unsigned char> in;
+	size_t in_pos;
+	size_t in_len;
+	bool eof;
+	size_t pending;                                                    // Last LZ4F_decompress() hint, 0 once a frame is complete
+};
+#endif
+
+// Returns true if this build can write and read the archive type
+bool twrpCompress_Supported(Archive_Type type);
+
+// Create and start a stream for a compressed archive type, NULL on failure.
+// A level of 0 picks the codec default. With a sink the compressed output
+// is written to it instead of fd, the writer takes sink over only when it
+// is returned.
+twrpStreamWriter* twrpCompress_New_Writer(Archive_Type type, int fd, int level, unsigned threads, twrpStreamWriter *sink = NULL);
+// With a source the compressed input is read from it instead of fd. The
+// reader takes source over only when it is returned.
+twrpStreamReader* twrpCompress_New_Reader(Archive_Type type, int fd, twrpStreamReader *source = NULL);
+
+// Number of worker threads to use for compressing one archive
+unsigned twrpCompress_Default_Threads();
+
+// Attach a stream to an open fd. The fd stays owned by the caller for
+// writers. An attached reader takes the fd over, from then on only
+// twrpCompress_Close_Reader() closes it; the caller closes it only when
+// attaching failed.
+bool twrpCompress_Attach_Writer(int fd, twrpStreamWriter *writer);
+bool twrpCompress_Attach_Reader(int fd, twrpStreamReader *reader);
+
+// tartype_t hooks, the fd selects the attached stream
+ssize_t twrpCompress_Write(int fd, const void *buf, size_t size);
+int twrpCompress_Close_Writer(int fd);                                     // Finishes the stream, does not close fd
+ssize_t twrpCompress_Read(int fd, void *buf, size_t size);
+int twrpCompress_Close_Reader(int fd);                                     // Frees the stream and closes fd, leaves fd alone if no stream is attached
+
+// Digest an output file while it is written, so a backup does not have to
+// read it back. Everything the streams write to fd is added, other writers
+// pass their data to twrpCompress_Digest_Output(). The caller keeps
+// ownership of the digest and must detach it before fd is closed.
+bool twrpCompress_Attach_Digest(int fd, twrpDigest *digest);
+void twrpCompress_Detach_Digest(int fd, twrpDigest *digest);             // Only detaches digest if it is still attached to fd
+void twrpCompress_Digest_Output(int fd, const void *buf, size_t size);
+int twrpCompress_Close_Output(int fd);                                     // closefunc hook, detaches any digest and closes fd
+
+// Index the tar stream written to fd. A compressed stream must already be
+// attached and is switched to independent frames, the index has to stay
+// valid until the stream is closed. Uncompressed archives pass their data
+// to twrpCompress_Index_Input() and must detach the index before fd is
+// closed. The caller keeps ownership of the index.
+bool twrpCompress_Attach_Index(int fd, twrpTarIndex *index);
+void twrpCompress_Detach_Index(int fd);
+void twrpCompress_Index_Input(int fd, size_t size);
+
+#endif //__TWRP_COMPRESS_HPP
@@ -0,0 +1,306 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "twrpDelete.hpp"
+#include "twcommon.h"
+
+#define TW_DELETE_PROGRESS_MS 200
+
+static uint64_t Now_Ms() {
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+twrpDelete::twrpDelete() {
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work_cond, NULL);
+	queued = 0;
+	outstanding = 0;
+	removed = 0;
+	failures = 0;
+	root = NULL;
+	keep_root = false;
+	last_progress_ms = 0;
+}
+
+twrpDelete::~twrpDelete() {
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void twrpDelete::Set_Skip(std::function<bool(const std::string&)> Skip) {
+	skip = Skip;
+}
+
+void twrpDelete::Set_Progress(std::function<void(uint64_t)> Progress) {
+	progress = Progress;
+}
+
+void twrpDelete::Count(uint64_t items, bool failed) {
+	bool report = false;
+	uint64_t count;
+
+	pthread_mutex_lock(&lock);
+	removed += items;
+	if (failed)
+		failures++;
+	count = removed;
+	if (progress) {
+		uint64_t now = Now_Ms();
+		if (now - last_progress_ms >= TW_DELETE_PROGRESS_MS) {
+			last_progress_ms = now;
+			report = true;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	if (report)
+		progress(count);
+}
+
+void twrpDelete::Push(unsigned id, Folder *folder) {
+	pthread_mutex_lock(&queues[id]->lock);
+	queues[id]->tasks.push_back(folder);
+	pthread_mutex_unlock(&queues[id]->lock);
+	pthread_mutex_lock(&lock);
+	queued++;
+	outstanding++;
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+twrpDelete::Folder* twrpDelete::Next_Task(unsigned id) {
+	Folder* folder = NULL;
+	size_t i, n = queues.size();
+
+	for (;;) {
+		// The newest task of our own queue keeps the walk depth first,
+		// which keeps the queues short
+		pthread_mutex_lock(&queues[id]->lock);
+		if (!queues[id]->tasks.empty()) {
+			folder = queues[id]->tasks.back();
+			queues[id]->tasks.pop_back();
+		}
+		pthread_mutex_unlock(&queues[id]->lock);
+		// Others lose their oldest task, the one with the most below it
+		for (i = 1; folder == NULL && i < n; i++) {
+			Queue* victim = queues[(id + i) % n];
+			pthread_mutex_lock(&victim->lock);
+			if (!victim->tasks.empty()) {
+				folder = victim->tasks.front();
+				victim->tasks.pop_front();
+			}
+			pthread_mutex_unlock(&victim->lock);
+		}
+		pthread_mutex_lock(&lock);
+		if (folder != NULL) {
+			queued--;
+			pthread_mutex_unlock(&lock);
+			return folder;
+		}
+		while (queued == 0 && outstanding > 0)
+			pthread_cond_wait(&work_cond, &lock);
+		if (outstanding == 0) {
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void twrpDelete::Read_Folder(unsigned id, Folder *folder) {
+	uint64_t count = 0;
+	bool failed = false;
+
+	int fd = open(folder->path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	DIR* d = fd >= 0 ? fdopendir(fd) : NULL;
+	if (d == NULL) {
+		LOGINFO("Unable to open '%s': %s\n", folder->path.c_str(), strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		pthread_mutex_lock(&lock);
+		folder->kept = true;
+		pthread_mutex_unlock(&lock);
+		Count(0, true);
+		return;
+	}
+
+	struct dirent* de;
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		std::string item = folder->path + "/" + de->d_name;
+		if (skip && skip(item)) {
+			LOGINFO("skipped '%s'\n", item.c_str());
+			pthread_mutex_lock(&lock);
+			folder->kept = true;
+			pthread_mutex_unlock(&lock);
+			continue;
+		}
+		unsigned char type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+				type = DT_DIR;
+		}
+		if (type == DT_DIR) {
+			Folder* sub = new Folder;
+			sub->path = item;
+			sub->parent = folder;
+			sub->pending = 1;
+			sub->kept = false;
+			pthread_mutex_lock(&lock);
+			folder->pending++;
+			pthread_mutex_unlock(&lock);
+			Push(id, sub);
+		} else if (unlinkat(fd, de->d_name, 0) == 0) {
+			count++;
+		} else if (errno != ENOENT) {
+			LOGINFO("Unable to unlink '%s': %s\n", item.c_str(), strerror(errno));
+			pthread_mutex_lock(&lock);
+			folder->kept = true;
+			pthread_mutex_unlock(&lock);
+			failed = true;
+		}
+		// Count in batches so the lock is not taken for every file
+		if (count >= 256 || failed) {
+			Count(count, failed);
+			count = 0;
+			failed = false;
+		}
+	}
+	closedir(d);
+	if (count)
+		Count(count, false);
+}
+
+void twrpDelete::Done(Folder *folder) {
+	while (folder != NULL) {
+		pthread_mutex_lock(&lock);
+		bool last = --folder->pending == 0;
+		bool kept = folder->kept;
+		pthread_mutex_unlock(&lock);
+		if (!last)
+			return;
+
+		Folder* parent = folder->parent;
+		if (!kept && !(folder == root && keep_root)) {
+			if (rmdir(folder->path.c_str()) == 0) {
+				Count(1, false);
+			} else {
+				LOGINFO("Unable to remove '%s': %s\n", folder->path.c_str(), strerror(errno));
+				kept = true;
+				Count(0, true);
+			}
+		}
+		if (kept && parent != NULL) {
+			pthread_mutex_lock(&lock);
+			parent->kept = true;
+			pthread_mutex_unlock(&lock);
+		}
+		delete folder;
+		folder = parent;
+	}
+}
+
+void twrpDelete::Work(unsigned id) {
+	Folder* folder;
+
+	while ((folder = Next_Task(id)) != NULL) {
+		Read_Folder(id, folder);
+		Done(folder);
+		pthread_mutex_lock(&lock);
+		if (--outstanding == 0)
+			pthread_cond_broadcast(&work_cond);
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+void* twrpDelete::Worker(void *cookie) {
+	Worker_Arg* arg = (Worker_Arg*) cookie;
+
+	arg->del->Work(arg->id);
+	return NULL;
+}
+
+bool twrpDelete::Remove(const std::string& Path, bool Keep_Path, unsigned threads) {
+	std::vector<pthread_t> workers;
+	std::vector<Worker_Arg> args;
+	uint64_t start = Now_Ms();
+	unsigned i;
+
+	if (threads == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 1 ? (unsigned) cores : 1;
+	}
+	removed = 0;
+	failures = 0;
+	queued = 0;
+	outstanding = 0;
+	keep_root = Keep_Path;
+	root = new Folder;
+	root->path = Path;
+	while (root->path.size() > 1 && root->path[root->path.size() - 1] == '/')
+		root->path.erase(root->path.size() - 1);
+	root->parent = NULL;
+	root->pending = 1;
+	root->kept = false;
+
+	for (i = 0; i < threads; i++) {
+		Queue* queue = new Queue;
+		pthread_mutex_init(&queue->lock, NULL);
+		queues.push_back(queue);
+	}
+	Push(0, root);
+
+	args.resize(threads);
+	for (i = 0; i < threads; i++) {
+		args[i].del = this;
+		args[i].id = i;
+	}
+	for (i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Worker, &args[i]) != 0) {
+			LOGINFO("Unable to create delete thread %u, continuing with %u\n", i, i);
+			break;
+		}
+		workers.push_back(thread);
+	}
+	Work(0);
+	for (i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+
+	for (i = 0; i < queues.size(); i++) {
+		pthread_mutex_destroy(&queues[i]->lock);
+		delete queues[i];
+	}
+	queues.clear();
+	root = NULL;
+	if (progress)
+		progress(removed);
+	LOGINFO("Removed %llu items from '%s' with %zu threads in %llu ms, %llu failed\n", (unsigned long long) removed, Path.c_str(),
+		workers.size() + 1, (unsigned long long) (Now_Ms() - start), (unsigned long long) failures);
+	return failures == 0;
+}
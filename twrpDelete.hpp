@@ -0,0 +1,92 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_DELETE_HPP
+#define __TWRP_DELETE_HPP
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Removes folder trees on a pool of threads. Every folder is a task: a
+// worker opens it, unlinks its files with unlinkat() relative to the
+// folder fd and queues its subfolders as new tasks. The folder itself is
+// removed once the last of its subfolders is gone. Each worker takes the
+// newest task of its own queue and steals the oldest task of another
+// queue when its own runs dry, so the tree is shared without a walk ahead
+// of time.
+class twrpDelete {
+public:
+	twrpDelete();
+	~twrpDelete();
+	// Called with the full path of every item, true keeps the item and
+	// the folders above it
+	void Set_Skip(std::function<bool(const std::string&)> Skip);
+	// Called with the number of items removed so far, from any worker and
+	// at most every 200 ms
+	void Set_Progress(std::function<void(uint64_t)> Progress);
+	// Removes everything below Path, and Path itself unless Keep_Path.
+	// threads 0 picks one per core. False if an item could not be removed,
+	// the rest is removed anyway.
+	bool Remove(const std::string& Path, bool Keep_Path, unsigned threads = 0);
+	uint64_t Removed_Count() { return removed; }
+
+private:
+	struct Folder {
+		std::string path;
+		Folder* parent;
+		unsigned pending;                                                  // Subfolders not removed yet, plus one until the folder is read
+		bool kept;                                                         // Something below was skipped or failed, so the folder stays
+	};
+
+	struct Queue {
+		std::deque<Folder*> tasks;
+		pthread_mutex_t lock;
+	};
+
+	struct Worker_Arg {
+		twrpDelete* del;
+		unsigned id;
+	};
+
+	static void* Worker(void *cookie);
+	void Work(unsigned id);
+	Folder* Next_Task(unsigned id);
+	void Push(unsigned id, Folder *folder);
+	void Read_Folder(unsigned id, Folder *folder);
+	void Done(Folder *folder);
+	void Count(uint64_t items, bool failed);
+
+	std::function<bool(const std::string&)> skip;
+	std::function<void(uint64_t)> progress;
+	std::vector<Queue*> queues;
+	pthread_mutex_t lock;                                                  // Guards the counters and the pending counts of the folders
+	pthread_cond_t work_cond;
+	uint64_t queued;                                                       // Tasks waiting in the queues
+	uint64_t outstanding;                                                  // Tasks queued or being read
+	uint64_t removed;
+	uint64_t failures;
+	Folder* root;
+	bool keep_root;
+	uint64_t last_progress_ms;
+};
+
+#endif // __TWRP_DELETE_HPP
@@ -1,4 +1,20 @@
 LOCAL_PATH:= $(call my-dir)
+
+# SHA256 hardware kernels need instruction set flags that the rest of the
+# library must not be built with, they check the CPU before they are used
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libtwrpdigest_sha256_hw
+LOCAL_MODULE_TAGS := optional
+LOCAL_SRC_FILES = \
+        digest/sha256/sha256_armv8.c \
+        digest/sha256/sha256_x86.c
+LOCAL_CFLAGS_arm64 := -march=armv8-a+crypto
+LOCAL_CFLAGS_x86 := -msse4.1 -msha
+LOCAL_CFLAGS_x86_64 := -msse4.1 -msha
+
+include $(BUILD_STATIC_LIBRARY)
+
 include $(CLEAR_VARS)
 
 LOCAL_MODULE := libtwrpdigest
@@ -9,7 +25,9 @@ LOCAL_C_INCLUDES := external/openssl/include bionic
 LOCAL_SRC_FILES = \
         twrpDigest.cpp \
         twrpMD5.cpp \
-        digest/md5/md5.c
+        twrpXXH64.cpp \
+        digest/md5/md5.c \
+        digest/xxh64/xxh64.c
 
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
         LOCAL_C_INCLUDES += external/stlport/stlport
@@ -22,8 +40,24 @@ ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
 else
         LOCAL_SHARED_LIBRARIES += libc++ libcrypto
 	LOCAL_SRC_FILES += \
-        	twrpSHA.cpp
+        	twrpSHA.cpp \
+        	digest/sha256/sha256.c
+	LOCAL_WHOLE_STATIC_LIBRARIES += libtwrpdigest_sha256_hw
 endif
 
 
 include $(BUILD_SHARED_LIBRARY)
+
+ifneq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
+# Digest speed on the device, not installed in the recovery image
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := twrpdigestbench
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS = -fno-strict-aliasing
+LOCAL_C_INCLUDES := external/openssl/include bionic
+LOCAL_SRC_FILES = twrpDigestBench.cpp
+LOCAL_SHARED_LIBRARIES += libc libc++ libcrypto libtwrpdigest
+
+include $(BUILD_EXECUTABLE)
+endif
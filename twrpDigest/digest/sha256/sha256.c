@@ -0,0 +1,170 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * SHA-256 (FIPS 180-4) with the block function picked at run time. The
+ * portable kernel is always available, the ARMv8 Crypto Extension and x86
+ * SHA-NI kernels are used when the CPU has them.
+ */
+
+#include <pthread.h>
+#include <string.h>
+
+#include "sha256.h"
+
+const uint32_t SHA256RoundK[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t H0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+#define ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x)		(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define S1(x)		(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define s0(x)		(ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define s1(x)		(ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static void sha256_blocks_c(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+	uint32_t W[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	while (blocks--) {
+		for (i = 0; i < 16; i++)
+			W[i] = (uint32_t) data[i * 4] << 24 | (uint32_t) data[i * 4 + 1] << 16 |
+			       (uint32_t) data[i * 4 + 2] << 8 | data[i * 4 + 3];
+		for (i = 16; i < 64; i++)
+			W[i] = s1(W[i - 2]) + W[i - 7] + s0(W[i - 15]) + W[i - 16];
+
+		a = state[0]; b = state[1]; c = state[2]; d = state[3];
+		e = state[4]; f = state[5]; g = state[6]; h = state[7];
+		for (i = 0; i < 64; i++) {
+			t1 = h + S1(e) + CH(e, f, g) + SHA256RoundK[i] + W[i];
+			t2 = S0(a) + MAJ(a, b, c);
+			h = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+		state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+		data += SHA256BLOCK;
+	}
+}
+
+static struct SHA256Kernel kernels[3];
+static unsigned kernel_count;
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void add_kernel(const char *name, SHA256BlockFn blocks)
+{
+	if (blocks) {
+		kernels[kernel_count].name = name;
+		kernels[kernel_count].blocks = blocks;
+		kernel_count++;
+	}
+}
+
+static void detect_kernels(void)
+{
+	add_kernel("armv8-ce", SHA256ARMv8Kernel());
+	add_kernel("sha-ni", SHA256SHANIKernel());
+	add_kernel("c", sha256_blocks_c);
+}
+
+const struct SHA256Kernel *SHA256GetKernel(unsigned index)
+{
+	pthread_once(&kernels_once, detect_kernels);
+	return index < kernel_count ? &kernels[index] : NULL;
+}
+
+void SHA256InitKernel(struct SHA256Context *ctx, const struct SHA256Kernel *kernel)
+{
+	memcpy(ctx->state, H0, sizeof(H0));
+	ctx->bytes = 0;
+	ctx->used = 0;
+	ctx->blocks = kernel->blocks;
+}
+
+void SHA256Init(struct SHA256Context *ctx)
+{
+	SHA256InitKernel(ctx, SHA256GetKernel(0));
+}
+
+void SHA256Update(struct SHA256Context *ctx, const unsigned char *buf, size_t len)
+{
+	size_t n;
+
+	ctx->bytes += len;
+	if (ctx->used) {
+		n = SHA256BLOCK - ctx->used;
+		if (n > len)
+			n = len;
+		memcpy(ctx->in + ctx->used, buf, n);
+		ctx->used += n;
+		buf += n;
+		len -= n;
+		if (ctx->used < SHA256BLOCK)
+			return;
+		ctx->blocks(ctx->state, ctx->in, 1);
+		ctx->used = 0;
+	}
+	/* Whole blocks are hashed straight from the caller's buffer */
+	n = len / SHA256BLOCK;
+	if (n) {
+		ctx->blocks(ctx->state, buf, n);
+		buf += n * SHA256BLOCK;
+		len -= n * SHA256BLOCK;
+	}
+	memcpy(ctx->in, buf, len);
+	ctx->used = len;
+}
+
+void SHA256Final(unsigned char digest[SHA256LENGTH], struct SHA256Context *ctx)
+{
+	uint64_t bits = ctx->bytes * 8;
+	int i;
+
+	ctx->in[ctx->used++] = 0x80;
+	if (ctx->used > SHA256BLOCK - 8) {
+		memset(ctx->in + ctx->used, 0, SHA256BLOCK - ctx->used);
+		ctx->blocks(ctx->state, ctx->in, 1);
+		ctx->used = 0;
+	}
+	memset(ctx->in + ctx->used, 0, SHA256BLOCK - 8 - ctx->used);
+	for (i = 0; i < 8; i++)
+		ctx->in[SHA256BLOCK - 1 - i] = (unsigned char) (bits >> (i * 8));
+	ctx->blocks(ctx->state, ctx->in, 1);
+
+	for (i = 0; i < 8; i++) {
+		digest[i * 4] = (unsigned char) (ctx->state[i] >> 24);
+		digest[i * 4 + 1] = (unsigned char) (ctx->state[i] >> 16);
+		digest[i * 4 + 2] = (unsigned char) (ctx->state[i] >> 8);
+		digest[i * 4 + 3] = (unsigned char) ctx->state[i];
+	}
+	memset(ctx, 0, sizeof(*ctx));
+}
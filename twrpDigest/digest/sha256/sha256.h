@@ -0,0 +1,68 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256LENGTH 32
+#define SHA256BLOCK 64
+
+/*
+ * Compresses a number of 64 byte blocks of data into state. Every kernel
+ * gives the same result, they only differ in the instructions they use.
+ */
+typedef void (*SHA256BlockFn)(uint32_t state[8], const unsigned char *data, size_t blocks);
+
+struct SHA256Kernel {
+	const char *name;
+	SHA256BlockFn blocks;
+};
+
+struct SHA256Context {
+	uint32_t state[8];
+	uint64_t bytes;
+	unsigned char in[SHA256BLOCK];
+	size_t used;
+	SHA256BlockFn blocks;
+};
+
+/*
+ * Kernels this CPU can run, from the fastest. Index 0 is the one that
+ * SHA256Init() picks, NULL is returned past the last one.
+ */
+const struct SHA256Kernel *SHA256GetKernel(unsigned index);
+
+void SHA256Init(struct SHA256Context *context);
+void SHA256InitKernel(struct SHA256Context *context, const struct SHA256Kernel *kernel);
+void SHA256Update(struct SHA256Context *context, const unsigned char *buf, size_t len);
+void SHA256Final(unsigned char digest[SHA256LENGTH], struct SHA256Context *context);
+
+/* Round constants, shared with the hardware kernels */
+extern const uint32_t SHA256RoundK[64];
+
+/*
+ * Hardware kernels, each returns NULL if it was not built for this
+ * architecture or the CPU does not have the instructions
+ */
+SHA256BlockFn SHA256ARMv8Kernel(void);
+SHA256BlockFn SHA256SHANIKernel(void);
+
+#endif /* !SHA256_H */
@@ -0,0 +1,84 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * SHA-256 block function for ARMv8 CPUs with the Crypto Extension. This
+ * file is built with -march=armv8-a+crypto, nothing in it runs unless the
+ * kernel reports the SHA2 instructions in AT_HWCAP.
+ */
+
+#include "sha256.h"
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO)
+
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+
+static void sha256_blocks_armv8(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+	uint32x4_t STATE0, STATE1, ABCD_SAVE, EFGH_SAVE, MSG, TMP, W[4];
+	int i;
+
+	STATE0 = vld1q_u32(&state[0]);
+	STATE1 = vld1q_u32(&state[4]);
+
+	while (blocks--) {
+		ABCD_SAVE = STATE0;
+		EFGH_SAVE = STATE1;
+
+		/* Four rounds per step, W holds the last 16 message words */
+		for (i = 0; i < 16; i++) {
+			if (i < 4)
+				W[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + i * 16)));
+			else
+				W[i & 3] = vsha256su1q_u32(vsha256su0q_u32(W[i & 3], W[(i + 1) & 3]),
+							   W[(i + 2) & 3], W[(i + 3) & 3]);
+			MSG = vaddq_u32(W[i & 3], vld1q_u32(&SHA256RoundK[i * 4]));
+			TMP = STATE0;
+			STATE0 = vsha256hq_u32(STATE0, STATE1, MSG);
+			STATE1 = vsha256h2q_u32(STATE1, TMP, MSG);
+		}
+
+		STATE0 = vaddq_u32(STATE0, ABCD_SAVE);
+		STATE1 = vaddq_u32(STATE1, EFGH_SAVE);
+		data += SHA256BLOCK;
+	}
+
+	vst1q_u32(&state[0], STATE0);
+	vst1q_u32(&state[4], STATE1);
+}
+
+SHA256BlockFn SHA256ARMv8Kernel(void)
+{
+	if (!(getauxval(AT_HWCAP) & HWCAP_SHA2))
+		return NULL;
+	return sha256_blocks_armv8;
+}
+
+#else
+
+SHA256BlockFn SHA256ARMv8Kernel(void)
+{
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,95 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * SHA-256 block function for x86 CPUs with the SHA extensions. This file is
+ * built with -msha -msse4.1, nothing in it runs unless CPUID reports them.
+ */
+
+#include "sha256.h"
+
+#if (defined(__i386__) || defined(__x86_64__)) && defined(__SHA__) && defined(__SSE4_1__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+static void sha256_blocks_shani(uint32_t state[8], const unsigned char *data, size_t blocks)
+{
+	const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i STATE0, STATE1, ABEF_SAVE, CDGH_SAVE, MSG, TMP, W[4];
+	int i;
+
+	/* The SHA instructions keep the state as ABEF and CDGH */
+	TMP = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1);
+	STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B);
+	STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);
+	STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);
+
+	while (blocks--) {
+		ABEF_SAVE = STATE0;
+		CDGH_SAVE = STATE1;
+
+		/* Four rounds per step, W holds the last 16 message words */
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				W[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + i * 16)), MASK);
+			} else {
+				TMP = _mm_add_epi32(_mm_sha256msg1_epu32(W[i & 3], W[(i + 1) & 3]),
+						    _mm_alignr_epi8(W[(i + 3) & 3], W[(i + 2) & 3], 4));
+				W[i & 3] = _mm_sha256msg2_epu32(TMP, W[(i + 3) & 3]);
+			}
+			MSG = _mm_add_epi32(W[i & 3], _mm_loadu_si128((const __m128i *) &SHA256RoundK[i * 4]));
+			STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+			STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, _mm_shuffle_epi32(MSG, 0x0E));
+		}
+
+		STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+		STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+		data += SHA256BLOCK;
+	}
+
+	TMP = _mm_shuffle_epi32(STATE0, 0x1B);
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);
+	_mm_storeu_si128((__m128i *) &state[0], _mm_blend_epi16(TMP, STATE1, 0xF0));
+	_mm_storeu_si128((__m128i *) &state[4], _mm_alignr_epi8(STATE1, TMP, 8));
+}
+
+SHA256BlockFn SHA256SHANIKernel(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return NULL;
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return NULL;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return NULL;
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	if (!(ebx & (1 << 29)))		/* SHA */
+		return NULL;
+	return sha256_blocks_shani;
+}
+
+#else
+
+SHA256BlockFn SHA256SHANIKernel(void)
+{
+	return NULL;
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "xxh64.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+	return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+		((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static inline uint32_t read32(const unsigned char *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val) {
+	acc ^= round64(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* Consumes whole 32 byte stripes, returns the bytes used */
+static size_t stripes(uint64_t v[4], const unsigned char *p, size_t len) {
+	const unsigned char *start = p;
+	uint64_t v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+
+	while (len >= XXH64STRIPE) {
+		v1 = round64(v1, read64(p));
+		v2 = round64(v2, read64(p + 8));
+		v3 = round64(v3, read64(p + 16));
+		v4 = round64(v4, read64(p + 24));
+		p += XXH64STRIPE;
+		len -= XXH64STRIPE;
+	}
+	v[0] = v1;
+	v[1] = v2;
+	v[2] = v3;
+	v[3] = v4;
+	return p - start;
+}
+
+void XXH64Init(struct XXH64Context *context, uint64_t seed) {
+	memset(context, 0, sizeof(*context));
+	context->v[0] = seed + PRIME64_1 + PRIME64_2;
+	context->v[1] = seed + PRIME64_2;
+	context->v[2] = seed;
+	context->v[3] = seed - PRIME64_1;
+}
+
+void XXH64Update(struct XXH64Context *context, const unsigned char *buf, size_t len) {
+	context->total_len += len;
+
+	if (context->memsize + len < XXH64STRIPE) {
+		memcpy(context->mem + context->memsize, buf, len);
+		context->memsize += len;
+		return;
+	}
+	if (context->memsize) {
+		size_t fill = XXH64STRIPE - context->memsize;
+
+		memcpy(context->mem + context->memsize, buf, fill);
+		stripes(context->v, context->mem, XXH64STRIPE);
+		buf += fill;
+		len -= fill;
+		context->memsize = 0;
+	}
+	size_t used = stripes(context->v, buf, len);
+	buf += used;
+	len -= used;
+	memcpy(context->mem, buf, len);
+	context->memsize = len;
+}
+
+void XXH64Final(unsigned char digest[XXH64LENGTH], struct XXH64Context *context) {
+	const unsigned char *p = context->mem;
+	size_t len = context->memsize;
+	uint64_t h;
+	int i;
+
+	if (context->total_len >= XXH64STRIPE) {
+		const uint64_t *v = context->v;
+
+		h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+		for (i = 0; i < 4; i++)
+			h = merge64(h, v[i]);
+	} else {
+		/* v[2] still holds the seed */
+		h = context->v[2] + PRIME64_5;
+	}
+	h += context->total_len;
+
+	while (len >= 8) {
+		h ^= round64(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+		p += 8;
+		len -= 8;
+	}
+	if (len >= 4) {
+		h ^= (uint64_t) read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+		len -= 4;
+	}
+	while (len > 0) {
+		h ^= (*p) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+		p++;
+		len--;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+
+	for (i = 0; i < XXH64LENGTH; i++)
+		digest[i] = (unsigned char) (h >> (56 - 8 * i));
+}
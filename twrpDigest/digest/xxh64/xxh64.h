@@ -0,0 +1,44 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef XXH64_H
+#define XXH64_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define XXH64LENGTH 8
+#define XXH64STRIPE 32
+
+/*
+ * 64 bit xxHash, a non-cryptographic checksum that runs at memory speed.
+ * It only guards a transfer against corruption, not against tampering.
+ */
+struct XXH64Context {
+	uint64_t v[4];
+	uint64_t total_len;
+	unsigned char mem[XXH64STRIPE];
+	size_t memsize;
+};
+
+void XXH64Init(struct XXH64Context *context, uint64_t seed);
+void XXH64Update(struct XXH64Context *context, const unsigned char *buf, size_t len);
+/* Big endian, the byte order xxhsum prints */
+void XXH64Final(unsigned char digest[XXH64LENGTH], struct XXH64Context *context);
+
+#endif /* XXH64_H */
@@ -0,0 +1,95 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Reports how fast each digest and SHA256 kernel runs on this device:
+//   twrpdigestbench [size in MB]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <openssl/sha.h>
+#include "twrpDigest.hpp"
+#include "twrpMD5.hpp"
+#include "twrpSHA.hpp"
+#include "twrpXXH64.hpp"
+
+#define BENCH_UPDATE_SIZE (1024 * 1024)                 // Same size as the backup writes
+
+// Only used to compare the built in kernels with the library one
+class libcryptoSHA256: public twrpDigest {
+public:
+	libcryptoSHA256() { init(); }
+	void init() { SHA256_Init(&ctx); }
+	void update(const unsigned char* stream, size_t len) { SHA256_Update(&ctx, stream, len); }
+	std::string return_digest_string() { finalize(); return hexify(store, SHA256_DIGEST_LENGTH); }
+
+protected:
+	void finalize() { SHA256_Final(store, &ctx); }
+
+private:
+	uint8_t store[SHA256_DIGEST_LENGTH];
+	SHA256_CTX ctx;
+};
+
+static double Now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static void Run(const char* algorithm, const char* kernel, twrpDigest* digest, const std::vector<unsigned char>& data) {
+	double start = Now();
+	for (size_t pos = 0; pos < data.size(); pos += BENCH_UPDATE_SIZE) {
+		size_t len = data.size() - pos < BENCH_UPDATE_SIZE ? data.size() - pos : BENCH_UPDATE_SIZE;
+		digest->update(&data[pos], len);
+	}
+	std::string result = digest->return_digest_string();
+	double secs = Now() - start;
+	printf("%-8s %-10s %8.1f MB/s  %s\n", algorithm, kernel, secs > 0 ? data.size() / 1048576.0 / secs : 0.0, result.c_str());
+	delete digest;
+}
+
+int main(int argc, char** argv) {
+	size_t size_mb = 256;
+	const struct SHA256Kernel* kernel;
+	unsigned i;
+
+	if (argc > 1)
+		size_mb = strtoul(argv[1], NULL, 10);
+	if (size_mb == 0) {
+		printf("Usage: %s [size in MB]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<unsigned char> data(size_mb * 1048576);
+	srand(1);
+	for (i = 0; i < data.size(); i++)
+		data[i] = (unsigned char) rand();
+
+	printf("Hashing %zu MB per run, digests of the same data must match\n", size_mb);
+	Run("md5", "c", new twrpMD5(), data);
+	Run("xxh64", "c", new twrpXXH64(), data);
+	for (i = 0; (kernel = SHA256GetKernel(i)) != NULL; i++)
+		Run("sha256", kernel->name, new twrpSHA256(kernel), data);
+	Run("sha256", "libcrypto", new libcryptoSHA256(), data);
+	Run("sha512", "libcrypto", new twrpSHA512(), data);
+	return 0;
+}
@@ -25,24 +25,30 @@
 #include "twrpSHA.hpp"
 
 twrpSHA256::twrpSHA256() {
+	sha256_kernel = SHA256GetKernel(0);
+	twrpSHA256::init();
+}
+
+twrpSHA256::twrpSHA256(const struct SHA256Kernel* kernel) {
+	sha256_kernel = kernel;
 	twrpSHA256::init();
 }
 
 void twrpSHA256::init(void) {
-	SHA256_Init(&sha256_ctx);
+	SHA256InitKernel(&sha256_ctx, sha256_kernel);
 }
 
 void twrpSHA256::update(const unsigned char* stream, size_t len) {
-	SHA256_Update(&sha256_ctx, stream, len);
+	SHA256Update(&sha256_ctx, stream, len);
 }
 
 void twrpSHA256::finalize(void) {
-	SHA256_Final(sha256_store, &sha256_ctx);
+	SHA256Final(sha256_store, &sha256_ctx);
 }
 
 std::string twrpSHA256::return_digest_string(void) {
 	twrpSHA256::finalize();
-	std::string digest_str = twrpDigest::hexify(sha256_store, SHA256_DIGEST_LENGTH);
+	std::string digest_str = twrpDigest::hexify(sha256_store, SHA256LENGTH);
 	return digest_str;
 }
 
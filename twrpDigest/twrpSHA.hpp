@@ -21,9 +21,14 @@
 #include <openssl/sha.h>
 #include "twrpDigest.hpp"
 
+extern "C" {
+	#include "digest/sha256/sha256.h"
+}
+
 class twrpSHA256: public twrpDigest {
 public:
 	twrpSHA256();                                            // Initialize the SHA256 digest for streaming activities only
+	twrpSHA256(const struct SHA256Kernel* kernel);           // Use a specific block function instead of the fastest one
 	void init();                                             // Initialize the SHA256 digest algorithm
 
 protected:
@@ -32,8 +37,9 @@ protected:
 	std::string return_digest_string();                      // Return the digest string computed to the callee
 
 private:
-	uint8_t sha256_store[SHA256_DIGEST_LENGTH];              // Initialize the SHA256 digest array that holds the computation
-	SHA256_CTX sha256_ctx;                                   // Initialize the SHA256 control structure
+	uint8_t sha256_store[SHA256LENGTH];                      // Initialize the SHA256 digest array that holds the computation
+	struct SHA256Context sha256_ctx;                         // Initialize the SHA256 control structure
+	const struct SHA256Kernel* sha256_kernel;                // Block function, picked from the CPU features
 };
 
 class twrpSHA512: public twrpDigest {
@@ -0,0 +1,42 @@
+/*
+	Copyright 2012 to 2017 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string>
+#include "twrpDigest.hpp"
+#include "twrpXXH64.hpp"
+
+twrpXXH64::twrpXXH64() {
+	init();
+}
+
+void twrpXXH64::init() {
+	XXH64Init(&xxh64c, 0);
+}
+
+void twrpXXH64::update(const unsigned char* stream, size_t len) {
+	XXH64Update(&xxh64c, stream, len);
+}
+
+void twrpXXH64::finalize() {
+	XXH64Final(xxh64sum, &xxh64c);
+}
+
+std::string twrpXXH64::return_digest_string() {
+	finalize();
+	return hexify(xxh64sum, sizeof(xxh64sum));
+}
@@ -0,0 +1,43 @@
+/*
+        Copyright 2012 to 2017 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRPXXH64_H
+#define __TWRPXXH64_H
+
+#include <string>
+#include "twrpDigest.hpp"
+
+extern "C" {
+	#include "digest/xxh64/xxh64.h"
+}
+
+// Checksum of adb backup streams, much faster than MD5 but not cryptographic
+class twrpXXH64: public twrpDigest {
+public:
+	twrpXXH64();                                                          // Stream initializer
+	void init();                                                          // Initialize XXH64 structures
+	void update(const unsigned char* stream, size_t len);                 // Update XXH64 stream with data
+	std::string return_digest_string();                                   // Return XXH64 digest as string to callee
+	void finalize();                                                      // Finalize and compute XXH64
+
+private:
+	struct XXH64Context xxh64c;                                           // XXH64 control structure
+	unsigned char xxh64sum[XXH64LENGTH];                                  // Stores the XXH64 computation
+};
+
+#endif //__TWRPXXH64_H
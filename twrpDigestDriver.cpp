@@ -17,13 +17,19 @@
 */
 
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 #include <string>
+#include <vector>
 #include <unistd.h>
+#include <sys/stat.h>
 #include "data.hpp"
 #include "partitions.hpp"
 #include "set_metadata.h"
 #include "twrpDigestDriver.hpp"
+#include "twrpThermal.hpp"
 #include "twrp-functions.hpp"
 #include "twcommon.h"
 #include "variables.h"
@@ -32,8 +38,70 @@
 #include "twrpDigest/twrpMD5.hpp"
 #include "twrpDigest/twrpSHA.hpp"
 
+#define DIGEST_READ_SIZE (1024 * 1024)
+#define MAX_DIGEST_THREADS 8
 
-bool twrpDigestDriver::Check_Restore_File_Digest(const string& Filename) {
+// All checks share one read rate, parallel checks and checks made while a
+// restore is running together stay under tw_digest_rate
+static pthread_mutex_t rate_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t rate_next_ns;                           // Time the next read may start
+
+static uint64_t Now_Ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void Throttle_Read(size_t bytes, unsigned Rate) {
+	uint64_t now, start;
+
+	if (Rate == 0)
+		return;
+	now = Now_Ns();
+	pthread_mutex_lock(&rate_lock);
+	if (rate_next_ns < now)
+		rate_next_ns = now;
+	start = rate_next_ns;
+	rate_next_ns += (uint64_t) bytes * 1000000000ULL / ((uint64_t) Rate * 1048576ULL);
+	pthread_mutex_unlock(&rate_lock);
+	if (start > now)
+		usleep((start - now) / 1000);
+}
+
+static unsigned Get_Digest_Rate() {
+	int rate = 0;
+
+	DataManager::GetValue(TW_DIGEST_RATE_VAR, rate);
+	return rate > 0 ? (unsigned) rate : 0;
+}
+
+#define WHOLE_FILE ((size_t) -1)
+
+struct Digest_Check_File {
+	string Filename;
+	twrpDigestTreeIndex Tree;
+	bool use_tree;                                          // Checked chunk by chunk against its tree digest
+	int fd;
+	int result;
+	uint64_t bad_start;                                     // Bytes of the first bad chunk found
+	uint64_t bad_end;
+};
+
+struct Digest_Check_Item {
+	size_t file;
+	size_t chunk;                                           // WHOLE_FILE if the file has no tree digest
+};
+
+struct Digest_Check_Job {
+	std::vector<Digest_Check_File>* Files;
+	std::vector<Digest_Check_Item> Items;
+	size_t next;
+	bool failed;
+	unsigned rate;
+	pthread_mutex_t lock;
+};
+
+twrpDigestDriver::Check_Result twrpDigestDriver::Verify_File(const string& Filename, unsigned Rate) {
 	twrpDigest *digest;
 	string digestfile = Filename, file_name = Filename;
 	string digest_str;
@@ -58,161 +126,358 @@ bool twrpDigestDriver::Check_Restore_File_Digest(const string& Filename) {
 #endif
 
 	if (!TWFunc::Path_Exists(digestfile)) {
-		gui_msg(Msg(msg::kError, "no_digest_found=No digest file found for '{1}'. Please unselect Enable Digest verification to restore.")(Filename));
 		delete digest;
-		return false;
+		return CHECK_NO_DIGEST;
 	}
 
-
-	if (TWFunc::read_file(digestfile, digest_str) != 0) {
-		gui_msg("digest_error=Digest Error!");
+	if (TWFunc::read_file(digestfile, digest_str) != 0 || !Stream_File(file_name, digest, Rate)) {
 		delete digest;
-		return false;
+		return CHECK_READ_ERROR;
 	}
+	string digest_check = digest->return_digest_string();
+	delete digest;
+	if (digest_check != digest_str)
+		return CHECK_MISMATCH;
+	if (use_sha2)
+		LOGINFO("SHA2 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Filename).c_str());
+	else
+		LOGINFO("MD5 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Filename).c_str());
+	return CHECK_MATCH;
+}
 
-	if (!stream_file_to_digest(file_name, digest)) {
-		delete digest;
-		return false;
+twrpDigestDriver::Check_Result twrpDigestDriver::Verify_Chunk(const Digest_Check_File& File, size_t Chunk, std::vector<unsigned char>* Buf, unsigned Rate) {
+	uint64_t offset = (uint64_t) Chunk * File.Tree.chunk_size;
+	bool read_error;
+
+	if (Buf->size() < File.Tree.chunk_size)
+		Buf->resize(File.Tree.chunk_size);
+	Throttle_Read(File.Tree.file_size - offset < File.Tree.chunk_size ? File.Tree.file_size - offset : File.Tree.chunk_size, Rate);
+	if (twrpDigestTree_Check_Chunk(File.fd, File.Tree, Chunk, &(*Buf)[0], &read_error))
+		return CHECK_MATCH;
+	return read_error ? CHECK_READ_ERROR : CHECK_MISMATCH;
+}
+
+bool twrpDigestDriver::Report_Check(const Digest_Check_File& File) {
+	switch (File.result) {
+		case CHECK_MATCH:
+			return true;
+		case CHECK_NO_DIGEST:
+			gui_msg(Msg(msg::kError, "no_digest_found=No digest file found for '{1}'. Please unselect Enable Digest verification to restore.")(File.Filename));
+			break;
+		case CHECK_READ_ERROR:
+			gui_msg("digest_error=Digest Error!");
+			break;
+		case CHECK_MISMATCH:
+			if (File.bad_end > File.bad_start)
+				gui_msg(Msg(msg::kError, "digest_tree_bad=Digest failed to match on '{1}' at bytes {2} to {3}.")(File.Filename)(File.bad_start)(File.bad_end));
+			else
+				gui_msg(Msg(msg::kError, "digest_fail_match=Digest failed to match on '{1}'.")(File.Filename));
+			break;
 	}
-	string digest_check = digest->return_digest_string();
-	if (digest_check == digest_str) {
-		if (use_sha2)
-			LOGINFO("SHA2 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Filename).c_str());
+	return false;
+}
+
+bool twrpDigestDriver::Check_Restore_File_Digest(const string& Filename) {
+	return Run_Checks(std::vector<string>(1, Filename), 1);
+}
+
+void twrpDigestDriver::List_Archive_Files(const string& Full_Filename, std::vector<string>* Files) {
+	char filename[512];
+	int thread_id, index;
+
+	if (TWFunc::Path_Exists(Full_Filename)) {
+		Files->push_back(Full_Filename);
+		return;
+	}
+	// Same names that twrpTar writes and restores, archive index for each thread
+	for (thread_id = 0; thread_id < 10; thread_id++) {
+		for (index = 0; index < 100; index++) {
+			snprintf(filename, sizeof(filename), "%s%i%02i", Full_Filename.c_str(), thread_id, index);
+			if (!TWFunc::Path_Exists(filename))
+				break;
+			Files->push_back(filename);
+		}
+		if (index == 0)
+			break;
+	}
+}
+
+void* twrpDigestDriver::Check_Thread(void *cookie) {
+	Digest_Check_Job* job = (Digest_Check_Job*) cookie;
+	std::vector<unsigned char> buf;
+
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		size_t i = job->next++;
+		bool stop = job->failed || i >= job->Items.size();
+		pthread_mutex_unlock(&job->lock);
+		if (stop)
+			break;
+		const Digest_Check_Item& item = job->Items[i];
+		Digest_Check_File* file = &job->Files->at(item.file);
+		Check_Result result;
+		uint64_t start = twrpThermal::Now_Usec();
+		if (item.chunk == WHOLE_FILE)
+			result = Verify_File(file->Filename, job->rate);
 		else
-			LOGINFO("MD5 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Filename).c_str());
-		delete digest;
-		return true;
+			result = Verify_Chunk(*file, item.chunk, &buf, job->rate);
+		if (result == CHECK_MATCH) {
+			twrpThermal::Get()->Pace(twrpThermal::Now_Usec() - start);
+			continue;
+		}
+		pthread_mutex_lock(&job->lock);
+		job->failed = true;
+		if (item.chunk == WHOLE_FILE) {
+			file->result = result;
+		} else {
+			uint64_t start = (uint64_t) item.chunk * file->Tree.chunk_size;
+			if (file->result == CHECK_MATCH || start < file->bad_start) {
+				file->result = result;
+				file->bad_start = start;
+				file->bad_end = start + file->Tree.chunk_size < file->Tree.file_size ? start + file->Tree.chunk_size : file->Tree.file_size;
+			}
+		}
+		pthread_mutex_unlock(&job->lock);
 	}
+	return NULL;
+}
 
-	gui_msg(Msg(msg::kError, "digest_fail_match=Digest failed to match on '{1}'.")(Filename));
-	delete digest;
-	return false;
+bool twrpDigestDriver::Run_Checks(const std::vector<string>& Files, int Thread_Count) {
+	std::vector<Digest_Check_File> Checks(Files.size());
+	std::vector<pthread_t> threads;
+	Digest_Check_Job job;
+	struct stat st;
+	size_t i, chunk;
+	bool ret = true;
 
+	job.Files = &Checks;
+	job.next = 0;
+	job.failed = false;
+	job.rate = Get_Digest_Rate();
+
+	// Files with a tree digest are split into chunks so that one large image
+	// is checked by every thread and a bad chunk stops the others right away
+	for (i = 0; i < Files.size(); i++) {
+		Digest_Check_File& file = Checks[i];
+		file.Filename = Files[i];
+		file.use_tree = false;
+		file.fd = -1;
+		file.result = CHECK_MATCH;
+		file.bad_start = file.bad_end = 0;
+		if (!TWFunc::Path_Exists(Files[i] + TW_DIGEST_TREE_EXT) || !twrpDigestTree_Load(Files[i], &file.Tree)) {
+			Digest_Check_Item item = {i, WHOLE_FILE};
+			job.Items.push_back(item);
+			continue;
+		}
+		file.use_tree = true;
+		file.fd = open(Files[i].c_str(), O_RDONLY);
+		if (file.fd < 0 || fstat(file.fd, &st) != 0) {
+			file.result = CHECK_READ_ERROR;
+			job.failed = true;
+		} else if ((uint64_t) st.st_size != file.Tree.file_size) {
+			file.result = CHECK_MISMATCH;
+			file.bad_start = (uint64_t) st.st_size < file.Tree.file_size ? st.st_size : file.Tree.file_size;
+			file.bad_end = (uint64_t) st.st_size < file.Tree.file_size ? file.Tree.file_size : st.st_size;
+			job.failed = true;
+		}
+		for (chunk = 0; chunk < file.Tree.leaves.size(); chunk++) {
+			Digest_Check_Item item = {i, chunk};
+			job.Items.push_back(item);
+		}
+	}
+
+	if (Thread_Count > MAX_DIGEST_THREADS)
+		Thread_Count = MAX_DIGEST_THREADS;
+	if (Thread_Count < 1)
+		Thread_Count = 1;
+	if ((size_t) Thread_Count > job.Items.size())
+		Thread_Count = job.Items.size() > 0 ? job.Items.size() : 1;
+	pthread_mutex_init(&job.lock, NULL);
+	LOGINFO("Checking %zu digests in %zu parts with %i threads\n", Files.size(), job.Items.size(), Thread_Count);
+
+	// The calling thread checks files too, so one thread never starts another
+	for (i = 1; i < (size_t) Thread_Count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Check_Thread, &job) != 0) {
+			LOGINFO("Unable to start digest thread, continuing with %zu\n", i);
+			break;
+		}
+		threads.push_back(thread);
+	}
+	Check_Thread(&job);
+	for (i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+
+	// Report the first bad file in backup order
+	for (i = 0; i < Checks.size(); i++) {
+		if (Checks[i].fd >= 0)
+			close(Checks[i].fd);
+		if (!ret)
+			continue;
+		if (Checks[i].use_tree && Checks[i].result == CHECK_MATCH)
+			LOGINFO("Tree Digest: %zu chunks match  %s\n", Checks[i].Tree.leaves.size(), TWFunc::Get_Filename(Checks[i].Filename).c_str());
+		ret = Report_Check(Checks[i]);
+	}
+	return ret;
 }
 
-bool twrpDigestDriver::Check_Digest(string Full_Filename) {
-	char split_filename[512];
-	int index = 0;
+bool twrpDigestDriver::Check_Digests(const std::vector<string>& Full_Filenames) {
+	std::vector<string> Files;
+	int thread_count = 0;
+	size_t i;
 
 	sync();
-	if (!TWFunc::Path_Exists(Full_Filename)) {
-		// This is a split archive, we presume
-		memset(split_filename, 0, sizeof(split_filename));
-		while (index < 1000) {
-			sprintf(split_filename, "%s%03i", Full_Filename.c_str(), index);
-			if (!TWFunc::Path_Exists(split_filename))
-				break;
-				LOGINFO("split_filename: %s\n", split_filename);
-				if (!Check_Restore_File_Digest(split_filename))
-					return false;
-				index++;
-		}
+	for (i = 0; i < Full_Filenames.size(); i++)
+		List_Archive_Files(Full_Filenames[i], &Files);
+	if (Files.empty())
 		return true;
-	}
-	return Check_Restore_File_Digest(Full_Filename); // Single file archive
+
+	DataManager::GetValue(TW_DIGEST_THREADS_VAR, thread_count);
+	if (thread_count <= 0)
+		thread_count = twrpThermal::Get()->Workers(sysconf(_SC_NPROCESSORS_ONLN));
+	return Run_Checks(Files, thread_count);
 }
 
-bool twrpDigestDriver::Write_Digest(string Full_Filename) {
-	twrpDigest *digest;
-	string digest_filename, digest_str;
-	int use_sha2;
+bool twrpDigestDriver::Check_Digest(string Full_Filename) {
+	return Check_Digests(std::vector<string>(1, Full_Filename));
+}
 
-#ifdef TW_NO_SHA2_LIBRARY
-	use_sha2 = 0;
-#else
+bool twrpDigestDriver::Use_SHA2() {
+	int use_sha2 = 0;
+
+#ifndef TW_NO_SHA2_LIBRARY
 	DataManager::GetValue(TW_USE_SHA2, use_sha2);
 #endif
+	return use_sha2 != 0;
+}
+
+twrpBackupDigest* twrpDigestDriver::New_Backup_Digest() {
+	twrpDigest* whole = NULL;
+	twrpDigestTree* tree = NULL;
+	int use_tree = 0;
 
-	if (use_sha2) {
 #ifndef TW_NO_SHA2_LIBRARY
-		digest = new twrpSHA256();
-		digest_filename = Full_Filename + ".sha2";
-		if (!stream_file_to_digest(Full_Filename, digest)) {
-			delete digest;
-			return false;
-		}
-		digest_str = digest->return_digest_string();
-		if (digest_str.empty()) {
-			delete digest;
-			return false;
-		}
-		LOGINFO("SHA2 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Full_Filename).c_str());
+	if (Use_SHA2())
+		whole = new twrpSHA256();
 #endif
+	if (whole == NULL)
+		whole = new twrpMD5();
+	DataManager::GetValue(TW_DIGEST_TREE_VAR, use_tree);
+	if (use_tree)
+		tree = new twrpDigestTree(TW_DIGEST_TREE_CHUNK);
+	return new twrpBackupDigest(whole, tree);
+}
+
+bool twrpDigestDriver::Write_Digest(string Full_Filename) {
+	twrpBackupDigest *digest = New_Backup_Digest();
+
+	if (!stream_file_to_digest(Full_Filename, digest)) {
+		delete digest;
+		return false;
 	}
-	else  {
-		digest = new twrpMD5();
+	bool ret = Write_Digest_File(Full_Filename, digest);
+	delete digest;
+	if (ret)
+		gui_msg("digest_created= * Digest Created.");
+	else
+		gui_err("digest_error= * Digest Error!");
+	return ret;
+}
+
+bool twrpDigestDriver::Write_Digest_File(string Full_Filename, twrpBackupDigest* digest) {
+	string digest_filename, digest_str;
+
+	digest_str = digest->return_digest_string();
+	if (digest_str.empty())
+		return false;
+	if (Use_SHA2()) {
+		digest_filename = Full_Filename + ".sha2";
+		LOGINFO("SHA2 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Full_Filename).c_str());
+	} else {
 		digest_filename = Full_Filename + ".md5";
-		if (!stream_file_to_digest(Full_Filename, digest)) {
-			delete digest;
-			return false;
-		}
-		digest_str = digest->return_digest_string();
-		if (digest_str.empty()) {
-			delete digest;
-			return false;
-		}
 		LOGINFO("MD5 Digest: %s  %s\n", digest_str.c_str(), TWFunc::Get_Filename(Full_Filename).c_str());
 	}
 
 	digest_str = digest_str + "  " + TWFunc::Get_Filename(Full_Filename) + "\n";
 	LOGINFO("digest_filename: %s\n", digest_filename.c_str());
 
-	if (TWFunc::write_to_file(digest_filename, digest_str) == 0) {
-		tw_set_default_metadata(digest_filename.c_str());
-		gui_msg("digest_created= * Digest Created.");
-	}
-	else {
-		gui_err("digest_error= * Digest Error!");
-		delete digest;
+	if (TWFunc::write_to_file(digest_filename, digest_str) != 0)
 		return false;
+	tw_set_default_metadata(digest_filename.c_str());
+	if (digest->Tree() != NULL) {
+		if (!digest->Tree()->Write_File(Full_Filename))
+			return false;
+		tw_set_default_metadata((Full_Filename + TW_DIGEST_TREE_EXT).c_str());
 	}
-	delete digest;
 	return true;
 }
 
 bool twrpDigestDriver::Make_Digest(string Full_Filename) {
-	string command, result;
+	std::vector<string> Files;
+	size_t i;
 
 	TWFunc::GUI_Operation_Text(TW_GENERATE_DIGEST_TEXT, gui_parse_text("{@generating_digest1}"));
 	gui_msg("generating_digest2= * Generating digest...");
-	if (TWFunc::Path_Exists(Full_Filename)) {
-		if (!Write_Digest(Full_Filename))
+	List_Archive_Files(Full_Filename, &Files);
+	if (Files.empty()) {
+		LOGERR("Backup file: '%s' not found!\n", Full_Filename.c_str());
+		return false;
+	}
+	for (i = 0; i < Files.size(); i++) {
+		if (!Write_Digest(Files[i]))
 			return false;
-	} else {
-		char filename[512];
-		int index = 0;
-		sprintf(filename, "%s%03i", Full_Filename.c_str(), index);
-		while (index < 1000) {
-			string digest_src(filename);
-			if (TWFunc::Path_Exists(filename)) {
-				if (!Write_Digest(filename))
-					return false;
-				}
-				else
-					break;
-				index++;
-				sprintf(filename, "%s%03i", Full_Filename.c_str(), index);
-			}
-			if (index == 0) {
-				LOGERR("Backup file: '%s' not found!\n", filename);
-					return false;
-			}
-			gui_msg("digest_created= * Digest Created.");
 	}
 	return true;
 }
 
 bool twrpDigestDriver::stream_file_to_digest(string filename, twrpDigest* digest) {
-	char buf[4096];
-	int bytes;
+	return Stream_File(filename, digest, 0);
+}
+
+bool twrpDigestDriver::Stream_File(const string& filename, twrpDigest* digest, unsigned Rate) {
+	std::vector<unsigned char> buf(DIGEST_READ_SIZE);
+	ssize_t bytes;
 
 	int fd = open(filename.c_str(), O_RDONLY);
 	if (fd < 0) {
 		return false;
 	}
-	while ((bytes = read(fd, &buf, sizeof(buf))) != 0) {
-		digest->update((unsigned char*)buf, bytes);
+	for (;;) {
+		Throttle_Read(buf.size(), Rate);
+		bytes = read(fd, &buf[0], buf.size());
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			break;
+		digest->update(&buf[0], bytes);
 	}
 	close(fd);
-	return true;
+	return bytes == 0;
+}
+
+twrpBackupDigest::twrpBackupDigest(twrpDigest* in_whole, twrpDigestTree* in_tree) {
+	whole = in_whole;
+	tree = in_tree;
+}
+
+twrpBackupDigest::~twrpBackupDigest() {
+	delete whole;
+	delete tree;
+}
+
+void twrpBackupDigest::init() {
+	whole->init();
+	if (tree)
+		tree->init();
+}
+
+void twrpBackupDigest::update(const unsigned char* stream, size_t len) {
+	whole->update(stream, len);
+	if (tree)
+		tree->update(stream, len);
+}
+
+std::string twrpBackupDigest::return_digest_string() {
+	return whole->return_digest_string();
 }
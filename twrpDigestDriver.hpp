@@ -19,15 +19,58 @@
 #ifndef __TWRP_DIGEST_DRIVER
 #define __TWRP_DIGEST_DRIVER
 #include <string>
+#include <vector>
 #include "twrpDigest/twrpDigest.hpp"
+#include "twrpDigestTree.hpp"
+
+// Digest of a backup file as it is written, the .sha2 or .md5 digest and,
+// when tw_digest_tree is set, a tree digest of the same data
+class twrpBackupDigest : public twrpDigest {
+public:
+	twrpBackupDigest(twrpDigest* whole, twrpDigestTree* tree);
+	~twrpBackupDigest();
+	void init();
+	void update(const unsigned char* stream, size_t len);
+	std::string return_digest_string();                                // Digest of the whole file
+	twrpDigestTree* Tree() { return tree; }                            // NULL if no tree digest is made
+
+protected:
+	void finalize() {}
+
+private:
+	twrpDigest* whole;
+	twrpDigestTree* tree;
+};
+
+struct Digest_Check_File;
 
 class twrpDigestDriver {
 public:
 
 	static bool Check_Restore_File_Digest(const string& Filename);		//Check the digest of a TWRP partition backup
 	static bool Check_Digest(string Full_Filename);				//Check to make sure the digest is correct
+	static bool Check_Digests(const std::vector<string>& Full_Filenames);	//Check several backups, their archives are checked in parallel
+	static void List_Archive_Files(const string& Full_Filename, std::vector<string>* Files); //Files of a backup, the split and thread archives if it has no single file
 	static bool Write_Digest(string Full_Filename);				//Write the digest to a file
 	static bool Make_Digest(string Full_Filename);				//Create the digest for a partition backup
 	static bool stream_file_to_digest(string filename, twrpDigest* digest); //Stream the file to twrpDigest
+	static twrpBackupDigest* New_Backup_Digest();				//Create the type of digest that backups use, SHA2 or MD5 and the tree digest if enabled
+	static bool Write_Digest_File(string Full_Filename, twrpBackupDigest* digest); //Write the digest files for a digest that was computed while the backup was written
+
+private:
+	enum Check_Result {
+		CHECK_MATCH,
+		CHECK_NO_DIGEST,
+		CHECK_READ_ERROR,
+		CHECK_MISMATCH
+	};
+
+	static bool Use_SHA2();							//Backups use SHA2 digests
+	static Check_Result Verify_File(const string& Filename, unsigned Rate);	//Check one file without showing messages, Rate is the read limit in MB/s, 0 for none
+	static bool Report_Check(const Digest_Check_File& File);		//Show the message for a failed check
+	static Check_Result Verify_Chunk(const Digest_Check_File& File, size_t Chunk, std::vector<unsigned char>* Buf, unsigned Rate); //Check one chunk of a file with a tree digest
+	static bool Run_Checks(const std::vector<string>& Files, int Thread_Count);
+	static bool Stream_File(const string& filename, twrpDigest* digest, unsigned Rate);
+	static void* Check_Thread(void *cookie);
 };
 #endif //__TWRP_DIGEST_DRIVER
@@ -0,0 +1,212 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "twrpDigestTree.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+#include "twrpDigest/twrpMD5.hpp"
+#ifndef TW_NO_SHA2_LIBRARY
+#include "twrpDigest/twrpSHA.hpp"
+#define TREE_LEAF_ALGORITHM "sha256"
+#else
+#define TREE_LEAF_ALGORITHM "md5"
+#endif
+
+#define TREE_MAGIC "TWTREE"
+#define TREE_VERSION 1
+#define TREE_MAX_CHUNK (64 * 1024 * 1024)
+
+static twrpDigest* New_Leaf_Digest(const std::string& algorithm) {
+#ifndef TW_NO_SHA2_LIBRARY
+	if (algorithm == "sha256")
+		return new twrpSHA256();
+#endif
+	if (algorithm == "md5")
+		return new twrpMD5();
+	return NULL;
+}
+
+twrpDigestTree::twrpDigestTree(uint64_t in_chunk_size) {
+	chunk_size = in_chunk_size;
+	leaf = NULL;
+	init();
+}
+
+twrpDigestTree::~twrpDigestTree() {
+	delete leaf;
+}
+
+void twrpDigestTree::init() {
+	delete leaf;
+	leaf = NULL;
+	chunk_used = 0;
+	total_size = 0;
+	leaves.clear();
+	root.clear();
+	finalized = false;
+}
+
+void twrpDigestTree::update(const unsigned char* stream, size_t len) {
+	while (len > 0) {
+		if (leaf == NULL)
+			leaf = New_Leaf_Digest(TREE_LEAF_ALGORITHM);
+		uint64_t n = chunk_size - chunk_used;
+		if (n > len)
+			n = len;
+		leaf->update(stream, (size_t)n);
+		chunk_used += n;
+		total_size += n;
+		stream += n;
+		len -= n;
+		if (chunk_used == chunk_size) {
+			leaves.push_back(leaf->return_digest_string());
+			delete leaf;
+			leaf = NULL;
+			chunk_used = 0;
+		}
+	}
+}
+
+std::string twrpDigestTree::Index_Body() {
+	char header[128];
+	std::string body;
+
+	snprintf(header, sizeof(header), "%s %i %s %llu %llu\n", TREE_MAGIC, TREE_VERSION, TREE_LEAF_ALGORITHM, (unsigned long long)chunk_size, (unsigned long long)total_size);
+	body = header;
+	for (size_t i = 0; i < leaves.size(); i++)
+		body += leaves[i] + "\n";
+	return body;
+}
+
+void twrpDigestTree::finalize() {
+	if (finalized)
+		return;
+	// A partial last chunk gets a leaf, an empty file has none
+	if (leaf != NULL) {
+		leaves.push_back(leaf->return_digest_string());
+		delete leaf;
+		leaf = NULL;
+	}
+	twrpDigest* top = New_Leaf_Digest(TREE_LEAF_ALGORITHM);
+	std::string body = Index_Body();
+	top->update((const unsigned char*)body.data(), body.size());
+	root = top->return_digest_string();
+	delete top;
+	finalized = true;
+}
+
+std::string twrpDigestTree::return_digest_string() {
+	finalize();
+	return root;
+}
+
+bool twrpDigestTree::Write_File(const std::string& Filename) {
+	finalize();
+	std::string tree_file = Filename + TW_DIGEST_TREE_EXT;
+	if (TWFunc::write_to_file(tree_file, Index_Body() + "root " + root + "\n") != 0) {
+		LOGINFO("Unable to write '%s'\n", tree_file.c_str());
+		return false;
+	}
+	LOGINFO("Tree digest: %s  %s (%zu chunks)\n", root.c_str(), TWFunc::Get_Filename(Filename).c_str(), leaves.size());
+	return true;
+}
+
+bool twrpDigestTree_Load(const std::string& Filename, twrpDigestTreeIndex *Index) {
+	std::string tree_file = Filename + TW_DIGEST_TREE_EXT, data, line, root;
+	size_t pos = 0, end, body_size = 0;
+	char magic[16], algorithm[16];
+	int version;
+	unsigned long long chunk_size, file_size;
+
+	if (TWFunc::read_file(tree_file, data) != 0)
+		return false;
+	end = data.find('\n');
+	if (end == std::string::npos)
+		return false;
+	line = data.substr(0, end);
+	if (sscanf(line.c_str(), "%15s %i %15s %llu %llu", magic, &version, algorithm, &chunk_size, &file_size) != 5 ||
+			std::string(magic) != TREE_MAGIC || version != TREE_VERSION || chunk_size == 0 || chunk_size > TREE_MAX_CHUNK) {
+		LOGINFO("'%s' is not a supported tree digest\n", tree_file.c_str());
+		return false;
+	}
+	Index->algorithm = algorithm;
+	Index->chunk_size = chunk_size;
+	Index->file_size = file_size;
+	Index->leaves.clear();
+	pos = end + 1;
+	while (pos < data.size()) {
+		end = data.find('\n', pos);
+		if (end == std::string::npos)
+			return false;
+		line = data.substr(pos, end - pos);
+		if (line.compare(0, 5, "root ") == 0) {
+			body_size = pos;
+			root = line.substr(5);
+			break;
+		}
+		Index->leaves.push_back(line);
+		pos = end + 1;
+	}
+	if (root.empty() || Index->leaves.size() != (file_size + chunk_size - 1) / chunk_size) {
+		LOGINFO("'%s' is incomplete\n", tree_file.c_str());
+		return false;
+	}
+
+	twrpDigest* top = New_Leaf_Digest(Index->algorithm);
+	if (top == NULL) {
+		LOGINFO("Unknown tree digest algorithm '%s'\n", Index->algorithm.c_str());
+		return false;
+	}
+	top->update((const unsigned char*)data.data(), body_size);
+	bool match = top->return_digest_string() == root;
+	delete top;
+	if (!match)
+		LOGINFO("Root of '%s' does not match its chunks\n", tree_file.c_str());
+	return match;
+}
+
+bool twrpDigestTree_Check_Chunk(int fd, const twrpDigestTreeIndex& Index, size_t chunk, unsigned char* buf, bool *Read_Error) {
+	uint64_t offset = (uint64_t)chunk * Index.chunk_size;
+	size_t len = (size_t)(Index.file_size - offset < Index.chunk_size ? Index.file_size - offset : Index.chunk_size);
+	size_t done = 0;
+
+	*Read_Error = false;
+	while (done < len) {
+		ssize_t r = pread(fd, buf + done, len - done, offset + done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			*Read_Error = true;
+			return false;
+		}
+		done += r;
+	}
+	twrpDigest* digest = New_Leaf_Digest(Index.algorithm);
+	if (digest == NULL)
+		return false;
+	digest->update(buf, len);
+	bool match = digest->return_digest_string() == Index.leaves[chunk];
+	delete digest;
+	return match;
+}
@@ -0,0 +1,78 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_DIGEST_TREE_HPP
+#define __TWRP_DIGEST_TREE_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "twrpDigest/twrpDigest.hpp"
+
+// A tree digest has a hash for every chunk of the file and a root hash over
+// the list of chunk hashes. Chunks can be checked in any order and on any
+// number of threads, and a mismatch names the bad byte range. It is stored
+// next to the file as:
+//   TWTREE 1 <leaf algorithm> <chunk size> <file size>
+//   <hash of chunk 0>
+//   ...
+//   root <hash of every line above>
+#define TW_DIGEST_TREE_EXT ".sha2tree"
+#define TW_DIGEST_TREE_CHUNK (4 * 1024 * 1024)
+
+class twrpDigestTree : public twrpDigest {
+public:
+	twrpDigestTree(uint64_t chunk_size);
+	~twrpDigestTree();
+	void init();
+	void update(const unsigned char* stream, size_t len);
+	std::string return_digest_string();                                // Root hash
+	bool Write_File(const std::string& Filename);                      // Writes Filename + TW_DIGEST_TREE_EXT
+
+protected:
+	void finalize();
+
+private:
+	std::string Index_Body();
+
+	uint64_t chunk_size;
+	uint64_t chunk_used;                                               // Bytes of the current chunk added to leaf
+	uint64_t total_size;
+	twrpDigest* leaf;
+	std::vector<std::string> leaves;
+	std::string root;
+	bool finalized;
+};
+
+// A tree digest file read back for checking
+struct twrpDigestTreeIndex {
+	std::string algorithm;
+	uint64_t chunk_size;
+	uint64_t file_size;
+	std::vector<std::string> leaves;
+};
+
+// Loads Filename + TW_DIGEST_TREE_EXT, false if it is missing, damaged or
+// its root does not match its chunk hashes
+bool twrpDigestTree_Load(const std::string& Filename, twrpDigestTreeIndex *Index);
+
+// Checks one chunk of the file open on fd against the index, buf must hold
+// Index.chunk_size bytes. Read_Error is set when the chunk could not be read.
+bool twrpDigestTree_Check_Chunk(int fd, const twrpDigestTreeIndex& Index, size_t chunk, unsigned char* buf, bool *Read_Error);
+
+#endif // __TWRP_DIGEST_TREE_HPP
@@ -0,0 +1,717 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#ifndef TW_NO_AES_LIBRARY
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+#else
+#include <linux/if_alg.h>
+#endif
+#include "twrpEncrypt.hpp"
+#include "twrpRestorePipeline.hpp"
+#include "twrpTarProgress.hpp"
+#include "twrpThermal.hpp"
+#include "twcommon.h"
+
+#ifndef AF_ALG
+#define AF_ALG 38
+#endif
+#ifndef SOL_ALG
+#define SOL_ALG 279
+#endif
+
+#define OAES_CHUNK_OVERHEAD (2 * OAES_BLOCK_SIZE)       // Header and IV in front of every chunk
+#define OAES_CHUNK_PAD 0x01                             // Header flag of a padded chunk
+#define ENCRYPT_BATCH_CHUNKS 64
+#define GCM_BATCH_CHUNKS 4
+#define IV_POOL_SIZE (ENCRYPT_BATCH_CHUNKS * OAES_BLOCK_SIZE)
+
+static void Put_Le32(unsigned char* buf, uint32_t value) {
+	for (int i = 0; i < 4; i++)
+		buf[i] = value >> (8 * i);
+}
+
+static uint32_t Get_Le32(const unsigned char* buf) {
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+bool twrpGcm_Supported() {
+#ifndef TW_NO_AES_LIBRARY
+	return true;
+#else
+	return false;
+#endif
+}
+
+static bool Gcm_Derive_Key(const std::string& Password, const unsigned char Header[TW_GCM_HEADER_SIZE], unsigned char Key[32]) {
+#ifndef TW_NO_AES_LIBRARY
+	return PKCS5_PBKDF2_HMAC(Password.data(), Password.size(), Header + 24, 16, Get_Le32(Header + 16), EVP_sha256(), 32, Key) == 1;
+#else
+	return false;
+#endif
+}
+
+bool twrpGcm_New_Header(const std::string& Password, unsigned char Header[TW_GCM_HEADER_SIZE], unsigned char Key[32]) {
+	memset(Header, 0, TW_GCM_HEADER_SIZE);
+	memcpy(Header, TW_GCM_MAGIC, TW_GCM_MAGIC_SIZE);
+	Put_Le32(Header + 8, TW_GCM_VERSION);
+	Put_Le32(Header + 12, TW_GCM_CHUNK);
+	Put_Le32(Header + 16, TW_GCM_KDF_ITERATIONS);
+#ifndef TW_NO_AES_LIBRARY
+	if (RAND_bytes(Header + 24, 20) != 1)
+		return false;
+#endif
+	return Gcm_Derive_Key(Password, Header, Key);
+}
+
+bool twrpGcm_Read_Header(const std::string& Password, const unsigned char Header[TW_GCM_HEADER_SIZE], uint32_t *Chunk_Size, unsigned char Key[32]) {
+	if (memcmp(Header, TW_GCM_MAGIC, TW_GCM_MAGIC_SIZE) != 0)
+		return false;
+	if (Get_Le32(Header + 8) != TW_GCM_VERSION) {
+		LOGINFO("twrpGcm: unknown archive version %u\n", Get_Le32(Header + 8));
+		return false;
+	}
+	*Chunk_Size = Get_Le32(Header + 12);
+	if (*Chunk_Size == 0 || *Chunk_Size > TW_GCM_MAX_CHUNK || Get_Le32(Header + 16) == 0) {
+		LOGINFO("twrpGcm: damaged archive header\n");
+		return false;
+	}
+	if (!Gcm_Derive_Key(Password, Header, Key)) {
+		LOGINFO("twrpGcm: this build can't read AES-GCM archives\n");
+		return false;
+	}
+	return true;
+}
+
+bool twrpGcm_Is_Archive(const std::string& fn) {
+	unsigned char magic[TW_GCM_MAGIC_SIZE];
+	int fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+	bool ret;
+
+	if (fd < 0)
+		return false;
+	ret = read(fd, magic, sizeof(magic)) == (ssize_t) sizeof(magic) && memcmp(magic, TW_GCM_MAGIC, TW_GCM_MAGIC_SIZE) == 0;
+	close(fd);
+	return ret;
+}
+
+static bool Key_Check_Verifier(const std::string& Password, const unsigned char Record[TW_KEY_CHECK_SIZE], unsigned char Verifier[32]) {
+#ifndef TW_NO_AES_LIBRARY
+	unsigned char key[32];
+	unsigned int len = 32;
+	bool ret;
+
+	ret = PKCS5_PBKDF2_HMAC(Password.data(), Password.size(), Record + 16, 16, Get_Le32(Record + 12), EVP_sha256(), sizeof(key), key) == 1
+		&& HMAC(EVP_sha256(), key, sizeof(key), (const unsigned char*) TW_KEY_CHECK_MAGIC, TW_KEY_CHECK_MAGIC_SIZE, Verifier, &len) != NULL;
+	memset(key, 0, sizeof(key));
+	return ret;
+#else
+	return false;
+#endif
+}
+
+bool twrpKeyCheck_Write(const std::string& Folder, const std::string& Password) {
+#ifndef TW_NO_AES_LIBRARY
+	unsigned char record[TW_KEY_CHECK_SIZE];
+	std::string fn = Folder + "/" + TW_KEY_CHECK_FILE;
+	bool ret;
+	int fd;
+
+	memset(record, 0, sizeof(record));
+	memcpy(record, TW_KEY_CHECK_MAGIC, TW_KEY_CHECK_MAGIC_SIZE);
+	Put_Le32(record + 8, TW_KEY_CHECK_VERSION);
+	Put_Le32(record + 12, TW_GCM_KDF_ITERATIONS);
+	if (RAND_bytes(record + 16, 16) != 1 || !Key_Check_Verifier(Password, record, record + 32)) {
+		LOGINFO("twrpKeyCheck: unable to derive the key check\n");
+		return false;
+	}
+	fd = open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+	if (fd < 0) {
+		LOGINFO("twrpKeyCheck: unable to create '%s': %s\n", fn.c_str(), strerror(errno));
+		return false;
+	}
+	ret = write(fd, record, sizeof(record)) == (ssize_t) sizeof(record);
+	if (close(fd) != 0)
+		ret = false;
+	if (!ret) {
+		LOGINFO("twrpKeyCheck: unable to write '%s'\n", fn.c_str());
+		unlink(fn.c_str());
+	}
+	return ret;
+#else
+	return false;
+#endif
+}
+
+int twrpKeyCheck_Verify(const std::string& Folder, const std::string& Password) {
+#ifndef TW_NO_AES_LIBRARY
+	unsigned char record[TW_KEY_CHECK_SIZE], verifier[32];
+	std::string fn = Folder + "/" + TW_KEY_CHECK_FILE;
+	ssize_t len;
+	int fd, ret;
+
+	fd = open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1; // Backups made before the record existed
+	len = read(fd, record, sizeof(record));
+	close(fd);
+	if (len != (ssize_t) sizeof(record) || memcmp(record, TW_KEY_CHECK_MAGIC, TW_KEY_CHECK_MAGIC_SIZE) != 0
+		|| Get_Le32(record + 8) != TW_KEY_CHECK_VERSION || Get_Le32(record + 12) == 0) {
+		LOGINFO("twrpKeyCheck: ignoring unreadable '%s'\n", fn.c_str());
+		return -1;
+	}
+	if (!Key_Check_Verifier(Password, record, verifier))
+		return -1;
+	// Compared in constant time, the time taken says nothing about the verifier
+	ret = CRYPTO_memcmp(verifier, record + 32, sizeof(verifier)) == 0 ? 1 : 0;
+	memset(verifier, 0, sizeof(verifier));
+	return ret;
+#else
+	return -1;
+#endif
+}
+
+twrpAesCipher::twrpAesCipher(const std::string& Password) {
+	password = Password;
+	key_len = twrpOaes_Key(Password, key);
+	evp = NULL;
+	alg_fd = -1;
+	alg_op_fd = -1;
+	oaes = NULL;
+	iv_pos = IV_POOL_SIZE;
+	ready = false;
+	gcm = false;
+#ifndef TW_NO_AES_LIBRARY
+	engine = ENGINE_LIBCRYPTO;
+	evp = EVP_CIPHER_CTX_new();
+	ready = evp != NULL;
+#else
+	struct sockaddr_alg sa;
+
+	engine = ENGINE_AF_ALG;
+	memset(&sa, 0, sizeof(sa));
+	sa.salg_family = AF_ALG;
+	strcpy((char*) sa.salg_type, "skcipher");
+	strcpy((char*) sa.salg_name, "cbc(aes)");
+	alg_fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (alg_fd >= 0 && bind(alg_fd, (struct sockaddr*) &sa, sizeof(sa)) == 0
+	&&  setsockopt(alg_fd, SOL_ALG, ALG_SET_KEY, key, key_len) == 0)
+		alg_op_fd = accept(alg_fd, NULL, 0);
+	ready = alg_op_fd >= 0;
+	if (!ready) {
+		if (alg_fd >= 0)
+			close(alg_fd);
+		alg_fd = -1;
+		engine = ENGINE_OPENAES;
+		ready = Oaes() != NULL;
+	}
+#endif
+}
+
+twrpAesCipher::~twrpAesCipher() {
+#ifndef TW_NO_AES_LIBRARY
+	if (evp != NULL)
+		EVP_CIPHER_CTX_free((EVP_CIPHER_CTX*) evp);
+#endif
+	if (alg_op_fd >= 0)
+		close(alg_op_fd);
+	if (alg_fd >= 0)
+		close(alg_fd);
+	if (oaes != NULL)
+		oaes_free(&oaes);
+	memset(key, 0, sizeof(key));
+	memset(gcm_key, 0, sizeof(gcm_key));
+}
+
+const char* twrpAesCipher::Engine() {
+	if (engine == ENGINE_LIBCRYPTO)
+		return "libcrypto";
+	if (engine == ENGINE_AF_ALG)
+		return "kernel (AF_ALG)";
+	return "openaes";
+}
+
+OAES_CTX* twrpAesCipher::Oaes() {
+	if (oaes == NULL)
+		oaes = twrpOaes_New_Context(password);
+	return oaes;
+}
+
+bool twrpAesCipher::Random_IV(unsigned char* iv) {
+	if (iv_pos == IV_POOL_SIZE) {
+		iv_pool.resize(IV_POOL_SIZE);
+#ifndef TW_NO_AES_LIBRARY
+		if (RAND_bytes(iv_pool.data(), iv_pool.size()) != 1)
+			return false;
+#else
+		int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+		size_t done = 0;
+		while (fd >= 0 && done < iv_pool.size()) {
+			ssize_t len = read(fd, iv_pool.data() + done, iv_pool.size() - done);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len <= 0)
+				break;
+			done += len;
+		}
+		if (fd >= 0)
+			close(fd);
+		if (done < iv_pool.size())
+			return false;
+#endif
+		iv_pos = 0;
+	}
+	memcpy(iv, iv_pool.data() + iv_pos, OAES_BLOCK_SIZE);
+	iv_pos += OAES_BLOCK_SIZE;
+	return true;
+}
+
+bool twrpAesCipher::Cbc(bool encrypt, const unsigned char* iv, const unsigned char* in, size_t len, unsigned char* out) {
+#ifndef TW_NO_AES_LIBRARY
+	EVP_CIPHER_CTX* ctx = (EVP_CIPHER_CTX*) evp;
+	const EVP_CIPHER* aes = key_len == 16 ? EVP_aes_128_cbc() : key_len == 24 ? EVP_aes_192_cbc() : EVP_aes_256_cbc();
+	int written;
+
+	if (EVP_CipherInit_ex(ctx, aes, NULL, key, iv, encrypt ? 1 : 0) != 1 || EVP_CIPHER_CTX_set_padding(ctx, 0) != 1)
+		return false;
+	return EVP_CipherUpdate(ctx, out, &written, in, len) == 1 && (size_t) written == len;
+#else
+	// One sendmsg() with the operation and the IV, then read the result back
+	char cbuf[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(struct af_alg_iv) + OAES_BLOCK_SIZE)];
+	struct msghdr msg;
+	struct cmsghdr* cmsg;
+	struct af_alg_iv* alg_iv;
+	struct iovec iov;
+	size_t done = 0;
+
+	memset(cbuf, 0, sizeof(cbuf));
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = (void*) in;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_ALG;
+	cmsg->cmsg_type = ALG_SET_OP;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+	*(uint32_t*) CMSG_DATA(cmsg) = encrypt ? ALG_OP_ENCRYPT : ALG_OP_DECRYPT;
+	cmsg = CMSG_NXTHDR(&msg, cmsg);
+	cmsg->cmsg_level = SOL_ALG;
+	cmsg->cmsg_type = ALG_SET_IV;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(struct af_alg_iv) + OAES_BLOCK_SIZE);
+	alg_iv = (struct af_alg_iv*) CMSG_DATA(cmsg);
+	alg_iv->ivlen = OAES_BLOCK_SIZE;
+	memcpy(alg_iv->iv, iv, OAES_BLOCK_SIZE);
+	if (sendmsg(alg_op_fd, &msg, 0) != (ssize_t) len)
+		return false;
+	while (done < len) {
+		ssize_t got = read(alg_op_fd, out + done, len - done);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return false;
+		done += got;
+	}
+	return true;
+#endif
+}
+
+size_t twrpAesCipher::Encrypt_Chunk(const unsigned char* in, size_t len, unsigned char* out) {
+	size_t whole = len - len % OAES_BLOCK_SIZE;
+	size_t padded = whole < len ? whole + OAES_BLOCK_SIZE : len;
+	OAES_OPTION options = OAES_OPTION_CBC;
+
+	if (!ready || len > TW_AES_ENC_CHUNK)
+		return 0;
+	if (engine == ENGINE_OPENAES) {
+		size_t chunk_len = OAES_CHUNK_OVERHEAD + padded;
+		if (oaes_encrypt(oaes, in, len, out, &chunk_len) != OAES_RET_SUCCESS)
+			return 0;
+		return chunk_len;
+	}
+
+	// The layout oaes_encrypt() writes in CBC mode: header, IV, then the
+	// data padded with 1, 2, 3... up to a whole AES block
+	memset(out, 0, OAES_CHUNK_OVERHEAD);
+	memcpy(out, "OAES\x01\x02", 6);
+	memcpy(out + 6, &options, sizeof(options));
+	out[8] = whole < len ? OAES_CHUNK_PAD : 0;
+	if (!Random_IV(out + OAES_BLOCK_SIZE))
+		return 0;
+	// The data and the pad are encrypted in one pass, so copy the last
+	// partial block next to the pad first
+	unsigned char* data = out + OAES_CHUNK_OVERHEAD;
+	memcpy(data, in, len);
+	for (size_t j = len; j < padded; j++)
+		data[j] = j - len + 1;
+	if (!Cbc(true, out + OAES_BLOCK_SIZE, data, padded, data))
+		return 0;
+	return OAES_CHUNK_OVERHEAD + padded;
+}
+
+ssize_t twrpAesCipher::Decrypt_Chunk(const unsigned char* in, size_t len, unsigned char* out) {
+	OAES_OPTION options;
+	size_t data_len;
+
+	if (!ready || len < OAES_CHUNK_OVERHEAD || len % OAES_BLOCK_SIZE || memcmp(in, "OAES\x01\x02", 6) != 0)
+		return -1;
+	memcpy(&options, in + 6, sizeof(options));
+	if (engine == ENGINE_OPENAES || options != OAES_OPTION_CBC || (in[8] & ~OAES_CHUNK_PAD)) {
+		// ECB chunks and anything else odd are left to openaes to judge
+		OAES_CTX* ctx = Oaes();
+		data_len = len;
+		if (ctx == NULL || oaes_decrypt(ctx, in, len, out, &data_len) != OAES_RET_SUCCESS)
+			return -1;
+		return data_len;
+	}
+
+	data_len = len - OAES_CHUNK_OVERHEAD;
+	if (data_len > 0 && !Cbc(false, in + OAES_BLOCK_SIZE, in + OAES_CHUNK_OVERHEAD, data_len, out))
+		return -1;
+	if (in[8] & OAES_CHUNK_PAD) {
+		// Same pad check as oaes_decrypt(), a wrong key fails it
+		size_t pad = data_len ? out[data_len - 1] : 0;
+		if (pad == 0 || pad >= OAES_BLOCK_SIZE)
+			return -1;
+		for (size_t i = 0; i < pad; i++) {
+			if (out[data_len - 1 - i] != pad - i)
+				return -1;
+		}
+		data_len -= pad;
+	}
+	return data_len;
+}
+
+bool twrpAesCipher::Use_Gcm(const unsigned char Header[TW_GCM_HEADER_SIZE], const unsigned char Key[32]) {
+	if (engine != ENGINE_LIBCRYPTO || !ready)
+		return false;
+	memcpy(gcm_header, Header, TW_GCM_HEADER_SIZE);
+	memcpy(gcm_key, Key, sizeof(gcm_key));
+	gcm = true;
+	return true;
+}
+
+#ifndef TW_NO_AES_LIBRARY
+// Nonce prefix then the chunk index, and the header then the chunk index as AAD
+static void Gcm_Nonce_Aad(const unsigned char* header, uint64_t index, unsigned char nonce[12], unsigned char aad[TW_GCM_HEADER_SIZE + 8]) {
+	memcpy(nonce, header + 40, 4);
+	memcpy(aad, header, TW_GCM_HEADER_SIZE);
+	for (int i = 0; i < 8; i++) {
+		nonce[4 + i] = index >> (56 - 8 * i);
+		aad[TW_GCM_HEADER_SIZE + i] = index >> (56 - 8 * i);
+	}
+}
+#endif
+
+size_t twrpAesCipher::Seal_Chunk(uint64_t index, const unsigned char* in, size_t len, unsigned char* out) {
+#ifndef TW_NO_AES_LIBRARY
+	EVP_CIPHER_CTX* ctx = (EVP_CIPHER_CTX*) evp;
+	unsigned char nonce[12], aad[TW_GCM_HEADER_SIZE + 8];
+	int written;
+
+	if (!gcm)
+		return 0;
+	Gcm_Nonce_Aad(gcm_header, index, nonce, aad);
+	if (EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, gcm_key, nonce) != 1
+	||  EVP_EncryptUpdate(ctx, NULL, &written, aad, sizeof(aad)) != 1
+	||  (len > 0 && EVP_EncryptUpdate(ctx, out, &written, in, len) != 1)
+	||  EVP_EncryptFinal_ex(ctx, out + len, &written) != 1
+	||  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TW_GCM_TAG_SIZE, out + len) != 1)
+		return 0;
+	return len + TW_GCM_TAG_SIZE;
+#else
+	return 0;
+#endif
+}
+
+ssize_t twrpAesCipher::Open_Chunk(uint64_t index, const unsigned char* in, size_t len, unsigned char* out) {
+#ifndef TW_NO_AES_LIBRARY
+	EVP_CIPHER_CTX* ctx = (EVP_CIPHER_CTX*) evp;
+	unsigned char nonce[12], aad[TW_GCM_HEADER_SIZE + 8], tag[TW_GCM_TAG_SIZE];
+	size_t data_len = len - TW_GCM_TAG_SIZE;
+	int written;
+
+	if (!gcm || len < TW_GCM_TAG_SIZE)
+		return -1;
+	Gcm_Nonce_Aad(gcm_header, index, nonce, aad);
+	memcpy(tag, in + data_len, TW_GCM_TAG_SIZE);
+	if (EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, gcm_key, nonce) != 1
+	||  EVP_DecryptUpdate(ctx, NULL, &written, aad, sizeof(aad)) != 1
+	||  (data_len > 0 && EVP_DecryptUpdate(ctx, out, &written, in, data_len) != 1)
+	||  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TW_GCM_TAG_SIZE, tag) != 1
+	||  EVP_DecryptFinal_ex(ctx, out + data_len, &written) != 1)
+		return -1;
+	return data_len;
+#else
+	return -1;
+#endif
+}
+
+twrpEncryptWriter::twrpEncryptWriter(int out_fd, const std::string& Password, unsigned threads, bool Legacy) {
+	fd = out_fd;
+	password = Password;
+	thread_count = threads;
+	gcm = !Legacy && twrpGcm_Supported();
+	batch_size = gcm ? TW_GCM_CHUNK * GCM_BATCH_CHUNKS : TW_AES_ENC_CHUNK * ENCRYPT_BATCH_CHUNKS;
+	next_chunk = 0;
+	total_in = 0;
+	header_written = false;
+	index = NULL;
+	stopping = false;
+	failed = false;
+	finished = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work_cond, NULL);
+	pthread_cond_init(&done_cond, NULL);
+	block.reserve(batch_size);
+}
+
+twrpEncryptWriter::~twrpEncryptWriter() {
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&lock);
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	while (!in_flight.empty()) {
+		delete in_flight.front();
+		in_flight.pop_front();
+	}
+	memset(gcm_key, 0, sizeof(gcm_key));
+	pthread_cond_destroy(&done_cond);
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void twrpEncryptWriter::Setup_Cipher(twrpAesCipher *cipher) {
+	if (gcm && !cipher->Use_Gcm(gcm_header, gcm_key))
+		LOGINFO("twrpEncryptWriter: unable to set up AES-GCM\n");
+}
+
+bool twrpEncryptWriter::Start() {
+	twrpAesCipher probe(password);
+
+	if (!probe.Ready()) {
+		LOGINFO("twrpEncryptWriter: no AES engine could be set up\n");
+		return false;
+	}
+	if (gcm && !twrpGcm_New_Header(password, gcm_header, gcm_key)) {
+		LOGINFO("twrpEncryptWriter: unable to start the AES-GCM archive\n");
+		failed = true;
+		return false;
+	}
+	unsigned count = twrpThermal::Get()->Workers(thread_count);
+	for (unsigned i = 0; i < count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Worker, this) != 0) {
+			LOGINFO("twrpEncryptWriter: unable to start encryption thread %u, using %u\n", i, i);
+			break;
+		}
+		threads.push_back(thread);
+	}
+	LOGINFO("twrpEncryptWriter: %s AES%s on %zu threads\n", probe.Engine(), gcm ? "-GCM" : "", threads.size());
+	return true;
+}
+
+void* twrpEncryptWriter::Worker(void *cookie) {
+	twrpEncryptWriter* enc = (twrpEncryptWriter*) cookie;
+	twrpAesCipher cipher(enc->password);
+
+	enc->Setup_Cipher(&cipher);
+	pthread_mutex_lock(&enc->lock);
+	for (;;) {
+		while (enc->queue.empty() && !enc->stopping)
+			pthread_cond_wait(&enc->work_cond, &enc->lock);
+		if (enc->queue.empty())
+			break;
+		Job* job = enc->queue.front();
+		enc->queue.pop_front();
+		pthread_mutex_unlock(&enc->lock);
+		uint64_t start = twrpThermal::Now_Usec();
+		enc->Encrypt(job, &cipher);
+		uint64_t busy = twrpThermal::Now_Usec() - start;
+		twrpTarProgress::Add_Time(TW_TAR_TIME_ENCRYPT, busy);
+		pthread_mutex_lock(&enc->lock);
+		job->done = true;
+		pthread_cond_broadcast(&enc->done_cond);
+		pthread_mutex_unlock(&enc->lock);
+		twrpThermal::Get()->Pace(busy);
+		pthread_mutex_lock(&enc->lock);
+	}
+	pthread_mutex_unlock(&enc->lock);
+	return NULL;
+}
+
+void twrpEncryptWriter::Encrypt(Job *job, twrpAesCipher *cipher) {
+	size_t out_len = 0;
+
+	job->error = !cipher->Ready();
+	if (gcm) {
+		// Batches before the last one hold whole chunks
+		size_t chunks = job->in.size() / TW_GCM_CHUNK + (job->last ? 1 : 0);
+		job->out.resize(job->in.size() + chunks * TW_GCM_TAG_SIZE);
+		for (size_t i = 0; i < chunks && !job->error; i++) {
+			size_t pos = i * TW_GCM_CHUNK;
+			size_t len = job->in.size() - pos < TW_GCM_CHUNK ? job->in.size() - pos : TW_GCM_CHUNK;
+			size_t chunk_len = cipher->Seal_Chunk(job->first_chunk + i, job->in.data() + pos, len, job->out.data() + out_len);
+			if (chunk_len == 0)
+				job->error = true;
+			out_len += chunk_len;
+		}
+		job->out.resize(out_len);
+		return;
+	}
+
+	size_t chunks = (job->in.size() + TW_AES_ENC_CHUNK - 1) / TW_AES_ENC_CHUNK;
+	job->out.resize(chunks * TW_AES_CHUNK_SIZE);
+	for (size_t pos = 0; pos < job->in.size() && !job->error; pos += TW_AES_ENC_CHUNK) {
+		size_t len = job->in.size() - pos < TW_AES_ENC_CHUNK ? job->in.size() - pos : TW_AES_ENC_CHUNK;
+		size_t chunk_len = cipher->Encrypt_Chunk(job->in.data() + pos, len, job->out.data() + out_len);
+		if (chunk_len == 0)
+			job->error = true;
+		out_len += chunk_len;
+	}
+	job->out.resize(out_len);
+}
+
+bool twrpEncryptWriter::Submit(bool last) {
+	Job* job = new Job;
+	job->done = false;
+	job->error = false;
+	job->last = last;
+	job->first_chunk = next_chunk;
+	next_chunk += block.size() / TW_GCM_CHUNK;
+	job->in.swap(block);
+	block.clear();
+	block.reserve(batch_size);
+
+	if (threads.empty()) {
+		// No worker threads could be started, encrypt in this thread
+		twrpAesCipher cipher(password);
+		Setup_Cipher(&cipher);
+		Encrypt(job, &cipher);
+		job->done = true;
+		in_flight.push_back(job);
+		return Drain(false);
+	}
+
+	pthread_mutex_lock(&lock);
+	queue.push_back(job);
+	in_flight.push_back(job);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+	return Drain(false);
+}
+
+bool twrpEncryptWriter::Drain(bool wait_all) {
+	size_t limit = threads.size() * 2;
+
+	pthread_mutex_lock(&lock);
+	while (!in_flight.empty()) {
+		Job* job = in_flight.front();
+		if (!job->done) {
+			// Keep up to two batches per thread queued before blocking
+			if (!wait_all && in_flight.size() < limit)
+				break;
+			pthread_cond_wait(&done_cond, &lock);
+			continue;
+		}
+		in_flight.pop_front();
+		pthread_mutex_unlock(&lock);
+		if (job->error) {
+			LOGINFO("twrpEncryptWriter: encryption failed\n");
+			failed = true;
+		}
+		// The header goes out with the first chunks, once the digest of
+		// the archive is attached
+		if (!failed && gcm && !header_written) {
+			header_written = true;
+			if (!Write_Output(fd, gcm_header, sizeof(gcm_header)))
+				failed = true;
+		}
+		if (!failed && !Write_Output(fd, job->out.data(), job->out.size()))
+			failed = true;
+		delete job;
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+	return !failed;
+}
+
+ssize_t twrpEncryptWriter::Write(const void *buf, size_t size) {
+	const unsigned char* ptr = (const unsigned char*) buf;
+	size_t left = size;
+
+	if (failed || finished)
+		return -1;
+	if (index) {
+		// Any offset can be read from, one frame every TW_TAR_INDEX_FRAME
+		// lets a restore seek ahead instead of decrypting its way there
+		uint64_t frame = total_in / TW_TAR_INDEX_FRAME + 1;
+		index->Add_Input(size);
+		total_in += size;
+		for (; frame * TW_TAR_INDEX_FRAME <= total_in; frame++)
+			index->Add_Frame(frame * TW_TAR_INDEX_FRAME, frame * TW_TAR_INDEX_FRAME);
+	}
+	while (left > 0) {
+		size_t len = batch_size - block.size();
+		if (len > left)
+			len = left;
+		block.insert(block.end(), ptr, ptr + len);
+		ptr += len;
+		left -= len;
+		if (block.size() >= batch_size && !Submit(false))
+			return -1;
+	}
+	return size;
+}
+
+int twrpEncryptWriter::Finish() {
+	if (finished)
+		return failed ? -1 : 0;
+	finished = true;
+	if (failed)
+		return -1;
+	// An AES-GCM archive always ends with a short chunk, even an empty one
+	if ((gcm || !block.empty()) && !Submit(true))
+		return -1;
+	return Drain(true) ? 0 : -1;
+}
+
+bool twrpEncryptWriter::Set_Index(twrpTarIndex *tar_index) {
+	if (!gcm)
+		return false;
+	// The chunks are fixed size, so frames are offsets in the tar stream
+	index = tar_index;
+	index->Add_Frame(0, 0);
+	return true;
+}
+
+#endif // TW_EXCLUDE_ENCRYPTED_BACKUPS
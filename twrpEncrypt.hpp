@@ -0,0 +1,190 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_ENCRYPT_HPP
+#define __TWRP_ENCRYPT_HPP
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "twrpCompress.hpp"
+#include "openaes/inc/oaes_lib.h"
+
+#define TW_AES_ENC_CHUNK 4064                                          // openaes enc encrypts this much at a time
+#define TW_AES_CHUNK_SIZE 4096                                         // and writes chunks of this size
+
+// Authenticated chunked archives. A TW_GCM_HEADER_SIZE header, then the
+// data cut into chunks of chunk_size bytes, each sealed on its own with
+// AES-256-GCM and followed by its tag. The last chunk is always shorter
+// than chunk_size, empty if need be, so a cut off archive fails to open.
+// Chunk n uses the nonce prefix of the header followed by n, and
+// authenticates the header and n, so chunks can't be swapped or moved
+// between archives, and a reader can start at any chunk. The key is
+// derived from the password and the salt of each archive.
+//   0  TW_GCM_MAGIC
+//   8  version, chunk size, PBKDF2 iterations, flags (le32 each)
+//  24  PBKDF2-HMAC-SHA256 salt (16 bytes)
+//  40  nonce prefix (4 bytes), the rest is zero
+#define TW_GCM_MAGIC "TWAESGCM"
+#define TW_GCM_MAGIC_SIZE 8
+#define TW_GCM_HEADER_SIZE 64
+#define TW_GCM_VERSION 1
+#define TW_GCM_CHUNK (64 * 1024)
+#define TW_GCM_TAG_SIZE 16
+#define TW_GCM_KDF_ITERATIONS 100000
+#define TW_GCM_MAX_CHUNK (16 * 1024 * 1024)                             // Larger chunk sizes in a header are refused
+
+// false in builds without libcrypto, which still read and write the
+// openaes format
+bool twrpGcm_Supported();
+// A new header with a random salt and the key Password derives with it
+bool twrpGcm_New_Header(const std::string& Password, unsigned char Header[TW_GCM_HEADER_SIZE], unsigned char Key[32]);
+// Checks Header and derives its key, false if it is not one this build reads
+bool twrpGcm_Read_Header(const std::string& Password, const unsigned char Header[TW_GCM_HEADER_SIZE], uint32_t *Chunk_Size, unsigned char Key[32]);
+// true if the file at fn starts with TW_GCM_MAGIC
+bool twrpGcm_Is_Archive(const std::string& fn);
+
+// Key check record in the folder of an encrypted backup, so the password
+// is checked once before a restore instead of by decrypting every archive.
+// It holds a verifier of the key the password derives, never the key.
+//   0  TW_KEY_CHECK_MAGIC
+//   8  version, PBKDF2 iterations (le32 each)
+//  16  PBKDF2-HMAC-SHA256 salt (16 bytes)
+//  32  HMAC-SHA256 of TW_KEY_CHECK_MAGIC with the derived key (32 bytes)
+#define TW_KEY_CHECK_FILE "backup.keycheck"
+#define TW_KEY_CHECK_MAGIC "TWKEYCHK"
+#define TW_KEY_CHECK_MAGIC_SIZE 8
+#define TW_KEY_CHECK_SIZE 64
+#define TW_KEY_CHECK_VERSION 1
+
+// Writes the key check record of Password into Folder
+bool twrpKeyCheck_Write(const std::string& Folder, const std::string& Password);
+// 1 if Password matches the record in Folder, 0 if it does not, -1 if
+// there is no record this build reads and the archives have to be tried
+int twrpKeyCheck_Verify(const std::string& Folder, const std::string& Password);
+
+// One thread's AES for the chunks openaes writes. Builds with libcrypto
+// use it, which runs on the ARMv8 or AES-NI instructions when the CPU has
+// them. Builds with TW_NO_AES_LIBRARY ask the kernel crypto API (AF_ALG)
+// for cbc(aes), which picks the hardware driver of the SoC, and use
+// openaes only when the kernel has no AF_ALG.
+class twrpAesCipher {
+public:
+	twrpAesCipher(const std::string& Password);
+	~twrpAesCipher();
+	bool Ready() { return ready; }                                     // false if no engine took the key
+	const char* Engine();
+	// Encrypts len <= TW_AES_ENC_CHUNK bytes into one chunk at out, with
+	// room for TW_AES_CHUNK_SIZE bytes, and returns the chunk size, 0 on
+	// failure
+	size_t Encrypt_Chunk(const unsigned char* in, size_t len, unsigned char* out);
+	// Decrypts one chunk into out, with room for len bytes, and returns
+	// the data size, -1 if the chunk is damaged or the key is wrong
+	ssize_t Decrypt_Chunk(const unsigned char* in, size_t len, unsigned char* out);
+	// Switches to the TW_GCM_MAGIC chunks of Header, sealed with Key
+	bool Use_Gcm(const unsigned char Header[TW_GCM_HEADER_SIZE], const unsigned char Key[32]);
+	// Seals chunk index of len bytes into out, which gets len +
+	// TW_GCM_TAG_SIZE bytes, 0 on failure
+	size_t Seal_Chunk(uint64_t index, const unsigned char* in, size_t len, unsigned char* out);
+	// Opens chunk index into out, returns its data size, -1 if it was
+	// changed or the key is wrong
+	ssize_t Open_Chunk(uint64_t index, const unsigned char* in, size_t len, unsigned char* out);
+
+private:
+	enum Engine_Type { ENGINE_LIBCRYPTO, ENGINE_AF_ALG, ENGINE_OPENAES };
+	bool Cbc(bool encrypt, const unsigned char* iv, const unsigned char* in, size_t len, unsigned char* out);
+	bool Random_IV(unsigned char* iv);                                 // IVs are taken from a pool refilled in batches
+	OAES_CTX* Oaes();                                                  // openaes context, made the first time it is needed
+
+	Engine_Type engine;
+	bool ready;
+	std::string password;
+	uint8_t key[32];
+	size_t key_len;
+	void* evp;                                                         // libcrypto cipher context
+	int alg_fd;                                                        // AF_ALG transform socket
+	int alg_op_fd;                                                     // AF_ALG operation socket
+	OAES_CTX* oaes;
+	std::vector<unsigned char> iv_pool;
+	size_t iv_pos;
+	bool gcm;
+	unsigned char gcm_header[TW_GCM_HEADER_SIZE];
+	unsigned char gcm_key[32];
+};
+
+// Encrypts archives in process, into TW_GCM_MAGIC chunks when the build
+// supports them and into the chunks openaes enc writes otherwise, or when
+// Legacy asks for archives older TWRP builds and openaes dec can read.
+// Every chunk stands on its own, so batches of chunks are encrypted on a
+// pool of threads, each with its own twrpAesCipher, and written in order.
+class twrpEncryptWriter : public twrpStreamWriter {
+public:
+	twrpEncryptWriter(int out_fd, const std::string& Password, unsigned threads, bool Legacy = false);
+	~twrpEncryptWriter();
+	bool Start();
+	ssize_t Write(const void *buf, size_t size);
+	int Finish();
+	bool Set_Index(twrpTarIndex *tar_index);                           // Only TW_GCM_MAGIC archives can be read from an offset
+	bool Seekable() { return gcm; }
+
+private:
+	struct Job {
+		std::vector<unsigned char> in;
+		std::vector<unsigned char> out;
+		uint64_t first_chunk;                                      // Index of the first TW_GCM_MAGIC chunk
+		bool last;                                                 // Ends the archive with a short chunk
+		bool done;
+		bool error;
+	};
+
+	static void* Worker(void *cookie);
+	void Encrypt(Job *job, twrpAesCipher *cipher);
+	bool Submit(bool last);                                            // Hand the current batch to the workers
+	bool Drain(bool wait_all);                                         // Write finished batches in order
+	void Setup_Cipher(twrpAesCipher *cipher);
+
+	int fd;
+	std::string password;
+	unsigned thread_count;
+	bool gcm;
+	unsigned char gcm_header[TW_GCM_HEADER_SIZE];
+	unsigned char gcm_key[32];
+	size_t batch_size;
+	uint64_t next_chunk;
+	uint64_t total_in;                                                 // Data written, for the index frames
+	bool header_written;
+	twrpTarIndex* index;
+	std::vector<pthread_t> threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	std::deque<Job*> queue;                                            // Jobs waiting for a worker
+	std::deque<Job*> in_flight;                                        // All submitted jobs in stream order
+	std::vector<unsigned char> block;                                  // Batch being filled by Write()
+	bool stopping;
+	bool failed;
+	bool finished;
+};
+
+#endif // TW_EXCLUDE_ENCRYPTED_BACKUPS
+
+#endif // __TWRP_ENCRYPT_HPP
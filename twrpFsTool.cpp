@@ -0,0 +1,297 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "twrpFsTool.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+
+extern char **environ;
+
+// The fd e2fsck and fsck.fat write their completion lines to in the child
+#define TW_FS_TOOL_PROGRESS_FD 3
+
+// Share of the work done when each e2fsck pass ends, the weights e2fsck
+// uses for its own progress bar
+static const float e2fsck_passes[] = { 0, 0.70, 0.90, 0.92, 0.95, 1.0 };
+
+// The same for fsck.fat: reading the FAT, checking the files, and the free
+// cluster passes at the end
+static const float fsck_fat_passes[] = { 0, 0.10, 0.95, 1.0 };
+
+// Stages of mke2fs that print a "done/total" counter, with the share of
+// the work done before each
+struct mke2fs_stage {
+	const char* label;
+	float start, end;
+};
+
+static const mke2fs_stage mke2fs_stages[] = {
+	{ "Allocating group tables", 0, 0.1 },
+	{ "Writing inode tables", 0.1, 0.9 },
+	{ "Creating journal", 0.9, 0.95 },
+	{ "Writing superblocks", 0.95, 1.0 },
+};
+
+// resize2fs draws a bar of this many X's for each of its up to 5 passes
+#define TW_RESIZE2FS_BAR 40
+#define TW_RESIZE2FS_PASSES 5
+
+twrpFsTool::twrpFsTool(const std::string& Tool) {
+	tool = Tool;
+	name = TWFunc::Get_Filename(Tool);
+	pass = 0;
+	reported = 0;
+}
+
+twrpFsTool& twrpFsTool::Arg(const std::string& Arg) {
+	args.push_back(Arg);
+	return *this;
+}
+
+void twrpFsTool::Set_Progress(twrpFsProgress Progress) {
+	progress = Progress;
+}
+
+void twrpFsTool::Set_Output(twrpFsOutput Output) {
+	output = Output;
+}
+
+std::string twrpFsTool::Command() {
+	std::string command = tool;
+
+	for (size_t i = 0; i < args.size(); i++)
+		command += " " + args[i];
+	return command;
+}
+
+void twrpFsTool::Report(float Done) {
+	if (!progress || Done <= reported)
+		return;
+	if (Done > 1)
+		Done = 1;
+	reported = Done;
+	progress(Done);
+}
+
+// e2fsck -C writes "pass current max device" lines, fsck.fat -C the same
+// without the device
+void twrpFsTool::Parse_Completion(const std::string& Line) {
+	const float* passes = e2fsck_passes;
+	int line_pass, last_pass = sizeof(e2fsck_passes) / sizeof(e2fsck_passes[0]) - 1;
+	unsigned long long current, max;
+
+	if (name == "fsck.fat") {
+		passes = fsck_fat_passes;
+		last_pass = sizeof(fsck_fat_passes) / sizeof(fsck_fat_passes[0]) - 1;
+	}
+	if (sscanf(Line.c_str(), "%d %llu %llu", &line_pass, &current, &max) != 3 || line_pass < 1 || line_pass > last_pass || max == 0)
+		return;
+	Report(passes[line_pass - 1] + (passes[line_pass] - passes[line_pass - 1]) * current / max);
+}
+
+void twrpFsTool::Parse_Output(const std::string& Segment) {
+	unsigned long long done, total;
+	size_t i, slash;
+
+	if (name == "resize2fs") {
+		int begin;
+		if (sscanf(Segment.c_str(), "Begin pass %d", &begin) == 1 && begin > 0 && begin <= TW_RESIZE2FS_PASSES) {
+			pass = begin;
+			Report((float) (pass - 1) / TW_RESIZE2FS_PASSES);
+		} else if (pass > 0) {
+			unsigned marks = 0;
+			for (i = 0; i < Segment.size(); i++) {
+				if (Segment[i] == 'X')
+					marks++;
+			}
+			if (marks)
+				Report((pass - 1 + (float) marks / TW_RESIZE2FS_BAR) / TW_RESIZE2FS_PASSES);
+		}
+		return;
+	}
+	if (name != "mke2fs" && name.compare(0, 8, "mkfs.ext") != 0)
+		return;
+	for (i = 0; i < sizeof(mke2fs_stages) / sizeof(mke2fs_stages[0]); i++) {
+		if (Segment.find(mke2fs_stages[i].label) != std::string::npos) {
+			pass = i + 1;
+			Report(mke2fs_stages[i].start);
+			break;
+		}
+	}
+	// The counter is rewritten in place with backspaces, so it shows up
+	// alone in the segments after the label
+	slash = Segment.rfind('/');
+	if (pass == 0 || slash == std::string::npos)
+		return;
+	i = slash;
+	while (i > 0 && Segment[i - 1] >= '0' && Segment[i - 1] <= '9')
+		i--;
+	if (i == slash || sscanf(Segment.c_str() + i, "%llu/%llu", &done, &total) != 2 || total == 0)
+		return;
+	const mke2fs_stage& stage = mke2fs_stages[pass - 1];
+	Report(stage.start + (stage.end - stage.start) * done / total);
+}
+
+int twrpFsTool::Run() {
+	std::vector<std::string> argv_str;
+	std::vector<char*> argv;
+	std::string command, line, pending, completion;
+	posix_spawn_file_actions_t actions;
+	int out_pipe[2], progress_pipe[2] = { -1, -1 };
+	int status, ret;
+	pid_t pid;
+	char buf[4096];
+	size_t i;
+
+	argv_str.push_back(tool);
+	if (progress && (name == "e2fsck" || name == "fsck.fat")) {
+		if (pipe2(progress_pipe, O_CLOEXEC) != 0) {
+			progress_pipe[0] = -1;
+			progress_pipe[1] = -1;
+		} else {
+			argv_str.push_back("-C");
+			argv_str.push_back(std::to_string(TW_FS_TOOL_PROGRESS_FD));
+		}
+	} else if (progress && name == "resize2fs") {
+		argv_str.push_back("-p");
+	}
+	argv_str.insert(argv_str.end(), args.begin(), args.end());
+	for (i = 0; i < argv_str.size(); i++) {
+		command += (i ? " " : "") + argv_str[i];
+		argv.push_back((char*) argv_str[i].c_str());
+	}
+	argv.push_back(NULL);
+	LOGINFO("Running '%s'\n", command.c_str());
+
+	if (pipe2(out_pipe, O_CLOEXEC) != 0) {
+		LOGERR("Unable to create pipe for %s: %s\n", name.c_str(), strerror(errno));
+		if (progress_pipe[0] >= 0) {
+			close(progress_pipe[0]);
+			close(progress_pipe[1]);
+		}
+		return -1;
+	}
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDOUT_FILENO);
+	if (!output)
+		posix_spawn_file_actions_adddup2(&actions, out_pipe[1], STDERR_FILENO);
+	if (progress_pipe[1] >= 0)
+		posix_spawn_file_actions_adddup2(&actions, progress_pipe[1], TW_FS_TOOL_PROGRESS_FD);
+	ret = posix_spawnp(&pid, tool.c_str(), &actions, NULL, argv.data(), environ);
+	posix_spawn_file_actions_destroy(&actions);
+	close(out_pipe[1]);
+	if (progress_pipe[1] >= 0)
+		close(progress_pipe[1]);
+	if (ret != 0) {
+		LOGERR("Unable to run %s: %s\n", tool.c_str(), strerror(ret));
+		close(out_pipe[0]);
+		if (progress_pipe[0] >= 0)
+			close(progress_pipe[0]);
+		return -1;
+	}
+
+	// Output lines go to the log with only their first and last segment, as
+	// the segments between carriage returns and backspaces are progress
+	// redrawn in place; the parsers see every segment
+	struct pollfd fds[2];
+	int nfds = 1;
+	fds[0].fd = out_pipe[0];
+	fds[0].events = POLLIN;
+	if (progress_pipe[0] >= 0) {
+		fds[1].fd = progress_pipe[0];
+		fds[1].events = POLLIN;
+		nfds = 2;
+	}
+	while (fds[0].fd >= 0 || (nfds > 1 && fds[1].fd >= 0)) {
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[0].fd >= 0 && fds[0].revents) {
+			ssize_t len = read(fds[0].fd, buf, sizeof(buf));
+			if (len <= 0) {
+				close(fds[0].fd);
+				fds[0].fd = -1;
+			}
+			for (ssize_t c = 0; c < len; c++) {
+				if (buf[c] == '\n') {
+					line += pending;
+					if (output)
+						output(line);
+					else if (!line.empty())
+						LOGINFO("%s: %s\n", name.c_str(), line.c_str());
+					Parse_Output(pending);
+					line.clear();
+					pending.clear();
+				} else if (buf[c] == '\r' || buf[c] == '\b') {
+					if (!pending.empty()) {
+						Parse_Output(pending);
+						if (line.empty())
+							line = pending;
+					}
+					pending.clear();
+				} else {
+					pending += buf[c];
+				}
+			}
+			// resize2fs adds X's to its bar without anything in between
+			if (name == "resize2fs" && !pending.empty())
+				Parse_Output(pending);
+		}
+		if (nfds > 1 && fds[1].fd >= 0 && fds[1].revents) {
+			ssize_t len = read(fds[1].fd, buf, sizeof(buf));
+			if (len <= 0) {
+				close(fds[1].fd);
+				fds[1].fd = -1;
+			}
+			for (ssize_t c = 0; c < len; c++) {
+				if (buf[c] == '\n') {
+					Parse_Completion(completion);
+					completion.clear();
+				} else {
+					completion += buf[c];
+				}
+			}
+		}
+	}
+	if (!pending.empty() || !line.empty()) {
+		if (output)
+			output(line + pending);
+		else
+			LOGINFO("%s: %s%s\n", name.c_str(), line.c_str(), pending.c_str());
+	}
+	if (fds[0].fd >= 0)
+		close(fds[0].fd);
+	if (nfds > 1 && fds[1].fd >= 0)
+		close(fds[1].fd);
+
+	if (TWFunc::Wait_For_Child(pid, &status, name) != 0)
+		return -1;
+	Report(1);
+	return 0;
+}
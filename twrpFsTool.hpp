@@ -0,0 +1,62 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_FS_TOOL_HPP
+#define __TWRP_FS_TOOL_HPP
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// Called with the fraction of the work a tool has done, 0 to 1
+typedef std::function<void(float)> twrpFsProgress;
+// Called with each line a tool writes to stdout, without the newline
+typedef std::function<void(const std::string&)> twrpFsOutput;
+
+// Runs one of the filesystem tools (mke2fs, e2fsck, resize2fs, mkfs.f2fs,
+// fsck.f2fs, mkfs.fat...), or any other program the partition code needs,
+// with posix_spawn, without a shell in between. Everything the tool prints
+// goes to the log. When a progress callback is set, e2fsck and fsck.fat are
+// asked for their completion lines on an extra pipe, resize2fs for its
+// progress bars, and "done/total" counters such as the inode table count of
+// mke2fs are picked out of the output. With an output callback, stdout
+// lines go to it instead and stderr straight to the log.
+class twrpFsTool {
+public:
+	twrpFsTool(const std::string& Tool);                               // A full path, or a name looked up in PATH
+	twrpFsTool& Arg(const std::string& Arg);
+	void Set_Progress(twrpFsProgress Progress);
+	void Set_Output(twrpFsOutput Output);
+	std::string Command();                                             // The command line, for the log
+	int Run();                                                         // 0 if the tool exited with 0, -1 otherwise, like TWFunc::Exec_Cmd
+
+private:
+	void Parse_Output(const std::string& Segment);
+	void Parse_Completion(const std::string& Line);
+	void Report(float Done);
+
+	std::string tool;
+	std::string name;                                                  // Tool without its path, picks the progress parsing
+	std::vector<std::string> args;
+	twrpFsProgress progress;
+	twrpFsOutput output;
+	int pass;                                                          // Stage of mke2fs or pass of resize2fs being printed, 0 before the first
+	float reported;                                                    // Progress only moves forward, as the stages of a tool restart their counters
+};
+
+#endif // __TWRP_FS_TOOL_HPP
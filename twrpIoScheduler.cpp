@@ -0,0 +1,262 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <vector>
+#include "twrpIoScheduler.hpp"
+#include "twrpRawCopy.hpp"
+#include "twrpRestorePipeline.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+
+// Reads of the probe, small enough that a disk that only streams one
+// request at a time shows it
+#define TW_IO_PROBE_READ (128 * 1024)
+
+twrpIoScheduler::twrpIoScheduler() {
+	pthread_mutex_init(&lock, NULL);
+}
+
+twrpIoScheduler::~twrpIoScheduler() {
+	std::map<std::string, twrpIoGroup*>::iterator it;
+
+	for (it = groups.begin(); it != groups.end(); it++)
+		delete it->second;
+	pthread_mutex_destroy(&lock);
+}
+
+twrpIoScheduler* twrpIoScheduler::Get() {
+	static twrpIoScheduler scheduler;
+	return &scheduler;
+}
+
+twrpIo_Class twrpIoScheduler::Get_Class(const std::string& Disk) {
+	std::string sysfs = "/sys/block/" + Disk, value;
+	char real[PATH_MAX];
+
+	if (Disk.compare(0, 6, "mmcblk") == 0) {
+		if (TWFunc::read_file(sysfs + "/device/type", value) == 0 && value.compare(0, 2, "SD") == 0)
+			return IO_CLASS_SD;
+		return IO_CLASS_EMMC;
+	}
+	if (Disk.compare(0, 4, "nvme") == 0)
+		return IO_CLASS_NVME;
+	if (TWFunc::read_file(sysfs + "/queue/rotational", value) == 0 && value.compare(0, 1, "1") == 0)
+		return IO_CLASS_ROTATIONAL;
+	if (realpath(sysfs.c_str(), real)) {
+		// USB sticks and card readers on OTG behave like SD cards
+		if (strstr(real, "/usb"))
+			return IO_CLASS_SD;
+		if (strstr(real, "ufs"))
+			return IO_CLASS_UFS;
+	}
+	return IO_CLASS_UNKNOWN;
+}
+
+struct Probe_Reader {
+	int fd;
+	uint64_t offset;
+	bool failed;
+};
+
+static void* Probe_Read(void *cookie) {
+	Probe_Reader* reader = (Probe_Reader*) cookie;
+	void* buf;
+	uint64_t done;
+
+	if (posix_memalign(&buf, TW_RAW_COPY_ALIGN, TW_IO_PROBE_READ) != 0) {
+		reader->failed = true;
+		return NULL;
+	}
+	for (done = 0; done < TW_IO_PROBE_SIZE; done += TW_IO_PROBE_READ) {
+		if (pread(reader->fd, buf, TW_IO_PROBE_READ, reader->offset + done) != TW_IO_PROBE_READ) {
+			reader->failed = true;
+			break;
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+uint64_t twrpIoScheduler::Probe_Rate(const std::string& Block_Device, unsigned Readers) {
+	std::vector<Probe_Reader> readers(Readers);
+	std::vector<pthread_t> threads;
+	uint64_t size = 0, start, usec;
+	unsigned i;
+	bool failed = false;
+
+	// The page cache would hide the disk, so the probe needs O_DIRECT
+	int fd = open(Block_Device.c_str(), O_RDONLY | O_DIRECT | O_LARGEFILE);
+	if (fd < 0)
+		return 0;
+	if (ioctl(fd, BLKGETSIZE64, &size) != 0 || size < (uint64_t) Readers * TW_IO_PROBE_SIZE * 2) {
+		close(fd);
+		return 0;
+	}
+	// Every reader gets its own stretch of the device, and every run other
+	// stretches than the run before
+	for (i = 0; i < Readers; i++) {
+		readers[i].fd = fd;
+		readers[i].offset = (size / Readers * i + (uint64_t) Readers * TW_IO_PROBE_SIZE) & ~((uint64_t) TW_RAW_COPY_ALIGN - 1);
+		if (readers[i].offset + TW_IO_PROBE_SIZE > size)
+			readers[i].offset = (size - TW_IO_PROBE_SIZE) & ~((uint64_t) TW_RAW_COPY_ALIGN - 1);
+		readers[i].failed = false;
+	}
+	start = twrpPipe_Now();
+	for (i = 1; i < Readers; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Probe_Read, &readers[i]) != 0) {
+			readers[i].failed = true;
+			continue;
+		}
+		threads.push_back(thread);
+	}
+	Probe_Read(&readers[0]);
+	for (i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	usec = twrpPipe_Now() - start;
+	close(fd);
+	for (i = 0; i < Readers; i++)
+		failed |= readers[i].failed;
+	if (failed || usec == 0)
+		return 0;
+	return (uint64_t) Readers * TW_IO_PROBE_SIZE * 1000000 / usec;
+}
+
+void twrpIoScheduler::Probe(twrpIoGroup *group, const std::string& Block_Device) {
+	uint64_t rate, best = 0;
+	uint64_t rates[TW_IO_MAX_LANES + 1];
+	unsigned readers, max_lanes = group->Lanes;
+
+	if (max_lanes <= 1)
+		return;
+	for (readers = 1; readers <= max_lanes; readers *= 2) {
+		rate = Probe_Rate(Block_Device, readers);
+		if (rate == 0) {
+			LOGINFO("Unable to probe '%s', keeping %u lanes\n", group->Disk.c_str(), group->Lanes);
+			return;
+		}
+		rates[readers] = rate;
+		if (rate > best)
+			best = rate;
+	}
+	// The fewest readers that come within 10% of the best rate
+	for (readers = 1; readers <= max_lanes; readers *= 2) {
+		if (rates[readers] >= best - best / 10)
+			break;
+	}
+	group->Lanes = readers;
+	LOGINFO("Probe of '%s' read %llu MB/s with one reader, %llu MB/s at best, using %u lanes\n", group->Disk.c_str(),
+		(unsigned long long) rates[1] / 1048576, (unsigned long long) best / 1048576, group->Lanes);
+}
+
+twrpIoGroup* twrpIoScheduler::Group(const std::string& Block_Device) {
+	std::string disk = TWFunc::Get_Block_Disk(Block_Device);
+	std::map<std::string, twrpIoGroup*>::iterator it;
+	twrpIoGroup* group;
+
+	if (disk.empty())
+		return NULL;
+	pthread_mutex_lock(&lock);
+	it = groups.find(disk);
+	if (it != groups.end()) {
+		group = it->second;
+		pthread_mutex_unlock(&lock);
+		return group;
+	}
+	group = new twrpIoGroup;
+	group->Disk = disk;
+	group->Class = Get_Class(disk);
+	group->Solo_Rate = 0;
+	switch (group->Class) {
+		case IO_CLASS_EMMC:
+		case IO_CLASS_SD:
+			group->Lanes = 1;
+			group->Depth = 2;
+			break;
+		case IO_CLASS_ROTATIONAL:
+			group->Lanes = 1;
+			group->Depth = TW_RAW_COPY_BUFFERS;
+			break;
+		case IO_CLASS_UFS:
+			group->Lanes = 4;
+			group->Depth = TW_RAW_COPY_BUFFERS;
+			break;
+		case IO_CLASS_NVME:
+			group->Lanes = TW_IO_MAX_LANES;
+			group->Depth = 8;
+			break;
+		default:
+			group->Lanes = 2;
+			group->Depth = TW_RAW_COPY_BUFFERS;
+			break;
+	}
+	// The probe runs under the lock so a disk is only probed once
+	Probe(group, Block_Device);
+	groups[disk] = group;
+	pthread_mutex_unlock(&lock);
+	LOGINFO("I/O group '%s': class %i, %u lanes, depth %u\n", disk.c_str(), (int) group->Class, group->Lanes, group->Depth);
+	return group;
+}
+
+unsigned twrpIoScheduler::Lanes(const std::string& Block_Device) {
+	twrpIoGroup* group = Group(Block_Device);
+
+	return group ? Lanes(group) : 1;
+}
+
+unsigned twrpIoScheduler::Lanes(twrpIoGroup *group) {
+	unsigned lanes;
+
+	pthread_mutex_lock(&lock);
+	lanes = group->Lanes;
+	pthread_mutex_unlock(&lock);
+	return lanes;
+}
+
+unsigned twrpIoScheduler::Depth(const std::string& Block_Device) {
+	twrpIoGroup* group = Group(Block_Device);
+
+	return group ? group->Depth : TW_RAW_COPY_BUFFERS;
+}
+
+void twrpIoScheduler::Record(twrpIoGroup *group, uint64_t Bytes, uint64_t Usec, unsigned Streams) {
+	uint64_t rate;
+
+	// Short transfers say more about setup time than about the disk
+	if (group == NULL || Usec == 0 || Bytes < 16 * 1024 * 1024)
+		return;
+	rate = Bytes * 1000000 / Usec;
+	pthread_mutex_lock(&lock);
+	if (Streams <= 1) {
+		if (rate > group->Solo_Rate)
+			group->Solo_Rate = rate;
+	} else if (group->Solo_Rate && group->Lanes > 1 && rate * Streams < group->Solo_Rate - group->Solo_Rate / 10) {
+		group->Lanes--;
+		LOGINFO("'%s' moved %llu MB/s with %u streams, less than one stream alone, now %u lanes\n", group->Disk.c_str(),
+			(unsigned long long) (rate * Streams) / 1048576, Streams, group->Lanes);
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,78 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_IO_SCHEDULER_HPP
+#define __TWRP_IO_SCHEDULER_HPP
+
+#include <stdint.h>
+#include <pthread.h>
+#include <map>
+#include <string>
+
+// Most streams a group is given, and the bytes each reader of the probe reads
+#define TW_IO_MAX_LANES 8
+#define TW_IO_PROBE_SIZE (4 * 1024 * 1024)
+
+enum twrpIo_Class {
+	IO_CLASS_UNKNOWN = 0,
+	IO_CLASS_EMMC,
+	IO_CLASS_SD,                                                       // SD cards and USB mass storage
+	IO_CLASS_UFS,
+	IO_CLASS_NVME,
+	IO_CLASS_ROTATIONAL,
+};
+
+// Work on the partitions of one disk. Lanes is how many backup or restore
+// streams, or tar threads, should use the disk at once, Depth how many
+// buffers each stream keeps in flight. eMMC and SD cards get one lane, as
+// their throughput falls apart under parallel small writes, UFS and NVMe
+// start with more and a read probe trims them to what the disk scales to.
+struct twrpIoGroup {
+	std::string Disk;                                                  // e.g. sda or mmcblk0
+	twrpIo_Class Class;
+	unsigned Lanes;
+	unsigned Depth;
+	uint64_t Solo_Rate;                                                // Bytes per second of a stream that had the disk to itself, 0 if none finished yet
+};
+
+// Groups the block devices of the partitions by the disk they are on, read
+// from sysfs, and keeps the settings of each disk for the whole session
+class twrpIoScheduler {
+public:
+	twrpIoScheduler();
+	~twrpIoScheduler();
+	static twrpIoScheduler* Get();
+	twrpIoGroup* Group(const std::string& Block_Device);               // NULL if the disk can't be found, groups stay valid for the session
+	unsigned Lanes(const std::string& Block_Device);                   // 1 for unknown disks
+	unsigned Lanes(twrpIoGroup *group);                                // Current lanes of the group, Record() can lower them
+	unsigned Depth(const std::string& Block_Device);
+	// Counts Bytes a stream moved in Usec while Streams used the group,
+	// and takes a lane away when sharing the disk does worse than one
+	// stream alone
+	void Record(twrpIoGroup *group, uint64_t Bytes, uint64_t Usec, unsigned Streams);
+
+private:
+	static twrpIo_Class Get_Class(const std::string& Disk);
+	static uint64_t Probe_Rate(const std::string& Block_Device, unsigned Readers); // Bytes per second of Readers reading at once, 0 on failure
+	void Probe(twrpIoGroup *group, const std::string& Block_Device);
+
+	std::map<std::string, twrpIoGroup*> groups;
+	pthread_mutex_t lock;
+};
+
+#endif // __TWRP_IO_SCHEDULER_HPP
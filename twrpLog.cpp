@@ -0,0 +1,99 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <unistd.h>
+#include "twrpLog.hpp"
+
+pthread_mutex_t twrpLog::lock = PTHREAD_MUTEX_INITIALIZER;
+std::atomic<int> twrpLog::file_level(TW_LOG_FILES_ALL);
+std::atomic<unsigned long> twrpLog::file_messages(0);
+bool twrpLog::started = false;
+
+static char log_buffer[TW_LOG_BUFFER_SIZE];
+
+void twrpLog::Start() {
+	if (started)
+		return;
+	// stderr stays unbuffered, so errors are in the log right away
+	if (setvbuf(stdout, log_buffer, _IOFBF, sizeof(log_buffer)) != 0)
+		return;
+	pthread_atfork(Before_Fork, After_Fork_Parent, After_Fork_Child);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, Flush_Thread, NULL) != 0) {
+		setvbuf(stdout, NULL, _IONBF, 0);
+		return;
+	}
+	pthread_detach(thread);
+	started = true;
+}
+
+void twrpLog::Flush() {
+	fflush(stdout);
+}
+
+void* twrpLog::Flush_Thread(void* cookie __unused) {
+	for (;;) {
+		usleep(TW_LOG_FLUSH_MS * 1000);
+		pthread_mutex_lock(&lock);
+		fflush(stdout);
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+void twrpLog::Before_Fork() {
+	// The child starts with what is written by now, and the flusher is
+	// kept out of stdout until the fork is done
+	pthread_mutex_lock(&lock);
+	fflush(stdout);
+}
+
+void twrpLog::After_Fork_Parent() {
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpLog::After_Fork_Child() {
+	pthread_mutex_init(&lock, NULL);
+	if (!started)
+		return;
+	// Lines another thread buffered since Before_Fork() belong to the parent
+	__fpurge(stdout);
+	setvbuf(stdout, NULL, _IONBF, 0);
+	started = false;
+}
+
+void twrpLog::Reset_File_Messages(int Level) {
+	file_level = Level;
+	file_messages = 0;
+}
+
+int twrpLog::File_Message() {
+	int level = file_level;
+	if (level >= TW_LOG_FILES_ALL)
+		return 1;
+	if (level <= TW_LOG_FILES_NONE)
+		return 0;
+	unsigned long count = file_messages++;
+	if (count < TW_LOG_FILES_BURST)
+		return 1;
+	if (count == TW_LOG_FILES_BURST)
+		LOGINFO("Logging one in %i of the remaining messages about single files\n", TW_LOG_FILES_EVERY);
+	return (count - TW_LOG_FILES_BURST) % TW_LOG_FILES_EVERY == 0;
+}
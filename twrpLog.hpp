@@ -0,0 +1,65 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_LOG_HPP
+#define __TWRP_LOG_HPP
+
+#include <pthread.h>
+#include <atomic>
+#include "twcommon.h"
+
+#define TW_LOG_BUFFER_SIZE (64 * 1024)
+#define TW_LOG_FLUSH_MS 100
+
+#define TW_LOG_FILES_NONE 0                                        // Messages about single files are left out
+#define TW_LOG_FILES_SOME 1                                        // The first TW_LOG_FILES_BURST, then every TW_LOG_FILES_EVERYth
+#define TW_LOG_FILES_ALL 2
+#define TW_LOG_FILES_BURST 200
+#define TW_LOG_FILES_EVERY 1000
+
+// A message for each file of a backup or restore, thinned out by the level
+#define LOGFILE(...) do { if (twrpLog::File_Message()) LOGINFO(__VA_ARGS__); } while (0)
+
+// The recovery log without a write for every line. stdout and stderr both
+// go to TMP_LOG_FILE; Start() gives stdout a buffer that a thread flushes
+// every TW_LOG_FLUSH_MS, so a line costs a copy instead of a write, and
+// leaves stderr unbuffered for errors. Copy the log only after Flush(). Forked children drop what they inherited
+// and go back to unbuffered output, as they don't have the thread and
+// often end with _exit(). Messages about single files are counted,
+// and past a burst only a sample of them is kept at TW_LOG_FILES_SOME, so
+// a backup of a million files doesn't write a million lines.
+class twrpLog {
+public:
+	static void Start();
+	static void Flush();
+	static void Reset_File_Messages(int Level);                        // TW_LOG_FILES_*, at the start of an operation
+	static int File_Message();                                         // Whether to log the next message about a file, nonzero to log it
+
+private:
+	static void* Flush_Thread(void* cookie);
+	static void Before_Fork();
+	static void After_Fork_Parent();
+	static void After_Fork_Child();
+
+	static pthread_mutex_t lock;                                       // Held by the flusher while it writes, and across fork()
+	static std::atomic<int> file_level;
+	static std::atomic<unsigned long> file_messages;
+	static bool started;
+};
+
+#endif // __TWRP_LOG_HPP
@@ -0,0 +1,282 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "twrpManifest.hpp"
+#include "twcommon.h"
+
+// Version 2 added ctime and keeps both times in nanoseconds
+#define TW_MANIFEST_HEADER "twrp-manifest 2"
+#define TW_MANIFEST_HEADER_V1 "twrp-manifest 1"
+
+twrpManifest::twrpManifest() {
+	sorted = true;
+}
+
+bool twrpManifest::Load(const std::string& Path) {
+	FILE* in;
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t r;
+	bool ret = true, v1 = false;
+
+	entries.clear();
+	in = fopen(Path.c_str(), "r");
+	if (in == NULL) {
+		LOGINFO("Unable to open manifest '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	r = getline(&line, &len, in);
+	if (r >= 0 && strncmp(line, TW_MANIFEST_HEADER_V1, strlen(TW_MANIFEST_HEADER_V1)) == 0) {
+		// Whole second mtimes and no ctime, its files never count as unchanged
+		v1 = true;
+	} else if (r < 0 || strncmp(line, TW_MANIFEST_HEADER, strlen(TW_MANIFEST_HEADER)) != 0) {
+		LOGINFO("'%s' is not a manifest\n", Path.c_str());
+		ret = false;
+	}
+	while (ret && (r = getline(&line, &len, in)) > 0) {
+		twrpManifestEntry Entry;
+		unsigned long long size, mtime, ctime = 0, inode;
+		char type, hash[64];
+		int path_pos = 0, fields;
+
+		if (line[r - 1] == '\n')
+			line[--r] = 0;
+		// The path follows the hash after exactly one space, it can begin with more
+		if (v1)
+			fields = sscanf(line, "%c %llu %llu %llu %63s%n", &type, &size, &mtime, &inode, hash, &path_pos) + 1;
+		else
+			fields = sscanf(line, "%c %llu %llu %llu %llu %63s%n", &type, &size, &mtime, &ctime, &inode, hash, &path_pos);
+		if (fields != 6 || path_pos == 0 || line[path_pos] != ' ') {
+			LOGINFO("Bad line in manifest '%s': '%s'\n", Path.c_str(), line);
+			ret = false;
+			break;
+		}
+		if (type == 'd')
+			Entry.type = DT_DIR;
+		else if (type == 'l')
+			Entry.type = DT_LNK;
+		else
+			Entry.type = DT_REG;
+		Entry.size = size;
+		Entry.mtime = v1 ? mtime * 1000000000ULL : mtime;
+		Entry.ctime = ctime;
+		Entry.inode = inode;
+		if (strcmp(hash, "-") != 0)
+			Entry.hash = hash;
+		Entry.fn = Unescape(line + path_pos + 1);
+		entries.push_back(Entry);
+	}
+	free(line);
+	fclose(in);
+	if (!ret) {
+		entries.clear();
+		return false;
+	}
+	sorted = false;
+	Sort();
+	LOGINFO("Loaded %zu items from manifest '%s'\n", entries.size(), Path.c_str());
+	return true;
+}
+
+bool twrpManifest::Save(const std::string& Path) {
+	FILE* out;
+	size_t i;
+	char type;
+
+	Sort();
+	out = fopen(Path.c_str(), "w");
+	if (out == NULL) {
+		LOGINFO("Unable to create manifest '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	fprintf(out, "%s\n", TW_MANIFEST_HEADER);
+	for (i = 0; i < entries.size(); i++) {
+		const twrpManifestEntry& Entry = entries[i];
+		if (Entry.type == DT_DIR)
+			type = 'd';
+		else if (Entry.type == DT_LNK)
+			type = 'l';
+		else
+			type = 'f';
+		fprintf(out, "%c %llu %llu %llu %llu %s %s\n", type, (unsigned long long)Entry.size, (unsigned long long)Entry.mtime,
+			(unsigned long long)Entry.ctime, (unsigned long long)Entry.inode, Entry.hash.empty() ? "-" : Entry.hash.c_str(), Escape(Entry.fn).c_str());
+	}
+	if (fclose(out) != 0) {
+		LOGINFO("Error writing manifest '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+void twrpManifest::Add(const twrpScanEntry& Entry) {
+	twrpManifestEntry Item;
+
+	Item.fn = Entry.fn;
+	Item.type = Entry.type;
+	Item.size = Entry.type == DT_REG ? Entry.size : 0;
+	Item.mtime = Entry.mtime;
+	Item.ctime = Entry.ctime;
+	Item.inode = Entry.inode;
+	entries.push_back(Item);
+	sorted = false;
+}
+
+const twrpManifestEntry& twrpManifest::Get(size_t index) {
+	return entries[index];
+}
+
+void twrpManifest::Set_Hash(size_t index, const std::string& hash) {
+	entries[index].hash = hash;
+}
+
+void twrpManifest::Sort() {
+	if (!sorted)
+		std::sort(entries.begin(), entries.end(), Compare_Entries);
+	sorted = true;
+}
+
+const twrpManifestEntry* twrpManifest::Find(const std::string& fn) {
+	std::vector<twrpManifestEntry>::const_iterator it = std::lower_bound(entries.begin(), entries.end(), fn, Compare_Path);
+	if (it == entries.end() || it->fn != fn)
+		return NULL;
+	return &(*it);
+}
+
+bool twrpManifest::Unchanged(const twrpScanEntry& Entry, std::string *hash) {
+	if (Entry.type != DT_REG)
+		return false;
+	const twrpManifestEntry* Item = Find(Entry.fn);
+	// Without a hash the base did not archive the file as it was scanned
+	if (Item == NULL || Item->type != DT_REG || Item->hash.empty() || Item->ctime == 0)
+		return false;
+	// A file rewritten in place keeps its inode and can keep its size, and
+	// its mtime can be set back, but the ctime still moves
+	if (Item->size != Entry.size || Item->mtime != Entry.mtime || Item->ctime != Entry.ctime || Item->inode != Entry.inode)
+		return false;
+	*hash = Item->hash;
+	return true;
+}
+
+void twrpManifest::Get_Deleted(twrpManifest *Base, std::vector<std::string> *Deleted) {
+	size_t i, j = 0;
+
+	Sort();
+	Base->Sort();
+	for (i = 0; i < Base->entries.size(); i++) {
+		const twrpManifestEntry& Old = Base->entries[i];
+		while (j < entries.size() && entries[j].fn < Old.fn)
+			j++;
+		// A path that is now a different type is removed before the new one is restored
+		if (j == entries.size() || entries[j].fn != Old.fn || entries[j].type != Old.type)
+			Deleted->push_back(Old.fn);
+	}
+}
+
+size_t twrpManifest::Size() {
+	return entries.size();
+}
+
+bool twrpManifest::Save_List(const std::string& Path, const std::vector<std::string>& List) {
+	FILE* out;
+	size_t i;
+
+	out = fopen(Path.c_str(), "w");
+	if (out == NULL) {
+		LOGINFO("Unable to create '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	for (i = 0; i < List.size(); i++)
+		fprintf(out, "%s\n", Escape(List[i]).c_str());
+	if (fclose(out) != 0) {
+		LOGINFO("Error writing '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool twrpManifest::Load_List(const std::string& Path, std::vector<std::string> *List) {
+	FILE* in;
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t r;
+
+	in = fopen(Path.c_str(), "r");
+	if (in == NULL) {
+		LOGINFO("Unable to open '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	while ((r = getline(&line, &len, in)) > 0) {
+		if (line[r - 1] == '\n')
+			line[--r] = 0;
+		if (r > 0)
+			List->push_back(Unescape(line));
+	}
+	free(line);
+	fclose(in);
+	return true;
+}
+
+bool twrpManifest::Compare_Entries(const twrpManifestEntry& a, const twrpManifestEntry& b) {
+	return a.fn < b.fn;
+}
+
+bool twrpManifest::Compare_Path(const twrpManifestEntry& a, const std::string& fn) {
+	return a.fn < fn;
+}
+
+// Paths are stored one per line, so newlines in file names are escaped
+std::string twrpManifest::Escape(const std::string& Path) {
+	std::string ret;
+	size_t i;
+
+	ret.reserve(Path.size());
+	for (i = 0; i < Path.size(); i++) {
+		if (Path[i] == '\\')
+			ret += "\\\\";
+		else if (Path[i] == '\n')
+			ret += "\\n";
+		else
+			ret += Path[i];
+	}
+	return ret;
+}
+
+std::string twrpManifest::Unescape(const std::string& Path) {
+	std::string ret;
+	size_t i;
+
+	ret.reserve(Path.size());
+	for (i = 0; i < Path.size(); i++) {
+		if (Path[i] == '\\' && i + 1 < Path.size()) {
+			i++;
+			ret += Path[i] == 'n' ? '\n' : Path[i];
+		} else {
+			ret += Path[i];
+		}
+	}
+	return ret;
+}
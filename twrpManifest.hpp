@@ -0,0 +1,68 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_MANIFEST_HPP
+#define __TWRP_MANIFEST_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "twrpScan.hpp"
+
+struct twrpManifestEntry {
+	std::string fn;                                                         // Full path
+	unsigned char type;                                                     // DT_DIR, DT_REG or DT_LNK
+	uint64_t size;
+	uint64_t mtime;                                                         // Nanoseconds
+	uint64_t ctime;                                                         // Nanoseconds, 0 in version 1 manifests
+	uint64_t inode;
+	std::string hash;                                                       // md5 of regular files, empty for folders and links
+};
+
+// The list of items in a backup, stored next to the archives as
+// <name>.manifest. An incremental backup compares the current scan against
+// the manifest of an earlier backup and only archives the files that are
+// new or changed. Paths that are gone are written to <name>.deleted.
+class twrpManifest {
+public:
+	twrpManifest();
+	bool Load(const std::string& Path);                                     // Loads and sorts, false if the file is missing or bad
+	bool Save(const std::string& Path);                                     // Sorts and writes
+	void Add(const twrpScanEntry& Entry);                                   // Adds a scanned item without a hash
+	const twrpManifestEntry& Get(size_t index);
+	void Set_Hash(size_t index, const std::string& hash);                   // index is the order of Add(), only valid before Sort()
+	void Sort();
+	const twrpManifestEntry* Find(const std::string& fn);                   // Needs a sorted manifest, NULL if not found
+	bool Unchanged(const twrpScanEntry& Entry, std::string *hash);          // True if Entry is a file with the same size, mtime, ctime and inode
+	void Get_Deleted(twrpManifest *Base, std::vector<std::string> *Deleted); // Paths in Base that are gone or changed type
+	size_t Size();
+
+	static bool Save_List(const std::string& Path, const std::vector<std::string>& List);
+	static bool Load_List(const std::string& Path, std::vector<std::string> *List);
+	static std::string Escape(const std::string& Path);                     // Paths are stored one per line
+	static std::string Unescape(const std::string& Path);
+
+private:
+	static bool Compare_Entries(const twrpManifestEntry& a, const twrpManifestEntry& b);
+	static bool Compare_Path(const twrpManifestEntry& a, const std::string& fn);
+
+	std::vector<twrpManifestEntry> entries;
+	bool sorted;
+};
+
+#endif // __TWRP_MANIFEST_HPP
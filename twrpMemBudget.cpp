@@ -0,0 +1,150 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "twrpMemBudget.hpp"
+#include "twcommon.h"
+
+#define MEMINFO "/proc/meminfo"
+// Used when /proc/meminfo can't be read
+#define TW_MEM_FALLBACK_BUDGET (64 * 1024 * 1024)
+
+twrpMemBudget::twrpMemBudget() {
+	pthread_mutex_init(&lock, NULL);
+	budget = 0;
+	granted = 0;
+	Update();
+	LOGINFO("twrpMemBudget: %zuMB of %zuMB\n", budget / 1048576, Read_Meminfo("MemTotal") / 1048576);
+}
+
+twrpMemBudget::~twrpMemBudget() {
+	pthread_mutex_destroy(&lock);
+}
+
+twrpMemBudget* twrpMemBudget::Get() {
+	static twrpMemBudget mem_budget;
+	return &mem_budget;
+}
+
+size_t twrpMemBudget::Read_Meminfo(const char* Field) {
+	FILE* fp = fopen(MEMINFO, "r");
+	char line[128];
+	size_t len = strlen(Field);
+	unsigned long long kb = 0;
+
+	if (fp == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, Field, len) == 0 && line[len] == ':') {
+			sscanf(line + len + 1, "%llu", &kb);
+			break;
+		}
+	}
+	fclose(fp);
+	return (size_t) (kb * 1024);
+}
+
+void twrpMemBudget::Update() {
+#ifdef TW_MEM_BUDGET_MB
+	budget = (size_t) TW_MEM_BUDGET_MB * 1048576;
+#else
+	size_t available = Read_Meminfo("MemAvailable");
+	// Kernels before 3.14 have no MemAvailable
+	if (available == 0)
+		available = Read_Meminfo("MemFree") + Read_Meminfo("Cached");
+	if (available == 0)
+		budget = TW_MEM_FALLBACK_BUDGET;
+	else
+		budget = available / 100 * TW_MEM_BUDGET_PERCENT;
+#endif
+}
+
+size_t twrpMemBudget::Grant(const char* Who, size_t Want, size_t Min) {
+	size_t left, bytes;
+
+	if (Min > Want)
+		Min = Want;
+	pthread_mutex_lock(&lock);
+	if (granted == 0)
+		Update();
+	left = budget > granted ? budget - granted : 0;
+	bytes = Want < left ? Want : left;
+	if (bytes < Min)
+		bytes = Min;
+	granted += bytes;
+	pthread_mutex_unlock(&lock);
+	if (bytes < Want)
+		LOGINFO("twrpMemBudget: %s gets %zuKB of the %zuKB it asked for\n", Who, bytes / 1024, Want / 1024);
+	return bytes;
+}
+
+void twrpMemBudget::Release(size_t Bytes) {
+	pthread_mutex_lock(&lock);
+	granted = Bytes < granted ? granted - Bytes : 0;
+	pthread_mutex_unlock(&lock);
+}
+
+size_t twrpMemBudget::Budget() {
+	pthread_mutex_lock(&lock);
+	size_t ret = budget;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+size_t twrpMemBudget::Granted() {
+	pthread_mutex_lock(&lock);
+	size_t ret = granted;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+twrpMemGrant::twrpMemGrant() {
+	bytes = 0;
+}
+
+twrpMemGrant::~twrpMemGrant() {
+	Release();
+}
+
+size_t twrpMemGrant::Take(const char* Who, size_t Want, size_t Min) {
+	Release();
+	bytes = twrpMemBudget::Get()->Grant(Who, Want, Min);
+	return bytes;
+}
+
+unsigned twrpMemGrant::Take_Units(const char* Who, size_t Unit, unsigned Want, unsigned Min) {
+	if (Unit == 0)
+		return Want;
+	Take(Who, Unit * Want, Unit * Min);
+	// Only whole units are used, so the rest goes back
+	unsigned units = bytes / Unit;
+	twrpMemBudget::Get()->Release(bytes - units * Unit);
+	bytes = units * Unit;
+	return units;
+}
+
+void twrpMemGrant::Release() {
+	if (bytes != 0)
+		twrpMemBudget::Get()->Release(bytes);
+	bytes = 0;
+}
+
+size_t twrpMemGrant::Size() {
+	return bytes;
+}
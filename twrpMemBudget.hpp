@@ -0,0 +1,78 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_MEM_BUDGET_HPP
+#define __TWRP_MEM_BUDGET_HPP
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Percent of MemAvailable the buffers, caches and worker pools may use
+// together, set with TW_MEM_BUDGET_PERCENT in BoardConfig.mk. The rest is
+// left for the kernel, the page cache and the files unpacked to /tmp.
+#ifndef TW_MEM_BUDGET_PERCENT
+#define TW_MEM_BUDGET_PERCENT 50
+#endif
+// TW_MEM_BUDGET_MB in BoardConfig.mk sets the budget instead, for devices
+// where MemAvailable is known to be misleading
+
+// Shares one memory budget between the parts of recovery that size their
+// buffers, caches and worker pools by how much RAM there is: the raw image
+// copy ring, the compression workers, the font caches and the sideload
+// block cache. Each asks for what it would like and the least it can work
+// with, and gets what is left of the budget between the two. The least is
+// always granted, so nothing fails for lack of budget, it only runs at its
+// smallest. The budget is read from /proc/meminfo again whenever nothing
+// is granted, so it follows what /tmp and the GUI have taken meanwhile.
+// Every process has its own budget; a forked child starts with the
+// parent's grants counted.
+class twrpMemBudget {
+public:
+	static twrpMemBudget* Get();
+	size_t Grant(const char* Who, size_t Want, size_t Min);            // Bytes between Min and Want
+	void Release(size_t Bytes);
+	size_t Budget();
+	size_t Granted();
+
+private:
+	twrpMemBudget();
+	~twrpMemBudget();
+	void Update();                                                     // Lock held
+	static size_t Read_Meminfo(const char* Field);                     // Bytes, 0 if it can't be read
+
+	size_t budget;
+	size_t granted;
+	pthread_mutex_t lock;
+};
+
+// A grant that is released when it goes out of scope, or when the next one
+// is taken in its place
+class twrpMemGrant {
+public:
+	twrpMemGrant();
+	~twrpMemGrant();
+	size_t Take(const char* Who, size_t Want, size_t Min);
+	unsigned Take_Units(const char* Who, size_t Unit, unsigned Want, unsigned Min); // Whole units of Unit bytes, at least Min
+	void Release();
+	size_t Size();
+
+private:
+	size_t bytes;
+};
+
+#endif // __TWRP_MEM_BUDGET_HPP
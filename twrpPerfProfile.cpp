@@ -0,0 +1,297 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <set>
+#include <sstream>
+#include "twrpPerfProfile.hpp"
+#include "twrpThermal.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+#include "cutils/properties.h"
+
+#define CPU_DIR "/sys/devices/system/cpu/"
+#define BLOCK_DIR "/sys/block/"
+#define VM_DIR "/proc/sys/vm/"
+
+static const char* operation_names[PERF_OPERATIONS] = {
+	"idle",
+	"backup",
+	"restore",
+	"install",
+	"wipe",
+};
+
+// Used for each operation TW_PERF_PROFILE_FILE doesn't name. Backups read
+// whole partitions in order, so they get a long read ahead
+static const char* builtin_profiles[] = {
+	"backup governor performance",
+	"backup read_ahead_kb 2048",
+	"restore governor performance",
+	"install governor performance",
+	"wipe governor performance",
+	NULL
+};
+
+twrpPerfProfile::twrpPerfProfile() {
+	std::vector<std::string> lines;
+
+	pthread_mutex_init(&lock, NULL);
+	active = 0;
+	for (int i = 0; builtin_profiles[i] != NULL; i++)
+		lines.push_back(builtin_profiles[i]);
+	Load(lines, false);
+	lines.clear();
+	if (TWFunc::read_file(TW_PERF_PROFILE_FILE, lines) == 0) {
+		LOGINFO("reading %s\n", TW_PERF_PROFILE_FILE);
+		Load(lines, true);
+	}
+	for (int i = 0; i < PERF_OPERATIONS; i++) {
+		if (!profiles[i].empty())
+			LOGINFO("twrpPerfProfile: %zu settings for %s\n", profiles[i].size(), operation_names[i]);
+	}
+}
+
+twrpPerfProfile::~twrpPerfProfile() {
+	pthread_mutex_destroy(&lock);
+}
+
+twrpPerfProfile* twrpPerfProfile::Get() {
+	static twrpPerfProfile profile;
+	return &profile;
+}
+
+void twrpPerfProfile::Load(const std::vector<std::string>& Lines, bool Replace) {
+	bool replaced[PERF_OPERATIONS] = { false };
+
+	for (size_t l = 0; l < Lines.size(); l++) {
+		std::string line = Lines[l].substr(0, Lines[l].find('#'));
+		std::istringstream fields(line);
+		std::string name, setting, value, disk;
+		int op;
+
+		if (!(fields >> name))
+			continue;
+		for (op = 0; op < PERF_OPERATIONS; op++) {
+			if (name == operation_names[op])
+				break;
+		}
+		if (op == PERF_OPERATIONS || !(fields >> setting)) {
+			LOGINFO("twrpPerfProfile: ignoring '%s'\n", Lines[l].c_str());
+			continue;
+		}
+		if (Replace && !replaced[op]) {
+			profiles[op].clear();
+			replaced[op] = true;
+		}
+		if (setting == "none")
+			continue;
+		if (!(fields >> value)) {
+			LOGINFO("twrpPerfProfile: no value in '%s'\n", Lines[l].c_str());
+			continue;
+		}
+		fields >> disk;
+		Add((twrpPerf_Operation) op, setting, value, disk);
+	}
+}
+
+void twrpPerfProfile::Add(twrpPerf_Operation Operation, const std::string& Name, const std::string& Value, const std::string& Disk) {
+	std::vector<Setting>& profile = profiles[Operation];
+	Setting setting;
+
+	setting.Value = Value;
+	setting.Write = true;
+	setting.Failed = false;
+	if (Name == "expect") {
+		// expect <path> <value>
+		setting.Path = Value;
+		setting.Value = Disk;
+		setting.Write = false;
+		if (!setting.Value.empty())
+			profile.push_back(setting);
+	} else if (Name == "governor" || Name == "min_freq" || Name == "max_freq") {
+		std::string file = Name == "governor" ? "scaling_governor" : "scaling_" + Name;
+		std::set<std::string> policies;
+		DIR* d = opendir(CPU_DIR);
+		struct dirent* de;
+
+		if (d == NULL)
+			return;
+		while ((de = readdir(d)) != NULL) {
+			if (strncmp(de->d_name, "cpu", 3) != 0 || de->d_name[3] < '0' || de->d_name[3] > '9')
+				continue;
+			// CPUs of a cluster share their cpufreq policy
+			std::string dir = std::string(CPU_DIR) + de->d_name + "/cpufreq";
+			char real[PATH_MAX];
+			if (realpath(dir.c_str(), real) == NULL || !policies.insert(real).second)
+				continue;
+			setting.Path = dir + "/" + file;
+			setting.Value = Value;
+			if (Value == "min" || Value == "max") {
+				setting.Value = Read_Value(dir + "/cpuinfo_" + Value + "_freq");
+				if (setting.Value.empty())
+					continue;
+			}
+			if (access(setting.Path.c_str(), F_OK) == 0)
+				profile.push_back(setting);
+		}
+		closedir(d);
+	} else if (Name == "scheduler" || Name == "read_ahead_kb" || Name == "nr_requests") {
+		DIR* d = opendir(BLOCK_DIR);
+		struct dirent* de;
+
+		if (d == NULL)
+			return;
+		while ((de = readdir(d)) != NULL) {
+			if (de->d_name[0] == '.')
+				continue;
+			if (Disk.empty()) {
+				// Disks only, the queues of virtual devices don't reach the flash
+				if (strncmp(de->d_name, "loop", 4) == 0 || strncmp(de->d_name, "ram", 3) == 0 || strncmp(de->d_name, "zram", 4) == 0 || strncmp(de->d_name, "dm-", 3) == 0)
+					continue;
+			} else if (Disk != de->d_name)
+				continue;
+			setting.Path = std::string(BLOCK_DIR) + de->d_name + "/queue/" + Name;
+			if (access(setting.Path.c_str(), F_OK) == 0)
+				profile.push_back(setting);
+		}
+		closedir(d);
+	} else if (Name.compare(0, 6, "dirty_") == 0) {
+		setting.Path = VM_DIR + Name;
+		profile.push_back(setting);
+	} else if (Name[0] == '/') {
+		setting.Path = Name;
+		profile.push_back(setting);
+	} else
+		LOGINFO("twrpPerfProfile: unknown setting '%s' for %s\n", Name.c_str(), operation_names[Operation]);
+}
+
+std::string twrpPerfProfile::Read_Value(const std::string& Path) {
+	char buf[512];
+	int fd = open(Path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return "";
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return "";
+	buf[len] = '\0';
+
+	std::string value(buf);
+	size_t open_pos = value.find('['), close_pos = value.find(']');
+	if (open_pos != std::string::npos && close_pos != std::string::npos && close_pos > open_pos)
+		return value.substr(open_pos + 1, close_pos - open_pos - 1);
+	size_t start = value.find_first_not_of(" \t\n");
+	if (start == std::string::npos)
+		return "";
+	return value.substr(start, value.find_last_not_of(" \t\n") - start + 1);
+}
+
+void twrpPerfProfile::Apply(twrpPerf_Operation Operation, bool Save) {
+	std::vector<Setting>& profile = profiles[Operation];
+
+	for (size_t i = 0; i < profile.size(); i++) {
+		if (!profile[i].Write)
+			continue;
+		if (Save) {
+			size_t s;
+			for (s = 0; s < saved.size(); s++) {
+				if (saved[s].Path == profile[i].Path)
+					break;
+			}
+			if (s == saved.size()) {
+				Setting old = profile[i];
+				old.Value = Read_Value(old.Path);
+				if (!old.Value.empty())
+					saved.push_back(old);
+			}
+		}
+		int fd = open(profile[i].Path.c_str(), O_WRONLY | O_TRUNC);
+		profile[i].Failed = fd < 0 || write(fd, profile[i].Value.c_str(), profile[i].Value.size()) < 0;
+		if (profile[i].Failed)
+			LOGINFO("twrpPerfProfile: unable to set %s to %s: %s\n", profile[i].Path.c_str(), profile[i].Value.c_str(), strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		// A value the kernel took but changed, like a clamped frequency,
+		// won't read back however long we wait
+		if (!profile[i].Failed && Read_Value(profile[i].Path) != profile[i].Value) {
+			LOGINFO("twrpPerfProfile: %s reads back as %s instead of %s\n", profile[i].Path.c_str(), Read_Value(profile[i].Path).c_str(), profile[i].Value.c_str());
+			profile[i].Failed = true;
+		}
+	}
+}
+
+void twrpPerfProfile::Wait_Ready(twrpPerf_Operation Operation) {
+	std::vector<Setting>& profile = profiles[Operation];
+	uint64_t start = twrpThermal::Now_Usec();
+
+	for (;;) {
+		size_t pending = 0;
+		for (size_t i = 0; i < profile.size(); i++) {
+			if (!profile[i].Failed && Read_Value(profile[i].Path) != profile[i].Value)
+				pending++;
+		}
+		if (pending == 0)
+			return;
+		if (twrpThermal::Now_Usec() - start >= (uint64_t) TW_PERF_READY_MS * 1000) {
+			LOGINFO("twrpPerfProfile: %zu settings for %s did not take\n", pending, operation_names[Operation]);
+			return;
+		}
+		usleep(TW_PERF_POLL_MS * 1000);
+	}
+}
+
+void twrpPerfProfile::Idle() {
+	pthread_mutex_lock(&lock);
+	// The idle profile is what the device goes back to, so it isn't saved
+	if (active == 0)
+		Apply(PERF_IDLE, false);
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpPerfProfile::Enter(twrpPerf_Operation Operation) {
+	pthread_mutex_lock(&lock);
+	if (active++ == 0)
+		property_set("recovery.perf.mode", "1");
+	Apply(Operation, true);
+	Wait_Ready(Operation);
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpPerfProfile::Leave(twrpPerf_Operation Operation __unused) {
+	pthread_mutex_lock(&lock);
+	if (active > 0 && --active == 0) {
+		// Backwards, so pairs like min_freq and max_freq never cross
+		for (size_t i = saved.size(); i > 0; i--) {
+			int fd = open(saved[i - 1].Path.c_str(), O_WRONLY | O_TRUNC);
+			if (fd < 0 || write(fd, saved[i - 1].Value.c_str(), saved[i - 1].Value.size()) < 0)
+				LOGINFO("twrpPerfProfile: unable to put back %s: %s\n", saved[i - 1].Path.c_str(), strerror(errno));
+			if (fd >= 0)
+				close(fd);
+		}
+		saved.clear();
+		property_set("recovery.perf.mode", "0");
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,87 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_PERF_PROFILE_HPP
+#define __TWRP_PERF_PROFILE_HPP
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+#define TW_PERF_PROFILE_FILE "/etc/twrp.perf"
+#define TW_PERF_READY_MS 500                                       // Longest wait for the settings to read back
+#define TW_PERF_POLL_MS 10
+
+enum twrpPerf_Operation {
+	PERF_IDLE = 0,                                                     // The GUI waiting for the user
+	PERF_BACKUP,
+	PERF_RESTORE,
+	PERF_INSTALL,
+	PERF_WIPE,
+	PERF_OPERATIONS
+};
+
+// Tunes the CPU, the block devices and writeback for each kind of
+// operation. The profiles are lines of
+//   <operation> <setting> <value> [<disk>]
+// with the operations idle, backup, restore, install and wipe. Settings
+// are governor, min_freq and max_freq (a number, or min or max of the CPU)
+// for every CPU, scheduler, read_ahead_kb and nr_requests for every disk
+// or just the one named, dirty_ratio, dirty_background_ratio,
+// dirty_expire_centisecs and dirty_writeback_centisecs, or the full path
+// of any other file. A setting of "expect" only waits for the file at the
+// path to read back the value, for what init changes on recovery.perf.mode.
+// "<operation> none" drops the operation's profile. A device tree can
+// put its own profiles in TW_PERF_PROFILE_FILE; each operation it names
+// replaces the built in profile of that operation.
+//
+// Enter() writes the profile of an operation, saving what it replaces,
+// and Leave() of the last running operation puts the saved values back.
+// Both keep recovery.perf.mode up to date for init. Instead of a fixed
+// sleep, Enter() waits until sysfs shows the settings, for at most
+// TW_PERF_READY_MS.
+class twrpPerfProfile {
+public:
+	static twrpPerfProfile* Get();
+	void Idle();                                                       // Apply the idle profile, once the GUI is up
+	void Enter(twrpPerf_Operation Operation);
+	void Leave(twrpPerf_Operation Operation);
+
+private:
+	struct Setting {
+		std::string Path;
+		std::string Value;
+		bool Write;                                                    // False to only wait for Value
+		bool Failed;                                                   // Couldn't be set, so not waited for
+	};
+
+	twrpPerfProfile();
+	~twrpPerfProfile();
+	void Load(const std::vector<std::string>& Lines, bool Replace);
+	void Add(twrpPerf_Operation Operation, const std::string& Name, const std::string& Value, const std::string& Disk);
+	void Apply(twrpPerf_Operation Operation, bool Save);
+	void Wait_Ready(twrpPerf_Operation Operation);
+	static std::string Read_Value(const std::string& Path);           // Trimmed, the selected choice of lists like scheduler
+
+	std::vector<Setting> profiles[PERF_OPERATIONS];
+	std::vector<Setting> saved;                                        // Values before the first running operation, in the order they were saved
+	unsigned active;                                                   // Operations between Enter() and Leave()
+	pthread_mutex_t lock;
+};
+
+#endif // __TWRP_PERF_PROFILE_HPP
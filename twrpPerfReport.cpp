@@ -0,0 +1,232 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "twrpPerfReport.hpp"
+#include "twrpTarProgress.hpp"
+#include "data.hpp"
+#include "set_metadata.h"
+#include "twcommon.h"
+#include "variables.h"
+#include "cutils/properties.h"
+
+static const char* time_names[TW_PERF_TIMES] = {
+	"scan",
+	"compress",
+	"encrypt",
+	"digest",
+	"write",
+};
+
+twrpPerfReport::twrpPerfReport(const std::string& Operation) {
+	pthread_mutex_init(&lock, NULL);
+	operation = Operation;
+	started = time(NULL);
+	start_usec = Now_Usec();
+	cpu_start_usec = Cpu_Usec(true);
+}
+
+twrpPerfReport::~twrpPerfReport() {
+	pthread_mutex_destroy(&lock);
+}
+
+uint64_t twrpPerfReport::Now_Usec() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+uint64_t twrpPerfReport::Cpu_Usec(bool Whole_Process) {
+	struct rusage self, children;
+	uint64_t total = 0;
+
+	if (getrusage(Whole_Process ? RUSAGE_SELF : RUSAGE_THREAD, &self) == 0)
+		total += (uint64_t) (self.ru_utime.tv_sec + self.ru_stime.tv_sec) * 1000000 + self.ru_utime.tv_usec + self.ru_stime.tv_usec;
+	// The tar processes count once they are reaped
+	if (getrusage(RUSAGE_CHILDREN, &children) == 0)
+		total += (uint64_t) (children.ru_utime.tv_sec + children.ru_stime.tv_sec) * 1000000 + children.ru_utime.tv_usec + children.ru_stime.tv_usec;
+	return total;
+}
+
+std::string twrpPerfReport::Quote(const std::string& Value) {
+	std::string ret = "\"";
+	char buf[8];
+
+	for (size_t i = 0; i < Value.size(); i++) {
+		unsigned char c = Value[i];
+		if (c == '"' || c == '\\') {
+			ret += '\\';
+			ret += c;
+		} else if (c < 0x20) {
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			ret += buf;
+		} else
+			ret += c;
+	}
+	return ret + "\"";
+}
+
+void twrpPerfReport::Setting(const std::string& Var) {
+	std::string value = DataManager::GetStrValue(Var);
+
+	pthread_mutex_lock(&lock);
+	settings.push_back(std::make_pair(Var, value));
+	pthread_mutex_unlock(&lock);
+}
+
+// Caller holds lock
+twrpPerfReport::Partition* twrpPerfReport::Current() {
+	pid_t tid = (pid_t) syscall(SYS_gettid);
+
+	for (size_t i = partitions.size(); i > 0; i--) {
+		if (partitions[i - 1].thread == tid)
+			return &partitions[i - 1];
+	}
+	return NULL;
+}
+
+void twrpPerfReport::Begin_Partition(const std::string& Name, const std::string& Method) {
+	Partition part;
+
+	part.name = Name;
+	part.method = Method;
+	part.thread = (pid_t) syscall(SYS_gettid);
+	part.ok = false;
+	part.tar = false;
+	part.bytes = 0;
+	part.files = 0;
+	part.threads = 1;
+	part.wall_usec = 0;
+	part.cpu_usec = 0;
+	memset(part.time_usec, 0, sizeof(part.time_usec));
+	part.cpu_start_usec = Cpu_Usec(false);
+	part.start_usec = Now_Usec();
+	pthread_mutex_lock(&lock);
+	partitions.push_back(part);
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpPerfReport::End_Partition(unsigned long long Bytes, bool Ok) {
+	uint64_t now = Now_Usec(), cpu = Cpu_Usec(false);
+
+	pthread_mutex_lock(&lock);
+	Partition* part = Current();
+	if (part != NULL) {
+		part->thread = 0;
+		part->ok = Ok;
+		if (!part->tar)
+			part->bytes = Bytes;
+		part->wall_usec = now - part->start_usec;
+		part->cpu_usec = cpu > part->cpu_start_usec ? cpu - part->cpu_start_usec : 0;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpPerfReport::Add_Tar(twrpTarProgress *Progress) {
+	pthread_mutex_lock(&lock);
+	Partition* part = Current();
+	if (part != NULL) {
+		if (!part->tar)
+			part->bytes = 0;
+		part->tar = true;
+		part->bytes += Progress->Total_Bytes();
+		part->files += Progress->Total_Files();
+		if (Progress->Threads() > part->threads)
+			part->threads = Progress->Threads();
+		part->time_usec[TW_PERF_TIME_SCAN] += Progress->Stage_Usec(TW_TAR_STAGE_SCAN);
+		part->time_usec[TW_PERF_TIME_COMPRESS] += Progress->Time_Usec(TW_TAR_TIME_COMPRESS);
+		part->time_usec[TW_PERF_TIME_ENCRYPT] += Progress->Time_Usec(TW_TAR_TIME_ENCRYPT);
+		part->time_usec[TW_PERF_TIME_DIGEST] += Progress->Time_Usec(TW_TAR_TIME_DIGEST);
+		part->time_usec[TW_PERF_TIME_WRITE] += Progress->Time_Usec(TW_TAR_TIME_WRITE);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpPerfReport::Add_Time(twrpPerfReport_Time Time, unsigned long long Usec) {
+	pthread_mutex_lock(&lock);
+	Partition* part = Current();
+	if (part != NULL)
+		part->time_usec[Time] += Usec;
+	pthread_mutex_unlock(&lock);
+}
+
+// Caller holds lock
+bool twrpPerfReport::Write_File(const std::string& Path) {
+	uint64_t wall = Now_Usec() - start_usec, cpu = Cpu_Usec(true) - cpu_start_usec;
+	unsigned long long total_bytes = 0;
+	char device[PROPERTY_VALUE_MAX];
+
+	FILE* f = fopen(Path.c_str(), "we");
+	if (!f)
+		return false;
+	property_get("ro.product.device", device, "");
+	for (size_t i = 0; i < partitions.size(); i++)
+		total_bytes += partitions[i].bytes;
+	fprintf(f, "{\n\t\"operation\": %s,\n\t\"version\": %s,\n\t\"device\": %s,\n\t\"cpus\": %ld,\n",
+		Quote(operation).c_str(), Quote(TW_VERSION_STR).c_str(), Quote(device).c_str(), sysconf(_SC_NPROCESSORS_CONF));
+	fprintf(f, "\t\"started\": %lld,\n\t\"wall_ms\": %llu,\n\t\"cpu_ms\": %llu,\n\t\"bytes\": %llu,\n\t\"mb_per_sec\": %.2f,\n",
+		(long long) started, (unsigned long long) wall / 1000, (unsigned long long) cpu / 1000, total_bytes,
+		wall > 0 ? total_bytes / 1048576.0 / (wall / 1000000.0) : 0.0);
+	fprintf(f, "\t\"settings\": {");
+	for (size_t i = 0; i < settings.size(); i++)
+		fprintf(f, "%s\n\t\t%s: %s", i ? "," : "", Quote(settings[i].first).c_str(), Quote(settings[i].second).c_str());
+	fprintf(f, "\n\t},\n\t\"partitions\": [");
+	for (size_t i = 0; i < partitions.size(); i++) {
+		const Partition& part = partitions[i];
+		fprintf(f, "%s\n\t\t{ \"name\": %s, \"method\": %s, \"ok\": %s, \"bytes\": %llu, \"files\": %llu, \"threads\": %u, ",
+			i ? "," : "", Quote(part.name).c_str(), Quote(part.method).c_str(), part.ok ? "true" : "false",
+			part.bytes, part.files, part.threads);
+		fprintf(f, "\"wall_ms\": %llu, \"cpu_ms\": %llu, \"mb_per_sec\": %.2f",
+			(unsigned long long) part.wall_usec / 1000, (unsigned long long) part.cpu_usec / 1000,
+			part.wall_usec > 0 ? part.bytes / 1048576.0 / (part.wall_usec / 1000000.0) : 0.0);
+		for (int t = 0; t < TW_PERF_TIMES; t++)
+			fprintf(f, ", \"%s_ms\": %llu", time_names[t], (unsigned long long) part.time_usec[t] / 1000);
+		fprintf(f, " }");
+	}
+	fprintf(f, "\n\t]\n}\n");
+	return fclose(f) == 0;
+}
+
+bool twrpPerfReport::Write(const std::string& Folder) {
+	char tmp_path[64];
+	bool ret = true;
+
+	snprintf(tmp_path, sizeof(tmp_path), TW_PERF_REPORT_TMP, operation.c_str());
+	pthread_mutex_lock(&lock);
+	if (!Write_File(tmp_path)) {
+		LOGINFO("Unable to write %s\n", tmp_path);
+		ret = false;
+	}
+	if (!Folder.empty()) {
+		std::string path = Folder + "/" + TW_PERF_REPORT_NAME;
+		if (Write_File(path)) {
+			tw_set_default_metadata(path.c_str());
+		} else {
+			LOGINFO("Unable to write %s\n", path.c_str());
+			ret = false;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
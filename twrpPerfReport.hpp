@@ -0,0 +1,94 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_PERF_REPORT_HPP
+#define __TWRP_PERF_REPORT_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+#define TW_PERF_REPORT_NAME "performance.json"                     // In the backup folder
+#define TW_PERF_REPORT_TMP "/tmp/%s_performance.json"               // %s is the operation
+
+class twrpTarProgress;
+
+enum twrpPerfReport_Time {
+	TW_PERF_TIME_SCAN = 0,
+	TW_PERF_TIME_COMPRESS,                                             // Or decompress, summed over the threads like the ones below
+	TW_PERF_TIME_ENCRYPT,                                              // Or decrypt
+	TW_PERF_TIME_DIGEST,
+	TW_PERF_TIME_WRITE,                                                // Archives on a backup, files on a restore
+	TW_PERF_TIMES
+};
+
+// A JSON report of a backup or restore, for tools that track the
+// throughput across devices and versions: the settings, and for each
+// partition the bytes, files, wall and CPU time, the tar threads and the
+// time spent in each kind of work. A partition is timed from
+// Begin_Partition() to End_Partition() on the same thread, which is how
+// Add_Tar() and Add_Time() find it. CPU time is the thread's own plus
+// what the children reaped meanwhile, the tar process among them.
+class twrpPerfReport {
+public:
+	twrpPerfReport(const std::string& Operation);                     // "backup" or "restore"
+	~twrpPerfReport();
+	void Setting(const std::string& Var);                              // Records the DataManager value of Var
+	void Begin_Partition(const std::string& Name, const std::string& Method);
+	void End_Partition(unsigned long long Bytes, bool Ok);             // Bytes is used unless a tar counted them
+	void Add_Tar(twrpTarProgress *Progress);                           // Files, threads and times of a tar process of the partition
+	void Add_Time(twrpPerfReport_Time Time, unsigned long long Usec);
+	bool Write(const std::string& Folder);                             // Folder may be empty for /tmp only
+
+private:
+	struct Partition {
+		std::string name;
+		std::string method;
+		pid_t thread;                                              // 0 once it has ended
+		bool ok;
+		bool tar;                                                  // Set by Add_Tar(), which counts the bytes
+		unsigned long long bytes;
+		unsigned long long files;
+		unsigned threads;
+		uint64_t start_usec;
+		uint64_t wall_usec;
+		uint64_t cpu_start_usec;
+		uint64_t cpu_usec;
+		uint64_t time_usec[TW_PERF_TIMES];
+	};
+
+	Partition* Current();                                              // Open partition of this thread, NULL if none, lock held
+	bool Write_File(const std::string& Path);
+	static uint64_t Now_Usec();
+	static uint64_t Cpu_Usec(bool Whole_Process);                      // This thread or the process, plus the reaped children
+	static std::string Quote(const std::string& Value);                // As a JSON string
+
+	std::string operation;
+	std::vector<std::pair<std::string, std::string> > settings;
+	std::vector<Partition> partitions;
+	time_t started;
+	uint64_t start_usec;
+	uint64_t cpu_start_usec;
+	pthread_mutex_t lock;
+};
+
+#endif // __TWRP_PERF_REPORT_HPP
@@ -0,0 +1,373 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "twrpRawCopy.hpp"
+#include "twcommon.h"
+
+// Turns O_DIRECT on or off, false if the fd does not support it
+static bool Set_Direct(int fd, bool direct) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+		return false;
+	flags = direct ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+	return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+twrpFdReader::twrpFdReader(int in_fd, bool direct) {
+	fd = in_fd;
+	use_direct = direct && Set_Direct(fd, true);
+}
+
+ssize_t twrpFdReader::Read(void *buf, size_t size) {
+	unsigned char* p = (unsigned char*) buf;
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t r = read(fd, p + done, size - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno == EINVAL && use_direct) {
+			// Transfer is not aligned for the device
+			use_direct = false;
+			Set_Direct(fd, false);
+			continue;
+		}
+		if (r < 0)
+			return -1;
+		if (r == 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+twrpFdWriter::twrpFdWriter(int out_fd, bool direct) {
+	fd = out_fd;
+	use_direct = direct && Set_Direct(fd, true);
+	zero_out = false;
+}
+
+void twrpFdWriter::Zero_Blocks(bool enable) {
+	struct stat st;
+
+	zero_out = enable && fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+}
+
+bool twrpFdWriter::Write_Zeros(const void *buf, size_t size) {
+	const unsigned char* p = (const unsigned char*) buf;
+	uint64_t range[2];
+	off_t pos;
+	size_t i;
+
+	if (size == 0 || size % TW_RAW_COPY_ALIGN != 0)
+		return false;
+	// A buffer that starts with zeros and equals itself shifted by that
+	// much is all zeros
+	for (i = 0; i < 16; i++) {
+		if (p[i] != 0)
+			return false;
+	}
+	if (memcmp(p, p + 16, size - 16) != 0)
+		return false;
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return false;
+	range[0] = pos;
+	range[1] = size;
+	if (ioctl(fd, BLKZEROOUT, &range) != 0) {
+		// Written out from now on
+		zero_out = false;
+		return false;
+	}
+	return lseek(fd, pos + size, SEEK_SET) == (off_t) (pos + size);
+}
+
+ssize_t twrpFdWriter::Write(const void *buf, size_t size) {
+	const unsigned char* p = (const unsigned char*) buf;
+	size_t done = 0;
+
+	// Zeroed by the device instead of sending it the zeros, flash that
+	// supports it only updates its mapping
+	if (zero_out && Write_Zeros(buf, size)) {
+		twrpCompress_Digest_Output(fd, buf, size);
+		return size;
+	}
+
+	while (done < size) {
+		ssize_t w = write(fd, p + done, size - done);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w < 0 && errno == EINVAL && use_direct) {
+			use_direct = false;
+			Set_Direct(fd, false);
+			continue;
+		}
+		if (w <= 0)
+			return -1;
+		twrpCompress_Digest_Output(fd, p + done, w);
+		done += w;
+	}
+	return size;
+}
+
+int twrpFdWriter::Finish() {
+	return 0;
+}
+
+twrpTeeWriter::twrpTeeWriter(const std::vector<twrpStreamWriter*>& Writers) {
+	size_t i;
+
+	cur_buf = NULL;
+	cur_size = 0;
+	generation = 0;
+	pending = 0;
+	stop = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+	lanes.resize(Writers.size());
+	for (i = 0; i < lanes.size(); i++) {
+		lanes[i].tee = this;
+		lanes[i].writer = Writers[i];
+		lanes[i].started = false;
+		lanes[i].failed = false;
+	}
+	// The first writer runs on the calling thread
+	for (i = 1; i < lanes.size(); i++)
+		lanes[i].started = pthread_create(&lanes[i].thread, NULL, Lane_Thread, &lanes[i]) == 0;
+}
+
+twrpTeeWriter::~twrpTeeWriter() {
+	pthread_mutex_lock(&lock);
+	stop = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	for (size_t i = 1; i < lanes.size(); i++) {
+		if (lanes[i].started)
+			pthread_join(lanes[i].thread, NULL);
+	}
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+void* twrpTeeWriter::Lane_Thread(void *cookie) {
+	Lane* lane = (Lane*) cookie;
+	twrpTeeWriter* tee = lane->tee;
+	uint64_t seen = 0;
+
+	pthread_mutex_lock(&tee->lock);
+	for (;;) {
+		while (tee->generation == seen && !tee->stop)
+			pthread_cond_wait(&tee->cond, &tee->lock);
+		if (tee->stop)
+			break;
+		seen = tee->generation;
+		const void* buf = tee->cur_buf;
+		size_t size = tee->cur_size;
+		pthread_mutex_unlock(&tee->lock);
+		bool failed = lane->writer->Write(buf, size) != (ssize_t)size;
+		pthread_mutex_lock(&tee->lock);
+		if (failed)
+			lane->failed = true;
+		if (--tee->pending == 0)
+			pthread_cond_broadcast(&tee->cond);
+	}
+	pthread_mutex_unlock(&tee->lock);
+	return NULL;
+}
+
+ssize_t twrpTeeWriter::Write(const void *buf, size_t size) {
+	bool failed = false;
+	size_t i;
+
+	if (lanes.empty())
+		return -1;
+	pthread_mutex_lock(&lock);
+	cur_buf = buf;
+	cur_size = size;
+	pending = 0;
+	for (i = 1; i < lanes.size(); i++) {
+		if (lanes[i].started)
+			pending++;
+	}
+	generation++;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+
+	if (lanes[0].writer->Write(buf, size) != (ssize_t)size)
+		lanes[0].failed = true;
+	// Lanes whose thread could not be started are written here as well
+	for (i = 1; i < lanes.size(); i++) {
+		if (!lanes[i].started && lanes[i].writer->Write(buf, size) != (ssize_t)size)
+			lanes[i].failed = true;
+	}
+
+	pthread_mutex_lock(&lock);
+	while (pending > 0)
+		pthread_cond_wait(&cond, &lock);
+	for (i = 0; i < lanes.size(); i++)
+		failed |= lanes[i].failed;
+	pthread_mutex_unlock(&lock);
+	return failed ? -1 : size;
+}
+
+int twrpTeeWriter::Finish() {
+	int ret = 0;
+
+	for (size_t i = 0; i < lanes.size(); i++) {
+		if (lanes[i].writer->Finish() != 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+twrpRawCopy::twrpRawCopy(size_t buffer_size, unsigned buffer_count) {
+	unsigned i;
+
+	buf_size = buffer_size;
+	src = NULL;
+	total_size = 0;
+	read_failed = false;
+	stop = false;
+	buffers.resize(buffer_count < 2 ? 2 : buffer_count);
+	for (i = 0; i < buffers.size(); i++) {
+		if (posix_memalign(&buffers[i].data, TW_RAW_COPY_ALIGN, buf_size) != 0)
+			buffers[i].data = NULL;
+		buffers[i].len = 0;
+		buffers[i].full = false;
+	}
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+twrpRawCopy::~twrpRawCopy() {
+	for (size_t i = 0; i < buffers.size(); i++)
+		free(buffers[i].data);
+	pthread_mutex_destroy(&lock);
+	pthread_cond_destroy(&cond);
+}
+
+bool twrpRawCopy::Copy(twrpStreamReader *reader, twrpStreamWriter *writer, uint64_t Size, std::function<bool(uint64_t)> Progress) {
+	pthread_t thread;
+	uint64_t done = 0;
+	size_t slot = 0;
+	bool ret = true;
+
+	for (slot = 0; slot < buffers.size(); slot++) {
+		if (buffers[slot].data == NULL) {
+			LOGINFO("twrpRawCopy failed to allocate buffers\n");
+			return false;
+		}
+		buffers[slot].full = false;
+	}
+	src = reader;
+	total_size = Size;
+	read_failed = false;
+	stop = false;
+	if (Size == 0)
+		return true;
+	if (pthread_create(&thread, NULL, Reader_Thread, this) != 0) {
+		LOGINFO("twrpRawCopy unable to start reader thread\n");
+		return false;
+	}
+
+	slot = 0;
+	while (done < Size) {
+		Buffer& buf = buffers[slot];
+
+		pthread_mutex_lock(&lock);
+		while (!buf.full && !stop)
+			pthread_cond_wait(&cond, &lock);
+		bool full = buf.full;
+		pthread_mutex_unlock(&lock);
+		if (!full) {
+			ret = false; // reader failed
+			break;
+		}
+		if (writer->Write(buf.data, buf.len) != (ssize_t)buf.len) {
+			LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
+			ret = false;
+			break;
+		}
+		done += buf.len;
+		pthread_mutex_lock(&lock);
+		buf.full = false;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		if (!Progress(done)) {
+			ret = false;
+			break;
+		}
+		slot = (slot + 1) % buffers.size();
+	}
+
+	pthread_mutex_lock(&lock);
+	stop = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	return ret && !read_failed;
+}
+
+void* twrpRawCopy::Reader_Thread(void *cookie) {
+	((twrpRawCopy*) cookie)->Read_Loop();
+	return NULL;
+}
+
+void twrpRawCopy::Read_Loop() {
+	uint64_t remain = total_size;
+	size_t slot = 0;
+
+	while (remain > 0) {
+		Buffer& buf = buffers[slot];
+		size_t len = remain < buf_size ? (size_t)remain : buf_size;
+
+		pthread_mutex_lock(&lock);
+		while (buf.full && !stop)
+			pthread_cond_wait(&cond, &lock);
+		bool stopped = stop;
+		pthread_mutex_unlock(&lock);
+		if (stopped)
+			return;
+
+		ssize_t r = src->Read(buf.data, len);
+		pthread_mutex_lock(&lock);
+		if (r != (ssize_t)len) {
+			LOGINFO("Error reading source fd (%s)\n", r < 0 ? strerror(errno) : "unexpected end of data");
+			read_failed = true;
+			stop = true;
+		} else {
+			buf.len = len;
+			buf.full = true;
+		}
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		if (read_failed)
+			return;
+		remain -= len;
+		slot = (slot + 1) % buffers.size();
+	}
+}
@@ -0,0 +1,123 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_RAW_COPY_HPP
+#define __TWRP_RAW_COPY_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <functional>
+#include <vector>
+#include "twrpCompress.hpp"
+
+// Buffers are aligned for O_DIRECT
+#define TW_RAW_COPY_ALIGN 4096
+#define TW_RAW_COPY_BUFFERS 4
+
+// Plain fd streams for twrpRawCopy. With direct set the fd is switched to
+// O_DIRECT, which falls back to cached I/O for a transfer the device does
+// not accept, like a short one at the end of a partition.
+class twrpFdReader : public twrpStreamReader {
+public:
+	twrpFdReader(int in_fd, bool direct);
+	ssize_t Read(void *buf, size_t size);                              // Fills buf unless the file ends
+
+private:
+	int fd;
+	bool use_direct;
+};
+
+class twrpFdWriter : public twrpStreamWriter {
+public:
+	twrpFdWriter(int out_fd, bool direct);
+	ssize_t Write(const void *buf, size_t size);
+	int Finish();                                                      // Nothing to flush, returns 0
+	void Zero_Blocks(bool enable);                                     // Zero whole buffers of zeros with BLKZEROOUT, only if the fd is a block device
+
+private:
+	bool Write_Zeros(const void *buf, size_t size);                    // false if buf isn't all zeros or the device can't zero it
+
+	int fd;
+	bool use_direct;
+	bool zero_out;
+};
+
+// Writes every buffer to several writers at once, each on its own thread,
+// so one source can be copied to several destinations with a single read.
+// Write() returns once all of them have the buffer, and fails if any did.
+// The writers are not freed with the tee.
+class twrpTeeWriter : public twrpStreamWriter {
+public:
+	twrpTeeWriter(const std::vector<twrpStreamWriter*>& Writers);
+	~twrpTeeWriter();
+	ssize_t Write(const void *buf, size_t size);
+	int Finish();                                                      // Finishes every writer, -1 if any failed
+
+private:
+	struct Lane {
+		twrpTeeWriter* tee;
+		twrpStreamWriter* writer;
+		pthread_t thread;
+		bool started;
+		bool failed;
+	};
+
+	static void* Lane_Thread(void *cookie);
+
+	std::vector<Lane> lanes;
+	const void* cur_buf;
+	size_t cur_size;
+	uint64_t generation;                                               // Counts buffers handed to the lanes
+	unsigned pending;                                                  // Lanes still writing the current buffer
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+// Copies a stream through a ring of buffers. A thread reads ahead while the
+// calling thread writes, so the source and destination work at the same time.
+class twrpRawCopy {
+public:
+	twrpRawCopy(size_t buffer_size, unsigned buffer_count);
+	~twrpRawCopy();
+	// Copies Size bytes, Progress gets the bytes written so far after every
+	// buffer and stops the copy by returning false
+	bool Copy(twrpStreamReader *reader, twrpStreamWriter *writer, uint64_t Size, std::function<bool(uint64_t)> Progress);
+
+private:
+	struct Buffer {
+		void* data;
+		size_t len;
+		bool full;
+	};
+
+	static void* Reader_Thread(void *cookie);
+	void Read_Loop();
+
+	std::vector<Buffer> buffers;
+	size_t buf_size;
+	twrpStreamReader *src;
+	uint64_t total_size;
+	bool read_failed;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+#endif // __TWRP_RAW_COPY_HPP
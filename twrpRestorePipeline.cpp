@@ -0,0 +1,749 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <linux/xattr.h>
+#include <selinux/selinux.h>
+#include "twrpRestorePipeline.hpp"
+#include "twrpLog.hpp"
+#include "twrpThermal.hpp"
+#include "twcommon.h"
+
+#define READ_AHEAD_BLOCK (1024 * 1024)
+#define DECRYPT_BATCH_CHUNKS 64
+#define GCM_DECRYPT_BATCH_CHUNKS 4
+#define EXTRACT_QUEUE_BYTES (64 * 1024 * 1024)          // File data read from the archive but not written yet, as the memory budget allows
+#define EXTRACT_QUEUE_MIN_BYTES (4 * 1024 * 1024)
+
+uint64_t twrpPipe_Now() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+twrpPipeStage* twrpPipeStats::Add(const std::string& name, unsigned threads) {
+	twrpPipeStage stage;
+
+	stage.name = name;
+	stage.threads = threads ? threads : 1;
+	stage.busy_usec = 0;
+	stage.starved_usec = 0;
+	stage.blocked_usec = 0;
+	stages.push_back(stage);
+	return &stages.back();
+}
+
+twrpPipeStage* twrpPipeStats::Find(const std::string& name) {
+	for (std::list<twrpPipeStage>::iterator it = stages.begin(); it != stages.end(); it++) {
+		if (it->name == name)
+			return &(*it);
+	}
+	return NULL;
+}
+
+void twrpPipeStats::Log(const std::string& Archive) {
+	std::list<twrpPipeStage>::iterator it, slowest = stages.end();
+	uint64_t slowest_work = 0;
+
+	LOGINFO("Restore pipeline for '%s':\n", Archive.c_str());
+	for (it = stages.begin(); it != stages.end(); it++) {
+		if (it->busy_usec == 0)
+			continue;                                              // Not used by this archive type
+		uint64_t waits = it->starved_usec + it->blocked_usec;
+		uint64_t work = (it->busy_usec > waits ? it->busy_usec - waits : 0) / it->threads;
+		LOGINFO("  %s: %.2fs working, %.2fs waiting for input, %.2fs waiting for output (%u threads)\n", it->name.c_str(),
+			work / 1000000.0, it->starved_usec / 1000000.0, it->blocked_usec / 1000000.0, it->threads);
+		if (slowest == stages.end() || work > slowest_work) {
+			slowest = it;
+			slowest_work = work;
+		}
+	}
+	if (slowest != stages.end())
+		LOGINFO("Slowest restore stage for '%s': %s\n", Archive.c_str(), slowest->name.c_str());
+}
+
+twrpReadAheadReader::twrpReadAheadReader(twrpStreamReader *in_reader, twrpPipeStage *in_stage, twrpPipeStage *consumer, size_t depth) {
+	reader = in_reader;
+	stage = in_stage;
+	consumer_stage = consumer;
+	max_blocks = depth ? depth : 1;
+	thread_started = false;
+	current_pos = 0;
+	eof = false;
+	failed = false;
+	stopping = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&not_empty, NULL);
+	pthread_cond_init(&not_full, NULL);
+}
+
+twrpReadAheadReader::~twrpReadAheadReader() {
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&not_full);
+	pthread_mutex_unlock(&lock);
+	if (thread_started)
+		pthread_join(thread, NULL);
+	delete reader;
+	pthread_cond_destroy(&not_full);
+	pthread_cond_destroy(&not_empty);
+	pthread_mutex_destroy(&lock);
+}
+
+bool twrpReadAheadReader::Start() {
+	if (pthread_create(&thread, NULL, Thread_Start, this) != 0) {
+		LOGINFO("twrpReadAheadReader: unable to start thread\n");
+		return false;
+	}
+	thread_started = true;
+	return true;
+}
+
+void* twrpReadAheadReader::Thread_Start(void *cookie) {
+	((twrpReadAheadReader*) cookie)->Run();
+	return NULL;
+}
+
+void twrpReadAheadReader::Run() {
+	uint64_t start = twrpPipe_Now();
+	bool error = false;
+
+	while (true) {
+		std::vector<unsigned char> block(READ_AHEAD_BLOCK);
+		ssize_t len = reader->Read(block.data(), block.size());
+		if (len <= 0) {
+			error = len < 0;
+			break;
+		}
+		block.resize(len);
+
+		pthread_mutex_lock(&lock);
+		if (blocks.size() >= max_blocks && !stopping) {
+			uint64_t wait = twrpPipe_Now();
+			while (blocks.size() >= max_blocks && !stopping)
+				pthread_cond_wait(&not_full, &lock);
+			if (stage)
+				stage->blocked_usec += twrpPipe_Now() - wait;
+		}
+		if (stopping) {
+			pthread_mutex_unlock(&lock);
+			break;
+		}
+		blocks.push_back(std::vector<unsigned char>());
+		blocks.back().swap(block);
+		pthread_cond_signal(&not_empty);
+		pthread_mutex_unlock(&lock);
+	}
+
+	pthread_mutex_lock(&lock);
+	if (stage)
+		stage->busy_usec += twrpPipe_Now() - start;
+	eof = true;
+	failed = error;
+	pthread_cond_broadcast(&not_empty);
+	pthread_mutex_unlock(&lock);
+}
+
+ssize_t twrpReadAheadReader::Read(void *buf, size_t size) {
+	size_t done = 0;
+
+	while (done < size) {
+		if (current_pos == current.size()) {
+			pthread_mutex_lock(&lock);
+			if (blocks.empty() && !eof) {
+				uint64_t wait = twrpPipe_Now();
+				while (blocks.empty() && !eof)
+					pthread_cond_wait(&not_empty, &lock);
+				if (consumer_stage)
+					consumer_stage->starved_usec += twrpPipe_Now() - wait;
+			}
+			if (blocks.empty()) {
+				bool error = failed;
+				pthread_mutex_unlock(&lock);
+				if (error && done == 0)
+					return -1;
+				break;
+			}
+			current.swap(blocks.front());
+			blocks.pop_front();
+			current_pos = 0;
+			pthread_cond_signal(&not_full);
+			pthread_mutex_unlock(&lock);
+		}
+		size_t len = current.size() - current_pos;
+		if (len > size - done)
+			len = size - done;
+		memcpy((unsigned char*) buf + done, current.data() + current_pos, len);
+		current_pos += len;
+		done += len;
+	}
+	return done;
+}
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+twrpDecryptReader::twrpDecryptReader(int in_fd, const std::string& Password, unsigned threads, twrpPipeStage *in_stage, twrpPipeStage *consumer, uint64_t Start_Offset) {
+	fd = in_fd;
+	password = Password;
+	thread_count = threads ? threads : 1;
+	stage = in_stage;
+	consumer_stage = consumer;
+	gcm = false;
+	chunk_in = TW_AES_CHUNK_SIZE;
+	next_chunk = 0;
+	start_offset = Start_Offset;
+	skip = 0;
+	current = NULL;
+	current_pos = 0;
+	eof = false;
+	failed = false;
+	stopping = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&job_ready, NULL);
+	pthread_cond_init(&job_done, NULL);
+}
+
+twrpDecryptReader::~twrpDecryptReader() {
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&job_ready);
+	pthread_mutex_unlock(&lock);
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	while (!jobs.empty()) {
+		delete jobs.front();
+		jobs.pop_front();
+	}
+	delete current;
+	memset(gcm_key, 0, sizeof(gcm_key));
+	pthread_cond_destroy(&job_done);
+	pthread_cond_destroy(&job_ready);
+	pthread_mutex_destroy(&lock);
+}
+
+bool twrpDecryptReader::Read_Header() {
+	size_t done = 0;
+
+	pending.resize(TW_GCM_HEADER_SIZE);
+	while (done < pending.size()) {
+		ssize_t len = read(fd, pending.data() + done, pending.size() - done);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len < 0) {
+			LOGINFO("twrpDecryptReader: read failed: %s\n", strerror(errno));
+			return false;
+		}
+		if (len == 0)
+			break;
+		done += len;
+	}
+	pending.resize(done);
+	if (done < TW_GCM_MAGIC_SIZE || memcmp(pending.data(), TW_GCM_MAGIC, TW_GCM_MAGIC_SIZE) != 0) {
+		// openaes chunks: what was read is the start of the first one
+		if (start_offset != 0) {
+			LOGINFO("twrpDecryptReader: openaes archives can only be read from the start\n");
+			return false;
+		}
+		return true;
+	}
+
+	uint32_t chunk_size;
+	if (done < TW_GCM_HEADER_SIZE || !twrpGcm_Read_Header(password, pending.data(), &chunk_size, gcm_key))
+		return false;
+	memcpy(gcm_header, pending.data(), TW_GCM_HEADER_SIZE);
+	pending.clear();
+	gcm = true;
+	chunk_in = chunk_size + TW_GCM_TAG_SIZE;
+	next_chunk = start_offset / chunk_size;
+	skip = start_offset % chunk_size;
+	if (next_chunk > 0 && lseek64(fd, TW_GCM_HEADER_SIZE + next_chunk * chunk_in, SEEK_SET) < 0) {
+		LOGINFO("twrpDecryptReader: seek failed: %s\n", strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool twrpDecryptReader::Start() {
+	twrpAesCipher probe(password);
+
+	if (!probe.Ready()) {
+		LOGINFO("twrpDecryptReader: no AES engine could be set up\n");
+		return false;
+	}
+	if (!Read_Header())
+		return false;
+	if (gcm && !probe.Use_Gcm(gcm_header, gcm_key)) {
+		LOGINFO("twrpDecryptReader: unable to set up AES-GCM\n");
+		return false;
+	}
+	unsigned count = twrpThermal::Get()->Workers(thread_count);
+	for (unsigned i = 0; i < count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Worker, this) != 0) {
+			LOGINFO("twrpDecryptReader: unable to start decryption thread %u, using %u\n", i, i);
+			break;
+		}
+		workers.push_back(thread);
+	}
+	LOGINFO("twrpDecryptReader: %s AES%s on %zu threads\n", probe.Engine(), gcm ? "-GCM" : "", workers.size());
+	return !workers.empty();
+}
+
+void* twrpDecryptReader::Worker(void *cookie) {
+	((twrpDecryptReader*) cookie)->Work();
+	return NULL;
+}
+
+size_t twrpOaes_Key(const std::string& Password, uint8_t key[32]) {
+	size_t key_len, i;
+
+	// Same key padding as openaes --key
+	for (i = 0; i < 32; i++)
+		key[i] = i + 1;
+	key_len = Password.size();
+	if (key_len <= 16)
+		key_len = 16;
+	else if (key_len <= 24)
+		key_len = 24;
+	else
+		key_len = 32;
+	memcpy(key, Password.c_str(), Password.size() < 32 ? Password.size() : 32);
+	return key_len;
+}
+
+OAES_CTX* twrpOaes_New_Context(const std::string& Password) {
+	uint8_t key_data[32];
+	size_t key_data_len = twrpOaes_Key(Password, key_data);
+	OAES_CTX* ctx;
+
+	ctx = oaes_alloc();
+	if (ctx != NULL && oaes_key_import_data(ctx, key_data, key_data_len) != OAES_RET_SUCCESS)
+		oaes_free(&ctx);
+	return ctx;
+}
+
+void twrpDecryptReader::Work() {
+	twrpAesCipher cipher(password);
+	size_t i;
+
+	if (gcm)
+		cipher.Use_Gcm(gcm_header, gcm_key);
+	pthread_mutex_lock(&lock);
+	while (true) {
+		Job* job = NULL;
+		for (i = 0; i < jobs.size(); i++) {
+			if (!jobs[i]->claimed) {
+				job = jobs[i];
+				break;
+			}
+		}
+		if (job == NULL) {
+			if (stopping)
+				break;
+			pthread_cond_wait(&job_ready, &lock);
+			continue;
+		}
+		job->claimed = true;
+		pthread_mutex_unlock(&lock);
+
+		uint64_t start = twrpPipe_Now();
+		bool error = !cipher.Ready();
+		size_t used = 0;
+		job->out.resize(job->in.size());
+		// An AES-GCM archive that ends on a whole chunk was cut off
+		if (gcm && job->last && job->in.size() % chunk_in == 0) {
+			LOGINFO("twrpDecryptReader: archive ends without its last chunk\n");
+			error = true;
+		}
+		for (size_t pos = 0, n = 0; pos < job->in.size() && !error; pos += chunk_in, n++) {
+			size_t in_len = job->in.size() - pos < chunk_in ? job->in.size() - pos : chunk_in;
+			ssize_t out_len;
+			if (gcm)
+				out_len = cipher.Open_Chunk(job->first_chunk + n, job->in.data() + pos, in_len, job->out.data() + used);
+			else
+				out_len = cipher.Decrypt_Chunk(job->in.data() + pos, in_len, job->out.data() + used);
+			if (out_len < 0)
+				error = true;
+			else
+				used += out_len;
+		}
+		job->out.resize(used);
+		uint64_t end = twrpPipe_Now();
+
+		pthread_mutex_lock(&lock);
+		if (stage)
+			stage->busy_usec += end - start;
+		job->error = error;
+		job->done = true;
+		pthread_cond_broadcast(&job_done);
+		pthread_mutex_unlock(&lock);
+		twrpThermal::Get()->Pace(end - start);
+		pthread_mutex_lock(&lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+bool twrpDecryptReader::Fill() {
+	while (!eof) {
+		pthread_mutex_lock(&lock);
+		size_t queued = jobs.size();
+		pthread_mutex_unlock(&lock);
+		if (queued >= workers.size() * 2)
+			break;
+
+		Job* job = new Job;
+		size_t done = pending.size();
+		job->claimed = false;
+		job->done = false;
+		job->error = false;
+		job->last = false;
+		job->first_chunk = next_chunk;
+		job->in.resize(chunk_in * (gcm ? GCM_DECRYPT_BATCH_CHUNKS : DECRYPT_BATCH_CHUNKS));
+		memcpy(job->in.data(), pending.data(), pending.size());
+		pending.clear();
+		while (done < job->in.size()) {
+			ssize_t len = read(fd, job->in.data() + done, job->in.size() - done);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0) {
+				LOGINFO("twrpDecryptReader: read failed: %s\n", strerror(errno));
+				delete job;
+				return false;
+			}
+			if (len == 0) {
+				eof = true;
+				break;
+			}
+			done += len;
+		}
+		// The workers check that an AES-GCM archive ends with a short chunk
+		if (done == 0 && !gcm) {
+			delete job;
+			break;
+		}
+		job->in.resize(done);
+		job->last = eof;
+		next_chunk += done / chunk_in;
+		pthread_mutex_lock(&lock);
+		jobs.push_back(job);
+		pthread_cond_signal(&job_ready);
+		pthread_mutex_unlock(&lock);
+	}
+	return true;
+}
+
+ssize_t twrpDecryptReader::Read(void *buf, size_t size) {
+	size_t done = 0;
+
+	if (failed)
+		return -1;
+	while (done < size) {
+		if (current == NULL || current_pos == current->out.size()) {
+			delete current;
+			current = NULL;
+			// Keep the workers busy while the last batch is used up
+			if (!Fill()) {
+				failed = true;
+				return -1;
+			}
+			pthread_mutex_lock(&lock);
+			if (jobs.empty()) {
+				pthread_mutex_unlock(&lock);
+				break;
+			}
+			Job* job = jobs.front();
+			if (!job->done) {
+				uint64_t wait = twrpPipe_Now();
+				while (!job->done)
+					pthread_cond_wait(&job_done, &lock);
+				if (consumer_stage)
+					consumer_stage->starved_usec += twrpPipe_Now() - wait;
+			}
+			jobs.pop_front();
+			pthread_mutex_unlock(&lock);
+			if (job->error) {
+				LOGINFO("twrpDecryptReader: decryption failed, is the password correct?\n");
+				delete job;
+				failed = true;
+				return -1;
+			}
+			current = job;
+			current_pos = 0;
+			// Reading starts in the middle of the first chunk
+			if (skip > 0) {
+				current_pos = skip < job->out.size() ? skip : job->out.size();
+				skip -= current_pos;
+			}
+			continue;
+		}
+		size_t len = current->out.size() - current_pos;
+		if (len > size - done)
+			len = size - done;
+		memcpy((unsigned char*) buf + done, current->out.data() + current_pos, len);
+		current_pos += len;
+		done += len;
+	}
+	return done;
+}
+#endif // TW_EXCLUDE_ENCRYPTED_BACKUPS
+
+twrpExtractPool::twrpExtractPool(unsigned threads, twrpPipeStage *in_stage, twrpPipeStage *producer) {
+	thread_count = threads ? threads : 1;
+	stage = in_stage;
+	producer_stage = producer;
+	queued_bytes = 0;
+	queue_limit = queue_grant.Take("extract queue", EXTRACT_QUEUE_BYTES, EXTRACT_QUEUE_MIN_BYTES);
+	open_files = 0;
+	failed = false;
+	stopping = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&chunk_ready, NULL);
+	pthread_cond_init(&space, NULL);
+}
+
+twrpExtractPool::~twrpExtractPool() {
+	Finish();
+	pthread_mutex_lock(&lock);
+	stopping = true;
+	pthread_cond_broadcast(&chunk_ready);
+	pthread_mutex_unlock(&lock);
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+	pthread_cond_destroy(&space);
+	pthread_cond_destroy(&chunk_ready);
+	pthread_mutex_destroy(&lock);
+}
+
+bool twrpExtractPool::Start() {
+	for (unsigned i = 0; i < thread_count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Worker, this) != 0) {
+			LOGINFO("twrpExtractPool: unable to start writer thread %u, using %u\n", i, i);
+			break;
+		}
+		workers.push_back(thread);
+	}
+	return !workers.empty();
+}
+
+void* twrpExtractPool::Worker(void *cookie) {
+	((twrpExtractPool*) cookie)->Work();
+	return NULL;
+}
+
+void twrpExtractPool::Work() {
+	pthread_mutex_lock(&lock);
+	while (true) {
+		if (chunks.empty()) {
+			if (stopping)
+				break;
+			pthread_cond_wait(&chunk_ready, &lock);
+			continue;
+		}
+		Chunk* chunk = chunks.front();
+		chunks.pop_front();
+		queued_bytes -= chunk->data.size();
+		pthread_cond_broadcast(&space);
+		pthread_mutex_unlock(&lock);
+
+		uint64_t start = twrpPipe_Now();
+		size_t done = 0;
+		while (done < chunk->data.size()) {
+			ssize_t len = pwrite64(chunk->file->fd, chunk->data.data() + done, chunk->data.size() - done, chunk->offset + done);
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len <= 0) {
+				LOGINFO("twrpExtractPool: unable to write '%s': %s\n", chunk->file->name.c_str(), strerror(errno));
+				pthread_mutex_lock(&lock);
+				chunk->file->failed = true;
+				pthread_mutex_unlock(&lock);
+				break;
+			}
+			done += len;
+		}
+		Release(chunk->file, 1);
+		delete chunk;
+
+		pthread_mutex_lock(&lock);
+		if (stage)
+			stage->busy_usec += twrpPipe_Now() - start;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpExtractPool::Release(File *file, unsigned count) {
+	pthread_mutex_lock(&lock);
+	file->pending -= count;
+	bool last = file->pending == 0;
+	pthread_mutex_unlock(&lock);
+	if (!last)
+		return;
+
+	bool ok = Close_File(file);
+	pthread_mutex_lock(&lock);
+	if (!ok)
+		failed = true;
+	open_files--;
+	open_names.erase(file->name);
+	pthread_cond_broadcast(&space);
+	pthread_mutex_unlock(&lock);
+	delete file;
+}
+
+bool twrpExtractPool::Close_File(File *file) {
+	const char* filename = file->name.c_str();
+	struct timespec times[2];
+	bool ret = !file->failed;
+
+	// Same order as tar_extract_file(), but on the open fd instead of the path
+	if (ret && geteuid() == 0 && fchown(file->fd, file->uid, file->gid) == -1) {
+		LOGINFO("twrpExtractPool: fchown '%s' failed: %s\n", filename, strerror(errno));
+		ret = false;
+	}
+	times[0].tv_sec = times[1].tv_sec = file->mtime;
+	times[0].tv_nsec = times[1].tv_nsec = 0;
+	if (ret && (futimens(file->fd, times) == -1 || fchmod(file->fd, file->mode) == -1)) {
+		LOGINFO("twrpExtractPool: unable to set times or mode of '%s': %s\n", filename, strerror(errno));
+		ret = false;
+	}
+	if (ret && !file->context.empty() && fsetfilecon(file->fd, file->context.c_str()) < 0)
+		fprintf(stderr, "tar_extract_file(): failed to restore SELinux context %s to file %s !!!\n", file->context.c_str(), filename);
+	if (ret && file->has_cap_data && fsetxattr(file->fd, XATTR_NAME_CAPS, &file->cap_data, sizeof(struct vfs_cap_data), 0) < 0)
+		fprintf(stderr, "tar_extract_file(): failed to restore posix capabilities to file %s !!!\n", filename);
+	if (close(file->fd) != 0) {
+		LOGINFO("twrpExtractPool: unable to close '%s': %s\n", filename, strerror(errno));
+		ret = false;
+	}
+	return ret;
+}
+
+int twrpExtractPool::Extract_Regfile(TAR *t, const char *realname, unsigned long long *progress) {
+	int64_t size = th_get_size(t), left;
+	unsigned chunk_count = size > 0 ? (unsigned) ((size + T_BULKSIZE - 1) / T_BULKSIZE) : 1, submitted = 0;
+	off64_t offset = 0;
+	const char* base;
+	File* file;
+
+	// A second copy of a file replaces the first only once that is written
+	Wait_For(realname);
+	pthread_mutex_lock(&lock);
+	bool error = failed;
+	pthread_mutex_unlock(&lock);
+	if (error)
+		return -1;
+
+	// Created in the directory libtar keeps open from the entry before
+	int dir_fd = tar_parent_dir(t, realname, &base);
+	if (dir_fd == -1)
+		return -1;
+	if (twrpLog::File_Message())
+		printf("  ==> extracting: %s (file size %" PRId64 " bytes)\n", realname, size);
+	int fd = openat(dir_fd, base, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE | O_CLOEXEC, 0666);
+	if (fd == -1)
+		return -1;
+	// Chunks land out of order, preallocating keeps the file in one piece
+	tar_preallocate(fd, realname, size);
+
+	file = new File;
+	file->fd = fd;
+	file->name = realname;
+	file->mode = th_get_mode(t);
+	file->uid = th_get_uid(t);
+	file->gid = th_get_gid(t);
+	file->mtime = th_get_mtime(t);
+	if ((t->options & TAR_STORE_SELINUX) && t->th_buf.selinux_context != NULL)
+		file->context = t->th_buf.selinux_context;
+	file->has_cap_data = (t->options & TAR_STORE_POSIX_CAP) && t->th_buf.has_cap_data;
+	if (file->has_cap_data)
+		memcpy(&file->cap_data, &t->th_buf.cap_data, sizeof(file->cap_data));
+	file->pending = chunk_count;
+	file->failed = false;
+	pthread_mutex_lock(&lock);
+	open_files++;
+	open_names.insert(file->name);
+	pthread_mutex_unlock(&lock);
+
+	// Whole blocks are read, only the file's bytes are written
+	for (left = size; submitted < chunk_count; submitted++) {
+		Chunk* chunk = new Chunk;
+		size_t len = left > T_BULKSIZE ? T_BULKSIZE : (size_t) left;
+		size_t blocks = (len + T_BLOCKSIZE - 1) & ~((size_t) T_BLOCKSIZE - 1);
+
+		chunk->file = file;
+		chunk->offset = offset;
+		if (blocks > 0) {
+			chunk->data.resize(blocks);
+			ssize_t k = tar_block_read_n(t, chunk->data.data(), blocks);
+			if (k != (ssize_t) blocks) {
+				if (k != -1)
+					errno = EINVAL;
+				delete chunk;
+				pthread_mutex_lock(&lock);
+				file->failed = true;
+				pthread_mutex_unlock(&lock);
+				Release(file, chunk_count - submitted);
+				return -1;
+			}
+			chunk->data.resize(len);
+			tar_extract_progress(t, progress, blocks);
+		}
+
+		pthread_mutex_lock(&lock);
+		if (queued_bytes + len > queue_limit && !chunks.empty()) {
+			uint64_t wait = twrpPipe_Now();
+			while (queued_bytes + len > queue_limit && !chunks.empty())
+				pthread_cond_wait(&space, &lock);
+			if (producer_stage)
+				producer_stage->blocked_usec += twrpPipe_Now() - wait;
+		}
+		chunks.push_back(chunk);
+		queued_bytes += len;
+		pthread_cond_signal(&chunk_ready);
+		pthread_mutex_unlock(&lock);
+		offset += len;
+		left -= len;
+	}
+	return 0;
+}
+
+void twrpExtractPool::Wait_For(const char *name) {
+	pthread_mutex_lock(&lock);
+	if (!open_names.empty()) {
+		std::string key(name);
+		while (open_names.count(key) > 0)
+			pthread_cond_wait(&space, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int twrpExtractPool::Finish() {
+	pthread_mutex_lock(&lock);
+	while (open_files > 0)
+		pthread_cond_wait(&space, &lock);
+	bool error = failed;
+	pthread_mutex_unlock(&lock);
+	return error ? -1 : 0;
+}
@@ -0,0 +1,218 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_RESTORE_PIPELINE_HPP
+#define __TWRP_RESTORE_PIPELINE_HPP
+
+#include <stdint.h>
+#include <pthread.h>
+#include <deque>
+#include <list>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "twrpCompress.hpp"
+#include "twrpMemBudget.hpp"
+extern "C" {
+	#include "libtar/libtar.h"
+}
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+#include "openaes/inc/oaes_lib.h"
+#include "twrpEncrypt.hpp"
+#endif
+
+// Restore runs as a pipeline inside the tar process:
+//
+//   archive -> decrypt workers -> decompress thread -> libtar -> writer pool
+//
+// Each arrow is a bounded queue, so a slow stage holds the ones before it
+// back instead of buffering the whole archive. Every stage records how long
+// it worked and how long it waited on its neighbours, and the totals are
+// logged when the archive is done so the stage that limited the restore
+// can be seen.
+
+struct twrpPipeStage {
+	std::string name;
+	unsigned threads;                                                  // busy_usec is summed over this many threads
+	uint64_t busy_usec;                                                // Time the stage ran, including both waits
+	uint64_t starved_usec;                                             // Time spent waiting for the stage before it
+	uint64_t blocked_usec;                                             // Time spent waiting for the stage after it
+};
+
+class twrpPipeStats {
+public:
+	twrpPipeStage* Add(const std::string& name, unsigned threads);    // Pointers stay valid until the stats are freed
+	twrpPipeStage* Find(const std::string& name);                      // NULL if there is no such stage
+	void Log(const std::string& Archive);
+
+private:
+	std::list<twrpPipeStage> stages;
+};
+
+uint64_t twrpPipe_Now();                                              // Monotonic time in usec
+
+// Runs another reader on its own thread and keeps up to depth blocks of
+// its output queued, so decompression overlaps extraction
+class twrpReadAheadReader : public twrpStreamReader {
+public:
+	twrpReadAheadReader(twrpStreamReader *in_reader, twrpPipeStage *in_stage, twrpPipeStage *consumer, size_t depth);
+	~twrpReadAheadReader();
+	bool Start();
+	ssize_t Read(void *buf, size_t size);
+
+private:
+	static void* Thread_Start(void *cookie);
+	void Run();
+
+	twrpStreamReader* reader;
+	twrpPipeStage* stage;
+	twrpPipeStage* consumer_stage;
+	size_t max_blocks;
+	pthread_t thread;
+	bool thread_started;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	std::deque<std::vector<unsigned char> > blocks;
+	std::vector<unsigned char> current;
+	size_t current_pos;
+	bool eof;                                                          // Producer is done
+	bool failed;
+	bool stopping;                                                     // Consumer is gone
+};
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+// The AES key that openaes --key derives from Password, returns its length
+size_t twrpOaes_Key(const std::string& Password, uint8_t key[32]);
+// openaes context with that key, NULL on failure
+OAES_CTX* twrpOaes_New_Context(const std::string& Password);
+
+// Decrypts encrypted archives in process, TW_GCM_MAGIC archives and the
+// output of openaes enc, told apart by the first bytes. Both are cut into
+// independent chunks, so batches of chunks are decrypted on a pool of
+// threads, each with its own twrpAesCipher, and handed out in order.
+// TW_GCM_MAGIC archives can be read from Start_Offset on instead of from
+// the start.
+class twrpDecryptReader : public twrpStreamReader {
+public:
+	twrpDecryptReader(int in_fd, const std::string& Password, unsigned threads, twrpPipeStage *in_stage, twrpPipeStage *consumer, uint64_t Start_Offset = 0);
+	~twrpDecryptReader();
+	bool Start();
+	ssize_t Read(void *buf, size_t size);
+
+private:
+	struct Job {
+		std::vector<unsigned char> in;
+		std::vector<unsigned char> out;
+		uint64_t first_chunk;                                      // Index of the first TW_GCM_MAGIC chunk
+		bool last;                                                 // Input ended in this batch
+		bool claimed;
+		bool done;
+		bool error;
+	};
+
+	static void* Worker(void *cookie);
+	void Work();
+	bool Read_Header();                                                // Tells the formats apart and seeks to start_offset
+	bool Fill();                                                       // Reads input until enough batches are queued
+
+	int fd;
+	std::string password;
+	unsigned thread_count;
+	twrpPipeStage* stage;
+	twrpPipeStage* consumer_stage;
+	bool gcm;
+	unsigned char gcm_header[TW_GCM_HEADER_SIZE];
+	unsigned char gcm_key[32];
+	size_t chunk_in;                                                   // Bytes of one encrypted chunk
+	uint64_t next_chunk;
+	uint64_t start_offset;
+	size_t skip;                                                       // Data before start_offset in the first chunk
+	std::vector<unsigned char> pending;                                // Bytes read by Read_Header that belong to the first batch
+	std::vector<pthread_t> workers;
+	pthread_mutex_t lock;
+	pthread_cond_t job_ready;
+	pthread_cond_t job_done;
+	std::deque<Job*> jobs;                                             // In file order
+	Job* current;
+	size_t current_pos;
+	bool eof;
+	bool failed;
+	bool stopping;
+};
+#endif
+
+// Finishes regular files on a pool of threads. libtar still walks the
+// archive and creates every file, then the data is written with pwrite()
+// and the file is closed, owned and labelled by whichever worker is free,
+// so small files don't wait on each other's metadata updates. An entry
+// that replaces or hardlinks to a file still in the pool waits for it with
+// Wait_For(), so it sees the finished file as a serial extract would.
+class twrpExtractPool {
+public:
+	twrpExtractPool(unsigned threads, twrpPipeStage *in_stage, twrpPipeStage *producer);
+	~twrpExtractPool();
+	bool Start();
+	int Extract_Regfile(TAR *t, const char *realname, unsigned long long *progress); // Same result as tar_extract_file() for a regular file
+	int Finish();                                                      // Waits for every queued file, -1 if any failed
+	void Wait_For(const char *name);                                   // Waits until the file queued as name is finished
+
+private:
+	struct File {
+		int fd;
+		std::string name;
+		mode_t mode;
+		uid_t uid;
+		gid_t gid;
+		time_t mtime;
+		std::string context;
+		bool has_cap_data;
+		struct vfs_cap_data cap_data;
+		unsigned pending;                                              // Chunks not written yet
+		bool failed;
+	};
+
+	struct Chunk {
+		File* file;
+		off64_t offset;
+		std::vector<unsigned char> data;
+	};
+
+	static void* Worker(void *cookie);
+	void Work();
+	void Release(File *file, unsigned count);                          // Counts chunks as done, finishes the file after the last one
+	bool Close_File(File *file);
+
+	unsigned thread_count;
+	twrpPipeStage* stage;
+	twrpPipeStage* producer_stage;
+	std::vector<pthread_t> workers;
+	pthread_mutex_t lock;
+	pthread_cond_t chunk_ready;
+	pthread_cond_t space;
+	std::deque<Chunk*> chunks;
+	size_t queued_bytes;
+	size_t queue_limit;                                                // Most queued_bytes before the producer waits
+	twrpMemGrant queue_grant;
+	unsigned open_files;
+	std::unordered_set<std::string> open_names;                        // Names of the files not finished yet
+	bool failed;
+	bool stopping;
+};
+
+#endif // __TWRP_RESTORE_PIPELINE_HPP
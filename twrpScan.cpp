@@ -0,0 +1,303 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "twrpScan.hpp"
+#include "gui/gui.hpp"
+#include "twcommon.h"
+
+#define MAX_SCAN_THREADS 8
+
+twrpScan::twrpScan() {
+	total_size = 0;
+	file_count = 0;
+	valid = false;
+	excl = NULL;
+	split = false;
+	failed = false;
+	busy = 0;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&work_cond, NULL);
+}
+
+twrpScan::~twrpScan() {
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&lock);
+}
+
+bool twrpScan::Scan(const std::string& Path, TWExclude *exclusions, unsigned threads) {
+	std::vector<pthread_t> workers;
+	Folder* root;
+	unsigned i;
+
+	Invalidate();
+	if (threads == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores < 1 ? 1 : (unsigned) cores;
+	}
+	if (threads > MAX_SCAN_THREADS)
+		threads = MAX_SCAN_THREADS;
+	excl = exclusions;
+	split = threads > 1;
+	failed = false;
+	busy = 0;
+
+	root = new Folder;
+	root->path = Path;
+	root->depth = 1;
+	queue.push_back(root);
+	for (i = 1; i < threads; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Worker, this) != 0) {
+			LOGINFO("Unable to create scan thread %u, continuing with %u\n", i, i);
+			break;
+		}
+		workers.push_back(thread);
+	}
+	// This thread walks folders too
+	Worker(this);
+	for (i = 0; i < workers.size(); i++)
+		pthread_join(workers[i], NULL);
+
+	Append(root);
+	Free_Folder(root);
+	Sum_Entries();
+	excl = NULL;
+	scan_path = Path;
+	valid = !failed;
+	LOGINFO("Scanned '%s': %zu items, %llu files, %llu bytes\n", Path.c_str(), entries.size(), (unsigned long long)file_count, (unsigned long long)total_size);
+	return valid;
+}
+
+void twrpScan::Invalidate() {
+	std::vector<twrpScanEntry>().swap(entries);
+	scan_path.clear();
+	total_size = 0;
+	file_count = 0;
+	valid = false;
+}
+
+bool twrpScan::Is_Valid(const std::string& Path) {
+	return valid && Path == scan_path;
+}
+
+const std::vector<twrpScanEntry>& twrpScan::Get_Entries() {
+	return entries;
+}
+
+uint64_t twrpScan::Get_Size() {
+	return total_size;
+}
+
+uint64_t twrpScan::Get_File_Count() {
+	return file_count;
+}
+
+void* twrpScan::Worker(void *cookie) {
+	twrpScan* scan = (twrpScan*) cookie;
+
+	pthread_mutex_lock(&scan->lock);
+	while (true) {
+		while (scan->queue.empty() && scan->busy > 0)
+			pthread_cond_wait(&scan->work_cond, &scan->lock);
+		if (scan->queue.empty())
+			break; // Nothing queued and nobody walking, so nothing more will be queued
+		Folder* folder = scan->queue.front();
+		scan->queue.pop_front();
+		scan->busy++;
+		pthread_mutex_unlock(&scan->lock);
+		scan->Scan_Folder(folder);
+		pthread_mutex_lock(&scan->lock);
+		scan->busy--;
+		if (scan->busy == 0 && scan->queue.empty())
+			pthread_cond_broadcast(&scan->work_cond);
+	}
+	pthread_mutex_unlock(&scan->lock);
+	return NULL;
+}
+
+void twrpScan::Queue_Folder(Folder *folder) {
+	pthread_mutex_lock(&lock);
+	queue.push_back(folder);
+	pthread_cond_signal(&work_cond);
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpScan::Scan_Error(const std::string& Path) {
+	gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
+	pthread_mutex_lock(&lock);
+	failed = true;
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpScan::Scan_Folder(Folder *folder) {
+	// The top of the scan may be a symlink, the folders below it never are
+	int fd = open(folder->path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | (folder->depth > 1 ? O_NOFOLLOW : 0));
+	if (fd < 0) {
+		Scan_Error(folder->path);
+		return;
+	}
+	Walk(fd, folder->path, folder->depth, folder);
+}
+
+void twrpScan::Walk(int dir_fd, const std::string& Path, unsigned depth, Folder *folder) {
+	DIR* d;
+	struct dirent* de;
+	struct stat st;
+	std::string FullPath;
+	twrpScanEntry Entry;
+	size_t excl_dir = excl->find_dir(Path);
+
+	d = fdopendir(dir_fd);
+	if (d == NULL) {
+		Scan_Error(Path);
+		close(dir_fd);
+		return;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (excl->check_skip(excl_dir, de->d_name))
+			continue;
+		FullPath = Path + "/" + de->d_name;
+
+		Entry.type = de->d_type;
+		Entry.size = 0;
+		Entry.mtime = 0;
+		Entry.ctime = 0;
+		Entry.inode = 0;
+		if (Entry.type == DT_REG || Entry.type == DT_LNK || Entry.type == DT_UNKNOWN) {
+			// Only files and links need a stat, relative to the folder that is already open
+			if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(FullPath)(strerror(errno)));
+				LOGINFO("Real error: Unable to stat '%s'\n", FullPath.c_str());
+				continue;
+			}
+			if (S_ISDIR(st.st_mode))
+				Entry.type = DT_DIR;
+			else if (S_ISREG(st.st_mode))
+				Entry.type = DT_REG;
+			else if (S_ISLNK(st.st_mode))
+				Entry.type = DT_LNK;
+			if (Entry.type == DT_REG) {
+				Entry.size = (uint64_t)(st.st_size);
+				// A rewrite within the same second only shows in the nanoseconds
+				Entry.mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+				Entry.ctime = (uint64_t)st.st_ctim.tv_sec * 1000000000ULL + st.st_ctim.tv_nsec;
+				Entry.inode = (uint64_t)(st.st_ino);
+			} else if (Entry.type == DT_LNK) {
+				// Counted with the length of its target, as Get_Folder_Size() does
+				Entry.size = (uint64_t)(st.st_size);
+			}
+		}
+		if (Entry.type != DT_DIR && Entry.type != DT_REG && Entry.type != DT_LNK)
+			continue;
+
+		Entry.fn = FullPath;
+		Entry.depth = depth;
+		Entry.files = 0;
+		Entry.end = 0;
+		folder->entries.push_back(Entry);
+		if (Entry.type != DT_DIR)
+			continue;
+
+		if (split && depth < TW_SCAN_SPLIT_DEPTH) {
+			// Let another worker walk this folder, its items go right after it
+			Folder* sub = new Folder;
+			sub->path = FullPath;
+			sub->depth = depth + 1;
+			folder->subfolders.push_back(std::make_pair(folder->entries.size(), sub));
+			Queue_Folder(sub);
+		} else {
+			int sub_fd = openat(dirfd(d), de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+			if (sub_fd < 0) {
+				Scan_Error(FullPath);
+				continue;
+			}
+			Walk(sub_fd, FullPath, depth + 1, folder);
+		}
+	}
+	closedir(d);
+}
+
+void twrpScan::Append(Folder *folder) {
+	size_t i, sub = 0;
+
+	if (entries.empty() && folder->subfolders.empty()) {
+		entries.swap(folder->entries);
+		return;
+	}
+	for (i = 0; i <= folder->entries.size(); i++) {
+		while (sub < folder->subfolders.size() && folder->subfolders[sub].first == i) {
+			Append(folder->subfolders[sub].second);
+			sub++;
+		}
+		if (i < folder->entries.size())
+			entries.push_back(folder->entries[i]);
+	}
+}
+
+void twrpScan::Free_Folder(Folder *folder) {
+	size_t i;
+
+	for (i = 0; i < folder->subfolders.size(); i++)
+		Free_Folder(folder->subfolders[i].second);
+	delete folder;
+}
+
+void twrpScan::Sum_Entries() {
+	std::vector<size_t> open_dirs;
+	size_t i;
+
+	total_size = 0;
+	file_count = 0;
+	for (i = 0; i <= entries.size(); i++) {
+		unsigned depth = i < entries.size() ? entries[i].depth : 0;
+
+		// Close the folders this item is not inside of
+		while (!open_dirs.empty() && entries[open_dirs.back()].depth >= depth) {
+			twrpScanEntry& dir = entries[open_dirs.back()];
+			dir.end = i;
+			open_dirs.pop_back();
+			if (!open_dirs.empty()) {
+				entries[open_dirs.back()].size += dir.size;
+				entries[open_dirs.back()].files += dir.files;
+			}
+		}
+		if (i == entries.size())
+			break;
+		if (entries[i].type == DT_DIR) {
+			open_dirs.push_back(i);
+		} else {
+			total_size += entries[i].size;
+			if (!open_dirs.empty())
+				entries[open_dirs.back()].size += entries[i].size;
+			if (entries[i].type == DT_REG) {
+				file_count++;
+				if (!open_dirs.empty())
+					entries[open_dirs.back()].files++;
+			}
+		}
+	}
+}
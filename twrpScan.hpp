@@ -0,0 +1,94 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_SCAN_HPP
+#define __TWRP_SCAN_HPP
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <deque>
+#include <string>
+#include <vector>
+#include "exclude.hpp"
+
+// Folders this close to the top of the scan are walked by their own task
+// so the worker threads can share the tree
+#define TW_SCAN_SPLIT_DEPTH 3
+
+struct twrpScanEntry {
+	std::string fn;                                                         // Full path
+	unsigned char type;                                                     // DT_DIR, DT_REG or DT_LNK
+	unsigned depth;                                                         // 1 for items directly in the scanned folder
+	uint64_t size;                                                          // File or link size, for folders the size of all files and links below
+	uint64_t mtime;                                                         // Files: modification time in nanoseconds
+	uint64_t ctime;                                                         // Files: status change time in nanoseconds
+	uint64_t inode;                                                         // Files: inode number
+	uint64_t files;                                                         // Folders: number of files below
+	size_t end;                                                             // Folders: index after the last item below
+};
+
+// A single walk of a folder tree that gives the backup size, the file count
+// and the list of items for tar, in directory order with every folder ahead
+// of its contents. Items that the exclusions skip, and device nodes, sockets
+// and fifos are left out, the same way tar leaves them out.
+class twrpScan {
+public:
+	twrpScan();
+	~twrpScan();
+	bool Scan(const std::string& Path, TWExclude *exclusions, unsigned threads = 0); // threads 0 picks one per core, false if part of the tree could not be read
+	void Invalidate();                                                      // Drop the result, called when the partition is mounted, unmounted or changed
+	bool Is_Valid(const std::string& Path);                                 // True if Path was scanned without errors since the last Invalidate()
+	const std::vector<twrpScanEntry>& Get_Entries();
+	uint64_t Get_Size();                                                    // Total size of the files and links
+	uint64_t Get_File_Count();
+
+private:
+	struct Folder {
+		std::string path;
+		unsigned depth;                                                     // Depth of the items inside this folder
+		std::vector<twrpScanEntry> entries;
+		std::vector<std::pair<size_t, Folder*> > subfolders;                // Folders walked by their own task, inserted ahead of entries[first]
+	};
+
+	static void* Worker(void *cookie);
+	void Scan_Folder(Folder *folder);
+	void Walk(int dir_fd, const std::string& Path, unsigned depth, Folder *folder);
+	void Queue_Folder(Folder *folder);
+	void Scan_Error(const std::string& Path);
+	void Append(Folder *folder);
+	void Free_Folder(Folder *folder);
+	void Sum_Entries();
+
+	std::string scan_path;
+	std::vector<twrpScanEntry> entries;
+	uint64_t total_size;
+	uint64_t file_count;
+	bool valid;
+
+	// Only used while a scan is running
+	TWExclude *excl;
+	bool split;
+	bool failed;
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	std::deque<Folder*> queue;
+	unsigned busy;                                                          // Folders being walked right now
+};
+
+#endif // __TWRP_SCAN_HPP
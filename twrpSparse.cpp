@@ -0,0 +1,625 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <sparse_format.h>
+#include "twrpSparse.hpp"
+#include "twcommon.h"
+
+// Keeps the byte count of a raw chunk well inside its 32 bit size field
+#define TW_SPARSE_MAX_RAW (64 * 1024 * 1024)
+
+// ext4 superblock fields used to find the block bitmaps
+#define EXT4_SUPERBLOCK_OFFSET 1024
+#define EXT4_SUPER_MAGIC 0xEF53
+#define EXT4_FEATURE_INCOMPAT_META_BG 0x0010
+#define EXT4_FEATURE_INCOMPAT_64BIT 0x0080
+#define EXT4_BG_BLOCK_UNINIT 0x0002
+
+static uint16_t Get_Le16(const unsigned char *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t Get_Le32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool Read_At(int fd, void *buf, size_t size, uint64_t offset) {
+	unsigned char* p = (unsigned char*) buf;
+	while (size > 0) {
+		ssize_t r = pread(fd, p, size, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return false;
+		p += r;
+		size -= r;
+		offset += r;
+	}
+	return true;
+}
+
+twrpSparseWriter::twrpSparseWriter(int out_fd, uint32_t block_size) {
+	fd = out_fd;
+	blk_sz = block_size;
+	total_blocks = 0;
+	added_blocks = 0;
+	chunk_count = 0;
+	stored_size = 0;
+	pending_type = 0;
+	pending_value = 0;
+	pending_blocks = 0;
+}
+
+bool twrpSparseWriter::Start(uint64_t Total_Size) {
+	sparse_header_t header;
+
+	if (blk_sz == 0 || blk_sz % 4 != 0 || Total_Size % blk_sz != 0 || Total_Size / blk_sz > UINT32_MAX)
+		return false;
+	total_blocks = Total_Size / blk_sz;
+	// Finish() rewrites the header with the chunk count
+	memset(&header, 0, sizeof(header));
+	header.magic = SPARSE_HEADER_MAGIC;
+	header.major_version = 1;
+	header.file_hdr_sz = sizeof(sparse_header_t);
+	header.chunk_hdr_sz = sizeof(chunk_header_t);
+	header.blk_sz = blk_sz;
+	header.total_blks = total_blocks;
+	return Write_All(&header, sizeof(header));
+}
+
+bool twrpSparseWriter::Write(const void *buf, size_t size) {
+	const unsigned char* p = (const unsigned char*) buf;
+	size_t blocks = size / blk_sz, i, raw_start = 0, raw_blocks = 0;
+
+	for (i = 0; i < blocks; i++) {
+		const uint32_t* words = (const uint32_t*)(p + i * blk_sz);
+		uint32_t value = words[0];
+		size_t w;
+
+		for (w = 1; w < blk_sz / 4; w++) {
+			if (words[w] != value)
+				break;
+		}
+		if (w < blk_sz / 4) {
+			// Raw data, runs are written once they end
+			if (raw_blocks == 0) {
+				if (!Flush_Pending())
+					return false;
+				raw_start = i;
+			}
+			raw_blocks++;
+			if ((uint64_t)raw_blocks * blk_sz < TW_SPARSE_MAX_RAW)
+				continue;
+		} else if (raw_blocks == 0) {
+			if (pending_type != CHUNK_TYPE_FILL || pending_value != value || pending_blocks >= UINT32_MAX) {
+				if (!Flush_Pending())
+					return false;
+				pending_type = CHUNK_TYPE_FILL;
+				pending_value = value;
+			}
+			pending_blocks++;
+			continue;
+		}
+		if (!Write_Chunk(CHUNK_TYPE_RAW, raw_blocks, p + raw_start * blk_sz, raw_blocks * blk_sz))
+			return false;
+		stored_size += (uint64_t)raw_blocks * blk_sz;
+		raw_blocks = 0;
+		if (w == blk_sz / 4) {
+			// This block is a fill that ended the raw run
+			pending_type = CHUNK_TYPE_FILL;
+			pending_value = value;
+			pending_blocks = 1;
+		}
+	}
+	if (raw_blocks > 0) {
+		if (!Write_Chunk(CHUNK_TYPE_RAW, raw_blocks, p + raw_start * blk_sz, raw_blocks * blk_sz))
+			return false;
+		stored_size += (uint64_t)raw_blocks * blk_sz;
+	}
+	return true;
+}
+
+bool twrpSparseWriter::Skip(uint64_t size) {
+	uint64_t blocks = size / blk_sz;
+
+	if (pending_type != CHUNK_TYPE_DONT_CARE && !Flush_Pending())
+		return false;
+	pending_type = CHUNK_TYPE_DONT_CARE;
+	pending_blocks += blocks;
+	return true;
+}
+
+bool twrpSparseWriter::Finish() {
+	sparse_header_t header;
+
+	if (!Flush_Pending())
+		return false;
+	if (added_blocks != total_blocks) {
+		LOGINFO("Sparse image has %llu of %llu blocks\n", (unsigned long long)added_blocks, (unsigned long long)total_blocks);
+		return false;
+	}
+	memset(&header, 0, sizeof(header));
+	header.magic = SPARSE_HEADER_MAGIC;
+	header.major_version = 1;
+	header.file_hdr_sz = sizeof(sparse_header_t);
+	header.chunk_hdr_sz = sizeof(chunk_header_t);
+	header.blk_sz = blk_sz;
+	header.total_blks = total_blocks;
+	header.total_chunks = chunk_count;
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+		LOGINFO("Error writing sparse header: %s\n", strerror(errno));
+		return false;
+	}
+	LOGINFO("Sparse image has %u chunks, %llu of %llu bytes stored\n", chunk_count, (unsigned long long)stored_size,
+		(unsigned long long)(total_blocks * blk_sz));
+	return true;
+}
+
+uint64_t twrpSparseWriter::Stored_Size() {
+	return stored_size;
+}
+
+bool twrpSparseWriter::Flush_Pending() {
+	bool ret = true;
+
+	// Don't care runs can be longer than one chunk
+	while (ret && pending_blocks > 0) {
+		uint32_t blocks = pending_blocks > UINT32_MAX ? UINT32_MAX : pending_blocks;
+		if (pending_type == CHUNK_TYPE_FILL)
+			ret = Write_Chunk(CHUNK_TYPE_FILL, blocks, &pending_value, sizeof(pending_value));
+		else
+			ret = Write_Chunk(CHUNK_TYPE_DONT_CARE, blocks, NULL, 0);
+		pending_blocks -= blocks;
+	}
+	pending_type = 0;
+	pending_blocks = 0;
+	return ret;
+}
+
+bool twrpSparseWriter::Write_Chunk(uint16_t type, uint32_t blocks, const void *data, uint32_t data_size) {
+	chunk_header_t chunk;
+
+	chunk.chunk_type = type;
+	chunk.reserved1 = 0;
+	chunk.chunk_sz = blocks;
+	chunk.total_sz = sizeof(chunk) + data_size;
+	if (!Write_All(&chunk, sizeof(chunk)) || (data_size > 0 && !Write_All(data, data_size)))
+		return false;
+	chunk_count++;
+	added_blocks += blocks;
+	return true;
+}
+
+bool twrpSparseWriter::Write_All(const void *buf, size_t size) {
+	const unsigned char* p = (const unsigned char*) buf;
+	while (size > 0) {
+		ssize_t w = write(fd, p, size);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0) {
+			LOGINFO("Error writing sparse image: %s\n", strerror(errno));
+			return false;
+		}
+		p += w;
+		size -= w;
+	}
+	return true;
+}
+
+// Buffers of the flasher are aligned like those of twrpRawCopy
+#define TW_SPARSE_ALIGN 4096
+
+twrpSparseFlasher::twrpSparseFlasher(size_t buffer_size, unsigned buffer_count) {
+	unsigned i;
+
+	buf_size = buffer_size;
+	buffers.resize(buffer_count < 2 ? 2 : buffer_count);
+	for (i = 0; i < buffers.size(); i++) {
+		if (posix_memalign(&buffers[i].data, TW_SPARSE_ALIGN, buf_size) != 0)
+			buffers[i].data = NULL;
+		buffers[i].full = false;
+	}
+	if (posix_memalign(&pattern, TW_SPARSE_ALIGN, buf_size) != 0)
+		pattern = NULL;
+	else
+		memset(pattern, 0, buf_size);
+	pattern_value = 0;
+	parse_index = 0;
+	src = -1;
+	dst = -1;
+	discard = false;
+	discard_failed = false;
+	parse_done = false;
+	parse_failed = false;
+	stop = false;
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+twrpSparseFlasher::~twrpSparseFlasher() {
+	for (size_t i = 0; i < buffers.size(); i++)
+		free(buffers[i].data);
+	free(pattern);
+	pthread_mutex_destroy(&lock);
+	pthread_cond_destroy(&cond);
+}
+
+twrpSparseFlasher::Buffer* twrpSparseFlasher::Next_Buffer() {
+	Buffer* buf = &buffers[parse_index];
+
+	pthread_mutex_lock(&lock);
+	while (buf->full && !stop)
+		pthread_cond_wait(&cond, &lock);
+	bool stopped = stop;
+	pthread_mutex_unlock(&lock);
+	if (stopped)
+		return NULL;
+	buf->len = 0;
+	buf->fill = 0;
+	return buf;
+}
+
+bool twrpSparseFlasher::Queue(Buffer *buf) {
+	pthread_mutex_lock(&lock);
+	buf->full = true;
+	parse_index = (parse_index + 1) % buffers.size();
+	pthread_cond_broadcast(&cond);
+	bool stopped = stop;
+	pthread_mutex_unlock(&lock);
+	return !stopped;
+}
+
+bool twrpSparseFlasher::Parse() {
+	sparse_header_t header;
+	chunk_header_t chunk;
+	Buffer* cur = NULL;                                                // Raw run being read
+	uint64_t in_off, out_off = 0, len;
+	uint32_t c, data_size;
+
+	if (!Read_At(src, &header, sizeof(header), 0) || header.magic != SPARSE_HEADER_MAGIC || header.major_version != 1 ||
+			header.file_hdr_sz < sizeof(header) || header.chunk_hdr_sz < sizeof(chunk) || header.blk_sz == 0 || header.blk_sz % 4 != 0) {
+		LOGINFO("Invalid sparse image header\n");
+		return false;
+	}
+	in_off = header.file_hdr_sz;
+	for (c = 0; c < header.total_chunks; c++) {
+		if (!Read_At(src, &chunk, sizeof(chunk), in_off) || chunk.total_sz < header.chunk_hdr_sz) {
+			LOGINFO("Invalid sparse chunk %u\n", c);
+			return false;
+		}
+		in_off += header.chunk_hdr_sz;
+		len = (uint64_t)chunk.chunk_sz * header.blk_sz;
+		data_size = chunk.total_sz - header.chunk_hdr_sz;
+		switch (chunk.chunk_type) {
+			case CHUNK_TYPE_RAW:
+				if (data_size != len) {
+					LOGINFO("Invalid size of raw sparse chunk %u\n", c);
+					return false;
+				}
+				while (len > 0) {
+					if (cur && (cur->offset + cur->len != out_off || cur->len == buf_size)) {
+						if (!Queue(cur))
+							return false;
+						cur = NULL;
+					}
+					if (!cur) {
+						if ((cur = Next_Buffer()) == NULL)
+							return false;
+						cur->type = CHUNK_TYPE_RAW;
+						cur->offset = out_off;
+					}
+					size_t n = len < buf_size - cur->len ? (size_t)len : buf_size - cur->len;
+					if (!Read_At(src, (unsigned char*)cur->data + cur->len, n, in_off)) {
+						LOGINFO("Sparse image ends inside chunk %u\n", c);
+						return false;
+					}
+					cur->len += n;
+					in_off += n;
+					out_off += n;
+					len -= n;
+				}
+				break;
+			case CHUNK_TYPE_FILL:
+			case CHUNK_TYPE_DONT_CARE:
+			{
+				uint32_t fill = 0;
+				if (data_size != (chunk.chunk_type == CHUNK_TYPE_FILL ? sizeof(fill) : 0) ||
+						(data_size && !Read_At(src, &fill, sizeof(fill), in_off))) {
+					LOGINFO("Invalid sparse chunk %u\n", c);
+					return false;
+				}
+				in_off += data_size;
+				if (chunk.chunk_type == CHUNK_TYPE_FILL || discard) {
+					if (cur && !Queue(cur))
+						return false;
+					if ((cur = Next_Buffer()) == NULL)
+						return false;
+					cur->type = chunk.chunk_type;
+					cur->offset = out_off;
+					cur->len = len;
+					cur->fill = fill;
+					if (!Queue(cur))
+						return false;
+					cur = NULL;
+				}
+				out_off += len;
+				break;
+			}
+			case CHUNK_TYPE_CRC32:
+				in_off += data_size;
+				break;
+			default:
+				LOGINFO("Unknown type %x of sparse chunk %u\n", chunk.chunk_type, c);
+				return false;
+		}
+	}
+	if (cur && !Queue(cur))
+		return false;
+	if (out_off != (uint64_t)header.total_blks * header.blk_sz) {
+		LOGINFO("Sparse image chunks cover %llu of %llu bytes\n", (unsigned long long)out_off,
+			(unsigned long long)header.total_blks * header.blk_sz);
+		return false;
+	}
+	return true;
+}
+
+void* twrpSparseFlasher::Parser_Thread(void *cookie) {
+	twrpSparseFlasher* flasher = (twrpSparseFlasher*) cookie;
+	bool ret = flasher->Parse();
+
+	pthread_mutex_lock(&flasher->lock);
+	flasher->parse_failed = !ret;
+	flasher->parse_done = true;
+	pthread_cond_broadcast(&flasher->cond);
+	pthread_mutex_unlock(&flasher->lock);
+	return NULL;
+}
+
+bool twrpSparseFlasher::Write_Pattern(uint64_t offset, uint64_t len, uint32_t fill) {
+	if (fill != pattern_value) {
+		uint32_t* words = (uint32_t*) pattern;
+		for (size_t i = 0; i < buf_size / 4; i++)
+			words[i] = fill;
+		pattern_value = fill;
+	}
+	while (len > 0) {
+		size_t n = len < buf_size ? (size_t)len : buf_size;
+		ssize_t w = pwrite(dst, pattern, n, offset);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		offset += w;
+		len -= w;
+	}
+	return true;
+}
+
+bool twrpSparseFlasher::Write_Run(Buffer *buf) {
+	uint64_t range[2] = { buf->offset, buf->len };
+
+	if (buf->type == CHUNK_TYPE_DONT_CARE) {
+		// Whatever the device returns for discarded blocks is fine here
+		if (!discard_failed && ioctl(dst, BLKDISCARD, &range) != 0) {
+			LOGINFO("Unable to discard don't care chunks (%s), leaving them as they are\n", strerror(errno));
+			discard_failed = true;
+		}
+		return true;
+	}
+	if (buf->type == CHUNK_TYPE_FILL) {
+		if (buf->fill == 0 && ioctl(dst, BLKZEROOUT, &range) == 0)
+			return true;
+		return Write_Pattern(buf->offset, buf->len, buf->fill);
+	}
+
+	unsigned char* p = (unsigned char*) buf->data;
+	uint64_t offset = buf->offset, len = buf->len;
+	while (len > 0) {
+		ssize_t w = pwrite(dst, p, len, offset);
+		if (w < 0 && errno == EINTR)
+			continue;
+		if (w <= 0)
+			return false;
+		p += w;
+		offset += w;
+		len -= w;
+	}
+	return true;
+}
+
+bool twrpSparseFlasher::Flash(int in_fd, int out_fd, bool Discard, std::function<bool(uint64_t)> Progress) {
+	pthread_t thread;
+	size_t slot;
+	bool ret = true;
+
+	for (slot = 0; slot < buffers.size(); slot++) {
+		if (buffers[slot].data == NULL || pattern == NULL) {
+			LOGINFO("twrpSparseFlasher failed to allocate buffers\n");
+			return false;
+		}
+		buffers[slot].full = false;
+	}
+	src = in_fd;
+	dst = out_fd;
+	discard = Discard;
+	discard_failed = false;
+	parse_index = 0;
+	parse_done = false;
+	parse_failed = false;
+	stop = false;
+	if (pthread_create(&thread, NULL, Parser_Thread, this) != 0) {
+		LOGINFO("twrpSparseFlasher unable to start parser thread\n");
+		return false;
+	}
+
+	slot = 0;
+	for (;;) {
+		Buffer& buf = buffers[slot];
+
+		pthread_mutex_lock(&lock);
+		while (!buf.full && !parse_done)
+			pthread_cond_wait(&cond, &lock);
+		bool full = buf.full;
+		pthread_mutex_unlock(&lock);
+		if (!full)
+			break;
+		if (!Write_Run(&buf)) {
+			LOGINFO("Error writing sparse image at %llu (%s)\n", (unsigned long long)buf.offset, strerror(errno));
+			ret = false;
+			break;
+		}
+		uint64_t done = buf.offset + buf.len;
+		pthread_mutex_lock(&lock);
+		buf.full = false;
+		pthread_cond_broadcast(&cond);
+		pthread_mutex_unlock(&lock);
+		if (!Progress(done)) {
+			ret = false;
+			break;
+		}
+		slot = (slot + 1) % buffers.size();
+	}
+
+	pthread_mutex_lock(&lock);
+	stop = true;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+	pthread_join(thread, NULL);
+	if (ret && !parse_failed && fsync(dst) != 0 && errno != EINVAL) {
+		LOGINFO("Error syncing sparse image target (%s)\n", strerror(errno));
+		ret = false;
+	}
+	return ret && !parse_failed;
+}
+
+twrpBlockMap::twrpBlockMap() {
+	block_size = TW_SPARSE_BLOCK_SIZE;
+	fs_blocks = 0;
+}
+
+bool twrpBlockMap::Load(int fd, uint64_t Device_Size) {
+	block_size = TW_SPARSE_BLOCK_SIZE;
+	fs_blocks = 0;
+	used.clear();
+	// f2fs keeps its allocation state in the SIT and NAT areas, which change
+	// with every checkpoint, so only ext4 bitmaps are read
+	if (Load_Ext4(fd, Device_Size))
+		return true;
+	block_size = TW_SPARSE_BLOCK_SIZE;
+	fs_blocks = 0;
+	used.clear();
+	return false;
+}
+
+uint32_t twrpBlockMap::Block_Size() {
+	return block_size;
+}
+
+bool twrpBlockMap::Used(uint64_t block) {
+	if (block >= fs_blocks)
+		return true;
+	return used[block];
+}
+
+bool twrpBlockMap::Load_Ext4(int fd, uint64_t Device_Size) {
+	unsigned char sb[1024];
+	uint64_t blocks, group, groups, first_block, bitmap_block;
+	uint32_t blocks_per_group, desc_size, incompat, i;
+
+	if (!Read_At(fd, sb, sizeof(sb), EXT4_SUPERBLOCK_OFFSET) || Get_Le16(sb + 0x38) != EXT4_SUPER_MAGIC)
+		return false;
+	if (Get_Le32(sb + 0x18) > 6)
+		return false;
+	block_size = 1024 << Get_Le32(sb + 0x18);
+	incompat = Get_Le32(sb + 0x60);
+	if (incompat & EXT4_FEATURE_INCOMPAT_META_BG) {
+		LOGINFO("ext4 meta_bg layout is not supported, not reading block bitmaps\n");
+		return false;
+	}
+	blocks = Get_Le32(sb + 0x04);
+	desc_size = 32;
+	if (incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+		blocks |= (uint64_t)Get_Le32(sb + 0x150) << 32;
+		desc_size = Get_Le16(sb + 0xFE);
+		if (desc_size < 64 || desc_size > block_size)
+			return false;
+	}
+	first_block = Get_Le32(sb + 0x14);
+	blocks_per_group = Get_Le32(sb + 0x20);
+	if (blocks == 0 || first_block >= blocks || blocks_per_group == 0 || blocks_per_group > block_size * 8)
+		return false;
+	if (blocks * block_size > Device_Size) {
+		LOGINFO("ext4 file system is larger than its partition, not reading block bitmaps\n");
+		return false;
+	}
+
+	groups = (blocks - first_block + blocks_per_group - 1) / blocks_per_group;
+	std::vector<unsigned char> gdt(groups * desc_size);
+	std::vector<unsigned char> bitmap(block_size);
+	if (!Read_At(fd, &gdt[0], gdt.size(), (first_block + 1) * block_size))
+		return false;
+
+	// Blocks of groups without an initialized bitmap still count as used, they
+	// can hold metadata of the group
+	used.assign(blocks, true);
+	for (group = 0; group < groups; group++) {
+		const unsigned char* desc = &gdt[group * desc_size];
+		uint64_t start = first_block + group * blocks_per_group;
+
+		if (Get_Le16(desc + 0x12) & EXT4_BG_BLOCK_UNINIT)
+			continue;
+		bitmap_block = Get_Le32(desc);
+		if (desc_size >= 64)
+			bitmap_block |= (uint64_t)Get_Le32(desc + 0x20) << 32;
+		if (bitmap_block == 0 || bitmap_block >= blocks || !Read_At(fd, &bitmap[0], block_size, bitmap_block * block_size)) {
+			LOGINFO("Unable to read the block bitmap of ext4 group %llu\n", (unsigned long long)group);
+			return false;
+		}
+		for (i = 0; i < blocks_per_group && start + i < blocks; i++)
+			used[start + i] = (bitmap[i / 8] >> (i % 8)) & 1;
+	}
+	fs_blocks = blocks;
+	LOGINFO("Read ext4 block bitmaps, %llu blocks of %u bytes\n", (unsigned long long)blocks, block_size);
+	return true;
+}
+
+bool twrpSparse_Get_Size(const std::string& Filename, uint64_t *Size) {
+	sparse_header_t header;
+	int fd;
+	bool ret;
+
+	fd = open(Filename.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	ret = Read_At(fd, &header, sizeof(header), 0) && header.magic == SPARSE_HEADER_MAGIC && header.file_hdr_sz >= sizeof(header);
+	close(fd);
+	if (ret)
+		*Size = (uint64_t)header.total_blks * header.blk_sz;
+	return ret;
+}
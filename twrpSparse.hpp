@@ -0,0 +1,133 @@
+/*
+        Copyright 2013 to 2018 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_SPARSE_HPP
+#define __TWRP_SPARSE_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Block size used when the image does not hold a known file system
+#define TW_SPARSE_BLOCK_SIZE 4096
+// Buffer size of twrpSparseFlasher, raw chunks are merged up to this much
+#define TW_SPARSE_FLASH_BUFFER (4 * 1024 * 1024)
+
+// Writes an Android sparse image of a block device to out_fd. Blocks passed
+// to Write() are stored as raw data, or as a fill if every 32 bit word in
+// them is the same. Skipped blocks are left untouched when the image is
+// flashed back, or discarded if twrpSparseFlasher is asked to. out_fd must be seekable, the header is
+// rewritten by Finish() once the chunk count is known.
+class twrpSparseWriter {
+public:
+	twrpSparseWriter(int out_fd, uint32_t block_size);
+	bool Start(uint64_t Total_Size);                                   // Total_Size has to be a multiple of the block size
+	bool Write(const void *buf, size_t size);                          // Whole blocks only
+	bool Skip(uint64_t size);                                          // Whole blocks only
+	bool Finish();                                                     // Fails if fewer than Total_Size bytes were added
+	uint64_t Stored_Size();                                            // Bytes of raw data in the image so far
+
+private:
+	bool Flush_Pending();
+	bool Write_Chunk(uint16_t type, uint32_t blocks, const void *data, uint32_t data_size);
+	bool Write_All(const void *buf, size_t size);
+
+	int fd;
+	uint32_t blk_sz;
+	uint64_t total_blocks;
+	uint64_t added_blocks;
+	uint32_t chunk_count;
+	uint64_t stored_size;
+	uint16_t pending_type;                                             // Fill or don't care run waiting to be written, 0 for none
+	uint32_t pending_value;
+	uint64_t pending_blocks;
+};
+
+// Expands a sparse image onto a block device. A thread parses the chunks and
+// reads the raw data into a ring of aligned buffers, merging raw chunks that
+// follow each other, while the calling thread writes them with large
+// pwrite()s. Zero fills become BLKZEROOUT and other fills are written from a
+// pattern buffer. Don't care chunks are skipped, or discarded with
+// BLKDISCARD when Discard is set. Ioctls the target does not support fall
+// back to writes, so the target can be a plain file as well.
+class twrpSparseFlasher {
+public:
+	twrpSparseFlasher(size_t buffer_size, unsigned buffer_count);
+	~twrpSparseFlasher();
+	// Progress gets the bytes of the expanded image done so far and stops
+	// the flash by returning false
+	bool Flash(int in_fd, int out_fd, bool Discard, std::function<bool(uint64_t)> Progress);
+
+private:
+	struct Buffer {
+		void* data;
+		uint64_t offset;                                           // Where the run starts on the target
+		uint64_t len;
+		uint16_t type;                                             // CHUNK_TYPE_RAW, _FILL or _DONT_CARE
+		uint32_t fill;
+		bool full;
+	};
+
+	static void* Parser_Thread(void *cookie);
+	bool Parse();
+	Buffer* Next_Buffer();                                             // Waits for a free buffer, NULL if the flash stopped
+	bool Queue(Buffer *buf);
+	bool Write_Run(Buffer *buf);
+	bool Write_Pattern(uint64_t offset, uint64_t len, uint32_t fill);
+
+	std::vector<Buffer> buffers;
+	size_t buf_size;
+	size_t parse_index;                                                // Buffer the parser fills next
+	void* pattern;                                                     // buf_size bytes of the current fill value
+	uint32_t pattern_value;
+	int src;
+	int dst;
+	bool discard;
+	bool discard_failed;                                               // The target refused a discard, the rest are skipped
+	bool parse_done;
+	bool parse_failed;
+	bool stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+// Blocks of a partition that its file system uses. Blocks outside of the
+// file system, such as a crypto footer or verity data, always count as used.
+class twrpBlockMap {
+public:
+	twrpBlockMap();
+	bool Load(int fd, uint64_t Device_Size);                           // false if no supported file system was found
+	uint32_t Block_Size();
+	bool Used(uint64_t block);
+
+private:
+	bool Load_Ext4(int fd, uint64_t Device_Size);
+
+	uint32_t block_size;
+	uint64_t fs_blocks;
+	std::vector<bool> used;
+};
+
+// Size of the device that a sparse image expands to, false if Filename is
+// not a sparse image
+bool twrpSparse_Get_Size(const std::string& Filename, uint64_t *Size);
+
+#endif // __TWRP_SPARSE_HPP
@@ -0,0 +1,126 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include "twrpStartupTasks.hpp"
+#include "twrpStartupTrace.hpp"
+#include "twcommon.h"
+
+twrpStartupTasks::twrpStartupTasks() {
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&cond, NULL);
+}
+
+twrpStartupTasks::~twrpStartupTasks() {
+	for (size_t i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&lock);
+}
+
+int twrpStartupTasks::Add(const char* Name, Task Run, const std::vector<int>& After) {
+	Item item;
+	item.name = Name;
+	item.run = Run;
+	// Only tasks added before this one, so that the tasks can't wait in a circle
+	for (size_t i = 0; i < After.size(); i++) {
+		if (After[i] >= 0 && After[i] < (int) items.size())
+			item.after.push_back(After[i]);
+	}
+	item.state = PENDING;
+	items.push_back(item);
+	return items.size() - 1;
+}
+
+void twrpStartupTasks::Start() {
+	size_t count = items.size() < TW_STARTUP_THREADS ? items.size() : TW_STARTUP_THREADS;
+	for (size_t i = 0; i < count; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Worker, this) == 0)
+			threads.push_back(thread);
+	}
+	if (threads.empty() && count > 0) {
+		LOGINFO("Unable to start startup threads, running startup tasks in order\n");
+		Worker(this);
+	}
+}
+
+bool twrpStartupTasks::Wait(int Index) {
+	if (Index < 0 || Index >= (int) items.size())
+		return false;
+	pthread_mutex_lock(&lock);
+	while (items[Index].state == PENDING || items[Index].state == RUNNING)
+		pthread_cond_wait(&cond, &lock);
+	bool ret = items[Index].state == DONE;
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+int twrpStartupTasks::Next() {
+	bool left = false;
+	for (size_t i = 0; i < items.size(); i++) {
+		if (items[i].state != PENDING)
+			continue;
+		bool ready = true;
+		for (size_t a = 0; a < items[i].after.size(); a++) {
+			State state = items[items[i].after[a]].state;
+			if (state == FAILED) {
+				LOGINFO("Skipping startup task '%s'\n", items[i].name);
+				items[i].state = FAILED;
+				pthread_cond_broadcast(&cond);
+				ready = false;
+				break;
+			}
+			if (state != DONE)
+				ready = false;
+		}
+		if (ready)
+			return i;
+		if (items[i].state == PENDING)
+			left = true;
+	}
+	return left ? -1 : -2;
+}
+
+void* twrpStartupTasks::Worker(void* cookie) {
+	twrpStartupTasks* tasks = (twrpStartupTasks*) cookie;
+
+	pthread_mutex_lock(&tasks->lock);
+	for (;;) {
+		int index = tasks->Next();
+		if (index == -2)
+			break;
+		if (index == -1) {
+			pthread_cond_wait(&tasks->cond, &tasks->lock);
+			continue;
+		}
+		Item& item = tasks->items[index];
+		item.state = RUNNING;
+		pthread_mutex_unlock(&tasks->lock);
+
+		int phase = twrpStartupTrace::Begin(item.name);
+		bool ret = item.run();
+		twrpStartupTrace::End(phase);
+
+		pthread_mutex_lock(&tasks->lock);
+		item.state = ret ? DONE : FAILED;
+		pthread_cond_broadcast(&tasks->cond);
+	}
+	pthread_mutex_unlock(&tasks->lock);
+	return NULL;
+}
@@ -0,0 +1,68 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_STARTUP_TASKS_HPP
+#define __TWRP_STARTUP_TASKS_HPP
+
+#include <pthread.h>
+#include <functional>
+#include <vector>
+
+#define TW_STARTUP_THREADS 2
+
+// Runs the steps of startup that don't need each other at the same time.
+// Each task names the tasks it has to wait for; a few threads pick up the
+// tasks whose inputs are ready, and main() waits for the ones it needs
+// before going on. All tasks are added before Start(). A task that fails
+// makes the tasks after it fail too, without running them. Each task is a
+// phase of the startup trace.
+class twrpStartupTasks {
+public:
+	typedef std::function<bool()> Task;                               // False if startup can't go on
+
+	twrpStartupTasks();
+	~twrpStartupTasks();                                               // Waits for all of the tasks
+
+	int Add(const char* Name, Task Run, const std::vector<int>& After = std::vector<int>()); // Index to hand to Wait() and to later tasks
+	void Start();
+	bool Wait(int Index);                                              // Whether the task and the ones it waited for succeeded
+
+private:
+	enum State {
+		PENDING,
+		RUNNING,
+		DONE,
+		FAILED
+	};
+	struct Item {
+		const char* name;
+		Task run;
+		std::vector<int> after;
+		State state;
+	};
+
+	static void* Worker(void* cookie);
+	int Next();                                                        // Caller holds lock; index of a task that can run, -1 if none can yet, -2 if none is left
+
+	std::vector<Item> items;
+	std::vector<pthread_t> threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+#endif // __TWRP_STARTUP_TASKS_HPP
@@ -0,0 +1,150 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "twrpStartupTrace.hpp"
+#include "twrpThermal.hpp"
+#include "twcommon.h"
+
+std::vector<twrpStartupTrace::Phase> twrpStartupTrace::phases;
+pthread_mutex_t twrpStartupTrace::lock = PTHREAD_MUTEX_INITIALIZER;
+std::atomic<bool> twrpStartupTrace::finished(false);
+
+int twrpStartupTrace::Begin(const char* Name) {
+	if (finished.load(std::memory_order_relaxed))
+		return -1;
+
+	Phase phase;
+	phase.name = Name;
+	phase.thread = (pid_t) syscall(SYS_gettid);
+	phase.depth = 0;
+	phase.start = twrpThermal::Now_Usec();
+	phase.end = 0;
+
+	pthread_mutex_lock(&lock);
+	if (finished.load(std::memory_order_relaxed)) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+	for (size_t i = 0; i < phases.size(); i++) {
+		if (phases[i].thread == phase.thread && phases[i].depth >= 0 && phases[i].end == 0)
+			phase.depth++;
+	}
+	int index = phases.size();
+	phases.push_back(phase);
+	pthread_mutex_unlock(&lock);
+	return index;
+}
+
+void twrpStartupTrace::End(int Index) {
+	if (Index < 0)
+		return;
+	uint64_t now = twrpThermal::Now_Usec();
+	pthread_mutex_lock(&lock);
+	if (!finished.load(std::memory_order_relaxed) && (size_t) Index < phases.size())
+		phases[Index].end = now;
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpStartupTrace::Mark(const std::string& Name) {
+	if (finished.load(std::memory_order_relaxed))
+		return;
+
+	Phase mark;
+	mark.name = Name;
+	mark.thread = (pid_t) syscall(SYS_gettid);
+	mark.depth = -1;
+	mark.start = mark.end = twrpThermal::Now_Usec();
+
+	pthread_mutex_lock(&lock);
+	if (!finished.load(std::memory_order_relaxed))
+		phases.push_back(mark);
+	pthread_mutex_unlock(&lock);
+}
+
+void twrpStartupTrace::Finish() {
+	if (finished.load(std::memory_order_relaxed))
+		return;
+	uint64_t now = twrpThermal::Now_Usec();
+
+	pthread_mutex_lock(&lock);
+	if (finished.exchange(true)) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	uint64_t origin = phases.empty() ? now : phases[0].start;
+	for (size_t i = 0; i < phases.size(); i++) {
+		if (phases[i].start < origin)
+			origin = phases[i].start;
+	}
+
+	// Phases still open, like the one around the main GUI, end here
+	for (size_t i = 0; i < phases.size(); i++) {
+		if (phases[i].end == 0)
+			phases[i].end = now;
+	}
+
+	LOGINFO("Startup took %llu ms to the main page (%llu ms after boot):\n",
+		(unsigned long long) (now - origin) / 1000, (unsigned long long) now / 1000);
+	for (size_t i = 0; i < phases.size(); i++) {
+		const Phase& phase = phases[i];
+		if (phase.depth < 0) {
+			LOGINFO("  %6llu ms  --- %s\n", (unsigned long long) (phase.start - origin) / 1000, phase.name.c_str());
+		} else {
+			LOGINFO("  %6llu ms %6llu ms  %*s%s\n", (unsigned long long) (phase.start - origin) / 1000,
+				(unsigned long long) (phase.end - phase.start) / 1000, phase.depth * 2, "", phase.name.c_str());
+		}
+	}
+	if (!Write_Json(origin))
+		LOGINFO("Unable to write %s\n", TW_STARTUP_TRACE_FILE);
+	phases.clear();
+	pthread_mutex_unlock(&lock);
+}
+
+// Caller holds lock
+bool twrpStartupTrace::Write_Json(uint64_t Origin) {
+	FILE* f = fopen(TW_STARTUP_TRACE_FILE, "we");
+	if (!f)
+		return false;
+
+	fprintf(f, "{\n\t\"boot_ms\": %llu,\n\t\"phases\": [", (unsigned long long) Origin / 1000);
+	bool first = true;
+	for (size_t i = 0; i < phases.size(); i++) {
+		const Phase& phase = phases[i];
+		if (phase.depth < 0)
+			continue;
+		fprintf(f, "%s\n\t\t{ \"name\": \"%s\", \"thread\": %d, \"depth\": %d, \"start_ms\": %.3f, \"ms\": %.3f }",
+			first ? "" : ",", phase.name.c_str(), (int) phase.thread, phase.depth,
+			(phase.start - Origin) / 1000.0, (phase.end - phase.start) / 1000.0);
+		first = false;
+	}
+	fprintf(f, "\n\t],\n\t\"marks\": [");
+	first = true;
+	for (size_t i = 0; i < phases.size(); i++) {
+		const Phase& phase = phases[i];
+		if (phase.depth >= 0)
+			continue;
+		fprintf(f, "%s\n\t\t{ \"name\": \"%s\", \"at_ms\": %.3f }", first ? "" : ",",
+			phase.name.c_str(), (phase.start - Origin) / 1000.0);
+		first = false;
+	}
+	fprintf(f, "\n\t]\n}\n");
+	return fclose(f) == 0;
+}
@@ -0,0 +1,71 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_STARTUP_TRACE_HPP
+#define __TWRP_STARTUP_TRACE_HPP
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define TW_STARTUP_TRACE_FILE "/tmp/twrp_startup.json"
+
+// Times the steps from the start of recovery until the main page is up, so
+// that slow steps stand out and a device tree that makes one slower shows
+// up in its log. Phases nest: a phase that begins while another one on the
+// same thread is open is counted as part of it. Marks are instants, like
+// the first frame of the decrypt page. Finish() is called on the first
+// frame of the main page; it logs the phases to the recovery log, writes
+// them to TW_STARTUP_TRACE_FILE as JSON, and turns the trace off, so the
+// phases in code that also runs later cost next to nothing then.
+class twrpStartupTrace {
+public:
+	// Times the block it is declared in
+	class Scope {
+	public:
+		Scope(const char* Name) : index(Begin(Name)) {}
+		~Scope() { End(index); }
+	private:
+		int index;
+	};
+
+	static int Begin(const char* Name);                               // Index to hand to End(), -1 once the trace is off
+	static void End(int Index);
+	static void Mark(const std::string& Name);
+	static void Finish();
+
+private:
+	struct Phase {
+		std::string name;
+		pid_t thread;
+		int depth;                                                 // -1 for a mark
+		uint64_t start;                                            // Monotonic usec
+		uint64_t end;                                              // 0 while open
+	};
+
+	static bool Write_Json(uint64_t Origin);
+
+	static std::vector<Phase> phases;
+	static pthread_mutex_t lock;
+	static std::atomic<bool> finished;
+};
+
+#endif // __TWRP_STARTUP_TRACE_HPP
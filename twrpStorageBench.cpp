@@ -0,0 +1,350 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+#include "twrpStorageBench.hpp"
+#include "twrpRawCopy.hpp"
+#include "twrpCompress.hpp"
+#include "twrpThermal.hpp"
+#include "twrp-functions.hpp"
+#include "infomanager.hpp"
+#include "data.hpp"
+#include "twcommon.h"
+
+#define BENCH_PATTERN_SIZE (4 * 1024 * 1024)
+#define BENCH_ZSTD_SAMPLE (16 * 1024 * 1024)                       // Compressed by each zstd level tried
+
+static const size_t block_sizes[] = { 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+static const int zstd_levels[] = { 1, 3, 6, 9, 12, 15, 19 };
+
+// Every other 4 KiB is noise, so the data compresses about as well as a
+// backup of app data
+static std::vector<unsigned char> pattern;
+
+static void Make_Pattern() {
+	uint32_t rng = 1;
+
+	if (!pattern.empty())
+		return;
+	pattern.resize(BENCH_PATTERN_SIZE);
+	for (size_t i = 0; i < pattern.size(); i += 4096) {
+		rng ^= rng << 13;
+		rng ^= rng >> 17;
+		rng ^= rng << 5;
+		bool noise = rng & 1;
+		for (size_t j = i; j < i + 4096; j++) {
+			if (noise) {
+				rng ^= rng << 13;
+				rng ^= rng >> 17;
+				rng ^= rng << 5;
+			}
+			pattern[j] = noise ? (unsigned char) rng : (unsigned char) ("twrp benchmark "[j % 15]);
+		}
+	}
+}
+
+// Feeds twrpRawCopy the pattern, so a write pass only measures the storage
+class Bench_Source : public twrpStreamReader {
+public:
+	Bench_Source() { offset = 0; }
+	ssize_t Read(void *buf, size_t size) {
+		size_t done = 0;
+		while (done < size) {
+			size_t len = size - done < pattern.size() - offset ? size - done : pattern.size() - offset;
+			memcpy((char*) buf + done, pattern.data() + offset, len);
+			done += len;
+			offset = (offset + len) % pattern.size();
+		}
+		return size;
+	}
+
+private:
+	size_t offset;
+};
+
+// Drops what a read pass reads
+class Bench_Sink : public twrpStreamWriter {
+public:
+	ssize_t Write(const void *buf __unused, size_t size) { return size; }
+	int Finish() { return 0; }
+};
+
+struct Bench_Stream {
+	std::string path;
+	size_t block_size;
+	uint64_t size;
+	bool read;
+	bool failed;
+};
+
+static void* Bench_Stream_Thread(void *cookie) {
+	Bench_Stream* stream = (Bench_Stream*) cookie;
+	twrpRawCopy raw_copy(stream->block_size, TW_RAW_COPY_BUFFERS);
+	auto keep_going = [](uint64_t) { return true; };
+
+	// The same readers and writers as an image backup and its restore
+	if (stream->read) {
+		int fd = open(stream->path.c_str(), O_RDONLY | O_LARGEFILE);
+		if (fd < 0) {
+			stream->failed = true;
+			return NULL;
+		}
+		twrpFdReader reader(fd, false);
+		Bench_Sink sink;
+		stream->failed = !raw_copy.Copy(&reader, &sink, stream->size, keep_going);
+		close(fd);
+	} else {
+		int fd = open(stream->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+		if (fd < 0) {
+			stream->failed = true;
+			return NULL;
+		}
+		Bench_Source source;
+		twrpFdWriter writer(fd, false);
+		stream->failed = !raw_copy.Copy(&source, &writer, stream->size, keep_going) || fsync(fd) != 0;
+		close(fd);
+	}
+	return NULL;
+}
+
+static uint64_t Run_Streams(const std::string& Dir, size_t Block_Size, unsigned Streams, bool Read) {
+	std::vector<Bench_Stream> streams(Streams);
+	std::vector<pthread_t> threads;
+	uint64_t start, usec;
+	unsigned i;
+	bool failed = false;
+
+	for (i = 0; i < Streams; i++) {
+		streams[i].path = Dir + "/seq" + TWFunc::to_string(i);
+		streams[i].block_size = Block_Size;
+		streams[i].size = TW_STORAGE_BENCH_SIZE / Streams;
+		streams[i].read = Read;
+		streams[i].failed = false;
+	}
+	start = twrpThermal::Now_Usec();
+	for (i = 1; i < Streams; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, Bench_Stream_Thread, &streams[i]) != 0) {
+			streams[i].failed = true;
+			continue;
+		}
+		threads.push_back(thread);
+	}
+	Bench_Stream_Thread(&streams[0]);
+	for (i = 0; i < threads.size(); i++)
+		pthread_join(threads[i], NULL);
+	usec = twrpThermal::Now_Usec() - start;
+	for (i = 0; i < Streams; i++)
+		failed |= streams[i].failed;
+	if (failed || usec == 0)
+		return 0;
+	return (uint64_t) TW_STORAGE_BENCH_SIZE * 1000000 / usec;
+}
+
+uint64_t twrpStorageBench::Write_Pass(const std::string& Dir, size_t Block_Size, unsigned Streams) {
+	uint64_t rate = Run_Streams(Dir, Block_Size, Streams, false);
+	LOGINFO("twrpStorageBench: %u streams of %zuKB writes: %llu MB/s\n", Streams, Block_Size / 1024, (unsigned long long) rate / 1048576);
+	return rate;
+}
+
+uint64_t twrpStorageBench::Read_Pass(const std::string& Dir, unsigned Streams) {
+	Drop_Caches();
+	uint64_t rate = Run_Streams(Dir, 1024 * 1024, Streams, true);
+	LOGINFO("twrpStorageBench: %u streams reading: %llu MB/s\n", Streams, (unsigned long long) rate / 1048576);
+	return rate;
+}
+
+unsigned twrpStorageBench::Small_Files(const std::string& Dir, bool Read) {
+	std::vector<unsigned char> buf(TW_STORAGE_BENCH_FILE_SIZE);
+	uint64_t start, usec;
+	unsigned i;
+
+	if (Read)
+		Drop_Caches();
+	start = twrpThermal::Now_Usec();
+	for (i = 0; i < TW_STORAGE_BENCH_FILES; i++) {
+		std::string path = Dir + "/small" + TWFunc::to_string(i);
+		int fd = open(path.c_str(), Read ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		ssize_t len;
+		if (fd < 0)
+			return 0;
+		if (Read)
+			len = read(fd, buf.data(), buf.size());
+		else
+			len = write(fd, pattern.data() + (i * TW_STORAGE_BENCH_FILE_SIZE) % pattern.size(), TW_STORAGE_BENCH_FILE_SIZE);
+		close(fd);
+		if (len != TW_STORAGE_BENCH_FILE_SIZE)
+			return 0;
+	}
+	if (!Read) {
+		// A restore syncs once at the end, not after every file
+		int dir_fd = open(Dir.c_str(), O_RDONLY | O_DIRECTORY);
+		if (dir_fd >= 0) {
+			syncfs(dir_fd);
+			close(dir_fd);
+		}
+	}
+	usec = twrpThermal::Now_Usec() - start;
+	if (usec == 0)
+		usec = 1;
+	unsigned rate = (unsigned) ((uint64_t) TW_STORAGE_BENCH_FILES * 1000000 / usec);
+	LOGINFO("twrpStorageBench: %s %u files per second\n", Read ? "read" : "created", rate);
+	return rate;
+}
+
+int twrpStorageBench::Pick_Zstd_Level(uint64_t Write_Rate) {
+	int best = 0;
+
+	if (!twrpCompress_Supported(COMPRESSED_ZSTD))
+		return 0;
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd < 0)
+		return 0;
+	// Levels get slower as they go up, so the first one that can't keep up ends the search
+	for (size_t l = 0; l < sizeof(zstd_levels) / sizeof(zstd_levels[0]); l++) {
+		twrpStreamWriter* writer = twrpCompress_New_Writer(COMPRESSED_ZSTD, fd, zstd_levels[l], twrpCompress_Default_Threads());
+		uint64_t start = twrpThermal::Now_Usec(), usec, rate;
+		bool ok = writer != NULL;
+
+		for (size_t done = 0; ok && done < BENCH_ZSTD_SAMPLE; done += 1024 * 1024)
+			ok = writer->Write(pattern.data() + done % pattern.size(), 1024 * 1024) == 1024 * 1024;
+		ok = ok && writer->Finish() == 0;
+		usec = twrpThermal::Now_Usec() - start;
+		delete writer;
+		if (!ok || usec == 0)
+			break;
+		rate = (uint64_t) BENCH_ZSTD_SAMPLE * 1000000 / usec;
+		LOGINFO("twrpStorageBench: zstd level %i compresses %llu MB/s\n", zstd_levels[l], (unsigned long long) rate / 1048576);
+		if (rate < Write_Rate)
+			break;
+		best = zstd_levels[l];
+	}
+	close(fd);
+	// Even the fastest level is slower than the storage, it still saves space
+	return best ? best : zstd_levels[0];
+}
+
+void twrpStorageBench::Drop_Caches() {
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd >= 0) {
+		if (write(fd, "3", 1) != 1)
+			LOGINFO("twrpStorageBench: unable to drop caches: %s\n", strerror(errno));
+		close(fd);
+	}
+}
+
+void twrpStorageBench::Remove_Dir(const std::string& Dir) {
+	if (TWFunc::Path_Exists(Dir))
+		TWFunc::removeDir(Dir, false);
+}
+
+bool twrpStorageBench::Run(const std::string& Path, uint64_t Free, twrpStorageBenchResult *Result) {
+	std::string dir = Path + TW_STORAGE_BENCH_DIR;
+	uint64_t rate, best = 0;
+	uint64_t stream_rates[TW_STORAGE_BENCH_MAX_STREAMS + 1];
+	unsigned streams;
+	bool ret = false;
+
+	memset(Result, 0, sizeof(*Result));
+	// The sequential files plus the small ones, with room to spare
+	if (Free < (uint64_t) TW_STORAGE_BENCH_SIZE * 2 + TW_STORAGE_BENCH_FILES * TW_STORAGE_BENCH_FILE_SIZE) {
+		LOGINFO("twrpStorageBench: not enough free space on '%s'\n", Path.c_str());
+		return false;
+	}
+	Make_Pattern();
+	Remove_Dir(dir);
+	if (!TWFunc::Recursive_Mkdir(dir)) {
+		LOGINFO("twrpStorageBench: unable to create '%s'\n", dir.c_str());
+		return false;
+	}
+
+	for (size_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++) {
+		rate = Write_Pass(dir, block_sizes[b], 1);
+		if (rate == 0)
+			goto exit;
+		if (rate > best) {
+			best = rate;
+			Result->Block_Size = block_sizes[b];
+		}
+	}
+	stream_rates[1] = best;
+	for (streams = 2; streams <= TW_STORAGE_BENCH_MAX_STREAMS; streams *= 2) {
+		stream_rates[streams] = Write_Pass(dir, Result->Block_Size, streams);
+		if (stream_rates[streams] > best)
+			best = stream_rates[streams];
+	}
+	// The fewest streams that come within 10% of the best, more only
+	// fragment the files for nothing
+	for (streams = 1; streams < TW_STORAGE_BENCH_MAX_STREAMS; streams *= 2) {
+		if (stream_rates[streams] >= best - best / 10)
+			break;
+	}
+	Result->Streams = streams;
+	Result->Write_Rate = stream_rates[streams];
+	// The files of the last pass are still there to read
+	Result->Read_Rate = Read_Pass(dir, TW_STORAGE_BENCH_MAX_STREAMS);
+	Result->Create_Rate = Small_Files(dir, false);
+	Result->File_Read_Rate = Small_Files(dir, true);
+	Result->Zstd_Level = Pick_Zstd_Level(Result->Write_Rate);
+	ret = Result->Read_Rate != 0 && Result->Create_Rate != 0 && Result->File_Read_Rate != 0;
+
+exit:
+	Remove_Dir(dir);
+	return ret;
+}
+
+bool twrpStorageBench::Load(const std::string& Storage, twrpStorageBenchResult *Result) {
+	InfoManager bench(DataManager::GetSettingsStoragePath() + TW_STORAGE_BENCH_FILE);
+	unsigned long long write_rate = 0, read_rate = 0;
+
+	memset(Result, 0, sizeof(*Result));
+	if (bench.LoadValues() != 0 || bench.GetValue(Storage + ":write", write_rate) != 0 || bench.GetValue(Storage + ":read", read_rate) != 0)
+		return false;
+	Result->Write_Rate = write_rate;
+	Result->Read_Rate = read_rate;
+	Result->Create_Rate = bench.GetIntValue(Storage + ":create");
+	Result->File_Read_Rate = bench.GetIntValue(Storage + ":file_read");
+	Result->Streams = bench.GetIntValue(Storage + ":streams");
+	Result->Block_Size = bench.GetIntValue(Storage + ":block_size");
+	Result->Zstd_Level = bench.GetIntValue(Storage + ":zstd_level");
+	return Result->Streams > 0 && Result->Block_Size > 0;
+}
+
+bool twrpStorageBench::Save(const std::string& Storage, const twrpStorageBenchResult& Result) {
+	InfoManager bench(DataManager::GetSettingsStoragePath() + TW_STORAGE_BENCH_FILE);
+
+	// The other storages keep their results
+	bench.LoadValues();
+	bench.SetValue(Storage + ":write", (unsigned long long) Result.Write_Rate);
+	bench.SetValue(Storage + ":read", (unsigned long long) Result.Read_Rate);
+	bench.SetValue(Storage + ":create", (int) Result.Create_Rate);
+	bench.SetValue(Storage + ":file_read", (int) Result.File_Read_Rate);
+	bench.SetValue(Storage + ":streams", (int) Result.Streams);
+	bench.SetValue(Storage + ":block_size", (int) Result.Block_Size);
+	bench.SetValue(Storage + ":zstd_level", Result.Zstd_Level);
+	return bench.SaveValues() == 0;
+}
@@ -0,0 +1,64 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_STORAGE_BENCH_HPP
+#define __TWRP_STORAGE_BENCH_HPP
+
+#include <stdint.h>
+#include <string>
+
+#define TW_STORAGE_BENCH_FILE "/TWRP/.twrpbench"                   // In the settings storage
+#define TW_STORAGE_BENCH_DIR "/TWRP/.bench"                        // Scratch files on the storage being measured
+#define TW_STORAGE_BENCH_SIZE (64 * 1024 * 1024)                   // Written by each sequential pass
+#define TW_STORAGE_BENCH_FILES 512                                 // Small files created and read
+#define TW_STORAGE_BENCH_FILE_SIZE (16 * 1024)
+#define TW_STORAGE_BENCH_MAX_STREAMS 4
+
+struct twrpStorageBenchResult {
+	uint64_t Write_Rate;                                               // Bytes per second
+	uint64_t Read_Rate;
+	unsigned Create_Rate;                                              // Small files per second
+	unsigned File_Read_Rate;
+	unsigned Streams;                                                  // Files written at once that did best
+	unsigned Block_Size;                                               // Write size that did best
+	int Zstd_Level;                                                    // Highest level that keeps up with the writes, 0 without zstd
+};
+
+// Measures a storage the way backups use it: sequential files written and
+// read back through twrpRawCopy with the buffer sizes and stream counts a
+// backup could pick, then many small files created and read like a tar of
+// app data. The results are kept per storage in TW_STORAGE_BENCH_FILE, and
+// Run_Backup takes its tar threads, zstd level and image write size from
+// them for storage that was measured.
+class twrpStorageBench {
+public:
+	// Path is the storage path, Free its free bytes
+	static bool Run(const std::string& Path, uint64_t Free, twrpStorageBenchResult *Result);
+	static bool Load(const std::string& Storage, twrpStorageBenchResult *Result); // false if Storage (a mount point) was never measured
+	static bool Save(const std::string& Storage, const twrpStorageBenchResult& Result);
+
+private:
+	static uint64_t Write_Pass(const std::string& Dir, size_t Block_Size, unsigned Streams); // Bytes per second, 0 on failure
+	static uint64_t Read_Pass(const std::string& Dir, unsigned Streams);
+	static unsigned Small_Files(const std::string& Dir, bool Read);    // Files per second, 0 on failure
+	static int Pick_Zstd_Level(uint64_t Write_Rate);
+	static void Drop_Caches();
+	static void Remove_Dir(const std::string& Dir);
+};
+
+#endif // __TWRP_STORAGE_BENCH_HPP
@@ -33,25 +33,39 @@ extern "C" {
 #include <string>
 #include <sstream>
 #include <vector>
+#include <queue>
+#include <algorithm>
+#include <functional>
 #include <csignal>
 #include <dirent.h>
 #include <libgen.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
 #include <zlib.h>
 #include <semaphore.h>
 #include "twrpTar.hpp"
+#include "twrpCompress.hpp"
+#include "twrpEncrypt.hpp"
 #include "twcommon.h"
 #include "variables.h"
 #include "adbbu/libtwadbbu.hpp"
 #include "twrp-functions.hpp"
 #include "gui/gui.hpp"
 #include "progresstracking.hpp"
+#include "twrpTarProgress.hpp"
+#include "twrpLog.hpp"
 #ifndef BUILD_TWRPTAR_MAIN
 #include "data.hpp"
 #include "infomanager.hpp"
 #include "set_metadata.h"
+#include "twrpDigestDriver.hpp"
+#include "twrpDigest/twrpMD5.hpp"
+#include "twrpChunkStore.hpp"
+#include "twrpPerfReport.hpp"
 #endif //ndef BUILD_TWRPTAR_MAIN
+#include "twrpRestorePipeline.hpp"
 
 #ifdef TW_INCLUDE_FBE
 #include "crypto/ext4crypt/ext4crypt_tar.h"
@@ -59,14 +73,31 @@ extern "C" {
 #else
 #define TWTAR_FLAGS TAR_GNU | TAR_STORE_SELINUX | TAR_STORE_POSIX_CAP | TAR_STORE_ANDROID_USER_XATTR
 #endif
+// Full restores set metadata through the open fd and leave directories for one pass at the end
+#define TWTAR_RESTORE_FLAGS (TWTAR_FLAGS | TAR_DEFER_METADATA)
+// Decompressed blocks queued between the decompress thread and libtar
+#define PIPE_QUEUE_DEPTH 8
+// Small files each backup thread reads ahead of the one it archives
+#define TW_TAR_PREFETCH_DEPTH 32
 
 using namespace std;
 
 twrpTar::twrpTar(void) {
 	use_encryption = 0;
+	legacy_encryption = false;
 	userdata_encryption = 0;
 	use_compression = 0;
+	use_dedup = 0;
+	compression_type = COMPRESSED;
+	compression_level = 0;
 	split_archives = 0;
+	max_archive_size = MAX_ARCHIVE_SIZE;
+	backup_threads = 0;
+	io_lanes = 0;
+	read_order = TW_READ_ORDER_SCAN;
+	compression_threads = 0;
+	thread_id = 0;
+	adb_streams = 1;
 	pigz_pid = 0;
 	oaes_pid = 0;
 	Total_Backup_Size = 0;
@@ -77,14 +108,34 @@ twrpTar::twrpTar(void) {
 	tar_type.readfunc = read;
 	input_fd = -1;
 	output_fd = -1;
+	tar_progress = NULL;
 	backup_exclusions = NULL;
+	backup_scan = NULL;
+	scan_entries = NULL;
+	restore_file_count = 0;
+	write_manifest = false;
+	write_digest = false;
+	verify_digest = false;
+	verify_only = false;
+	output_digest = NULL;
+	digest_fd = -1;
+	write_index = false;
+	output_index = NULL;
+	index_fd = -1;
+	restore_paths = NULL;
+	restored_count = 0;
+	pipe_stats = NULL;
+	pipe_threads = 1;
+	write_threads = 1;
+	manifest = NULL;
 #ifdef TW_INCLUDE_FBE
 	e4crypt_set_mode();
 #endif
 }
 
 twrpTar::~twrpTar(void) {
-	// Do nothing
+	Free_Output_Digest();
+	Free_Output_Index();
 }
 
 void twrpTar::setfn(string fn) {
@@ -113,7 +164,7 @@ void twrpTar::Set_Archive_Type(Archive_Type archive_type) {
 
 int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 	int status = 0;
-	int progress_pipe[2];
+	twrpTarProgress progress_block;
 
 	file_count = 0;
 	if (backup_exclusions == NULL) {
@@ -122,175 +173,152 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 	}
 
 #ifndef BUILD_TWRPTAR_MAIN
+	twrpLog::Reset_File_Messages(DataManager::GetIntValue(TW_LOG_FILE_MESSAGES_VAR));
 	if (part_settings->adbbackup) {
+		// Every tar thread of a threaded backup gets its own adb stream
 		std::string Backup_FileName(tarfn);
-		if (!twadbbu::Write_TWFN(Backup_FileName, Total_Backup_Size, use_compression))
+		unsigned tar_threads = Backup_Thread_Count();
+		adb_streams = 1;
+		if (use_encryption || userdata_encryption || tar_threads > 1)
+			adb_streams = userdata_encryption ? tar_threads + 1 : tar_threads;
+		uint64_t compression = UNCOMPRESSED;
+		if (use_compression)
+			compression = (use_encryption || !twrpCompress_Supported(compression_type)) ? COMPRESSED : compression_type;
+		// Encrypted archives are always gzip, the unencrypted stream of
+		// userdata encryption included
+		if (use_encryption) {
+			uint64_t encrypted = (1ULL << adb_streams) - 1;
+			if (userdata_encryption)
+				encrypted &= ~1ULL;
+			compression |= encrypted << 32;
+			compression_type = COMPRESSED;
+		}
+		if (!twadbbu::Write_TWFN(Backup_FileName, Total_Backup_Size, compression, adb_streams))
 			return -1;
 	}
 #endif
 
-	if (pipe(progress_pipe) < 0) {
-		LOGINFO("Error creating progress tracking pipe\n");
+	if (!progress_block.Map()) {
 		gui_err("backup_error=Error creating backup.");
 		return -1;
 	}
+	tar_progress = &progress_block;
 	if ((*tar_fork_pid = fork()) == -1) {
 		LOGINFO("create tar failed to fork.\n");
 		gui_err("backup_error=Error creating backup.");
-		close(progress_pipe[0]);
-		close(progress_pipe[1]);
+		tar_progress = NULL;
 		return -1;
 	}
 
 	if (*tar_fork_pid == 0) {
 		// Child process
-		// Child closes input side of progress pipe
 		signal(SIGUSR2, twrpTar::Signal_Kill);
-		close(progress_pipe[0]);
-		progress_pipe_fd = progress_pipe[1];
-
-		if (use_encryption || userdata_encryption) {
-			LOGINFO("Using encryption\n");
-			DIR* d;
-			struct dirent* de;
-			unsigned long long regular_size = 0, encrypt_size = 0, target_size = 0, total_size;
-			unsigned enc_thread_id = 1, regular_thread_id = 0, i, start_thread_id = 1, core_count = 1;
-			int item_len, ret, thread_error = 0;
+		tar_progress->Make_Current();
+		tar_progress->Start_Stage(TW_TAR_STAGE_SCAN);
+
+		// One walk of the tree gives the sizes and the tar lists. The
+		// partition's scan from the size update is reused if it is current.
+		twrpScan local_scan;
+		twrpScan* scan = backup_scan;
+		if (scan == NULL || !scan->Is_Valid(tardir)) {
+			if (!local_scan.Scan(tardir, backup_exclusions)) {
+				LOGINFO("Error scanning '%s'\n", tardir.c_str());
+				gui_err("backup_error=Error creating backup.");
+				_exit(-1);
+			}
+			scan = &local_scan;
+		} else {
+			LOGINFO("Using the existing scan of '%s'\n", tardir.c_str());
+		}
+		const std::vector<twrpScanEntry>& Entries = scan->Get_Entries();
+		scan_entries = &Entries;
+
+		twrpManifest New_Manifest, Base_Manifest;
+		if (write_manifest && !Prepare_Manifest(Entries, &New_Manifest, &Base_Manifest)) {
+			gui_err("backup_error=Error creating backup.");
+			_exit(-1);
+		}
+
+		unsigned tar_threads = Backup_Thread_Count();
+		if (use_encryption || userdata_encryption || tar_threads > 1) {
+			// Threaded backup: the data is divided between tar_threads archive sets
+			if (use_encryption || userdata_encryption)
+				LOGINFO("Using encryption\n");
+			unsigned long long regular_size = 0, encrypt_size = 0, total_size;
+			unsigned enc_thread_id = 1, i, start_thread_id = 1, core_count = 1;
+			int ret, thread_error = 0;
+			size_t idx, next;
 			std::vector<TarListStruct> RegularList;
 			std::vector<TarListStruct> EncryptList;
-			string FileName;
-			struct TarListStruct TarItem;
 			twrpTar reg, enc[9];
-			struct stat st;
 			pthread_t enc_thread[9];
 			pthread_attr_t tattr;
 			void *thread_return;
 
-			core_count = sysconf(_SC_NPROCESSORS_CONF);
-			if (core_count > 8)
-				core_count = 8;
-			LOGINFO("   Core Count      : %u\n", core_count);
+			core_count = tar_threads;
+			LOGINFO("   Thread Count    : %u\n", core_count);
 			Archive_Current_Size = 0;
-
-			d = opendir(tardir.c_str());
-			if (d == NULL) {
-				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tardir)(strerror(errno)));
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			// Figure out the size of all data to be encrypted and create a list of unencrypted files
-			while ((de = readdir(d)) != NULL) {
-				FileName = tardir + "/" + de->d_name;
-
-				if (de->d_type == DT_BLK || de->d_type == DT_CHR || backup_exclusions->check_skip_dirs(FileName))
-					continue;
-				if (de->d_type == DT_DIR) {
-					item_len = strlen(de->d_name);
-					if (userdata_encryption && ((item_len >= 3 && strncmp(de->d_name, "app", 3) == 0) || (item_len >= 6 && strncmp(de->d_name, "dalvik", 6) == 0))) {
-						ret = Generate_TarList(FileName, &RegularList, &target_size, &regular_thread_id);
-						if (ret < 0) {
-							LOGINFO("Error in Generate_TarList with regular list!\n");
-							gui_err("backup_error=Error creating backup.");
-							closedir(d);
-							close(progress_pipe_fd);
-							close(progress_pipe[1]);
-							_exit(-1);
-						}
-						file_count = (unsigned long long)(ret);
-						regular_size += backup_exclusions->Get_Folder_Size(FileName);
-					} else {
-						encrypt_size += backup_exclusions->Get_Folder_Size(FileName);
-					}
-				} else if (de->d_type == DT_REG) {
-					stat(FileName.c_str(), &st);
-					encrypt_size += (unsigned long long)(st.st_size);
-				}
-			}
-			closedir(d);
-
-			target_size = encrypt_size / core_count;
-			target_size++;
-			LOGINFO("   Unencrypted size: %llu\n", regular_size);
-			LOGINFO("   Encrypted size  : %llu\n", encrypt_size);
-			LOGINFO("   Target size     : %llu\n", target_size);
 			if (!userdata_encryption) {
 				enc_thread_id = 0;
 				start_thread_id = 0;
 				core_count--;
 			}
-			Archive_Current_Size = 0;
-
-			d = opendir(tardir.c_str());
-			if (d == NULL) {
-				gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tardir)(strerror(errno)));
-				close(progress_pipe[1]);
-				_exit(-1);
+			if (use_compression) {
+				// Share the cores between the archives instead of giving each its own set of workers
+				compression_threads = twrpCompress_Default_Threads() / (core_count + 1 - start_thread_id);
+				if (compression_threads == 0)
+					compression_threads = 1;
 			}
-			// Divide up the encrypted file list for threading
-			while ((de = readdir(d)) != NULL) {
-				FileName = tardir + "/" + de->d_name;
 
-				if (de->d_type == DT_BLK || de->d_type == DT_CHR || backup_exclusions->check_skip_dirs(FileName))
-					continue;
-				if (de->d_type == DT_DIR) {
-					item_len = strlen(de->d_name);
-					if (userdata_encryption && ((item_len >= 3 && strncmp(de->d_name, "app", 3) == 0) || (item_len >= 6 && strncmp(de->d_name, "dalvik", 6) == 0))) {
-						// Do nothing, we added these to RegularList earlier
-					} else {
-						FileName = tardir + "/" + de->d_name;
-						ret = Generate_TarList(FileName, &EncryptList, &target_size, &enc_thread_id);
-						if (ret < 0) {
-							LOGINFO("Error in Generate_TarList with encrypted list!\n");
-							gui_err("backup_error=Error creating backup.");
-							closedir(d);
-							close(progress_pipe[1]);
-							_exit(-1);
-						}
-						file_count += (unsigned long long)(ret);
-					}
-				} else if (de->d_type == DT_REG || de->d_type == DT_LNK) {
-					stat(FileName.c_str(), &st);
-					if (de->d_type == DT_REG)
-						Archive_Current_Size += (unsigned long long)(st.st_size);
-					TarItem.fn = FileName;
-					TarItem.thread_id = enc_thread_id;
-					EncryptList.push_back(TarItem);
-					file_count++;
-				}
-			}
-			closedir(d);
-			if (enc_thread_id != core_count) {
-				LOGINFO("Error dividing up threads for encryption, %u threads for %u cores!\n", enc_thread_id, core_count);
-				if (enc_thread_id > core_count) {
-					gui_err("backup_error=Error creating backup.");
-					close(progress_pipe[1]);
-					_exit(-1);
+			// Split the top level items between the unencrypted and threaded lists
+			for (idx = 0; idx < Entries.size(); idx = next) {
+				const twrpScanEntry& Entry = Entries[idx];
+
+				if (Entry.type == DT_DIR) {
+					next = Entry.end;
+					string Name = TWFunc::Get_Filename(Entry.fn);
+					if (userdata_encryption && (Name.compare(0, 3, "app") == 0 || Name.compare(0, 6, "dalvik") == 0))
+						file_count += Generate_TarList(Entries, idx + 1, next, &RegularList, 0, &regular_size);
+					else
+						file_count += Generate_TarList(Entries, idx + 1, next, &EncryptList, enc_thread_id, &encrypt_size);
 				} else {
-					LOGINFO("Continuining anyway.");
+					next = idx + 1;
+					file_count += Generate_TarList(Entries, idx, next, &EncryptList, enc_thread_id, &encrypt_size);
 				}
 			}
+			LOGINFO("   Unencrypted size: %llu\n", regular_size);
+			LOGINFO("   Threaded size   : %llu\n", encrypt_size);
+			Balance_TarList(&EncryptList, start_thread_id, core_count + 1 - start_thread_id);
+			Sort_TarList(&RegularList);
+			Sort_TarList(&EncryptList);
 
-			// Send file count to parent
-			write(progress_pipe_fd, &file_count, sizeof(file_count));
-			// Send backup size to parent
 			total_size = regular_size + encrypt_size;
-			write(progress_pipe_fd, &total_size, sizeof(total_size));
+			tar_progress->Set_Totals(file_count, total_size);
+			tar_progress->Start_Stage(TW_TAR_STAGE_ARCHIVE);
 
 			if (userdata_encryption) {
 				// Create a backup of unencrypted data
 				reg.setfn(tarfn);
 				reg.ItemList = &RegularList;
+				reg.scan_entries = scan_entries;
 				reg.thread_id = 0;
 				reg.use_encryption = 0;
 				reg.use_compression = use_compression;
+				reg.compression_type = compression_type;
+				reg.use_dedup = use_dedup;
+				reg.write_digest = write_digest;
+				reg.write_index = write_index;
+				reg.compression_level = compression_level;
 				reg.split_archives = 1;
-				reg.progress_pipe_fd = progress_pipe_fd;
+				reg.max_archive_size = max_archive_size;
+				reg.tar_progress = tar_progress;
 				reg.part_settings = part_settings;
+				reg.manifest = manifest;
+				reg.adb_streams = adb_streams;
 				LOGINFO("Creating unencrypted backup...\n");
 				if (createList((void*)&reg) != 0) {
 					LOGINFO("Error creating unencrypted backup.\n");
 					gui_err("backup_error=Error creating backup.");
-					close(progress_pipe[1]);
 					_exit(-1);
 				}
 			}
@@ -298,19 +326,16 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			if (pthread_attr_init(&tattr)) {
 				LOGINFO("Unable to pthread_attr_init\n");
 				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
 				_exit(-1);
 			}
 			if (pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_JOINABLE)) {
 				LOGINFO("Error setting pthread_attr_setdetachstate\n");
 				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
 				_exit(-1);
 			}
 			if (pthread_attr_setscope(&tattr, PTHREAD_SCOPE_SYSTEM)) {
 				LOGINFO("Error setting pthread_attr_setscope\n");
 				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
 				_exit(-1);
 			}
 			/*if (pthread_attr_setstacksize(&tattr, 524288)) {
@@ -323,21 +348,31 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				enc[i].setdir(tardir);
 				enc[i].setfn(tarfn);
 				enc[i].ItemList = &EncryptList;
+				enc[i].scan_entries = scan_entries;
 				enc[i].thread_id = i;
 				enc[i].use_encryption = use_encryption;
 				enc[i].setpassword(password);
+				enc[i].legacy_encryption = legacy_encryption;
 				enc[i].use_compression = use_compression;
+				enc[i].compression_type = compression_type;
+				enc[i].use_dedup = use_dedup;
+				enc[i].write_digest = write_digest;
+				enc[i].write_index = write_index;
+				enc[i].compression_level = compression_level;
+				enc[i].compression_threads = compression_threads;
 				enc[i].split_archives = 1;
-				enc[i].progress_pipe_fd = progress_pipe_fd;
+				enc[i].max_archive_size = max_archive_size;
+				enc[i].tar_progress = tar_progress;
 				enc[i].part_settings = part_settings;
-				LOGINFO("Start encryption thread %i\n", i);
+				enc[i].manifest = manifest;
+				enc[i].adb_streams = adb_streams;
+				LOGINFO("Start backup thread %i\n", i);
 				ret = pthread_create(&enc_thread[i], &tattr, createList, (void*)&enc[i]);
 				if (ret) {
-					LOGINFO("Unable to create %i thread for encryption! %i\nContinuing in same thread (backup will be slower).\n", i, ret);
+					LOGINFO("Unable to create %i thread for backup! %i\nContinuing in same thread (backup will be slower).\n", i, ret);
 					if (createList((void*)&enc[i]) != 0) {
-						LOGINFO("Error creating encrypted backup %i.\n", i);
+						LOGINFO("Error creating backup %i.\n", i);
 						gui_err("backup_error=Error creating backup.");
-						close(progress_pipe[1]);
 						_exit(-1);
 					} else {
 						enc[i].thread_id = i + 1;
@@ -353,7 +388,6 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 					if (pthread_join(enc_thread[i], &thread_return)) {
 						LOGINFO("Error joining thread %i\n", i);
 						gui_err("backup_error=Error creating backup.");
-						close(progress_pipe[1]);
 						_exit(-1);
 					} else {
 						LOGINFO("Joined thread %i.\n", i);
@@ -362,7 +396,6 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 							thread_error = 1;
 							LOGINFO("Thread %i returned an error %i.\n", i, ret);
 							gui_err("backup_error=Error creating backup.");
-							close(progress_pipe[1]);
 							_exit(-1);
 						}
 					}
@@ -373,86 +406,84 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			if (thread_error) {
 				LOGINFO("Error returned by one or more threads.\n");
 				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
 				_exit(-1);
 			}
-			LOGINFO("Finished encrypted backup.\n");
-			close(progress_pipe[1]);
+			tar_progress->Start_Stage(TW_TAR_STAGE_FINISH);
+			if (write_manifest && !Save_Manifest(&New_Manifest, &Base_Manifest)) {
+				gui_err("backup_error=Error creating backup.");
+				_exit(-1);
+			}
+#ifndef BUILD_TWRPTAR_MAIN
+			// The streams of a threaded adb backup end together
+			if (part_settings->adbbackup && adb_streams > 1 && !twadbbu::Write_TWEOF()) {
+				gui_err("backup_error=Error creating backup.");
+				_exit(-1);
+			}
+#endif
+			LOGINFO("Finished threaded backup.\n");
+			tar_progress->Done();
 			_exit(0);
 		} else {
 			// Not encrypted
 			std::vector<TarListStruct> FileList;
-			unsigned thread_id = 0;
-			unsigned long long target_size = 0;
+			unsigned long long list_size = 0;
 			twrpTar reg;
-			int ret;
 
 			// Generate list of files to back up
-			ret = Generate_TarList(tardir, &FileList, &target_size, &thread_id);
-			if (ret < 0) {
-				LOGINFO("Error in Generate_TarList!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
-				_exit(-1);
-			}
-			file_count = (unsigned long long)(ret);
+			file_count = Generate_TarList(Entries, 0, Entries.size(), &FileList, 0, &list_size);
+			Sort_TarList(&FileList);
+			if (!incremental_base.empty())
+				Total_Backup_Size = list_size;
 			// Create a backup
 			reg.setfn(tarfn);
 			reg.ItemList = &FileList;
+			reg.scan_entries = scan_entries;
 			reg.thread_id = 0;
 			reg.use_encryption = 0;
 			reg.use_compression = use_compression;
+			reg.compression_type = compression_type;
+			reg.use_dedup = use_dedup;
+			reg.write_digest = write_digest;
+			reg.write_index = write_index;
+			reg.compression_level = compression_level;
 			reg.setsize(Total_Backup_Size);
-			reg.progress_pipe_fd = progress_pipe_fd;
+			reg.tar_progress = tar_progress;
 			reg.part_settings = part_settings;
-			if (Total_Backup_Size > MAX_ARCHIVE_SIZE && !part_settings->adbbackup) {
+			reg.manifest = manifest;
+			reg.max_archive_size = max_archive_size;
+			if (Total_Backup_Size > max_archive_size && !part_settings->adbbackup) {
 				gui_msg("split_backup=Breaking backup file into multiple archives...");
 				reg.split_archives = 1;
 			} else {
 				reg.split_archives = 0;
 			}
 			LOGINFO("Creating backup...\n");
-			write(progress_pipe_fd, &file_count, sizeof(file_count));
-			write(progress_pipe_fd, &Total_Backup_Size, sizeof(Total_Backup_Size));
+			tar_progress->Set_Totals(file_count, Total_Backup_Size);
+			tar_progress->Start_Stage(TW_TAR_STAGE_ARCHIVE);
 			if (createList((void*)&reg) != 0) {
 				gui_err("backup_error=Error creating backup.");
-				close(progress_pipe[1]);
 				_exit(-1);
 			}
-			close(progress_pipe[1]);
+			tar_progress->Start_Stage(TW_TAR_STAGE_FINISH);
+			if (write_manifest && !Save_Manifest(&New_Manifest, &Base_Manifest)) {
+				gui_err("backup_error=Error creating backup.");
+				_exit(-1);
+			}
+			tar_progress->Done();
 			_exit(0);
 		}
 	} else {
 		// Parent side
-		unsigned long long fs, size_backup = 0, files_backup = 0, file_count = 0;
-		int first_data = 0;
-
-		// Parent closes output side
-		close(progress_pipe[1]);
-
-		// Read progress data from children
-		while (read(progress_pipe[0], &fs, sizeof(fs)) > 0) {
-			if (first_data == 0) {
-				// First incoming data is the file count
-				file_count = fs;
-				if (file_count == 0) file_count = 1; // prevent division by 0 below
-				first_data = 1;
-			} else if (first_data == 1) {
-				// Second incoming data is total size
-				first_data = 2;
-				part_settings->progress->SetSizeCount(fs, file_count);
-			} else {
-				if (fs > 0) {
-					size_backup += fs;
-					part_settings->progress->UpdateSize(size_backup);
-				} else { // fs == 0 increments the file counter
-					files_backup++;
-					part_settings->progress->UpdateSizeCount(size_backup, files_backup);
-				}
-			}
-		}
-		close(progress_pipe[0]);
+		unsigned long long size_backup, files_backup;
+
+		progress_block.Watch(*tar_fork_pid, part_settings->progress);
+		size_backup = progress_block.Total_Bytes();
+		files_backup = progress_block.Total_Files();
+		progress_block.Log(partition_name.empty() ? tardir : partition_name);
+		tar_progress = NULL;
 #ifndef BUILD_TWRPTAR_MAIN
+		if (part_settings->report)
+			part_settings->report->Add_Tar(&progress_block);
 		DataManager::SetValue("tw_file_progress", "");
 		DataManager::SetValue("tw_size_progress", "");
 		part_settings->progress->DisplayFileCount(false);
@@ -461,15 +492,23 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 		if (!part_settings->adbbackup) {
 			InfoManager backup_info(backup_folder + "/" + partition_name + ".info");
 			backup_info.SetValue("backup_size", size_backup);
-			if (use_compression && use_encryption)
+			if (use_dedup && !use_encryption)
+				backup_info.SetValue("backup_type", CHUNKED);
+			else if (use_compression && use_encryption)
 				backup_info.SetValue("backup_type", COMPRESSED_ENCRYPTED);
 			else if (use_encryption)
 				backup_info.SetValue("backup_type", ENCRYPTED);
 			else if (use_compression)
-				backup_info.SetValue("backup_type", COMPRESSED);
+				backup_info.SetValue("backup_type", !twrpCompress_Supported(compression_type) ? COMPRESSED : compression_type);
 			else
 				backup_info.SetValue("backup_type", UNCOMPRESSED);
 			backup_info.SetValue("file_count", files_backup);
+			if (write_manifest) {
+				// Restore finds the archives of every backup in an incremental chain from its .info
+				backup_info.SetValue("backup_file", TWFunc::Get_Filename(tarfn));
+				if (!incremental_base.empty())
+					backup_info.SetValue("incremental_base", TWFunc::Get_Filename(incremental_base));
+			}
 			backup_info.SaveValues();
 		}
 #endif //ndef BUILD_TWRPTAR_MAIN
@@ -482,28 +521,35 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 int twrpTar::extractTarFork() {
 	int status = 0;
 	pid_t tar_fork_pid;
-	int progress_pipe[2];
+	twrpTarProgress progress_block;
 
-	if (pipe(progress_pipe) < 0) {
-		LOGINFO("Error creating progress tracking pipe\n");
+#ifndef BUILD_TWRPTAR_MAIN
+	twrpLog::Reset_File_Messages(DataManager::GetIntValue(TW_LOG_FILE_MESSAGES_VAR));
+#endif
+	if (!progress_block.Map()) {
 		gui_err("restore_error=Error during restore process.");
 		return -1;
 	}
+	tar_progress = &progress_block;
 
 	tar_fork_pid = fork();
 	if (tar_fork_pid >= 0) // fork was successful
 	{
 		if (tar_fork_pid == 0) // child process
 		{
-			close(progress_pipe[0]);
-			progress_pipe_fd = progress_pipe[1];
-			if (TWFunc::Path_Exists(tarfn) || part_settings->adbbackup) {
+			tar_progress->Make_Current();
+			tar_progress->Start_Stage(TW_TAR_STAGE_ARCHIVE);
+			bool adb_multi = part_settings->adbbackup && part_settings->adb_streams > 1;
+			if (TWFunc::Path_Exists(tarfn) || (part_settings->adbbackup && !adb_multi)) {
 				LOGINFO("Single archive\n");
+				if (!Check_Archive_Digest())
+					_exit(-1);
+				tar_progress->Start_Thread(thread_id);
 				if (extract() != 0)
 					_exit(-1);
-				else {
-					_exit(0);
-				}
+				tar_progress->End_Thread(thread_id);
+				tar_progress->Done();
+				_exit(0);
 			} else {
 				LOGINFO("Multiple archives\n");
 				string temp;
@@ -511,67 +557,50 @@ int twrpTar::extractTarFork() {
 				twrpTar tars[9];
 				pthread_t tar_thread[9];
 				pthread_attr_t tattr;
-				unsigned thread_count = 0, i, start_thread_id = 1;
+				unsigned thread_count = 0, i;
 				int ret, thread_error = 0;
 				void *thread_return;
 
 				basefn = tarfn;
 				temp = basefn + "%i%02i";
 				tarfn += "000";
-				if (!TWFunc::Path_Exists(tarfn)) {
+				if (!adb_multi && !TWFunc::Path_Exists(tarfn)) {
 					LOGINFO("Unable to locate '%s' or '%s'\n", basefn.c_str(), tarfn.c_str());
 					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
 					_exit(-1);
 				}
-				if (TWFunc::Get_File_Type(tarfn) != 2) {
-					LOGINFO("First tar file '%s' not encrypted\n", tarfn.c_str());
-					tars[0].basefn = basefn;
-					tars[0].thread_id = 0;
-					tars[0].progress_pipe_fd = progress_pipe_fd;
-					tars[0].part_settings = part_settings;
-					if (extractMulti((void*)&tars[0]) != 0) {
-						LOGINFO("Error extracting split archive.\n");
-						gui_err("restore_error=Error during restore process.");
-						close(progress_pipe_fd);
-						_exit(-1);
-					}
-				} else {
-					start_thread_id = 0;
-				}
-				// Start threading encrypted restores
+				// Every archive set holds different files, restore them all in parallel
 				if (pthread_attr_init(&tattr)) {
 					LOGINFO("Unable to pthread_attr_init\n");
 					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
 					_exit(-1);
 				}
 				if (pthread_attr_setdetachstate(&tattr, PTHREAD_CREATE_JOINABLE)) {
 					LOGINFO("Error setting pthread_attr_setdetachstate\n");
 					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
 					_exit(-1);
 				}
 				if (pthread_attr_setscope(&tattr, PTHREAD_SCOPE_SYSTEM)) {
 					LOGINFO("Error setting pthread_attr_setscope\n");
 					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
 					_exit(-1);
 				}
 				/*if (pthread_attr_setstacksize(&tattr, 524288)) {
 					LOGERR("Error setting pthread_attr_setstacksize\n");
-					close(progress_pipe_fd);
 					_exit(-1);
 				}*/
-				for (i = start_thread_id; i < 9; i++) {
+				for (i = 0; i < 9; i++) {
 					sprintf(actual_filename, temp.c_str(), i, 0);
-					if (TWFunc::Path_Exists(actual_filename)) {
+					// Each stream of an adb backup is one archive set
+					if (adb_multi ? i < part_settings->adb_streams : TWFunc::Path_Exists(actual_filename)) {
 						thread_count++;
 						tars[i].basefn = basefn;
 						tars[i].setpassword(password);
 						tars[i].thread_id = i;
-						tars[i].progress_pipe_fd = progress_pipe_fd;
+						tars[i].tar_progress = tar_progress;
 						tars[i].part_settings = part_settings;
+						tars[i].verify_digest = verify_digest;
+						tars[i].verify_only = verify_only;
 						LOGINFO("Creating extract thread ID %i\n", i);
 						ret = pthread_create(&tar_thread[i], &tattr, extractMulti, (void*)&tars[i]);
 						if (ret) {
@@ -579,7 +608,6 @@ int twrpTar::extractTarFork() {
 							if (extractMulti((void*)&tars[i]) != 0) {
 								LOGINFO("Error extracting backup in thread %i.\n", i);
 								gui_err("restore_error=Error during restore process.");
-								close(progress_pipe_fd);
 								_exit(-1);
 							} else {
 								tars[i].thread_id = i + 1;
@@ -590,12 +618,11 @@ int twrpTar::extractTarFork() {
 						break;
 					}
 				}
-				for (i = start_thread_id; i < thread_count + start_thread_id; i++) {
+				for (i = 0; i < thread_count; i++) {
 					if (tars[i].thread_id == i) {
 						if (pthread_join(tar_thread[i], &thread_return)) {
 							LOGINFO("Error joining thread %i\n", i);
 							gui_err("restore_error=Error during restore process.");
-							close(progress_pipe_fd);
 							_exit(-1);
 						} else {
 							LOGINFO("Joined thread %i.\n", i);
@@ -604,7 +631,6 @@ int twrpTar::extractTarFork() {
 								thread_error = 1;
 								LOGINFO("Thread %i returned an error %i.\n", i, ret);
 								gui_err("restore_error=Error during restore process.");
-								close(progress_pipe_fd);
 								_exit(-1);
 							}
 						}
@@ -615,27 +641,27 @@ int twrpTar::extractTarFork() {
 				if (thread_error) {
 					LOGINFO("Error returned by one or more threads.\n");
 					gui_err("restore_error=Error during restore process.");
-					close(progress_pipe_fd);
 					_exit(-1);
 				}
-				LOGINFO("Finished encrypted restore.\n");
-				close(progress_pipe_fd);
+#ifndef BUILD_TWRPTAR_MAIN
+				if (adb_multi && !twadbbu::Write_TWEOF()) {
+					_exit(-1);
+				}
+#endif
+				LOGINFO("Finished threaded restore.\n");
+				tar_progress->Done();
 				_exit(0);
 			}
 		}
 		else // parent process
 		{
-			unsigned long long fs, size_backup = 0;
-
-			// Parent closes output side
-			close(progress_pipe[1]);
-
-			// Read progress data from children
-			while (read(progress_pipe[0], &fs, sizeof(fs)) > 0) {
-				size_backup += fs;
-				part_settings->progress->UpdateSize(size_backup);
-			}
-			close(progress_pipe[0]);
+			progress_block.Watch(tar_fork_pid, part_settings->progress, restore_file_count != 0);
+			progress_block.Log(tarfn);
+			tar_progress = NULL;
+#ifndef BUILD_TWRPTAR_MAIN
+			if (part_settings->report)
+				part_settings->report->Add_Tar(&progress_block);
+#endif
 			part_settings->progress->UpdateDisplayDetails(true);
 
 			if (TWFunc::Wait_For_Child(tar_fork_pid, &status, "extractTarFork()") != 0)
@@ -644,75 +670,260 @@ int twrpTar::extractTarFork() {
 	}
 	else // fork has failed
 	{
-		close(progress_pipe[0]);
-		close(progress_pipe[1]);
+		tar_progress = NULL;
 		LOGINFO("extract tar failed to fork.\n");
 		return -1;
 	}
 	return 0;
 }
 
-int twrpTar::Generate_TarList(string Path, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id) {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
-	string FileName;
+unsigned long long twrpTar::Generate_TarList(const std::vector<twrpScanEntry>& Entries, size_t first, size_t last, std::vector<TarListStruct> *TarList, unsigned thread_id, unsigned long long *list_size) {
 	struct TarListStruct TarItem;
-	int ret, file_count;
-	file_count = 0;
+	unsigned long long file_count = 0;
+	size_t i;
 
-	d = opendir(Path.c_str());
-	if (d == NULL) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
-		closedir(d);
-		return -1;
+	TarList->reserve(TarList->size() + (last - first));
+	for (i = first; i < last; i++) {
+		if (!unchanged.empty() && unchanged[i])
+			continue;
+		TarItem.scan_index = i;
+		TarItem.thread_id = thread_id;
+		TarItem.is_dir = Entries[i].type == DT_DIR;
+		if (Entries[i].type == DT_REG) {
+			*list_size += Entries[i].size;
+			file_count++;
+		}
+		TarList->push_back(TarItem);
+	}
+	return file_count;
+}
+
+bool twrpTar::Prepare_Manifest(const std::vector<twrpScanEntry>& Entries, twrpManifest *New_Manifest, twrpManifest *Base) {
+	unsigned long long unchanged_files = 0, unchanged_size = 0;
+	string hash;
+	size_t i;
+
+	if (!incremental_base.empty()) {
+		string Base_File = incremental_base + "/" + partition_name + ".manifest";
+		if (!Base->Load(Base_File)) {
+			gui_msg(Msg(msg::kError, "incremental_base_err=Unable to read incremental base '{1}'")(Base_File));
+			return false;
+		}
+		unchanged.assign(Entries.size(), false);
+	}
+	// Folders and links are always archived, files only if they are new or
+	// their size, mtime, ctime or inode changed. Unchanged files keep their hash.
+	for (i = 0; i < Entries.size(); i++) {
+		New_Manifest->Add(Entries[i]);
+		if (!incremental_base.empty() && Base->Unchanged(Entries[i], &hash)) {
+			New_Manifest->Set_Hash(i, hash);
+			unchanged[i] = true;
+			unchanged_files++;
+			unchanged_size += Entries[i].size;
+		}
+	}
+	manifest = New_Manifest;
+	if (!incremental_base.empty())
+		LOGINFO("Incremental backup against '%s': %llu unchanged files, %llu bytes\n", incremental_base.c_str(), unchanged_files, unchanged_size);
+	return true;
+}
+
+bool twrpTar::Save_Manifest(twrpManifest *New_Manifest, twrpManifest *Base) {
+	string Manifest_File = backup_folder + "/" + partition_name + ".manifest";
+
+	if (!New_Manifest->Save(Manifest_File))
+		return false;
+	if (!incremental_base.empty()) {
+		std::vector<std::string> Deleted;
+		string Deleted_File = backup_folder + "/" + partition_name + ".deleted";
+
+		New_Manifest->Get_Deleted(Base, &Deleted);
+		LOGINFO("Incremental backup: %zu items removed since the base\n", Deleted.size());
+		if (!twrpManifest::Save_List(Deleted_File, Deleted))
+			return false;
+	}
+	return true;
+}
+
+void twrpTar::Balance_TarList(std::vector<TarListStruct> *TarList, unsigned first_thread, unsigned thread_count) {
+	typedef std::pair<unsigned long long, unsigned> Thread_Load;
+	std::vector<std::pair<unsigned long long, size_t> > files;
+	std::priority_queue<Thread_Load, std::vector<Thread_Load>, std::greater<Thread_Load> > loads;
+	std::vector<unsigned long long> thread_size(thread_count, 0);
+	std::vector<unsigned> dir_threads(TarList->size(), 0);
+	std::vector<size_t> dir_stack;
+	std::vector<TarListStruct> Balanced;
+	size_t i, j;
+	unsigned t;
+
+	if (thread_count < 1)
+		return;
+
+	// Longest processing time first: the largest files are placed first,
+	// each on the thread with the least data so far. The cost of a file is
+	// what it takes up in the archive, header and padding included.
+	for (i = 0; i < TarList->size(); i++) {
+		if (!TarList->at(i).is_dir) {
+			const twrpScanEntry& Entry = scan_entries->at(TarList->at(i).scan_index);
+			unsigned long long size = Entry.type == DT_REG ? Entry.size : 0;
+			files.push_back(std::make_pair(((size + T_BLOCKSIZE - 1) / T_BLOCKSIZE + 1) * T_BLOCKSIZE, i));
+		}
+	}
+	std::sort(files.rbegin(), files.rend());
+	for (t = 0; t < thread_count; t++)
+		loads.push(Thread_Load(0, t));
+	for (i = 0; i < files.size(); i++) {
+		Thread_Load least = loads.top();
+		loads.pop();
+		TarList->at(files[i].second).thread_id = first_thread + least.second;
+		least.first += files[i].first;
+		thread_size[least.second] = least.first;
+		loads.push(least);
 	}
-	while ((de = readdir(d)) != NULL) {
-		FileName = Path + "/" + de->d_name;
 
-		if (de->d_type == DT_BLK || de->d_type == DT_CHR || backup_exclusions->check_skip_dirs(FileName))
+	// Every thread also gets a copy of the folders above its files, so each
+	// archive set restores its folders (and their encryption policies)
+	// before anything is written into them, whatever order the threads run in.
+	for (i = 0; i < TarList->size(); i++) {
+		const TarListStruct& item = TarList->at(i);
+		// The items below a folder of the scan end at its end index
+		while (!dir_stack.empty()) {
+			if (item.scan_index < scan_entries->at(TarList->at(dir_stack.back()).scan_index).end)
+				break;
+			dir_stack.pop_back();
+		}
+		if (item.is_dir) {
+			dir_stack.push_back(i);
 			continue;
-		TarItem.fn = FileName;
-		TarItem.thread_id = *thread_id;
-		if (de->d_type == DT_DIR) {
-			TarList->push_back(TarItem);
-			ret = Generate_TarList(FileName, TarList, Target_Size, thread_id);
-			if (ret < 0)
-				return -1;
-			file_count += ret;
-		} else if (de->d_type == DT_REG || de->d_type == DT_LNK) {
-			stat(FileName.c_str(), &st);
-			TarList->push_back(TarItem);
-			if (de->d_type == DT_REG) {
-				file_count++;
-				Archive_Current_Size += st.st_size;
-			}
-			if (Archive_Current_Size != 0 && *Target_Size != 0 && Archive_Current_Size > *Target_Size) {
-				*thread_id = *thread_id + 1;
-				Archive_Current_Size = 0;
+		}
+		unsigned mask = 1U << (item.thread_id - first_thread);
+		for (j = dir_stack.size(); j > 0 && !(dir_threads[dir_stack[j - 1]] & mask); j--)
+			dir_threads[dir_stack[j - 1]] |= mask;
+	}
+	for (i = 0; i < TarList->size(); i++) {
+		if (!TarList->at(i).is_dir) {
+			Balanced.push_back(TarList->at(i));
+			continue;
+		}
+		if (dir_threads[i] == 0)
+			dir_threads[i] = 1; // empty folders go with the first thread
+		for (t = 0; t < thread_count; t++) {
+			if (dir_threads[i] & (1U << t)) {
+				Balanced.push_back(TarList->at(i));
+				Balanced.back().thread_id = first_thread + t;
 			}
 		}
 	}
-	closedir(d);
-	return file_count;
+	TarList->swap(Balanced);
+
+	for (t = 0; t < thread_count; t++)
+		LOGINFO("   Thread %u size   : %llu\n", first_thread + t, thread_size[t]);
+}
+
+// Physical byte offset of the start of a file, false if it has no mapped
+// extent (inline data, delayed allocation) or the filesystem can't tell
+static bool Get_First_Extent(const string& Path, uint64_t *physical) {
+	uint64_t buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(uint64_t)];
+	struct fiemap* map = (struct fiemap*) buf;
+	int fd = open(Path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	memset(buf, 0, sizeof(buf));
+	map->fm_length = FIEMAP_MAX_OFFSET;
+	map->fm_extent_count = 1;
+	int ret = ioctl(fd, FS_IOC_FIEMAP, map);
+	close(fd);
+	if (ret != 0 || map->fm_mapped_extents == 0 || (map->fm_extents[0].fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE)))
+		return false;
+	*physical = map->fm_extents[0].fe_physical;
+	return true;
+}
+
+void twrpTar::Sort_TarList(std::vector<TarListStruct> *TarList) {
+	std::vector<std::pair<uint64_t, size_t> > files;
+	std::vector<TarListStruct> Sorted;
+	size_t i;
+
+	if (read_order != TW_READ_ORDER_INODE && read_order != TW_READ_ORDER_EXTENT)
+		return;
+
+	// readdir order is hash order on ext4 and f2fs, which scatters the reads
+	// over the disk. Folders and links keep their order and go first, so
+	// every folder is still restored before anything is written into it.
+	// Inode numbers follow the block groups closely enough to make the file
+	// reads mostly sequential; the first extent is exact but costs an open
+	// and an ioctl per file.
+	Sorted.reserve(TarList->size());
+	for (i = 0; i < TarList->size(); i++) {
+		const TarListStruct& item = TarList->at(i);
+		const twrpScanEntry& Entry = scan_entries->at(item.scan_index);
+		if (Entry.type != DT_REG || Entry.size == 0) {
+			Sorted.push_back(item);
+			continue;
+		}
+		uint64_t key = Entry.inode;
+		if (read_order == TW_READ_ORDER_EXTENT) {
+			uint64_t physical;
+			if (Get_First_Extent(Entry.fn, &physical))
+				key = physical;
+		}
+		files.push_back(std::make_pair(key, i));
+	}
+	std::sort(files.begin(), files.end());
+	for (i = 0; i < files.size(); i++)
+		Sorted.push_back(TarList->at(files[i].second));
+	TarList->swap(Sorted);
 }
 
 int twrpTar::extractTar() {
 	char* charRootDir = (char*) tardir.c_str();
-	if (openTar() == -1)
+	twrpPipeStats stats;
+	int ret = 0;
+
+	// Stages are listed in pipeline order, the ones an archive type doesn't use are not logged
+	pipe_threads = twrpCompress_Default_Threads();
+	write_threads = pipe_threads;
+	if (io_lanes > 0 && write_threads > io_lanes)
+		write_threads = io_lanes;
+	stats.Add("read", 1);
+	stats.Add("decrypt", pipe_threads);
+	stats.Add("decompress", 1);
+	stats.Add("extract", 1);
+	stats.Add("write", write_threads);
+	pipe_stats = &stats;
+	if (openTar() == -1) {
+		pipe_stats = NULL;
 		return -1;
-	if (tar_extract_all(t, charRootDir, &progress_pipe_fd) != 0) {
+	}
+	if (verify_only) {
+		ret = Verify_Entries();
+	} else if (restore_paths != NULL) {
+		ret = Extract_Matching();
+	} else if (Extract_All(charRootDir) != 0) {
 		LOGINFO("Unable to extract tar archive '%s'\n", tarfn.c_str());
-		gui_err("restore_error=Error during restore process.");
-		return -1;
+		ret = -1;
 	}
-	if (tar_close(t) != 0) {
+	if (ret == 0 && !verify_only && tar_extract_finish(t) != 0) {
+		LOGINFO("Unable to set folder permissions of '%s'\n", tarfn.c_str());
+		ret = -1;
+	}
+	// Closing the reader stops the stage threads
+	if (tar_close(t) != 0 && ret == 0) {
 		LOGINFO("Unable to close tar file\n");
+		ret = -1;
+	}
+	pipe_stats = NULL;
+	if (ret != 0) {
 		gui_err("restore_error=Error during restore process.");
 		return -1;
 	}
+	stats.Log(tarfn);
+	Add_Stage_Time(&stats, "decompress", TW_TAR_TIME_COMPRESS);
+	Add_Stage_Time(&stats, "decrypt", TW_TAR_TIME_ENCRYPT);
+	Add_Stage_Time(&stats, "write", TW_TAR_TIME_WRITE);
 #ifndef BUILD_TWRPTAR_MAIN
-	if (part_settings->adbbackup) {
+	// The threads of a multiplexed restore end together, see extractTarFork()
+	if (part_settings->adbbackup && part_settings->adb_streams <= 1) {
 		if (!twadbbu::Write_TWEOF())
 			return -1;
 	}
@@ -726,17 +937,36 @@ int twrpTar::extract() {
 		Set_Archive_Type(TWFunc::Get_File_Type(tarfn));
 	}
 	else {
-		if (part_settings->adb_compression == 1) 
-			current_archive_type = COMPRESSED;
-		else
-			current_archive_type = UNCOMPRESSED;
+		// The file header gives the codec and which streams are encrypted
+		current_archive_type = (Archive_Type) part_settings->adb_compression;
+		if (part_settings->adb_encrypted_streams & (1U << thread_id))
+			current_archive_type = current_archive_type == COMPRESSED ? COMPRESSED_ENCRYPTED : ENCRYPTED;
 	}
 
-	if (current_archive_type == COMPRESSED) {
+	if (current_archive_type == COMPRESSED || current_archive_type == COMPRESSED_ZSTD || current_archive_type == COMPRESSED_LZ4) {
+		if (!twrpCompress_Supported(current_archive_type)) {
+			gui_msg(Msg(msg::kError, "unsupported_compression=Compression used by '{1}' is not supported by this TWRP build")(tarfn));
+			return -1;
+		}
 		//if you return the extractTGZ function directly, stack crashes happen
-		LOGINFO("Extracting gzipped tar\n");
+		LOGINFO("Extracting compressed tar\n");
 		int ret = extractTar();
 		return ret;
+	} else if (current_archive_type == CHUNKED) {
+#ifdef BUILD_TWRPTAR_MAIN
+		LOGERR("'%s' is a deduplicated archive, restore it from TWRP\n", tarfn.c_str());
+		return -1;
+#else
+		LOGINFO("Extracting deduplicated tar\n");
+		return extractTar();
+#endif
+	} else if (current_archive_type == COMPRESSED_ENCRYPTED) {
+		// Only an adb file header says so up front
+		LOGINFO("Extracting encrypted and compressed tar.\n");
+		return extractTar();
+	} else if (current_archive_type == ENCRYPTED && part_settings->adbbackup) {
+		LOGINFO("Extracting encrypted tar.\n");
+		return extractTar();
 	} else if (current_archive_type == ENCRYPTED) {
 		int ret = TWFunc::Try_Decrypting_File(tarfn, password);
 		if (ret < 1) {
@@ -760,13 +990,330 @@ int twrpTar::extract() {
 	}
 }
 
+// Same name that tar_extract_all() extracts to
+static string Extract_Name(const string& prefix, const char* filename) {
+	string path = prefix + "/" + filename, ret;
+	size_t i;
+
+	for (i = 0; i < path.size(); i++) {
+		if (path[i] == '/' && !ret.empty() && ret[ret.size() - 1] == '/')
+			continue;
+		ret += path[i];
+	}
+	if (ret.size() > 1 && ret[ret.size() - 1] == '/')
+		ret.resize(ret.size() - 1);
+	return ret;
+}
+
+int twrpTar::extractPaths(const std::vector<string>& Paths, unsigned long long *restored) {
+	std::vector<string> archives;
+	string restore_dir = tardir;
+	char actual_filename[PATH_MAX];
+	unsigned thread;
+	int index, ret = 0;
+	size_t i;
+
+#ifndef BUILD_TWRPTAR_MAIN
+	twrpLog::Reset_File_Messages(DataManager::GetIntValue(TW_LOG_FILE_MESSAGES_VAR));
+#endif
+	// Split archives store full paths and are extracted without a prefix
+	if (TWFunc::Path_Exists(tarfn)) {
+		archives.push_back(tarfn);
+	} else {
+		restore_dir = "";
+		for (thread = 0; thread < 10; thread++) {
+			for (index = 0; index < 100; index++) {
+				snprintf(actual_filename, sizeof(actual_filename), "%s%i%02i", tarfn.c_str(), thread, index);
+				if (!TWFunc::Path_Exists(actual_filename))
+					break;
+				archives.push_back(actual_filename);
+			}
+			if (index == 0)
+				break;
+		}
+	}
+	if (archives.empty()) {
+		LOGINFO("Unable to locate '%s'\n", tarfn.c_str());
+		gui_err("restore_error=Error during restore process.");
+		return -1;
+	}
+
+	string fn = tarfn, dir = tardir;
+	tardir = restore_dir;
+	restore_paths = &Paths;
+	restored_count = 0;
+	for (i = 0; i < archives.size() && ret == 0; i++) {
+		twrpTarIndex Index;
+		tarfn = archives[i];
+		Set_Archive_Type(TWFunc::Get_File_Type(tarfn));
+		bool seekable = current_archive_type == UNCOMPRESSED || twrpCompress_Supported(current_archive_type);
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+		if (current_archive_type == ENCRYPTED && twrpGcm_Is_Archive(tarfn)) {
+			// Decrypting the start tells whether it is compressed and checks the password
+			int decrypted = TWFunc::Try_Decrypting_File(tarfn, password);
+			if (decrypted < 2) {
+				gui_msg(Msg(msg::kError, "fail_decrypt_tar=Failed to decrypt tar file '{1}'")(tarfn));
+				ret = -1;
+				break;
+			}
+			if (decrypted == 3)
+				current_archive_type = COMPRESSED_ENCRYPTED;
+			seekable = true;
+		}
+#endif
+		if (seekable && Index.Load(tarfn)) {
+			LOGINFO("Restoring from '%s' with its index\n", tarfn.c_str());
+			ret = Extract_Indexed(&Index);
+		} else {
+			// Older backups and openaes archives have no index
+			LOGINFO("Searching all of '%s'\n", tarfn.c_str());
+			ret = extract();
+		}
+	}
+	*restored = restored_count;
+	restore_paths = NULL;
+	tarfn = fn;
+	tardir = dir;
+	return ret;
+}
+
+int twrpTar::Extract_All(char* prefix) {
+	twrpPipeStage* extract_stage = Pipe_Stage("extract");
+	twrpExtractPool pool(write_threads, Pipe_Stage("write"), extract_stage);
+	bool use_pool = pool.Start() && !(t->options & TAR_NOOVERWRITE);
+	uint64_t start = twrpPipe_Now();
+	unsigned long long* progress = tar_progress ? tar_progress->Bytes(thread_id) : NULL;
+	char buf[PATH_MAX], target[PATH_MAX];
+	int i, ret = 0;
+
+	// tar_extract_all() with regular files handed to the writer pool
+	while ((i = th_read(t)) == 0) {
+		bool regular = TH_ISREG(t) && !TH_ISLNK(t) && !TH_ISSYM(t);
+		snprintf(buf, sizeof(buf), "%s/%s", prefix, th_get_pathname(t));
+		if (use_pool && regular) {
+			ret = pool.Extract_Regfile(t, buf, progress);
+		} else {
+			// A hardlink gets its target, and anything else its path, only
+			// after the pool has written and labelled the file there
+			if (use_pool) {
+				pool.Wait_For(buf);
+				if (TH_ISLNK(t)) {
+					snprintf(target, sizeof(target), "%s/%s", prefix, th_get_linkname(t));
+					pool.Wait_For(target);
+				}
+			}
+			ret = tar_extract_file(t, buf, prefix, progress);
+		}
+		if (ret != 0) {
+			LOGINFO("Unable to extract '%s'\n", buf);
+			break;
+		}
+		if (regular && tar_progress)
+			tar_progress->Add_File(thread_id);
+	}
+	if (i != 0 && i != 1)
+		ret = -1;
+	if (pool.Finish() != 0)
+		ret = -1;
+	if (extract_stage)
+		extract_stage->busy_usec += twrpPipe_Now() - start;
+	return ret;
+}
+
+int twrpTar::Verify_Entries() {
+	twrpPipeStage* extract_stage = Pipe_Stage("extract");
+	uint64_t start = twrpPipe_Now();
+	unsigned long long* progress = tar_progress ? tar_progress->Bytes(thread_id) : NULL;
+	int i;
+
+	// th_read() checks each header, and skipping a payload still reads it
+	// through the decrypt and decompress stages, so a short or corrupt
+	// archive fails here the way it would on a restore
+	while ((i = th_read(t)) == 0) {
+		if (!TH_ISREG(t) || TH_ISLNK(t) || TH_ISSYM(t))
+			continue;
+		if (tar_skip_regfile(t) != 0) {
+			LOGINFO("Unable to read '%s' in '%s'\n", th_get_pathname(t), tarfn.c_str());
+			i = -1;
+			break;
+		}
+		if (progress != NULL)
+			__atomic_fetch_add(progress, (unsigned long long) th_get_size(t), __ATOMIC_RELAXED);
+		if (tar_progress)
+			tar_progress->Add_File(thread_id);
+	}
+	if (extract_stage)
+		extract_stage->busy_usec += twrpPipe_Now() - start;
+	if (i != 1) {
+		LOGINFO("Unable to read tar archive '%s'\n", tarfn.c_str());
+		return -1;
+	}
+	return 0;
+}
+
+twrpPipeStage* twrpTar::Pipe_Stage(const string& name) {
+	return pipe_stats ? pipe_stats->Find(name) : NULL;
+}
+
+int twrpTar::Extract_Matching() {
+	char* charRootDir = (char*) tardir.c_str();
+	int i;
+
+	while ((i = th_read(t)) == 0) {
+		string name = Extract_Name(tardir, th_get_pathname(t));
+		if (!twrpTarIndex::Path_Matches(name, *restore_paths)) {
+			if (TH_ISREG(t) && tar_skip_regfile(t) != 0)
+				return -1;
+			continue;
+		}
+		LOGFILE("Restoring '%s'\n", name.c_str());
+		if (tar_extract_file(t, name.c_str(), charRootDir, NULL) != 0)
+			return -1;
+		restored_count++;
+	}
+	return i == 1 ? 0 : -1;
+}
+
+int twrpTar::Open_Indexed_Input(const twrpTarIndexFrame& Frame, uint64_t offset) {
+	char* charRootDir = (char*) tardir.c_str();
+
+	fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
+	if (fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
+		return -1;
+	}
+	if (current_archive_type == UNCOMPRESSED) {
+		if (lseek64(fd, offset, SEEK_SET) < 0) {
+			close(fd);
+			return -1;
+		}
+		tar_type.readfunc = read;
+		tar_type.closefunc = close;
+	} else {
+		twrpStreamReader* reader = NULL;
+		if (current_archive_type == ENCRYPTED || current_archive_type == COMPRESSED_ENCRYPTED) {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+			// Frames of AES-GCM archives are offsets into the decrypted
+			// stream, the reader seeks to their chunk
+			twrpDecryptReader* decrypt = new twrpDecryptReader(fd, password, pipe_threads, NULL, NULL, Frame.compressed);
+			if (!decrypt->Start())
+				delete decrypt;
+			else if (current_archive_type == ENCRYPTED)
+				reader = decrypt;
+			else if ((reader = twrpCompress_New_Reader(COMPRESSED, fd, decrypt)) == NULL)
+				delete decrypt;
+#endif
+		} else if (lseek64(fd, Frame.compressed, SEEK_SET) >= 0) {
+			reader = twrpCompress_New_Reader(current_archive_type, fd);
+		}
+		if (reader == NULL || !twrpCompress_Attach_Reader(fd, reader)) {
+			LOGINFO("Unable to start decompression of '%s'\n", tarfn.c_str());
+			delete reader;
+			close(fd);
+			return -1;
+		}
+		if (!Skip_Indexed_Input(offset - Frame.uncompressed)) {
+			twrpCompress_Close_Reader(fd);
+			return -1;
+		}
+		tar_type.readfunc = twrpCompress_Read;
+		tar_type.closefunc = twrpCompress_Close_Reader;
+	}
+	if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+		tar_type.closefunc(fd);
+		LOGINFO("tar_fdopen failed\n");
+		return -1;
+	}
+	t->file_msg = twrpLog::File_Message;
+	return 0;
+}
+
+bool twrpTar::Skip_Indexed_Input(uint64_t size) {
+	char buf[64 * 1024];
+
+	if (current_archive_type == UNCOMPRESSED)
+		return lseek64(fd, size, SEEK_CUR) >= 0;
+	while (size > 0) {
+		ssize_t len = twrpCompress_Read(fd, buf, size < sizeof(buf) ? size : sizeof(buf));
+		if (len <= 0) {
+			LOGINFO("Unexpected end of '%s'\n", tarfn.c_str());
+			return false;
+		}
+		size -= len;
+	}
+	return true;
+}
+
+int twrpTar::Extract_Indexed(twrpTarIndex *Index) {
+	std::vector<twrpTarIndexEntry> Found;
+	char* charRootDir = (char*) tardir.c_str();
+	bool is_open = false;
+	uint64_t pos = 0;
+	size_t i;
+	int ret = 0;
+
+	Index->Find(*restore_paths, &Found);
+	for (i = 0; i < Found.size() && ret == 0; i++) {
+		const twrpTarIndexEntry& Entry = Found[i];
+		twrpTarIndexFrame Frame = Index->Frame_For(Entry.start);
+		// Read on through the current frame, seek when a later frame is closer
+		if (!is_open || Entry.start < pos || Frame.uncompressed > pos) {
+			if (is_open)
+				tar_close(t);
+			is_open = Open_Indexed_Input(Frame, Entry.start) == 0;
+			if (!is_open) {
+				ret = -1;
+				break;
+			}
+		} else if (!Skip_Indexed_Input(Entry.start - pos)) {
+			ret = -1;
+			break;
+		}
+		string name;
+		if (th_read(t) == 0)
+			name = Extract_Name(tardir, th_get_pathname(t));
+		if (name.empty() || !twrpTarIndex::Path_Matches(name, *restore_paths)) {
+			LOGINFO("Index of '%s' does not match the archive at %llu\n", tarfn.c_str(), (unsigned long long)Entry.start);
+			ret = -1;
+			break;
+		}
+		LOGFILE("Restoring '%s'\n", name.c_str());
+		if (tar_extract_file(t, name.c_str(), charRootDir, NULL) != 0) {
+			ret = -1;
+			break;
+		}
+		restored_count++;
+		pos = Entry.end;
+	}
+	if (is_open && tar_close(t) != 0)
+		ret = -1;
+	if (ret != 0)
+		gui_err("restore_error=Error during restore process.");
+	return ret;
+}
+
+#ifndef BUILD_TWRPTAR_MAIN
+// The manifest hash of a file is taken from the bytes libtar archives, so it
+// matches the archive and the file is only read once
+struct Manifest_Hash {
+	twrpMD5 digest;
+	uint64_t len;
+};
+
+static void Manifest_Hash_Data(void *arg, const void *buf, size_t len) {
+	Manifest_Hash* hash = (Manifest_Hash*) arg;
+
+	hash->digest.update((const unsigned char*) buf, len);
+	hash->len += len;
+}
+#endif
+
 int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
-	struct stat st;
-	char buf[PATH_MAX];
 	int list_size = TarList->size(), i = 0, archive_count = 0;
 	string temp;
 	char actual_filename[PATH_MAX];
 	unsigned long long fs;
+	int prefetch_next = 0;
 
 	if (split_archives) {
 		basefn = tarfn;
@@ -789,14 +1336,15 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 		return -2;
 	}
 	Archive_Current_Size = 0;
+	tar_prefetch_init(t, TW_TAR_PREFETCH_DEPTH);
 
 	while (i < list_size) {
 		if (TarList->at(i).thread_id == thread_id) {
-			strcpy(buf, TarList->at(i).fn.c_str());
-			lstat(buf, &st);
-			if (S_ISREG(st.st_mode)) { // item is a regular file
-				fs = (unsigned long long)(st.st_size);
-				if (split_archives && Archive_Current_Size + fs > MAX_ARCHIVE_SIZE) {
+			// The scan already has the type and size, libtar stats the item itself
+			const twrpScanEntry& Entry = scan_entries->at(TarList->at(i).scan_index);
+			if (Entry.type == DT_REG) { // item is a regular file
+				fs = (unsigned long long) Entry.size;
+				if (split_archives && !part_settings->adbbackup && Archive_Current_Size + fs > max_archive_size) {
 					if (closeTar() != 0) {
 						LOGINFO("Error closing '%s' on thread %i\n", tarfn.c_str(), thread_id);
 						gui_err("backup_error=Error creating backup.");
@@ -817,17 +1365,53 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 						return -2;
 					}
 					Archive_Current_Size = 0;
+					tar_prefetch_init(t, TW_TAR_PREFETCH_DEPTH);
+					prefetch_next = i;
 				}
 				Archive_Current_Size += fs;
-				fs = 0; // Sending a 0 size to the pipe tells it to increment the file counter
-				write(progress_pipe_fd, &fs, sizeof(fs));
+				if (tar_progress)
+					tar_progress->Add_File(thread_id);
+			}
+			// Keep the small files coming up for this thread queued for reading
+			if (prefetch_next < i)
+				prefetch_next = i;
+			for (; prefetch_next < list_size; prefetch_next++) {
+				const TarListStruct& next = TarList->at(prefetch_next);
+				if (next.thread_id != thread_id || next.is_dir)
+					continue;
+				const twrpScanEntry& Next_Entry = scan_entries->at(next.scan_index);
+				if (tar_prefetch_add(t, Next_Entry.fn.c_str(), Next_Entry.type == DT_REG ? Next_Entry.size : 0) != 0)
+					break;
 			}
-			LOGINFO("addFile '%s' including root: %i\n", buf, include_root_dir);
-			if (addFile(buf, include_root_dir) != 0) {
-				LOGINFO("Error adding file '%s' to '%s'\n", buf, tarfn.c_str());
+			LOGFILE("addFile '%s' including root: %i\n", Entry.fn.c_str(), include_root_dir);
+			if (output_index)
+				output_index->Begin_Entry();
+#ifndef BUILD_TWRPTAR_MAIN
+			Manifest_Hash hash;
+			hash.len = 0;
+			if (manifest != NULL && Entry.type == DT_REG) {
+				t->data_hook = Manifest_Hash_Data;
+				t->data_hook_arg = &hash;
+			}
+#endif
+			int add_ret = addFile(Entry.fn, include_root_dir);
+#ifndef BUILD_TWRPTAR_MAIN
+			t->data_hook = NULL;
+			t->data_hook_arg = NULL;
+#endif
+			if (add_ret != 0) {
+				LOGINFO("Error adding file '%s' to '%s'\n", Entry.fn.c_str(), tarfn.c_str());
 				gui_err("backup_error=Error creating backup.");
 				return -1;
 			}
+			if (output_index)
+				output_index->End_Entry(Entry.fn, Entry.type == DT_DIR ? 'd' : Entry.type == DT_REG ? 'f' : Entry.type == DT_LNK ? 'l' : 'o');
+#ifndef BUILD_TWRPTAR_MAIN
+			// A hard link or a file that changed size since the scan has no
+			// hash, and is archived again by the next incremental backup
+			if (manifest != NULL && Entry.type == DT_REG && hash.len == Entry.size)
+				manifest->Set_Hash(TarList->at(i).scan_index, hash.digest.return_digest_string());
+#endif
 		}
 		i++;
 	}
@@ -840,12 +1424,41 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 	return 0;
 }
 
+unsigned twrpTar::Backup_Thread_Count() {
+	unsigned count;
+
+	if (backup_threads > 0)
+		count = (unsigned) backup_threads;
+	else {
+		count = sysconf(_SC_NPROCESSORS_ONLN);
+		// eMMC and SD cards do worse with more writers than their lanes
+		if (io_lanes > 0 && count > io_lanes)
+			count = io_lanes;
+	}
+	if (count < 1)
+		count = 1;
+	if (count > TW_MAX_TAR_THREADS)
+		count = TW_MAX_TAR_THREADS;
+	if (!use_encryption && !userdata_encryption) {
+		// Small partitions are not worth splitting
+		if (Total_Backup_Size / TW_MIN_THREAD_SIZE < count)
+			count = Total_Backup_Size / TW_MIN_THREAD_SIZE;
+		if (count < 1)
+			count = 1;
+	}
+	return count;
+}
+
 void* twrpTar::createList(void *cookie) {
 	twrpTar* threadTar = (twrpTar*) cookie;
+	if (threadTar->tar_progress)
+		threadTar->tar_progress->Start_Thread(threadTar->thread_id);
 	if (threadTar->tarList(threadTar->ItemList, threadTar->thread_id) != 0) {
 		LOGINFO("ERROR tarList for thread ID %i\n", threadTar->thread_id);
 		return (void*)-2;
 	}
+	if (threadTar->tar_progress)
+		threadTar->tar_progress->End_Thread(threadTar->thread_id);
 	LOGINFO("Thread ID %i finished successfully.\n", threadTar->thread_id);
 	return (void*)0;
 }
@@ -856,8 +1469,25 @@ void* twrpTar::extractMulti(void *cookie) {
 	string temp = threadTar->basefn + "%i%02i";
 	char actual_filename[255];
 	sprintf(actual_filename, temp.c_str(), threadTar->thread_id, archive_count);
+	if (threadTar->tar_progress)
+		threadTar->tar_progress->Start_Thread(threadTar->thread_id);
+	if (threadTar->part_settings->adbbackup) {
+		// The archive set of this thread is one adb stream
+		threadTar->tarfn = actual_filename;
+		if (threadTar->extract() != 0) {
+			LOGINFO("Error extracting adb stream %i\n", threadTar->thread_id);
+			return (void*)-2;
+		}
+		if (threadTar->tar_progress)
+			threadTar->tar_progress->End_Thread(threadTar->thread_id);
+		LOGINFO("Thread ID %i finished successfully.\n", threadTar->thread_id);
+		return (void*)0;
+	}
 	while (TWFunc::Path_Exists(actual_filename)) {
 		threadTar->tarfn = actual_filename;
+		// Other threads keep extracting while this one checks its next archive
+		if (!threadTar->Check_Archive_Digest())
+			return (void*)-2;
 		if (threadTar->extract() != 0) {
 			LOGINFO("Error extracting '%s' in thread ID %i\n", actual_filename, threadTar->thread_id);
 			return (void*)-2;
@@ -867,6 +1497,8 @@ void* twrpTar::extractMulti(void *cookie) {
 			break;
 		sprintf(actual_filename, temp.c_str(), threadTar->thread_id, archive_count);
 	}
+	if (threadTar->tar_progress)
+		threadTar->tar_progress->End_Thread(threadTar->thread_id);
 	LOGINFO("Thread ID %i finished successfully.\n", threadTar->thread_id);
 	return (void*)0;
 }
@@ -895,219 +1527,68 @@ int twrpTar::createTar() {
 	char* charTarFile = (char*) tarfn.c_str();
 	char* charRootDir = (char*) tardir.c_str();
 
-	if (use_encryption && use_compression) {
-		// Compressed and encrypted
-		current_archive_type = COMPRESSED_ENCRYPTED;
-		LOGINFO("Using encryption and compression...\n");
-		int i, pipes[4];
-
-		if (pipe(pipes) < 0) {
-			LOGINFO("Error creating first pipe\n");
-			gui_err("backup_error=Error creating backup.");
-			return -1;
-		}
-		if (pipe(pipes + 2) < 0) {
-			LOGINFO("Error creating second pipe\n");
-			gui_err("backup_error=Error creating backup.");
-			return -1;
-		}
-		output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-		if (output_fd < 0) {
+#ifndef BUILD_TWRPTAR_MAIN
+	if (use_dedup && !use_encryption && !part_settings->adbbackup) {
+		// Deduplicated, tarfn only gets the chunk index and compression is not used
+		current_archive_type = CHUNKED;
+		LOGINFO("Using the chunk store...\n");
+		fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+		if (fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			for (i = 0; i < 4; i++)
-				close(pipes[i]); // close all
 			return -1;
 		}
-		pigz_pid = fork();
-
-		if (pigz_pid < 0) {
-			LOGINFO("pigz fork() failed\n");
-			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			for (i = 0; i < 4; i++)
-				close(pipes[i]); // close all
+		if (Open_Compressed_Output(charRootDir) != 0)
 			return -1;
-		} else if (pigz_pid == 0) {
-			// pigz Child
-			close(pipes[1]);
-			close(pipes[2]);
-			int stdinfd = fileno(stdin);
-			int stdoutfd = fileno(stdout);
-			close(stdinfd);
-			dup2(pipes[0], stdinfd);
-			close(stdoutfd);
-			dup2(pipes[3], stdoutfd);
-			if (execlp("pigz", "pigz", "-", NULL) < 0) {
-				LOGINFO("execlp pigz ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				close(pipes[0]);
-				close(pipes[3]);
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			oaes_pid = fork();
-
-			if (oaes_pid < 0) {
-				LOGINFO("openaes fork() failed\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				for (i = 0; i < 4; i++)
-					close(pipes[i]); // close all
-				return -1;
-			} else if (oaes_pid == 0) {
-				// openaes Child
-				close(pipes[0]);
-				close(pipes[1]);
-				close(pipes[3]);
-				int stdinfd = fileno(stdin);
-				int stdoutfd = fileno(stdout);
-				close(stdinfd);
-				dup2(pipes[2], stdinfd);
-				close(stdoutfd);
-				dup2(output_fd, stdoutfd);
-				if (execlp("openaes", "openaes", "enc", "--key", password.c_str(), NULL) < 0) {
-					LOGINFO("execlp openaes ERROR!\n");
-					gui_err("backup_error=Error creating backup.");
-					close(pipes[2]);
-					close(output_fd);
-					_exit(-1);
-				}
-			} else {
-				// Parent
-				close(pipes[0]);
-				close(pipes[2]);
-				close(pipes[3]);
-				fd = pipes[1];
-				init_libtar_no_buffer(progress_pipe_fd);
-				tar_type.writefunc = write_tar_no_buffer;
-				if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-					close(fd);
-					LOGINFO("tar_fdopen failed\n");
-					gui_err("backup_error=Error creating backup.");
-					return -1;
-				}
-				return 0;
-			}
-		}
-	} else if (use_compression) {
-		// Compressed
-		current_archive_type = COMPRESSED;
-		LOGINFO("Using compression...\n");
-		int pigzfd[2];
+		return 0;
+	}
+#endif //ndef BUILD_TWRPTAR_MAIN
+	if (use_encryption) {
+		// Encrypted in process into the chunks openaes writes, gzip
+		// compressed first when compression is on
+		current_archive_type = use_compression ? COMPRESSED_ENCRYPTED : ENCRYPTED;
+		LOGINFO("Using encryption%s...\n", use_compression ? " and compression" : "");
 		if (part_settings->adbbackup) {
-			LOGINFO("opening TW_ADB_BACKUP compressed stream\n");
-			output_fd = open(TW_ADB_BACKUP, O_WRONLY);
+			LOGINFO("opening TW_ADB_BACKUP encrypted stream %u\n", thread_id);
+			fd = open(twadb_stream_fifo(TW_ADB_BACKUP, thread_id).c_str(), O_WRONLY);
 		}
 		else {
-			output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+			fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 		}
-		if (output_fd < 0) {
+		if (fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			close(pigzfd[0]);
 			return -1;
 		}
-
-		if (pipe(pigzfd) < 0) {
-			LOGINFO("Error creating pipe\n");
-			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
+		if (Open_Compressed_Output(charRootDir) != 0)
 			return -1;
+	} else if (use_compression) {
+		// Compressed, the adb file header tells the restore about the codec
+		if (!twrpCompress_Supported(compression_type))
+			current_archive_type = COMPRESSED;
+		else
+			current_archive_type = compression_type;
+		LOGINFO("Using compression type %i...\n", current_archive_type);
+		if (part_settings->adbbackup) {
+			LOGINFO("opening TW_ADB_BACKUP compressed stream %u\n", thread_id);
+			fd = open(twadb_stream_fifo(TW_ADB_BACKUP, thread_id).c_str(), O_WRONLY);
 		}
-		pigz_pid = fork();
-
-		if (pigz_pid < 0) {
-			LOGINFO("fork() failed\n");
-			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			close(pigzfd[0]);
-			close(pigzfd[1]);
-			return -1;
-		} else if (pigz_pid == 0) {
-			// Child
-			close(pigzfd[1]);   // close unused output pipe
-			dup2(pigzfd[0], fileno(stdin)); // remap stdin
-			dup2(output_fd, fileno(stdout)); // remap stdout to output file
-			if (execlp("pigz", "pigz", "-", NULL) < 0) {
-				LOGINFO("execlp pigz ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				close(pigzfd[0]);
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(pigzfd[0]); // close parent input
-			fd = pigzfd[1];   // copy parent output
-			init_libtar_no_buffer(progress_pipe_fd);
-			tar_type.writefunc = write_tar_no_buffer;
-			if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("backup_error=Error creating backup.");
-				return -1;
-			}
+		else {
+			fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
 		}
-	} else if (use_encryption) {
-		// Encrypted
-		current_archive_type = ENCRYPTED;
-		LOGINFO("Using encryption...\n");
-		int oaesfd[2];
-		output_fd = open(tarfn.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
-		if (output_fd < 0) {
+		if (fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
-		if (pipe(oaesfd) < 0) {
-			LOGINFO("Error creating pipe\n");
-			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
+		if (Open_Compressed_Output(charRootDir) != 0)
 			return -1;
-		}
-		oaes_pid = fork();
-
-		if (oaes_pid < 0) {
-			LOGINFO("fork() failed\n");
-			gui_err("backup_error=Error creating backup.");
-			close(output_fd);
-			close(oaesfd[0]);
-			close(oaesfd[1]);
-			return -1;
-		} else if (oaes_pid == 0) {
-			// Child
-			close(oaesfd[1]);   // close unused
-			dup2(oaesfd[0], fileno(stdin)); // remap stdin
-			dup2(output_fd, fileno(stdout)); // remap stdout to output file
-			if (execlp("openaes", "openaes", "enc", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				close(oaesfd[0]);
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(oaesfd[0]); // close parent input
-			fd = oaesfd[1];   // copy parent output
-			init_libtar_no_buffer(progress_pipe_fd);
-			tar_type.writefunc = write_tar_no_buffer;
-			if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("backup_error=Error creating backup.");
-				return -1;
-			}
-			return 0;
-		}
 	} else {
 		// Not compressed or encrypted
 		current_archive_type = UNCOMPRESSED;
-		init_libtar_buffer(0, progress_pipe_fd);
+		init_libtar_buffer(0, tar_progress ? tar_progress->Bytes(thread_id) : NULL);
+		tar_type.closefunc = close;
 		if (part_settings->adbbackup) {
-			LOGINFO("Opening TW_ADB_BACKUP uncompressed stream\n");
+			LOGINFO("Opening TW_ADB_BACKUP uncompressed stream %u\n", thread_id);
 			tar_type.writefunc = write_tar_no_buffer;
-			output_fd = open(TW_ADB_BACKUP, O_WRONLY);
+			output_fd = open(twadb_stream_fifo(TW_ADB_BACKUP, thread_id).c_str(), O_WRONLY);
 			if(tar_fdopen(&t, output_fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
 				close(output_fd);
 				LOGERR("tar_fdopen failed\n");
@@ -1116,235 +1597,261 @@ int twrpTar::createTar() {
 		}
 		else {
 			tar_type.writefunc = write_tar;
+			tar_type.closefunc = twrpCompress_Close_Output;
 			if (tar_open(&t, charTarFile, &tar_type, O_WRONLY | O_CREAT | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) == -1) {
 				LOGERR("tar_open error opening '%s'\n", tarfn.c_str());
 				gui_err("backup_error=Error creating backup.");
 				return -1;
 			}
+			if (!Start_Output_Digest(tar_fd(t))) {
+				tar_close(t);
+				gui_err("backup_error=Error creating backup.");
+				return -1;
+			}
+			Start_Output_Index(tar_fd(t));
 		}
 	}
+	t->file_msg = twrpLog::File_Message;
 	return 0;
 }
 
 int twrpTar::openTar() {
 	char* charRootDir = (char*) tardir.c_str();
 	char* charTarFile = (char*) tarfn.c_str();
-	string Password;
-
-	if (current_archive_type == COMPRESSED_ENCRYPTED) {
-		LOGINFO("Opening encrypted and compressed backup...\n");
-		int i, pipes[4];
-		input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
-		if (input_fd < 0) {
-			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
-			return -1;
-		}
-
-		if (pipe(pipes) < 0) {
-			LOGINFO("Error creating first pipe\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			return -1;
-		}
-		if (pipe(pipes + 2) < 0) {
-			LOGINFO("Error creating second pipe\n");
-			gui_err("restore_error=Error during restore process.");
-			close(pipes[0]);
-			close(pipes[1]);
-			close(input_fd);
-			return -1;
-		}
-		oaes_pid = fork();
 
-		if (oaes_pid < 0) {
-			LOGINFO("pigz fork() failed\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			for (i = 0; i < 4; i++)
-				close(pipes[i]); // close all
-			return -1;
-		} else if (oaes_pid == 0) {
-			// openaes Child
-			close(pipes[0]); // Close pipes that are not used by this child
-			close(pipes[2]);
-			close(pipes[3]);
-			int stdinfd = fileno(stdin);
-			int stdoutfd = fileno(stdout);
-			close(stdinfd);
-			dup2(input_fd, stdinfd);
-			close(stdoutfd);
-			dup2(pipes[1], stdoutfd);
-			if (execlp("openaes", "openaes", "dec", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("restore_error=Error during restore process.");
-				close(input_fd);
-				close(pipes[1]);
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			pigz_pid = fork();
-
-			if (pigz_pid < 0) {
-				LOGINFO("openaes fork() failed\n");
-				gui_err("restore_error=Error during restore process.");
-				close(input_fd);
-				for (i = 0; i < 4; i++)
-					close(pipes[i]); // close all
-				return -1;
-			} else if (pigz_pid == 0) {
-				// pigz Child
-				close(pipes[1]); // Close pipes not used by this child
-				close(pipes[2]);
-				int stdinfd = fileno(stdin);
-				int stdoutfd = fileno(stdout);
-				close(stdinfd);
-				dup2(pipes[0], stdinfd);
-				close(stdoutfd);
-				dup2(pipes[3], stdoutfd);
-				if (execlp("pigz", "pigz", "-d", "-c", NULL) < 0) {
-					LOGINFO("execlp pigz ERROR!\n");
-					gui_err("restore_error=Error during restore process.");
-					close(input_fd);
-					close(pipes[0]);
-					close(pipes[3]);
-					_exit(-1);
-				}
-			} else {
-				// Parent
-				close(pipes[0]); // Close pipes not used by parent
-				close(pipes[1]);
-				close(pipes[3]);
-				fd = pipes[2];
-				if (tar_fdopen(&t, fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-					close(fd);
-					LOGINFO("tar_fdopen failed\n");
-					gui_err("restore_error=Error during restore process.");
-					return -1;
-				}
-			}
+	if (current_archive_type == COMPRESSED_ENCRYPTED || current_archive_type == ENCRYPTED) {
+		LOGINFO("Opening encrypted%s backup...\n", current_archive_type == COMPRESSED_ENCRYPTED ? " and compressed" : "");
+		if (part_settings->adbbackup) {
+			LOGINFO("opening TW_ADB_RESTORE encrypted stream %u\n", thread_id);
+			fd = open(twadb_stream_fifo(TW_ADB_RESTORE, thread_id).c_str(), O_RDONLY | O_LARGEFILE);
 		}
-	} else if (current_archive_type == ENCRYPTED) {
-		LOGINFO("Opening encrypted backup...\n");
-		int oaesfd[2];
-		input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
-		if (input_fd < 0) {
+		else
+			fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
+		if (fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
-
-		if (pipe(oaesfd) < 0) {
-			LOGINFO("Error creating pipe\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
+		// Decrypted in process, see Open_Compressed_Input()
+		if (Open_Compressed_Input(charRootDir) != 0)
 			return -1;
-		}
-
-		oaes_pid = fork();
-		if (oaes_pid < 0) {
-			LOGINFO("fork() failed\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			close(oaesfd[0]);
-			close(oaesfd[1]);
-			return -1;
-		} else if (oaes_pid == 0) {
-			// Child
-			close(oaesfd[0]); // Close unused pipe
-			int stdinfd = fileno(stdin);
-			close(stdinfd);   // close stdin
-			dup2(oaesfd[1], fileno(stdout)); // remap stdout
-			dup2(input_fd, stdinfd); // remap input fd to stdin
-			if (execlp("openaes", "openaes", "dec", "--key", password.c_str(), NULL) < 0) {
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("restore_error=Error during restore process.");
-				close(input_fd);
-				close(oaesfd[1]);
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(oaesfd[1]); // close parent output
-			fd = oaesfd[0];   // copy parent input
-			if (tar_fdopen(&t, fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("restore_error=Error during restore process.");
-				return -1;
-			}
-		}
-	} else if (current_archive_type == COMPRESSED) {
-		int pigzfd[2];
-
-		LOGINFO("Opening gzip compressed tar...\n");
+	} else if (current_archive_type == COMPRESSED || current_archive_type == COMPRESSED_ZSTD || current_archive_type == COMPRESSED_LZ4 || current_archive_type == CHUNKED) {
+		LOGINFO("Opening compressed tar type %i...\n", current_archive_type);
 		if (part_settings->adbbackup)  {
-			LOGINFO("opening TW_ADB_RESTORE compressed stream\n");
-			input_fd = open(TW_ADB_RESTORE, O_RDONLY | O_LARGEFILE);
+			LOGINFO("opening TW_ADB_RESTORE compressed stream %u\n", thread_id);
+			fd = open(twadb_stream_fifo(TW_ADB_RESTORE, thread_id).c_str(), O_RDONLY | O_LARGEFILE);
 		}
 		else
-			input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
+			fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
 
-		if (input_fd < 0) {
+		if (fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
 		}
-
-		if (pipe(pigzfd) < 0) {
-			LOGINFO("Error creating pipe\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			return -1;
-		}
-
-		pigz_pid = fork();
-		if (pigz_pid < 0) {
-			LOGINFO("fork() failed\n");
-			gui_err("restore_error=Error during restore process.");
-			close(input_fd);
-			close(pigzfd[0]);
-			close(pigzfd[1]);
+		if (Open_Compressed_Input(charRootDir) != 0)
 			return -1;
-		} else if (pigz_pid == 0) {
-			// Child
-			close(pigzfd[0]);
-			dup2(pigzfd[1], fileno(stdout)); // remap stdout
-			dup2(input_fd, fileno(stdin)); // remap input fd to stdin
-			if (execlp("pigz", "pigz", "-d", "-c", NULL) < 0) {
-				close(pigzfd[1]);
-				close(input_fd);
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("restore_error=Error during restore process.");
-				_exit(-1);
-			}
-		} else {
-			// Parent
-			close(pigzfd[1]); // close parent output
-			fd = pigzfd[0];   // copy parent input
-			if (tar_fdopen(&t, fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
-				close(fd);
-				LOGINFO("tar_fdopen failed\n");
-				gui_err("restore_error=Error during restore process.");
-				return -1;
-			}
-		}
 	} else  {
 		if (part_settings->adbbackup) {
-			LOGINFO("Opening TW_ADB_RESTORE uncompressed stream\n");
-			input_fd = open(TW_ADB_RESTORE, O_RDONLY);
-			if (tar_fdopen(&t, input_fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			LOGINFO("Opening TW_ADB_RESTORE uncompressed stream %u\n", thread_id);
+			input_fd = open(twadb_stream_fifo(TW_ADB_RESTORE, thread_id).c_str(), O_RDONLY);
+			if (tar_fdopen(&t, input_fd, charRootDir, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_RESTORE_FLAGS) != 0) {
 				LOGERR("Unable to open tar archive '%s'\n", charTarFile);
 				gui_err("restore_error=Error during restore process.");
 				return -1;
 			}
 		}
 		else {
-			if (tar_open(&t, charTarFile, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+			if (tar_open(&t, charTarFile, NULL, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_RESTORE_FLAGS) != 0) {
 				LOGERR("Unable to open tar archive '%s'\n", charTarFile);
 				gui_err("restore_error=Error during restore process.");
 				return -1;
 			}
 		}
 	}
+	t->file_msg = twrpLog::File_Message;
+	return 0;
+}
+
+int twrpTar::Open_Compressed_Output(char* charRootDir) {
+	twrpStreamWriter* writer = NULL;
+	unsigned threads = compression_threads ? compression_threads : twrpCompress_Default_Threads();
+	bool seekable = current_archive_type == COMPRESSED || current_archive_type == COMPRESSED_ZSTD || current_archive_type == COMPRESSED_LZ4;
+
+	if (current_archive_type == COMPRESSED_ENCRYPTED || current_archive_type == ENCRYPTED) {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+		twrpEncryptWriter* encrypt = new twrpEncryptWriter(fd, password, threads, legacy_encryption);
+		seekable = encrypt->Seekable();
+		if (!encrypt->Start())
+			delete encrypt;
+		else if (current_archive_type == ENCRYPTED)
+			writer = encrypt;
+		else if ((writer = twrpCompress_New_Writer(COMPRESSED, fd, compression_level, threads, encrypt)) == NULL)
+			delete encrypt;
+#endif
+	}
+#ifndef BUILD_TWRPTAR_MAIN
+	else if (current_archive_type == CHUNKED)
+		writer = twrpChunk_New_Writer(fd, twrpChunk_Store_Path(TWFunc::Get_Path(tarfn)));
+#endif
+	else
+		writer = twrpCompress_New_Writer(current_archive_type, fd, compression_level, threads);
+	if (writer == NULL || !twrpCompress_Attach_Writer(fd, writer)) {
+		delete writer;
+		close(fd);
+		LOGINFO("Unable to start compression\n");
+		gui_err("backup_error=Error creating backup.");
+		return -1;
+	}
+	if (!Start_Output_Digest(fd)) {
+		twrpCompress_Close_Writer(fd);
+		close(fd);
+		gui_err("backup_error=Error creating backup.");
+		return -1;
+	}
+	// openaes archives are decrypted from the start, their offsets are no use
+	if (seekable)
+		Start_Output_Index(fd);
+	init_libtar_no_buffer(tar_progress ? tar_progress->Bytes(thread_id) : NULL);
+	tar_type.writefunc = write_tar_compressed;
+	tar_type.closefunc = twrpCompress_Close_Writer; // fd itself is closed in closeTar()
+	if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_FLAGS) != 0) {
+		twrpCompress_Close_Writer(fd);
+		Free_Output_Digest();
+		Free_Output_Index();
+		close(fd);
+		LOGINFO("tar_fdopen failed\n");
+		gui_err("backup_error=Error creating backup.");
+		return -1;
+	}
+	return 0;
+}
+
+void twrpTar::Add_Stage_Time(twrpPipeStats *Stats, const char* Stage, twrpTarProgress_Time Time) {
+	twrpPipeStage* stage = Stats->Find(Stage);
+
+	// Only the time the stage worked, not what it waited for its neighbours
+	if (stage != NULL && stage->busy_usec > stage->starved_usec + stage->blocked_usec)
+		twrpTarProgress::Add_Time(Time, stage->busy_usec - stage->starved_usec - stage->blocked_usec);
+}
+
+bool twrpTar::Check_Archive_Digest() {
+#ifndef BUILD_TWRPTAR_MAIN
+	if (verify_digest && !part_settings->adbbackup) {
+		LOGINFO("Checking digest of '%s'\n", tarfn.c_str());
+		uint64_t start = twrpPipe_Now();
+		bool ret = twrpDigestDriver::Check_Restore_File_Digest(tarfn);
+		twrpTarProgress::Add_Time(TW_TAR_TIME_DIGEST, twrpPipe_Now() - start);
+		return ret;
+	}
+#endif
+	return true;
+}
+
+bool twrpTar::Start_Output_Digest(int out_fd) {
+	Free_Output_Digest();
+#ifndef BUILD_TWRPTAR_MAIN
+	if (!write_digest || part_settings->adbbackup)
+		return true;
+	output_digest = twrpDigestDriver::New_Backup_Digest();
+	if (!twrpCompress_Attach_Digest(out_fd, output_digest)) {
+		LOGINFO("Unable to digest '%s' while writing it\n", tarfn.c_str());
+		delete output_digest;
+		output_digest = NULL;
+		return false;
+	}
+	digest_fd = out_fd;
+#endif
+	return true;
+}
+
+void twrpTar::Start_Output_Index(int out_fd) {
+	Free_Output_Index();
+	if (!write_index || part_settings->adbbackup)
+		return;
+	output_index = new twrpTarIndex();
+	if (!twrpCompress_Attach_Index(out_fd, output_index)) {
+		// Restores of single paths still work without it, only slower
+		LOGINFO("Unable to index '%s'\n", tarfn.c_str());
+		delete output_index;
+		output_index = NULL;
+		return;
+	}
+	index_fd = out_fd;
+}
+
+void twrpTar::Free_Output_Index() {
+	if (output_index == NULL)
+		return;
+	twrpCompress_Detach_Index(index_fd);
+	delete output_index;
+	output_index = NULL;
+	index_fd = -1;
+}
+
+void twrpTar::Free_Output_Digest() {
+#ifndef BUILD_TWRPTAR_MAIN
+	if (output_digest == NULL)
+		return;
+	twrpCompress_Detach_Digest(digest_fd, output_digest);
+	delete output_digest;
+	output_digest = NULL;
+	digest_fd = -1;
+#endif
+}
+
+int twrpTar::Open_Compressed_Input(char* charRootDir) {
+	twrpStreamReader* reader = NULL;
+	twrpStreamReader* source = NULL;
+
+	if (current_archive_type == COMPRESSED_ENCRYPTED || current_archive_type == ENCRYPTED) {
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+		twrpPipeStage* consumer = Pipe_Stage(current_archive_type == ENCRYPTED ? "extract" : "decompress");
+		twrpDecryptReader* decrypt = new twrpDecryptReader(fd, password, pipe_threads, Pipe_Stage("decrypt"), consumer);
+		if (decrypt->Start())
+			source = decrypt;
+		else
+			delete decrypt;
+#endif
+		if (source == NULL) {
+			close(fd);
+			LOGINFO("Unable to start decryption\n");
+			gui_err("restore_error=Error during restore process.");
+			return -1;
+		}
+	}
+#ifndef BUILD_TWRPTAR_MAIN
+	if (current_archive_type == CHUNKED)
+		reader = twrpChunk_New_Reader(fd, twrpChunk_Store_Path(TWFunc::Get_Path(tarfn)));
+	else
+#endif
+	if (current_archive_type == ENCRYPTED)
+		reader = source;
+	else if ((reader = twrpCompress_New_Reader(current_archive_type == COMPRESSED_ENCRYPTED ? COMPRESSED : current_archive_type, fd, source)) == NULL)
+		delete source;
+	// Decompression gets its own thread, decryption already runs ahead on its workers
+	if (reader != NULL && pipe_stats != NULL && current_archive_type != ENCRYPTED) {
+		twrpReadAheadReader* ahead = new twrpReadAheadReader(reader, Pipe_Stage(current_archive_type == CHUNKED ? "read" : "decompress"), Pipe_Stage("extract"), PIPE_QUEUE_DEPTH);
+		if (ahead->Start()) {
+			reader = ahead;
+		} else {
+			delete ahead;
+			reader = NULL;
+		}
+	}
+	if (reader == NULL || !twrpCompress_Attach_Reader(fd, reader)) {
+		delete reader;
+		close(fd);
+		LOGINFO("Unable to start decompression\n");
+		gui_err("restore_error=Error during restore process.");
+		return -1;
+	}
+	tar_type.readfunc = twrpCompress_Read;
+	tar_type.closefunc = twrpCompress_Close_Reader;
+	if (tar_fdopen(&t, fd, charRootDir, &tar_type, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TWTAR_RESTORE_FLAGS) != 0) {
+		twrpCompress_Close_Reader(fd);
+		LOGINFO("tar_fdopen failed\n");
+		gui_err("restore_error=Error during restore process.");
+		return -1;
+	}
 	return 0;
 }
 
@@ -1395,6 +1902,10 @@ int twrpTar::closeTar() {
 		return -1;
 	}
 	if (current_archive_type > 0) {
+#ifndef BUILD_TWRPTAR_MAIN
+		if (output_digest)
+			twrpCompress_Detach_Digest(fd, output_digest);
+#endif
 		close(fd);
 		int status;
 		if (pigz_pid > 0 && TWFunc::Wait_For_Child(pigz_pid, &status, "pigz") != 0)
@@ -1416,9 +1927,21 @@ int twrpTar::closeTar() {
 		}
 #ifndef BUILD_TWRPTAR_MAIN
 		tw_set_default_metadata(tarfn.c_str());
+		if (output_digest && !twrpDigestDriver::Write_Digest_File(tarfn, output_digest)) {
+			gui_err("digest_error= * Digest Error!");
+			return -1;
+		}
+#endif
+		Free_Output_Digest();
+		if (output_index && output_index->Save(tarfn)) {
+#ifndef BUILD_TWRPTAR_MAIN
+			tw_set_default_metadata((tarfn + TW_TAR_INDEX_EXT).c_str());
 #endif
+		}
+		Free_Output_Index();
 	}
-	else {
+	else if (adb_streams <= 1) {
+		// Threaded backups end the file once every thread is done
 #ifndef BUILD_TWRPTAR_MAIN
 		if (!twadbbu::Write_TWEOF())
 			return -1;
@@ -1464,49 +1987,52 @@ int twrpTar::entryExists(string entry) {
 }
 
 unsigned long long twrpTar::get_size() {
+	unsigned long long total_restore_size = 0;
+
 	if (part_settings->adbbackup || TWFunc::Path_Exists(tarfn)) {
 		LOGINFO("Single archive\n");
-		return uncompressedSize(tarfn);
+		total_restore_size = uncompressedSize(tarfn);
 	} else {
 		LOGINFO("Multiple archives\n");
 		string temp;
 		char actual_filename[255];
 		int archive_count = 0;
-		unsigned long long total_restore_size = 0;
 
 		basefn = tarfn;
 		temp = basefn + "%i%02i";
 		tarfn += "000";
 		thread_id = 0;
 		sprintf(actual_filename, temp.c_str(), thread_id, archive_count);
-		if (!part_settings->adbbackup) {
-			if (!TWFunc::Path_Exists(actual_filename)) {
-				LOGERR("Unable to locate '%s' or '%s'\n", basefn.c_str(), tarfn.c_str());
-				return 0;
-			}
-			for (int i = 0; i < 9; i++) {
-				archive_count = 0;
+		if (!TWFunc::Path_Exists(actual_filename)) {
+			LOGERR("Unable to locate '%s' or '%s'\n", basefn.c_str(), tarfn.c_str());
+			return 0;
+		}
+		for (int i = 0; i < 9; i++) {
+			archive_count = 0;
+			sprintf(actual_filename, temp.c_str(), i, archive_count);
+			while (TWFunc::Path_Exists(actual_filename)) {
+				total_restore_size += uncompressedSize(actual_filename);
+				archive_count++;
+				if (archive_count > 99)
+					break;
 				sprintf(actual_filename, temp.c_str(), i, archive_count);
-				while (TWFunc::Path_Exists(actual_filename)) {
-					total_restore_size += uncompressedSize(actual_filename);
-					archive_count++;
-					if (archive_count > 99)
-						break;
-					sprintf(actual_filename, temp.c_str(), i, archive_count);
-				}
 			}
-	#ifndef BUILD_TWRPTAR_MAIN
-	        if (!part_settings->adbbackup) {
-			InfoManager backup_info(tarfn + ".info");
-			backup_info.SetValue("backup_size", total_restore_size);
-			backup_info.SetValue("backup_type", current_archive_type);
-			backup_info.SaveValues();
-	        }
-	#endif //ndef BUILD_TWRPTAR_MAIN
 		}
-		return total_restore_size;
 	}
-	return 0;
+#ifndef BUILD_TWRPTAR_MAIN
+	// The backup predates the sizes in the .info files, keep the measured
+	// size there so the next restore reads it. Encrypted archives are left
+	// alone, a wrong password gives the size of the encrypted file.
+	if (!part_settings->adbbackup && !backup_folder.empty() && total_restore_size != 0 &&
+			current_archive_type != ENCRYPTED && current_archive_type != COMPRESSED_ENCRYPTED) {
+		InfoManager backup_info(backup_folder + "/" + partition_name + ".info");
+		backup_info.LoadValues();
+		backup_info.SetValue("backup_size", total_restore_size);
+		backup_info.SetValue("backup_type", current_archive_type);
+		backup_info.SaveValues();
+	}
+#endif //ndef BUILD_TWRPTAR_MAIN
+	return total_restore_size;
 }
 
 unsigned long long twrpTar::uncompressedSize(string filename) {
@@ -1534,6 +2060,13 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 			if (split.size() > 4)
 				total_size = atoi(split[5].c_str());
 		}
+	} else if (current_archive_type == COMPRESSED_ZSTD || current_archive_type == COMPRESSED_LZ4) {
+		// No cheap way to read the original size, the .info file normally has it
+		total_size = TWFunc::Get_File_Size(filename);
+#ifndef BUILD_TWRPTAR_MAIN
+	} else if (current_archive_type == CHUNKED) {
+		total_size = twrpChunk_Index_Size(filename);
+#endif
 	} else if (current_archive_type == COMPRESSED_ENCRYPTED) {
 		// File is encrypted and may be compressed
 		int ret = TWFunc::Try_Decrypting_File(filename, password);
@@ -1543,6 +2076,11 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 		} else if (ret == 1) {
 			LOGERR("Decrypted file is not in tar format.\n");
 			total_size = TWFunc::Get_File_Size(filename);
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+		} else if (ret == 3 && twrpGcm_Is_Archive(filename)) {
+			// openaes dec can't read AES-GCM archives, the .info file normally has the size
+			total_size = TWFunc::Get_File_Size(filename);
+#endif
 		} else if (ret == 3) {
 			Command = "openaes dec --key \"" + password + "\" --in '" + filename + "' | pigz -l";
 			/* if we set Command = "pigz -l " + tarfn + " | sed '1d' | cut -f5 -d' '";
@@ -1569,9 +2107,22 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 }
 
 extern "C" ssize_t write_tar(int fd, const void *buffer, size_t size) {
-	return (ssize_t) write_libtar_buffer(fd, buffer, size);
+	ssize_t ret = (ssize_t) write_libtar_buffer(fd, buffer, size);
+	// Buffered data reaches the file in the same order it is passed in here
+	if (ret == (ssize_t) size) {
+		twrpCompress_Digest_Output(fd, buffer, size);
+		twrpCompress_Index_Input(fd, size);
+	}
+	return ret;
 }
 
 extern "C" ssize_t write_tar_no_buffer(int fd, const void *buffer, size_t size) {
 	return (ssize_t) write_libtar_no_buffer(fd, buffer, size);
 }
+
+extern "C" ssize_t write_tar_compressed(int fd, const void *buffer, size_t size) {
+	ssize_t ret = twrpCompress_Write(fd, buffer, size);
+	if (ret > 0)
+		report_libtar_progress(ret);
+	return ret;
+}
@@ -21,5 +21,6 @@
 
 ssize_t write_tar(int fd, const void *buffer, size_t size);
 ssize_t write_tar_no_buffer(int fd, const void *buffer, size_t size);
+ssize_t write_tar_compressed(int fd, const void *buffer, size_t size);
 
 #endif  // _TWRPTAR_HEADER
@@ -24,19 +24,42 @@ extern "C" {
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
 #include <fstream>
 #include <string>
 #include <vector>
 #include "exclude.hpp"
 #include "progresstracking.hpp"
+#include "twrpTarProgress.hpp"
 #include "partitions.hpp"
 #include "twrp-functions.hpp"
+#include "twrpScan.hpp"
+#include "twrpManifest.hpp"
+#include "twrpTarIndex.hpp"
 
 using namespace std;
 
+// Threaded backups use at most this many tar threads
+#define TW_MAX_TAR_THREADS 8
+// and give each thread at least this much data
+#define TW_MIN_THREAD_SIZE (128ULL * 1024 * 1024)
+
+// Order the files of each archive are read in, see twrpTar::read_order
+#define TW_READ_ORDER_SCAN 0                                                    // Directory order of the scan
+#define TW_READ_ORDER_INODE 1                                                   // Inode number
+#define TW_READ_ORDER_EXTENT 2                                                  // Physical block of the first extent, by FIEMAP
+
+class twrpBackupDigest;
+class twrpPipeStats;
+struct twrpPipeStage;
+
+// One item of a tar work list. The path, type, size and inode are read
+// from the scan that the lists of a backup share, so an item takes 8 bytes
+// however long its path is.
 struct TarListStruct {
-	std::string fn;
-	unsigned thread_id;
+	uint32_t scan_index;                                                            // Index of the item in the scan
+	uint16_t thread_id;
+	bool is_dir;
 };
 
 struct thread_data_struct {
@@ -50,6 +73,7 @@ public:
 	virtual ~twrpTar();
 	int createTarFork(pid_t *tar_fork_pid);
 	int extractTarFork();
+	int extractPaths(const std::vector<string>& Paths, unsigned long long *restored); // Restores only the items that are or are inside Paths
 	void setfn(string fn);
 	void setdir(string dir);
 	void setsize(unsigned long long backup_size);
@@ -59,15 +83,31 @@ public:
 
 public:
 	int use_encryption;
+	bool legacy_encryption;                                                         // Encrypt into openaes chunks instead of AES-GCM ones
 	int userdata_encryption;
 	int use_compression;
+	int use_dedup;                                                                  // Store the archive in the shared chunk store, ignores use_compression
+	Archive_Type compression_type;                                                  // COMPRESSED, COMPRESSED_ZSTD or COMPRESSED_LZ4
+	int compression_level;                                                          // 0 for the codec default
 	int split_archives;
+	unsigned long long max_archive_size;                                            // Split archives are cut at this size, MAX_ARCHIVE_SIZE by default
+	int backup_threads;                                                             // Tar threads for a backup, 0 for one per core
+	unsigned io_lanes;                                                              // Lanes of the disks read and written, caps the automatic tar threads and the extract writers, 0 for no cap
+	int read_order;                                                                 // TW_READ_ORDER_*, files are archived after all folders and links in this order
 	string backup_name;
-	int progress_pipe_fd;
 	string partition_name;
 	string backup_folder;
+	unsigned long long restore_file_count;                                          // Files in the archives being restored from the .info, 0 if unknown
 	PartitionSettings *part_settings;
 	TWExclude *backup_exclusions;
+	twrpScan *backup_scan;                                                          // Scan of the backup folder to reuse, may be NULL
+	bool write_manifest;                                                            // Write partition_name.manifest so later backups can be incremental
+	string incremental_base;                                                        // Backup folder of the earlier backup to compare against, empty for a full one
+	bool write_digest;                                                              // Write the digest file of each archive while it is written
+	bool verify_digest;                                                             // Check the digest of each archive right before it is extracted
+	bool verify_only;                                                               // Read every header and payload of the archives without extracting anything
+	bool write_index;                                                               // Write a seek index next to each archive for restoring single paths
+	unsigned adb_streams;                                                           // adb streams the backup is split over, one per tar thread
 
 private:
 	int extract();
@@ -78,14 +118,34 @@ private:
 	int closeTar();
 	int removeEOT(string tarFile);
 	int extractTar();
+	int Extract_All(char* prefix);                                                  // tar_extract_all() that finishes regular files on a writer pool
+	int Extract_Matching();                                                         // Streams the open archive and extracts restore_paths
+	int Verify_Entries();                                                           // Streams the open archive through the pipeline and drops the payloads
+	twrpPipeStage* Pipe_Stage(const string& name);                                  // NULL unless a restore is timing its stages
+	int Extract_Indexed(twrpTarIndex *Index);                                       // Seeks to each item of restore_paths in tarfn
+	int Open_Indexed_Input(const twrpTarIndexFrame& Frame, uint64_t offset);
+	bool Skip_Indexed_Input(uint64_t size);
 	string Strip_Root_Dir(string Path);
 	int openTar();
-	int Generate_TarList(string Path, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id);
+	int Open_Compressed_Output(char* charRootDir);
+	int Open_Compressed_Input(char* charRootDir);
+	bool Check_Archive_Digest();                                                    // true if verify_digest is off or tarfn matches its digest
+	static void Add_Stage_Time(twrpPipeStats *Stats, const char* Stage, twrpTarProgress_Time Time); // Work time of a restore stage for the performance report
+	bool Start_Output_Digest(int out_fd);                                           // Digests everything written to out_fd if write_digest is set
+	void Free_Output_Digest();
+	void Start_Output_Index(int out_fd);                                            // Indexes the archive written to out_fd if write_index is set
+	void Free_Output_Index();
+	unsigned long long Generate_TarList(const std::vector<twrpScanEntry>& Entries, size_t first, size_t last, std::vector<TarListStruct> *TarList, unsigned thread_id, unsigned long long *list_size); // Add Entries[first, last) to TarList, returns the number of files
+	bool Prepare_Manifest(const std::vector<twrpScanEntry>& Entries, twrpManifest *New_Manifest, twrpManifest *Base); // Loads the base and marks the unchanged files
+	bool Save_Manifest(twrpManifest *New_Manifest, twrpManifest *Base);           // Writes the manifest and the list of deleted paths
+	void Balance_TarList(std::vector<TarListStruct> *TarList, unsigned first_thread, unsigned thread_count); // Spread the files evenly over thread_count threads
+	void Sort_TarList(std::vector<TarListStruct> *TarList);                         // Move the files behind the folders and links in read_order
 	static void* createList(void *cookie);
 	static void* extractMulti(void *cookie);
 	int tarList(std::vector<TarListStruct> *TarList, unsigned thread_id);
 	unsigned long long uncompressedSize(string filename);
 	static void Signal_Kill(int signum);
+	unsigned Backup_Thread_Count();
 
 	enum Archive_Type current_archive_type;
 	unsigned long long Archive_Current_Size;
@@ -95,9 +155,14 @@ private:
 	tartype_t tar_type; // Only used in createTar() but variable must persist while the tar is open
 	int fd;
 	int input_fd;                                                                   // this stores the fd for libtar to write to
+	twrpBackupDigest* output_digest;                                                // Digest of the archive being written, NULL if none
+	int digest_fd;                                                                  // fd that output_digest is attached to
+	twrpTarIndex* output_index;                                                     // Index of the archive being written, NULL if none
+	int index_fd;
 	pid_t pigz_pid;
 	pid_t oaes_pid;
 	unsigned long long file_count;
+	twrpTarProgress *tar_progress;                                                  // Progress block shared with the GUI process, NULL outside a fork
 
 	string tardir;
 	string tarfn;
@@ -105,6 +170,15 @@ private:
 	string password;
 
 	std::vector<TarListStruct> *ItemList;
+	const std::vector<twrpScanEntry> *scan_entries;                                 // Items of the scan that ItemList indexes
 	int output_fd;                                                                  // this stores the output fd that gzip will read from
 	unsigned thread_id;
+	unsigned compression_threads;                                                   // Compression workers per archive, 0 for the default
+	twrpManifest *manifest;                                                         // Hashes of the archived files are stored here, may be NULL
+	std::vector<bool> unchanged;                                                    // Scan items an incremental backup leaves out
+	const std::vector<string> *restore_paths;                                       // Only these are extracted, NULL for everything
+	unsigned long long restored_count;
+	twrpPipeStats *pipe_stats;                                                      // Stage timing of the archive being extracted
+	unsigned pipe_threads;                                                          // Decrypt threads per archive
+	unsigned write_threads;                                                         // Extract writer threads per archive
 };
@@ -0,0 +1,165 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "twrpTarIndex.hpp"
+#include "twrpManifest.hpp"
+#include "twcommon.h"
+
+#define TW_TAR_INDEX_HEADER "twrp-tarindex 1"
+
+twrpTarIndex::twrpTarIndex() {
+	input_size = 0;
+	entry_start = 0;
+}
+
+void twrpTarIndex::Add_Frame(uint64_t uncompressed, uint64_t compressed) {
+	twrpTarIndexFrame Frame;
+
+	Frame.uncompressed = uncompressed;
+	Frame.compressed = compressed;
+	frames.push_back(Frame);
+}
+
+void twrpTarIndex::End_Entry(const std::string& fn, char type) {
+	twrpTarIndexEntry Entry;
+
+	Entry.start = entry_start;
+	Entry.end = input_size;
+	Entry.type = type;
+	Entry.fn = fn;
+	entries.push_back(Entry);
+}
+
+bool twrpTarIndex::Save(const std::string& Archive) {
+	std::string Path = Archive + TW_TAR_INDEX_EXT;
+	FILE* out;
+	size_t i;
+
+	out = fopen(Path.c_str(), "w");
+	if (out == NULL) {
+		LOGINFO("Unable to create '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	fprintf(out, "%s\n", TW_TAR_INDEX_HEADER);
+	for (i = 0; i < frames.size(); i++)
+		fprintf(out, "z %llu %llu\n", (unsigned long long)frames[i].uncompressed, (unsigned long long)frames[i].compressed);
+	for (i = 0; i < entries.size(); i++)
+		fprintf(out, "%c %llu %llu %s\n", entries[i].type, (unsigned long long)entries[i].start, (unsigned long long)entries[i].end,
+			twrpManifest::Escape(entries[i].fn).c_str());
+	if (fclose(out) != 0) {
+		LOGINFO("Error writing '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	LOGINFO("Indexed %zu items in %zu frames for '%s'\n", entries.size(), frames.size(), Archive.c_str());
+	return true;
+}
+
+bool twrpTarIndex::Load(const std::string& Archive) {
+	std::string Path = Archive + TW_TAR_INDEX_EXT;
+	FILE* in;
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t r;
+	bool ret = true;
+
+	frames.clear();
+	entries.clear();
+	in = fopen(Path.c_str(), "r");
+	if (in == NULL)
+		return false;
+	r = getline(&line, &len, in);
+	if (r < 0 || strncmp(line, TW_TAR_INDEX_HEADER, strlen(TW_TAR_INDEX_HEADER)) != 0) {
+		LOGINFO("'%s' is not a tar index\n", Path.c_str());
+		ret = false;
+	}
+	while (ret && (r = getline(&line, &len, in)) > 0) {
+		unsigned long long a, b;
+		char type;
+		int path_pos = 0;
+
+		if (line[r - 1] == '\n')
+			line[--r] = 0;
+		if (line[0] == 'z' && sscanf(line, "z %llu %llu", &a, &b) == 2) {
+			Add_Frame(a, b);
+		} else if (sscanf(line, "%c %llu %llu %n", &type, &a, &b, &path_pos) == 3 && path_pos > 0 && a <= b) {
+			twrpTarIndexEntry Entry;
+			Entry.start = a;
+			Entry.end = b;
+			Entry.type = type;
+			Entry.fn = twrpManifest::Unescape(line + path_pos);
+			entries.push_back(Entry);
+		} else {
+			LOGINFO("Bad line in tar index '%s': '%s'\n", Path.c_str(), line);
+			ret = false;
+		}
+	}
+	free(line);
+	fclose(in);
+	if (!ret) {
+		frames.clear();
+		entries.clear();
+	}
+	return ret;
+}
+
+bool twrpTarIndex::Path_Matches(const std::string& fn, const std::vector<std::string>& Paths) {
+	size_t i;
+
+	for (i = 0; i < Paths.size(); i++) {
+		std::string Path = Paths[i];
+		while (Path.size() > 1 && Path[Path.size() - 1] == '/')
+			Path.resize(Path.size() - 1);
+		if (Path == "/" || fn == Path)
+			return true;
+		if (fn.size() > Path.size() && fn.compare(0, Path.size(), Path) == 0 && fn[Path.size()] == '/')
+			return true;
+	}
+	return false;
+}
+
+void twrpTarIndex::Find(const std::vector<std::string>& Paths, std::vector<twrpTarIndexEntry> *Found) {
+	size_t i;
+
+	for (i = 0; i < entries.size(); i++) {
+		if (Path_Matches(entries[i].fn, Paths))
+			Found->push_back(entries[i]);
+	}
+}
+
+twrpTarIndexFrame twrpTarIndex::Frame_For(uint64_t offset) {
+	twrpTarIndexFrame Frame = {0, 0};
+	size_t lo = 0, hi = frames.size();
+
+	// Frames are added in stream order
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (frames[mid].uncompressed <= offset) {
+			Frame = frames[mid];
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return Frame;
+}
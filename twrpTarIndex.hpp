@@ -0,0 +1,71 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_TAR_INDEX_HPP
+#define __TWRP_TAR_INDEX_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Seek index for a tar archive, stored next to it as <archive>.twidx. It
+// lists where every item starts and ends in the uncompressed tar stream.
+// Compressed archives are written as a series of independent frames (gzip
+// members, zstd or lz4 frames) and the index lists the uncompressed and
+// compressed offset of each one, so a restore of a few paths decompresses
+// from the nearest frame instead of from the start of the archive.
+#define TW_TAR_INDEX_EXT ".twidx"
+#define TW_TAR_INDEX_FRAME (4 * 1024 * 1024)     // Uncompressed bytes per frame
+
+struct twrpTarIndexEntry {
+	uint64_t start;                           // First header of the item in the tar stream
+	uint64_t end;                             // Offset right after its data
+	char type;                                // 'd', 'f', 'l' or 'o'
+	std::string fn;                           // Full path when it was backed up
+};
+
+struct twrpTarIndexFrame {
+	uint64_t uncompressed;
+	uint64_t compressed;
+};
+
+class twrpTarIndex {
+public:
+	twrpTarIndex();
+
+	// Used while the archive is written, only by the thread writing it
+	void Add_Input(size_t size) { input_size += size; }                     // Counts the uncompressed tar stream
+	void Add_Frame(uint64_t uncompressed, uint64_t compressed);
+	void Begin_Entry() { entry_start = input_size; }
+	void End_Entry(const std::string& fn, char type);
+	bool Save(const std::string& Archive);                                   // Writes Archive + TW_TAR_INDEX_EXT
+
+	bool Load(const std::string& Archive);                                   // false if the archive has no usable index
+	void Find(const std::vector<std::string>& Paths, std::vector<twrpTarIndexEntry> *Found); // Items that are or are inside Paths, in archive order
+	twrpTarIndexFrame Frame_For(uint64_t offset);                            // Last frame that starts at or before offset
+
+	static bool Path_Matches(const std::string& fn, const std::vector<std::string>& Paths);
+
+private:
+	std::vector<twrpTarIndexFrame> frames;
+	std::vector<twrpTarIndexEntry> entries;
+	uint64_t input_size;
+	uint64_t entry_start;
+};
+
+#endif // __TWRP_TAR_INDEX_HPP
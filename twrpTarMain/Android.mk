@@ -5,11 +5,25 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
+	twrpTarBench.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpTarProgress.cpp \
+	../twrpCompress.cpp \
+	../twrpScan.cpp \
+	../twrpManifest.cpp \
+	../twrpTarIndex.cpp \
+	../twrpRestorePipeline.cpp \
+	../twrpEncrypt.cpp \
+	../twrpThermal.cpp \
+	../twrpMemBudget.cpp \
+	../twrpDigest/twrpDigest.cpp \
+	../twrpDigest/twrpMD5.cpp \
+	../twrpDigest/digest/md5/md5.c \
 	../tarWrite.c \
 	../exclude.cpp \
 	../progresstracking.cpp \
+	../twrpLog.cpp \
 	../gui/twmsg.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
 
@@ -32,6 +46,22 @@ ifeq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
     LOCAL_CFLAGS += -DTW_EXCLUDE_ENCRYPTED_BACKUPS
 else
 	LOCAL_STATIC_LIBRARIES += libopenaes_static
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 24; echo $$?),0)
+	LOCAL_CFLAGS += -DTW_NO_AES_LIBRARY
+else
+	LOCAL_C_INCLUDES += external/boringssl/include
+	LOCAL_STATIC_LIBRARIES += libcrypto_static
+endif
+endif
+ifneq ($(wildcard external/zstd/lib/zstd.h),)
+    LOCAL_CFLAGS += -DTW_INCLUDE_ZSTD
+    LOCAL_C_INCLUDES += external/zstd/lib
+    LOCAL_STATIC_LIBRARIES += libzstd
+endif
+ifneq ($(wildcard external/lz4/lib/lz4frame.h),)
+    LOCAL_CFLAGS += -DTW_INCLUDE_LZ4
+    LOCAL_C_INCLUDES += external/lz4/lib
+    LOCAL_STATIC_LIBRARIES += liblz4
 endif
 
 LOCAL_MODULE:= twrpTar_static
@@ -47,11 +77,25 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
+	twrpTarBench.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpTarProgress.cpp \
+	../twrpCompress.cpp \
+	../twrpScan.cpp \
+	../twrpManifest.cpp \
+	../twrpTarIndex.cpp \
+	../twrpRestorePipeline.cpp \
+	../twrpEncrypt.cpp \
+	../twrpThermal.cpp \
+	../twrpMemBudget.cpp \
+	../twrpDigest/twrpDigest.cpp \
+	../twrpDigest/twrpMD5.cpp \
+	../twrpDigest/digest/md5/md5.c \
 	../tarWrite.c \
 	../exclude.cpp \
 	../progresstracking.cpp \
+	../twrpLog.cpp \
 	../gui/twmsg.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
 
@@ -73,6 +117,22 @@ ifeq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
     LOCAL_CFLAGS += -DTW_EXCLUDE_ENCRYPTED_BACKUPS
 else
 	LOCAL_SHARED_LIBRARIES += libopenaes
+ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 24; echo $$?),0)
+	LOCAL_CFLAGS += -DTW_NO_AES_LIBRARY
+else
+	LOCAL_C_INCLUDES += external/boringssl/include
+	LOCAL_SHARED_LIBRARIES += libcrypto
+endif
+endif
+ifneq ($(wildcard external/zstd/lib/zstd.h),)
+    LOCAL_CFLAGS += -DTW_INCLUDE_ZSTD
+    LOCAL_C_INCLUDES += external/zstd/lib
+    LOCAL_SHARED_LIBRARIES += libzstd
+endif
+ifneq ($(wildcard external/lz4/lib/lz4frame.h),)
+    LOCAL_CFLAGS += -DTW_INCLUDE_LZ4
+    LOCAL_C_INCLUDES += external/lz4/lib
+    LOCAL_SHARED_LIBRARIES += liblz4
 endif
 
 LOCAL_MODULE:= twrpTar
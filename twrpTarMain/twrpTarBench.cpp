@@ -0,0 +1,625 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "twrpTarBench.hpp"
+#include "../twrpTar.hpp"
+#include "../twrpCompress.hpp"
+#include "../twrpScan.hpp"
+#include "../twrpRestorePipeline.hpp"
+#include "../twrpEncrypt.hpp"
+#include "../twrpDigest/twrpMD5.hpp"
+#include "../exclude.hpp"
+#include "../progresstracking.hpp"
+
+#define BENCH_IO_SIZE (1024 * 1024)                         // Same size as the backup writes
+#define BENCH_SAMPLE_MAX (256ULL * 1024 * 1024)             // Archive data kept in memory for the stage runs
+#define BENCH_DEFAULT_FILES 2000
+#define BENCH_DEFAULT_SIZE (256ULL * 1024 * 1024)
+#define BENCH_SMALL_FILE_MAX (64 * 1024)
+#define BENCH_FOLDERS 32
+
+class twrpBenchTimer {
+public:
+	twrpBenchTimer() { Start(); }
+	void Start();
+	void Report(const char* stage, const std::string& detail, unsigned long long bytes, unsigned long long files);
+
+private:
+	static double Cpu_Time();                                      // This process and the tar children it waited for
+
+	double start_wall;
+	double start_cpu;
+};
+
+static std::vector<unsigned char> sample;                          // Start of the uncompressed archive
+static unsigned long long archived;
+static uint32_t rng_state = 1;
+
+static double Now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+double twrpBenchTimer::Cpu_Time() {
+	struct rusage self, children;
+
+	getrusage(RUSAGE_SELF, &self);
+	getrusage(RUSAGE_CHILDREN, &children);
+	return self.ru_utime.tv_sec + self.ru_stime.tv_sec + children.ru_utime.tv_sec + children.ru_stime.tv_sec
+		+ (self.ru_utime.tv_usec + self.ru_stime.tv_usec + children.ru_utime.tv_usec + children.ru_stime.tv_usec) / 1000000.0;
+}
+
+void twrpBenchTimer::Start() {
+	start_wall = Now();
+	start_cpu = Cpu_Time();
+}
+
+void twrpBenchTimer::Report(const char* stage, const std::string& detail, unsigned long long bytes, unsigned long long files) {
+	double wall = Now() - start_wall, cpu = Cpu_Time() - start_cpu;
+
+	if (wall <= 0)
+		wall = 0.000001;
+	printf("%-8s %-32s %9.1f MB/s", stage, detail.c_str(), bytes / 1048576.0 / wall);
+	if (files > 0)
+		printf(" %9.0f files/s", files / wall);
+	else
+		printf(" %9s files/s", "-");
+	printf(" %8.2fs cpu %8.2fs wall\n", cpu, wall);
+}
+
+static uint32_t Random() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static unsigned Parse_List(const char* list, std::vector<std::string> *Items) {
+	std::string item;
+
+	for (const char* p = list; ; p++) {
+		if (*p == ',' || *p == '\0') {
+			if (!item.empty())
+				Items->push_back(item);
+			item.clear();
+			if (*p == '\0')
+				break;
+		} else {
+			item += *p;
+		}
+	}
+	return Items->size();
+}
+
+static const char* Codec_Name(Archive_Type type) {
+	switch (type) {
+		case COMPRESSED:
+			return "gzip";
+		case COMPRESSED_ZSTD:
+			return "zstd";
+		case COMPRESSED_LZ4:
+			return "lz4";
+		default:
+			return "none";
+	}
+}
+
+static int Remove_Item(const char* path, const struct stat* sb, int flag, struct FTW* ftwbuf) {
+	return remove(path);
+}
+
+static void Remove_Tree(const std::string& Path) {
+	if (access(Path.c_str(), F_OK) == 0)
+		nftw(Path.c_str(), Remove_Item, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+static bool Make_Dir(const std::string& Path) {
+	std::vector<char> dir(Path.begin(), Path.end());
+
+	dir.push_back('\0');
+	if (mkdirhier(&dir[0]) == -1) {
+		printf("Unable to create '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+// The measured runs should read from storage, not from the previous run's cache
+static void Drop_Caches() {
+	int fd;
+
+	sync();
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd >= 0) {
+		write(fd, "3", 1);
+		close(fd);
+	}
+}
+
+static bool Write_File(const std::string& Path, unsigned long long size, std::vector<unsigned char> *buf) {
+	int fd = open(Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	unsigned long long left = size;
+
+	if (fd < 0) {
+		printf("Unable to create '%s': %s\n", Path.c_str(), strerror(errno));
+		return false;
+	}
+	while (left > 0) {
+		size_t len = left < buf->size() ? left : buf->size(), i;
+		// Every other 4 KiB is random, so the tree compresses about as well as app data
+		for (i = 0; i < len; i += 4096) {
+			size_t end = i + 4096 < len ? i + 4096 : len;
+			bool noise = Random() & 1;
+			for (size_t j = i; j < end; j++)
+				(*buf)[j] = noise ? (unsigned char) Random() : (unsigned char) ("twrp benchmark "[j % 15]);
+		}
+		if (write(fd, buf->data(), len) != (ssize_t) len) {
+			printf("Unable to write '%s': %s\n", Path.c_str(), strerror(errno));
+			close(fd);
+			return false;
+		}
+		left -= len;
+	}
+	close(fd);
+	return true;
+}
+
+// Mostly small files with a few large ones holding the rest of the size,
+// similar to a data partition
+static bool Make_Tree(const std::string& Path, unsigned files, unsigned long long size) {
+	std::vector<unsigned char> buf(BENCH_IO_SIZE);
+	unsigned small_files = files - files / 10, i;
+	unsigned long long small_size = 0, large_size = 0;
+	char name[64];
+
+	printf("Creating %u files, %llu MB in '%s'...\n", files, size / 1048576, Path.c_str());
+	for (i = 0; i < BENCH_FOLDERS; i++) {
+		snprintf(name, sizeof(name), "/folder%02u", i);
+		if (!Make_Dir(Path + name))
+			return false;
+	}
+	for (i = 0; i < files; i++) {
+		unsigned long long file_size;
+		if (i < small_files) {
+			file_size = 512 + Random() % BENCH_SMALL_FILE_MAX;
+			small_size += file_size;
+		} else {
+			if (i == small_files && size > small_size)
+				large_size = (size - small_size) / (files - small_files);
+			file_size = large_size;
+		}
+		snprintf(name, sizeof(name), "/folder%02u/file%05u", i % BENCH_FOLDERS, i);
+		if (!Write_File(Path + name, file_size, &buf))
+			return false;
+	}
+	sync();
+	return true;
+}
+
+static ssize_t Sample_Write(int fd, const void* buf, size_t size) {
+	if (sample.size() < BENCH_SAMPLE_MAX) {
+		size_t keep = BENCH_SAMPLE_MAX - sample.size() < size ? BENCH_SAMPLE_MAX - sample.size() : size;
+		sample.insert(sample.end(), (const unsigned char*) buf, (const unsigned char*) buf + keep);
+	}
+	archived += size;
+	return size;
+}
+
+static bool Run_Scan(const twrpTarBenchOptions& Options, TWExclude *exclude, twrpScan *scan) {
+	char detail[64];
+	size_t i;
+
+	for (i = 0; i < Options.threads.size(); i++) {
+		twrpScan run;
+		Drop_Caches();
+		twrpBenchTimer timer;
+		if (!run.Scan(Options.tree, exclude, Options.threads[i])) {
+			printf("Unable to scan '%s'\n", Options.tree.c_str());
+			return false;
+		}
+		snprintf(detail, sizeof(detail), "%u threads", Options.threads[i]);
+		timer.Report("scan", detail, run.Get_Size(), run.Get_File_Count());
+	}
+	return scan->Scan(Options.tree, exclude);
+}
+
+// libtar alone, the archive is kept in memory for the later stages
+static bool Run_Archive(twrpScan *scan) {
+	const std::vector<twrpScanEntry>& Entries = scan->Get_Entries();
+	tartype_t type = { (openfunc_t) open, close, read, Sample_Write };
+	TAR* t;
+	size_t i;
+
+	sample.clear();
+	archived = 0;
+	int fd = open("/dev/null", O_WRONLY);
+	if (fd < 0 || tar_fdopen(&t, fd, (char*) "bench", &type, O_WRONLY | O_CREAT, 0644, TAR_GNU | TAR_STORE_SELINUX | TAR_STORE_POSIX_CAP) != 0) {
+		printf("Unable to start the archive\n");
+		return false;
+	}
+	Drop_Caches();
+	twrpBenchTimer timer;
+	for (i = 0; i < Entries.size(); i++) {
+		if (tar_append_file(t, (char*) Entries[i].fn.c_str(), NULL) != 0) {
+			printf("Unable to archive '%s': %s\n", Entries[i].fn.c_str(), strerror(errno));
+			tar_close(t);
+			return false;
+		}
+	}
+	tar_append_eof(t);
+	tar_close(t);
+	timer.Report("archive", "libtar, 1 thread", archived, scan->Get_File_Count());
+	return true;
+}
+
+static void Run_Compress(const twrpTarBenchOptions& Options) {
+	char detail[64];
+	size_t i, j, pos;
+
+	for (i = 0; i < Options.codecs.size(); i++) {
+		if (Options.codecs[i] == UNCOMPRESSED)
+			continue;
+		for (j = 0; j < Options.threads.size(); j++) {
+			int fd = open("/dev/null", O_WRONLY);
+			twrpStreamWriter* writer = twrpCompress_New_Writer(Options.codecs[i], fd, 0, Options.threads[j]);
+			if (writer == NULL) {
+				close(fd);
+				continue;
+			}
+			twrpBenchTimer timer;
+			for (pos = 0; pos < sample.size(); pos += BENCH_IO_SIZE)
+				writer->Write(&sample[pos], sample.size() - pos < BENCH_IO_SIZE ? sample.size() - pos : BENCH_IO_SIZE);
+			writer->Finish();
+			snprintf(detail, sizeof(detail), "%s, %u threads", Codec_Name(Options.codecs[i]), Options.threads[j]);
+			timer.Report("compress", detail, sample.size(), 0);
+			delete writer;
+			close(fd);
+		}
+	}
+}
+
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+static void Run_Encrypt(const twrpTarBenchOptions& Options) {
+	std::string password = Options.password.empty() ? "twrpbench" : Options.password;
+	char detail[64];
+	size_t pos, j;
+
+	for (j = 0; j < Options.threads.size(); j++) {
+		int fd = open("/dev/null", O_WRONLY);
+		twrpEncryptWriter writer(fd, password, Options.threads[j]);
+		writer.Start();
+		twrpBenchTimer timer;
+		for (pos = 0; pos < sample.size(); pos += BENCH_IO_SIZE)
+			writer.Write(&sample[pos], sample.size() - pos < BENCH_IO_SIZE ? sample.size() - pos : BENCH_IO_SIZE);
+		writer.Finish();
+		snprintf(detail, sizeof(detail), "aes, %u threads", Options.threads[j]);
+		timer.Report("encrypt", detail, sample.size(), 0);
+		close(fd);
+	}
+}
+#endif
+
+static void Run_Digest() {
+	twrpMD5 md5;
+	size_t pos;
+
+	twrpBenchTimer timer;
+	for (pos = 0; pos < sample.size(); pos += BENCH_IO_SIZE)
+		md5.update(&sample[pos], sample.size() - pos < BENCH_IO_SIZE ? sample.size() - pos : BENCH_IO_SIZE);
+	md5.return_digest_string();
+	// twrpdigestbench compares the SHA256 kernels
+	timer.Report("digest", "md5", sample.size(), 0);
+}
+
+static void Run_Write(const std::string& Work) {
+	std::string Path = Work + "/write.bench";
+	size_t pos;
+
+	int fd = open(Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		printf("Unable to create '%s': %s\n", Path.c_str(), strerror(errno));
+		return;
+	}
+	twrpBenchTimer timer;
+	for (pos = 0; pos < sample.size(); pos += BENCH_IO_SIZE) {
+		size_t len = sample.size() - pos < BENCH_IO_SIZE ? sample.size() - pos : BENCH_IO_SIZE;
+		if (write(fd, &sample[pos], len) != (ssize_t) len) {
+			printf("Unable to write '%s': %s\n", Path.c_str(), strerror(errno));
+			break;
+		}
+	}
+	fsync(fd);
+	timer.Report("write", "1 MB writes + fsync", sample.size(), 0);
+	close(fd);
+	unlink(Path.c_str());
+}
+
+static unsigned long long Folder_Size(const std::string& Path, unsigned *Count) {
+	twrpScan scan;
+	TWExclude none;
+
+	if (!scan.Scan(Path, &none))
+		return 0;
+	if (Count)
+		*Count = scan.Get_File_Count();
+	return scan.Get_Size();
+}
+
+// Backs the tree up with one combination of the options and restores it
+// the way TWRP does, by wiping the tree and extracting the archives in
+// place. Returns false if the tree was lost.
+static bool Run_Combination(const twrpTarBenchOptions& Options, TWExclude *exclude, twrpScan *scan, unsigned threads, Archive_Type codec, bool encrypt, unsigned long long split) {
+	std::string Backup_Dir = Options.work + "/backup";
+	std::string Tar_Filename = Backup_Dir + "/bench.tar";
+	unsigned long long tree_size = scan->Get_Size(), tree_files = scan->Get_File_Count();
+	unsigned archive_count = 0, restored_files = 0;
+	char detail[96], split_name[32];
+	pid_t tar_fork_pid = 0;
+
+	if (split)
+		snprintf(split_name, sizeof(split_name), "%lluMB", split / 1048576);
+	else
+		snprintf(split_name, sizeof(split_name), "default");
+	snprintf(detail, sizeof(detail), "%u thr %s%s split %s", threads, Codec_Name(codec), encrypt ? "+aes" : "", split_name);
+
+	Remove_Tree(Backup_Dir);
+	if (!Make_Dir(Backup_Dir))
+		return true;
+
+	ProgressTracking backup_progress(tree_size);
+	PartitionSettings backup_settings = PartitionSettings();
+	backup_settings.progress = &backup_progress;
+	twrpTar backup;
+	backup.setdir(Options.tree);
+	backup.setfn(Tar_Filename);
+	backup.setsize(tree_size);
+	backup.use_compression = codec != UNCOMPRESSED;
+	if (codec != UNCOMPRESSED)
+		backup.compression_type = codec;
+	backup.backup_threads = threads;
+	backup.backup_exclusions = exclude;
+	backup.part_settings = &backup_settings;
+	if (split)
+		backup.max_archive_size = split;
+	if (encrypt) {
+		backup.use_encryption = 1;
+		backup.setpassword(Options.password);
+	}
+	Drop_Caches();
+	twrpBenchTimer backup_timer;
+	if (backup.createTarFork(&tar_fork_pid) != 0) {
+		printf("backup   %-32s failed\n", detail);
+		Remove_Tree(Backup_Dir);
+		return true;
+	}
+	sync();
+	backup_timer.Report("backup", detail, tree_size, tree_files);
+	unsigned long long archive_size = Folder_Size(Backup_Dir, &archive_count);
+	printf("         %u archives, %.1f MB, %.0f%% of the tree\n", archive_count, archive_size / 1048576.0, tree_size ? archive_size * 100.0 / tree_size : 0.0);
+	if (!Options.restore) {
+		Remove_Tree(Backup_Dir);
+		return true;
+	}
+
+	ProgressTracking restore_progress(archive_size);
+	PartitionSettings restore_settings = PartitionSettings();
+	restore_settings.progress = &restore_progress;
+	twrpTar restore;
+	// Single archives are extracted below the first folder of the stored
+	// paths, the same way TWRP restores a partition to its mount point
+	restore.setdir(Options.tree.substr(0, Options.tree.find('/', 1)));
+	restore.setfn(Tar_Filename);
+	restore.part_settings = &restore_settings;
+	if (encrypt)
+		restore.setpassword(Options.password);
+	Remove_Tree(Options.tree);
+	Drop_Caches();
+	twrpBenchTimer restore_timer;
+	int ret = restore.extractTarFork();
+	sync();
+	if (ret == 0)
+		restore_timer.Report("restore", detail, tree_size, tree_files);
+	else
+		printf("restore  %-32s failed\n", detail);
+	Folder_Size(Options.tree, &restored_files);
+	Remove_Tree(Backup_Dir);
+	if (restored_files != tree_files) {
+		printf("         only %u of %llu files were restored\n", restored_files, tree_files);
+		return false;
+	}
+	return true;
+}
+
+void twrpTarBench_Usage() {
+	printf("twrpTar -b -w <work folder> [options]\n\n");
+	printf(" -w    work folder for the synthetic tree and the archives\n");
+	printf(" -d    tree to back up instead of a synthetic one, only backups are run\n");
+	printf(" -r    restore over the -d tree too, it is deleted before every restore\n");
+	printf(" -n    files in the synthetic tree (default %u)\n", BENCH_DEFAULT_FILES);
+	printf(" -m    MB in the synthetic tree (default %llu)\n", BENCH_DEFAULT_SIZE / 1048576);
+	printf(" -j    thread counts, e.g. 1,4 (default 1 and one per core)\n");
+	printf(" -z    compression, any of none,gzip,zstd,lz4 (default all this build supports)\n");
+	printf(" -s    split sizes in MB, 0 for the default (default 0)\n");
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	printf(" -e    also run encrypted backups with this password\n");
+#endif
+	printf("\nLists are comma separated, every combination is backed up and restored.\n");
+	printf("Restores wipe the tree and extract in place, like TWRP does.\n");
+	printf("The page cache is dropped before each measured run when possible.\n");
+}
+
+int twrpTarBench_Main(int argc, char **argv) {
+	twrpTarBenchOptions Options;
+	std::vector<std::string> Items;
+	bool synthetic;
+	int i;
+	size_t j, x, y, z, w;
+
+	// The tar children inherit stdout, keep it line buffered so piped
+	// results are not printed twice when a child exits
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	Options.files = BENCH_DEFAULT_FILES;
+	Options.restore = false;
+	Options.size = BENCH_DEFAULT_SIZE;
+	for (i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0) {
+			Options.restore = true;
+			continue;
+		}
+		if (argv[i][0] != '-' || argv[i][1] == '\0' || argv[i][2] != '\0' || i + 1 >= argc) {
+			printf("Invalid option '%s'\n", argv[i]);
+			twrpTarBench_Usage();
+			return -1;
+		}
+		const char* arg = argv[++i];
+		Items.clear();
+		switch (argv[i - 1][1]) {
+			case 'w':
+				Options.work = arg;
+				break;
+			case 'd':
+				Options.tree = arg;
+				break;
+			case 'n':
+				Options.files = strtoul(arg, NULL, 10);
+				break;
+			case 'm':
+				Options.size = strtoull(arg, NULL, 10) * 1048576;
+				break;
+			case 'j':
+				Parse_List(arg, &Items);
+				for (j = 0; j < Items.size(); j++)
+					Options.threads.push_back(strtoul(Items[j].c_str(), NULL, 10));
+				break;
+			case 'z':
+				Parse_List(arg, &Items);
+				for (j = 0; j < Items.size(); j++) {
+					Archive_Type type;
+					if (Items[j] == "none")
+						type = UNCOMPRESSED;
+					else if (Items[j] == "gzip")
+						type = COMPRESSED;
+					else if (Items[j] == "zstd")
+						type = COMPRESSED_ZSTD;
+					else if (Items[j] == "lz4")
+						type = COMPRESSED_LZ4;
+					else {
+						printf("Unknown compression '%s'\n", Items[j].c_str());
+						return -1;
+					}
+					if (type != UNCOMPRESSED && !twrpCompress_Supported(type)) {
+						printf("%s is not supported by this build\n", Items[j].c_str());
+						return -1;
+					}
+					Options.codecs.push_back(type);
+				}
+				break;
+			case 's':
+				Parse_List(arg, &Items);
+				for (j = 0; j < Items.size(); j++)
+					Options.splits.push_back(strtoull(Items[j].c_str(), NULL, 10) * 1048576);
+				break;
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+			case 'e':
+				Options.password = arg;
+				break;
+#endif
+			default:
+				printf("Invalid option '%s'\n", argv[i - 1]);
+				twrpTarBench_Usage();
+				return -1;
+		}
+	}
+	if (Options.work.empty() || Options.files == 0) {
+		twrpTarBench_Usage();
+		return -1;
+	}
+	if (Options.threads.empty()) {
+		Options.threads.push_back(1);
+		if (twrpCompress_Default_Threads() > 1)
+			Options.threads.push_back(twrpCompress_Default_Threads());
+	}
+	if (Options.codecs.empty()) {
+		Options.codecs.push_back(UNCOMPRESSED);
+		if (twrpCompress_Supported(COMPRESSED))
+			Options.codecs.push_back(COMPRESSED);
+		if (twrpCompress_Supported(COMPRESSED_ZSTD))
+			Options.codecs.push_back(COMPRESSED_ZSTD);
+		if (twrpCompress_Supported(COMPRESSED_LZ4))
+			Options.codecs.push_back(COMPRESSED_LZ4);
+	}
+	if (Options.splits.empty())
+		Options.splits.push_back(0);
+
+	if (!Make_Dir(Options.work))
+		return -1;
+	synthetic = Options.tree.empty();
+	if (synthetic) {
+		Options.restore = true;
+		Options.tree = Options.work + "/tree";
+		Remove_Tree(Options.tree);
+		if (!Make_Tree(Options.tree, Options.files, Options.size))
+			return -1;
+	}
+
+	TWExclude exclude;
+	twrpScan scan;
+	exclude.add_absolute_dir(Options.work);
+
+	printf("\nStages:\n");
+	if (!Run_Scan(Options, &exclude, &scan) || !Run_Archive(&scan)) {
+		if (synthetic)
+			Remove_Tree(Options.tree);
+		return -1;
+	}
+	Run_Compress(Options);
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+	Run_Encrypt(Options);
+#endif
+	Run_Digest();
+	Run_Write(Options.work);
+	sample.clear();
+
+	printf("\nBackup and restore of %llu files, %.1f MB:\n", (unsigned long long) scan.Get_File_Count(), scan.Get_Size() / 1048576.0);
+	for (w = 0; w < Options.splits.size(); w++) {
+		for (x = 0; x < Options.threads.size(); x++) {
+			for (y = 0; y < Options.codecs.size(); y++) {
+				for (z = 0; z < (Options.password.empty() ? 1U : 2U); z++) {
+					if (!Run_Combination(Options, &exclude, &scan, Options.threads[x], Options.codecs[y], z == 1, Options.splits[w]))
+						return -1;
+				}
+			}
+		}
+	}
+	if (synthetic)
+		Remove_Tree(Options.tree);
+	return 0;
+}
@@ -0,0 +1,45 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_TAR_BENCH_HPP
+#define __TWRP_TAR_BENCH_HPP
+
+#include <string>
+#include <vector>
+#include "../twrp-functions.hpp"
+
+// Benchmark mode of twrpTar. Every stage of a backup is first timed on its
+// own, then the tree is backed up and restored with each combination of the
+// options, so regressions and device tuning can be measured without the GUI.
+
+struct twrpTarBenchOptions {
+	std::string tree;                                                  // Tree to back up, a synthetic one is made when empty
+	bool restore;                                                      // Restore over the tree after every backup
+	std::string work;                                                  // Holds the synthetic tree and the archives
+	std::vector<unsigned> threads;                                     // Tar thread counts to try
+	std::vector<Archive_Type> codecs;                                  // UNCOMPRESSED for no compression
+	std::string password;                                              // Encrypted runs are added when it is set
+	std::vector<unsigned long long> splits;                            // Split sizes in bytes, 0 keeps the default
+	unsigned files;                                                    // Shape of the synthetic tree
+	unsigned long long size;
+};
+
+void twrpTarBench_Usage();
+int twrpTarBench_Main(int argc, char **argv);                              // argv[1] is -b
+
+#endif // __TWRP_TAR_BENCH_HPP
@@ -23,7 +23,10 @@
 #include "../progresstracking.hpp"
 #include "../gui/gui.hpp"
 #include "../gui/twmsg.h"
+#include "twrpTarBench.hpp"
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 void gui_msg(const char* text)
 {
@@ -67,13 +70,15 @@ void gui_msg(Message msg)
 void usage() {
 	printf("twrpTar <action> [options]\n\n");
 	printf("actions: -c create\n");
-	printf("         -x extract\n\n");
+	printf("         -x extract\n");
+	printf("         -b benchmark, see twrpTar -b\n\n");
 	printf(" -d    target directory\n");
 	printf(" -t    output file\n");
 	printf(" -m    skip media subfolder (has data media)\n");
-	printf(" -z    compress backup (/sbin/pigz must be present)\n");
+	printf(" -z    compress backup\n");
+	printf(" -j    number of tar threads for the backup, 0 for one per core\n");
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
-	printf(" -e    encrypt/decrypt backup followed by password (/sbin/openaes must be present)\n");
+	printf(" -e    encrypt/decrypt backup followed by password\n");
 	printf(" -u    encrypt using userdata encryption (must be used with -e)\n");
 #endif
 	printf("\n\n");
@@ -83,11 +88,12 @@ void usage() {
 
 int main(int argc, char **argv) {
 	twrpTar tar;
-	int use_encryption = 0, userdata_encryption = 0, has_data_media = 0, use_compression = 0, include_root = 0;
+	int use_encryption = 0, userdata_encryption = 0, has_data_media = 0, use_compression = 0, include_root = 0, backup_threads = 1;
 	int i, action = 0;
 	unsigned j;
 	string Directory, Tar_Filename;
 	ProgressTracking progress(1);
+	PartitionSettings part_settings = PartitionSettings();
 	pid_t tar_fork_pid = 0;
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	string Password;
@@ -98,7 +104,9 @@ int main(int argc, char **argv) {
 		return 0;
 	}
 
-	if (strcmp(argv[1], "-c") == 0)
+	if (strcmp(argv[1], "-b") == 0)
+		return twrpTarBench_Main(argc, argv);
+	else if (strcmp(argv[1], "-c") == 0)
 		action = 1; // create tar
 	else if (strcmp(argv[1], "-x") == 0)
 		action = 2; // extract tar
@@ -151,6 +159,17 @@ int main(int argc, char **argv) {
 			if (action == 2)
 				printf("NOTE: %s option not needed when extracting.\n", argv[i]);
 			use_compression = 1;
+		} else if (strcmp(argv[i], "-j") == 0) {
+			i++;
+			if (argc <= i) {
+				printf("No argument specified for %s\n", argv[i - 1]);
+				usage();
+				return -1;
+			} else {
+				if (action == 2)
+					printf("NOTE: %s option not needed when extracting.\n", argv[i - 1]);
+				backup_threads = atoi(argv[i]);
+			}
 		} else if (strcmp(argv[i], "-u") == 0) {
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 			if (action == 2)
@@ -165,13 +184,16 @@ int main(int argc, char **argv) {
 	}
 
 	TWExclude exclude;
-	exclude.add_absolute_dir("/data/media");
-	tar.has_data_media = has_data_media;
+	if (has_data_media)
+		exclude.add_absolute_dir("/data/media");
 	tar.setdir(Directory);
 	tar.setfn(Tar_Filename);
 	tar.setsize(exclude.Get_Folder_Size(Directory));
 	tar.use_compression = use_compression;
+	tar.backup_threads = backup_threads;
 	tar.backup_exclusions = &exclude;
+	part_settings.progress = &progress;
+	tar.part_settings = &part_settings;
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	if (userdata_encryption && !use_encryption) {
 		printf("userdata encryption set without encryption option\n");
@@ -0,0 +1,239 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "twrpTarProgress.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+
+static const char* stage_names[TW_TAR_STAGES] = {
+	"scan",
+	"tar",
+	"finish",
+};
+
+twrpTarProgressBlock* twrpTarProgress::current = NULL;
+
+twrpTarProgress::twrpTarProgress() {
+	block = NULL;
+}
+
+twrpTarProgress::~twrpTarProgress() {
+	if (block != NULL)
+		munmap(block, sizeof(*block));
+}
+
+bool twrpTarProgress::Map() {
+	void* mem = mmap(NULL, sizeof(*block), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		LOGINFO("Unable to map the tar progress block: %s\n", strerror(errno));
+		return false;
+	}
+	// Anonymous memory starts out zeroed
+	block = (twrpTarProgressBlock*) mem;
+	return true;
+}
+
+unsigned long long twrpTarProgress::Now_Usec() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+unsigned long long twrpTarProgress::Load(const unsigned long long *Value) {
+	return __atomic_load_n(Value, __ATOMIC_ACQUIRE);
+}
+
+void twrpTarProgress::Store(unsigned long long *Value, unsigned long long New_Value) {
+	__atomic_store_n(Value, New_Value, __ATOMIC_RELEASE);
+}
+
+void twrpTarProgress::Make_Current() {
+	current = block;
+}
+
+void twrpTarProgress::Add_Time(twrpTarProgress_Time Time, unsigned long long Usec) {
+	// Nothing to add to in the GUI process
+	if (current != NULL)
+		__atomic_fetch_add(&current->time_usec[Time], Usec, __ATOMIC_RELAXED);
+}
+
+extern "C" void twrpTarProgress_Add_Write_Time(unsigned long long usec) {
+	twrpTarProgress::Add_Time(TW_TAR_TIME_WRITE, usec);
+}
+
+void twrpTarProgress::Set_Totals(unsigned long long Files, unsigned long long Size) {
+	Store(&block->total_files, Files);
+	Store(&block->total_size, Size);
+	Store(&block->totals_set, 1);
+}
+
+void twrpTarProgress::Start_Stage(twrpTarProgress_Stage Stage) {
+	Store(&block->stage_usec[Stage], Now_Usec());
+}
+
+void twrpTarProgress::Done() {
+	Store(&block->stage_usec[TW_TAR_STAGES], Now_Usec());
+}
+
+void twrpTarProgress::Start_Thread(unsigned Thread) {
+	if (Thread < TW_TAR_PROGRESS_THREADS)
+		Store(&block->threads[Thread].start_usec, Now_Usec());
+}
+
+void twrpTarProgress::End_Thread(unsigned Thread) {
+	if (Thread < TW_TAR_PROGRESS_THREADS)
+		Store(&block->threads[Thread].end_usec, Now_Usec());
+}
+
+void twrpTarProgress::Add_File(unsigned Thread) {
+	if (Thread < TW_TAR_PROGRESS_THREADS)
+		__atomic_fetch_add(&block->threads[Thread].files, 1, __ATOMIC_RELAXED);
+}
+
+unsigned long long* twrpTarProgress::Bytes(unsigned Thread) {
+	if (block == NULL || Thread >= TW_TAR_PROGRESS_THREADS)
+		return NULL;
+	return &block->threads[Thread].bytes;
+}
+
+unsigned long long twrpTarProgress::Total_Bytes() {
+	unsigned long long total = 0;
+
+	for (unsigned i = 0; i < TW_TAR_PROGRESS_THREADS; i++)
+		total += Load(&block->threads[i].bytes);
+	return total;
+}
+
+unsigned long long twrpTarProgress::Total_Files() {
+	unsigned long long total = 0;
+
+	for (unsigned i = 0; i < TW_TAR_PROGRESS_THREADS; i++)
+		total += Load(&block->threads[i].files);
+	return total;
+}
+
+void twrpTarProgress::Update(ProgressTracking *Progress, bool *Totals_Shown) {
+	unsigned long long bytes = Total_Bytes(), now = Now_Usec();
+	unsigned long long start = Load(&block->stage_usec[TW_TAR_STAGE_ARCHIVE]);
+
+	if (!*Totals_Shown && Load(&block->totals_set)) {
+		unsigned long long files = Load(&block->total_files);
+		if (files == 0)
+			files = 1; // prevent division by 0 in the file progress
+		Progress->SetSizeCount(Load(&block->total_size), files);
+		*Totals_Shown = true;
+	}
+	// Averaged over the whole archive stage, so the rate and the time left
+	// don't jump with every folder of small files
+	if (start != 0 && now > start + 1000000)
+		Progress->SetRate(bytes * 1000000 / (now - start));
+	if (*Totals_Shown)
+		Progress->UpdateSizeCount(bytes, Total_Files());
+	else
+		Progress->UpdateSize(bytes);
+}
+
+void twrpTarProgress::Watch(pid_t pid, ProgressTracking *Progress, bool Counting) {
+	int pidfd = TWFunc::Pidfd_Open(pid);
+	bool totals_shown = Counting, exited = false;
+
+	while (!exited) {
+		if (pidfd >= 0) {
+			// Readable once the tar process has exited
+			struct pollfd pfd;
+			pfd.fd = pidfd;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			poll(&pfd, 1, TW_TAR_PROGRESS_REFRESH_MS);
+		} else {
+			usleep(TW_TAR_PROGRESS_REFRESH_MS * 1000);
+		}
+		// WNOWAIT leaves the exit status for TWFunc::Wait_For_Child()
+		siginfo_t info;
+		memset(&info, 0, sizeof(info));
+		exited = waitid(P_PID, pid, &info, WEXITED | WNOHANG | WNOWAIT) != 0 || info.si_pid != 0;
+		Update(Progress, &totals_shown);
+	}
+	if (pidfd >= 0)
+		close(pidfd);
+	Progress->SetRate(0);
+}
+
+void twrpTarProgress::Log(const std::string& Name) {
+	unsigned long long end = 0;
+	std::string stages;
+	char buf[128];
+
+	for (int i = 0; i < TW_TAR_STAGES; i++) {
+		unsigned long long start = Load(&block->stage_usec[i]), stop = 0;
+		if (start == 0)
+			continue;
+		for (int next = i + 1; next <= TW_TAR_STAGES && stop == 0; next++)
+			stop = Load(&block->stage_usec[next]);
+		if (stop < start)
+			continue;
+		snprintf(buf, sizeof(buf), " %s %.1fs", stage_names[i], (stop - start) / 1000000.0);
+		stages += buf;
+		end = stop;
+	}
+	if (!stages.empty())
+		LOGINFO("%s tar stages:%s\n", Name.c_str(), stages.c_str());
+	for (unsigned i = 0; i < TW_TAR_PROGRESS_THREADS; i++) {
+		const twrpTarProgressThread& thread = block->threads[i];
+		unsigned long long start = Load(&thread.start_usec), stop = Load(&thread.end_usec);
+		if (start == 0)
+			continue;
+		if (stop < start)
+			stop = end > start ? end : Now_Usec();
+		double secs = (stop - start) / 1000000.0;
+		LOGINFO("  thread %u: %lluMB, %llu files in %.1fs, %.1fMB/s\n", i, Load(&thread.bytes) / 1048576, Load(&thread.files),
+			secs, secs > 0 ? Load(&thread.bytes) / 1048576.0 / secs : 0.0);
+	}
+}
+
+unsigned long long twrpTarProgress::Stage_Usec(twrpTarProgress_Stage Stage) {
+	unsigned long long start = Load(&block->stage_usec[Stage]), stop = 0;
+
+	if (start == 0)
+		return 0;
+	for (int next = Stage + 1; next <= TW_TAR_STAGES && stop == 0; next++)
+		stop = Load(&block->stage_usec[next]);
+	return stop > start ? stop - start : 0;
+}
+
+unsigned long long twrpTarProgress::Time_Usec(twrpTarProgress_Time Time) {
+	return Load(&block->time_usec[Time]);
+}
+
+unsigned twrpTarProgress::Threads() {
+	unsigned count = 0;
+
+	for (unsigned i = 0; i < TW_TAR_PROGRESS_THREADS; i++) {
+		if (Load(&block->threads[i].start_usec) != 0)
+			count++;
+	}
+	return count;
+}
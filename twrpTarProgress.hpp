@@ -0,0 +1,106 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_TAR_PROGRESS_HPP
+#define __TWRP_TAR_PROGRESS_HPP
+
+#include <sys/types.h>
+#include <string>
+#include "progresstracking.hpp"
+
+#define TW_TAR_PROGRESS_THREADS 9                                          // twrpTar thread ids 0 to 8
+#define TW_TAR_PROGRESS_REFRESH_MS 200                                     // How often the GUI process reads the block
+
+enum twrpTarProgress_Stage {
+	TW_TAR_STAGE_SCAN = 0,                                             // Walking the tree and building the lists
+	TW_TAR_STAGE_ARCHIVE,                                              // Writing or extracting the archives
+	TW_TAR_STAGE_FINISH,                                               // Manifest and stream ends after the last archive
+	TW_TAR_STAGES
+};
+
+// Work timed inside the tar process, summed over its threads
+enum twrpTarProgress_Time {
+	TW_TAR_TIME_COMPRESS = 0,                                          // Or decompress
+	TW_TAR_TIME_ENCRYPT,                                               // Or decrypt
+	TW_TAR_TIME_DIGEST,
+	TW_TAR_TIME_WRITE,
+	TW_TAR_TIMES
+};
+
+// Counters of one tar thread, each on its own cache line so the threads
+// don't slow each other down
+struct twrpTarProgressThread {
+	unsigned long long bytes;                                          // Archived or extracted
+	unsigned long long files;                                          // Regular files archived or extracted
+	unsigned long long start_usec;                                     // 0 until the thread starts
+	unsigned long long end_usec;                                       // 0 until it is done
+} __attribute__((aligned(64)));
+
+struct twrpTarProgressBlock {
+	unsigned long long total_files;
+	unsigned long long total_size;
+	unsigned long long totals_set;                                     // Stored after the totals, 0 until the scan is done
+	unsigned long long stage_usec[TW_TAR_STAGES + 1];                  // Start of each stage that ran, and the end of the last
+	unsigned long long time_usec[TW_TAR_TIMES];
+	twrpTarProgressThread threads[TW_TAR_PROGRESS_THREADS];
+};
+
+// Progress of the tar process, in memory shared with the GUI process that
+// forked it. The tar threads only add to their own counters, without a
+// lock or a system call, and the GUI process reads them every
+// TW_TAR_PROGRESS_REFRESH_MS until the tar process exits. Map() has to be
+// called before the fork.
+class twrpTarProgress {
+public:
+	twrpTarProgress();
+	~twrpTarProgress();
+	bool Map();
+
+	// Tar process
+	void Make_Current();                                               // Block that Add_Time() adds to, after the fork
+	static void Add_Time(twrpTarProgress_Time Time, unsigned long long Usec);
+	void Set_Totals(unsigned long long Files, unsigned long long Size);
+	void Start_Stage(twrpTarProgress_Stage Stage);
+	void Done();                                                       // Ends the last stage
+	void Start_Thread(unsigned Thread);
+	void End_Thread(unsigned Thread);
+	void Add_File(unsigned Thread);
+	unsigned long long* Bytes(unsigned Thread);                        // Counter for libtar, NULL for an unknown thread
+
+	// GUI process
+	void Watch(pid_t pid, ProgressTracking *Progress, bool Counting = false); // Shows the progress until pid exits, doesn't reap it. Counting if the caller set the size and file count
+	unsigned long long Total_Bytes();
+	unsigned long long Total_Files();
+	void Log(const std::string& Name);                                 // Stage times and the rate of each thread
+	unsigned long long Stage_Usec(twrpTarProgress_Stage Stage);        // 0 if it didn't run
+	unsigned long long Time_Usec(twrpTarProgress_Time Time);
+	unsigned Threads();                                                // That started
+
+private:
+	void Update(ProgressTracking *Progress, bool *Totals_Shown);
+	static unsigned long long Now_Usec();
+	static unsigned long long Load(const unsigned long long *Value);
+	static void Store(unsigned long long *Value, unsigned long long New_Value);
+
+	twrpTarProgressBlock* block;
+	static twrpTarProgressBlock* current;
+};
+
+extern "C" void twrpTarProgress_Add_Write_Time(unsigned long long usec); // For tarWrite.c
+
+#endif // __TWRP_TAR_PROGRESS_HPP
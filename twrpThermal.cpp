@@ -0,0 +1,158 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "twrpThermal.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+
+#define THERMAL_ZONES "/sys/class/thermal/"
+// Percent of level per degree C per second that the sensor is off the target
+#define TW_THERMAL_GAIN 1.0
+// Longest rest Pace() takes at once, so a slow piece of work can't stall its pool
+#define TW_THERMAL_MAX_REST_USEC 1000000
+
+uint64_t twrpThermal::Now_Usec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+twrpThermal::twrpThermal() {
+	pthread_mutex_init(&lock, NULL);
+	last_sample = 0;
+	level = 100;
+	logged_level = 100;
+
+#ifdef TW_CUSTOM_CPU_TEMP_PATH
+	sensors.push_back(EXPAND(TW_CUSTOM_CPU_TEMP_PATH));
+#else
+	// The CPU zones when their type says so, tsens on older Qualcomm SoCs,
+	// otherwise every zone
+	std::vector<std::string> all;
+	DIR* d = opendir(THERMAL_ZONES);
+	if (d != NULL) {
+		struct dirent* de;
+		while ((de = readdir(d)) != NULL) {
+			if (strncmp(de->d_name, "thermal_zone", 12) != 0)
+				continue;
+			std::string zone = std::string(THERMAL_ZONES) + de->d_name, type;
+			all.push_back(zone + "/temp");
+			if (TWFunc::read_file(zone + "/type", type) == 0 && (type.find("cpu") != std::string::npos || type.find("tsens") != std::string::npos))
+				sensors.push_back(zone + "/temp");
+		}
+		closedir(d);
+	}
+	if (sensors.empty())
+		sensors = all;
+#endif
+	if (sensors.empty())
+		LOGINFO("twrpThermal: no temperature sensors, workers run at full speed\n");
+	else
+		LOGINFO("twrpThermal: watching %zu sensors, target %i C\n", sensors.size(), TW_THERMAL_TARGET);
+}
+
+twrpThermal::~twrpThermal() {
+	pthread_mutex_destroy(&lock);
+}
+
+twrpThermal* twrpThermal::Get() {
+	static twrpThermal thermal;
+	return &thermal;
+}
+
+int twrpThermal::Read_Temperature() {
+	int max = -1;
+
+	for (size_t i = 0; i < sensors.size(); i++) {
+		std::string value;
+		if (TWFunc::read_file(sensors[i], value) != 0)
+			continue;
+		long temp = strtol(value.c_str(), NULL, 0);
+		// Same units guessing as the CPU temperature on the status bar:
+		// most kernels report millidegrees, some degrees or tenths
+		if (temp > 0 && temp < 1000)
+			temp *= 1000;
+		else if (temp >= 150000 && temp < 1500000)
+			temp /= 10;
+		if (temp <= 0 || temp >= 150000)
+			continue;                                                  // Disabled or broken sensor
+		if (temp > max)
+			max = temp;
+	}
+	return max;
+}
+
+void twrpThermal::Update() {
+	if (sensors.empty() || pthread_mutex_trylock(&lock) != 0)
+		return;                                                        // Another worker is taking the reading
+	uint64_t now = Now_Usec();
+	if (now - last_sample < TW_THERMAL_SAMPLE_MS * 1000ULL) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	// After an idle stretch only the last sample period counts, the work
+	// that heats the device just started again
+	double seconds = last_sample == 0 || now - last_sample > 2 * TW_THERMAL_SAMPLE_MS * 1000ULL ? TW_THERMAL_SAMPLE_MS / 1000.0 : (now - last_sample) / 1000000.0;
+	last_sample = now;
+	int temp = Read_Temperature();
+	if (temp >= 0) {
+		level += TW_THERMAL_GAIN * (TW_THERMAL_TARGET - temp / 1000.0) * seconds;
+		if (level > 100)
+			level = 100;
+		else if (level < TW_THERMAL_MIN_LEVEL)
+			level = TW_THERMAL_MIN_LEVEL;
+		unsigned rounded = (unsigned) (level + 0.5);
+		if (rounded + 10 <= logged_level || rounded >= logged_level + 10 || (rounded == 100 && logged_level != 100)) {
+			LOGINFO("twrpThermal: %i.%i C, workers at %u%%\n", temp / 1000, (temp % 1000) / 100, rounded);
+			logged_level = rounded;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+unsigned twrpThermal::Level() {
+	unsigned current;
+
+	Update();
+	pthread_mutex_lock(&lock);
+	current = (unsigned) (level + 0.5);
+	pthread_mutex_unlock(&lock);
+	return current;
+}
+
+unsigned twrpThermal::Workers(unsigned Wanted) {
+	unsigned workers = (Wanted * Level() + 99) / 100;
+	if (workers < Wanted)
+		LOGINFO("twrpThermal: starting %u of %u threads\n", workers ? workers : 1, Wanted);
+	return workers ? workers : 1;
+}
+
+void twrpThermal::Pace(uint64_t Busy_Usec) {
+	unsigned current = Level();
+	if (current >= 100 || Busy_Usec == 0)
+		return;
+	uint64_t rest = Busy_Usec * (100 - current) / current;
+	if (rest > TW_THERMAL_MAX_REST_USEC)
+		rest = TW_THERMAL_MAX_REST_USEC;
+	usleep(rest);
+}
@@ -0,0 +1,66 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_THERMAL_HPP
+#define __TWRP_THERMAL_HPP
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+// Temperature in degrees C the hottest CPU sensor is steered to, set with
+// TW_THERMAL_TARGET in BoardConfig.mk, a bit below where the kernel starts
+// throttling hard
+#ifndef TW_THERMAL_TARGET
+#define TW_THERMAL_TARGET 75
+#endif
+#define TW_THERMAL_MIN_LEVEL 25                                    // Percent, the slowest the workers are held to
+#define TW_THERMAL_SAMPLE_MS 500
+
+// Keeps long CPU bound jobs (tar, compression, encryption and digests) just
+// under the thermal limit. Running flat out until the kernel throttles the
+// clocks down hard, then bursting again once it lets go, is a lot slower
+// overall than running steadily a little below the limit. The level is the
+// percent of full speed workers may use. It is integrated from how far the
+// sensor is above or below the target, so it settles where the heat the
+// work makes matches what the device can get rid of. New pools start fewer
+// threads when the level is down, and running workers call Pace() after
+// each piece of work to rest for their share of the time.
+class twrpThermal {
+public:
+	static twrpThermal* Get();
+	static uint64_t Now_Usec();                                        // Monotonic clock for timing the work handed to Pace()
+	unsigned Level();                                                  // 100 when cool or without a sensor
+	unsigned Workers(unsigned Wanted);                                 // Threads to start for a pool that would use Wanted, at least 1
+	void Pace(uint64_t Busy_Usec);                                     // Sleep long enough after Busy_Usec of work to hold this thread to the level
+
+private:
+	twrpThermal();
+	~twrpThermal();
+	void Update();
+	int Read_Temperature();                                            // Hottest sensor in millidegrees C, -1 if none can be read
+
+	std::vector<std::string> sensors;
+	pthread_mutex_t lock;
+	uint64_t last_sample;                                              // Monotonic usec of the last reading
+	double level;
+	unsigned logged_level;
+};
+
+#endif // __TWRP_THERMAL_HPP
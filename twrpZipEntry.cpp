@@ -0,0 +1,148 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "twrpZipEntry.hpp"
+#include "twcommon.h"
+
+// zlib counts its input in uInt, so large entries are fed in slices
+#define TW_ZIP_ENTRY_SLICE (1U << 30)
+
+twrpZipEntryReader::twrpZipEntryReader(const ZipWrapEntry& Entry) {
+	entry = Entry;
+	consumed = 0;
+	produced = 0;
+	crc = crc32(0L, Z_NULL, 0);
+	failed = false;
+	strm_init = false;
+	stream_end = false;
+	memset(&strm, 0, sizeof(strm));
+	if (entry.deflated) {
+		// Zip entries are raw deflate streams without a zlib header
+		if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+			LOGERR("Unable to initialize inflate for zip entry\n");
+			failed = true;
+		} else {
+			strm_init = true;
+		}
+	} else if (entry.uncompressed_length != entry.compressed_length) {
+		LOGERR("Stored zip entry is %llu bytes in the zip but %llu bytes long\n", (unsigned long long) entry.compressed_length, (unsigned long long) entry.uncompressed_length);
+		failed = true;
+	}
+	// The entry is read once from start to end
+	long page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t) entry.data & ~((uintptr_t) page - 1);
+	madvise((void*) start, (uintptr_t) entry.data - start + entry.compressed_length, MADV_SEQUENTIAL);
+}
+
+twrpZipEntryReader::~twrpZipEntryReader() {
+	if (strm_init)
+		inflateEnd(&strm);
+}
+
+bool twrpZipEntryReader::Verify() {
+	// The end of the deflate stream may still be unread when the output is
+	// complete, anything it inflates to is more than the entry size
+	if (entry.deflated && !stream_end) {
+		unsigned char extra;
+		uint64_t avail = entry.compressed_length - consumed;
+		strm.next_in = (Bytef*) entry.data + consumed;
+		strm.avail_in = avail > TW_ZIP_ENTRY_SLICE ? TW_ZIP_ENTRY_SLICE : (uInt) avail;
+		strm.next_out = &extra;
+		strm.avail_out = 1;
+		uInt in_before = strm.avail_in;
+		int ret = inflate(&strm, Z_NO_FLUSH);
+		consumed += in_before - strm.avail_in;
+		if (ret != Z_STREAM_END || strm.avail_out == 0) {
+			LOGERR("Zip entry inflates to more than %llu bytes\n", (unsigned long long) entry.uncompressed_length);
+			return false;
+		}
+		stream_end = true;
+	}
+	if (entry.deflated && consumed != entry.compressed_length) {
+		LOGERR("Zip entry has %llu bytes of deflated data, expected %llu\n", (unsigned long long) consumed, (unsigned long long) entry.compressed_length);
+		return false;
+	}
+	if ((uint32_t) crc != entry.crc32) {
+		LOGERR("Zip entry CRC32 is %08x, expected %08x\n", (uint32_t) crc, entry.crc32);
+		return false;
+	}
+	return true;
+}
+
+ssize_t twrpZipEntryReader::Read(void *buf, size_t size) {
+	size_t total = 0;
+
+	if (failed)
+		return -1;
+	if (size > entry.uncompressed_length - produced)
+		size = entry.uncompressed_length - produced;
+	if (size == 0)
+		return 0;
+
+	if (!entry.deflated) {
+		memcpy(buf, entry.data + consumed, size);
+		consumed += size;
+		total = size;
+	} else {
+		while (total < size) {
+			uint64_t avail = entry.compressed_length - consumed;
+			strm.next_in = (Bytef*) entry.data + consumed;
+			strm.avail_in = avail > TW_ZIP_ENTRY_SLICE ? TW_ZIP_ENTRY_SLICE : (uInt) avail;
+			strm.next_out = (Bytef*) buf + total;
+			strm.avail_out = size - total;
+			uInt in_before = strm.avail_in;
+			uInt out_before = strm.avail_out;
+			int ret = inflate(&strm, Z_NO_FLUSH);
+			consumed += in_before - strm.avail_in;
+			total += out_before - strm.avail_out;
+			if (ret == Z_STREAM_END) {
+				stream_end = true;
+				break;
+			}
+			// No progress with room left in buf means the input ran out
+			if (ret == Z_BUF_ERROR) {
+				LOGERR("Zip entry ends before its data does\n");
+				failed = true;
+				errno = EIO;
+				return -1;
+			}
+			if (ret != Z_OK) {
+				LOGERR("Unable to inflate zip entry: %s\n", strm.msg ? strm.msg : zError(ret));
+				failed = true;
+				errno = EIO;
+				return -1;
+			}
+		}
+	}
+	crc = crc32(crc, (const Bytef*) buf, total);
+	produced += total;
+	if (produced == entry.uncompressed_length || total < size) {
+		if (total < size)
+			LOGERR("Zip entry ended after %llu of %llu bytes\n", (unsigned long long) produced, (unsigned long long) entry.uncompressed_length);
+		if (total < size || !Verify()) {
+			failed = true;
+			errno = EIO;
+			return -1;
+		}
+	}
+	return total;
+}
@@ -0,0 +1,50 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_ZIP_ENTRY_HPP
+#define __TWRP_ZIP_ENTRY_HPP
+
+#include <stdint.h>
+#include <zlib.h>
+#include "twrpCompress.hpp"
+#include "zipwrap.hpp"
+
+// Reads an entry straight out of a mapped zip for twrpRawCopy. Stored
+// entries are copied from the map and deflated ones are inflated from it,
+// so nothing is extracted first. The CRC32 is checked as the data goes by
+// and the read that reaches the end of the entry fails on a mismatch.
+class twrpZipEntryReader : public twrpStreamReader {
+public:
+	twrpZipEntryReader(const ZipWrapEntry& Entry);
+	~twrpZipEntryReader();
+	ssize_t Read(void *buf, size_t size);                              // Fills buf unless the entry ends
+
+private:
+	bool Verify();
+
+	ZipWrapEntry entry;
+	z_stream strm;
+	bool strm_init;
+	bool stream_end;
+	uint64_t consumed;                                                 // Bytes of the map used so far
+	uint64_t produced;                                                 // Bytes of the entry handed out so far
+	uLong crc;
+	bool failed;
+};
+
+#endif // __TWRP_ZIP_ENTRY_HPP
@@ -0,0 +1,202 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "twrpZipPrefetch.hpp"
+#include "twcommon.h"
+#include "data.hpp"
+#include "variables.h"
+#ifdef USE_OLD_VERIFIER
+#include "verifier24/verifier.h"
+#else
+#include "verifier.h"
+#endif
+
+twrpZipPrefetch::twrpZipPrefetch() {
+	pthread_mutex_init(&lock, NULL);
+}
+
+twrpZipPrefetch::~twrpZipPrefetch() {
+	Clear();
+	pthread_mutex_destroy(&lock);
+}
+
+twrpZipPrefetch* twrpZipPrefetch::Get() {
+	static twrpZipPrefetch prefetch;
+	return &prefetch;
+}
+
+int twrpZipPrefetch::Verify(const unsigned char* addr, size_t length, const std::function<void(float)>& progress) {
+#ifdef USE_OLD_VERIFIER
+	(void) progress;
+	return verify_file(addr, length);
+#else
+	std::vector<Certificate> loadedKeys;
+	if (!load_keys("/res/keys", loadedKeys)) {
+		LOGINFO("Failed to load keys\n");
+		return VERIFY_FAILURE;
+	}
+	return verify_file(addr, length, loadedKeys, progress);
+#endif
+}
+
+// MemAvailable counts the page cache that can be dropped, which free
+// memory alone does not
+uint64_t twrpZipPrefetch::Available_Memory() {
+	FILE* fp = fopen("/proc/meminfo", "r");
+	char line[128];
+	unsigned long long kb = 0;
+
+	if (fp == NULL)
+		return 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+			break;
+	}
+	fclose(fp);
+	return (uint64_t) kb * 1024;
+}
+
+bool twrpZipPrefetch::Same_File(const struct stat& a, const struct stat& b) {
+	return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size &&
+		a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec &&
+		a.st_ctim.tv_sec == b.st_ctim.tv_sec && a.st_ctim.tv_nsec == b.st_ctim.tv_nsec;
+}
+
+void twrpZipPrefetch::Start(const std::string& Path) {
+	struct stat st;
+	uint64_t budget = Available_Memory() / 2, pending = 0;
+	size_t i;
+
+	// Block maps of zips on encrypted data are only readable through the map
+	if (Path.empty() || Path[0] == '@' || stat(Path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+		return;
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < jobs.size(); i++) {
+		if (jobs[i]->path == Path) {
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		pending += jobs[i]->size;
+	}
+	if ((uint64_t) st.st_size + pending > budget) {
+		pthread_mutex_unlock(&lock);
+		LOGINFO("Not reading ahead '%s', %llu bytes do not fit in %llu bytes of memory\n", Path.c_str(),
+			(unsigned long long) st.st_size, (unsigned long long) (budget > pending ? budget - pending : 0));
+		return;
+	}
+	Job* job = new Job;
+	job->path = Path;
+	job->size = st.st_size;
+	job->verify = true;
+	job->checked = false;
+	job->ret_val = VERIFY_FAILURE;
+#ifndef TW_OEM_BUILD
+	job->verify = DataManager::GetIntValue(TW_SIGNED_ZIP_VERIFY_VAR) != 0;
+#endif
+	if (pthread_create(&job->thread, NULL, Job_Thread, job) != 0) {
+		pthread_mutex_unlock(&lock);
+		LOGINFO("Unable to start read ahead of '%s'\n", Path.c_str());
+		delete job;
+		return;
+	}
+	jobs.push_back(job);
+	pthread_mutex_unlock(&lock);
+	LOGINFO("Reading ahead '%s'\n", Path.c_str());
+}
+
+void* twrpZipPrefetch::Job_Thread(void *cookie) {
+	Run((Job*) cookie);
+	return NULL;
+}
+
+void twrpZipPrefetch::Run(Job *job) {
+	struct stat after;
+	void* addr;
+
+	int fd = open(job->path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s' for read ahead: %s\n", job->path.c_str(), strerror(errno));
+		return;
+	}
+	if (fstat(fd, &job->st) != 0 || job->st.st_size == 0) {
+		close(fd);
+		return;
+	}
+	if (!job->verify) {
+		// Only the page cache is filled, the install checks nothing
+		readahead(fd, 0, job->st.st_size);
+		close(fd);
+		return;
+	}
+	addr = mmap(NULL, job->st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		LOGINFO("Unable to map '%s' for read ahead: %s\n", job->path.c_str(), strerror(errno));
+		close(fd);
+		return;
+	}
+	job->ret_val = Verify((const unsigned char*) addr, job->st.st_size, nullptr);
+	munmap(addr, job->st.st_size);
+	// A write during the check makes the result worthless
+	job->checked = fstat(fd, &after) == 0 && Same_File(job->st, after);
+	close(fd);
+}
+
+bool twrpZipPrefetch::Take_Result(const std::string& Path, int* ret_val) {
+	struct stat st;
+	Job* job = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < jobs.size(); i++) {
+		if (jobs[i]->path == Path) {
+			job = jobs[i];
+			jobs.erase(jobs.begin() + i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+	if (job == NULL)
+		return false;
+
+	pthread_join(job->thread, NULL);
+	bool ret = job->checked && stat(Path.c_str(), &st) == 0 && Same_File(job->st, st);
+	if (ret)
+		*ret_val = job->ret_val;
+	LOGINFO("Read ahead of '%s' %s\n", Path.c_str(), ret ? "has the signature result" : "is only in the page cache");
+	delete job;
+	return ret;
+}
+
+void twrpZipPrefetch::Clear() {
+	std::vector<Job*> dropped;
+	size_t i;
+
+	pthread_mutex_lock(&lock);
+	dropped.swap(jobs);
+	pthread_mutex_unlock(&lock);
+	for (i = 0; i < dropped.size(); i++) {
+		pthread_join(dropped[i]->thread, NULL);
+		delete dropped[i];
+	}
+}
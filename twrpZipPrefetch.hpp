@@ -0,0 +1,69 @@
+/*
+	Copyright 2013 to 2018 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TWRP_ZIP_PREFETCH_HPP
+#define __TWRP_ZIP_PREFETCH_HPP
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Reads and verifies the next zips of an install queue in the background
+// while the current one installs. A zip is only read ahead when it fits
+// in half of the available memory, less what is read ahead already, so it
+// is still in the page cache when its install maps it. The signature
+// result is only handed to the install when the file has the same inode,
+// size, mtime and ctime as when it was checked.
+class twrpZipPrefetch {
+public:
+	twrpZipPrefetch();
+	~twrpZipPrefetch();
+	static twrpZipPrefetch* Get();
+	void Start(const std::string& Path);
+	// True if Path was read ahead with its signature checked and has not
+	// changed since, with the verify_file result in ret_val. Waits for a
+	// check that is still running.
+	bool Take_Result(const std::string& Path, int* ret_val);
+	void Clear();                                                      // Waits for and drops every zip not taken
+	// verify_file() against the recovery keys, shared with the install
+	static int Verify(const unsigned char* addr, size_t length, const std::function<void(float)>& progress);
+
+private:
+	struct Job {
+		std::string path;
+		uint64_t size;
+		bool verify;                                                   // Signature checking was on when the job started
+		bool checked;                                                  // The signature was checked and the file did not change meanwhile
+		int ret_val;
+		struct stat st;
+		pthread_t thread;
+	};
+
+	static void* Job_Thread(void *cookie);
+	static void Run(Job *job);
+	static uint64_t Available_Memory();
+	static bool Same_File(const struct stat& a, const struct stat& b);
+
+	std::vector<Job*> jobs;
+	pthread_mutex_t lock;
+};
+
+#endif // __TWRP_ZIP_PREFETCH_HPP
@@ -90,11 +90,13 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <libgen.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -120,6 +122,7 @@
 
 static constexpr int WINDOW_SIZE = 5;
 static constexpr int FIBMAP_RETRY_LIMIT = 3;
+static constexpr size_t FIEMAP_EXTENTS = 256;
 
 // uncrypt provides three services: SETUP_BCB, CLEAR_BCB and UNCRYPT.
 //
@@ -249,6 +252,99 @@ static int retry_fibmap(const int fd, const char* name, int* block, const int he
     return kUncryptIoctlError;
 }
 
+// A run of file blocks that are contiguous on the block device.
+struct BlockExtent {
+    int64_t logical;
+    int64_t physical;
+    int64_t count;
+};
+
+// Maps the whole file with FS_IOC_FIEMAP, a few calls for any size instead of one FIBMAP per
+// block. Returns false if the file system doesn't support it or reports an extent that can't be
+// read back through the block device as it is, and the blocks are then looked up with FIBMAP.
+static bool read_fiemap(int fd, const char* name, int64_t blocks, int64_t block_size,
+                        std::vector<BlockExtent>* extents) {
+    std::vector<unsigned char> buf(sizeof(struct fiemap) + FIEMAP_EXTENTS * sizeof(struct fiemap_extent));
+    struct fiemap* fm = reinterpret_cast<struct fiemap*>(buf.data());
+    uint64_t start = 0, end = static_cast<uint64_t>(blocks) * block_size;
+    const uint32_t unusable = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+                              FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_ENCRYPTED |
+                              FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE |
+                              FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_UNWRITTEN;
+
+    extents->clear();
+    while (start < end) {
+        memset(buf.data(), 0, buf.size());
+        fm->fm_start = start;
+        fm->fm_length = end - start;
+        // Allocates delayed blocks first, which the FIBMAP retries wait for
+        fm->fm_flags = FIEMAP_FLAG_SYNC;
+        fm->fm_extent_count = FIEMAP_EXTENTS;
+        if (ioctl(fd, FS_IOC_FIEMAP, fm) != 0) {
+            PLOG(INFO) << "FIEMAP of \"" << name << "\" failed, using FIBMAP";
+            return false;
+        }
+        if (fm->fm_mapped_extents == 0) {
+            break;
+        }
+        bool last = false;
+        for (uint32_t i = 0; i < fm->fm_mapped_extents; i++) {
+            const struct fiemap_extent& fe = fm->fm_extents[i];
+            if ((fe.fe_flags & unusable) != 0 || fe.fe_logical % block_size != 0 ||
+                fe.fe_physical % block_size != 0) {
+                LOG(INFO) << "FIEMAP extent at " << fe.fe_logical << " of \"" << name
+                          << "\" has flags " << fe.fe_flags << ", using FIBMAP";
+                return false;
+            }
+            BlockExtent extent;
+            extent.logical = fe.fe_logical / block_size;
+            extent.physical = fe.fe_physical / block_size;
+            extent.count = (fe.fe_length + block_size - 1) / block_size;
+            if (extent.physical + extent.count > INT32_MAX) {
+                LOG(INFO) << "FIEMAP extent of \"" << name << "\" is past the block map range";
+                return false;
+            }
+            if (!extents->empty() && extents->back().logical + extents->back().count == extent.logical &&
+                extents->back().physical + extents->back().count == extent.physical) {
+                extents->back().count += extent.count;
+            } else {
+                extents->push_back(extent);
+            }
+            start = fe.fe_logical + fe.fe_length;
+            last = (fe.fe_flags & FIEMAP_EXTENT_LAST) != 0;
+        }
+        if (last) {
+            break;
+        }
+    }
+    return true;
+}
+
+// Finds the device block of head_block, from the FIEMAP extents if they cover it. cursor is the
+// extent to start looking from, since the blocks are looked up in order.
+static int find_block(const int fd, const char* name, const std::vector<BlockExtent>& extents,
+                      size_t* cursor, const int head_block, int* block) {
+    while (*cursor < extents.size() &&
+           head_block >= extents[*cursor].logical + extents[*cursor].count) {
+        ++*cursor;
+    }
+    if (*cursor < extents.size() && head_block >= extents[*cursor].logical) {
+        *block = static_cast<int>(extents[*cursor].physical + (head_block - extents[*cursor].logical));
+        return kUncryptNoError;
+    }
+
+    *block = head_block;
+    if (ioctl(fd, FIBMAP, block) != 0) {
+        PLOG(ERROR) << "failed to find block " << head_block;
+        return kUncryptIoctlError;
+    }
+    if (*block == 0) {
+        LOG(ERROR) << "failed to find block " << head_block << ", retrying";
+        return retry_fibmap(fd, name, block, head_block);
+    }
+    return kUncryptNoError;
+}
+
 static int produce_block_map(const char* path, const char* map_file, const char* blk_dev,
                              bool encrypted, bool f2fs_fs, int socket) {
     std::string err;
@@ -324,6 +420,12 @@ static int produce_block_map(const char* path, const char* map_file, const char*
         return kUncryptIoctlError;
     }
 
+    std::vector<BlockExtent> extents;
+    size_t cursor = 0;
+    if (read_fiemap(fd, path, blocks, sb.st_blksize, &extents)) {
+        LOG(INFO) << "  " << extents.size() << " extents";
+    }
+
     off64_t pos = 0;
     int last_progress = 0;
     while (pos < sb.st_size) {
@@ -336,18 +438,10 @@ static int produce_block_map(const char* path, const char* map_file, const char*
 
         if ((tail+1) % WINDOW_SIZE == head) {
             // write out head buffer
-            int block = head_block;
-            if (ioctl(fd, FIBMAP, &block) != 0) {
-                PLOG(ERROR) << "failed to find block " << head_block;
-                return kUncryptIoctlError;
-            }
-
-            if (block == 0) {
-                LOG(ERROR) << "failed to find block " << head_block << ", retrying";
-                int error = retry_fibmap(fd, path, &block, head_block);
-                if (error != kUncryptNoError) {
-                    return error;
-                }
+            int block;
+            int error = find_block(fd, path, extents, &cursor, head_block, &block);
+            if (error != kUncryptNoError) {
+                return error;
             }
 
             add_block_to_ranges(ranges, block);
@@ -381,18 +475,10 @@ static int produce_block_map(const char* path, const char* map_file, const char*
 
     while (head != tail) {
         // write out head buffer
-        int block = head_block;
-        if (ioctl(fd, FIBMAP, &block) != 0) {
-            PLOG(ERROR) << "failed to find block " << head_block;
-            return kUncryptIoctlError;
-        }
-
-        if (block == 0) {
-            LOG(ERROR) << "failed to find block " << head_block << ", retrying";
-            int error = retry_fibmap(fd, path, &block, head_block);
-            if (error != kUncryptNoError) {
-                return error;
-            }
+        int block;
+        int error = find_block(fd, path, extents, &cursor, head_block, &block);
+        if (error != kUncryptNoError) {
+            return error;
         }
 
         add_block_to_ranges(ranges, block);
@@ -406,18 +492,15 @@ static int produce_block_map(const char* path, const char* map_file, const char*
         ++head_block;
     }
 
-    if (!android::base::WriteStringToFd(
-            android::base::StringPrintf("%zu\n", ranges.size() / 2), mapfd)) {
+    // The ranges are written with a single write
+    std::string map = android::base::StringPrintf("%zu\n", ranges.size() / 2);
+    for (size_t i = 0; i < ranges.size(); i += 2) {
+        android::base::StringAppendF(&map, "%d %d\n", ranges[i], ranges[i+1]);
+    }
+    if (!android::base::WriteStringToFd(map, mapfd)) {
         PLOG(ERROR) << "failed to write " << tmp_map_file;
         return kUncryptWriteError;
     }
-    for (size_t i = 0; i < ranges.size(); i += 2) {
-        if (!android::base::WriteStringToFd(
-                android::base::StringPrintf("%d %d\n", ranges[i], ranges[i+1]), mapfd)) {
-            PLOG(ERROR) << "failed to write " << tmp_map_file;
-            return kUncryptWriteError;
-        }
-    }
 
     if (fsync(mapfd) == -1) {
         PLOG(ERROR) << "failed to fsync \"" << tmp_map_file << "\"";
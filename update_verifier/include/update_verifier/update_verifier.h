@@ -16,9 +16,22 @@
 
 #pragma once
 
+#include <stdint.h>
+
 #include <string>
 
 int update_verifier(int argc, char** argv);
 
+struct VerifyOptions {
+  // Where to record the blocks that read back fine, keyed by the verity root hash of their
+  // partition, so that an attempt cut short by a reboot picks up where it left off. Empty to read
+  // every block on every attempt. The file is removed once all the blocks have been verified.
+  std::string progress_file;
+  // Cap on the total read rate in bytes per second, so verification leaves the rest of the boot
+  // some I/O. 0 for no cap.
+  uint64_t max_bytes_per_sec = 0;
+};
+
 // Exposed for testing purpose.
 bool verify_image(const std::string& care_map_name);
+bool verify_image(const std::string& care_map_name, const VerifyOptions& options);
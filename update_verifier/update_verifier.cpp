@@ -33,6 +33,12 @@
  *
  * The current slot will be marked as having booted successfully if the
  * verifier reaches the end after the verification.
+ *
+ * Blocks that read back fine are recorded as they go, so an attempt that is
+ * cut short (for example by a watchdog reboot) doesn't start over on the next
+ * boot. The record is keyed by the verity root hash of each partition, so it
+ * never carries over to a different build, and it is removed once every block
+ * has been verified.
  */
 
 #include "update_verifier/update_verifier.h"
@@ -42,11 +48,19 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
 
+#include <linux/dm-ioctl.h>
+
 #include <algorithm>
+#include <chrono>
 #include <future>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -73,7 +87,170 @@ static int dm_name_filter(const dirent* de) {
   return 0;
 }
 
-static bool read_blocks(const std::string& partition, const std::string& range_str) {
+// Blocks that have read back fine through dm-verity on an earlier attempt, one
+// "<partition> <root hash> <start> <end>" line per range. Lines are appended as ranges are read, so
+// only lines that made it to the disk with their newline are trusted.
+class VerifiedBlocks {
+ public:
+  explicit VerifiedBlocks(const std::string& path) : path_(path) {
+    if (path_.empty()) return;
+    std::string content;
+    if (android::base::ReadFileToString(path_, &content)) {
+      std::vector<std::string> lines = android::base::Split(content, "\n");
+      lines.pop_back();  // Empty, or a line cut short
+      for (const auto& line : lines) {
+        std::vector<std::string> tokens = android::base::Split(line, " ");
+        size_t start;
+        size_t end;
+        if (tokens.size() != 4 || !android::base::ParseUint(tokens[2], &start) ||
+            !android::base::ParseUint(tokens[3], &end) || start >= end) {
+          continue;
+        }
+        verified_[{ tokens[0], tokens[1] }].emplace_back(start, end);
+      }
+    }
+    fd_.reset(TEMP_FAILURE_RETRY(
+        open(path_.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)));
+    if (fd_ == -1) {
+      PLOG(WARNING) << "Failed to open " << path_ << "; verifying without recording progress";
+    }
+  }
+
+  // Returns the ranges of |partition| verified under |root_hash|, sorted and merged.
+  std::vector<Range> Get(const std::string& partition, const std::string& root_hash) const {
+    auto it = verified_.find({ partition, root_hash });
+    if (it == verified_.end()) return {};
+    std::vector<Range> ranges = it->second;
+    std::sort(ranges.begin(), ranges.end());
+    std::vector<Range> merged;
+    for (const auto& range : ranges) {
+      if (!merged.empty() && range.first <= merged.back().second) {
+        merged.back().second = std::max(merged.back().second, range.second);
+      } else {
+        merged.push_back(range);
+      }
+    }
+    return merged;
+  }
+
+  void Record(const std::string& partition, const std::string& root_hash, size_t start,
+              size_t end) {
+    if (fd_ == -1 || root_hash.empty()) return;
+    std::string line = partition + " " + root_hash + " " + std::to_string(start) + " " +
+                       std::to_string(end) + "\n";
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!android::base::WriteStringToFd(line, fd_) || fdatasync(fd_) == -1) {
+      PLOG(WARNING) << "Failed to record verified blocks in " << path_;
+    }
+  }
+
+  void Remove() {
+    if (path_.empty()) return;
+    fd_.reset();
+    if (unlink(path_.c_str()) == -1 && errno != ENOENT) {
+      PLOG(WARNING) << "Failed to remove " << path_;
+    }
+  }
+
+ private:
+  std::string path_;
+  android::base::unique_fd fd_;
+  std::mutex mutex_;
+  std::map<std::pair<std::string, std::string>, std::vector<Range>> verified_;
+};
+
+// Spreads the reads of all the threads out to at most |bytes_per_sec|. Each read waits for the
+// time the reads before it take at that rate.
+class ReadRateLimiter {
+ public:
+  explicit ReadRateLimiter(uint64_t bytes_per_sec)
+      : bytes_per_sec_(bytes_per_sec), next_(std::chrono::steady_clock::now()) {}
+
+  void Acquire(size_t bytes) {
+    if (bytes_per_sec_ == 0) return;
+    std::chrono::steady_clock::time_point start;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      start = std::max(next_, std::chrono::steady_clock::now());
+      next_ = start + std::chrono::microseconds(bytes * 1000000 / bytes_per_sec_);
+    }
+    std::this_thread::sleep_until(start);
+  }
+
+ private:
+  uint64_t bytes_per_sec_;
+  std::mutex mutex_;
+  std::chrono::steady_clock::time_point next_;
+};
+
+// Returns the root digest of the verity target in the device-mapper table |dm_name|, or an empty
+// string if it has none or the table can't be read.
+static std::string verity_root_hash(const std::string& dm_name) {
+  android::base::unique_fd dm_fd(
+      TEMP_FAILURE_RETRY(open("/dev/device-mapper", O_RDWR | O_CLOEXEC)));
+  if (dm_fd == -1) {
+    PLOG(WARNING) << "Failed to open /dev/device-mapper";
+    return "";
+  }
+  std::vector<char> buf(16 * 1024);
+  struct dm_ioctl* io = reinterpret_cast<struct dm_ioctl*>(buf.data());
+  io->version[0] = DM_VERSION_MAJOR;
+  io->version[1] = DM_VERSION_MINOR;
+  io->version[2] = DM_VERSION_PATCHLEVEL;
+  io->data_size = buf.size();
+  io->data_start = sizeof(struct dm_ioctl);
+  io->flags = DM_STATUS_TABLE_FLAG;
+  snprintf(io->name, sizeof(io->name), "%s", dm_name.c_str());
+  if (ioctl(dm_fd, DM_TABLE_STATUS, io) == -1) {
+    PLOG(WARNING) << "Failed to get the table of " << dm_name;
+    return "";
+  }
+  if (io->flags & DM_BUFFER_FULL_FLAG) {
+    LOG(WARNING) << "Table of " << dm_name << " doesn't fit in " << buf.size() << " bytes";
+    return "";
+  }
+
+  // Each target is a dm_target_spec followed by its parameters. For verity those are
+  // "<version> <dev> <hash_dev> <data_block_size> <hash_block_size> <num_data_blocks>
+  // <hash_start_block> <algorithm> <root_digest> <salt> ...".
+  size_t offset = io->data_start;
+  for (uint32_t i = 0; i < io->target_count; i++) {
+    if (offset + sizeof(struct dm_target_spec) >= io->data_size) break;
+    const struct dm_target_spec* spec =
+        reinterpret_cast<const struct dm_target_spec*>(buf.data() + offset);
+    std::string params(reinterpret_cast<const char*>(spec + 1),
+                       strnlen(reinterpret_cast<const char*>(spec + 1),
+                               io->data_size - offset - sizeof(*spec)));
+    if (strncmp(spec->target_type, "verity", sizeof(spec->target_type)) == 0) {
+      std::vector<std::string> tokens = android::base::Split(params, " ");
+      if (tokens.size() > 8) return tokens[8];
+    }
+    if (spec->next == 0) break;
+    offset = io->data_start + spec->next;
+  }
+  return "";
+}
+
+// Returns the ranges of |ranges| that are not in |verified|, which must be sorted and merged.
+static std::vector<Range> subtract_ranges(const RangeSet& ranges,
+                                          const std::vector<Range>& verified) {
+  std::vector<Range> remaining;
+  for (const auto& range : ranges) {
+    size_t start = range.first;
+    auto it = std::upper_bound(verified.begin(), verified.end(), Range(start, SIZE_MAX));
+    if (it != verified.begin()) --it;
+    for (; it != verified.end() && it->first < range.second && start < range.second; ++it) {
+      if (it->second <= start) continue;
+      if (it->first > start) remaining.emplace_back(start, it->first);
+      start = std::max(start, it->second);
+    }
+    if (start < range.second) remaining.emplace_back(start, range.second);
+  }
+  return remaining;
+}
+
+static bool read_blocks(const std::string& partition, const std::string& range_str,
+                        VerifiedBlocks* verified, ReadRateLimiter* limiter) {
   if (partition != "system" && partition != "vendor" && partition != "product") {
     LOG(ERROR) << "Invalid partition name \"" << partition << "\"";
     return false;
@@ -96,6 +273,7 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
   static constexpr auto DM_PATH_SUFFIX = "/dm/name";
   static constexpr auto DEV_PATH = "/dev/block/";
   std::string dm_block_device;
+  std::string dm_name;
   while (n--) {
     std::string path = DM_PATH_PREFIX + std::string(namelist[n]->d_name) + DM_PATH_SUFFIX;
     std::string content;
@@ -103,6 +281,7 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
       PLOG(WARNING) << "Failed to read " << path;
     } else {
       std::string dm_block_name = android::base::Trim(content);
+      dm_name = dm_block_name;
 #ifdef BOARD_AVB_ENABLE
       // AVB is using 'vroot' for the root block device but we're expecting 'system'.
       if (dm_block_name == "vroot") {
@@ -136,6 +315,23 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
     return false;
   }
 
+  // Skip what an earlier attempt has already read under the same root hash.
+  std::string root_hash = verified ? verity_root_hash(dm_name) : "";
+  if (!root_hash.empty()) {
+    std::vector<Range> remaining = subtract_ranges(ranges, verified->Get(partition, root_hash));
+    if (remaining.empty()) {
+      LOG(INFO) << "All " << ranges.blocks() << " blocks on " << dm_block_device
+                << " were verified by an earlier attempt";
+      return true;
+    }
+    RangeSet unverified(std::move(remaining));
+    if (unverified.blocks() < ranges.blocks()) {
+      LOG(INFO) << "Skipping " << ranges.blocks() - unverified.blocks() << " of " << ranges.blocks()
+                << " blocks on " << dm_block_device << " verified by an earlier attempt";
+    }
+    ranges = std::move(unverified);
+  }
+
   // RangeSet::Split() splits the ranges into multiple groups with same number of blocks (except for
   // the last group).
   size_t thread_num = std::thread::hardware_concurrency() ?: 4;
@@ -143,7 +339,7 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
 
   std::vector<std::future<bool>> threads;
   for (const auto& group : groups) {
-    auto thread_func = [&group, &dm_block_device, &partition]() {
+    auto thread_func = [&group, &dm_block_device, &partition, &root_hash, verified, limiter]() {
       android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(dm_block_device.c_str(), O_RDONLY)));
       if (fd.get() == -1) {
         PLOG(ERROR) << "Error reading " << dm_block_device << " for partition " << partition;
@@ -151,6 +347,8 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
       }
 
       static constexpr size_t kBlockSize = 4096;
+      // Blocks read between two records of the progress, bounding what a reboot throws away
+      static constexpr size_t kRecordBlocks = 16384;
       std::vector<uint8_t> buf(1024 * kBlockSize);
 
       size_t block_count = 0;
@@ -162,14 +360,21 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
           return false;
         }
 
+        size_t recorded = range_start;
         size_t remain = (range_end - range_start) * kBlockSize;
         while (remain > 0) {
           size_t to_read = std::min(remain, 1024 * kBlockSize);
+          if (limiter) limiter->Acquire(to_read);
           if (!android::base::ReadFully(fd.get(), buf.data(), to_read)) {
             PLOG(ERROR) << "Failed to read blocks " << range_start << " to " << range_end;
             return false;
           }
           remain -= to_read;
+          size_t done = range_end - remain / kBlockSize;
+          if (verified && (done - recorded >= kRecordBlocks || remain == 0)) {
+            verified->Record(partition, root_hash, recorded, done);
+            recorded = done;
+          }
         }
         block_count += (range_end - range_start);
       }
@@ -197,6 +402,10 @@ static bool read_blocks(const std::string& partition, const std::string& range_s
 // care_map.txt. This could be a result of sideloading an O OTA while the device having a pending N
 // update.
 bool verify_image(const std::string& care_map_name) {
+  return verify_image(care_map_name, VerifyOptions());
+}
+
+bool verify_image(const std::string& care_map_name, const VerifyOptions& options) {
   android::base::unique_fd care_map_fd(TEMP_FAILURE_RETRY(open(care_map_name.c_str(), O_RDONLY)));
   // If the device is flashed before the current boot, it may not have care_map.txt
   // in /data/ota_package. To allow the device to continue booting in this situation,
@@ -222,6 +431,8 @@ bool verify_image(const std::string& care_map_name) {
     return false;
   }
 
+  VerifiedBlocks verified(options.progress_file);
+  ReadRateLimiter limiter(options.max_bytes_per_sec);
   for (size_t i = 0; i < lines.size(); i += 2) {
     // We're seeing an N care_map.txt. Skip the verification since it's not compatible with O
     // update_verifier (the last few metadata blocks can't be read via device mapper).
@@ -229,11 +440,13 @@ bool verify_image(const std::string& care_map_name) {
       LOG(WARNING) << "Found legacy care_map.txt; skipped.";
       return true;
     }
-    if (!read_blocks(lines[i], lines[i+1])) {
+    if (!read_blocks(lines[i], lines[i + 1], options.progress_file.empty() ? nullptr : &verified,
+                     options.max_bytes_per_sec ? &limiter : nullptr)) {
       return false;
     }
   }
 
+  verified.Remove();
   return true;
 }
 
@@ -291,7 +504,14 @@ int update_verifier(int argc, char** argv) {
 
     if (!skip_verification) {
       static constexpr auto CARE_MAP_FILE = "/data/ota_package/care_map.txt";
-      if (!verify_image(CARE_MAP_FILE)) {
+      static constexpr auto VERIFIED_BLOCKS_FILE = "/data/ota_package/verified_blocks.txt";
+      VerifyOptions options;
+      if (android::base::GetBoolProperty("ro.update_verifier.incremental", true)) {
+        options.progress_file = VERIFIED_BLOCKS_FILE;
+      }
+      options.max_bytes_per_sec =
+          android::base::GetUintProperty<uint64_t>("ro.update_verifier.max_read_mib", 0) << 20;
+      if (!verify_image(CARE_MAP_FILE, options)) {
         LOG(ERROR) << "Failed to verify all blocks in care map file.";
         return reboot_device();
       }
@@ -75,6 +75,10 @@ LOCAL_CFLAGS := \
     -Werror \
     -Wno-unused-parameter
 
+ifneq ($(TW_UPDATER_STASH_RAM_MB),)
+    LOCAL_CFLAGS += -DSTASH_RAM_BUDGET_MB=$(TW_UPDATER_STASH_RAM_MB)
+endif
+
 LOCAL_EXPORT_C_INCLUDE_DIRS := \
     $(LOCAL_PATH)/include
 
@@ -33,11 +33,21 @@
 #include <unistd.h>
 #include <fec/io.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <future>
 #include <limits>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <android-base/file.h>
@@ -68,10 +78,24 @@
 static constexpr size_t BLOCKSIZE = 4096;
 static constexpr mode_t STASH_DIRECTORY_MODE = 0700;
 static constexpr mode_t STASH_FILE_MODE = 0600;
+// Blocks range_sha1 reads in one go on each of its threads
+static constexpr size_t RANGE_SHA1_CHUNK_BLOCKS = 2048;
+
+// Memory kept for copies of the stashes, in MiB. 0 picks a quarter of the available memory.
+#ifndef STASH_RAM_BUDGET_MB
+#define STASH_RAM_BUDGET_MB 0
+#endif
 
 static CauseCode failure_type = kNoCause;
 static bool is_retry = false;
 static std::unordered_map<std::string, RangeSet> stash_map;
+// Copies of the stashes written by this run, so the commands using them don't read them back from
+// /cache. The stash files are written as before, since an interrupted update resumes from them.
+static std::unordered_map<std::string, std::vector<uint8_t>> stash_ram;
+static size_t stash_ram_size = 0;
+static size_t stash_ram_budget = 0;
+// Stash ids freed by this run, see CheckpointLastCommand()
+static std::unordered_set<std::string> freed_stashes;
 
 static void DeleteLastCommandFile() {
   std::string last_command_file = CacheLocation::location().last_command_file();
@@ -338,66 +362,113 @@ class RangeSinkWriter {
  * of the archive (it's compressed) without writing it to a temp file, but we can't write each
  * section until it's that transfer's turn to go.
  *
- * To achieve this, we expand the new data from the archive in a background thread, and block that
- * threads 'receive uncompressed data' function until the main thread has reached a point where we
- * want some new data to be written. We signal the background thread with the destination for the
- * data and block the main thread, waiting for the background thread to complete writing that
- * section. Then it signals the main thread to wake up and goes back to blocking waiting for a
- * transfer.
+ * To achieve this, we expand the new data from the archive in a background thread into a ring
+ * buffer, which keeps decoding ahead while the main thread runs the other commands. When the main
+ * thread reaches a 'new' transfer, it writes the data out of the ring to the target ranges, in
+ * pieces as large as the ring holds.
  *
- * NewThreadInfo is the struct used to pass information back and forth between the two threads. When
- * the main thread wants some data written, it sets writer to the destination location and signals
- * the condition. When the background thread is done writing, it clears writer and signals the
- * condition again.
+ * The ring has one writer, the background thread, and one reader, the main thread. The positions
+ * are atomics; the mutex and condition are only used to sleep when the ring is full or empty.
+ * receiver_available is cleared by the background thread once all the data is in the ring, or by
+ * the main thread to stop the background thread on an error.
  */
 struct NewThreadInfo {
   ZipArchiveHandle za;
   ZipEntry entry;
   bool brotli_compressed;
 
-  std::unique_ptr<RangeSinkWriter> writer;
   BrotliDecoderState* brotli_decoder_state;
   bool receiver_available;
 
+  std::vector<uint8_t> ring;
+  std::atomic<size_t> ring_head;  // Bytes put in the ring so far
+  std::atomic<size_t> ring_tail;  // Bytes taken out of the ring so far
+
+  // Time each side spent waiting for the other, to tell if decoding or writing holds things up
+  uint64_t decoder_wait_ns;
+  uint64_t writer_wait_ns;
+
   pthread_mutex_t mu;
   pthread_cond_t cv;
 };
 
-static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
-  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
+static uint64_t ElapsedNs(const std::chrono::steady_clock::time_point& start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+                                                              start)
+      .count();
+}
 
-  while (size > 0) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
+// Returns the free space at the head of the ring, waiting for some if it is full. Empty when the
+// main thread stopped the update.
+static std::pair<uint8_t*, size_t> RingSpace(NewThreadInfo* nti) {
+  size_t size = nti->ring.size();
+  size_t head = nti->ring_head.load(std::memory_order_relaxed);
+  if (head - nti->ring_tail.load(std::memory_order_acquire) == size) {
+    auto start = std::chrono::steady_clock::now();
     pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
-      // End the new data receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
+    while (nti->receiver_available &&
+           head - nti->ring_tail.load(std::memory_order_acquire) == size) {
       pthread_cond_wait(&nti->cv, &nti->mu);
     }
+    bool available = nti->receiver_available;
     pthread_mutex_unlock(&nti->mu);
+    nti->decoder_wait_ns += ElapsedNs(start);
+    if (!available) return { nullptr, 0 };
+  }
+  size_t used = head - nti->ring_tail.load(std::memory_order_acquire);
+  size_t offset = head % size;
+  return { nti->ring.data() + offset, std::min(size - used, size - offset) };
+}
 
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-    size_t write_now = std::min(size, nti->writer->AvailableSpace());
-    if (nti->writer->Write(data, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
+static void RingPut(NewThreadInfo* nti, size_t size) {
+  nti->ring_head.fetch_add(size, std::memory_order_release);
+  pthread_mutex_lock(&nti->mu);
+  pthread_cond_broadcast(&nti->cv);
+  pthread_mutex_unlock(&nti->mu);
+}
+
+// Returns the data at the tail of the ring, waiting for some if it is empty. Empty when the
+// background thread has nothing more to give.
+static std::pair<const uint8_t*, size_t> RingData(NewThreadInfo* nti) {
+  size_t size = nti->ring.size();
+  size_t tail = nti->ring_tail.load(std::memory_order_relaxed);
+  if (nti->ring_head.load(std::memory_order_acquire) == tail) {
+    auto start = std::chrono::steady_clock::now();
+    pthread_mutex_lock(&nti->mu);
+    while (nti->receiver_available && nti->ring_head.load(std::memory_order_acquire) == tail) {
+      pthread_cond_wait(&nti->cv, &nti->mu);
     }
+    pthread_mutex_unlock(&nti->mu);
+    nti->writer_wait_ns += ElapsedNs(start);
+  }
+  size_t used = nti->ring_head.load(std::memory_order_acquire) - tail;
+  size_t offset = tail % size;
+  return { nti->ring.data() + offset, std::min(used, size - offset) };
+}
 
-    data += write_now;
-    size -= write_now;
+static void RingTake(NewThreadInfo* nti, size_t size) {
+  nti->ring_tail.fetch_add(size, std::memory_order_release);
+  pthread_mutex_lock(&nti->mu);
+  pthread_cond_broadcast(&nti->cv);
+  pthread_mutex_unlock(&nti->mu);
+}
 
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
+static bool receive_new_data(const uint8_t* data, size_t size, void* cookie) {
+  NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
+  while (size > 0) {
+    auto space = RingSpace(nti);
+    if (space.second == 0) {
+      // End the new data receiver if we encounter an error when performing block image update.
+      return false;
     }
+
+    size_t copy_now = std::min(size, space.second);
+    memcpy(space.first, data, copy_now);
+    RingPut(nti, copy_now);
+
+    data += copy_now;
+    size -= copy_now;
   }
 
   return true;
@@ -407,32 +478,18 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
   NewThreadInfo* nti = static_cast<NewThreadInfo*>(cookie);
 
   while (size > 0 || BrotliDecoderHasMoreOutput(nti->brotli_decoder_state)) {
-    // Wait for nti->writer to be non-null, indicating some of this data is wanted.
-    pthread_mutex_lock(&nti->mu);
-    while (nti->writer == nullptr) {
+    auto space = RingSpace(nti);
+    if (space.second == 0) {
       // End the receiver if we encounter an error when performing block image update.
-      if (!nti->receiver_available) {
-        pthread_mutex_unlock(&nti->mu);
-        return false;
-      }
-      pthread_cond_wait(&nti->cv, &nti->mu);
-    }
-    pthread_mutex_unlock(&nti->mu);
-
-    // At this point nti->writer is set, and we own it. The main thread is waiting for it to
-    // disappear from nti.
-
-    size_t buffer_size = std::min<size_t>(32768, nti->writer->AvailableSpace());
-    if (buffer_size == 0) {
-      LOG(ERROR) << "No space left in output range";
       return false;
     }
-    uint8_t buffer[buffer_size];
+
     size_t available_in = size;
-    size_t available_out = buffer_size;
-    uint8_t* next_out = buffer;
+    size_t available_out = space.second;
+    uint8_t* next_out = space.first;
 
-    // The brotli decoder will update |data|, |available_in|, |next_out| and |available_out|.
+    // The brotli decoder will update |data|, |available_in|, |next_out| and |available_out|,
+    // decoding straight into the ring.
     BrotliDecoderResult result = BrotliDecoderDecompressStream(
         nti->brotli_decoder_state, &available_in, &data, &available_out, &next_out, nullptr);
 
@@ -442,26 +499,13 @@ static bool receive_brotli_new_data(const uint8_t* data, size_t size, void* cook
       return false;
     }
 
-    LOG(DEBUG) << "bytes to write: " << buffer_size - available_out << ", bytes consumed "
+    LOG(DEBUG) << "bytes decoded: " << space.second - available_out << ", bytes consumed "
                << size - available_in << ", decoder status " << result;
 
-    size_t write_now = buffer_size - available_out;
-    if (nti->writer->Write(buffer, write_now) != write_now) {
-      LOG(ERROR) << "Failed to write " << write_now << " bytes.";
-      return false;
-    }
+    RingPut(nti, space.second - available_out);
 
     // Update the remaining size. The input data ptr is already updated by brotli decoder function.
     size = available_in;
-
-    if (nti->writer->Finished()) {
-      // We have written all the bytes desired by this writer.
-
-      pthread_mutex_lock(&nti->mu);
-      nti->writer = nullptr;
-      pthread_cond_broadcast(&nti->cv);
-      pthread_mutex_unlock(&nti->mu);
-    }
   }
 
   return true;
@@ -476,9 +520,7 @@ static void* unzip_new_data(void* cookie) {
   }
   pthread_mutex_lock(&nti->mu);
   nti->receiver_available = false;
-  if (nti->writer != nullptr) {
-    pthread_cond_broadcast(&nti->cv);
-  }
+  pthread_cond_broadcast(&nti->cv);
   pthread_mutex_unlock(&nti->mu);
   return nullptr;
 }
@@ -524,6 +566,429 @@ static int WriteBlocks(const RangeSet& tgt, const std::vector<uint8_t>& buffer,
   return 0;
 }
 
+// Like ReadBlocks(), but sizes |data| to the range and leaves failure_type alone, for the threads
+// reading on their own fd.
+static bool ReadBlocksQuietly(int fd, const RangeSet& range, std::vector<uint8_t>& data) {
+  data.resize(range.blocks() * BLOCKSIZE);
+  size_t p = 0;
+  for (const auto& r : range) {
+    if (TEMP_FAILURE_RETRY(lseek64(fd, static_cast<off64_t>(r.first) * BLOCKSIZE, SEEK_SET)) ==
+        -1) {
+      return false;
+    }
+    size_t end = p + (r.second - r.first) * BLOCKSIZE;
+    while (p < end) {
+      ssize_t n = TEMP_FAILURE_RETRY(ota_read(fd, data.data() + p, end - p));
+      if (n <= 0) return false;
+      p += n;
+    }
+  }
+  return true;
+}
+
+/**
+ * BlockPrefetcher reads the source and target blocks of the commands coming up in the transfer
+ * list on its own thread and fd, while the current command patches and writes. A read is only
+ * queued when none of the commands before the one that needs it, and not completed yet, write to
+ * the same blocks; anything else, and anything the reader fails on, is read by the command itself
+ * as before. Writes stay synchronous, as each command is fsync'ed before the last command file
+ * moves past it.
+ *
+ * During an update, bsdiff and imgdiff commands that read only from the partition, not from the
+ * stash, and whose source doesn't overlap their target are also checked and patched ahead, in
+ * memory, on a pool of patch threads. The command then only writes the result, in transfer list
+ * order like the rest. A patch that fails for any reason is left to the command to do again.
+ */
+class BlockPrefetcher {
+ public:
+  // Commands and bytes read ahead of the current command at most
+  static constexpr size_t kMaxCommands = 16;
+  static constexpr size_t kMaxBytes = 64 << 20;
+  static constexpr unsigned kMaxPatchers = 4;
+
+  ~BlockPrefetcher() {
+    Stop();
+  }
+
+  // |patch_start| is where the patch data of the diff commands starts, nullptr to not patch ahead
+  bool Start(const std::string& blockdev, const uint8_t* patch_start) {
+    fd_.reset(TEMP_FAILURE_RETRY(ota_open(blockdev.c_str(), O_RDONLY)));
+    if (fd_ == -1) {
+      PLOG(WARNING) << "open \"" << blockdev << "\" for reading ahead failed";
+      return false;
+    }
+    thread_ = std::thread(&BlockPrefetcher::Worker, this);
+
+    patch_start_ = patch_start;
+    size_t patchers = patch_start != nullptr ? std::thread::hardware_concurrency() : 0;
+    if (patchers > kMaxPatchers) patchers = kMaxPatchers;
+    for (size_t i = 0; i < patchers; ++i) {
+      int fd = TEMP_FAILURE_RETRY(ota_open(blockdev.c_str(), O_RDONLY));
+      if (fd == -1) break;
+      patch_fds_.emplace_back(fd);
+      patchers_.emplace_back(&BlockPrefetcher::PatchWorker, this, fd);
+    }
+    return true;
+  }
+
+  void Stop() {
+    if (!thread_.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+    for (auto& patcher : patchers_) {
+      patcher.join();
+    }
+    patchers_.clear();
+    patch_fds_.clear();
+    reads_.clear();
+    patches_.clear();
+    bytes_ = 0;
+  }
+
+  // Queues the reads of the commands after |cmdindex|, and of |cmdindex| itself, and drops what
+  // was read for the commands before it. |runs| tells if a command is going to be executed.
+  void Plan(const std::vector<std::string>& lines, size_t start, int cmdindex, bool canwrite,
+            const std::function<bool(int, const std::string&)>& runs) {
+    Drop(cmdindex);
+    while (!writes_.empty() && writes_.front().first < cmdindex) {
+      writes_.pop_front();
+    }
+
+    size_t current = start + cmdindex;
+    planned_ = std::max(planned_, current);
+    while (planned_ < lines.size() && planned_ < current + kMaxCommands && Queued() < kMaxBytes) {
+      int index = planned_ - start;
+      std::vector<std::string> tokens = android::base::Split(lines[planned_++], " ");
+      if (tokens[0].empty() || !runs(index, tokens[0])) continue;
+
+      std::vector<RangeSet> reads;
+      RangeSet written;
+      TransferRanges(tokens, &reads, &written);
+      auto clobbered = [this](const RangeSet& range) {
+        for (const auto& write : writes_) {
+          if (write.second.Overlaps(range)) return true;
+        }
+        return false;
+      };
+      std::unique_ptr<Patch> patch;
+      if (canwrite && !patchers_.empty()) {
+        patch = PatchOf(index, tokens);
+      }
+      if (patch != nullptr && patch->bytes <= kMaxBytes && !clobbered(patch->src) &&
+          !clobbered(patch->tgt)) {
+        QueuePatch(std::move(patch));
+      } else {
+        for (const auto& range : reads) {
+          if (range.blocks() * BLOCKSIZE > kMaxBytes) continue;
+          if (!clobbered(range)) Queue(index, range);
+        }
+      }
+      if (canwrite && written) {
+        writes_.emplace_back(index, std::move(written));
+      }
+    }
+  }
+
+  // Copies the blocks read ahead for |range| of command |cmdindex| to the start of |buffer|,
+  // waiting for the read if it is still going. False if the blocks weren't read ahead or the read
+  // failed.
+  bool Take(int cmdindex, const RangeSet& range, std::vector<uint8_t>& buffer) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto it = reads_.begin(); it != reads_.end(); ++it) {
+      Read* read = it->get();
+      if (read->cmdindex != cmdindex || read->range != range) continue;
+      cv_.wait(lock, [read] { return read->state == Read::DONE || read->state == Read::FAILED; });
+      bool ok = read->state == Read::DONE;
+      if (ok) {
+        memcpy(buffer.data(), read->data.data(), read->data.size());
+      }
+      bytes_ -= read->data.size();
+      reads_.erase(it);
+      return ok;
+    }
+    return false;
+  }
+
+  // Takes the result of the diff command |cmdindex| if it was patched ahead, waiting for it if it
+  // is still going: 0 with the target blocks in |output|, 1 if the target blocks had the
+  // expected contents already, -1 if the command has to do the work itself.
+  int TakePatch(int cmdindex, RangeSet* tgt, size_t* src_blocks, std::vector<uint8_t>* output) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (auto it = patches_.begin(); it != patches_.end(); ++it) {
+      Patch* patch = it->get();
+      if (patch->cmdindex != cmdindex) continue;
+      cv_.wait(lock, [patch] { return patch->state == Patch::DONE; });
+      int result = patch->result;
+      *tgt = patch->tgt;
+      *src_blocks = patch->src.blocks();
+      output->swap(patch->output);
+      bytes_ -= patch->bytes;
+      patches_.erase(it);
+      return result;
+    }
+    return -1;
+  }
+
+ private:
+  struct Read {
+    enum State { QUEUED, READING, DONE, FAILED };
+    int cmdindex;
+    RangeSet range;
+    std::vector<uint8_t> data;
+    State state;
+    bool dropped;
+  };
+
+  struct Patch {
+    enum State { QUEUED, PATCHING, DONE };
+    int cmdindex;
+    bool imgdiff;
+    size_t offset;
+    size_t len;
+    std::string srchash;
+    std::string tgthash;
+    RangeSet src;
+    RangeSet tgt;
+    size_t bytes;  // Memory the patch takes: the source, the target read and the output
+    std::vector<uint8_t> output;
+    State state;
+    int result;  // As returned by TakePatch()
+    bool dropped;
+  };
+
+  // A patch job for a diff command that reads only from the partition, with no overlap:
+  // <cmd> <offset> <len> <srchash> <tgthash> <tgt_range> <src_block_count> <src_range>
+  static std::unique_ptr<Patch> PatchOf(int cmdindex, const std::vector<std::string>& tokens) {
+    if ((tokens[0] != "bsdiff" && tokens[0] != "imgdiff") || tokens.size() != 8 ||
+        tokens[7] == "-") {
+      return nullptr;
+    }
+    std::unique_ptr<Patch> patch(new Patch{});
+    size_t src_blocks;
+    if (!android::base::ParseUint(tokens[1], &patch->offset) ||
+        !android::base::ParseUint(tokens[2], &patch->len) ||
+        !android::base::ParseUint(tokens[6], &src_blocks)) {
+      return nullptr;
+    }
+    patch->cmdindex = cmdindex;
+    patch->imgdiff = tokens[0] == "imgdiff";
+    patch->srchash = tokens[3];
+    patch->tgthash = tokens[4];
+    patch->tgt = RangeSet::Parse(tokens[5]);
+    patch->src = RangeSet::Parse(tokens[7]);
+    if (!patch->tgt || !patch->src || patch->src.blocks() != src_blocks ||
+        patch->src.Overlaps(patch->tgt)) {
+      return nullptr;
+    }
+    patch->bytes = (patch->src.blocks() + 2 * patch->tgt.blocks()) * BLOCKSIZE;
+    patch->state = Patch::QUEUED;
+    patch->result = -1;
+    return patch;
+  }
+
+  // The ranges a transfer list command reads from and writes to the partition, see
+  // LoadSrcTgtVersion3() and PerformCommandStash() for the formats.
+  static void TransferRanges(const std::vector<std::string>& tokens, std::vector<RangeSet>* reads,
+                             RangeSet* written) {
+    const std::string& name = tokens[0];
+    size_t tgt_pos = 0;
+    if (name == "move") {
+      tgt_pos = 2;
+    } else if (name == "bsdiff" || name == "imgdiff") {
+      tgt_pos = 5;
+    } else if (name == "stash") {
+      if (tokens.size() > 2) reads->push_back(RangeSet::Parse(tokens[2]));
+    } else if (name == "zero" || name == "new" || name == "erase") {
+      if (tokens.size() > 1) *written = RangeSet::Parse(tokens[1]);
+    }
+
+    // <tgt_range> <src_block_count> <src_range>|-
+    if (tgt_pos != 0 && tokens.size() > tgt_pos + 2) {
+      *written = RangeSet::Parse(tokens[tgt_pos]);
+      reads->push_back(*written);
+      if (tokens[tgt_pos + 2] != "-") reads->push_back(RangeSet::Parse(tokens[tgt_pos + 2]));
+    }
+    reads->erase(std::remove_if(reads->begin(), reads->end(),
+                                [](const RangeSet& range) { return !range; }),
+                 reads->end());
+  }
+
+  size_t Queued() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+
+  void Queue(int cmdindex, const RangeSet& range) {
+    std::unique_ptr<Read> read(new Read{ cmdindex, range, {}, Read::QUEUED, false });
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      bytes_ += range.blocks() * BLOCKSIZE;
+      reads_.push_back(std::move(read));
+    }
+    cv_.notify_all();
+  }
+
+  void QueuePatch(std::unique_ptr<Patch> patch) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      bytes_ += patch->bytes;
+      patches_.push_back(std::move(patch));
+    }
+    cv_.notify_all();
+  }
+
+  // Forgets the reads and patches of the commands before |cmdindex|, the ones that were skipped or
+  // didn't need their blocks after all.
+  void Drop(int cmdindex) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = patches_.begin(); it != patches_.end();) {
+      Patch* patch = it->get();
+      if (patch->cmdindex >= cmdindex) {
+        ++it;
+      } else if (patch->state == Patch::PATCHING) {
+        patch->dropped = true;
+        ++it;
+      } else {
+        bytes_ -= patch->bytes;
+        it = patches_.erase(it);
+      }
+    }
+    for (auto it = reads_.begin(); it != reads_.end();) {
+      Read* read = it->get();
+      if (read->cmdindex >= cmdindex) {
+        ++it;
+      } else if (read->state == Read::READING) {
+        read->dropped = true;
+        ++it;
+      } else {
+        bytes_ -= read->range.blocks() * BLOCKSIZE;
+        it = reads_.erase(it);
+      }
+    }
+  }
+
+  void Worker() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+      Read* read = nullptr;
+      for (const auto& it : reads_) {
+        if (it->state == Read::QUEUED) {
+          read = it.get();
+          break;
+        }
+      }
+      if (read == nullptr) {
+        cv_.wait(lock);
+        continue;
+      }
+
+      read->state = Read::READING;
+      lock.unlock();
+      // The command reads the blocks again and reports the error if this fails
+      bool ok = ReadBlocksQuietly(fd_, read->range, read->data);
+      lock.lock();
+      read->state = ok ? Read::DONE : Read::FAILED;
+      if (read->dropped) {
+        bytes_ -= read->range.blocks() * BLOCKSIZE;
+        reads_.remove_if([read](const std::unique_ptr<Read>& it) { return it.get() == read; });
+      }
+      cv_.notify_all();
+    }
+  }
+
+  void PatchWorker(int fd) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+      Patch* patch = nullptr;
+      for (const auto& it : patches_) {
+        if (it->state == Patch::QUEUED) {
+          patch = it.get();
+          break;
+        }
+      }
+      if (patch == nullptr) {
+        cv_.wait(lock);
+        continue;
+      }
+
+      patch->state = Patch::PATCHING;
+      lock.unlock();
+      int result = RunPatch(fd, patch);
+      lock.lock();
+      patch->result = result;
+      patch->state = Patch::DONE;
+      if (patch->dropped) {
+        bytes_ -= patch->bytes;
+        patches_.remove_if([patch](const std::unique_ptr<Patch>& it) { return it.get() == patch; });
+      }
+      cv_.notify_all();
+    }
+  }
+
+  // What LoadSrcTgtVersion3() and PerformCommandDiff() do, into patch->output. Nothing is
+  // reported here: whatever fails is done again by the command, which reports it.
+  int RunPatch(int fd, Patch* patch) {
+    std::vector<uint8_t> tgt_data;
+    if (!ReadBlocksQuietly(fd, patch->tgt, tgt_data)) return -1;
+    if (Sha1Hex(tgt_data) == patch->tgthash) return 1;
+
+    std::vector<uint8_t> src_data;
+    if (!ReadBlocksQuietly(fd, patch->src, src_data) || Sha1Hex(src_data) != patch->srchash) {
+      return -1;
+    }
+
+    Value patch_value(VAL_BLOB, std::string(reinterpret_cast<const char*>(patch_start_ +
+                                                                          patch->offset),
+                                            patch->len));
+    std::vector<uint8_t>& output = patch->output;
+    size_t size = tgt_data.size();
+    output.reserve(size);
+    SinkFn sink = [&output, size](const uint8_t* data, size_t len) -> size_t {
+      if (output.size() + len > size) return 0;
+      output.insert(output.end(), data, data + len);
+      return len;
+    };
+    int status;
+    if (patch->imgdiff) {
+      status = ApplyImagePatch(src_data.data(), src_data.size(), patch_value, sink, nullptr,
+                               nullptr);
+    } else {
+      status = ApplyBSDiffPatch(src_data.data(), src_data.size(), patch_value, 0, sink, nullptr);
+    }
+    if (status != 0 || output.size() != size) {
+      output.clear();
+      return -1;
+    }
+    return 0;
+  }
+
+  static std::string Sha1Hex(const std::vector<uint8_t>& data) {
+    uint8_t digest[SHA_DIGEST_LENGTH];
+    SHA1(data.data(), data.size(), digest);
+    return print_sha1(digest);
+  }
+
+  android::base::unique_fd fd_;
+  std::thread thread_;
+  const uint8_t* patch_start_ = nullptr;
+  std::vector<android::base::unique_fd> patch_fds_;
+  std::vector<std::thread> patchers_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::list<std::unique_ptr<Read>> reads_;     // Reads of the planned commands, in command order
+  std::list<std::unique_ptr<Patch>> patches_;  // Patches of the planned commands
+  size_t bytes_ = 0;                           // Bytes of the reads and patches
+  bool stop_ = false;
+  // Only used by the updater thread: the next transfer list line to plan, and the blocks written
+  // by the planned commands that haven't completed yet
+  size_t planned_ = 0;
+  std::deque<std::pair<int, RangeSet>> writes_;
+};
+
 // Parameters for transfer list command functions
 struct CommandParameters {
     std::vector<std::string> tokens;
@@ -546,8 +1011,57 @@ struct CommandParameters {
     std::vector<uint8_t> buffer;
     uint8_t* patch_start;
     bool target_verified;  // The target blocks have expected contents already.
+    std::unique_ptr<BlockPrefetcher> prefetch;
+    // The last command that wrote to the stash and isn't in the last command file yet, and how
+    // many commands did since the file was written
+    int checkpoint_index;
+    std::string checkpoint_cmdline;
+    size_t checkpoint_pending;
+    std::chrono::steady_clock::time_point checkpoint_time;
 };
 
+// The last command file is written at most every this many stashing commands, or this often.
+static constexpr size_t CHECKPOINT_COMMANDS = 32;
+static constexpr std::chrono::milliseconds CHECKPOINT_INTERVAL(1000);
+
+// Writes the pending checkpoint to the last command file, if there is one.
+static void FlushLastCommand(CommandParameters& params) {
+  if (params.checkpoint_pending == 0) return;
+
+  if (!UpdateLastCommandIndex(params.checkpoint_index, params.checkpoint_cmdline)) {
+    LOG(WARNING) << "Failed to update the last command file.";
+  }
+  params.checkpoint_pending = 0;
+  params.checkpoint_time = std::chrono::steady_clock::now();
+}
+
+// Records that the current command wrote the stash |id|. The last command file only moves forward
+// every CHECKPOINT_COMMANDS stashes or CHECKPOINT_INTERVAL, so a resumed update may run again the
+// commands after the one in the file. Those are safe to repeat: move and diff find their target
+// blocks done already, and stash finds its file or its source blocks. The exception is free: run
+// again, it would delete a stash written later under the same id, so stashing an id that was
+// freed before writes the file right away.
+static void CheckpointLastCommand(CommandParameters& params, const std::string& id) {
+  params.checkpoint_index = params.cmdindex;
+  params.checkpoint_cmdline = params.cmdline;
+  params.checkpoint_pending++;
+  if (freed_stashes.find(id) != freed_stashes.end() ||
+      params.checkpoint_pending >= CHECKPOINT_COMMANDS ||
+      std::chrono::steady_clock::now() - params.checkpoint_time >= CHECKPOINT_INTERVAL) {
+    FlushLastCommand(params);
+  }
+}
+
+// ReadBlocks() for the blocks of the current command, taking them from the prefetcher when it has
+// read them already.
+static int ReadCommandBlocks(CommandParameters& params, const RangeSet& range,
+                             std::vector<uint8_t>& buffer) {
+  if (params.prefetch != nullptr && params.prefetch->Take(params.cmdindex, range, buffer)) {
+    return 0;
+  }
+  return ReadBlocks(range, buffer, params.fd);
+}
+
 // Print the hash in hex for corrupted source blocks (excluding the stashed blocks which is
 // handled separately).
 static void PrintHashForCorruptedSourceBlocks(const CommandParameters& params,
@@ -718,8 +1232,59 @@ static void DeleteFile(const std::string& fn) {
   }
 }
 
+// MemAvailable includes the page cache that can be dropped, which is most of the memory in
+// recovery.
+static size_t MemAvailable() {
+  std::string meminfo;
+  if (!android::base::ReadFileToString("/proc/meminfo", &meminfo)) {
+    return 0;
+  }
+  for (const auto& line : android::base::Split(meminfo, "\n")) {
+    unsigned long long kb;
+    if (sscanf(line.c_str(), "MemAvailable: %llu kB", &kb) == 1) {
+      return std::min<unsigned long long>(kb * 1024, std::numeric_limits<size_t>::max());
+    }
+  }
+  return 0;
+}
+
+static size_t StashRamBudget() {
+  if (STASH_RAM_BUDGET_MB > 0) {
+    return static_cast<size_t>(STASH_RAM_BUDGET_MB) << 20;
+  }
+  return MemAvailable() / 4;
+}
+
+// A sixteenth of the available memory, between 4 and 64 MiB
+static size_t NewDataRingSize() {
+  return std::min<size_t>(std::max<size_t>(MemAvailable() / 16, 4 << 20), 64 << 20);
+}
+
+static void KeepStash(const std::string& id, const std::vector<uint8_t>& buffer, size_t blocks) {
+  size_t size = blocks * BLOCKSIZE;
+  if (stash_ram.find(id) != stash_ram.end() || stash_ram_size + size > stash_ram_budget) {
+    return;
+  }
+  stash_ram[id].assign(buffer.begin(), buffer.begin() + size);
+  stash_ram_size += size;
+}
+
+static void DropStash(const std::string& id) {
+  auto it = stash_ram.find(id);
+  if (it != stash_ram.end()) {
+    stash_ram_size -= it->second.size();
+    stash_ram.erase(it);
+  }
+}
+
+static void ClearStashRam() {
+  stash_ram.clear();
+  stash_ram_size = 0;
+}
+
 static void DeleteStash(const std::string& base) {
   if (base.empty()) return;
+  ClearStashRam();
 
   LOG(INFO) << "deleting stash " << base;
 
@@ -760,6 +1325,15 @@ static int LoadStash(CommandParameters& params, const std::string& id, bool veri
     blocks = &blockcount;
   }
 
+  // Copies are only kept of blocks that matched their hash when they were stashed.
+  auto kept = stash_ram.find(id);
+  if (kept != stash_ram.end()) {
+    allocate(kept->second.size(), buffer);
+    memcpy(buffer.data(), kept->second.data(), kept->second.size());
+    *blocks = kept->second.size() / BLOCKSIZE;
+    return 0;
+  }
+
   std::string fn = GetStashFileName(params.stashbase, id, "");
 
   struct stat sb;
@@ -832,6 +1406,7 @@ static int WriteStash(const std::string& base, const std::string& id, int blocks
             // are unlikely)
             LOG(INFO) << " skipping " << blocks << " existing blocks in " << cn;
             *exists = true;
+            KeepStash(id, buffer, blocks);
             return 0;
         }
 
@@ -882,6 +1457,7 @@ static int WriteStash(const std::string& base, const std::string& id, int blocks
         return -1;
     }
 
+    KeepStash(id, buffer, blocks);
     return 0;
 }
 
@@ -974,6 +1550,8 @@ static int FreeStash(const std::string& base, const std::string& id) {
     return -1;
   }
 
+  DropStash(id);
+  freed_stashes.insert(id);
   DeleteFile(GetStashFileName(base, id, ""));
 
   return 0;
@@ -1034,7 +1612,7 @@ static int LoadSourceBlocks(CommandParameters& params, const RangeSet& tgt, size
     CHECK(static_cast<bool>(src));
     *overlap = src.Overlaps(tgt);
 
-    if (ReadBlocks(src, params.buffer, params.fd) == -1) {
+    if (ReadCommandBlocks(params, src, params.buffer) == -1) {
       return -1;
     }
 
@@ -1135,7 +1713,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
   CHECK(static_cast<bool>(tgt));
 
   std::vector<uint8_t> tgtbuffer(tgt.blocks() * BLOCKSIZE);
-  if (ReadBlocks(tgt, tgtbuffer, params.fd) == -1) {
+  if (ReadCommandBlocks(params, tgt, tgtbuffer) == -1) {
     return -1;
   }
 
@@ -1163,9 +1741,7 @@ static int LoadSrcTgtVersion3(CommandParameters& params, RangeSet& tgt, size_t*
         return -1;
       }
 
-      if (!UpdateLastCommandIndex(params.cmdindex, params.cmdline)) {
-        LOG(WARNING) << "Failed to update the last command file.";
-      }
+      CheckpointLastCommand(params, srchash);
 
       params.stashed += *src_blocks;
       // Can be deleted when the write has completed.
@@ -1255,7 +1831,7 @@ static int PerformCommandStash(CommandParameters& params) {
   CHECK(static_cast<bool>(src));
 
   allocate(src.blocks() * BLOCKSIZE, params.buffer);
-  if (ReadBlocks(src, params.buffer, params.fd) == -1) {
+  if (ReadCommandBlocks(params, src, params.buffer) == -1) {
     return -1;
   }
   blocks = src.blocks();
@@ -1277,9 +1853,7 @@ static int PerformCommandStash(CommandParameters& params) {
   LOG(INFO) << "stashing " << blocks << " blocks to " << id;
   int result = WriteStash(params.stashbase, id, blocks, params.buffer, false, nullptr);
   if (result == 0) {
-    if (!UpdateLastCommandIndex(params.cmdindex, params.cmdline)) {
-      LOG(WARNING) << "Failed to update the last command file.";
-    }
+    CheckpointLastCommand(params, id);
 
     params.stashed += blocks;
   }
@@ -1358,21 +1932,21 @@ static int PerformCommandNew(CommandParameters& params) {
   if (params.canwrite) {
     LOG(INFO) << " writing " << tgt.blocks() << " blocks of new data";
 
-    pthread_mutex_lock(&params.nti.mu);
-    params.nti.writer = std::make_unique<RangeSinkWriter>(params.fd, tgt);
-    pthread_cond_broadcast(&params.nti.cv);
+    RangeSinkWriter writer(params.fd, tgt);
+    while (!writer.Finished()) {
+      auto data = RingData(&params.nti);
+      if (data.second == 0) {
+        LOG(ERROR) << "missing " << writer.AvailableSpace() << " bytes of new data";
+        return -1;
+      }
 
-    while (params.nti.writer != nullptr) {
-      if (!params.nti.receiver_available) {
-        LOG(ERROR) << "missing " << (tgt.blocks() * BLOCKSIZE - params.nti.writer->BytesWritten())
-                   << " bytes of new data";
-        pthread_mutex_unlock(&params.nti.mu);
+      size_t write_now = std::min(data.second, writer.AvailableSpace());
+      if (writer.Write(data.first, write_now) != write_now) {
+        LOG(ERROR) << "Failed to write " << write_now << " bytes.";
         return -1;
       }
-      pthread_cond_wait(&params.nti.cv, &params.nti.mu);
+      RingTake(&params.nti, write_now);
     }
-
-    pthread_mutex_unlock(&params.nti.mu);
   }
 
   params.written += tgt.blocks();
@@ -1402,7 +1976,14 @@ static int PerformCommandDiff(CommandParameters& params) {
   RangeSet tgt;
   size_t blocks = 0;
   bool overlap = false;
-  int status = LoadSrcTgtVersion3(params, tgt, &blocks, false, &overlap);
+  std::vector<uint8_t> patched;
+  int status = -1;
+  if (params.prefetch != nullptr) {
+    status = params.prefetch->TakePatch(params.cmdindex, &tgt, &blocks, &patched);
+  }
+  if (status == -1) {
+    status = LoadSrcTgtVersion3(params, tgt, &blocks, false, &overlap);
+  }
 
   if (status == -1) {
     LOG(ERROR) << "failed to read blocks for diff";
@@ -1419,7 +2000,12 @@ static int PerformCommandDiff(CommandParameters& params) {
   }
 
   if (params.canwrite) {
-    if (status == 0) {
+    if (status == 0 && !patched.empty()) {
+      LOG(INFO) << "patched " << blocks << " blocks to " << tgt.blocks() << " ahead";
+      if (WriteBlocks(tgt, patched, params.fd) == -1) {
+        return -1;
+      }
+    } else if (status == 0) {
       LOG(INFO) << "patching " << blocks << " blocks to " << tgt.blocks();
       Value patch_value(
           VAL_BLOB, std::string(reinterpret_cast<const char*>(params.patch_start + offset), len));
@@ -1609,6 +2195,8 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
       params.nti.brotli_decoder_state = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr);
     }
     params.nti.receiver_available = true;
+    params.nti.ring.resize(NewDataRingSize());
+    LOG(INFO) << "decoding new data ahead into " << (params.nti.ring.size() >> 20) << " MiB";
 
     pthread_mutex_init(&params.nti.mu, nullptr);
     pthread_cond_init(&params.nti.cv, nullptr);
@@ -1674,6 +2262,14 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
 
   params.createdstash = res;
 
+  ClearStashRam();
+  freed_stashes.clear();
+  params.checkpoint_time = std::chrono::steady_clock::now();
+  stash_ram_budget = params.canwrite ? StashRamBudget() : 0;
+  if (params.canwrite) {
+    LOG(INFO) << "keeping up to " << (stash_ram_budget >> 20) << " MiB of stashes in memory";
+  }
+
   // When performing an update, save the index and cmdline of the current command into
   // the last_command_file if this command writes to the stash either explicitly of implicitly.
   // Upon resuming an update, read the saved index first; then
@@ -1703,6 +2299,17 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     cmd_map[commands[i].name] = &commands[i];
   }
 
+  params.prefetch = std::make_unique<BlockPrefetcher>();
+  if (!params.prefetch->Start(blockdev_filename->data,
+                              params.canwrite ? params.patch_start : nullptr)) {
+    params.prefetch.reset();
+  }
+  auto command_runs = [&](int cmdindex, const std::string& cmdname) {
+    auto it = cmd_map.find(cmdname);
+    return it != cmd_map.end() && it->second->f != nullptr &&
+           !(params.canwrite && cmdindex <= saved_last_command_index);
+  };
+
   int rc = -1;
 
   // Subsequent lines are all individual transfer commands
@@ -1721,6 +2328,10 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
     params.cmdline = line.c_str();
     params.target_verified = false;
 
+    if (params.prefetch != nullptr && params.cmdindex != -1) {
+      params.prefetch->Plan(lines, start, params.cmdindex, params.canwrite, command_runs);
+    }
+
     if (cmd_map.find(params.cmdname) == cmd_map.end()) {
       LOG(ERROR) << "unexpected command [" << params.cmdname << "]";
       goto pbiudone;
@@ -1768,6 +2379,9 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
         PLOG(ERROR) << "fsync failed";
         goto pbiudone;
       }
+      if (std::chrono::steady_clock::now() - params.checkpoint_time >= CHECKPOINT_INTERVAL) {
+        FlushLastCommand(params);
+      }
       fprintf(cmd_pipe, "set_progress %.4f\n", static_cast<double>(params.written) / total_blocks);
       fflush(cmd_pipe);
     }
@@ -1776,6 +2390,12 @@ static Value* PerformBlockImageUpdate(const char* name, State* state,
   rc = 0;
 
 pbiudone:
+  params.prefetch.reset();
+  ClearStashRam();
+  if (params.canwrite && rc != 0) {
+    // Keep what was done for the retry
+    FlushLastCommand(params);
+  }
   if (params.canwrite) {
     pthread_mutex_lock(&params.nti.mu);
     if (params.nti.receiver_available) {
@@ -1788,6 +2408,9 @@ pbiudone:
     if (ret != 0) {
       LOG(WARNING) << "pthread join returned with " << strerror(ret);
     }
+    LOG(INFO) << "new data: " << (params.nti.ring_head >> 20) << " MiB decoded, decoder waited "
+              << params.nti.decoder_wait_ns / 1000000 << " ms for room, writer waited "
+              << params.nti.writer_wait_ns / 1000000 << " ms for data";
 
     if (rc == 0) {
       LOG(INFO) << "wrote " << params.written << " blocks; expected " << total_blocks;
@@ -1943,37 +2566,57 @@ Value* RangeSha1Fn(const char* name, State* state, const std::vector<std::unique
     return StringValue("");
   }
 
-  android::base::unique_fd fd(ota_open(blockdev_filename->data.c_str(), O_RDWR));
-  if (fd == -1) {
-    ErrorAbort(state, kFileOpenFailure, "open \"%s\" failed: %s", blockdev_filename->data.c_str(),
-               strerror(errno));
-    return StringValue("");
-  }
-
   RangeSet rs = RangeSet::Parse(ranges->data);
   CHECK(static_cast<bool>(rs));
 
-  SHA_CTX ctx;
-  SHA1_Init(&ctx);
-
-  std::vector<uint8_t> buffer(BLOCKSIZE);
-  for (const auto& range : rs) {
-    if (!check_lseek(fd, static_cast<off64_t>(range.first) * BLOCKSIZE, SEEK_SET)) {
-      ErrorAbort(state, kLseekFailure, "failed to seek %s: %s", blockdev_filename->data.c_str(),
-                 strerror(errno));
+  // SHA-1 can't be split, so the ranges are read in chunks on several threads, each with its own
+  // fd, and hashed here in their order while the next chunks are read.
+  size_t readers = std::min(std::max(std::thread::hardware_concurrency(), 1U), 4U);
+  std::vector<RangeSet> chunks =
+      rs.Split((rs.blocks() + RANGE_SHA1_CHUNK_BLOCKS - 1) / RANGE_SHA1_CHUNK_BLOCKS);
+  std::vector<android::base::unique_fd> fds(readers);
+  std::vector<std::vector<uint8_t>> buffers(readers);
+  std::vector<std::future<bool>> reads(readers);
+  for (size_t i = 0; i < readers; ++i) {
+    fds[i].reset(ota_open(blockdev_filename->data.c_str(), O_RDONLY));
+    if (fds[i] == -1) {
+      ErrorAbort(state, kFileOpenFailure, "open \"%s\" failed: %s",
+                 blockdev_filename->data.c_str(), strerror(errno));
       return StringValue("");
     }
+  }
+  auto start_read = [&](size_t chunk) {
+    size_t slot = chunk % readers;
+    reads[slot] = std::async(std::launch::async, ReadBlocksQuietly, fds[slot].get(),
+                             std::cref(chunks[chunk]), std::ref(buffers[slot]));
+  };
+  for (size_t i = 0; i < readers && i < chunks.size(); ++i) {
+    start_read(i);
+  }
 
-    for (size_t j = range.first; j < range.second; ++j) {
-      if (read_all(fd, buffer, BLOCKSIZE) == -1) {
-        ErrorAbort(state, kFreadFailure, "failed to read %s: %s", blockdev_filename->data.c_str(),
-                   strerror(errno));
-        return StringValue("");
-      }
+  SHA_CTX ctx;
+  SHA1_Init(&ctx);
 
-      SHA1_Update(&ctx, buffer.data(), BLOCKSIZE);
+  bool ok = true;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    size_t slot = i % readers;
+    if (!reads[slot].get()) {
+      ok = false;
+      break;
+    }
+    SHA1_Update(&ctx, buffers[slot].data(), buffers[slot].size());
+    if (i + readers < chunks.size()) {
+      start_read(i + readers);
     }
   }
+  // The futures of std::async wait for their reads when they go away
+  reads.clear();
+  if (!ok) {
+    // errno stayed on the reading thread
+    ErrorAbort(state, kFreadFailure, "failed to read %s", blockdev_filename->data.c_str());
+    return StringValue("");
+  }
+
   uint8_t digest[SHA_DIGEST_LENGTH];
   SHA1_Final(digest, &ctx);
 
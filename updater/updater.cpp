@@ -22,9 +22,13 @@
 #include <fcntl.h>
 #include <string.h>
 
+#include <algorithm>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include <android-base/logging.h>
+#include <android-base/properties.h>
 #include <android-base/strings.h>
 #include <selinux/android.h>
 #include <selinux/label.h>
@@ -96,7 +100,7 @@ int main(int argc, char** argv) {
 
   const char* package_filename = argv[3];
   MemMapping map;
-  if (!map.MapFile(package_filename)) {
+  if (!map.MapFile(package_filename, MemMapping::Policy::kWillNeed)) {
     LOG(ERROR) << "failed to map package " << argv[3];
     return 3;
   }
@@ -187,9 +191,25 @@ int main(int argc, char** argv) {
     sehandle = selabel_open(SELABEL_CTX_FILE, seopts, 1);
   }
 
+  // "setprop updater.time_functions 1" before the install logs the time each function took.
+  state.time_functions = android::base::GetBoolProperty("updater.time_functions", false);
+
   std::string result;
   bool status = Evaluate(&state, root, &result);
 
+  if (state.time_functions) {
+    std::vector<std::pair<std::string, FunctionTime>> times(state.function_times.begin(),
+                                                            state.function_times.end());
+    std::sort(times.begin(), times.end(), [](const auto& a, const auto& b) {
+      return a.second.ns > b.second.ns;
+    });
+    LOG(INFO) << "Time spent in each function, including its arguments:";
+    for (const auto& time : times) {
+      LOG(INFO) << "  " << time.first << ": " << time.second.calls << " calls, "
+                << time.second.ns / 1000000 << " ms";
+    }
+  }
+
   if (have_eio_error) {
     fprintf(cmd_pipe, "retry_update\n");
   }
@@ -21,6 +21,21 @@
 #define TW_VERSION_STR TW_MAIN_VERSION_STR TW_DEVICE_VERSION
 
 #define TW_USE_COMPRESSION_VAR      "tw_use_compression"
+#define TW_COMPRESSION_TYPE_VAR     "tw_compression_type"
+#define TW_ZSTD_LEVEL_VAR           "tw_zstd_level"
+#define TW_ADB_COMPRESSION_VAR      "tw_adb_compression"
+#define TW_BACKUP_THREADS_VAR       "tw_backup_threads"
+#define TW_INCREMENTAL_BACKUP_VAR   "tw_incremental_backup"
+#define TW_DEDUP_BACKUP_VAR         "tw_dedup_backup"
+#define TW_SPARSE_BACKUP_VAR        "tw_sparse_backup"
+#define TW_COMPRESS_IMAGES_VAR      "tw_compress_images"
+#define TW_BACKUP_INDEX_VAR         "tw_backup_index"
+#define TW_BACKUP_AUTO_TUNE_VAR     "tw_backup_auto_tune"
+#define TW_ENCRYPT_LEGACY_VAR       "tw_encrypt_legacy"
+#define TW_RAW_DIRECT_IO_VAR        "tw_raw_direct_io"
+#define TW_BACKUP_IO_STREAMS_VAR    "tw_backup_io_streams"
+#define TW_BACKUP_READ_ORDER_VAR    "tw_backup_read_order"
+#define TW_LOG_FILE_MESSAGES_VAR    "tw_log_file_messages"
 #define TW_FILENAME                 "tw_filename"
 #define TW_ZIP_INDEX                "tw_zip_index"
 #define TW_ZIP_QUEUE_COUNT       "tw_zip_queue_count"
@@ -71,11 +86,17 @@
 #define TW_DISABLE_FREE_SPACE_VAR   "tw_disable_free_space"
 #define TW_FORCE_DIGEST_CHECK_VAR   "tw_force_digest_check"
 #define TW_SKIP_DIGEST_CHECK_VAR    "tw_skip_digest_check"
+#define TW_DIGEST_THREADS_VAR       "tw_digest_threads"
+#define TW_DIGEST_RATE_VAR          "tw_digest_rate"
+#define TW_DIGEST_ON_EXTRACT_VAR    "tw_digest_on_extract"
+#define TW_DIGEST_TREE_VAR          "tw_digest_tree"
 #define TW_SKIP_DIGEST_GENERATE_VAR "tw_skip_digest_generate"
 #define TW_SIGNED_ZIP_VERIFY_VAR    "tw_signed_zip_verify"
 #define TW_INSTALL_REBOOT_VAR       "tw_install_reboot"
 #define TW_TIME_ZONE_VAR            "tw_time_zone"
 #define TW_RM_RF_VAR                "tw_rm_rf"
+#define TW_WIPE_DISCARD_VAR         "tw_wipe_discard"
+#define TW_WIPE_SECURE_DISCARD_VAR  "tw_wipe_secure_discard"
 
 #define TW_BACKUPS_FOLDER_VAR       "tw_backups_folder"
 
@@ -136,6 +157,7 @@
 #define TW_HAS_CRYPTO               "tw_has_crypto"
 #define TW_IS_FBE                   "tw_is_fbe"
 #define TW_CRYPTO_PASSWORD          "tw_crypto_password"
+#define TW_CRYPTO_HAL_TRACE         "tw_crypto_hal_trace"
 #define TW_SDEXT_DISABLE_EXT4       "tw_sdext_disable_ext4"
 #define TW_MILITARY_TIME            "tw_military_time"
 #define TW_USE_SHA2                 "tw_use_sha2"
@@ -20,10 +20,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <functional>
 #include <memory>
+#include <thread>
 #include <vector>
 
 #include <android-base/logging.h>
@@ -36,6 +39,16 @@
 
 static constexpr size_t MiB = 1024 * 1024;
 
+// Gives the kernel a read-ahead hint for part of the package. The package
+// may be a block map or a plain buffer that does not take hints, so a
+// failure is ignored.
+static void advise_range(const unsigned char* addr, size_t length, int advice) {
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = reinterpret_cast<uintptr_t>(addr) & ~(page - 1);
+  uintptr_t end = reinterpret_cast<uintptr_t>(addr) + length;
+  madvise(reinterpret_cast<void*>(start), end - start, advice);
+}
+
 /*
  * Simple version of PKCS#7 SignedData extraction. This extracts the
  * signature OCTET STRING to be used for signature verification.
@@ -211,6 +224,21 @@ int verify_file(const unsigned char* addr, size_t length, const std::vector<Cert
   SHA1_Init(&sha1_ctx);
   SHA256_Init(&sha256_ctx);
 
+  // The package is read once from start to end. Each chunk is requested
+  // while the one before it is hashed, so slow storage and the hashing
+  // overlap instead of faulting the package in a page at a time.
+  advise_range(addr, signed_len, MADV_SEQUENTIAL);
+  advise_range(addr, std::min(signed_len, 16 * MiB), MADV_WILLNEED);
+
+  // When the keys need both digests, SHA-1 runs on its own core over the
+  // same pages while this thread does SHA-256 and the progress.
+  std::thread sha1_thread;
+  bool sha1_inline = need_sha1;
+  if (need_sha1 && need_sha256) {
+    sha1_inline = false;
+    sha1_thread = std::thread([&]() { SHA1_Update(&sha1_ctx, addr, signed_len); });
+  }
+
   double frac = -1.0;
   size_t so_far = 0;
   while (so_far < signed_len) {
@@ -219,7 +247,10 @@ int verify_file(const unsigned char* addr, size_t length, const std::vector<Cert
     // http://b/28135231.
     size_t size = std::min(signed_len - so_far, 16 * MiB);
 
-    if (need_sha1) SHA1_Update(&sha1_ctx, addr + so_far, size);
+    if (so_far + size < signed_len) {
+      advise_range(addr + so_far + size, std::min(signed_len - so_far - size, 16 * MiB), MADV_WILLNEED);
+    }
+    if (sha1_inline) SHA1_Update(&sha1_ctx, addr + so_far, size);
     if (need_sha256) SHA256_Update(&sha256_ctx, addr + so_far, size);
     so_far += size;
 
@@ -232,6 +263,10 @@ int verify_file(const unsigned char* addr, size_t length, const std::vector<Cert
     }
   }
 
+  if (sha1_thread.joinable()) {
+    sha1_thread.join();
+  }
+
   uint8_t sha1[SHA_DIGEST_LENGTH];
   SHA1_Final(sha1, &sha1_ctx);
   uint8_t sha256[SHA256_DIGEST_LENGTH];
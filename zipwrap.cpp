@@ -17,6 +17,7 @@
 
 #include "zipwrap.hpp"
 #include <string>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -31,7 +32,23 @@
 #include "otautil/SysUtil.h"
 #endif
 
+// Write a stored entry straight out of the mapped zip, so its data goes
+// from the page cache to the target with no inflate or bounce buffer
+static bool Write_Stored(int fd, const ZipWrapEntry& entry) {
+	const uint8_t* data = entry.data;
+	uint64_t left = entry.uncompressed_length;
+	while (left > 0) {
+		ssize_t written = TEMP_FAILURE_RETRY(write(fd, data, left));
+		if (written <= 0)
+			return false;
+		data += written;
+		left -= written;
+	}
+	return true;
+}
+
 ZipWrap::ZipWrap() {
+	zip_map = NULL;
 	zip_open = false;
 }
 
@@ -53,6 +70,7 @@ bool ZipWrap::Open(const char* file, MemMapping* map) {
 	if (OpenArchiveFromMemory(map->addr, map->length, file, &Zip) != 0)
 		return false;
 #endif
+	zip_map = map;
 	zip_open = true;
 	return true;
 }
@@ -93,6 +111,21 @@ bool ZipWrap::ExtractEntry(const string& source_file, const string& target_file,
 		return false;
 	}
 
+	ZipWrapEntry entry;
+	if (!GetEntryData(source_file, &entry)) {
+		close(fd);
+		return false;
+	}
+	if (!entry.deflated && entry.compressed_length == entry.uncompressed_length) {
+		bool written = Write_Stored(fd, entry);
+		close(fd);
+		if (!written) {
+			printf("Could not extract '%s': %s\n", target_file.c_str(), strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
 #ifdef USE_MINZIP
 	const ZipEntry* file_entry = mzFindZipEntry(&Zip, source_file.c_str());
 	if (file_entry == NULL) {
@@ -151,6 +184,15 @@ long ZipWrap::GetUncompressedSize(const string& filename) {
 }
 
 bool ZipWrap::ExtractToBuffer(const string& filename, uint8_t* buffer) {
+	ZipWrapEntry entry;
+	if (!GetEntryData(filename, &entry))
+		return false;
+	if (!entry.deflated && entry.compressed_length == entry.uncompressed_length) {
+		// Stored, so one copy out of the map does it
+		memcpy(buffer, entry.data, entry.uncompressed_length);
+		return true;
+	}
+
 #ifdef USE_MINZIP
 	const ZipEntry* file_entry = mzFindZipEntry(&Zip, filename.c_str());
 	if (file_entry == NULL) {
@@ -175,6 +217,50 @@ bool ZipWrap::ExtractToBuffer(const string& filename, uint8_t* buffer) {
 	return true;
 }
 
+bool ZipWrap::GetEntryData(const string& filename, ZipWrapEntry* entry) {
+	uint64_t offset;
+	int method;
+
+#ifdef USE_MINZIP
+	const ZipEntry* file_entry = mzFindZipEntry(&Zip, filename.c_str());
+	if (file_entry == NULL) {
+		printf("'%s' does not exist in zip '%s'\n", filename.c_str(), zip_file.c_str());
+		return false;
+	}
+	offset = mzGetZipEntryOffset(file_entry);
+	method = file_entry->compression;
+	entry->compressed_length = file_entry->compLen;
+	entry->uncompressed_length = file_entry->uncompLen;
+	entry->crc32 = (uint32_t) file_entry->crc32;
+#else
+	ZipString zip_string(filename.c_str());
+	ZipEntry file_entry;
+
+	if (FindEntry(Zip, zip_string, &file_entry) != 0) {
+		printf("'%s' does not exist in zip '%s'\n", filename.c_str(), zip_file.c_str());
+		return false;
+	}
+	offset = file_entry.offset;
+	method = file_entry.method;
+	entry->compressed_length = file_entry.compressed_length;
+	entry->uncompressed_length = file_entry.uncompressed_length;
+	entry->crc32 = file_entry.crc32;
+#endif
+	// 0 is stored and 8 is deflated in the zip format, nothing else is
+	// written by the signing tools
+	if (method != 0 && method != 8) {
+		printf("'%s' in zip '%s' uses unsupported compression method %d\n", filename.c_str(), zip_file.c_str(), method);
+		return false;
+	}
+	if (zip_map == NULL || offset > zip_map->length || entry->compressed_length > zip_map->length - offset) {
+		printf("'%s' runs past the end of zip '%s'\n", filename.c_str(), zip_file.c_str());
+		return false;
+	}
+	entry->data = zip_map->addr + offset;
+	entry->deflated = method == 8;
+	return true;
+}
+
 #ifdef USE_MINZIP
 loff_t ZipWrap::GetEntryOffset(const string& filename) {
 	const ZipEntry* file_entry = mzFindZipEntry(&Zip, filename.c_str());
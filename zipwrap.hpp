@@ -29,6 +29,16 @@
 
 using namespace std;
 
+// Where the data of an entry sits in the mapped zip, so it can be read
+// without extracting it first
+struct ZipWrapEntry {
+	const uint8_t* data;                                               // Start of the stored or deflated data in the map
+	uint64_t compressed_length;
+	uint64_t uncompressed_length;
+	uint32_t crc32;
+	bool deflated;                                                     // Raw deflate stream, otherwise stored as is
+};
+
 class ZipWrap {
 	public:
 		ZipWrap();
@@ -42,6 +52,7 @@ class ZipWrap {
 		long GetUncompressedSize(const string& filename);
 		bool ExtractToBuffer(const string& filename, uint8_t* begin);
 		bool ExtractRecursive(const string& source_dir, const string& target_dir);
+		bool GetEntryData(const string& filename, ZipWrapEntry* entry);
 #ifdef USE_MINZIP
 		loff_t GetEntryOffset(const string& filename);
 #else
@@ -56,6 +67,7 @@ class ZipWrap {
 		ZipArchiveHandle Zip;
 #endif
 		string zip_file;
+		MemMapping* zip_map;
 		bool zip_open;
 };
 